@@ -25,38 +25,106 @@
      it is not locking in the sense of taking ownership. It's merely returning
      a validity-checked pointer -- if it's not nullptr, then it is safe to
      dereference, unless the "master_ref" itself is dangling (easier to manage.)
- * - They are not thread safe, they should not be passed across threads. If you
-     need that then you should use `std::shared_ptr` instead.
+ * - By default they are not thread safe, they should not be passed across
+     threads. With the `weak_ref_policy::atomic` policy, the control structure
+     is reference counted atomically, so that copies may be made and destroyed
+     on any thread, and `lock` sees the `master_ref` being reset. Even then, a
+     pointer obtained from `lock` is only safe to use if the master can't be
+     reset concurrently -- otherwise, use `std::shared_ptr`.
  * - The interface mimics `std::weak_ptr`.
  * - There is no possibility of leaks due to "cyclic references". The only
      object whose lifetime is managed by reference counting here, is a shared
      control structure, whose destructor is trivial.
  */
 
+#include <atomic>
 #include <utility>
 
 namespace nonstd {
 
-namespace detail {
+/***
+ * Policies, which say how the control structure is shared.
+ *
+ * A control structure has the payload pointer, and a count of the weak refs.
+ * `release_weak` and `release_master` return true when the caller must delete
+ * the control structure.
+ */
+namespace weak_ref_policy {
 
-template <typename T>
-struct weak_ref_control_structure {
-  T * payload_;
-  mutable long ref_count_;
+struct single_threaded {
+  template <typename T>
+  struct control {
+    T * payload_;
+    mutable long ref_count_;
+
+    explicit control(T * t) : payload_(t), ref_count_(0) {}
+
+    T * payload() const noexcept { return payload_; }
+    void add_weak() const noexcept { ++ref_count_; }
+    long weak_count() const noexcept { return ref_count_; }
+
+    bool release_weak() const noexcept {
+      return !--ref_count_ && !payload_;
+    }
 
-  explicit weak_ref_control_structure(T * t) : payload_(t), ref_count_(0) {}
+    bool release_master() noexcept {
+      payload_ = nullptr;
+      return !ref_count_;
+    }
+  };
 };
 
+// The master holds one count too, so that whichever of the master and the last
+// weak ref is released last deletes the structure.
+struct atomic {
+  template <typename T>
+  struct control {
+    std::atomic<T *> payload_;
+    mutable std::atomic<long> ref_count_;
+
+    explicit control(T * t) : payload_(t), ref_count_(1) {}
+
+    T * payload() const noexcept {
+      return payload_.load(std::memory_order_acquire);
+    }
+
+    void add_weak() const noexcept {
+      ref_count_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    long weak_count() const noexcept {
+      const long n = ref_count_.load(std::memory_order_relaxed);
+      return this->payload() ? n - 1 : n;
+    }
+
+    bool release_weak() const noexcept {
+      return ref_count_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+
+    bool release_master() noexcept {
+      payload_.store(nullptr, std::memory_order_release);
+      return ref_count_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    }
+  };
+};
+
+} // end namespace weak_ref_policy
+
+namespace detail {
+
+template <typename T, typename Policy>
+using weak_ref_control_structure = typename Policy::template control<T>;
+
 } // end namespace detail
 
 // Forward declare weak_ref
-template <typename T>
+template <typename T, typename Policy = weak_ref_policy::single_threaded>
 class weak_ref;
 
 // master_ref: Owner of control structure
-template <typename T>
+template <typename T, typename Policy = weak_ref_policy::single_threaded>
 class master_ref {
-  using ctrl_t = detail::weak_ref_control_structure<T>;
+  using ctrl_t = detail::weak_ref_control_structure<T, Policy>;
 
   ctrl_t * ptr_;
 
@@ -74,9 +142,9 @@ class master_ref {
   }
 
   // Invariant: If ptr_ is not null, it points to a ctrl_t that no other
-  // master_ref points to, and ptr_->payload_ is also not null.
+  // master_ref points to, and ptr_->payload() is also not null.
 
-  friend class weak_ref<T>;
+  friend class weak_ref<T, Policy>;
 
 public:
   typedef T element_type;
@@ -99,7 +167,7 @@ public:
 
   // Copy ctor: Make a new ctrl structure pointing to the same payload
   master_ref(const master_ref & other) {
-    this->init(other.ptr_ ? other.ptr_->payload_ : nullptr);
+    this->init(other.ptr_ ? other.ptr_->payload() : nullptr);
   }
 
   // Copy assignment: Copy and swap
@@ -111,11 +179,10 @@ public:
 
   // Reset (release managed control object)
   // Set the payload pointer to null, to signal to weak refs that they are
-  // now closed. If ref_count_ is zero, then we must delete.
+  // now closed. If there are no weak refs, then we must delete.
   void reset() noexcept {
     if (ptr_) {
-      ptr_->payload_ = nullptr;
-      if (!ptr_->ref_count_) {
+      if (ptr_->release_master()) {
         delete ptr_;
       }
       ptr_ = nullptr;
@@ -132,7 +199,7 @@ public:
   // Observers
   // Get the managed pointer
   T * get() const noexcept {
-    if (ptr_) { return ptr_->payload_; }
+    if (ptr_) { return ptr_->payload(); }
     return nullptr;
   }
 
@@ -156,14 +223,17 @@ public:
 
   // weak_ref_count: do something more useful :)
   long weak_ref_count() const noexcept {
-    if (ptr_) { return ptr_->ref_count_; }
+    if (ptr_) { return ptr_->weak_count(); }
     return 0;
   }
+
+  // The control structure, for policies which keep more data in it
+  const ctrl_t * control() const noexcept { return ptr_; }
 };
 
-template <typename T>
+template <typename T, typename Policy>
 class weak_ref {
-  using ctrl_t = detail::weak_ref_control_structure<T>;
+  using ctrl_t = detail::weak_ref_control_structure<T, Policy>;
 
   // Rationale: When we lock the weak_ref, if the ref has expired, we want to
   // release this immediately, and set to nullptr, so that future lookups are
@@ -173,7 +243,7 @@ class weak_ref {
 
   void init(const ctrl_t * c) noexcept {
     if (c) {
-      ++(c->ref_count_);
+      c->add_weak();
     }
     ptr_ = c;
   }
@@ -187,10 +257,8 @@ class weak_ref {
   // *still* result in release if the master_ref is gone.
   void release() const noexcept {
     if (ptr_) {
-      if (!--(ptr_->ref_count_)) {
-        if (!ptr_->payload_) { // Check if the master is still pointing to it.
-          delete ptr_;
-        }
+      if (ptr_->release_weak()) { // The master is gone, and we were the last
+        delete ptr_;
       }
       ptr_ = nullptr;
     }
@@ -220,11 +288,11 @@ public:
   }
 
   // Construct from master_ref
-  explicit weak_ref(const master_ref<T> & u) noexcept {
+  explicit weak_ref(const master_ref<T, Policy> & u) noexcept {
     this->init(u.ptr_);
   }
 
-  weak_ref & operator = (const master_ref<T> & u) noexcept {
+  weak_ref & operator = (const master_ref<T, Policy> & u) noexcept {
     this->release();
     this->init(u.ptr_);
     return *this;
@@ -245,7 +313,7 @@ public:
   // Lock: Obtain the payload if possible, otherwise return nullptr
   T * lock() const noexcept {
     if (ptr_) {
-      T * result = ptr_->payload_;
+      T * result = ptr_->payload();
       if (!result) { this->release(); }
       return result;
     }
@@ -265,13 +333,17 @@ public:
   // weak_ref_count: do something more useful :)
   long weak_ref_count() const noexcept {
     if (ptr_) {
-      if (ptr_->payload_) {
-        return ptr_->ref_count_;
+      if (ptr_->payload()) {
+        return ptr_->weak_count();
       }
       this->release();
     }
     return 0;
   }
+
+  // The control structure, for policies which keep more data in it. It stays
+  // valid while this weak_ref holds it, even after the master is reset.
+  const ctrl_t * control() const noexcept { return ptr_; }
 };
 
 /***
@@ -280,12 +352,12 @@ public:
  * same structure.
  */
 
-template <typename T>
+template <typename T, typename Policy = weak_ref_policy::single_threaded>
 struct weakly_referenced {
   T object;
 
 private:
-  master_ref<T> ref;
+  master_ref<T, Policy> ref;
 
 public:
   template <typename... Args>
@@ -294,8 +366,8 @@ public:
     , ref(&object)
   {}
 
-  weak_ref<T> get_weak_ref() const {
-    return weak_ref<T>{this->ref};
+  weak_ref<T, Policy> get_weak_ref() const {
+    return weak_ref<T, Policy>{this->ref};
   }
 };
 
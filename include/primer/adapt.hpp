@@ -27,13 +27,18 @@ PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/expected.hpp>
 #include <primer/lua.hpp>
+#include <primer/push.hpp>
 #include <primer/read.hpp>
 #include <primer/result.hpp>
+#include <primer/variadic.hpp>
 
 #include <primer/detail/count.hpp>
 #include <primer/detail/max_int.hpp>
+#include <primer/support/alloc_scope.hpp>
 #include <primer/support/implement_result.hpp>
 
+#include <limits>
+#include <tuple>
 #include <type_traits>
 #include <utility>
 
@@ -61,15 +66,179 @@ template <lua_CFunction target_func>
 class adapt<lua_CFunction, target_func> {
 public:
   static int adapted(lua_State * L) { return target_func(L); }
+
+  // Raw functions may longjmp, so they are not put in an allocation scope
+  static int adapted_by(lua_State * L, lua_CFunction) { return target_func(L); }
 };
 //]
 
+namespace detail {
+
+/***
+ * The return types of adapted functions, and how they become a
+ * `primer::result`. A `std::tuple` is several return values, each pushed with
+ * `primer::push`, and an `expected` of a tuple is those values or an error.
+ * `stack_space()` is the most that `convert` pushes.
+ */
+template <typename R>
+struct adapt_return;
+
+template <>
+struct adapt_return<primer::result> {
+  static constexpr int stack_space() { return 0; }
+
+  static primer::result convert(lua_State *, primer::result r) { return r; }
+};
+
+template <typename... Ts>
+struct adapt_return<std::tuple<Ts...>> {
+  static constexpr int stack_space() {
+    return stack_space_for_push_each<Ts...>();
+  }
+
+  template <std::size_t... indices>
+  static void push_tuple(lua_State * L, const std::tuple<Ts...> & t,
+                         SizeList<indices...>) {
+    primer::push_each(L, std::get<indices>(t)...);
+  }
+
+  static primer::result convert(lua_State * L, const std::tuple<Ts...> & t) {
+    push_tuple(L, t, Count_t<sizeof...(Ts)>{});
+    return static_cast<int>(sizeof...(Ts));
+  }
+};
+
+template <typename... Ts>
+struct adapt_return<expected<std::tuple<Ts...>>> {
+  static constexpr int stack_space() {
+    return adapt_return<std::tuple<Ts...>>::stack_space();
+  }
+
+  static primer::result convert(lua_State * L,
+                                const expected<std::tuple<Ts...>> & e) {
+    if (!e) { return e.err(); }
+    return adapt_return<std::tuple<Ts...>>::convert(L, *e);
+  }
+};
+
+// Whether the last of the types is a `primer::variadic`
+template <typename... Ts>
+struct last_is_variadic : std::false_type {};
+
+template <typename T>
+struct last_is_variadic<T> : is_variadic<T> {};
+
+template <typename T, typename U, typename... Ts>
+struct last_is_variadic<T, U, Ts...> : last_is_variadic<U, Ts...> {};
+
+// Whether any but the last of the types is a `primer::variadic`
+template <typename... Ts>
+struct variadic_before_last : std::false_type {};
+
+template <typename T, typename U, typename... Ts>
+struct variadic_before_last<T, U, Ts...>
+  : std::integral_constant<bool, is_variadic<T>::value
+                                   || variadic_before_last<U, Ts...>::value> {};
+
+/***
+ * Parameters of primitive types, which are read directly from the stack when
+ * every parameter of a function is one. `fast_read` accepts exactly the
+ * values which `primer::read` reads without converting them from a string,
+ * and gives the same result. Otherwise it returns false, and the function
+ * takes the general path, which converts strings, or reports the error.
+ * (A user specialization of `primer::traits::read` for one of these types
+ * isn't used when the fast path is taken.)
+ */
+template <typename T, typename ENABLE = void>
+struct fast_param : std::false_type {};
+
+template <>
+struct fast_param<bool> : std::true_type {
+  static bool fast_read(lua_State * L, int idx, bool & out) noexcept {
+    if (lua_type(L, idx) != LUA_TBOOLEAN) { return false; }
+    out = lua_toboolean(L, idx);
+    return true;
+  }
+};
+
+template <typename T>
+struct fast_param<
+  T, enable_if_t<std::is_same<T, int>::value || std::is_same<T, long>::value
+                 || std::is_same<T, long long>::value
+                 || std::is_same<T, unsigned int>::value
+                 || std::is_same<T, unsigned long>::value
+                 || std::is_same<T, unsigned long long>::value>>
+  : std::true_type {
+  using limits = std::numeric_limits<T>;
+
+  static bool fast_read(lua_State * L, int idx, T & out) noexcept {
+    if (!lua_isinteger(L, idx)) { return false; }
+    const LUA_INTEGER i = lua_tointeger(L, idx);
+    if (std::is_signed<T>::value) {
+      if (sizeof(T) < sizeof(LUA_INTEGER)
+          && (i > static_cast<LUA_INTEGER>(limits::max())
+              || i < static_cast<LUA_INTEGER>(limits::min()))) {
+        return false;
+      }
+    } else {
+      if (i < 0
+          || (sizeof(T) < sizeof(LUA_INTEGER)
+              && i > static_cast<LUA_INTEGER>(limits::max()))) {
+        return false;
+      }
+    }
+    out = static_cast<T>(i);
+    return true;
+  }
+};
+
+template <typename T>
+struct fast_param<T, enable_if_t<traits::is_float_type<T>::value>>
+  : std::true_type {
+  static bool fast_read(lua_State * L, int idx, T & out) noexcept {
+    if (lua_type(L, idx) != LUA_TNUMBER) { return false; }
+    out = static_cast<T>(lua_tonumber(L, idx));
+    return true;
+  }
+};
+
+// A function without parameters has nothing to read
+template <typename... Ts>
+struct all_fast_params : std::false_type {};
+
+template <typename T>
+struct all_fast_params<T> : std::integral_constant<bool, fast_param<T>::value> {
+};
+
+template <typename T, typename U, typename... Ts>
+struct all_fast_params<T, U, Ts...>
+  : std::integral_constant<bool, fast_param<T>::value
+                                   && all_fast_params<U, Ts...>::value> {};
+
+inline bool
+all_of() noexcept {
+  return true;
+}
+
+template <typename... Bs>
+bool
+all_of(bool b, Bs... bs) noexcept {
+  return b && all_of(bs...);
+}
+
+} // end namespace detail
+
 /***
- * Implementation for a "free" function, using `primer::result` return type.
+ * Implementation for a "free" function, returning `primer::result`, or a
+ * `std::tuple` of values, or an `expected` of one.
  */
-template <typename... Args,
-          primer::result (*target_func)(lua_State * L, Args...)>
-class adapt<primer::result (*)(lua_State * L, Args...), target_func> {
+template <typename R, typename... Args,
+          R (*target_func)(lua_State * L, Args...)>
+class adapt<R (*)(lua_State * L, Args...), target_func> {
+  using return_t = detail::adapt_return<R>;
+
+  static_assert(!detail::variadic_before_last<Args...>::value,
+                "primer::variadic may only be the last parameter");
 
   /***
    * We introduce a local class to do the actual dispatching.
@@ -85,12 +254,27 @@ class adapt<primer::result (*)(lua_State * L, Args...), target_func> {
     // from propagating to lua.
 
     static primer::result adapted(lua_State * L) noexcept {
+      return adapted(L, detail::all_fast_params<Args...>{});
+    }
+
+    static primer::result adapted(lua_State * L, std::false_type) noexcept {
       // Create a flag that all the readers can use in order to signal an error
       expected<void> ok;
       // indices + 1 is because lua counts from 1
       return call_helper(L, ok, read_helper<Args>(L, indices + 1, ok)...);
     }
 
+    // Every parameter is a primitive. They are read in one pass, without
+    // `expected`, and only if one of them doesn't fit, the general path reads
+    // them again, to convert it or to report the error.
+    static primer::result adapted(lua_State * L, std::true_type) noexcept {
+      std::tuple<Args...> args;
+      const bool fits = detail::all_of(detail::fast_param<Args>::fast_read(
+        L, indices + 1, std::get<indices>(args))...);
+      if (!fits) { return adapted(L, std::false_type{}); }
+      return return_t::convert(L, target_func(L, std::get<indices>(args)...));
+    }
+
     // When we don't use exceptions, we can't use "unwrap".
     // This version simulates manually the short-circuiting logic.
     template <typename T>
@@ -115,29 +299,37 @@ class adapt<primer::result (*)(lua_State * L, Args...), target_func> {
     static primer::result call_helper(lua_State * L, expected<void> & ok,
                                       expected<Args>... args) {
       if (!ok) { return std::move(ok.err()); }
-      return target_func(L, (*std::move(args))...);
+      return return_t::convert(L, target_func(L, (*std::move(args))...));
       // Note: * std::move(...) rather than std::move(* ...)` is important, that
       // allows it to work with expected<T&>
     }
   };
 
+  // The target runs in an allocation scope, see support/alloc_scope.hpp
+  static primer::result scoped_call(lua_State * L, lua_CFunction self) {
+    PRIMER_ALLOC_SCOPE(self, nullptr);
+    return impl<detail::Count_t<sizeof...(Args)>>::adapted(L);
+  }
+
 public:
-  static int adapted(lua_State * L) {
+  static int adapted(lua_State * L) { return adapted_by(L, &adapted); }
+
+  // As `adapted`, for a dispatcher whose own function is the one lua calls.
+  // `self` is that function, which identifies the call to a profiler.
+  static int adapted_by(lua_State * L, lua_CFunction self) {
     // Estimate how much stack space we will need to read the arguments.
     // If we don't have enough, then signal an error
     // We are guaranteed at least LUA_MINSTACK by the implementation whenever
     // this function is called by lua.
-    constexpr int estimate =
-      detail::max_int(0, stack_space_for_read<Args>()...);
+    constexpr int estimate = detail::max_int(0, return_t::stack_space(),
+                                             stack_space_for_read<Args>()...);
     if (estimate > LUA_MINSTACK) {
       if (!lua_checkstack(L, estimate)) {
         return luaL_error(L, "not enough stack space, needed %d", estimate);
       }
     }
 
-    using I = detail::Count_t<sizeof...(Args)>;
-
-    auto temp = detail::implement_result_step_one(L, impl<I>::adapted(L));
+    auto temp = detail::implement_result_step_one(L, scoped_call(L, self));
     // primer::result is destroyed at the end of "full expression" in the above
     // line, so it is safe to longjmp after this.
     return detail::implement_result_step_two(L, temp);
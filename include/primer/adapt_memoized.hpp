@@ -0,0 +1,291 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * PRIMER_ADAPT_MEMOIZED adapts a pure function, like PRIMER_ADAPT, and keeps
+ * the results of its last calls, so that a call with the same arguments
+ * pushes the result again without calling the function.
+ *
+ *   std::tuple<std::string> translate(lua_State *, std::string key, int n);
+ *
+ *   lua_pushcfunction(L, PRIMER_ADAPT_MEMOIZED(&translate, 256));
+ *
+ * The arguments are read with `primer::read`, as values, and the tuple of
+ * them is the key of an LRU cache of `capacity` results. So the parameters
+ * must be value types, or const references to them, which `std::hash` and
+ * `==` work with. The function must return a `std::tuple` of values, or an
+ * `expected` of one, and errors aren't kept.
+ *
+ * The cache doesn't depend on the state which calls, since the function is
+ * pure. Each thread has its own, so that VMs on several threads don't wait
+ * for each other. When the function's results change, e.g. the language was
+ * switched, `PRIMER_ADAPT_MEMOIZED_TYPE(&f, capacity)::invalidate()` clears
+ * the caches of all threads, each at the next call on it.
+ *
+ * If the cache can't allocate, the result is pushed without being kept.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/push.hpp>
+#include <primer/read.hpp>
+#include <primer/result.hpp>
+
+#include <primer/adapt.hpp>
+#include <primer/detail/count.hpp>
+#include <primer/detail/max_int.hpp>
+#include <primer/support/implement_result.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+namespace primer {
+
+//[ primer_adapt_memoized
+template <typename T, T, std::size_t capacity>
+class adapt_memoized;
+
+#define PRIMER_ADAPT_MEMOIZED_TYPE(F, capacity)                                \
+  ::primer::adapt_memoized<decltype(F), (F), (capacity)>
+
+#define PRIMER_ADAPT_MEMOIZED(F, capacity)                                     \
+  &PRIMER_ADAPT_MEMOIZED_TYPE(F, capacity)::adapted
+//]
+
+namespace detail {
+
+// The results which can be kept, and how to tell if a result is one
+template <typename R>
+struct memo_result;
+
+template <typename... Ts>
+struct memo_result<std::tuple<Ts...>> {
+  using value_type = std::tuple<Ts...>;
+
+  static bool keep(const std::tuple<Ts...> &) noexcept { return true; }
+  static const value_type & value(const std::tuple<Ts...> & r) noexcept {
+    return r;
+  }
+};
+
+template <typename... Ts>
+struct memo_result<expected<std::tuple<Ts...>>> {
+  using value_type = std::tuple<Ts...>;
+
+  static bool keep(const expected<std::tuple<Ts...>> & r) noexcept {
+    return static_cast<bool>(r);
+  }
+  static const value_type & value(const expected<std::tuple<Ts...>> & r) {
+    return *r;
+  }
+};
+
+// Parameters which are read as values, and not pointers into lua
+template <typename... Ts>
+struct memo_params : std::true_type {};
+
+template <typename T, typename... Ts>
+struct memo_params<T, Ts...>
+  : std::integral_constant<
+      bool,
+      !std::is_pointer<typename std::decay<T>::type>::value
+        && (!std::is_lvalue_reference<T>::value
+            || std::is_const<typename std::remove_reference<T>::type>::value)
+        && memo_params<Ts...>::value> {};
+
+inline void
+memo_hash_combine(std::size_t & seed, std::size_t h) noexcept {
+  seed ^= h + 0x9e3779b9u + (seed << 6) + (seed >> 2);
+}
+
+template <typename... Ts>
+struct memo_key_hash {
+  template <std::size_t... I>
+  static std::size_t hash(const std::tuple<Ts...> & t, SizeList<I...>) {
+    std::size_t seed = sizeof...(Ts);
+    using expand = int[];
+    (void)expand{0, (memo_hash_combine(
+                       seed, std::hash<Ts>{}(std::get<I>(t))),
+                     0)...};
+    return seed;
+  }
+
+  std::size_t operator()(const std::tuple<Ts...> & t) const {
+    return hash(t, Count_t<sizeof...(Ts)>{});
+  }
+};
+
+// A bounded map from keys to values, which forgets the one used least
+// recently
+template <typename K, typename V, typename H>
+class memo_cache {
+  using list_t = std::list<std::pair<K, V>>;
+
+  list_t entries_; // Most recent first
+  std::unordered_map<K, typename list_t::iterator, H> index_;
+  std::uint64_t generation_ = 0;
+
+public:
+  // Forgets everything if the function was invalidated since the last call
+  void check(std::uint64_t generation) noexcept {
+    if (generation != generation_) {
+      index_.clear();
+      entries_.clear();
+      generation_ = generation;
+    }
+  }
+
+  const V * find(const K & k) {
+    auto it = index_.find(k);
+    if (it == index_.end()) { return nullptr; }
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return &it->second->second;
+  }
+
+  void insert(const K & k, const V & v, std::size_t capacity) {
+    if (index_.size() >= capacity) {
+      index_.erase(entries_.back().first);
+      entries_.pop_back();
+    }
+    entries_.emplace_front(k, v);
+    PRIMER_TRY { index_.emplace(k, entries_.begin()); }
+    PRIMER_CATCH(...) {
+      entries_.pop_front();
+      PRIMER_RETHROW;
+    }
+  }
+
+  std::size_t size() const noexcept { return index_.size(); }
+};
+
+} // end namespace detail
+
+template <typename R, typename... Args,
+          R (*target_func)(lua_State * L, Args...), std::size_t capacity>
+class adapt_memoized<R (*)(lua_State * L, Args...), target_func, capacity> {
+  static_assert(capacity > 0, "a memoized function keeps at least one result");
+
+  static_assert(detail::memo_params<Args...>::value,
+                "memoized functions take values, or const references");
+  static_assert(!detail::last_is_variadic<Args...>::value
+                  && !detail::variadic_before_last<Args...>::value,
+                "memoized functions can't be variadic");
+
+  template <typename T>
+  using value_t = typename std::decay<T>::type;
+
+  using return_t = detail::adapt_return<R>;
+  using memo_t = detail::memo_result<R>;
+  using key_t = std::tuple<value_t<Args>...>;
+  using cache_t = detail::memo_cache<key_t, typename memo_t::value_type,
+                                     detail::memo_key_hash<value_t<Args>...>>;
+
+  static std::atomic<std::uint64_t> & generation() noexcept {
+    static std::atomic<std::uint64_t> g{0};
+    return g;
+  }
+
+  static cache_t & cache() noexcept {
+    static thread_local cache_t c;
+    return c;
+  }
+
+  static primer::result lookup(lua_State * L, const key_t & key) noexcept {
+    cache_t & c = cache();
+    c.check(generation().load(std::memory_order_acquire));
+    const typename memo_t::value_type * hit = nullptr;
+    PRIMER_TRY_BAD_ALLOC { hit = c.find(key); }
+    PRIMER_CATCH_BAD_ALLOC {}
+    if (hit) { return return_t::convert(L, *hit); }
+
+    R r = call(L, key, detail::Count_t<sizeof...(Args)>{});
+    if (memo_t::keep(r)) {
+      PRIMER_TRY_BAD_ALLOC { c.insert(key, memo_t::value(r), capacity); }
+      PRIMER_CATCH_BAD_ALLOC {}
+    }
+    return return_t::convert(L, r);
+  }
+
+  template <std::size_t... indices>
+  static R call(lua_State * L, const key_t & key,
+                detail::SizeList<indices...>) {
+    return target_func(L, std::get<indices>(key)...);
+  }
+
+  template <typename T>
+  struct impl;
+
+  template <std::size_t... indices>
+  struct impl<detail::SizeList<indices...>> {
+    static primer::result adapted(lua_State * L) noexcept {
+      expected<void> ok;
+      return call_helper(L, ok,
+                         read_helper<value_t<Args>>(L, indices + 1, ok)...);
+    }
+
+    // As in `adapt`, the first error stops the reading
+    template <typename T>
+    static expected<T> read_helper(lua_State * L, int index,
+                                   expected<void> & ok) {
+      expected<T> result{primer::error{}};
+      if (ok) {
+        result = primer::read<T>(L, index);
+        if (!result) { ok = std::move(result.err()); }
+      }
+      return result;
+    }
+
+    static primer::result call_helper(lua_State * L, expected<void> & ok,
+                                      expected<value_t<Args>>... args) {
+      if (!ok) { return std::move(ok.err()); }
+      return lookup(L, key_t{*std::move(args)...});
+    }
+  };
+
+public:
+  static int adapted(lua_State * L) {
+    constexpr int estimate =
+      detail::max_int(0, return_t::stack_space(),
+                      stack_space_for_read<value_t<Args>>()...);
+    if (estimate > LUA_MINSTACK) {
+      if (!lua_checkstack(L, estimate)) {
+        return luaL_error(L, "not enough stack space, needed %d", estimate);
+      }
+    }
+
+    auto temp = detail::implement_result_step_one(
+      L, impl<detail::Count_t<sizeof...(Args)>>::adapted(L));
+    return detail::implement_result_step_two(L, temp);
+  }
+
+  // Forgets the results on every thread, before their next call
+  static void invalidate() noexcept {
+    generation().fetch_add(1, std::memory_order_acq_rel);
+  }
+
+  // The number of results kept for this thread
+  static std::size_t size() noexcept {
+    cache_t & c = cache();
+    c.check(generation().load(std::memory_order_acquire));
+    return c.size();
+  }
+};
+
+} // end namespace primer
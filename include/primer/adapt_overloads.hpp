@@ -0,0 +1,163 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * PRIMER_ADAPT_OVERLOADS combines several adaptable callbacks into a single
+ * lua_CFunction, which selects one of them based on the arguments it was
+ * called with.
+ *
+ * The lua types of the arguments are computed once, with integers told apart
+ * from other numbers. Then the overloads are
+ * checked in order against a compile-time table of the lua types that each
+ * parameter could accept (see <primer/traits/read_type_mask.hpp>), and the
+ * first one that matches is called. An overload matches if it takes at least
+ * as many parameters as were passed, or ends with a `primer::variadic`, and
+ * each type is accepted by the corresponding parameter. Missing arguments have
+ * type `LUA_TNONE`.
+ *
+ * Only the selected overload reads its arguments. Since the type check is a
+ * necessary condition only, that read may still fail (e.g. an integer which
+ * overflows an `int` parameter), and then its error is reported as usual.
+ *
+ * A raw `lua_CFunction` matches anything, so it can be given last as a
+ * fallback. If nothing matches, a lua error is raised which lists the
+ * argument types.
+ *
+ *   int f(lua_State * L); // can be used as a last resort
+ *   primer::result g(lua_State * L, double);
+ *   primer::result h(lua_State * L, std::string, std::map<int, int>);
+ *
+ *   lua_CFunction func = PRIMER_ADAPT_OVERLOADS(&g, &h, &f);
+ *
+ * (Up to 10 overloads are supported.)
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/adapt.hpp>
+#include <primer/lua.hpp>
+#include <primer/result.hpp>
+#include <primer/traits/read_type_mask.hpp>
+
+#include <primer/detail/max_int.hpp>
+#include <primer/detail/preprocessor.hpp>
+
+namespace primer {
+
+namespace detail {
+
+// Describes the signature of an `adapt` specialization
+template <typename A>
+struct overload_signature;
+
+template <lua_CFunction target_func>
+struct overload_signature<adapt<lua_CFunction, target_func>> {
+  static constexpr int arity = 0;
+
+  static bool matches(const int *, int) noexcept { return true; }
+};
+
+template <typename R, typename... Args,
+          R (*target_func)(lua_State * L, Args...)>
+struct overload_signature<adapt<R (*)(lua_State * L, Args...), target_func>> {
+  static constexpr int arity = sizeof...(Args);
+  static constexpr bool is_variadic = last_is_variadic<Args...>::value;
+
+  // `types` holds the lua type of each argument, and has at least `arity`
+  // entries. A trailing `variadic` accepts any number of arguments, of which
+  // only the first is checked here.
+  static bool matches(const int * types, int nargs) noexcept {
+    if (nargs > arity && !is_variadic) { return false; }
+
+    // The trailing zero only avoids a zero-sized array.
+    const unsigned masks[] = {traits::read_type_mask<Args>::value..., 0u};
+    for (int i = 0; i < arity; ++i) {
+      if (is_variadic && i == arity - 1 && i >= nargs) { break; }
+      if (!(masks[i] & primer::lua_type_bit(types[i]))) { return false; }
+    }
+    return true;
+  }
+};
+
+} // end namespace detail
+
+template <typename... Adapters>
+class adapt_overloads {
+  struct entry {
+    bool (*matches)(const int *, int);
+    lua_CFunction func;
+  };
+
+  static constexpr int max_arity =
+    detail::max_int(0, detail::overload_signature<Adapters>::arity...);
+
+  // Raise an error describing the arguments. No C++ objects with nontrivial
+  // destructors are alive here, so it's okay to longjmp.
+  static int no_match(lua_State * L, int nargs) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    luaL_addstring(&b, "no matching overload for arguments (");
+    for (int i = 1; i <= nargs; ++i) {
+      if (i > 1) { luaL_addstring(&b, ", "); }
+      luaL_addstring(&b, luaL_typename(L, i));
+    }
+    luaL_addstring(&b, ")");
+    luaL_pushresult(&b);
+    return lua_error(L);
+  }
+
+public:
+  static int adapted(lua_State * L) {
+    static const entry table[] = {
+      {&detail::overload_signature<Adapters>::matches, &Adapters::adapted}...};
+
+    const int nargs = lua_gettop(L);
+
+    // The trailing slot only avoids a zero-sized array.
+    int types[max_arity + 1];
+    for (int i = 0; i < max_arity; ++i) {
+      types[i] = (i < nargs) ? primer::lua_type_tag(L, i + 1) : LUA_TNONE;
+    }
+
+    for (const entry & e : table) {
+      if (e.matches(types, nargs)) { return e.func(L); }
+    }
+    return no_match(L, nargs);
+  }
+};
+
+} // end namespace primer
+
+#define PRIMER_ADAPT_OVERLOAD_TYPE(F) ::primer::adapt<decltype(F), (F)>
+
+#define PRIMER_ADAPT_OVERLOADS_1(A) PRIMER_ADAPT_OVERLOAD_TYPE(A)
+#define PRIMER_ADAPT_OVERLOADS_2(A, ...)                                       \
+  PRIMER_ADAPT_OVERLOAD_TYPE(A), PRIMER_ADAPT_OVERLOADS_1(__VA_ARGS__)
+#define PRIMER_ADAPT_OVERLOADS_3(A, ...)                                       \
+  PRIMER_ADAPT_OVERLOAD_TYPE(A), PRIMER_ADAPT_OVERLOADS_2(__VA_ARGS__)
+#define PRIMER_ADAPT_OVERLOADS_4(A, ...)                                       \
+  PRIMER_ADAPT_OVERLOAD_TYPE(A), PRIMER_ADAPT_OVERLOADS_3(__VA_ARGS__)
+#define PRIMER_ADAPT_OVERLOADS_5(A, ...)                                       \
+  PRIMER_ADAPT_OVERLOAD_TYPE(A), PRIMER_ADAPT_OVERLOADS_4(__VA_ARGS__)
+#define PRIMER_ADAPT_OVERLOADS_6(A, ...)                                       \
+  PRIMER_ADAPT_OVERLOAD_TYPE(A), PRIMER_ADAPT_OVERLOADS_5(__VA_ARGS__)
+#define PRIMER_ADAPT_OVERLOADS_7(A, ...)                                       \
+  PRIMER_ADAPT_OVERLOAD_TYPE(A), PRIMER_ADAPT_OVERLOADS_6(__VA_ARGS__)
+#define PRIMER_ADAPT_OVERLOADS_8(A, ...)                                       \
+  PRIMER_ADAPT_OVERLOAD_TYPE(A), PRIMER_ADAPT_OVERLOADS_7(__VA_ARGS__)
+#define PRIMER_ADAPT_OVERLOADS_9(A, ...)                                       \
+  PRIMER_ADAPT_OVERLOAD_TYPE(A), PRIMER_ADAPT_OVERLOADS_8(__VA_ARGS__)
+#define PRIMER_ADAPT_OVERLOADS_10(A, ...)                                      \
+  PRIMER_ADAPT_OVERLOAD_TYPE(A), PRIMER_ADAPT_OVERLOADS_9(__VA_ARGS__)
+
+//[ primer_adapt_overloads
+#define PRIMER_ADAPT_OVERLOADS(...)                                            \
+  &::primer::adapt_overloads<PRIMER_PP_OVERLOAD(PRIMER_ADAPT_OVERLOADS_,       \
+                                                __VA_ARGS__)>::adapted
+//]
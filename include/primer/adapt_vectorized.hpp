@@ -0,0 +1,220 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * PRIMER_ADAPT_VECTORIZED turns a scalar function, like
+ *
+ *   double lerp(double a, double b, double t);
+ *
+ * into a lua_CFunction which applies it elementwise to typed arrays, see
+ * <primer/typed_array.hpp>. Each argument may be a number, or a
+ * `typed_array` of the parameter's type, or a column of a `soa_view` of it,
+ * see <primer/soa_view.hpp>. The arrays must have the same length, except
+ * that an array of length one, like a number, is broadcast to all the
+ * elements.
+ *
+ * The results are written to a new `typed_array` of the return type, which
+ * is returned, or to the array given as an extra last argument, which must
+ * have the same length. When every argument is a number, the function is
+ * called once and its result is returned.
+ *
+ * The arguments are checked once per call, and then the function is applied
+ * in a plain loop over the elements, which the compiler can inline it into,
+ * and vectorize. When no argument is broadcast, the loop indexes each array
+ * directly.
+ *
+ *   lua_pushcfunction(L, PRIMER_ADAPT_VECTORIZED(&lerp));
+ *
+ * With a `parallel_pool` in the state, large inputs are split into chunks
+ * which run on the threads of the pool, see <primer/parallel_pool.hpp>.
+ *
+ * The parameters and the return type must be arithmetic types which
+ * `typed_array` supports.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/parallel_pool.hpp>
+#include <primer/push.hpp>
+#include <primer/read.hpp>
+#include <primer/result.hpp>
+#include <primer/soa_view.hpp>
+#include <primer/typed_array.hpp>
+#include <primer/userdata.hpp>
+
+#include <primer/detail/count.hpp>
+#include <primer/support/implement_result.hpp>
+
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace primer {
+
+//[ primer_adapt_vectorized
+template <typename T, T>
+class adapt_vectorized;
+
+#define PRIMER_ADAPT_VECTORIZED(F)                                             \
+  &::primer::adapt_vectorized<decltype(F), (F)>::adapted
+//]
+
+namespace detail {
+
+// One argument of a vectorized call. A number is held in `scalar`, and
+// `data` points to it.
+template <typename T>
+struct vector_arg {
+  const T * data = nullptr;
+  std::size_t size = 1;
+  std::size_t step = 0;
+  T scalar{};
+};
+
+template <typename T>
+expected<void>
+read_vector_arg(lua_State * L, int idx, vector_arg<T> & a) {
+  if (lua_type(L, idx) == LUA_TNUMBER) {
+    auto r = primer::read<T>(L, idx);
+    if (!r) { return std::move(r.err()); }
+    a.scalar = *r;
+    a.data = &a.scalar;
+    return {};
+  }
+  array_ref<const T> arr{nullptr, 0};
+  if (detail::test_array_ref(L, idx, &arr)) {
+    a.data = arr.data();
+    a.size = arr.size();
+    a.step = 1;
+    return {};
+  }
+  return primer::arg_error(L, idx, "number or typed array");
+}
+
+template <typename... Ts>
+struct all_arithmetic : std::true_type {};
+
+template <typename T, typename... Ts>
+struct all_arithmetic<T, Ts...>
+  : std::integral_constant<bool, std::is_arithmetic<T>::value
+                                   && all_arithmetic<Ts...>::value> {};
+
+} // end namespace detail
+
+template <typename R, typename... Args, R (*target_func)(Args...)>
+class adapt_vectorized<R (*)(Args...), target_func> {
+  static_assert(detail::all_arithmetic<R, Args...>::value,
+                "vectorized functions take and return numbers");
+
+  using args_t = std::tuple<detail::vector_arg<Args>...>;
+
+  static constexpr int output_index = sizeof...(Args) + 1;
+
+  // The parameters are copies, so that the compiler knows that writing `out`
+  // doesn't change them
+  static void dense(R * out, std::size_t begin, std::size_t end,
+                    const Args *... in) noexcept {
+    for (std::size_t i = begin; i < end; ++i) {
+      out[i] = target_func(in[i]...);
+    }
+  }
+
+  static void strided(R * out, std::size_t begin, std::size_t end,
+                      detail::vector_arg<Args>... in) noexcept {
+    for (std::size_t i = begin; i < end; ++i) {
+      out[i] = target_func(in.data[i * in.step]...);
+    }
+  }
+
+  template <typename T>
+  struct impl;
+
+  template <std::size_t... I>
+  struct impl<detail::SizeList<I...>> {
+    static primer::result call(lua_State * L) noexcept {
+      args_t a;
+      expected<void> ok;
+      using expand = int[];
+      (void)expand{0, (ok ? void(ok = detail::read_vector_arg<Args>(
+                                   L, static_cast<int>(I) + 1, std::get<I>(a)))
+                          : void(),
+                       0)...};
+      if (!ok) { return std::move(ok.err()); }
+
+      // The length of the results, and whether any argument is an array
+      std::size_t n = 1;
+      bool dense_args = true;
+      bool any_array = false;
+      for (std::size_t s : {std::get<I>(a).size...}) {
+        if (s != 1) { n = s; }
+      }
+      const bool arrays[] = {false, (std::get<I>(a).step != 0)...};
+      const std::size_t sizes[] = {0, std::get<I>(a).size...};
+      for (std::size_t i = 1; i <= sizeof...(Args); ++i) {
+        any_array = any_array || arrays[i];
+        if (sizes[i] == n) { continue; }
+        if (sizes[i] != 1) {
+          return primer::error{"In argument #", i, ": typed array has ",
+                               sizes[i], " elements, expected ", n};
+        }
+        dense_args = false;
+      }
+      (void)expand{0, (std::get<I>(a).step = (std::get<I>(a).size == n), 0)...};
+
+      if (!any_array) {
+        primer::push(L, target_func(std::get<I>(a).scalar...));
+        return 1;
+      }
+
+      detail::array_ref<R> out{nullptr, 0};
+      if (lua_isnoneornil(L, output_index)) {
+        typed_array<R> & arr = primer::push_typed_array<R>(L, nullptr, n);
+        out = detail::array_ref<R>{arr.data(), arr.size()};
+      } else {
+        if (!detail::test_array_ref(L, output_index, &out)) {
+          return primer::arg_error(L, output_index, "typed array for results");
+        }
+        if (out.size() != n) {
+          return primer::error{"Output typed array has ", out.size(),
+                               " elements, expected ", n};
+        }
+        lua_pushvalue(L, output_index);
+      }
+
+      R * results = out.data();
+      const detail::parallel_split split = detail::split_for_pool(L, n);
+      if (dense_args) {
+        auto body = [&](std::size_t, std::size_t begin, std::size_t end) {
+          dense(results, begin, end, std::get<I>(a).data...);
+        };
+        detail::run_split(split, body);
+      } else {
+        auto body = [&](std::size_t, std::size_t begin, std::size_t end) {
+          strided(results, begin, end, std::get<I>(a)...);
+        };
+        detail::run_split(split, body);
+      }
+      return 1;
+    }
+  };
+
+public:
+  static int adapted(lua_State * L) {
+    auto temp = detail::implement_result_step_one(
+      L, impl<detail::Count_t<sizeof...(Args)>>::call(L));
+    return detail::implement_result_step_two(L, temp);
+  }
+};
+
+} // end namespace primer
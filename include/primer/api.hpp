@@ -15,15 +15,40 @@ PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/primer.hpp>
 
+#include <primer/api/alloc_profiler.hpp>
+#include <primer/api/array_algorithms.hpp>
 #include <primer/api/base.hpp>
+#include <primer/api/bytecode_cache.hpp>
 #include <primer/api/callback_registrar.hpp>
 #include <primer/api/callbacks.hpp>
+#include <primer/api/call_recorder.hpp>
+#include <primer/api/call_tracer.hpp>
+#include <primer/api/codec.hpp>
+#include <primer/api/cpu_budget.hpp>
 #include <primer/api/extraspace_dispatch.hpp>
 #include <primer/api/feature.hpp>
+#include <primer/api/format.hpp>
+#include <primer/api/gc_controller.hpp>
 #include <primer/api/libraries.hpp>
+#include <primer/api/log.hpp>
+#include <primer/api/memory_limiter.hpp>
+#include <primer/api/metrics.hpp>
+#include <primer/api/module_archive.hpp>
 #include <primer/api/no_fs.hpp>
+#include <primer/api/persist_codec.hpp>
 #include <primer/api/persistable.hpp>
 #include <primer/api/persistent_value.hpp>
 #include <primer/api/print_manager.hpp>
+#include <primer/api/print_ring.hpp>
+#include <primer/api/ref_tracker.hpp>
+#include <primer/api/replication.hpp>
+#include <primer/api/sampling_profiler.hpp>
+#include <primer/api/shared_buffers.hpp>
+#include <primer/api/snapshot_delta.hpp>
+#include <primer/api/snapshot_store.hpp>
+#include <primer/api/timers.hpp>
 #include <primer/api/userdatas.hpp>
+#include <primer/api/vector_math.hpp>
 #include <primer/api/vfs.hpp>
+#include <primer/api/vm_pool.hpp>
+#include <primer/api/vm_template.hpp>
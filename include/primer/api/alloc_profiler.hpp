@@ -0,0 +1,258 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_alloc_profiler_overview
+/*`
+`primer::api::alloc_profiler` is an API feature which finds out which bound C++
+functions allocate lua memory, and what for.
+
+Like `memory_limiter`, it wraps the allocator of the state on `initialize_api`.
+Each block which lua allocates, and each growth of a block, is charged to
+
+* the callback which is running, by the name which it was registered with,
+* the kind of object made by primer, i.e. the name of a userdata type or
+  `"sequence"`, `"map"` or `"set"` for a container pushed by `to_stack`.
+
+Memory allocated by lua code outside of any callback is charged to `"<lua>"`,
+and memory allocated in adapted functions whose name isn't known to the
+profiler to `"<C function>"`.
+
+The attribution relies on primer's entry points, which only record what is
+running when `PRIMER_ALLOC_PROFILER` is defined. Without it, all memory is
+charged to `"<lua>"`. Raw `lua_CFunction` callbacks, which often raise errors,
+are not tracked, see `<primer/support/alloc_scope.hpp>`.
+
+Names are taken from the `luaW_Reg` list of a `callback_registrar`:
+
+``
+  struct my_api : primer::api::base<my_api> {
+    API_FEATURE(primer::api::alloc_profiler, profiler_);
+    API_FEATURE(primer::api::callbacks, callbacks_);
+
+    my_api()
+      : profiler_(this)
+      , callbacks_(this) { ... }
+  };
+``
+
+and others can be given with `add_name(func, name)`.
+
+`report()` gives the totals of each pair of callback and object kind, largest
+first, and `write_report(os)` formats them. `dump_if_due(os, interval)`, called
+e.g. once per frame, writes and resets the report when the interval has passed.
+
+The profiler is not thread-safe, and all of it must be used on the thread which
+runs the state.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/api/callback_registrar.hpp>
+#include <primer/detail/span.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/alloc_scope.hpp>
+#include <primer/support/lua_state_ref.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+class alloc_profiler {
+public:
+  struct entry {
+    std::string callback;
+    std::string object; // Empty if no object kind was recorded
+    std::size_t bytes;
+    std::size_t allocations;
+  };
+
+private:
+  struct counter {
+    const char * callback;
+    const char * object;
+    std::size_t bytes;
+    std::size_t allocations;
+  };
+
+  lua_state_ref sref_;
+  lua_Alloc prev_ = nullptr;
+  void * prev_ud_ = nullptr;
+
+  std::map<lua_CFunction, const char *> names_;
+  std::vector<counter> counters_;
+  std::map<std::pair<const char *, const char *>, std::size_t> index_;
+
+  // The counter of the context which was seen last
+  bool cache_valid_ = false;
+  unsigned long cached_generation_ = 0;
+  std::size_t cached_index_ = 0;
+
+  std::chrono::steady_clock::time_point last_dump_{};
+
+  static void * alloc(void * ud, void * ptr, std::size_t osize,
+                      std::size_t nsize) noexcept {
+    return static_cast<alloc_profiler *>(ud)->reallocate(ptr, osize, nsize);
+  }
+
+  void * reallocate(void * ptr, std::size_t osize, std::size_t nsize) noexcept {
+    void * result = prev_(prev_ud_, ptr, osize, nsize);
+    if (result) {
+      if (!ptr) {
+        this->charge(nsize, 1);
+      } else if (nsize > osize) {
+        this->charge(nsize - osize, 0);
+      }
+    }
+    return result;
+  }
+
+  // Finds the callback and the object kind of the current context
+  std::pair<const char *, const char *>
+  resolve(const detail::alloc_context & c) const {
+    const char * callback = nullptr;
+    const char * object = nullptr;
+    bool saw_func = false;
+    for (int i = 0; i < c.depth; ++i) {
+      const detail::alloc_frame & f = c.frames[i];
+      if (f.name && !object && !callback) { object = f.name; }
+      if (f.func && !callback) {
+        saw_func = true;
+        auto it = names_.find(f.func);
+        if (it != names_.end()) { callback = it->second; }
+      }
+    }
+    if (!callback) { callback = saw_func ? "<C function>" : "<lua>"; }
+    return {callback, object};
+  }
+
+  void charge(std::size_t bytes, std::size_t allocations) noexcept {
+    const detail::alloc_context & c = detail::current_alloc_context();
+    if (!cache_valid_ || c.generation != cached_generation_) {
+      PRIMER_TRY_BAD_ALLOC {
+        auto key = this->resolve(c);
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+          counters_.push_back(counter{key.first, key.second, 0, 0});
+          it = index_.emplace(key, counters_.size() - 1).first;
+        }
+        cached_index_ = it->second;
+        cached_generation_ = c.generation;
+        cache_valid_ = true;
+      }
+      PRIMER_CATCH_BAD_ALLOC { return; }
+    }
+    counter & k = counters_[cached_index_];
+    k.bytes += bytes;
+    k.allocations += allocations;
+  }
+
+public:
+  alloc_profiler() = default;
+
+  explicit alloc_profiler(const detail::span<const luaW_Reg> & list) {
+    this->add_names(list);
+  }
+
+  // Takes the names of the callbacks of an api object
+  template <typename T>
+  explicit alloc_profiler(T *)
+    : alloc_profiler(T::callbacks_array()) {}
+
+  alloc_profiler(const alloc_profiler &) = delete;
+  alloc_profiler & operator=(const alloc_profiler &) = delete;
+
+  ~alloc_profiler() noexcept {
+    if (lua_State * L = sref_.lock()) { lua_setallocf(L, prev_, prev_ud_); }
+  }
+
+  void add_names(const detail::span<const luaW_Reg> & list) {
+    for (const auto & r : list) {
+      if (r.func) { this->add_name(r.func, r.name); }
+    }
+  }
+
+  // `name` must outlive the profiler, e.g. a string literal
+  void add_name(lua_CFunction func, const char * name) {
+    names_[func] = name;
+    cache_valid_ = false;
+  }
+
+  // The totals so far, largest first
+  std::vector<entry> report() const {
+    std::vector<entry> result;
+    result.reserve(counters_.size());
+    for (const counter & k : counters_) {
+      result.push_back(
+        entry{k.callback, k.object ? k.object : "", k.bytes, k.allocations});
+    }
+    std::stable_sort(result.begin(), result.end(),
+                     [](const entry & a, const entry & b) {
+                       return a.bytes > b.bytes;
+                     });
+    return result;
+  }
+
+  void write_report(std::ostream & os, std::size_t max_rows = 20) const {
+    const std::vector<entry> r = this->report();
+    os << "bytes\tallocations\tcallback\tobject\n";
+    for (std::size_t i = 0; i < r.size() && i < max_rows; ++i) {
+      os << r[i].bytes << '\t' << r[i].allocations << '\t' << r[i].callback
+         << '\t' << r[i].object << '\n';
+    }
+  }
+
+  void reset() noexcept {
+    counters_.clear();
+    index_.clear();
+    cache_valid_ = false;
+  }
+
+  // Writes and resets the report, if `interval` has passed since the last time
+  template <typename Rep, typename Period>
+  bool dump_if_due(std::ostream & os,
+                   std::chrono::duration<Rep, Period> interval) {
+    const auto now = std::chrono::steady_clock::now();
+    if (now - last_dump_ < interval) { return false; }
+    last_dump_ = now;
+    this->write_report(os);
+    this->reset();
+    return true;
+  }
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    void * ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    if (f == &alloc && ud == this) { return; }
+
+    sref_ = primer::obtain_state_ref(L);
+    prev_ = f;
+    prev_ud_ = ud;
+    last_dump_ = std::chrono::steady_clock::now();
+    lua_setallocf(L, &alloc, this);
+  }
+
+  void on_persist_table(lua_State *) {}
+  void on_unpersist_table(lua_State *) {}
+};
+
+} // end namespace api
+} // end namespace primer
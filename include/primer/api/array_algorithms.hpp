@@ -0,0 +1,468 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_array_algorithms_overview
+/*`
+`primer::api::array_algorithms` is an API feature which gives scripts a
+table of functions over typed arrays, see `<primer/typed_array.hpp>`, so
+that common loops over numbers run in C++:
+
+[table
+[[Function] [Result]]
+[[`sum(a)`] [The sum of the elements.]]
+[[`min(a)`, `max(a)`] [The least or greatest element, and its index, or nil
+  if there is none. NaN is ignored.]]
+[[`dot(a, b)`] [The sum of the products of the elements, of arrays of the
+  same type and length.]]
+[[`add(a, b [, out])`, `sub`, `mul`] [The elementwise result, as with
+  `PRIMER_ADAPT_VECTORIZED`: either argument may be a number.]]
+[[`scale(a, k [, out])`] [Each element multiplied by `k`.]]
+[[`prefix_sum(a [, out])`] [The running totals. `out` may be `a`.]]
+[[`sort(a)`] [Sorts `a` in place, with NaN last, and returns it.]]
+[[`argsort(a)`] [A new integer array, of the indices which would sort `a`.
+  Equal elements keep their order.]]
+]
+
+Each function works with every element type of `typed_array`, and with the
+columns of a `soa_view`, see `<primer/soa_view.hpp>`, in place of typed
+arrays. Integer arithmetic wraps around, as it does in lua.
+
+The loops are written so that the compiler can vectorize them for the
+target, and the reductions keep several partial sums so that they don't
+depend on the previous element. No instruction set is chosen at compile
+time, so the same code is used on any target.
+
+With a `primer::parallel_pool` in the state, see
+`<primer/parallel_pool.hpp>`, the reductions, the elementwise functions and
+`prefix_sum` split large inputs into chunks which run on the threads of the
+pool. `sort` and `argsort` stay on the calling thread.
+
+The table is put in a global, by default `array`, and its functions are
+added to the permanent objects table, so scripts which hold them can be
+persisted. So are the reconstructors of typed arrays of each element type,
+and of soa views, which are persisted by copy.
+
+``
+  API_FEATURE(primer::api::array_algorithms, arrays_);
+``
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/adapt.hpp>
+#include <primer/adapt_vectorized.hpp>
+#include <primer/error.hpp>
+#include <primer/lua.hpp>
+#include <primer/parallel_pool.hpp>
+#include <primer/push.hpp>
+#include <primer/result.hpp>
+#include <primer/set_funcs.hpp>
+#include <primer/soa_view.hpp>
+#include <primer/typed_array.hpp>
+#include <primer/userdata.hpp>
+
+#include <primer/api/callback_registrar.hpp>
+#include <primer/api/help.hpp>
+
+#include <primer/detail/span.hpp>
+#include <primer/support/permanents_helper.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <type_traits>
+
+namespace primer {
+
+namespace detail {
+
+// Integer arithmetic is done unsigned, so that it wraps around
+template <typename T, bool = std::is_integral<T>::value>
+struct array_arith {
+  static T add(T a, T b) { return a + b; }
+  static T sub(T a, T b) { return a - b; }
+  static T mul(T a, T b) { return a * b; }
+  static bool is_nan(T x) { return std::isnan(x); }
+};
+
+template <typename T>
+struct array_arith<T, true> {
+  using U = typename std::make_unsigned<T>::type;
+
+  static T add(T a, T b) {
+    return static_cast<T>(static_cast<U>(a) + static_cast<U>(b));
+  }
+  static T sub(T a, T b) {
+    return static_cast<T>(static_cast<U>(a) - static_cast<U>(b));
+  }
+  static T mul(T a, T b) {
+    return static_cast<T>(static_cast<U>(a) * static_cast<U>(b));
+  }
+  static bool is_nan(T) { return false; }
+};
+
+template <typename T>
+struct array_kernels {
+  using arith = array_arith<T>;
+
+  // The number of partial sums of a reduction
+  static constexpr std::size_t lanes = 4;
+
+  static T sum(const T * p, std::size_t n) noexcept {
+    T acc[lanes] = {};
+    std::size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+      for (std::size_t j = 0; j < lanes; ++j) {
+        acc[j] = arith::add(acc[j], p[i + j]);
+      }
+    }
+    for (; i < n; ++i) {
+      acc[0] = arith::add(acc[0], p[i]);
+    }
+    return arith::add(arith::add(acc[0], acc[1]), arith::add(acc[2], acc[3]));
+  }
+
+  static T dot(const T * a, const T * b, std::size_t n) noexcept {
+    T acc[lanes] = {};
+    std::size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+      for (std::size_t j = 0; j < lanes; ++j) {
+        acc[j] = arith::add(acc[j], arith::mul(a[i + j], b[i + j]));
+      }
+    }
+    for (; i < n; ++i) {
+      acc[0] = arith::add(acc[0], arith::mul(a[i], b[i]));
+    }
+    return arith::add(arith::add(acc[0], acc[1]), arith::add(acc[2], acc[3]));
+  }
+
+  // The position of the least or greatest element, or n if they are all NaN
+  template <bool greatest>
+  static std::size_t extreme(const T * p, std::size_t n) noexcept {
+    std::size_t best = 0;
+    while (best < n && arith::is_nan(p[best])) {
+      ++best;
+    }
+    for (std::size_t i = best + 1; i < n; ++i) {
+      if (greatest ? p[best] < p[i] : p[i] < p[best]) { best = i; }
+    }
+    return best;
+  }
+
+  static void prefix_sum(const T * in, T * out, std::size_t n,
+                         T total = T{}) noexcept {
+    for (std::size_t i = 0; i < n; ++i) {
+      total = arith::add(total, in[i]);
+      out[i] = total;
+    }
+  }
+
+  static void sort(T * p, std::size_t n) {
+    T * numbers_end =
+      std::partition(p, p + n, [](T x) { return !arith::is_nan(x); });
+    std::sort(p, numbers_end);
+  }
+
+  // Writes the 1-based indices which sort `p`, with NaN last
+  static void argsort(const T * p, std::size_t n, lua_Integer * out) {
+    for (std::size_t i = 0; i < n; ++i) {
+      out[i] = static_cast<lua_Integer>(i);
+    }
+    std::stable_sort(out, out + n, [p](lua_Integer a, lua_Integer b) {
+      const T x = p[a];
+      const T y = p[b];
+      return x < y || (!arith::is_nan(x) && arith::is_nan(y));
+    });
+    for (std::size_t i = 0; i < n; ++i) {
+      ++out[i];
+    }
+  }
+};
+
+// The callbacks for arrays of T
+template <typename T>
+struct array_callbacks {
+  using kernels = array_kernels<T>;
+  using arith = array_arith<T>;
+
+  // The most chunks an input is split into, which hold partial results
+  static constexpr std::size_t max_partials = 64;
+
+  static primer::result sum(lua_State * L, array_ref<const T> a) {
+    const parallel_split split = split_for_pool(L, a.size(), max_partials);
+    T partials[max_partials];
+    auto body = [&](std::size_t i, std::size_t begin, std::size_t end) {
+      partials[i] = kernels::sum(a.data() + begin, end - begin);
+    };
+    run_split(split, body);
+    T total = partials[0];
+    for (std::size_t i = 1; i < split.count; ++i) {
+      total = arith::add(total, partials[i]);
+    }
+    primer::push(L, total);
+    return 1;
+  }
+
+  // The first of the least or greatest elements of the chunks is the first
+  // of the array
+  template <bool greatest>
+  static primer::result extreme(lua_State * L, array_ref<const T> a) {
+    const std::size_t n = a.size();
+    const parallel_split split = split_for_pool(L, n, max_partials);
+    std::size_t partials[max_partials];
+    auto body = [&](std::size_t i, std::size_t begin, std::size_t end) {
+      const std::size_t k =
+        kernels::template extreme<greatest>(a.data() + begin, end - begin);
+      partials[i] = (k == end - begin) ? n : begin + k;
+    };
+    run_split(split, body);
+    std::size_t i = n;
+    for (std::size_t c = 0; c < split.count; ++c) {
+      const std::size_t k = partials[c];
+      if (k == n) { continue; }
+      if (i == n || (greatest ? a[i] < a[k] : a[k] < a[i])) { i = k; }
+    }
+    if (i == n) {
+      lua_pushnil(L);
+      return 1;
+    }
+    primer::push(L, a[i]);
+    lua_pushinteger(L, static_cast<lua_Integer>(i + 1));
+    return 2;
+  }
+
+  static primer::result min(lua_State * L, array_ref<const T> a) {
+    return extreme<false>(L, a);
+  }
+
+  static primer::result max(lua_State * L, array_ref<const T> a) {
+    return extreme<true>(L, a);
+  }
+
+  static primer::result dot(lua_State * L, array_ref<const T> a,
+                            array_ref<const T> b) {
+    if (a.size() != b.size()) {
+      return primer::error{"Typed arrays have ", a.size(), " and ", b.size(),
+                           " elements"};
+    }
+    const parallel_split split = split_for_pool(L, a.size(), max_partials);
+    T partials[max_partials];
+    auto body = [&](std::size_t i, std::size_t begin, std::size_t end) {
+      partials[i] =
+        kernels::dot(a.data() + begin, b.data() + begin, end - begin);
+    };
+    run_split(split, body);
+    T total = partials[0];
+    for (std::size_t i = 1; i < split.count; ++i) {
+      total = arith::add(total, partials[i]);
+    }
+    primer::push(L, total);
+    return 1;
+  }
+
+  static primer::result prefix_sum(lua_State * L, array_ref<const T> a) {
+    array_ref<T> out{nullptr, 0};
+    if (lua_isnoneornil(L, 2)) {
+      typed_array<T> & arr = primer::push_typed_array<T>(L, nullptr, a.size());
+      out = array_ref<T>{arr.data(), arr.size()};
+    } else {
+      if (!test_array_ref(L, 2, &out)) {
+        return primer::arg_error(L, 2, "typed array for results");
+      }
+      if (out.size() != a.size()) {
+        return primer::error{"Output typed array has ", out.size(),
+                             " elements, expected ", a.size()};
+      }
+      lua_pushvalue(L, 2);
+    }
+    const T * in = a.data();
+    T * results = out.data();
+    const parallel_split split = split_for_pool(L, a.size(), max_partials);
+    if (split.count == 1) {
+      kernels::prefix_sum(in, results, a.size());
+      return 1;
+    }
+
+    // The totals of the chunks, and then the total before each chunk
+    T offsets[max_partials];
+    auto totals = [&](std::size_t i, std::size_t begin, std::size_t end) {
+      offsets[i] = kernels::sum(in + begin, end - begin);
+    };
+    run_split(split, totals);
+    T total{};
+    for (std::size_t i = 0; i < split.count; ++i) {
+      const T t = offsets[i];
+      offsets[i] = total;
+      total = arith::add(total, t);
+    }
+    auto scan = [&](std::size_t i, std::size_t begin, std::size_t end) {
+      kernels::prefix_sum(in + begin, results + begin, end - begin,
+                          offsets[i]);
+    };
+    run_split(split, scan);
+    return 1;
+  }
+
+  static primer::result sort(lua_State * L, array_ref<T> a) {
+    kernels::sort(a.data(), a.size());
+    lua_settop(L, 1);
+    return 1;
+  }
+
+  static primer::result argsort(lua_State * L, array_ref<const T> a) {
+    typed_array<lua_Integer> & out =
+      primer::push_typed_array<lua_Integer>(L, nullptr, a.size());
+    kernels::argsort(a.data(), a.size(), out.data());
+    return 1;
+  }
+};
+
+// An operation, adapted for arrays of each element type
+#define PRIMER_ARRAY_OP(NAME, ADAPT, FUNC)                                     \
+  template <typename T>                                                        \
+  struct array_op_##NAME {                                                     \
+    static int call(lua_State * L) { return (ADAPT(&FUNC))(L); }               \
+  }
+
+PRIMER_ARRAY_OP(sum, PRIMER_ADAPT, array_callbacks<T>::sum);
+PRIMER_ARRAY_OP(min, PRIMER_ADAPT, array_callbacks<T>::min);
+PRIMER_ARRAY_OP(max, PRIMER_ADAPT, array_callbacks<T>::max);
+PRIMER_ARRAY_OP(dot, PRIMER_ADAPT, array_callbacks<T>::dot);
+PRIMER_ARRAY_OP(prefix_sum, PRIMER_ADAPT, array_callbacks<T>::prefix_sum);
+PRIMER_ARRAY_OP(sort, PRIMER_ADAPT, array_callbacks<T>::sort);
+PRIMER_ARRAY_OP(argsort, PRIMER_ADAPT, array_callbacks<T>::argsort);
+PRIMER_ARRAY_OP(add, PRIMER_ADAPT_VECTORIZED, array_arith<T>::add);
+PRIMER_ARRAY_OP(sub, PRIMER_ADAPT_VECTORIZED, array_arith<T>::sub);
+PRIMER_ARRAY_OP(mul, PRIMER_ADAPT_VECTORIZED, array_arith<T>::mul);
+PRIMER_ARRAY_OP(scale, PRIMER_ADAPT_VECTORIZED, array_arith<T>::mul);
+
+#undef PRIMER_ARRAY_OP
+
+// Calls `Op` for the element type of the typed array at `idx`
+template <template <typename> class Op, typename... Ts>
+struct array_dispatch;
+
+template <template <typename> class Op, typename T, typename... Ts>
+struct array_dispatch<Op, T, Ts...> {
+  static int call(lua_State * L, int idx) {
+    std::size_t rows;
+    if (primer::test_udata<typed_array<T>>(L, idx)
+        || primer::test_soa_column<T>(L, idx, &rows)) {
+      return Op<T>::call(L);
+    }
+    return array_dispatch<Op, Ts...>::call(L, idx);
+  }
+};
+
+template <template <typename> class Op>
+struct array_dispatch<Op> {
+  static int call(lua_State * L, int idx) {
+    return luaL_argerror(L, idx, "typed array expected");
+  }
+};
+
+// The array is the first argument, or the second if the first is a number
+template <template <typename> class Op>
+int
+array_function(lua_State * L) {
+  const int idx = (lua_type(L, 1) == LUA_TNUMBER) ? 2 : 1;
+  return array_dispatch<Op, double, float, long long, int, long, unsigned int,
+                        unsigned long, unsigned long long>::call(L, idx);
+}
+
+} // end namespace detail
+
+namespace api {
+
+class array_algorithms {
+  const char * global_;
+
+  template <typename T>
+  static void type_permanents(lua_State * L, bool reverse) {
+    if (reverse) {
+      detail::permanents_helper<typed_array<T>>::populate_reverse(L);
+    } else {
+      detail::permanents_helper<typed_array<T>>::populate(L);
+    }
+  }
+
+  static void permanents(lua_State * L, bool reverse) {
+    static const luaL_Reg soa[] = {
+      {"soa_view.restore", &detail::soa_view_restore},
+    };
+    if (reverse) {
+      primer::set_funcs_prefix_reverse(L, "array_algorithms.", functions());
+      primer::set_funcs_reverse(L, soa);
+    } else {
+      primer::set_funcs_prefix(L, "array_algorithms.", functions());
+      primer::set_funcs(L, soa);
+    }
+    type_permanents<int>(L, reverse);
+    type_permanents<long>(L, reverse);
+    type_permanents<long long>(L, reverse);
+    type_permanents<unsigned int>(L, reverse);
+    type_permanents<unsigned long>(L, reverse);
+    type_permanents<unsigned long long>(L, reverse);
+    type_permanents<float>(L, reverse);
+    type_permanents<double>(L, reverse);
+  }
+
+public:
+  static detail::span<const luaW_Reg> functions() {
+    static const luaW_Reg list[] = {
+      {"sum", &detail::array_function<detail::array_op_sum>,
+       "sum(a): The sum of the elements of a typed array"},
+      {"min", &detail::array_function<detail::array_op_min>,
+       "min(a): The least element of a typed array, and its index"},
+      {"max", &detail::array_function<detail::array_op_max>,
+       "max(a): The greatest element of a typed array, and its index"},
+      {"dot", &detail::array_function<detail::array_op_dot>,
+       "dot(a, b): The dot product of two typed arrays"},
+      {"add", &detail::array_function<detail::array_op_add>,
+       "add(a, b [, out]): The elementwise sum"},
+      {"sub", &detail::array_function<detail::array_op_sub>,
+       "sub(a, b [, out]): The elementwise difference"},
+      {"mul", &detail::array_function<detail::array_op_mul>,
+       "mul(a, b [, out]): The elementwise product"},
+      {"scale", &detail::array_function<detail::array_op_scale>,
+       "scale(a, k [, out]): Each element multiplied by k"},
+      {"prefix_sum", &detail::array_function<detail::array_op_prefix_sum>,
+       "prefix_sum(a [, out]): The running totals of a typed array"},
+      {"sort", &detail::array_function<detail::array_op_sort>,
+       "sort(a): Sorts a typed array in place, and returns it"},
+      {"argsort", &detail::array_function<detail::array_op_argsort>,
+       "argsort(a): The indices which sort a typed array"},
+    };
+    return list;
+  }
+
+  explicit array_algorithms(const char * global = "array")
+    : global_(global) {}
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    static const help_index index{functions()};
+    api::add_help_index(L, index);
+
+    lua_newtable(L);
+    primer::set_funcs(L, functions());
+    lua_setglobal(L, global_);
+  }
+
+  void on_persist_table(lua_State * L) { permanents(L, true); }
+
+  void on_unpersist_table(lua_State * L) { permanents(L, false); }
+};
+
+} // end namespace api
+} // end namespace primer
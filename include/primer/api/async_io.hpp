@@ -0,0 +1,453 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_async_io_overview
+/*`
+`primer::api::async_io` is an API feature which gives the tasks of a
+`primer::scheduler` file operations which don't block the thread of the VM.
+A task which calls one is suspended, the operation runs on a worker thread,
+and the task is resumed with its results once the host has collected them.
+
+[table
+[[Function] [Result]]
+[[`aio.read(path [, offset [, size]])`] [A `byte_buffer` of the bytes of the
+  file from `offset`, 0 by default, up to `size` of them, or to the end.
+  Fewer bytes are returned at the end of the file.]]
+[[`aio.write(path, data [, offset])`] [The number of bytes written. `data` is
+  a string or a byte buffer. Without an offset the file is replaced, with one
+  it is written in place, and made if it doesn't exist.]]
+[[`aio.stat(path)`] [A table with the `size` of the file, and its `type`,
+  `"file"`, `"directory"` or `"other"`.]]
+]
+
+If the operation fails, the results are `nil`, a message and the `errno`
+value, as for the `io` library.
+
+``
+  local buf = aio.read("data/level1.bin")
+  local n = buf:get_u32(1)
+``
+
+The host gives the feature its scheduler, and collects finished operations
+once per frame, before the tick which resumes their tasks:
+
+``
+  io_.set_scheduler(&sched);
+  ...
+  io_.poll();
+  sched.tick();
+``
+
+The bytes are read into a vector on the worker thread, which the
+`byte_buffer` given to lua then takes over, without copying them. The data of a write is
+copied when the write is started, since the task may change or drop it
+meanwhile.
+
+Operations are queued for a fixed pool of worker threads, by default two,
+each doing blocking positional reads and writes, so a VM thread may have any
+number of them in flight. Queuing an operation allocates its node on the
+thread of the VM, and the workers only move nodes between lists, so a worker
+never allocates except for the bytes it reads.
+
+The functions must be called from a scheduler task, which can yield. Pending
+operations are not saved by `persist`, but the functions can be, and are
+bound again to the restoring feature.
+
+This header uses `std::thread` and POSIX file I/O, and isn't included by
+`primer/api.hpp`.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/api/self_closures.hpp>
+#include <primer/byte_buffer.hpp>
+#include <primer/cpp_pcall.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref_seq.hpp>
+#include <primer/read.hpp>
+#include <primer/scheduler.hpp>
+#include <primer/support/lua_state_ref.hpp>
+#include <primer/userdata.hpp>
+
+#include <array>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace primer {
+namespace api {
+
+class async_io {
+  enum class op { read, write, stat };
+
+  struct operation {
+    op kind = op::read;
+    scheduler::ticket ticket = 0;
+    std::string path;
+    std::uint64_t offset = 0;
+    bool has_offset = false;
+    std::uint64_t size = 0; // The limit of a read
+    bool has_size = false;
+    std::vector<unsigned char> bytes; // Written, or read
+
+    int error = 0;           // The errno value, if it failed
+    std::uint64_t count = 0; // Bytes written, or the size of a stat
+    const char * type = "other";
+  };
+
+  const char * global_;
+  scheduler * sched_ = nullptr;
+  lua_state_ref sref_;
+  std::size_t in_flight_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable wake_;
+  std::list<operation> queue_;
+  std::list<operation> done_;
+  bool stopping_ = false;
+  std::vector<std::thread> workers_;
+
+  //
+  // Worker threads
+  //
+
+  static void do_read(operation & o, int fd) noexcept {
+    std::uint64_t n = o.size;
+    if (!o.has_size) {
+      struct stat st;
+      if (::fstat(fd, &st)) {
+        o.error = errno;
+        return;
+      }
+      const auto end = static_cast<std::uint64_t>(st.st_size);
+      n = end > o.offset ? end - o.offset : 0;
+    }
+    PRIMER_TRY_BAD_ALLOC { o.bytes.resize(static_cast<std::size_t>(n)); }
+    PRIMER_CATCH_BAD_ALLOC {
+      o.error = ENOMEM;
+      return;
+    }
+
+    std::size_t got = 0;
+    while (got < o.bytes.size()) {
+      const ssize_t r = ::pread(fd, o.bytes.data() + got, o.bytes.size() - got,
+                                static_cast<off_t>(o.offset + got));
+      if (r < 0) {
+        if (errno == EINTR) { continue; }
+        o.error = errno;
+        return;
+      }
+      if (!r) { break; }
+      got += static_cast<std::size_t>(r);
+    }
+    o.bytes.resize(got);
+  }
+
+  static void do_write(operation & o, int fd) noexcept {
+    std::size_t put = 0;
+    while (put < o.bytes.size()) {
+      const ssize_t r = ::pwrite(fd, o.bytes.data() + put, o.bytes.size() - put,
+                                 static_cast<off_t>(o.offset + put));
+      if (r < 0) {
+        if (errno == EINTR) { continue; }
+        o.error = errno;
+        return;
+      }
+      put += static_cast<std::size_t>(r);
+    }
+    o.count = put;
+  }
+
+  static void perform(operation & o) noexcept {
+    if (o.kind == op::stat) {
+      struct stat st;
+      if (::stat(o.path.c_str(), &st)) {
+        o.error = errno;
+        return;
+      }
+      o.count = static_cast<std::uint64_t>(st.st_size);
+      o.type = S_ISREG(st.st_mode) ? "file"
+                                   : S_ISDIR(st.st_mode) ? "directory" : "other";
+      return;
+    }
+
+    const int flags = o.kind == op::read
+                        ? O_RDONLY
+                        : O_WRONLY | O_CREAT | (o.has_offset ? 0 : O_TRUNC);
+    const int fd = ::open(o.path.c_str(), flags | O_CLOEXEC, 0666);
+    if (fd < 0) {
+      o.error = errno;
+      return;
+    }
+    if (o.kind == op::read) {
+      do_read(o, fd);
+    } else {
+      do_write(o, fd);
+    }
+    ::close(fd);
+  }
+
+  void work() noexcept {
+    std::list<operation> mine;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      wake_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+      if (stopping_) { return; }
+      mine.splice(mine.end(), queue_, queue_.begin());
+      lock.unlock();
+      perform(mine.front());
+      lock.lock();
+      done_.splice(done_.end(), mine);
+    }
+  }
+
+  //
+  // Lua functions
+  //
+
+  // Queues the operation, and suspends the task until `poll` delivers it.
+  // The operation is made by `f` inside the protection against allocation
+  // failure.
+  template <typename F>
+  int submit(lua_State * L, F && f) {
+    if (!sched_) { return luaL_error(L, "async_io has no scheduler"); }
+    if (!lua_isyieldable(L)) {
+      return luaL_error(L, "async_io must be called from a scheduler task");
+    }
+    const scheduler::ticket t = sched_->make_ticket();
+    bool failed = false;
+    PRIMER_TRY_BAD_ALLOC {
+      std::list<operation> node(1);
+      f(node.front());
+      node.front().ticket = t;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.splice(queue_.end(), node);
+      }
+      wake_.notify_one();
+    }
+    PRIMER_CATCH_BAD_ALLOC { failed = true; }
+    if (failed) { return luaL_error(L, "not enough memory"); }
+    ++in_flight_;
+    return scheduler::await(L, t);
+  }
+
+  static std::uint64_t check_offset(lua_State * L, int idx) {
+    const lua_Integer n = luaL_checkinteger(L, idx);
+    luaL_argcheck(L, n >= 0, idx, "must not be negative");
+    return static_cast<std::uint64_t>(n);
+  }
+
+  static int intf_read(lua_State * L) {
+    async_io * self = recover_self_upvalue<async_io>(L);
+    const char * path = luaL_checkstring(L, 1);
+    const bool has_offset = !lua_isnoneornil(L, 2);
+    const std::uint64_t offset = has_offset ? check_offset(L, 2) : 0;
+    const bool has_size = !lua_isnoneornil(L, 3);
+    const std::uint64_t size = has_size ? check_offset(L, 3) : 0;
+    return self->submit(L, [&](operation & o) {
+      o.kind = op::read;
+      o.path = path;
+      o.offset = offset;
+      o.has_offset = has_offset;
+      o.size = size;
+      o.has_size = has_size;
+    });
+  }
+
+  static int intf_write(lua_State * L) {
+    async_io * self = recover_self_upvalue<async_io>(L);
+    const char * path = luaL_checkstring(L, 1);
+    const unsigned char * data;
+    std::size_t len;
+    if (lua_type(L, 2) == LUA_TSTRING) {
+      data = reinterpret_cast<const unsigned char *>(lua_tolstring(L, 2, &len));
+    } else if (auto span = primer::read<byte_span>(L, 2)) {
+      data = span->data();
+      len = span->size();
+    } else {
+      return luaL_argerror(L, 2, "expected a string or a byte buffer");
+    }
+    const bool has_offset = !lua_isnoneornil(L, 3);
+    const std::uint64_t offset = has_offset ? check_offset(L, 3) : 0;
+    return self->submit(L, [&](operation & o) {
+      o.kind = op::write;
+      o.path = path;
+      o.offset = offset;
+      o.has_offset = has_offset;
+      o.bytes.assign(data, data + len);
+    });
+  }
+
+  static int intf_stat(lua_State * L) {
+    async_io * self = recover_self_upvalue<async_io>(L);
+    const char * path = luaL_checkstring(L, 1);
+    return self->submit(L, [&](operation & o) {
+      o.kind = op::stat;
+      o.path = path;
+    });
+  }
+
+  static std::array<const luaL_Reg, 3> get_funcs() {
+    std::array<const luaL_Reg, 3> funcs = {{
+      luaL_Reg{"read", &intf_read},
+      luaL_Reg{"write", &intf_write},
+      luaL_Reg{"stat", &intf_stat},
+    }};
+    return funcs;
+  }
+
+  // Pushes the results of a finished operation, and returns how many. The
+  // bytes of a read go into `buffer` only once the results are all made, so
+  // that they are still there if that fails.
+  static int push_results(lua_State * L, const operation & o,
+                          byte_buffer *& buffer) {
+    if (o.error) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "%s: %s", o.path.c_str(), std::strerror(o.error));
+      lua_pushinteger(L, o.error);
+      return 3;
+    }
+    switch (o.kind) {
+      case op::read:
+        primer::push_udata<byte_buffer>(L);
+        buffer = primer::test_udata<byte_buffer>(L, -1);
+        break;
+      case op::write:
+        lua_pushinteger(L, static_cast<lua_Integer>(o.count));
+        break;
+      case op::stat:
+        lua_createtable(L, 0, 2);
+        lua_pushinteger(L, static_cast<lua_Integer>(o.count));
+        lua_setfield(L, -2, "size");
+        lua_pushstring(L, o.type);
+        lua_setfield(L, -2, "type");
+        break;
+    }
+    return 1;
+  }
+
+  // Stops and joins the workers which were started
+  void stop() noexcept {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto & w : workers_) {
+      w.join();
+    }
+  }
+
+public:
+  // Note: Can throw `std::system_error`, when the worker threads are started
+  explicit async_io(unsigned threads = 2, const char * global = "aio")
+    : global_(global) {
+    if (!threads) { threads = 1; }
+    PRIMER_TRY {
+      for (unsigned i = 0; i < threads; ++i) {
+        workers_.emplace_back([this]() { this->work(); });
+      }
+    }
+    PRIMER_CATCH(...) {
+      // The destructor doesn't run, and joinable threads would terminate
+      this->stop();
+      PRIMER_RETHROW;
+    }
+  }
+
+  ~async_io() noexcept { this->stop(); }
+
+  async_io(const async_io &) = delete;
+  async_io & operator=(const async_io &) = delete;
+
+  // The scheduler which runs the tasks that call the functions
+  void set_scheduler(scheduler * s) noexcept { sched_ = s; }
+
+  // The number of operations which have been started, and not delivered
+  std::size_t in_flight() const noexcept { return in_flight_; }
+
+  // Hands the results of the finished operations to the scheduler, which
+  // resumes their tasks on its next tick. Returns the number delivered.
+  // Results which can't be made for lack of memory are kept for the next call.
+  std::size_t poll() noexcept {
+    std::list<operation> finished;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      finished.splice(finished.end(), done_);
+    }
+    lua_State * L = sref_.lock();
+    if (finished.empty() || !L || !sched_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_.splice(done_.begin(), finished);
+      return 0;
+    }
+
+    std::size_t delivered = 0;
+    while (!finished.empty()) {
+      operation & o = finished.front();
+      lua_ref_seq results;
+      byte_buffer * buffer = nullptr;
+      auto ok = primer::mem_pcall(L, [&]() {
+        const int n = push_results(L, o, buffer);
+        primer::pop_n(L, n, results);
+      });
+      if (!ok) { break; }
+      if (buffer) { buffer->bytes().swap(o.bytes); }
+      PRIMER_TRY_BAD_ALLOC {
+        sched_->complete_seq(o.ticket, std::move(results));
+      }
+      PRIMER_CATCH_BAD_ALLOC { break; }
+      finished.pop_front();
+      --in_flight_;
+      ++delivered;
+    }
+    if (!finished.empty()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_.splice(done_.begin(), finished);
+    }
+    return delivered;
+  }
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    sref_ = primer::obtain_state_ref(L);
+    lua_newtable(L);
+    api::set_self_closures(L, get_funcs(), this);
+    lua_setglobal(L, global_);
+  }
+
+  void on_persist_table(lua_State * L) {
+    api::set_self_closures_prefix_reverse(L, "async_io__", get_funcs());
+  }
+
+  void on_unpersist_table(lua_State * L) {
+    api::set_self_closures_prefix(L, "async_io__", get_funcs(), this);
+  }
+};
+
+} // end namespace api
+} // end namespace primer
@@ -20,8 +20,11 @@ namespace primer {
 
 namespace api {
 
-template <typename T>
-struct base : public callback_registrar<T>, public persistable<T> {};
+// `slot` is the extraspace slot, and `instrumented` turns on the counters of
+// the callbacks, see <primer/api/callback_registrar.hpp>
+template <typename T, int slot = -1, bool instrumented = false>
+struct base : public callback_registrar<T, slot, instrumented>,
+              public persistable<T> {};
 
 } // end namespace api
 
@@ -0,0 +1,228 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_bytecode_cache_overview
+/*`
+`primer::api::bytecode_cache` keeps the compiled form of lua chunks, so that a
+module which is loaded into many lua states is only parsed once.
+
+A "VFS Provider" can call `bytecode_cache::load` in place of `luaL_loadbuffer`.
+The cache is keyed by the path and a hash of the source text, so if the source
+changes, it is compiled again. A cache may be shared by any number of lua
+states, on any threads; `bytecode_cache::shared()` is one for the process.
+
+A cache may also be given a directory, in which the compiled chunks are stored,
+so that they survive the process. Lua doesn't verify precompiled chunks, so the
+directory must not be writable by anyone untrusted. A chunk which lua rejects,
+e.g. because it was compiled by another version of lua, is compiled again.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/lua_reader_writer.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace primer {
+namespace api {
+
+class bytecode_cache {
+  struct entry {
+    std::uint64_t hash;
+    std::size_t size;
+    std::shared_ptr<const std::string> bytecode;
+  };
+
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, entry> entries_;
+  std::string directory_;
+  std::size_t hits_ = 0;
+  std::size_t disk_hits_ = 0;
+  std::size_t misses_ = 0;
+
+  static std::uint64_t hash(const char * data, std::size_t size) noexcept {
+    std::uint64_t h = 14695981039346656037ull;
+    for (std::size_t i = 0; i < size; ++i) {
+      h ^= static_cast<unsigned char>(data[i]);
+      h *= 1099511628211ull;
+    }
+    return h;
+  }
+
+  // The path is hashed too, so the file name is safe whatever it is
+  std::string file_name(const std::string & path, const entry & e) const {
+    std::ostringstream ss;
+    ss << directory_ << '/' << std::hex << hash(path.data(), path.size())
+       << '-' << e.hash << '-' << e.size << ".luac";
+    return ss.str();
+  }
+
+  std::shared_ptr<const std::string> find(const std::string & path,
+                                          const entry & e) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(path);
+    if (it != entries_.end() && it->second.hash == e.hash
+        && it->second.size == e.size) {
+      ++hits_;
+      return it->second.bytecode;
+    }
+    return {};
+  }
+
+  std::shared_ptr<const std::string> read_file(const std::string & path,
+                                               const entry & e) {
+    if (directory_.empty()) { return {}; }
+    std::ifstream file(file_name(path, e), std::ios::binary);
+    if (!file) { return {}; }
+    std::ostringstream ss;
+    ss << file.rdbuf();
+    if (!file) { return {}; }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++disk_hits_;
+    return std::make_shared<const std::string>(ss.str());
+  }
+
+  // Written to a temporary file first, so that no one reads half of it
+  void write_file(const std::string & path, const entry & e) {
+    if (directory_.empty()) { return; }
+    const std::string name = file_name(path, e);
+    const std::string temp = name + ".tmp";
+    {
+      std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+      file.write(e.bytecode->data(),
+                 static_cast<std::streamsize>(e.bytecode->size()));
+      if (!file) {
+        file.close();
+        std::remove(temp.c_str());
+        return;
+      }
+    }
+    if (std::rename(temp.c_str(), name.c_str())) { std::remove(temp.c_str()); }
+  }
+
+  void store(const std::string & path, entry e) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_[path] = std::move(e);
+  }
+
+public:
+  // Memory only
+  bytecode_cache() = default;
+
+  // Also stores the compiled chunks in `directory`, which must exist
+  explicit bytecode_cache(std::string directory)
+    : directory_(std::move(directory)) {}
+
+  bytecode_cache(const bytecode_cache &) = delete;
+  bytecode_cache & operator=(const bytecode_cache &) = delete;
+
+  // The hash which the cache keys sources by, e.g. for `vfs::source_hash`
+  static std::uint64_t hash_source(const std::string & source) noexcept {
+    return hash(source.data(), source.size());
+  }
+
+  // A memory only cache for the whole process
+  static bytecode_cache & shared() {
+    static bytecode_cache instance;
+    return instance;
+  }
+
+  /***
+   * Pushes the chunk compiled from `source`, like `luaL_loadbuffer` does,
+   * reusing an earlier compilation of the same source at the same path.
+   * On failure, nothing is pushed.
+   */
+  expected<void> load(lua_State * L, const std::string & path,
+                      const char * source, std::size_t size) {
+    PRIMER_TRY_BAD_ALLOC {
+      entry e{hash(source, size), size, {}};
+
+      auto bytecode = this->find(path, e);
+      const bool in_memory = static_cast<bool>(bytecode);
+      if (!in_memory) { bytecode = this->read_file(path, e); }
+
+      if (bytecode) {
+        if (LUA_OK == luaL_loadbufferx(L, bytecode->data(), bytecode->size(),
+                                       path.c_str(), "b")) {
+          if (!in_memory) {
+            e.bytecode = std::move(bytecode);
+            this->store(path, std::move(e));
+          }
+          return {};
+        }
+        lua_pop(L, 1);
+      }
+
+      int code = luaL_loadbuffer(L, source, size, path.c_str());
+      if (code != LUA_OK) { return primer::pop_error(L, code); }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++misses_;
+      }
+
+      std::string dumped;
+      if (lua_dump(L, &detail::trivial_string_writer, &dumped, 0)) {
+        // The chunk is loaded anyways, it just isn't cached
+        return {};
+      }
+      e.bytecode = std::make_shared<const std::string>(std::move(dumped));
+      this->write_file(path, e);
+      this->store(path, std::move(e));
+      return {};
+    }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+  }
+
+  expected<void> load(lua_State * L, const std::string & path,
+                      const std::string & source) {
+    return this->load(L, path, source.data(), source.size());
+  }
+
+  // Forgets the chunks held in memory. Files in the directory are kept.
+  void clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+  }
+
+  // Statistics: loads served from memory, from the directory, and compiled
+  std::size_t hits() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+  }
+
+  std::size_t disk_hits() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return disk_hits_;
+  }
+
+  std::size_t misses() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return misses_;
+  }
+};
+
+} // end namespace api
+} // end namespace primer
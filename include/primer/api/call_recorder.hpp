@@ -0,0 +1,651 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_call_recorder_overview
+/*`
+`primer::api::call_recorder` is an API feature which records the calls from
+C++ into lua, with their arguments, into a compact binary trace, so that the
+same work can be run again later, e.g. to measure a change to the scripts or
+to primer on a real workload.
+
+It uses the same hooks as `call_tracer`, so it needs `PRIMER_CALL_TRACING`,
+and a state can't have both. While the recorder is started, each call of a
+`bound_function` which isn't made from inside another traced call is
+recorded. Resumes of coroutines are not recorded.
+
+Functions which give a different answer each time, like the time or a random
+number, should be stubbed before recording:
+
+``
+  rec_.stub(L, "now");
+  rec_.start();
+  ... // run the game
+  rec_.stop();
+  std::string trace = rec_.trace();
+``
+
+A stubbed function records what it returned, or the message of the error it
+raised, each time it is called while recording. The stubs are persisted with
+the state. `replay(L, trace)` then calls the recorded functions again, in
+order, with the recorded arguments, while each stub returns what it returned
+at that point of the recording, instead of calling the function. It returns a
+`replay_report` with the time of each call.
+
+Replay is meant for a state restored from a snapshot taken when the recording
+started. It finds each function by where it is defined, like
+`[scripts/ai.lua:88]`, among the functions in the global table and in the
+modules of `package.loaded`, or with a resolver function given by the host.
+
+Arguments and results may be nil, booleans, numbers, strings, and tables of
+these. Other values, like functions and userdata, are recorded as nil, and
+counted by `lossy_values()`.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/bound_function.hpp>
+#include <primer/cpp_pcall.hpp>
+#include <primer/error.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/call_trace.hpp>
+#include <primer/support/function.hpp>
+#include <primer/support/lua_state_ref.hpp>
+#include <primer/traits/binary.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+namespace detail {
+
+// The values of a trace. Tables are written as their pairs, and an end tag.
+struct recorded_value {
+  static constexpr char nil = 'n';
+  static constexpr char false_value = 'f';
+  static constexpr char true_value = 't';
+  static constexpr char integer = 'i';
+  static constexpr char number = 'd';
+  static constexpr char string = 's';
+  static constexpr char table = 'T';
+  static constexpr char end = 'e';
+
+  static constexpr int max_depth = 32;
+
+  // Returns the number of values which had to be written as nil
+  static std::size_t write(lua_State * L, int idx, std::string & out,
+                           int depth = 0) {
+    switch (lua_type(L, idx)) {
+      case LUA_TNIL: out += nil; return 0;
+      case LUA_TBOOLEAN:
+        out += lua_toboolean(L, idx) ? true_value : false_value;
+        return 0;
+      case LUA_TNUMBER:
+        if (lua_isinteger(L, idx)) {
+          out += integer;
+          traits::binary<lua_Integer>::write(out, lua_tointeger(L, idx));
+        } else {
+          out += number;
+          traits::binary<lua_Number>::write(out, lua_tonumber(L, idx));
+        }
+        return 0;
+      case LUA_TSTRING: {
+        std::size_t len;
+        const char * str = lua_tolstring(L, idx, &len);
+        out += string;
+        binary_write_size(out, len);
+        out.append(str, len);
+        return 0;
+      }
+      case LUA_TTABLE:
+        if (depth < max_depth && lua_checkstack(L, 3)) {
+          idx = lua_absindex(L, idx);
+          std::size_t lossy = 0;
+          out += table;
+          lua_pushnil(L);
+          while (lua_next(L, idx)) {
+            lossy += write(L, -2, out, depth + 1);
+            lossy += write(L, -1, out, depth + 1);
+            lua_pop(L, 1);
+          }
+          out += end;
+          return lossy;
+        }
+        out += nil;
+        return 1;
+      default: out += nil; return 1;
+    }
+  }
+
+  // Pushes one value. Returns false, with nothing pushed, if the input is
+  // malformed.
+  static bool read(lua_State * L, const char *& pos, const char * end_pos,
+                   int depth = 0) {
+    if (pos == end_pos || !lua_checkstack(L, 3)) { return false; }
+    switch (*pos++) {
+      case nil: lua_pushnil(L); return true;
+      case false_value: lua_pushboolean(L, false); return true;
+      case true_value: lua_pushboolean(L, true); return true;
+      case integer: {
+        lua_Integer i;
+        if (!traits::binary<lua_Integer>::read(pos, end_pos, i)) {
+          return false;
+        }
+        lua_pushinteger(L, i);
+        return true;
+      }
+      case number: {
+        lua_Number n;
+        if (!traits::binary<lua_Number>::read(pos, end_pos, n)) {
+          return false;
+        }
+        lua_pushnumber(L, n);
+        return true;
+      }
+      case string: {
+        std::size_t len;
+        if (!binary_read_count(pos, end_pos, len)) { return false; }
+        lua_pushlstring(L, pos, len);
+        pos += len;
+        return true;
+      }
+      case table: {
+        if (depth >= max_depth) { return false; }
+        lua_newtable(L);
+        while (pos != end_pos && *pos != end) {
+          if (!read(L, pos, end_pos, depth + 1)) {
+            lua_pop(L, 1);
+            return false;
+          }
+          if (!read(L, pos, end_pos, depth + 1)) {
+            lua_pop(L, 2);
+            return false;
+          }
+          if (lua_isnil(L, -2)) {
+            lua_pop(L, 2);
+          } else {
+            lua_rawset(L, -3);
+          }
+        }
+        if (pos == end_pos) {
+          lua_pop(L, 1);
+          return false;
+        }
+        ++pos;
+        return true;
+      }
+      default: return false;
+    }
+  }
+
+  static bool skip_bytes(const char *& pos, const char * end_pos,
+                         std::size_t n) noexcept {
+    if (static_cast<std::size_t>(end_pos - pos) < n) { return false; }
+    pos += n;
+    return true;
+  }
+
+  // Skips one value, checking that it is well-formed
+  static bool skip(const char *& pos, const char * end_pos, int depth = 0) {
+    if (pos == end_pos) { return false; }
+    switch (*pos++) {
+      case nil:
+      case false_value:
+      case true_value: return true;
+      case integer: return skip_bytes(pos, end_pos, sizeof(lua_Integer));
+      case number: return skip_bytes(pos, end_pos, sizeof(lua_Number));
+      case string: {
+        std::size_t len;
+        if (!binary_read_count(pos, end_pos, len)) { return false; }
+        pos += len;
+        return true;
+      }
+      case table:
+        if (depth >= max_depth) { return false; }
+        while (pos != end_pos && *pos != end) {
+          if (!skip(pos, end_pos, depth + 1)
+              || !skip(pos, end_pos, depth + 1)) {
+            return false;
+          }
+        }
+        if (pos == end_pos) { return false; }
+        ++pos;
+        return true;
+      default: return false;
+    }
+  }
+};
+
+} // end namespace detail
+
+namespace api {
+
+class call_recorder {
+public:
+  struct replay_report {
+    std::size_t calls = 0;
+    // Calls which raised an error, and their errors
+    std::size_t failed = 0;
+    std::vector<primer::error> errors;
+    // Calls whose function wasn't found, which were skipped
+    std::size_t unresolved = 0;
+    // The time of each call which was made, in order
+    std::vector<std::chrono::nanoseconds> durations;
+    std::chrono::nanoseconds total{0};
+  };
+
+  // Pushes the function recorded as `where`, e.g. "[scripts/ai.lua:88]", and
+  // returns true, or returns false with nothing pushed
+  using resolver_t = std::function<bool(lua_State *, const std::string &)>;
+
+private:
+  static constexpr char call_event = 'C';
+  static constexpr char result_event = 'R';
+  static constexpr char error_event = 'X';
+
+  static const char * magic() noexcept { return "PRR1"; }
+
+  lua_state_ref sref_;
+  detail::call_trace_hooks hooks_;
+  bool recording_ = false;
+  bool replaying_ = false;
+  int depth_ = 0;
+
+  std::string trace_;
+  std::size_t calls_ = 0;
+  std::size_t lossy_ = 0;
+  bool overflowed_ = false;
+
+  // While replaying, the recorded results of each stub, as positions in the
+  // trace, and whether each was an error
+  const std::string * replay_trace_ = nullptr;
+  std::map<std::string, std::deque<std::pair<std::size_t, bool>>> results_;
+
+  static void * registry_key() noexcept {
+    static char key;
+    return &key;
+  }
+
+  static call_recorder * recover(lua_State * L) {
+    lua_rawgetp(L, LUA_REGISTRYINDEX, registry_key());
+    auto self = static_cast<call_recorder *>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    return self;
+  }
+
+  // Where the function at `idx` is defined
+  static std::string function_key(lua_State * L, int idx) {
+    lua_Debug ar;
+    lua_pushvalue(L, idx);
+    if (!lua_getinfo(L, ">S", &ar)) { return "(unknown)"; }
+    ar.name = nullptr;
+    ar.namewhat = "";
+    return detail::describe_function(ar).substr(1);
+  }
+
+  void append_values(lua_State * L, int first, int n) {
+    detail::binary_write_size(trace_, static_cast<std::size_t>(n));
+    for (int i = 0; i < n; ++i) {
+      lossy_ += detail::recorded_value::write(L, first + i, trace_);
+    }
+  }
+
+  bool identify(lua_State * L, lua_State * T, int fidx,
+                detail::call_trace_token & t) {
+    if (!recording_) { return false; }
+    if (!depth_ && !t.resume && fidx && T == L && lua_checkstack(L, 2)) {
+      PRIMER_TRY_BAD_ALLOC {
+        std::string key = function_key(L, fidx);
+        trace_ += call_event;
+        traits::binary<std::string>::write(trace_, key);
+        this->append_values(L, fidx + 1, t.nargs);
+        ++calls_;
+      }
+      PRIMER_CATCH_BAD_ALLOC { overflowed_ = true; }
+    }
+    ++depth_;
+    return true;
+  }
+
+  void end(const detail::call_trace_token &, bool) noexcept {
+    if (depth_) { --depth_; }
+  }
+
+  static bool identify_hook(void * self, lua_State * L, lua_State * T,
+                            int fidx, detail::call_trace_token & t) {
+    return static_cast<call_recorder *>(self)->identify(L, T, fidx, t);
+  }
+
+  static void end_hook(void * self, const detail::call_trace_token & t,
+                       bool ok) noexcept {
+    static_cast<call_recorder *>(self)->end(t, ok);
+  }
+
+  // Pushes the next recorded results of a stub, or raises its error
+  int replay_stub(lua_State * L, const char * name) {
+    auto it = results_.find(name);
+    if (it == results_.end() || it->second.empty()) {
+      return luaL_error(L, "replay: no more recorded results for '%s'", name);
+    }
+    const auto event = it->second.front();
+    it->second.pop_front();
+    const char * pos = replay_trace_->data() + event.first;
+    const char * end = replay_trace_->data() + replay_trace_->size();
+    if (event.second) {
+      std::size_t len = 0;
+      detail::binary_read_count(pos, end, len);
+      lua_pushlstring(L, pos, len);
+      return lua_error(L);
+    }
+    std::size_t n = 0;
+    detail::binary_read_count(pos, end, n);
+    lua_settop(L, 0);
+    for (std::size_t i = 0; i < n; ++i) {
+      if (!detail::recorded_value::read(L, pos, end)) {
+        return luaL_error(L, "replay: bad results for '%s'", name);
+      }
+    }
+    return static_cast<int>(n);
+  }
+
+  // Upvalues: the original function, and the name of the stub
+  static int stub_function(lua_State * L) {
+    call_recorder * self = recover(L);
+    const char * name = lua_tostring(L, lua_upvalueindex(2));
+    if (self && self->replaying_) { return self->replay_stub(L, name); }
+
+    const int n = lua_gettop(L);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    if (!self || !self->recording_) {
+      lua_call(L, n, LUA_MULTRET);
+      return lua_gettop(L);
+    }
+
+    const int code = lua_pcall(L, n, LUA_MULTRET, 0);
+    PRIMER_TRY_BAD_ALLOC {
+      if (code != LUA_OK) {
+        std::size_t len = 0;
+        const char * msg = lua_tolstring(L, -1, &len);
+        self->trace_ += error_event;
+        traits::binary<std::string>::write(self->trace_, name);
+        traits::binary<std::string>::write(
+          self->trace_, msg ? std::string(msg, len) : "(error object)");
+      } else {
+        self->trace_ += result_event;
+        traits::binary<std::string>::write(self->trace_, name);
+        self->append_values(L, 1, lua_gettop(L));
+      }
+    }
+    PRIMER_CATCH_BAD_ALLOC { self->overflowed_ = true; }
+    if (code != LUA_OK) { return lua_error(L); }
+    return lua_gettop(L);
+  }
+
+  // An index from where functions are defined to the functions, of the
+  // global table and the modules in package.loaded, is pushed
+  static void push_default_index(lua_State * L) {
+    lua_newtable(L);
+    const int index = lua_gettop(L);
+    auto add_table = [&](int t) {
+      lua_pushnil(L);
+      while (lua_next(L, t)) {
+        if (lua_isfunction(L, -1)) {
+          // Keys are strings, since the names may be used for lookups
+          const std::string key = function_key(L, -1);
+          lua_pushlstring(L, key.data(), key.size());
+          if (lua_rawget(L, index) == LUA_TNIL) {
+            lua_pushlstring(L, key.data(), key.size());
+            lua_pushvalue(L, -3);
+            lua_rawset(L, index);
+          }
+          lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+      }
+    };
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    add_table(lua_gettop(L));
+    lua_pop(L, 1);
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+    const int loaded = lua_gettop(L);
+    lua_pushnil(L);
+    while (lua_next(L, loaded)) {
+      if (lua_istable(L, -1)) { add_table(lua_gettop(L)); }
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+
+  struct recorded_call {
+    std::string where;
+    std::size_t args; // Position of the arguments in the trace
+  };
+
+  // Checks the trace, and finds the calls and the results of the stubs
+  expected<std::vector<recorded_call>> parse(const std::string & trace) {
+    std::vector<recorded_call> calls;
+    const std::size_t magic_len = std::strlen(magic());
+    if (trace.size() < magic_len
+        || trace.compare(0, magic_len, magic()) != 0) {
+      return primer::error{"Not a call recording"};
+    }
+    const char * begin = trace.data();
+    const char * pos = begin + magic_len;
+    const char * end = begin + trace.size();
+    const primer::error bad{"Bad call recording"};
+    while (pos != end) {
+      const char kind = *pos++;
+      std::string name;
+      if (!traits::binary<std::string>::read(pos, end, name)) { return bad; }
+      const std::size_t at = static_cast<std::size_t>(pos - begin);
+      if (kind == error_event) {
+        std::string msg;
+        if (!traits::binary<std::string>::read(pos, end, msg)) { return bad; }
+        results_[name].emplace_back(at, true);
+        continue;
+      }
+      std::size_t n;
+      if (!detail::binary_read_count(pos, end, n)) { return bad; }
+      std::size_t i = 0;
+      for (; i < n && detail::recorded_value::skip(pos, end); ++i) {}
+      if (i < n) { return bad; }
+      if (kind == call_event) {
+        calls.push_back(recorded_call{std::move(name), at});
+      } else if (kind == result_event) {
+        results_[name].emplace_back(at, false);
+      } else {
+        return bad;
+      }
+    }
+    return calls;
+  }
+
+public:
+  call_recorder()
+    : hooks_{static_cast<void *>(this), &identify_hook, &end_hook} {
+    trace_ = magic();
+  }
+
+  call_recorder(const call_recorder &) = delete;
+  call_recorder & operator=(const call_recorder &) = delete;
+
+  ~call_recorder() noexcept {
+    if (lua_State * L = sref_.lock()) {
+      lua_rawgetp(L, LUA_REGISTRYINDEX, detail::call_trace_key());
+      const bool ours = (lua_touserdata(L, -1) == &hooks_);
+      lua_pop(L, 1);
+      if (ours) {
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, detail::call_trace_key());
+      }
+      if (recover(L) == this) {
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, registry_key());
+      }
+    }
+  }
+
+  void start() noexcept { recording_ = true; }
+  void stop() noexcept { recording_ = false; }
+  bool recording() const noexcept { return recording_; }
+
+  /***
+   * Replaces the global function `name` with a stub, which records its
+   * results. Returns false if the global is not a function. A function which
+   * is already a stub is left alone.
+   */
+  expected<bool> stub(lua_State * L, const char * name) {
+    expected<bool> result{false};
+    auto ok = primer::cpp_pcall(L, [&]() {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+      if (lua_getfield(L, -1, name) != LUA_TFUNCTION) {
+        lua_pop(L, 1);
+      } else if (lua_tocfunction(L, -1) == &stub_function) {
+        lua_pop(L, 1);
+        *result = true;
+      } else {
+        lua_pushstring(L, name);
+        lua_pushcclosure(L, &stub_function, 2);
+        lua_setfield(L, -2, name);
+        *result = true;
+      }
+      lua_pop(L, 1);
+    });
+    if (!ok) { result = std::move(ok.err()); }
+    return result;
+  }
+
+  // The recording so far
+  const std::string & trace() const noexcept { return trace_; }
+
+  // Forgets the recording
+  void clear() {
+    trace_ = magic();
+    calls_ = 0;
+    lossy_ = 0;
+    overflowed_ = false;
+  }
+
+  std::size_t calls_recorded() const noexcept { return calls_; }
+  std::size_t lossy_values() const noexcept { return lossy_; }
+  // True if memory ran out while recording, so that some events are missing
+  bool incomplete() const noexcept { return overflowed_; }
+
+  /***
+   * Calls the recorded functions again, in order, with the stubs returning
+   * the recorded results.
+   */
+  expected<replay_report> replay(lua_State * L, const std::string & trace,
+                                 resolver_t resolve = {}) {
+    expected<replay_report> result;
+    results_.clear();
+    auto calls = this->parse(trace);
+    if (!calls) { return std::move(calls.err()); }
+
+    replay_report & report = *result;
+    replay_trace_ = &trace;
+    replaying_ = true;
+    const bool was_recording = recording_;
+    recording_ = false;
+
+    auto ok = primer::cpp_pcall(L, [&]() {
+      const int base = lua_gettop(L);
+      if (!resolve) { push_default_index(L); }
+      const int index = lua_gettop(L);
+      const char * end = trace.data() + trace.size();
+      for (const recorded_call & c : *calls) {
+        if (resolve) {
+          if (!resolve(L, c.where)) {
+            ++report.unresolved;
+            continue;
+          }
+        } else {
+          lua_pushlstring(L, c.where.data(), c.where.size());
+          lua_rawget(L, index);
+        }
+        if (!lua_isfunction(L, -1)) {
+          lua_pop(L, 1);
+          ++report.unresolved;
+          continue;
+        }
+
+        const char * pos = trace.data() + c.args;
+        std::size_t n = 0;
+        detail::binary_read_count(pos, end, n);
+        luaL_checkstack(L, static_cast<int>(n) + 2, "replay");
+        for (std::size_t i = 0; i < n; ++i) {
+          if (!detail::recorded_value::read(L, pos, end)) {
+            luaL_error(L, "replay: bad arguments");
+          }
+        }
+
+        ++report.calls;
+        const auto start = std::chrono::steady_clock::now();
+        int code;
+        std::tie(code, std::ignore) =
+          detail::pcall_helper(L, static_cast<int>(n), 0);
+        const auto d = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start);
+        report.durations.push_back(d);
+        report.total += d;
+        if (code != LUA_OK) {
+          ++report.failed;
+          report.errors.push_back(primer::pop_error(L, code));
+        }
+      }
+      lua_settop(L, base);
+    });
+
+    replaying_ = false;
+    recording_ = was_recording;
+    replay_trace_ = nullptr;
+    results_.clear();
+    if (!ok) { result = std::move(ok.err()); }
+    return result;
+  }
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    sref_ = primer::obtain_state_ref(L);
+    lua_pushlightuserdata(L, static_cast<void *>(&hooks_));
+    lua_rawsetp(L, LUA_REGISTRYINDEX, detail::call_trace_key());
+    lua_pushlightuserdata(L, static_cast<void *>(this));
+    lua_rawsetp(L, LUA_REGISTRYINDEX, registry_key());
+  }
+
+  void on_persist_table(lua_State * L) {
+    lua_pushcfunction(L, &stub_function);
+    lua_pushliteral(L, "call_recorder_stub");
+    lua_settable(L, -3);
+  }
+
+  void on_unpersist_table(lua_State * L) {
+    lua_pushcfunction(L, &stub_function);
+    lua_setfield(L, -2, "call_recorder_stub");
+  }
+};
+
+} // end namespace api
+} // end namespace primer
@@ -0,0 +1,333 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_call_tracer_overview
+/*`
+`primer::api::call_tracer` is an API feature which records a span for each call
+from C++ into lua, i.e. each call of a `bound_function` and each resume of a
+`coroutine`, so that the time of a frame can be charged to the script entry
+points which used it.
+
+A span has the function which was called, the number of arguments, whether it
+was a resume, whether it succeeded, and its start and duration. Calls are only
+traced when `PRIMER_CALL_TRACING` is defined, see
+`<primer/support/call_trace.hpp>`, and while the tracer is started:
+
+``
+  tracer_.start();
+  ...
+  tracer_.stop();
+  tracer_.write_chrome_trace(file);
+``
+
+Functions are numbered the first time they are called while tracing, and named
+by where they are defined, like `[scripts/ai.lua:88]`. The numbers are kept in
+a weak table of the state, so later calls cost a table lookup, and not a use of
+the debug API. A coroutine is numbered by the function which it started with.
+
+Spans are kept in a ring buffer of fixed size, so that tracing never allocates
+once the functions are known, and the oldest spans are overwritten when it is
+full. They are read by
+
+* `spans()`, oldest first, with `function_name(id)`,
+* `write_chrome_trace(os)`, a JSON array of trace events, which chrome's
+  `about:tracing` and perfetto load.
+
+For other exporters, `set_hook(f, ud)` installs a function which is called with
+each span when the call starts, with `ended` false and no duration, and when it
+ends.
+
+The tracer is not thread-safe, and all of it must be used on the thread which
+runs the state.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/bound_function.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/call_trace.hpp>
+#include <primer/support/lua_state_ref.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+class call_tracer {
+public:
+  struct span {
+    std::uint32_t function;
+    std::uint16_t nargs;
+    bool resume;
+    bool ok;
+    std::uint64_t start_ns; // Since the tracer was made
+    std::uint64_t duration_ns;
+  };
+
+  using hook_t = void (*)(void * ud, const span & s, bool ended);
+
+private:
+  lua_state_ref sref_;
+  detail::call_trace_hooks hooks_;
+  int ids_ref_ = LUA_NOREF; // Weak table, functions and threads to ids
+  bool running_ = false;
+
+  detail::trace_clock::time_point epoch_;
+  std::vector<std::string> names_;
+
+  std::vector<span> ring_;
+  std::size_t next_ = 0;
+  std::size_t size_ = 0;
+  std::size_t overwritten_ = 0;
+
+  hook_t hook_ = nullptr;
+  void * hook_ud_ = nullptr;
+
+  std::uint64_t since_epoch(detail::trace_clock::time_point t) const noexcept {
+    return static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(t - epoch_).count());
+  }
+
+  // The id of the function on top of the stack, which is popped
+  std::uint32_t function_id(lua_State * L, int ids) {
+    lua_pushvalue(L, -1);
+    lua_rawget(L, ids);
+    if (lua_isinteger(L, -1)) {
+      const auto id = static_cast<std::uint32_t>(lua_tointeger(L, -1));
+      lua_pop(L, 2);
+      return id;
+    }
+    lua_pop(L, 1);
+
+    const auto id = static_cast<std::uint32_t>(names_.size());
+    lua_pushvalue(L, -1);
+    lua_pushinteger(L, id);
+    lua_rawset(L, ids);
+
+    lua_Debug ar;
+    std::string name{"(unknown)"};
+    if (lua_getinfo(L, ">S", &ar)) {
+      ar.name = nullptr;
+      ar.namewhat = "";
+      name = detail::describe_function(ar).substr(1);
+    }
+    names_.emplace_back(std::move(name));
+    return id;
+  }
+
+  bool identify(lua_State * L, lua_State * T, int fidx,
+                detail::call_trace_token & t) {
+    if (!running_ || !lua_checkstack(L, 4) || !lua_checkstack(T, 1)) {
+      return false;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ids_ref_);
+    const int ids = lua_gettop(L);
+    if (!lua_istable(L, ids)) {
+      lua_pop(L, 1);
+      return false;
+    }
+
+    if (fidx) {
+      lua_pushvalue(T, fidx);
+      if (T != L) { lua_xmove(T, L, 1); }
+      t.function = this->function_id(L, ids);
+    } else {
+      // A yielded coroutine, which may have been numbered when it started
+      lua_pushthread(T);
+      lua_xmove(T, L, 1);
+      lua_rawget(L, ids);
+      const bool known = lua_isinteger(L, -1);
+      t.function = static_cast<std::uint32_t>(lua_tointeger(L, -1));
+      lua_pop(L, 1);
+      if (!known) {
+        lua_Debug ar;
+        int level = 0;
+        while (lua_getstack(T, level + 1, &ar)) {
+          ++level;
+        }
+        if (!lua_getstack(T, level, &ar) || !lua_getinfo(T, "f", &ar)) {
+          lua_pop(L, 1);
+          return false;
+        }
+        lua_xmove(T, L, 1);
+        t.function = this->function_id(L, ids);
+      }
+    }
+
+    if (T != L) {
+      // Remember the function of the coroutine, replacing the last one the
+      // thread had, if it came from a `coroutine_pool`
+      lua_pushthread(T);
+      lua_xmove(T, L, 1);
+      lua_pushinteger(L, t.function);
+      lua_rawset(L, ids);
+    }
+    lua_pop(L, 1);
+
+    if (hook_) {
+      span s{t.function, static_cast<std::uint16_t>(t.nargs), t.resume, true,
+             this->since_epoch(detail::trace_clock::now()), 0};
+      hook_(hook_ud_, s, false);
+    }
+    return true;
+  }
+
+  void end(const detail::call_trace_token & t, bool ok) noexcept {
+    const auto now = detail::trace_clock::now();
+    const span s{t.function, static_cast<std::uint16_t>(t.nargs), t.resume, ok,
+                 this->since_epoch(t.start),
+                 static_cast<std::uint64_t>(
+                   std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     now - t.start)
+                     .count())};
+    if (!ring_.empty()) {
+      if (size_ == ring_.size()) {
+        ++overwritten_;
+      } else {
+        ++size_;
+      }
+      ring_[next_] = s;
+      next_ = (next_ + 1) % ring_.size();
+    }
+    if (hook_) { hook_(hook_ud_, s, true); }
+  }
+
+  static bool identify_hook(void * self, lua_State * L, lua_State * T,
+                            int fidx, detail::call_trace_token & t) {
+    return static_cast<call_tracer *>(self)->identify(L, T, fidx, t);
+  }
+
+  static void end_hook(void * self, const detail::call_trace_token & t,
+                       bool ok) noexcept {
+    static_cast<call_tracer *>(self)->end(t, ok);
+  }
+
+  static void write_json_string(std::ostream & os, const std::string & str) {
+    static constexpr const char * hex = "0123456789abcdef";
+    os << '"';
+    for (char c : str) {
+      const auto u = static_cast<unsigned char>(c);
+      if (c == '"' || c == '\\') {
+        os << '\\' << c;
+      } else if (u < 0x20) {
+        os << "\\u00" << hex[u >> 4] << hex[u & 0xf];
+      } else {
+        os << c;
+      }
+    }
+    os << '"';
+  }
+
+public:
+  explicit call_tracer(std::size_t capacity = 65536)
+    : hooks_{static_cast<void *>(this), &identify_hook, &end_hook}
+    , epoch_(detail::trace_clock::now())
+    , ring_(capacity) {}
+
+  call_tracer(const call_tracer &) = delete;
+  call_tracer & operator=(const call_tracer &) = delete;
+
+  ~call_tracer() noexcept {
+    if (lua_State * L = sref_.lock()) {
+      lua_rawgetp(L, LUA_REGISTRYINDEX, detail::call_trace_key());
+      const bool ours = (lua_touserdata(L, -1) == &hooks_);
+      lua_pop(L, 1);
+      if (ours) {
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, detail::call_trace_key());
+      }
+      luaL_unref(L, LUA_REGISTRYINDEX, ids_ref_);
+    }
+  }
+
+  void start() noexcept { running_ = true; }
+  void stop() noexcept { running_ = false; }
+  bool running() const noexcept { return running_; }
+
+  // Called at the start and end of each traced call
+  void set_hook(hook_t hook, void * ud) noexcept {
+    hook_ = hook;
+    hook_ud_ = ud;
+  }
+
+  // The recorded spans, oldest first
+  std::vector<span> spans() const {
+    std::vector<span> result;
+    result.reserve(size_);
+    const std::size_t first = (next_ + ring_.size() - size_) % ring_.size();
+    for (std::size_t i = 0; i < size_; ++i) {
+      result.push_back(ring_[(first + i) % ring_.size()]);
+    }
+    return result;
+  }
+
+  // Spans lost to the ring buffer being full
+  std::size_t overwritten() const noexcept { return overwritten_; }
+
+  // Forgets the spans, but not the function names
+  void clear() noexcept {
+    next_ = 0;
+    size_ = 0;
+    overwritten_ = 0;
+  }
+
+  const std::string & function_name(std::uint32_t id) const {
+    static const std::string unknown{"(unknown)"};
+    return id < names_.size() ? names_[id] : unknown;
+  }
+
+  // The spans as "complete" trace events, with times in microseconds
+  void write_chrome_trace(std::ostream & os) const {
+    os << "[";
+    bool first = true;
+    for (const span & s : this->spans()) {
+      if (!first) { os << ","; }
+      first = false;
+      os << "\n{\"name\":";
+      write_json_string(os, this->function_name(s.function));
+      os << ",\"cat\":\"" << (s.resume ? "resume" : "call")
+         << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << s.start_ns / 1000
+         << '.' << (s.start_ns / 100) % 10 << ",\"dur\":"
+         << s.duration_ns / 1000 << '.' << (s.duration_ns / 100) % 10
+         << ",\"args\":{\"nargs\":" << s.nargs
+         << ",\"ok\":" << (s.ok ? "true" : "false") << "}}";
+    }
+    os << "\n]\n";
+  }
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    sref_ = primer::obtain_state_ref(L);
+
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    ids_ref_ = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_pushlightuserdata(L, static_cast<void *>(&hooks_));
+    lua_rawsetp(L, LUA_REGISTRYINDEX, detail::call_trace_key());
+  }
+
+  void on_persist_table(lua_State *) {}
+  void on_unpersist_table(lua_State *) {}
+};
+
+} // end namespace api
+} // end namespace primer
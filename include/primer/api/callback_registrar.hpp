@@ -13,16 +13,27 @@
  * the callbacks.
  *
  * The actual API_FEATURE is called `callbacks`.
+ *
+ * If `instrumented` is true, each callback is wrapped so that it counts its
+ * calls and records its latency, see `callback_stats()`. Otherwise the list
+ * holds the adapted functions themselves, and nothing is recorded.
  */
 
 #include <primer/api/extraspace_dispatch.hpp>
 
+#include <primer/detail/latency_histogram.hpp>
 #include <primer/detail/preprocessor.hpp>
 #include <primer/detail/rank.hpp>
 #include <primer/detail/span.hpp>
 #include <primer/detail/typelist.hpp>
 
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
 
 namespace primer {
 
@@ -47,8 +58,55 @@ struct luaW_RegType {
   static constexpr luaW_Reg get() { return {name(), func(), help()}; }
 };
 
+/***
+ * callback_stat:
+ * A snapshot of the counters of one callback, in instrumented mode.
+ *
+ * `calls` counts every call, and `returned` those which returned normally, so
+ * the difference is the number which raised a lua error. The latencies are of
+ * the calls which returned.
+ */
+
+struct callback_stat {
+  const char * name;
+  std::uint64_t calls;
+  std::uint64_t returned;
+  std::chrono::nanoseconds p50;
+  std::chrono::nanoseconds p99;
+};
+
 namespace detail {
 
+struct callback_counters {
+  std::atomic<std::uint64_t> calls{0};
+  latency_histogram latency;
+};
+
+// The entry of a callback in the list. In instrumented mode, the target is
+// wrapped, and records into the counters of the callback's ordinal.
+template <typename T, std::size_t ordinal, lua_CFunction target,
+          bool instrumented = T::primer_instrument_callbacks>
+struct callback_entry {
+  static constexpr lua_CFunction get() { return target; }
+};
+
+template <typename T, std::size_t ordinal, lua_CFunction target>
+struct callback_entry<T, ordinal, target, true> {
+  // A lua error longjmps through here, so there is nothing to destroy
+  static int instrumented(lua_State * L) {
+    callback_counters & c = T::callback_counters_array()[ordinal];
+    c.calls.fetch_add(1, std::memory_order_relaxed);
+    const auto start = std::chrono::steady_clock::now();
+    const int result = target(L);
+    const auto d = std::chrono::steady_clock::now() - start;
+    c.latency.record(static_cast<std::uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()));
+    return result;
+  }
+
+  static constexpr lua_CFunction get() { return &instrumented; }
+};
+
 // Map compile-time list to an array
 template <typename T, typename TL>
 struct objlist_adaptor;
@@ -64,26 +122,42 @@ struct objlist_adaptor<T, TypeList<Ts...>> {
 
 /***
  * Actual callback_registrar template
+ *
+ * `slot` is the extraspace slot used to dispatch to the owner, see
+ * <primer/api/extraspace_dispatch.hpp>. The default `-1` means that the owner
+ * is the only one, and the extraspace points directly to it.
+ *
+ * `instrumented` turns on the counters of the callbacks. They are kept per
+ * owner type, not per object, and may be updated from several threads, e.g. by
+ * the states of a `vm_pool`.
  */
 
-template <typename T>
+template <typename T, int slot = -1, bool instrumented = false>
 class callback_registrar {
 
 protected:
   typedef T owner_type;
 
-  // detail, typelist assembly
-  static inline detail::TypeList<> GetCallbacks(primer::detail::Rank<0>);
+  // detail, typelist assembly, in chunks, see <primer/detail/rank.hpp>
+  static inline detail::TypeList<> GetCallbacks(primer::detail::RankChunk<0>,
+                                                primer::detail::Rank<0>);
+  static inline std::integral_constant<int, 0>
+    GetCallbacksChunk(primer::detail::Rank<0>);
 
-  static constexpr int maxCallbacks = 100;
+  static constexpr int maxCallbacks = primer::detail::rank_max_size;
 
 public:
+  static constexpr int primer_extraspace_slot = slot;
+
 /***
  * Methods to access the registries in a simple form at runtime.
  */
 
 #define GET_CALLBACKS                                                          \
-  decltype(owner_type::GetCallbacks(primer::detail::Rank<maxCallbacks>{}))
+  decltype(owner_type::GetCallbacks(                                           \
+    primer::detail::RankChunk<decltype(owner_type::GetCallbacksChunk(          \
+      primer::detail::Rank<primer::detail::rank_max_chunks>{}))::value>{},     \
+    primer::detail::Rank<primer::detail::rank_chunk_size>{}))
 
   static detail::span<const luaW_Reg> callbacks_array() {
     // arrays of size zero are not allowed
@@ -94,8 +168,49 @@ public:
       detail::objlist_adaptor<const luaW_Reg, GET_CALLBACKS>::to_array());
     return static_instance;
   }
+
+  /***
+   * Counters of the callbacks, by ordinal, in instrumented mode
+   */
+
+  static constexpr bool primer_instrument_callbacks = instrumented;
+
+  static detail::callback_counters * callback_counters_array() {
+    static detail::callback_counters counters[GET_CALLBACKS::size
+                                                ? GET_CALLBACKS::size
+                                                : 1];
+    return counters;
+  }
+
+  static std::vector<callback_stat> callback_stats() {
+    PRIMER_STATIC_ASSERT(instrumented, "The callbacks are not instrumented");
+    std::vector<callback_stat> result;
+    const detail::callback_counters * counters = callback_counters_array();
+    std::size_t i = 0;
+    for (const luaW_Reg & r : callbacks_array()) {
+      const detail::callback_counters & c = counters[i++];
+      result.push_back(
+        callback_stat{r.name, c.calls.load(std::memory_order_relaxed),
+                      c.latency.count(),
+                      std::chrono::nanoseconds{c.latency.quantile(0.5)},
+                      std::chrono::nanoseconds{c.latency.quantile(0.99)}});
+    }
+    return result;
+  }
+
+  static void reset_callback_stats() noexcept {
+    detail::callback_counters * counters = callback_counters_array();
+    for (std::size_t i = 0; i < GET_CALLBACKS::size; ++i) {
+      counters[i].calls.store(0, std::memory_order_relaxed);
+      counters[i].latency.reset();
+    }
+  }
 };
 
+template <typename T, int slot, bool instrumented>
+constexpr bool
+  callback_registrar<T, slot, instrumented>::primer_instrument_callbacks;
+
 } // end namespace primer
 
 /***
@@ -110,15 +225,27 @@ public:
 #define USE_LUA_CALLBACK_3(name, help, fcn)                                    \
   static constexpr const char * lua_callback_name_##name() { return #name; }   \
   static constexpr const char * lua_callback_help_##name() { return help; }    \
+  static constexpr std::size_t lua_callback_ordinal_##name =                   \
+    GET_CALLBACKS::size;                                                       \
+  static_assert(lua_callback_ordinal_##name < maxCallbacks,                    \
+                "Too many callbacks");                                         \
   static constexpr lua_CFunction lua_get_fcn_ptr_##name() {                    \
-    return PRIMER_ADAPT_EXTRASPACE(owner_type, fcn);                           \
+    return primer::detail::callback_entry<                                     \
+      owner_type, lua_callback_ordinal_##name,                                 \
+      PRIMER_ADAPT_EXTRASPACE(owner_type, fcn)>::get();                        \
   }                                                                            \
   static inline primer::detail::                                               \
     Append_t<GET_CALLBACKS,                                                    \
              primer::luaW_RegType<&owner_type::lua_callback_name_##name,       \
                                   &owner_type::lua_callback_help_##name,       \
                                   &owner_type::lua_get_fcn_ptr_##name>>        \
-      GetCallbacks(primer::detail::Rank<GET_CALLBACKS::size + 1>);             \
+      GetCallbacks(                                                            \
+        primer::detail::rank_chunk_of<lua_callback_ordinal_##name + 1>,        \
+        primer::detail::rank_position_of<lua_callback_ordinal_##name + 1>);    \
+  static inline primer::detail::rank_chunk_index<                              \
+    lua_callback_ordinal_##name + 1>                                           \
+    GetCallbacksChunk(                                                         \
+      primer::detail::rank_chunk_marker<lua_callback_ordinal_##name + 1>);     \
   static_assert(true, "")
 
 #define USE_LUA_CALLBACK_2(name, fcn) USE_LUA_CALLBACK_3(name, "", fcn)
@@ -12,13 +12,30 @@
  * It provides them as global functions to the lua state, and ensures that they
  * are in the persistent objects table.
  *
- * It also registers their help strings.
+ * It also makes their help strings available. When the list is the
+ * `callbacks_array()` of the owner type, the help is looked up in a
+ * `help_index` built once for that type and shared by all lua states.
+ * Otherwise each help string is copied into the help table of the state.
  *
  * Finally, it is initalizes the lua_extraspace pointer to the value "owner_ptr"
  * which is passed to it. This should point to the base class of any member
  * functions that are passed to lua using the ADAPT_EXTRASPACE macro. This
  * should generally be the class deriving from api::base.
  *
+ * If the owner type selects an extraspace slot, only that slot of the owner
+ * table is written, so several callbacks features with distinct owners can
+ * share one lua state.
+ *
+ * In the lazy mode, `callbacks(this, callbacks::install_mode::lazy)`, the
+ * globals are not set at init. Instead `_G` gets an `__index` metamethod,
+ * which looks a missing name up in an index of the callbacks of the owner
+ * type, sorted once and shared by all lua states, and sets the global the
+ * first time it is read. This saves time and memory at startup when a script
+ * uses few of many callbacks. The persist and unpersist tables still list
+ * every callback. Until a callback is used, `rawget` and `pairs` on `_G`
+ * don't see it. If `_G` already has an `__index` metamethod, the globals are
+ * set at init as usual.
+ *
  * Note that you can use other methods for registering / dispatching callbacks,
  * but the extraspace method will be the most performant.
  */
@@ -35,39 +52,146 @@ PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/detail/span.hpp>
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
 namespace primer {
 
+namespace detail {
+
+// The help index of the callbacks of `T`, built the first time it is needed
+template <typename T>
+const api::help_index &
+callbacks_help_index() {
+  static const api::help_index instance{T::callbacks_array()};
+  return instance;
+}
+
+// The callbacks of `T`, sorted by name, built the first time it is needed
+template <typename T>
+const std::vector<const luaW_Reg *> &
+callbacks_sorted_index() {
+  static const std::vector<const luaW_Reg *> instance = []() {
+    std::vector<const luaW_Reg *> result;
+    for (const auto & r : T::callbacks_array()) {
+      if (r.name && r.func) { result.push_back(&r); }
+    }
+    std::sort(result.begin(), result.end(),
+              [](const luaW_Reg * a, const luaW_Reg * b) {
+                return std::strcmp(a->name, b->name) < 0;
+              });
+    return result;
+  }();
+  return instance;
+}
+
+// The `__index` of `_G` in the lazy mode. Sets the global which was missing,
+// if it is a callback of `T`.
+template <typename T>
+int
+lazy_callbacks_index(lua_State * L) {
+  if (lua_type(L, 2) != LUA_TSTRING) { return 0; }
+  const char * key = lua_tostring(L, 2);
+
+  const auto & index = callbacks_sorted_index<T>();
+  auto it = std::lower_bound(index.begin(), index.end(), key,
+                             [](const luaW_Reg * r, const char * k) {
+                               return std::strcmp(r->name, k) < 0;
+                             });
+  if (it == index.end() || std::strcmp((*it)->name, key)) { return 0; }
+
+  lua_pushcfunction(L, (*it)->func);
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, 1);
+  return 1;
+}
+
+} // end namespace detail
+
 namespace api {
 
 class callbacks {
+public:
+  enum class install_mode { eager, lazy };
 
+private:
   detail::span<const luaW_Reg> list_;
   void * owner_ptr_;
+  int slot_;
+  const help_index & (*help_)();
+  lua_CFunction lazy_index_;
+  bool lazy_installed_;
+
+  // The name of the `__index` of `_G` in the persist tables
+  static const char * lazy_index_name() noexcept {
+    return "primer_lazy_callbacks_index";
+  }
+
+  template <typename T>
+  constexpr callbacks(const detail::span<const luaW_Reg> & _l,
+                      T * _owner_ptr, const help_index & (*_help)(),
+                      lua_CFunction _lazy_index)
+    : list_(_l)
+    , owner_ptr_(static_cast<void *>(_owner_ptr))
+    , slot_(detail::extraspace_slot<T>::value)
+    , help_(_help)
+    , lazy_index_(_lazy_index)
+    , lazy_installed_(false) {}
+
+  // Sets `lazy_index_` as the `__index` of `_G`. False if `_G` has another.
+  // Note: Can cause lua memory allocation failure
+  bool install_lazy_index(lua_State * L) const {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    if (!lua_getmetatable(L, -1)) {
+      lua_createtable(L, 0, 1);
+      lua_pushvalue(L, -1);
+      lua_setmetatable(L, -3);
+    }
+    lua_getfield(L, -1, "__index");
+    const bool free = lua_isnil(L, -1) || lua_tocfunction(L, -1) == lazy_index_;
+    lua_pop(L, 1);
+    if (free) {
+      lua_pushcfunction(L, lazy_index_);
+      lua_setfield(L, -2, "__index");
+    }
+    lua_pop(L, 2);
+    return free;
+  }
 
 public:
   template <typename T>
   constexpr explicit callbacks(const detail::span<const luaW_Reg> & _l,
                                T * _owner_ptr)
-    : list_(_l)
-    , owner_ptr_(static_cast<void *>(_owner_ptr)) {}
+    : callbacks(_l, _owner_ptr, nullptr, nullptr) {}
 
   // This is the ctor you should usually use, when using this
   // with an api_base object
   template <typename T>
-  constexpr explicit callbacks(T * _owner_ptr)
-    : callbacks(T::callbacks_array(), _owner_ptr) {}
+  constexpr explicit callbacks(T * _owner_ptr,
+                               install_mode mode = install_mode::eager)
+    : callbacks(T::callbacks_array(), _owner_ptr,
+                &detail::callbacks_help_index<T>,
+                mode == install_mode::lazy ? &detail::lazy_callbacks_index<T>
+                                           : nullptr) {}
 
   //
   // API Feature
   //
 
-  void on_init(lua_State * L) const {
-    // Initialize the extraspace to point to the owner
-    detail::access_extraspace_ptr(L) = owner_ptr_;
+  void on_init(lua_State * L) {
+    // Initialize the extraspace (or our slot of it) to point to the owner
+    detail::set_extraspace_owner(L, slot_, owner_ptr_);
+
+    if (help_) { api::add_help_index(L, help_()); }
+
+    lazy_installed_ = lazy_index_ && this->install_lazy_index(L);
+    if (lazy_installed_) { return; }
 
     for (const auto & r : list_) {
       if (r.func) {
-        api::set_help_string(L, r.func, r.help);
+        if (!help_) { api::set_help_string(L, r.func, r.help); }
         lua_pushcfunction(L, r.func);
         lua_setglobal(L, r.name);
       }
@@ -75,10 +199,24 @@ public:
   }
 
   // Register as func - name pairs
-  void on_persist_table(lua_State * L) const { set_funcs_reverse(L, list_); }
+  void on_persist_table(lua_State * L) const {
+    set_funcs_reverse(L, list_);
+    if (lazy_installed_) {
+      lua_pushcfunction(L, lazy_index_);
+      lua_pushstring(L, lazy_index_name());
+      lua_settable(L, -3);
+    }
+  }
 
   // Register as name - func pairs
-  void on_unpersist_table(lua_State * L) const { set_funcs(L, list_); }
+  void on_unpersist_table(lua_State * L) const {
+    set_funcs(L, list_);
+    if (lazy_installed_) {
+      lua_pushstring(L, lazy_index_name());
+      lua_pushcfunction(L, lazy_index_);
+      lua_settable(L, -3);
+    }
+  }
 };
 
 } // end namespace api
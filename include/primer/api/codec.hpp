@@ -0,0 +1,993 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_codec_overview
+/*`
+`primer::api::codec` is an API feature which encodes lua values as msgpack or
+JSON, and decodes them, without reading them into C++ containers first. The
+encoder walks the value on the stack and appends bytes to a `std::string` or
+a `primer::byte_buffer`, and the decoder pushes tables straight from the
+bytes. The tables of a msgpack message are created with their sizes from the
+array and map headers.
+
+From C++:
+
+``
+  std::string out;
+  auto ok = primer::api::codec::encode_msgpack(L, idx, out);
+  ...
+  auto ok = primer::api::codec::decode_msgpack(L, out.data(), out.size());
+``
+
+A decode pushes one value, or nothing if it fails. From lua, the feature
+adds a global table `codec`, with
+
+* `codec.encode_msgpack(v [, buffer])`, `codec.encode_json(v [, buffer])`,
+which return a string, or append to a byte buffer and return it, and
+* `codec.decode_msgpack(s)`, `codec.decode_json(s)`, of a string or a byte
+buffer.
+
+A table is an array if its keys are exactly `1..n`, and otherwise it is a map.
+An empty table is an empty map. JSON objects need string keys, so integer
+keys are written as strings, and other keys are an error. Integers and floats
+stay apart: a float is written with a decimal point or exponent in JSON, and
+as a float64 in msgpack. JSON has no NaN or infinity, so they are an error, and
+`null` is decoded as `nil`.
+
+Functions, userdata, threads, and tables nested more than 64 deep, which
+includes tables which contain themselves, can't be encoded. The decoders
+check every length against the input, so a malformed message is an error and
+can't make them allocate more than the size of the input.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/adapt.hpp>
+#include <primer/byte_buffer.hpp>
+#include <primer/cpp_pcall.hpp>
+#include <primer/error.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/result.hpp>
+#include <primer/set_funcs.hpp>
+#include <primer/userdata.hpp>
+
+#include <primer/api/callback_registrar.hpp>
+#include <primer/api/help.hpp>
+
+#include <primer/detail/span.hpp>
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace primer {
+
+namespace detail {
+
+inline void
+codec_append(std::string & out, const char * p, std::size_t n) {
+  out.append(p, n);
+}
+
+inline void
+codec_append(std::vector<unsigned char> & out, const char * p,
+             std::size_t n) {
+  const auto * b = reinterpret_cast<const unsigned char *>(p);
+  out.insert(out.end(), b, b + n);
+}
+
+constexpr int codec_max_depth = 64;
+
+// The array length of the table at `idx`, or -1 if it is not an array
+inline LUA_INTEGER
+codec_array_length(lua_State * L, int idx) {
+  const LUA_INTEGER n = static_cast<LUA_INTEGER>(lua_rawlen(L, idx));
+  if (!n) { return -1; }
+  LUA_INTEGER count = 0;
+  lua_pushnil(L);
+  while (lua_next(L, idx)) {
+    lua_pop(L, 1);
+    if (!lua_isinteger(L, -1)) {
+      lua_pop(L, 1);
+      return -1;
+    }
+    const LUA_INTEGER k = lua_tointeger(L, -1);
+    if (k < 1 || k > n) {
+      lua_pop(L, 1);
+      return -1;
+    }
+    ++count;
+  }
+  return (count == n) ? n : -1;
+}
+
+// Common to the encoders: the output, and the first error
+template <typename Out>
+struct codec_writer {
+  lua_State * L;
+  Out & out;
+  const char * error;
+
+  codec_writer(lua_State * _L, Out & _out) noexcept
+    : L(_L)
+    , out(_out)
+    , error(nullptr) {}
+
+  void put(const char * p, std::size_t n) { codec_append(out, p, n); }
+  void put(char c) { codec_append(out, &c, 1); }
+
+  bool fail(const char * msg) {
+    if (!error) { error = msg; }
+    return false;
+  }
+
+  bool fail_type(int t) {
+    switch (t) {
+      case LUA_TFUNCTION: return fail("Cannot encode a function");
+      case LUA_TUSERDATA:
+      case LUA_TLIGHTUSERDATA: return fail("Cannot encode a userdata");
+      case LUA_TTHREAD: return fail("Cannot encode a thread");
+      default: return fail("Cannot encode this value");
+    }
+  }
+};
+
+/***
+ * msgpack
+ */
+
+template <typename Out>
+struct msgpack_encoder : codec_writer<Out> {
+  using codec_writer<Out>::put;
+  using codec_writer<Out>::fail;
+
+  using codec_writer<Out>::codec_writer;
+
+  void put_be(unsigned char tag, std::uint64_t v, int bytes) {
+    char buf[9];
+    buf[0] = static_cast<char>(tag);
+    for (int i = 0; i < bytes; ++i) {
+      buf[bytes - i] = static_cast<char>((v >> (8 * i)) & 0xff);
+    }
+    put(buf, static_cast<std::size_t>(bytes) + 1);
+  }
+
+  // A length, in the smallest of the fix, 16 and 32 bit forms
+  void put_length(std::size_t n, unsigned char fix, std::size_t fix_max,
+                  unsigned char tag8, unsigned char tag16,
+                  unsigned char tag32) {
+    if (n <= fix_max) {
+      put(static_cast<char>(fix | n));
+    } else if (tag8 && n <= 0xff) {
+      put_be(tag8, n, 1);
+    } else if (n <= 0xffff) {
+      put_be(tag16, n, 2);
+    } else {
+      put_be(tag32, n, 4);
+    }
+  }
+
+  void put_integer(LUA_INTEGER i) {
+    if (i >= 0) {
+      const auto u = static_cast<std::uint64_t>(i);
+      if (u < 0x80) {
+        put(static_cast<char>(u));
+      } else if (u <= 0xff) {
+        put_be(0xcc, u, 1);
+      } else if (u <= 0xffff) {
+        put_be(0xcd, u, 2);
+      } else if (u <= 0xffffffffu) {
+        put_be(0xce, u, 4);
+      } else {
+        put_be(0xcf, u, 8);
+      }
+    } else if (i >= -32) {
+      put(static_cast<char>(i));
+    } else {
+      const auto u = static_cast<std::uint64_t>(i);
+      if (i >= -128) {
+        put_be(0xd0, u, 1);
+      } else if (i >= -32768) {
+        put_be(0xd1, u, 2);
+      } else if (i >= -2147483647 - 1) {
+        put_be(0xd2, u, 4);
+      } else {
+        put_be(0xd3, u, 8);
+      }
+    }
+  }
+
+  void put_number(double d) {
+    std::uint64_t bits;
+    std::memcpy(&bits, &d, sizeof bits);
+    put_be(0xcb, bits, 8);
+  }
+
+  bool write(int idx, int depth) {
+    lua_State * L = this->L;
+    switch (lua_type(L, idx)) {
+      case LUA_TNIL: put(static_cast<char>(0xc0)); return true;
+      case LUA_TBOOLEAN:
+        put(static_cast<char>(lua_toboolean(L, idx) ? 0xc3 : 0xc2));
+        return true;
+      case LUA_TNUMBER:
+        if (lua_isinteger(L, idx)) {
+          put_integer(lua_tointeger(L, idx));
+        } else {
+          put_number(static_cast<double>(lua_tonumber(L, idx)));
+        }
+        return true;
+      case LUA_TSTRING: {
+        std::size_t len;
+        const char * s = lua_tolstring(L, idx, &len);
+        if (len > 0xffffffffu) { return fail("String too long for msgpack"); }
+        put_length(len, 0xa0, 31, 0xd9, 0xda, 0xdb);
+        put(s, len);
+        return true;
+      }
+      case LUA_TTABLE: return write_table(lua_absindex(L, idx), depth);
+      default: return this->fail_type(lua_type(L, idx));
+    }
+  }
+
+  bool write_table(int idx, int depth) {
+    lua_State * L = this->L;
+    if (depth >= codec_max_depth) { return fail("Tables nested too deeply"); }
+    if (!lua_checkstack(L, 3)) { return fail("Not enough stack space"); }
+
+    const LUA_INTEGER n = codec_array_length(L, idx);
+    if (n >= 0) {
+      if (static_cast<std::uint64_t>(n) > 0xffffffffu) {
+        return fail("Table too long for msgpack");
+      }
+      put_length(static_cast<std::size_t>(n), 0x90, 15, 0, 0xdc, 0xdd);
+      for (LUA_INTEGER i = 1; i <= n; ++i) {
+        lua_rawgeti(L, idx, i);
+        const bool ok = write(-1, depth + 1);
+        lua_pop(L, 1);
+        if (!ok) { return false; }
+      }
+      return true;
+    }
+
+    std::size_t count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+      lua_pop(L, 1);
+      ++count;
+    }
+    if (count > 0xffffffffu) { return fail("Table too long for msgpack"); }
+    put_length(count, 0x80, 15, 0, 0xde, 0xdf);
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+      if (!write(-2, depth + 1) || !write(-1, depth + 1)) {
+        lua_pop(L, 2);
+        return false;
+      }
+      lua_pop(L, 1);
+    }
+    return true;
+  }
+};
+
+// Common to the decoders: the input, and the first error
+struct codec_reader {
+  lua_State * L;
+  const unsigned char * pos;
+  const unsigned char * end;
+  const char * error;
+
+  codec_reader(lua_State * _L, const char * data, std::size_t n) noexcept
+    : L(_L)
+    , pos(reinterpret_cast<const unsigned char *>(data))
+    , end(pos + n)
+    , error(nullptr) {}
+
+  bool fail(const char * msg) {
+    if (!error) { error = msg; }
+    return false;
+  }
+
+  std::size_t remaining() const noexcept {
+    return static_cast<std::size_t>(end - pos);
+  }
+};
+
+struct msgpack_decoder : codec_reader {
+  using codec_reader::codec_reader;
+
+  void skip_trailing() noexcept {}
+
+  bool get_be(int bytes, std::uint64_t & v) {
+    if (remaining() < static_cast<std::size_t>(bytes)) {
+      return fail("Truncated msgpack");
+    }
+    v = 0;
+    for (int i = 0; i < bytes; ++i) {
+      v = (v << 8) | *pos++;
+    }
+    return true;
+  }
+
+  bool push_string(std::uint64_t n) {
+    if (n > remaining()) { return fail("Truncated msgpack"); }
+    lua_pushlstring(L, reinterpret_cast<const char *>(pos),
+                    static_cast<std::size_t>(n));
+    pos += n;
+    return true;
+  }
+
+  bool push_signed(std::uint64_t v, int bytes) {
+    // Sign-extend the value, without shifting negative numbers
+    if (bytes < 8 && (v >> (8 * bytes - 1))) {
+      v |= ~std::uint64_t{0} << (8 * bytes);
+    }
+    lua_pushinteger(L, static_cast<LUA_INTEGER>(static_cast<std::int64_t>(v)));
+    return true;
+  }
+
+  // Each element takes a byte at least, which bounds the sizes by the input
+  bool push_array(std::uint64_t n, int depth) {
+    if (n > remaining()) { return fail("Truncated msgpack"); }
+    if (depth >= codec_max_depth) { return fail("Tables nested too deeply"); }
+    if (!lua_checkstack(L, 3)) { return fail("Not enough stack space"); }
+    lua_createtable(L, static_cast<int>(n), 0);
+    for (std::uint64_t i = 1; i <= n; ++i) {
+      if (!read(depth + 1)) { return false; }
+      lua_rawseti(L, -2, static_cast<LUA_INTEGER>(i));
+    }
+    return true;
+  }
+
+  bool push_map(std::uint64_t n, int depth) {
+    if (n > remaining() / 2) { return fail("Truncated msgpack"); }
+    if (depth >= codec_max_depth) { return fail("Tables nested too deeply"); }
+    if (!lua_checkstack(L, 4)) { return fail("Not enough stack space"); }
+    lua_createtable(L, 0, static_cast<int>(n));
+    for (std::uint64_t i = 0; i < n; ++i) {
+      if (!read(depth + 1) || !read(depth + 1)) { return false; }
+      if (lua_isnil(L, -2)
+          || (lua_type(L, -2) == LUA_TNUMBER && std::isnan(lua_tonumber(L, -2)))) {
+        return fail("Invalid table key in msgpack");
+      }
+      lua_rawset(L, -3);
+    }
+    return true;
+  }
+
+  bool push_float(std::uint64_t bits, bool single) {
+    if (single) {
+      const auto b32 = static_cast<std::uint32_t>(bits);
+      float f;
+      std::memcpy(&f, &b32, sizeof f);
+      lua_pushnumber(L, static_cast<LUA_NUMBER>(f));
+    } else {
+      double d;
+      std::memcpy(&d, &bits, sizeof d);
+      lua_pushnumber(L, static_cast<LUA_NUMBER>(d));
+    }
+    return true;
+  }
+
+  // Pushes one value
+  bool read(int depth) {
+    if (!remaining()) { return fail("Truncated msgpack"); }
+    const unsigned char tag = *pos++;
+    std::uint64_t v = 0;
+    if (tag < 0x80) {
+      lua_pushinteger(L, tag);
+      return true;
+    }
+    if (tag >= 0xe0) {
+      lua_pushinteger(L, static_cast<LUA_INTEGER>(tag) - 256);
+      return true;
+    }
+    if ((tag & 0xf0) == 0x80) { return push_map(tag & 0x0f, depth); }
+    if ((tag & 0xf0) == 0x90) { return push_array(tag & 0x0f, depth); }
+    if ((tag & 0xe0) == 0xa0) { return push_string(tag & 0x1f); }
+    switch (tag) {
+      case 0xc0: lua_pushnil(L); return true;
+      case 0xc2: lua_pushboolean(L, false); return true;
+      case 0xc3: lua_pushboolean(L, true); return true;
+      // bin and str are both strings
+      case 0xc4:
+      case 0xd9: return get_be(1, v) && push_string(v);
+      case 0xc5:
+      case 0xda: return get_be(2, v) && push_string(v);
+      case 0xc6:
+      case 0xdb: return get_be(4, v) && push_string(v);
+      case 0xca: return get_be(4, v) && push_float(v, true);
+      case 0xcb: return get_be(8, v) && push_float(v, false);
+      case 0xcc:
+      case 0xcd:
+      case 0xce: {
+        const int bytes = 1 << (tag - 0xcc);
+        if (!get_be(bytes, v)) { return false; }
+        lua_pushinteger(L, static_cast<LUA_INTEGER>(v));
+        return true;
+      }
+      case 0xcf:
+        if (!get_be(8, v)) { return false; }
+        // Beyond the range of lua integers, the number is approximate
+        if (v > static_cast<std::uint64_t>(INT64_MAX)) {
+          lua_pushnumber(L, static_cast<LUA_NUMBER>(v));
+        } else {
+          lua_pushinteger(L, static_cast<LUA_INTEGER>(v));
+        }
+        return true;
+      case 0xd0:
+      case 0xd1:
+      case 0xd2:
+      case 0xd3: {
+        const int bytes = 1 << (tag - 0xd0);
+        return get_be(bytes, v) && push_signed(v, bytes);
+      }
+      case 0xdc: return get_be(2, v) && push_array(v, depth);
+      case 0xdd: return get_be(4, v) && push_array(v, depth);
+      case 0xde: return get_be(2, v) && push_map(v, depth);
+      case 0xdf: return get_be(4, v) && push_map(v, depth);
+      default: return fail("Unsupported msgpack type");
+    }
+  }
+};
+
+/***
+ * JSON
+ */
+
+template <typename Out>
+struct json_encoder : codec_writer<Out> {
+  using codec_writer<Out>::put;
+  using codec_writer<Out>::fail;
+
+  using codec_writer<Out>::codec_writer;
+
+  void put_string(const char * s, std::size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    put('"');
+    std::size_t run = 0;
+    for (std::size_t i = 0; i < len; ++i) {
+      const auto c = static_cast<unsigned char>(s[i]);
+      if (c >= 0x20 && c != '"' && c != '\\') { continue; }
+      put(s + run, i - run);
+      run = i + 1;
+      switch (c) {
+        case '"': put("\\\"", 2); break;
+        case '\\': put("\\\\", 2); break;
+        case '\n': put("\\n", 2); break;
+        case '\r': put("\\r", 2); break;
+        case '\t': put("\\t", 2); break;
+        default: {
+          const char esc[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+          put(esc, 6);
+        }
+      }
+    }
+    put(s + run, len - run);
+    put('"');
+  }
+
+  void put_integer(LUA_INTEGER i) {
+    char buf[32];
+    const int n = std::snprintf(buf, sizeof buf, LUA_INTEGER_FMT,
+                                static_cast<LUA_INTEGER>(i));
+    put(buf, static_cast<std::size_t>(n));
+  }
+
+  bool put_number(double d) {
+    if (!std::isfinite(d)) { return fail("Cannot encode NaN or inf as JSON"); }
+    char buf[40];
+    const int n = std::snprintf(buf, sizeof buf, "%.17g", d);
+    put(buf, static_cast<std::size_t>(n));
+    // Keep the decimal point, so that it is decoded as a float
+    if (!std::strpbrk(buf, ".eE")) { put(".0", 2); }
+    return true;
+  }
+
+  bool write(int idx, int depth) {
+    lua_State * L = this->L;
+    switch (lua_type(L, idx)) {
+      case LUA_TNIL: put("null", 4); return true;
+      case LUA_TBOOLEAN:
+        if (lua_toboolean(L, idx)) {
+          put("true", 4);
+        } else {
+          put("false", 5);
+        }
+        return true;
+      case LUA_TNUMBER:
+        if (lua_isinteger(L, idx)) {
+          put_integer(lua_tointeger(L, idx));
+          return true;
+        }
+        return put_number(static_cast<double>(lua_tonumber(L, idx)));
+      case LUA_TSTRING: {
+        std::size_t len;
+        const char * s = lua_tolstring(L, idx, &len);
+        put_string(s, len);
+        return true;
+      }
+      case LUA_TTABLE: return write_table(lua_absindex(L, idx), depth);
+      default: return this->fail_type(lua_type(L, idx));
+    }
+  }
+
+  bool write_table(int idx, int depth) {
+    lua_State * L = this->L;
+    if (depth >= codec_max_depth) { return fail("Tables nested too deeply"); }
+    if (!lua_checkstack(L, 3)) { return fail("Not enough stack space"); }
+
+    const LUA_INTEGER n = codec_array_length(L, idx);
+    if (n >= 0) {
+      put('[');
+      for (LUA_INTEGER i = 1; i <= n; ++i) {
+        if (i > 1) { put(','); }
+        lua_rawgeti(L, idx, i);
+        const bool ok = write(-1, depth + 1);
+        lua_pop(L, 1);
+        if (!ok) { return false; }
+      }
+      put(']');
+      return true;
+    }
+
+    put('{');
+    bool first = true;
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+      if (!first) { put(','); }
+      first = false;
+      // Keys are not converted in place, which would confuse lua_next
+      if (lua_type(L, -2) == LUA_TSTRING) {
+        std::size_t len;
+        const char * s = lua_tolstring(L, -2, &len);
+        put_string(s, len);
+      } else if (lua_isinteger(L, -2)) {
+        put('"');
+        put_integer(lua_tointeger(L, -2));
+        put('"');
+      } else {
+        lua_pop(L, 2);
+        return fail("JSON object keys must be strings or integers");
+      }
+      put(':');
+      if (!write(-1, depth + 1)) {
+        lua_pop(L, 2);
+        return false;
+      }
+      lua_pop(L, 1);
+    }
+    put('}');
+    return true;
+  }
+};
+
+struct json_decoder : codec_reader {
+  using codec_reader::codec_reader;
+
+  void skip_space() noexcept {
+    while (pos != end
+           && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r')) {
+      ++pos;
+    }
+  }
+
+  void skip_trailing() noexcept { skip_space(); }
+
+  bool literal(const char * word, std::size_t n) {
+    if (remaining() < n || std::memcmp(pos, word, n) != 0) {
+      return fail("Invalid JSON");
+    }
+    pos += n;
+    return true;
+  }
+
+  static int hex_digit(unsigned char c) noexcept {
+    if (c >= '0' && c <= '9') { return c - '0'; }
+    if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+    if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+    return -1;
+  }
+
+  bool get_hex4(unsigned & code) {
+    if (remaining() < 4) { return fail("Invalid JSON escape"); }
+    code = 0;
+    for (int i = 0; i < 4; ++i) {
+      const int d = hex_digit(*pos++);
+      if (d < 0) { return fail("Invalid JSON escape"); }
+      code = (code << 4) | static_cast<unsigned>(d);
+    }
+    return true;
+  }
+
+  static void add_utf8(luaL_Buffer & b, unsigned code) {
+    if (code < 0x80) {
+      luaL_addchar(&b, static_cast<char>(code));
+    } else if (code < 0x800) {
+      luaL_addchar(&b, static_cast<char>(0xc0 | (code >> 6)));
+      luaL_addchar(&b, static_cast<char>(0x80 | (code & 0x3f)));
+    } else if (code < 0x10000) {
+      luaL_addchar(&b, static_cast<char>(0xe0 | (code >> 12)));
+      luaL_addchar(&b, static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+      luaL_addchar(&b, static_cast<char>(0x80 | (code & 0x3f)));
+    } else {
+      luaL_addchar(&b, static_cast<char>(0xf0 | (code >> 18)));
+      luaL_addchar(&b, static_cast<char>(0x80 | ((code >> 12) & 0x3f)));
+      luaL_addchar(&b, static_cast<char>(0x80 | ((code >> 6) & 0x3f)));
+      luaL_addchar(&b, static_cast<char>(0x80 | (code & 0x3f)));
+    }
+  }
+
+  // The opening quote has been read. A string without escapes is pushed
+  // directly, and one with escapes is put together in a luaL_Buffer.
+  bool push_string() {
+    const unsigned char * start = pos;
+    while (pos != end && *pos != '"' && *pos != '\\') {
+      if (*pos < 0x20) { return fail("Invalid character in JSON string"); }
+      ++pos;
+    }
+    if (pos == end) { return fail("Unterminated JSON string"); }
+    if (*pos == '"') {
+      lua_pushlstring(L, reinterpret_cast<const char *>(start),
+                      static_cast<std::size_t>(pos - start));
+      ++pos;
+      return true;
+    }
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    luaL_addlstring(&b, reinterpret_cast<const char *>(start),
+                    static_cast<std::size_t>(pos - start));
+    while (pos != end && *pos != '"') {
+      const unsigned char c = *pos++;
+      if (c < 0x20) {
+        luaL_pushresult(&b);
+        lua_pop(L, 1);
+        return fail("Invalid character in JSON string");
+      }
+      if (c != '\\') {
+        luaL_addchar(&b, static_cast<char>(c));
+        continue;
+      }
+      if (pos == end) { break; }
+      const unsigned char e = *pos++;
+      unsigned code = 0;
+      bool ok = true;
+      switch (e) {
+        case '"': luaL_addchar(&b, '"'); break;
+        case '\\': luaL_addchar(&b, '\\'); break;
+        case '/': luaL_addchar(&b, '/'); break;
+        case 'b': luaL_addchar(&b, '\b'); break;
+        case 'f': luaL_addchar(&b, '\f'); break;
+        case 'n': luaL_addchar(&b, '\n'); break;
+        case 'r': luaL_addchar(&b, '\r'); break;
+        case 't': luaL_addchar(&b, '\t'); break;
+        case 'u':
+          ok = get_hex4(code);
+          // A surrogate pair is one code point
+          if (ok && code >= 0xd800 && code < 0xdc00) {
+            unsigned low = 0;
+            ok = remaining() >= 2 && pos[0] == '\\' && pos[1] == 'u';
+            if (ok) {
+              pos += 2;
+              ok = get_hex4(low) && low >= 0xdc00 && low < 0xe000;
+            }
+            code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+          } else if (ok && code >= 0xdc00 && code < 0xe000) {
+            ok = false;
+          }
+          if (ok) { add_utf8(b, code); }
+          break;
+        default: ok = false;
+      }
+      if (!ok) {
+        luaL_pushresult(&b);
+        lua_pop(L, 1);
+        return fail("Invalid JSON escape");
+      }
+    }
+    luaL_pushresult(&b);
+    if (pos == end) {
+      lua_pop(L, 1);
+      return fail("Unterminated JSON string");
+    }
+    ++pos;
+    return true;
+  }
+
+  bool push_number() {
+    const unsigned char * start = pos;
+    if (pos != end && *pos == '-') { ++pos; }
+    const unsigned char * digits = pos;
+    while (pos != end
+           && ((*pos >= '0' && *pos <= '9') || *pos == '.' || *pos == 'e'
+               || *pos == 'E' || *pos == '+' || *pos == '-')) {
+      ++pos;
+    }
+    const std::size_t len = static_cast<std::size_t>(pos - start);
+    char buf[64];
+    if (pos == digits || len >= sizeof buf || *digits < '0' || *digits > '9') {
+      return fail("Invalid JSON number");
+    }
+    std::memcpy(buf, start, len);
+    buf[len] = 0;
+    if (lua_stringtonumber(L, buf) != len + 1) {
+      return fail("Invalid JSON number");
+    }
+    return true;
+  }
+
+  bool push_array(int depth) {
+    lua_newtable(L);
+    skip_space();
+    if (pos != end && *pos == ']') {
+      ++pos;
+      return true;
+    }
+    for (LUA_INTEGER i = 1;; ++i) {
+      if (!read(depth + 1)) { return false; }
+      lua_rawseti(L, -2, i);
+      skip_space();
+      if (pos == end) { return fail("Unterminated JSON array"); }
+      const unsigned char c = *pos++;
+      if (c == ']') { return true; }
+      if (c != ',') { return fail("Expected ',' or ']' in JSON array"); }
+    }
+  }
+
+  bool push_object(int depth) {
+    lua_newtable(L);
+    skip_space();
+    if (pos != end && *pos == '}') {
+      ++pos;
+      return true;
+    }
+    for (;;) {
+      skip_space();
+      if (pos == end || *pos != '"') { return fail("Expected a JSON key"); }
+      ++pos;
+      if (!push_string()) { return false; }
+      skip_space();
+      if (pos == end || *pos++ != ':') { return fail("Expected ':' in JSON"); }
+      if (!read(depth + 1)) { return false; }
+      lua_rawset(L, -3);
+      skip_space();
+      if (pos == end) { return fail("Unterminated JSON object"); }
+      const unsigned char c = *pos++;
+      if (c == '}') { return true; }
+      if (c != ',') { return fail("Expected ',' or '}' in JSON object"); }
+    }
+  }
+
+  // Pushes one value
+  bool read(int depth) {
+    skip_space();
+    if (pos == end) { return fail("Truncated JSON"); }
+    switch (*pos) {
+      case '{':
+      case '[': {
+        if (depth >= codec_max_depth) {
+          return fail("Tables nested too deeply");
+        }
+        if (!lua_checkstack(L, 4)) { return fail("Not enough stack space"); }
+        const bool object = (*pos++ == '{');
+        return object ? push_object(depth) : push_array(depth);
+      }
+      case '"': ++pos; return push_string();
+      case 't':
+        if (!literal("true", 4)) { return false; }
+        lua_pushboolean(L, true);
+        return true;
+      case 'f':
+        if (!literal("false", 5)) { return false; }
+        lua_pushboolean(L, false);
+        return true;
+      case 'n':
+        if (!literal("null", 4)) { return false; }
+        lua_pushnil(L);
+        return true;
+      default: return push_number();
+    }
+  }
+};
+
+template <template <typename> class Encoder, typename Out>
+expected<void>
+codec_encode(lua_State * L, int idx, Out & out) {
+  idx = lua_absindex(L, idx);
+  const int top = lua_gettop(L);
+  const std::size_t size = out.size();
+  Encoder<Out> e{L, out};
+  bool ok = false;
+  PRIMER_TRY_BAD_ALLOC { ok = e.write(idx, 0); }
+  PRIMER_CATCH_BAD_ALLOC { e.error = "Out of memory while encoding"; }
+  lua_settop(L, top);
+  if (ok) { return {}; }
+  out.resize(size);
+  return primer::error{e.error};
+}
+
+// The decoder pushes in a protected call, so that a memory error is returned
+// as an error rather than raised
+template <typename Decoder>
+expected<void>
+codec_decode(lua_State * L, const char * data, std::size_t n) {
+  Decoder d{L, data, n};
+  auto ok = primer::cpp_pcall(L, [&]() {
+    if (d.read(0)) {
+      d.skip_trailing();
+      if (d.pos == d.end) { return; }
+      d.fail("Trailing bytes after the value");
+    }
+    lua_settop(L, 0);
+  });
+  if (!ok) { return std::move(ok.err()); }
+  if (d.error) { return primer::error{d.error}; }
+  return {};
+}
+
+} // end namespace detail
+
+namespace api {
+
+class codec {
+  //
+  // C++ entry points
+  //
+
+public:
+  /// Appends the value at `idx`. On failure, `out` is left as it was.
+  static expected<void> encode_msgpack(lua_State * L, int idx,
+                                       std::string & out) {
+    return detail::codec_encode<detail::msgpack_encoder>(L, idx, out);
+  }
+
+  static expected<void> encode_msgpack(lua_State * L, int idx,
+                                       byte_buffer & out) {
+    return detail::codec_encode<detail::msgpack_encoder>(L, idx, out.bytes());
+  }
+
+  static expected<void> encode_json(lua_State * L, int idx,
+                                    std::string & out) {
+    return detail::codec_encode<detail::json_encoder>(L, idx, out);
+  }
+
+  static expected<void> encode_json(lua_State * L, int idx,
+                                    byte_buffer & out) {
+    return detail::codec_encode<detail::json_encoder>(L, idx, out.bytes());
+  }
+
+  /// Pushes the decoded value, or nothing on failure
+  static expected<void> decode_msgpack(lua_State * L, const char * data,
+                                       std::size_t n) {
+    return detail::codec_decode<detail::msgpack_decoder>(L, data, n);
+  }
+
+  static expected<void> decode_json(lua_State * L, const char * data,
+                                    std::size_t n) {
+    return detail::codec_decode<detail::json_decoder>(L, data, n);
+  }
+
+private:
+  //
+  // Lua entry points
+  //
+
+  typedef expected<void> (*buffer_encoder)(lua_State *, int, byte_buffer &);
+  typedef expected<void> (*string_encoder)(lua_State *, int, std::string &);
+  typedef expected<void> (*decoder)(lua_State *, const char *, std::size_t);
+
+  static primer::result encode(lua_State * L, string_encoder s,
+                               buffer_encoder b) {
+    luaL_checkany(L, 1);
+    expected<void> ok;
+    if (lua_isnoneornil(L, 2)) {
+      std::string out;
+      ok = s(L, 1, out);
+      if (ok) {
+        lua_pushlstring(L, out.data(), out.size());
+        return 1;
+      }
+    } else if (auto * buffer = primer::test_udata<byte_buffer>(L, 2)) {
+      ok = b(L, 1, *buffer);
+      if (ok) {
+        lua_settop(L, 2);
+        return 1;
+      }
+    } else {
+      return primer::arg_error(L, 2, "byte buffer");
+    }
+    return std::move(ok.err());
+  }
+
+  static primer::result decode(lua_State * L, decoder d) {
+    const char * data = nullptr;
+    std::size_t n = 0;
+    if (lua_type(L, 1) == LUA_TSTRING) {
+      data = lua_tolstring(L, 1, &n);
+    } else if (auto bytes = primer::read<byte_span>(L, 1)) {
+      data = reinterpret_cast<const char *>(bytes->data());
+      n = bytes->size();
+    } else {
+      return primer::arg_error(L, 1, "string or byte buffer");
+    }
+    lua_settop(L, 1);
+    if (auto ok = d(L, data, n)) { return 1; }
+    else { return std::move(ok.err()); }
+  }
+
+  static primer::result intf_encode_msgpack(lua_State * L) {
+    return encode(L, &codec::encode_msgpack, &codec::encode_msgpack);
+  }
+
+  static primer::result intf_encode_json(lua_State * L) {
+    return encode(L, &codec::encode_json, &codec::encode_json);
+  }
+
+  static primer::result intf_decode_msgpack(lua_State * L) {
+    return decode(L, &codec::decode_msgpack);
+  }
+
+  static primer::result intf_decode_json(lua_State * L) {
+    return decode(L, &codec::decode_json);
+  }
+
+  const char * global_;
+
+public:
+  static detail::span<const luaW_Reg> functions() {
+    static const luaW_Reg list[] = {
+      {"encode_msgpack", PRIMER_ADAPT(&intf_encode_msgpack),
+       "encode_msgpack(v [, buffer]): v as msgpack, in a string or appended "
+       "to a byte buffer"},
+      {"decode_msgpack", PRIMER_ADAPT(&intf_decode_msgpack),
+       "decode_msgpack(s): The value of msgpack in a string or byte buffer"},
+      {"encode_json", PRIMER_ADAPT(&intf_encode_json),
+       "encode_json(v [, buffer]): v as JSON, in a string or appended to a "
+       "byte buffer"},
+      {"decode_json", PRIMER_ADAPT(&intf_decode_json),
+       "decode_json(s): The value of JSON in a string or byte buffer"},
+    };
+    return list;
+  }
+
+  explicit codec(const char * global = "codec")
+    : global_(global) {}
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    static const help_index index{functions()};
+    api::add_help_index(L, index);
+
+    lua_newtable(L);
+    primer::set_funcs(L, functions());
+    lua_setglobal(L, global_);
+  }
+
+  void on_persist_table(lua_State * L) {
+    primer::set_funcs_prefix_reverse(L, "codec.", functions());
+  }
+
+  void on_unpersist_table(lua_State * L) {
+    primer::set_funcs_prefix(L, "codec.", functions());
+  }
+};
+
+} // end namespace api
+} // end namespace primer
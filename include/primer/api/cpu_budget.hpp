@@ -0,0 +1,237 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_cpu_budget_overview
+/*`
+`primer::api::cpu_budget` is an API feature which bounds the time that lua
+code may run in one call, so that a script with an infinite loop can't stall
+the host.
+
+Its `limits` are
+
+* `instructions`, the number of lua instructions, `0` meaning no limit,
+* `wall`, the elapsed time, `0` meaning no limit,
+* `action`, what happens when the budget is used up:
+  * `on_exceed::error` raises a lua error, and the call fails with
+    `primer::error::cpu_budget_exceeded()`, which `is_cpu_budget_exceeded()`
+    tells apart from the errors of the script. The error is raised again at
+    each instruction until the call has unwound, so `pcall` can't catch it
+    for good.
+  * `on_exceed::yield` yields a coroutine, so that a scheduler can run others,
+    and `preempted()` is true. A hook can't yield across a C call boundary,
+    e.g. inside a metamethod, so then the coroutine runs on until the next
+    check.
+
+A call or a resume is run under the budget by `run`:
+
+``
+  auto r = budget_.run([&]() { return func.call_no_ret(x); });
+  if (!r && r.err().is_cpu_budget_exceeded()) { ... }
+
+  auto y = budget_.run(co, [&]() { return co.call_one_ret(); });
+  if (y && budget_.preempted()) { ... }
+``
+
+Each `run` has a fresh budget. Instructions are counted by a count hook,
+which only fires every `check_interval` instructions while a wall-clock limit is
+set, and only once, when the budget is spent, when there is just an instruction
+limit. So the cost is one hook call per `check_interval` instructions.
+
+The hook is subscribed, through `primer::hook_mux`, on the thread which runs,
+for the duration of `run`, so it doesn't disturb a profiler or an executor
+which share the hook. If the thread has a hook which isn't shared, `run` fails
+without calling `f`. Coroutines which the script creates inherit the hook, so
+their instructions count too, but they can only be stopped by an error.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/coroutine.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/hook_mux.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/lua_state_ref.hpp>
+
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <utility>
+
+namespace primer {
+namespace api {
+
+class cpu_budget {
+public:
+  using clock_t = std::chrono::steady_clock;
+
+  enum class on_exceed { error, yield };
+
+  struct limits {
+    std::uint64_t instructions = 0;
+    clock_t::duration wall{0};
+    on_exceed action = on_exceed::error;
+  };
+
+private:
+  // The state of a run, saved and restored across nested runs
+  struct armed_t {
+    lua_State * thread = nullptr;
+    hook_mux::subscription hook = -1;
+    int count = 0;               // Instructions since the last check
+    std::uint64_t remaining = 0; // Instructions, if limited
+    clock_t::time_point deadline{};
+  };
+
+  lua_state_ref sref_;
+  limits limits_;
+  int check_interval_ = 1000;
+
+  armed_t armed_;
+  bool exceeded_ = false;
+  bool preempted_ = false;
+
+  static void count_hook(lua_State * L, lua_Debug *, void * ud) {
+    static_cast<cpu_budget *>(ud)->on_count(L);
+  }
+
+  void set_count(int n) noexcept {
+    armed_.count = n;
+    hook_mux::set_count(armed_.thread, armed_.hook, n);
+  }
+
+  // Instructions until the next check
+  int next_count() const noexcept {
+    std::uint64_t n = limits_.wall.count()
+                        ? static_cast<std::uint64_t>(check_interval_)
+                        : static_cast<std::uint64_t>(INT_MAX);
+    if (limits_.instructions && armed_.remaining < n) {
+      n = armed_.remaining;
+    }
+    return n ? static_cast<int>(n) : 1;
+  }
+
+  void on_count(lua_State * L) {
+    if (limits_.instructions) {
+      const auto used = static_cast<std::uint64_t>(armed_.count);
+      armed_.remaining -= (used < armed_.remaining) ? used : armed_.remaining;
+    }
+    const bool over = exceeded_
+                      || (limits_.instructions && !armed_.remaining)
+                      || (limits_.wall.count() && clock_t::now()
+                                                    >= armed_.deadline);
+    if (!over) {
+      this->set_count(this->next_count());
+      return;
+    }
+
+    if (limits_.action == on_exceed::yield && L == armed_.thread) {
+      if (lua_isyieldable(L)) {
+        preempted_ = true;
+        lua_yield(L, 0);
+        return;
+      }
+      this->set_count(check_interval_);
+      return;
+    }
+
+    // Raise the error at every instruction, until the run has unwound
+    exceeded_ = true;
+    this->set_count(1);
+    luaL_error(L, "cpu budget exceeded");
+  }
+
+  // The run which this one is nested in is paused meanwhile
+  expected<armed_t> arm(lua_State * T) {
+    armed_t saved = armed_;
+    if (saved.thread) { hook_mux::set_count(saved.thread, saved.hook, 0); }
+    armed_ = armed_t{};
+    armed_.thread = T;
+    armed_.remaining = limits_.instructions;
+    armed_.deadline = clock_t::now() + limits_.wall;
+    armed_.count = this->next_count();
+    auto s = hook_mux::subscribe(T, &count_hook, this, 0, armed_.count);
+    if (!s) {
+      this->disarm(saved);
+      return s.err();
+    }
+    armed_.hook = *s;
+    exceeded_ = false;
+    preempted_ = false;
+    return saved;
+  }
+
+  void disarm(const armed_t & saved) noexcept {
+    if (armed_.hook >= 0) { hook_mux::unsubscribe(armed_.thread, armed_.hook); }
+    armed_ = saved;
+    if (armed_.thread) { this->set_count(this->next_count()); }
+  }
+
+  template <typename F>
+  auto run_on(lua_State * T, F && f) -> decltype(f()) {
+    if (!T || !(limits_.instructions || limits_.wall.count())) { return f(); }
+    const auto saved = this->arm(T);
+    if (!saved) { return saved.err(); }
+    auto result = f();
+    const bool exceeded = exceeded_;
+    this->disarm(*saved);
+    exceeded_ = exceeded;
+    if (!result && exceeded) { result = primer::error::cpu_budget_exceeded(); }
+    return result;
+  }
+
+public:
+  cpu_budget() = default;
+  cpu_budget(const cpu_budget &) = delete;
+  cpu_budget & operator=(const cpu_budget &) = delete;
+
+  void set_limits(const limits & l) noexcept { limits_ = l; }
+  const limits & get_limits() const noexcept { return limits_; }
+
+  // Instructions between checks of the wall clock
+  void set_check_interval(int instructions) noexcept {
+    check_interval_ = instructions > 0 ? instructions : 1;
+  }
+  int check_interval() const noexcept { return check_interval_; }
+
+  // Runs `f`, e.g. a call of a `bound_function`, under the budget.
+  // `f` must return an `expected`.
+  template <typename F>
+  auto run(F && f) -> decltype(f()) {
+    return this->run_on(sref_.lock(), std::forward<F>(f));
+  }
+
+  // Runs `f`, a resume of `co`, under the budget
+  template <typename F>
+  auto run(coroutine & co, F && f) -> decltype(f()) {
+    return this->run_on(sref_.lock() ? co.thread_stack_ : nullptr,
+                        std::forward<F>(f));
+  }
+
+  // Whether the last run went over its budget
+  bool exceeded() const noexcept { return exceeded_ || preempted_; }
+
+  // Whether the last run was a resume which the budget yielded
+  bool preempted() const noexcept { return preempted_; }
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    sref_ = primer::obtain_state_ref(L);
+  }
+
+  void on_persist_table(lua_State *) {}
+  void on_unpersist_table(lua_State *) {}
+};
+
+} // end namespace api
+} // end namespace primer
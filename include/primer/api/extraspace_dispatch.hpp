@@ -8,6 +8,15 @@
 /***
  * Facilities to dispatch member function calls to an object using a pointer
  * to that object stored in the lua extraspace.
+ *
+ * By default, the extraspace holds a pointer to exactly one owner object.
+ *
+ * If several owners need to dispatch this way in the same lua state, give each
+ * of them a distinct slot index in `[0, PRIMER_EXTRASPACE_SLOTS)`, e.g. by
+ * deriving from `callback_registrar<T, slot>` or `api::base<T, slot>`. Then the
+ * extraspace instead points to a small array of owner pointers, which lives
+ * in a userdata anchored in the registry, and dispatch loads `owners[slot]`.
+ * All owners in a given lua state must use the same mode.
  */
 
 #include <primer/base.hpp>
@@ -15,9 +24,17 @@
 PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/adapt.hpp>
+#include <primer/detail/type_traits.hpp>
 #include <primer/lua.hpp>
+#include <primer/push_singleton.hpp>
 #include <primer/support/asserts.hpp>
 
+#include <type_traits>
+
+#ifndef PRIMER_EXTRASPACE_SLOTS
+#define PRIMER_EXTRASPACE_SLOTS 8
+#endif
+
 namespace primer {
 
 /***
@@ -36,6 +53,66 @@ inline void_ptr &
 access_extraspace_ptr(lua_State * L) {
   return *static_cast<void_ptr *>(lua_getextraspace(L));
 }
+
+// Multi-owner mode: the owner table
+inline void
+extraspace_owner_table(lua_State * L) {
+  void_ptr * table = static_cast<void_ptr *>(
+    lua_newuserdata(L, sizeof(void_ptr) * PRIMER_EXTRASPACE_SLOTS));
+  for (int i = 0; i < PRIMER_EXTRASPACE_SLOTS; ++i) {
+    table[i] = nullptr;
+  }
+}
+
+// Slot index of an owner type. -1 means "the extraspace is the owner".
+template <typename T, typename ENABLE = void>
+struct extraspace_slot : std::integral_constant<int, -1> {};
+
+template <typename T>
+struct extraspace_slot<T, enable_if_t<std::is_same<
+                            decltype(T::primer_extraspace_slot),
+                            decltype(T::primer_extraspace_slot)>::value>>
+  : std::integral_constant<int, T::primer_extraspace_slot> {};
+
+// Resolve the owner pointer for a given slot
+template <int slot>
+inline void_ptr
+get_extraspace_owner(lua_State * L, std::true_type) {
+  void_ptr * table = static_cast<void_ptr *>(access_extraspace_ptr(L));
+  PRIMER_ASSERT(table, "Extraspace owner table was not initialized!");
+  return table[slot];
+}
+
+template <int slot>
+inline void_ptr
+get_extraspace_owner(lua_State * L, std::false_type) {
+  return access_extraspace_ptr(L);
+}
+
+template <int slot>
+inline void_ptr
+get_extraspace_owner(lua_State * L) {
+  PRIMER_STATIC_ASSERT(slot < PRIMER_EXTRASPACE_SLOTS,
+                       "Extraspace slot index is too large, increase "
+                       "PRIMER_EXTRASPACE_SLOTS");
+  return get_extraspace_owner<slot>(L,
+                                    std::integral_constant<bool, (slot >= 0)>{});
+}
+
+// Install an owner, creating the owner table if needed in multi-owner mode.
+inline void
+set_extraspace_owner(lua_State * L, int slot, void_ptr owner) {
+  if (slot < 0) {
+    access_extraspace_ptr(L) = owner;
+  } else {
+    PRIMER_ASSERT(slot < PRIMER_EXTRASPACE_SLOTS, "Bad extraspace slot");
+    push_singleton<&extraspace_owner_table>(L);
+    void_ptr * table = static_cast<void_ptr *>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    table[slot] = owner;
+    access_extraspace_ptr(L) = table;
+  }
+}
 } // end namespace detail
 
 namespace api {
@@ -64,7 +141,8 @@ template <typename T, typename R, typename... Args,
 struct extraspace_dispatcher<T, R (T::*)(lua_State *, Args...), target_func> {
 
   static R dispatch_target(lua_State * L, Args... args) {
-    void * vptr = detail::access_extraspace_ptr(L);
+    void * vptr =
+      detail::get_extraspace_owner<detail::extraspace_slot<T>::value>(L);
     PRIMER_ASSERT(vptr, "Extraspace pointer was not initialized!");
     T * object_ptr = static_cast<T *>(vptr);
     return (object_ptr->*target_func)(L, std::forward<Args>(args)...);
@@ -72,7 +150,7 @@ struct extraspace_dispatcher<T, R (T::*)(lua_State *, Args...), target_func> {
 
   static int adapted(lua_State * L) {
     using helper_t = adapt<R (*)(lua_State *, Args...), dispatch_target>;
-    return helper_t::adapted(L);
+    return helper_t::adapted_by(L, &adapted);
   }
 };
 
@@ -71,6 +71,7 @@ PRIMER_ASSERT_FILESCOPE;
 #include <primer/support/diagnostics.hpp>
 
 #include <type_traits>
+#include <utility>
 
 namespace primer {
 
@@ -81,29 +82,26 @@ template <typename T, typename ENABLE = void>
 struct has_on_init_method : std::false_type {};
 
 template <typename T>
-struct has_on_init_method<T, decltype(static_cast<T *>(nullptr)->on_init(
-                                        static_cast<lua_State *>(nullptr)),
-                                      void())> : std::true_type {};
+struct has_on_init_method<
+  T, decltype(std::declval<T &>().on_init(std::declval<lua_State *>()), void())>
+  : std::true_type {};
 
 template <typename T, typename ENABLE = void>
 struct has_on_persist_table_method : std::false_type {};
 
 template <typename T>
-struct has_on_persist_table_method<T, decltype(
-                                        static_cast<T *>(nullptr)
-                                          ->on_persist_table(
-                                            static_cast<lua_State *>(nullptr)),
-                                        void())> : std::true_type {};
+struct has_on_persist_table_method<
+  T, decltype(std::declval<T &>().on_persist_table(std::declval<lua_State *>()),
+              void())> : std::true_type {};
 
 template <typename T, typename ENABLE = void>
 struct has_on_unpersist_table_method : std::false_type {};
 
 template <typename T>
-struct has_on_unpersist_table_method<T, decltype(static_cast<T *>(nullptr)
-                                                   ->on_unpersist_table(
-                                                     static_cast<lua_State *>(
-                                                       nullptr)),
-                                                 void())> : std::true_type {};
+struct has_on_unpersist_table_method<
+  T,
+  decltype(std::declval<T &>().on_unpersist_table(std::declval<lua_State *>()),
+           void())> : std::true_type {};
 
 // Trait which validates that a type is an API feature
 
@@ -111,31 +109,26 @@ template <typename T, typename ENABLE = void>
 struct is_feature : std::false_type {};
 
 template <typename T>
-struct is_feature<T, decltype(static_cast<T *>(nullptr)->on_init(
-                                static_cast<lua_State *>(nullptr)),
-                              static_cast<T *>(nullptr)->on_persist_table(
-                                static_cast<lua_State *>(nullptr)),
-                              static_cast<T *>(nullptr)->on_unpersist_table(
-                                static_cast<lua_State *>(nullptr)),
-                              void())> : std::true_type {};
+struct is_feature<
+  T,
+  decltype(std::declval<T &>().on_init(std::declval<lua_State *>()),
+           std::declval<T &>().on_persist_table(std::declval<lua_State *>()),
+           std::declval<T &>().on_unpersist_table(std::declval<lua_State *>()),
+           void())> : std::true_type {};
 
 // Trait which validates that a type is a serial feature
 template <typename T, typename ENABLE = void>
 struct is_serial_feature : std::false_type {};
 
 template <typename T>
-struct is_serial_feature<T,
-                         decltype(static_cast<T *>(nullptr)->on_init(
-                                    static_cast<lua_State *>(nullptr)),
-                                  static_cast<T *>(nullptr)->on_persist_table(
-                                    static_cast<lua_State *>(nullptr)),
-                                  static_cast<T *>(nullptr)->on_unpersist_table(
-                                    static_cast<lua_State *>(nullptr)),
-                                  static_cast<T *>(nullptr)->on_serialize(
-                                    static_cast<lua_State *>(nullptr)),
-                                  static_cast<T *>(nullptr)->on_deserialize(
-                                    static_cast<lua_State *>(nullptr)),
-                                  void())> : std::true_type {};
+struct is_serial_feature<
+  T,
+  decltype(std::declval<T &>().on_init(std::declval<lua_State *>()),
+           std::declval<T &>().on_persist_table(std::declval<lua_State *>()),
+           std::declval<T &>().on_unpersist_table(std::declval<lua_State *>()),
+           std::declval<T &>().on_serialize(std::declval<lua_State *>()),
+           std::declval<T &>().on_deserialize(std::declval<lua_State *>()),
+           void())> : std::true_type {};
 
 // Ptr to member type, for use in type lists
 
@@ -175,6 +168,7 @@ static_cast<void>(S)
 
 struct on_init_visitor {
   lua_State * L;
+  static const char * phase() { return "on_init"; }
 
   template <typename H, typename T>
   void visit_type(T & t) {
@@ -186,6 +180,7 @@ struct on_init_visitor {
 
 struct on_persist_table_visitor {
   lua_State * L;
+  static const char * phase() { return "on_persist_table"; }
 
   template <typename H, typename T>
   void visit_type(T & t) {
@@ -198,6 +193,7 @@ struct on_persist_table_visitor {
 
 struct on_unpersist_table_visitor {
   lua_State * L;
+  static const char * phase() { return "on_unpersist_table"; }
 
   template <typename H, typename T>
   void visit_type(T & t) {
@@ -210,6 +206,7 @@ struct on_unpersist_table_visitor {
 
 struct on_serialize_visitor {
   lua_State * L;
+  static const char * phase() { return "on_serialize"; }
 
   template <typename H, typename T>
   enable_if_t<is_serial_feature<typename H::target_type>::value> visit_type(
@@ -229,6 +226,7 @@ struct on_serialize_visitor {
 
 struct on_deserialize_visitor {
   lua_State * L;
+  static const char * phase() { return "on_deserialize"; }
 
   template <typename H, typename T>
   enable_if_t<is_serial_feature<typename H::target_type>::value> visit_type(
@@ -0,0 +1,213 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A feature_timings records how long each API_FEATURE of an api takes in each
+ * phase of `initialize_api`, `persist` and `unpersist`, and how much the lua
+ * heap grows meanwhile.
+ *
+ *   primer::api::feature_timings timings;
+ *   timings.attach(L);
+ *   my_api api{L};       // calls initialize_api
+ *   api.persist(L, buffer);
+ *   std::cout << timings.breakdown("on_init") << std::endl;
+ *   // libs_: 3.1 ms, cb_man_: 0.4 ms
+ *
+ * The phases are named after the methods of the feature concept: "on_init",
+ * "on_persist_table", "on_unpersist_table", "on_serialize" and
+ * "on_deserialize". The permanent objects tables are cached, so their phases
+ * are only timed when the tables are built. The features are keyed by the
+ * names given to API_FEATURE, which are those of the members.
+ *
+ * Each entry accumulates over calls. The heap growth is measured with
+ * `lua_gc` before and after each feature, so it is net of what is collected
+ * meanwhile, and can be negative.
+ *
+ * Attaching stores a pointer to the object in the registry, and `persistable`
+ * looks it up once for each phase. When nothing is attached, nothing is
+ * timed. The object must outlive the attachment, or be detached first.
+ * Recording doesn't raise errors: an entry which can't be allocated is
+ * dropped.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/cpp_pcall.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/asserts.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+namespace api {
+
+class feature_timings {
+public:
+  struct entry {
+    const char * feature;
+    const char * phase;
+    std::size_t calls;
+    std::chrono::nanoseconds time;
+    long long bytes; // Net growth of the lua heap
+
+    double ms() const noexcept { return time.count() / 1e6; }
+  };
+
+private:
+  std::vector<entry> entries_;
+
+  static void * registry_key() noexcept {
+    static char key;
+    return &key;
+  }
+
+  static long long heap_bytes(lua_State * L) noexcept {
+    return static_cast<long long>(lua_gc(L, LUA_GCCOUNT, 0)) * 1024
+           + lua_gc(L, LUA_GCCOUNTB, 0);
+  }
+
+  void record(const char * feature, const char * phase,
+              std::chrono::nanoseconds time, long long bytes) noexcept {
+    for (entry & e : entries_) {
+      if (!std::strcmp(e.feature, feature) && !std::strcmp(e.phase, phase)) {
+        ++e.calls;
+        e.time += time;
+        e.bytes += bytes;
+        return;
+      }
+    }
+    PRIMER_TRY_BAD_ALLOC {
+      entries_.push_back(entry{feature, phase, 1, time, bytes});
+    }
+    PRIMER_CATCH_BAD_ALLOC {}
+  }
+
+public:
+  feature_timings() = default;
+  feature_timings(const feature_timings &) = delete;
+  feature_timings & operator=(const feature_timings &) = delete;
+
+  // Note: Can't raise lua errors, reports memory failure instead
+  expected<void> attach(lua_State * L) noexcept {
+    return primer::mem_pcall(L, [this, L]() {
+      lua_pushlightuserdata(L, static_cast<void *>(this));
+      lua_rawsetp(L, LUA_REGISTRYINDEX, registry_key());
+    });
+  }
+
+  static void detach(lua_State * L) noexcept {
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, registry_key());
+  }
+
+  // The attached object, or nullptr
+  static feature_timings * get(lua_State * L) noexcept {
+    lua_rawgetp(L, LUA_REGISTRYINDEX, registry_key());
+    auto * result = static_cast<feature_timings *>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    return result;
+  }
+
+  const std::vector<entry> & entries() const noexcept { return entries_; }
+  void clear() noexcept { entries_.clear(); }
+
+  // The entry of a feature in a phase, or nullptr
+  const entry * find(const char * feature, const char * phase) const noexcept {
+    for (const entry & e : entries_) {
+      if (!std::strcmp(e.feature, feature) && !std::strcmp(e.phase, phase)) {
+        return &e;
+      }
+    }
+    return nullptr;
+  }
+
+  // "feature: ms, feature: ms", for one phase, or summed over all of them
+  // Note: Can throw std::bad_alloc
+  std::string breakdown(const char * phase = nullptr) const {
+    std::vector<std::pair<const char *, std::chrono::nanoseconds>> totals;
+    for (const entry & e : entries_) {
+      if (phase && std::strcmp(e.phase, phase)) { continue; }
+      bool found = false;
+      for (auto & t : totals) {
+        if (!std::strcmp(t.first, e.feature)) {
+          t.second += e.time;
+          found = true;
+        }
+      }
+      if (!found) { totals.emplace_back(e.feature, e.time); }
+    }
+
+    std::string result;
+    for (const auto & t : totals) {
+      char buffer[32];
+      const double ms = t.second.count() / 1e6;
+      std::snprintf(buffer, sizeof(buffer), ": %.1f ms", ms);
+      if (!result.empty()) { result += ", "; }
+      result += t.first;
+      result += buffer;
+    }
+    return result;
+  }
+
+  // Times one feature. The visitor runs in a protected call, and if the
+  // feature raises an error, the scope is skipped, and nothing is recorded.
+  class scope {
+    feature_timings * t_;
+    lua_State * L_;
+    const char * feature_;
+    const char * phase_;
+    std::chrono::steady_clock::time_point start_;
+    long long bytes_;
+
+  public:
+    scope(feature_timings * t, lua_State * L, const char * feature,
+          const char * phase) noexcept
+      : t_(t)
+      , L_(L)
+      , feature_(feature)
+      , phase_(phase)
+      , start_(std::chrono::steady_clock::now())
+      , bytes_(heap_bytes(L)) {}
+
+    void finish() noexcept {
+      auto d = std::chrono::steady_clock::now() - start_;
+      t_->record(feature_, phase_,
+                 std::chrono::duration_cast<std::chrono::nanoseconds>(d),
+                 heap_bytes(L_) - bytes_);
+    }
+  };
+};
+
+// Wraps one of the visitors of feature.hpp, timing each feature which it
+// visits
+template <typename V>
+struct timed_visitor {
+  V & v;
+  feature_timings * timings;
+  const char * phase;
+
+  template <typename H, typename T>
+  void visit_type(T & t) {
+    feature_timings::scope s{timings, v.L, H::get_name(), phase};
+    v.template visit_type<H>(t);
+    s.finish();
+  }
+};
+
+} // end namespace api
+
+} // end namespace primer
@@ -0,0 +1,941 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_format_overview
+/*`
+`primer::api::format` is an API feature which gives scripts a global function
+`format`, which is `string.format` without parsing the format on each call.
+
+``
+  label.text = format("%s: %d / %d", name, hp, max_hp)
+``
+
+A format is compiled once into a `format_program`, a list of literal runs and
+of conversions, with `%%` resolved and the length modifiers of lua numbers
+added. The programs are kept in an LRU cache of the feature, keyed by the
+address of the lua string. Short strings are interned by lua, so a format
+written in a script is found again by any call to it, and a long format by
+the call site which holds the constant.
+
+Running a program writes straight into a `luaL_Buffer`. Literal runs are
+copied in one go, a plain `%d` of an integer and a plain `%s` don't go through
+`snprintf`, and the other conversions use it with the specification which was
+prepared when compiling. The result, and the errors, are those of
+`string.format`, in the same order.
+
+The same programs format from C++, with a list of `format_arg`, which may be
+booleans, integers, floating point numbers, strings or nil. Strings aren't
+converted to numbers, as lua would do.
+
+``
+  primer::api::format_program p{"%-12s%6.2f"};
+  primer::expected<std::string> s = p({"total", 12.5});
+
+  primer::expected<std::string> t = primer::api::format_string("%d", {5});
+``
+
+The cache holds 64 formats by default. The feature may be persisted, and the
+cache isn't, it fills again as formats are used.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/api/self_closures.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/types.hpp>
+
+#include <array>
+#include <cctype>
+#include <clocale>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+/***
+ * An argument of a format, from C++
+ */
+
+class format_arg {
+public:
+  enum class kind : std::uint8_t { nil, boolean, integer, number, string };
+
+private:
+  kind kind_;
+  bool boolean_ = false;
+  lua_Integer integer_ = 0;
+  lua_Number number_ = 0;
+  lua_string_view string_{"", 0};
+
+public:
+  format_arg() noexcept : kind_(kind::nil) {}
+
+  format_arg(bool b) noexcept
+    : kind_(kind::boolean)
+    , boolean_(b) {}
+
+  template <typename T,
+            typename std::enable_if<std::is_integral<T>::value
+                                    && !std::is_same<T, bool>::value>::type * =
+              nullptr>
+  format_arg(T n) noexcept
+    : kind_(kind::integer)
+    , integer_(static_cast<lua_Integer>(n)) {}
+
+  template <typename T, typename std::enable_if<
+                          std::is_floating_point<T>::value>::type * = nullptr>
+  format_arg(T x) noexcept
+    : kind_(kind::number)
+    , number_(static_cast<lua_Number>(x)) {}
+
+  format_arg(lua_string_view s) noexcept
+    : kind_(kind::string)
+    , string_(s) {}
+
+  format_arg(const std::string & s) noexcept
+    : kind_(kind::string)
+    , string_{s.data(), s.size()} {}
+
+  // A null pointer is nil
+  format_arg(const char * s) noexcept
+    : kind_(s ? kind::string : kind::nil)
+    , string_{s ? s : "", s ? std::strlen(s) : 0} {}
+
+  kind type() const noexcept { return kind_; }
+  bool boolean() const noexcept { return boolean_; }
+  lua_Integer integer() const noexcept { return integer_; }
+  lua_Number number() const noexcept { return number_; }
+  lua_string_view string() const noexcept { return string_; }
+
+  // The name of the lua type
+  const char * type_name() const noexcept {
+    switch (kind_) {
+      case kind::boolean: return "boolean";
+      case kind::integer:
+      case kind::number: return "number";
+      case kind::string: return "string";
+      default: return "nil";
+    }
+  }
+};
+
+} // end namespace api
+
+namespace detail {
+
+// The size of the largest item, as in lstrlib
+constexpr std::size_t format_max_item =
+  120 + std::numeric_limits<lua_Number>::max_exponent10;
+
+enum class format_kind : std::uint8_t {
+  literal,       // A run of text
+  plain_integer, // `%d` or `%i`, without modifiers
+  integer,       // `%d`, `%i`, `%o`, `%u`, `%x` or `%X`
+  character,     // `%c`
+  number,        // `%a`, `%A`, `%e`, `%E`, `%f`, `%g` or `%G`
+  quoted,        // `%q`
+  plain_string,  // `%s`, without modifiers
+  string,        // `%s`
+  invalid        // An error, raised when the item is reached
+};
+
+struct format_item {
+  format_kind kind;
+  // The text of the run, or the specification for snprintf or the message
+  // of the error, with a terminating zero
+  std::uint32_t offset;
+  std::uint32_t length;
+};
+
+// Integers in decimal, as `%d`, written backwards from `end`
+inline char *
+format_write_integer(char * end, lua_Integer n) noexcept {
+  using U = std::make_unsigned<lua_Integer>::type;
+  U u = static_cast<U>(n);
+  if (n < 0) { u = U(0) - u; }
+  char * p = end;
+  do {
+    *--p = static_cast<char>('0' + u % 10);
+    u /= 10;
+  } while (u);
+  if (n < 0) { *--p = '-'; }
+  return p;
+}
+
+template <typename W>
+void
+format_add_integer(W & w, lua_Integer n) {
+  char buf[std::numeric_limits<lua_Integer>::digits10 + 3];
+  char * end = buf + sizeof buf;
+  const char * p = format_write_integer(end, n);
+  w.add(p, static_cast<std::size_t>(end - p));
+}
+
+// `%q` of a string, as addquoted in lstrlib
+template <typename W>
+void
+format_add_quoted(W & w, const char * s, std::size_t len) {
+  w.add("\"", 1);
+  for (std::size_t i = 0; i < len; ++i) {
+    const unsigned char c = static_cast<unsigned char>(s[i]);
+    if (c == '"' || c == '\\' || c == '\n') {
+      const char esc[2] = {'\\', s[i]};
+      w.add(esc, 2);
+    } else if (std::iscntrl(c)) {
+      char buf[10];
+      const bool digit_next =
+        i + 1 < len && std::isdigit(static_cast<unsigned char>(s[i + 1]));
+      const int n = std::snprintf(buf, sizeof buf,
+                                  digit_next ? "\\%03d" : "\\%d",
+                                  static_cast<int>(c));
+      w.add(buf, static_cast<std::size_t>(n));
+    } else {
+      w.add(s + i, 1);
+    }
+  }
+  w.add("\"", 1);
+}
+
+// `%q` of a number, as addliteral in lstrlib
+template <typename W>
+void
+format_add_literal(W & w, lua_Integer n) {
+  char * buf = w.prepare(format_max_item);
+  const int nb = std::snprintf(buf, format_max_item,
+                               n == std::numeric_limits<lua_Integer>::min()
+                                 ? "0x%" LUA_INTEGER_FRMLEN "x"
+                                 : LUA_INTEGER_FMT,
+                               static_cast<LUAI_UACINT>(n));
+  w.commit(static_cast<std::size_t>(nb));
+}
+
+template <typename W>
+void
+format_add_literal(W & w, lua_Number x) {
+  char * buf = w.prepare(format_max_item);
+  const int nb = std::snprintf(buf, format_max_item,
+                               "%" LUA_NUMBER_FRMLEN "a",
+                               static_cast<LUAI_UACNUMBER>(x));
+  const std::size_t len = static_cast<std::size_t>(nb);
+  if (!std::memchr(buf, '.', len)) {
+    if (char * p = static_cast<char *>(
+          std::memchr(buf, lua_getlocaledecpoint(), len))) {
+      *p = '.';
+    }
+  }
+  w.commit(len);
+}
+
+} // end namespace detail
+
+namespace api {
+
+/***
+ * A compiled format
+ */
+
+class format_program {
+  std::string text_;
+  std::vector<detail::format_item> items_;
+
+  void push_item(detail::format_kind k, const char * s, std::size_t n,
+                 bool terminate) {
+    items_.push_back(
+      detail::format_item{k, static_cast<std::uint32_t>(text_.size()),
+                          static_cast<std::uint32_t>(n)});
+    text_.append(s, n);
+    if (terminate) { text_ += '\0'; }
+  }
+
+  void push_literal(std::string & run) {
+    if (!run.empty()) {
+      push_item(detail::format_kind::literal, run.data(), run.size(), false);
+      run.clear();
+    }
+  }
+
+public:
+  format_program() = default;
+
+  // May throw `std::bad_alloc`
+  format_program(const char * fmt, std::size_t len) { this->compile(fmt, len); }
+  explicit format_program(lua_string_view fmt)
+    : format_program(fmt.data(), fmt.size()) {}
+  explicit format_program(const std::string & fmt)
+    : format_program(fmt.data(), fmt.size()) {}
+  explicit format_program(const char * fmt)
+    : format_program(fmt, std::strlen(fmt)) {}
+
+  // Errors of the format are kept in the program, and reported by `run` when
+  // it reaches them, after the arguments before them, as `string.format`
+  // does. Compiling stops at the first error.
+  void compile(const char * fmt, std::size_t len) {
+    using detail::format_kind;
+    static constexpr char flags[] = "-+ #0";
+
+    text_.clear();
+    items_.clear();
+
+    const char * const end = fmt + len;
+    // The format as lua sees it, with a terminating zero
+    auto at = [end](const char * q) -> char { return q < end ? *q : '\0'; };
+    auto digit = [](char c) {
+      return std::isdigit(static_cast<unsigned char>(c)) != 0;
+    };
+
+    std::string run;
+    const char * p = fmt;
+    while (p < end) {
+      if (*p != '%') {
+        const void * next = std::memchr(p, '%', static_cast<std::size_t>(end - p));
+        const char * q = next ? static_cast<const char *>(next) : end;
+        run.append(p, static_cast<std::size_t>(q - p));
+        p = q;
+        continue;
+      }
+      if (at(++p) == '%') {
+        run += '%';
+        ++p;
+        continue;
+      }
+      push_literal(run);
+
+      const char * q = p;
+      while (at(q) != '\0' && std::strchr(flags, at(q))) { ++q; }
+      if (static_cast<std::size_t>(q - p) >= sizeof flags) {
+        static const char msg[] = "invalid format (repeated flags)";
+        push_item(format_kind::invalid, msg, sizeof msg - 1, true);
+        return;
+      }
+      if (digit(at(q))) { ++q; }
+      if (digit(at(q))) { ++q; }
+      if (at(q) == '.') {
+        ++q;
+        if (digit(at(q))) { ++q; }
+        if (digit(at(q))) { ++q; }
+      }
+      if (digit(at(q))) {
+        static const char msg[] =
+          "invalid format (width or precision too long)";
+        push_item(format_kind::invalid, msg, sizeof msg - 1, true);
+        return;
+      }
+
+      const char conv = at(q);
+      const bool plain = (q == p);
+      // The specification, without the conversion
+      char spec[32];
+      std::size_t n = 0;
+      spec[n++] = '%';
+      for (const char * s = p; s < q; ++s) {
+        spec[n++] = *s;
+      }
+      p = q + 1;
+
+      format_kind k;
+      const char * lenmod = "";
+      switch (conv) {
+        case 'c': k = format_kind::character; break;
+        case 'd':
+        case 'i':
+          k = plain ? format_kind::plain_integer : format_kind::integer;
+          lenmod = LUA_INTEGER_FRMLEN;
+          break;
+        case 'o':
+        case 'u':
+        case 'x':
+        case 'X':
+          k = format_kind::integer;
+          lenmod = LUA_INTEGER_FRMLEN;
+          break;
+        case 'a':
+        case 'A':
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'g':
+        case 'G':
+          k = format_kind::number;
+          lenmod = LUA_NUMBER_FRMLEN;
+          break;
+        case 'q': k = format_kind::quoted; break;
+        case 's':
+          k = plain ? format_kind::plain_string : format_kind::string;
+          break;
+        default: {
+          // The option is written as luaL_error writes a `%c`
+          std::string msg{"invalid option '%"};
+          if (std::isprint(static_cast<unsigned char>(conv))) {
+            msg += conv;
+          } else {
+            char buf[8];
+            std::snprintf(buf, sizeof buf, "<\\%d>",
+                          static_cast<int>(static_cast<unsigned char>(conv)));
+            msg += buf;
+          }
+          msg += "' to 'format'";
+          push_item(format_kind::invalid, msg.data(), msg.size(), true);
+          return;
+        }
+      }
+      for (; *lenmod; ++lenmod) {
+        spec[n++] = *lenmod;
+      }
+      spec[n++] = conv;
+      push_item(k, spec, n, true);
+    }
+    push_literal(run);
+  }
+
+  std::size_t size() const noexcept { return items_.size(); }
+
+  // Runs the program with a writer, which reads the arguments and takes the
+  // text, and returns false if it fails. The lua function and the C++
+  // functions are the writers of this file.
+  template <typename W>
+  bool run(W & w) const;
+
+  // Appends the result to `out`. If it fails, `out` has the text of the items
+  // before the error.
+  expected<void> format_to(std::string & out, const format_arg * args,
+                           std::size_t count) const noexcept;
+
+  expected<void> format_to(std::string & out,
+                           std::initializer_list<format_arg> args) const
+    noexcept {
+    return this->format_to(out, args.begin(), args.size());
+  }
+
+  expected<std::string> operator()(std::initializer_list<format_arg> args) const
+    noexcept;
+};
+
+template <typename W>
+bool
+format_program::run(W & w) const {
+  using detail::format_kind;
+  using detail::format_max_item;
+
+  const char * const text = text_.data();
+  int arg = 0;
+  for (const detail::format_item & it : items_) {
+    const char * s = text + it.offset;
+    if (it.kind == format_kind::literal) {
+      w.add(s, it.length);
+      continue;
+    }
+    if (!w.has(++arg)) { return w.no_value(arg); }
+    switch (it.kind) {
+      case format_kind::plain_integer: {
+        lua_Integer n = 0;
+        if (!w.integer(arg, n)) { return false; }
+        detail::format_add_integer(w, n);
+        break;
+      }
+      case format_kind::integer: {
+        lua_Integer n = 0;
+        if (!w.integer(arg, n)) { return false; }
+        char * buf = w.prepare(format_max_item);
+        w.commit(static_cast<std::size_t>(std::snprintf(
+          buf, format_max_item, s, static_cast<LUAI_UACINT>(n))));
+        break;
+      }
+      case format_kind::character: {
+        lua_Integer n = 0;
+        if (!w.integer(arg, n)) { return false; }
+        char * buf = w.prepare(format_max_item);
+        w.commit(static_cast<std::size_t>(
+          std::snprintf(buf, format_max_item, s, static_cast<int>(n))));
+        break;
+      }
+      case format_kind::number: {
+        lua_Number x = 0;
+        if (!w.number(arg, x)) { return false; }
+        char * buf = w.prepare(format_max_item);
+        w.commit(static_cast<std::size_t>(std::snprintf(
+          buf, format_max_item, s, static_cast<LUAI_UACNUMBER>(x))));
+        break;
+      }
+      case format_kind::quoted:
+        if (!w.quoted(arg)) { return false; }
+        break;
+      case format_kind::plain_string:
+        if (!w.string(arg)) { return false; }
+        break;
+      case format_kind::string:
+        if (!w.string(arg, s)) { return false; }
+        break;
+      default: return w.fail(s, it.length);
+    }
+  }
+  return true;
+}
+
+} // end namespace api
+
+namespace detail {
+
+// The writer of the lua function, into a luaL_Buffer which is on the top of
+// the stack. The arguments are those after `base`.
+class format_lua_writer {
+  lua_State * L_;
+  luaL_Buffer * b_;
+  int base_;
+  int top_;
+
+public:
+  format_lua_writer(lua_State * L, luaL_Buffer * b, int base, int top) noexcept
+    : L_(L)
+    , b_(b)
+    , base_(base)
+    , top_(top) {}
+
+  void add(const char * s, std::size_t n) { luaL_addlstring(b_, s, n); }
+  char * prepare(std::size_t n) { return luaL_prepbuffsize(b_, n); }
+  void commit(std::size_t n) { luaL_addsize(b_, n); }
+
+  bool has(int arg) const noexcept { return base_ + arg <= top_; }
+
+  bool no_value(int arg) {
+    luaL_argerror(L_, base_ + arg, "no value");
+    return false;
+  }
+
+  bool fail(const char * msg, std::size_t) {
+    luaL_error(L_, "%s", msg);
+    return false;
+  }
+
+  bool integer(int arg, lua_Integer & n) {
+    n = luaL_checkinteger(L_, base_ + arg);
+    return true;
+  }
+
+  bool number(int arg, lua_Number & x) {
+    x = luaL_checknumber(L_, base_ + arg);
+    return true;
+  }
+
+  bool quoted(int arg) {
+    const int idx = base_ + arg;
+    switch (lua_type(L_, idx)) {
+      case LUA_TSTRING: {
+        std::size_t len;
+        const char * s = lua_tolstring(L_, idx, &len);
+        format_add_quoted(*this, s, len);
+        break;
+      }
+      case LUA_TNUMBER:
+        if (lua_isinteger(L_, idx)) {
+          format_add_literal(*this, lua_tointeger(L_, idx));
+        } else {
+          format_add_literal(*this, lua_tonumber(L_, idx));
+        }
+        break;
+      case LUA_TNIL:
+      case LUA_TBOOLEAN:
+        luaL_tolstring(L_, idx, nullptr);
+        luaL_addvalue(b_);
+        break;
+      default: luaL_argerror(L_, idx, "value has no literal form");
+    }
+    return true;
+  }
+
+  bool string(int arg) {
+    luaL_tolstring(L_, base_ + arg, nullptr);
+    luaL_addvalue(b_);
+    return true;
+  }
+
+  bool string(int arg, const char * spec) {
+    const int idx = base_ + arg;
+    char * buf = luaL_prepbuffsize(b_, format_max_item);
+    std::size_t len;
+    const char * s = luaL_tolstring(L_, idx, &len);
+    luaL_argcheck(L_, len == std::strlen(s), idx, "string contains zeros");
+    if (!std::strchr(spec, '.') && len >= 100) {
+      // Too long for the buffer, and nothing to cut
+      luaL_addvalue(b_);
+    } else {
+      const int nb = std::snprintf(buf, format_max_item, spec, s);
+      lua_pop(L_, 1);
+      luaL_addsize(b_, static_cast<std::size_t>(nb));
+    }
+    return true;
+  }
+};
+
+// The writer of the C++ functions, into a string
+class format_string_writer {
+  std::string & out_;
+  const api::format_arg * args_;
+  std::size_t count_;
+  std::size_t pending_ = 0;
+  std::string error_;
+
+  const api::format_arg & get(int arg) const noexcept {
+    return args_[static_cast<std::size_t>(arg - 1)];
+  }
+
+  bool bad_argument(int arg, const char * msg) {
+    char buf[32];
+    std::snprintf(buf, sizeof buf, "bad argument #%d", arg);
+    error_ = buf;
+    error_ += " to 'format' (";
+    error_ += msg;
+    error_ += ')';
+    return false;
+  }
+
+  bool type_error(int arg, const char * expected) {
+    return bad_argument(
+      arg, (std::string{expected} + " expected, got " + get(arg).type_name())
+             .c_str());
+  }
+
+  // The text of `%s`, as luaL_tolstring, in `buf` if it isn't a string
+  lua_string_view text(int arg, char (&buf)[64]) const noexcept {
+    const api::format_arg & a = get(arg);
+    int n = 0;
+    switch (a.type()) {
+      case api::format_arg::kind::string: return a.string();
+      case api::format_arg::kind::boolean:
+        return a.boolean() ? lua_string_view{"true", 4}
+                           : lua_string_view{"false", 5};
+      case api::format_arg::kind::integer:
+        n = std::snprintf(buf, sizeof buf, LUA_INTEGER_FMT,
+                          static_cast<LUAI_UACINT>(a.integer()));
+        break;
+      case api::format_arg::kind::number:
+        n = lua_number2str(buf, sizeof buf - 2, a.number());
+        // Floats which look like integers get a ".0", as in lua
+        if (buf[std::strspn(buf, "-0123456789")] == '\0') {
+          buf[n++] = lua_getlocaledecpoint();
+          buf[n++] = '0';
+          buf[n] = '\0';
+        }
+        break;
+      default: return lua_string_view{"nil", 3};
+    }
+    return lua_string_view{buf, static_cast<std::size_t>(n)};
+  }
+
+public:
+  format_string_writer(std::string & out, const api::format_arg * args,
+                       std::size_t count) noexcept
+    : out_(out)
+    , args_(args)
+    , count_(count) {}
+
+  const std::string & error() const noexcept { return error_; }
+
+  void add(const char * s, std::size_t n) { out_.append(s, n); }
+
+  char * prepare(std::size_t n) {
+    pending_ = out_.size();
+    out_.resize(pending_ + n);
+    return &out_[pending_];
+  }
+  void commit(std::size_t n) { out_.resize(pending_ + n); }
+
+  bool has(int arg) const noexcept {
+    return static_cast<std::size_t>(arg) <= count_;
+  }
+
+  bool no_value(int arg) { return bad_argument(arg, "no value"); }
+
+  bool fail(const char * msg, std::size_t len) {
+    error_.assign(msg, len);
+    return false;
+  }
+
+  bool integer(int arg, lua_Integer & n) {
+    const api::format_arg & a = get(arg);
+    if (a.type() == api::format_arg::kind::integer) {
+      n = a.integer();
+      return true;
+    }
+    if (a.type() != api::format_arg::kind::number) {
+      return type_error(arg, "number");
+    }
+    if (!lua_numbertointeger(std::floor(a.number()), &n)
+        || static_cast<lua_Number>(n) != a.number()) {
+      return bad_argument(arg, "number has no integer representation");
+    }
+    return true;
+  }
+
+  bool number(int arg, lua_Number & x) {
+    const api::format_arg & a = get(arg);
+    if (a.type() == api::format_arg::kind::integer) {
+      x = static_cast<lua_Number>(a.integer());
+      return true;
+    }
+    if (a.type() != api::format_arg::kind::number) {
+      return type_error(arg, "number");
+    }
+    x = a.number();
+    return true;
+  }
+
+  bool quoted(int arg) {
+    const api::format_arg & a = get(arg);
+    switch (a.type()) {
+      case api::format_arg::kind::string:
+        format_add_quoted(*this, a.string().data(), a.string().size());
+        break;
+      case api::format_arg::kind::integer: format_add_literal(*this, a.integer()); break;
+      case api::format_arg::kind::number: format_add_literal(*this, a.number()); break;
+      default: return this->string(arg);
+    }
+    return true;
+  }
+
+  bool string(int arg) {
+    char buf[64];
+    const lua_string_view s = this->text(arg, buf);
+    out_.append(s.data(), s.size());
+    return true;
+  }
+
+  bool string(int arg, const char * spec) {
+    char buf[64];
+    const lua_string_view s = this->text(arg, buf);
+    if (std::memchr(s.data(), '\0', s.size())) {
+      return bad_argument(arg, "string contains zeros");
+    }
+    if (!std::strchr(spec, '.') && s.size() >= 100) {
+      out_.append(s.data(), s.size());
+      return true;
+    }
+    // Here the views of the arguments aren't known to end with a zero
+    const std::string str = s.str();
+    char * p = this->prepare(format_max_item);
+    this->commit(static_cast<std::size_t>(
+      std::snprintf(p, format_max_item, spec, str.c_str())));
+    return true;
+  }
+};
+
+} // end namespace detail
+
+namespace api {
+
+inline expected<void>
+format_program::format_to(std::string & out, const format_arg * args,
+                          std::size_t count) const noexcept {
+  PRIMER_TRY_BAD_ALLOC {
+    detail::format_string_writer w{out, args, count};
+    if (!this->run(w)) { return primer::error{w.error()}; }
+    return {};
+  }
+  PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+}
+
+inline expected<std::string>
+format_program::operator()(std::initializer_list<format_arg> args) const
+  noexcept {
+  PRIMER_TRY_BAD_ALLOC {
+    std::string out;
+    expected<void> r = this->format_to(out, args.begin(), args.size());
+    if (!r) { return std::move(r.err()); }
+    return out;
+  }
+  PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+}
+
+// Compiles the format and runs it once
+inline expected<std::string>
+format_string(lua_string_view fmt, std::initializer_list<format_arg> args) noexcept {
+  PRIMER_TRY_BAD_ALLOC {
+    const format_program p{fmt};
+    return p(args);
+  }
+  PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+}
+
+inline expected<std::string>
+format_string(const char * fmt, std::initializer_list<format_arg> args) noexcept {
+  return format_string(lua_string_view{fmt, std::strlen(fmt)}, args);
+}
+
+/***
+ * The feature
+ */
+
+class format {
+  struct entry {
+    const void * key;
+    std::uint64_t stamp;
+  };
+
+  std::size_t capacity_;
+  // t[i + 1] is the program of entries_[i], a userdata whose user value is
+  // its format, so that the key stays valid while it is cached
+  lua_ref cache_;
+  std::vector<entry> entries_;
+  std::unordered_map<const void *, std::size_t> slots_;
+  std::uint64_t clock_ = 0;
+  std::uint64_t hits_ = 0;
+  std::uint64_t misses_ = 0;
+
+  //<-
+  static int program_gc(lua_State * L) noexcept {
+    static_cast<format_program *>(lua_touserdata(L, 1))->~format_program();
+    return 0;
+  }
+
+  static void program_metatable(lua_State * L) {
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, &program_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+
+  void reset() noexcept {
+    entries_.clear();
+    slots_.clear();
+  }
+
+  // Pushes the program of the string at `idx`. It stays alive while it is on
+  // the stack, even if a nested call evicts it. Raises lua errors.
+  const format_program * push_program(lua_State * L, int idx) {
+    std::size_t len;
+    const char * fmt = lua_tolstring(L, idx, &len);
+    const void * key = static_cast<const void *>(fmt);
+
+    cache_.push(L);
+    auto it = slots_.find(key);
+    if (it != slots_.end()) {
+      ++hits_;
+      entries_[it->second].stamp = ++clock_;
+      lua_rawgeti(L, -1, static_cast<lua_Integer>(it->second + 1));
+      lua_remove(L, -2);
+      return static_cast<const format_program *>(lua_touserdata(L, -1));
+    }
+    ++misses_;
+
+    void * block = lua_newuserdata(L, sizeof(format_program));
+    format_program * p = new (block) format_program{};
+    primer::push_singleton<&format::program_metatable>(L);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, idx);
+    lua_setuservalue(L, -2);
+
+    bool ok = false;
+    std::size_t slot = 0;
+    PRIMER_TRY_BAD_ALLOC {
+      p->compile(fmt, len);
+      if (entries_.size() < capacity_) {
+        entries_.reserve(capacity_);
+        slot = entries_.size();
+        entries_.push_back(entry{nullptr, 0});
+      } else {
+        // Evict the entry which was used least recently
+        for (std::size_t i = 1; i < entries_.size(); ++i) {
+          if (entries_[i].stamp < entries_[slot].stamp) { slot = i; }
+        }
+        slots_.erase(entries_[slot].key);
+      }
+      slots_.emplace(key, slot);
+      entries_[slot] = entry{key, ++clock_};
+      ok = true;
+    }
+    PRIMER_CATCH_BAD_ALLOC {}
+    if (!ok) {
+      // The slot may be half made, so it is forgotten with the others
+      this->reset();
+      luaL_error(L, "not enough memory");
+    }
+
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, static_cast<lua_Integer>(slot + 1));
+    lua_remove(L, -2);
+    return p;
+  }
+
+  static int intf_format_impl(lua_State * L) {
+    format * self = recover_self_upvalue<format>(L);
+    luaL_checkstring(L, 1);
+    const int top = lua_gettop(L);
+    const format_program * p = self->push_program(L, 1);
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    detail::format_lua_writer w{L, &b, 1, top};
+    p->run(w);
+    luaL_pushresult(&b);
+    return 1;
+  }
+
+  static std::array<const luaL_Reg, 1> get_funcs() {
+    std::array<const luaL_Reg, 1> funcs = {{
+      luaL_Reg{"format", &intf_format_impl},
+    }};
+    return funcs;
+  }
+  //->
+
+public:
+  // The cache holds at least one format
+  explicit format(std::size_t capacity = 64)
+    : capacity_(capacity ? capacity : 1) {}
+
+  format(const format &) = delete;
+  format & operator=(const format &) = delete;
+
+  std::size_t capacity() const noexcept { return capacity_; }
+  std::size_t size() const noexcept { return slots_.size(); }
+  std::uint64_t hits() const noexcept { return hits_; }
+  std::uint64_t misses() const noexcept { return misses_; }
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    this->reset();
+    lua_createtable(L, static_cast<int>(capacity_), 0);
+    cache_ = lua_ref{L};
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    api::set_self_closures(L, get_funcs(), this);
+    lua_pop(L, 1);
+  }
+
+  void on_persist_table(lua_State * L) {
+    api::set_self_closures_prefix_reverse(L, "format__", get_funcs());
+  }
+
+  void on_unpersist_table(lua_State * L) {
+    api::set_self_closures_prefix(L, "format__", get_funcs(), this);
+  }
+};
+
+} // end namespace api
+} // end namespace primer
@@ -0,0 +1,274 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_gc_controller_overview
+/*`
+`primer::api::gc_controller` is an API feature which paces the garbage
+collector of a lua state, so that its work can be spread over the frames of a
+host loop rather than landing wherever lua happens to allocate.
+
+Its `settings` are the parameters of `lua_gc`:
+
+* `gc_mode`, `incremental` or `generational`. Generational mode exists only
+  from lua 5.4; on older versions the collector stays incremental.
+* `pause` and `step_multiplier`, in percent, as for `collectgarbage`.
+* `step_kb`, the work of each step, as for `LUA_GCSTEP`. `0` makes each step as
+  small as lua allows.
+* `automatic`. If it is `false`, the collector only runs when the host steps it.
+
+Once per frame, the host gives it a time budget:
+
+``
+  auto stats = gc_.step_for(std::chrono::microseconds{500});
+``
+
+This runs steps until the budget is spent, or the current cycle is finished.
+A new cycle is started by `step_for` only once the heap has grown by `pause`
+percent since the last one ended, so that a quiet state doesn't spend its whole
+budget in the collector.
+
+It reports
+
+* `last_cycle_time()` and `last_cycle_frames()`, the time spent in steps during
+  the last finished cycle, and over how many frames it was spread,
+* `cycles()`, the number of cycles which `step_for` finished,
+* `debt_bytes()`, the growth of the heap since the last cycle ended.
+  Lua doesn't expose the debt of its collector, so this is the nearest
+  measure which the API gives.
+
+Time is measured by `Clock`, which is `std::chrono::steady_clock` for
+`gc_controller`, and may be any clock of the host with `basic_gc_controller`.
+
+Finalizers run by the steps may raise errors. They are kept until
+`take_errors()`.
+
+The settings are saved with the state by `persist`, and applied again to the
+state when it is restored.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/cpp_pcall.hpp>
+#include <primer/error.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/lua_state_ref.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+template <typename Clock>
+class basic_gc_controller {
+public:
+  using clock_t = Clock;
+  using duration = typename Clock::duration;
+
+  enum class mode { incremental, generational };
+
+#if LUA_VERSION_NUM >= 504
+  static constexpr bool has_generational_mode = true;
+#else
+  static constexpr bool has_generational_mode = false;
+#endif
+
+  struct settings {
+    mode gc_mode = mode::incremental;
+    int pause = 200;
+    int step_multiplier = 200;
+    int step_kb = 0;
+    bool automatic = true;
+  };
+
+  struct frame_stats {
+    duration time{};
+    std::size_t steps = 0;
+    bool finished_cycle = false;
+  };
+
+private:
+  lua_state_ref sref_;
+  settings settings_;
+  std::vector<primer::error> errors_;
+
+  bool in_cycle_ = false;
+  std::size_t baseline_ = 0; // Bytes in use when the last cycle ended
+  std::size_t cycles_ = 0;
+  duration cycle_time_{};
+  std::size_t cycle_frames_ = 0;
+  duration last_cycle_time_{};
+  std::size_t last_cycle_frames_ = 0;
+
+  static std::size_t count_bytes(lua_State * L) noexcept {
+    return static_cast<std::size_t>(lua_gc(L, LUA_GCCOUNT, 0)) * 1024
+           + static_cast<std::size_t>(lua_gc(L, LUA_GCCOUNTB, 0));
+  }
+
+  void apply(lua_State * L) const noexcept {
+#if LUA_VERSION_NUM >= 504
+    if (settings_.gc_mode == mode::generational) {
+      lua_gc(L, LUA_GCGEN, 0, 0);
+    } else {
+      lua_gc(L, LUA_GCINC, 0, 0, 0);
+    }
+#endif
+    lua_gc(L, LUA_GCSETPAUSE, settings_.pause);
+    lua_gc(L, LUA_GCSETSTEPMUL, settings_.step_multiplier);
+    lua_gc(L, settings_.automatic ? LUA_GCRESTART : LUA_GCSTOP, 0);
+  }
+
+  bool due(lua_State * L) const noexcept {
+    return in_cycle_
+           || count_bytes(L) * 100
+                >= baseline_ * static_cast<std::size_t>(settings_.pause);
+  }
+
+public:
+  basic_gc_controller() = default;
+  basic_gc_controller(const basic_gc_controller &) = delete;
+  basic_gc_controller & operator=(const basic_gc_controller &) = delete;
+
+  const settings & get_settings() const noexcept { return settings_; }
+
+  // Takes effect at once if the feature is initialized
+  void configure(const settings & s) noexcept {
+    settings_ = s;
+    if (lua_State * L = sref_.lock()) { this->apply(L); }
+  }
+
+  // Runs collector steps for at most `budget`, or until a cycle is finished
+  template <typename Rep, typename Period>
+  frame_stats step_for(std::chrono::duration<Rep, Period> budget) noexcept {
+    frame_stats result;
+    lua_State * L = sref_.lock();
+    if (!L || !lua_checkstack(L, 3) || !this->due(L)) { return result; }
+
+    const auto start = clock_t::now();
+    const auto deadline =
+      start + std::chrono::duration_cast<duration>(budget);
+    in_cycle_ = true;
+    ++cycle_frames_;
+    auto now = start;
+    do {
+      int finished = 0;
+      const int data = settings_.step_kb;
+      auto ok = primer::cpp_pcall(
+        L, [L, data, &finished]() { finished = lua_gc(L, LUA_GCSTEP, data); });
+      if (!ok) {
+        PRIMER_TRY_BAD_ALLOC { errors_.emplace_back(std::move(ok.err())); }
+        PRIMER_CATCH_BAD_ALLOC {}
+      }
+      ++result.steps;
+      now = clock_t::now();
+      if (finished) {
+        result.finished_cycle = true;
+        break;
+      }
+    } while (now < deadline);
+
+    result.time = now - start;
+    cycle_time_ += result.time;
+    if (result.finished_cycle) {
+      in_cycle_ = false;
+      baseline_ = count_bytes(L);
+      ++cycles_;
+      last_cycle_time_ = cycle_time_;
+      last_cycle_frames_ = cycle_frames_;
+      cycle_time_ = duration{};
+      cycle_frames_ = 0;
+    }
+    return result;
+  }
+
+  // Time spent in steps during the last finished cycle
+  duration last_cycle_time() const noexcept { return last_cycle_time_; }
+  std::size_t last_cycle_frames() const noexcept { return last_cycle_frames_; }
+  std::size_t cycles() const noexcept { return cycles_; }
+  bool in_cycle() const noexcept { return in_cycle_; }
+
+  std::size_t bytes_in_use() const noexcept {
+    lua_State * L = sref_.lock();
+    return L ? count_bytes(L) : 0;
+  }
+
+  std::size_t debt_bytes() const noexcept {
+    const std::size_t current = this->bytes_in_use();
+    return current > baseline_ ? current - baseline_ : 0;
+  }
+
+  // Errors raised by finalizers since the last call
+  std::vector<primer::error> take_errors() noexcept {
+    std::vector<primer::error> result;
+    result.swap(errors_);
+    return result;
+  }
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    sref_ = primer::obtain_state_ref(L);
+    in_cycle_ = false;
+    baseline_ = count_bytes(L);
+    this->apply(L);
+  }
+
+  void on_persist_table(lua_State *) {}
+  void on_unpersist_table(lua_State *) {}
+
+  void on_serialize(lua_State * L) {
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, static_cast<int>(settings_.gc_mode));
+    lua_setfield(L, -2, "mode");
+    lua_pushinteger(L, settings_.pause);
+    lua_setfield(L, -2, "pause");
+    lua_pushinteger(L, settings_.step_multiplier);
+    lua_setfield(L, -2, "step_multiplier");
+    lua_pushinteger(L, settings_.step_kb);
+    lua_setfield(L, -2, "step_kb");
+    lua_pushboolean(L, settings_.automatic);
+    lua_setfield(L, -2, "automatic");
+  }
+
+  // Snapshots from before the settings were persisted have nil here
+  void on_deserialize(lua_State * L) {
+    if (!lua_istable(L, -1)) {
+      lua_pop(L, 1);
+      return;
+    }
+    lua_getfield(L, -1, "mode");
+    settings_.gc_mode =
+      lua_tointeger(L, -1) == static_cast<int>(mode::generational)
+        ? mode::generational
+        : mode::incremental;
+    lua_getfield(L, -2, "pause");
+    settings_.pause = static_cast<int>(lua_tointeger(L, -1));
+    lua_getfield(L, -3, "step_multiplier");
+    settings_.step_multiplier = static_cast<int>(lua_tointeger(L, -1));
+    lua_getfield(L, -4, "step_kb");
+    settings_.step_kb = static_cast<int>(lua_tointeger(L, -1));
+    lua_getfield(L, -5, "automatic");
+    settings_.automatic = lua_toboolean(L, -1);
+    lua_pop(L, 6);
+    this->apply(L);
+  }
+};
+
+template <typename Clock>
+constexpr bool basic_gc_controller<Clock>::has_generational_mode;
+
+using gc_controller = basic_gc_controller<std::chrono::steady_clock>;
+
+} // end namespace api
+} // end namespace primer
@@ -7,6 +7,14 @@
 
 /***
  * Defines a simple registry-based help interface.
+ *
+ * Help for functions which are known when the program is built, like the
+ * callbacks of a `callback_registrar`, is kept in a `help_index`. It is built
+ * once for the whole program and shared by every lua state, which only holds
+ * a pointer to it in the registry.
+ *
+ * Help which is added while the program runs, using `set_help_string`, is kept
+ * in a table in the registry of each lua state, and is looked at first.
  */
 
 #include <primer/base.hpp>
@@ -15,17 +23,72 @@ PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/lua.hpp>
 #include <primer/push_singleton.hpp>
+#include <primer/support/asserts.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <vector>
 
 namespace primer {
 
 namespace api {
 
+/***
+ * help_index: The help strings of a fixed list of functions, sorted by
+ * function pointer. The strings are not copied, so they should be static.
+ */
+
+class help_index {
+  using entry = std::pair<lua_CFunction, const char *>;
+
+  std::vector<entry> entries_;
+
+  static bool less(const entry & a, const entry & b) noexcept {
+    return std::less<lua_CFunction>{}(a.first, b.first);
+  }
+
+public:
+  // Takes a range of objects with members `func` and `help`, like `luaW_Reg`.
+  // Entries without a function or without help are skipped. If a function
+  // appears several times, the last help string is the one kept, as if
+  // `set_help_string` were called for each entry in order.
+  template <typename R>
+  explicit help_index(const R & range) {
+    for (const auto & r : range) {
+      if (r.func && r.help) { entries_.emplace_back(r.func, r.help); }
+    }
+    std::reverse(entries_.begin(), entries_.end());
+    std::stable_sort(entries_.begin(), entries_.end(), &less);
+    entries_.erase(std::unique(entries_.begin(), entries_.end(),
+                               [](const entry & a, const entry & b) {
+                                 return a.first == b.first;
+                               }),
+                   entries_.end());
+  }
+
+  const char * find(lua_CFunction f) const noexcept {
+    const entry key{f, nullptr};
+    auto it = std::lower_bound(entries_.begin(), entries_.end(), key, &less);
+    if (it != entries_.end() && it->first == f) { return it->second; }
+    return nullptr;
+  }
+
+  std::size_t size() const noexcept { return entries_.size(); }
+};
+
 // The help database table does not need to be anything special.
 inline void
 make_help_table(lua_State * L) {
   lua_newtable(L);
 }
 
+// The sequence of help indices used by this lua state, as light userdata
+inline void
+make_help_index_list(lua_State * L) {
+  lua_newtable(L);
+}
+
 /***
  * set_help_string: Registers a help string for a function in the help database
  * for this lua state.
@@ -45,13 +108,40 @@ set_help_string(lua_State * L, lua_CFunction f, const char * help_str) {
   lua_pop(L, 1);
 }
 
+/***
+ * add_help_index: Makes the help in `index` available in this lua state.
+ * The index must outlive the lua state. Adding the same index again does
+ * nothing.
+ */
+inline void
+add_help_index(lua_State * L, const help_index & index) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+
+  void * p = const_cast<help_index *>(&index);
+  primer::push_singleton<&make_help_index_list>(L);
+  const LUA_INTEGER n = static_cast<LUA_INTEGER>(lua_rawlen(L, -1));
+  for (LUA_INTEGER i = 1; i <= n; ++i) {
+    lua_rawgeti(L, -1, i);
+    const bool found = (lua_touserdata(L, -1) == p);
+    lua_pop(L, 1);
+    if (found) {
+      lua_pop(L, 1);
+      return;
+    }
+  }
+  lua_pushlightuserdata(L, p);
+  lua_rawseti(L, -2, n + 1);
+  lua_pop(L, 1);
+}
+
 /***
  * get_help_string: Try to obtain a help string from the database.
  * return nullptr if lookup fails.
  *
- * The string is owned by lua and is linked to from the help database, so its
- * lifetime is at least until set_help_string is called to change this string,
- * or the lua_State is collected.
+ * A string set with set_help_string is owned by lua and is linked to from the
+ * help database, so its lifetime is at least until set_help_string is called
+ * to change this string, or the lua_State is collected. A string from a help
+ * index lives as long as the index.
  */
 
 inline const char *
@@ -60,11 +150,23 @@ get_help_string(lua_State * L, lua_CFunction f) {
 
   primer::push_singleton<&make_help_table>(L);
   lua_pushcfunction(L, f);
-  lua_gettable(L, -2);
+  lua_rawget(L, -2);
   const char * str = lua_tostring(L, -1);
   lua_pop(L, 2);
   // Note: The string is still in the registry table, so it will not be
   // garbage collected by lua until that link is broken.
+  if (str) { return str; }
+
+  primer::push_singleton<&make_help_index_list>(L);
+  const LUA_INTEGER n = static_cast<LUA_INTEGER>(lua_rawlen(L, -1));
+  for (LUA_INTEGER i = 1; i <= n && !str; ++i) {
+    lua_rawgeti(L, -1, i);
+    if (const void * p = lua_touserdata(L, -1)) {
+      str = static_cast<const help_index *>(p)->find(f);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
   return str;
 }
 
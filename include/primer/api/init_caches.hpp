@@ -19,6 +19,7 @@ PRIMER_ASSERT_FILESCOPE;
 #include <primer/lua.hpp>
 #include <primer/push_singleton.hpp>
 #include <primer/support/lua_state_ref.hpp>
+#include <primer/support/registry_slots.hpp>
 
 namespace primer {
 namespace api {
@@ -27,6 +28,11 @@ inline void
 init_caches(lua_State * L) {
   PRIMER_ASSERT_STACK_NEUTRAL(L);
 
+#ifdef PRIMER_REGISTRY_SLOTS
+  // This comes first, before anything takes an integer key of the registry
+  primer::reserve_registry_slots(L);
+#endif
+
   // Initialize some cached objects. If these can't be created later in a low
   // memory situation it will cause problems, so, try to preempt this.
   lua_state_ref::obtain_weak_ref_to_state(L);
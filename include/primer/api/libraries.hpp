@@ -16,6 +16,9 @@ PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/lua.hpp>
 
+#include <cstring>
+#include <type_traits>
+
 namespace primer {
 namespace api {
 
@@ -91,6 +94,30 @@ struct lua_math_lib_sandboxed {
   static constexpr lua_CFunction func = &get_clean_math;
 };
 
+//[ lua_lazy_lib
+/*`
+Wrapping a library in `lazy` means that it isn't opened by `initialize_api`.
+Its global is brought in by an `__index` metamethod of `_G`, which opens the
+library the first time the global is read, e.g.
+
+  libraries<lua_base_lib, lua_string_lib, lazy<lua_io_lib>, lazy<lua_os_lib>>
+
+A state which never uses `io` or `os` never pays for them. The functions of a
+lazy library are added to the permanent objects table just as in eager mode,
+because a persisted state may have opened it.
+
+Until it is read, the global doesn't exist as a key of `_G`, so `pairs(_G)`
+doesn't see it, and `require` doesn't find it. The base library can't be lazy,
+and the string library should only be lazy if the string methods aren't used
+before the global, since opening it sets the metatable of strings.
+*/
+template <typename T>
+struct lazy {
+  static constexpr const char * name = T::name;
+  static constexpr lua_CFunction func = T::func;
+};
+//]
+
 /***
  * An API feature object which registers a number of libraries
  */
@@ -99,11 +126,117 @@ template <typename... Ts>
 class libraries {
 
   template <typename T>
-  static void load_lib_globally(lua_State * L) {
+  struct is_lazy : std::false_type {};
+
+  template <typename T>
+  struct is_lazy<lazy<T>> : std::true_type {};
+
+  template <typename T>
+  static void load_lib_globally(lua_State * L, std::false_type) {
     luaL_requiref(L, T::name, T::func, 1);
     lua_pop(L, 1);
   }
 
+  // Adds a lazy library to the table of pending names at the top of the stack
+  template <typename T>
+  static void load_lib_globally(lua_State * L, std::true_type) {
+    lua_pushboolean(L, true);
+    lua_setfield(L, -2, T::name);
+  }
+
+  template <typename T>
+  static bool open_if_named(lua_State * L, const char * k) {
+    if (!is_lazy<T>::value || std::strcmp(k, T::name)) { return false; }
+    luaL_requiref(L, T::name, T::func, 0);
+    return true;
+  }
+
+  // __index of _G, opening the lazy libraries.
+  // Upvalues: the table of names not opened yet, and the previous __index.
+  static int lazy_index(lua_State * L) {
+    if (lua_type(L, 2) == LUA_TSTRING) {
+      lua_pushvalue(L, 2);
+      if (lua_rawget(L, lua_upvalueindex(1)) != LUA_TNIL) { // [t] [k] [true]
+        lua_pop(L, 1);
+        lua_pushvalue(L, 2);
+        lua_pushnil(L);
+        lua_rawset(L, lua_upvalueindex(1));
+
+        const char * k = lua_tostring(L, 2);
+        bool found[] = {open_if_named<Ts>(L, k)..., false};
+        static_cast<void>(found);               // [t] [k] [lib]
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, 1);
+        return 1;
+      }
+      lua_pop(L, 1);
+    }
+
+    switch (lua_type(L, lua_upvalueindex(2))) {
+      case LUA_TNIL: return 0;
+      case LUA_TFUNCTION: {
+        lua_pushvalue(L, lua_upvalueindex(2));
+        lua_insert(L, 1);
+        lua_call(L, 2, 1);
+        return 1;
+      }
+      default: {
+        lua_gettable(L, lua_upvalueindex(2));
+        return 1;
+      }
+    }
+  }
+
+  static bool any_lazy() {
+    const bool lazy[] = {is_lazy<Ts>::value..., false};
+    for (bool l : lazy) {
+      if (l) { return true; }
+    }
+    return false;
+  }
+
+  // Installs `lazy_index`, for the table of pending names at the top of the
+  // stack
+  static void install_lazy_index(lua_State * L) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS); // [pending] [_G]
+    if (!lua_getmetatable(L, -1)) {
+      lua_newtable(L);
+      lua_pushvalue(L, -1);
+      lua_setmetatable(L, -3);
+    } // [pending] [_G] [mt]
+
+    lua_pushvalue(L, -3);
+    lua_getfield(L, -2, "__index");
+    lua_pushcclosure(L, &lazy_index, 2);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 3);
+  }
+
+  // The placeholder name of `lazy_index`, e.g. "libraries_lazy_index_io_os"
+  static void push_lazy_index_name(lua_State * L) {
+    lua_pushliteral(L, "libraries_lazy_index");
+    int n = 1;
+    const char * names[] = {(is_lazy<Ts>::value ? Ts::name : "")..., ""};
+    for (const char * name : names) {
+      if (*name) {
+        lua_pushfstring(L, "_%s", name);
+        ++n;
+      }
+    }
+    lua_concat(L, n);
+  }
+
+  template <bool kv_order>
+  static void load_lazy_index_into_table(lua_State * L) {
+    if (!any_lazy()) { return; }
+    PRIMER_ASSERT_TABLE(L);
+    lua_pushcfunction(L, &lazy_index);
+    push_lazy_index_name(L);
+    if (kv_order) { lua_insert(L, -2); }
+    lua_settable(L, -3);
+  }
+
   template <typename T, bool kv_order>
   static void load_lib_into_table(lua_State * L) {
     constexpr const char * fmt = "%s_lib_%s";
@@ -129,18 +262,26 @@ class libraries {
 
 public:
   void on_init(lua_State * L) {
-    int dummy[] = {(load_lib_globally<Ts>(L), 0)..., 0};
+    lua_newtable(L); // [pending]
+    int dummy[] = {(load_lib_globally<Ts>(L, is_lazy<Ts>{}), 0)..., 0};
     static_cast<void>(dummy);
+    if (any_lazy()) {
+      install_lazy_index(L);
+    } else {
+      lua_pop(L, 1);
+    }
   }
 
   void on_persist_table(lua_State * L) {
     int dummy[] = {(load_lib_into_table<Ts, false>(L), 0)..., 0};
     static_cast<void>(dummy);
+    load_lazy_index_into_table<false>(L);
   }
 
   void on_unpersist_table(lua_State * L) {
     int dummy[] = {(load_lib_into_table<Ts, true>(L), 0)..., 0};
     static_cast<void>(dummy);
+    load_lazy_index_into_table<true>(L);
   }
 };
 
@@ -155,5 +296,10 @@ using sandboxed_basic_libraries =
   libraries<lua_base_lib_sandboxed, lua_table_lib, lua_math_lib_sandboxed,
             lua_string_lib, lua_coroutine_lib>;
 
+using lazy_core_libraries =
+  libraries<lua_base_lib, lua_table_lib, lua_math_lib, lua_string_lib,
+            lazy<lua_coroutine_lib>, lazy<lua_io_lib>, lazy<lua_os_lib>,
+            lazy<lua_debug_lib>>;
+
 } // end namespace api
 } // end namespace primer
@@ -0,0 +1,500 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_log_overview
+/*`
+`primer::api::log` is an API feature which gives scripts a global table `log`
+of leveled logging functions, `log.trace`, `log.debug`, `log.info`,
+`log.warn` and `log.error`, which write structured records instead of text.
+
+``
+  log.debug("spawned", id, x, y)
+``
+
+Each function checks its level against the threshold of the feature first, so
+a call which is filtered out returns before it looks at its arguments.
+Otherwise the arguments are captured as typed values: nil, booleans, integers,
+numbers and strings are copied as they are, a `string_builder` as its text,
+and other values as their type name. They go into one binary record, with the
+level and the time, in the `log_ring` of the VM. Nothing is converted to a
+string, formatted or allocated by the VM.
+
+`log.enabled(level)` tells scripts if a level, one of the names above, passes
+the threshold, to skip building arguments which are costly.
+
+A `log_ring` is a single-producer / single-consumer queue of fixed capacity,
+like `print_ring`. If a record doesn't fit, it is dropped and counted, so the
+VM never waits. `log_consumer` is used by one thread, which holds any number of
+rings, and `drain` delivers their records to a callback
+
+  void(const log_ring &, const log_record &)
+
+which formats them, if it wants text, with `log_record::format`. The record is
+only valid during the call.
+
+The feature makes its own ring of 64 KiB, which `ring()` shares. The threshold
+is `log_level::info` by default, and may be set from any thread.
+
+``
+  API_FEATURE(primer::api::log, log_);
+
+  consumer.add(log_.ring());
+  log_.set_level(primer::api::log_level::debug);
+``
+
+The functions are added to the permanent objects table, so scripts which hold
+them can be persisted.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/api/self_closures.hpp>
+#include <primer/lua.hpp>
+#include <primer/string_builder.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/types.hpp>
+#include <primer/userdata.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+enum class log_level : std::uint8_t { trace, debug, info, warn, error, off };
+
+inline const char *
+log_level_name(log_level l) noexcept {
+  static const char * const names[] = {"trace", "debug", "info",
+                                       "warn",  "error", "off"};
+  return names[static_cast<std::size_t>(l)];
+}
+
+// One captured argument of a record. A string is a view into the record.
+struct log_value {
+  enum class kind : std::uint8_t {
+    nil,
+    boolean,
+    integer,
+    number,
+    string,
+    other
+  };
+
+  kind type;
+  bool boolean;
+  lua_Integer integer;
+  lua_Number number;
+  lua_string_view string; // Also the type name, for `other`
+};
+
+class log_record {
+  log_level level_;
+  std::chrono::system_clock::time_point time_;
+  std::vector<log_value> values_;
+
+  friend class log_ring;
+
+public:
+  log_level level() const noexcept { return level_; }
+  std::chrono::system_clock::time_point time() const noexcept {
+    return time_;
+  }
+  const std::vector<log_value> & values() const noexcept { return values_; }
+
+  // Appends the values, separated by tabs, as `print` would show them
+  // Note: Can throw std::bad_alloc
+  void format(std::string & out) const {
+    for (std::size_t i = 0; i < values_.size(); ++i) {
+      if (i) { out += '\t'; }
+      const log_value & v = values_[i];
+      char buffer[64];
+      switch (v.type) {
+        case log_value::kind::nil: out += "nil"; break;
+        case log_value::kind::boolean:
+          out += v.boolean ? "true" : "false";
+          break;
+        case log_value::kind::integer:
+          std::snprintf(buffer, sizeof(buffer), LUA_INTEGER_FMT, v.integer);
+          out += buffer;
+          break;
+        case log_value::kind::number:
+          std::snprintf(buffer, sizeof(buffer), LUA_NUMBER_FMT, v.number);
+          out += buffer;
+          break;
+        case log_value::kind::string:
+          out.append(v.string.data(), v.string.size());
+          break;
+        case log_value::kind::other:
+          out += '<';
+          out.append(v.string.data(), v.string.size());
+          out += '>';
+          break;
+      }
+    }
+  }
+
+  std::string format() const {
+    std::string result;
+    this->format(result);
+    return result;
+  }
+};
+
+class log_ring {
+  // Each record is its size, then the level, the count of values, the time in
+  // nanoseconds since the epoch, and then, for each value, its kind and its
+  // bytes. Strings are a length and then their characters.
+  using size_t32 = std::uint32_t;
+  using count_t = std::uint16_t;
+  static constexpr std::size_t cache_line = 64;
+  static constexpr std::size_t fixed_size =
+    sizeof(size_t32) + 1 + sizeof(count_t) + sizeof(std::int64_t);
+
+  std::size_t id_;
+  std::size_t mask_;
+  std::unique_ptr<char[]> data_;
+
+  char pad0_[cache_line];
+  std::atomic<std::size_t> head_{0};
+  std::atomic<std::size_t> dropped_{0};
+  char pad1_[cache_line];
+  std::atomic<std::size_t> tail_{0};
+  char pad2_[cache_line];
+
+  static std::size_t round_up(std::size_t n) noexcept {
+    std::size_t result = 64;
+    while (result < n) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  void write_bytes(std::size_t pos, const void * src,
+                   std::size_t n) noexcept {
+    const char * s = static_cast<const char *>(src);
+    const std::size_t offset = pos & mask_;
+    const std::size_t first = n < mask_ + 1 - offset ? n : mask_ + 1 - offset;
+    std::memcpy(data_.get() + offset, s, first);
+    std::memcpy(data_.get(), s + first, n - first);
+  }
+
+  void read_bytes(std::size_t pos, void * dest, std::size_t n) const noexcept {
+    char * d = static_cast<char *>(dest);
+    const std::size_t offset = pos & mask_;
+    const std::size_t first = n < mask_ + 1 - offset ? n : mask_ + 1 - offset;
+    std::memcpy(d, data_.get() + offset, first);
+    std::memcpy(d + first, data_.get(), n - first);
+  }
+
+  // The kind of the value at `idx`, and its string, if it has one
+  static log_value::kind classify(lua_State * L, int idx, const char *& str,
+                                  std::size_t & len) noexcept {
+    switch (lua_type(L, idx)) {
+      case LUA_TNIL: return log_value::kind::nil;
+      case LUA_TBOOLEAN: return log_value::kind::boolean;
+      case LUA_TNUMBER:
+        return lua_isinteger(L, idx) ? log_value::kind::integer
+                                     : log_value::kind::number;
+      case LUA_TSTRING:
+        str = lua_tolstring(L, idx, &len);
+        return log_value::kind::string;
+      case LUA_TUSERDATA:
+        if (const auto * b = primer::test_udata<string_builder>(L, idx)) {
+          str = b->data();
+          len = b->size();
+          return log_value::kind::string;
+        }
+        break;
+      default: break;
+    }
+    str = luaL_typename(L, idx);
+    len = std::strlen(str);
+    return log_value::kind::other;
+  }
+
+  static std::size_t value_size(log_value::kind k, std::size_t len) noexcept {
+    switch (k) {
+      case log_value::kind::nil: return 1;
+      case log_value::kind::boolean: return 2;
+      case log_value::kind::integer: return 1 + sizeof(lua_Integer);
+      case log_value::kind::number: return 1 + sizeof(lua_Number);
+      default: return 1 + sizeof(size_t32) + len;
+    }
+  }
+
+  friend class log_consumer;
+
+  // Consumer side
+  template <typename F>
+  std::size_t drain(F && f, std::string & scratch, log_record & rec) {
+    std::size_t count = 0;
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    const std::size_t head = head_.load(std::memory_order_acquire);
+    while (tail != head) {
+      size_t32 size;
+      this->read_bytes(tail, &size, sizeof(size));
+      scratch.resize(size);
+      this->read_bytes(tail, &scratch[0], size);
+      tail += size;
+      tail_.store(tail, std::memory_order_release);
+
+      const char * p = scratch.data() + sizeof(size_t32);
+      rec.level_ = static_cast<log_level>(*p++);
+      count_t n;
+      std::memcpy(&n, p, sizeof(n));
+      p += sizeof(n);
+      std::int64_t ns;
+      std::memcpy(&ns, p, sizeof(ns));
+      p += sizeof(ns);
+      rec.time_ = std::chrono::system_clock::time_point{
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::nanoseconds{ns})};
+
+      rec.values_.resize(n);
+      for (log_value & v : rec.values_) {
+        v.type = static_cast<log_value::kind>(*p++);
+        switch (v.type) {
+          case log_value::kind::nil: break;
+          case log_value::kind::boolean: v.boolean = *p++ != 0; break;
+          case log_value::kind::integer:
+            std::memcpy(&v.integer, p, sizeof(v.integer));
+            p += sizeof(v.integer);
+            break;
+          case log_value::kind::number:
+            std::memcpy(&v.number, p, sizeof(v.number));
+            p += sizeof(v.number);
+            break;
+          default: {
+            size_t32 len;
+            std::memcpy(&len, p, sizeof(len));
+            p += sizeof(len);
+            v.string = lua_string_view{p, len};
+            p += len;
+          }
+        }
+      }
+
+      f(static_cast<const log_ring &>(*this),
+        static_cast<const log_record &>(rec));
+      ++count;
+    }
+    return count;
+  }
+
+public:
+  // The capacity is rounded up to a power of two, at least 64 bytes
+  explicit log_ring(std::size_t capacity, std::size_t id = 0)
+    : id_(id)
+    , mask_(round_up(capacity) - 1)
+    , data_(new char[mask_ + 1]) {}
+
+  log_ring(const log_ring &) = delete;
+  log_ring & operator=(const log_ring &) = delete;
+
+  std::size_t id() const noexcept { return id_; }
+  std::size_t capacity() const noexcept { return mask_ + 1; }
+
+  // Records which didn't fit when they were logged
+  std::size_t dropped() const noexcept {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+  // Producer side: records the values at `[first, first + n)`
+  void write(lua_State * L, log_level level, int first, int n) noexcept {
+    if (n > static_cast<count_t>(-1)) { n = static_cast<count_t>(-1); }
+
+    std::size_t size = fixed_size;
+    for (int i = first; i < first + n; ++i) {
+      const char * str;
+      std::size_t len = 0;
+      const log_value::kind k = classify(L, i, str, len);
+      size += value_size(k, len);
+    }
+
+    const std::size_t head = head_.load(std::memory_order_relaxed);
+    const std::size_t tail = tail_.load(std::memory_order_acquire);
+    if (size > mask_ + 1 - (head - tail)
+        || size > static_cast<size_t32>(-1)) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    std::size_t pos = head;
+    auto put = [&](const void * src, std::size_t bytes) {
+      this->write_bytes(pos, src, bytes);
+      pos += bytes;
+    };
+
+    const size_t32 size32 = static_cast<size_t32>(size);
+    put(&size32, sizeof(size32));
+    const char lvl = static_cast<char>(level);
+    put(&lvl, 1);
+    const count_t count = static_cast<count_t>(n);
+    put(&count, sizeof(count));
+    const std::int64_t ns =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch())
+        .count();
+    put(&ns, sizeof(ns));
+
+    for (int i = first; i < first + n; ++i) {
+      const char * str = nullptr;
+      std::size_t len = 0;
+      const log_value::kind k = classify(L, i, str, len);
+      const char tag = static_cast<char>(k);
+      put(&tag, 1);
+      switch (k) {
+        case log_value::kind::nil: break;
+        case log_value::kind::boolean: {
+          const char b = static_cast<char>(lua_toboolean(L, i));
+          put(&b, 1);
+          break;
+        }
+        case log_value::kind::integer: {
+          const lua_Integer x = lua_tointeger(L, i);
+          put(&x, sizeof(x));
+          break;
+        }
+        case log_value::kind::number: {
+          const lua_Number x = lua_tonumber(L, i);
+          put(&x, sizeof(x));
+          break;
+        }
+        default: {
+          const size_t32 len32 = static_cast<size_t32>(len);
+          put(&len32, sizeof(len32));
+          put(str, len);
+        }
+      }
+    }
+    head_.store(pos, std::memory_order_release);
+  }
+};
+
+class log_consumer {
+  std::vector<std::shared_ptr<log_ring>> rings_;
+  std::string scratch_;
+  log_record record_;
+
+public:
+  void add(std::shared_ptr<log_ring> r) { rings_.push_back(std::move(r)); }
+
+  void remove(const log_ring * r) {
+    for (auto it = rings_.begin(); it != rings_.end(); ++it) {
+      if (it->get() == r) {
+        rings_.erase(it);
+        return;
+      }
+    }
+  }
+
+  std::size_t size() const noexcept { return rings_.size(); }
+
+  // Delivers every record which is in the rings now, and returns how many
+  template <typename F>
+  std::size_t drain(F && f) {
+    std::size_t count = 0;
+    for (const auto & r : rings_) {
+      count += r->drain(f, scratch_, record_);
+    }
+    return count;
+  }
+};
+
+class log {
+  std::shared_ptr<log_ring> ring_;
+  std::atomic<std::uint8_t> level_;
+
+  //<-
+  template <log_level level>
+  static int intf_log_impl(lua_State * L) {
+    log * self = recover_self_upvalue<log>(L);
+    if (static_cast<std::uint8_t>(level)
+        < self->level_.load(std::memory_order_relaxed)) {
+      return 0;
+    }
+    self->ring_->write(L, level, 1, lua_gettop(L));
+    return 0;
+  }
+
+  static int intf_enabled_impl(lua_State * L) {
+    log * self = recover_self_upvalue<log>(L);
+    const char * name = luaL_checkstring(L, 1);
+    for (std::uint8_t l = 0; l < static_cast<std::uint8_t>(log_level::off);
+         ++l) {
+      if (!std::strcmp(name, log_level_name(static_cast<log_level>(l)))) {
+        lua_pushboolean(L, l >= self->level_.load(std::memory_order_relaxed));
+        return 1;
+      }
+    }
+    return luaL_argerror(L, 1, "log level expected");
+  }
+
+  static std::array<const luaL_Reg, 6> get_funcs() {
+    std::array<const luaL_Reg, 6> funcs = {{
+      luaL_Reg{"trace", &intf_log_impl<log_level::trace>},
+      luaL_Reg{"debug", &intf_log_impl<log_level::debug>},
+      luaL_Reg{"info", &intf_log_impl<log_level::info>},
+      luaL_Reg{"warn", &intf_log_impl<log_level::warn>},
+      luaL_Reg{"error", &intf_log_impl<log_level::error>},
+      luaL_Reg{"enabled", &intf_enabled_impl},
+    }};
+    return funcs;
+  }
+  //->
+
+public:
+  log()
+    : ring_(std::make_shared<log_ring>(1 << 16))
+    , level_(static_cast<std::uint8_t>(log_level::info)) {}
+
+  // The ring which records go to. Replace it only while no script runs.
+  const std::shared_ptr<log_ring> & ring() const noexcept { return ring_; }
+  void set_ring(std::shared_ptr<log_ring> r) noexcept { ring_ = std::move(r); }
+
+  log_level level() const noexcept {
+    return static_cast<log_level>(level_.load(std::memory_order_relaxed));
+  }
+  void set_level(log_level l) noexcept {
+    level_.store(static_cast<std::uint8_t>(l), std::memory_order_relaxed);
+  }
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    lua_createtable(L, 0, 6);
+    api::set_self_closures(L, get_funcs(), this);
+    lua_setglobal(L, "log");
+  }
+
+  void on_persist_table(lua_State * L) {
+    api::set_self_closures_prefix_reverse(L, "log__", get_funcs());
+  }
+
+  void on_unpersist_table(lua_State * L) {
+    api::set_self_closures_prefix(L, "log__", get_funcs(), this);
+  }
+};
+
+} // end namespace api
+} // end namespace primer
@@ -0,0 +1,164 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_mapped_vfs_overview
+/*`
+`primer::api::mapped_vfs` is a ready-made "VFS Provider", which loads modules
+from a directory, on POSIX systems.
+
+A lua-style path `a.b.c` is resolved like `package.path` would, by substituting
+`a/b/c` for `?` in each of the patterns, by default `?.lua` and `?/init.lua`,
+relative to the root directory. The first file which exists is loaded.
+
+The files are memory-mapped with `primer::mapped_file`, and the mapped bytes are
+passed straight to `luaL_loadbuffer`. The mappings are shared by all of the lua
+states in the process.
+
+`primer::api::archive_vfs` is the same, for a module archive (see
+`primer/api/module_archive.hpp`). The archive is mapped once, the names are
+looked up in its index, and there are no other files to open or search.
+
+This header isn't included by `primer/api.hpp`.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/api/module_archive.hpp>
+#include <primer/api/vfs.hpp>
+#include <primer/error.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/mapped_file.hpp>
+
+#include <memory>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+namespace primer {
+namespace api {
+
+class mapped_vfs : public vfs<mapped_vfs> {
+  std::string root_;
+  std::vector<std::string> patterns_;
+
+  // The components of the path are nonempty, and can't leave the root
+  static bool valid_path(const std::string & path) noexcept {
+    if (path.empty() || path.front() == '.' || path.back() == '.') {
+      return false;
+    }
+    char prev = 0;
+    for (char c : path) {
+      if (c == '/' || c == '\\' || (c == '.' && prev == '.')) { return false; }
+      prev = c;
+    }
+    return true;
+  }
+
+public:
+  explicit mapped_vfs(std::string root)
+    : root_(std::move(root))
+    , patterns_{"?.lua", "?/init.lua"} {}
+
+  mapped_vfs(std::string root, std::vector<std::string> patterns)
+    : root_(std::move(root))
+    , patterns_(std::move(patterns)) {}
+
+  // The file which `path` resolves to, or the empty string
+  std::string resolve(const std::string & path) const {
+    if (!valid_path(path)) { return {}; }
+    std::string name{path};
+    for (char & c : name) {
+      if (c == '.') { c = '/'; }
+    }
+
+    for (const std::string & pattern : patterns_) {
+      std::string file{root_};
+      file += '/';
+      for (char c : pattern) {
+        if (c == '?') {
+          file += name;
+        } else {
+          file += c;
+        }
+      }
+      if (!::access(file.c_str(), R_OK)) { return file; }
+    }
+    return {};
+  }
+
+  // VFS Provider
+  expected<void> load(lua_State * L, const std::string & path) {
+    PRIMER_TRY_BAD_ALLOC {
+      const std::string file = this->resolve(path);
+      if (file.empty()) { return primer::error::module_not_found(path); }
+
+      auto mapping = mapped_file::open(file);
+      if (!mapping) { return primer::error{"could not map '", file, "'"}; }
+
+      const std::string chunkname = "@" + file;
+      int code = luaL_loadbuffer(L, mapping->data(), mapping->size(),
+                                 chunkname.c_str());
+      if (code != LUA_OK) { return primer::pop_error(L, code); }
+      return {};
+    }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+  }
+};
+
+class archive_vfs : public vfs<archive_vfs> {
+  std::string file_;
+  std::shared_ptr<const mapped_file> mapping_;
+  expected<module_archive> archive_;
+
+  static expected<module_archive> open_archive(const mapped_file * m) {
+    if (!m) { return primer::error{"could not map archive"}; }
+    return module_archive::open(m->data(), m->size());
+  }
+
+public:
+  // If the archive can't be opened, every load reports why
+  explicit archive_vfs(std::string file)
+    : file_(std::move(file))
+    , mapping_(mapped_file::open(file_))
+    , archive_(open_archive(mapping_.get())) {}
+
+  const expected<module_archive> & archive() const noexcept {
+    return archive_;
+  }
+
+  // VFS Provider
+  expected<void> load(lua_State * L, const std::string & path) {
+    if (!archive_) {
+      return primer::error{"in '", file_, "': ", archive_.err().str()};
+    }
+
+    const char * data;
+    std::size_t size;
+    if (!archive_->find(path, data, size)) {
+      return primer::error::module_not_found(path);
+    }
+
+    PRIMER_TRY_BAD_ALLOC {
+      const std::string chunkname = "@" + file_ + ":" + path;
+      int code = luaL_loadbuffer(L, data, size, chunkname.c_str());
+      if (code != LUA_OK) { return primer::pop_error(L, code); }
+      return {};
+    }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+  }
+};
+
+} // end namespace api
+} // end namespace primer
@@ -0,0 +1,167 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_memory_limiter_overview
+/*`
+`primer::api::memory_limiter` is an API feature which accounts for the memory
+used by a lua state, and may cap it.
+
+On `initialize_api`, it wraps the allocator of the state, whatever it is, and
+starts counting from the bytes which lua reports in use then. It tracks
+
+* `bytes_in_use()` and `peak()`,
+* `new_objects(type)`, the number of objects created of each lua type, e.g.
+  `LUA_TTABLE` or `LUA_TSTRING`,
+* `refused()`, the number of allocations which were refused.
+
+The counts of bytes may be read from other threads, e.g. by a scheduler which
+places sessions according to their footprint.
+
+`set_limit(n)` sets a hard budget of `n` bytes. An allocation which would go
+over it fails, and lua then runs an emergency full collection and tries again,
+so a script only gets a memory error if it is really using that much. A limit of
+`0` means no limit. With `set_limit(n, memory_limiter::mode::soft)`, the
+allocation succeeds, and only `over_limit()` says that the budget is exceeded,
+for the host to act on.
+
+A hard limit makes memory errors an ordinary event, so it should not be used
+with `PRIMER_NO_MEMORY_FAILURE`.
+
+The feature must be destroyed before the state is closed, or after, but the
+state must not be closed by another thread meanwhile. Its destructor puts back
+the original allocator, if the state is still open.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/support/lua_state_ref.hpp>
+
+#include <atomic>
+#include <cstddef>
+
+namespace primer {
+namespace api {
+
+class memory_limiter {
+public:
+  enum class mode { hard, soft };
+
+private:
+  // Lua tags new objects by type, up to its internal types at LUA_NUMTAGS + 1
+  static constexpr int num_types = LUA_NUMTAGS + 2;
+
+  lua_state_ref sref_;
+  lua_Alloc prev_ = nullptr;
+  void * prev_ud_ = nullptr;
+
+  std::size_t limit_ = 0;
+  mode mode_ = mode::hard;
+
+  std::atomic<std::size_t> current_{0};
+  std::atomic<std::size_t> peak_{0};
+  std::size_t refused_ = 0;
+  std::size_t new_objects_[num_types] = {};
+
+  static void * alloc(void * ud, void * ptr, std::size_t osize,
+                      std::size_t nsize) noexcept {
+    return static_cast<memory_limiter *>(ud)->reallocate(ptr, osize, nsize);
+  }
+
+  void * reallocate(void * ptr, std::size_t osize, std::size_t nsize) noexcept {
+    std::size_t real_osize = osize;
+    if (!ptr) {
+      // Then osize is the type of a new object, or 0
+      if (nsize && osize < static_cast<std::size_t>(num_types)) {
+        ++new_objects_[osize];
+      }
+      real_osize = 0;
+    }
+
+    const std::size_t current = current_.load(std::memory_order_relaxed);
+    const std::size_t next = current - real_osize + nsize;
+    // Lua assumes that shrinking never fails
+    if (nsize > real_osize && limit_ && next > limit_ && mode_ == mode::hard) {
+      ++refused_;
+      return nullptr;
+    }
+
+    void * result = prev_(prev_ud_, ptr, osize, nsize);
+    if (result || !nsize) {
+      current_.store(next, std::memory_order_relaxed);
+      if (next > peak_.load(std::memory_order_relaxed)) {
+        peak_.store(next, std::memory_order_relaxed);
+      }
+    }
+    return result;
+  }
+
+public:
+  memory_limiter() = default;
+  memory_limiter(const memory_limiter &) = delete;
+  memory_limiter & operator=(const memory_limiter &) = delete;
+
+  ~memory_limiter() noexcept {
+    if (lua_State * L = sref_.lock()) { lua_setallocf(L, prev_, prev_ud_); }
+  }
+
+  void set_limit(std::size_t bytes, mode m = mode::hard) noexcept {
+    limit_ = bytes;
+    mode_ = m;
+  }
+
+  std::size_t limit() const noexcept { return limit_; }
+  mode limit_mode() const noexcept { return mode_; }
+
+  bool over_limit() const noexcept {
+    return limit_ && this->bytes_in_use() > limit_;
+  }
+
+  std::size_t bytes_in_use() const noexcept {
+    return current_.load(std::memory_order_relaxed);
+  }
+
+  std::size_t peak() const noexcept {
+    return peak_.load(std::memory_order_relaxed);
+  }
+
+  void reset_peak() noexcept {
+    peak_.store(this->bytes_in_use(), std::memory_order_relaxed);
+  }
+
+  std::size_t refused() const noexcept { return refused_; }
+
+  // Objects of a lua type created so far
+  std::size_t new_objects(int type) const noexcept {
+    return type >= 0 && type < num_types ? new_objects_[type] : 0;
+  }
+
+  void on_init(lua_State * L) {
+    void * ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    if (f == &alloc && ud == this) { return; }
+
+    sref_ = primer::obtain_state_ref(L);
+    prev_ = f;
+    prev_ud_ = ud;
+    const std::size_t bytes =
+      static_cast<std::size_t>(lua_gc(L, LUA_GCCOUNT, 0)) * 1024
+      + static_cast<std::size_t>(lua_gc(L, LUA_GCCOUNTB, 0));
+    current_.store(bytes, std::memory_order_relaxed);
+    peak_.store(bytes, std::memory_order_relaxed);
+    lua_setallocf(L, &alloc, this);
+  }
+
+  void on_persist_table(lua_State *) {}
+  void on_unpersist_table(lua_State *) {}
+};
+
+} // end namespace api
+} // end namespace primer
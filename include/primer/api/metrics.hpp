@@ -0,0 +1,512 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_metrics_overview
+/*`
+`primer::api::metrics` is a registry of runtime statistics of many lua states,
+for a monitoring system to scrape.
+
+The host declares counters, gauges and histograms once, and makes a `shard`
+for each VM, with labels like `vm="12"`. Only the thread running the VM writes
+to its shard, so the values are relaxed atomics, and a write takes no lock.
+Another thread may `collect` the values of every shard at any time, or write
+them in the Prometheus text format, or as a compact binary snapshot, which
+`metrics::read_snapshot` reads back.
+
+``
+  primer::api::metrics m;
+  auto ids = primer::api::add_vm_metrics(m);
+  auto & shard = m.make_shard("vm=\"12\"");
+  ...
+  // On the thread of the VM, e.g. at the end of a frame
+  primer::api::publish_lua_memory(shard, ids, L);
+  primer::api::publish_gc(shard, ids, api.gc_);
+  {
+    primer::api::metrics::shard::timer t{shard, ids.persist_seconds};
+    buffer = api.persist(L);
+  }
+  ...
+  // On the thread serving /metrics
+  std::string text = m.prometheus_text();
+``
+
+A metric may also be computed when it is collected, by a function which lists
+its values, if they are safe to read from another thread. The counters of
+instrumented callbacks are like that, see `add_callback_metrics<my_api>(m)`.
+
+Durations are recorded in nanoseconds, in a log-linear histogram, and written
+in seconds, with a bucket at each power of two. A shard only has the metrics
+which were declared before it was made, and writes to others are ignored.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/api/callback_registrar.hpp>
+#include <primer/detail/latency_histogram.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/traits/binary.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+enum class metric_kind : unsigned char { counter, gauge, histogram };
+
+// One value of a collected metric. Histograms give several, with the
+// suffixes `_bucket`, `_sum` and `_count`, as in the Prometheus format.
+struct metric_sample {
+  std::string name;
+  std::string labels;
+  metric_kind kind;
+  double value;
+};
+
+class metrics {
+public:
+  using metric_id = std::size_t;
+
+  // The values of a computed metric, as labels and values
+  using computed_values = std::vector<std::pair<std::string, double>>;
+  using compute_function = std::function<void(computed_values &)>;
+
+private:
+  struct definition {
+    std::string name;
+    std::string help;
+    metric_kind kind;
+    std::size_t slot;
+    compute_function compute;
+  };
+
+  struct histogram_cell {
+    detail::latency_histogram buckets;
+    std::atomic<std::uint64_t> sum_ns{0};
+  };
+
+public:
+  class shard {
+    friend class metrics;
+
+    struct slot_t {
+      metric_kind kind;
+      std::size_t index;
+      bool stored;
+    };
+
+    std::string labels_;
+    // Where each metric is, as when the shard was made
+    std::vector<slot_t> slots_;
+    std::unique_ptr<std::atomic<std::uint64_t>[]> counters_;
+    std::unique_ptr<std::atomic<double>[]> gauges_;
+    std::unique_ptr<histogram_cell[]> histograms_;
+
+    static constexpr std::size_t npos() noexcept {
+      return static_cast<std::size_t>(-1);
+    }
+
+    // The index of `id` in the storage of kind `k`, or `npos()`
+    std::size_t slot_of(metric_id id, metric_kind k) const noexcept {
+      if (id < slots_.size() && slots_[id].stored && slots_[id].kind == k) {
+        return slots_[id].index;
+      }
+      return npos();
+    }
+
+    explicit shard(std::string labels)
+      : labels_(std::move(labels)) {}
+
+  public:
+    const std::string & labels() const noexcept { return labels_; }
+
+    void add(metric_id id, std::uint64_t n = 1) noexcept {
+      const std::size_t i = this->slot_of(id, metric_kind::counter);
+      if (i != npos()) { counters_[i].fetch_add(n, std::memory_order_relaxed); }
+    }
+
+    // For a counter which comes from a running total kept elsewhere
+    void set_total(metric_id id, std::uint64_t total) noexcept {
+      const std::size_t i = this->slot_of(id, metric_kind::counter);
+      if (i != npos()) { counters_[i].store(total, std::memory_order_relaxed); }
+    }
+
+    void set(metric_id id, double value) noexcept {
+      const std::size_t i = this->slot_of(id, metric_kind::gauge);
+      if (i != npos()) { gauges_[i].store(value, std::memory_order_relaxed); }
+    }
+
+    void record(metric_id id, std::chrono::nanoseconds d) noexcept {
+      const std::size_t i = this->slot_of(id, metric_kind::histogram);
+      if (i != npos()) {
+        const auto ns =
+          static_cast<std::uint64_t>(d.count() > 0 ? d.count() : 0);
+        histograms_[i].buckets.record(ns);
+        histograms_[i].sum_ns.fetch_add(ns, std::memory_order_relaxed);
+      }
+    }
+
+    // Records the time until it is destroyed
+    class timer {
+      shard & s_;
+      metric_id id_;
+      std::chrono::steady_clock::time_point start_;
+
+    public:
+      timer(shard & s, metric_id id) noexcept
+        : s_(s)
+        , id_(id)
+        , start_(std::chrono::steady_clock::now()) {}
+      timer(const timer &) = delete;
+      timer & operator=(const timer &) = delete;
+
+      ~timer() noexcept {
+        s_.record(id_, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - start_));
+      }
+    };
+  };
+
+private:
+  mutable std::mutex mutex_;
+  std::vector<definition> defs_;
+  std::size_t counts_[3] = {0, 0, 0};
+  std::vector<std::unique_ptr<shard>> shards_;
+
+  metric_id add(std::string name, std::string help, metric_kind kind,
+                compute_function compute = {}) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const std::size_t slot =
+      compute ? 0 : counts_[static_cast<int>(kind)]++;
+    defs_.push_back(definition{std::move(name), std::move(help), kind, slot,
+                               std::move(compute)});
+    return defs_.size() - 1;
+  }
+
+  static std::string join_labels(const std::string & a,
+                                 const std::string & b) {
+    if (a.empty()) { return b; }
+    if (b.empty()) { return a; }
+    return a + "," + b;
+  }
+
+  // Buckets are written at each power of two, in seconds
+  static void histogram_samples(std::vector<metric_sample> & out,
+                                const std::string & name,
+                                const std::string & labels,
+                                const histogram_cell & h) {
+    using hist = detail::latency_histogram;
+    std::uint64_t seen = 0;
+    char le[48];
+    for (std::size_t i = 0; i < hist::num_buckets; ++i) {
+      seen += h.buckets.bucket_count(i);
+      const std::size_t next = i + 1;
+      if (next < hist::num_buckets && next % 4) { continue; }
+      if (next < hist::num_buckets) {
+        std::snprintf(le, sizeof le, "le=\"%.9g\"",
+                      static_cast<double>(hist::lower_bound(next)) * 1e-9);
+      } else {
+        std::snprintf(le, sizeof le, "le=\"+Inf\"");
+      }
+      out.push_back(metric_sample{name + "_bucket", join_labels(labels, le),
+                                  metric_kind::histogram,
+                                  static_cast<double>(seen)});
+    }
+    out.push_back(metric_sample{
+      name + "_sum", labels, metric_kind::histogram,
+      static_cast<double>(h.sum_ns.load(std::memory_order_relaxed)) * 1e-9});
+    out.push_back(metric_sample{name + "_count", labels,
+                                metric_kind::histogram,
+                                static_cast<double>(seen)});
+  }
+
+  void samples_of(std::vector<metric_sample> & out,
+                  const definition & d, metric_id id) const {
+    if (d.compute) {
+      computed_values values;
+      d.compute(values);
+      for (auto & v : values) {
+        out.push_back(
+          metric_sample{d.name, std::move(v.first), d.kind, v.second});
+      }
+      return;
+    }
+    for (const auto & s : shards_) {
+      if (id >= s->slots_.size()) { continue; }
+      const std::size_t slot = s->slots_[id].index;
+      switch (d.kind) {
+        case metric_kind::counter:
+          out.push_back(metric_sample{
+            d.name, s->labels_, d.kind,
+            static_cast<double>(
+              s->counters_[slot].load(std::memory_order_relaxed))});
+          break;
+        case metric_kind::gauge:
+          out.push_back(
+            metric_sample{d.name, s->labels_, d.kind,
+                          s->gauges_[slot].load(std::memory_order_relaxed)});
+          break;
+        case metric_kind::histogram:
+          histogram_samples(out, d.name, s->labels_, s->histograms_[slot]);
+          break;
+      }
+    }
+  }
+
+  static const char * kind_name(metric_kind k) noexcept {
+    switch (k) {
+      case metric_kind::counter: return "counter";
+      case metric_kind::gauge: return "gauge";
+      default: return "histogram";
+    }
+  }
+
+  static void append_value(std::string & out, double v) {
+    char buf[32];
+    std::snprintf(buf, sizeof buf, "%.17g", v);
+    out += buf;
+  }
+
+public:
+  metrics() = default;
+  metrics(const metrics &) = delete;
+  metrics & operator=(const metrics &) = delete;
+
+  // Declaring metrics. Names should follow the Prometheus conventions, e.g.
+  // `primer_gc_cycles_total`.
+  metric_id add_counter(std::string name, std::string help) {
+    return this->add(std::move(name), std::move(help), metric_kind::counter);
+  }
+
+  metric_id add_gauge(std::string name, std::string help) {
+    return this->add(std::move(name), std::move(help), metric_kind::gauge);
+  }
+
+  metric_id add_histogram(std::string name, std::string help) {
+    return this->add(std::move(name), std::move(help), metric_kind::histogram);
+  }
+
+  // A counter or gauge whose values are listed by `f` when collected, on the
+  // collecting thread
+  metric_id add_computed(std::string name, std::string help, metric_kind kind,
+                         compute_function f) {
+    return this->add(std::move(name), std::move(help), kind, std::move(f));
+  }
+
+  // The shard stays valid until it is removed, or the registry is destroyed
+  shard & make_shard(std::string labels) {
+    std::unique_ptr<shard> s{new shard{std::move(labels)}};
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Computed metrics have no storage in the shards
+    for (const auto & d : defs_) {
+      s->slots_.push_back(shard::slot_t{d.kind, d.slot, !d.compute});
+    }
+    // One more than needed, so that none of the arrays is empty
+    s->counters_.reset(new std::atomic<std::uint64_t>[counts_[0] + 1]);
+    s->gauges_.reset(new std::atomic<double>[counts_[1] + 1]);
+    s->histograms_.reset(new histogram_cell[counts_[2] + 1]);
+    for (std::size_t i = 0; i <= counts_[0]; ++i) {
+      s->counters_[i].store(0, std::memory_order_relaxed);
+    }
+    for (std::size_t i = 0; i <= counts_[1]; ++i) {
+      s->gauges_[i].store(0, std::memory_order_relaxed);
+    }
+    shards_.push_back(std::move(s));
+    return *shards_.back();
+  }
+
+  void remove_shard(shard & s) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = shards_.begin(); it != shards_.end(); ++it) {
+      if (it->get() == &s) {
+        shards_.erase(it);
+        return;
+      }
+    }
+  }
+
+  std::size_t shard_count() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return shards_.size();
+  }
+
+  // The values of every metric in every shard, in the order of declaration
+  std::vector<metric_sample> collect() const {
+    std::vector<metric_sample> result;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::size_t i = 0; i < defs_.size(); ++i) {
+      this->samples_of(result, defs_[i], i);
+    }
+    return result;
+  }
+
+  // The Prometheus text exposition format
+  std::string prometheus_text() const {
+    std::string out;
+    std::vector<metric_sample> samples;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::size_t i = 0; i < defs_.size(); ++i) {
+      const definition & d = defs_[i];
+      out += "# HELP " + d.name + " " + d.help + "\n";
+      out += "# TYPE " + d.name + " " + kind_name(d.kind) + "\n";
+      samples.clear();
+      this->samples_of(samples, d, i);
+      for (const auto & s : samples) {
+        out += s.name;
+        if (!s.labels.empty()) { out += "{" + s.labels + "}"; }
+        out += ' ';
+        append_value(out, s.value);
+        out += '\n';
+      }
+    }
+    return out;
+  }
+
+  // A compact binary form of `collect()`, read by `read_snapshot`
+  std::string snapshot() const {
+    std::string out;
+    const auto samples = this->collect();
+    detail::binary_write_size(out, samples.size());
+    for (const auto & s : samples) {
+      traits::binary<std::string>::write(out, s.name);
+      traits::binary<std::string>::write(out, s.labels);
+      out += static_cast<char>(s.kind);
+      traits::binary<double>::write(out, s.value);
+    }
+    return out;
+  }
+
+  static expected<std::vector<metric_sample>> read_snapshot(
+    const std::string & bytes) {
+    std::vector<metric_sample> result;
+    const char * pos = bytes.data();
+    const char * end = pos + bytes.size();
+    std::size_t n;
+    // Each sample takes at least four bytes
+    if (!detail::binary_read_count(pos, end, n)) {
+      return primer::error{"Bad metrics snapshot"};
+    }
+    result.reserve(n / 4);
+    for (std::size_t i = 0; i < n; ++i) {
+      metric_sample s;
+      if (!traits::binary<std::string>::read(pos, end, s.name)
+          || !traits::binary<std::string>::read(pos, end, s.labels)
+          || pos == end || static_cast<unsigned char>(*pos) > 2) {
+        return primer::error{"Bad metrics snapshot"};
+      }
+      s.kind = static_cast<metric_kind>(*pos++);
+      if (!traits::binary<double>::read(pos, end, s.value)) {
+        return primer::error{"Bad metrics snapshot"};
+      }
+      result.push_back(std::move(s));
+    }
+    if (pos != end) { return primer::error{"Bad metrics snapshot"}; }
+    return result;
+  }
+};
+
+/***
+ * Standard metrics of a VM, and functions to publish them from the features
+ * which keep them. The publishing functions are called on the thread of the
+ * VM, e.g. once a frame.
+ */
+
+struct vm_metric_ids {
+  metrics::metric_id lua_bytes;
+  metrics::metric_id gc_cycles;
+  metrics::metric_id gc_cycle_seconds;
+  metrics::metric_id persist_seconds;
+  metrics::metric_id coroutines;
+};
+
+inline vm_metric_ids
+add_vm_metrics(metrics & m) {
+  vm_metric_ids ids;
+  ids.lua_bytes = m.add_gauge("primer_lua_bytes", "Bytes used by the VM");
+  ids.gc_cycles =
+    m.add_counter("primer_gc_cycles_total", "Completed collection cycles");
+  ids.gc_cycle_seconds = m.add_gauge("primer_gc_last_cycle_seconds",
+                                     "Duration of the last collection cycle");
+  ids.persist_seconds =
+    m.add_histogram("primer_persist_seconds", "Durations of persist calls");
+  ids.coroutines = m.add_gauge("primer_coroutines", "Live coroutines");
+  return ids;
+}
+
+inline void
+publish_lua_memory(metrics::shard & s, const vm_metric_ids & ids,
+                   lua_State * L) noexcept {
+  const double bytes = 1024.0 * lua_gc(L, LUA_GCCOUNT, 0)
+                       + static_cast<double>(lua_gc(L, LUA_GCCOUNTB, 0));
+  s.set(ids.lua_bytes, bytes);
+}
+
+// `G` is a `gc_controller`
+template <typename G>
+void
+publish_gc(metrics::shard & s, const vm_metric_ids & ids,
+           const G & gc) noexcept {
+  s.set_total(ids.gc_cycles, gc.cycles());
+  s.set(ids.gc_cycle_seconds,
+        std::chrono::duration<double>(gc.last_cycle_time()).count());
+}
+
+/***
+ * Computed metrics for the instrumented callbacks of the API type `R`, see
+ * `callback_registrar`. The counters are per type and atomic, so they are read
+ * when collected. `prefix` starts their names.
+ */
+template <typename R>
+void
+add_callback_metrics(metrics & m, const std::string & prefix = "primer") {
+  PRIMER_STATIC_ASSERT(R::primer_instrument_callbacks,
+                       "The callbacks are not instrumented");
+  auto each = [](metrics::computed_values & out,
+                 double (*value)(const callback_stat &)) {
+    for (const auto & c : R::callback_stats()) {
+      out.emplace_back(std::string{"callback=\""} + c.name + "\"", value(c));
+    }
+  };
+  m.add_computed(prefix + "_callback_calls_total", "Calls of each callback",
+                 metric_kind::counter, [each](metrics::computed_values & out) {
+                   each(out, [](const callback_stat & c) {
+                     return static_cast<double>(c.calls);
+                   });
+                 });
+  m.add_computed(prefix + "_callback_errors_total",
+                 "Calls of each callback which raised an error",
+                 metric_kind::counter, [each](metrics::computed_values & out) {
+                   each(out, [](const callback_stat & c) {
+                     return static_cast<double>(c.calls - c.returned);
+                   });
+                 });
+  m.add_computed(prefix + "_callback_p99_seconds",
+                 "99th percentile latency of each callback",
+                 metric_kind::gauge, [each](metrics::computed_values & out) {
+                   each(out, [](const callback_stat & c) {
+                     return std::chrono::duration<double>(c.p99).count();
+                   });
+                 });
+}
+
+} // end namespace api
+} // end namespace primer
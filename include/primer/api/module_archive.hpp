@@ -0,0 +1,241 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_module_archive_overview
+/*`
+A module archive is one read-only file which holds many lua modules, by their
+lua-style names, e.g. `pkg.sub`. Each module is either source text, or a chunk
+precompiled with `compile_chunk`.
+
+`make_module_archive` writes an archive, and `module_archive` looks modules up
+in one which is in memory, by binary search of a sorted index. The index is
+checked when the archive is opened, so lookups don't need to be.
+
+`api::archive_vfs`, in `primer/api/mapped_vfs.hpp`, is a "VFS Provider" which
+maps an archive and loads from it.
+
+Lua doesn't verify precompiled chunks, so an archive which holds them must come
+from a trusted source.
+*/
+//]
+
+/***
+ * Layout, with integers little-endian:
+ *
+ *   "PRA1"  u32 count
+ *   count x { u64 name offset, u64 name size, u64 data offset, u64 data size }
+ *   names and data
+ *
+ * Offsets are from the start of the archive. The entries are sorted by name,
+ * comparing bytes as unsigned, and the names are unique.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/lua_reader_writer.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <new>
+#include <string>
+
+namespace primer {
+
+namespace detail {
+
+struct module_archive_format {
+  static const char * magic() noexcept { return "PRA1"; }
+  static constexpr std::size_t magic_size = 4;
+  static constexpr std::size_t header_size = magic_size + 4;
+  static constexpr std::size_t entry_size = 4 * 8;
+
+  static void put(std::string & out, std::uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+      out.push_back(static_cast<char>((v >> (8 * i)) & 0xFF));
+    }
+  }
+
+  static std::uint64_t get(const char * pos, int bytes) noexcept {
+    std::uint64_t v = 0;
+    for (int i = 0; i < bytes; ++i) {
+      v |= static_cast<std::uint64_t>(static_cast<unsigned char>(pos[i]))
+           << (8 * i);
+    }
+    return v;
+  }
+
+  // Byte order, like memcmp
+  static int compare(const char * a, std::size_t a_size, const char * b,
+                     std::size_t b_size) noexcept {
+    const std::size_t n = a_size < b_size ? a_size : b_size;
+    if (int c = n ? std::memcmp(a, b, n) : 0) { return c; }
+    return a_size < b_size ? -1 : (a_size > b_size ? 1 : 0);
+  }
+};
+
+} // end namespace detail
+
+namespace api {
+
+class module_archive {
+  using F = primer::detail::module_archive_format;
+
+  const char * data_;
+  std::size_t size_;
+  std::size_t count_;
+
+  module_archive(const char * d, std::size_t n, std::size_t c) noexcept
+    : data_(d)
+    , size_(n)
+    , count_(c) {}
+
+  const char * entry(std::size_t i) const noexcept {
+    return data_ + F::header_size + i * F::entry_size;
+  }
+
+  const char * field(std::size_t i, int which, std::size_t & size) const
+    noexcept {
+    const char * e = this->entry(i) + 16 * which;
+    size = static_cast<std::size_t>(F::get(e + 8, 8));
+    return data_ + F::get(e, 8);
+  }
+
+public:
+  // An empty archive
+  module_archive() noexcept
+    : data_(nullptr)
+    , size_(0)
+    , count_(0) {}
+
+  // Checks the index of the archive at `[data, data + size)`, which must
+  // outlive the result
+  static expected<module_archive> open(const char * data,
+                                       std::size_t size) noexcept {
+    if (size < F::header_size || std::memcmp(data, F::magic(), F::magic_size)) {
+      return primer::error{"not a module archive"};
+    }
+    const std::uint64_t count = F::get(data + F::magic_size, 4);
+    if (count > (size - F::header_size) / F::entry_size) {
+      return primer::error{"malformed module archive"};
+    }
+
+    module_archive result{data, size, static_cast<std::size_t>(count)};
+    const char * prev = nullptr;
+    std::size_t prev_size = 0;
+    for (std::size_t i = 0; i < result.count_; ++i) {
+      const char * e = result.entry(i);
+      for (int which = 0; which < 2; ++which) {
+        const std::uint64_t offset = F::get(e + 16 * which, 8);
+        const std::uint64_t len = F::get(e + 16 * which + 8, 8);
+        if (offset > size || len > size - offset) {
+          return primer::error{"malformed module archive"};
+        }
+      }
+      std::size_t name_size;
+      const char * name = result.field(i, 0, name_size);
+      if (prev && F::compare(prev, prev_size, name, name_size) >= 0) {
+        return primer::error{"module archive index is not sorted"};
+      }
+      prev = name;
+      prev_size = name_size;
+    }
+    return result;
+  }
+
+  std::size_t size() const noexcept { return count_; }
+
+  // The name of the i'th module, in sorted order
+  std::string name(std::size_t i) const {
+    std::size_t n;
+    const char * p = this->field(i, 0, n);
+    return std::string(p, n);
+  }
+
+  // Finds the module named `name`, or returns false
+  bool find(const std::string & name, const char *& data,
+            std::size_t & size) const noexcept {
+    std::size_t lo = 0, hi = count_;
+    while (lo < hi) {
+      const std::size_t mid = lo + (hi - lo) / 2;
+      std::size_t n;
+      const char * p = this->field(mid, 0, n);
+      const int c = F::compare(p, n, name.data(), name.size());
+      if (c < 0) {
+        lo = mid + 1;
+      } else if (c > 0) {
+        hi = mid;
+      } else {
+        data = this->field(mid, 1, size);
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+/***
+ * Writes an archive of `modules`, which maps names to source text or to
+ * precompiled chunks.
+ */
+inline expected<void>
+make_module_archive(const std::map<std::string, std::string> & modules,
+                    std::string & out) noexcept {
+  using F = primer::detail::module_archive_format;
+
+  PRIMER_TRY_BAD_ALLOC {
+    // `std::map` orders the names as unsigned bytes, like the index
+    out.clear();
+    out.append(F::magic(), F::magic_size);
+    F::put(out, modules.size(), 4);
+
+    std::uint64_t offset = F::header_size + modules.size() * F::entry_size;
+    for (const auto & m : modules) {
+      F::put(out, offset, 8);
+      F::put(out, m.first.size(), 8);
+      offset += m.first.size();
+      F::put(out, offset, 8);
+      F::put(out, m.second.size(), 8);
+      offset += m.second.size();
+    }
+    for (const auto & m : modules) {
+      out.append(m.first);
+      out.append(m.second);
+    }
+  }
+  PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+  return {};
+}
+
+/***
+ * Compiles `source` with `L`, and writes the chunk to `out`, for an archive.
+ * With `strip`, the debug information is left out. The stack is unchanged.
+ */
+inline expected<void>
+compile_chunk(lua_State * L, const std::string & name,
+              const std::string & source, std::string & out,
+              bool strip = false) noexcept {
+  int code = luaL_loadbuffer(L, source.data(), source.size(), name.c_str());
+  if (code != LUA_OK) { return primer::pop_error(L, code); }
+
+  out.clear();
+  code = lua_dump(L, &primer::detail::trivial_string_writer, &out, strip);
+  lua_pop(L, 1);
+  if (code) { return primer::error::bad_alloc(); }
+  return {};
+}
+
+} // end namespace api
+
+} // end namespace primer
@@ -0,0 +1,169 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A codec is a streaming compression stage, which `persistable` can run the
+ * output of eris through, and the input of eris back through, in one pass.
+ *
+ * Primer doesn't depend on any compression library. A codec is a class like
+ * this, which would typically wrap e.g. a zstd or lz4 stream:
+
+   struct my_codec {
+     // Recorded in the header of the output, and checked when reading.
+     static const char * name() noexcept;
+
+     // Consume input, and pass any output which is ready to `out`.
+     bool compress(const char * data, std::size_t size, byte_sink out);
+
+     // Pass the remaining output to `out`.
+     bool finish(byte_sink out);
+
+     // Fill `buf` with up to `size` bytes of output, reading input from `in`
+     // as needed. Returns the number of bytes, 0 at the end or on failure.
+     std::size_t decompress(byte_source in, char * buf, std::size_t size);
+   };
+
+ * The functions return false (or 0) on failure, and should not throw.
+ *
+ * The output begins with a header, which is the magic string "PRC1", a byte
+ * with the length of the codec name, and the name.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace primer {
+namespace api {
+
+//[ primer_byte_sink
+// Non-owning reference to a callable `bool(const char *, std::size_t)`
+class byte_sink {
+  void * ctx_;
+  bool (*fcn_)(void *, const char *, std::size_t);
+
+  template <typename F>
+  static bool dispatch(void * ctx, const char * data, std::size_t size) {
+    return (*static_cast<F *>(ctx))(data, size);
+  }
+
+  // Doesn't hide the copy constructor
+  template <typename F>
+  using not_self =
+    typename std::enable_if<!std::is_same<typename std::decay<F>::type,
+                                          byte_sink>::value>::type;
+
+public:
+  template <typename F, typename = not_self<F>>
+  explicit byte_sink(F & f) noexcept
+    : ctx_(&f)
+    , fcn_(&dispatch<F>) {}
+
+  bool operator()(const char * data, std::size_t size) const {
+    return fcn_(ctx_, data, size);
+  }
+};
+
+// Non-owning reference to a callable `std::size_t(char *, std::size_t)`
+class byte_source {
+  void * ctx_;
+  std::size_t (*fcn_)(void *, char *, std::size_t);
+
+  template <typename F>
+  static std::size_t dispatch(void * ctx, char * buf, std::size_t size) {
+    return (*static_cast<F *>(ctx))(buf, size);
+  }
+
+  // Doesn't hide the copy constructor
+  template <typename F>
+  using not_self =
+    typename std::enable_if<!std::is_same<typename std::decay<F>::type,
+                                          byte_source>::value>::type;
+
+public:
+  template <typename F, typename = not_self<F>>
+  explicit byte_source(F & f) noexcept
+    : ctx_(&f)
+    , fcn_(&dispatch<F>) {}
+
+  std::size_t operator()(char * buf, std::size_t size) const {
+    return fcn_(ctx_, buf, size);
+  }
+};
+//]
+
+//[ primer_identity_codec
+// Passes the bytes through unchanged
+struct identity_codec {
+  static const char * name() noexcept { return "none"; }
+
+  bool compress(const char * data, std::size_t size, byte_sink out) {
+    return out(data, size);
+  }
+
+  bool finish(byte_sink) { return true; }
+
+  std::size_t decompress(byte_source in, char * buf, std::size_t size) {
+    return in(buf, size);
+  }
+};
+//]
+
+} // end namespace api
+
+namespace detail {
+
+struct codec_header {
+  static const char * magic() noexcept { return "PRC1"; }
+  static constexpr std::size_t magic_size = 4;
+
+  static bool write(api::byte_sink out, const char * name) {
+    std::size_t len = std::strlen(name);
+    if (len > 255) { return false; }
+    const char len_byte = static_cast<char>(len);
+    return out(magic(), magic_size) && out(&len_byte, 1) && out(name, len);
+  }
+
+  static bool read_exact(api::byte_source in, char * buf, std::size_t size) {
+    while (size) {
+      std::size_t n = in(buf, size);
+      if (!n) { return false; }
+      buf += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  static expected<void> read(api::byte_source in, const char * name) {
+    char buf[256];
+    if (!read_exact(in, buf, magic_size + 1)
+        || std::memcmp(buf, magic(), magic_size)) {
+      return primer::error{"missing compression header"};
+    }
+    const std::size_t len = static_cast<unsigned char>(buf[magic_size]);
+    if (!read_exact(in, buf, len)) {
+      return primer::error{"missing compression header"};
+    }
+    if (len != std::strlen(name) || std::memcmp(buf, name, len)) {
+      return primer::error{"snapshot was compressed with '",
+                           std::string(buf, len), "', expected '", name, "'"};
+    }
+    return {};
+  }
+};
+
+} // end namespace detail
+
+} // end namespace primer
@@ -0,0 +1,156 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Persisting many independent lua states at once, on several threads.
+ *
+ * `persist_many(count, f, checkpoint)` calls `f(i, buffer)` for each `i` in
+ * `[0, count)`, from a few worker threads, where `f` persists the i'th state
+ * into `buffer`, and returns `expected<void>`. Typically, `f` calls `persist`
+ * of the i'th api object. It should not throw. The buffers are then put
+ * together into one checkpoint, which `split_checkpoint` takes apart again.
+ *
+ * This is safe as long as the states share nothing, and none of them is in
+ * use by another thread in the meantime. Each call to `f` uses one state only.
+ *
+ * This header uses `std::thread`, and isn't included by `primer/api.hpp`.
+ *
+ * Checkpoint layout, with integers little-endian:
+ *
+ *   "PRM1"  u32 count  count x u64 size  count x buffer
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+template <typename F>
+expected<void>
+persist_many(std::size_t count, F && f, std::string & checkpoint,
+             unsigned threads = 0) {
+  std::vector<std::string> buffers(count);
+  std::vector<expected<void>> results(count);
+
+  std::atomic<std::size_t> next{0};
+  auto work = [&]() {
+    for (std::size_t i; (i = next++) < count;) {
+      results[i] = f(i, buffers[i]);
+    }
+  };
+
+  if (!threads) { threads = std::thread::hardware_concurrency(); }
+  if (!threads) { threads = 1; }
+  if (threads > count) { threads = static_cast<unsigned>(count); }
+
+  // The calling thread is one of the workers
+  std::vector<std::thread> pool;
+  PRIMER_TRY {
+    for (unsigned t = 1; t < threads; ++t) {
+      pool.emplace_back(work);
+    }
+  }
+  PRIMER_CATCH(std::system_error &) {}
+  work();
+  for (auto & t : pool) {
+    t.join();
+  }
+
+  for (std::size_t i = 0; i < count; ++i) {
+    if (!results[i]) {
+      return primer::error{"state ", i, ": ", results[i].err().str()};
+    }
+  }
+
+  PRIMER_TRY_BAD_ALLOC {
+    std::size_t total = 8 + 8 * count;
+    for (const auto & b : buffers) {
+      total += b.size();
+    }
+    checkpoint.clear();
+    checkpoint.reserve(total);
+    checkpoint.append("PRM1", 4);
+
+    auto put = [&checkpoint](std::uint64_t v, int bytes) {
+      for (int i = 0; i < bytes; ++i) {
+        checkpoint.push_back(static_cast<char>((v >> (8 * i)) & 0xFF));
+      }
+    };
+    put(count, 4);
+    for (const auto & b : buffers) {
+      put(b.size(), 8);
+    }
+    for (const auto & b : buffers) {
+      checkpoint.append(b);
+    }
+  }
+  PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+  return {};
+}
+
+// The buffers of a checkpoint made by `persist_many`, in order
+inline expected<std::vector<std::string>>
+split_checkpoint(const std::string & checkpoint) noexcept {
+  const char * pos = checkpoint.data();
+  const char * end = pos + checkpoint.size();
+  auto get = [&pos, end](std::uint64_t & v, int bytes) {
+    if (end - pos < bytes) { return false; }
+    v = 0;
+    for (int i = 0; i < bytes; ++i) {
+      v |= static_cast<std::uint64_t>(static_cast<unsigned char>(pos[i]))
+           << (8 * i);
+    }
+    pos += bytes;
+    return true;
+  };
+
+  std::uint64_t count;
+  if (checkpoint.size() < 4 || std::memcmp(pos, "PRM1", 4)) {
+    return primer::error{"not a checkpoint"};
+  }
+  pos += 4;
+  if (!get(count, 4) || count > static_cast<std::uint64_t>(end - pos) / 8) {
+    return primer::error{"malformed checkpoint"};
+  }
+
+  expected<std::vector<std::string>> result{std::vector<std::string>{}};
+  PRIMER_TRY_BAD_ALLOC {
+    std::vector<std::uint64_t> sizes(static_cast<std::size_t>(count));
+    for (auto & s : sizes) {
+      get(s, 8);
+    }
+    result->reserve(sizes.size());
+    for (auto s : sizes) {
+      if (s > static_cast<std::uint64_t>(end - pos)) {
+        return primer::error{"malformed checkpoint"};
+      }
+      result->emplace_back(pos, static_cast<std::size_t>(s));
+      pos += s;
+    }
+  }
+  PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+  return result;
+}
+
+} // end namespace api
+} // end namespace primer
@@ -0,0 +1,100 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Options for one call to persist or unpersist, which map onto the settings
+ * of eris.
+ *
+ * Tracking the path to each object, so that an error can say where in the
+ * state the offending value was, makes eris much slower. By default, a call
+ * runs without it, and if it fails, it is run again with it, so that the error
+ * which is reported has the path. Most calls succeed, and run at full speed.
+ *
+ * `persistable` applies the options around a call, and puts the previous
+ * settings back afterwards, see `persistable::with_persist_options`.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/eris.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/asserts.hpp>
+
+namespace primer {
+
+namespace api {
+
+//[ primer_persist_options
+struct persist_options {
+  /*<< Track the path to each object from the start >>*/
+  bool path = false;
+  /*<< If the call fails without path tracking, run it again with it >>*/
+  bool retry_with_path = true;
+  /*<< Write line numbers and the names of locals and upvalues of functions.
+       Without them, the snapshot is smaller, but errors in the functions
+       have no line numbers. >>*/
+  bool debug_info = true;
+  /*<< The deepest nesting of objects which eris accepts >>*/
+  lua_Integer maxrec = 10000;
+
+  /*<< No path tracking, and no retry >>*/
+  static persist_options fast() noexcept {
+    persist_options result;
+    result.retry_with_path = false;
+    return result;
+  }
+
+  /*<< Path tracking from the start >>*/
+  static persist_options diagnostic() noexcept {
+    persist_options result;
+    result.path = true;
+    return result;
+  }
+};
+//]
+
+} // end namespace api
+
+namespace detail {
+
+// The eris settings which `persist_options` covers
+struct eris_settings {
+  bool path;
+  bool debug_info;
+  lua_Integer maxrec;
+
+  // These may raise lua errors
+  static eris_settings get(lua_State * L) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    eris_settings result;
+    eris_get_setting(L, "path");
+    result.path = lua_toboolean(L, -1);
+    eris_get_setting(L, "debug");
+    result.debug_info = lua_toboolean(L, -1);
+    eris_get_setting(L, "maxrec");
+    result.maxrec = lua_tointeger(L, -1);
+    lua_pop(L, 3);
+    return result;
+  }
+
+  void set(lua_State * L) const {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    lua_pushboolean(L, path);
+    eris_set_setting(L, "path", -1);
+    lua_pushboolean(L, debug_info);
+    eris_set_setting(L, "debug", -1);
+    lua_pushinteger(L, maxrec);
+    eris_set_setting(L, "maxrec", -1);
+    lua_pop(L, 3);
+  }
+};
+
+} // end namespace detail
+
+} // end namespace primer
@@ -12,8 +12,35 @@
  * The persistable class exposes protected static member functions:
 
    void initialize_api(lua_State *);
+   void invalidate_permanents(lua_State *);
    void persist(lua_State *, std::string &);
+   void persist(lua_State *, std::string &, const persist_options &);
+   void persist(lua_State *, std::ostream &);
+   void persist_chunked(lua_State *, F && sink, std::size_t chunk_size);
+   void persist_delta(lua_State *, const std::string & base, std::string &);
+   void persist_replica(lua_State *, replication_sender &, F && sink);
+   void persist_coroutine(lua_State *, const coroutine &, std::string &);
+   void persist_compressed(lua_State *, Codec &, F && sink, std::size_t);
+   void persist_compressed(lua_State *, Codec &, std::string &);
+   std::future<expected<std::string>> persist_async(lua_State *);
+   void persist_sections(lua_State *, const std::vector<std::string> & globals,
+                         std::string &);
    void unpersist(lua_State *, const std::string &);
+   void unpersist(lua_State *, const std::string &, const persist_options &);
+   void unpersist(lua_State *, const char * data, std::size_t size);
+   void unpersist(lua_State *, std::istream &);
+   void unpersist_chunked(lua_State *, F && source, std::size_t chunk_size);
+   void unpersist_delta(lua_State *, const std::string & base,
+                        const std::string & delta);
+   void unpersist_replica(lua_State *, replication_standby &);
+   coroutine unpersist_coroutine(lua_State *, const std::string &);
+   coroutine migrate(lua_State *, coroutine &, T & to, lua_State * to_L);
+   void unpersist_compressed(lua_State *, Codec &, F && source, std::size_t);
+   void unpersist_compressed(lua_State *, Codec &, const std::string &);
+   void unpersist_sections(lua_State *, const std::string &, bool lazy);
+   void unpersist_sections(lua_State *, const std::string &,
+                           const std::vector<std::string> & names);
+   void with_persist_options(lua_State *, const persist_options &, F && f);
 
    initialize_api: Ask each feature to initialize itself in the given lua state.
    persist:        - Create a permanent objects table by asking each feature to
@@ -22,14 +49,20 @@
                      any auxiliary objects created by the features.
                      ("on_serialize" method)
                    - Invoke eris and serialize the result into the given string
-                     buffer.
+                     buffer, stream, or chunked sink.
    unpersist:      - Create a (reversed) permanent objects table by asking each
                      feature to register its permanent objects. ("on_unpersist")
-                   - Recreate the target table from the persisted string, using
-                     eris.
+                   - Recreate the target table from the persisted string, memory
+                     region, stream, or chunked source, using eris.
                    - Install the reconstructed globals table, and ask each
                      feature to restore itself ("on_deserialize" method).
 
+   The permanent objects tables are built on first use, and then kept in the
+   registry, until initialize_api is called again.
+
+   If a `feature_timings` is attached to the state, each feature is timed in
+   each of these phases, see feature_timings.hpp.
+
  *
  * The class persistable has no built-in member variables, it only provides
  * typedefs and static methods. The lua_State belongs to you, it is your job
@@ -40,16 +73,39 @@
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <primer/coroutine.hpp>
 #include <primer/eris.hpp>
+#include <primer/lua_ref.hpp>
 
 #include <primer/api/feature.hpp>
+#include <primer/api/feature_timings.hpp>
 #include <primer/api/init_caches.hpp>
+#include <primer/api/persist_codec.hpp>
+#include <primer/api/persist_options.hpp>
+#include <primer/api/replication.hpp>
+#include <primer/api/snapshot_delta.hpp>
+#include <primer/api/snapshot_sections.hpp>
 #include <primer/detail/rank.hpp>
+#include <primer/detail/type_traits.hpp>
 #include <primer/detail/typelist.hpp>
 #include <primer/detail/typelist_iterator.hpp>
 #include <primer/support/asserts.hpp>
 #include <primer/support/lua_reader_writer.hpp>
 
+#ifdef PRIMER_ASYNC_PERSIST
+#include <primer/support/fork_snapshot.hpp>
+#include <future>
+#endif
+
+#include <algorithm>
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
 namespace primer {
 
 namespace api {
@@ -64,35 +120,371 @@ class persistable {
 protected:
   typedef T primer_persistable_type;
 
-  // detail, typelist assembly
-  static inline detail::TypeList<> GetApiFeatures(primer::detail::Rank<0>);
+  // detail, typelist assembly, in chunks, see <primer/detail/rank.hpp>
+  static inline detail::TypeList<>
+    GetApiFeatures(primer::detail::RankChunk<0>, primer::detail::Rank<0>);
+  static inline std::integral_constant<int, 0>
+    GetApiFeaturesChunk(primer::detail::Rank<0>);
 
-  static constexpr int maxFeatures = 100;
+  static constexpr int maxFeatures = primer::detail::rank_max_size;
 
 #define GET_API_FEATURES                                                       \
   decltype(primer_persistable_type::GetApiFeatures(                            \
-    primer::detail::Rank<maxFeatures>{}))
+    primer::detail::RankChunk<decltype(                                        \
+      primer_persistable_type::GetApiFeaturesChunk(                            \
+        primer::detail::Rank<primer::detail::rank_max_chunks>{}))::value>{},   \
+    primer::detail::Rank<primer::detail::rank_chunk_size>{}))
 
 private:
   // Apply a visitor to the feature_list
   template <typename V>
   void visit_features(V && v) {
     using helper_t = detail::typelist_iterator<GET_API_FEATURES>;
+    using visitor_t = typename std::decay<V>::type;
+    if (feature_timings * timings = feature_timings::get(v.L)) {
+      helper_t::apply_visitor(
+        timed_visitor<visitor_t>{v, timings, visitor_t::phase()},
+        *static_cast<T *>(this));
+      return;
+    }
     helper_t::apply_visitor(std::forward<V>(v), *static_cast<T *>(this));
   }
 
-  void make_persist_table(lua_State * L) {
+  // The permanent objects tables don't change between calls, so each is built
+  // once and kept in the registry, until `initialize_api` is called again or
+  // `invalidate_permanents` is called.
+  static void * persist_table_key() noexcept {
+    static char key;
+    return &key;
+  }
+
+  static void * unpersist_table_key() noexcept {
+    static char key;
+    return &key;
+  }
+
+  template <typename V>
+  void make_permanents_table(lua_State * L, void * key, bool reverse) {
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, key) == LUA_TTABLE) { return; }
+    lua_pop(L, 1);
+
     lua_newtable(L);
+    {
+      PRIMER_ASSERT_STACK_NEUTRAL(L);
+      this->visit_features(V{L});
+      register_section_stubs(L, reverse);
+    }
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, key);
+  }
 
-    PRIMER_ASSERT_STACK_NEUTRAL(L);
-    this->visit_features(on_persist_table_visitor{L});
+  void make_persist_table(lua_State * L) {
+    this->make_permanents_table<on_persist_table_visitor>(
+      L, persist_table_key(), false);
   }
 
   void make_unpersist_table(lua_State * L) {
+    this->make_permanents_table<on_unpersist_table_visitor>(
+      L, unpersist_table_key(), true);
+  }
+
+  /***
+   * Sectioned snapshots
+   */
+
+  // The stubs which a lazy `unpersist_sections` installs in the metatable of
+  // _G are permanent objects, so a state can be persisted again before all of
+  // its sections are loaded.
+  static void register_section_stubs(lua_State * L, bool reverse) {
+    const char * names[] = {"primer_section_index", "primer_section_newindex"};
+    lua_CFunction funcs[] = {&section_index, &section_newindex};
+    for (int i = 0; i < 2; ++i) {
+      if (reverse) {
+        lua_pushcfunction(L, funcs[i]);
+        lua_setfield(L, -2, names[i]);
+      } else {
+        lua_pushcfunction(L, funcs[i]);
+        lua_pushstring(L, names[i]);
+        lua_rawset(L, -3);
+      }
+    }
+  }
+
+  // Pushes the value of the section whose blob is at index `blob`
+  static void load_section(lua_State * L, int blob) {
+    using format = primer::detail::snapshot_sections_format;
+    blob = lua_absindex(L, blob);
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, unpersist_table_key())
+        != LUA_TTABLE) {
+      luaL_error(L, "can't load a section, the api was reinitialized");
+    }
+    // References to _G from within a section are to the current _G
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    lua_setfield(L, -2, format::globals_perm_name());
+
+    eris_unpersist(L, -1, blob); // [perms] [value]
+    lua_remove(L, -2);
+  }
+
+  // __index of _G, while some sections are not loaded yet.
+  // Upvalues: the table of pending blobs, and the previous __index.
+  static int section_index(lua_State * L) {
+    if (lua_type(L, 2) == LUA_TSTRING) {
+      lua_pushvalue(L, 2);
+      if (lua_rawget(L, lua_upvalueindex(1)) == LUA_TSTRING) { // [t] [k] [blob]
+        lua_pushvalue(L, 2);
+        lua_pushnil(L);
+        lua_rawset(L, lua_upvalueindex(1));
+
+        load_section(L, 3); // [t] [k] [blob] [value]
+        lua_pushvalue(L, 2);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, 1);
+        return 1;
+      }
+      lua_pop(L, 1);
+    }
+
+    switch (lua_type(L, lua_upvalueindex(2))) {
+      case LUA_TNIL: return 0;
+      case LUA_TFUNCTION: {
+        lua_pushvalue(L, lua_upvalueindex(2));
+        lua_insert(L, 1);
+        lua_call(L, 2, 1);
+        return 1;
+      }
+      default: {
+        lua_gettable(L, lua_upvalueindex(2));
+        return 1;
+      }
+    }
+  }
+
+  // __newindex of _G, while some sections are not loaded yet. Assigning to
+  // a pending section discards it.
+  // Upvalues: the table of pending blobs, and the previous __newindex.
+  static int section_newindex(lua_State * L) {
+    if (lua_type(L, 2) == LUA_TSTRING) {
+      lua_pushvalue(L, 2);
+      lua_pushnil(L);
+      lua_rawset(L, lua_upvalueindex(1));
+    }
+
+    switch (lua_type(L, lua_upvalueindex(2))) {
+      case LUA_TNIL: {
+        lua_rawset(L, 1);
+        return 0;
+      }
+      case LUA_TFUNCTION: {
+        lua_pushvalue(L, lua_upvalueindex(2));
+        lua_insert(L, 1);
+        lua_call(L, 3, 0);
+        return 0;
+      }
+      default: {
+        lua_settable(L, lua_upvalueindex(2));
+        return 0;
+      }
+    }
+  }
+
+  // Installs the stubs, for the table of pending blobs at the top of the stack
+  static void install_section_stubs(lua_State * L) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS); // [pending] [_G]
+    if (!lua_getmetatable(L, -1)) {
+      lua_newtable(L);
+      lua_pushvalue(L, -1);
+      lua_setmetatable(L, -3);
+    } // [pending] [_G] [mt]
+
+    lua_pushvalue(L, -3);
+    lua_getfield(L, -2, "__index");
+    lua_pushcclosure(L, &section_index, 2);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushvalue(L, -3);
+    lua_getfield(L, -2, "__newindex");
+    lua_pushcclosure(L, &section_newindex, 2);
+    lua_setfield(L, -2, "__newindex");
+
+    lua_pop(L, 3);
+  }
+
+  // With [perms] [sections] [_G] on the stack. Takes the sections out of _G,
+  // and dumps the main section with them missing, and then each section alone.
+  void dump_sections_impl(lua_State * L, std::string & buffer) {
+    using format = primer::detail::snapshot_sections_format;
+
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+      lua_pop(L, 1);
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, 3);
+    }
+
+    this->make_target_table(L); // [4] target
+    eris_persist(L, 1, 4);      // [5] main blob
+
+    lua_pushvalue(L, 3);
+    lua_pushstring(L, format::globals_perm_name());
+    lua_rawset(L, 1);
+
+    lua_newtable(L); // [6] name -> blob
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+      eris_persist(L, 1, -1); // [k] [v] [blob]
+      lua_remove(L, -2);
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);
+      lua_rawset(L, 6);
+    }
+
+    bool failed = false;
+    PRIMER_TRY_BAD_ALLOC {
+      std::vector<primer::detail::snapshot_section> sections;
+      std::size_t size;
+      const char * data = lua_tolstring(L, 5, &size);
+      sections.push_back(primer::detail::snapshot_section{"", data, size});
+
+      lua_pushnil(L);
+      while (lua_next(L, 6)) {
+        std::size_t len;
+        const char * name = lua_tolstring(L, -2, &len);
+        data = lua_tolstring(L, -1, &size);
+        sections.push_back(
+          primer::detail::snapshot_section{std::string(name, len), data, size});
+        lua_pop(L, 1);
+      }
+      format::write(buffer, sections);
+    }
+    PRIMER_CATCH_BAD_ALLOC { failed = true; }
+    if (failed) { luaL_error(L, "not enough memory"); }
+  }
+
+  void persist_sections_impl(lua_State * L,
+                             const std::vector<std::string> & globals,
+                             std::string & buffer) {
+    this->make_persist_table(L); // [1] perms
+    lua_newtable(L);             // [2] sections, name -> value
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS); // [3] _G
+
+    for (const std::string & name : globals) {
+      lua_pushlstring(L, name.data(), name.size());
+      lua_pushvalue(L, -1);
+      if (lua_rawget(L, 3) == LUA_TNIL) {
+        lua_pop(L, 2);
+      } else {
+        lua_rawset(L, 2);
+      }
+    }
+
+    // Put the sections back in _G, and clean up the perms, even on error
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    bool ok;
+    {
+      expected<void> dump = cpp_pcall<3>(
+        L, [&L, &buffer, this]() { this->dump_sections_impl(L, buffer); });
+      ok = static_cast<bool>(dump);
+      if (!ok) { lua_pushstring(L, dump.err().what()); } // [4] error
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, 2)) {
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);
+      lua_rawset(L, 3);
+    }
+    lua_pushvalue(L, 3);
+    lua_pushnil(L);
+    lua_rawset(L, 1);
+
+    if (!ok) { lua_error(L); }
+  }
+
+  // names, if not null, selects the sections to load
+  void unpersist_sections_impl(
+    lua_State * L, const std::vector<primer::detail::snapshot_section> & secs,
+    bool lazy, const std::vector<std::string> * names) {
+    detail::reader_helper rh{secs[0].data, secs[0].size};
+    this->unpersist_impl(L, detail::trivial_string_reader, &rh);
+    if (secs.size() == 1) { return; }
+
+    if (lazy) {
+      lua_createtable(L, 0, static_cast<int>(secs.size() - 1));
+      for (std::size_t i = 1; i < secs.size(); ++i) {
+        lua_pushlstring(L, secs[i].name.data(), secs[i].name.size());
+        lua_pushlstring(L, secs[i].data, secs[i].size);
+        lua_rawset(L, -3);
+      }
+      install_section_stubs(L);
+      return;
+    }
+
+    this->make_unpersist_table(L); // Ensure that it is cached
+    lua_pop(L, 1);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS); // [1] _G
+    for (std::size_t i = 1; i < secs.size(); ++i) {
+      if (names && std::find(names->begin(), names->end(), secs[i].name)
+                     == names->end()) {
+        continue;
+      }
+      lua_pushlstring(L, secs[i].name.data(), secs[i].name.size()); // [2]
+      lua_pushlstring(L, secs[i].data, secs[i].size);               // [3]
+      load_section(L, 3);                                           // [4]
+      lua_remove(L, 3);
+      lua_rawset(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+
+  /***
+   * Coroutine migration
+   */
+
+  // Pushes a copy of the permanent objects table at `perms`, in which the
+  // globals of the state are also a permanent object
+  static void push_perms_with_globals(lua_State * L, int perms, bool reverse) {
+    using format = primer::detail::snapshot_sections_format;
+    perms = lua_absindex(L, perms);
     lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, perms)) {
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);
+      lua_rawset(L, -4);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    lua_pushstring(L, format::globals_perm_name());
+    if (reverse) { lua_insert(L, -2); }
+    lua_rawset(L, -3);
+  }
 
-    PRIMER_ASSERT_STACK_NEUTRAL(L);
-    this->visit_features(on_unpersist_table_visitor{L});
+  // With the thread at index 1
+  void persist_coroutine_impl(lua_State * L, std::string & buffer) {
+    this->make_persist_table(L);          // [2] perms
+    push_perms_with_globals(L, 2, false); // [3]
+    eris_persist(L, 3, 1);                // [4] blob
+
+    bool failed = false;
+    std::size_t size;
+    const char * data = lua_tolstring(L, 4, &size);
+    PRIMER_TRY_BAD_ALLOC { buffer.assign(data, size); }
+    PRIMER_CATCH_BAD_ALLOC { failed = true; }
+    if (failed) { luaL_error(L, "not enough memory"); }
+  }
+
+  // Leaves the thread on the stack
+  void unpersist_coroutine_impl(lua_State * L, const std::string & buffer) {
+    this->make_unpersist_table(L);                    // [1] perms
+    push_perms_with_globals(L, 1, true);              // [2]
+    lua_pushlstring(L, buffer.data(), buffer.size()); // [3]
+    eris_unpersist(L, 2, 3);                          // [4] value
+    if (!lua_isthread(L, 4)) { luaL_error(L, "not a coroutine"); }
+    lua_replace(L, 1);
+    lua_settop(L, 1);
   }
 
   static constexpr const char * global_table_field_name = "_G";
@@ -127,28 +519,47 @@ private:
   // These impl functions may raise lua errors, but they should not throw
   // exceptions.
   void initialize_api_impl(lua_State * L) {
+    this->invalidate_permanents(L);
     primer::api::init_caches(L);
     this->visit_features(on_init_visitor{L});
   }
 
-  void persist_impl(lua_State * L, std::string & buffer) {
+  void persist_impl(lua_State * L, lua_Writer writer, void * ud) {
+    // A good moment to unref what was released on other threads
+    primer::release_deferred_refs(L);
     this->make_persist_table(L);
     this->make_target_table(L);
 
-    buffer.resize(0);
-    eris_dump(L, detail::trivial_string_writer, &buffer); // [_persist] [target]
+    eris_dump(L, writer, ud); // [_persist] [target]
   }
 
-  void unpersist_impl(lua_State * L, const std::string & buffer) {
+  void unpersist_impl(lua_State * L, lua_Reader reader, void * ud) {
     this->make_unpersist_table(L); // [_unpersist]
 
-    detail::reader_helper rh{buffer};
-    eris_undump(L, detail::trivial_string_reader, &rh); // [_unpersist] [target]
+    eris_undump(L, reader, ud); // [_unpersist] [target]
 
     lua_remove(L, 1); // [target]
     this->consume_target_table(L);
   }
 
+  expected<void> unpersist_sections_with(
+    lua_State * L, const std::string & buffer, bool lazy,
+    const std::vector<std::string> * names) {
+    using format = primer::detail::snapshot_sections_format;
+    auto secs = format::read(buffer);
+    if (!secs) { return std::move(secs.err()); }
+
+    lua_settop(L, 0);
+
+    expected<void> result = cpp_pcall<0>(L, [&L, &secs, lazy, names, this]() {
+      this->unpersist_sections_impl(L, *secs, lazy, names);
+    });
+
+    lua_settop(L, 0);
+
+    return result;
+  }
+
 protected:
   /***
    * Forward-facing interface for derived classes. Initialization / persistance.
@@ -167,22 +578,383 @@ protected:
     return cpp_pcall<0>(L, [&L, this]() { this->initialize_api_impl(L); });
   }
 
+  // Drops the cached permanent objects tables. A feature whose permanent
+  // objects change after `initialize_api` should call this.
+  static void invalidate_permanents(lua_State * L) noexcept {
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, persist_table_key());
+    lua_pushnil(L);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, unpersist_table_key());
+  }
+
   expected<void> persist(lua_State * L, std::string & buffer) {
     lua_settop(L, 0);
 
-    expected<void> result =
-      cpp_pcall<0>(L, [&L, &buffer, this]() { this->persist_impl(L, buffer); });
+    buffer.resize(0);
+    expected<void> result = cpp_pcall<0>(L, [&L, &buffer, this]() {
+      this->persist_impl(L, detail::trivial_string_writer, &buffer);
+    });
+
+    lua_settop(L, 0);
+
+    return result;
+  }
+
+  // Writes to the stream as eris produces output. Fails if the stream does.
+  expected<void> persist(lua_State * L, std::ostream & os) {
+    lua_settop(L, 0);
+
+    expected<void> result = cpp_pcall<0>(L, [&L, &os, this]() {
+      this->persist_impl(L, detail::ostream_writer, &os);
+    });
 
     lua_settop(L, 0);
 
     return result;
   }
 
+  // Passes the output to `sink(const char *, std::size_t)` in chunks of
+  // `chunk_size` bytes. The sink returns false to abort, and must not throw.
+  template <typename F>
+  expected<void> persist_chunked(lua_State * L, F && sink,
+                                 std::size_t chunk_size = 1 << 16) {
+    // The writer lives outside the protected call, so that a lua error
+    // doesn't skip its destructor.
+    using sink_t = typename std::remove_reference<F>::type;
+    detail::chunked_writer<sink_t> w{sink, chunk_size};
+    PRIMER_TRY_BAD_ALLOC { w.init(); }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+
+    lua_settop(L, 0);
+
+    expected<void> result = cpp_pcall<0>(L, [&L, &w, this]() {
+      this->persist_impl(L, detail::chunked_writer_fcn<sink_t>, &w);
+    });
+
+    lua_settop(L, 0);
+
+    if (result && !w.flush()) {
+      result = primer::error{"could not write data"};
+    }
+    return result;
+  }
+
+  // Runs the output through a streaming compression stage, see
+  // `persist_codec.hpp`, and passes it to `sink(const char *, std::size_t)`.
+  template <typename Codec, typename F>
+  expected<void> persist_compressed(lua_State * L, Codec & codec, F && sink,
+                                    std::size_t chunk_size = 1 << 16) {
+    using sink_t = typename std::remove_reference<F>::type;
+    byte_sink out{static_cast<sink_t &>(sink)};
+    if (!primer::detail::codec_header::write(out, Codec::name())) {
+      return primer::error{"could not write data"};
+    }
+
+    auto stage = [&codec, out](const char * data, std::size_t size) {
+      return codec.compress(data, size, out);
+    };
+    expected<void> result = this->persist_chunked(L, stage, chunk_size);
+    if (result && !codec.finish(out)) {
+      result = primer::error{"could not write data"};
+    }
+    return result;
+  }
+
+  template <typename Codec>
+  expected<void> persist_compressed(lua_State * L, Codec & codec,
+                                    std::string & buffer) {
+    buffer.resize(0);
+    auto append = [&buffer](const char * data, std::size_t size) {
+      PRIMER_TRY_BAD_ALLOC {
+        buffer.append(data, size);
+        return true;
+      }
+      PRIMER_CATCH_BAD_ALLOC { return false; }
+    };
+    return this->persist_compressed(L, codec, append);
+  }
+
+#ifdef PRIMER_ASYNC_PERSIST
+  // Persists in a forked child process, which has a copy-on-write image of
+  // the state, so the caller can go on running lua at once. The future holds
+  // the same string as `persist` would have produced at the time of the call.
+  // See `support/fork_snapshot.hpp` for caveats.
+  std::future<expected<std::string>> persist_async(lua_State * L) {
+    return primer::detail::fork_snapshot([this, L](int fd) -> bool {
+      return static_cast<bool>(
+        this->persist_chunked(L, primer::detail::fd_sink{fd}));
+    });
+  }
+#endif
+
+  // Persists the named top-level globals each as a separate section, which
+  // can be restored independently, and everything else as the main section.
+  // References to _G from within a section are saved as such. Other objects
+  // which a section shares with the rest of the state are duplicated.
+  expected<void> persist_sections(lua_State * L,
+                                  const std::vector<std::string> & globals,
+                                  std::string & buffer) {
+    lua_settop(L, 0);
+
+    expected<void> result = cpp_pcall<0>(L, [&L, &globals, &buffer, this]() {
+      this->persist_sections_impl(L, globals, buffer);
+    });
+
+    lua_settop(L, 0);
+
+    return result;
+  }
+
+  // Persists, and writes to `delta` only the difference from `base`, which
+  // is an earlier full snapshot. See `snapshot_delta.hpp`.
+  expected<void> persist_delta(lua_State * L, const std::string & base,
+                               std::string & delta) {
+    std::string full;
+    if (auto ok = this->persist(L, full)) {
+      return primer::api::make_snapshot_delta(base, full, delta);
+    } else {
+      return ok;
+    }
+  }
+
+  // Persists, and sends the snapshot to a standby as the next frame of
+  // `sender`. See `replication.hpp`.
+  template <typename F>
+  expected<void> persist_replica(lua_State * L,
+                                 primer::api::replication_sender & sender,
+                                 F && sink) {
+    std::string full;
+    if (auto ok = this->persist(L, full)) {
+      return sender.publish(full, std::forward<F>(sink));
+    } else {
+      return ok;
+    }
+  }
+
+  // Persists the coroutine `co` of `L` alone, to resume it in another state
+  // of the same api. It must be suspended, or not started yet. References to
+  // the globals of `L`, and to permanent objects of the features, are saved
+  // as such, and restored as those of the other state. Other objects which
+  // the coroutine shares with the rest of `L` are copied.
+  expected<void> persist_coroutine(lua_State * L, const coroutine & co,
+                                   std::string & buffer) {
+    if (!co) { return primer::error::expired_coroutine(); }
+    lua_State * thread = co.thread_stack_;
+    lua_Debug ar;
+    if (lua_status(thread) != LUA_YIELD
+        && (lua_getstack(thread, 0, &ar) || !lua_gettop(thread))) {
+      return primer::error{"can't persist a running coroutine"};
+    }
+
+    lua_settop(L, 0);
+
+    expected<void> result = cpp_pcall<0>(L, [&L, &co, &buffer, this]() {
+      co.ref_.push(L);
+      this->persist_coroutine_impl(L, buffer);
+    });
+
+    lua_settop(L, 0);
+
+    return result;
+  }
+
+  // Restores a coroutine made by `persist_coroutine`, as a coroutine of `L`
+  expected<coroutine> unpersist_coroutine(lua_State * L,
+                                          const std::string & buffer) {
+    lua_settop(L, 0);
+
+    expected<void> ok = cpp_pcall<0>(L, [&L, &buffer, this]() {
+      this->unpersist_coroutine_impl(L, buffer);
+    });
+    if (!ok) {
+      lua_settop(L, 0);
+      return std::move(ok.err());
+    }
+
+    coroutine co;
+    co.thread_stack_ = lua_tothread(L, -1);
+    co.ref_ = lua_ref{L};
+    lua_settop(L, 0);
+    return co;
+  }
+
+  // Moves `co` from `L` to `to_L`, the state of `to`, and returns it there.
+  // On success `co` is reset, and the thread left in `L` is collected. For
+  // states in different threads, use `persist_coroutine` and
+  // `unpersist_coroutine`, and pass the string between them.
+  expected<coroutine> migrate(lua_State * L, coroutine & co, T & to,
+                              lua_State * to_L) {
+    std::string buffer;
+    if (auto ok = this->persist_coroutine(L, co, buffer)) {
+      expected<coroutine> result = to.unpersist_coroutine(to_L, buffer);
+      if (result) { co.reset(); }
+      return result;
+    } else {
+      return std::move(ok.err());
+    }
+  }
+
+  // Runs `f()`, which persists or unpersists and returns `expected<void>`,
+  // with the eris settings of `opts`, and puts the previous settings back
+  // afterwards. See `persist_options.hpp`. With `retry_with_path`, `f` may be
+  // called twice, so it should not have sent any output anywhere when it fails.
+  template <typename F>
+  expected<void> with_persist_options(lua_State * L,
+                                      const persist_options & opts, F && f) {
+    lua_settop(L, 0);
+
+    primer::detail::eris_settings saved{false, false, 0};
+    primer::detail::eris_settings wanted{opts.path, opts.debug_info, opts.maxrec};
+    expected<void> ok = cpp_pcall<0>(L, [&L, &saved, &wanted]() {
+      saved = primer::detail::eris_settings::get(L);
+      wanted.set(L);
+    });
+    if (!ok) { return ok; }
+
+    expected<void> result = f();
+    if (!result && opts.retry_with_path && !opts.path) {
+      wanted.path = true;
+      ok = cpp_pcall<0>(L, [&L, &wanted]() { wanted.set(L); });
+      if (ok) { result = f(); }
+    }
+
+    lua_settop(L, 0);
+    expected<void> restored =
+      cpp_pcall<0>(L, [&L, &saved]() { saved.set(L); });
+    lua_settop(L, 0);
+
+    if (result && !restored) { return restored; }
+    return result;
+  }
+
+  expected<void> persist(lua_State * L, std::string & buffer,
+                         const persist_options & opts) {
+    return this->with_persist_options(
+      L, opts, [&L, &buffer, this]() { return this->persist(L, buffer); });
+  }
+
   expected<void> unpersist(lua_State * L, const std::string & buffer) {
+    return this->unpersist(L, buffer.c_str(), buffer.size());
+  }
+
+  expected<void> unpersist(lua_State * L, const std::string & buffer,
+                           const persist_options & opts) {
+    return this->with_persist_options(
+      L, opts, [&L, &buffer, this]() { return this->unpersist(L, buffer); });
+  }
+
+  // Restores from a region of memory, e.g. a memory-mapped file, which is
+  // read in place.
+  expected<void> unpersist(lua_State * L, const char * data, std::size_t size) {
+    lua_settop(L, 0);
+
+    detail::reader_helper rh{data, size};
+    expected<void> result = cpp_pcall<0>(L, [&L, &rh, this]() {
+      this->unpersist_impl(L, detail::trivial_string_reader, &rh);
+    });
+
+    lua_settop(L, 0);
+
+    return result;
+  }
+
+  // Restores a snapshot made by `persist_sections`. If `lazy`, each section
+  // is loaded on the first access to its global, otherwise all of them are
+  // loaded now.
+  expected<void> unpersist_sections(lua_State * L, const std::string & buffer,
+                                    bool lazy = true) {
+    return this->unpersist_sections_with(L, buffer, lazy, nullptr);
+  }
+
+  // Restores the main section, and only the named sections.
+  expected<void> unpersist_sections(lua_State * L, const std::string & buffer,
+                                    const std::vector<std::string> & names) {
+    return this->unpersist_sections_with(L, buffer, false, &names);
+  }
+
+  // Restores the snapshot which `delta` describes in terms of `base`.
+  expected<void> unpersist_delta(lua_State * L, const std::string & base,
+                                 const std::string & delta) {
+    std::string full;
+    if (auto ok = primer::api::apply_snapshot_delta(base, delta, full)) {
+      return this->unpersist(L, full);
+    } else {
+      return ok;
+    }
+  }
+
+  // Restores the latest snapshot which `standby` has received, if it changed
+  // since the last call.
+  expected<void> unpersist_replica(lua_State * L,
+                                   primer::api::replication_standby & standby) {
+    if (!standby.has_update()) { return {}; }
+    expected<void> result = this->unpersist(L, standby.image());
+    if (result) { standby.mark_applied(); }
+    return result;
+  }
+
+  // Reads input from `source(char * buf, std::size_t size)` and runs it back
+  // through the codec which `persist_compressed` used.
+  template <typename Codec, typename F,
+            typename = primer::enable_if_t<
+              !std::is_same<primer::decay_t<F>, std::string>::value>>
+  expected<void> unpersist_compressed(lua_State * L, Codec & codec,
+                                      F && source,
+                                      std::size_t chunk_size = 1 << 16) {
+    using source_t = typename std::remove_reference<F>::type;
+    byte_source in{static_cast<source_t &>(source)};
+    if (auto ok = primer::detail::codec_header::read(in, Codec::name())) {
+      auto stage = [&codec, in](char * buf, std::size_t size) {
+        return codec.decompress(in, buf, size);
+      };
+      return this->unpersist_chunked(L, stage, chunk_size);
+    } else {
+      return ok;
+    }
+  }
+
+  template <typename Codec>
+  expected<void> unpersist_compressed(lua_State * L, Codec & codec,
+                                      const std::string & buffer) {
+    std::size_t pos = 0;
+    auto read = [&buffer, &pos](char * buf, std::size_t size) {
+      size = buffer.copy(buf, size, pos);
+      pos += size;
+      return size;
+    };
+    return this->unpersist_compressed(L, codec, read);
+  }
+
+  // Reads from the stream in chunks, as eris consumes the input.
+  expected<void> unpersist(lua_State * L, std::istream & is,
+                           std::size_t chunk_size = 1 << 16) {
+    auto source = [&is](char * buf, std::size_t size) -> std::size_t {
+      is.read(buf, static_cast<std::streamsize>(size));
+      return static_cast<std::size_t>(is.gcount());
+    };
+    expected<void> result = this->unpersist_chunked(L, source, chunk_size);
+    if (is.bad() && result) { result = primer::error{"could not read data"}; }
+    return result;
+  }
+
+  // Reads through a buffer of `chunk_size` bytes, refilled by
+  // `source(char * buf, std::size_t size)`, which returns the number of bytes
+  // read, or 0 at the end. The source must not throw.
+  template <typename F>
+  expected<void> unpersist_chunked(lua_State * L, F && source,
+                                   std::size_t chunk_size = 1 << 16) {
+    // The reader lives outside the protected call, so that a lua error
+    // doesn't skip its destructor.
+    using source_t = typename std::remove_reference<F>::type;
+    detail::chunked_reader<source_t> r{source, chunk_size};
+    PRIMER_TRY_BAD_ALLOC { r.init(); }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+
     lua_settop(L, 0);
 
-    expected<void> result = cpp_pcall<0>(
-      L, [&L, &buffer, this]() { this->unpersist_impl(L, buffer); });
+    expected<void> result = cpp_pcall<0>(L, [&L, &r, this]() {
+      this->unpersist_impl(L, detail::chunked_reader_fcn<source_t>, &r);
+    });
 
     lua_settop(L, 0);
 
@@ -209,11 +981,18 @@ protected:
                 "Missing on_unpersist_table method!");                         \
   static_assert(primer::api::is_feature<TYPE>::value,                          \
                 "Type does not meet criteria for an API_FEATURE!");            \
+  static constexpr int feature_ordinal_##NAME = GET_API_FEATURES::size;        \
+  static_assert(feature_ordinal_##NAME < maxFeatures, "Too many features");    \
   static inline primer::detail::                                               \
     Append_t<GET_API_FEATURES,                                                 \
              primer::api::                                                     \
                ptr_to_member<primer_persistable_type, TYPE,                    \
                              &primer_persistable_type::NAME,                   \
                              &primer_persistable_type::feature_name_##NAME>>   \
-      GetApiFeatures(primer::detail::Rank<GET_API_FEATURES::size + 1>);        \
+      GetApiFeatures(                                                          \
+        primer::detail::rank_chunk_of<feature_ordinal_##NAME + 1>,             \
+        primer::detail::rank_position_of<feature_ordinal_##NAME + 1>);         \
+  static inline primer::detail::rank_chunk_index<feature_ordinal_##NAME + 1>   \
+    GetApiFeaturesChunk(                                                       \
+      primer::detail::rank_chunk_marker<feature_ordinal_##NAME + 1>);          \
   static_assert(true, "")
@@ -10,16 +10,27 @@
  * serialization, and restored from the target table upon deserialization.
  * This is an easy way to create a persistent value outside of the lua state,
  * provided that the type can be pushed and read.
+ *
+ * By default the value is pushed, so eris serializes whatever lua values
+ * represent it. With `binary_encoding`, the value is instead encoded using
+ * `traits::binary`, and eris serializes one string. This is much faster for a
+ * large value, like a big map of vectors, which would otherwise be converted to
+ * and from many lua tables. The headers which specialize `traits::binary` for
+ * the types involved, e.g. `primer/std/map.hpp`, must be included.
  */
 
 #include <primer/base.hpp>
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <primer/cpp_pcall.hpp>
 #include <primer/lua.hpp>
 #include <primer/push.hpp>
 #include <primer/read.hpp>
+#include <primer/traits/binary.hpp>
 
+#include <new>
+#include <string>
 #include <type_traits>
 #include <utility>
 
@@ -27,7 +38,73 @@ PRIMER_ASSERT_FILESCOPE;
 namespace primer {
 namespace api {
 
-template <typename T>
+// The default, which pushes and reads the value
+struct lua_value_encoding {
+  template <typename T>
+  static void on_serialize(lua_State * L, const T & value) {
+    primer::push(L, value);
+  }
+
+  template <typename T>
+  static void on_deserialize(lua_State * L, T & value) {
+    if (auto result = primer::read<T>(L, -1)) {
+      value = std::move(*result);
+    } else {
+      // XXX TODO
+    }
+    lua_pop(L, 1);
+  }
+};
+
+// Encodes the value as one string, using `traits::binary`
+struct binary_encoding {
+  template <typename T>
+  static void on_serialize(lua_State * L, const T & value) {
+    // The string is pushed in a protected call, so that a memory error
+    // doesn't jump past the destructor of the buffer
+    luaL_checkstack(L, 4, "persistent value");
+    bool ok = false;
+    {
+      std::string buffer;
+      PRIMER_TRY_BAD_ALLOC {
+        traits::binary<T>::write(buffer, value);
+        ok = true;
+      }
+      PRIMER_CATCH_BAD_ALLOC {}
+      if (ok) {
+        ok = static_cast<bool>(primer::mem_pcall(L, [L, &buffer]() {
+          lua_pushlstring(L, buffer.data(), buffer.size());
+        }));
+      }
+    }
+    if (!ok) { luaL_error(L, "not enough memory"); }
+  }
+
+  template <typename T>
+  static void on_deserialize(lua_State * L, T & value) {
+    const char * error = nullptr;
+    if (lua_type(L, -1) != LUA_TSTRING) {
+      error = "persistent value is not a string";
+    } else {
+      std::size_t size;
+      const char * pos = lua_tolstring(L, -1, &size);
+      const char * end = pos + size;
+      PRIMER_TRY_BAD_ALLOC {
+        T result{};
+        if (traits::binary<T>::read(pos, end, result) && pos == end) {
+          value = std::move(result);
+        } else {
+          error = "persistent value is malformed";
+        }
+      }
+      PRIMER_CATCH_BAD_ALLOC { error = "not enough memory"; }
+    }
+    lua_pop(L, 1);
+    if (error) { luaL_error(L, "%s", error); }
+  }
+};
+
+template <typename T, typename Encoding = lua_value_encoding>
 struct persistent_value {
   T value_;
 
@@ -42,18 +119,11 @@ struct persistent_value {
   void on_persist_table(lua_State *) {}
   void on_unpersist_table(lua_State *) {}
 
-  void on_serialize(lua_State * L) { primer::push(L, value_); }
+  void on_serialize(lua_State * L) { Encoding::on_serialize(L, value_); }
 
   PRIMER_STATIC_ASSERT(std::is_nothrow_move_constructible<T>::value,
                        "persistent value must be nothrow move constructible");
-  void on_deserialize(lua_State * L) {
-    if (auto result = primer::read<T>(L, -1)) {
-      value_ = std::move(*result);
-    } else {
-      // XXX TODO
-    }
-    lua_pop(L, 1);
-  }
+  void on_deserialize(lua_State * L) { Encoding::on_deserialize(L, value_); }
 };
 
 } // end namespace api
@@ -0,0 +1,404 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_pool_map_overview
+/*`
+`primer::api::pool_map<WorkerApi>` is an API feature which lets the tasks of a
+`primer::scheduler` spread pure script work over the VMs of a
+`vm_worker_pool<WorkerApi>`:
+
+``
+  local scores = pool.map("score", candidates)
+``
+
+calls the global function `score` of the workers once for each element of
+the sequence `candidates`, and returns a table of the first result of each
+call, in the same order. The workers must define the function, e.g. by loading
+the same module in the setup function of the pool.
+
+The items are split into contiguous chunks, by default four per worker. Each
+chunk is a small lua state of its own, a parcel, which the items are copied
+into with `primer::transfer_value` on the thread of the caller. A worker
+copies each item out of the parcel into its VM, calls the function, and copies
+the result back in its place, so a VM is only ever used by the thread which
+owns it, and nothing is encoded. Items and results must therefore be plain
+data: nil, booleans, numbers, strings, and tables of them.
+
+The calling task is suspended until every chunk is back, and the host collects
+finished chunks once per frame, before the tick which resumes their tasks:
+
+``
+  map_.set_pool(&workers);
+  map_.set_scheduler(&sched);
+  ...
+  map_.poll();
+  sched.tick();
+``
+
+If a call raises an error, or a value can't be copied, the results are `nil`
+and a message, which tells the index of the item, as for the `io` library. The
+other chunks still run. An empty sequence gives an empty table at once.
+
+The function must be called from a scheduler task, which can yield. Pending
+maps are not saved by `persist`, but the function can be, and is bound again
+to the restoring feature. If the feature is destroyed first, the chunks which
+didn't start yet are skipped by the workers.
+
+This header uses `std::thread`, and isn't included by `primer/api.hpp`.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/api/self_closures.hpp>
+#include <primer/api/vm_worker_pool.hpp>
+#include <primer/cpp_pcall.hpp>
+#include <primer/error.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/lua_ref_seq.hpp>
+#include <primer/scheduler.hpp>
+#include <primer/support/lua_state_ref.hpp>
+#include <primer/transfer.hpp>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+namespace primer {
+namespace api {
+
+template <typename WorkerApi>
+class pool_map {
+  using pool_t = vm_worker_pool<WorkerApi>;
+
+  // A contiguous run of the items of a map, in a state of its own. The
+  // worker replaces each item on its stack with the result.
+  struct chunk {
+    scheduler::ticket ticket = 0;
+    lua_Integer first = 1; // The index of the first item in the sequence
+    std::string name;
+    lua_State * parcel = nullptr;
+    expected<void> status;
+    bool gathered = false;
+
+    chunk() = default;
+    chunk(const chunk &) = delete;
+    chunk & operator=(const chunk &) = delete;
+    ~chunk() noexcept {
+      if (parcel) { lua_close(parcel); }
+    }
+  };
+
+  // Shared with the tasks in the queues of the workers, which may outlive the
+  // feature
+  struct outbox {
+    std::mutex mutex;
+    std::list<chunk> running;
+    std::list<chunk> done;
+    std::atomic<bool> abandoned{false};
+  };
+
+  struct job {
+    lua_ref results; // A table of one slot per item
+    std::size_t pending = 0; // Chunks not gathered
+    expected<void> status;
+  };
+
+  const char * global_;
+  std::size_t chunks_per_worker_;
+  pool_t * pool_ = nullptr;
+  scheduler * sched_ = nullptr;
+  lua_state_ref sref_;
+  std::shared_ptr<outbox> box_;
+  std::unordered_map<scheduler::ticket, job> jobs_;
+
+  //
+  // Worker threads
+  //
+
+  static void run_chunk(lua_State * W, chunk & c) noexcept {
+    lua_State * P = c.parcel;
+    if (!lua_checkstack(W, 4) || !lua_checkstack(P, 1)) {
+      c.status = primer::error::insufficient_stack_space(4);
+      return;
+    }
+    const int n = lua_gettop(P);
+    for (int i = 1; i <= n; ++i) {
+      lua_getglobal(W, c.name.c_str());
+      auto ok = primer::transfer_value(P, i, W);
+      if (ok) {
+        const int code = lua_pcall(W, 1, 1, 0);
+        if (code != LUA_OK) {
+          ok = primer::pop_error(W, code);
+        } else {
+          ok = primer::transfer_value(W, -1, P);
+          if (ok) { lua_replace(P, i); }
+        }
+      }
+      lua_settop(W, 0);
+      if (!ok) {
+        ok.err().prepend_error_line("In item #", c.first + i - 1, ",");
+        c.status = std::move(ok);
+        return;
+      }
+    }
+  }
+
+  //
+  // Lua functions
+  //
+
+  // Copies the items into chunks, and queues them. The table of results is
+  // on top of the stack, and the items at index 2.
+  expected<void> start(lua_State * L, const char * name, scheduler::ticket t,
+                       lua_Integer n) {
+    const lua_Integer most =
+      static_cast<lua_Integer>(pool_->size() * chunks_per_worker_);
+    const lua_Integer count = (n < most) ? n : most;
+
+    std::list<chunk> made;
+    job j;
+    PRIMER_TRY_BAD_ALLOC {
+      lua_pushvalue(L, -1);
+      auto ref_ok = primer::mem_pcall<1>(L, [&]() { j.results = lua_ref{L}; });
+      if (!ref_ok) { return std::move(ref_ok.err()); }
+
+      for (lua_Integer k = 0; k < count; ++k) {
+        made.emplace_back();
+        chunk & c = made.back();
+        c.ticket = t;
+        c.first = 1 + n * k / count;
+        c.name = name;
+        c.parcel = luaL_newstate();
+        if (!c.parcel) { return primer::error::bad_alloc(); }
+
+        const lua_Integer last = n * (k + 1) / count;
+        const int size = static_cast<int>(last - c.first + 1);
+        if (!lua_checkstack(c.parcel, size)) {
+          return primer::error::insufficient_stack_space(size);
+        }
+        for (lua_Integer i = c.first; i <= last; ++i) {
+          lua_rawgeti(L, 2, i);
+          auto ok = primer::transfer_value(L, -1, c.parcel);
+          lua_pop(L, 1);
+          if (!ok) {
+            ok.err().prepend_error_line("In item #", i, ",");
+            return ok;
+          }
+        }
+      }
+
+      j.pending = made.size();
+      jobs_.emplace(t, std::move(j));
+    }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+
+    // A chunk which can't be queued goes straight to the outbox, failed
+    std::shared_ptr<outbox> box = box_;
+    while (!made.empty()) {
+      typename std::list<chunk>::iterator it;
+      {
+        std::lock_guard<std::mutex> lock(box->mutex);
+        it = made.begin();
+        box->running.splice(box->running.end(), made, it);
+      }
+      PRIMER_TRY_BAD_ALLOC {
+        pool_->post([box, it](WorkerApi &, lua_State * W) {
+          if (!box->abandoned) { run_chunk(W, *it); }
+          std::lock_guard<std::mutex> lock(box->mutex);
+          box->done.splice(box->done.end(), box->running, it);
+        });
+      }
+      PRIMER_CATCH_BAD_ALLOC {
+        std::lock_guard<std::mutex> lock(box->mutex);
+        it->status = primer::error::bad_alloc();
+        box->done.splice(box->done.end(), box->running, it);
+      }
+    }
+    return {};
+  }
+
+  static int intf_map(lua_State * L) {
+    pool_map * self = recover_self_upvalue<pool_map>(L);
+    const char * name = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (!self->pool_ || !self->sched_) {
+      return luaL_error(L, "pool.map has no worker pool or scheduler");
+    }
+    if (!lua_isyieldable(L)) {
+      return luaL_error(L, "pool.map must be called from a scheduler task");
+    }
+    const lua_Integer n = static_cast<lua_Integer>(lua_rawlen(L, 2));
+    luaL_checkstack(L, 2, "not enough stack space");
+    lua_settop(L, 2);
+    lua_createtable(L, static_cast<int>(n), 0);
+    if (!n) { return 1; }
+
+    const scheduler::ticket t = self->sched_->make_ticket();
+    bool failed = false;
+    {
+      auto ok = self->start(L, name, t, n);
+      if (!ok) {
+        primer::push_error(L, ok.err());
+        failed = true;
+      }
+    }
+    if (failed) { return lua_error(L); }
+    return scheduler::await(L, t);
+  }
+
+  static std::array<const luaL_Reg, 1> get_funcs() {
+    std::array<const luaL_Reg, 1> funcs = {{
+      luaL_Reg{"map", &intf_map},
+    }};
+    return funcs;
+  }
+
+  //
+  // Gathering
+  //
+
+  // Copies the results of a chunk into the table of its job. The table has
+  // a slot for each of them, so setting them doesn't allocate.
+  static bool gather(lua_State * L, job & j, chunk & c) noexcept {
+    if (!c.status) {
+      if (j.status) { j.status = std::move(c.status); }
+      return true;
+    }
+    if (!j.status) { return true; }
+    if (!lua_checkstack(L, 2) || !j.results.push(L)) { return false; }
+    const int n = lua_gettop(c.parcel);
+    for (int k = 1; k <= n; ++k) {
+      auto ok = primer::transfer_value(c.parcel, k, L);
+      if (!ok) {
+        ok.err().prepend_error_line("In result #", c.first + k - 1, ",");
+        j.status = std::move(ok);
+        break;
+      }
+      lua_rawseti(L, -2, c.first + k - 1);
+    }
+    lua_pop(L, 1);
+    return true;
+  }
+
+  // Wakes the task of a job whose chunks are all gathered
+  bool finish(lua_State * L, scheduler::ticket t, job & j) noexcept {
+    lua_ref_seq results;
+    auto ok = primer::mem_pcall(L, [&]() {
+      if (j.status) {
+        j.results.push(L);
+        primer::pop_n(L, 1, results);
+      } else {
+        lua_pushnil(L);
+        primer::push_error(L, j.status.err());
+        primer::pop_n(L, 2, results);
+      }
+    });
+    if (!ok) { return false; }
+    PRIMER_TRY_BAD_ALLOC { sched_->complete_seq(t, std::move(results)); }
+    PRIMER_CATCH_BAD_ALLOC { return false; }
+    return true;
+  }
+
+public:
+  explicit pool_map(std::size_t chunks_per_worker = 4,
+                    const char * global = "pool")
+    : global_(global)
+    , chunks_per_worker_(chunks_per_worker ? chunks_per_worker : 1)
+    , box_(std::make_shared<outbox>()) {}
+
+  ~pool_map() noexcept { box_->abandoned = true; }
+
+  pool_map(const pool_map &) = delete;
+  pool_map & operator=(const pool_map &) = delete;
+
+  // The workers which run the calls, and the scheduler which runs the tasks
+  // that make them
+  void set_pool(pool_t * p) noexcept { pool_ = p; }
+  void set_scheduler(scheduler * s) noexcept { sched_ = s; }
+
+  // The number of maps which have been started, and not delivered
+  std::size_t in_flight() const noexcept { return jobs_.size(); }
+
+  // Gathers the finished chunks, and hands the results of the finished maps
+  // to the scheduler, which resumes their tasks on its next tick. Returns the
+  // number of maps delivered. Chunks which can't be gathered for lack of
+  // memory are kept for the next call.
+  std::size_t poll() noexcept {
+    std::list<chunk> finished;
+    {
+      std::lock_guard<std::mutex> lock(box_->mutex);
+      finished.splice(finished.end(), box_->done);
+    }
+    lua_State * L = sref_.lock();
+    if (finished.empty() || !L || !sched_) {
+      std::lock_guard<std::mutex> lock(box_->mutex);
+      box_->done.splice(box_->done.begin(), finished);
+      return 0;
+    }
+
+    std::size_t delivered = 0;
+    while (!finished.empty()) {
+      chunk & c = finished.front();
+      auto it = jobs_.find(c.ticket);
+      if (it != jobs_.end()) {
+        job & j = it->second;
+        if (!c.gathered) {
+          if (!gather(L, j, c)) { break; }
+          c.gathered = true;
+        }
+        if (j.pending == 1) {
+          if (!this->finish(L, c.ticket, j)) { break; }
+          jobs_.erase(it);
+          ++delivered;
+        } else {
+          --j.pending;
+        }
+      }
+      finished.pop_front();
+    }
+    if (!finished.empty()) {
+      std::lock_guard<std::mutex> lock(box_->mutex);
+      box_->done.splice(box_->done.begin(), finished);
+    }
+    return delivered;
+  }
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    sref_ = primer::obtain_state_ref(L);
+    lua_newtable(L);
+    api::set_self_closures(L, get_funcs(), this);
+    lua_setglobal(L, global_);
+  }
+
+  void on_persist_table(lua_State * L) {
+    api::set_self_closures_prefix_reverse(L, "pool_map__", get_funcs());
+  }
+
+  void on_unpersist_table(lua_State * L) {
+    api::set_self_closures_prefix(L, "pool_map__", get_funcs(), this);
+  }
+};
+
+} // end namespace api
+} // end namespace primer
@@ -9,17 +9,25 @@
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <primer/api/self_closures.hpp>
 #include <primer/cpp_pcall.hpp>
+#include <primer/detail/type_traits.hpp>
 #include <primer/error_capture.hpp>
 #include <primer/lua.hpp>
 #include <primer/registry_helper.hpp>
-#include <primer/set_funcs.hpp>
+#include <primer/string_builder.hpp>
 #include <primer/support/asserts.hpp>
-#include <primer/support/scoped_stash_global_value.hpp>
+#include <primer/support/types.hpp>
 
 #include <array>
+#include <chrono>
+#include <cstddef>
 #include <iostream>
+#include <list>
 #include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 //[ primer_print_manager_overview
@@ -41,12 +49,27 @@ PRIMER_ASSERT_FILESCOPE;
 //`
 //` This is handled using an
 //` "experimental compilation" approach. First, we assume that the command is
-//` a lua value, and we transform it to `_pretty_print(input)`, and check if
-//` that is syntactically well-formed. If so, we execute it.
+//` a lua value, and we transform it to `return input`, and check if that is
+//` syntactically well-formed. If so, we execute it, and pretty print the first
+//` value which it returns.
 //`
 //` If it is not well-formed,
 //` then we try simply loading `input` -- maybe it is just a statement. If so,
 //` we execute it, if not we report a syntax error to the user.
+//`
+//` With "set_interpreter_cache_size", the compiled commands are kept in a
+//` least-recently-used cache, keyed by the input text, which remembers which
+//` form compiled, so that a repeated command is not compiled again.
+//`
+//` By default, each line of print output is delivered when it is printed. In
+//` buffered mode, set by "set_buffered", the lines are appended to one buffer
+//` owned by the print manager, and delivered together when the buffer reaches
+//` a size limit, when the oldest line in it reaches an age limit, or when
+//` "flush" is called. The buffer is reused, so a busy script doesn't allocate
+//` per line, and the default output to `std::cout` is flushed once per batch.
+//`
+//` A `primer::string_builder` passed to "print" is copied from its own buffer,
+//` without making a lua string of it first.
 //]
 
 namespace primer {
@@ -67,6 +90,14 @@ namespace primer {
 //`    it again. You can use `clear_input` as the cue to clear the editbox
 //`    instead, then it will only be cleared when the input was successfully
 //`    parsed.
+//`
+//` Optionally, a context may also have
+//`
+//= void new_text_block(primer::lua_string_view);
+//`
+//` which, in buffered mode, receives a batch of lines at once, each one ended
+//` by `'\n'`. The view is only valid during the call. A context without it has
+//` `new_text` called for each line of the batch instead.
 //]
 
 namespace detail {
@@ -77,9 +108,35 @@ class interpreter_context_ptr {
 
   obj_ptr object_;
   void (*new_text_call_)(obj_ptr, const std::string &);
+  void (*new_text_block_call_)(obj_ptr, lua_string_view);
   void (*error_text_call_)(obj_ptr, const std::string &);
   void (*clear_input_call_)(obj_ptr);
 
+  // Uses `new_text_block` if `T` has it, otherwise `new_text` for each line
+  template <typename T, typename ENABLE = void>
+  struct block_helper {
+    static void new_text_block(obj_ptr o, lua_string_view block) {
+      const char * begin = block.begin();
+      for (const char * it = begin; it != block.end(); ++it) {
+        if (*it == '\n') {
+          static_cast<T *>(o)->new_text(std::string(begin, it));
+          begin = it + 1;
+        }
+      }
+      if (begin != block.end()) {
+        static_cast<T *>(o)->new_text(std::string(begin, block.end()));
+      }
+    }
+  };
+
+  template <typename T>
+  struct block_helper<T, void_t<decltype(std::declval<T &>().new_text_block(
+                           std::declval<lua_string_view>()))>> {
+    static void new_text_block(obj_ptr o, lua_string_view block) {
+      static_cast<T *>(o)->new_text_block(block);
+    }
+  };
+
   template <typename T>
   struct helper {
     static void new_text(obj_ptr o, const std::string & str) {
@@ -96,6 +153,10 @@ public:
     this->new_text_call_(object_, str);
   }
 
+  void new_text_block(lua_string_view block) const {
+    this->new_text_block_call_(object_, block);
+  }
+
   void error_text(const std::string & str) const {
     this->error_text_call_(object_, str);
   }
@@ -106,26 +167,50 @@ public:
   explicit interpreter_context_ptr(T * t)
     : object_(static_cast<obj_ptr>(t))
     , new_text_call_(&helper<T>::new_text)
+    , new_text_block_call_(&block_helper<T>::new_text_block)
     , error_text_call_(&helper<T>::error_text)
     , clear_input_call_(&helper<T>::clear_input) {}
 };
 
+// The text of a print argument. A string builder is printed in place,
+// without making a lua string of it.
+inline const char *
+print_arg_text(lua_State * L, int idx, std::size_t & len) {
+  if (const auto * b = primer::test_udata<string_builder>(L, idx)) {
+    len = b->size();
+    return b->data();
+  }
+  return lua_tolstring(L, idx, &len);
+}
+
 // Default print and pretty print implementations
 inline std::string
 default_print_format(lua_State * L) {
   std::string buffer;
   int nargs = lua_gettop(L);
   for (int i = 1; i <= nargs; ++i) {
-    const char * str = lua_tostring(L, i);
-    if (!str) { str = ""; }
+    std::size_t len = 0;
+    const char * str = print_arg_text(L, i, len);
     if (i > 1) {
       buffer += "\t"; // separate multiple args with tab character
     }
-    buffer += str;
+    if (str) { buffer.append(str, len); }
   }
   return buffer;
 }
 
+// Same as `default_print_format`, but appends to `buffer`
+inline void
+default_print_append(lua_State * L, std::string & buffer) {
+  int nargs = lua_gettop(L);
+  for (int i = 1; i <= nargs; ++i) {
+    std::size_t len = 0;
+    const char * str = print_arg_text(L, i, len);
+    if (i > 1) { buffer += '\t'; }
+    if (str) { buffer.append(str, len); }
+  }
+}
+
 inline std::string
 default_pretty_print_format(lua_State * L) {
   if (!lua_gettop(L)) { return ""; }
@@ -185,6 +270,25 @@ class print_manager {
   format_func_t print_format_ = nullptr;
   format_func_t pretty_print_format_ = nullptr;
 
+  // Buffered mode, when `buffer_limit_` is nonzero
+  using clock_t = std::chrono::steady_clock;
+
+  std::size_t buffer_limit_ = 0;
+  clock_t::duration buffer_delay_{};
+  mutable clock_t::time_point buffer_since_{};
+  mutable std::string buffer_;
+
+  // Compiled interpreter commands, most recently used first. The functions are
+  // in a registry table, keyed by the text.
+  struct cached_chunk {
+    std::list<std::string>::iterator position;
+    bool is_expression;
+  };
+
+  std::size_t chunk_cache_limit_ = 0;
+  std::list<std::string> chunk_order_;
+  std::unordered_map<std::string, cached_chunk> chunk_cache_;
+
   //<-
   static constexpr const char * pretty_print_name = "_pretty_print";
 
@@ -194,9 +298,16 @@ class print_manager {
     return man;
   }
 
+  // Our lua functions are closures holding the self pointer as an upvalue, so
+  // they don't need the registry lookup.
   static int intf_print_impl(lua_State * L) {
-    print_manager * man = recover_self(L);
-    if (man->print_format_) {
+    print_manager * man = recover_self_upvalue<print_manager>(L);
+    if (man->buffer_limit_ && !man->print_format_) {
+      const bool was_empty = man->buffer_.empty();
+      detail::default_print_append(L, man->buffer_);
+      man->buffer_ += '\n';
+      man->buffered_line_added(was_empty);
+    } else if (man->print_format_) {
       man->new_text(man->print_format_(L));
     } else {
       man->new_text(detail::default_print_format(L));
@@ -205,7 +316,7 @@ class print_manager {
   }
 
   static int intf_pretty_print_impl(lua_State * L) {
-    print_manager * man = recover_self(L);
+    print_manager * man = recover_self_upvalue<print_manager>(L);
     if (man->pretty_print_format_) {
       man->new_text(man->pretty_print_format_(L));
     } else {
@@ -214,6 +325,122 @@ class print_manager {
     return 0;
   }
 
+  // Flushes the buffer if it is over a limit
+  void buffered_line_added(bool was_empty) const {
+    if (buffer_delay_ == clock_t::duration::zero()) {
+      if (buffer_.size() >= buffer_limit_) { this->flush(); }
+      return;
+    }
+    const clock_t::time_point now = clock_t::now();
+    if (was_empty) { buffer_since_ = now; }
+    if (buffer_.size() >= buffer_limit_
+        || now - buffer_since_ >= buffer_delay_) {
+      this->flush();
+    }
+  }
+
+  static void * chunk_cache_key() noexcept {
+    static char key;
+    return &key;
+  }
+
+  // Pushes the compiled command and returns true, or pushes nothing.
+  // A function which doesn't use the current globals is stale, e.g. after
+  // unpersist replaced them.
+  bool find_cached_chunk(lua_State * L, const std::string & text,
+                         bool & is_expression) {
+    auto it = chunk_cache_.find(text);
+    if (it == chunk_cache_.end()) { return false; }
+
+    bool found = false;
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, chunk_cache_key()) == LUA_TTABLE) {
+      lua_pushlstring(L, text.data(), text.size());
+      if (lua_rawget(L, -2) == LUA_TFUNCTION) { // [cache] [f]
+        lua_getupvalue(L, -1, 1);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+        found = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+      }
+      lua_remove(L, -2);
+      if (!found) { lua_pop(L, 1); }
+    } else {
+      lua_pop(L, 1);
+    }
+
+    if (!found) {
+      this->evict_chunk(L, it);
+      return false;
+    }
+    chunk_order_.splice(chunk_order_.begin(), chunk_order_,
+                        it->second.position);
+    is_expression = it->second.is_expression;
+    return true;
+  }
+
+  void evict_chunk(lua_State * L,
+                   std::unordered_map<std::string, cached_chunk>::iterator it) {
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, chunk_cache_key()) == LUA_TTABLE) {
+      lua_pushlstring(L, it->first.data(), it->first.size());
+      lua_pushnil(L);
+      lua_rawset(L, -3);
+    }
+    lua_pop(L, 1);
+    chunk_order_.erase(it->second.position);
+    chunk_cache_.erase(it);
+  }
+
+  // Caches the compiled command at the top of the stack, leaving it there
+  void cache_chunk(lua_State * L, const std::string & text,
+                   bool is_expression) {
+    if (!chunk_cache_limit_ || !lua_checkstack(L, 3)) { return; }
+    PRIMER_TRY_BAD_ALLOC {
+      while (chunk_cache_.size() >= chunk_cache_limit_) {
+        this->evict_chunk(L, chunk_cache_.find(chunk_order_.back()));
+      }
+      chunk_order_.push_front(text);
+      chunk_cache_.emplace(text,
+                           cached_chunk{chunk_order_.begin(), is_expression});
+    }
+    PRIMER_CATCH_BAD_ALLOC {
+      chunk_order_.clear();
+      chunk_cache_.clear();
+      lua_pushnil(L);
+      lua_rawsetp(L, LUA_REGISTRYINDEX, chunk_cache_key());
+      return;
+    }
+
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, chunk_cache_key()) != LUA_TTABLE) {
+      lua_pop(L, 1);
+      lua_newtable(L);
+      lua_pushvalue(L, -1);
+      lua_rawsetp(L, LUA_REGISTRYINDEX, chunk_cache_key());
+    } // [f] [cache]
+    lua_pushlstring(L, text.data(), text.size());
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+  }
+
+  // Compiles the command and pushes it, or reports the error
+  bool compile_input(lua_State * L, const std::string & text,
+                     bool & is_expression) {
+    if (this->find_cached_chunk(L, text, is_expression)) { return true; }
+
+    std::string experiment = "return " + text;
+    is_expression = (LUA_OK == luaL_loadstring(L, experiment.c_str()));
+    if (!is_expression) {
+      // Got an error (presumably a syntax error), try just the original text
+      lua_pop(L, 1);
+      int err_code = luaL_loadstring(L, text.c_str());
+      if (LUA_OK != err_code) {
+        this->handle_interpreter_error(L, err_code);
+        return false;
+      }
+    }
+    this->cache_chunk(L, text, is_expression);
+    return true;
+  }
+
   void handle_interpreter_error(lua_State * L, int code) {
     primer::error e{primer::pop_error(L, code)};
     this->error_text(detail::strip_line_info(e.what()));
@@ -231,15 +458,67 @@ class print_manager {
   //->
 public:
   // Add or remove interpreter context pointers from the stack
+  // Buffered text goes to the context which was on top when it was printed.
   template <typename T>
   void set_interpreter_context(T * t) {
+    this->flush();
     stack_.emplace_back(t);
   }
 
   void pop_interpreter_context() {
+    this->flush();
     if (stack_.size()) { stack_.pop_back(); }
   }
 
+  // Buffer print output, delivering it when `limit` bytes are buffered, or,
+  // if `max_delay` is nonzero, when a line is printed and the oldest buffered
+  // line is older than that. The age is only checked when a line is printed.
+  void set_buffered(std::size_t limit,
+                    std::chrono::milliseconds max_delay =
+                      std::chrono::milliseconds::zero()) {
+    this->flush();
+    buffer_limit_ = limit ? limit : 1;
+    buffer_delay_ = max_delay;
+    buffer_.reserve(buffer_limit_);
+  }
+
+  void set_unbuffered() {
+    this->flush();
+    buffer_limit_ = 0;
+  }
+
+  bool buffered() const noexcept { return buffer_limit_ != 0; }
+
+  // Keep up to `n` compiled interpreter commands of the lua state `L`. Zero
+  // disables the cache.
+  void set_interpreter_cache_size(lua_State * L, std::size_t n) {
+    chunk_cache_limit_ = n;
+    while (chunk_cache_.size() > chunk_cache_limit_) {
+      this->evict_chunk(L, chunk_cache_.find(chunk_order_.back()));
+    }
+  }
+
+  std::size_t interpreter_cache_size() const noexcept {
+    return chunk_cache_.size();
+  }
+
+  // Deliver any buffered text now
+  void flush() const {
+    if (buffer_.empty()) { return; }
+    if (stack_.size()) {
+      stack_.back().new_text_block(
+        lua_string_view{buffer_.data(), buffer_.size()});
+    } else {
+      std::cout.write(buffer_.data(), buffer_.size());
+      std::cout.flush();
+    }
+    buffer_.clear();
+  }
+
+  ~print_manager() {
+    if (stack_.empty()) { this->flush(); }
+  }
+
   // Set a custom print or pretty-print formatting
   // Function should take a `lua_State *` and return `std::string`.
   // Do whatever you like with the stack. Don't raise errors.
@@ -252,7 +531,12 @@ public:
   // Interact directly with context on top of stack, or,
   // with stdout / stderr if stack is empty
   void new_text(const std::string & str) const {
-    if (stack_.size()) {
+    if (buffer_limit_) {
+      const bool was_empty = buffer_.empty();
+      buffer_ += str;
+      buffer_ += '\n';
+      this->buffered_line_added(was_empty);
+    } else if (stack_.size()) {
       stack_.back().new_text(str);
     } else {
       std::cout << str << std::endl;
@@ -260,6 +544,7 @@ public:
   }
 
   void error_text(const std::string & str) const {
+    this->flush();
     if (stack_.size()) {
       stack_.back().error_text(str);
     } else {
@@ -300,16 +585,16 @@ public:
     registry_helper<print_manager>::store(L, this);
 
     lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
-    primer::set_funcs(L, get_funcs());
+    api::set_self_closures(L, get_funcs(), this);
     lua_pop(L, 1);
   }
 
   void on_persist_table(lua_State * L) {
-    primer::set_funcs_prefix_reverse(L, "print_manager__", get_funcs());
+    api::set_self_closures_prefix_reverse(L, "print_manager__", get_funcs());
   }
 
   void on_unpersist_table(lua_State * L) {
-    primer::set_funcs_prefix(L, "print_manager__", get_funcs());
+    api::set_self_closures_prefix(L, "print_manager__", get_funcs(), this);
   }
 };
 
@@ -321,39 +606,35 @@ api::print_manager::handle_interpreter_input(lua_State * L,
                                              const std::string & text) {
   lua_settop(L, 0);
 
-  if (!lua_checkstack(L, 2)) {
-    this->error_text("Insufficient stack space, needed 2");
+  if (!lua_checkstack(L, 4)) {
+    this->error_text("Insufficient stack space, needed 4");
     return;
   }
 
-  // If the user messed with _pretty_print function, temporarily ours back.
-  primer::detail::scoped_stash_global_value(L, pretty_print_name);
-  lua_pushcfunction(L, &intf_pretty_print_impl);
-  lua_setglobal(L, pretty_print_name);
-
-  std::string experiment = pretty_print_name + ("(" + text + ")");
-
-  if (LUA_OK != luaL_loadstring(L, experiment.c_str())) {
-    // Got an error (presumably a syntax error), try just the original text
-    lua_pop(L, 1);
-    int err_code = luaL_loadstring(L, text.c_str());
-    if (LUA_OK != err_code) {
-      this->handle_interpreter_error(L, err_code);
-      lua_settop(L, 0);
-      return;
+  bool is_expression;
+  if (!this->compile_input(L, text, is_expression)) {
+    lua_settop(L, 0);
+    this->flush();
+    return;
+  }
+  this->new_text("$ " + text);
+  this->clear_input();
+
+  if (is_expression) {
+    // Pretty print the result with our function, even if the user replaced
+    // the global `_pretty_print`.
+    api::push_stashed_self_closure(L, &intf_pretty_print_impl);
+    lua_insert(L, 1);
+    int err_code = lua_pcall(L, 0, LUA_MULTRET, 0);
+    if (LUA_OK == err_code) {
+      err_code = lua_pcall(L, lua_gettop(L) - 1, 0, 0);
     }
-    this->new_text("$ " + text);
-    this->clear_input();
-
-    err_code = lua_pcall(L, 0, 0, 0);
     if (LUA_OK != err_code) { this->handle_interpreter_error(L, err_code); }
   } else {
-    this->new_text("$ " + text);
-    this->clear_input();
-
     int err_code = lua_pcall(L, 0, 0, 0);
     if (LUA_OK != err_code) { this->handle_interpreter_error(L, err_code); }
   }
   lua_settop(L, 0);
+  this->flush();
 }
 } // end namespace primer
@@ -0,0 +1,216 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_print_ring_overview
+/*`
+`primer::api::print_ring` is an interpreter context for `print_manager`, which
+hands print output to another thread without locking.
+
+Each VM gets its own ring, which is a single-producer / single-consumer queue
+of bytes, of a fixed capacity. The thread running the VM is the producer: its
+output is copied into the ring, and, if the ring is full, the output is dropped
+and counted, so that the VM never waits for the consumer.
+
+`print_ring_consumer` is used by one thread, e.g. the one which writes the
+console or the log. It holds any number of rings, and `drain` delivers what is
+in each of them to a callback
+
+  void(const print_ring &, print_ring::kind, const std::string &)
+
+where the text is one or more lines, each ended by `'\n'`, and `kind` is `text`
+or `error`. The string is reused, and is only valid during the call.
+
+A ring must outlive the VMs using it, so the consumer holds them by
+`shared_ptr`. Rings are added and removed on the consumer thread.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/support/types.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+class print_ring {
+public:
+  enum class kind : std::uint32_t { text = 0, error = 1 };
+
+private:
+  // Each record is a header, (size << 1) | kind, then the bytes
+  using header_t = std::uint32_t;
+  static constexpr std::size_t header_size = sizeof(header_t);
+  static constexpr std::size_t cache_line = 64;
+
+  std::size_t id_;
+  std::size_t mask_;
+  std::unique_ptr<char[]> data_;
+
+  // Written by the producer, and by the consumer, padded apart so they aren't
+  // on the same cache line
+  char pad0_[cache_line];
+  std::atomic<std::size_t> head_{0};
+  std::atomic<std::size_t> dropped_{0};
+  char pad1_[cache_line];
+  std::atomic<std::size_t> tail_{0};
+  char pad2_[cache_line];
+
+  static std::size_t round_up(std::size_t n) noexcept {
+    std::size_t result = 64;
+    while (result < n) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  void write_bytes(std::size_t pos, const char * src, std::size_t n) noexcept {
+    const std::size_t offset = pos & mask_;
+    const std::size_t first = n < mask_ + 1 - offset ? n : mask_ + 1 - offset;
+    std::memcpy(data_.get() + offset, src, first);
+    std::memcpy(data_.get(), src + first, n - first);
+  }
+
+  void read_bytes(std::size_t pos, char * dest, std::size_t n) const noexcept {
+    const std::size_t offset = pos & mask_;
+    const std::size_t first = n < mask_ + 1 - offset ? n : mask_ + 1 - offset;
+    std::memcpy(dest, data_.get() + offset, first);
+    std::memcpy(dest + first, data_.get(), n - first);
+  }
+
+  // Producer side. The record is the bytes followed by a newline
+  void push(kind k, const char * str, std::size_t n) noexcept {
+    const std::size_t size = n + 1;
+    const std::size_t head = head_.load(std::memory_order_relaxed);
+    const std::size_t tail = tail_.load(std::memory_order_acquire);
+    if (size > mask_ + 1 - header_size - (head - tail)
+        || size > (static_cast<header_t>(-1) >> 1)) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    const header_t header =
+      static_cast<header_t>(size << 1) | static_cast<header_t>(k);
+    char h[header_size];
+    std::memcpy(h, &header, header_size);
+    this->write_bytes(head, h, header_size);
+    this->write_bytes(head + header_size, str, n);
+    this->write_bytes(head + header_size + n, "\n", 1);
+    head_.store(head + header_size + size, std::memory_order_release);
+  }
+
+  friend class print_ring_consumer;
+
+  // Consumer side
+  template <typename F>
+  std::size_t drain(F && f, std::string & scratch) {
+    std::size_t count = 0;
+    std::size_t tail = tail_.load(std::memory_order_relaxed);
+    const std::size_t head = head_.load(std::memory_order_acquire);
+    while (tail != head) {
+      char h[header_size];
+      this->read_bytes(tail, h, header_size);
+      header_t header;
+      std::memcpy(&header, h, header_size);
+
+      const std::size_t size = header >> 1;
+      scratch.resize(size);
+      this->read_bytes(tail + header_size, &scratch[0], size);
+      tail += header_size + size;
+      tail_.store(tail, std::memory_order_release);
+
+      f(static_cast<const print_ring &>(*this), static_cast<kind>(header & 1),
+        static_cast<const std::string &>(scratch));
+      ++count;
+    }
+    return count;
+  }
+
+public:
+  // The capacity is rounded up to a power of two, at least 64 bytes
+  explicit print_ring(std::size_t capacity, std::size_t id = 0)
+    : id_(id)
+    , mask_(round_up(capacity) - 1)
+    , data_(new char[mask_ + 1]) {}
+
+  print_ring(const print_ring &) = delete;
+  print_ring & operator=(const print_ring &) = delete;
+
+  std::size_t id() const noexcept { return id_; }
+  std::size_t capacity() const noexcept { return mask_ + 1; }
+
+  // Records which didn't fit when they were printed
+  std::size_t dropped() const noexcept {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+  //
+  // Interpreter context, used by the producer
+  //
+
+  void new_text(const std::string & str) noexcept {
+    this->push(kind::text, str.data(), str.size());
+  }
+
+  // A batch of lines from a buffered `print_manager`, which already end in
+  // newlines
+  void new_text_block(lua_string_view block) noexcept {
+    if (block.empty()) { return; }
+    std::size_t n = block.size();
+    if (block[n - 1] == '\n') { --n; }
+    this->push(kind::text, block.data(), n);
+  }
+
+  void error_text(const std::string & str) noexcept {
+    this->push(kind::error, str.data(), str.size());
+  }
+
+  void clear_input() noexcept {}
+};
+
+class print_ring_consumer {
+  std::vector<std::shared_ptr<print_ring>> rings_;
+  std::string scratch_;
+
+public:
+  void add(std::shared_ptr<print_ring> r) { rings_.push_back(std::move(r)); }
+
+  void remove(const print_ring * r) {
+    for (auto it = rings_.begin(); it != rings_.end(); ++it) {
+      if (it->get() == r) {
+        rings_.erase(it);
+        return;
+      }
+    }
+  }
+
+  std::size_t size() const noexcept { return rings_.size(); }
+
+  // Delivers everything which is in the rings now, and returns the number of
+  // records
+  template <typename F>
+  std::size_t drain(F && f) {
+    std::size_t count = 0;
+    for (const auto & r : rings_) {
+      count += r->drain(f, scratch_);
+    }
+    return count;
+  }
+};
+
+} // end namespace api
+} // end namespace primer
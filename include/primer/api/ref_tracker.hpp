@@ -0,0 +1,259 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_ref_tracker_overview
+/*`
+`primer::api::ref_tracker` is an API feature which counts the `lua_ref`
+objects which hold a slot of a state, to find the refs which C++ code forgets
+to release. Each leaked ref keeps its slot in the registry, and its value
+alive, so they slow the collector down as they pile up.
+
+Refs only report their slots when `PRIMER_REF_TRACKING` is defined, see
+`<primer/support/ref_tracking.hpp>`. The tracker then keeps
+
+* the number of live refs, and of refs created and released since it was
+  installed, which cost a registry lookup for each ref,
+* if sites are captured, for each live ref, the return address of its
+  constructor and its time of creation, in a side table keyed by slot.
+
+``
+  struct my_api : primer::api::base<my_api> {
+    API_FEATURE(primer::api::ref_tracker, refs_);
+    ...
+  };
+
+  api.refs_.set_capture_sites(true);
+  ...
+  api.refs_.write_report(std::cerr); // The sites with the most live refs
+``
+
+`sites(order)` aggregates the live refs by site, with the most refs or the
+oldest ref first. The sites are code addresses, which `addr2line` or a debugger
+can resolve. The counts may be published with the other metrics of the VM,
+see `add_ref_metrics` and `publish_refs`.
+
+Refs made before the tracker is installed aren't counted, so it should be the
+first feature of the API. While sites are captured, releasing such a ref is
+ignored, and otherwise the live count can't go below zero.
+
+The tracker is not thread-safe, and all of it must be used on the thread which
+runs the state.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/api/metrics.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/lua_state_ref.hpp>
+#include <primer/support/ref_tracking.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+class ref_tracker {
+public:
+  using clock = std::chrono::steady_clock;
+
+  struct site_stat {
+    const void * site;
+    std::size_t refs;           // Live refs made at the site
+    clock::time_point oldest;   // Creation time of the oldest of them
+  };
+
+  enum class order { most_refs, oldest };
+
+private:
+  struct slot_info {
+    const void * site;
+    clock::time_point created;
+  };
+
+  using slot_key = std::pair<const detail::ref_pool *, int>;
+
+  lua_state_ref sref_;
+  detail::ref_tracking_hooks hooks_;
+  bool capture_sites_;
+
+  std::size_t live_ = 0;
+  std::uint64_t created_ = 0;
+  std::uint64_t released_ = 0;
+  std::map<slot_key, slot_info> slots_;
+
+  void created(const detail::ref_pool * pool, int iref,
+               const void * site) noexcept {
+    ++created_;
+    ++live_;
+    if (capture_sites_) {
+      PRIMER_TRY_BAD_ALLOC {
+        slots_[slot_key{pool, iref}] = slot_info{site, clock::now()};
+      }
+      PRIMER_CATCH_BAD_ALLOC {}
+    }
+  }
+
+  void released(const detail::ref_pool * pool, int iref) noexcept {
+    if (capture_sites_) {
+      auto it = slots_.find(slot_key{pool, iref});
+      if (it == slots_.end()) { return; }
+      slots_.erase(it);
+    }
+    ++released_;
+    if (live_) { --live_; }
+  }
+
+  static void created_hook(void * self, const detail::ref_pool * pool,
+                           int iref, const void * site) noexcept {
+    static_cast<ref_tracker *>(self)->created(pool, iref, site);
+  }
+
+  static void released_hook(void * self, const detail::ref_pool * pool,
+                            int iref) noexcept {
+    static_cast<ref_tracker *>(self)->released(pool, iref);
+  }
+
+public:
+  explicit ref_tracker(bool capture_sites = false)
+    : hooks_{static_cast<void *>(this), &created_hook, &released_hook}
+    , capture_sites_(capture_sites) {}
+
+  ref_tracker(const ref_tracker &) = delete;
+  ref_tracker & operator=(const ref_tracker &) = delete;
+
+  ~ref_tracker() noexcept {
+    if (lua_State * L = sref_.lock()) {
+      lua_rawgetp(L, LUA_REGISTRYINDEX, detail::ref_tracking_key());
+      const bool ours = (lua_touserdata(L, -1) == &hooks_);
+      lua_pop(L, 1);
+      if (ours) {
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, detail::ref_tracking_key());
+      }
+    }
+  }
+
+  // Refs made while sites are not captured aren't in the side table, so
+  // turning it on only sees the refs made from then on
+  void set_capture_sites(bool on) noexcept {
+    capture_sites_ = on;
+    if (!on) { slots_.clear(); }
+  }
+  bool capture_sites() const noexcept { return capture_sites_; }
+
+  std::size_t live() const noexcept { return live_; }
+  std::uint64_t created() const noexcept { return created_; }
+  std::uint64_t released() const noexcept { return released_; }
+
+  // The live refs of each site, while sites are captured
+  std::vector<site_stat> sites(order o = order::most_refs) const {
+    std::map<const void *, site_stat> by_site;
+    for (const auto & s : slots_) {
+      auto it = by_site.find(s.second.site);
+      if (it == by_site.end()) {
+        by_site.emplace(s.second.site,
+                        site_stat{s.second.site, 1, s.second.created});
+      } else {
+        ++it->second.refs;
+        it->second.oldest = std::min(it->second.oldest, s.second.created);
+      }
+    }
+
+    std::vector<site_stat> result;
+    result.reserve(by_site.size());
+    for (const auto & s : by_site) {
+      result.push_back(s.second);
+    }
+    if (o == order::most_refs) {
+      std::stable_sort(result.begin(), result.end(),
+                       [](const site_stat & a, const site_stat & b) {
+                         return a.refs > b.refs;
+                       });
+    } else {
+      std::stable_sort(result.begin(), result.end(),
+                       [](const site_stat & a, const site_stat & b) {
+                         return a.oldest < b.oldest;
+                       });
+    }
+    return result;
+  }
+
+  void write_report(std::ostream & os, order o = order::most_refs,
+                    std::size_t max_rows = 20) const {
+    const std::vector<site_stat> r = this->sites(o);
+    const auto now = clock::now();
+    os << "live " << live_ << ", created " << created_ << ", released "
+       << released_ << "\n";
+    os << "refs\toldest (s)\tsite\n";
+    for (std::size_t i = 0; i < r.size() && i < max_rows; ++i) {
+      char site[32];
+      std::snprintf(site, sizeof site, "%p", r[i].site);
+      os << r[i].refs << '\t'
+         << std::chrono::duration<double>(now - r[i].oldest).count() << '\t'
+         << site << '\n';
+    }
+  }
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    sref_ = primer::obtain_state_ref(L);
+    lua_pushlightuserdata(L, static_cast<void *>(&hooks_));
+    lua_rawsetp(L, LUA_REGISTRYINDEX, detail::ref_tracking_key());
+  }
+
+  void on_persist_table(lua_State *) {}
+  void on_unpersist_table(lua_State *) {}
+};
+
+/***
+ * Metrics of the refs of a VM, published from its tracker on the thread of
+ * the VM
+ */
+
+struct ref_metric_ids {
+  metrics::metric_id live;
+  metrics::metric_id created;
+  metrics::metric_id sites;
+};
+
+inline ref_metric_ids
+add_ref_metrics(metrics & m) {
+  ref_metric_ids ids;
+  ids.live = m.add_gauge("primer_lua_refs", "Live lua_ref slots");
+  ids.created =
+    m.add_counter("primer_lua_refs_created_total", "Created lua_ref slots");
+  ids.sites = m.add_gauge("primer_lua_ref_sites",
+                          "Sites with live lua_refs, if they are captured");
+  return ids;
+}
+
+inline void
+publish_refs(metrics::shard & s, const ref_metric_ids & ids,
+             const ref_tracker & t) {
+  s.set(ids.live, static_cast<double>(t.live()));
+  s.set_total(ids.created, t.created());
+  if (t.capture_sites()) {
+    s.set(ids.sites, static_cast<double>(t.sites().size()));
+  }
+}
+
+} // end namespace api
+} // end namespace primer
@@ -0,0 +1,264 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Replication of a lua state to a hot standby.
+ *
+ * A `replication_sender` turns a series of full snapshots of one state into a
+ * stream of frames. The first frame, and every `base_interval`'th one after
+ * it, holds a full snapshot, and the others hold only a delta against the
+ * snapshot before them, see `snapshot_delta.hpp`. The frames are passed to a
+ * `sink(const char *, std::size_t)`, the same as for `persist_chunked`, which
+ * may write them to a socket, a pipe, or a ring in shared memory.
+ *
+ * A `replication_standby` is fed the bytes of the stream, in pieces of any
+ * size, as they arrive, and keeps the latest full snapshot. The standby
+ * process restores it into its VM, with `persistable::unpersist_replica`,
+ * as often as it likes, so that on failover the VM is at most one frame
+ * behind.
+ *
+ * ```
+ *   // primary, e.g. every 250ms
+ *   api.persist_replica(L, sender, primer::detail::fd_sink{sock});
+ *
+ *   // standby, whenever the socket is readable
+ *   auto n = ::read(sock, buf, sizeof buf);
+ *   if (!standby.feed(buf, n)) { reconnect(); }
+ *   if (standby.needs_base()) { ask_primary_for_base(); }
+ *   api.unpersist_replica(L, standby);
+ * ```
+ *
+ * Each frame is numbered. If the standby misses a frame, e.g. it was started
+ * late, it drops deltas until the next full snapshot, and `needs_base` is
+ * true until then. How the standby tells the primary so is up to the host,
+ * which then calls `request_base` on the sender. A frame which is malformed,
+ * or a delta which doesn't apply, is reported by `feed`.
+ *
+ * Neither class touches a lua state. They return errors for malformed input,
+ * and for memory allocation failure.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/api/snapshot_delta.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <utility>
+
+namespace primer {
+
+namespace detail {
+
+struct replication_format {
+  static const char * magic() noexcept { return "PRR1"; }
+  static constexpr std::size_t magic_size = 4;
+  // magic, kind, sequence number, payload size
+  static constexpr std::size_t header_size = magic_size + 1 + 2 * 8;
+
+  static constexpr char base_frame = 'B';
+  static constexpr char delta_frame = 'D';
+};
+
+} // end namespace detail
+
+namespace api {
+
+class replication_sender {
+  using format = primer::detail::replication_format;
+
+  std::string last_;
+  std::string frame_;
+  std::uint64_t sequence_;
+  std::size_t base_interval_;
+  std::size_t since_base_;
+  bool need_base_;
+
+public:
+  explicit replication_sender(std::size_t base_interval = 64) noexcept
+    : last_()
+    , frame_()
+    , sequence_(0)
+    , base_interval_(base_interval ? base_interval : 1)
+    , since_base_(0)
+    , need_base_(true) {}
+
+  // The next frame will hold a full snapshot, e.g. because a standby has
+  // (re)connected.
+  void request_base() noexcept { need_base_ = true; }
+
+  // The number of the last frame sent
+  std::uint64_t sequence() const noexcept { return sequence_; }
+
+  // Sends `snapshot`, a full snapshot of the state, as the next frame. If the
+  // sink fails, the stream should be considered broken, and the next frame
+  // holds a full snapshot.
+  template <typename F>
+  expected<void> publish(const std::string & snapshot, F && sink) {
+    bool base = need_base_ || since_base_ + 1 >= base_interval_;
+
+    PRIMER_TRY_BAD_ALLOC {
+      frame_.clear();
+      if (!base) {
+        std::string delta;
+        if (auto ok = make_snapshot_delta(last_, snapshot, delta)) {
+          // A delta larger than the snapshot is of no use
+          if (delta.size() < snapshot.size()) {
+            this->make_frame(format::delta_frame, delta);
+          } else {
+            base = true;
+          }
+        } else {
+          return ok;
+        }
+      }
+      if (base) { this->make_frame(format::base_frame, snapshot); }
+
+      std::string next{snapshot};
+      if (!sink(frame_.data(), frame_.size())) {
+        need_base_ = true;
+        return primer::error{"could not write data"};
+      }
+      last_.swap(next);
+    }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+
+    ++sequence_;
+    since_base_ = base ? 0 : since_base_ + 1;
+    need_base_ = false;
+    return {};
+  }
+
+private:
+  void make_frame(char kind, const std::string & payload) {
+    using D = primer::detail::snapshot_delta_format;
+    frame_.reserve(format::header_size + payload.size());
+    frame_.append(format::magic(), format::magic_size);
+    frame_.push_back(kind);
+    D::put_u64(frame_, sequence_ + 1);
+    D::put_u64(frame_, payload.size());
+    frame_.append(payload);
+  }
+};
+
+class replication_standby {
+  using format = primer::detail::replication_format;
+
+  std::string pending_;
+  std::string image_;
+  std::string scratch_;
+  std::uint64_t sequence_;
+  bool have_base_;
+  bool updated_;
+
+public:
+  replication_standby() noexcept
+    : pending_()
+    , image_()
+    , scratch_()
+    , sequence_(0)
+    , have_base_(false)
+    , updated_(false) {}
+
+  // True until a full snapshot has been received after a missed frame
+  bool needs_base() const noexcept { return !have_base_; }
+
+  // True if a frame was applied since the last `mark_applied`
+  bool has_update() const noexcept { return updated_; }
+  void mark_applied() noexcept { updated_ = false; }
+
+  // The latest full snapshot, and the number of its frame
+  const std::string & image() const noexcept { return image_; }
+  std::uint64_t sequence() const noexcept { return sequence_; }
+
+  // Takes the next bytes of the stream. Complete frames are applied at once,
+  // and the rest is held until more bytes arrive. After an error, the bytes
+  // held are dropped, and the standby waits for a full snapshot, which should
+  // start a new stream.
+  expected<void> feed(const char * data, std::size_t size) {
+    PRIMER_TRY_BAD_ALLOC {
+      pending_.append(data, size);
+
+      std::size_t used = 0;
+      while (pending_.size() - used >= format::header_size) {
+        const char * pos = pending_.data() + used;
+        const char * end = pending_.data() + pending_.size();
+        if (std::memcmp(pos, format::magic(), format::magic_size)) {
+          return this->fail("replication stream: bad frame header");
+        }
+        pos += format::magic_size;
+        const char kind = *pos++;
+
+        using D = primer::detail::snapshot_delta_format;
+        std::uint64_t seq = 0;
+        std::uint64_t payload_size = 0;
+        D::get_u64(pos, end, seq);
+        D::get_u64(pos, end, payload_size);
+        if (payload_size > static_cast<std::uint64_t>(end - pos)) { break; }
+
+        const std::size_t n = static_cast<std::size_t>(payload_size);
+        if (auto ok = this->apply(kind, seq, pos, n)) {
+          used += format::header_size + n;
+        } else {
+          return ok;
+        }
+      }
+      pending_.erase(0, used);
+    }
+    PRIMER_CATCH_BAD_ALLOC { return this->fail_bad_alloc(); }
+    return {};
+  }
+
+private:
+  expected<void> apply(char kind, std::uint64_t seq, const char * payload,
+                       std::size_t size) {
+    if (kind == format::base_frame) {
+      image_.assign(payload, size);
+    } else if (kind == format::delta_frame) {
+      // A delta after a missed frame can't be applied, it is skipped
+      if (!have_base_ || seq != sequence_ + 1) {
+        have_base_ = false;
+        return {};
+      }
+      if (auto ok = apply_snapshot_delta(image_, std::string{payload, size},
+                                         scratch_)) {
+        image_.swap(scratch_);
+      } else {
+        return this->fail(ok.err().str());
+      }
+    } else {
+      return this->fail("replication stream: unknown frame kind");
+    }
+    sequence_ = seq;
+    have_base_ = true;
+    updated_ = true;
+    return {};
+  }
+
+  expected<void> fail(std::string msg) {
+    pending_.clear();
+    have_base_ = false;
+    return primer::error{std::move(msg)};
+  }
+
+  expected<void> fail_bad_alloc() noexcept {
+    pending_.clear();
+    have_base_ = false;
+    return primer::error::bad_alloc();
+  }
+};
+
+} // end namespace api
+
+} // end namespace primer
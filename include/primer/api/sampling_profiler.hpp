@@ -0,0 +1,297 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_sampling_profiler_overview
+/*`
+`primer::api::sampling_profiler` is an API feature which finds the hot lua
+functions of a state, while it runs.
+
+`start()` installs a count hook, which takes a sample of the lua call stack
+every `interval` instructions, and `stop()` removes it, so that the profiler
+costs nothing while it is off. It can be turned on and off at any time from the
+thread which runs the state.
+
+``
+  profiler_.set_interval(1000);
+  profiler_.start();
+  ...
+  profiler_.stop();
+  profiler_.write_flat(std::cout);
+``
+
+The reports are
+
+* `flat_report()`, the functions by the number of samples in which they were
+  running (`self`) or on the stack (`total`), and `write_flat(os)`,
+* `write_folded(os)`, a line for each distinct call stack, outermost function
+  first, separated by `;` and followed by its count. This is the input format of
+  flamegraph tools.
+
+Functions are named as by `bound_function::debug_string`, with the name which
+lua gives the function at the call site where it was first sampled.
+
+Samples are kept in a fixed-size buffer, which is aggregated when it is full or
+when a report is made, so the hook doesn't allocate, except to name a function
+the first time it is seen. Stacks deeper than `max_depth` keep only their
+innermost functions.
+
+The hook is installed on the main thread, and lua copies it to coroutines which
+are created while the profiler runs. Coroutines created before `start()` are not
+sampled. The hook is shared through `primer::hook_mux`, so the profiler runs
+alongside e.g. a `cpu_budget` or `vm_executor::install_count_hook`, and
+`start()` only fails if the main thread has a hook which isn't shared.
+
+The profiler is not thread-safe, and all of it must be used on the thread which
+runs the state.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/bound_function.hpp>
+#include <primer/hook_mux.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/lua_state_ref.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+class sampling_profiler {
+public:
+  struct flat_entry {
+    std::string function;
+    std::size_t self;  // Samples in which the function was running
+    std::size_t total; // Samples in which it was on the stack
+  };
+
+private:
+  using frame_id = std::uint32_t;
+
+  // Identity of a function. `source` is immutable lua memory, which may be
+  // reused once the function is collected, so a hit is checked against the
+  // name of the source.
+  struct function_key {
+    const char * source;
+    int line;
+    lua_CFunction cfunc;
+
+    bool operator<(const function_key & o) const {
+      return std::tie(source, line, cfunc)
+             < std::tie(o.source, o.line, o.cfunc);
+    }
+  };
+
+  struct function_info {
+    std::string short_src;
+    frame_id id;
+  };
+
+  lua_state_ref sref_;
+  int interval_ = 1000;
+  hook_mux::subscription hook_ = -1;
+
+  // The sample buffer
+  std::size_t capacity_;
+  std::size_t max_depth_;
+  std::vector<frame_id> frames_; // Innermost first, max_depth_ per sample
+  std::vector<std::size_t> depths_;
+  std::size_t used_ = 0;
+
+  std::map<function_key, function_info> ids_;
+  std::vector<std::string> names_; // By frame_id
+
+  std::vector<std::size_t> self_;  // By frame_id
+  std::vector<std::size_t> total_; // By frame_id
+  std::map<std::vector<frame_id>, std::size_t> stacks_; // Outermost first
+  std::size_t samples_ = 0;
+  std::size_t dropped_ = 0;
+
+  static void count_hook(lua_State * L, lua_Debug *, void * ud) {
+    static_cast<sampling_profiler *>(ud)->take_sample(L);
+  }
+
+  frame_id intern(const lua_Debug & ar, lua_CFunction cfunc) {
+    const function_key key{ar.source, ar.linedefined, cfunc};
+    auto it = ids_.find(key);
+    if (it != ids_.end() && it->second.short_src == ar.short_src) {
+      return it->second.id;
+    }
+
+    const frame_id id = static_cast<frame_id>(names_.size());
+    names_.emplace_back(detail::describe_function(ar));
+    self_.push_back(0);
+    total_.push_back(0);
+    if (it != ids_.end()) {
+      it->second = function_info{ar.short_src, id};
+    } else {
+      ids_.emplace(key, function_info{ar.short_src, id});
+    }
+    return id;
+  }
+
+  void take_sample(lua_State * L) noexcept {
+    PRIMER_TRY_BAD_ALLOC {
+      if (used_ == capacity_) { this->aggregate(); }
+      frame_id * out = &frames_[used_ * max_depth_];
+      std::size_t depth = 0;
+      lua_Debug ar;
+      for (int level = 0; depth < max_depth_ && lua_getstack(L, level, &ar);
+           ++level) {
+        if (!lua_getinfo(L, "nSf", &ar)) { break; }
+        lua_CFunction cfunc = lua_tocfunction(L, -1);
+        lua_pop(L, 1);
+        out[depth++] = this->intern(ar, cfunc);
+      }
+      depths_[used_++] = depth;
+    }
+    PRIMER_CATCH_BAD_ALLOC { ++dropped_; }
+  }
+
+  // Moves the buffered samples into the totals
+  void aggregate() {
+    std::vector<frame_id> stack;
+    for (std::size_t i = 0; i < used_; ++i) {
+      const frame_id * f = &frames_[i * max_depth_];
+      const std::size_t depth = depths_[i];
+      if (!depth) { continue; }
+
+      ++self_[f[0]];
+      stack.assign(f, f + depth);
+      std::sort(stack.begin(), stack.end());
+      stack.erase(std::unique(stack.begin(), stack.end()), stack.end());
+      for (frame_id id : stack) {
+        ++total_[id];
+      }
+
+      stack.assign(f, f + depth);
+      std::reverse(stack.begin(), stack.end());
+      ++stacks_[stack];
+      ++samples_;
+    }
+    used_ = 0;
+  }
+
+public:
+  explicit sampling_profiler(std::size_t capacity = 4096,
+                             std::size_t max_depth = 32)
+    : capacity_(capacity ? capacity : 1)
+    , max_depth_(max_depth ? max_depth : 1)
+    , frames_(capacity_ * max_depth_)
+    , depths_(capacity_) {}
+
+  sampling_profiler(const sampling_profiler &) = delete;
+  sampling_profiler & operator=(const sampling_profiler &) = delete;
+
+  ~sampling_profiler() noexcept { this->stop(); }
+
+  // Instructions between samples. Takes effect at the next `start`.
+  void set_interval(int instructions) noexcept {
+    interval_ = instructions > 0 ? instructions : 1;
+  }
+  int interval() const noexcept { return interval_; }
+
+  // Returns false if the state is gone, or has a hook which isn't shared.
+  bool start() noexcept {
+    lua_State * L = sref_.lock();
+    if (!L) { return false; }
+    if (hook_ >= 0) {
+      hook_mux::set_count(L, hook_, interval_);
+      return true;
+    }
+    auto s = hook_mux::subscribe(L, &count_hook, this, 0, interval_);
+    if (!s) { return false; }
+    hook_ = *s;
+    return true;
+  }
+
+  void stop() noexcept {
+    if (hook_ < 0) { return; }
+    if (lua_State * L = sref_.lock()) { hook_mux::unsubscribe(L, hook_); }
+    hook_ = -1;
+  }
+
+  bool running() const noexcept { return hook_ >= 0; }
+
+  // Samples taken so far, and samples lost to memory failures
+  std::size_t samples() const noexcept { return samples_ + used_; }
+  std::size_t dropped() const noexcept { return dropped_; }
+
+  void reset() noexcept {
+    used_ = 0;
+    std::fill(self_.begin(), self_.end(), 0);
+    std::fill(total_.begin(), total_.end(), 0);
+    stacks_.clear();
+    samples_ = 0;
+    dropped_ = 0;
+  }
+
+  // Functions by the number of samples in which they were running
+  std::vector<flat_entry> flat_report() {
+    this->aggregate();
+    std::vector<flat_entry> result;
+    for (std::size_t id = 0; id < names_.size(); ++id) {
+      if (total_[id]) {
+        result.push_back(flat_entry{names_[id], self_[id], total_[id]});
+      }
+    }
+    std::stable_sort(result.begin(), result.end(),
+                     [](const flat_entry & a, const flat_entry & b) {
+                       return std::tie(a.self, a.total)
+                              > std::tie(b.self, b.total);
+                     });
+    return result;
+  }
+
+  void write_flat(std::ostream & os, std::size_t max_rows = 20) {
+    const std::vector<flat_entry> r = this->flat_report();
+    os << "self\ttotal\tfunction\n";
+    for (std::size_t i = 0; i < r.size() && i < max_rows; ++i) {
+      os << r[i].self << '\t' << r[i].total << '\t' << r[i].function << '\n';
+    }
+  }
+
+  // One line per call stack, in the folded format of flamegraph tools
+  void write_folded(std::ostream & os) {
+    this->aggregate();
+    for (const auto & s : stacks_) {
+      for (std::size_t i = 0; i < s.first.size(); ++i) {
+        if (i) { os << ';'; }
+        os << names_[s.first[i]];
+      }
+      os << ' ' << s.second << '\n';
+    }
+  }
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    const bool was_running = this->running();
+    this->stop();
+    sref_ = primer::obtain_state_ref(L);
+    if (was_running) { this->start(); }
+  }
+
+  void on_persist_table(lua_State *) {}
+  void on_unpersist_table(lua_State *) {}
+};
+
+} // end namespace api
+} // end namespace primer
@@ -0,0 +1,122 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Helpers for api features which install C functions that need to know which
+ * feature object they belong to.
+ *
+ * Rather than stashing the self pointer in the registry and looking it up on
+ * every call, each function is pushed as a C closure whose first upvalue is a
+ * light userdata holding the self pointer. Recovering it is then just
+ * `lua_touserdata(L, lua_upvalueindex(1))`.
+ *
+ * Eris can't meaningfully persist a light userdata, so the closures themselves
+ * are made permanent objects. Each closure is also remembered in the registry,
+ * keyed by its C function, so that:
+ *
+ * - `set_self_closures_prefix_reverse` (for the persist table) can find the
+ *   exact closure objects that scripts hold,
+ * - `set_self_closures_prefix` (for the unpersist table) creates fresh
+ *   closures bound to the restoring feature object, and remembers those
+ *   instead.
+ *
+ * These are used like the `set_funcs` family.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/detail/luaL_Reg.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/asserts.hpp>
+
+#include <string>
+#include <utility>
+
+namespace primer {
+namespace api {
+
+// Recover self pointer in a function pushed by one of the below.
+template <typename T>
+T *
+recover_self_upvalue(lua_State * L) {
+  void * ptr = lua_touserdata(L, lua_upvalueindex(1));
+  PRIMER_ASSERT(ptr, "Could not recover self pointer!");
+  return static_cast<T *>(ptr);
+}
+
+// Push a new closure bound to self, and remember it.
+inline void
+push_self_closure(lua_State * L, lua_CFunction func, void * self) {
+  lua_pushcfunction(L, func);
+  lua_pushlightuserdata(L, self);
+  lua_pushcclosure(L, func, 1);
+  lua_pushvalue(L, -1);
+  lua_insert(L, -3);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+// Push the closure most recently created for this function.
+// Pushes nil if there is none.
+inline void
+push_stashed_self_closure(lua_State * L, lua_CFunction func) {
+  lua_pushcfunction(L, func);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+}
+
+template <typename T>
+void
+set_self_closures(lua_State * L, T && seq, void * self) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  PRIMER_ASSERT_TABLE(L);
+  primer::detail::iterate_L_Reg_sequence(
+    std::forward<T>(seq), [&](const char * name, lua_CFunction func) {
+      if (name && func) {
+        push_self_closure(L, func, self);
+        lua_setfield(L, -2, name);
+      }
+    });
+}
+
+template <typename T>
+void
+set_self_closures_prefix(lua_State * L, const std::string & prefix, T && seq,
+                         void * self) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  PRIMER_ASSERT_TABLE(L);
+  primer::detail::iterate_L_Reg_sequence(
+    std::forward<T>(seq), [&](const char * name, lua_CFunction func) {
+      if (name && func) {
+        push_self_closure(L, func, self);
+        lua_setfield(L, -2, (prefix + name).c_str());
+      }
+    });
+}
+
+template <typename T>
+void
+set_self_closures_prefix_reverse(lua_State * L, const std::string & prefix,
+                                 T && seq) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  PRIMER_ASSERT_TABLE(L);
+  primer::detail::iterate_L_Reg_sequence(
+    std::forward<T>(seq), [&](const char * name, lua_CFunction func) {
+      if (name && func) {
+        push_stashed_self_closure(L, func);
+        if (lua_isnil(L, -1)) {
+          lua_pop(L, 1);
+        } else {
+          lua_pushstring(L, (prefix + name).c_str());
+          lua_settable(L, -3);
+        }
+      }
+    });
+}
+
+} // end namespace api
+} // end namespace primer
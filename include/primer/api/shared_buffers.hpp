@@ -0,0 +1,84 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Defines an API feature which makes named `primer::shared_buffer` blocks
+ * permanent objects, so that a state which refers to them can be persisted.
+ *
+ * The image refers to each buffer by its name, and unpersisting pushes the
+ * buffer which has that name in the target api. So the elements are written
+ * neither into the image nor into the VM, and the target may even share the
+ * same blocks.
+ *
+ * Buffers must be added before the api first persists or unpersists, since
+ * the permanent objects tables are cached, or else `invalidate_permanents`
+ * must be called after.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/push.hpp>
+#include <primer/shared_buffer.hpp>
+#include <primer/support/asserts.hpp>
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+class shared_buffers {
+  struct entry {
+    std::string name;
+    std::function<void(lua_State *)> push;
+  };
+
+  std::vector<entry> entries_;
+
+  static void push_name(lua_State * L, const entry & e) {
+    lua_pushfstring(L, "shared_buffer_%s", e.name.c_str());
+  }
+
+public:
+  // Names must be unique within the api
+  template <typename T>
+  void add(std::string name, shared_buffer<T> buffer) {
+    entries_.push_back(entry{std::move(name), [buffer](lua_State * L) {
+                               primer::push(L, buffer);
+                             }});
+  }
+
+  std::size_t size() const noexcept { return entries_.size(); }
+
+  void on_init(lua_State *) {}
+
+  void on_persist_table(lua_State * L) {
+    PRIMER_ASSERT_TABLE(L);
+    for (const auto & e : entries_) {
+      e.push(L);
+      push_name(L, e);
+      lua_settable(L, -3);
+    }
+  }
+
+  void on_unpersist_table(lua_State * L) {
+    PRIMER_ASSERT_TABLE(L);
+    for (const auto & e : entries_) {
+      push_name(L, e);
+      e.push(L);
+      lua_settable(L, -3);
+    }
+  }
+};
+
+} // end namespace api
+} // end namespace primer
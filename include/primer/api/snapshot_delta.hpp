@@ -0,0 +1,306 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Delta encoding of persisted states.
+ *
+ * A delta describes a snapshot in terms of an earlier "base" snapshot, as a
+ * sequence of copies out of the base, and literal bytes. When little of the
+ * state has changed between two snapshots, the delta is small.
+ *
+ * Eris output can't be sliced into independent pieces per global, since any
+ * object may be shared by several of them, so the delta is taken of the bytes.
+ * Both snapshots are split into chunks at content-defined boundaries (a rolling
+ * hash), so that an insertion early in the output only disturbs the chunks
+ * near it, and the chunks of the target are looked up among those of the base.
+ *
+ * A delta records the size and hash of its base, and applying it to any other
+ * base is an error. A chain of deltas is compacted by applying each in turn,
+ * which gives a full snapshot, suitable as the next base.
+ *
+ * These functions don't touch a lua state. They return errors for malformed
+ * input, and for memory allocation failure.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace primer {
+
+namespace detail {
+
+struct snapshot_delta_format {
+  static const char * magic() noexcept { return "PRD1"; }
+  static constexpr std::size_t magic_size = 4;
+  static constexpr std::size_t header_size = magic_size + 3 * 8;
+
+  static constexpr char copy_op = 'C';
+  static constexpr char insert_op = 'I';
+
+  // Chunk boundaries: at least min_chunk bytes, on average about
+  // min_chunk + mask + 1, and at most max_chunk.
+  static constexpr std::size_t min_chunk = 64;
+  static constexpr std::uint64_t boundary_mask = 511;
+  static constexpr std::size_t max_chunk = 4096;
+
+  static std::uint64_t hash(const char * data, std::size_t size) noexcept {
+    std::uint64_t h = 14695981039346656037ull;
+    for (std::size_t i = 0; i < size; ++i) {
+      h ^= static_cast<unsigned char>(data[i]);
+      h *= 1099511628211ull;
+    }
+    return h;
+  }
+
+  // Random values per byte, for the rolling hash
+  static const std::uint64_t * gear_table() noexcept {
+    struct table {
+      std::uint64_t values[256];
+
+      table() noexcept {
+        std::uint64_t x = 0x9E3779B97F4A7C15ull;
+        for (std::uint64_t & v : values) {
+          x += 0x9E3779B97F4A7C15ull;
+          std::uint64_t z = x;
+          z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+          z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+          v = z ^ (z >> 31);
+        }
+      }
+    };
+    static const table t;
+    return t.values;
+  }
+
+  // Length of the chunk starting at `data`
+  static std::size_t next_chunk(const char * data, std::size_t size) noexcept {
+    if (size <= min_chunk) { return size; }
+    const std::size_t limit = size < max_chunk ? size : max_chunk;
+    const std::uint64_t * gear = gear_table();
+    std::uint64_t h = 0;
+    for (std::size_t i = 0; i < limit; ++i) {
+      h = (h << 1) + gear[static_cast<unsigned char>(data[i])];
+      if (i >= min_chunk && !(h & boundary_mask)) { return i + 1; }
+    }
+    return limit;
+  }
+
+  static void put_u64(std::string & out, std::uint64_t v) {
+    char buf[8];
+    for (int i = 0; i < 8; ++i) {
+      buf[i] = static_cast<char>((v >> (8 * i)) & 0xFF);
+    }
+    out.append(buf, 8);
+  }
+
+  static bool get_u64(const char *& pos, const char * end,
+                      std::uint64_t & v) noexcept {
+    if (end - pos < 8) { return false; }
+    v = 0;
+    for (int i = 0; i < 8; ++i) {
+      v |= static_cast<std::uint64_t>(static_cast<unsigned char>(pos[i]))
+           << (8 * i);
+    }
+    pos += 8;
+    return true;
+  }
+};
+
+} // end namespace detail
+
+namespace api {
+
+/***
+ * Writes to `delta` a description of `target` in terms of `base`.
+ */
+inline expected<void>
+make_snapshot_delta(const char * base, std::size_t base_size,
+                    const char * target, std::size_t target_size,
+                    std::string & delta) noexcept {
+  using F = primer::detail::snapshot_delta_format;
+
+  PRIMER_TRY_BAD_ALLOC {
+    delta.clear();
+    delta.append(F::magic(), F::magic_size);
+    F::put_u64(delta, base_size);
+    F::put_u64(delta, F::hash(base, base_size));
+    F::put_u64(delta, target_size);
+
+    // Index the chunks of the base by hash
+    std::unordered_multimap<std::uint64_t, std::size_t> index;
+    index.reserve(base_size / (F::min_chunk + F::boundary_mask) + 1);
+    for (std::size_t pos = 0; pos < base_size;) {
+      std::size_t len = F::next_chunk(base + pos, base_size - pos);
+      index.emplace(F::hash(base + pos, len), pos);
+      pos += len;
+    }
+
+    // Adjacent copies and inserts are merged into one op
+    std::uint64_t copy_start = 0, copy_len = 0;
+    std::size_t insert_start = 0, insert_len = 0;
+
+    auto flush_copy = [&]() {
+      if (copy_len) {
+        delta.push_back(static_cast<char>(F::copy_op));
+        F::put_u64(delta, copy_start);
+        F::put_u64(delta, copy_len);
+        copy_len = 0;
+      }
+    };
+    auto flush_insert = [&]() {
+      if (insert_len) {
+        delta.push_back(static_cast<char>(F::insert_op));
+        F::put_u64(delta, insert_len);
+        delta.append(target + insert_start, insert_len);
+        insert_len = 0;
+      }
+    };
+
+    for (std::size_t pos = 0; pos < target_size;) {
+      std::size_t len = F::next_chunk(target + pos, target_size - pos);
+
+      bool found = false;
+      std::size_t match = 0;
+      auto range = index.equal_range(F::hash(target + pos, len));
+      for (auto it = range.first; it != range.second; ++it) {
+        if (it->second + len <= base_size
+            && !std::memcmp(base + it->second, target + pos, len)) {
+          found = true;
+          match = it->second;
+          break;
+        }
+      }
+
+      if (found) {
+        flush_insert();
+        if (copy_len && copy_start + copy_len == match) {
+          copy_len += len;
+        } else {
+          flush_copy();
+          copy_start = match;
+          copy_len = len;
+        }
+      } else {
+        flush_copy();
+        if (!insert_len) { insert_start = pos; }
+        insert_len += len;
+      }
+      pos += len;
+    }
+    flush_copy();
+    flush_insert();
+  }
+  PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+  return {};
+}
+
+inline expected<void>
+make_snapshot_delta(const std::string & base, const std::string & target,
+                    std::string & delta) noexcept {
+  return make_snapshot_delta(base.data(), base.size(), target.data(),
+                             target.size(), delta);
+}
+
+/***
+ * Writes to `output` the snapshot described by `delta`, which must have been
+ * made against `base`.
+ */
+inline expected<void>
+apply_snapshot_delta(const std::string & base, const std::string & delta,
+                     std::string & output) noexcept {
+  using F = primer::detail::snapshot_delta_format;
+
+  const char * pos = delta.data();
+  const char * end = pos + delta.size();
+
+  std::uint64_t base_size = 0, base_hash = 0, target_size = 0;
+  if (delta.size() < F::header_size
+      || std::memcmp(pos, F::magic(), F::magic_size)) {
+    return primer::error{"malformed snapshot delta"};
+  }
+  pos += F::magic_size;
+  F::get_u64(pos, end, base_size);
+  F::get_u64(pos, end, base_hash);
+  F::get_u64(pos, end, target_size);
+
+  if (base_size != base.size()
+      || base_hash != F::hash(base.data(), base.size())) {
+    return primer::error{"snapshot delta doesn't match its base"};
+  }
+
+  PRIMER_TRY_BAD_ALLOC {
+    output.clear();
+    // Don't trust the recorded size for a large allocation
+    const std::uint64_t limit = base.size() + delta.size();
+    output.reserve(target_size < limit ? target_size : limit);
+    while (pos < end) {
+      const char op = *pos++;
+      std::uint64_t a, b;
+      if (op == F::copy_op) {
+        if (!F::get_u64(pos, end, a) || !F::get_u64(pos, end, b)
+            || a > base.size() || b > base.size() - a) {
+          return primer::error{"malformed snapshot delta"};
+        }
+        output.append(base, a, b);
+      } else if (op == F::insert_op) {
+        if (!F::get_u64(pos, end, a)
+            || a > static_cast<std::uint64_t>(end - pos)) {
+          return primer::error{"malformed snapshot delta"};
+        }
+        output.append(pos, a);
+        pos += a;
+      } else {
+        return primer::error{"malformed snapshot delta"};
+      }
+    }
+  }
+  PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+
+  if (output.size() != target_size) {
+    return primer::error{"malformed snapshot delta"};
+  }
+  return {};
+}
+
+/***
+ * Applies a chain of deltas, each made against the result of the previous one,
+ * to `base`. The result is a full snapshot.
+ */
+inline expected<void>
+compact_snapshot_deltas(const std::string & base,
+                        const std::vector<std::string> & deltas,
+                        std::string & output) noexcept {
+  PRIMER_TRY_BAD_ALLOC {
+    std::string current{base};
+    for (const std::string & d : deltas) {
+      if (auto ok = apply_snapshot_delta(current, d, output)) {
+        current.swap(output);
+      } else {
+        return ok;
+      }
+    }
+    output.swap(current);
+  }
+  PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+  return {};
+}
+
+} // end namespace api
+
+} // end namespace primer
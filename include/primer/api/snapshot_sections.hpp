@@ -0,0 +1,138 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Container format for sectioned snapshots, which are made by
+ * `persistable::persist_sections`.
+ *
+ * A sectioned snapshot is a table of contents followed by independent eris
+ * blobs. The main section has the empty name, and holds the usual target
+ * table. Each other section holds the value of one top-level global.
+ *
+ * Layout, with integers little-endian:
+ *
+ *   "PRS1"  u32 count
+ *   count x { u32 name length, name, u64 blob size }
+ *   count x blob
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace primer {
+namespace detail {
+
+struct snapshot_section {
+  std::string name;
+  const char * data;
+  std::size_t size;
+};
+
+struct snapshot_sections_format {
+  static const char * magic() noexcept { return "PRS1"; }
+  static constexpr std::size_t magic_size = 4;
+
+  static constexpr const char * globals_perm_name() {
+    return "primer_sections_G";
+  }
+
+  static void put(std::string & out, std::uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+      out.push_back(static_cast<char>((v >> (8 * i)) & 0xFF));
+    }
+  }
+
+  static bool get(const char *& pos, const char * end, std::uint64_t & v,
+                  int bytes) noexcept {
+    if (end - pos < bytes) { return false; }
+    v = 0;
+    for (int i = 0; i < bytes; ++i) {
+      v |= static_cast<std::uint64_t>(static_cast<unsigned char>(pos[i]))
+           << (8 * i);
+    }
+    pos += bytes;
+    return true;
+  }
+
+  // Writes the table of contents, and then the blobs, in order
+  static void write(std::string & out,
+                    const std::vector<snapshot_section> & sections) {
+    out.clear();
+    out.append(magic(), magic_size);
+    put(out, sections.size(), 4);
+    for (const auto & s : sections) {
+      put(out, s.name.size(), 4);
+      out.append(s.name);
+      put(out, s.size, 8);
+    }
+    for (const auto & s : sections) {
+      out.append(s.data, s.size);
+    }
+  }
+
+  // The sections refer into `buffer`
+  static expected<std::vector<snapshot_section>> read(
+    const std::string & buffer) noexcept {
+    expected<std::vector<snapshot_section>> result{
+      std::vector<snapshot_section>{}};
+    const char * pos = buffer.data();
+    const char * end = pos + buffer.size();
+    std::uint64_t count;
+    if (buffer.size() < magic_size || std::memcmp(pos, magic(), magic_size)) {
+      return primer::error{"not a sectioned snapshot"};
+    }
+    pos += magic_size;
+    if (!get(pos, end, count, 4)) {
+      return primer::error{"malformed sectioned snapshot"};
+    }
+
+    PRIMER_TRY_BAD_ALLOC {
+      for (std::uint64_t i = 0; i < count; ++i) {
+        std::uint64_t len, size;
+        if (!get(pos, end, len, 4)
+            || len > static_cast<std::uint64_t>(end - pos)) {
+          return primer::error{"malformed sectioned snapshot"};
+        }
+        std::string name(pos, len);
+        pos += len;
+        if (!get(pos, end, size, 8)) {
+          return primer::error{"malformed sectioned snapshot"};
+        }
+        result->push_back(
+          snapshot_section{std::move(name), nullptr,
+                           static_cast<std::size_t>(size)});
+      }
+      for (auto & s : *result) {
+        if (s.size > static_cast<std::size_t>(end - pos)) {
+          return primer::error{"malformed sectioned snapshot"};
+        }
+        s.data = pos;
+        pos += s.size;
+      }
+    }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+
+    if (result->empty() || !result->front().name.empty()) {
+      return primer::error{"sectioned snapshot has no main section"};
+    }
+    return result;
+  }
+};
+
+} // end namespace detail
+} // end namespace primer
@@ -0,0 +1,487 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Deduplicated storage of many snapshots.
+ *
+ * When a host runs many similar lua states, e.g. one per player, all made from
+ * the same scripts, their snapshots have most of their bytes in common. A
+ * `snapshot_store` splits each snapshot into chunks at content-defined
+ * boundaries, the same as `make_snapshot_delta`, and keeps each distinct chunk
+ * only once, with a count of the snapshots using it. Each snapshot is then
+ * just a manifest, a list of chunks, under a key.
+ *
+ * A snapshot can be put into the store from a string, or streamed into it by
+ * a `writer`, which is a sink for `persistable::persist_chunked`. A `reader`
+ * streams it back out, as a source for `persistable::unpersist_chunked`, so
+ * that the whole snapshot never needs to be in one buffer.
+ *
+ * ```
+ *   auto w = store.make_writer("vm 12");
+ *   if (auto ok = api.persist_chunked(L, w)) { ok = w.commit(); }
+ *   ...
+ *   auto r = store.make_reader("vm 12");
+ *   if (r) { api.unpersist_chunked(L, *r); }
+ * ```
+ *
+ * The whole store can be serialized with `write`, and loaded with `read`.
+ *
+ * Like the delta functions, the store doesn't touch a lua state. A reader is
+ * invalidated by any modification of the store.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/api/snapshot_delta.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+namespace api {
+
+class snapshot_store {
+  using format = primer::detail::snapshot_delta_format;
+
+  static const char * magic() noexcept { return "PRS1"; }
+  static std::size_t npos() noexcept { return static_cast<std::size_t>(-1); }
+
+  struct chunk {
+    std::string data;
+    std::uint64_t hash;
+    std::size_t refs;
+  };
+
+  struct manifest {
+    std::vector<std::size_t> ids;
+    std::size_t size;
+  };
+
+  std::vector<chunk> chunks_;
+  // Unused slots of chunks_. Its capacity is kept at least chunks_.size(), so
+  // that releasing a chunk can't fail.
+  std::vector<std::size_t> free_;
+  std::unordered_multimap<std::uint64_t, std::size_t> index_;
+  std::map<std::string, manifest> manifests_;
+  std::size_t stored_bytes_ = 0;
+  std::size_t logical_bytes_ = 0;
+
+  // Gives a reference to the chunk with these contents, adding it if needed.
+  // Strong exception guarantee.
+  std::size_t intern(const char * data, std::size_t size) {
+    const std::uint64_t h = format::hash(data, size);
+    auto range = index_.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it) {
+      chunk & c = chunks_[it->second];
+      if (c.data.size() == size && !std::memcmp(c.data.data(), data, size)) {
+        ++c.refs;
+        return it->second;
+      }
+    }
+
+    std::string copy{data, size};
+    std::size_t id;
+    if (free_.empty()) {
+      free_.reserve(chunks_.size() + 1);
+      id = chunks_.size();
+      chunks_.push_back(chunk{std::string{}, 0, 0});
+    } else {
+      id = free_.back();
+      free_.pop_back();
+    }
+
+    PRIMER_TRY { index_.emplace(h, id); }
+    PRIMER_CATCH(...) {
+      free_.push_back(id);
+      PRIMER_RETHROW;
+    }
+
+    chunk & c = chunks_[id];
+    c.data.swap(copy);
+    c.hash = h;
+    c.refs = 1;
+    stored_bytes_ += size;
+    return id;
+  }
+
+  void release(std::size_t id) noexcept {
+    chunk & c = chunks_[id];
+    if (--c.refs) { return; }
+
+    auto range = index_.equal_range(c.hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      if (it->second == id) {
+        index_.erase(it);
+        break;
+      }
+    }
+    stored_bytes_ -= c.data.size();
+    std::string{}.swap(c.data);
+    free_.push_back(id);
+  }
+
+  void release(const std::vector<std::size_t> & ids) noexcept {
+    for (std::size_t id : ids) {
+      if (id != npos()) { this->release(id); }
+    }
+  }
+
+  // Splits `data` into chunks, appending references to `ids`. On failure,
+  // `ids` ends with npos, and the caller releases it.
+  void intern_all(const char * data, std::size_t size,
+                  std::vector<std::size_t> & ids) {
+    for (std::size_t pos = 0; pos < size;) {
+      const std::size_t len = format::next_chunk(data + pos, size - pos);
+      ids.push_back(npos());
+      ids.back() = this->intern(data + pos, len);
+      pos += len;
+    }
+  }
+
+  // Puts `ids` under `key`, releasing what was there before, or releases
+  // `ids` on failure. Doesn't throw.
+  expected<void> install(const std::string & key,
+                         std::vector<std::size_t> & ids,
+                         std::size_t size) noexcept {
+    PRIMER_TRY_BAD_ALLOC {
+      auto r = manifests_.emplace(key, manifest{{}, 0});
+      manifest & m = r.first->second;
+      m.ids.swap(ids);
+      logical_bytes_ -= m.size;
+      logical_bytes_ += size;
+      m.size = size;
+      this->release(ids);
+      ids.clear();
+    }
+    PRIMER_CATCH_BAD_ALLOC {
+      this->release(ids);
+      ids.clear();
+      return primer::error::bad_alloc();
+    }
+    return {};
+  }
+
+  const manifest * find(const std::string & key) const noexcept {
+    auto it = manifests_.find(key);
+    return it == manifests_.end() ? nullptr : &it->second;
+  }
+
+public:
+  snapshot_store() = default;
+  snapshot_store(snapshot_store &&) = default;
+  snapshot_store & operator=(snapshot_store &&) = default;
+
+  void swap(snapshot_store & other) noexcept {
+    chunks_.swap(other.chunks_);
+    free_.swap(other.free_);
+    index_.swap(other.index_);
+    manifests_.swap(other.manifests_);
+    std::swap(stored_bytes_, other.stored_bytes_);
+    std::swap(logical_bytes_, other.logical_bytes_);
+  }
+
+  /***
+   * Stores a snapshot under `key`, replacing any snapshot already there. On
+   * failure, the store is unchanged.
+   */
+  expected<void> put(const std::string & key, const char * data,
+                     std::size_t size) noexcept {
+    std::vector<std::size_t> ids;
+    PRIMER_TRY_BAD_ALLOC {
+      ids.reserve(size / (format::min_chunk + format::boundary_mask) + 1);
+      this->intern_all(data, size, ids);
+    }
+    PRIMER_CATCH_BAD_ALLOC {
+      this->release(ids);
+      return primer::error::bad_alloc();
+    }
+    return this->install(key, ids, size);
+  }
+
+  expected<void> put(const std::string & key,
+                     const std::string & snapshot) noexcept {
+    return this->put(key, snapshot.data(), snapshot.size());
+  }
+
+  /***
+   * Streams a snapshot into the store. It is a sink for `persist_chunked`, and
+   * the snapshot is stored only by `commit`. If the writer is destroyed
+   * without committing, the store is unchanged.
+   */
+  class writer {
+    snapshot_store * store_;
+    std::string key_;
+    std::vector<std::size_t> ids_;
+    std::string pending_;
+    std::size_t size_ = 0;
+    bool failed_ = false;
+
+    friend class snapshot_store;
+    writer(snapshot_store & s, std::string key)
+      : store_(&s)
+      , key_(std::move(key)) {}
+
+    // Chunks all of `pending_` if `last`, otherwise only while the boundary
+    // can't depend on bytes to come
+    void cut(bool last) {
+      std::size_t pos = 0;
+      const std::size_t size = pending_.size();
+      while (pos < size && (last || size - pos >= format::max_chunk)) {
+        const std::size_t len =
+          format::next_chunk(pending_.data() + pos, size - pos);
+        ids_.push_back(npos());
+        ids_.back() = store_->intern(pending_.data() + pos, len);
+        pos += len;
+      }
+      pending_.erase(0, pos);
+    }
+
+  public:
+    writer(writer && o) noexcept
+      : store_(o.store_)
+      , key_(std::move(o.key_))
+      , ids_(std::move(o.ids_))
+      , pending_(std::move(o.pending_))
+      , size_(o.size_)
+      , failed_(o.failed_) {
+      o.store_ = nullptr;
+    }
+
+    ~writer() noexcept {
+      if (store_) { store_->release(ids_); }
+    }
+
+    bool operator()(const char * data, std::size_t size) noexcept {
+      if (!store_ || failed_) { return false; }
+      PRIMER_TRY_BAD_ALLOC {
+        pending_.append(data, size);
+        size_ += size;
+        this->cut(false);
+      }
+      PRIMER_CATCH_BAD_ALLOC { failed_ = true; }
+      return !failed_;
+    }
+
+    expected<void> commit() noexcept {
+      if (!store_) { return primer::error{"snapshot writer already committed"}; }
+      if (!failed_) {
+        PRIMER_TRY_BAD_ALLOC { this->cut(true); }
+        PRIMER_CATCH_BAD_ALLOC { failed_ = true; }
+      }
+      snapshot_store * s = store_;
+      store_ = nullptr;
+      if (failed_) {
+        s->release(ids_);
+        return primer::error::bad_alloc();
+      }
+      return s->install(key_, ids_, size_);
+    }
+  };
+
+  writer make_writer(std::string key) { return writer{*this, std::move(key)}; }
+
+  /***
+   * Streams a snapshot out of the store. It is a source for
+   * `unpersist_chunked`.
+   */
+  class reader {
+    const snapshot_store * store_;
+    const std::vector<std::size_t> * ids_;
+    std::size_t next_ = 0;
+    std::size_t offset_ = 0;
+
+    friend class snapshot_store;
+    reader(const snapshot_store & s, const std::vector<std::size_t> & ids)
+      : store_(&s)
+      , ids_(&ids) {}
+
+  public:
+    std::size_t operator()(char * buf, std::size_t size) noexcept {
+      std::size_t filled = 0;
+      while (filled < size && next_ < ids_->size()) {
+        const std::string & c = store_->chunks_[(*ids_)[next_]].data;
+        std::size_t n = c.size() - offset_;
+        if (n > size - filled) { n = size - filled; }
+        std::memcpy(buf + filled, c.data() + offset_, n);
+        filled += n;
+        offset_ += n;
+        if (offset_ == c.size()) {
+          ++next_;
+          offset_ = 0;
+        }
+      }
+      return filled;
+    }
+  };
+
+  expected<reader> make_reader(const std::string & key) const noexcept {
+    if (const manifest * m = this->find(key)) { return reader{*this, m->ids}; }
+    return primer::error{"no snapshot '", key, "'"};
+  }
+
+  /***
+   * Copies out the snapshot stored under `key`.
+   */
+  expected<void> get(const std::string & key, std::string & output) const
+    noexcept {
+    const manifest * m = this->find(key);
+    if (!m) { return primer::error{"no snapshot '", key, "'"}; }
+    PRIMER_TRY_BAD_ALLOC {
+      output.clear();
+      output.reserve(m->size);
+      for (std::size_t id : m->ids) {
+        output.append(chunks_[id].data);
+      }
+    }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+    return {};
+  }
+
+  bool contains(const std::string & key) const noexcept {
+    return this->find(key);
+  }
+
+  /***
+   * Drops the snapshot stored under `key`, and any chunks only it used.
+   */
+  bool erase(const std::string & key) noexcept {
+    auto it = manifests_.find(key);
+    if (it == manifests_.end()) { return false; }
+    this->release(it->second.ids);
+    logical_bytes_ -= it->second.size;
+    manifests_.erase(it);
+    return true;
+  }
+
+  // The number of snapshots
+  std::size_t size() const noexcept { return manifests_.size(); }
+  // The number of distinct chunks
+  std::size_t chunk_count() const noexcept { return index_.size(); }
+  // The bytes held in distinct chunks
+  std::size_t stored_bytes() const noexcept { return stored_bytes_; }
+  // The total size of the snapshots
+  std::size_t logical_bytes() const noexcept { return logical_bytes_; }
+
+  /***
+   * Serializes the store, with its chunks renumbered densely.
+   */
+  expected<void> write(std::string & output) const noexcept {
+    PRIMER_TRY_BAD_ALLOC {
+      std::vector<std::size_t> dense(chunks_.size(), npos());
+      output.clear();
+      output.append(magic(), format::magic_size);
+      format::put_u64(output, index_.size());
+      std::size_t count = 0;
+      for (std::size_t id = 0; id < chunks_.size(); ++id) {
+        if (chunks_[id].refs) {
+          dense[id] = count++;
+          format::put_u64(output, chunks_[id].data.size());
+          output.append(chunks_[id].data);
+        }
+      }
+      format::put_u64(output, manifests_.size());
+      for (const auto & p : manifests_) {
+        format::put_u64(output, p.first.size());
+        output.append(p.first);
+        format::put_u64(output, p.second.ids.size());
+        for (std::size_t id : p.second.ids) {
+          format::put_u64(output, dense[id]);
+        }
+      }
+    }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+    return {};
+  }
+
+  /***
+   * Replaces the contents of the store with the output of `write`. On failure,
+   * the store is unchanged.
+   */
+  expected<void> read(const std::string & input) noexcept {
+    const char * pos = input.data();
+    const char * end = pos + input.size();
+    const primer::error malformed{"malformed snapshot store"};
+
+    if (input.size() < format::magic_size
+        || std::memcmp(pos, magic(), format::magic_size)) {
+      return malformed;
+    }
+    pos += format::magic_size;
+
+    snapshot_store result;
+    PRIMER_TRY_BAD_ALLOC {
+      // Chunks are interned again, so that duplicates in the input merge, and
+      // each is given its references by the manifests.
+      std::uint64_t count, len;
+      if (!format::get_u64(pos, end, count)
+          || count > static_cast<std::uint64_t>(end - pos) / 8) {
+        return malformed;
+      }
+      std::vector<std::pair<const char *, std::size_t>> spans;
+      spans.reserve(count);
+      for (std::uint64_t i = 0; i < count; ++i) {
+        if (!format::get_u64(pos, end, len)
+            || len > static_cast<std::uint64_t>(end - pos)) {
+          return malformed;
+        }
+        spans.emplace_back(pos, len);
+        pos += len;
+      }
+
+      std::uint64_t manifests;
+      if (!format::get_u64(pos, end, manifests)) { return malformed; }
+      std::vector<std::size_t> ids;
+      for (std::uint64_t i = 0; i < manifests; ++i) {
+        std::uint64_t n;
+        if (!format::get_u64(pos, end, len)
+            || len > static_cast<std::uint64_t>(end - pos)) {
+          return malformed;
+        }
+        std::string key{pos, static_cast<std::size_t>(len)};
+        pos += len;
+        if (!format::get_u64(pos, end, n)
+            || n > static_cast<std::uint64_t>(end - pos) / 8) {
+          return malformed;
+        }
+
+        ids.clear();
+        std::size_t size = 0;
+        for (std::uint64_t j = 0; j < n; ++j) {
+          std::uint64_t c = 0;
+          format::get_u64(pos, end, c);
+          if (c >= count) { return malformed; }
+          ids.push_back(npos());
+          ids.back() = result.intern(spans[c].first, spans[c].second);
+          size += spans[c].second;
+        }
+        auto ok = result.install(key, ids, size);
+        if (!ok) { return ok; }
+      }
+      if (pos != end) { return malformed; }
+    }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+
+    this->swap(result);
+    return {};
+  }
+};
+
+} // end namespace api
+
+} // end namespace primer
@@ -0,0 +1,484 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_timers_overview
+/*`
+`primer::api::timers` is an API feature which lets scripts schedule delayed
+callbacks, e.g. thousands of them for the effects and cooldowns of a game.
+
+``
+  local id = after(2.5, function() door:close() end)
+  ...
+  cancel_timer(id)
+``
+
+The host advances time, in seconds, once per frame:
+
+``
+  timers_.advance(dt);
+``
+
+Time is counted in ticks of `resolution` seconds, `0.01` by default, and a
+callback is called on the first tick at or after its delay, and at least one
+tick later. The timers are kept in a hierarchical timer wheel: four levels of
+64 slots, each slot a list of the timers which expire within its span. So
+adding and cancelling a timer are constant time, and a timer is moved down a
+level at most three times before it fires. A timer which is further away than
+the wheel reaches, about 46 hours at the default resolution, is kept in the
+last slot it reaches, and placed again when that slot comes around.
+
+The callbacks are kept in one lua table, indexed by the slot of the timer,
+rather than one reference each. `advance` makes one protected call, fetches
+the error handler once, and calls every expired callback within it. An error
+in one callback is captured with the handler, and kept until `take_errors()`,
+and the rest are still called.
+
+`after(delay, fn)` returns an id, and `cancel_timer(id)` returns whether the
+timer was still pending. A callback may add and cancel timers. One which is
+added with a delay of zero is called on the next tick.
+
+Pending timers, and the current time, are saved with the state by `persist`.
+The ids held by scripts remain valid when it is restored.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/api/self_closures.hpp>
+#include <primer/cpp_pcall.hpp>
+#include <primer/error.hpp>
+#include <primer/error_handler.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/function.hpp>
+#include <primer/support/function_check_stack.hpp>
+#include <primer/support/function_return.hpp>
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+class timers {
+public:
+  using timer_id = lua_Integer;
+
+  PRIMER_STATIC_ASSERT(sizeof(lua_Integer) >= 8,
+                       "timer ids need a 64 bit lua integer");
+
+private:
+  static constexpr int level_bits = 6;
+  static constexpr int level_slots = 1 << level_bits;
+  static constexpr int levels = 4;
+  // After the slots of the wheels, the list of the timers which are firing
+  static constexpr int firing = levels * level_slots;
+
+  struct node {
+    std::uint64_t expiry = 0;
+    int prev = -1;
+    int next = -1;
+    int list = -1; // -1 if the node is free
+    std::uint32_t generation = 0;
+  };
+
+  double resolution_;
+  double carry_ = 0;      // Seconds which are not yet a whole tick
+  std::uint64_t now_ = 0; // In ticks
+  std::vector<node> nodes_;
+  int free_ = -1; // Free nodes, linked by `next`
+  std::array<int, firing + 1> heads_;
+  std::size_t size_ = 0;
+  std::size_t level0_size_ = 0;
+  lua_ref callbacks_; // t[i + 1] is the callback of node i
+  std::vector<primer::error> errors_;
+
+  void reset() noexcept {
+    carry_ = 0;
+    now_ = 0;
+    nodes_.clear();
+    free_ = -1;
+    heads_.fill(-1);
+    size_ = 0;
+    level0_size_ = 0;
+  }
+
+  void link(int i, int list) noexcept {
+    node & n = nodes_[i];
+    n.list = list;
+    n.prev = -1;
+    n.next = heads_[list];
+    if (n.next >= 0) { nodes_[n.next].prev = i; }
+    heads_[list] = i;
+    if (list < level_slots) { ++level0_size_; }
+  }
+
+  void unlink(int i) noexcept {
+    node & n = nodes_[i];
+    if (n.prev >= 0) {
+      nodes_[n.prev].next = n.next;
+    } else {
+      heads_[n.list] = n.next;
+    }
+    if (n.next >= 0) { nodes_[n.next].prev = n.prev; }
+    if (n.list < level_slots) { --level0_size_; }
+    n.list = -1;
+  }
+
+  void release(int i) noexcept {
+    node & n = nodes_[i];
+    n.generation = (n.generation + 1) & 0x7fffffff;
+    n.next = free_;
+    free_ = i;
+    --size_;
+  }
+
+  // Puts the node in the slot for its expiry, on the lowest level which
+  // reaches it
+  void schedule(int i) noexcept {
+    const std::uint64_t expiry =
+      nodes_[i].expiry > now_ ? nodes_[i].expiry : now_;
+    const std::uint64_t delta = expiry - now_;
+    for (int level = 0; level < levels; ++level) {
+      const int shift = level_bits * level;
+      if (delta < (std::uint64_t{1} << (shift + level_bits))) {
+        this->link(i, level * level_slots
+                        + static_cast<int>((expiry >> shift)
+                                           & (level_slots - 1)));
+        return;
+      }
+    }
+    // As far as the wheel reaches
+    const int shift = level_bits * (levels - 1);
+    const std::uint64_t reach =
+      now_ + (std::uint64_t{1} << (level_bits * levels)) - 1;
+    this->link(i, (levels - 1) * level_slots
+                    + static_cast<int>((reach >> shift) & (level_slots - 1)));
+  }
+
+  // Places the timers of a slot again, on lower levels
+  void cascade(int list) noexcept {
+    while (heads_[list] >= 0) {
+      const int i = heads_[list];
+      this->unlink(i);
+      this->schedule(i);
+    }
+  }
+
+  // With the callbacks table and the error handler on the stack
+  void tick(lua_State * L, int callbacks, int handler, std::size_t & fired) {
+    ++now_;
+    for (int level = 1; level < levels; ++level) {
+      const int shift = level_bits * level;
+      if (now_ & ((std::uint64_t{1} << shift) - 1)) { break; }
+      this->cascade(level * level_slots
+                    + static_cast<int>((now_ >> shift) & (level_slots - 1)));
+    }
+
+    const int list = static_cast<int>(now_ & (level_slots - 1));
+    while (heads_[list] >= 0) {
+      const int i = heads_[list];
+      this->unlink(i);
+      this->link(i, firing);
+    }
+
+    // A callback may cancel the timers after it, which unlinks them from here
+    while (heads_[firing] >= 0) {
+      const int i = heads_[firing];
+      this->unlink(i);
+      lua_rawgeti(L, callbacks, i + 1);
+      lua_pushnil(L);
+      lua_rawseti(L, callbacks, i + 1);
+      this->release(i);
+
+      expected<void> r;
+      primer::detail::pinned_fcn_call<void,
+                                      primer::detail::read_return_helper<void>>(
+        r, L, 0, handler);
+      ++fired;
+      if (!r) {
+        PRIMER_TRY_BAD_ALLOC { errors_.emplace_back(std::move(r.err())); }
+        PRIMER_CATCH_BAD_ALLOC {}
+      }
+    }
+  }
+
+  timer_id id_of(int i) const noexcept {
+    return static_cast<timer_id>(
+      (static_cast<std::uint64_t>(nodes_[i].generation) << 32)
+      | static_cast<std::uint64_t>(i + 1));
+  }
+
+  // The node of a pending timer, or -1
+  int find(timer_id id) const noexcept {
+    const auto u = static_cast<std::uint64_t>(id);
+    const std::uint64_t index = (u & 0xffffffff) - 1;
+    if (id <= 0 || index >= nodes_.size()) { return -1; }
+    const node & n = nodes_[static_cast<std::size_t>(index)];
+    if (n.list < 0 || n.generation != (u >> 32)) { return -1; }
+    return static_cast<int>(index);
+  }
+
+  bool cancel_impl(lua_State * L, timer_id id) noexcept {
+    const int i = this->find(id);
+    if (i < 0 || !lua_checkstack(L, 2)) { return false; }
+    this->unlink(i);
+    // The entry exists, so this doesn't allocate
+    callbacks_.push(L);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, i + 1);
+    lua_pop(L, 1);
+    this->release(i);
+    return true;
+  }
+
+  static int intf_after(lua_State * L) {
+    timers * self = recover_self_upvalue<timers>(L);
+    const double delay = static_cast<double>(luaL_checknumber(L, 1));
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+    lua_pushinteger(L, self->after(L, delay));
+    return 1;
+  }
+
+  static int intf_cancel(lua_State * L) {
+    timers * self = recover_self_upvalue<timers>(L);
+    const timer_id id = luaL_checkinteger(L, 1);
+    lua_pushboolean(L, self->cancel_impl(L, id));
+    return 1;
+  }
+
+  static std::array<const luaL_Reg, 2> get_funcs() {
+    std::array<const luaL_Reg, 2> funcs = {{
+      luaL_Reg{"after", &intf_after},
+      luaL_Reg{"cancel_timer", &intf_cancel},
+    }};
+    return funcs;
+  }
+
+public:
+  explicit timers(double resolution = 0.01) noexcept
+    : resolution_(resolution > 0 ? resolution : 0.01) {
+    this->reset();
+  }
+
+  timers(const timers &) = delete;
+  timers & operator=(const timers &) = delete;
+
+  double resolution() const noexcept { return resolution_; }
+
+  // The time since the feature was initialized, in seconds
+  double now() const noexcept {
+    return static_cast<double>(now_) * resolution_ + carry_;
+  }
+
+  // The number of pending timers
+  std::size_t size() const noexcept { return size_; }
+
+  // Pops the function on top of the stack, and calls it after `delay` seconds
+  // Note: Can cause lua memory allocation failure
+  timer_id after(lua_State * L, double delay) {
+    std::uint64_t ticks = 1;
+    if (delay > resolution_) {
+      const double t = std::ceil(delay / resolution_);
+      ticks = t < 4e18 ? static_cast<std::uint64_t>(t) : 4000000000000000000u;
+    }
+
+    if (free_ < 0 && nodes_.size() == nodes_.capacity()) {
+      bool failed = false;
+      PRIMER_TRY_BAD_ALLOC {
+        nodes_.reserve(nodes_.empty() ? 16 : 2 * nodes_.size());
+      }
+      PRIMER_CATCH_BAD_ALLOC { failed = true; }
+      if (failed) { luaL_error(L, "not enough memory"); }
+    }
+
+    const int i = free_ >= 0 ? free_ : static_cast<int>(nodes_.size());
+    callbacks_.push(L);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, i + 1);
+    lua_pop(L, 1);
+
+    if (free_ >= 0) {
+      free_ = nodes_[i].next;
+    } else {
+      nodes_.emplace_back();
+    }
+    nodes_[i].expiry = now_ + ticks;
+    this->schedule(i);
+    ++size_;
+    return this->id_of(i);
+  }
+
+  // Returns false if the timer has fired, or was cancelled
+  bool cancel(timer_id id) noexcept {
+    lua_State * L = callbacks_.lock();
+    return L && this->cancel_impl(L, id);
+  }
+
+  // Advances time, and calls the callbacks of the timers which expire, in one
+  // protected call. Returns the number of callbacks which were called.
+  std::size_t advance(double seconds) noexcept {
+    lua_State * L = callbacks_.lock();
+    if (!L || !(seconds > 0)) { return 0; }
+
+    carry_ += seconds;
+    const double whole = std::floor(carry_ / resolution_);
+    if (whole < 1) { return 0; }
+    carry_ = carry_ > whole * resolution_ ? carry_ - whole * resolution_ : 0;
+    const std::uint64_t target = now_ + static_cast<std::uint64_t>(whole);
+
+    std::size_t fired = 0;
+    if (size_) {
+      auto ok = primer::detail::check_stack_push_n(L, 4);
+      if (ok) {
+        ok = primer::mem_pcall(L, [this, L, target, &fired]() {
+          primer::get_error_handler(L);
+          const int handler = lua_gettop(L);
+          callbacks_.push(L);
+          while (now_ < target && size_) {
+            if (!level0_size_) {
+              // Nothing fires before the next cascade
+              const std::uint64_t skip = now_ | (level_slots - 1);
+              if (skip >= target) { break; }
+              now_ = skip;
+            }
+            this->tick(L, handler + 1, handler, fired);
+          }
+          lua_settop(L, handler - 1);
+        });
+      }
+      // Time stands still, so that no slot is skipped
+      if (!ok) {
+        PRIMER_TRY_BAD_ALLOC { errors_.emplace_back(std::move(ok.err())); }
+        PRIMER_CATCH_BAD_ALLOC {}
+        return fired;
+      }
+    }
+    now_ = target;
+    return fired;
+  }
+
+  // Errors raised by callbacks since the last call
+  std::vector<primer::error> take_errors() noexcept {
+    std::vector<primer::error> result;
+    result.swap(errors_);
+    return result;
+  }
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    this->reset();
+    lua_newtable(L);
+    callbacks_ = lua_ref{L};
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    api::set_self_closures(L, get_funcs(), this);
+    lua_pop(L, 1);
+  }
+
+  void on_persist_table(lua_State * L) {
+    api::set_self_closures_prefix_reverse(L, "timers__", get_funcs());
+  }
+
+  void on_unpersist_table(lua_State * L) {
+    api::set_self_closures_prefix(L, "timers__", get_funcs(), this);
+  }
+
+  void on_serialize(lua_State * L) {
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, static_cast<lua_Integer>(now_));
+    lua_setfield(L, -2, "now");
+    lua_pushnumber(L, static_cast<lua_Number>(carry_));
+    lua_setfield(L, -2, "carry");
+    callbacks_.push(L);
+    lua_setfield(L, -2, "callbacks");
+
+    // Of every node, so that stale ids stay stale
+    lua_createtable(L, static_cast<int>(nodes_.size()), 0);
+    lua_createtable(L, 0, static_cast<int>(size_));
+    for (std::size_t i = 0; i < nodes_.size(); ++i) {
+      const int key = static_cast<int>(i) + 1;
+      lua_pushinteger(L, static_cast<lua_Integer>(nodes_[i].generation));
+      lua_rawseti(L, -3, key);
+      if (nodes_[i].list >= 0) {
+        lua_pushinteger(L, static_cast<lua_Integer>(nodes_[i].expiry));
+        lua_rawseti(L, -2, key);
+      }
+    }
+    lua_setfield(L, -3, "expiry");
+    lua_setfield(L, -2, "generation");
+  }
+
+  void on_deserialize(lua_State * L) {
+    if (!lua_istable(L, -1)) {
+      lua_pop(L, 1);
+      return;
+    }
+    this->reset();
+
+    lua_getfield(L, -1, "generation");
+    const int n = lua_istable(L, -1) ? static_cast<int>(lua_rawlen(L, -1)) : 0;
+    bool failed = false;
+    PRIMER_TRY_BAD_ALLOC { nodes_.resize(static_cast<std::size_t>(n)); }
+    PRIMER_CATCH_BAD_ALLOC { failed = true; }
+    if (failed) { luaL_error(L, "not enough memory"); }
+
+    lua_getfield(L, -2, "now");
+    now_ = static_cast<std::uint64_t>(lua_tointeger(L, -1));
+    lua_getfield(L, -3, "carry");
+    carry_ = static_cast<double>(lua_tonumber(L, -1));
+    lua_pop(L, 2);
+
+    lua_getfield(L, -2, "expiry");
+    if (!lua_istable(L, -1)) {
+      lua_pop(L, 1);
+      lua_newtable(L);
+    }
+    for (int i = n - 1; i >= 0; --i) {
+      node & nd = nodes_[static_cast<std::size_t>(i)];
+      lua_rawgeti(L, -2, i + 1);
+      nd.generation = static_cast<std::uint32_t>(lua_tointeger(L, -1));
+      lua_rawgeti(L, -2, i + 1);
+      if (lua_isinteger(L, -1)) {
+        const auto expiry = static_cast<std::uint64_t>(lua_tointeger(L, -1));
+        nd.expiry = expiry > now_ ? expiry : now_ + 1;
+        this->schedule(i);
+        ++size_;
+      } else {
+        nd.next = free_;
+        free_ = i;
+      }
+      lua_pop(L, 2);
+    }
+    lua_pop(L, 2);
+
+    lua_getfield(L, -1, "callbacks");
+    if (lua_istable(L, -1)) {
+      callbacks_ = lua_ref{L};
+    } else {
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+};
+
+} // end namespace api
+} // end namespace primer
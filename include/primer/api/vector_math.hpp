@@ -0,0 +1,187 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_api_vector_math_overview
+/*`
+`primer::api::vector_math` is an API feature which gives scripts the small
+vector types of `<primer/vector_math.hpp>`, in a table of these functions:
+
+[table
+[[Function] [Result]]
+[[`vec2(x, y)`, `vec3(x, y, z)`, `vec4(x, y, z, w)`] [A new vector. Missing
+  components are zero.]]
+[[`quat(x, y, z, w)`] [A new quaternion, by default the identity.]]
+[[`axis_angle(axis, angle)`] [The quaternion which rotates by `angle`
+  radians around the `vec3` `axis`.]]
+[[`transform(q, offset, points)`] [Rotates the points of a typed array of
+  numbers, as consecutive x, y, z, in place by the unit quaternion `q`, and
+  adds the `vec3` `offset`, which may be `nil`. Returns `points`.]]
+]
+
+``
+  local v = vec.vec3(1, 2, 3)
+  local w = (v + v:normalize() * 2):cross(vec.vec3(0, 0, 1))
+``
+
+The table is put in a global, by default `vec`. The functions, the methods
+and the metamethods of the types are added to the permanent objects table,
+so scripts which hold them, and the vectors themselves, can be persisted.
+
+``
+  API_FEATURE(primer::api::vector_math, vec_);
+``
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/metatable.hpp>
+#include <primer/set_funcs.hpp>
+#include <primer/support/permanents_helper.hpp>
+#include <primer/typed_array.hpp>
+#include <primer/userdata.hpp>
+#include <primer/vector_math.hpp>
+
+#include <primer/detail/span.hpp>
+
+#include <array>
+#include <cstddef>
+#include <string>
+
+namespace primer {
+
+namespace detail {
+
+template <typename V>
+int
+vector_construct(lua_State * L) {
+  V v;
+  for (int i = 0; i < vector_size<V>::value; ++i) {
+    vector_data(v)[i] = luaL_optnumber(L, i + 1, 0);
+  }
+  return vector_lua<V>::push(L, v);
+}
+
+template <>
+inline int
+vector_construct<quat>(lua_State * L) {
+  return vector_lua<quat>::push(
+    L, quat{luaL_optnumber(L, 1, 0), luaL_optnumber(L, 2, 0),
+            luaL_optnumber(L, 3, 0), luaL_optnumber(L, 4, 1)});
+}
+
+inline int
+vector_axis_angle(lua_State * L) {
+  return vector_lua<quat>::push(
+    L, primer::quat_from_axis_angle(vector_lua<vec3>::check(L, 1),
+                                    luaL_checknumber(L, 2)));
+}
+
+inline int
+vector_transform(lua_State * L) {
+  const quat & q = vector_lua<quat>::check(L, 1);
+  const vec3 offset =
+    lua_isnoneornil(L, 2) ? vec3{0, 0, 0} : vector_lua<vec3>::check(L, 2);
+  auto * points = primer::test_udata<typed_array<lua_Number>>(L, 3);
+  if (!points) {
+    return luaL_error(L, "Expected a typed array of numbers, found %s",
+                      luaL_typename(L, 3));
+  }
+  if (points->size() % 3) {
+    return luaL_error(L, "Expected x, y, z triples, found %d numbers",
+                      static_cast<int>(points->size()));
+  }
+  primer::transform_points(q, offset, points->data(), points->size() / 3);
+  lua_settop(L, 3);
+  return 1;
+}
+
+} // end namespace detail
+
+namespace api {
+
+class vector_math {
+  const char * global_;
+
+  template <typename V>
+  static std::string prefix() {
+    return std::string{"vector_math."}
+           + detail::vector_type_name(static_cast<V *>(nullptr)) + ".";
+  }
+
+  // The methods and metamethods of `V`, and its reconstructor
+  template <typename V>
+  static void type_permanents(lua_State * L, bool reverse) {
+    using lua_t = detail::vector_lua<V>;
+    const std::string p = prefix<V>();
+    if (reverse) {
+      primer::set_funcs_prefix_reverse(L, p, lua_t::methods());
+      primer::set_funcs_prefix_reverse(L, p,
+                                       detail::vector_extra_methods<V>::list());
+      primer::set_funcs_prefix_reverse(L, p, lua_t::metamethods());
+      detail::permanents_helper<V>::populate_reverse(L);
+    } else {
+      primer::set_funcs_prefix(L, p, lua_t::methods());
+      primer::set_funcs_prefix(L, p, detail::vector_extra_methods<V>::list());
+      primer::set_funcs_prefix(L, p, lua_t::metamethods());
+      detail::permanents_helper<V>::populate(L);
+    }
+  }
+
+  static void permanents(lua_State * L, bool reverse) {
+    if (reverse) {
+      primer::set_funcs_prefix_reverse(L, "vector_math.", functions());
+    } else {
+      primer::set_funcs_prefix(L, "vector_math.", functions());
+    }
+    type_permanents<vec2>(L, reverse);
+    type_permanents<vec3>(L, reverse);
+    type_permanents<vec4>(L, reverse);
+    type_permanents<quat>(L, reverse);
+  }
+
+public:
+  static detail::span<const luaL_Reg> functions() {
+    static const luaL_Reg list[] = {
+      {"vec2", &detail::vector_construct<vec2>},
+      {"vec3", &detail::vector_construct<vec3>},
+      {"vec4", &detail::vector_construct<vec4>},
+      {"quat", &detail::vector_construct<quat>},
+      {"axis_angle", &detail::vector_axis_angle},
+      {"transform", &detail::vector_transform},
+    };
+    return list;
+  }
+
+  explicit vector_math(const char * global = "vec")
+    : global_(global) {}
+
+  //
+  // API Feature
+  //
+
+  void on_init(lua_State * L) {
+    primer::init_metatable<vec2>(L);
+    primer::init_metatable<vec3>(L);
+    primer::init_metatable<vec4>(L);
+    primer::init_metatable<quat>(L);
+
+    lua_newtable(L);
+    primer::set_funcs(L, functions());
+    lua_setglobal(L, global_);
+  }
+
+  void on_persist_table(lua_State * L) { permanents(L, true); }
+
+  void on_unpersist_table(lua_State * L) { permanents(L, false); }
+};
+
+} // end namespace api
+} // end namespace primer
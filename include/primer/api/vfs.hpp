@@ -12,17 +12,23 @@ PRIMER_ASSERT_FILESCOPE;
 #include <primer/lua.hpp>
 
 #include <primer/adapt.hpp>
+#include <primer/api/self_closures.hpp>
 #include <primer/cpp_pcall.hpp>
+#include <primer/detail/rank.hpp>
 #include <primer/error_capture.hpp>
-#include <primer/registry_helper.hpp>
-#include <primer/set_funcs.hpp>
+#include <primer/expected.hpp>
 #include <primer/support/asserts.hpp>
 #include <primer/support/function.hpp>
 
+#include <algorithm>
 #include <array>
+#include <cstdint>
+#include <map>
+#include <set>
 #include <string>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 //[ primer_vfs_overview
 /*`
@@ -45,6 +51,33 @@ either call `luaL_loadbuffer` to load a chunk onto the stack and return
 message regarding the path.
 
 The vfs can then be constructed from a pointer to an instance of your class.
+
+The modules which `require` has loaded through the vfs are persisted along with
+the state, so that they aren't loaded again after it is restored.
+*/
+//]
+
+//[ primer_vfs_reload
+/*`
+The vfs also records which modules each module required while it loaded, so
+that a change can be reloaded without starting over. `reload(L, paths)` loads
+the given modules again, and every module which depends on them, directly or
+not, and leaves the others as they are. The modules are loaded again in the
+order they first finished loading, so a module is reloaded after the modules
+it requires. If one fails, the modules which weren't reloaded yet keep their
+old values, and the error is returned.
+
+If the provider also has
+*/
+//= std::uint64_t source_hash(const std::string & path)
+/*`
+for instance computed with `bytecode_cache::hash_source`, the vfs remembers
+the hash of each module when it is loaded, and `changed_modules()` lists the
+ones whose source is different now. So a host can call
+`reload(L, changed_modules())` on each of its VMs when files change.
+
+The dependencies are only recorded by the vfs object, so they aren't
+persisted, and modules loaded before a restore aren't tracked.
 */
 //]
 
@@ -54,10 +87,96 @@ namespace api {
 template <typename T>
 class vfs {
 
+  // Our functions are closures holding the self pointer as an upvalue
   static T * recover_this(lua_State * L) {
-    vfs * ptr = registry_helper<vfs>::obtain(L);
-    PRIMER_ASSERT(ptr, "Could not recover self pointer!");
-    return static_cast<T *>(ptr);
+    return static_cast<T *>(recover_self_upvalue<vfs>(L));
+  }
+
+  // The modules loaded by `require`, in the registry. These are also in the
+  // _LOADED table, along with the standard libraries, but only these ones are
+  // persisted.
+  static void * loaded_key() noexcept {
+    static char key;
+    return &key;
+  }
+
+  static void push_loaded_table(lua_State * L) {
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, loaded_key()) != LUA_TTABLE) {
+      lua_pop(L, 1);
+      lua_newtable(L);
+      lua_pushvalue(L, -1);
+      lua_rawsetp(L, LUA_REGISTRYINDEX, loaded_key());
+    }
+  }
+
+  // The dependency graph: the modules which each module required, the order
+  // in which modules finished loading, and the modules loading now
+  std::map<std::string, std::set<std::string>> requires_;
+  std::vector<std::string> load_order_;
+  std::vector<std::string> loading_;
+  std::map<std::string, std::uint64_t> hashes_;
+
+  // The modules which `require` loaded, in the order it asked for them
+  std::vector<std::string> profile_;
+
+  static vfs * recover_vfs(lua_State * L) {
+    return static_cast<vfs *>(recover_this(L));
+  }
+
+  // Remember the source hash, if the provider can compute one
+  template <typename U>
+  static auto record_hash(U * u, vfs * self, const std::string & path,
+                          detail::Rank<1>)
+    -> decltype(u->source_hash(path), void()) {
+    self->hashes_[path] = u->source_hash(path);
+  }
+
+  template <typename U>
+  static void record_hash(U *, vfs *, const std::string &, detail::Rank<0>) {}
+
+  void begin_loading(const std::string & path) {
+    requires_[path].clear();
+    loading_.push_back(path);
+  }
+
+  void end_loading(const std::string & path, bool ok) {
+    loading_.pop_back();
+    if (!ok) { return; }
+    if (std::find(load_order_.begin(), load_order_.end(), path)
+        == load_order_.end()) {
+      load_order_.push_back(path);
+    }
+    record_hash(recover_this_ptr(), this, path, detail::Rank<1>{});
+  }
+
+  T * recover_this_ptr() noexcept { return static_cast<T *>(this); }
+
+  // The modules to reload for a change to `paths`, in load order
+  std::vector<std::string> dependents_of(
+    const std::vector<std::string> & paths) const {
+    std::set<std::string> affected(paths.begin(), paths.end());
+    std::vector<std::string> result;
+    // Modules finish loading after the modules they require, so one pass in
+    // load order finds everything which depends on a change.
+    for (const auto & m : load_order_) {
+      bool hit = affected.count(m);
+      if (!hit) {
+        auto it = requires_.find(m);
+        if (it != requires_.end()) {
+          for (const auto & dep : it->second) {
+            if (affected.count(dep)) {
+              hit = true;
+              break;
+            }
+          }
+        }
+      }
+      if (hit) {
+        affected.insert(m);
+        result.push_back(m);
+      }
+    }
+    return result;
   }
 
 protected:
@@ -87,6 +206,11 @@ protected:
   }
 
   static primer::result intf_require(lua_State * L, std::string path) {
+    vfs * self = recover_vfs(L);
+    if (!self->loading_.empty()) {
+      self->requires_[self->loading_.back()].insert(path);
+    }
+
     lua_settop(L, 1); /* _LOADED table will be at index 2 */
     lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
     lua_getfield(L, 2, path.c_str()); /* _LOADED[path] */
@@ -95,13 +219,24 @@ protected:
 
     if (auto ok = recover_this(L)->load(L, path)) {
       PRIMER_ASSERT(lua_isfunction(L, -1), "load did not produce a function");
+      if (std::find(self->profile_.begin(), self->profile_.end(), path)
+          == self->profile_.end()) {
+        self->profile_.push_back(path);
+      }
 
       int code;
+      self->begin_loading(path);
       std::tie(code, std::ignore) = detail::pcall_helper(L, 0, 1);
+      self->end_loading(path, code == LUA_OK);
       if (code != LUA_OK) { return primer::pop_error(L, code); }
 
       lua_pushvalue(L, -1);             // push an extra copy
       lua_setfield(L, 2, path.c_str()); // set to _LOADED table
+
+      push_loaded_table(L);
+      lua_pushvalue(L, -2);
+      lua_setfield(L, -2, path.c_str());
+      lua_pop(L, 1);
       return 1;
     } else {
       return std::move(ok.err());
@@ -118,24 +253,140 @@ protected:
   }
 
 public:
-  // API Feature
+  // Hot reload
 
-  void on_init(lua_State * L) {
-    registry_helper<vfs>::store(L, this);
+  /***
+   * Loads the modules in `paths` again, along with the modules which depend
+   * on them. Modules which were never loaded by `require` are skipped.
+   * Returns the reloaded modules, in the order they were loaded.
+   */
+  expected<std::vector<std::string>> reload(
+    lua_State * L, const std::vector<std::string> & paths) {
+    expected<std::vector<std::string>> result;
+    PRIMER_TRY_BAD_ALLOC { *result = this->dependents_of(paths); }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+    const std::vector<std::string> & modules = *result;
+    if (modules.empty()) { return result; }
+
+    // The old values, saved in a table, are put back for the modules which
+    // weren't reloaded if one fails
+    auto ok = primer::cpp_pcall(L, [&]() {
+      lua_createtable(L, 0, static_cast<int>(modules.size()));
+      const int saved = lua_gettop(L);
+      luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+      push_loaded_table(L);
+      for (const auto & m : modules) {
+        lua_getfield(L, saved + 1, m.c_str());
+        lua_setfield(L, saved, m.c_str());
+        lua_pushnil(L);
+        lua_setfield(L, saved + 1, m.c_str());
+        lua_pushnil(L);
+        lua_setfield(L, saved + 2, m.c_str());
+      }
+
+      std::size_t done = 0;
+      for (; done < modules.size(); ++done) {
+        const char * m = modules[done].c_str();
+        // It may have been loaded again already, by a dependent
+        if (lua_getfield(L, saved + 1, m) != LUA_TNIL) {
+          lua_pop(L, 1);
+          continue;
+        }
+        lua_pop(L, 1);
+        api::push_self_closure(L, PRIMER_ADAPT(&intf_require),
+                               static_cast<vfs *>(this));
+        lua_pushstring(L, m);
+        int code;
+        std::tie(code, std::ignore) = detail::pcall_helper(L, 1, 0);
+        if (code != LUA_OK) {
+          lua_insert(L, saved); // keep the error below our tables
+          break;
+        }
+      }
+
+      if (done < modules.size()) {
+        const int t = saved + 1;
+        for (const auto & m : modules) {
+          if (lua_getfield(L, t + 1, m.c_str()) == LUA_TNIL) {
+            lua_getfield(L, t, m.c_str());
+            lua_pushvalue(L, -1);
+            lua_setfield(L, t + 1, m.c_str());
+            lua_setfield(L, t + 2, m.c_str());
+          }
+          lua_pop(L, 1);
+        }
+        lua_settop(L, saved);
+        lua_error(L);
+      }
+      lua_settop(L, saved - 1);
+    });
+    if (!ok) { result = std::move(ok.err()); }
+    return result;
+  }
 
-    PRIMER_ASSERT(recover_this(L) == static_cast<T *>(this), "bad self store");
+  // The modules whose source changed since they were loaded. Needs a
+  // `source_hash` function in the provider.
+  template <typename U = T>
+  auto changed_modules()
+    -> decltype(std::declval<U &>().source_hash(std::string{}),
+                std::vector<std::string>()) {
+    std::vector<std::string> result;
+    for (const auto & h : hashes_) {
+      if (recover_this_ptr()->source_hash(h.first) != h.second) {
+        result.push_back(h.first);
+      }
+    }
+    return result;
+  }
+
+  // Startup profile
+
+  /***
+   * The modules which `require` has loaded, in the order it first asked for
+   * them, including ones which failed when they ran. A later VM, or the next
+   * run of the process, can `prefetch_modules` these while the entry script
+   * is loaded, see `vfs_prefetch.hpp`.
+   */
+  const std::vector<std::string> & startup_profile() const noexcept {
+    return profile_;
+  }
+
+  // API Feature
 
+  void on_init(lua_State * L) {
     lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
-    primer::set_funcs(L, vfs::get_funcs());
+    api::set_self_closures(L, vfs::get_funcs(), static_cast<vfs *>(this));
     lua_pop(L, 1);
   }
 
   void on_persist_table(lua_State * L) {
-    primer::set_funcs_prefix_reverse(L, "vfs_funcs_", vfs::get_funcs());
+    api::set_self_closures_prefix_reverse(L, "vfs_funcs_", vfs::get_funcs());
   }
 
   void on_unpersist_table(lua_State * L) {
-    primer::set_funcs_prefix(L, "vfs_funcs_", vfs::get_funcs());
+    api::set_self_closures_prefix(L, "vfs_funcs_", vfs::get_funcs(),
+                                  static_cast<vfs *>(this));
+  }
+
+  void on_serialize(lua_State * L) { push_loaded_table(L); }
+
+  // Snapshots from before the loaded modules were persisted have nil here
+  void on_deserialize(lua_State * L) {
+    if (!lua_istable(L, -1)) {
+      lua_pop(L, 1);
+      return;
+    }
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, loaded_key());
+
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED"); // [loaded] [_LOADED]
+    lua_pushnil(L);
+    while (lua_next(L, -3)) {
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);
+      lua_settable(L, -4);
+    }
+    lua_pop(L, 2);
   }
 };
 
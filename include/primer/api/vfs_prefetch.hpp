@@ -0,0 +1,138 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_vfs_prefetch_overview
+/*`
+`primer::api::prefetch_modules(provider, paths)` compiles modules ahead of
+time, on worker threads, so that a later `require` on the thread of the VM
+only loads bytecode.
+
+Each worker makes a scratch lua state, calls `provider.load(L, path)` for some
+of the paths, and throws the loaded chunks away. That is only useful if the
+provider compiles through a `bytecode_cache`, which then holds the compiled
+chunks, and which is safe to share between threads. The `load` function of
+the provider is called from several threads at once, so it must not modify
+the provider, as for instance looking up a `std::map` doesn't.
+
+It returns the result of each load, in the order of the paths. A module which
+fails to compile fails again when it is required, with the same message.
+`prefetch_modules_async` does the same on a new thread, so that the host can
+keep going, and the provider must then outlive the future.
+
+The paths to prefetch can come from the `startup_profile()` of the vfs of an
+earlier VM, which lists the modules that its `require` loaded, in order.
+`write_startup_profile` makes text out of it, one path on each line, to be
+kept along with the scripts, and `read_startup_profile` reads it back in the
+next run of the process.
+
+This header uses `std::thread`, and isn't included by `primer/api.hpp`.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <future>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+template <typename P>
+std::vector<expected<void>>
+prefetch_modules(P & provider, const std::vector<std::string> & paths,
+                 unsigned threads = 0) {
+  const std::size_t count = paths.size();
+  std::vector<expected<void>> results(count);
+  if (!count) { return results; }
+
+  std::atomic<std::size_t> next{0};
+  auto work = [&]() {
+    lua_State * L = luaL_newstate();
+    for (std::size_t i; (i = next++) < count;) {
+      if (!L) {
+        results[i] = primer::error::bad_alloc();
+        continue;
+      }
+      results[i] = provider.load(L, paths[i]);
+      lua_settop(L, 0);
+    }
+    if (L) { lua_close(L); }
+  };
+
+  if (!threads) { threads = std::thread::hardware_concurrency(); }
+  if (!threads) { threads = 1; }
+  if (threads > count) { threads = static_cast<unsigned>(count); }
+
+  // The calling thread is one of the workers
+  std::vector<std::thread> pool;
+  PRIMER_TRY {
+    for (unsigned t = 1; t < threads; ++t) {
+      pool.emplace_back(work);
+    }
+  }
+  PRIMER_CATCH(std::system_error &) {}
+  work();
+  for (auto & t : pool) {
+    t.join();
+  }
+  return results;
+}
+
+// Startup profiles
+
+inline std::string
+write_startup_profile(const std::vector<std::string> & paths) {
+  std::string result;
+  for (const auto & p : paths) {
+    if (p.empty() || p.find('\n') != std::string::npos) { continue; }
+    result += p;
+    result += '\n';
+  }
+  return result;
+}
+
+// Blank lines, and a carriage return at the end of a line, are ignored
+inline std::vector<std::string>
+read_startup_profile(const std::string & text) {
+  std::vector<std::string> result;
+  std::size_t pos = 0;
+  while (pos < text.size()) {
+    std::size_t end = text.find('\n', pos);
+    if (end == std::string::npos) { end = text.size(); }
+    std::size_t len = end - pos;
+    if (len && text[pos + len - 1] == '\r') { --len; }
+    if (len) { result.emplace_back(text, pos, len); }
+    pos = end + 1;
+  }
+  return result;
+}
+
+template <typename P>
+std::future<std::vector<expected<void>>>
+prefetch_modules_async(P & provider, std::vector<std::string> paths,
+                       unsigned threads = 0) {
+  return std::async(std::launch::async,
+                    [&provider, threads](std::vector<std::string> p) {
+                      return prefetch_modules(provider, p, threads);
+                    },
+                    std::move(paths));
+}
+
+} // end namespace api
+} // end namespace primer
@@ -0,0 +1,271 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_vm_multiplexer_overview
+/*`
+`primer::api::vm_multiplexer` runs many lua states over a fixed number of
+threads, for hosts with far more states, e.g. one per tenant, than it would
+be reasonable to give a thread each.
+
+Each state added with `add(L)` gets a `primer::scheduler` of coroutine tasks,
+and a `primer::vm_executor` of C++ tasks. Work is given to a state, from any
+thread, with `post(id, f)`, which runs `f(L, sched)` on whichever thread
+next runs the state, e.g. to spawn a task, signal it, or complete a ticket.
+
+A state runs in slices. A slice runs the posted tasks, and then one tick of
+the scheduler, in which each ready coroutine is resumed until it yields, or
+until it has run `budget` instructions and the count hook of the scheduler
+preempts it. A state which still has work after a slice goes back into the
+run queue, and one which has none waits until something is posted to it.
+
+A state is only ever run by one thread at a time, so nothing in it needs a
+lock, but it may run on a different thread in each slice. So it must not use
+thread-local storage, e.g. `pool_allocator::this_thread()`. Primer's own cache
+of weak state refs is thread-local, and is only compiled with
+`PRIMER_THREAD_SAFE_STATE_REFS`, whose refs may be released on any thread.
+
+The run queue is ordered by the time each state has run, divided by its
+`weight`, so all states get slices in turn, and over time a state of weight 2
+runs twice as long as a state of weight 1. A state which was idle rejoins at
+the back of the queue, rather than being made up for the time it was idle.
+
+The states are owned by the host. `remove(id)` waits until the state is not
+running, after which the host may close it. `wait_idle()` waits until no state
+has work, and the destructor finishes the slices which are running, and joins
+the threads, without running the work which is left.
+
+This header isn't included by `primer/api.hpp`.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/lua.hpp>
+#include <primer/scheduler.hpp>
+#include <primer/support/lua_state_ref.hpp>
+#include <primer/vm_executor.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+class vm_multiplexer {
+public:
+  using vm_id = std::size_t;
+  using task_t = std::function<void(lua_State *, primer::scheduler &)>;
+
+private:
+  using clock_t = std::chrono::steady_clock;
+
+  enum class vm_state { idle, queued, running };
+
+  struct vm {
+    lua_State * L;
+    primer::vm_executor exec;
+    primer::scheduler sched;
+    unsigned weight;
+    vm_state state = vm_state::idle;
+    bool removing = false;
+    std::uint64_t vruntime = 0;
+    std::uint64_t slices = 0;
+
+    vm(lua_State * l, unsigned w, int budget)
+      : L(l)
+      , exec(l)
+      , sched()
+      , weight(w ? w : 1) {
+      sched.set_budget(budget);
+    }
+
+    bool has_work() const noexcept {
+      return !exec.empty() || sched.pending();
+    }
+  };
+
+  std::vector<std::unique_ptr<vm>> vms_;
+  std::vector<vm_id> free_;
+  // By virtual runtime, then by id
+  std::set<std::pair<std::uint64_t, vm_id>> run_queue_;
+  std::uint64_t min_vruntime_ = 0;
+  std::size_t running_ = 0;
+  std::vector<std::pair<vm_id, primer::error>> errors_;
+  int budget_;
+  bool stop_ = false;
+
+  mutable std::mutex mutex_;
+  std::condition_variable work_;
+  std::condition_variable idle_;
+  std::vector<std::thread> threads_;
+
+  // With the lock held
+  void enqueue(vm_id id) {
+    vm & v = *vms_[id];
+    if (v.vruntime < min_vruntime_) { v.vruntime = min_vruntime_; }
+    v.state = vm_state::queued;
+    run_queue_.emplace(v.vruntime, id);
+    work_.notify_one();
+  }
+
+  void run_slice(vm & v, std::vector<primer::error> & errors) {
+    v.exec.run_pending();
+    v.sched.tick();
+    for (auto & e : v.exec.take_errors()) {
+      errors.emplace_back(std::move(e));
+    }
+    for (auto & e : v.sched.take_errors()) {
+      errors.emplace_back(std::move(e));
+    }
+  }
+
+  void run_worker() {
+    std::vector<primer::error> errors;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      work_.wait(lock, [this]() { return stop_ || !run_queue_.empty(); });
+      if (stop_) { break; }
+
+      const vm_id id = run_queue_.begin()->second;
+      min_vruntime_ = run_queue_.begin()->first;
+      run_queue_.erase(run_queue_.begin());
+      vm & v = *vms_[id];
+      v.state = vm_state::running;
+      ++running_;
+
+      lock.unlock();
+      const auto start = clock_t::now();
+      this->run_slice(v, errors);
+      const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        clock_t::now() - start)
+                        .count();
+      lock.lock();
+
+      --running_;
+      ++v.slices;
+      v.vruntime += static_cast<std::uint64_t>(ns) / v.weight + 1;
+      for (auto & e : errors) {
+        errors_.emplace_back(id, std::move(e));
+      }
+      errors.clear();
+
+      if (!v.removing && v.has_work()) {
+        this->enqueue(id);
+      } else {
+        v.state = vm_state::idle;
+        idle_.notify_all();
+      }
+    }
+  }
+
+public:
+  // `budget` is the number of instructions a coroutine runs before it is
+  // preempted, see `scheduler::set_budget`
+  explicit vm_multiplexer(std::size_t threads, int budget = 100000)
+    : budget_(budget) {
+    if (!threads) { threads = 1; }
+    for (std::size_t i = 0; i < threads; ++i) {
+      threads_.emplace_back([this]() { this->run_worker(); });
+    }
+  }
+
+  vm_multiplexer(const vm_multiplexer &) = delete;
+  vm_multiplexer & operator=(const vm_multiplexer &) = delete;
+
+  ~vm_multiplexer() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    work_.notify_all();
+    for (auto & t : threads_) {
+      t.join();
+    }
+  }
+
+  std::size_t threads() const noexcept { return threads_.size(); }
+
+  // From here on, `L` is only used by the multiplexer, until it is removed.
+  // Note: Can cause lua memory allocation failure
+  vm_id add(lua_State * L, unsigned weight = 1) {
+    std::unique_ptr<vm> v{new vm{L, weight, budget_}};
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.empty()) {
+      vms_.emplace_back(std::move(v));
+      return vms_.size() - 1;
+    }
+    const vm_id id = free_.back();
+    free_.pop_back();
+    vms_[id] = std::move(v);
+    return id;
+  }
+
+  // Waits until the state isn't running, and drops what was posted to it
+  void remove(vm_id id) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    vm & v = *vms_[id];
+    v.removing = true;
+    if (v.state == vm_state::queued) {
+      run_queue_.erase(std::make_pair(v.vruntime, id));
+      v.state = vm_state::idle;
+    }
+    idle_.wait(lock, [&v]() { return v.state == vm_state::idle; });
+    vms_[id].reset();
+    free_.push_back(id);
+    idle_.notify_all();
+  }
+
+  // Runs `f(L, sched)` in the next slice of the state
+  void post(vm_id id, task_t f) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    vm & v = *vms_[id];
+    primer::scheduler * sched = &v.sched;
+    v.exec.post([sched, f](lua_State * L) { f(L, *sched); });
+    // A running state checks for work when its slice ends
+    if (v.state == vm_state::idle && !v.removing) { this->enqueue(id); }
+  }
+
+  void set_weight(vm_id id, unsigned weight) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    vms_[id]->weight = weight ? weight : 1;
+  }
+
+  // The number of slices which the state has run
+  std::uint64_t slices(vm_id id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return vms_[id]->slices;
+  }
+
+  // Waits until no state has work
+  void wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this]() { return run_queue_.empty() && !running_; });
+  }
+
+  // Errors raised by the tasks of any state since the last call
+  std::vector<std::pair<vm_id, primer::error>> take_errors() {
+    std::vector<std::pair<vm_id, primer::error>> result;
+    std::lock_guard<std::mutex> lock(mutex_);
+    result.swap(errors_);
+    return result;
+  }
+};
+
+} // end namespace api
+} // end namespace primer
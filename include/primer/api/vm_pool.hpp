@@ -0,0 +1,279 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_vm_pool_overview
+/*`
+`primer::api::vm_pool<Api>` keeps lua states which are ready for a new session,
+so that a session doesn't pay for creating a state and initializing its api,
+and the end of a session doesn't pay for closing it.
+
+Each state in the pool is made by `primer::new_state`, from the `vm_config`
+given to the pool, and owned together with an `Api` object which is constructed
+from the `lua_State *`, and which initializes the api in its constructor. The state is then stamped from a `vm_template<Api>`.
+
+When a session ends, `release` resets the state to the template, and keeps it
+for the next `acquire`:
+
+* The stack is cleared, any debug hook is removed, and the weak references made
+  by `obtain_state_ref` are closed, as when the state is closed.
+* Registry entries made since the state was first stamped are removed, and the
+  `_LOADED` table of modules is put back as it was then.
+* The template is stamped again, which replaces the globals, and restores each
+  serial api feature.
+* A full garbage collection is run.
+
+The extraspace of the state, and everything else set up by `initialize_api`,
+is left as it is, so it must not be changed by the session. A state which fails
+to be reset is closed instead.
+
+The pool is safe to use from several threads, but each state is used by one
+thread at a time.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/api/vm_template.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/support/lua_state_ref.hpp>
+#include <primer/vm_config.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace primer {
+namespace api {
+
+template <typename Api>
+class vm_pool {
+  // Closes the state, after the api object which uses it is gone
+  struct state_closer {
+    lua_State * L;
+    ~state_closer() {
+      if (L) { lua_close(L); }
+    }
+  };
+
+public:
+  class vm {
+    state_closer closer_;
+
+  public:
+    lua_State * const L;
+    Api api;
+
+    explicit vm(lua_State * s)
+      : closer_{s}
+      , L(s)
+      , api(s) {}
+
+    vm(const vm &) = delete;
+    vm & operator=(const vm &) = delete;
+  };
+
+  using vm_ptr = std::unique_ptr<vm>;
+
+private:
+  vm_template<Api> template_;
+  std::size_t max_idle_;
+  vm_config config_;
+  mutable std::mutex mutex_;
+  std::vector<vm_ptr> idle_;
+
+  static void * baseline_key() noexcept {
+    static char key;
+    return &key;
+  }
+
+  static void * loaded_baseline_key() noexcept {
+    static char key;
+    return &key;
+  }
+
+  // Copies the table at the top of the stack into the table at `dest`
+  static void copy_table(lua_State * L, int dest) {
+    dest = lua_absindex(L, dest);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);
+      lua_rawset(L, dest);
+    }
+  }
+
+  // Records the keys which the registry has now, and the contents of _LOADED
+  static void save_baseline(lua_State * L) {
+    lua_newtable(L);
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+    copy_table(L, -2);
+    lua_pop(L, 1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, loaded_baseline_key());
+
+    lua_newtable(L);
+    lua_pushnil(L);
+    while (lua_next(L, LUA_REGISTRYINDEX)) {
+      lua_pop(L, 1);
+      lua_pushvalue(L, -1);
+      lua_pushboolean(L, true);
+      lua_rawset(L, -4);
+    }
+    lua_pushlightuserdata(L, baseline_key());
+    lua_pushboolean(L, true);
+    lua_rawset(L, -3);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, baseline_key());
+  }
+
+  // Removes the keys which the registry didn't have then, and puts back the
+  // contents of _LOADED
+  static void restore_baseline(lua_State * L) {
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED"); // [_LOADED]
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      lua_pop(L, 1);
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, -4);
+    }
+    lua_rawgetp(L, LUA_REGISTRYINDEX, loaded_baseline_key());
+    copy_table(L, -2);
+    lua_pop(L, 2);
+
+    lua_rawgetp(L, LUA_REGISTRYINDEX, baseline_key()); // [baseline]
+    lua_pushnil(L);
+    while (lua_next(L, LUA_REGISTRYINDEX)) { // [baseline] [k] [v]
+      lua_pop(L, 1);
+      lua_pushvalue(L, -1);
+      if (lua_rawget(L, -3) == LUA_TNIL) { // [baseline] [k] [?]
+        lua_pushvalue(L, -2);
+        lua_pushnil(L);
+        lua_rawset(L, LUA_REGISTRYINDEX); // Clearing fields is allowed here
+      }
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+
+  static int save_baseline_fcn(lua_State * L) {
+    save_baseline(L);
+    return 0;
+  }
+
+  static int restore_baseline_fcn(lua_State * L) {
+    restore_baseline(L);
+    return 0;
+  }
+
+  // These may run out of memory
+  static int protected_call(lua_State * L, lua_CFunction f) {
+    lua_pushcfunction(L, f);
+    int code = lua_pcall(L, 0, 0, 0);
+    lua_settop(L, 0);
+    return code;
+  }
+
+  expected<vm_ptr> make_vm() {
+    lua_State * L = primer::new_state(config_);
+    if (!L) { return primer::error::bad_alloc(); }
+
+    expected<vm_ptr> result{vm_ptr{}};
+    PRIMER_TRY_BAD_ALLOC { result->reset(new vm{L}); }
+    PRIMER_CATCH_BAD_ALLOC {
+      lua_close(L);
+      return primer::error::bad_alloc();
+    }
+
+    vm & v = **result;
+    if (auto ok = template_.stamp(v.api, v.L)) {
+      lua_settop(v.L, 0);
+      if (LUA_OK != protected_call(v.L, &save_baseline_fcn)) {
+        return primer::error{"could not record the registry of a new state"};
+      }
+    } else {
+      return std::move(ok.err());
+    }
+    return result;
+  }
+
+  bool reset(vm & v) {
+    lua_State * L = v.L;
+    lua_settop(L, 0);
+    lua_sethook(L, nullptr, 0, 0);
+    primer::release_deferred_refs(L);
+    primer::close_state_refs(L);
+    if (LUA_OK != protected_call(L, &restore_baseline_fcn)) { return false; }
+    if (!template_.stamp(v.api, L)) { return false; }
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    lua_settop(L, 0);
+    return true;
+  }
+
+public:
+  // Keeps at most `max_idle` states which aren't in use
+  explicit vm_pool(vm_template<Api> t, std::size_t max_idle = 16,
+                   vm_config config = {})
+    : template_(std::move(t))
+    , max_idle_(max_idle)
+    , config_(config) {}
+
+  vm_pool(const vm_pool &) = delete;
+  vm_pool & operator=(const vm_pool &) = delete;
+
+  // A state which is a copy of the template
+  expected<vm_ptr> acquire() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!idle_.empty()) {
+        vm_ptr result = std::move(idle_.back());
+        idle_.pop_back();
+        return result;
+      }
+    }
+    return this->make_vm();
+  }
+
+  // Resets the state, and keeps it, or closes it
+  void release(vm_ptr v) {
+    if (!v || !this->reset(*v)) { return; }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (idle_.size() < max_idle_) {
+      PRIMER_TRY_BAD_ALLOC { idle_.push_back(std::move(v)); }
+      PRIMER_CATCH_BAD_ALLOC {}
+    }
+  }
+
+  // Makes states ahead of time, until `n` are idle
+  expected<void> reserve(std::size_t n) {
+    for (;;) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (idle_.size() >= n || idle_.size() >= max_idle_) { return {}; }
+      }
+      auto v = this->make_vm();
+      if (!v) { return std::move(v.err()); }
+      std::lock_guard<std::mutex> lock(mutex_);
+      PRIMER_TRY_BAD_ALLOC { idle_.push_back(std::move(*v)); }
+      PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+    }
+  }
+
+  std::size_t idle() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return idle_.size();
+  }
+};
+
+} // end namespace api
+} // end namespace primer
@@ -0,0 +1,70 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_vm_template_overview
+/*`
+`primer::api::vm_template<Api>` holds the image of a lua state which has been
+fully set up once, e.g. with all of its modules loaded, so that new sessions
+start from a copy of it rather than by running the setup again.
+
+`capture` persists a prepared state into the template. `stamp` restores the
+template into another state, which must have been freshly initialized with
+`initialize_api` by an api object of the same type. The template is immutable
+after `capture`, so it may be shared by threads which stamp concurrently.
+
+`persist` and `unpersist` are protected members of the api object, so the api
+class must declare
+
+  friend class primer::api::vm_template<my_api>;
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+
+#include <string>
+#include <utility>
+
+namespace primer {
+namespace api {
+
+template <typename Api>
+class vm_template {
+  std::string image_;
+
+public:
+  vm_template() = default;
+
+  // Uses an image made earlier by `capture`
+  explicit vm_template(std::string image)
+    : image_(std::move(image)) {}
+
+  // Replaces the template with the current state of `L`, owned by `api`
+  expected<void> capture(Api & api, lua_State * L) {
+    std::string image;
+    auto ok = api.persist(L, image);
+    if (ok) { image_ = std::move(image); }
+    return ok;
+  }
+
+  // Makes `L`, owned by `api`, a copy of the template
+  expected<void> stamp(Api & api, lua_State * L) const {
+    if (image_.empty()) { return primer::error{"vm template is empty"}; }
+    return api.unpersist(L, image_);
+  }
+
+  bool empty() const noexcept { return image_.empty(); }
+  const std::string & image() const noexcept { return image_; }
+};
+
+} // end namespace api
+} // end namespace primer
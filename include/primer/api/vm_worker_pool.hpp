@@ -0,0 +1,437 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_vm_worker_pool_overview
+/*`
+`primer::api::vm_worker_pool<Api>` spreads work over several threads, each of
+which owns one lua state and one `Api` object. As for `vm_pool`, the `Api` is
+constructed from the `lua_State *`, and initializes the api in its constructor.
+An optional setup function then runs on each worker, e.g. to load scripts.
+
+Lua states are never shared between threads. Work is given to the pool as
+tasks:
+
+* `post(f)` runs `f(api, L)` on some worker.
+* `call<R>(name, args...)` calls the global function `name` on some worker,
+  and returns a `std::future<expected<R>>` of the result, read with
+  `primer::read<R>`.
+
+The arguments of `call` are encoded on the calling thread with
+`traits::binary` (see `primer/traits/binary.hpp`), into a message which shares
+nothing with the caller, and are decoded and pushed on the worker. So they may
+be of any type which has both a `traits::binary` and a `traits::push`.
+
+A task which throws a C++ exception doesn't stop its worker. The futures of
+`call` get the exception, and the exceptions of other tasks are kept as errors
+until `take_errors()`.
+
+Each worker has its own queue of tasks. New tasks are dealt out round-robin,
+and a worker whose queue is empty steals from the others, so that no worker is
+idle while there is work. Tasks may therefore run in any order, on any worker,
+and should not depend on state left behind by other tasks.
+
+The destructor runs the tasks which are still queued, then joins the workers.
+The workers tear down their states at the same time, each on its own thread.
+After `set_fast_teardown(true)`, they do it with `primer::fast_close`, see
+`<primer/fast_close.hpp>`, which skips the finalizers of most userdata. Then
+the memory of a state is freed in bulk when its thread exits, if the state
+uses the `pool_allocator` of its thread, i.e. the pool has a placement policy,
+e.g. one which returns `vm_placement::anywhere()`.
+
+On a machine with several NUMA nodes, a state whose thread moves to another
+node reaches its heap through the interconnect. A `vm_placement_policy`, given
+to the constructor, says where each worker runs:
+
+* `vm_placement_policy::spread_over_cpus()` pins worker `i` to core `i`, modulo
+  the number of cores.
+* `vm_placement_policy::spread_over_nodes()` pins worker `i` to the cores of
+  the `i`-th online node, modulo the number of online nodes, and asks the
+  kernel for memory from that node. Node ids need not be contiguous.
+* Any function from the index of a worker to a `vm_placement` may be used.
+
+With a policy, the state of each worker uses the `pool_allocator` of its
+thread, whose chunks are first touched there, and so are local to where the
+state runs. `placed(i)` tells if worker `i` could be placed as asked, which
+may fail e.g. in a restricted cpuset, and then it runs where the system puts
+it.
+
+This header isn't included by `primer/api.hpp`.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/fast_close.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/pool_allocator.hpp>
+#include <primer/push.hpp>
+#include <primer/read.hpp>
+#include <primer/support/thread_placement.hpp>
+#include <primer/traits/binary.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+namespace detail {
+
+// Encodes a list of arguments into a message, and pushes them from it
+template <typename... Args>
+struct message_codec;
+
+template <>
+struct message_codec<> {
+  static void encode(std::string &) {}
+
+  static bool push_decoded(lua_State *, const char *& pos, const char * end) {
+    return pos == end;
+  }
+};
+
+template <typename T, typename... Args>
+struct message_codec<T, Args...> {
+  static void encode(std::string & out, const T & t, const Args &... args) {
+    traits::binary<T>::write(out, t);
+    message_codec<Args...>::encode(out, args...);
+  }
+
+  static bool push_decoded(lua_State * L, const char *& pos, const char * end) {
+    T t{};
+    if (!traits::binary<T>::read(pos, end, t)) { return false; }
+    primer::push(L, t);
+    return message_codec<Args...>::push_decoded(L, pos, end);
+  }
+};
+
+// Calls the global function named by the first argument with the others, so
+// that the lookup, which may run an `__index` metamethod of `_G`, is protected
+inline int
+call_named_global(lua_State * L) {
+  lua_getglobal(L, lua_tostring(L, 1));
+  lua_replace(L, 1);
+  lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+  return lua_gettop(L);
+}
+
+template <typename R>
+struct worker_call_result {
+  static constexpr int nresults = 1;
+  static expected<R> read(lua_State * L) { return primer::read<R>(L, -1); }
+};
+
+template <>
+struct worker_call_result<void> {
+  static constexpr int nresults = 0;
+  static expected<void> read(lua_State *) { return {}; }
+};
+
+} // end namespace detail
+
+namespace api {
+
+//[ primer_vm_placement
+// Where a worker of a `vm_worker_pool` runs
+struct vm_placement {
+  enum class kind { any, cpu, node };
+
+  kind where;
+  std::size_t index;
+
+  static vm_placement anywhere() noexcept { return {kind::any, 0}; }
+  static vm_placement on_cpu(std::size_t c) noexcept { return {kind::cpu, c}; }
+  static vm_placement on_node(std::size_t n) noexcept {
+    return {kind::node, n};
+  }
+};
+
+class vm_placement_policy {
+public:
+  using function_t = std::function<vm_placement(std::size_t worker)>;
+
+  vm_placement_policy() = default; // Workers run anywhere, as without a policy
+  explicit vm_placement_policy(function_t f)
+    : f_(std::move(f)) {}
+
+  static vm_placement_policy spread_over_cpus();
+  static vm_placement_policy spread_over_nodes();
+
+  explicit operator bool() const noexcept { return static_cast<bool>(f_); }
+  vm_placement operator()(std::size_t worker) const {
+    return f_ ? f_(worker) : vm_placement::anywhere();
+  }
+
+private:
+  function_t f_;
+};
+//]
+
+inline vm_placement_policy
+vm_placement_policy::spread_over_cpus() {
+  const std::size_t cpus = primer::detail::cpu_count();
+  return vm_placement_policy{[cpus](std::size_t worker) {
+    return vm_placement::on_cpu(worker % cpus);
+  }};
+}
+
+inline vm_placement_policy
+vm_placement_policy::spread_over_nodes() {
+  std::vector<std::size_t> nodes = primer::detail::numa_online_nodes();
+  return vm_placement_policy{[nodes](std::size_t worker) {
+    return vm_placement::on_node(nodes[worker % nodes.size()]);
+  }};
+}
+
+template <typename Api>
+class vm_worker_pool {
+public:
+  using task_t = std::function<void(Api &, lua_State *)>;
+
+private:
+  struct task_queue {
+    std::mutex mutex;
+    std::deque<task_t> tasks;
+    std::atomic<bool> placed{false};
+  };
+
+  std::vector<std::unique_ptr<task_queue>> queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<std::size_t> next_{0};
+
+  // Wakes the idle workers. `pending_` counts the queued tasks.
+  std::mutex wake_mutex_;
+  std::condition_variable wake_;
+  std::size_t pending_ = 0;
+  bool stop_ = false;
+  std::atomic<bool> fast_teardown_{false};
+
+  std::mutex errors_mutex_;
+  std::vector<primer::error> errors_;
+
+  void add_error(primer::error e) noexcept {
+    std::lock_guard<std::mutex> lock(errors_mutex_);
+    PRIMER_TRY_BAD_ALLOC { errors_.emplace_back(std::move(e)); }
+    PRIMER_CATCH_BAD_ALLOC {}
+  }
+
+  bool try_pop(std::size_t i, task_t & t) {
+    task_queue & q = *queues_[i];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.tasks.empty()) { return false; }
+    t = std::move(q.tasks.front());
+    q.tasks.pop_front();
+    return true;
+  }
+
+  // Takes the newest task of another worker
+  bool try_steal(std::size_t i, task_t & t) {
+    for (std::size_t k = 1; k < queues_.size(); ++k) {
+      task_queue & q = *queues_[(i + k) % queues_.size()];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if (!q.tasks.empty()) {
+        t = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool place_this_thread(const vm_placement & p) noexcept {
+    switch (p.where) {
+      case vm_placement::kind::cpu:
+        return primer::detail::pin_this_thread_to_cpu(p.index);
+      case vm_placement::kind::node:
+        return primer::detail::pin_this_thread_to_node(p.index)
+               && primer::detail::prefer_local_memory(p.index);
+      default: return true;
+    }
+  }
+
+  void run_worker(std::size_t i, const task_t & setup,
+                  const vm_placement_policy & placement) {
+    // Memory which was touched before stays where it is, so the thread is
+    // placed before it makes its state
+    lua_State * L;
+    if (placement) {
+      queues_[i]->placed = place_this_thread(placement(i));
+      L = primer::pool_allocator::this_thread().new_state();
+    } else {
+      L = luaL_newstate();
+    }
+    {
+      Api api{L};
+      if (setup) { setup(api, L); }
+
+      for (;;) {
+        task_t t;
+        if (this->try_pop(i, t) || this->try_steal(i, t)) {
+          {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+            --pending_;
+          }
+          lua_settop(L, 0);
+          primer::release_deferred_refs(L);
+          PRIMER_TRY { t(api, L); }
+          PRIMER_CATCH(std::exception & e) {
+            this->add_error(primer::error{"worker task threw: ", e.what()});
+          }
+          PRIMER_CATCH(...) {
+            this->add_error(primer::error{"worker task threw an exception"});
+          }
+          continue;
+        }
+
+        std::unique_lock<std::mutex> lock(wake_mutex_);
+        wake_.wait(lock, [this]() { return stop_ || pending_; });
+        if (stop_ && !pending_) { break; }
+      }
+    }
+    if (fast_teardown_) {
+      primer::fast_close(L);
+    } else {
+      lua_close(L);
+    }
+  }
+
+public:
+  explicit vm_worker_pool(std::size_t threads, task_t setup = task_t{})
+    : vm_worker_pool(threads, vm_placement_policy{}, std::move(setup)) {}
+
+  vm_worker_pool(std::size_t threads, vm_placement_policy placement,
+                 task_t setup = task_t{}) {
+    if (!threads) { threads = 1; }
+    for (std::size_t i = 0; i < threads; ++i) {
+      queues_.emplace_back(new task_queue);
+    }
+    for (std::size_t i = 0; i < threads; ++i) {
+      threads_.emplace_back([this, i, setup, placement]() {
+        this->run_worker(i, setup, placement);
+      });
+    }
+  }
+
+  vm_worker_pool(const vm_worker_pool &) = delete;
+  vm_worker_pool & operator=(const vm_worker_pool &) = delete;
+
+  ~vm_worker_pool() {
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto & t : threads_) {
+      t.join();
+    }
+  }
+
+  std::size_t size() const noexcept { return threads_.size(); }
+
+  // Whether the workers tear down their states with `fast_close` when the
+  // pool is destroyed
+  void set_fast_teardown(bool on) noexcept { fast_teardown_ = on; }
+
+  // True once worker `i` runs where its placement asked. It is set before
+  // the setup function runs on the worker.
+  bool placed(std::size_t i) const noexcept { return queues_[i]->placed; }
+
+  // Runs `f(api, L)` on some worker
+  void post(task_t f) {
+    task_queue & q = *queues_[next_++ % queues_.size()];
+    // Counted before it is published, so that a worker which takes it at once
+    // doesn't count below zero
+    {
+      std::lock_guard<std::mutex> lock(wake_mutex_);
+      ++pending_;
+    }
+    {
+      std::lock_guard<std::mutex> lock(q.mutex);
+      PRIMER_TRY { q.tasks.push_back(std::move(f)); }
+      PRIMER_CATCH(...) {
+        std::lock_guard<std::mutex> wake_lock(wake_mutex_);
+        --pending_;
+        PRIMER_RETHROW;
+      }
+    }
+    wake_.notify_one();
+  }
+
+  // Exceptions thrown by tasks given to `post` since the last call
+  std::vector<primer::error> take_errors() {
+    std::vector<primer::error> result;
+    std::lock_guard<std::mutex> lock(errors_mutex_);
+    result.swap(errors_);
+    return result;
+  }
+
+  // Calls the global function `name` with `args` on some worker
+  template <typename R, typename... Args>
+  std::future<expected<R>> call(std::string name, const Args &... args) {
+    using codec = detail::message_codec<Args...>;
+    using result = detail::worker_call_result<R>;
+
+    std::string message;
+    codec::encode(message, args...);
+
+    auto promise = std::make_shared<std::promise<expected<R>>>();
+    std::future<expected<R>> future = promise->get_future();
+
+    this->post([promise, name, message](Api &, lua_State * L) {
+      PRIMER_TRY {
+        if (!lua_checkstack(L, 3 + static_cast<int>(sizeof...(Args)))) {
+          promise->set_value(primer::error::insufficient_stack_space(
+            3 + static_cast<int>(sizeof...(Args))));
+          return;
+        }
+        lua_pushcfunction(L, &detail::call_named_global);
+        lua_pushlstring(L, name.data(), name.size());
+
+        const char * pos = message.data();
+        if (!codec::push_decoded(L, pos, pos + message.size())) {
+          lua_settop(L, 0);
+          promise->set_value(
+            primer::error{"malformed message for '", name, "'"});
+          return;
+        }
+
+        const int code =
+          lua_pcall(L, 1 + sizeof...(Args), result::nresults, 0);
+        if (code != LUA_OK) {
+          promise->set_value(primer::pop_error(L, code));
+        } else {
+          promise->set_value(result::read(L));
+        }
+        lua_settop(L, 0);
+      }
+      PRIMER_CATCH(...) {
+        lua_settop(L, 0);
+        promise->set_exception(std::current_exception());
+      }
+    });
+    return future;
+  }
+};
+
+} // end namespace api
+} // end namespace primer
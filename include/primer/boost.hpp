@@ -13,5 +13,9 @@
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <primer/boost/flat_map.hpp>
 #include <primer/boost/optional.hpp>
+#include <primer/boost/small_vector.hpp>
+#include <primer/boost/static_vector.hpp>
+#include <primer/boost/variant.hpp>
 #include <primer/boost/vector.hpp>
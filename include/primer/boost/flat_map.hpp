@@ -0,0 +1,46 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * How to transport `boost::container::flat_map` to and from the stack
+ *
+ * A table is read in one pass into the underlying vector, which is then
+ * sorted once, rather than inserting each pair in order. So a large table
+ * is read in O(n log n), into contiguous storage.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <boost/container/flat_map.hpp>
+#include <primer/container/map_base.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <primer/traits/ref_proxy.hpp>
+
+namespace primer {
+namespace traits {
+
+template <typename K, typename V, typename... Rest>
+struct push<boost::container::flat_map<K, V, Rest...>>
+  : container::map_push_helper<boost::container::flat_map<K, V, Rest...>> {};
+
+template <typename K, typename V, typename... Rest>
+struct read<boost::container::flat_map<K, V, Rest...>>
+  : container::flat_map_read_helper<boost::container::flat_map<K, V, Rest...>> {
+};
+
+template <typename K, typename V, typename... Rest>
+struct read_type_mask<boost::container::flat_map<K, V, Rest...>>
+  : type_mask_constant<table_type_mask> {};
+
+template <typename K, typename V, typename... Rest>
+struct ref_proxy_access<boost::container::flat_map<K, V, Rest...>>
+  : container::map_proxy_helper<boost::container::flat_map<K, V, Rest...>> {};
+
+} // end namespace traits
+} // end namespace primer
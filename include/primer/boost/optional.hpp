@@ -17,6 +17,7 @@ PRIMER_ASSERT_FILESCOPE;
 //[ primer_example_boost_optional_decl
 #include <boost/optional/optional.hpp>
 #include <primer/container/optional_base.hpp>
+#include <primer/traits/read_type_mask.hpp>
 
 namespace primer {
 namespace traits {
@@ -29,6 +30,9 @@ template <typename T>
 struct read<boost::optional<T>>
   : container::optional_strict_read<boost::optional<T>> {};
 
+template <typename T>
+struct read_type_mask<boost::optional<T>> : optional_type_mask<T> {};
+
 } // end namespace traits
 } // end namespace primer
 //]
@@ -0,0 +1,53 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * How to transport `boost::container::small_vector` to and from the stack
+ *
+ * A table of at most `N` elements is read into the inline storage, without
+ * touching the heap. A longer one spills onto the heap, as the vector would.
+ *
+ * `primer::read` needs the vector to be nothrow move constructible, which it
+ * is not if its elements are not trivially copyable, e.g. `std::string`, so
+ * those are read in place with `primer::read_into`.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <boost/container/small_vector.hpp>
+#include <primer/container/seq_base.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <primer/traits/ref_proxy.hpp>
+
+#include <cstddef>
+
+namespace primer {
+namespace traits {
+
+template <typename T, std::size_t N, typename... Rest>
+struct push<boost::container::small_vector<T, N, Rest...>>
+  : container::push_seq_helper<boost::container::small_vector<T, N, Rest...>> {
+};
+
+template <typename T, std::size_t N, typename... Rest>
+struct read<boost::container::small_vector<T, N, Rest...>>
+  : container::read_seq_helper<boost::container::small_vector<T, N, Rest...>> {
+};
+
+template <typename T, std::size_t N, typename... Rest>
+struct read_type_mask<boost::container::small_vector<T, N, Rest...>>
+  : type_mask_constant<table_type_mask> {};
+
+template <typename T, std::size_t N, typename... Rest>
+struct ref_proxy_access<boost::container::small_vector<T, N, Rest...>>
+  : container::seq_proxy_helper<
+      boost::container::small_vector<T, N, Rest...>> {};
+
+} // end namespace traits
+} // end namespace primer
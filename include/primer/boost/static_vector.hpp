@@ -0,0 +1,63 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * How to transport `boost::container::static_vector` to and from the stack
+ *
+ * The elements live in the vector, so reading never touches the heap.
+ * Reading a table with more than `Capacity` elements is an error, like
+ * reading a table which is too long for a `std::array`.
+ *
+ * As with `small_vector.hpp`, a vector of elements which are not trivially
+ * copyable is read in place with `primer::read_into`.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <boost/container/static_vector.hpp>
+#include <primer/container/seq_base.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <primer/traits/ref_proxy.hpp>
+
+#include <cstddef>
+#include <type_traits>
+
+namespace primer {
+
+namespace container {
+
+template <typename T, std::size_t C, typename... Rest>
+struct capacity_limit<boost::container::static_vector<T, C, Rest...>>
+  : std::integral_constant<std::size_t, C> {};
+
+} // end namespace container
+
+namespace traits {
+
+template <typename T, std::size_t C, typename... Rest>
+struct push<boost::container::static_vector<T, C, Rest...>>
+  : container::push_seq_helper<boost::container::static_vector<T, C, Rest...>> {
+};
+
+template <typename T, std::size_t C, typename... Rest>
+struct read<boost::container::static_vector<T, C, Rest...>>
+  : container::read_seq_helper<boost::container::static_vector<T, C, Rest...>> {
+};
+
+template <typename T, std::size_t C, typename... Rest>
+struct read_type_mask<boost::container::static_vector<T, C, Rest...>>
+  : type_mask_constant<table_type_mask> {};
+
+template <typename T, std::size_t C, typename... Rest>
+struct ref_proxy_access<boost::container::static_vector<T, C, Rest...>>
+  : container::seq_proxy_helper<
+      boost::container::static_vector<T, C, Rest...>> {};
+
+} // end namespace traits
+} // end namespace primer
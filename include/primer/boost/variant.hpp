@@ -0,0 +1,43 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * How to transfer `boost::variant` to and from the stack. The value is pushed
+ * as the alternative which it holds, and read as the first alternative which
+ * accepts it, see <primer/container/variant_base.hpp>.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <boost/variant/apply_visitor.hpp>
+#include <boost/variant/variant.hpp>
+#include <primer/container/variant_base.hpp>
+#include <primer/traits/read_type_mask.hpp>
+
+namespace primer {
+namespace traits {
+
+template <typename... Ts>
+struct push<boost::variant<Ts...>> : container::variant_push_space<Ts...> {
+  static void to_stack(lua_State * L, const boost::variant<Ts...> & v) {
+    boost::apply_visitor(container::variant_push_visitor{L}, v);
+  }
+};
+
+template <typename... Ts>
+struct read<boost::variant<Ts...>>
+  : container::variant_read<boost::variant<Ts...>, Ts...> {};
+
+template <typename... Ts>
+struct read_type_mask<boost::variant<Ts...>>
+  : type_mask_constant<
+      container::variant_read<boost::variant<Ts...>, Ts...>::mask> {};
+
+} // end namespace traits
+} // end namespace primer
@@ -15,6 +15,8 @@ PRIMER_ASSERT_FILESCOPE;
 
 #include <boost/container/vector.hpp>
 #include <primer/container/seq_base.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <primer/traits/ref_proxy.hpp>
 
 namespace primer {
 namespace traits {
@@ -27,5 +29,13 @@ template <typename T>
 struct read<boost::container::vector<T>>
   : container::read_seq_helper<boost::container::vector<T>> {};
 
+template <typename T>
+struct read_type_mask<boost::container::vector<T>>
+  : type_mask_constant<table_type_mask> {};
+
+template <typename T>
+struct ref_proxy_access<boost::container::vector<T>>
+  : container::seq_proxy_helper<boost::container::vector<T>> {};
+
 } // end namespace traits
 } // end namespace primer
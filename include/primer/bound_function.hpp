@@ -28,13 +28,18 @@ PRIMER_ASSERT_FILESCOPE;
 #include <primer/lua.hpp>
 #include <primer/lua_ref.hpp>
 #include <primer/lua_ref_seq.hpp>
+#include <primer/packed_ref_seq.hpp>
 #include <primer/push.hpp>
 #include <primer/read.hpp>
+#include <primer/support/call_trace.hpp>
 #include <primer/support/function.hpp>
 #include <primer/support/function_check_stack.hpp>
 #include <primer/support/function_return.hpp>
+#include <primer/traits/read_type_mask.hpp>
 
+#include <iterator>
 #include <string>
+#include <type_traits>
 #include <utility>
 
 namespace primer {
@@ -46,7 +51,9 @@ class bound_function {
   //<-
 
   // Calls the bound_function in a protected context. This is no fail.
-  template <typename return_type, typename... Args>
+  template <typename return_type,
+            typename helper = detail::return_helper<return_type>,
+            typename... Args>
   expected<return_type> protected_call(Args &&... args) const noexcept {
     expected<return_type> result{primer::error::cant_lock_vm()};
     if (lua_State * L = ref_.lock()) {
@@ -55,13 +62,17 @@ class bound_function {
 // All versions, not just some, and the error message is unhelpful.
 // The simplest fix is to use [&] even though I don't like doing that.
 //      auto ok = mem_pcall(L, [this, L, &result, &args...]() {
+        detail::call_trace_token trace;
         auto ok = mem_pcall(L, [&]() {
           ref_.push(L);
           primer::push_each(L, std::forward<Args>(args)...);
-          detail::fcn_call(result, L, sizeof...(args));
+          detail::call_trace_begin(trace, L, L, -1 - int{sizeof...(args)},
+                                   sizeof...(args), false);
+          detail::fcn_call<return_type, helper>(result, L, sizeof...(args));
         });
 
         if (!ok) { result = std::move(ok.err()); }
+        detail::call_trace_end(trace, result);
 
       } else {
         result = std::move(stack_check.err());
@@ -77,12 +88,16 @@ class bound_function {
     expected<return_type> result{primer::error::cant_lock_vm()};
     if (lua_State * L = ref_.lock()) {
       if (auto stack_check = detail::check_stack_push_n(L, 1 + inputs.size())) {
-        auto ok = primer::mem_pcall(L, [this, &result, L, &inputs]() {
+        detail::call_trace_token trace;
+        auto ok = primer::mem_pcall(L, [this, &result, L, &inputs, &trace]() {
           ref_.push(L);
           inputs.push_each(L);
+          const int n = static_cast<int>(inputs.size());
+          detail::call_trace_begin(trace, L, L, -1 - n, n, false);
           detail::fcn_call(result, L, inputs.size());
         });
         if (!ok) { result = std::move(ok.err()); }
+        detail::call_trace_end(trace, result);
       } else {
         result = std::move(stack_check.err());
       }
@@ -113,6 +128,7 @@ public:
   lua_State * push() const noexcept { return ref_.push(); }
   bool push(lua_State * L) const noexcept { return ref_.push(L); }
   void reset() noexcept { ref_.reset(); }
+  void promote() { ref_.promote(); }
   void swap(bound_function & other) noexcept { ref_.swap(other.ref_); }
 
   // Call methods
@@ -142,12 +158,53 @@ public:
   expected<lua_ref_seq> call(lua_ref_seq const &) const noexcept;
   expected<lua_ref_seq> call(lua_ref_seq &&) const noexcept;
 
+  // As `call`, but all the results are held by a single table.
+  template <typename... Args>
+  expected<packed_ref_seq> call_packed(Args &&... args) const noexcept;
+  expected<packed_ref_seq> call_packed(lua_ref_seq &) const noexcept;
+  expected<packed_ref_seq> call_packed(lua_ref_seq const &) const noexcept;
+  expected<packed_ref_seq> call_packed(lua_ref_seq &&) const noexcept;
+
+  // Read the results directly as C++ values, without making lua_refs.
+  // `T` may be a `std::tuple` to read several results. Missing results are
+  // read as nil.
+  template <typename T, typename... Args>
+  expected<T> call_as(Args &&... args) const noexcept;
+
+  // Call the function once for each element of `range`, within a single
+  // protected context, and pass each result to `sink` as an `expected<T>`,
+  // read as by `call_as`. An error in one call is passed to the sink and the
+  // batch continues. The returned error is for failures of the whole batch.
+  /*<< The sink is called within the protected context, so it must not throw
+       or raise lua errors, and it must leave the stack as it found it. >>*/
+  template <typename T = void, typename R, typename S>
+  expected<void> call_each(const R & range, S && sink) const noexcept;
+
   // Get a debug string describing what function is bound
   // Uses lua debug api
   std::string debug_string() const;
 };
 //]
 
+namespace detail {
+
+// The name of a function, from the "n" and "S" fields of its lua_Debug.
+// This is the format of `debug_string`, and of the profiler reports.
+inline std::string
+describe_function(const lua_Debug & ar) {
+  std::string result;
+  if (*ar.namewhat) { result = ar.namewhat + std::string{" "}; }
+  if (ar.name) { result += ar.name; }
+  result += " [";
+  result += ar.short_src;
+  result += ":";
+  result += std::to_string(ar.linedefined);
+  result += "]";
+  return result;
+}
+
+} // end namespace detail
+
 inline bound_function::bound_function(lua_State * L) //
   : ref_((L && lua_gettop(L))
            ? (lua_isfunction(L, -1) ? L : (lua_pop(L, 1), nullptr))
@@ -164,14 +221,7 @@ bound_function::debug_string() const {
       result = "function ";
       lua_Debug ar;
       if (lua_getinfo(L, ">nS", &ar)) {
-        result = "";
-        if (*ar.namewhat) { result = ar.namewhat + (" " + result); }
-        if (ar.name) { result += ar.name; }
-        result += " [";
-        result += ar.short_src;
-        result += ":";
-        result += std::to_string(ar.linedefined);
-        result += "]";
+        result = detail::describe_function(ar);
       } else {
         result += "(unknown)";
       }
@@ -206,11 +256,51 @@ bound_function::debug_string() const {
 CALL_DEFINITIONS(call_no_ret, void)
 CALL_DEFINITIONS(call_one_ret, lua_ref)
 CALL_DEFINITIONS(call, lua_ref_seq)
+CALL_DEFINITIONS(call_packed, packed_ref_seq)
 
 #undef CALL_ARGS_HELPER
 #undef CALL_REF_SEQ_HELPER
 #undef CALL_DEFINITIONS
 
+template <typename T, typename... Args>
+inline expected<T>
+bound_function::call_as(Args &&... args) const noexcept {
+  return this->protected_call<T, detail::read_return_helper<T>>(
+    std::forward<Args>(args)...);
+}
+
+template <typename T, typename R, typename S>
+inline expected<void>
+bound_function::call_each(const R & range, S && sink) const noexcept {
+  using helper = detail::read_return_helper<T>;
+  using elem_t = typename std::decay<decltype(*std::begin(range))>::type;
+
+  expected<void> result{primer::error::cant_lock_vm()};
+  if (lua_State * L = ref_.lock()) {
+    // Error handler, function, its copy, and an element
+    if (auto stack_check =
+          detail::check_stack_push_each<int, int, int, elem_t>(L)) {
+      auto ok = mem_pcall(L, [&]() {
+        primer::get_error_handler(L);
+        const int handler = lua_gettop(L);
+        ref_.push(L);
+        for (const auto & elem : range) {
+          lua_pushvalue(L, handler + 1);
+          primer::push(L, elem);
+          expected<T> r{primer::error::cant_lock_vm()};
+          detail::pinned_fcn_call<T, helper>(r, L, 1, handler);
+          sink(std::move(r));
+        }
+        lua_settop(L, handler - 1);
+      });
+      result = std::move(ok);
+    } else {
+      result = std::move(stack_check.err());
+    }
+  }
+  return result;
+}
+
 inline void
 swap(bound_function & one, bound_function & other) noexcept {
   one.swap(other);
@@ -246,5 +336,10 @@ struct read<primer::bound_function> {
   static constexpr int stack_space_needed{1};
 };
 
+template <>
+struct read_type_mask<primer::bound_function>
+  : type_mask_constant<lua_type_bit(LUA_TNONE) | lua_type_bit(LUA_TNIL)
+                       | lua_type_bit(LUA_TFUNCTION)> {};
+
 } // end namespace traits
 } // end namespace primer
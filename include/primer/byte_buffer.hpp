@@ -0,0 +1,480 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A byte buffer is a userdata holding a mutable, growable, contiguous block of
+ * bytes, for passing payloads between lua and C++ without making lua strings
+ * of them.
+ *
+ * From lua, a buffer supports `#b`, and methods which read and write numbers
+ * at byte positions, like `b:get_u16(pos)` and `b:set_f64(pos, x)`, in the
+ * byte order of the machine. Positions are 1-based, as for `string.unpack`,
+ * and reading or writing out of range is an error. `b:slice(i, j)` gives a
+ * slice of the bytes `i` to `j`, which has the same methods, and refers to the
+ * buffer without copying. A slice keeps its buffer alive, and if the buffer is
+ * shrunk, the slice only sees the bytes which remain.
+ *
+ * C++ code may read `primer::byte_buffer &`, or `primer::byte_span`, which
+ * accepts a buffer or a slice, and points to its bytes. A span is valid until
+ * the buffer is resized, so it shouldn't be kept after the callback returns.
+ *
+ * A buffer or span can be loaded as a lua chunk without copying it, by
+ * `primer::load_bytes`, e.g. in a VFS provider.
+ *
+ * A buffer is persisted as one string of its bytes, see
+ * <primer/support/raw_persist.hpp>, and restored as a new buffer. Its
+ * reconstructor is in the permanents of its userdata trait. A slice is a
+ * reference into a buffer, and can't be persisted.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/adapt.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/read.hpp>
+#include <primer/result.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/diagnostics.hpp>
+#include <primer/support/raw_persist.hpp>
+#include <primer/support/userdata_common.hpp>
+#include <primer/traits/read.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <primer/traits/userdata.hpp>
+#include <primer/userdata.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+//[ primer_byte_buffer
+class byte_buffer {
+  std::vector<unsigned char> bytes_;
+
+public:
+  byte_buffer() noexcept = default;
+
+  /*<< May throw `std::bad_alloc` >>*/
+  explicit byte_buffer(std::size_t n)
+    : bytes_(n) {}
+
+  /// Takes over the bytes of a vector, without copying them
+  explicit byte_buffer(std::vector<unsigned char> v) noexcept
+    : bytes_(std::move(v)) {}
+
+  unsigned char * data() noexcept { return bytes_.data(); }
+  const unsigned char * data() const noexcept { return bytes_.data(); }
+  std::size_t size() const noexcept { return bytes_.size(); }
+  bool empty() const noexcept { return bytes_.empty(); }
+
+  /// New bytes are zero
+  /*<< May throw `std::bad_alloc` >>*/
+  void resize(std::size_t n) { bytes_.resize(n); }
+
+  /*<< May throw `std::bad_alloc` >>*/
+  void append(const void * src, std::size_t n) {
+    const auto * p = static_cast<const unsigned char *>(src);
+    bytes_.insert(bytes_.end(), p, p + n);
+  }
+
+  std::vector<unsigned char> & bytes() noexcept { return bytes_; }
+  const std::vector<unsigned char> & bytes() const noexcept { return bytes_; }
+};
+
+/// The bytes of a buffer or of a slice, which it doesn't own
+struct byte_span {
+  unsigned char * data_;
+  std::size_t size_;
+
+  unsigned char * data() const noexcept { return data_; }
+  std::size_t size() const noexcept { return size_; }
+  bool empty() const noexcept { return !size_; }
+
+  unsigned char * begin() const noexcept { return data_; }
+  unsigned char * end() const noexcept { return data_ + size_; }
+  unsigned char & operator[](std::size_t i) const noexcept { return data_[i]; }
+};
+
+/// Load bytes as a lua chunk, like `luaL_loadbuffer`
+inline int
+load_bytes(lua_State * L, byte_span bytes, const char * chunkname) {
+  return luaL_loadbuffer(L, reinterpret_cast<const char *>(bytes.data()),
+                         bytes.size(), chunkname);
+}
+//]
+
+namespace detail {
+
+// A slice is bytes of the buffer which is its uservalue
+struct byte_slice {
+  std::size_t offset;
+  std::size_t size;
+};
+
+} // end namespace detail
+
+namespace traits {
+
+template <>
+struct userdata<primer::byte_buffer> {
+  static constexpr const char * name = "primer_byte_buffer";
+  static void metatable(lua_State * L);
+  static const std::vector<luaL_Reg> & permanents();
+};
+
+template <>
+struct userdata<primer::detail::byte_slice> {
+  static constexpr const char * name = "primer_byte_slice";
+  static constexpr int user_values = 1;
+  static void metatable(lua_State * L);
+};
+
+} // end namespace traits
+
+namespace detail {
+
+// The bytes which the slice at `idx` can still see
+inline byte_span
+byte_slice_span(lua_State * L, int idx, const byte_slice & s) {
+  lua_getuservalue(L, idx);
+  byte_buffer * b = primer::test_udata<byte_buffer>(L, -1);
+  lua_pop(L, 1);
+  if (!b || s.offset >= b->size()) { return byte_span{nullptr, 0}; }
+  const std::size_t rest = b->size() - s.offset;
+  return byte_span{b->data() + s.offset, s.size < rest ? s.size : rest};
+}
+
+// The methods take their object at index 1
+inline byte_span
+byte_span_of(lua_State *, byte_buffer & b) {
+  return byte_span{b.data(), b.size()};
+}
+
+inline byte_span
+byte_span_of(lua_State * L, byte_slice & s) {
+  return byte_slice_span(L, 1, s);
+}
+
+// The position of `n` bytes at 1-based `pos`, or an error
+inline expected<std::size_t>
+byte_position(byte_span bytes, LUA_INTEGER pos, std::size_t n) {
+  if (pos < 1 || static_cast<std::size_t>(pos - 1) > bytes.size()
+      || bytes.size() - static_cast<std::size_t>(pos - 1) < n) {
+    return primer::error{"Position ", pos, " out of bounds, size is ",
+                         bytes.size()};
+  }
+  return static_cast<std::size_t>(pos - 1);
+}
+
+template <typename T>
+void
+byte_push_number(lua_State * L, T t, std::true_type) {
+  lua_pushinteger(L, static_cast<LUA_INTEGER>(t));
+}
+
+template <typename T>
+void
+byte_push_number(lua_State * L, T t, std::false_type) {
+  lua_pushnumber(L, static_cast<LUA_NUMBER>(t));
+}
+
+template <typename S, typename T>
+primer::result
+byte_get(lua_State * L, S & self, LUA_INTEGER pos) {
+  const byte_span bytes = byte_span_of(L, self);
+  auto p = byte_position(bytes, pos, sizeof(T));
+  if (!p) { return std::move(p.err()); }
+  T t;
+  std::memcpy(&t, bytes.data() + *p, sizeof(T));
+  byte_push_number(L, t, std::is_integral<T>{});
+  return 1;
+}
+
+template <typename S, typename T>
+primer::result
+byte_set_integer(lua_State * L, S & self, LUA_INTEGER pos, LUA_INTEGER v) {
+  if (v < static_cast<LUA_INTEGER>(std::numeric_limits<T>::min())
+      || v > static_cast<LUA_INTEGER>(std::numeric_limits<T>::max())) {
+    return primer::error::integer_overflow(v);
+  }
+  const byte_span bytes = byte_span_of(L, self);
+  auto p = byte_position(bytes, pos, sizeof(T));
+  if (!p) { return std::move(p.err()); }
+  const T t = static_cast<T>(v);
+  std::memcpy(bytes.data() + *p, &t, sizeof(T));
+  return 0;
+}
+
+template <typename S, typename T>
+primer::result
+byte_set_number(lua_State * L, S & self, LUA_INTEGER pos, LUA_NUMBER v) {
+  const byte_span bytes = byte_span_of(L, self);
+  auto p = byte_position(bytes, pos, sizeof(T));
+  if (!p) { return std::move(p.err()); }
+  const T t = static_cast<T>(v);
+  std::memcpy(bytes.data() + *p, &t, sizeof(T));
+  return 0;
+}
+
+// Bytes `i` to `j` inclusive, clamped, as for `string.sub`
+inline void
+byte_range(std::size_t size, LUA_INTEGER i, LUA_INTEGER j, std::size_t & first,
+           std::size_t & count) {
+  const auto n = static_cast<LUA_INTEGER>(size);
+  if (i < 0) { i = n + i + 1; }
+  if (j < 0) { j = n + j + 1; }
+  if (i < 1) { i = 1; }
+  if (j > n) { j = n; }
+  if (i > j) {
+    first = count = 0;
+    return;
+  }
+  first = static_cast<std::size_t>(i - 1);
+  count = static_cast<std::size_t>(j - i + 1);
+}
+
+// Push a slice of the buffer at `owner`
+inline void
+push_byte_slice(lua_State * L, int owner, std::size_t offset,
+                std::size_t size) {
+  owner = lua_absindex(L, owner);
+  primer::push_udata<byte_slice>(L, byte_slice{offset, size});
+  lua_pushvalue(L, owner);
+  lua_setuservalue(L, -2);
+}
+
+// An optional integer argument
+inline expected<LUA_INTEGER>
+byte_opt_integer(lua_State * L, int idx, LUA_INTEGER def) {
+  if (lua_isnoneornil(L, idx)) { return def; }
+  return primer::read<LUA_INTEGER>(L, idx);
+}
+
+inline primer::result
+byte_buffer_slice(lua_State * L, byte_buffer & b, LUA_INTEGER i) {
+  auto j = byte_opt_integer(L, 3, -1);
+  if (!j) { return std::move(j.err()); }
+  std::size_t first, count;
+  byte_range(b.size(), i, *j, first, count);
+  push_byte_slice(L, 1, first, count);
+  return 1;
+}
+
+inline primer::result
+byte_slice_slice(lua_State * L, byte_slice & s, LUA_INTEGER i) {
+  auto j = byte_opt_integer(L, 3, -1);
+  if (!j) { return std::move(j.err()); }
+  std::size_t first, count;
+  byte_range(byte_slice_span(L, 1, s).size(), i, *j, first, count);
+  lua_getuservalue(L, 1);
+  push_byte_slice(L, -1, s.offset + first, count);
+  return 1;
+}
+
+// A copy of bytes `i` to `j` as a string, by default all of them
+template <typename S>
+primer::result
+byte_tostring(lua_State * L, S & self) {
+  auto i = byte_opt_integer(L, 2, 1);
+  if (!i) { return std::move(i.err()); }
+  auto j = byte_opt_integer(L, 3, -1);
+  if (!j) { return std::move(j.err()); }
+  const byte_span bytes = byte_span_of(L, self);
+  std::size_t first, count;
+  byte_range(bytes.size(), *i, *j, first, count);
+  lua_pushlstring(L, reinterpret_cast<const char *>(bytes.data() + first),
+                  count);
+  return 1;
+}
+
+template <typename S>
+primer::result
+byte_len(lua_State * L, S & self) {
+  lua_pushinteger(L, static_cast<LUA_INTEGER>(byte_span_of(L, self).size()));
+  return 1;
+}
+
+inline primer::result
+byte_buffer_resize(lua_State *, byte_buffer & b, LUA_INTEGER n) {
+  if (n < 0) { return primer::error{"Size ", n, " is negative"}; }
+  PRIMER_TRY_BAD_ALLOC { b.resize(static_cast<std::size_t>(n)); }
+  PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+  return 0;
+}
+
+// Append a string, or the bytes of a buffer or a slice
+inline primer::result
+byte_buffer_append(lua_State * L, byte_buffer & b) {
+  const unsigned char * src = nullptr;
+  std::size_t n = 0;
+  if (lua_type(L, 2) == LUA_TSTRING) {
+    src = reinterpret_cast<const unsigned char *>(lua_tolstring(L, 2, &n));
+  } else if (auto bytes = primer::read<byte_span>(L, 2)) {
+    src = bytes->data();
+    n = bytes->size();
+  } else {
+    return primer::arg_error(L, 2, "string or byte buffer");
+  }
+  // The source may be `b` itself, which could move while growing
+  const std::size_t offset =
+    (src >= b.data() && src < b.data() + b.size())
+      ? static_cast<std::size_t>(src - b.data())
+      : b.size() + 1;
+  PRIMER_TRY_BAD_ALLOC {
+    if (offset <= b.size()) {
+      const std::size_t old = b.size();
+      b.resize(old + n);
+      std::memmove(b.data() + old, b.data() + offset, n);
+    } else {
+      b.append(src, n);
+    }
+  }
+  PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+  return 0;
+}
+
+// Populate the metatable on top of the stack, with the methods of buffers and
+// slices, and then `extra`
+template <typename S>
+void
+byte_populate(lua_State * L, std::initializer_list<luaL_Reg> extra) {
+  static const luaL_Reg methods[] = {
+    {"get_i8", PRIMER_ADAPT((&byte_get<S, std::int8_t>))},
+    {"get_u8", PRIMER_ADAPT((&byte_get<S, std::uint8_t>))},
+    {"get_i16", PRIMER_ADAPT((&byte_get<S, std::int16_t>))},
+    {"get_u16", PRIMER_ADAPT((&byte_get<S, std::uint16_t>))},
+    {"get_i32", PRIMER_ADAPT((&byte_get<S, std::int32_t>))},
+    {"get_u32", PRIMER_ADAPT((&byte_get<S, std::uint32_t>))},
+    {"get_i64", PRIMER_ADAPT((&byte_get<S, std::int64_t>))},
+    {"get_f32", PRIMER_ADAPT((&byte_get<S, float>))},
+    {"get_f64", PRIMER_ADAPT((&byte_get<S, double>))},
+    {"set_i8", PRIMER_ADAPT((&byte_set_integer<S, std::int8_t>))},
+    {"set_u8", PRIMER_ADAPT((&byte_set_integer<S, std::uint8_t>))},
+    {"set_i16", PRIMER_ADAPT((&byte_set_integer<S, std::int16_t>))},
+    {"set_u16", PRIMER_ADAPT((&byte_set_integer<S, std::uint16_t>))},
+    {"set_i32", PRIMER_ADAPT((&byte_set_integer<S, std::int32_t>))},
+    {"set_u32", PRIMER_ADAPT((&byte_set_integer<S, std::uint32_t>))},
+    {"set_i64", PRIMER_ADAPT((&byte_set_integer<S, std::int64_t>))},
+    {"set_f32", PRIMER_ADAPT((&byte_set_number<S, float>))},
+    {"set_f64", PRIMER_ADAPT((&byte_set_number<S, double>))},
+    {"tostring", PRIMER_ADAPT(&byte_tostring<S>)},
+    {"__len", PRIMER_ADAPT(&byte_len<S>)}};
+
+  for (const luaL_Reg & r : methods) {
+    lua_pushcfunction(L, r.func);
+    lua_setfield(L, -2, r.name);
+  }
+  for (const luaL_Reg & r : extra) {
+    lua_pushcfunction(L, r.func);
+    lua_setfield(L, -2, r.name);
+  }
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  if (udata_needs_gc<S>::value) {
+    lua_pushcfunction(L, &common_gc_impl<S>);
+    lua_setfield(L, -2, "__gc");
+  }
+  // A buffer replaces this with its own, and a slice is a reference
+  lua_pushboolean(L, false);
+  lua_setfield(L, -2, "__persist");
+  lua_pushstring(L, primer::traits::userdata<S>::name);
+  lua_setfield(L, -2, "__metatable");
+}
+
+// The reconstructor of a buffer. Upvalue 1 is the persisted block.
+inline int
+byte_buffer_restore(lua_State * L) {
+  std::size_t len = 0;
+  const char * s = lua_tolstring(L, lua_upvalueindex(1), &len);
+  raw_persist_block block;
+  if (!s || !raw_persist_parse(s, len, 'u', 1, block)) {
+    return luaL_error(L, "Could not rebuild a persisted '%s'",
+                      primer::traits::userdata<byte_buffer>::name);
+  }
+  primer::push_udata<byte_buffer>(L);
+  byte_buffer * b = primer::test_udata<byte_buffer>(L, -1);
+  bool ok = true;
+  PRIMER_TRY_BAD_ALLOC { b->append(block.data, block.count); }
+  PRIMER_CATCH_BAD_ALLOC { ok = false; }
+  if (!ok) { return luaL_error(L, "not enough memory"); }
+  return 1;
+}
+
+inline int
+byte_buffer_persist(lua_State * L) {
+  const byte_buffer * b = primer::test_udata<byte_buffer>(L, 1);
+  if (!b) {
+    return luaL_argerror(L, 1, primer::traits::userdata<byte_buffer>::name);
+  }
+  raw_persist_push(L, 'u', 1, b->data(), b->size());
+  lua_pushcclosure(L, &byte_buffer_restore, 1);
+  return 1;
+}
+
+} // end namespace detail
+
+namespace traits {
+
+inline void
+userdata<primer::byte_buffer>::metatable(lua_State * L) {
+  PRIMER_ASSERT_TABLE(L);
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  detail::byte_populate<primer::byte_buffer>(
+    L, {{"slice", PRIMER_ADAPT(&detail::byte_buffer_slice)},
+        {"resize", PRIMER_ADAPT(&detail::byte_buffer_resize)},
+        {"append", PRIMER_ADAPT(&detail::byte_buffer_append)}});
+  lua_pushcfunction(L, &detail::byte_buffer_persist);
+  lua_setfield(L, -2, "__persist");
+}
+
+inline const std::vector<luaL_Reg> &
+userdata<primer::byte_buffer>::permanents() {
+  static const std::vector<luaL_Reg> permanents_array{
+    {"primer_byte_buffer.restore", &detail::byte_buffer_restore}};
+  return permanents_array;
+}
+
+inline void
+userdata<primer::detail::byte_slice>::metatable(lua_State * L) {
+  PRIMER_ASSERT_TABLE(L);
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  detail::byte_populate<primer::detail::byte_slice>(
+    L, {{"slice", PRIMER_ADAPT(&detail::byte_slice_slice)}});
+}
+
+template <>
+struct read<primer::byte_span> {
+  static expected<primer::byte_span> from_stack(lua_State * L, int idx) {
+    if (auto * b = primer::test_udata<primer::byte_buffer>(L, idx)) {
+      return primer::byte_span{b->data(), b->size()};
+    }
+    if (auto * s = primer::test_udata<primer::detail::byte_slice>(L, idx)) {
+      return detail::byte_slice_span(L, lua_absindex(L, idx), *s);
+    }
+    return primer::arg_error(L, idx, "byte buffer");
+  }
+  static constexpr int stack_space_needed{2};
+};
+
+template <>
+struct read_type_mask<primer::byte_span>
+  : type_mask_constant<lua_type_bit(LUA_TUSERDATA)> {};
+
+} // end namespace traits
+
+} // end namespace primer
@@ -0,0 +1,203 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A cached<T> is a read wrapper, which remembers the conversion of each table
+ * to `T`, so that reading the same table again costs one lookup.
+ *
+ *   primer::result on_spawn(lua_State * L, primer::cached<spawn_config> cfg,
+ *                           int count);
+ *
+ * The conversions are kept, for each `T`, in a table in the registry with weak
+ * keys, from each table to a userdata holding a `std::shared_ptr<const T>`.
+ * So a conversion is forgotten when its table is collected, and a `cached<T>`
+ * holds the value for as long as it needs to, even if it is forgotten.
+ *
+ * The cache doesn't see if the table is changed later. This is meant for
+ * tables which don't change, like configuration. When one does, call
+ * `primer::invalidate_cached<T>(L, idx)`, or `primer::clear_cached<T>(L)` to
+ * forget all of them.
+ *
+ * Only tables are cached. Values of other types are converted each time.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/detail/max_int.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/read.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/traits/read_type_mask.hpp>
+
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace primer {
+
+//[ primer_cached
+template <typename T>
+class cached {
+  std::shared_ptr<const T> value_;
+
+public:
+  explicit cached(std::shared_ptr<const T> v) noexcept
+    : value_(std::move(v)) {}
+
+  const T & get() const noexcept { return *value_; }
+  const T & operator*() const noexcept { return *value_; }
+  const T * operator->() const noexcept { return value_.get(); }
+
+  // Shares ownership of the value
+  const std::shared_ptr<const T> & pointer() const noexcept { return value_; }
+};
+
+/// Forget the conversion of the table at `idx`, if there is one
+template <typename T>
+void invalidate_cached(lua_State * L, int idx);
+
+/// Forget all the conversions to `T`
+template <typename T>
+void clear_cached(lua_State * L);
+//]
+
+namespace detail {
+
+template <typename T>
+int
+cached_entry_gc(lua_State * L) noexcept {
+  using ptr_t = std::shared_ptr<const T>;
+  static_cast<ptr_t *>(lua_touserdata(L, 1))->~ptr_t();
+  return 0;
+}
+
+template <typename T>
+void
+cached_entry_metatable(lua_State * L) {
+  lua_createtable(L, 0, 1);
+  lua_pushcfunction(L, &cached_entry_gc<T>);
+  lua_setfield(L, -2, "__gc");
+}
+
+// The table of conversions to `T`, with weak keys
+template <typename T>
+void
+cached_memo(lua_State * L) {
+  lua_newtable(L);
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+}
+
+// The memo, the userdata, and its metatable while it is created
+constexpr int cached_stack_space = 4;
+
+} // end namespace detail
+
+template <typename T>
+void
+invalidate_cached(lua_State * L, int idx) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  idx = lua_absindex(L, idx);
+  primer::push_singleton<&detail::cached_memo<T>>(L);
+  lua_pushvalue(L, idx);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+template <typename T>
+void
+clear_cached(lua_State * L) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  primer::push_singleton<&detail::cached_memo<T>>(L);
+  const int memo = lua_absindex(L, -1);
+  lua_pushnil(L);
+  while (lua_next(L, memo)) {
+    // Clearing the field of the key being visited is allowed by lua_next
+    lua_pop(L, 1);
+    lua_pushvalue(L, -1);
+    lua_pushnil(L);
+    lua_rawset(L, memo);
+  }
+  lua_pop(L, 1);
+}
+
+namespace traits {
+
+template <typename T>
+struct read<primer::cached<T>> {
+  using ptr_t = std::shared_ptr<const T>;
+
+  static expected<primer::cached<T>> from_stack(lua_State * L, int idx) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    idx = lua_absindex(L, idx);
+    if (!lua_istable(L, idx)) {
+      auto value = traits::read<T>::from_stack(L, idx);
+      if (!value) { return std::move(value.err()); }
+
+      expected<primer::cached<T>> result{primer::error{}};
+      PRIMER_TRY_BAD_ALLOC {
+        result =
+          primer::cached<T>{std::make_shared<const T>(*std::move(value))};
+      }
+      PRIMER_CATCH_BAD_ALLOC { result = primer::error::bad_alloc(); }
+      return result;
+    }
+
+    primer::push_singleton<&detail::cached_memo<T>>(L);
+    const int memo = lua_absindex(L, -1);
+    lua_pushvalue(L, idx);
+    lua_rawget(L, memo);
+    if (const auto * p = static_cast<const ptr_t *>(lua_touserdata(L, -1))) {
+      primer::cached<T> result{*p};
+      lua_pop(L, 2);
+      return result;
+    }
+    lua_pop(L, 1);
+
+    expected<primer::cached<T>> result{primer::error{}};
+    {
+      auto value = traits::read<T>::from_stack(L, idx);
+      if (!value) {
+        lua_pop(L, 1);
+        return std::move(value.err());
+      }
+      PRIMER_TRY_BAD_ALLOC {
+        result =
+          primer::cached<T>{std::make_shared<const T>(*std::move(value))};
+      }
+      PRIMER_CATCH_BAD_ALLOC {
+        lua_pop(L, 1);
+        return primer::error::bad_alloc();
+      }
+    }
+
+    lua_pushvalue(L, idx);
+    new (lua_newuserdata(L, sizeof(ptr_t))) ptr_t{result->pointer()};
+    primer::push_singleton<&detail::cached_entry_metatable<T>>(L);
+    lua_setmetatable(L, -2);
+    lua_rawset(L, memo);
+    lua_pop(L, 1);
+    return result;
+  }
+  static constexpr int stack_space_needed{detail::max_int(
+    detail::cached_stack_space, 1 + traits::read<T>::stack_space_needed)};
+};
+
+template <typename T>
+struct read_type_mask<primer::cached<T>> : read_type_mask<T> {};
+
+} // end namespace traits
+
+} // end namespace primer
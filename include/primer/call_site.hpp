@@ -0,0 +1,175 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A call_site is a prepared context for calling one bound_function many times
+ * in a row.
+ *
+ * Each call through `bound_function` locks the weak state ref, fetches the
+ * function from the registry, fetches the error handler from the registry by
+ * string key, and (unless `PRIMER_NO_MEMORY_FAILURE` is defined) sets up a
+ * protected context for memory errors.
+ *
+ * A call_site does the locking and the registry lookups once, when it is
+ * constructed, and pins the error handler and the function in two slots of the
+ * main thread's stack. Each call is then a `lua_pushvalue`, pushing the
+ * arguments, `lua_pcall`, and reading the results.
+ *
+ * The pinned slots are removed when the call_site is destroyed. In between,
+ * the stack above them must be balanced whenever a call is made, so a
+ * call_site should be a local object scoped to one batch of calls.
+ * The lua state must stay open for the lifetime of the call_site.
+ *
+ * The call methods mirror those of `bound_function`, they do not raise lua
+ * errors or throw exceptions.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/bound_function.hpp>
+#include <primer/cpp_pcall.hpp>
+#include <primer/error.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/error_handler.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/lua_ref_seq.hpp>
+#include <primer/push.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/function_check_stack.hpp>
+#include <primer/support/function_return.hpp>
+
+#include <utility>
+
+namespace primer {
+
+//[ primer_call_site
+class call_site {
+  lua_State * L_ = nullptr;
+  int handler_ = 0; // Absolute index of the error handler
+  int func_ = 0;    // Absolute index of the function
+
+  //<-
+  template <typename return_type,
+            typename helper = detail::return_helper<return_type>,
+            typename... Args>
+  expected<return_type> protected_call(Args &&... args) noexcept;
+  //->
+public:
+  /*<< Locks the state of `f` and pins its function and the error handler.
+       If `f` is empty or its state is gone, the call_site is empty, and
+       calls report `cant_lock_vm`. >>*/
+  explicit call_site(const bound_function & f) noexcept;
+  ~call_site() noexcept;
+
+  call_site(const call_site &) = delete;
+  call_site & operator=(const call_site &) = delete;
+
+  explicit operator bool() const noexcept { return L_; }
+
+  // Call methods, as in `bound_function`
+  template <typename... Args>
+  expected<void> call_no_ret(Args &&... args) noexcept;
+
+  template <typename... Args>
+  expected<lua_ref> call_one_ret(Args &&... args) noexcept;
+
+  template <typename... Args>
+  expected<lua_ref_seq> call(Args &&... args) noexcept;
+
+  template <typename T, typename... Args>
+  expected<T> call_as(Args &&... args) noexcept;
+};
+//]
+
+inline call_site::call_site(const bound_function & f) noexcept {
+  lua_State * L = f.lock();
+  if (!L || !lua_checkstack(L, 2)) { return; }
+
+  primer::get_error_handler(L);
+  f.push(L);
+  if (!lua_isfunction(L, -1)) {
+    lua_pop(L, 2);
+    return;
+  }
+  L_ = L;
+  func_ = lua_gettop(L);
+  handler_ = func_ - 1;
+}
+
+inline call_site::~call_site() noexcept {
+  if (L_) {
+    PRIMER_ASSERT(lua_gettop(L_) == func_, "call_site stack discipline error");
+    lua_settop(L_, handler_ - 1);
+  }
+}
+
+template <typename return_type, typename helper, typename... Args>
+expected<return_type>
+call_site::protected_call(Args &&... args) noexcept {
+  expected<return_type> result{primer::error::cant_lock_vm()};
+  if (lua_State * L = L_) {
+    PRIMER_ASSERT(lua_gettop(L) == func_, "call_site stack discipline error");
+    if (auto stack_check = detail::check_stack_push_each<int, int, int, int,
+                                                         Args...>(L)) {
+#ifdef PRIMER_NO_MEMORY_FAILURE
+      lua_pushvalue(L, func_);
+      primer::push_each(L, std::forward<Args>(args)...);
+      detail::pinned_fcn_call<return_type, helper>(result, L, sizeof...(args),
+                                                   handler_);
+#else
+      // Inside the protected frame, the handler and function are at 1 and 2.
+      auto f = [&]() {
+        lua_pushvalue(L, 2);
+        primer::push_each(L, std::forward<Args>(args)...);
+        detail::pinned_fcn_call<return_type, helper>(result, L,
+                                                     sizeof...(args), 1);
+        lua_settop(L, 0);
+      };
+      lua_pushcfunction(L, &detail::lambda_arg_dispatch<decltype(f)>);
+      lua_pushlightuserdata(L, static_cast<void *>(&f));
+      lua_pushvalue(L, handler_);
+      lua_pushvalue(L, func_);
+      const int code = lua_pcall(L, 3, 0, handler_);
+      if (code != LUA_OK) { result = primer::pop_error(L, code); }
+#endif
+    } else {
+      result = std::move(stack_check.err());
+    }
+  }
+  return result;
+}
+
+template <typename... Args>
+inline expected<void>
+call_site::call_no_ret(Args &&... args) noexcept {
+  return this->protected_call<void>(std::forward<Args>(args)...);
+}
+
+template <typename... Args>
+inline expected<lua_ref>
+call_site::call_one_ret(Args &&... args) noexcept {
+  return this->protected_call<lua_ref>(std::forward<Args>(args)...);
+}
+
+template <typename... Args>
+inline expected<lua_ref_seq>
+call_site::call(Args &&... args) noexcept {
+  return this->protected_call<lua_ref_seq>(std::forward<Args>(args)...);
+}
+
+template <typename T, typename... Args>
+inline expected<T>
+call_site::call_as(Args &&... args) noexcept {
+  return this->protected_call<T, detail::read_return_helper<T>>(
+    std::forward<Args>(args)...);
+}
+
+} // end namespace primer
@@ -0,0 +1,146 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_cancel_token_overview
+/*`
+A `primer::cancel_token` lets another thread, e.g. a supervisor, stop a script
+which is running on a lua thread, without waiting for the call to return.
+
+``
+  primer::cancel_token token;
+  auto ok = token.attach(L);
+  ...
+  // on the thread which owns L
+  auto r = token.run([&]() { return f.call_no_ret(); });
+  if (!r && r.err().is_cancelled()) { ... }
+
+  // on the supervisor thread, or in a signal handler
+  token.cancel();
+``
+
+`attach` subscribes the token to the `primer::hook_mux` of the thread, with
+no events and no count, so while no cancellation is pending there is no hook
+at all, unless other subscribers want one. `cancel` sets an atomic flag and
+calls `hook_mux::interrupt`, which only does a `lua_sethook`, so it is safe
+from any thread and from a signal handler. At the next instruction, the hook
+raises the error "cancelled". It is raised again at each instruction until the
+call has unwound, so `pcall` can't catch it for good. `run` then reports
+`primer::error::cancelled()`, which `is_cancelled()` tells apart from the
+errors of the script.
+
+The token stays cancelled, so later calls fail at their first instruction,
+until the owner calls `reset()`. If the owner thread reinstalls its hook at the
+moment of the cancellation, e.g. a profiler subscribes, the interrupt can be
+lost, but the flag is seen at the next event of the multiplexer, and `cancel`
+may be called again.
+
+Only the attached thread is interrupted. A coroutine which it resumes is
+stopped once it yields back, or sooner if it runs the hook of the multiplexer
+for another subscriber, since the flag is checked at every event. The token
+must be detached, or destroyed, on the owner thread, and it can't be moved
+while it is attached.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/cpp_pcall.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/hook_mux.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/lua_state_ref.hpp>
+#include <primer/support/main_thread.hpp>
+
+#include <atomic>
+#include <utility>
+
+namespace primer {
+
+class cancel_token {
+  lua_state_ref sref_;
+  std::atomic<lua_State *> thread_{nullptr};
+  hook_mux::subscription hook_ = -1;
+  std::atomic<bool> requested_{false};
+  bool raised_ = false;
+
+  static void cancel_hook(lua_State * L, lua_Debug *, void * ud) {
+    auto * t = static_cast<cancel_token *>(ud);
+    if (!t->requested_.load(std::memory_order_acquire)) { return; }
+    t->raised_ = true;
+    luaL_error(L, "cancelled");
+  }
+
+public:
+  cancel_token() noexcept = default;
+  ~cancel_token() noexcept { this->detach(); }
+
+  cancel_token(const cancel_token &) = delete;
+  cancel_token & operator=(const cancel_token &) = delete;
+
+  // Subscribes to the hook of `T`. Fails if `T` has a hook which isn't shared,
+  // or on memory allocation failure.
+  expected<void> attach(lua_State * T) noexcept {
+    this->detach();
+    // `T` may be a suspended coroutine, which can't make a call
+    lua_State * M = primer::main_thread(T);
+    auto ok = primer::mem_pcall(M, [this, M]() {
+      sref_ = primer::obtain_state_ref(M);
+    });
+    if (!ok) { return std::move(ok.err()); }
+    auto s = hook_mux::subscribe(T, &cancel_hook, this, 0, 0, &requested_);
+    if (!s) {
+      sref_.reset();
+      return std::move(s.err());
+    }
+    thread_ = T;
+    hook_ = *s;
+    return {};
+  }
+
+  // Removes the subscription, if the state is still open
+  void detach() noexcept {
+    lua_State * T = thread_.exchange(nullptr);
+    if (T && sref_.lock()) { hook_mux::unsubscribe(T, hook_); }
+    sref_.reset();
+    hook_ = -1;
+  }
+
+  bool attached() const noexcept { return thread_.load(); }
+
+  // May be called from any thread, or a signal handler
+  void cancel() noexcept {
+    requested_.store(true, std::memory_order_release);
+    if (lua_State * T = thread_.load()) { hook_mux::interrupt(T); }
+  }
+
+  bool cancelled() const noexcept {
+    return requested_.load(std::memory_order_acquire);
+  }
+
+  // Lets calls run again. Called by the owner thread, when nothing is running.
+  void reset() noexcept {
+    requested_.store(false, std::memory_order_release);
+    raised_ = false;
+    lua_State * T = thread_.load();
+    if (T && sref_.lock()) { hook_mux::set_count(T, hook_, 0); }
+  }
+
+  // Runs `f`, e.g. a call of a `bound_function`, which must return an
+  // `expected`. If the call was cancelled, its error is `error::cancelled()`.
+  template <typename F>
+  auto run(F && f) -> decltype(f()) {
+    raised_ = false;
+    auto result = std::forward<F>(f)();
+    if (!result && raised_) { result = primer::error::cancelled(); }
+    return result;
+  }
+};
+
+} // end namespace primer
@@ -0,0 +1,126 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * How to push a lambda (or other function object) to the stack, as a closure.
+ *
+ * The function object is constructed directly in a userdata, which becomes the
+ * only upvalue of an adapted C closure. Its call signature is taken from its
+ * `operator()`, which must look like `R(lua_State *, Args...)`, and be
+ * adaptable via `PRIMER_ADAPT`. (So, it can't be a generic lambda.)
+ *
+ * Compared to `push_std_function`, there is no `std::function` in the middle,
+ * so pushing costs exactly one allocation (the userdata), and calling does not
+ * go through type erasure. If the function object is trivially destructible,
+ * no metatable is installed at all, since there is nothing to `__gc`.
+ * Otherwise, the metatable is cached per function object type.
+ *
+ * Like `push_std_function`, this is not compatible with eris persistence.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/adapt.hpp>
+#include <primer/lua.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/support/asserts.hpp>
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace primer {
+
+namespace detail {
+
+// Get `R(lua_State *, Args...)` from a pointer to member `operator()`
+template <typename T>
+struct closure_signature;
+
+template <typename C, typename R, typename... Args>
+struct closure_signature<R (C::*)(lua_State *, Args...) const> {
+  using type = R(lua_State *, Args...);
+};
+
+template <typename C, typename R, typename... Args>
+struct closure_signature<R (C::*)(lua_State *, Args...)> {
+  using type = R(lua_State *, Args...);
+};
+
+// Lua only guarantees that userdata are suitably aligned for these types.
+union closure_max_align {
+  double d;
+  void * p;
+  long l;
+  long long ll;
+};
+
+template <typename F, typename S>
+struct closure_udata;
+
+template <typename F, typename R, typename... Args>
+struct closure_udata<F, R(lua_State *, Args...)> {
+  PRIMER_STATIC_ASSERT(alignof(F) <= alignof(closure_max_align),
+                       "function object is overaligned for lua userdata");
+
+  // gc function for userdata
+  static int gc(lua_State * L) {
+    PRIMER_ASSERT(lua_isuserdata(L, 1),
+                  "gc called with argument that is not userdata");
+
+    F * ptr = static_cast<F *>(lua_touserdata(L, 1));
+    ptr->~F();
+    lua_pushnil(L);
+    lua_setmetatable(L, -2);
+    return 0;
+  }
+
+  static void push_metatable(lua_State * L) {
+    lua_newtable(L);
+    lua_pushcfunction(L, &closure_udata::gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushliteral(L, "closure");
+    lua_setfield(L, -2, "__metatable");
+  }
+
+  static R closure_function(lua_State * L, Args... args) noexcept {
+    PRIMER_ASSERT(lua_isuserdata(L, lua_upvalueindex(1)),
+                  "closure_function called but first upvalue is not userdata");
+    F * f = static_cast<F *>(lua_touserdata(L, lua_upvalueindex(1)));
+    return (*f)(L, std::forward<Args>(args)...);
+  }
+
+  template <typename G>
+  static void push_instance(lua_State * L, G && g) {
+    new (lua_newuserdata(L, sizeof(F))) F(std::forward<G>(g));
+    if (!std::is_trivially_destructible<F>::value) {
+      push_singleton<&closure_udata::push_metatable>(L);
+      lua_setmetatable(L, -2);
+    }
+    lua_CFunction func =
+      &adapt<R (*)(lua_State *, Args...), &closure_udata::closure_function>::
+        adapted;
+    lua_pushcclosure(L, func, 1);
+  }
+};
+
+} // end namespace detail
+
+//[ primer_push_closure
+template <typename F>
+void
+push_closure(lua_State * L, F && f) {
+  using T = typename std::decay<F>::type;
+  using S =
+    typename detail::closure_signature<decltype(&T::operator())>::type;
+  detail::closure_udata<T, S>::push_instance(L, std::forward<F>(f));
+}
+//]
+
+} // end namespace primer
@@ -12,3 +12,11 @@
 /* #define PRIMER_NO_STATIC_ASSERTS */
 /* #define PRIMER_NO_EXCEPTIONS */
 /* #define PRIMER_NO_MEMORY_FAILURE */
+/* #define PRIMER_NO_STATE_REF_CACHE */
+/* #define PRIMER_ASYNC_PERSIST */
+/* #define PRIMER_THREAD_SAFE_STATE_REFS */
+/* #define PRIMER_ALLOC_PROFILER */
+/* #define PRIMER_CALL_TRACING */
+/* #define PRIMER_REF_TRACKING */
+/* #define PRIMER_REGISTRY_SLOTS */
+/* #define PRIMER_INTERNAL_STATS */
@@ -0,0 +1,116 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * How to encode standard containers with `traits::binary`. This is a
+ * collection of common base classes using a template parameter.
+ *
+ * A container is encoded as its size, followed by its elements in iteration
+ * order. Maps encode each key followed by its value.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/container/seq_base.hpp>
+#include <primer/detail/type_traits.hpp>
+#include <primer/traits/binary.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+namespace primer {
+namespace container {
+
+// For dynamically sized sequences and sets, like std::vector and std::set
+template <typename T>
+struct binary_seq_helper {
+  using value_type = remove_cv_t<typename T::value_type>;
+  using elem_t = traits::binary<value_type>;
+
+  static void write(std::string & out, const T & seq) {
+    detail::binary_write_size(out, seq.size());
+    for (const value_type & item : seq) {
+      elem_t::write(out, item);
+    }
+  }
+
+  static bool read(const char *& pos, const char * end, T & seq) {
+    std::size_t n;
+    if (!detail::binary_read_count(pos, end, n)) { return false; }
+    seq.clear();
+    reserve_helper<T>::reserve(seq, static_cast<int>(n));
+    for (std::size_t i = 0; i < n; ++i) {
+      value_type item{};
+      if (!elem_t::read(pos, end, item)) { return false; }
+      seq.insert(seq.end(), std::move(item));
+    }
+    return true;
+  }
+};
+
+// For fixed sized sequences, like std::array. The size is checked on reading.
+template <typename T>
+struct binary_fixed_seq_helper {
+  using value_type = remove_cv_t<typename T::value_type>;
+  using elem_t = traits::binary<value_type>;
+
+  static void write(std::string & out, const T & seq) {
+    detail::binary_write_size(out, seq.size());
+    for (const value_type & item : seq) {
+      elem_t::write(out, item);
+    }
+  }
+
+  static bool read(const char *& pos, const char * end, T & seq) {
+    std::uint64_t n;
+    if (!detail::binary_read_size(pos, end, n) || n != seq.size()) {
+      return false;
+    }
+    for (auto & item : seq) {
+      if (!elem_t::read(pos, end, item)) { return false; }
+    }
+    return true;
+  }
+};
+
+// For maps, like std::map and std::unordered_map
+template <typename M>
+struct binary_map_helper {
+  using first_t = typename M::key_type;
+  using second_t = typename M::mapped_type;
+
+  static void write(std::string & out, const M & m) {
+    detail::binary_write_size(out, m.size());
+    for (const auto & item : m) {
+      traits::binary<first_t>::write(out, item.first);
+      traits::binary<second_t>::write(out, item.second);
+    }
+  }
+
+  static bool read(const char *& pos, const char * end, M & m) {
+    std::size_t n;
+    if (!detail::binary_read_count(pos, end, n)) { return false; }
+    m.clear();
+    for (std::size_t i = 0; i < n; ++i) {
+      first_t key{};
+      second_t value{};
+      if (!traits::binary<first_t>::read(pos, end, key)
+          || !traits::binary<second_t>::read(pos, end, value)) {
+        return false;
+      }
+      m.emplace_hint(m.end(), std::move(key), std::move(value));
+    }
+    return true;
+  }
+};
+
+} // end namespace container
+} // end namespace primer
@@ -15,15 +15,22 @@
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <primer/container/seq_base.hpp>
+#include <primer/container/table_layout.hpp>
 #include <primer/detail/max_int.hpp>
+#include <primer/detail/push_into.hpp>
 #include <primer/detail/type_traits.hpp>
 #include <primer/error_capture.hpp>
 #include <primer/expected.hpp>
 #include <primer/lua.hpp>
+#include <primer/support/alloc_scope.hpp>
 #include <primer/support/asserts.hpp>
+#include <primer/traits/never_pushes_nil.hpp>
 #include <primer/traits/push.hpp>
 #include <primer/traits/read.hpp>
 
+#include <cstddef>
+#include <type_traits>
 #include <utility>
 
 namespace primer {
@@ -35,23 +42,86 @@ struct map_push_helper {
   using second_t = typename M::mapped_type;
 
   static void to_stack(lua_State * L, const M & m) {
-    if (std::is_integral<first_t>::value) {
-      lua_createtable(L, m.size(), 0);
-    } else {
-      lua_createtable(L, 0, m.size());
-    }
+    push_impl(L, m, nullptr);
+  }
+
+  static void to_stack(lua_State * L, const M & m, table_pool & pool) {
+    push_impl(L, m, &pool);
+  }
+
+  static void push_impl(lua_State * L, const M & m, table_pool * pool) {
+    PRIMER_ALLOC_SCOPE(nullptr, "map");
+    table_layout<first_t>::create(
+      L, m, [](const typename M::value_type & item) { return item.first; },
+      pool);
 
     PRIMER_ASSERT_STACK_NEUTRAL(L);
     for (const auto & item : m) {
+      detail::push_maybe_pooled(L, item.first, pool);
+      if (!traits::never_pushes_nil<first_t>::value && lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+      } else {
+        detail::push_maybe_pooled(L, item.second, pool);
+        lua_settable(L, -3);
+      }
+    }
+  }
+
+  // A temporary gives up its mapped values. The keys are const.
+  static void to_stack(lua_State * L, M && m) {
+    PRIMER_ALLOC_SCOPE(nullptr, "map");
+    table_layout<first_t>::create(
+      L, m, [](const typename M::value_type & item) { return item.first; });
+
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    for (auto & item : m) {
       traits::push<first_t>::to_stack(L, item.first);
-      if (lua_isnil(L, -1)) {
+      if (!traits::never_pushes_nil<first_t>::value && lua_isnil(L, -1)) {
         lua_pop(L, 1);
       } else {
-        traits::push<second_t>::to_stack(L, item.second);
+        traits::push<second_t>::to_stack(L, std::move(item.second));
         lua_settable(L, -3);
       }
     }
   }
+
+  // Overwrites the values which changed, and then removes every key which
+  // doesn't read as a key of the map
+  static void to_existing(lua_State * L, int idx, const M & m) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    luaL_checkstack(L, 2 + stack_space_needed, "push_into");
+
+    for (const auto & item : m) {
+      traits::push<first_t>::to_stack(L, item.first);
+      if (!traits::never_pushes_nil<first_t>::value && lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        continue;
+      }
+      lua_pushvalue(L, -1);
+      lua_rawget(L, idx);
+      if (detail::replace_value(L, item.second)) {
+        lua_rawset(L, idx);
+      } else {
+        lua_pop(L, 1);
+      }
+    }
+
+    // Assigning nil to a field while traversing is allowed
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+      lua_pop(L, 1);
+      // Read a copy of the key, in case read messes with it
+      lua_pushvalue(L, -1);
+      auto key = traits::read<first_t>::from_stack(L, -1);
+      lua_pop(L, 1);
+      if (!key || m.find(*key) == m.end()) {
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, idx);
+      }
+    }
+  }
+
   static constexpr int stack_space_needed{
     1 + detail::max_int(traits::push<second_t>::stack_space_needed,
                         traits::push<first_t>::stack_space_needed)};
@@ -62,21 +132,42 @@ struct map_read_helper {
   using first_t = typename M::key_type;
   using second_t = typename M::mapped_type;
 
-  PRIMER_STATIC_ASSERT(std::is_nothrow_constructible<M>::value,
-                       "map type must be nothrow default constructible");
   PRIMER_STATIC_ASSERT(std::is_nothrow_move_constructible<first_t>::value,
                        "key type must be nothrow move constructible");
   PRIMER_STATIC_ASSERT(std::is_nothrow_move_constructible<second_t>::value,
                        "value type must be nothrow move constructible");
 
   static expected<M> from_stack(lua_State * L, int index) {
+    // Only needed here, `into_existing` works with any allocator
+    PRIMER_STATIC_ASSERT(std::is_nothrow_constructible<M>::value,
+                         "map type must be nothrow default constructible");
+
+    expected<M> result{};
+    auto ok = into_existing(L, index, *result);
+    if (!ok) { result = std::move(ok.err()); }
+    return result;
+  }
+
+  // The container is cleared first, so that e.g. an unordered container keeps
+  // its buckets. If it can `reserve`, and has no room yet, the entries are
+  // counted, so that it doesn't rehash while it is filled.
+  static expected<void> into_existing(lua_State * L, int index, M & result) {
     if (!lua_istable(L, index) && !lua_isuserdata(L, index)) {
       return primer::arg_error(L, index, "table");
     }
     PRIMER_ASSERT_STACK_NEUTRAL(L);
 
     index = lua_absindex(L, index);
-    M result;
+    const bool count = reserve_helper<M>::available && lua_istable(L, index)
+                       && !reserved_helper<M>::reserved(result);
+    result.clear();
+
+    if (count) {
+      PRIMER_TRY_BAD_ALLOC {
+        reserve_helper<M>::reserve(result, table_entries(L, index));
+      }
+      PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+    }
 
     lua_pushnil(L);
     while (lua_next(L, index) != 0) {
@@ -103,12 +194,139 @@ struct map_read_helper {
         return first.err();
       }
     }
+    return {};
+  }
+  static constexpr int stack_space_needed{
+    3 + detail::max_int(traits::read<second_t>::stack_space_needed,
+                        traits::read<first_t>::stack_space_needed)};
+};
+
+// For sorted vector maps, like `boost::container::flat_map`, which would move
+// their tail on every `emplace`. Instead the pairs are appended to the
+// underlying sequence in one pass over the table, and then sorted and
+// deduplicated once, by `adopt_sequence`. The sequence keeps its storage and
+// allocator.
+template <typename M>
+struct flat_map_read_helper {
+  using first_t = typename M::key_type;
+  using second_t = typename M::mapped_type;
+  using sequence_t = typename M::sequence_type;
+
+  PRIMER_STATIC_ASSERT(std::is_nothrow_move_constructible<first_t>::value,
+                       "key type must be nothrow move constructible");
+  PRIMER_STATIC_ASSERT(std::is_nothrow_move_constructible<second_t>::value,
+                       "value type must be nothrow move constructible");
+
+  static expected<M> from_stack(lua_State * L, int index) {
+    // The default constructor of a flat map is not noexcept, though it
+    // doesn't allocate
+    expected<M> result{primer::error::bad_alloc()};
+    PRIMER_TRY_BAD_ALLOC { result = M{}; }
+    PRIMER_CATCH_BAD_ALLOC { return result; }
+
+    auto ok = into_existing(L, index, *result);
+    if (!ok) { result = std::move(ok.err()); }
     return result;
   }
+
+  static expected<void> into_existing(lua_State * L, int index, M & result) {
+    if (!lua_istable(L, index) && !lua_isuserdata(L, index)) {
+      return primer::arg_error(L, index, "table");
+    }
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+
+    index = lua_absindex(L, index);
+    sequence_t seq{result.extract_sequence()};
+    const bool count =
+      lua_istable(L, index) && !reserved_helper<sequence_t>::reserved(seq);
+    seq.clear();
+
+    if (count) {
+      PRIMER_TRY_BAD_ALLOC {
+        seq.reserve(static_cast<std::size_t>(table_entries(L, index)));
+      }
+      PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+      // As in `map_read_helper`, the key is read from a copy
+      lua_pushvalue(L, -2);
+      if (auto first = traits::read<first_t>::from_stack(L, -1)) {
+        if (auto second = traits::read<second_t>::from_stack(L, -2)) {
+          PRIMER_TRY_BAD_ALLOC {
+            seq.emplace_back(std::move(*first), std::move(*second));
+          }
+          PRIMER_CATCH_BAD_ALLOC {
+            lua_pop(L, 3);
+            return primer::error::bad_alloc();
+          }
+          lua_pop(L, 2);
+        } else {
+          lua_pop(L, 3);
+          return second.err();
+        }
+      } else {
+        lua_pop(L, 3);
+        return first.err();
+      }
+    }
+
+    PRIMER_TRY_BAD_ALLOC { result.adopt_sequence(std::move(seq)); }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+    return {};
+  }
   static constexpr int stack_space_needed{
     3 + detail::max_int(traits::read<second_t>::stack_space_needed,
                         traits::read<first_t>::stack_space_needed)};
 };
 
+// Lazy access for `ref_proxy`
+// The key is read only long enough to find the element.
+template <typename M>
+struct map_proxy_helper {
+  using first_t = typename M::key_type;
+  using second_t = typename M::mapped_type;
+  using iterator_t = typename M::const_iterator;
+
+  static iterator_t find(lua_State * L, const M & m) {
+    if (auto key = traits::read<first_t>::from_stack(L, 2)) {
+      return m.find(*key);
+    }
+    return m.end();
+  }
+
+  static void index(lua_State * L, const M & m) {
+    iterator_t it = find(L, m);
+    if (it == m.end()) {
+      lua_pushnil(L);
+    } else {
+      traits::push<second_t>::to_stack(L, it->second);
+    }
+  }
+
+  static int next(lua_State * L, const M & m) {
+    iterator_t it = m.begin();
+    if (!lua_isnil(L, 2)) {
+      it = find(L, m);
+      if (it != m.end()) { ++it; }
+    }
+    if (it == m.end()) {
+      lua_pushnil(L);
+      return 1;
+    }
+    traits::push<first_t>::to_stack(L, it->first);
+    traits::push<second_t>::to_stack(L, it->second);
+    return 2;
+  }
+
+  static std::size_t size(const M & m) { return m.size(); }
+
+  static constexpr int stack_space_needed{
+    detail::max_int(traits::read<first_t>::stack_space_needed,
+                    traits::push<first_t>::stack_space_needed
+                      + traits::push<second_t>::stack_space_needed)};
+};
+
 } // end namespace container
 } // end namespace primer
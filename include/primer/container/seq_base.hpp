@@ -16,14 +16,19 @@
 PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/detail/max_int.hpp>
-#include <primer/detail/move_assign_noexcept.hpp>
+#include <primer/detail/push_into.hpp>
+#include <primer/detail/read_into.hpp>
 #include <primer/detail/type_traits.hpp>
 #include <primer/error_capture.hpp>
 #include <primer/lua.hpp>
+#include <primer/support/alloc_scope.hpp>
 #include <primer/support/asserts.hpp>
+#include <primer/table_pool.hpp>
 #include <primer/traits/push.hpp>
 #include <primer/traits/read.hpp>
 
+#include <cstddef>
+#include <limits>
 #include <string>
 #include <type_traits>
 #include <utility>
@@ -36,70 +41,329 @@ struct push_seq_helper {
   using value_type = typename T::value_type;
 
   static void to_stack(lua_State * L, const T & seq) {
+    push_impl(L, seq, nullptr);
+  }
+
+  static void to_stack(lua_State * L, const T & seq, table_pool & pool) {
+    push_impl(L, seq, &pool);
+  }
+
+  static void push_impl(lua_State * L, const T & seq, table_pool * pool) {
+    PRIMER_ALLOC_SCOPE(nullptr, "sequence");
+    int n = static_cast<int>(seq.size());
+    detail::new_table(L, n, 0, pool);
+
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    for (int i = 0; i < n; ++i) {
+      detail::push_maybe_pooled(L, seq[i], pool);
+      lua_rawseti(L, -2, (i + 1));
+    }
+  }
+
+  // A temporary gives up its elements, e.g. userdata are moved into lua
+  static void to_stack(lua_State * L, T && seq) {
+    PRIMER_ALLOC_SCOPE(nullptr, "sequence");
     int n = static_cast<int>(seq.size());
     lua_createtable(L, n, 0);
 
     PRIMER_ASSERT_STACK_NEUTRAL(L);
     for (int i = 0; i < n; ++i) {
-      traits::push<value_type>::to_stack(L, seq[i]);
+      traits::push<value_type>::to_stack(L, std::move(seq[i]));
       lua_rawseti(L, -2, (i + 1));
     }
   }
+
+  // Overwrites the elements which changed, and removes those past the end
+  static void to_existing(lua_State * L, int idx, const T & seq) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    luaL_checkstack(L, 2 + stack_space_needed, "push_into");
+    const int n = static_cast<int>(seq.size());
+    const int old_n = static_cast<int>(lua_rawlen(L, idx));
+
+    for (int i = 0; i < n; ++i) {
+      lua_rawgeti(L, idx, i + 1);
+      if (detail::replace_value(L, seq[i])) { lua_rawseti(L, idx, i + 1); }
+    }
+    // From the top, so that the length stays well-defined
+    for (int i = old_n; i > n; --i) {
+      lua_pushnil(L);
+      lua_rawseti(L, idx, i);
+    }
+  }
+
   static constexpr int stack_space_needed{
     1 + traits::push<value_type>::stack_space_needed};
 };
 
-// For dynamically sized sequences, like std::vector
+// Reserve, if possible
+// Assume that it has same semantics as std::vector
+template <typename U, typename ENABLE = void>
+struct reserve_helper {
+  static constexpr bool available{false};
+  static void reserve(U &, int) {}
+};
+
+template <typename U>
+struct reserve_helper<U, enable_if_t<std::is_same<decltype(std::declval<U>()
+                                                             .reserve(0)),
+                                                  decltype(
+                                                    std::declval<U>().reserve(
+                                                      0))>::value>> {
+  static constexpr bool available{true};
+  static void reserve(U & u, int n) { u.reserve(n); }
+};
+
+// Whether a container already has room, because it holds elements from an
+// earlier read, or the caller reserved it. Then counting the entries of a
+// table first, in order to reserve, isn't worth another traversal. A default
+// constructed unordered container has at most one bucket.
+template <typename U, typename ENABLE = void>
+struct reserved_helper {
+  static bool reserved(const U & u) { return !u.empty(); }
+};
+
+template <typename U>
+struct reserved_helper<U, enable_if_t<std::is_same<
+                            decltype(std::declval<const U &>().capacity()),
+                            decltype(std::declval<const U &>()
+                                       .capacity())>::value>> {
+  static bool reserved(const U & u) { return !u.empty() || u.capacity(); }
+};
+
+template <typename U>
+struct reserved_helper<U, enable_if_t<std::is_same<
+                            decltype(std::declval<const U &>().bucket_count()),
+                            decltype(std::declval<const U &>()
+                                       .bucket_count())>::value>> {
+  static bool reserved(const U & u) {
+    return !u.empty() || u.bucket_count() > 1;
+  }
+};
+
+// The most elements which a sequence can hold, for one which can't grow past
+// its inline storage, like `boost::container::static_vector`. 0 if there is
+// no limit.
+template <typename U>
+struct capacity_limit : std::integral_constant<std::size_t, 0> {};
+
+template <typename U>
+expected<void>
+check_capacity(int n) {
+  constexpr std::size_t limit = capacity_limit<U>::value;
+  if (limit && static_cast<std::size_t>(n) > limit) {
+    return primer::error{"Too many elements, found ", n, " expected at most ",
+                         limit};
+  }
+  return {};
+}
+
+// Reads element `i` in place. A sequence like `std::vector<bool>` hands out a
+// proxy rather than a reference, so its element is read and then assigned.
+template <typename T, typename ENABLE = void>
+struct read_element_helper {
+  static expected<void> read(lua_State * L, int idx, T & seq, std::size_t i) {
+    return detail::read_into(L, idx, seq[i]);
+  }
+};
+
 template <typename T>
+struct read_element_helper<
+  T, enable_if_t<!std::is_lvalue_reference<decltype(
+       std::declval<T &>()[0])>::value>> {
+  using value_type = remove_cv_t<typename T::value_type>;
+
+  static expected<void> read(lua_State * L, int idx, T & seq, std::size_t i) {
+    auto result = traits::read<value_type>::from_stack(L, idx);
+    if (!result) { return std::move(result.err()); }
+    seq[i] = std::move(*result);
+    return {};
+  }
+};
+
+// For dynamically sized sequences, like std::vector
+template <typename T, typename ENABLE = void>
 struct read_seq_helper {
   using value_type = remove_cv_t<typename T::value_type>;
 
-  PRIMER_STATIC_ASSERT(std::is_nothrow_constructible<T>::value,
-                       "sequence type must be nothrow default constructible");
   PRIMER_STATIC_ASSERT(std::is_nothrow_move_constructible<value_type>::value,
                        "value type must be nothrow move constructible");
 
-  // Reserve, if possible
-  // Assume that it has same semantics as std::vector
-  template <typename U, typename ENABLE = void>
-  struct reserve_helper {
-    static void reserve(U &, int) {}
-  };
-
-  template <typename U>
-  struct reserve_helper<U, enable_if_t<std::is_same<decltype(std::declval<U>()
-                                                               .reserve(0)),
-                                                    decltype(
-                                                      std::declval<U>().reserve(
-                                                        0))>::value>> {
-    static void reserve(U & u, int n) { u.reserve(n); }
-  };
-
   static expected<T> from_stack(lua_State * L, int idx) {
-    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    // Only needed here, `into_existing` works with any allocator
+    PRIMER_STATIC_ASSERT(std::is_nothrow_constructible<T>::value,
+                         "sequence type must be nothrow default constructible");
 
     expected<T> result{};
+    auto ok = into_existing(L, idx, *result);
+    if (!ok) { result = std::move(ok.err()); }
+    return result;
+  }
+
+  // Elements already present are read into in place, the rest are appended.
+  static expected<void> into_existing(lua_State * L, int idx, T & out) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+
+    expected<void> result;
 
     idx = lua_absindex(L, idx);
-    if (!lua_istable(L, idx)) {
-      result = primer::arg_error(L, idx, "table");
-    } else {
-      int n = lua_rawlen(L, idx);
+    if (!lua_istable(L, idx)) { return primer::arg_error(L, idx, "table"); }
+
+    int n = lua_rawlen(L, idx);
+    auto capacity = check_capacity<T>(n);
+    if (!capacity) { return capacity; }
+    int reused = detail::min(n, static_cast<int>(out.size()));
 
-      PRIMER_TRY_BAD_ALLOC { reserve_helper<T>::reserve(*result, n); }
+    for (int i = 0; (i < reused) && result; ++i) {
+      lua_rawgeti(L, idx, i + 1);
+      result = read_element_helper<T>::read(L, -1, out, i);
+      if (!result) {
+        result.err().prepend_error_line("In index [", i + 1, "],");
+      }
+      lua_pop(L, 1);
+    }
+
+    if (result) {
+      PRIMER_TRY_BAD_ALLOC {
+        out.erase(out.begin() + reused, out.end());
+        reserve_helper<T>::reserve(out, n);
+      }
       PRIMER_CATCH_BAD_ALLOC { result = primer::error::bad_alloc(); }
+    }
+
+    for (int i = reused; (i < n) && result; ++i) {
+      lua_rawgeti(L, idx, i + 1);
+      if (auto object = traits::read<value_type>::from_stack(L, -1)) {
+        PRIMER_TRY_BAD_ALLOC { out.emplace_back(std::move(*object)); }
+        PRIMER_CATCH_BAD_ALLOC { result = primer::error::bad_alloc(); }
+      } else {
+        result = std::move(object.err());
+        result.err().prepend_error_line("In index [", i + 1, "],");
+      }
+      lua_pop(L, 1);
+    }
 
-      for (int i = 0; (i < n) && result; ++i) {
-        lua_rawgeti(L, idx, i + 1);
+    return result;
+  }
+  static constexpr int stack_space_needed{
+    1 + traits::read<value_type>::stack_space_needed};
+};
+
+// Fast path for arithmetic types. These don't construct an `expected` per
+// element, instead the lua value is checked and converted inline, with the
+// same semantics as `traits::read`. Only when a check fails is the read trait
+// consulted, in order to produce the error message. If the user supplied their
+// own full specialization of `traits::read` for the element type, the fast
+// path isn't taken, and every element goes through that specialization.
+template <typename T, typename ENABLE = void>
+struct arithmetic_read_helper;
+
+template <typename T>
+struct arithmetic_read_helper<T, enable_if_t<std::is_same<T, int>::value ||  //
+                                             std::is_same<T, long>::value || //
+                                             std::is_same<T, long long>::value>> {
+  static bool from_stack(lua_State * L, int idx, T & out) {
+    if (!lua_isinteger(L, idx)) { return false; }
+    LUA_INTEGER i = lua_tointeger(L, idx);
+    if (sizeof(T) < sizeof(LUA_INTEGER)
+        && (i > static_cast<LUA_INTEGER>(std::numeric_limits<T>::max())
+            || i < static_cast<LUA_INTEGER>(std::numeric_limits<T>::min()))) {
+      return false;
+    }
+    out = static_cast<T>(i);
+    return true;
+  }
+};
+
+template <typename T>
+struct arithmetic_read_helper<
+  T, enable_if_t<std::is_same<T, unsigned int>::value ||  //
+                 std::is_same<T, unsigned long>::value || //
+                 std::is_same<T, unsigned long long>::value>> {
+  using signed_t = typename std::make_signed<T>::type;
+
+  static bool from_stack(lua_State * L, int idx, T & out) {
+    signed_t s;
+    if (!arithmetic_read_helper<signed_t>::from_stack(L, idx, s) || s < 0) {
+      return false;
+    }
+    out = static_cast<T>(s);
+    return true;
+  }
+};
+
+template <typename T>
+struct arithmetic_read_helper<
+  T, enable_if_t<std::is_same<T, float>::value ||  //
+                 std::is_same<T, double>::value || //
+                 std::is_same<T, long double>::value>> {
+  static bool from_stack(lua_State * L, int idx, T & out) {
+    // Under PRIMER_STRICT_NUMBERS, strings are left to the read trait to reject
+    if (traits::strict_number_reads && lua_type(L, idx) != LUA_TNUMBER) {
+      return false;
+    }
+    int isnum = 0;
+    LUA_NUMBER n = lua_tonumberx(L, idx, &isnum);
+    out = static_cast<T>(n);
+    return isnum;
+  }
+};
+
+template <typename T, typename ENABLE = void>
+struct use_arithmetic_read : std::false_type {};
+
+template <typename T>
+struct use_arithmetic_read<
+  T, enable_if_t<std::is_same<decltype(arithmetic_read_helper<T>::from_stack),
+                              decltype(arithmetic_read_helper<
+                                       T>::from_stack)>::value>>
+  : detail::is_builtin_read<T> {};
+
+template <typename T>
+struct read_seq_helper<
+  T, enable_if_t<use_arithmetic_read<remove_cv_t<typename T::value_type>>::value>> {
+  using value_type = remove_cv_t<typename T::value_type>;
+
+  static expected<T> from_stack(lua_State * L, int idx) {
+    // Only needed here, `into_existing` works with any allocator
+    PRIMER_STATIC_ASSERT(std::is_nothrow_constructible<T>::value,
+                         "sequence type must be nothrow default constructible");
+
+    expected<T> result{};
+    auto ok = into_existing(L, idx, *result);
+    if (!ok) { result = std::move(ok.err()); }
+    return result;
+  }
+
+  static expected<void> into_existing(lua_State * L, int idx, T & out) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+
+    expected<void> result;
+
+    idx = lua_absindex(L, idx);
+    if (!lua_istable(L, idx)) { return primer::arg_error(L, idx, "table"); }
+
+    int n = lua_rawlen(L, idx);
+    auto capacity = check_capacity<T>(n);
+    if (!capacity) { return capacity; }
+
+    // After this, nothing in the loop can throw
+    PRIMER_TRY_BAD_ALLOC { out.resize(n); }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+
+    for (int i = 0; i < n; ++i) {
+      lua_rawgeti(L, idx, i + 1);
+      value_type & v = out[i];
+      if (!arithmetic_read_helper<value_type>::from_stack(L, -1, v)) {
         if (auto object = traits::read<value_type>::from_stack(L, -1)) {
-          PRIMER_TRY_BAD_ALLOC { result->emplace_back(std::move(*object)); }
-          PRIMER_CATCH_BAD_ALLOC { result = primer::error::bad_alloc(); }
+          v = *object;
         } else {
           result = std::move(object.err());
           result.err().prepend_error_line("In index [", i + 1, "],");
+          lua_pop(L, 1);
+          break;
         }
-        lua_pop(L, 1);
       }
+      lua_pop(L, 1);
     }
 
     return result;
@@ -117,28 +381,33 @@ struct read_fixed_seq_helper {
                        "sequence type must be nothrow default constructible");
 
   static expected<T> from_stack(lua_State * L, int idx) {
+    expected<T> result{};
+    auto ok = into_existing(L, idx, *result);
+    if (!ok) { result = std::move(ok.err()); }
+    return result;
+  }
+
+  static expected<void> into_existing(lua_State * L, int idx, T & out) {
     PRIMER_ASSERT_STACK_NEUTRAL(L);
 
-    expected<T> result{};
+    expected<void> result;
 
     idx = lua_absindex(L, idx);
-    if (!lua_istable(L, idx)) { result = primer::arg_error(L, idx, "table"); }
+    if (!lua_istable(L, idx)) { return primer::arg_error(L, idx, "table"); }
 
-    int n = static_cast<int>(result->size());
+    int n = static_cast<int>(out.size());
     {
       int m = lua_rawlen(L, idx);
       if (m > n) {
-        result = primer::error{"Too many elements, found ", m, " expected ", n};
+        return primer::error{"Too many elements, found ", m, " expected ", n};
       }
     }
 
     for (int i = 0; (i < n) && result; ++i) {
       lua_rawgeti(L, idx, i + 1);
-      if (auto object = traits::read<value_type>::from_stack(L, -1)) {
-        detail::move_assign_noexcept((*result)[i], std::move(*object));
-      } else {
-        result =
-          std::move(object.err().prepend_error_line("In index [", i + 1, "],"));
+      result = read_element_helper<T>::read(L, -1, out, i);
+      if (!result) {
+        result.err().prepend_error_line("In index [", i + 1, "],");
       }
       lua_pop(L, 1);
     }
@@ -149,5 +418,45 @@ struct read_fixed_seq_helper {
     1 + traits::read<value_type>::stack_space_needed};
 };
 
+// Lazy access for `ref_proxy`
+template <typename T>
+struct seq_proxy_helper {
+  using value_type = typename T::value_type;
+
+  // Position of the integer key at `idx`, if it is in range, or zero
+  static std::size_t position(lua_State * L, int idx, const T & seq) {
+    int isnum = 0;
+    lua_Integer i = lua_tointegerx(L, idx, &isnum);
+    if (isnum && i > 0 && static_cast<std::size_t>(i) <= seq.size()) {
+      return static_cast<std::size_t>(i);
+    }
+    return 0;
+  }
+
+  static void index(lua_State * L, const T & seq) {
+    if (std::size_t i = position(L, 2, seq)) {
+      traits::push<value_type>::to_stack(L, seq[i - 1]);
+    } else {
+      lua_pushnil(L);
+    }
+  }
+
+  static int next(lua_State * L, const T & seq) {
+    std::size_t i = lua_isnil(L, 2) ? 0 : position(L, 2, seq);
+    if ((lua_isnil(L, 2) || i) && i < seq.size()) {
+      lua_pushinteger(L, static_cast<lua_Integer>(i + 1));
+      traits::push<value_type>::to_stack(L, seq[i]);
+      return 2;
+    }
+    lua_pushnil(L);
+    return 1;
+  }
+
+  static std::size_t size(const T & seq) { return seq.size(); }
+
+  static constexpr int stack_space_needed{
+    1 + traits::push<value_type>::stack_space_needed};
+};
+
 } // end namespace container
 } // end namespace primer
@@ -15,12 +15,16 @@
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <primer/container/seq_base.hpp>
+#include <primer/container/table_layout.hpp>
 #include <primer/detail/max_int.hpp>
 #include <primer/detail/type_traits.hpp>
 #include <primer/error_capture.hpp>
 #include <primer/expected.hpp>
 #include <primer/lua.hpp>
+#include <primer/support/alloc_scope.hpp>
 #include <primer/support/asserts.hpp>
+#include <primer/traits/never_pushes_nil.hpp>
 #include <primer/traits/push.hpp>
 #include <primer/traits/read.hpp>
 
@@ -34,16 +38,22 @@ struct set_push_helper {
   using first_t = typename M::key_type;
 
   static void to_stack(lua_State * L, const M & m) {
-    if (std::is_integral<first_t>::value) {
-      lua_createtable(L, m.size(), 0);
-    } else {
-      lua_createtable(L, 0, m.size());
-    }
+    push_impl(L, m, nullptr);
+  }
+
+  static void to_stack(lua_State * L, const M & m, table_pool & pool) {
+    push_impl(L, m, &pool);
+  }
+
+  static void push_impl(lua_State * L, const M & m, table_pool * pool) {
+    PRIMER_ALLOC_SCOPE(nullptr, "set");
+    table_layout<first_t>::create(
+      L, m, [](const typename M::value_type & item) { return item; }, pool);
 
     PRIMER_ASSERT_STACK_NEUTRAL(L);
     for (const auto & item : m) {
-      traits::push<first_t>::to_stack(L, item);
-      if (lua_isnil(L, -1)) {
+      detail::push_maybe_pooled(L, item, pool);
+      if (!traits::never_pushes_nil<first_t>::value && lua_isnil(L, -1)) {
         lua_pop(L, 1);
       } else {
         lua_pushboolean(L, true);
@@ -60,19 +70,40 @@ template <typename M>
 struct set_read_helper {
   using first_t = typename M::key_type;
 
-  PRIMER_STATIC_ASSERT(std::is_nothrow_constructible<M>::value,
-                       "set must be nothrow default constructible");
   PRIMER_STATIC_ASSERT(std::is_nothrow_move_constructible<first_t>::value,
                        "key type must be nothrow move constructible");
 
   static expected<M> from_stack(lua_State * L, int index) {
+    // Only needed here, `into_existing` works with any allocator
+    PRIMER_STATIC_ASSERT(std::is_nothrow_constructible<M>::value,
+                         "set must be nothrow default constructible");
+
+    expected<M> result{};
+    auto ok = into_existing(L, index, *result);
+    if (!ok) { result = std::move(ok.err()); }
+    return result;
+  }
+
+  // The container is cleared first, so that e.g. an unordered container keeps
+  // its buckets. If it can `reserve`, and has no room yet, the entries are
+  // counted, so that it doesn't rehash while it is filled.
+  static expected<void> into_existing(lua_State * L, int index, M & result) {
     if (!lua_istable(L, index) && !lua_isuserdata(L, index)) {
       return primer::arg_error(L, index, "table");
     }
     PRIMER_ASSERT_STACK_NEUTRAL(L);
 
     index = lua_absindex(L, index);
-    M result;
+    const bool count = reserve_helper<M>::available && lua_istable(L, index)
+                       && !reserved_helper<M>::reserved(result);
+    result.clear();
+
+    if (count) {
+      PRIMER_TRY_BAD_ALLOC {
+        reserve_helper<M>::reserve(result, table_entries(L, index));
+      }
+      PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+    }
 
     lua_pushnil(L);
     while (lua_next(L, index) != 0) {
@@ -94,7 +125,7 @@ struct set_read_helper {
         return key.err();
       }
     }
-    return std::move(result);
+    return {};
   }
   static constexpr int stack_space_needed{
     3 + traits::read<first_t>::stack_space_needed};
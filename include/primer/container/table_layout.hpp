@@ -0,0 +1,84 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * How to size the table which a map or a set is pushed into, so that filling
+ * it never rehashes.
+ *
+ * Keys which are not integers all go in the hash part. For integer keys, the
+ * keys in `1..n` are counted, where `n` is the number of keys, and if more
+ * than half of `1..n` is used, those keys get an array part of size `n`, like
+ * lua itself would choose. The other keys go in the hash part.
+ *
+ * `create(L, m, key)` pushes the table, where `key` gives the key of an
+ * element of `m`. Given a `table_pool`, the table is taken from it.
+ *
+ * When reading, the number of entries of a table is only known by traversing
+ * it, which `table_entries` does. Map and set reads do that first, if the
+ * container can `reserve` and has no room yet, so that it doesn't rehash while
+ * it is filled. A container which was reserved by the caller, or read into
+ * before, with `read_into`, is filled without counting.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/detail/type_traits.hpp>
+#include <primer/lua.hpp>
+#include <primer/table_pool.hpp>
+
+#include <cstddef>
+#include <type_traits>
+
+namespace primer {
+namespace container {
+
+template <typename K, typename ENABLE = void>
+struct table_layout {
+  template <typename M, typename F>
+  static void create(lua_State * L, const M & m, F,
+                     table_pool * pool = nullptr) {
+    detail::new_table(L, 0, static_cast<int>(m.size()), pool);
+  }
+};
+
+template <typename K>
+struct table_layout<K, enable_if_t<std::is_integral<K>::value
+                                   && !std::is_same<K, bool>::value>> {
+  template <typename M, typename F>
+  static void create(lua_State * L, const M & m, F key,
+                     table_pool * pool = nullptr) {
+    const std::size_t n = m.size();
+    std::size_t dense = 0;
+    for (const auto & item : m) {
+      const K k = key(item);
+      if (k >= K{1} && static_cast<std::size_t>(k) <= n) { ++dense; }
+    }
+    if (2 * dense > n) {
+      detail::new_table(L, static_cast<int>(n), static_cast<int>(n - dense),
+                        pool);
+    } else {
+      detail::new_table(L, 0, static_cast<int>(n), pool);
+    }
+  }
+};
+
+// Number of entries of the table at `index`
+inline int
+table_entries(lua_State * L, int index) {
+  int n = 0;
+  lua_pushnil(L);
+  while (lua_next(L, index) != 0) {
+    ++n;
+    lua_pop(L, 1);
+  }
+  return n;
+}
+
+} // end namespace container
+} // end namespace primer
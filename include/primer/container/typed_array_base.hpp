@@ -0,0 +1,89 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * How to transport contiguous numeric sequences like `std::vector<double>` to
+ * and from the stack as a `primer::typed_array` userdata. These are used in
+ * place of the table helpers when `traits::use_typed_array` is specialized.
+ *
+ * When reading, tables are still accepted, and handled by the table helpers.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/container/seq_base.hpp>
+#include <primer/detail/max_int.hpp>
+#include <primer/detail/type_traits.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/traits/typed_array.hpp>
+#include <primer/typed_array.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+namespace primer {
+namespace container {
+
+template <typename T>
+struct push_typed_array_helper {
+  using value_type = remove_cv_t<typename T::value_type>;
+
+  static void to_stack(lua_State * L, const T & seq) {
+    primer::push_typed_array<value_type>(L, seq.data(), seq.size());
+  }
+  // userdata, metatable, and a metamethod while populating the metatable
+  static constexpr int stack_space_needed{3};
+};
+
+// For dynamically sized sequences, like std::vector
+template <typename T>
+struct read_typed_array_seq_helper {
+  using value_type = remove_cv_t<typename T::value_type>;
+
+  static expected<T> from_stack(lua_State * L, int idx) {
+    if (const auto * a = primer::test_udata<typed_array<value_type>>(L, idx)) {
+      expected<T> result{};
+      PRIMER_TRY_BAD_ALLOC { result->assign(a->begin(), a->end()); }
+      PRIMER_CATCH_BAD_ALLOC { result = primer::error::bad_alloc(); }
+      return result;
+    }
+    return read_seq_helper<T>::from_stack(L, idx);
+  }
+  static constexpr int stack_space_needed{
+    detail::max_int(3, read_seq_helper<T>::stack_space_needed)};
+};
+
+// For fixed sized sequences, like std::array
+template <typename T>
+struct read_typed_array_fixed_seq_helper {
+  using value_type = remove_cv_t<typename T::value_type>;
+
+  static expected<T> from_stack(lua_State * L, int idx) {
+    if (const auto * a = primer::test_udata<typed_array<value_type>>(L, idx)) {
+      expected<T> result{};
+      if (a->size() > result->size()) {
+        return primer::error{"Too many elements, found ", a->size(),
+                             " expected ", result->size()};
+      }
+      std::fill(result->begin(), result->end(), value_type{});
+      std::memcpy(result->data(), a->data(), a->size() * sizeof(value_type));
+      return result;
+    }
+    return read_fixed_seq_helper<T>::from_stack(L, idx);
+  }
+  static constexpr int stack_space_needed{
+    detail::max_int(3, read_fixed_seq_helper<T>::stack_space_needed)};
+};
+
+} // end namespace container
+} // end namespace primer
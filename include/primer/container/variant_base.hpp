@@ -0,0 +1,137 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * How to push and read variants like `boost::variant` and `std::variant`.
+ *
+ * Reading looks at the lua type of the value once, and only tries the
+ * alternatives whose `read_type_mask` accepts that type, in the order of the
+ * variant. The masks and the readers are tables made at compile-time. The
+ * first alternative which reads successfully is taken. If none accepts the lua
+ * type, the error names the lua types which could have been read. If some
+ * accepted it but failed to convert, the error of the last is reported.
+ *
+ * Alternatives whose mask is `lua_type_any`, like types without a
+ * `read_type_mask`, are always tried.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/detail/max_int.hpp>
+#include <primer/error.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/traits/push.hpp>
+#include <primer/traits/read.hpp>
+#include <primer/traits/read_type_mask.hpp>
+
+#include <string>
+#include <utility>
+
+namespace primer {
+namespace container {
+
+/***
+ * How to push a variant, by a visitor which pushes the alternative it holds
+ */
+struct variant_push_visitor {
+  using result_type = void;
+
+  lua_State * L;
+
+  template <typename T>
+  void operator()(const T & t) const {
+    traits::push<T>::to_stack(L, t);
+  }
+};
+
+template <typename... Ts>
+struct variant_push_space {
+  static constexpr int stack_space_needed{
+    detail::max_int(0, traits::push<Ts>::stack_space_needed...)};
+};
+
+/***
+ * How to read a variant `V` whose alternatives are `Ts...`
+ */
+template <typename V, typename... Ts>
+struct variant_read {
+  static constexpr unsigned mask = 0u;
+};
+
+template <typename V, typename T, typename... Ts>
+struct variant_read<V, T, Ts...> {
+  static constexpr unsigned mask =
+    traits::read_type_mask<T>::value | variant_read<V, Ts...>::mask;
+
+private:
+  using reader_t = expected<V> (*)(lua_State *, int);
+
+  template <typename U>
+  static expected<V> read_as(lua_State * L, int idx) {
+    if (auto result = traits::read<U>::from_stack(L, idx)) {
+      return V{*std::move(result)};
+    } else {
+      return std::move(result.err());
+    }
+  }
+
+  // Names of the lua types in `mask`, for the error when none matches
+  static const char * expected_types() {
+    static const std::string names = []() {
+      const int types[] = {LUA_TNIL,      LUA_TBOOLEAN,       LUA_TNUMBER,
+                           LUA_TSTRING,   LUA_TTABLE,         LUA_TFUNCTION,
+                           LUA_TUSERDATA, LUA_TLIGHTUSERDATA, LUA_TTHREAD};
+      const char * type_names[] = {"nil",      "boolean",  "number",
+                                   "string",   "table",    "function",
+                                   "userdata", "userdata", "thread"};
+      std::string result;
+      for (std::size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+        unsigned bit = primer::lua_type_bit(types[i]);
+        if (types[i] == LUA_TNUMBER) { bit |= lua_type_bit(lua_tinteger); }
+        if ((mask & bit) && result.find(type_names[i]) == std::string::npos) {
+          if (!result.empty()) { result += " or "; }
+          result += type_names[i];
+        }
+      }
+      return result;
+    }();
+    return names.c_str();
+  }
+
+public:
+  static expected<V> from_stack(lua_State * L, int idx) {
+    static constexpr unsigned masks[] = {traits::read_type_mask<T>::value,
+                                         traits::read_type_mask<Ts>::value...};
+    static constexpr reader_t readers[] = {&read_as<T>, &read_as<Ts>...};
+
+    const unsigned bit = primer::lua_type_bit(primer::lua_type_tag(L, idx));
+    if (!(mask & bit)) { return primer::arg_error(L, idx, expected_types()); }
+
+    expected<V> result{primer::error{}};
+    for (std::size_t i = 0; i < 1 + sizeof...(Ts); ++i) {
+      if (masks[i] & bit) {
+        result = readers[i](L, idx);
+        if (result) { break; }
+      }
+    }
+    return result;
+  }
+
+  static constexpr int stack_space_needed{
+    detail::max_int(0, traits::read<T>::stack_space_needed,
+                    traits::read<Ts>::stack_space_needed...)};
+};
+
+template <typename V, typename T, typename... Ts>
+constexpr unsigned variant_read<V, T, Ts...>::mask;
+
+} // end namespace container
+} // end namespace primer
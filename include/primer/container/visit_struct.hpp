@@ -8,6 +8,10 @@
 /***
  * How to transfer "visitable structures" to and from the stack, as tables
  *
+ * The table is keyed by field name, or by position, or the structure is pushed
+ * as a userdata holding a copy, see `traits::visitable_layout`. The userdata
+ * form also needs `<primer/visitable_userdata.hpp>`.
+ *
  * Note:
  * In order to be read, the members must be default-constructible and
  * nothrow move-assignable, nothrow swappable, or nothrow move constructible
@@ -18,50 +22,255 @@
 
 PRIMER_ASSERT_FILESCOPE;
 
-#include <primer/detail/move_assign_noexcept.hpp>
+#include <primer/detail/max_int.hpp>
+#include <primer/detail/push_into.hpp>
+#include <primer/detail/read_into.hpp>
 #include <primer/detail/type_traits.hpp>
 #include <primer/error_capture.hpp>
+#include <primer/event_channel.hpp>
 #include <primer/expected.hpp>
 #include <primer/lua.hpp>
+#include <primer/push_singleton.hpp>
 #include <primer/support/asserts.hpp>
+#include <primer/support/diagnostics.hpp>
+#include <primer/support/function_check_stack.hpp>
+#include <primer/table_pool.hpp>
+#include <primer/tracked_table.hpp>
+#include <primer/traits/binary.hpp>
 #include <primer/traits/push.hpp>
 #include <primer/traits/read.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <primer/traits/ref_proxy.hpp>
+#include <primer/traits/visitable_layout.hpp>
+#include <primer/traits/visitable_read.hpp>
+#include <primer/userdata.hpp>
 
 #include <visit_struct/visit_struct.hpp>
 
+#include <cstddef>
+#include <string>
 #include <type_traits>
 #include <utility>
 
 namespace primer {
 
+// The userdata which holds a copy of a visitable structure, when its layout is
+// `value_userdata`. Its userdata trait is in `visitable_userdata.hpp`.
+template <typename T>
+struct visitable_value {
+  T value;
+};
+
 /***
  * Visitor which pushes members to a table in lua
  */
 
 namespace detail {
 
+/***
+ * The field names of each visitable structure are interned once, in an array
+ * held in the registry, so that pushing and reading doesn't hash them again.
+ * The array is in the same order as the visitation order.
+ */
+
+struct field_key_helper {
+  lua_State * L;
+  int count;
+
+  template <typename T>
+  void operator()(const char * name, T &&) {
+    PRIMER_ASSERT_TABLE(L);
+    lua_pushstring(L, name);
+    lua_rawseti(L, -2, ++count);
+  }
+};
+
+template <typename T>
+void
+visitable_field_keys(lua_State * L) {
+  lua_createtable(L, visit_struct::field_count<T>(), 0);
+  field_key_helper vis{L, 0};
+  visit_struct::visit_types<T>(vis);
+}
+
+// Pushes the array of interned keys for the type T
+template <typename T>
+void
+push_visitable_field_keys(lua_State * L) {
+  primer::push_singleton<&visitable_field_keys<T>>(L);
+}
+
+// Needed to create the field keys array, and to put it in the registry
+constexpr int visitable_field_keys_stack_space = 3;
+
 struct push_helper {
   lua_State * L;
+  int table;
+  int keys;
+  int count;
+  table_pool * pool;
 
   template <typename T>
-  void operator()(const char * name, const T & value) {
+  void operator()(const char *, const T & value) {
     PRIMER_ASSERT_STACK_NEUTRAL(L);
-    PRIMER_ASSERT_TABLE(L);
-    traits::push<T>::to_stack(L, value);
-    lua_setfield(L, -2, name);
+    lua_rawgeti(L, keys, ++count);
+    detail::push_maybe_pooled(L, value, pool);
+    lua_rawset(L, table);
   }
 };
 
-struct stack_space_push_checker {
-  int needed = 0;
+// Updates the fields of an existing table, for `push_into`
+struct update_helper {
+  lua_State * L;
+  int table;
+  int keys;
+  int count;
 
   template <typename T>
-  void operator()(const char *, const T &) {
-    constexpr int s = stack_space_for_push<T>();
-    if (s > needed) { needed = s; }
+  void operator()(const char *, const T & value) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    lua_rawgeti(L, keys, ++count);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, table);
+    if (detail::replace_value(L, value)) {
+      lua_rawset(L, table);
+    } else {
+      lua_pop(L, 1);
+    }
+  }
+};
+
+/***
+ * Positional layout, the fields are `t[1] .. t[n]`
+ */
+
+struct positional_update_helper {
+  lua_State * L;
+  int table;
+  int count;
+
+  template <typename T>
+  void operator()(const char *, const T & value) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    lua_rawgeti(L, table, ++count);
+    if (detail::replace_value(L, value)) { lua_rawseti(L, table, count); }
+  }
+};
+
+struct positional_push_helper {
+  lua_State * L;
+  int count;
+  table_pool * pool;
+
+  template <typename T>
+  void operator()(const char *, const T & value) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    detail::push_maybe_pooled(L, value, pool);
+    lua_rawseti(L, -2, ++count);
+  }
+};
+
+// The metatable shared by the positional tables of the type T
+template <typename T>
+void
+visitable_positional_metatable(lua_State * L) {
+  lua_createtable(L, 0, 1);
+  push_visitable_field_keys<T>(L);
+  lua_setfield(L, -2, "__fields");
+}
+
+// Needed to create the metatable, and to put it in the registry
+constexpr int visitable_positional_metatable_stack_space =
+  1 + visitable_field_keys_stack_space;
+
+template <typename T>
+constexpr bool
+is_positional() {
+  return traits::visitable_layout<T>::value
+         == traits::visitable_layout_style::positional;
+}
+
+/***
+ * Value userdata layout, the structure is copied into a userdata.
+ */
+
+template <typename T>
+constexpr bool
+is_value_userdata() {
+  return traits::visitable_layout<T>::value
+         == traits::visitable_layout_style::value_userdata;
+}
+
+// The userdata, and creating its metatable
+constexpr int visitable_value_stack_space = 4;
+
+template <typename T, bool = is_value_userdata<T>()>
+struct visitable_value_ops {
+  static bool push(lua_State *, const T &) { return false; }
+  static bool read(lua_State *, int, T &, expected<void> &) noexcept {
+    return false;
   }
 };
 
+template <typename T>
+struct visitable_value_ops<T, true> {
+  static bool push(lua_State * L, const T & t) {
+    primer::push_udata<primer::visitable_value<T>>(L, t);
+    return true;
+  }
+
+  // Reads a copy, if the value at `index` is one
+  static bool read(lua_State * L, int index, T & out,
+                   expected<void> & ok) noexcept {
+    const auto * u = primer::test_udata<primer::visitable_value<T>>(L, index);
+    if (!u) { return false; }
+    PRIMER_TRY_BAD_ALLOC { out = u->value; }
+    PRIMER_CATCH_BAD_ALLOC { ok = primer::error::bad_alloc(); }
+    return true;
+  }
+};
+
+// Computes, at compile-time, the largest amount of stack space needed to push
+// or read any of the fields of a visitable structure.
+template <typename T, int idx, int count>
+struct visitable_stack_space {
+  using field_t = remove_cv_t<visit_struct::type_at<idx, T>>;
+  using next_t = visitable_stack_space<T, idx + 1, count>;
+
+  static constexpr int push() {
+    return detail::max_int(traits::push<field_t>::stack_space_needed,
+                           next_t::push());
+  }
+  static constexpr int read() {
+    return detail::max_int(traits::read<field_t>::stack_space_needed,
+                           next_t::read());
+  }
+};
+
+template <typename T, int count>
+struct visitable_stack_space<T, count, count> {
+  static constexpr int push() { return 0; }
+  static constexpr int read() { return 0; }
+};
+
+template <typename T>
+using visitable_stack_space_t =
+  visitable_stack_space<T, 0, static_cast<int>(
+                                visit_struct::traits::visitable<T>::field_count)>;
+
+// Pushes the table keyed by field name
+template <typename T>
+void
+push_visitable_named(lua_State * L, const T & t, table_pool * pool) {
+  detail::new_table(L, 0, visit_struct::field_count(t), pool);
+  push_visitable_field_keys<T>(L);
+
+  push_helper vis{L, lua_absindex(L, -2), lua_absindex(L, -1), 0, pool};
+  visit_struct::apply_visitor(vis, t);
+
+  lua_pop(L, 1);
+}
+
 } // end namespace detail
 
 namespace traits {
@@ -69,22 +278,64 @@ namespace traits {
 template <typename T>
 struct push<T, enable_if_t<visit_struct::traits::is_visitable<T>::value>> {
   static void to_stack(lua_State * L, const T & t) {
-    {
-      detail::stack_space_push_checker sc{};
-      visit_struct::apply_visitor(sc, t);
-      if (sc.needed > 1 && !lua_checkstack(L, 1 + sc.needed)) {
-        luaL_error(L, "insufficient stack space, needed %d", sc.needed);
-      }
+    push_impl(L, t, nullptr);
+  }
+
+  // A userdata copy is not pooled
+  static void to_stack(lua_State * L, const T & t, table_pool & pool) {
+    push_impl(L, t, &pool);
+  }
+
+  static void push_impl(lua_State * L, const T & t, table_pool * pool) {
+    if (detail::visitable_value_ops<T>::push(L, t)) { return; }
+
+    if (detail::is_positional<T>()) {
+      detail::new_table(L, visit_struct::field_count(t), 0, pool);
+      detail::positional_push_helper vis{L, 0, pool};
+      visit_struct::apply_visitor(vis, t);
+
+      primer::push_singleton<&detail::visitable_positional_metatable<T>>(L);
+      lua_setmetatable(L, -2);
+      return;
     }
 
-    lua_createtable(L, 0, visit_struct::field_count(t));
+    detail::push_visitable_named(L, t, pool);
+  }
+
+  // Keys which are not fields are left alone. A value userdata is not a
+  // table, so it can't be updated.
+  template <typename U = T,
+            typename = enable_if_t<!detail::is_value_userdata<U>()>>
+  static void to_existing(lua_State * L, int idx, const U & t) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    luaL_checkstack(L, 2 + stack_space_needed, "push_into");
+
+    if (detail::is_positional<T>()) {
+      detail::positional_update_helper vis{L, idx, 0};
+      visit_struct::apply_visitor(vis, t);
+
+      primer::push_singleton<&detail::visitable_positional_metatable<T>>(L);
+      lua_setmetatable(L, idx);
+      return;
+    }
 
-    detail::push_helper vis{L};
+    detail::push_visitable_field_keys<T>(L);
+    detail::update_helper vis{L, idx, lua_absindex(L, -1), 0};
     visit_struct::apply_visitor(vis, t);
+    lua_pop(L, 1);
   }
-  // If we could evaluate stack_space_push_checker at compile time, we could
-  // factor it into stack_space_needed here and skip the run time check above
-  static constexpr int stack_space_needed = 2;
+
+  // The table, the keys, and a key and whatever the largest field needs.
+  // Positional, the table, and the metatable or whatever the largest field
+  // needs.
+  static constexpr int stack_space_needed =
+    detail::is_value_userdata<T>()
+      ? detail::visitable_value_stack_space
+      : detail::is_positional<T>()
+      ? 1 + detail::max_int(detail::visitable_positional_metatable_stack_space,
+                            detail::visitable_stack_space_t<T>::push())
+      : 1 + detail::max_int(detail::visitable_field_keys_stack_space,
+                            2 + detail::visitable_stack_space_t<T>::push());
 };
 
 } // end namespace traits
@@ -95,24 +346,51 @@ struct push<T, enable_if_t<visit_struct::traits::is_visitable<T>::value>> {
 
 namespace detail {
 
-struct stack_space_read_checker {
-  int needed = 0;
+// Read a field from the top of the stack. Does not pop it.
+template <typename T>
+void
+read_visitable_field(lua_State * L, const char * name, T & value,
+                     expected<void> & ok) noexcept {
+  ok = detail::read_into(L, -1, value);
+  if (!ok) { ok.err().prepend_error_line("In field name '", name, "',"); }
+}
+
+struct read_helper {
+  lua_State * L;
+  int index;
+  int keys;
+  int count;
+  expected<void> ok;
+
+  explicit read_helper(lua_State * _L, int _idx, int _keys)
+    : L(_L)
+    , index(_idx)
+    , keys(_keys)
+    , count(0)
+    , ok{} {}
 
   template <typename T>
-  void operator()(const char *, const T &) {
-    constexpr int s = stack_space_for_read<T>();
-    if (s > needed) { needed = s; }
+  void operator()(const char * name, T & value) noexcept {
+    if (!ok) { return; }
+
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    lua_rawgeti(L, keys, ++count);
+    lua_gettable(L, index);
+    read_visitable_field(L, name, value, ok);
+    lua_pop(L, 1);
   }
 };
 
-struct read_helper {
+struct positional_read_helper {
   lua_State * L;
   int index;
+  int count;
   expected<void> ok;
 
-  explicit read_helper(lua_State * _L, int _idx)
+  explicit positional_read_helper(lua_State * _L, int _idx)
     : L(_L)
     , index(_idx)
+    , count(0)
     , ok{} {}
 
   template <typename T>
@@ -120,19 +398,178 @@ struct read_helper {
     if (!ok) { return; }
 
     PRIMER_ASSERT_STACK_NEUTRAL(L);
-    lua_getfield(L, index, name);
+    lua_rawgeti(L, index, ++count);
+    read_visitable_field(L, name, value, ok);
+    lua_pop(L, 1);
+  }
+};
 
-    if (auto result = traits::read<remove_cv_t<T>>::from_stack(L, -1)) {
-      detail::move_assign_noexcept(value, std::move(*result));
+/***
+ * Single pass reading
+ *
+ * The inverse of the field keys array maps each field name to its (1-based)
+ * position in the visitation order. When walking the table, each key is
+ * looked up there, and the position is dispatched to the field at compile-time.
+ */
+
+template <typename T>
+void
+visitable_field_indices(lua_State * L) {
+  push_visitable_field_keys<T>(L);
+  const int keys = lua_absindex(L, -1);
+  const int n = static_cast<int>(lua_rawlen(L, keys));
+
+  lua_createtable(L, 0, n);
+  for (int i = 1; i <= n; ++i) {
+    lua_rawgeti(L, keys, i);
+    lua_pushinteger(L, i);
+    lua_rawset(L, -3);
+  }
+  lua_remove(L, keys);
+}
+
+// Needed to create the field indices table, and to put it in the registry
+constexpr int visitable_field_indices_stack_space =
+  1 + visitable_field_keys_stack_space;
+
+template <typename T, int idx, int count>
+struct visitable_field_dispatch {
+  static void read(lua_State * L, int which, T & t,
+                   expected<void> & ok) noexcept {
+    if (which == idx + 1) {
+      read_visitable_field(L, visit_struct::get_name<idx, T>(),
+                           visit_struct::get<idx>(t), ok);
     } else {
-      ok = std::move(
-        result.err().prepend_error_line("In field name '", name, "',"));
+      visitable_field_dispatch<T, idx + 1, count>::read(L, which, t, ok);
     }
+  }
+
+  static void push(lua_State * L, int which, const T & t) {
+    if (which == idx + 1) {
+      using field_t = remove_cv_t<visit_struct::type_at<idx, T>>;
+      traits::push<field_t>::to_stack(L, visit_struct::get<idx>(t));
+    } else {
+      visitable_field_dispatch<T, idx + 1, count>::push(L, which, t);
+    }
+  }
+};
+
+template <typename T, int count>
+struct visitable_field_dispatch<T, count, count> {
+  static void read(lua_State *, int, T &, expected<void> &) noexcept {}
+  static void push(lua_State * L, int, const T &) { lua_pushnil(L); }
+};
+
+template <typename T>
+using visitable_field_dispatch_t =
+  visitable_field_dispatch<T, 0, static_cast<int>(
+                                   visit_struct::traits::visitable<T>::field_count)>;
+
+// Position of the field named by the key at `idx`, or zero
+template <typename T>
+int
+visitable_field_position(lua_State * L, int idx) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  idx = lua_absindex(L, idx);
+  int which = 0;
+  primer::push_singleton<&visitable_field_indices<T>>(L);
+  lua_pushvalue(L, idx);
+  if (LUA_TNUMBER == lua_rawget(L, -2)) {
+    which = static_cast<int>(lua_tointeger(L, -1));
+  }
+  lua_pop(L, 2);
+  return which;
+}
+
+// Finding the field position needs the indices and the key
+constexpr int visitable_field_position_stack_space =
+  1 + visitable_field_indices_stack_space;
+
+template <typename T>
+void
+read_visitable_single_pass(lua_State * L, int index, T & t, bool strict,
+                           expected<void> & ok) noexcept {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  constexpr int count =
+    static_cast<int>(visit_struct::traits::visitable<T>::field_count);
+  bool seen[count + 1] = {};
+
+  primer::push_singleton<&visitable_field_indices<T>>(L);
+  const int indices = lua_absindex(L, -1);
+
+  lua_pushnil(L);
+  while (lua_next(L, index)) {
+    lua_pushvalue(L, -2);
+    if (LUA_TNUMBER == lua_rawget(L, indices)) {
+      const int which = static_cast<int>(lua_tointeger(L, -1));
+      lua_pop(L, 1);
+      visitable_field_dispatch_t<T>::read(L, which, t, ok);
+      seen[which] = true;
+    } else {
+      lua_pop(L, 1);
+      if (strict) {
+        ok = primer::error{"Unexpected key ", describe_lua_value(L, -2)};
+      }
+    }
+    if (!ok) {
+      lua_pop(L, 2);
+      break;
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+
+  // Fields which did not appear are read from nil. If there is a metatable,
+  // its `__index` may supply them, so then they are looked up as by
+  // `read_helper`.
+  const bool lookup = lua_getmetatable(L, index);
+  int keys = 0;
+  if (lookup) {
     lua_pop(L, 1);
+    push_visitable_field_keys<T>(L);
+    keys = lua_absindex(L, -1);
+  }
+  for (int i = 1; ok && i <= count; ++i) {
+    if (!seen[i]) {
+      if (lookup) {
+        lua_rawgeti(L, keys, i);
+        lua_gettable(L, index);
+      } else {
+        lua_pushnil(L);
+      }
+      visitable_field_dispatch_t<T>::read(L, i, t, ok);
+      lua_pop(L, 1);
+    }
+  }
+  if (lookup) { lua_pop(L, 1); }
+}
+
+/***
+ * Visitors for `traits::binary`. The fields are encoded in visitation order,
+ * without their names.
+ */
+
+struct binary_write_helper {
+  std::string & out;
+
+  template <typename T>
+  void operator()(const char *, const T & value) {
+    traits::binary<T>::write(out, value);
   }
 };
 
-} // end namespace container
+struct binary_read_helper {
+  const char *& pos;
+  const char * end;
+  bool ok;
+
+  template <typename T>
+  void operator()(const char *, T & value) {
+    if (ok) { ok = traits::binary<T>::read(pos, end, value); }
+  }
+};
+
+} // end namespace detail
 
 namespace traits {
 
@@ -144,31 +581,181 @@ struct read<T, enable_if_t<visit_struct::traits::is_visitable<T>::value>> {
                          "no-throw constructible");
 
     expected<T> result{};
+    auto ok = into_existing(L, index, *result);
+    if (!ok) { result = std::move(ok.err()); }
+    return result;
+  }
 
-    detail::stack_space_read_checker sc{};
-    visit_struct::apply_visitor(sc, *result);
-    if (sc.needed > 1 && !lua_checkstack(L, 1 + sc.needed)) {
-      result = primer::error::insufficient_stack_space(sc.needed);
+  // Fields are read into in place
+  static expected<void> into_existing(lua_State * L, int index,
+                                      T & out) noexcept {
+    constexpr visitable_read_strategy strategy = visitable_read<T>::value;
+
+    expected<void> result;
+
+    index = lua_absindex(L, index);
+
+    if (detail::visitable_value_ops<T>::read(L, index, out, result)) {
+      // A copy of the userdata
+    } else if (!lua_istable(L, index) && !lua_isuserdata(L, index)) {
+      result = primer::arg_error(L, index, "table or userdata");
+    } else if (detail::is_positional<T>() && lua_istable(L, index)) {
+      detail::positional_read_helper vis{L, index};
+      visit_struct::apply_visitor(vis, out);
+
+      if (!vis.ok) { result = std::move(vis.ok.err()); }
+    } else if (strategy != visitable_read_strategy::per_field
+               && lua_istable(L, index)) {
+      detail::read_visitable_single_pass(
+        L, index, out,
+        strategy == visitable_read_strategy::single_pass_strict, result);
     } else {
-      index = lua_absindex(L, index);
+      detail::push_visitable_field_keys<T>(L);
 
-      if (!lua_istable(L, index) && !lua_isuserdata(L, index)) {
-        result = primer::arg_error(L, index, "table or userdata");
-      } else {
-        detail::read_helper vis{L, index};
-        visit_struct::apply_visitor(vis, *result);
+      detail::read_helper vis{L, index, lua_absindex(L, -1)};
+      visit_struct::apply_visitor(vis, out);
 
-        if (!vis.ok) { result = std::move(vis.ok.err()); }
-      }
+      lua_pop(L, 1);
+
+      if (!vis.ok) { result = std::move(vis.ok.err()); }
     }
 
     return result;
   }
-  static constexpr int stack_space_needed = 2;
-  // If we could evaluate stack_space_push_checker at compile time, we could
-  // factor it into stack_space_needed here and skip the run time check above
+  // The keys, the field being read, and whatever the largest field read needs.
+  // A single pass needs the indices, the key and value, and then either a copy
+  // of the key, or whatever the largest field read needs. After it, looking up
+  // the fields which did not appear needs as much as reading per field.
+  // Positional needs the field being read as well, which fits in the others.
+  static constexpr int stack_space_needed =
+    visitable_read<T>::value == visitable_read_strategy::per_field
+      ? detail::max_int(detail::visitable_field_keys_stack_space,
+                        2 + detail::visitable_stack_space_t<T>::read())
+      : detail::max_int(detail::visitable_field_indices_stack_space, 4,
+                        3 + detail::visitable_stack_space_t<T>::read());
+};
+
+// Lazy access for `ref_proxy`, by field name
+template <typename T>
+struct ref_proxy_access<
+  T, enable_if_t<visit_struct::traits::is_visitable<T>::value>> {
+  using dispatch_t = detail::visitable_field_dispatch_t<T>;
+  static constexpr int count =
+    static_cast<int>(visit_struct::traits::visitable<T>::field_count);
+
+  static void index(lua_State * L, const T & t) {
+    if (int which = detail::visitable_field_position<T>(L, 2)) {
+      dispatch_t::push(L, which, t);
+    } else {
+      lua_pushnil(L);
+    }
+  }
+
+  static int next(lua_State * L, const T & t) {
+    const bool first = lua_isnil(L, 2);
+    const int which = first ? 0 : detail::visitable_field_position<T>(L, 2);
+    if ((first || which) && which < count) {
+      detail::push_visitable_field_keys<T>(L);
+      lua_rawgeti(L, -1, which + 1);
+      lua_remove(L, -2);
+      dispatch_t::push(L, which + 1, t);
+      return 2;
+    }
+    lua_pushnil(L);
+    return 1;
+  }
+
+  // The number of fields
+  static std::size_t size(const T &) { return static_cast<std::size_t>(count); }
+
+  static constexpr int stack_space_needed =
+    detail::max_int(detail::visitable_field_position_stack_space,
+                    detail::visitable_field_keys_stack_space + 1,
+                    1 + detail::visitable_stack_space_t<T>::push());
+};
+
+template <typename T>
+struct read_type_mask<T,
+                      enable_if_t<visit_struct::traits::is_visitable<T>::value>>
+  : type_mask_constant<lua_type_bit(LUA_TTABLE) | lua_type_bit(LUA_TUSERDATA)> {
+};
+
+template <typename T>
+struct binary<T, enable_if_t<visit_struct::traits::is_visitable<T>::value>> {
+  static void write(std::string & out, const T & t) {
+    detail::binary_write_helper vis{out};
+    visit_struct::apply_visitor(vis, t);
+  }
+
+  static bool read(const char *& pos, const char * end, T & t) {
+    detail::binary_read_helper vis{pos, end, true};
+    visit_struct::apply_visitor(vis, t);
+    return vis.ok;
+  }
 };
 
 } // end namespace traits
 
+namespace detail {
+
+// A batch of visitable events is a table of typed arrays, one per field,
+// indexed by the field names
+template <typename T, int idx, int count>
+struct event_batch_fields {
+  static void to_stack(lua_State * L, const T * a, std::size_t na, const T * b,
+                       std::size_t nb) {
+    using field_t = remove_cv_t<visit_struct::type_at<idx, T>>;
+    typed_array<field_t> & arr =
+      primer::push_typed_array<field_t>(L, nullptr, na + nb);
+    for (std::size_t i = 0; i < na; ++i) {
+      arr[i] = visit_struct::get<idx>(a[i]);
+    }
+    for (std::size_t i = 0; i < nb; ++i) {
+      arr[na + i] = visit_struct::get<idx>(b[i]);
+    }
+    lua_setfield(L, -2, visit_struct::get_name<idx, T>());
+    event_batch_fields<T, idx + 1, count>::to_stack(L, a, na, b, nb);
+  }
+};
+
+template <typename T, int count>
+struct event_batch_fields<T, count, count> {
+  static void to_stack(lua_State *, const T *, std::size_t, const T *,
+                       std::size_t) {}
+};
+
+template <typename T>
+struct event_batch<T,
+                   enable_if_t<visit_struct::traits::is_visitable<T>::value>> {
+  static constexpr int count =
+    static_cast<int>(visit_struct::traits::visitable<T>::field_count);
+
+  static void to_stack(lua_State * L, const T * a, std::size_t na, const T * b,
+                       std::size_t nb) {
+    lua_createtable(L, 0, count);
+    event_batch_fields<T, 0, count>::to_stack(L, a, na, b, nb);
+  }
+};
+
+} // end namespace detail
+
+// Reads the fields which scripts assigned to the tracked table since the last
+// sync into `out`. Keys which are not fields are forgotten.
+template <typename T>
+enable_if_t<visit_struct::traits::is_visitable<T>::value, expected<void>>
+sync_into(tracked_table & table, T & out) noexcept {
+  return table.sync([&out](lua_State * L) -> expected<void> {
+    auto stack_check = detail::check_stack_push_n(
+      L, detail::max_int(detail::visitable_field_position_stack_space,
+                         detail::visitable_stack_space_t<T>::read()));
+    if (!stack_check) { return stack_check; }
+
+    expected<void> ok;
+    if (const int which = detail::visitable_field_position<T>(L, -2)) {
+      detail::visitable_field_dispatch_t<T>::read(L, which, out, ok);
+    }
+    return ok;
+  });
+}
+
 } // end namespace primer
@@ -42,28 +42,113 @@ API.
 PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/bound_function.hpp>
+#include <primer/coroutine_pool.hpp>
 #include <primer/cpp_pcall.hpp>
+#include <primer/detail/push_cant_fail.hpp>
 #include <primer/expected.hpp>
 #include <primer/lua.hpp>
 #include <primer/lua_ref.hpp>
 #include <primer/lua_ref_seq.hpp>
+#include <primer/packed_ref_seq.hpp>
+#include <primer/support/call_trace.hpp>
 #include <primer/support/function.hpp>
 #include <primer/support/function_check_stack.hpp>
 #include <primer/support/function_return.hpp>
 
 namespace primer {
 
+namespace api {
+class cpu_budget;
+template <typename T>
+class persistable;
+} // end namespace api
+
+template <typename T>
+class generator_range;
+
 //[ primer_coroutine
 class coroutine {
 
   lua_ref ref_;
   lua_State * thread_stack_;
+  detail::thread_pool * pool_;
 
   //<-
 
+  // Called when the coroutine has stopped for good. Returns the thread to the
+  // pool, if it was borrowed from one.
+  void finish() noexcept {
+    if (pool_) {
+      if (lua_State * L = ref_.push()) { pool_->release(L); }
+    }
+    this->reset();
+  }
+
+  friend class scheduler;
+  friend class api::cpu_budget;
+  template <typename>
+  friend class api::persistable;
+  template <typename>
+  friend class generator_range;
+
+  // The function is below the arguments until the first resume
+  void trace_begin(detail::call_trace_token & t, lua_State * L, int nargs) {
+#ifdef PRIMER_CALL_TRACING
+    const int fidx = (lua_status(thread_stack_) == LUA_OK) ? -1 - nargs : 0;
+    detail::call_trace_begin(t, L, thread_stack_, fidx, nargs, true);
+#else
+    static_cast<void>(t);
+    static_cast<void>(L);
+    static_cast<void>(nargs);
+#endif
+  }
+
+  // Pushes the arguments with `push_args`, and resumes. `lua_resume` is
+  // itself a protected boundary, so a protected context on the main thread is
+  // only made for the steps which may raise memory errors: the pushes, unless
+  // `safe_push`, the call tracing, and popping the results, unless the return
+  // helper can't fail. So the common resume is exactly one `lua_resume`.
+  template <typename return_type, typename helper, typename F>
+  void resume(expected<return_type> & result, lua_State * L, int nargs,
+              bool safe_push, F && push_args) noexcept {
+    detail::call_trace_token trace;
+#ifdef PRIMER_CALL_TRACING
+    safe_push = false;
+#endif
+    expected<void> ok;
+    if (safe_push) {
+      push_args();
+    } else {
+      ok = primer::mem_pcall(L, [&]() {
+        push_args();
+        this->trace_begin(trace, L, nargs);
+      });
+    }
+
+    if (ok) {
+      detail::resume_call_with<return_type, helper>(
+        result, thread_stack_, nargs,
+        [L](lua_State * T, int idx, expected<return_type> & r) {
+          if (detail::return_pop_cant_fail<helper>::value) {
+            helper::pop(T, idx, r);
+            return;
+          }
+          auto pop_ok = primer::mem_pcall(L, [&]() { helper::pop(T, idx, r); });
+          if (!pop_ok) { r = std::move(pop_ok.err()); }
+        });
+    } else {
+      result = std::move(ok.err());
+    }
+    detail::call_trace_end(trace, result);
+
+    if (lua_status(thread_stack_) != LUA_YIELD) { this->finish(); }
+  }
+
   // Takes one of the structures `detail::return_none`, `detail::return_one`,
   // `detail::return_many` as first parameter
-  template <typename return_type, typename... Args>
+  template <typename return_type,
+            typename helper = detail::return_helper<return_type>,
+            typename... Args>
   expected<return_type> protected_call(Args &&... args) noexcept {
     expected<return_type> result{primer::error::expired_coroutine()};
 
@@ -71,14 +156,11 @@ class coroutine {
       if (lua_State * L = ref_.lock()) {
         if (auto check =
               detail::check_stack_push_each<Args...>(thread_stack_)) {
-          auto ok = primer::mem_pcall(L, [&]() {
-            primer::push_each(thread_stack_, std::forward<Args>(args)...);
-            detail::resume_call(result, thread_stack_, sizeof...(Args));
-          });
-
-          if (!ok) { result = std::move(ok.err()); }
-
-          if (lua_status(thread_stack_) != LUA_YIELD) { this->reset(); }
+          this->resume<return_type, helper>(
+            result, L, sizeof...(Args), detail::push_cant_fail<Args...>::value,
+            [&]() {
+              primer::push_each(thread_stack_, std::forward<Args>(args)...);
+            });
         } else {
           result = std::move(check.err());
         }
@@ -92,20 +174,17 @@ class coroutine {
   }
 
   // Another version, using `lua_ref_seq` as input instead of a parameter pack.
-  template <typename return_type>
+  // Pushing references can't fail.
+  template <typename return_type,
+            typename helper = detail::return_helper<return_type>>
   expected<return_type> protected_call2(const lua_ref_seq & inputs) noexcept {
     expected<return_type> result{primer::error::expired_coroutine()};
     if (thread_stack_) {
       if (lua_State * L = ref_.lock()) {
         if (auto c = detail::check_stack_push_n(thread_stack_, inputs.size())) {
-          auto ok = primer::mem_pcall(L, [&]() {
-            inputs.push_each(thread_stack_);
-            detail::resume_call(result, thread_stack_, inputs.size());
-          });
-
-          if (!ok) { result = ok.err(); }
-
-          if (lua_status(thread_stack_) != LUA_YIELD) { this->reset(); }
+          this->resume<return_type, helper>(
+            result, L, static_cast<int>(inputs.size()), true,
+            [&]() { inputs.push_each(thread_stack_); });
         } else {
           result = std::move(c.err());
         }
@@ -120,7 +199,7 @@ class coroutine {
   //->
 public:
   // Special member functions
-  coroutine() noexcept : ref_(), thread_stack_(nullptr) {}
+  coroutine() noexcept : ref_(), thread_stack_(nullptr), pool_(nullptr) {}
 
   coroutine(coroutine &&) noexcept = default;
   coroutine & operator=(coroutine &&) noexcept = default;
@@ -134,6 +213,11 @@ public:
   /*<< Note: Can cause lua memory allocation failure >>*/
   explicit coroutine(const bound_function & bf);
 
+  // Construct from bound_function, borrowing a thread from the pool
+  /*<< If the pool belongs to a different state than `bf`, a new thread is
+       made as usual. Note: Can cause lua memory allocation failure >>*/
+  coroutine(const coroutine_pool & pool, const bound_function & bf);
+
   /*<< Check if the coroutine is valid to call >>*/
   explicit operator bool() const noexcept { return thread_stack_ && ref_; }
 
@@ -176,6 +260,18 @@ public:
   expected<lua_ref_seq> call(lua_ref_seq &) noexcept;
   expected<lua_ref_seq> call(lua_ref_seq const &) noexcept;
   expected<lua_ref_seq> call(lua_ref_seq &&) noexcept;
+
+  // As `call`, but all the results are held by a single table.
+  template <typename... Args>
+  expected<packed_ref_seq> call_packed(Args &&... args) noexcept;
+  expected<packed_ref_seq> call_packed(lua_ref_seq &) noexcept;
+  expected<packed_ref_seq> call_packed(lua_ref_seq const &) noexcept;
+  expected<packed_ref_seq> call_packed(lua_ref_seq &&) noexcept;
+
+  // Read the yielded or returned values directly as C++ values, as by
+  // `bound_function::call_as`, without making lua_refs.
+  template <typename T, typename... Args>
+  expected<T> resume_as(Args &&... args) noexcept;
 };
 
 //]
@@ -191,16 +287,35 @@ inline coroutine::coroutine(const bound_function & bf) //
   }
 }
 
+inline coroutine::coroutine(const coroutine_pool & pool,
+                            const bound_function & bf) //
+  : coroutine()                                        //
+{
+  if (lua_State * L = bf.push()) {
+    if (pool.lock() == L) {
+      pool_ = pool.pool_;
+      thread_stack_ = pool_->acquire(L);
+    } else {
+      thread_stack_ = lua_newthread(L);
+    }
+    lua_insert(L, -2);
+    lua_xmove(L, thread_stack_, 1);
+    ref_ = lua_ref(L);
+  }
+}
+
 inline void
 coroutine::reset() noexcept {
   ref_.reset();
   thread_stack_ = nullptr;
+  pool_ = nullptr;
 }
 
 inline void
 coroutine::swap(coroutine & other) noexcept {
   ref_.swap(other.ref_);
   std::swap(thread_stack_, other.thread_stack_);
+  std::swap(pool_, other.pool_);
 }
 
 inline void
@@ -208,6 +323,13 @@ swap(coroutine & one, coroutine & other) noexcept {
   one.swap(other);
 }
 
+template <typename T, typename... Args>
+inline expected<T>
+coroutine::resume_as(Args &&... args) noexcept {
+  return this->protected_call<T, detail::read_return_helper<T>>(
+    std::forward<Args>(args)...);
+}
+
 // Instantiate call definitions
 
 #define CALL_ARGS_HELPER(N, T)                                                 \
@@ -234,6 +356,7 @@ swap(coroutine & one, coroutine & other) noexcept {
 CALL_DEFINITIONS(call_no_ret, void)
 CALL_DEFINITIONS(call_one_ret, lua_ref)
 CALL_DEFINITIONS(call, lua_ref_seq)
+CALL_DEFINITIONS(call_packed, packed_ref_seq)
 
 #undef CALL_ARGS_HELPER
 #undef CALL_REF_SEQ_HELPER
@@ -0,0 +1,142 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A coroutine_pool is a handle to a per-state pool of idle lua threads, which
+ * `coroutine` can borrow instead of creating a new thread each time.
+ *
+ * When a coroutine borrowed from the pool returns normally, its thread has
+ * status `LUA_OK` and an empty stack, so it can run another function. Instead
+ * of being dropped for the GC, it goes back to the pool, up to
+ * `PRIMER_COROUTINE_POOL_SIZE` idle threads. Threads which raised an error are
+ * dead in lua 5.3, and are not recycled.
+ *
+ * The idle threads are held in a table in the registry, whose array part is
+ * allocated up front, so returning a thread doesn't allocate.
+ *
+ * Obtain the handle once (this may raise a lua error on memory failure), and
+ * then construct coroutines with `coroutine{pool, f}`.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/lua_state_ref.hpp>
+
+#include <cstddef>
+#include <new>
+
+#ifndef PRIMER_COROUTINE_POOL_SIZE
+#define PRIMER_COROUTINE_POOL_SIZE 64
+#endif
+
+namespace primer {
+
+class coroutine;
+
+namespace detail {
+
+// Lives in a userdata, anchored in the registry. Trivially destructible, so
+// it needs no __gc.
+struct thread_pool {
+  int table_ref; // Registry index of the table of idle threads
+  int count;     // Number of idle threads
+
+  static constexpr int capacity = PRIMER_COROUTINE_POOL_SIZE;
+
+  // Pushes an idle thread, or a new one, and returns it.
+  // May raise a lua error if a new thread is needed and memory fails.
+  lua_State * acquire(lua_State * L) {
+    if (!count) { return lua_newthread(L); }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, table_ref);
+    lua_rawgeti(L, -1, count);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, count);
+    lua_remove(L, -2);
+    --count;
+    return lua_tothread(L, -1);
+  }
+
+  // Whether a thread which is done can run another function. With lua 5.4, a
+  // thread which raised an error is reset to be used again.
+  static bool recyclable(lua_State * L, lua_State * T) noexcept {
+    if (lua_status(T) == LUA_OK && !lua_gettop(T)) { return true; }
+    if (!detail::can_reset_thread() || lua_status(T) == LUA_YIELD) {
+      return false;
+    }
+    detail::reset_thread(T, L);
+    lua_settop(T, 0);
+    return true;
+  }
+
+  // Pops a thread from the top of the stack. It is kept if it can be reused
+  // and there is room, otherwise it is left for the GC.
+  void release(lua_State * L) noexcept {
+    lua_State * T = lua_tothread(L, -1);
+    PRIMER_ASSERT(T, "expected a thread");
+    if (count < capacity && recyclable(L, T)) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, table_ref);
+      lua_insert(L, -2);
+      lua_rawseti(L, -2, ++count);
+    }
+    lua_pop(L, 1);
+  }
+
+  static void make(lua_State * L) {
+    thread_pool * p =
+      new (lua_newuserdata(L, sizeof(thread_pool))) thread_pool{};
+    lua_createtable(L, capacity, 0);
+    p->table_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    p->count = 0;
+  }
+
+  static thread_pool * get(lua_State * L) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    primer::push_singleton<&thread_pool::make>(L);
+    void * result = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    PRIMER_ASSERT(result, "Failed to obtain coroutine pool");
+    return static_cast<thread_pool *>(result);
+  }
+};
+
+} // end namespace detail
+
+//[ primer_coroutine_pool
+class coroutine_pool {
+  lua_state_ref sref_;
+  detail::thread_pool * pool_ = nullptr;
+
+  friend class coroutine;
+
+public:
+  coroutine_pool() noexcept = default;
+
+  /*<< Obtains the pool of the given lua state, creating it if necessary.
+       This may raise a lua error on memory allocation failure. >>*/
+  explicit coroutine_pool(lua_State * L)
+    : sref_(primer::obtain_state_ref(L))
+    , pool_(detail::thread_pool::get(L)) {}
+
+  // The main thread of the lua state, or nullptr if it is gone
+  lua_State * lock() const noexcept { return pool_ ? sref_.lock() : nullptr; }
+
+  explicit operator bool() const noexcept { return this->lock(); }
+
+  // Number of idle threads
+  std::size_t size() const noexcept {
+    return this->lock() ? static_cast<std::size_t>(pool_->count) : 0;
+  }
+};
+//]
+
+} // end namespace primer
@@ -29,6 +29,7 @@ PRIMER_ASSERT_FILESCOPE;
 #include <primer/expected.hpp>
 #include <primer/lua.hpp>
 #include <primer/support/function.hpp>
+#include <primer/support/internal_stats.hpp>
 
 #include <tuple>
 #include <type_traits>
@@ -64,10 +65,14 @@ namespace primer {
 
 namespace detail {
 
+// The callable is passed as a light userdata below the arguments, rather than
+// as an upvalue, so that the C function is light and pushing it doesn't
+// allocate a closure.
 template <typename T>
 int
-lambda_upvalue_dispatch(lua_State * L) {
-  T * t = static_cast<T *>(lua_touserdata(L, lua_upvalueindex(1)));
+lambda_arg_dispatch(lua_State * L) {
+  T * t = static_cast<T *>(lua_touserdata(L, 1));
+  lua_remove(L, 1);
   (*t)();
   return lua_gettop(L);
 }
@@ -78,17 +83,24 @@ template <int narg, typename F, typename... Args>
 expected<void>
 cpp_pcall(lua_State * L, F && f, Args &&... args) noexcept {
   expected<void> result;
+  PRIMER_INTERNAL_COUNT(L, cpp_pcalls);
 
   auto lambda = [&]() { (std::forward<F>(f))(std::forward<Args>(args)...); };
+  lua_pushcfunction(L, &detail::lambda_arg_dispatch<decltype(lambda)>);
   lua_pushlightuserdata(L, static_cast<void *>(&lambda));
-  lua_pushcclosure(L, &detail::lambda_upvalue_dispatch<decltype(lambda)>, 1);
 
-  if (narg) { lua_insert(L, -1 - narg); }
+  if (narg) {
+    lua_insert(L, -2 - narg);
+    lua_insert(L, -2 - narg);
+  }
 
   int code; // pcall_helper installs a custom error handler
-  std::tie(code, std::ignore) = detail::pcall_helper(L, narg, LUA_MULTRET);
+  std::tie(code, std::ignore) = detail::pcall_helper(L, narg + 1, LUA_MULTRET);
 
-  if (code != LUA_OK) { result = pop_error(L, code); }
+  if (code != LUA_OK) {
+    if (code == LUA_ERRMEM) { PRIMER_INTERNAL_COUNT(L, bad_alloc_recoveries); }
+    result = pop_error(L, code);
+  }
   return result;
 }
 //]
@@ -0,0 +1,112 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Copies a lua value deeply within its own VM, in place of the recursive
+ * `deepcopy` functions which scripts write in lua.
+ *
+ * The traversal is the one of `primer::transfer`: tables are copied in one
+ * pass, a table which is reached more than once, including by a cycle, is
+ * copied once and shared in the same way in the copy, and each copy is made
+ * at the sizes of its source, so that filling it doesn't rehash it. Since the
+ * copy is in the same VM:
+ *
+ * - Strings, functions, threads and light userdata are shared, not copied.
+ * - A table with a metatable is copied, and the copy gets the same metatable.
+ *   Metatables themselves are not copied.
+ * - Userdata of a type `T` for which `register_transfer<T>(L)` was called are
+ *   copied with the copy constructor of `T`. Other userdata are shared.
+ *
+ * Tables may be nested 200 deep. Fields are read and written raw, so `__index`
+ * and `__newindex` aren't called.
+ *
+ * From lua, if `primer::intf_deep_copy` is registered:
+ *
+ *   lua_pushcfunction(L, &primer::intf_deep_copy);
+ *   lua_setglobal(L, "deepcopy");
+ *
+ *   local snapshot = deepcopy(state)
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/cpp_pcall.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/transfer.hpp>
+
+#include <utility>
+
+namespace primer {
+
+namespace detail {
+
+// Expects the value on top of the stack, and replaces it with its copy
+inline void
+deep_copy_top(lua_State * L) {
+  luaL_checkstack(L, 4, "deep_copy");
+  const int idx = lua_gettop(L);
+  lua_newtable(L);
+  detail::transfer_context c{L, L, idx + 1, "deep_copy"};
+  c.copy_value(idx);
+  lua_replace(L, idx);
+  lua_settop(L, idx);
+}
+
+} // end namespace detail
+
+/// Copies the first argument, see above
+inline int
+intf_deep_copy(lua_State * L) {
+  luaL_checkany(L, 1);
+  lua_settop(L, 1);
+  detail::deep_copy_top(L);
+  return 1;
+}
+
+/***
+ * Pushes a copy of the value at `idx`, or pushes nothing and returns an error.
+ */
+inline expected<void>
+deep_copy_value(lua_State * L, int idx) noexcept {
+  if (!lua_checkstack(L, 5)) {
+    return primer::error::insufficient_stack_space(5);
+  }
+  lua_pushvalue(L, idx);
+  return primer::cpp_pcall<1>(L, [L]() { detail::deep_copy_top(L); });
+}
+
+/***
+ * A reference to a copy of the value of `r`
+ */
+inline expected<lua_ref>
+deep_copy(const lua_ref & r) {
+  lua_State * L = r.lock();
+  if (!L) { return primer::error::cant_lock_vm(); }
+  if (!lua_checkstack(L, 1)) {
+    return primer::error::insufficient_stack_space(1);
+  }
+
+  r.push();
+  auto ok = primer::deep_copy_value(L, -1);
+  if (!ok) {
+    lua_pop(L, 1);
+    return std::move(ok.err());
+  }
+  lua_remove(L, -2);
+
+  expected<lua_ref> result;
+  auto ref_ok = primer::mem_pcall<1>(L, [&]() { result = lua_ref{L}; });
+  if (!ref_ok) { return std::move(ref_ok.err()); }
+  return result;
+}
+
+} // end namespace primer
@@ -0,0 +1,106 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A log-linear histogram of durations, in nanoseconds.
+ *
+ * Durations below 8ns have a bucket each. Above that, each power of two is
+ * split into four buckets, so a quantile is known to within 25%. Durations of
+ * more than 2^40 ns (about 18 minutes) share the last bucket.
+ *
+ * The counts are relaxed atomics, so that several threads may record into one
+ * histogram, and it may be read while they do.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace primer {
+namespace detail {
+
+class latency_histogram {
+  static constexpr int sub_bits = 2;
+  static constexpr int max_exponent = 40;
+
+public:
+  static constexpr std::size_t num_buckets =
+    (max_exponent - sub_bits + 2) << sub_bits;
+
+  static std::size_t bucket_of(std::uint64_t ns) noexcept {
+    if (ns < (2u << sub_bits)) { return static_cast<std::size_t>(ns); }
+    int e = 0;
+    for (std::uint64_t v = ns; v >>= 1;) {
+      ++e;
+    }
+    if (e > max_exponent) { return num_buckets - 1; }
+    const std::size_t group = static_cast<std::size_t>(e - sub_bits + 1);
+    const std::size_t sub = (ns >> (e - sub_bits)) & ((1u << sub_bits) - 1);
+    return (group << sub_bits) + sub;
+  }
+
+  // The smallest duration which falls in a bucket
+  static std::uint64_t lower_bound(std::size_t bucket) noexcept {
+    if (bucket < (2u << sub_bits)) { return bucket; }
+    const std::size_t group = bucket >> sub_bits;
+    const std::uint64_t sub = bucket & ((1u << sub_bits) - 1);
+    return ((1u << sub_bits) + sub) << (group - 1);
+  }
+
+private:
+  std::atomic<std::uint64_t> counts_[num_buckets];
+
+public:
+  latency_histogram() noexcept { this->reset(); }
+  latency_histogram(const latency_histogram &) = delete;
+  latency_histogram & operator=(const latency_histogram &) = delete;
+
+  void record(std::uint64_t ns) noexcept {
+    counts_[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  std::uint64_t count() const noexcept {
+    std::uint64_t result = 0;
+    for (const auto & c : counts_) {
+      result += c.load(std::memory_order_relaxed);
+    }
+    return result;
+  }
+
+  std::uint64_t bucket_count(std::size_t bucket) const noexcept {
+    return counts_[bucket].load(std::memory_order_relaxed);
+  }
+
+  // An upper bound for the quantile `q` in [0, 1], or 0 if nothing was recorded
+  std::uint64_t quantile(double q) const noexcept {
+    const std::uint64_t total = this->count();
+    if (!total) { return 0; }
+    std::uint64_t rank = static_cast<std::uint64_t>(q * total);
+    if (rank >= total) { rank = total - 1; }
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < num_buckets; ++i) {
+      seen += counts_[i].load(std::memory_order_relaxed);
+      if (seen > rank) {
+        return i + 1 < num_buckets ? lower_bound(i + 1) - 1 : lower_bound(i);
+      }
+    }
+    return lower_bound(num_buckets - 1);
+  }
+
+  void reset() noexcept {
+    for (auto & c : counts_) {
+      c.store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+} // end namespace detail
+} // end namespace primer
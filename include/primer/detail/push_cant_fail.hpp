@@ -0,0 +1,57 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Trait which says that pushing a type can't raise a lua error, once there is
+ * stack space for it, because it doesn't allocate lua memory. Then a sequence
+ * of them can be pushed without a protected context.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/detail/type_traits.hpp>
+#include <primer/support/types.hpp>
+
+#include <type_traits>
+
+namespace primer {
+
+class lua_ref;
+
+namespace detail {
+
+template <typename T>
+struct push_cant_fail_impl
+  : std::integral_constant<bool, std::is_arithmetic<T>::value> {};
+
+template <>
+struct push_cant_fail_impl<primer::nil_t> : std::true_type {};
+
+template <>
+struct push_cant_fail_impl<primer::truthy> : std::true_type {};
+
+// Pushing a reference reads the registry, even if its state is gone
+template <>
+struct push_cant_fail_impl<primer::lua_ref> : std::true_type {};
+
+template <typename... Args>
+struct push_cant_fail;
+
+template <>
+struct push_cant_fail<> : std::true_type {};
+
+template <typename T, typename... Args>
+struct push_cant_fail<T, Args...>
+  : std::integral_constant<bool,
+                           push_cant_fail_impl<remove_cv_t<
+                             remove_reference_t<T>>>::value
+                             && push_cant_fail<Args...>::value> {};
+
+} // end namespace detail
+} // end namespace primer
@@ -0,0 +1,73 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Dispatch for `primer::push_into`.
+ *
+ * A push trait may optionally provide
+ *
+ * static void to_existing(lua_State *, int, const T &);
+ *
+ * which makes the table at the index hold what `to_stack` would put in a new
+ * table, without replacing it. It is called only with a table at the index,
+ * and may raise lua memory errors, as `to_stack` may.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/detail/type_traits.hpp>
+#include <primer/lua.hpp>
+#include <primer/traits/push.hpp>
+
+#include <type_traits>
+#include <utility>
+
+namespace primer {
+namespace detail {
+
+template <typename T, typename ENABLE = void>
+struct push_into_helper {
+  static constexpr bool available{false};
+  static void update(lua_State *, int, const T &) {}
+};
+
+template <typename T>
+struct push_into_helper<
+  T, void_t<decltype(traits::push<T>::to_existing(
+       std::declval<lua_State *>(), 0, std::declval<const T &>()))>> {
+  static constexpr bool available{true};
+  static void update(lua_State * L, int idx, const T & t) {
+    traits::push<T>::to_existing(L, idx, t);
+  }
+};
+
+// Expects the old value of a field on top of the stack. If it is a table which
+// can be updated in place, or is equal to the new value, it is popped and this
+// returns false. Otherwise it is replaced by the new value, and this returns
+// true, and the caller stores it.
+template <typename T>
+bool
+replace_value(lua_State * L, const T & value) {
+  if (push_into_helper<T>::available && lua_istable(L, -1)) {
+    push_into_helper<T>::update(L, lua_absindex(L, -1), value);
+    lua_pop(L, 1);
+    return false;
+  }
+
+  traits::push<T>::to_stack(L, value);
+  if (lua_rawequal(L, -1, -2)) {
+    lua_pop(L, 2);
+    return false;
+  }
+  lua_remove(L, -2);
+  return true;
+}
+
+} // end namespace detail
+} // end namespace primer
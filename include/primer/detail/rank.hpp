@@ -11,6 +11,8 @@
  * an inheritance hierarchy of trivial classes.
  */
 
+#include <type_traits>
+
 namespace primer {
 
 namespace detail {
@@ -21,6 +23,51 @@ struct Rank : Rank<N - 1> {};
 template <>
 struct Rank<0> {};
 
+/***
+ * Chunked ranks, for the lists which a class assembles by declaring one
+ * overload per element, like the callbacks of a `callback_registrar`.
+ *
+ * Looking up the latest overload with a single Rank needs a hierarchy as deep
+ * as the list is long, which limits the length, and makes each lookup cost the
+ * whole depth. Instead, the elements are split into chunks of
+ * `rank_chunk_size`. The overload for the list of size `n` takes
+ * `rank_chunk_of<n>`, which is only viable when the argument is exactly that
+ * chunk, and `rank_position_of<n>`, a Rank within it. The first element of
+ * each chunk also declares a chunk marker, taking `rank_chunk_marker<n>`, which
+ * returns `rank_chunk_index<n>`.
+ *
+ * The current list is found in two lookups, of depth at most
+ * `rank_max_chunks` and `rank_chunk_size`: first the latest chunk marker, with
+ * a `Rank<rank_max_chunks>`, and then the latest overload in that chunk, with
+ * a `Rank<rank_chunk_size>`. The empty list is in chunk 0, at position 0.
+ */
+
+constexpr int rank_chunk_size = 64;
+constexpr int rank_max_chunks = 64;
+constexpr int rank_max_size = rank_chunk_size * rank_max_chunks;
+
+template <int N>
+struct RankChunk {};
+
+// Never viable, taken by the marker of an element which doesn't begin a chunk
+template <int N>
+struct RankNoChunk {};
+
+template <int n>
+using rank_chunk_of = RankChunk<(n - 1) / rank_chunk_size>;
+
+template <int n>
+using rank_position_of = Rank<(n - 1) % rank_chunk_size + 1>;
+
+template <int n>
+using rank_chunk_marker =
+  typename std::conditional<(n - 1) % rank_chunk_size == 0,
+                            Rank<(n - 1) / rank_chunk_size>,
+                            RankNoChunk<n>>::type;
+
+template <int n>
+using rank_chunk_index = std::integral_constant<int, (n - 1) / rank_chunk_size>;
+
 } // end namespace detail
 
 } // end namespace mpl
@@ -0,0 +1,64 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Dispatch for `primer::read_into`.
+ *
+ * A read trait may optionally provide
+ *
+ * static expected<void> into_existing(lua_State *, int, T &);
+ *
+ * which reads into an existing object, reusing whatever resources it holds,
+ * e.g. the capacity of a container. If it isn't provided, we fall back to
+ * `from_stack` and move assign the result.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/detail/move_assign_noexcept.hpp>
+#include <primer/detail/type_traits.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/traits/read.hpp>
+
+#include <type_traits>
+#include <utility>
+
+namespace primer {
+namespace detail {
+
+template <typename T, typename ENABLE = void>
+struct read_into_helper {
+  static expected<void> read(lua_State * L, int idx, T & out) {
+    auto result = traits::read<T>::from_stack(L, idx);
+    if (!result) { return std::move(result.err()); }
+    detail::move_assign_noexcept(out, std::move(*result));
+    return {};
+  }
+};
+
+template <typename T>
+struct read_into_helper<
+  T, enable_if_t<std::is_same<decltype(traits::read<T>::into_existing(
+                                std::declval<lua_State *>(), 0,
+                                std::declval<T &>())),
+                              expected<void>>::value>> {
+  static expected<void> read(lua_State * L, int idx, T & out) {
+    return traits::read<T>::into_existing(L, idx, out);
+  }
+};
+
+template <typename T>
+expected<void>
+read_into(lua_State * L, int idx, T & out) {
+  return read_into_helper<T>::read(L, idx, out);
+}
+
+} // end namespace detail
+} // end namespace primer
@@ -0,0 +1,256 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A vector which holds its first `N` elements inside of itself, and only
+ * allocates when it grows past them.
+ *
+ * Only what `lua_ref_seq` needs is here. `T` must be nothrow move
+ * constructible, since elements are moved when the storage changes.
+ * Allocation failure throws `std::bad_alloc`, like `std::vector`.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <cstddef>
+#include <cstdlib>
+#include <initializer_list>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+namespace primer {
+namespace detail {
+
+template <typename T, std::size_t N>
+class small_vector {
+  PRIMER_STATIC_ASSERT(N > 0, "small_vector needs some inline capacity");
+  PRIMER_STATIC_ASSERT(std::is_nothrow_move_constructible<T>::value,
+                       "small_vector elements must be nothrow movable");
+
+  using storage_t = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+  T * data_;
+  std::size_t size_ = 0;
+  std::size_t capacity_ = N;
+  storage_t inline_[N];
+
+  T * inline_data() noexcept { return reinterpret_cast<T *>(inline_); }
+  bool is_inline() const noexcept {
+    return data_ == reinterpret_cast<const T *>(inline_);
+  }
+
+  void destroy_all() noexcept {
+    for (std::size_t i = 0; i < size_; ++i) {
+      data_[i].~T();
+    }
+    size_ = 0;
+  }
+
+  void deallocate() noexcept {
+    if (!this->is_inline()) { ::operator delete(data_); }
+    data_ = this->inline_data();
+    capacity_ = N;
+  }
+
+  // Move the elements into a new buffer of `cap` elements
+  void relocate(std::size_t cap) {
+    T * buffer = static_cast<T *>(::operator new(cap * sizeof(T)));
+    for (std::size_t i = 0; i < size_; ++i) {
+      new (buffer + i) T(std::move(data_[i]));
+      data_[i].~T();
+    }
+    this->deallocate();
+    data_ = buffer;
+    capacity_ = cap;
+  }
+
+  void grow_for(std::size_t n) {
+    if (n > capacity_) {
+      std::size_t cap = 2 * capacity_;
+      this->relocate(cap < n ? n : cap);
+    }
+  }
+
+  // Take the elements of `other`, which is left empty
+  void steal(small_vector & other) noexcept {
+    if (other.is_inline()) {
+      for (std::size_t i = 0; i < other.size_; ++i) {
+        new (this->inline_data() + i) T(std::move(other.data_[i]));
+      }
+      size_ = other.size_;
+      other.destroy_all();
+    } else {
+      data_ = other.data_;
+      size_ = other.size_;
+      capacity_ = other.capacity_;
+      other.data_ = other.inline_data();
+      other.size_ = 0;
+      other.capacity_ = N;
+    }
+  }
+
+public:
+  using value_type = T;
+  using reference = T &;
+  using const_reference = const T &;
+  using iterator = T *;
+  using const_iterator = const T *;
+
+  small_vector() noexcept : data_(this->inline_data()) {}
+
+  small_vector(const small_vector & other)
+    : small_vector() {
+    this->insert(this->end(), other.begin(), other.end());
+  }
+
+  small_vector(small_vector && other) noexcept : small_vector() {
+    this->steal(other);
+  }
+
+  small_vector(std::initializer_list<T> list)
+    : small_vector() {
+    this->insert(this->end(), list.begin(), list.end());
+  }
+
+  small_vector & operator=(const small_vector & other) {
+    if (this != &other) {
+      small_vector temp{other};
+      *this = std::move(temp);
+    }
+    return *this;
+  }
+
+  small_vector & operator=(small_vector && other) noexcept {
+    if (this != &other) {
+      this->destroy_all();
+      this->deallocate();
+      this->steal(other);
+    }
+    return *this;
+  }
+
+  ~small_vector() noexcept {
+    this->destroy_all();
+    this->deallocate();
+  }
+
+  std::size_t size() const noexcept { return size_; }
+  bool empty() const noexcept { return !size_; }
+  std::size_t capacity() const noexcept { return capacity_; }
+  static constexpr std::size_t inline_capacity() noexcept { return N; }
+
+  T * data() noexcept { return data_; }
+  const T * data() const noexcept { return data_; }
+
+  reference operator[](std::size_t i) noexcept { return data_[i]; }
+  const_reference operator[](std::size_t i) const noexcept { return data_[i]; }
+
+  reference at(std::size_t i) {
+    this->check_index(i);
+    return data_[i];
+  }
+  const_reference at(std::size_t i) const {
+    this->check_index(i);
+    return data_[i];
+  }
+
+  reference front() noexcept { return data_[0]; }
+  const_reference front() const noexcept { return data_[0]; }
+  reference back() noexcept { return data_[size_ - 1]; }
+  const_reference back() const noexcept { return data_[size_ - 1]; }
+
+  iterator begin() noexcept { return data_; }
+  const_iterator begin() const noexcept { return data_; }
+  iterator end() noexcept { return data_ + size_; }
+  const_iterator end() const noexcept { return data_ + size_; }
+
+  void reserve(std::size_t n) {
+    if (n > capacity_) { this->relocate(n); }
+  }
+
+  void clear() noexcept { this->destroy_all(); }
+
+  // New elements are value-initialized
+  void resize(std::size_t n) {
+    if (n < size_) {
+      while (size_ > n) {
+        this->pop_back();
+      }
+      return;
+    }
+    this->grow_for(n);
+    for (; size_ < n; ++size_) {
+      new (data_ + size_) T();
+    }
+  }
+
+  void pop_back() noexcept { data_[--size_].~T(); }
+
+  template <typename... Args>
+  void emplace_back(Args &&... args) {
+    if (size_ == capacity_) {
+      // Construct first, in case an argument refers to an element
+      T temp(std::forward<Args>(args)...);
+      this->grow_for(size_ + 1);
+      new (data_ + size_) T(std::move(temp));
+    } else {
+      new (data_ + size_) T(std::forward<Args>(args)...);
+    }
+    ++size_;
+  }
+
+  void push_back(const T & t) { this->emplace_back(t); }
+  void push_back(T && t) { this->emplace_back(std::move(t)); }
+
+  template <typename... Args>
+  iterator emplace(const_iterator pos, Args &&... args) {
+    const std::size_t idx = static_cast<std::size_t>(pos - data_);
+    this->emplace_back(std::forward<Args>(args)...);
+    this->rotate_back(idx, 1);
+    return data_ + idx;
+  }
+
+  template <typename InputIt>
+  iterator insert(const_iterator pos, InputIt first, InputIt last) {
+    const std::size_t idx = static_cast<std::size_t>(pos - data_);
+    const std::size_t old_size = size_;
+    for (; first != last; ++first) {
+      this->emplace_back(*first);
+    }
+    this->rotate_back(idx, size_ - old_size);
+    return data_ + idx;
+  }
+
+private:
+  void check_index(std::size_t i) const {
+    if (i >= size_) {
+#ifdef PRIMER_NO_EXCEPTIONS
+      std::abort();
+#else
+      throw std::out_of_range{"small_vector::at"};
+#endif
+    }
+  }
+
+  // Move the last `count` elements to position `idx`
+  void rotate_back(std::size_t idx, std::size_t count) noexcept {
+    for (std::size_t n = 0; n < count; ++n) {
+      for (std::size_t i = size_ - count + n; i > idx + n; --i) {
+        using std::swap;
+        swap(data_[i], data_[i - 1]);
+      }
+    }
+  }
+};
+
+} // end namespace detail
+} // end namespace primer
@@ -7,13 +7,24 @@
 
 /***
  * Helper function that takes string-like things and concatenates them.
- * Also takes numbers and calls "std::to_string" on them.
+ * Also takes integers and floating point numbers and formats them.
+ *
+ * The result is built in two passes: each argument is first turned into a
+ * "piece", a pointer and length (numbers are formatted into a small buffer
+ * inside the piece), then the total length is reserved once and the pieces are
+ * appended. So a call costs at most one allocation.
+ *
+ * String-like means `const char *`, or any type with `data()` and `size()`
+ * members, e.g. `std::string`, `std::string_view`, `primer::lua_string_view`.
  */
 
 #include <primer/base.hpp>
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
 #include <string>
 #include <type_traits>
 #include <utility>
@@ -21,38 +32,163 @@ PRIMER_ASSERT_FILESCOPE;
 namespace primer {
 namespace detail {
 
+// A piece of the output string. Either refers to external storage, or holds
+// formatted text in its own buffer. (We don't point `data_` at `buf_`, so that
+// pieces may be copied safely.)
+struct str_cat_piece {
+  static constexpr std::size_t buffer_size = 48;
+
+  const char * data_;
+  std::size_t size_;
+  char buf_[buffer_size];
+
+  const char * data() const noexcept { return data_ ? data_ : buf_; }
+  std::size_t size() const noexcept { return size_; }
+
+  static str_cat_piece external(const char * s, std::size_t n) noexcept {
+    str_cat_piece result;
+    result.data_ = s;
+    result.size_ = n;
+    return result;
+  }
+};
+
 // Trait
 template <typename T, typename ENABLE = void>
 struct str_cat_helper {};
 
 template <>
-struct str_cat_helper<std::string> {
-  static std::string to_string(std::string s) { return s; }
+struct str_cat_helper<const char *> {
+  static str_cat_piece to_piece(const char * s) noexcept {
+    return str_cat_piece::external(s, std::strlen(s));
+  }
 };
 
 template <>
-struct str_cat_helper<const char *> {
-  static std::string to_string(const char * s) { return s; }
+struct str_cat_helper<char *> : str_cat_helper<const char *> {};
+
+// Anything with `data()` and `size()`
+template <typename T>
+struct str_cat_helper<T,
+                      typename std::enable_if<std::is_convertible<
+                        decltype(std::declval<const T &>().data()),
+                        const char *>::value>::type> {
+  static str_cat_piece to_piece(const T & t) noexcept {
+    return str_cat_piece::external(t.data(), t.size());
+  }
 };
 
 template <typename T>
-struct str_cat_helper<T, typename std::enable_if<std::is_integral<T>::value>::
-                           type> {
-  static std::string to_string(T t) { return std::to_string(t); }
+constexpr bool
+str_cat_is_negative(T t, std::true_type) noexcept {
+  return t < T(0);
+}
+
+template <typename T>
+constexpr bool
+str_cat_is_negative(T, std::false_type) noexcept {
+  return false;
+}
+
+template <typename T>
+struct str_cat_helper<T, typename std::enable_if<std::is_integral<T>::value
+                                                 && !std::is_same<T, bool>::
+                                                      value>::type> {
+  static str_cat_piece to_piece(T t) noexcept {
+    using U = typename std::make_unsigned<T>::type;
+
+    str_cat_piece result;
+    result.data_ = nullptr;
+
+    // Take the magnitude in the unsigned type, so that the minimum value of
+    // a signed type doesn't overflow.
+    bool negative = str_cat_is_negative(t, std::is_signed<T>{});
+    U u = negative ? U(U(0) - static_cast<U>(t)) : static_cast<U>(t);
+
+    char temp[str_cat_piece::buffer_size];
+    std::size_t n = 0;
+    do {
+      temp[n++] = static_cast<char>('0' + (u % 10));
+      u /= 10;
+    } while (u);
+
+    std::size_t i = 0;
+    if (negative) { result.buf_[i++] = '-'; }
+    while (n) { result.buf_[i++] = temp[--n]; }
+    result.size_ = i;
+    return result;
+  }
+};
+
+// Formatted as an integer, like `std::to_string`
+template <>
+struct str_cat_helper<bool> {
+  static str_cat_piece to_piece(bool b) noexcept {
+    return str_cat_helper<int>::to_piece(b);
+  }
+};
+
+// Uses the same format as lua's default number formatting
+template <typename T>
+struct str_cat_helper<T, typename std::enable_if<
+                           std::is_floating_point<T>::value>::type> {
+  static str_cat_piece to_piece(T t) noexcept {
+    str_cat_piece result;
+    result.data_ = nullptr;
+    int n = std::snprintf(result.buf_, str_cat_piece::buffer_size, "%.14g",
+                          static_cast<double>(t));
+    result.size_ = n > 0 ? static_cast<std::size_t>(n) : 0;
+    if (result.size_ >= str_cat_piece::buffer_size) {
+      result.size_ = str_cat_piece::buffer_size - 1;
+    }
+    return result;
+  }
 };
 
+// Piece helpers, also used by `primer::error` to format directly into its own
+// storage.
+template <typename T>
+str_cat_piece
+str_cat_make_piece(const T & t) noexcept {
+  return str_cat_helper<typename std::decay<T>::type>::to_piece(t);
+}
+
+template <std::size_t N>
+std::size_t
+str_cat_length(const str_cat_piece (&pieces)[N]) noexcept {
+  std::size_t total = 0;
+  for (const auto & p : pieces) {
+    total += p.size();
+  }
+  return total;
+}
+
+// Returns a pointer to the end of the written text. Does not null-terminate.
+template <std::size_t N>
+char *
+str_cat_write(char * dest, const str_cat_piece (&pieces)[N]) noexcept {
+  for (const auto & p : pieces) {
+    if (p.size()) { std::memcpy(dest, p.data(), p.size()); }
+    dest += p.size();
+  }
+  return dest;
+}
+
 // Template function
 inline std::string
 str_cat() {
   return {};
 }
 
-template <typename T, typename... Args>
+template <typename... Args>
 std::string
-str_cat(T && t, Args &&... args) {
-  using helper_t = str_cat_helper<typename std::decay<T>::type>;
-  return helper_t::to_string(std::forward<T>(t))
-         + str_cat(std::forward<Args>(args)...);
+str_cat(const Args &... args) {
+  const str_cat_piece pieces[] = {str_cat_make_piece(args)...};
+
+  std::string result;
+  result.resize(str_cat_length(pieces));
+  str_cat_write(&result[0], pieces);
+  return result;
 }
 
 } // end namespace detail
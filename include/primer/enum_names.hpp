@@ -0,0 +1,126 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Push and read traits for enums which have a table of names.
+ *
+ * The values of the enum must be 0, 1, 2, ... and the table lists the name of
+ * each one, in order. Names are pushed as interned strings, see
+ * `interned_string.hpp`, or the values are pushed as integers, if the policy
+ * says so. In either case, both a name and an integer in range can be read.
+ *
+ * Reading a name is one raw lookup of the lua string in a table which maps
+ * the names to their values. Lua keeps the hash of each short string, so
+ * nothing is hashed again, compared byte by byte, or allocated.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/interned_string.hpp>
+#include <primer/lua.hpp>
+#include <primer/primer_fwd.hpp>
+#include <primer/push.hpp>
+#include <primer/read.hpp>
+#include <primer/traits/read_type_mask.hpp>
+
+#include <primer/detail/rank.hpp>
+#include <primer/detail/type_traits.hpp>
+
+#include <array>
+#include <cstddef>
+#include <type_traits>
+
+//[ primer_enum_names
+namespace primer {
+
+enum class enum_push_policy { name, integer };
+
+namespace traits {
+
+/*<< Specialize this with a static function `names()`, returning a reference
+     to a `std::array` of `const char *`, and optionally a static member
+     `policy` of type `enum_push_policy`. >>*/
+template <typename E>
+struct enum_names;
+
+} // end namespace traits
+} // end namespace primer
+//]
+
+namespace primer {
+namespace detail {
+
+template <typename E, typename ENABLE = void>
+struct has_enum_names : std::false_type {};
+
+template <typename E>
+struct has_enum_names<E, decltype(traits::enum_names<E>::names(), void())>
+  : std::is_enum<E> {};
+
+template <typename E>
+constexpr enum_push_policy
+enum_policy(Rank<1>, decltype(traits::enum_names<E>::policy) * = nullptr) {
+  return traits::enum_names<E>::policy;
+}
+
+template <typename E>
+constexpr enum_push_policy
+enum_policy(Rank<0>) {
+  return enum_push_policy::name;
+}
+
+template <typename E>
+using enum_strings = interned_strings<traits::enum_names<E>>;
+
+} // end namespace detail
+
+namespace traits {
+
+template <typename E>
+struct push<E, enable_if_t<detail::has_enum_names<E>::value>> {
+  static void to_stack(lua_State * L, E e) {
+    if (detail::enum_policy<E>(detail::Rank<1>{})
+        == enum_push_policy::integer) {
+      lua_pushinteger(L, static_cast<lua_Integer>(e));
+    } else {
+      detail::enum_strings<E>::push(L, static_cast<std::size_t>(e));
+    }
+  }
+  static constexpr int stack_space_needed{
+    detail::enum_strings<E>::stack_space_needed};
+};
+
+template <typename E>
+struct read<E, enable_if_t<detail::has_enum_names<E>::value>> {
+  static expected<E> from_stack(lua_State * L, int idx) {
+    const std::size_t n = detail::enum_strings<E>::size();
+    if (lua_isinteger(L, idx)) {
+      const lua_Integer i = lua_tointeger(L, idx);
+      if (i >= 0 && static_cast<std::size_t>(i) < n) {
+        return static_cast<E>(i);
+      }
+    } else {
+      const std::size_t i = detail::enum_strings<E>::find(L, idx);
+      if (i < n) { return static_cast<E>(i); }
+    }
+    return primer::arg_error(L, idx, "enum name");
+  }
+  static constexpr int stack_space_needed{
+    detail::enum_strings<E>::stack_space_needed};
+};
+
+template <typename E>
+struct read_type_mask<E, enable_if_t<detail::has_enum_names<E>::value>>
+  : type_mask_constant<lua_type_bit(LUA_TSTRING) | lua_type_bit(lua_tinteger)> {
+};
+
+} // end namespace traits
+} // end namespace primer
@@ -15,6 +15,12 @@
 
 */
 
+/*` An error must not be used by several threads at once, not even through
+   its const member functions, since its message may be formatted when it is
+   first read. Copies are independent, so each thread should have its own.
+
+*/
+
 /*` Primer generally translates lua errors into `primer::error` when it
    performs an operation which fails, and will translate `primer::error` into
    a lua error when adapting callbacks.
@@ -28,13 +34,64 @@
 PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/detail/str_cat.hpp>
+#include <primer/lua.hpp>
 
+#include <atomic>
+#include <cstddef>
+#include <cstring>
 #include <new>
 #include <string>
+#include <type_traits>
 #include <utility>
 
 namespace primer {
 
+namespace detail {
+
+inline const char *
+error_code_to_string(const int err_code) noexcept {
+  switch (err_code) {
+    case LUA_ERRSYNTAX:
+      return "a syntax error:";
+    case LUA_ERRRUN:
+      return "a runtime error:";
+    case LUA_ERRMEM:
+      return "a memory allocation error:";
+    case LUA_ERRERR:
+      return "an error in the error handler function:";
+#ifdef LUA_ERRGCMM
+    // Removed in lua 5.4, where errors in finalizers are only warnings
+    case LUA_ERRGCMM:
+      return "an error in a __gc metamethod";
+#endif
+    case LUA_OK:
+      return "this error code means there was no error... please report this:";
+    default:
+      return "an unknown type of error:";
+  }
+}
+
+// The original object of a lua error, held by a `primer::error`. The holder
+// is defined by <primer/error_capture.hpp>, which knows how to release it.
+// `type_name` has static storage duration.
+struct error_object {
+  std::atomic<std::size_t> refs;
+  void (*destroy)(error_object *) noexcept;
+  const char * type_name;
+
+  static void add_ref(error_object * o) noexcept {
+    o->refs.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void release(error_object * o) noexcept {
+    if (o->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      o->destroy(o);
+    }
+  }
+};
+
+} // end namespace detail
+
 //->
 
 //<-
@@ -57,36 +114,229 @@ namespace primer {
 class error {
   //<-
 
+  // The message is stored compactly, so that `expected<T>` stays small, and
+  // so that copying and moving errors never allocates:
+  // - Fixed messages are just a state.
+  // - Deferred messages keep their arguments (static strings or a number) and
+  //   are only formatted if the text is actually used. That may happen in a
+  //   const accessor, so an error must not be used by several threads at
+  //   once, not even through const accessors. Copies are independent, and
+  //   may be used on different threads.
+  // - Dynamic text lives in one immutable, reference-counted allocation,
+  //   shared by all copies. Adding context makes a new allocation.
+  // - Errors raised by lua keep the error code, and the message without the
+  //   line naming the code, which is only added if the text is used. If the
+  //   error object wasn't a string, a reference to it is kept instead.
   class impl {
-    enum class state {
+    enum class state : unsigned char {
       uninitialized,
       bad_alloc,
       cant_lock_vm,
       invalid_coroutine,
-      dynamic_text
+      cpu_budget_exceeded,
+      cancelled,
+      dynamic_text,
+      unexpected_value,
+      integer_overflow,
+      unsigned_overflow,
+      insufficient_stack_space,
+      lua_error,
+      lua_error_text
+    };
+
+    // Header of a dynamic message. The characters follow it in the same
+    // allocation, and are null-terminated.
+    struct text_block {
+      std::atomic<std::size_t> refs;
+      std::size_t size;
+
+      char * data() noexcept { return reinterpret_cast<char *>(this + 1); }
+
+      static text_block * allocate(std::size_t n) noexcept {
+        void * p = ::operator new(sizeof(text_block) + n + 1, std::nothrow);
+        if (!p) { return nullptr; }
+        text_block * result = new (p) text_block();
+        result->refs.store(1, std::memory_order_relaxed);
+        result->size = n;
+        return result;
+      }
+
+      static void add_ref(text_block * b) noexcept {
+        b->refs.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      static void release(text_block * b) noexcept {
+        if (b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          b->~text_block();
+          ::operator delete(b);
+        }
+      }
     };
 
-    using string_t = std::string;
+    union data_t {
+      struct {
+        const char * expected;
+        const char * found;
+      } value;
+      long long number;
+      unsigned long long unsigned_number;
+      text_block * text;
+      // In lua_error, `text` is the bare message, if the object was a string.
+      // In lua_error_text, it is the whole message.
+      struct {
+        text_block * text;
+        primer::detail::error_object * object;
+      } lua;
+    };
 
-    string_t str_;
-    state state_;
+    mutable state state_;
+    unsigned char code_;
+    mutable data_t data_;
 
     // Helpers
-    template <typename T>
-    void initialize_string(T && t) {
-      state_ = state::dynamic_text;
-      str_ = std::forward<T>(t);
+    bool is_lua_error() const noexcept {
+      return state_ == state::lua_error || state_ == state::lua_error_text;
+    }
+
+    static bool is_deferred(state s) noexcept {
+      return s == state::unexpected_value || s == state::integer_overflow
+             || s == state::unsigned_overflow
+             || s == state::insufficient_stack_space || s == state::lua_error;
+    }
+
+    void add_refs() const noexcept {
+      if (state_ == state::dynamic_text) {
+        text_block::add_ref(data_.text);
+      } else if (this->is_lua_error()) {
+        if (data_.lua.text) { text_block::add_ref(data_.lua.text); }
+        if (data_.lua.object) {
+          primer::detail::error_object::add_ref(data_.lua.object);
+        }
+      }
+    }
+
+    void reset() noexcept {
+      if (state_ == state::dynamic_text) {
+        text_block::release(data_.text);
+      } else if (this->is_lua_error()) {
+        if (data_.lua.text) { text_block::release(data_.lua.text); }
+        if (data_.lua.object) {
+          primer::detail::error_object::release(data_.lua.object);
+        }
+      }
+      state_ = state::uninitialized;
+      code_ = 0;
+    }
+
+    void copy_from(const impl & other) noexcept {
+      state_ = other.state_;
+      code_ = other.code_;
+      data_ = other.data_;
+      this->add_refs();
+    }
+
+    void steal_from(impl & other) noexcept {
+      state_ = other.state_;
+      code_ = other.code_;
+      data_ = other.data_;
+      other.state_ = state::uninitialized;
+      other.code_ = 0;
+    }
+
+    // Replace the text of a lua error, keeping its object
+    bool set_lua_text(text_block * b) noexcept {
+      if (!b) { return false; }
+      if (data_.lua.text) { text_block::release(data_.lua.text); }
+      data_.lua.text = b;
+      state_ = state::lua_error_text;
+      return true;
+    }
+
+    template <typename... Args>
+    static text_block * make_text(const Args &... args) noexcept {
+      const primer::detail::str_cat_piece pieces[] = {
+        primer::detail::str_cat_make_piece(args)...};
+
+      text_block * b =
+        text_block::allocate(primer::detail::str_cat_length(pieces));
+      if (b) { *primer::detail::str_cat_write(b->data(), pieces) = 0; }
+      return b;
+    }
+
+    // Format a deferred message, switching to dynamic text.
+    // (If it can't be allocated, we become bad_alloc. A lua error keeps its
+    // object and code, and stays unrendered.)
+    void render() const noexcept {
+      const state s = state_;
+      if (!is_deferred(s)) { return; }
+
+      state next = state::dynamic_text;
+      text_block * b = nullptr;
+      switch (s) {
+        case state::lua_error: {
+          const char * line = primer::detail::error_code_to_string(code_);
+          if (data_.lua.text) {
+            b = make_text(line, "\n",
+                          primer::detail::str_cat_piece::external(
+                            data_.lua.text->data(), data_.lua.text->size));
+          } else {
+            b = make_text(line, "\n(error object is a ",
+                          data_.lua.object->type_name, " value)");
+          }
+          next = state::lua_error;
+          if (b) {
+            if (data_.lua.text) { text_block::release(data_.lua.text); }
+            data_.lua.text = b;
+            next = state::lua_error_text;
+          }
+          break;
+        }
+        case state::unexpected_value:
+          b = make_text("Expected ", data_.value.expected, " found: '",
+                        data_.value.found, "'");
+          break;
+        case state::integer_overflow:
+          b = make_text("Integer overflow occurred: ", data_.number);
+          break;
+        case state::unsigned_overflow:
+          b = make_text("Integer overflow occurred: ", data_.unsigned_number);
+          break;
+        case state::insufficient_stack_space:
+          b = make_text("Insufficient stack space: needed ", data_.number);
+          break;
+        default:
+          break;
+      }
+      if (next == state::dynamic_text) {
+        if (b) {
+          data_.text = b;
+        } else {
+          next = state::bad_alloc;
+        }
+      }
+      state_ = next;
     }
 
   public:
-    impl()
-      : str_()
-      , state_(state::uninitialized) {}
-    impl(impl && other) = default;
-    impl(const impl & other) = default;
-    impl & operator=(impl && other) = default;
-    impl & operator=(const impl & other) = default;
-    ~impl() = default;
+    // The whole union is zeroed, as copies and moves copy all of it
+    impl() noexcept : state_(state::uninitialized), code_(0), data_() {}
+    impl(const impl & other) noexcept { this->copy_from(other); }
+    impl(impl && other) noexcept { this->steal_from(other); }
+    impl & operator=(const impl & other) noexcept {
+      if (this != &other) {
+        this->reset();
+        this->copy_from(other);
+      }
+      return *this;
+    }
+    impl & operator=(impl && other) noexcept {
+      if (this != &other) {
+        this->reset();
+        this->steal_from(other);
+      }
+      return *this;
+    }
+    ~impl() noexcept { this->reset(); }
 
     // Construct with fixed error messages
     struct bad_alloc_tag {
@@ -98,17 +348,124 @@ class error {
     struct invalid_coroutine_tag {
       static constexpr state value = state::invalid_coroutine;
     };
+    struct cpu_budget_exceeded_tag {
+      static constexpr state value = state::cpu_budget_exceeded;
+    };
+    struct cancelled_tag {
+      static constexpr state value = state::cancelled;
+    };
 
     template <typename T, typename = decltype(T::value)>
-    explicit impl(T) noexcept : str_(), state_(T::value) {}
+    explicit impl(T) noexcept : impl() {
+      state_ = T::value;
+    }
 
-    // Construct from string
-    explicit impl(std::string s) noexcept : impl() {
-      this->initialize_string(std::move(s));
+    // Construct deferred messages
+    struct unexpected_value_tag {};
+    struct integer_overflow_tag {
+      static constexpr state deferred = state::integer_overflow;
+    };
+    struct insufficient_stack_space_tag {
+      static constexpr state deferred = state::insufficient_stack_space;
+    };
+    struct unsigned_overflow_tag {};
+
+    // The strings must have static storage duration, e.g. string literals or
+    // the result of `lua_typename`.
+    impl(unexpected_value_tag, const char * expected,
+         const char * found) noexcept : impl() {
+      state_ = state::unexpected_value;
+      data_.value.expected = expected;
+      data_.value.found = found;
+    }
+
+    template <typename T, typename = decltype(T::deferred)>
+    impl(T, long long n) noexcept : impl() {
+      state_ = T::deferred;
+      data_.number = n;
+    }
+
+    impl(unsigned_overflow_tag, unsigned long long n) noexcept : impl() {
+      state_ = state::unsigned_overflow;
+      data_.unsigned_number = n;
+    }
+
+    // Construct a lua error, from the bare message or the original object.
+    // Takes ownership of the object, and copies the message. If the copy
+    // can't be allocated, we become bad_alloc, keeping the code.
+    struct lua_error_tag {};
+    impl(lua_error_tag, int code, const char * msg, std::size_t len,
+         primer::detail::error_object * object) noexcept : impl() {
+      code_ = static_cast<unsigned char>(code);
+      data_.lua.text = nullptr;
+      data_.lua.object = object;
+      if (msg) {
+        data_.lua.text = make_text(primer::detail::str_cat_piece::external(msg,
+                                                                         len));
+        if (!data_.lua.text && !object) {
+          state_ = state::bad_alloc;
+          return;
+        }
+      }
+      state_ = state::lua_error;
+    }
+
+    // Replace the message with the concatenation of the arguments.
+    // The arguments may refer to the current message.
+    // Returns false, leaving the message unchanged, if allocation fails.
+    template <typename... Args>
+    bool set_text(const Args &... args) noexcept {
+      const primer::detail::str_cat_piece pieces[] = {
+        primer::detail::str_cat_make_piece(args)...};
+
+      std::size_t n = primer::detail::str_cat_length(pieces);
+      text_block * b = text_block::allocate(n);
+      if (!b) { return false; }
+      *primer::detail::str_cat_write(b->data(), pieces) = 0;
+
+      this->reset();
+      data_.text = b;
+      state_ = state::dynamic_text;
+      return true;
+    }
+
+    // Put a line in front of the message. A lua error keeps its object and
+    // code.
+    template <typename... Args>
+    bool prepend_line(const Args &... args) noexcept {
+      this->render();
+      if (state_ == state::lua_error) { return false; }
+      const char * old = this->c_str();
+      std::size_t old_size = (state_ == state::dynamic_text)
+                               ? data_.text->size
+                               : (state_ == state::lua_error_text)
+                                   ? data_.lua.text->size
+                                   : std::strlen(old);
+      const auto old_piece =
+        primer::detail::str_cat_piece::external(old, old_size);
+      if (state_ == state::lua_error_text) {
+        return this->set_lua_text(make_text(args..., "\n", old_piece));
+      }
+      return this->set_text(args..., "\n", old_piece);
+    }
+
+    bool is_cpu_budget_exceeded() const noexcept {
+      return state_ == state::cpu_budget_exceeded;
+    }
+
+    bool is_cancelled() const noexcept { return state_ == state::cancelled; }
+
+    bool is_bad_alloc() const noexcept { return state_ == state::bad_alloc; }
+
+    int lua_code() const noexcept { return code_; }
+
+    primer::detail::error_object * lua_object() const noexcept {
+      return this->is_lua_error() ? data_.lua.object : nullptr;
     }
 
     // Access error message
-    const char * c_str() const {
+    const char * c_str() const noexcept {
+      this->render();
       switch (state_) {
         case state::uninitialized:
           return "uninitialized error message";
@@ -118,20 +475,21 @@ class error {
           return "couldn't access the lua VM";
         case state::invalid_coroutine:
           return "invalid coroutine";
+        case state::cpu_budget_exceeded:
+          return "cpu budget exceeded";
+        case state::cancelled:
+          return "cancelled";
         case state::dynamic_text:
-          return str_.c_str();
+          return data_.text->data();
+        case state::lua_error_text:
+          return data_.lua.text->data();
+        case state::lua_error:
+          // Rendering failed
+          return "bad_alloc";
         default:
           return "invalid error message state";
       }
     }
-
-    // Get reference to dynamic string, or convert it to such.
-    std::string & str() {
-      if (state_ != state::dynamic_text) {
-        this->initialize_string(this->c_str());
-      }
-      return str_;
-    }
   };
 
   impl msg_;
@@ -153,13 +511,12 @@ public:
   // Takes a sequence of strings, string literals, or numbers
   // and concatenates them to form the message.
   // (Implementation note: The t parameter is only here to help out msvc 2015)
-  template <typename T, typename... Args>
+  // (Copying a non-const error should not select this constructor.)
+  template <typename T, typename... Args,
+            typename = typename std::enable_if<!std::is_same<
+              typename std::decay<T>::type, error>::value>::type>
   explicit error(T && t, Args &&... args) noexcept : msg_() {
-    PRIMER_TRY_BAD_ALLOC {
-      msg_ = impl{primer::detail::str_cat(std::forward<T>(t),
-                                          std::forward<Args>(args)...)};
-    }
-    PRIMER_CATCH_BAD_ALLOC { msg_ = impl{impl::bad_alloc_tag{}}; }
+    if (!msg_.set_text(t, args...)) { msg_ = impl{impl::bad_alloc_tag{}}; }
   }
 
   // Help to give context to errors
@@ -175,6 +532,7 @@ public:
 
   // Used to indicate an out-of-memory error like `std::bad_alloc`
   static error bad_alloc() noexcept;
+  bool is_bad_alloc() const noexcept { return msg_.is_bad_alloc(); }
 
   // "Integer overflow occured: X"
   template <typename T>
@@ -187,6 +545,12 @@ public:
   template <typename T>
   static error unexpected_value(const char * expected, T && found) noexcept;
 
+  // As above, but the strings aren't copied, and the message is only
+  // formatted if it is actually used. Both must have static storage
+  // duration, e.g. string literals or the result of `lua_typename`.
+  static error unexpected_static_value(const char * expected,
+                                       const char * found) noexcept;
+
   // "Can't lock VM".
   /*<< Used with coroutines / bound_functions that are called but the VM could
        not be accessed. >>*/
@@ -199,6 +563,38 @@ public:
   // "Module 'foo' not found"
   static error module_not_found(const std::string & path) noexcept;
 
+  // "cpu budget exceeded"
+  /*<< Used by `api::cpu_budget` when a call runs out of time or
+       instructions >>*/
+  static error cpu_budget_exceeded() noexcept;
+  bool is_cpu_budget_exceeded() const noexcept {
+    return msg_.is_cpu_budget_exceeded();
+  }
+
+  // "cancelled"
+  /*<< Used by `primer::cancel_token` when a call is cancelled from another
+       thread >>*/
+  static error cancelled() noexcept;
+  bool is_cancelled() const noexcept { return msg_.is_cancelled(); }
+
+  // An error raised by lua, see `primer::pop_error`
+  /*<< Takes ownership of `object`, which may be null, and copies `msg`, which
+       may be null if there is an object. Nothing is formatted until the
+       message is used. >>*/
+  static error from_lua(int code, const char * msg, std::size_t len,
+                        detail::error_object * object) noexcept;
+
+  // The lua error code, e.g. `LUA_ERRRUN`, or `LUA_OK` if the error wasn't
+  // raised by lua
+  int lua_code() const noexcept { return msg_.lua_code(); }
+
+  // The original error object, if it wasn't a string.
+  /*<< Push it with `primer::push_error_object`. >>*/
+  bool has_lua_object() const noexcept { return msg_.lua_object(); }
+  detail::error_object * lua_object() const noexcept {
+    return msg_.lua_object();
+  }
+
   // Accessor
   const char * what() const noexcept { return msg_.c_str(); }
   const char * c_str() const noexcept { return this->what(); }
@@ -210,7 +606,13 @@ public:
 template <typename T>
 inline error
 error::integer_overflow(const T & t) noexcept {
-  return error("Integer overflow occurred: ", t);
+  PRIMER_STATIC_ASSERT(std::is_integral<T>::value,
+                       "integer overflow requires an integral value");
+  // Unsigned values are kept as such, so that those above LLONG_MAX survive
+  return error{std::is_signed<T>::value
+                 ? impl{impl::integer_overflow_tag{}, static_cast<long long>(t)}
+                 : impl{impl::unsigned_overflow_tag{},
+                        static_cast<unsigned long long>(t)}};
 }
 
 template <typename T>
@@ -219,9 +621,15 @@ error::unexpected_value(const char * expected, T && t) noexcept {
   return error("Expected ", expected, " found: '", std::forward<T>(t), "'");
 }
 
+inline error
+error::unexpected_static_value(const char * expected,
+                               const char * found) noexcept {
+  return error{impl{impl::unexpected_value_tag{}, expected, found}};
+}
+
 inline error
 error::insufficient_stack_space(int n) noexcept {
-  return error("Insufficient stack space: needed ", n);
+  return error{impl{impl::insufficient_stack_space_tag{}, n}};
 }
 
 inline error
@@ -244,16 +652,27 @@ error::cant_lock_vm() noexcept {
   return error{impl{impl::cant_lock_vm_tag{}}};
 }
 
+inline error
+error::cpu_budget_exceeded() noexcept {
+  return error{impl{impl::cpu_budget_exceeded_tag{}}};
+}
+
+inline error
+error::cancelled() noexcept {
+  return error{impl{impl::cancelled_tag{}}};
+}
+
+inline error
+error::from_lua(int code, const char * msg, std::size_t len,
+                detail::error_object * object) noexcept {
+  return error{impl{impl::lua_error_tag{}, code, msg, len, object}};
+}
+
 template <typename... Args>
 inline error &
 error::prepend_error_line(Args &&... args) noexcept {
-  PRIMER_TRY_BAD_ALLOC {
-    std::string & s = msg_.str();
-    s = primer::detail::str_cat(std::forward<Args>(args)...) + "\n" + s;
-  }
-  PRIMER_CATCH_BAD_ALLOC { /* msg_ = impl{impl::bad_alloc_tag{}}; */
-  }
-  // Note: Assigning bad_alloc there may be detrimental to error report quality
+  msg_.prepend_line(args...);
+  // Note: If this fails due to bad_alloc, we don't become bad_alloc.
   // prepend error line is used to give context, better to keep the previous
   // error and skip the addition of context than lose all of the original.
   return *this;
@@ -267,4 +686,10 @@ error::prepend_error_line(Args &&... args) noexcept {
 //` message as it comes up the callstack. For instance,
 //= err.prepend_error_line("In index [", idx, "] of table:");
 
+//` Errors which come from lua, through `primer::pop_error`, keep the lua
+//` error code, so that C++ code can branch on `err.lua_code()` without looking
+//` at the text. If the error object wasn't a string, the error holds a
+//` reference to it, and `primer::push_error_object` pushes it again, with its
+//` structure. The message is only formatted if `what()` is used.
+
 //]
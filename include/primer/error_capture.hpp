@@ -7,6 +7,12 @@
 
 /***
  * Support code related to interpretting lua runtime errors
+ *
+ * `pop_error` doesn't format anything: the error keeps the lua error code,
+ * which C++ code can branch on with `error::lua_code()`, and the text is only
+ * built if it is used. If the error object isn't a string, for instance a
+ * table with fields that a caller wants to inspect, a reference to it is kept,
+ * and `push_error_object` pushes it again.
  */
 
 #include <primer/base.hpp>
@@ -17,42 +23,92 @@ PRIMER_ASSERT_FILESCOPE;
 #include <primer/lua.hpp>
 #include <primer/support/asserts.hpp>
 #include <primer/support/diagnostics.hpp>
+#include <primer/support/lua_state_ref.hpp>
+#include <primer/support/main_thread.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <new>
 
 namespace primer {
 namespace detail {
 
-inline const char *
-error_code_to_string(const int err_code) noexcept {
-  switch (err_code) {
-    case LUA_ERRSYNTAX:
-      return "a syntax error:";
-    case LUA_ERRRUN:
-      return "a runtime error:";
-    case LUA_ERRMEM:
-      return "a memory allocation error:";
-    case LUA_ERRERR:
-      return "an error in the error handler function:";
-    case LUA_ERRGCMM:
-      return "an error in a __gc metamethod";
-    case LUA_OK:
-      return "this error code means there was no error... please report this:";
-    default:
-      return "an unknown type of error:";
+// Holds an error object in the registry. (This can't use `lua_ref`, which
+// depends on this header.) It is released like a `lua_ref` is.
+struct lua_error_object : error_object {
+  lua_state_ref sref;
+  int iref = LUA_NOREF;
+
+  static void destroy_impl(error_object * o) noexcept {
+    auto self = static_cast<lua_error_object *>(o);
+#ifdef PRIMER_THREAD_SAFE_STATE_REFS
+    if (!self->sref.on_owner_thread()) {
+      self->sref.defer_unref(self->iref, nullptr);
+      delete self;
+      return;
+    }
+#endif
+    if (lua_State * L = self->sref.lock()) {
+      luaL_unref(L, LUA_REGISTRYINDEX, self->iref);
+    }
+    delete self;
   }
-}
+
+  // Pops the object at index 1 into the registry. Upvalue-free, so that
+  // pushing it doesn't allocate. The holder is a light userdata at index 2.
+  static int capture(lua_State * L) {
+    auto self = static_cast<lua_error_object *>(lua_touserdata(L, 2));
+    lua_settop(L, 1);
+    self->sref = primer::obtain_state_ref(L);
+    self->iref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 0;
+  }
+
+  // Takes the object on top of the stack, or returns nullptr, leaving it.
+  // Capturing can fail to allocate, so it is protected, and it isn't
+  // attempted on a thread which can't make calls.
+  static error_object * make(lua_State * L) noexcept {
+    if (lua_status(L) != LUA_OK || !lua_checkstack(L, 3)) { return nullptr; }
+    auto self = new (std::nothrow) lua_error_object;
+    if (!self) { return nullptr; }
+    self->refs.store(1, std::memory_order_relaxed);
+    self->destroy = &destroy_impl;
+    self->type_name = lua_typename(L, lua_type(L, -1));
+
+    lua_pushcfunction(L, &capture);
+    lua_pushvalue(L, -2);
+    lua_pushlightuserdata(L, self);
+    if (lua_pcall(L, 2, 0, 0) != LUA_OK) {
+      lua_pop(L, 1);
+      delete self;
+      return nullptr;
+    }
+    return self;
+  }
+};
 
 } // end namespace detail
 
-// Gets an error string from the top of the stack, forms a primer::error.
-// Pops the error string.
+// Gets an error object from the top of the stack, forms a primer::error.
+// Pops the error object.
+// Strings (and numbers) are copied, other objects are kept by reference,
+// except after a memory error.
 // Note: This is noexcept because primer::error consumes any bad_alloc within
 // ctor and sets itself to bad_alloc state.
 inline primer::error
 pop_error(lua_State * L, int err_code) noexcept {
   PRIMER_ASSERT(lua_gettop(L), "No error object to pop!");
-  primer::error e{lua_isstring(L, -1) ? lua_tostring(L, -1)
-                                      : "(no description available)"};
-  e.prepend_error_line(detail::error_code_to_string(err_code));
+  std::size_t len = 0;
+  const char * msg = nullptr;
+  detail::error_object * object = nullptr;
+  if (lua_isstring(L, -1)) {
+    msg = lua_tolstring(L, -1, &len);
+  } else if (err_code == LUA_ERRMEM
+             || !(object = detail::lua_error_object::make(L))) {
+    msg = "(no description available)";
+    len = std::strlen(msg);
+  }
+  primer::error e{primer::error::from_lua(err_code, msg, len, object)};
   lua_pop(L, 1);
   return e;
 }
@@ -65,11 +121,29 @@ push_error(lua_State * L, const primer::error & e) noexcept {
   lua_pushstring(L, e.what());
 }
 
+// Pushes the original object of an error from lua, if it has one, and it is in
+// the VM of `L`. Otherwise pushes the message.
+// Returns true if the original object was pushed.
+inline bool
+push_error_object(lua_State * L, const primer::error & e) noexcept {
+  if (auto o = static_cast<detail::lua_error_object *>(e.lua_object())) {
+    lua_State * M = o->sref.lock();
+    if (M && M == primer::main_thread(L)) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, o->iref);
+      return true;
+    }
+  }
+  push_error(L, e);
+  return false;
+}
+
 // Create an "unexpected value" error
+// This does not allocate, the message is formatted only if it is used. So
+// `expected` must have static storage duration, like a type name.
 inline primer::error
 arg_error(lua_State * L, int index, const char * expected) noexcept {
-  return primer::error::unexpected_value(expected,
-                                         primer::describe_lua_value(L, index));
+  return primer::error::unexpected_static_value(
+    expected, primer::describe_lua_value(L, index));
 }
 
 } // end namespace primer
@@ -29,7 +29,13 @@ fetch_traceback_function(lua_State * L) noexcept {
   lua_remove(L, -2);
 }
 
-static constexpr const char * error_handler_reg_key = "primer_error_handler";
+// The handler is held in the registry at a light userdata key, so fetching it
+// is a raw lookup which doesn't hash a string.
+inline void *
+error_handler_reg_key() noexcept {
+  static char key;
+  return &key;
+}
 
 } // end namespace detail
 
@@ -39,7 +45,15 @@ static constexpr const char * error_handler_reg_key = "primer_error_handler";
 inline int get_error_handler(lua_State * L) noexcept;
 
 // Set a new error handler. Pops one object from top of stack.
+// Setting nil restores the default.
 inline void set_error_handler(lua_State * L) noexcept;
+
+// An error handler which only appends the source and line of the innermost lua
+// function on the stack to the error message, and doesn't build a traceback.
+inline int lean_error_handler(lua_State * L);
+
+// Install `lean_error_handler` as the error handler.
+inline void use_lean_error_handler(lua_State * L) noexcept;
 //]
 
 //[ primer_protected_call_decl
@@ -53,17 +67,47 @@ inline int protected_call(lua_State * L, int narg, int nret) noexcept;
 
 inline int
 get_error_handler(lua_State * L) noexcept {
-  lua_getfield(L, LUA_REGISTRYINDEX, detail::error_handler_reg_key);
-  if (!lua_toboolean(L, -1)) {
+  if (!lua_rawgetp(L, LUA_REGISTRYINDEX, detail::error_handler_reg_key())) {
+    // Cache the default, so that the next lookup is a single one
     lua_pop(L, 1);
     primer::push_singleton<detail::fetch_traceback_function>(L);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, detail::error_handler_reg_key());
   }
   return 1;
 }
 
 inline void
 set_error_handler(lua_State * L) noexcept {
-  lua_setfield(L, LUA_REGISTRYINDEX, detail::error_handler_reg_key);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, detail::error_handler_reg_key());
+}
+
+inline int
+lean_error_handler(lua_State * L) {
+  // Like debug.traceback, leave non-string error objects alone
+  const char * msg = lua_tostring(L, 1);
+  if (!msg) {
+    lua_settop(L, 1);
+    return 1;
+  }
+
+  // Level 0 is this function
+  lua_Debug ar;
+  for (int level = 1; lua_getstack(L, level, &ar); ++level) {
+    lua_getinfo(L, "Sl", &ar);
+    if (ar.currentline > 0) {
+      lua_pushfstring(L, "%s\n\tat %s:%d", msg, ar.short_src, ar.currentline);
+      return 1;
+    }
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+inline void
+use_lean_error_handler(lua_State * L) noexcept {
+  lua_pushcfunction(L, &lean_error_handler);
+  primer::set_error_handler(L);
 }
 
 //[ primer_protected_call_defn
@@ -19,5 +19,8 @@ inline int get_error_handler(lua_State * L) noexcept;
 // Pops a function from the stack and sets it to be the error handler.
 inline void set_error_handler(lua_State * L) noexcept;
 
+// Sets an error handler which reports only the faulting source and line.
+inline void use_lean_error_handler(lua_State * L) noexcept;
+
 } // end namespace primer
 //]
@@ -0,0 +1,180 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_event_channel_overview
+/*`
+A `primer::event_channel<T>` collects events which happen at a high rate,
+e.g. input or network packets, and hands them to a lua handler in batches,
+rather than calling the handler once for each of them.
+
+``
+  primer::event_channel<double> samples{handler, 1024};
+  ...
+  samples.post(x);
+  ...
+  // each tick
+  auto ok = samples.deliver();
+``
+
+The events are kept in a ring buffer in C++, whose capacity is fixed when the
+channel is made, so that posting an event never allocates. When the buffer is
+full, `post` returns false, and the event is counted by `dropped()`.
+
+`deliver` makes one protected call, in which it copies the pending events to
+the stack, and calls the handler once, as `handler(events, n)`. If `T` is an
+arithmetic type, `events` is a `primer::typed_array<T>` of the `n` events. If
+`T` is a visitable structure whose fields are arithmetic, and
+`primer/visit_struct.hpp` is included, `events` is a table which holds a
+typed array for each field, keyed by its name, so that `events.x[i]` is the
+field `x` of the `i`th event.
+
+``
+  function on_input(events, n)
+    for i = 1, n do
+      move(events.dx[i], events.dy[i])
+    end
+  end
+``
+
+If the handler raises an error, it is returned, and the events are still
+delivered. If the batch could not be made, e.g. for lack of memory, the
+events are kept for the next call.
+
+A channel belongs to the thread which runs the lua state, as the rest of
+primer does. Events from other threads should be handed over to that thread,
+e.g. through a `primer::vm_executor`, and posted there.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/bound_function.hpp>
+#include <primer/cpp_pcall.hpp>
+#include <primer/detail/type_traits.hpp>
+#include <primer/error.hpp>
+#include <primer/error_handler.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/function.hpp>
+#include <primer/support/function_check_stack.hpp>
+#include <primer/support/function_return.hpp>
+#include <primer/typed_array.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+namespace detail {
+
+// How a batch of events is pushed, as one value. The events are the `na`
+// events at `a`, followed by the `nb` events at `b`.
+template <typename T, typename ENABLE = void>
+struct event_batch;
+
+template <typename T>
+struct event_batch<T, enable_if_t<std::is_arithmetic<T>::value>> {
+  static void to_stack(lua_State * L, const T * a, std::size_t na, const T * b,
+                       std::size_t nb) {
+    typed_array<T> & arr = primer::push_typed_array(L, a, na + nb);
+    if (nb) { std::memcpy(arr.data() + na, b, nb * sizeof(T)); }
+  }
+};
+
+} // end namespace detail
+
+template <typename T>
+class event_channel {
+  PRIMER_STATIC_ASSERT(std::is_nothrow_copy_assignable<T>::value,
+                       "events must be nothrow copy assignable");
+
+  bound_function handler_;
+  std::vector<T> buffer_;
+  std::size_t head_ = 0; // The position of the oldest pending event
+  std::size_t size_ = 0;
+  std::size_t dropped_ = 0;
+
+public:
+  event_channel() noexcept = default;
+
+  // Note: Can throw `std::bad_alloc`, when the buffer is allocated
+  event_channel(bound_function handler, std::size_t capacity)
+    : handler_(std::move(handler))
+    , buffer_(capacity ? capacity : 1) {}
+
+  event_channel(const event_channel &) = delete;
+  event_channel & operator=(const event_channel &) = delete;
+
+  std::size_t capacity() const noexcept { return buffer_.size(); }
+  std::size_t size() const noexcept { return size_; }
+  bool empty() const noexcept { return !size_; }
+
+  // The number of events which didn't fit, since the last `reset_dropped`
+  std::size_t dropped() const noexcept { return dropped_; }
+  void reset_dropped() noexcept { dropped_ = 0; }
+
+  // Returns false, and drops the event, if the buffer is full
+  bool post(const T & event) noexcept {
+    if (size_ == buffer_.size()) {
+      ++dropped_;
+      return false;
+    }
+    std::size_t pos = head_ + size_;
+    if (pos >= buffer_.size()) { pos -= buffer_.size(); }
+    buffer_[pos] = event;
+    ++size_;
+    return true;
+  }
+
+  void clear() noexcept {
+    head_ = 0;
+    size_ = 0;
+  }
+
+  // Calls the handler once with the pending events, within a single
+  // protected context. If the handler raises an error, it is returned, and
+  // the events count as delivered.
+  expected<void> deliver() noexcept {
+    if (!size_) { return {}; }
+    lua_State * L = handler_.lock();
+    if (!L) { return primer::error::cant_lock_vm(); }
+    // Error handler, the handler, the batch and the count
+    auto stack_check = detail::check_stack_push_n(L, 5);
+    if (!stack_check) { return std::move(stack_check.err()); }
+
+    const std::size_t first = buffer_.size() - head_ < size_
+                                ? buffer_.size() - head_
+                                : size_;
+    const T * a = buffer_.data() + head_;
+    const T * b = buffer_.data();
+
+    expected<void> result;
+    bool called = false;
+    auto ok = primer::mem_pcall(L, [&]() {
+      primer::get_error_handler(L);
+      const int handler = lua_gettop(L);
+      handler_.push(L);
+      detail::event_batch<T>::to_stack(L, a, first, b, size_ - first);
+      lua_pushinteger(L, static_cast<lua_Integer>(size_));
+      called = true;
+      detail::pinned_fcn_call<void, detail::read_return_helper<void>>(
+        result, L, 2, handler);
+      lua_settop(L, handler - 1);
+    });
+    if (called) { this->clear(); }
+    if (!ok) { return std::move(ok.err()); }
+    return result;
+  }
+};
+
+} // end namespace primer
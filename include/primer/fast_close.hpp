@@ -0,0 +1,188 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_fast_close_overview
+/*`
+`lua_close` finalizes every object which has a finalizer, and frees every
+object one by one. When a process is shutting down, most of that work is
+wasted: the destructors of most userdata only give back memory, which the
+process is about to lose anyway.
+
+`primer::fast_close(L)` tears down a state whose allocator is a
+`primer::pool_allocator`, without closing it:
+
+* The collector is stopped, so that no other finalizer runs.
+* The finalizers of the userdata of types which must be finalized run, e.g.
+  of types which hold file handles or flush buffers. A type asks for it with
+  `static constexpr bool must_finalize = true;` in its userdata trait.
+* Every `lua_state_ref` to the state expires, so that the `lua_ref`s which
+  outlive it don't touch it.
+
+The memory of the state stays in the pool, and is freed in bulk when the pool
+is destroyed, or by `pool_allocator::release_all()`, which is then only a walk
+over the chunks and the large blocks of the pool.
+
+``
+  primer::pool_allocator pool;
+  lua_State * L = pool.new_state();
+  ...
+  primer::fast_close(L);
+  pool.release_all();        // or let the pool be destroyed
+``
+
+For a state with another allocator, `fast_close` calls `lua_close`, and
+returns false.
+
+The finalizers which must run are found through a table with weak keys in the
+registry, which a userdata of such a type joins when it is pushed, so finding
+them doesn't walk the heap. They run in no particular order, rather than in
+the reverse order of their creation. A finalizer which raises an error doesn't
+stop the others. Objects which the finalizers themselves make are not
+finalized.
+
+[important Files which scripts open with lua's `io` library are userdata of
+the `io` library, not of primer, so `fast_close` doesn't finalize them by
+itself, and what was buffered for them but not written is lost. Either close
+them before the state is torn down, or call `primer::track_io_files(L)` once
+after the `io` library is opened. Then the files which `io.open`, `io.popen`,
+`io.tmpfile`, `io.input` and `io.output` return are finalized like the
+objects of must-finalize types, which flushes and closes them. Files opened
+by `io.lines` are only read, and are not tracked.]
+
+The finalizer of a must-finalize type should clear the metatable of its
+object, as primer's default `__gc` does. Then an object which the collector
+already finalized is not finalized again.
+
+Everything else which finalizers would have released, e.g. the heap memory of
+C++ objects in userdata, is simply not released. This is meant for the end of
+a process, not for states which are replaced while it runs.
+
+States on different pools are independent, so they may be torn down in
+parallel, one thread for each pool. A `vm_worker_pool` does that, see
+`set_fast_teardown`.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/pool_allocator.hpp>
+#include <primer/support/lua_state_ref.hpp>
+#include <primer/support/must_finalize.hpp>
+
+namespace primer {
+
+//[ primer_fast_close
+/// Tears down a state which uses a `pool_allocator`, leaving its memory to the
+/// pool, or closes it if it uses another allocator. Returns true in the first
+/// case. The state must not be used after this.
+bool fast_close(lua_State * L) noexcept;
+//]
+
+//[ primer_track_io_files
+/// Makes the files which the `io` library of the state opens from now on be
+/// finalized by `fast_close`. Does nothing if the `io` library isn't loaded.
+/// Note: Raises a lua error on memory allocation failure
+void track_io_files(lua_State * L);
+//]
+
+namespace detail {
+
+// The objects are copied into a sequence first, since a finalizer may push
+// new ones, which would join the table while it is walked. Those are not
+// finalized.
+inline int
+run_must_finalize_fcn(lua_State * L) {
+  luaL_checkstack(L, 4, "fast_close");
+  lua_rawgetp(L, LUA_REGISTRYINDEX, must_finalize_key());
+  if (!lua_istable(L, 1)) { return 0; }
+  lua_newtable(L);
+  int n = 0;
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    lua_pop(L, 1);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, 2, ++n);
+  }
+
+  for (int i = 1; i <= n; ++i) {
+    luaL_checkstack(L, 3, "fast_close");
+    lua_rawgeti(L, 2, i);
+    if (luaL_getmetafield(L, -1, "__gc")) {
+      lua_insert(L, -2);
+      if (lua_pcall(L, 1, 0, 0) != LUA_OK) { lua_pop(L, 1); }
+    } else {
+      lua_pop(L, 1);
+    }
+  }
+  return 0;
+}
+
+// Calls the function of the io library in its upvalue, and tracks the file
+// which it returns, if any.
+inline int
+tracked_io_fcn(lua_State * L) {
+  luaL_checkstack(L, 2, "track_io_files");
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_insert(L, 1);
+  lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+  if (lua_gettop(L) >= 1 && luaL_testudata(L, 1, LUA_FILEHANDLE)) {
+    lua_pushvalue(L, 1);
+    track_must_finalize(L);
+    lua_pop(L, 1);
+  }
+  return lua_gettop(L);
+}
+
+} // end namespace detail
+
+inline void
+track_io_files(lua_State * L) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  luaL_checkstack(L, 3, "track_io_files");
+  static const char * const names[] = {"open", "popen", "tmpfile", "input",
+                                       "output"};
+  lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  if (lua_istable(L, -1)) {
+    lua_getfield(L, -1, "io");
+    if (lua_istable(L, -1)) {
+      for (const char * name : names) {
+        lua_getfield(L, -1, name);
+        if (lua_tocfunction(L, -1) != &detail::tracked_io_fcn
+            && lua_isfunction(L, -1)) {
+          lua_pushcclosure(L, &detail::tracked_io_fcn, 1);
+          lua_setfield(L, -2, name);
+        } else {
+          lua_pop(L, 1);
+        }
+      }
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+inline bool
+fast_close(lua_State * L) noexcept {
+  void * ud = nullptr;
+  if (lua_getallocf(L, &ud) != &pool_allocator::alloc) {
+    lua_close(L);
+    return false;
+  }
+
+  lua_settop(L, 0);
+  lua_sethook(L, nullptr, 0, 0);
+  lua_gc(L, LUA_GCSTOP, 0);
+  lua_pushcfunction(L, &detail::run_must_finalize_fcn);
+  if (lua_pcall(L, 0, 0, 0) != LUA_OK) { lua_pop(L, 1); }
+  primer::close_state_refs(L);
+  return true;
+}
+
+} // end namespace primer
@@ -0,0 +1,167 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A generator range exposes a coroutine as a C++ input range of the values
+ * which it yields, read as `T` by `primer::read`, like
+ * `coroutine::resume_as<T>`.
+ *
+ * The coroutine is resumed lazily, first by `begin`, and then by each `++` of
+ * the iterator. No lua_refs are made, so streaming numbers from a lua
+ * producer allocates nothing for each item. `T` may be a `std::tuple` to take
+ * several values from each yield.
+ *
+ * The range ends when the coroutine returns, and what it returns is ignored.
+ * It also ends if the coroutine raises an error, or a yielded value can't be
+ * read as a `T`, and then `error()` gives the error.
+ *
+ *   for (int x : primer::generator_range<int>{std::move(co)}) { ... }
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/coroutine.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/function_return.hpp>
+
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+namespace primer {
+
+namespace detail {
+
+template <typename T>
+struct generator_step {
+  expected<T> value{primer::error{}};
+  bool finished = false; // The coroutine returned
+};
+
+// Reads the yielded values, and only notes that the coroutine returned
+template <typename T>
+struct generator_step_helper {
+  using return_type = expected<generator_step<T>>;
+
+  static void pop(lua_State * L, int start_idx, return_type & result) {
+    result = generator_step<T>{};
+    if (lua_status(L) == LUA_YIELD) {
+      read_return_helper<T>::pop(L, start_idx, result->value);
+    } else {
+      result->finished = true;
+      lua_settop(L, start_idx - 1);
+    }
+  }
+
+  static constexpr int nrets = read_return_helper<T>::nrets;
+};
+
+template <typename T>
+struct return_pop_cant_fail<generator_step_helper<T>> : std::true_type {};
+
+} // end namespace detail
+
+//[ primer_generator_range
+template <typename T>
+class generator_range {
+  PRIMER_STATIC_ASSERT(!std::is_void<T>::value,
+                       "a generator range must have a value type");
+
+  coroutine co_;
+  expected<T> current_{primer::error{}};
+  expected<void> error_;
+  bool started_ = false;
+  bool done_ = false;
+
+  //<-
+  void advance() noexcept {
+    using step_t = detail::generator_step<T>;
+    auto step =
+      co_.protected_call<step_t, detail::generator_step_helper<T>>();
+    if (!step) {
+      error_ = std::move(step.err());
+      done_ = true;
+    } else if (step->finished) {
+      done_ = true;
+    } else if (!step->value) {
+      error_ = std::move(step->value.err());
+      done_ = true;
+      co_.reset();
+    } else {
+      current_ = std::move(step->value);
+    }
+  }
+  //->
+
+public:
+  class iterator {
+    generator_range * range_ = nullptr;
+
+    friend class generator_range;
+    explicit iterator(generator_range * r) noexcept
+      : range_(r) {}
+
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T *;
+    using reference = const T &;
+
+    iterator() noexcept = default;
+
+    reference operator*() const noexcept { return *range_->current_; }
+    pointer operator->() const noexcept { return &*range_->current_; }
+
+    /*<< Resumes the coroutine >>*/
+    iterator & operator++() noexcept {
+      range_->advance();
+      if (range_->done_) { range_ = nullptr; }
+      return *this;
+    }
+
+    bool operator==(const iterator & o) const noexcept {
+      return range_ == o.range_;
+    }
+    bool operator!=(const iterator & o) const noexcept {
+      return range_ != o.range_;
+    }
+  };
+
+  explicit generator_range(coroutine co) noexcept
+    : co_(std::move(co)) {}
+
+  generator_range(generator_range &&) = default;
+  generator_range & operator=(generator_range &&) = default;
+
+  /*<< Resumes the coroutine the first time >>*/
+  iterator begin() noexcept {
+    if (!started_) {
+      started_ = true;
+      if (co_) {
+        this->advance();
+      } else {
+        error_ = primer::error::expired_coroutine();
+        done_ = true;
+      }
+    }
+    return done_ ? iterator{} : iterator{this};
+  }
+
+  iterator end() noexcept { return iterator{}; }
+
+  /*<< The error which ended the range, if any >>*/
+  const expected<void> & error() const noexcept { return error_; }
+};
+//]
+
+} // end namespace primer
@@ -0,0 +1,326 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_global_function_cache_overview
+/*`
+A `primer::global_function_cache` is for the entry points of scripts, such as
+`on_update` or `on_event`, which the host calls by name, e.g. every frame.
+Each name is given a slot once, and the function is then called by its slot,
+without looking up the name, or making a `bound_function`.
+
+``
+  primer::global_function_cache entry{L};
+  const int on_update = entry.add("on_update");
+  ...
+  // each frame
+  auto ok = entry.call_no_ret(on_update, dt);
+``
+
+The functions are kept in one table, behind one registry reference, whose
+array part holds the function of each slot, or `false` if the global isn't a
+function. Names are looked up raw in the globals table, when they are added
+and when `rebind()` is called. Calling a slot whose global isn't a function is
+an error.
+
+The cache has to hear about changes to the globals:
+
+* `rebind()` looks up every name again. This is needed after the globals are
+  replaced, e.g. when a state is unpersisted or stamped from a template.
+* `watch()` puts a `__newindex` in the metatable of the globals, so that
+  defining one of the names updates its slot. An existing `__newindex` is
+  called by it. Lua only calls `__newindex` for names which aren't yet defined,
+  so a global which is reassigned, or assigned by `rawset`, still needs
+  `rebind()`. The watch is a C closure, and can't be persisted.
+
+To call one slot many times in a row, `function(slot)` gives a
+`bound_function`, for a `primer::call_site`.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/bound_function.hpp>
+#include <primer/cpp_pcall.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/lua_ref_seq.hpp>
+#include <primer/push.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/call_trace.hpp>
+#include <primer/support/function.hpp>
+#include <primer/support/function_check_stack.hpp>
+#include <primer/support/function_return.hpp>
+
+#include <utility>
+
+namespace primer {
+
+namespace detail {
+
+// Expects the cache table at `t`, and the value of a global on top of the
+// stack, and stores it in `slot`
+inline void
+set_function_slot(lua_State * L, int t, int slot) {
+  if (!lua_isfunction(L, -1)) {
+    lua_pop(L, 1);
+    lua_pushboolean(L, false);
+  }
+  lua_rawseti(L, t, slot);
+}
+
+// Looks up each name of the cache table on top of the stack again
+inline void
+rebind_function_slots(lua_State * L) {
+  const int t = lua_gettop(L);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+  lua_pushnil(L);
+  while (lua_next(L, t)) { // [globals] [k] [v]
+    if (lua_type(L, -2) == LUA_TSTRING) {
+      const int slot = static_cast<int>(lua_tointeger(L, -1));
+      lua_pushvalue(L, -2);
+      lua_rawget(L, t + 1);
+      detail::set_function_slot(L, t, slot);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+// Upvalues: the cache table, and the previous `__newindex`, or nil
+inline int
+function_cache_newindex(lua_State * L) {
+  lua_settop(L, 3);
+  switch (lua_type(L, lua_upvalueindex(2))) {
+    case LUA_TNIL:
+      lua_pushvalue(L, 2);
+      lua_pushvalue(L, 3);
+      lua_rawset(L, 1);
+      break;
+    case LUA_TFUNCTION:
+      lua_pushvalue(L, lua_upvalueindex(2));
+      lua_pushvalue(L, 1);
+      lua_pushvalue(L, 2);
+      lua_pushvalue(L, 3);
+      lua_call(L, 3, 0);
+      break;
+    default:
+      lua_pushvalue(L, lua_upvalueindex(2));
+      lua_pushvalue(L, 2);
+      lua_pushvalue(L, 3);
+      lua_settable(L, -3);
+      lua_pop(L, 1);
+      break;
+  }
+
+  if (lua_type(L, 2) == LUA_TSTRING) {
+    lua_pushvalue(L, 2);
+    if (LUA_TNUMBER == lua_rawget(L, lua_upvalueindex(1))) {
+      const int slot = static_cast<int>(lua_tointeger(L, -1));
+      lua_pushvalue(L, 3);
+      detail::set_function_slot(L, lua_upvalueindex(1), slot);
+    }
+  }
+  return 0;
+}
+
+} // end namespace detail
+
+//[ primer_global_function_cache
+class global_function_cache {
+  lua_ref table_; // t[slot] is the function, t[name] is the slot
+
+  //<-
+  template <typename return_type,
+            typename helper = detail::return_helper<return_type>,
+            typename... Args>
+  expected<return_type> protected_call(int slot, Args &&... args) const
+    noexcept;
+  //->
+public:
+  global_function_cache() noexcept = default;
+
+  /*<< Note: Can cause lua memory allocation failure >>*/
+  explicit global_function_cache(lua_State * L);
+
+  global_function_cache(const global_function_cache &) = delete;
+  global_function_cache & operator=(const global_function_cache &) = delete;
+  global_function_cache(global_function_cache &&) noexcept = default;
+  global_function_cache & operator=(global_function_cache &&) noexcept =
+    default;
+
+  explicit operator bool() const noexcept { return static_cast<bool>(table_); }
+
+  /*<< Returns the slot of `name`, which is looked up now. Adding a name again
+       returns the same slot. Returns 0 if the state is gone.
+       Note: Can cause lua memory allocation failure >>*/
+  int add(const char * name);
+
+  // Whether the global of the slot is a function
+  bool has(int slot) const noexcept;
+
+  // Looks up every name again
+  expected<void> rebind() noexcept;
+
+  // Updates slots when their names are defined, see above
+  expected<void> watch() noexcept;
+
+  /*<< The function of the slot, or an empty `bound_function`
+       Note: Can cause lua memory allocation failure >>*/
+  bound_function function(int slot) const;
+
+  // Call methods, as in `bound_function`
+  template <typename... Args>
+  expected<void> call_no_ret(int slot, Args &&... args) const noexcept;
+
+  template <typename... Args>
+  expected<lua_ref> call_one_ret(int slot, Args &&... args) const noexcept;
+
+  template <typename... Args>
+  expected<lua_ref_seq> call(int slot, Args &&... args) const noexcept;
+
+  template <typename T, typename... Args>
+  expected<T> call_as(int slot, Args &&... args) const noexcept;
+};
+//]
+
+inline global_function_cache::global_function_cache(lua_State * L) {
+  lua_newtable(L);
+  table_ = lua_ref{L};
+}
+
+inline int
+global_function_cache::add(const char * name) {
+  lua_State * L = table_.push();
+  if (!L) { return 0; }
+  const int t = lua_gettop(L);
+  int slot;
+  if (LUA_TNUMBER == lua_getfield(L, t, name)) {
+    slot = static_cast<int>(lua_tointeger(L, -1));
+  } else {
+    slot = static_cast<int>(lua_rawlen(L, t)) + 1;
+    lua_pushinteger(L, slot);
+    lua_setfield(L, t, name);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    lua_pushstring(L, name);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+    detail::set_function_slot(L, t, slot);
+  }
+  lua_settop(L, t - 1);
+  return slot;
+}
+
+inline bool
+global_function_cache::has(int slot) const noexcept {
+  lua_State * L = table_.push();
+  if (!L) { return false; }
+  lua_rawgeti(L, -1, slot);
+  const bool result = lua_isfunction(L, -1);
+  lua_pop(L, 2);
+  return result;
+}
+
+inline expected<void>
+global_function_cache::rebind() noexcept {
+  lua_State * L = table_.lock();
+  if (!L) { return primer::error::cant_lock_vm(); }
+  auto stack_check = detail::check_stack_push_n(L, 6);
+  if (!stack_check) { return std::move(stack_check.err()); }
+  return primer::mem_pcall(L, [&]() {
+    table_.push(L);
+    detail::rebind_function_slots(L);
+    lua_pop(L, 1);
+  });
+}
+
+inline expected<void>
+global_function_cache::watch() noexcept {
+  lua_State * L = table_.lock();
+  if (!L) { return primer::error::cant_lock_vm(); }
+  auto stack_check = detail::check_stack_push_n(L, 6);
+  if (!stack_check) { return std::move(stack_check.err()); }
+  return primer::mem_pcall(L, [&]() {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    if (!lua_getmetatable(L, -1)) {
+      lua_newtable(L);
+      lua_pushvalue(L, -1);
+      lua_setmetatable(L, -3);
+    }
+    table_.push(L);
+    lua_getfield(L, -2, "__newindex");
+    lua_pushcclosure(L, &detail::function_cache_newindex, 2);
+    lua_setfield(L, -2, "__newindex");
+    lua_pop(L, 2);
+  });
+}
+
+inline bound_function
+global_function_cache::function(int slot) const {
+  lua_State * L = table_.push();
+  if (!L) { return {}; }
+  lua_rawgeti(L, -1, slot);
+  lua_remove(L, -2);
+  return bound_function{L};
+}
+
+template <typename return_type, typename helper, typename... Args>
+expected<return_type>
+global_function_cache::protected_call(int slot, Args &&... args) const
+  noexcept {
+  expected<return_type> result{primer::error::cant_lock_vm()};
+  if (lua_State * L = table_.lock()) {
+    if (auto stack_check = detail::check_stack_push_each<int, Args...>(L)) {
+      detail::call_trace_token trace;
+      auto ok = mem_pcall(L, [&]() {
+        table_.push(L);
+        lua_rawgeti(L, -1, slot);
+        lua_remove(L, -2);
+        if (!lua_isfunction(L, -1)) {
+          lua_pop(L, 1);
+          result = primer::error{"No function in slot ", slot};
+          return;
+        }
+        primer::push_each(L, std::forward<Args>(args)...);
+        detail::call_trace_begin(trace, L, L, -1 - int{sizeof...(args)},
+                                 sizeof...(args), false);
+        detail::fcn_call<return_type, helper>(result, L, sizeof...(args));
+      });
+
+      if (!ok) { result = std::move(ok.err()); }
+      detail::call_trace_end(trace, result);
+    } else {
+      result = std::move(stack_check.err());
+    }
+  }
+  return result;
+}
+
+#define CALL_HELPER(N, T)                                                      \
+  template <typename... Args>                                                  \
+  inline expected<T> global_function_cache::N(int slot, Args &&... args) const \
+    noexcept {                                                                 \
+    return this->protected_call<T>(slot, std::forward<Args>(args)...);         \
+  }
+
+CALL_HELPER(call_no_ret, void)
+CALL_HELPER(call_one_ret, lua_ref)
+CALL_HELPER(call, lua_ref_seq)
+
+#undef CALL_HELPER
+
+template <typename T, typename... Args>
+inline expected<T>
+global_function_cache::call_as(int slot, Args &&... args) const noexcept {
+  return this->protected_call<T, detail::read_return_helper<T>>(
+    slot, std::forward<Args>(args)...);
+}
+
+} // end namespace primer
@@ -0,0 +1,299 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_hook_mux_overview
+/*`
+A lua thread has just one hook. `primer::hook_mux` shares it, so that e.g. the
+`sampling_profiler`, a `cpu_budget`, the budget of a `scheduler` and the count
+hook of a `vm_executor` can all be used at once.
+
+``
+  auto s = primer::hook_mux::subscribe(T, &on_sample, this, 0, 1000);
+  ...
+  primer::hook_mux::unsubscribe(T, *s);
+``
+
+A subscriber is a `void(lua_State *, lua_Debug *, void * ud)`, a mask of
+`LUA_MASKCALL`, `LUA_MASKRET` and `LUA_MASKLINE` events, and a `count`. It is
+called for the events in its mask, and once every `count` instructions, `0`
+meaning never. The hook which is installed on the thread has the union of the
+masks, and the smallest count which any subscriber is still waiting for, so
+it fires only as often as the most demanding subscriber needs, and not at all
+when there are none. A subscriber which wants a deadline, rather than a
+period, calls `set_count` from its callback, as `cpu_budget` does.
+
+The subscriptions belong to the state, and are dispatched on every thread
+which runs the hook: the thread named in `subscribe`, and the coroutines
+which it creates later, which inherit the hook from it. So the instructions
+of a coroutine count towards every subscriber.
+
+A callback may yield, if the thread is yieldable, and then the subscribers
+after it are not called for that event. It may also raise an error. The count
+of a subscriber may be late by up to one count of another when subscribers
+come and go, since the count which lua is running down starts again.
+
+A subscriber may also give a `std::atomic<bool>` flag. While it is set, the
+subscriber is called at every event, and the hook counts every instruction.
+Another thread, or a signal handler, sets the flag and then calls
+`hook_mux::interrupt(T)`, which installs a count hook of one instruction, as
+`lua_sethook` may be called asynchronously. So the subscriber runs at the
+next instruction of `T`, and the flag costs nothing while it isn't set.
+
+`subscribe` fails if the thread has a hook which was not installed by the
+multiplexer, which it would replace. The named thread must live until the
+subscription is removed.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/cpp_pcall.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/main_thread.hpp>
+
+#include <atomic>
+#include <new>
+#include <vector>
+
+namespace primer {
+
+class hook_mux {
+public:
+  using hook_t = void (*)(lua_State *, lua_Debug *, void *);
+  using subscription = int;
+
+private:
+  struct subscriber {
+    hook_t fn = nullptr; // nullptr if the slot is free
+    void * ud = nullptr;
+    lua_State * thread = nullptr;
+    int mask = 0;
+    int count = 0;
+    int remaining = 0;
+    bool due = false;
+    const std::atomic<bool> * flag = nullptr;
+
+    bool flagged() const noexcept {
+      return flag && flag->load(std::memory_order_acquire);
+    }
+  };
+
+  std::vector<subscriber> subs_;
+
+  hook_mux() = default;
+
+  static void * registry_key() noexcept {
+    static char key;
+    return &key;
+  }
+
+  static int gc(lua_State * L) {
+    static_cast<hook_mux *>(lua_touserdata(L, 1))->~hook_mux();
+    return 0;
+  }
+
+  static hook_mux * find(lua_State * L) noexcept {
+    lua_rawgetp(L, LUA_REGISTRYINDEX, registry_key());
+    auto m = static_cast<hook_mux *>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    return m;
+  }
+
+  // Note: Can cause lua memory allocation failure
+  static hook_mux * get(lua_State * L) {
+    if (hook_mux * m = find(L)) { return m; }
+    hook_mux * m = new (lua_newuserdata(L, sizeof(hook_mux))) hook_mux{};
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, &gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, registry_key());
+    return m;
+  }
+
+  static void dispatch(lua_State * L, lua_Debug * ar) {
+    if (hook_mux * m = find(L)) {
+      m->on_event(L, ar);
+    } else {
+      // The state is closing
+      lua_sethook(L, nullptr, 0, 0);
+    }
+  }
+
+  void on_event(lua_State * L, lua_Debug * ar) {
+    int bit;
+    switch (ar->event) {
+      case LUA_HOOKCOUNT: bit = LUA_MASKCOUNT; break;
+      case LUA_HOOKLINE: bit = LUA_MASKLINE; break;
+      case LUA_HOOKRET: bit = LUA_MASKRET; break;
+      default: bit = LUA_MASKCALL; break; // A call, or a tail call
+    }
+
+    bool any = false;
+    if (bit == LUA_MASKCOUNT) {
+      // The count of this thread is the number of instructions since it fired
+      const int elapsed = lua_gethookcount(L);
+      for (auto & s : subs_) {
+        s.due = false;
+        if (s.fn && s.count) {
+          s.remaining -= elapsed < s.remaining ? elapsed : s.remaining;
+          if (!s.remaining) {
+            s.due = any = true;
+            s.remaining = s.count;
+          }
+        }
+      }
+    } else {
+      for (auto & s : subs_) {
+        s.due = s.fn && (s.mask & bit);
+        any = any || s.due;
+      }
+    }
+    for (auto & s : subs_) {
+      if (s.fn && s.flagged()) { s.due = any = true; }
+    }
+
+    // First, in case a subscriber raises an error
+    this->reinstall(L);
+    if (!any) { return; }
+
+    // A callback may add subscribers, which can move `subs_`
+    for (std::size_t i = 0; i < subs_.size(); ++i) {
+      if (!subs_[i].due) { continue; }
+      subs_[i].due = false;
+      const hook_t fn = subs_[i].fn;
+      fn(L, ar, subs_[i].ud);
+      if (lua_status(L) == LUA_YIELD) { break; }
+    }
+    this->reinstall(L);
+  }
+
+  // The mask and count which the subscribers need
+  void wanted(int & mask, int & count) const noexcept {
+    mask = 0;
+    count = 0;
+    for (const auto & s : subs_) {
+      if (!s.fn) { continue; }
+      mask |= s.mask;
+      if (s.flagged()) {
+        count = 1;
+      } else if (s.count && (!count || s.remaining < count)) {
+        count = s.remaining;
+      }
+    }
+    if (count) { mask |= LUA_MASKCOUNT; }
+  }
+
+  void install(lua_State * T) const noexcept {
+    int mask, count;
+    this->wanted(mask, count);
+    lua_sethook(T, mask ? &dispatch : nullptr, mask, count);
+  }
+
+  // As `install`, but leaves the hook alone if it is already the one needed.
+  // `lua_sethook` restarts the count, and the remaining counts only go down
+  // at count events, so a call, return or line event must not restart it.
+  // After a count event, lua has restarted it by itself.
+  void reinstall(lua_State * T) const noexcept {
+    int mask, count;
+    this->wanted(mask, count);
+    if (lua_gethook(T) == (mask ? &dispatch : nullptr)
+        && lua_gethookmask(T) == mask && lua_gethookcount(T) == count) {
+      return;
+    }
+    lua_sethook(T, mask ? &dispatch : nullptr, mask, count);
+  }
+
+  subscriber * at(subscription id) noexcept {
+    if (id < 0 || static_cast<std::size_t>(id) >= subs_.size()) {
+      return nullptr;
+    }
+    subscriber & s = subs_[static_cast<std::size_t>(id)];
+    return s.fn ? &s : nullptr;
+  }
+
+public:
+  hook_mux(const hook_mux &) = delete;
+  hook_mux & operator=(const hook_mux &) = delete;
+
+  // Installs the hook on `T`, if it isn't there already. Fails if `T` has
+  // some other hook, or on memory allocation failure.
+  static expected<subscription>
+  subscribe(lua_State * T, hook_t fn, void * ud, int mask, int count,
+            const std::atomic<bool> * flag = nullptr) noexcept {
+    lua_Hook h = lua_gethook(T);
+    if (h && h != &dispatch) {
+      return primer::error{"the thread has a hook which is not shared"};
+    }
+
+    // `T` may be a suspended coroutine, which can't make a call
+    lua_State * M = primer::main_thread(T);
+    hook_mux * m = find(T);
+    if (!m) {
+      auto ok = primer::mem_pcall(M, [&m, M]() { m = get(M); });
+      if (!ok) { return ok.err(); }
+    }
+
+    subscriber s;
+    s.fn = fn;
+    s.ud = ud;
+    s.thread = T;
+    s.mask = mask & (LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE);
+    s.count = s.remaining = count > 0 ? count : 0;
+    s.flag = flag;
+
+    std::size_t id = 0;
+    while (id < m->subs_.size() && m->subs_[id].fn) {
+      ++id;
+    }
+    PRIMER_TRY_BAD_ALLOC {
+      if (id == m->subs_.size()) {
+        m->subs_.push_back(s);
+      } else {
+        m->subs_[id] = s;
+      }
+    }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+
+    m->install(T);
+    return static_cast<subscription>(id);
+  }
+
+  // Removes the subscriber, and the hook of its thread if it was the last
+  static void unsubscribe(lua_State * L, subscription id) noexcept {
+    hook_mux * m = find(L);
+    if (!m) { return; }
+    if (subscriber * s = m->at(id)) {
+      lua_State * T = s->thread;
+      *s = subscriber{};
+      m->install(T);
+    }
+  }
+
+  // Calls the subscriber after `count` more instructions, and every `count`
+  // instructions after that. `0` stops the calls.
+  static void set_count(lua_State * L, subscription id, int count) noexcept {
+    hook_mux * m = find(L);
+    if (!m) { return; }
+    if (subscriber * s = m->at(id)) {
+      s->count = s->remaining = count > 0 ? count : 0;
+      m->install(s->thread);
+    }
+  }
+
+  // Makes the hook of `T` run at its next instruction. May be called from any
+  // thread, or a signal handler, while `T` has a subscriber.
+  static void interrupt(lua_State * T) noexcept {
+    lua_sethook(T, &dispatch, LUA_MASKCOUNT, 1);
+  }
+};
+
+} // end namespace primer
@@ -0,0 +1,187 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Strings which C++ pushes very often, interned once in each state.
+ *
+ * `lua_pushstring` hashes the string and looks it up in the string table every
+ * time. The strings of an `interned_strings` table are put in an array, held
+ * by `push_singleton`, the first time one is used in a state, and after that,
+ * pushing one is a `lua_rawgeti` into the array. With PRIMER_REGISTRY_SLOTS,
+ * finding the array is a `lua_rawgeti` as well.
+ *
+ * The table is named by a type with a static function `names()`, which returns
+ * a reference to a `std::array` of `const char *`, that lives as long as the
+ * program:
+ *
+ *   struct event_names {
+ *     static const std::array<const char *, 3> & names() {
+ *       static const std::array<const char *, 3> n{{"spawn", "hit", "die"}};
+ *       return n;
+ *     }
+ *   };
+ *
+ * `interned_string<event_names>` is a handle to one of the strings, which can
+ * be pushed and read. `traits::interned_enum` pushes and reads an enum whose
+ * values are the positions of its labels in a table, as in
+ *
+ *   namespace primer { namespace traits {
+ *   template <>
+ *   struct push<event> : interned_enum<event, event_names> {};
+ *   template <>
+ *   struct read<event> : interned_enum<event, event_names> {};
+ *   }}
+ *
+ * The field names of visitable structures are interned in the same way.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/push.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/read.hpp>
+#include <primer/support/asserts.hpp>
+
+#include <array>
+#include <cstddef>
+
+namespace primer {
+
+//[ primer_interned_strings
+template <typename Table>
+struct interned_strings {
+  static std::size_t size() noexcept { return Table::names().size(); }
+
+  /*<< Pushes string `i`, which must be less than `size()` >>*/
+  static void push(lua_State * L, std::size_t i) {
+    PRIMER_ASSERT(i < size(), "Interned string index out of range");
+    push_singleton<&interned_strings::make_array>(L);
+    lua_rawgeti(L, -1, static_cast<lua_Integer>(i + 1));
+    lua_remove(L, -2);
+  }
+
+  /*<< The position of the value at `idx` among the strings, or `size()` if it
+       isn't one of them >>*/
+  static std::size_t find(lua_State * L, int idx) {
+    if (lua_type(L, idx) != LUA_TSTRING) { return size(); }
+    idx = lua_absindex(L, idx);
+    push_singleton<&interned_strings::make_positions>(L);
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    std::size_t result = size();
+    if (lua_isinteger(L, -1)) {
+      result = static_cast<std::size_t>(lua_tointeger(L, -1));
+    }
+    lua_pop(L, 2);
+    return result;
+  }
+
+  // Making the array, or the table of positions, and putting it in the
+  // registry, needs three
+  static constexpr int stack_space_needed{3};
+
+  //<-
+private:
+  static void make_array(lua_State * L) {
+    const auto & names = Table::names();
+    lua_createtable(L, static_cast<int>(names.size()), 0);
+    lua_Integer i = 0;
+    for (const char * name : names) {
+      lua_pushstring(L, name);
+      lua_rawseti(L, -2, ++i);
+    }
+  }
+
+  // Maps each string to its position, as used by `find`
+  static void make_positions(lua_State * L) {
+    const auto & names = Table::names();
+    lua_createtable(L, 0, static_cast<int>(names.size()));
+    lua_Integer i = 0;
+    for (const char * name : names) {
+      lua_pushstring(L, name);
+      lua_pushinteger(L, i++);
+      lua_rawset(L, -3);
+    }
+  }
+  //->
+};
+
+template <typename Table>
+class interned_string {
+  std::size_t index_;
+
+public:
+  explicit constexpr interned_string(std::size_t index) noexcept
+    : index_(index) {}
+
+  constexpr std::size_t index() const noexcept { return index_; }
+  const char * c_str() const noexcept { return Table::names()[index_]; }
+
+  void push(lua_State * L) const { interned_strings<Table>::push(L, index_); }
+};
+//]
+
+template <typename Table>
+constexpr bool
+operator==(const interned_string<Table> & a,
+           const interned_string<Table> & b) noexcept {
+  return a.index() == b.index();
+}
+
+template <typename Table>
+constexpr bool
+operator!=(const interned_string<Table> & a,
+           const interned_string<Table> & b) noexcept {
+  return a.index() != b.index();
+}
+
+namespace traits {
+
+template <typename Table>
+struct push<primer::interned_string<Table>> {
+  static void to_stack(lua_State * L, const interned_string<Table> & s) {
+    s.push(L);
+  }
+  static constexpr int stack_space_needed{
+    interned_strings<Table>::stack_space_needed};
+};
+
+template <typename Table>
+struct read<primer::interned_string<Table>> {
+  static expected<interned_string<Table>> from_stack(lua_State * L, int idx) {
+    const std::size_t i = interned_strings<Table>::find(L, idx);
+    if (i < interned_strings<Table>::size()) {
+      return interned_string<Table>{i};
+    }
+    return primer::arg_error(L, idx, "interned string");
+  }
+  static constexpr int stack_space_needed{
+    interned_strings<Table>::stack_space_needed};
+};
+
+// Pushes and reads an enum as the label at the position of its value
+template <typename E, typename Table>
+struct interned_enum {
+  static void to_stack(lua_State * L, E e) {
+    interned_strings<Table>::push(L, static_cast<std::size_t>(e));
+  }
+  static expected<E> from_stack(lua_State * L, int idx) {
+    const std::size_t i = interned_strings<Table>::find(L, idx);
+    if (i < interned_strings<Table>::size()) { return static_cast<E>(i); }
+    return primer::arg_error(L, idx, "enum label");
+  }
+  static constexpr int stack_space_needed{
+    interned_strings<Table>::stack_space_needed};
+};
+
+} // end namespace traits
+} // end namespace primer
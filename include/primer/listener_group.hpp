@@ -0,0 +1,205 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_listener_group_overview
+/*`
+A `primer::listener_group` is a list of lua functions which are all called
+with the same arguments, e.g. the subscribers to one event of an event bus.
+
+``
+  primer::listener_group on_hit{L};
+  auto id = on_hit.add(f);
+  ...
+  auto errors = on_hit.broadcast(target, damage);
+  ...
+  on_hit.remove(*id);
+``
+
+The functions are held in one table, behind one reference, rather than in a
+`bound_function` each. Dispatching locks the state once, makes one protected
+call, fetches the error handler once, and pushes the arguments once, and then
+calls each listener with copies of them. So a listener sees the same table
+argument as the others, and any changes they made to it.
+
+An error in one listener is captured, with the error handler, and the rest
+are still called. `broadcast` returns the errors, with the id of the listener
+which raised each, and `call_each` passes the results of every listener to a
+sink, as `bound_function::call_each` does.
+
+The listeners are called in the order of their ids. A listener may add and
+remove listeners while they are being called. One which is removed is not
+called after that, and one which is added may or may not be called by the
+dispatch which is running.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/bound_function.hpp>
+#include <primer/cpp_pcall.hpp>
+#include <primer/error.hpp>
+#include <primer/error_handler.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/push.hpp>
+#include <primer/support/function.hpp>
+#include <primer/support/function_check_stack.hpp>
+#include <primer/support/function_return.hpp>
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+class listener_group {
+public:
+  using listener_id = int;
+
+private:
+  lua_ref table_; // t[id] is the listener, or nil if it was removed
+  std::vector<listener_id> free_;
+  listener_id end_ = 0; // The largest id handed out
+  std::size_t size_ = 0;
+
+public:
+  listener_group() noexcept = default;
+
+  // Note: Can cause lua memory allocation failure
+  explicit listener_group(lua_State * L)
+    : table_() {
+    lua_newtable(L);
+    table_ = lua_ref{L};
+  }
+
+  listener_group(const listener_group &) = delete;
+  listener_group & operator=(const listener_group &) = delete;
+
+  std::size_t size() const noexcept { return size_; }
+  bool empty() const noexcept { return !size_; }
+
+  // The function must belong to the same state as the group
+  expected<listener_id> add(const bound_function & f) noexcept {
+    lua_State * L = table_.lock();
+    if (!L) { return primer::error::cant_lock_vm(); }
+    if (!f) { return primer::error{"can't add an empty function"}; }
+    auto stack_check = detail::check_stack_push_n(L, 2);
+    if (!stack_check) { return std::move(stack_check.err()); }
+
+    const listener_id id = free_.empty() ? end_ + 1 : free_.back();
+    auto ok = primer::mem_pcall(L, [this, L, &f, id]() {
+      table_.push(L);
+      f.push(L);
+      lua_rawseti(L, -2, id);
+      lua_pop(L, 1);
+    });
+    if (!ok) { return ok.err(); }
+
+    if (free_.empty()) {
+      ++end_;
+    } else {
+      free_.pop_back();
+    }
+    ++size_;
+    return id;
+  }
+
+  // Does nothing if there is no such listener
+  void remove(listener_id id) noexcept {
+    if (id < 1 || id > end_) { return; }
+    lua_State * L = table_.lock();
+    if (!L || !lua_checkstack(L, 2)) { return; }
+
+    table_.push(L);
+    lua_rawgeti(L, -1, id);
+    const bool present = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+    if (present) {
+      // The slot exists, so this doesn't allocate
+      lua_pushnil(L);
+      lua_rawseti(L, -2, id);
+      --size_;
+      // If the id can't be kept, it is never reused
+      PRIMER_TRY_BAD_ALLOC { free_.push_back(id); }
+      PRIMER_CATCH_BAD_ALLOC {}
+    }
+    lua_pop(L, 1);
+  }
+
+  // Calls each listener with the arguments, within a single protected
+  // context, and passes its id and its results, read as by
+  // `bound_function::call_as`, to `sink`. The returned error is for failures
+  // of the whole dispatch.
+  /*<< The sink is called within the protected context, so it must not throw
+       or raise lua errors, and it must leave the stack as it found it. >>*/
+  template <typename T = void, typename S, typename... Args>
+  expected<void> call_each(S && sink, Args &&... args) const noexcept {
+    using helper = detail::read_return_helper<T>;
+    constexpr int narg = sizeof...(Args);
+
+    expected<void> result{primer::error::cant_lock_vm()};
+    if (lua_State * L = table_.lock()) {
+      // Error handler, the table, the arguments, and a listener with a copy
+      // of each of them
+      if (auto stack_check = detail::check_stack_push_n(
+            L, primer::stack_space_for_push_each<int, int, int, Args...>()
+                 + narg)) {
+        auto ok = mem_pcall(L, [&]() {
+          primer::get_error_handler(L);
+          const int handler = lua_gettop(L);
+          table_.push(L);
+          primer::push_each(L, std::forward<Args>(args)...);
+          for (listener_id id = 1; id <= end_; ++id) {
+            lua_rawgeti(L, handler + 1, id);
+            if (lua_isnil(L, -1)) {
+              lua_pop(L, 1);
+              continue;
+            }
+            for (int i = 0; i < narg; ++i) {
+              lua_pushvalue(L, handler + 2 + i);
+            }
+            expected<T> r{primer::error::cant_lock_vm()};
+            detail::pinned_fcn_call<T, helper>(r, L, narg, handler);
+            sink(id, std::move(r));
+          }
+          lua_settop(L, handler - 1);
+        });
+        result = std::move(ok);
+      } else {
+        result = std::move(stack_check.err());
+      }
+    }
+    return result;
+  }
+
+  // Calls each listener with the arguments, and returns the errors which
+  // they raised
+  template <typename... Args>
+  expected<std::vector<std::pair<listener_id, primer::error>>>
+  broadcast(Args &&... args) const noexcept {
+    std::vector<std::pair<listener_id, primer::error>> errors;
+    PRIMER_TRY_BAD_ALLOC { errors.reserve(size_); }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+
+    auto ok = this->call_each(
+      [&errors](listener_id id, expected<void> r) {
+        if (r) { return; }
+        // Only listeners added while dispatching could need more space
+        PRIMER_TRY_BAD_ALLOC { errors.emplace_back(id, std::move(r.err())); }
+        PRIMER_CATCH_BAD_ALLOC {}
+      },
+      std::forward<Args>(args)...);
+    if (!ok) { return std::move(ok.err()); }
+    return errors;
+  }
+};
+
+} // end namespace primer
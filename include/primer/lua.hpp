@@ -7,6 +7,9 @@
 
 /***
  * Include lua headers as C or C++ depending on a macro
+ *
+ * Also, a few functions over the parts of the lua API which differ between
+ * lua 5.3 and lua 5.4.
  */
 
 #include <primer/base.hpp>
@@ -28,3 +31,75 @@ extern "C" {
 #include <lualib.h>
 
 #endif
+
+#if LUA_VERSION_NUM < 503
+#error "Primer requires lua 5.3 or later"
+#endif
+
+#include <cstddef>
+
+namespace primer {
+namespace detail {
+
+// A userdata with `nuvalue` user values. In lua 5.3 there is always one.
+inline void *
+newuserdata(lua_State * L, std::size_t size, int nuvalue) {
+#if LUA_VERSION_NUM >= 504
+  return lua_newuserdatauv(L, size, nuvalue);
+#else
+  static_cast<void>(nuvalue);
+  return lua_newuserdata(L, size);
+#endif
+}
+
+// `lua_resume`, giving also the number of values which were returned or
+// yielded, which are on top of the stack of `L`
+inline int
+resume(lua_State * L, lua_State * from, int narg, int * nres) {
+#if LUA_VERSION_NUM >= 504
+  return lua_resume(L, from, narg, nres);
+#else
+  // A suspended thread's values are replaced on resume, so then the results
+  // start at the bottom of the stack, and otherwise where the function was.
+  const int start = (lua_status(L) == LUA_YIELD) ? 1 : lua_gettop(L) - narg;
+  const int code = lua_resume(L, from, narg);
+  *nres =
+    (code == LUA_OK || code == LUA_YIELD) ? lua_gettop(L) - start + 1 : 0;
+  return code;
+#endif
+}
+
+// Whether a thread which is dead, because of an error, can be reset to be
+// used again. Only lua 5.4 can do it.
+constexpr bool
+can_reset_thread() {
+#if LUA_VERSION_NUM >= 504
+  return true;
+#else
+  return false;
+#endif
+}
+
+// Reset a thread, closing its pending to-be-closed variables, and leaving it
+// with status `LUA_OK` and an empty stack. Returns the status of the thread
+// before, or of an error while closing. In lua 5.3 this only works for a
+// thread which is not dead, and then just clears the stack.
+inline int
+reset_thread(lua_State * T, lua_State * from) {
+#if LUA_VERSION_NUM >= 504
+#if LUA_VERSION_RELEASE_NUM >= 50406
+  return lua_closethread(T, from);
+#else
+  static_cast<void>(from);
+  return lua_resetthread(T);
+#endif
+#else
+  static_cast<void>(from);
+  const int code = lua_status(T);
+  if (code == LUA_OK) { lua_settop(T, 0); }
+  return code;
+#endif
+}
+
+} // end namespace detail
+} // end namespace primer
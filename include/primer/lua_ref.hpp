@@ -17,14 +17,22 @@ PRIMER_ASSERT_FILESCOPE;
 #include <primer/error.hpp>
 #include <primer/expected.hpp>
 #include <primer/lua.hpp>
+#include <primer/lua_ref_pool.hpp>
+#include <primer/push_singleton.hpp>
 
 #include <primer/support/asserts.hpp>
+#include <primer/support/internal_stats.hpp>
 #include <primer/support/lua_state_ref.hpp>
+#include <primer/support/ref_tracking.hpp>
 
 #ifdef PRIMER_NO_EXCEPTIONS
 #include <cstdlib> // for std::abort
 #endif
 
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <new>
 #include <utility>
 
@@ -35,23 +43,90 @@ class lua_ref {
   /*<< A weak reference to a lua state.
        See `<primer/support/lua_state_ref.hpp>` for details. >>*/
   lua_state_ref sref_;
-  /*<< Holds the registry index to the object. Mutable because, if `sref_`
+  /*<< The pool which holds the object, or nullptr if it is held directly in
+       the registry. >>*/
+  detail::ref_pool * pool_ = nullptr;
+  /*<< Holds the registry (or pool) index to the object. Mutable because, if `sref_`
        becomes empty, we want to set `iref_` to `LUA_NOREF` immediately. >>*/
   mutable int iref_ = LUA_NOREF;
+  /*<< The identity of the object, captured when it is bound, so that refs can
+       be compared and hashed without the VM. See `identity_hash`. >>*/
+  signed char kind_ = LUA_TNONE;
+  /*<< The epoch of the `ref_scope` which holds the object, or 0. >>*/
+  std::uint16_t epoch_ = 0;
+  std::uint64_t id_ = 0;
+  /*<< The state which held the object, see `lua_state_ref::identity`. Kept
+       after the state is gone, unlike `sref_`. >>*/
+  const void * vm_ = nullptr;
 
   //<-
 
+  // A float which isn't an integer has its own kind, since its bits are
+  // stored rather than its value.
+  static constexpr signed char float_kind() noexcept { return -2; }
+
+  // A NaN isn't equal to anything, as for `lua_rawequal`
+  bool is_nan() const noexcept {
+    if (kind_ != float_kind()) { return false; }
+    double d;
+    std::memcpy(&d, &id_, sizeof(d));
+    return d != d;
+  }
+
+  // Capture the identity of the value on top of the stack
+  void capture_identity(lua_State * L) noexcept {
+    kind_ = static_cast<signed char>(lua_type(L, -1));
+    id_ = 0;
+    switch (kind_) {
+      case LUA_TBOOLEAN:
+        id_ = lua_toboolean(L, -1);
+        break;
+      case LUA_TNUMBER: {
+        int isint = 0;
+        lua_Integer i = lua_tointegerx(L, -1, &isint);
+        if (isint) {
+          id_ = static_cast<std::uint64_t>(i);
+        } else {
+          double d = static_cast<double>(lua_tonumber(L, -1));
+          std::memcpy(&id_, &d, sizeof(d));
+          kind_ = float_kind();
+        }
+        break;
+      }
+      // Short strings are interned, so the address of the characters is the
+      // identity of the content. Long strings are compared by identity.
+      case LUA_TSTRING:
+        id_ = reinterpret_cast<std::uintptr_t>(lua_tostring(L, -1));
+        break;
+      case LUA_TNIL:
+        break;
+      default:
+        id_ = reinterpret_cast<std::uintptr_t>(lua_topointer(L, -1));
+        break;
+    }
+  }
+
   // Set to empty / disengaged state
   void set_empty() noexcept {
     sref_.reset();
+    pool_ = nullptr;
     iref_ = LUA_NOREF;
+    kind_ = LUA_TNONE;
+    epoch_ = 0;
+    id_ = 0;
+    vm_ = nullptr;
   }
 
   // Check if we are engaged, and return lua_State * to our state if we are.
+  // A ref of a scope which has ended is empty. Its pool is only looked at
+  // while the state is alive.
   lua_State * check_engaged() const noexcept {
     if (iref_ != LUA_NOREF) {
       lua_State * result = sref_.lock();
-      if (!result) { iref_ = LUA_NOREF; }
+      if (!result || (epoch_ && pool_->epoch != epoch_)) {
+        iref_ = LUA_NOREF;
+        return nullptr;
+      }
       return result;
     }
     return nullptr;
@@ -61,26 +136,68 @@ class lua_ref {
   // Note: Memory allocation failure can occur in luaL_ref, or in
   // obtain_state_ref
   // Doesn't throw exceptions
-  void init(lua_State * L) {
+  // `site` is given to the ref tracker, see <primer/support/ref_tracking.hpp>
+  void init(lua_State * L, const void * site) {
     if (L) {
       if (lua_gettop(L)) {
-        sref_ = primer::obtain_state_ref(L);
-        if (sref_) {
-          iref_ = luaL_ref(L, LUA_REGISTRYINDEX);
-          return;
-        }
+        lua_state_ref sref = primer::obtain_state_ref(L);
+        detail::ref_pool * scope = detail::find_ref_scope(sref);
+        this->init(L, sref, scope, site);
+        return;
       }
     }
 
     this->set_empty();
   }
 
+  // As above, but with a state ref (and pool) which are already known.
+  // The state ref must refer to the state of L.
+  void init(lua_State * L, const lua_state_ref & sref, detail::ref_pool * pool,
+            const void * site) {
+    if (L && lua_gettop(L) && sref) {
+      this->capture_identity(L);
+      if (pool) {
+        iref_ = pool->acquire(L);
+      } else {
+        iref_ = luaL_ref(L, LUA_REGISTRYINDEX);
+        PRIMER_INTERNAL_COUNT(L, registry_refs);
+      }
+      sref_ = sref;
+      vm_ = sref.identity();
+      pool_ = pool;
+      epoch_ = pool ? pool->epoch : 0;
+      detail::ref_tracking_created(L, pool, iref_, site);
+      return;
+    }
+
+    this->set_empty();
+  }
+
   // Release the *ref* but not the lua state ref necessarily.
 
   // Release the ref if we are in an engaged state. Ends in empty state.
+  // Off the owner thread of a thread-safe state ref, the slot is queued for the
+  // owner instead.
   void release() noexcept {
+    // The slots of a scope are released with it, from any thread
+    if (epoch_) {
+      this->set_empty();
+      return;
+    }
+#ifdef PRIMER_THREAD_SAFE_STATE_REFS
+    if (iref_ != LUA_NOREF && !sref_.on_owner_thread()) {
+      sref_.defer_unref(iref_, pool_);
+      this->set_empty();
+      return;
+    }
+#endif
     if (lua_State * L = this->check_engaged()) {
-      luaL_unref(L, LUA_REGISTRYINDEX, iref_);
+      detail::ref_tracking_released(L, pool_, iref_);
+      if (pool_) {
+        pool_->release(L, iref_);
+      } else {
+        luaL_unref(L, LUA_REGISTRYINDEX, iref_);
+      }
     }
     this->set_empty();
   }
@@ -88,7 +205,12 @@ class lua_ref {
   // Pilfer the resources of another `lua_ref`.
   void move(lua_ref & other) noexcept {
     sref_ = std::move(other.sref_);
+    pool_ = other.pool_;
     iref_ = other.iref_;
+    kind_ = other.kind_;
+    epoch_ = other.epoch_;
+    id_ = other.id_;
+    vm_ = other.vm_;
     other.iref_ = LUA_NOREF;
     other.set_empty();
   }
@@ -114,10 +236,24 @@ Note: This can cause a lua memory allocation failure, but it doesn't throw
   >>*/
   explicit lua_ref(lua_State * L);
 
+  // Pooled constructor
+  /*<< As above, but stores the object in the given pool rather than in the
+       registry. `L` must be a thread of the state that the pool belongs to.
+       If the pool is empty, enters the empty state. >>*/
+  lua_ref(const lua_ref_pool & pool, lua_State * L);
+
   // Reset to empty state
   /*<< Releases the lua reference, reverts to empty state. >>*/
   void reset() noexcept;
 
+  // Outlive the scope
+  /*<< If the ref was made in a `ref_scope`, moves the object to the registry,
+       so that it is kept when the scope ends. Otherwise, does nothing.
+
+Note: This can cause a lua memory allocation failure, as the primary
+  constructor. >>*/
+  void promote();
+
   // Standard swap function
   void swap(lua_ref & other) noexcept;
 
@@ -130,7 +266,8 @@ Note: This can cause a lua memory allocation failure, but it doesn't throw
 
   // Push to the main stack
   // Return value is same as lock()
-  /*<< Note: Does not check for stack space
+  /*<< Note: Does not check for stack space. A pooled ref uses two slots
+temporarily.
 
 This cannot cause lua memory allocation error.>>*/
   lua_State * push() const noexcept;
@@ -167,6 +304,30 @@ check.
   >>*/
   template <typename T>
   expected<T> as() const noexcept;
+
+  // Identity
+  /*<< Two refs are equal if they were bound in the same VM to the same lua
+       object, or to equal numbers, booleans, or short strings, or if both are
+       empty. This never touches the VM, so refs can be keys of
+       `std::unordered_set`, `std::set`, and so on.
+
+Long strings (over 40 bytes) are compared by identity rather than by content,
+unlike `lua_rawequal`. The identity is kept if the VM is destroyed, and refs
+from different VMs are never equal. As for `lua_rawequal`, a ref to NaN is
+equal to no ref, not even itself, so it can't be found in a hashed container.
+`operator<` orders NaNs by their bits. >>*/
+  std::size_t identity_hash() const noexcept;
+  friend bool operator==(const lua_ref & a, const lua_ref & b) noexcept {
+    return a.kind_ == b.kind_ && a.id_ == b.id_ && a.vm_ == b.vm_
+           && !a.is_nan();
+  }
+  friend bool operator!=(const lua_ref & a, const lua_ref & b) noexcept {
+    return !(a == b);
+  }
+  friend bool operator<(const lua_ref & a, const lua_ref & b) noexcept {
+    if (a.vm_ != b.vm_) { return std::less<const void *>{}(a.vm_, b.vm_); }
+    return a.kind_ < b.kind_ || (a.kind_ == b.kind_ && a.id_ < b.id_);
+  }
 };
 //]
 
@@ -179,7 +340,15 @@ check.
 // Note: Decided that it's acceptable for this to raise a lua error, since you
 // are explicitly manipulating a lua_State * and there is no possible leak.
 // It does not throw std::bad_alloc, that gets translated to a lua error.
-inline lua_ref::lua_ref(lua_State * L) { this->init(L); }
+// With PRIMER_REF_TRACKING, the constructors which bind aren't inlined, so
+// that their return address is the site which made the ref.
+PRIMER_REF_SITE_NOINLINE
+inline lua_ref::lua_ref(lua_State * L) { this->init(L, PRIMER_REF_SITE()); }
+
+PRIMER_REF_SITE_NOINLINE
+inline lua_ref::lua_ref(const lua_ref_pool & pool, lua_State * L) {
+  this->init(L, pool.sref_, pool.pool_, PRIMER_REF_SITE());
+}
 
 inline lua_ref::lua_ref(lua_ref && other) noexcept { this->move(other); }
 
@@ -188,10 +357,13 @@ inline lua_ref::lua_ref(lua_ref && other) noexcept { this->move(other); }
 //       allocation failure, and it's really not very practical to require the
 //       user to create a protected context for any, accidental, copy.
 
+PRIMER_REF_SITE_NOINLINE
 inline lua_ref::lua_ref(const lua_ref & other)
   : lua_ref() {
   if (lua_State * L = other.lock()) {
-    if (!lua_checkstack(L, 1)) {
+    const void * site = PRIMER_REF_SITE();
+    // The value, and for a pooled ref, the pool table and a free list link.
+    if (!lua_checkstack(L, 3)) {
       PRIMER_CTOR_FAIL("lua_ref copy ctor: out of lua stack space");
     }
     if (!other.push(L)) {
@@ -201,8 +373,11 @@ inline lua_ref::lua_ref(const lua_ref & other)
       return;
     }
 
-    // Protect against memory failure in `luaL_ref`.
-    auto ok = primer::mem_pcall<1>(L, [this, L]() { this->init(L); });
+    // Protect against memory failure in `luaL_ref`. The copy shares the state
+    // ref and pool of the original, so they need not be looked up again.
+    auto ok = primer::mem_pcall<1>(L, [this, L, &other, site]() {
+      this->init(L, other.sref_, other.pool_, site);
+    });
     if (!ok) { PRIMER_CTOR_FAIL("lua_ref copy ctor: bad_alloc"); }
   }
 }
@@ -230,10 +405,27 @@ lua_ref::reset() noexcept {
   this->release();
 }
 
+PRIMER_REF_SITE_NOINLINE
+inline void
+lua_ref::promote() {
+  if (!epoch_) { return; }
+  if (lua_State * L = this->push()) {
+    const void * site = PRIMER_REF_SITE();
+    lua_state_ref sref = sref_;
+    this->set_empty();
+    this->init(L, sref, nullptr, site);
+  }
+}
+
 inline void
 lua_ref::swap(lua_ref & other) noexcept {
   sref_.swap(other.sref_);
+  std::swap(pool_, other.pool_);
   std::swap(iref_, other.iref_);
+  std::swap(kind_, other.kind_);
+  std::swap(epoch_, other.epoch_);
+  std::swap(id_, other.id_);
+  std::swap(vm_, other.vm_);
 }
 
 inline lua_State *
@@ -244,7 +436,11 @@ lua_ref::lock() const noexcept {
 inline lua_State *
 lua_ref::push() const noexcept {
   if (lua_State * L = this->check_engaged()) {
-    lua_rawgeti(L, LUA_REGISTRYINDEX, iref_);
+    if (pool_) {
+      pool_->push(L, iref_);
+    } else {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, iref_);
+    }
     return L;
   }
   return nullptr;
@@ -259,7 +455,11 @@ lua_ref::push(lua_State * T) const noexcept {
 #else
     static_cast<void>(L); // suppress unused warning
 #endif
-    lua_rawgeti(T, LUA_REGISTRYINDEX, iref_);
+    if (pool_) {
+      pool_->push(T, iref_);
+    } else {
+      lua_rawgeti(T, LUA_REGISTRYINDEX, iref_);
+    }
     return true;
   } else {
     // Even if we are empty, T exists, and expects a value, so push nil.
@@ -268,6 +468,17 @@ lua_ref::push(lua_State * T) const noexcept {
   }
 }
 
+inline std::size_t
+lua_ref::identity_hash() const noexcept {
+  // Mix the bits, since pointers have zeros at the bottom
+  std::uint64_t h = id_ ^ (static_cast<std::uint64_t>(kind_ + 2) << 59)
+                    ^ reinterpret_cast<std::uintptr_t>(vm_);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return static_cast<std::size_t>(h);
+}
+
 inline lua_ref::operator bool() const noexcept {
   return static_cast<bool>(this->check_engaged());
 }
@@ -277,4 +488,88 @@ swap(lua_ref & one, lua_ref & other) noexcept {
   one.swap(other);
 }
 
+/***
+ * Unrefs the slots which `lua_ref` objects released on other threads, and
+ * returns how many there were. This must be called on the thread which owns
+ * the state, and makes it the owner.
+ *
+ * Only does anything if PRIMER_THREAD_SAFE_STATE_REFS is defined. Doesn't
+ * allocate, and does nothing if the stack has no room for two values.
+ */
+inline std::size_t
+release_deferred_refs(lua_State * L) noexcept {
+  std::size_t count = 0;
+#ifdef PRIMER_THREAD_SAFE_STATE_REFS
+  if (!lua_checkstack(L, 2)) { return 0; }
+  detail::deferred_unref * list = lua_state_ref::take_deferred_unrefs(L);
+  for (auto node = list; node; node = node->next) {
+    detail::ref_tracking_released(L, node->pool, node->iref);
+    if (node->pool) {
+      node->pool->release(L, node->iref);
+    } else {
+      luaL_unref(L, LUA_REGISTRYINDEX, node->iref);
+    }
+    ++count;
+  }
+  detail::deferred_unref_queue::free_list(list);
+#else
+  static_cast<void>(L);
+#endif
+  return count;
+}
+
+namespace detail {
+
+int deferred_refs_sentinel_gc(lua_State * L);
+
+inline void
+deferred_refs_sentinel_metatable(lua_State * L) {
+  lua_newtable(L);
+  lua_pushcfunction(L, &deferred_refs_sentinel_gc);
+  lua_setfield(L, -2, "__gc");
+}
+
+// Makes a garbage object, which is finalized at the end of the next cycle
+inline int
+make_deferred_refs_sentinel(lua_State * L) {
+  lua_newuserdata(L, 0);
+  primer::push_singleton<&deferred_refs_sentinel_metatable>(L);
+  lua_setmetatable(L, -2);
+  lua_pop(L, 1);
+  return 0;
+}
+
+inline int
+deferred_refs_sentinel_gc(lua_State * L) {
+  primer::release_deferred_refs(L);
+  // An error here would be raised by whatever triggered the collection, so
+  // if the next sentinel can't be made, stop.
+  lua_pushcfunction(L, &make_deferred_refs_sentinel);
+  lua_pcall(L, 0, 0, 0);
+  return 0;
+}
+
+} // end namespace detail
+
+/***
+ * Calls `release_deferred_refs` at the end of each garbage collection cycle,
+ * from now on. The collector must run on the owner thread.
+ * May raise a lua error if memory fails.
+ */
+inline void
+release_deferred_refs_on_gc(lua_State * L) {
+  detail::make_deferred_refs_sentinel(L);
+}
+
 } // end namespace primer
+
+namespace std {
+
+template <>
+struct hash<primer::lua_ref> {
+  std::size_t operator()(const primer::lua_ref & r) const noexcept {
+    return r.identity_hash();
+  }
+};
+
+} // end namespace std
@@ -0,0 +1,177 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A lua_ref_pool is a handle to a per-state pool of reference slots, which
+ * `lua_ref` can use instead of the registry.
+ *
+ * `luaL_ref` keeps its free list at key 0 of the registry, which lives in the
+ * hash part, and constructing a `lua_ref` from a `lua_State *` also looks up
+ * the state's strong pointer in the registry. When many refs are churned, this
+ * adds up.
+ *
+ * The pool is a single table, held at an integer index of the registry, with
+ * a range of slots linked into a free list up front. The head of the free list
+ * is kept in C++. So acquiring or releasing a slot is a store into the array
+ * part of that table, and pushing is two array loads.
+ *
+ * The handle caches the pool and the weak state ref, so obtain it once (this
+ * may raise a lua error on memory failure), and then construct refs with
+ * `lua_ref{pool, L}`. Copies of a pooled ref use the same pool.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/lua_state_ref.hpp>
+
+#include <cstdint>
+#include <new>
+
+namespace primer {
+
+class lua_ref;
+
+namespace detail {
+
+// Lives in a userdata, anchored in the registry. Trivially destructible, so
+// it needs no __gc.
+//
+// The pool of a `ref_scope` has an epoch, which is not 0, and which its refs
+// keep. Its table is made by the first ref, and dropped with all the slots
+// when the scope ends, which starts the next epoch.
+struct ref_pool {
+  int table_ref;        // Registry index of the slot table
+  int free_head;        // First free slot, or 0 if none
+  int size;             // Number of slots in the table
+  std::uint16_t epoch;  // Of a scope, or 0
+  ref_pool * next_free; // Pools of scopes which aren't in use
+
+  static constexpr int initial_size = 64;
+
+  void push_table(lua_State * L) const noexcept {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, table_ref);
+  }
+
+  // Pops a value from the top of the stack and stores it in a slot.
+  // May raise a lua error if the table must grow and memory fails.
+  int acquire(lua_State * L) {
+    PRIMER_ASSERT(lua_gettop(L), "nothing to acquire");
+    if (table_ref == LUA_NOREF) {
+      lua_createtable(L, initial_size, 0);
+      table_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    push_table(L);
+    lua_insert(L, -2);
+    int slot;
+    if (free_head) {
+      slot = free_head;
+      lua_rawgeti(L, -2, slot);
+      free_head = static_cast<int>(lua_tointeger(L, -1));
+      lua_pop(L, 1);
+      lua_rawseti(L, -2, slot);
+    } else {
+      slot = size + 1;
+      lua_rawseti(L, -2, slot);
+      size = slot;
+    }
+    lua_pop(L, 1);
+    return slot;
+  }
+
+  // The slot is in the array part already, so this doesn't allocate.
+  void release(lua_State * L, int slot) noexcept {
+    push_table(L);
+    lua_pushinteger(L, free_head);
+    lua_rawseti(L, -2, slot);
+    lua_pop(L, 1);
+    free_head = slot;
+  }
+
+  void push(lua_State * L, int slot) const noexcept {
+    push_table(L);
+    lua_rawgeti(L, -1, slot);
+    lua_remove(L, -2);
+  }
+
+  static void make(lua_State * L) {
+    ref_pool * p = new (lua_newuserdata(L, sizeof(ref_pool))) ref_pool{};
+    lua_createtable(L, initial_size, 0);
+    for (int i = 1; i <= initial_size; ++i) {
+      lua_pushinteger(L, i < initial_size ? i + 1 : 0);
+      lua_rawseti(L, -2, i);
+    }
+    p->table_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    p->free_head = 1;
+    p->size = initial_size;
+  }
+
+  static ref_pool * get(lua_State * L) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    primer::push_singleton<&ref_pool::make>(L);
+    void * result = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    PRIMER_ASSERT(result, "Failed to obtain lua_ref pool");
+    return static_cast<ref_pool *>(result);
+  }
+};
+
+// The `ref_scope` objects which are active on this thread, innermost first.
+// A ref made from a `lua_State *` goes to the innermost scope of its state.
+struct ref_scope_frame {
+  lua_State * main;
+  ref_pool * pool;
+  ref_scope_frame * prev;
+};
+
+inline ref_scope_frame *&
+ref_scope_top() noexcept {
+  static thread_local ref_scope_frame * top = nullptr;
+  return top;
+}
+
+inline ref_pool *
+find_ref_scope(const lua_state_ref & sref) noexcept {
+  ref_scope_frame * f = ref_scope_top();
+  if (!f) { return nullptr; }
+  lua_State * main = sref.lock();
+  for (; f; f = f->prev) {
+    if (f->main == main) { return f->pool; }
+  }
+  return nullptr;
+}
+
+} // end namespace detail
+
+//[ primer_lua_ref_pool
+class lua_ref_pool {
+  lua_state_ref sref_;
+  detail::ref_pool * pool_ = nullptr;
+
+  friend class lua_ref;
+
+public:
+  lua_ref_pool() noexcept = default;
+
+  /*<< Obtains the pool of the given lua state, creating it if necessary.
+       This may raise a lua error on memory allocation failure. >>*/
+  explicit lua_ref_pool(lua_State * L)
+    : sref_(primer::obtain_state_ref(L))
+    , pool_(detail::ref_pool::get(L)) {}
+
+  // The main thread of the lua state, or nullptr if it is gone
+  lua_State * lock() const noexcept { return pool_ ? sref_.lock() : nullptr; }
+
+  explicit operator bool() const noexcept { return this->lock(); }
+};
+//]
+
+} // end namespace primer
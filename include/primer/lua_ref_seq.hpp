@@ -10,26 +10,41 @@
  * say "take all the elements on this stack and put them on that stack". Or, to
  * transfer the results of a lua function call that returns multiple elements to
  * C++ comfortably.
+ *
+ * The first few refs are held inline, so that calls which return only a few
+ * values don't allocate for the sequence.
  */
 
 #include <primer/base.hpp>
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <primer/detail/small_vector.hpp>
 #include <primer/lua.hpp>
 #include <primer/lua_ref.hpp>
 
+#include <cstddef>
 #include <type_traits>
 #include <utility>
-#include <vector>
 
 namespace primer {
 
 //[ lua_ref_seq_synopsis
-struct lua_ref_seq {
-  using refs_t = std::vector<lua_ref>;
+class lua_ref_seq {
+public:
+  /*<< A `std::vector`-like container, with room for four refs inline >>*/
+  using refs_t = detail::small_vector<lua_ref, 4>;
+
+private:
   refs_t refs_;
 
+public:
+  /*<< The underlying container. Its type is an implementation detail, which
+was `std::vector<lua_ref>` before, so code which needs a `std::vector` should
+copy the refs out of it. >>*/
+  refs_t & refs() noexcept { return refs_; }
+  const refs_t & refs() const noexcept { return refs_; }
+
   /*<< Push all the refs onto the stack in succession.
 Return of `true` means every push succeeded.
 You can usually ignore the result, it only fails if some of the refs in the
@@ -47,10 +62,12 @@ See `lua_ref`. >>*/
   }
 
   //
-  // Forward MANY methods from std::vector...
+  // Forward MANY methods from the container...
   //
 
   std::size_t size() const { return refs_.size(); }
+  bool empty() const { return refs_.empty(); }
+  std::size_t capacity() const { return refs_.capacity(); }
 
   using value_type = refs_t::value_type;
   using reference = refs_t::reference;
@@ -0,0 +1,290 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A matrix is a sequence of rows of equal length, stored contiguously in one
+ * allocation, in row-major order.
+ *
+ * In lua, it is a table of rows, each of which is a table, like
+ *
+ *   { {1, 2, 3}, {4, 5, 6} }
+ *
+ * Reading one takes the number of columns from the first row, allocates
+ * once, and then checks the length of each row as its elements are read, so
+ * the table is traversed a single time. Reading `std::vector<std::vector<T>>`
+ * instead would allocate once per row. An empty table is a matrix with no rows.
+ *
+ * Numeric elements are converted inline, like the elements of a
+ * `std::vector` of numbers, without constructing an `expected` for each one.
+ *
+ * If `traits::use_typed_array<matrix<T>>` is specialized to be true, each row
+ * is pushed as a `primer::typed_array<T>`, and reading accepts rows which are
+ * typed arrays as well as tables.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/container/seq_base.hpp>
+#include <primer/detail/max_int.hpp>
+#include <primer/detail/type_traits.hpp>
+#include <primer/error.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/alloc_scope.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/traits/push.hpp>
+#include <primer/traits/read.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <primer/traits/typed_array.hpp>
+#include <primer/typed_array.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+//[ primer_matrix
+template <typename T>
+class matrix {
+  std::vector<T> data_;
+  std::size_t rows_ = 0;
+  std::size_t cols_ = 0;
+
+public:
+  matrix() noexcept = default;
+
+  /*<< May throw `std::bad_alloc` >>*/
+  matrix(std::size_t rows, std::size_t cols)
+    : data_(rows * cols)
+    , rows_(rows)
+    , cols_(cols) {}
+
+  std::size_t rows() const noexcept { return rows_; }
+  std::size_t cols() const noexcept { return cols_; }
+  std::size_t size() const noexcept { return data_.size(); }
+  bool empty() const noexcept { return !rows_; }
+
+  // All of the elements, row after row
+  T * data() noexcept { return data_.data(); }
+  const T * data() const noexcept { return data_.data(); }
+
+  // The `cols()` elements of row `r`
+  T * row(std::size_t r) noexcept { return data_.data() + r * cols_; }
+  const T * row(std::size_t r) const noexcept {
+    return data_.data() + r * cols_;
+  }
+
+  T & operator()(std::size_t r, std::size_t c) noexcept {
+    return data_[r * cols_ + c];
+  }
+  const T & operator()(std::size_t r, std::size_t c) const noexcept {
+    return data_[r * cols_ + c];
+  }
+};
+
+template <typename T>
+bool
+operator==(const matrix<T> & a, const matrix<T> & b) {
+  if (a.rows() != b.rows() || a.cols() != b.cols()) { return false; }
+  for (std::size_t i = 0; i < a.size(); ++i) {
+    if (!(a.data()[i] == b.data()[i])) { return false; }
+  }
+  return true;
+}
+
+template <typename T>
+bool
+operator!=(const matrix<T> & a, const matrix<T> & b) {
+  return !(a == b);
+}
+//]
+
+namespace detail {
+
+// How to read one element, inline for numbers
+template <typename T, typename ENABLE = void>
+struct matrix_elem_reader {
+  static expected<void> from_stack(lua_State * L, int idx, T & out) {
+    auto object = traits::read<T>::from_stack(L, idx);
+    if (!object) { return std::move(object.err()); }
+    out = std::move(*object);
+    return {};
+  }
+};
+
+template <typename T>
+struct matrix_elem_reader<
+  T, enable_if_t<std::is_same<decltype(container::arithmetic_read_helper<
+                                       T>::from_stack),
+                              decltype(container::arithmetic_read_helper<
+                                       T>::from_stack)>::value>> {
+  static expected<void> from_stack(lua_State * L, int idx, T & out) {
+    if (container::arithmetic_read_helper<T>::from_stack(L, idx, out)) {
+      return {};
+    }
+    auto object = traits::read<T>::from_stack(L, idx);
+    if (!object) { return std::move(object.err()); }
+    out = *object;
+    return {};
+  }
+};
+
+// How to push and read a row, as a table, or also as a typed array
+template <typename T, bool typed = traits::use_typed_array<matrix<T>>::value>
+struct matrix_row {
+  static void to_stack(lua_State * L, const T * row, std::size_t n) {
+    lua_createtable(L, static_cast<int>(n), 0);
+    for (std::size_t j = 0; j < n; ++j) {
+      traits::push<T>::to_stack(L, row[j]);
+      lua_rawseti(L, -2, static_cast<LUA_INTEGER>(j + 1));
+    }
+  }
+
+  static constexpr int push_space{1 + traits::push<T>::stack_space_needed};
+
+  // Length of the row at `idx`, or a negative number if it is not one
+  static long length(lua_State * L, int idx) {
+    if (!lua_istable(L, idx)) { return -1; }
+    return static_cast<long>(lua_rawlen(L, idx));
+  }
+
+  static expected<void> into(lua_State * L, int idx, T * out, std::size_t n) {
+    expected<void> result;
+    for (std::size_t j = 0; j < n; ++j) {
+      lua_rawgeti(L, idx, static_cast<LUA_INTEGER>(j + 1));
+      result = matrix_elem_reader<T>::from_stack(L, -1, out[j]);
+      lua_pop(L, 1);
+      if (!result) {
+        result.err().prepend_error_line("In index [", j + 1, "],");
+        break;
+      }
+    }
+    return result;
+  }
+
+  static constexpr const char * expected_type() { return "table"; }
+
+  static constexpr int read_space{1 + traits::read<T>::stack_space_needed};
+};
+
+template <typename T>
+struct matrix_row<T, true> : matrix_row<T, false> {
+  using base = matrix_row<T, false>;
+
+  static void to_stack(lua_State * L, const T * row, std::size_t n) {
+    primer::push_typed_array<T>(L, row, n);
+  }
+
+  // userdata, metatable, and a metamethod while populating the metatable
+  static constexpr int push_space{3};
+
+  static long length(lua_State * L, int idx) {
+    if (const auto * a = primer::test_udata<typed_array<T>>(L, idx)) {
+      return static_cast<long>(a->size());
+    }
+    return base::length(L, idx);
+  }
+
+  static expected<void> into(lua_State * L, int idx, T * out, std::size_t n) {
+    if (const auto * a = primer::test_udata<typed_array<T>>(L, idx)) {
+      std::memcpy(out, a->data(), n * sizeof(T));
+      return {};
+    }
+    return base::into(L, idx, out, n);
+  }
+
+  static constexpr const char * expected_type() {
+    return "table or typed array";
+  }
+
+  static constexpr int read_space{detail::max_int(3, base::read_space)};
+};
+
+} // end namespace detail
+
+namespace traits {
+
+template <typename T>
+struct push<primer::matrix<T>> {
+  using row_t = detail::matrix_row<T>;
+
+  static void to_stack(lua_State * L, const primer::matrix<T> & m) {
+    PRIMER_ALLOC_SCOPE(nullptr, "matrix");
+    lua_createtable(L, static_cast<int>(m.rows()), 0);
+
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    for (std::size_t i = 0; i < m.rows(); ++i) {
+      row_t::to_stack(L, m.row(i), m.cols());
+      lua_rawseti(L, -2, static_cast<LUA_INTEGER>(i + 1));
+    }
+  }
+  static constexpr int stack_space_needed{1 + row_t::push_space};
+};
+
+template <typename T>
+struct read<primer::matrix<T>> {
+  using row_t = detail::matrix_row<T>;
+
+  static expected<primer::matrix<T>> from_stack(lua_State * L, int idx) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    idx = lua_absindex(L, idx);
+    if (!lua_istable(L, idx)) { return primer::arg_error(L, idx, "table"); }
+
+    const std::size_t rows = lua_rawlen(L, idx);
+    if (!rows) { return primer::matrix<T>{}; }
+
+    // The first row gives the number of columns
+    lua_rawgeti(L, idx, 1);
+    const long cols = row_t::length(L, -1);
+    if (cols < 0) {
+      primer::error err = primer::arg_error(L, -1, row_t::expected_type());
+      lua_pop(L, 1);
+      err.prepend_error_line("In index [1],");
+      return err;
+    }
+    lua_pop(L, 1);
+
+    expected<primer::matrix<T>> result{primer::error{}};
+    PRIMER_TRY_BAD_ALLOC {
+      result = primer::matrix<T>{rows, static_cast<std::size_t>(cols)};
+    }
+    PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+
+    expected<void> ok;
+    for (std::size_t i = 0; i < rows && ok; ++i) {
+      lua_rawgeti(L, idx, static_cast<LUA_INTEGER>(i + 1));
+      const long n = row_t::length(L, -1);
+      if (n < 0) {
+        ok = primer::arg_error(L, -1, row_t::expected_type());
+      } else if (n != cols) {
+        ok = primer::error{"Row has ", n, " elements, expected ", cols};
+      } else {
+        ok = row_t::into(L, lua_absindex(L, -1), result->row(i),
+                         static_cast<std::size_t>(cols));
+      }
+      lua_pop(L, 1);
+      if (!ok) { ok.err().prepend_error_line("In index [", i + 1, "],"); }
+    }
+    if (!ok) { result = std::move(ok.err()); }
+    return result;
+  }
+  static constexpr int stack_space_needed{1 + row_t::read_space};
+};
+
+template <typename T>
+struct read_type_mask<primer::matrix<T>> : type_mask_constant<table_type_mask> {
+};
+
+} // end namespace traits
+
+} // end namespace primer
@@ -14,19 +14,47 @@
 PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/lua.hpp>
+#include <primer/push_singleton.hpp>
 #include <primer/support/asserts.hpp>
 #include <primer/support/metatable.hpp>
 #include <primer/traits/userdata.hpp>
 
 namespace primer {
 
+namespace detail {
+
+// Fetches or initializes the metatable in the registry, by name.
+// This is `luaL_newmetatable`, except that the table is created at the size
+// which `populate` will need.
+template <typename T>
+void
+produce_metatable(lua_State * L) {
+  const char * name = primer::traits::userdata<T>::name;
+  if (lua_getfield(L, LUA_REGISTRYINDEX, name) != LUA_TNIL) { return; }
+  lua_pop(L, 1);
+
+  lua_createtable(L, 0, primer::detail::metatable<T>::size_hint());
+#if LUA_VERSION_NUM >= 503
+  lua_pushstring(L, name);
+  lua_setfield(L, -2, "__name");
+#endif
+  lua_pushvalue(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, name);
+  primer::detail::metatable<T>::populate(L);
+}
+
+} // end namespace detail
+
 // Fetches or initializes the metatable, leaves it on the stack.
+//
+// The metatable is also cached in the registry under a light C function key
+// which is unique to `T`, so after the first call this costs one raw lookup
+// by pointer, and no string hashing. This matters because it happens
+// whenever a userdata argument is type-checked.
 template <typename T>
 void
 push_metatable(lua_State * L) {
-  if (luaL_newmetatable(L, primer::traits::userdata<T>::name)) {
-    primer::detail::metatable<T>::populate(L);
-  }
+  primer::push_singleton<&detail::produce_metatable<T>>(L);
 }
 
 // Calls the above, but pops result from the stack
@@ -0,0 +1,106 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A packed_ref_seq is an alternative to lua_ref_seq, which holds a sequence of
+ * lua values in a single table, bound by a single lua_ref.
+ *
+ * Popping n values costs one table creation and one `luaL_ref`, rather than n
+ * of them plus a vector allocation, and pushing them back costs one `lock()`.
+ * The tradeoff is that the values can't be accessed individually as lua_refs.
+ *
+ * The size is tracked separately, so nils in the sequence are preserved.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+
+#include <cstddef>
+
+namespace primer {
+
+//[ packed_ref_seq_synopsis
+class packed_ref_seq {
+  lua_ref table_;
+  int size_ = 0;
+
+public:
+  packed_ref_seq() noexcept = default;
+
+  /*<< Pop `n` elements from the stack `L` into a new table.
+       They are ordered such that calling `push_each(L)` will restore them.
+       Can cause lua memory alloc failure, but doesn't throw. >>*/
+  packed_ref_seq(lua_State * L, int n);
+
+  std::size_t size() const noexcept { return static_cast<std::size_t>(size_); }
+  bool empty() const noexcept { return !size_; }
+
+  /*<< Push all the values onto the stack in succession. This needs one more
+       stack slot than the size, which is not checked.
+       Return of `false` means the VM was gone, and then `size()` nils were
+       pushed instead. >>*/
+  bool push_each(lua_State * L) const noexcept;
+
+  // The table holding the values, at indices `1` to `size()`
+  const lua_ref & table() const noexcept { return table_; }
+
+  void clear() noexcept {
+    table_.reset();
+    size_ = 0;
+  }
+};
+//]
+
+inline packed_ref_seq::packed_ref_seq(lua_State * L, int n) {
+  {
+    int top = lua_gettop(L);
+    if (n > top) { n = top; }
+    if (n < 0) { n = 0; }
+  }
+  if (!n) { return; }
+
+  lua_createtable(L, n, 0);
+  lua_insert(L, -1 - n);
+  const int t = lua_absindex(L, -1 - n);
+  for (int i = n; i > 0; --i) {
+    lua_rawseti(L, t, i);
+  }
+  table_ = lua_ref{L};
+  size_ = n;
+}
+
+inline bool
+packed_ref_seq::push_each(lua_State * L) const noexcept {
+  if (!size_) { return true; }
+
+  const bool ok = table_.push(L);
+  if (ok) {
+    const int t = lua_gettop(L);
+    for (int i = 1; i <= size_; ++i) {
+      lua_rawgeti(L, t, i);
+    }
+    lua_remove(L, t);
+  } else {
+    lua_pop(L, 1);
+    for (int i = 0; i < size_; ++i) {
+      lua_pushnil(L);
+    }
+  }
+  return ok;
+}
+
+/*<< Pop `n` elements from the stack into a packed_ref_seq. >>*/
+inline packed_ref_seq
+pop_n_packed(lua_State * L, int n) {
+  return packed_ref_seq{L, n};
+}
+
+} // end namespace primer
@@ -0,0 +1,142 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A thread pool of the host, which the kernels over typed arrays may use for
+ * large inputs.
+ *
+ * `PRIMER_ADAPT_VECTORIZED` functions, and the functions of
+ * `api::array_algorithms`, look for a `parallel_pool` in the registry of their
+ * state. If there is one, and the input has at least `threshold` elements, it
+ * is split into chunks of `chunk` elements, and `run` is asked to run them.
+ * The calling thread waits until they have finished. Smaller inputs, and
+ * states without a pool, are done on the calling thread.
+ *
+ * The chunks only read and write the elements of the arrays, which don't move
+ * while the calling thread waits, and never touch a `lua_State`. So the pool
+ * may run them on any threads, in any order, e.g. by work-stealing, and may
+ * run some of them on the calling thread.
+ *
+ * The partial results of a reduction are kept per chunk, and combined in
+ * order, so that a sum of floating point numbers doesn't depend on which
+ * threads ran the chunks. It depends on `chunk`, and on whether the input was
+ * split at all.
+ *
+ *   primer::parallel_pool pool{&my_pool, &my_pool_run, 1 << 16, 1 << 14};
+ *   primer::set_parallel_pool(L, &pool);
+ *
+ * The pool must outlive its use by the state, or be removed by
+ * `set_parallel_pool(L, nullptr)`.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+
+#include <cstddef>
+
+namespace primer {
+
+//[ primer_parallel_pool
+struct parallel_pool {
+  void * self;
+  // Runs `task(data, i)` for each `i` in `[0, n)`, and returns when they have
+  // all finished
+  void (*run)(void * self, std::size_t n, void (*task)(void *, std::size_t),
+              void * data);
+  // Inputs with fewer elements than this stay on the calling thread
+  std::size_t threshold;
+  // The number of elements of a chunk
+  std::size_t chunk;
+};
+//]
+
+namespace detail {
+
+inline void *
+parallel_pool_key() noexcept {
+  static char key;
+  return &key;
+}
+
+} // end namespace detail
+
+inline void
+set_parallel_pool(lua_State * L, const parallel_pool * pool) {
+  if (pool) {
+    lua_pushlightuserdata(L, const_cast<parallel_pool *>(pool));
+  } else {
+    lua_pushnil(L);
+  }
+  lua_rawsetp(L, LUA_REGISTRYINDEX, detail::parallel_pool_key());
+}
+
+inline const parallel_pool *
+get_parallel_pool(lua_State * L) {
+  lua_rawgetp(L, LUA_REGISTRYINDEX, detail::parallel_pool_key());
+  const void * result = lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return static_cast<const parallel_pool *>(result);
+}
+
+namespace detail {
+
+// How an input of `n` elements is split. A single chunk is done on the
+// calling thread.
+struct parallel_split {
+  const parallel_pool * pool;
+  std::size_t n;
+  std::size_t chunk;
+  std::size_t count;
+
+  std::size_t begin(std::size_t i) const noexcept { return i * chunk; }
+  std::size_t end(std::size_t i) const noexcept {
+    return (i + 1 == count) ? n : (i + 1) * chunk;
+  }
+};
+
+// At most `max_chunks` chunks, which makes them larger for very large inputs
+inline parallel_split
+split_for_pool(lua_State * L, std::size_t n,
+               std::size_t max_chunks = static_cast<std::size_t>(-1)) {
+  parallel_split s{nullptr, n, n, 1};
+  const parallel_pool * pool = get_parallel_pool(L);
+  if (!pool || !pool->run || n < pool->threshold || n < 2) { return s; }
+
+  std::size_t chunk = pool->chunk ? pool->chunk : 1;
+  if ((n - 1) / chunk + 1 > max_chunks) { chunk = (n - 1) / max_chunks + 1; }
+  s.chunk = chunk;
+  s.count = (n - 1) / chunk + 1;
+  if (s.count > 1) { s.pool = pool; }
+  return s;
+}
+
+// Calls `f(i, begin, end)` for each chunk `i`, on the threads of the pool if
+// there is more than one
+template <typename F>
+void
+run_split(const parallel_split & s, F & f) {
+  if (!s.pool) {
+    f(std::size_t{0}, std::size_t{0}, s.n);
+    return;
+  }
+  struct job {
+    const parallel_split * split;
+    F * f;
+  } j{&s, &f};
+  s.pool->run(s.pool->self, s.count,
+              [](void * data, std::size_t i) {
+                const job & j = *static_cast<const job *>(data);
+                (*j.f)(i, j.split->begin(i), j.split->end(i));
+              },
+              &j);
+}
+
+} // end namespace detail
+} // end namespace primer
@@ -0,0 +1,291 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_pool_allocator_overview
+/*`
+`primer::pool_allocator` is a `lua_Alloc` for lua states whose heap is mostly
+small objects, such as strings, tables and closures, which are created and
+collected at a high rate.
+
+Blocks of up to 256 bytes are taken from free lists, one for each multiple of
+16 bytes, which are refilled from chunks of 64KB. A freed block goes back to
+the list of its size class, so churning objects of similar sizes reuses the
+same memory rather than fragmenting the heap. Larger blocks are passed to
+`std::realloc` and `std::free`.
+
+``
+  primer::pool_allocator pool;
+  lua_State * L = pool.new_state();   // or lua_newstate(&pool_allocator::alloc,
+                                      //                 &pool)
+  ...
+  lua_close(L);
+``
+
+A pool may serve several states, but it isn't thread-safe, so they must all be
+used by one thread, and it must outlive them. Chunks are returned to the system
+only when the pool is destroyed.
+
+The pool also keeps the larger blocks in a list, so that it can free all of
+its memory at once. A state which is torn down by `primer::fast_close`, see
+`<primer/fast_close.hpp>`, is never closed, and its memory is freed in bulk by
+`release_all()`, or by the destructor of the pool.
+
+For a thread which owns its states, e.g. a worker of a pool of VMs,
+`pool_allocator::this_thread()` is a pool which is private to the thread, so
+that its states share free lists without any locking. States using it must be
+closed on that thread, before the thread exits.
+
+The allocator is only seen by lua, so it doesn't change what can be persisted,
+and eris can unpersist into a state which uses it.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+namespace primer {
+
+class pool_allocator {
+  static constexpr std::size_t granularity = 16;
+  static constexpr std::size_t max_small = 256;
+  static constexpr std::size_t num_classes = max_small / granularity;
+  static constexpr std::size_t chunk_size = 64 * 1024;
+
+  struct free_node {
+    free_node * next;
+  };
+
+  // Chunks are linked through their first slot
+  struct chunk_header {
+    chunk_header * next;
+  };
+
+  // Large blocks are linked through a header before the block, whose size
+  // keeps the block aligned as `malloc` would
+  struct large_header {
+    large_header * prev;
+    large_header * next;
+  };
+
+  static_assert(sizeof(large_header) <= granularity,
+                "large block header must fit in one granule");
+
+  free_node * free_[num_classes] = {};
+  chunk_header * chunks_ = nullptr;
+  char * bump_ = nullptr;
+  char * bump_end_ = nullptr;
+  large_header * large_ = nullptr;
+  std::size_t in_use_ = 0;
+  std::size_t chunk_bytes_ = 0;
+
+  static std::size_t class_of(std::size_t n) noexcept {
+    return (n - 1) / granularity;
+  }
+
+  static bool is_small(std::size_t n) noexcept {
+    return n && n <= max_small;
+  }
+
+  bool new_chunk() noexcept {
+    char * c = static_cast<char *>(std::malloc(chunk_size));
+    if (!c) { return false; }
+    auto h = reinterpret_cast<chunk_header *>(c);
+    h->next = chunks_;
+    chunks_ = h;
+    bump_ = c + granularity;
+    bump_end_ = c + chunk_size;
+    chunk_bytes_ += chunk_size;
+    return true;
+  }
+
+  void * allocate_small(std::size_t n) noexcept {
+    const std::size_t cls = class_of(n);
+    if (free_node * f = free_[cls]) {
+      free_[cls] = f->next;
+      return f;
+    }
+    const std::size_t slot = (cls + 1) * granularity;
+    if (static_cast<std::size_t>(bump_end_ - bump_) < slot
+        && !this->new_chunk()) {
+      return nullptr;
+    }
+    void * result = bump_;
+    bump_ += slot;
+    return result;
+  }
+
+  void deallocate_small(void * p, std::size_t n) noexcept {
+    const std::size_t cls = class_of(n);
+    free_node * f = static_cast<free_node *>(p);
+    f->next = free_[cls];
+    free_[cls] = f;
+  }
+
+  static large_header * header_of(void * p) noexcept {
+    return reinterpret_cast<large_header *>(static_cast<char *>(p)
+                                            - granularity);
+  }
+
+  static void * block_of(large_header * h) noexcept {
+    return reinterpret_cast<char *>(h) + granularity;
+  }
+
+  void link_large(large_header * h) noexcept {
+    h->prev = nullptr;
+    h->next = large_;
+    if (large_) { large_->prev = h; }
+    large_ = h;
+  }
+
+  void unlink_large(large_header * h) noexcept {
+    if (h->prev) {
+      h->prev->next = h->next;
+    } else {
+      large_ = h->next;
+    }
+    if (h->next) { h->next->prev = h->prev; }
+  }
+
+  void * allocate_large(std::size_t n) noexcept {
+    if (n > static_cast<std::size_t>(-1) - granularity) { return nullptr; }
+    auto h = static_cast<large_header *>(std::malloc(n + granularity));
+    if (!h) { return nullptr; }
+    this->link_large(h);
+    return block_of(h);
+  }
+
+  void deallocate_large(void * p) noexcept {
+    large_header * h = header_of(p);
+    this->unlink_large(h);
+    std::free(h);
+  }
+
+  void * reallocate_large(void * p, std::size_t n) noexcept {
+    if (n > static_cast<std::size_t>(-1) - granularity) { return nullptr; }
+    large_header * h = header_of(p);
+    this->unlink_large(h);
+    auto moved = static_cast<large_header *>(std::realloc(h, n + granularity));
+    if (!moved) {
+      this->link_large(h);
+      return nullptr;
+    }
+    this->link_large(moved);
+    return block_of(moved);
+  }
+
+  // Frees every block, whether or not it was deallocated
+  void free_everything() noexcept {
+    while (chunks_) {
+      chunk_header * next = chunks_->next;
+      std::free(chunks_);
+      chunks_ = next;
+    }
+    while (large_) {
+      large_header * next = large_->next;
+      std::free(large_);
+      large_ = next;
+    }
+  }
+
+  void * reallocate(void * ptr, std::size_t osize, std::size_t nsize) noexcept {
+    if (!ptr) { osize = 0; } // Then osize is the type of a new object
+
+    if (!nsize) {
+      if (ptr) {
+        if (is_small(osize)) {
+          this->deallocate_small(ptr, osize);
+        } else {
+          this->deallocate_large(ptr);
+        }
+        in_use_ -= osize;
+      }
+      return nullptr;
+    }
+
+    void * result;
+    if (is_small(nsize)) {
+      if (ptr && is_small(osize) && class_of(osize) == class_of(nsize)) {
+        result = ptr;
+      } else {
+        result = this->allocate_small(nsize);
+        if (!result) { return nullptr; }
+        if (ptr) {
+          std::memcpy(result, ptr, osize < nsize ? osize : nsize);
+          if (is_small(osize)) {
+            this->deallocate_small(ptr, osize);
+          } else {
+            this->deallocate_large(ptr);
+          }
+        }
+      }
+    } else if (ptr && is_small(osize)) {
+      result = this->allocate_large(nsize);
+      if (!result) { return nullptr; }
+      std::memcpy(result, ptr, osize);
+      this->deallocate_small(ptr, osize);
+    } else if (ptr) {
+      result = this->reallocate_large(ptr, nsize);
+      if (!result) { return nullptr; }
+    } else {
+      result = this->allocate_large(nsize);
+      if (!result) { return nullptr; }
+    }
+    in_use_ += nsize;
+    in_use_ -= osize;
+    return result;
+  }
+
+public:
+  pool_allocator() noexcept = default;
+  pool_allocator(const pool_allocator &) = delete;
+  pool_allocator & operator=(const pool_allocator &) = delete;
+
+  ~pool_allocator() noexcept { this->free_everything(); }
+
+  // The `lua_Alloc`, whose `ud` is the pool
+  static void * alloc(void * ud, void * ptr, std::size_t osize,
+                      std::size_t nsize) noexcept {
+    return static_cast<pool_allocator *>(ud)->reallocate(ptr, osize, nsize);
+  }
+
+  // A new state which uses this pool, or nullptr if memory fails
+  lua_State * new_state() noexcept { return lua_newstate(&alloc, this); }
+
+  // The pool of the calling thread
+  static pool_allocator & this_thread() noexcept {
+    static thread_local pool_allocator instance;
+    return instance;
+  }
+
+  // Bytes which lua has allocated and not freed
+  std::size_t bytes_in_use() const noexcept { return in_use_; }
+
+  // Bytes held in chunks for small blocks, in use or free
+  std::size_t chunk_bytes() const noexcept { return chunk_bytes_; }
+
+  // Frees all of the memory of the pool, including the blocks which lua still
+  // holds, i.e. the states which use it are gone, and must not be used or
+  // closed after this. The pool can then serve new states.
+  void release_all() noexcept {
+    this->free_everything();
+    for (free_node *& f : free_) {
+      f = nullptr;
+    }
+    bump_ = bump_end_ = nullptr;
+    in_use_ = 0;
+    chunk_bytes_ = 0;
+  }
+};
+
+} // end namespace primer
@@ -14,27 +14,71 @@
 PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/adapt.hpp>
+#include <primer/adapt_memoized.hpp>
+#include <primer/adapt_overloads.hpp>
+#include <primer/adapt_vectorized.hpp>
 #include <primer/bound_function.hpp>
+#include <primer/byte_buffer.hpp>
+#include <primer/cached.hpp>
+#include <primer/call_site.hpp>
+#include <primer/cancel_token.hpp>
+#include <primer/closure.hpp>
 #include <primer/coroutine.hpp>
+#include <primer/coroutine_pool.hpp>
+#include <primer/deep_copy.hpp>
+#include <primer/enum_names.hpp>
 #include <primer/error.hpp>
 #include <primer/error_capture.hpp>
+#include <primer/event_channel.hpp>
 #include <primer/expected.hpp>
+#include <primer/fast_close.hpp>
 #include <primer/function.hpp>
+#include <primer/generator_range.hpp>
+#include <primer/global_function_cache.hpp>
+#include <primer/hook_mux.hpp>
+#include <primer/interned_string.hpp>
+#include <primer/listener_group.hpp>
 #include <primer/lua.hpp>
 #include <primer/lua_ref.hpp>
+#include <primer/lua_ref_pool.hpp>
 #include <primer/lua_ref_as.hpp>
 #include <primer/lua_ref_seq.hpp>
+#include <primer/matrix.hpp>
+#include <primer/parallel_pool.hpp>
+#include <primer/packed_ref_seq.hpp>
+#include <primer/pool_allocator.hpp>
 #include <primer/metatable.hpp>
 #include <primer/push.hpp>
+#include <primer/push_iterator.hpp>
 #include <primer/push_singleton.hpp>
+#include <primer/push_streamed.hpp>
 #include <primer/read.hpp>
+#include <primer/ref_proxy.hpp>
+#include <primer/ref_scope.hpp>
 #include <primer/registry_helper.hpp>
 #include <primer/result.hpp>
+#include <primer/scheduler.hpp>
 #include <primer/set_funcs.hpp>
+#include <primer/shared_buffer.hpp>
+#include <primer/soa_view.hpp>
+#include <primer/stack_ref.hpp>
+#include <primer/string_builder.hpp>
+#include <primer/table_pool.hpp>
+#include <primer/table_view.hpp>
+#include <primer/tracked_table.hpp>
+#include <primer/transfer.hpp>
+#include <primer/typed_array.hpp>
+#include <primer/udata_array.hpp>
+#include <primer/udata_holder.hpp>
+#include <primer/udata_ref.hpp>
 #include <primer/userdata.hpp>
 #include <primer/userdata_dispatch.hpp>
+#include <primer/variadic.hpp>
+#include <primer/vector_math.hpp>
+#include <primer/vm_config.hpp>
 
 #include <primer/container/map_base.hpp>
 #include <primer/container/optional_base.hpp>
 #include <primer/container/seq_base.hpp>
 #include <primer/container/set_base.hpp>
+#include <primer/container/typed_array_base.hpp>
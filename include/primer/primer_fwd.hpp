@@ -17,11 +17,16 @@ PRIMER_ASSERT_FILESCOPE;
 namespace primer {
 
 class bound_function;
+class call_site;
 class coroutine;
+class coroutine_pool;
 class lua_ref;
-struct lua_ref_seq;
+class lua_ref_pool;
+class lua_ref_seq;
+class packed_ref_seq;
 class lua_state_ref;
 class result;
+class scheduler;
 
 namespace traits {
 
@@ -8,14 +8,27 @@
 /***
  * primer::push function. Push a single object to the stack, resolves
  * how to do so using the push trait.
+ *
+ * A non-const rvalue is passed on to the trait as an rvalue, so a trait which
+ * has a `to_stack(lua_State *, T &&)` may move from it, e.g. into userdata.
+ *
+ * primer::push_into function. Update a table which was pushed before, rather
+ * than pushing a new one.
  */
 
 #include <primer/base.hpp>
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <primer/detail/push_into.hpp>
 #include <primer/detail/stack_push_each_helper.hpp>
+#include <primer/detail/type_traits.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/support/asserts.hpp>
 #include <primer/traits/push.hpp>
+#include <cstddef>
+#include <type_traits>
 #include <utility>
 
 namespace primer {
@@ -23,6 +36,17 @@ namespace primer {
 //[ primer_push
 template <typename T>
 void push(lua_State * L, const T & t);
+
+template <typename T, typename = enable_if_t<!std::is_lvalue_reference<T>::value
+                                             && !std::is_const<T>::value>>
+void push(lua_State * L, T && t);
+
+// A const char array is a literal, and a mutable one is a buffer
+template <std::size_t n>
+void push(lua_State * L, const char (&str)[n]);
+
+template <std::size_t n>
+void push(lua_State * L, char (&str)[n]);
 //]
 
 //[ primer_push_impl
@@ -35,6 +59,24 @@ push(lua_State * L, const T & t) {
   static_cast<void>(::primer::traits::push<T>::stack_space_needed);
   //->
 }
+
+template <typename T, typename>
+void
+push(lua_State * L, T && t) {
+  ::primer::traits::push<T>::to_stack(L, std::move(t));
+}
+
+template <std::size_t n>
+void
+push(lua_State * L, const char (&str)[n]) {
+  ::primer::traits::push<const char[n]>::to_stack(L, str);
+}
+
+template <std::size_t n>
+void
+push(lua_State * L, char (&str)[n]) {
+  ::primer::traits::push<char[n]>::to_stack(L, str);
+}
 //]
 
 //[ primer_push_each
@@ -51,6 +93,27 @@ push_each(lua_State * L, Args &&... args) {
 }
 //]
 
+//[ primer_push_into
+// Make the table at `index` hold what `push` would put in a new table. Fields
+// which are unchanged are not assigned, nested tables are updated in place,
+// and stale keys are removed, so scripts which hold the table see the new
+// contents. Fails if there is no table at `index`.
+// Note: Can cause lua memory allocation failure
+template <typename T>
+expected<void> push_into(lua_State * L, int index, const T & t);
+//]
+
+template <typename T>
+expected<void>
+push_into(lua_State * L, int index, const T & t) {
+  PRIMER_STATIC_ASSERT(detail::push_into_helper<T>::available,
+                       "push trait has no to_existing");
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  if (!lua_istable(L, index)) { return primer::arg_error(L, index, "table"); }
+  detail::push_into_helper<T>::update(L, lua_absindex(L, index), t);
+  return {};
+}
+
 //[ primer_stack_space_for_push
 template <typename T>
 constexpr int stack_space_for_push();
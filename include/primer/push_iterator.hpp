@@ -0,0 +1,172 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Push a C++ range as a lazy lua iterator, for the generic `for`.
+ *
+ * `primer::push_iterator(L, begin, end)` pushes the three values which a
+ * generic `for` expects: a stepping function, its state, and nil. The state
+ * is a userdata holding the pair of iterators, and the stepping function is a
+ * C function for the iterator type, which converts an element only when the
+ * loop asks for it. So a loop which breaks early costs only what it consumed,
+ * and nothing is copied into a table.
+ *
+ * If the elements are `std::pair`s, as for maps, each step gives the key and
+ * the value. Otherwise it gives the 1-based position and the element, like
+ * `ipairs`. The elements are pushed with `primer::push`.
+ *
+ * The iterators refer to the C++ range, which must outlive the loop, and
+ * which must not be modified while scripts may still step through it. The
+ * state can't be persisted.
+ *
+ *   primer::result intf_entities(lua_State * L) {
+ *     primer::push_iterator(L, entities_.begin(), entities_.end());
+ *     return 3;
+ *   }
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/detail/type_traits.hpp>
+#include <primer/lua.hpp>
+#include <primer/push.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/support/alloc_scope.hpp>
+#include <primer/support/asserts.hpp>
+
+#include <cstddef>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace primer {
+
+//[ primer_push_iterator
+/// Push the stepping function, state, and initial value of a generic `for`
+/// over the elements from `begin` to `end`
+template <typename It>
+void push_iterator(lua_State * L, It begin, It end);
+
+/// The same, over a whole range
+template <typename R>
+void push_iterator(lua_State * L, const R & range);
+//]
+
+namespace detail {
+
+template <typename V>
+struct iterator_pushes_pair : std::false_type {};
+
+template <typename A, typename B>
+struct iterator_pushes_pair<std::pair<A, B>> : std::true_type {};
+
+template <typename It>
+struct iterator_state {
+  It current;
+  It end;
+  LUA_INTEGER position;
+};
+
+template <typename It>
+int
+iterator_state_gc(lua_State * L) {
+  static_cast<iterator_state<It> *>(lua_touserdata(L, 1))->~iterator_state();
+  return 0;
+}
+
+template <typename It>
+void
+iterator_state_metatable(lua_State * L) {
+  lua_createtable(L, 0, 2);
+  lua_pushcfunction(L, &iterator_state_gc<It>);
+  lua_setfield(L, -2, "__gc");
+  lua_pushboolean(L, false);
+  lua_setfield(L, -2, "__persist");
+}
+
+template <typename It>
+int
+iterator_push_element(lua_State * L, const iterator_state<It> & s,
+                      std::true_type) {
+  primer::push(L, s.current->first);
+  primer::push(L, s.current->second);
+  return 2;
+}
+
+template <typename It>
+int
+iterator_push_element(lua_State * L, const iterator_state<It> & s,
+                      std::false_type) {
+  lua_pushinteger(L, s.position);
+  primer::push(L, *s.current);
+  return 2;
+}
+
+// The state, if the value at `idx` is one for `It`
+template <typename It>
+iterator_state<It> *
+test_iterator_state(lua_State * L, int idx) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  void * p = lua_touserdata(L, idx);
+  if (!p || !lua_getmetatable(L, idx)) { return nullptr; }
+  primer::push_singleton<&iterator_state_metatable<It>>(L);
+  if (!lua_rawequal(L, -1, -2)) { p = nullptr; }
+  lua_pop(L, 2);
+  return static_cast<iterator_state<It> *>(p);
+}
+
+// Upvalue-free, so that pushing it doesn't allocate. Scripts can call it with
+// anything, so the state is checked.
+template <typename It>
+int
+iterator_step(lua_State * L) {
+  auto * s = test_iterator_state<It>(L, 1);
+  if (!s) { return luaL_argerror(L, 1, "expected an iterator state"); }
+  if (s->current == s->end) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  using value_t =
+    remove_cv_t<typename std::iterator_traits<It>::value_type>;
+  ++s->position;
+  const int n =
+    iterator_push_element(L, *s, iterator_pushes_pair<value_t>{});
+  ++s->current;
+  return n;
+}
+
+} // end namespace detail
+
+template <typename It>
+void
+push_iterator(lua_State * L, It begin, It end) {
+  PRIMER_ALLOC_SCOPE(nullptr, "iterator");
+  // The metatable is pushed first, so that nothing can fail after the state
+  // is constructed and before it is given its `__gc`.
+  lua_pushcfunction(L, &detail::iterator_step<It>);
+  primer::push_singleton<&detail::iterator_state_metatable<It>>(L);
+  void * storage = lua_newuserdata(L, sizeof(detail::iterator_state<It>));
+  new (storage)
+    detail::iterator_state<It>{std::move(begin), std::move(end), 0};
+  lua_insert(L, -2);
+  lua_setmetatable(L, -2);
+  lua_pushnil(L);
+}
+
+template <typename R>
+void
+push_iterator(lua_State * L, const R & range) {
+  using std::begin;
+  using std::end;
+  primer::push_iterator(L, begin(range), end(range));
+}
+
+} // end namespace primer
@@ -11,6 +11,11 @@ PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/lua.hpp>
 #include <primer/support/asserts.hpp>
+#include <primer/support/registry_slots.hpp>
+
+#ifdef PRIMER_REGISTRY_SLOTS
+#include <type_traits>
+#endif
 
 //[ primer_push_singleton_overview
 /*`
@@ -80,6 +85,25 @@ template <int (*producer_func)(lua_State * L)>
 void
 push_singleton(lua_State * L) {
   constexpr lua_CFunction registry_key = producer_func;
+#ifdef PRIMER_REGISTRY_SLOTS
+  // With a slot reserved in this state, it is a lookup in the array part
+  using slot_t = detail::registry_slot<
+    std::integral_constant<lua_CFunction, producer_func>>;
+  const int slot = slot_t::value;
+  if (slot && detail::registry_slots_reserved(L)) {
+    if (lua_rawgeti(L, LUA_REGISTRYINDEX, slot) == LUA_TBOOLEAN) {
+      PRIMER_ASSERT_STACK_NEUTRAL(L);
+      lua_pop(L, 1);
+
+      producer_func(L);
+      if (lua_gettop(L) && !lua_isnil(L, -1)) {
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, LUA_REGISTRYINDEX, slot);
+      }
+    }
+    return;
+  }
+#endif
   // Note that even if the function is inline and defined in a header, C++
   // guarantees that it has a unique address.
   //
@@ -105,4 +129,36 @@ push_singleton(lua_State * L) {
   push_singleton<detail::wrapped_as_cfunc<producer_func>>(L);
 }
 
+namespace detail {
+
+// Pushes the object of a producer if it was made already, or nil, and returns
+// its type. Unlike `push_singleton`, this never makes it, and doesn't allocate.
+template <int (*producer_func)(lua_State * L)>
+int
+push_existing_singleton(lua_State * L) noexcept {
+#ifdef PRIMER_REGISTRY_SLOTS
+  using slot_t = detail::registry_slot<
+    std::integral_constant<lua_CFunction, producer_func>>;
+  const int slot = slot_t::value;
+  if (slot && detail::registry_slots_reserved(L)) {
+    // A reserved slot holds a boolean until the object is made
+    if (lua_rawgeti(L, LUA_REGISTRYINDEX, slot) == LUA_TBOOLEAN) {
+      lua_pop(L, 1);
+      lua_pushnil(L);
+    }
+    return lua_type(L, -1);
+  }
+#endif
+  lua_pushcfunction(L, producer_func);
+  return lua_rawget(L, LUA_REGISTRYINDEX);
+}
+
+template <void (*producer_func)(lua_State * L)>
+int
+push_existing_singleton(lua_State * L) noexcept {
+  return push_existing_singleton<wrapped_as_cfunc<producer_func>>(L);
+}
+
+} // end namespace detail
+
 } // end namespace primer
@@ -0,0 +1,117 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Push a large string which C++ code writes piece by piece, without building
+ * a `std::string` of it first.
+ *
+ * `primer::push_streamed(L, writer)` calls `writer(out)`, where `out` is a
+ * `primer::stream_appender`, backed by a `luaL_Buffer`, so the pieces go
+ * straight into the lua string being built. When the writer returns, the
+ * string is pushed. At peak, the output is held once by the buffer and once
+ * by the new string, rather than also by a `std::string`.
+ *
+ * The writer may return `void`, or `expected<void>`. If it returns an error,
+ * or lua runs out of memory, what was written is discarded, nothing is
+ * pushed, and the error is returned.
+ *
+ * The writer is called in a protected call, see `cpp_pcall`, and so it must
+ * not throw, and it must not use the lua stack of `L` while it writes, since
+ * the buffer lives on top of it. A memory error in `append` unwinds the
+ * writer as a lua error does, so, unless lua is compiled as C++, the writer
+ * should not hold objects which need their destructors to run across calls
+ * to `append`.
+ *
+ *   auto ok = primer::push_streamed(L, [&](primer::stream_appender & out) {
+ *     for (const auto & e : entries_) {
+ *       out.append(e.name);
+ *       out.push_back('\n');
+ *     }
+ *   });
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/cpp_pcall.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace primer {
+
+//[ primer_push_streamed
+class stream_appender {
+  luaL_Buffer * buffer_;
+
+public:
+  explicit stream_appender(luaL_Buffer * b) noexcept
+    : buffer_(b) {}
+
+  void append(const char * s, std::size_t n) { luaL_addlstring(buffer_, s, n); }
+  void append(const char * s) { this->append(s, std::strlen(s)); }
+  void append(const std::string & s) { this->append(s.data(), s.size()); }
+  void push_back(char c) { luaL_addchar(buffer_, c); }
+
+  /// Space for at least `n` characters, to write in place, and then `commit`
+  char * prepare(std::size_t n) { return luaL_prepbuffsize(buffer_, n); }
+  void commit(std::size_t n) noexcept { luaL_addsize(buffer_, n); }
+};
+
+template <typename F>
+expected<void> push_streamed(lua_State * L, F && writer);
+//]
+
+namespace detail {
+
+template <typename F>
+expected<void>
+call_stream_writer(F & f, stream_appender & out, std::true_type) {
+  f(out);
+  return {};
+}
+
+template <typename F>
+expected<void>
+call_stream_writer(F & f, stream_appender & out, std::false_type) {
+  return f(out);
+}
+
+} // end namespace detail
+
+template <typename F>
+expected<void>
+push_streamed(lua_State * L, F && writer) {
+  using returns_void =
+    std::is_void<decltype(writer(std::declval<stream_appender &>()))>;
+
+  // The error of the writer is held outside of the protected call, and the
+  // unfinished buffer is left on the stack of the call, which discards it
+  expected<void> written;
+  auto ok = primer::cpp_pcall(L, [&]() {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    stream_appender out{&b};
+    written = detail::call_stream_writer(writer, out, returns_void{});
+    if (written) {
+      luaL_pushresult(&b);
+    } else {
+      lua_settop(L, 0);
+    }
+  });
+  if (!ok) { return ok; }
+  return written;
+}
+
+} // end namespace primer
@@ -14,6 +14,7 @@
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <primer/detail/read_into.hpp>
 #include <primer/expected.hpp>
 #include <primer/support/asserts.hpp>
 #include <primer/traits/read.hpp>
@@ -38,6 +39,22 @@ read(lua_State * L, int index) {
 }
 //]
 
+//[ primer_read_into
+// Read into an existing object, reusing resources it holds where possible.
+// For instance, containers keep their capacity, and elements already present
+// are read into in place.
+// If it fails, `out` is left in a valid but unspecified state.
+template <typename T>
+expected<void> read_into(lua_State * L, int index, T & out);
+//]
+
+template <typename T>
+expected<void>
+read_into(lua_State * L, int index, T & out) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  return ::primer::detail::read_into(L, index, out);
+}
+
 //[ primer_stack_space_for_read
 template <typename T>
 constexpr int stack_space_for_read();
@@ -0,0 +1,156 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * How to push a C++ object to lua by reference, rather than as a table copy.
+ *
+ * `primer::push(L, primer::make_ref_proxy(obj))` pushes a small userdata which
+ * holds a pointer to `obj`. Its metatable provides `__index`, `__len` and
+ * `__pairs`, which convert elements only when a script touches them, using
+ * `traits::ref_proxy_access<T>`. So a script which reads two fields of a large
+ * structure only pays for those two fields.
+ *
+ * The elements themselves are pushed by `traits::push` as usual, so nested
+ * containers are still copied when they are reached, unless they are also
+ * wrapped.
+ *
+ * The proxy is read-only, and it does not own the object. Made from a
+ * `nonstd::weak_ref` or a `nonstd::weakly_referenced`, it tracks the object,
+ * and once the master ref is gone, using the proxy raises an error. Made from
+ * a plain reference, it doesn't track the object, which must then outlive
+ * every use of the proxy in lua, e.g. by only handing it to a single function
+ * call.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/traits/push.hpp>
+#include <primer/traits/ref_proxy.hpp>
+#include <primer/weak_ref.hpp>
+
+#include <new>
+
+namespace primer {
+
+//[ primer_ref_proxy
+template <typename T>
+struct ref_proxy {
+  const T * ptr;          // Untracked, or
+  nonstd::weak_ref<T> ref; // tracked, if `ptr` is null
+};
+
+template <typename T>
+ref_proxy<T>
+make_ref_proxy(const T & t) {
+  return ref_proxy<T>{&t, {}};
+}
+
+template <typename T>
+ref_proxy<T>
+make_ref_proxy(const nonstd::weak_ref<T> & r) {
+  return ref_proxy<T>{nullptr, r};
+}
+
+template <typename T>
+ref_proxy<T>
+make_ref_proxy(const nonstd::weakly_referenced<T> & w) {
+  return ref_proxy<T>{nullptr, w.get_weak_ref()};
+}
+//]
+
+namespace detail {
+
+template <typename T>
+struct ref_proxy_udata {
+  using access = traits::ref_proxy_access<T>;
+
+  static void push_metatable(lua_State * L) {
+    lua_newtable(L);
+    lua_pushcfunction(L, &ref_proxy_udata::gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, &ref_proxy_udata::index);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, &ref_proxy_udata::len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, &ref_proxy_udata::pairs);
+    lua_setfield(L, -2, "__pairs");
+    lua_pushliteral(L, "ref_proxy");
+    lua_setfield(L, -2, "__metatable");
+  }
+
+  // The iterator function returned by `pairs` can be called with anything, so
+  // check the metatable.
+  static const T & self(lua_State * L) {
+    void * p = lua_touserdata(L, 1);
+    bool ok = false;
+    if (p && lua_getmetatable(L, 1)) {
+      push_singleton<&ref_proxy_udata::push_metatable>(L);
+      ok = lua_rawequal(L, -1, -2);
+      lua_pop(L, 2);
+    }
+    if (!ok) { luaL_argerror(L, 1, "expected ref_proxy"); }
+    const ref_proxy<T> & r = *static_cast<const ref_proxy<T> *>(p);
+    const T * t = r.ptr ? r.ptr : r.ref.lock();
+    if (!t) { luaL_error(L, "ref_proxy: the object is gone"); }
+    return *t;
+  }
+
+  static int gc(lua_State * L) {
+    static_cast<ref_proxy<T> *>(lua_touserdata(L, 1))->~ref_proxy<T>();
+    return 0;
+  }
+
+  static int index(lua_State * L) {
+    luaL_checkstack(L, access::stack_space_needed, "not enough stack space");
+    access::index(L, self(L));
+    return 1;
+  }
+
+  static int len(lua_State * L) {
+    lua_pushinteger(L, static_cast<lua_Integer>(access::size(self(L))));
+    return 1;
+  }
+
+  static int next(lua_State * L) {
+    luaL_checkstack(L, access::stack_space_needed, "not enough stack space");
+    lua_settop(L, 2);
+    return access::next(L, self(L));
+  }
+
+  static int pairs(lua_State * L) {
+    self(L);
+    lua_pushcfunction(L, &ref_proxy_udata::next);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+  }
+};
+
+} // end namespace detail
+
+namespace traits {
+
+template <typename T>
+struct push<ref_proxy<T>> {
+  static void to_stack(lua_State * L, const ref_proxy<T> & r) {
+    PRIMER_ASSERT(r.ptr || r.ref.lock(), "ref_proxy to null");
+    new (lua_newuserdata(L, sizeof(ref_proxy<T>))) ref_proxy<T>(r);
+    push_singleton<&detail::ref_proxy_udata<T>::push_metatable>(L);
+    lua_setmetatable(L, -2);
+  }
+  // The userdata, and creating the metatable
+  static constexpr int stack_space_needed{4};
+};
+
+} // end namespace traits
+
+} // end namespace primer
@@ -0,0 +1,180 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A ref_scope is an arena for the refs which C++ code makes for a short time,
+ * e.g. for one frame.
+ *
+ * While a scope is active on a thread, a `lua_ref` which is made from a
+ * `lua_State *` of its state, and so the refs inside a `bound_function`, a
+ * `lua_ref_seq` and so on, is stored in a table of the scope instead of the
+ * registry. Destroying such a ref does nothing, and when the scope ends, the
+ * table is dropped, which releases all of them at once. Copies of a ref are
+ * stored where the original is.
+ *
+ * A ref which must outlive the scope is moved to the registry with
+ * `lua_ref::promote`. The refs which are left become empty when the scope
+ * ends, and may be destroyed on any thread after that.
+ *
+ * Scopes nest, and must be destroyed in the reverse order of construction, on
+ * the thread which made them. A ref goes to the innermost active scope of its
+ * state. `release` ends the refs of a scope early, so a long-lived scope may
+ * be released once per frame.
+ *
+ * The tables of scopes are kept in pools, which are reused, so a scope costs
+ * one table, made by its first ref.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/lua_ref_pool.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/lua_state_ref.hpp>
+#include <primer/support/ref_tracking.hpp>
+
+#include <cstddef>
+#include <new>
+
+namespace primer {
+
+namespace detail {
+
+// The pools of the scopes of a state, in a userdata whose user value keeps
+// them all. A pool is made when no pool is free, and is never collected,
+// since refs which outlive their scope look at its epoch.
+struct ref_scope_pools {
+  ref_pool * free;
+  int count;
+
+  static void make(lua_State * L) {
+    new (lua_newuserdata(L, sizeof(ref_scope_pools))) ref_scope_pools{};
+    lua_newtable(L);
+    lua_setuservalue(L, -2);
+  }
+
+  static ref_scope_pools * get(lua_State * L) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    primer::push_singleton<&ref_scope_pools::make>(L);
+    void * result = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    PRIMER_ASSERT(result, "Failed to obtain ref scope pools");
+    return static_cast<ref_scope_pools *>(result);
+  }
+
+  // May raise a lua error on memory failure
+  ref_pool * acquire(lua_State * L) {
+    if (ref_pool * p = free) {
+      free = p->next_free;
+      p->next_free = nullptr;
+      return p;
+    }
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    primer::push_singleton<&ref_scope_pools::make>(L);
+    lua_getuservalue(L, -1);
+    ref_pool * p = new (lua_newuserdata(L, sizeof(ref_pool))) ref_pool{};
+    p->table_ref = LUA_NOREF;
+    p->epoch = 1;
+    lua_rawseti(L, -2, ++count);
+    lua_pop(L, 2);
+    return p;
+  }
+
+  // Drops the slots of the pool, and starts its next epoch. A pool whose
+  // epochs are used up is retired, and never reused.
+  void release(lua_State * L, ref_pool * p) noexcept {
+#ifdef PRIMER_REF_TRACKING
+    if (const ref_tracking_hooks * hooks = get_ref_tracking_hooks(L)) {
+      for (int i = 1; i <= p->size; ++i) {
+        hooks->released(hooks->self, p, i);
+      }
+    }
+#endif
+    if (p->table_ref != LUA_NOREF) {
+      luaL_unref(L, LUA_REGISTRYINDEX, p->table_ref);
+      p->table_ref = LUA_NOREF;
+    }
+    p->free_head = 0;
+    p->size = 0;
+    ++p->epoch;
+  }
+
+  void put_back(ref_pool * p) noexcept {
+    if (p->epoch) {
+      p->next_free = free;
+      free = p;
+    }
+  }
+};
+
+} // end namespace detail
+
+//[ primer_ref_scope
+class ref_scope {
+  lua_state_ref sref_;
+  detail::ref_scope_pools * pools_;
+  detail::ref_scope_frame frame_;
+
+public:
+  /*<< Makes the scope active on this thread. This may raise a lua error on
+       memory allocation failure. >>*/
+  explicit ref_scope(lua_State * L);
+
+  /*<< Releases the refs of the scope, and makes the scope which was active
+       before it active again. >>*/
+  ~ref_scope() noexcept;
+
+  ref_scope(const ref_scope &) = delete;
+  ref_scope & operator=(const ref_scope &) = delete;
+
+  /*<< Releases the refs made in the scope so far, which become empty. The
+       scope stays active. Once in 65535 times, this takes a new pool, which
+       may raise a lua error on memory allocation failure. >>*/
+  void release();
+
+  // The number of refs made in the scope since it was last released
+  std::size_t size() const noexcept;
+};
+//]
+
+inline ref_scope::ref_scope(lua_State * L)
+  : sref_(primer::obtain_state_ref(L))
+  , pools_(detail::ref_scope_pools::get(L))
+  , frame_{sref_.lock(), nullptr, detail::ref_scope_top()} {
+  frame_.pool = pools_->acquire(L);
+  detail::ref_scope_top() = &frame_;
+}
+
+inline ref_scope::~ref_scope() noexcept {
+  PRIMER_ASSERT(detail::ref_scope_top() == &frame_,
+                "ref scopes must end in the reverse order of their start");
+  detail::ref_scope_top() = frame_.prev;
+  if (lua_State * L = sref_.lock()) {
+    pools_->release(L, frame_.pool);
+    pools_->put_back(frame_.pool);
+  }
+}
+
+inline void
+ref_scope::release() {
+  if (lua_State * L = sref_.lock()) {
+    pools_->release(L, frame_.pool);
+    if (!frame_.pool->epoch) { frame_.pool = pools_->acquire(L); }
+  }
+}
+
+inline std::size_t
+ref_scope::size() const noexcept {
+  if (!sref_.lock()) { return 0; }
+  return static_cast<std::size_t>(frame_.pool->size);
+}
+
+} // end namespace primer
@@ -10,6 +10,9 @@
  * unique location in the registry, and allows to recover later.
  *
  * Use with care
+ *
+ * With PRIMER_REGISTRY_SLOTS, the pointer is kept in a registry slot of the
+ * type, see <primer/support/registry_slots.hpp>.
  */
 
 #include <primer/base.hpp>
@@ -18,6 +21,7 @@ PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/lua.hpp>
 #include <primer/support/asserts.hpp>
+#include <primer/support/registry_slots.hpp>
 
 namespace primer {
 
@@ -29,14 +33,37 @@ class registry_helper {
     return 0;
   }
 
+#ifdef PRIMER_REGISTRY_SLOTS
+  // The slot, if this state reserved it, or 0
+  static int get_slot(lua_State * L) {
+    const int slot = detail::registry_slot<registry_helper>::value;
+    return (slot && detail::registry_slots_reserved(L)) ? slot : 0;
+  }
+#endif
+
 public:
   static void store(lua_State * L, T * t) {
+#ifdef PRIMER_REGISTRY_SLOTS
+    if (const int slot = get_slot(L)) {
+      lua_pushlightuserdata(L, static_cast<void *>(t));
+      lua_rawseti(L, LUA_REGISTRYINDEX, slot);
+      return;
+    }
+#endif
     get_key(L);
     lua_pushlightuserdata(L, static_cast<void *>(t));
     lua_settable(L, LUA_REGISTRYINDEX);
   }
 
   static T * obtain(lua_State * L) {
+#ifdef PRIMER_REGISTRY_SLOTS
+    if (const int slot = get_slot(L)) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, slot);
+      void * ptr = lua_touserdata(L, -1);
+      lua_pop(L, 1);
+      return static_cast<T *>(ptr);
+    }
+#endif
     get_key(L);
     lua_gettable(L, LUA_REGISTRYINDEX);
     void * ptr = lua_touserdata(L, -1);
@@ -0,0 +1,441 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A scheduler runs many `primer::coroutine` tasks cooperatively, in ticks.
+ *
+ * Each call to `tick()` advances the clock by one, and resumes every task
+ * which is ready, once. What a task yields says when it wants to run again:
+ *
+ *   coroutine.yield()        -- on the next tick
+ *   coroutine.yield(n)       -- after n ticks
+ *   coroutine.yield("name")  -- after `signal("name")` is called
+ *
+ * Any other yielded value means the next tick. Sleeping tasks are kept in a
+ * heap ordered by wake tick, and waiting tasks in lists by signal name, so a
+ * tick only touches the tasks which are due, rather than scanning all of them.
+ *
+ * If an instruction budget is set, a count hook is subscribed on the thread,
+ * through the `hook_mux`, for the duration of each resume, which yields once
+ * the budget is used up.
+ * (A hook can't yield across a C call boundary, e.g. inside a metamethod,
+ * so then the task runs on until the next count.) A preempted task runs again
+ * on the next tick.
+ *
+ * A C function called by a task can also suspend it until some C++ work
+ * completes, without blocking the other tasks:
+ *
+ *   auto t = sched.make_ticket();
+ *   start_io(..., [&sched, t](std::string r) { sched.complete(t, r); });
+ *   return primer::scheduler::await(L, t);
+ *
+ * The values passed to `complete` become the results of the C function in lua,
+ * and the task runs on the next tick after that. A ticket made while a task
+ * runs belongs to that task: if the task ends without awaiting it, values
+ * which were passed to `complete` for it are dropped, then or later.
+ *
+ * Tasks which return are dropped. Tasks which raise an error are dropped too,
+ * and the error is kept until `take_errors()`.
+ *
+ * The scheduler is not copyable, and tasks refer to the lua state weakly, as
+ * `coroutine` does.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/bound_function.hpp>
+#include <primer/coroutine.hpp>
+#include <primer/coroutine_pool.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/hook_mux.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref_seq.hpp>
+#include <primer/push.hpp>
+#include <primer/support/function_check_stack.hpp>
+#include <primer/support/lua_state_ref.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+namespace detail {
+
+// What a task asked for when it last yielded
+struct scheduler_wake {
+  enum kind_t { next_tick, sleep, wait, await };
+
+  kind_t kind = next_tick;
+  lua_Integer ticks = 0; // Or the ticket, for `await`
+  std::string signal;
+};
+
+// Yielded by `scheduler::await`, ahead of the ticket
+inline void *
+scheduler_await_key() noexcept {
+  static char key;
+  return &key;
+}
+
+// Reads the wake condition from the yielded values. Returned values are read
+// the same way, and ignored.
+struct scheduler_wake_helper {
+  using return_type = expected<scheduler_wake>;
+
+  static void pop(lua_State * L, int start_idx, return_type & result) {
+    result = scheduler_wake{};
+    if (start_idx <= lua_gettop(L)) {
+      switch (lua_type(L, start_idx)) {
+        case LUA_TNUMBER: {
+          result->kind = scheduler_wake::sleep;
+          result->ticks =
+            static_cast<lua_Integer>(lua_tonumber(L, start_idx));
+          break;
+        }
+        case LUA_TSTRING: {
+          std::size_t len;
+          const char * str = lua_tolstring(L, start_idx, &len);
+          PRIMER_TRY_BAD_ALLOC {
+            result->kind = scheduler_wake::wait;
+            result->signal.assign(str, len);
+          }
+          PRIMER_CATCH_BAD_ALLOC { result = primer::error::bad_alloc(); }
+          break;
+        }
+        case LUA_TLIGHTUSERDATA: {
+          if (lua_touserdata(L, start_idx) == scheduler_await_key()) {
+            result->kind = scheduler_wake::await;
+            result->ticks = lua_tointeger(L, start_idx + 1);
+          }
+          break;
+        }
+        default: break;
+      }
+    }
+    lua_settop(L, start_idx - 1);
+  }
+
+  static constexpr int nrets = LUA_MULTRET;
+};
+
+// It only reads numbers and strings, so resuming a task needs no protection
+template <>
+struct return_pop_cant_fail<scheduler_wake_helper> : std::true_type {};
+
+inline void
+scheduler_budget_hook(lua_State * L, lua_Debug *, void *) {
+  if (lua_isyieldable(L)) { lua_yield(L, 0); }
+}
+
+} // end namespace detail
+
+//[ primer_scheduler
+class scheduler {
+public:
+  using ticket = std::uint64_t;
+
+private:
+  using sleeper = std::pair<std::uint64_t, std::size_t>; // wake tick, task
+
+  struct task {
+    coroutine co;
+    lua_ref_seq resume_args;     // Results for a completed `await`
+    std::vector<ticket> tickets; // Made while it ran, and not awaited yet
+  };
+
+  static constexpr std::size_t no_task = static_cast<std::size_t>(-1);
+
+  std::vector<task> tasks_;
+  std::vector<std::size_t> free_;
+  std::vector<std::size_t> ready_;
+  std::vector<std::size_t> batch_;
+  std::priority_queue<sleeper, std::vector<sleeper>, std::greater<sleeper>>
+    sleeping_;
+  std::unordered_map<std::string, std::vector<std::size_t>> waiting_;
+  std::unordered_map<ticket, std::size_t> awaiting_;
+  std::unordered_map<ticket, lua_ref_seq> completed_early_;
+  std::unordered_map<ticket, std::size_t> owners_; // Tickets not awaited yet
+  std::vector<primer::error> errors_;
+  coroutine_pool pool_;
+  lua_state_ref sref_;
+  std::uint64_t now_ = 0;
+  ticket last_ticket_ = 0;
+  int budget_ = 0;
+  std::size_t live_ = 0;
+  std::size_t running_ = no_task;
+
+  //<-
+  void forget_ticket(ticket t) noexcept;
+  void park(std::size_t idx, ticket t);
+  std::size_t add_task(coroutine && c);
+  void drop_task(std::size_t idx) noexcept;
+  void resume_task(std::size_t idx);
+  //->
+public:
+  scheduler() = default;
+
+  // Borrow the task threads from a pool
+  explicit scheduler(coroutine_pool pool) : pool_(std::move(pool)) {}
+
+  scheduler(const scheduler &) = delete;
+  scheduler & operator=(const scheduler &) = delete;
+
+  /*<< Add a task which calls `f`, ready on the next tick. Returns false if
+       `f` is empty or its state is gone.
+       Note: Can cause lua memory allocation failure >>*/
+  bool spawn(const bound_function & f);
+
+  // Wake every task which is waiting on this signal, for the next tick.
+  void signal(const std::string & name);
+
+  /*<< A new ticket, for a task to `await`. If a task is running, the ticket
+       belongs to it. >>*/
+  ticket make_ticket();
+
+  /*<< For use in a C function called by a task, as
+       `return primer::scheduler::await(L, t);`. Suspends the task until
+       `complete(t, ...)` is called. >>*/
+  static int await(lua_State * L, ticket t);
+
+  /*<< Wake the task awaiting `t`, for the next tick. The values become the
+       results of the C function which awaited. The values are dropped if
+       the task which the ticket belongs to has ended. Returns false if the
+       values could not be captured. Note: Can cause lua memory allocation failure
+       only if there is no protection. >>*/
+  template <typename... Args>
+  bool complete(ticket t, Args &&... results);
+
+  /*<< As `complete`, with results which are already references, e.g. taken
+       from the stack by `pop_n`. >>*/
+  void complete_seq(ticket t, lua_ref_seq results);
+
+  /*<< Advance the clock, and resume each task which is ready, once.
+       Returns the number of tasks resumed. >>*/
+  std::size_t tick();
+
+  // Instructions per resume before a task is preempted. 0 means no limit.
+  void set_budget(int instructions) noexcept { budget_ = instructions; }
+  int budget() const noexcept { return budget_; }
+
+  std::uint64_t now() const noexcept { return now_; }
+
+  // Number of tasks which haven't finished
+  std::size_t size() const noexcept { return live_; }
+
+  // Number of tasks which coming ticks will resume by themselves, i.e. which
+  // are ready or sleeping, rather than waiting on a signal or a ticket
+  std::size_t pending() const noexcept {
+    return ready_.size() + sleeping_.size();
+  }
+
+  // Errors raised by tasks since the last call
+  std::vector<primer::error> take_errors() noexcept {
+    std::vector<primer::error> result;
+    result.swap(errors_);
+    return result;
+  }
+};
+//]
+
+inline std::size_t
+scheduler::add_task(coroutine && c) {
+  std::size_t idx;
+  if (free_.empty()) {
+    idx = tasks_.size();
+    tasks_.emplace_back(task{std::move(c), lua_ref_seq{}, {}});
+  } else {
+    idx = free_.back();
+    free_.pop_back();
+    tasks_[idx].co = std::move(c);
+  }
+  ++live_;
+  return idx;
+}
+
+inline void
+scheduler::drop_task(std::size_t idx) noexcept {
+  tasks_[idx].co.reset();
+  tasks_[idx].resume_args.clear();
+  // Values completed early for its tickets would never be taken
+  for (ticket t : tasks_[idx].tickets) {
+    owners_.erase(t);
+    completed_early_.erase(t);
+  }
+  tasks_[idx].tickets.clear();
+  free_.push_back(idx);
+  --live_;
+}
+
+inline bool
+scheduler::spawn(const bound_function & f) {
+  coroutine c = pool_ ? coroutine{pool_, f} : coroutine{f};
+  if (!c) { return false; }
+  if (!sref_.lock()) { sref_ = primer::obtain_state_ref(c.lock()); }
+  ready_.push_back(this->add_task(std::move(c)));
+  return true;
+}
+
+inline void
+scheduler::signal(const std::string & name) {
+  auto it = waiting_.find(name);
+  if (it == waiting_.end()) { return; }
+  ready_.insert(ready_.end(), it->second.begin(), it->second.end());
+  waiting_.erase(it);
+}
+
+inline int
+scheduler::await(lua_State * L, ticket t) {
+  luaL_checkstack(L, 2, "not enough stack space");
+  lua_pushlightuserdata(L, detail::scheduler_await_key());
+  lua_pushinteger(L, static_cast<lua_Integer>(t));
+  return lua_yield(L, 2);
+}
+
+inline scheduler::ticket
+scheduler::make_ticket() {
+  const ticket t = last_ticket_ + 1;
+  owners_.emplace(t, running_);
+  if (running_ != no_task) { tasks_[running_].tickets.push_back(t); }
+  last_ticket_ = t;
+  return t;
+}
+
+inline void
+scheduler::forget_ticket(ticket t) noexcept {
+  auto it = owners_.find(t);
+  if (it == owners_.end()) { return; }
+  if (it->second != no_task) {
+    std::vector<ticket> & v = tasks_[it->second].tickets;
+    auto pos = std::find(v.begin(), v.end(), t);
+    if (pos != v.end()) {
+      *pos = v.back();
+      v.pop_back();
+    }
+  }
+  owners_.erase(it);
+}
+
+inline void
+scheduler::park(std::size_t idx, ticket t) {
+  this->forget_ticket(t);
+  auto it = completed_early_.find(t);
+  if (it != completed_early_.end()) {
+    tasks_[idx].resume_args = std::move(it->second);
+    completed_early_.erase(it);
+    ready_.push_back(idx);
+  } else {
+    awaiting_[t] = idx;
+  }
+}
+
+template <typename... Args>
+bool
+scheduler::complete(ticket t, Args &&... results) {
+  lua_State * L = sref_.lock();
+  lua_ref_seq seq;
+  if (sizeof...(Args)) {
+    if (!L || !detail::check_stack_push_each<Args...>(L)) { return false; }
+    auto ok = mem_pcall(L, [&]() {
+      primer::push_each(L, std::forward<Args>(results)...);
+      primer::pop_n(L, sizeof...(Args), seq);
+    });
+    if (!ok) { return false; }
+  }
+  this->complete_seq(t, std::move(seq));
+  return true;
+}
+
+inline void
+scheduler::complete_seq(ticket t, lua_ref_seq results) {
+  auto it = awaiting_.find(t);
+  if (it != awaiting_.end()) {
+    tasks_[it->second].resume_args = std::move(results);
+    ready_.push_back(it->second);
+    awaiting_.erase(it);
+  } else if (owners_.count(t)) {
+    completed_early_[t] = std::move(results);
+  }
+}
+
+inline void
+scheduler::resume_task(std::size_t idx) {
+  coroutine & c = tasks_[idx].co;
+  lua_State * T = c.thread_stack_;
+  if (!c || !T) {
+    this->drop_task(idx);
+    return;
+  }
+
+  // Without a budget, e.g. if the thread has a hook which isn't shared
+  hook_mux::subscription budget_hook = -1;
+  if (budget_) {
+    if (auto s = hook_mux::subscribe(T, &detail::scheduler_budget_hook,
+                                     nullptr, 0, budget_)) {
+      budget_hook = *s;
+    }
+  }
+  using wake_t = detail::scheduler_wake;
+  using helper_t = detail::scheduler_wake_helper;
+  expected<wake_t> result{primer::error::expired_coroutine()};
+  running_ = idx;
+  if (tasks_[idx].resume_args.size()) {
+    lua_ref_seq args{std::move(tasks_[idx].resume_args)};
+    tasks_[idx].resume_args.clear();
+    result = c.protected_call2<wake_t, helper_t>(args);
+  } else {
+    result = c.protected_call<wake_t, helper_t>();
+  }
+  running_ = no_task;
+  if (budget_hook >= 0) { hook_mux::unsubscribe(T, budget_hook); }
+
+  if (!c) {
+    if (!result) { errors_.emplace_back(std::move(result.err())); }
+    this->drop_task(idx);
+  } else if (!result) {
+    // Failed to resume at all, e.g. out of memory. Try again next tick.
+    errors_.emplace_back(std::move(result.err()));
+    ready_.push_back(idx);
+  } else if (result->kind == detail::scheduler_wake::sleep
+             && result->ticks > 0) {
+    sleeping_.emplace(now_ + static_cast<std::uint64_t>(result->ticks), idx);
+  } else if (result->kind == detail::scheduler_wake::wait) {
+    waiting_[result->signal].push_back(idx);
+  } else if (result->kind == detail::scheduler_wake::await) {
+    this->park(idx, static_cast<ticket>(result->ticks));
+  } else {
+    ready_.push_back(idx);
+  }
+}
+
+inline std::size_t
+scheduler::tick() {
+  ++now_;
+  while (!sleeping_.empty() && sleeping_.top().first <= now_) {
+    ready_.push_back(sleeping_.top().second);
+    sleeping_.pop();
+  }
+
+  // Tasks which become ready during this tick run on the next one
+  batch_.clear();
+  batch_.swap(ready_);
+  for (std::size_t idx : batch_) {
+    this->resume_task(idx);
+  }
+  return batch_.size();
+}
+
+} // end namespace primer
@@ -0,0 +1,250 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A shared buffer is an immutable block of numbers, owned by an atomically
+ * reference counted pointer, which can be pushed into any number of lua VMs
+ * without copying the elements.
+ *
+ * Pushing one makes a small userdata which holds a copy of the handle. From
+ * lua, it behaves like a read-only sequence, supporting `#b` and `b[i]`.
+ * Indexing is 1-based, reading out of range elements gives `nil`, and writing
+ * is an error. Reading a `primer::shared_buffer<T>` hands the same block back
+ * to C++.
+ *
+ * Within one VM, pushing the same block again gives the same userdata, as long
+ * as the first one is alive.
+ *
+ * The elements are not persisted. A buffer can only be persisted if it is
+ * registered by name with the `primer::api::shared_buffers` feature, which
+ * makes it a permanent object, and otherwise persisting it is an error.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/adapt.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/push.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/read.hpp>
+#include <primer/result.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/diagnostics.hpp>
+#include <primer/support/userdata_common.hpp>
+#include <primer/traits/push.hpp>
+#include <primer/traits/read.hpp>
+#include <primer/traits/userdata.hpp>
+#include <primer/userdata.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+namespace detail {
+
+// Name of the metatable associated to each element type
+template <typename T>
+struct shared_buffer_name;
+
+#define PRIMER_SHARED_BUFFER_NAME(TYPE)                                        \
+  template <>                                                                  \
+  struct shared_buffer_name<TYPE> {                                            \
+    static constexpr const char * value() {                                    \
+      return "primer_shared_buffer<" #TYPE ">";                                \
+    }                                                                          \
+  }
+
+PRIMER_SHARED_BUFFER_NAME(unsigned char);
+PRIMER_SHARED_BUFFER_NAME(int);
+PRIMER_SHARED_BUFFER_NAME(long);
+PRIMER_SHARED_BUFFER_NAME(long long);
+PRIMER_SHARED_BUFFER_NAME(unsigned int);
+PRIMER_SHARED_BUFFER_NAME(unsigned long);
+PRIMER_SHARED_BUFFER_NAME(unsigned long long);
+PRIMER_SHARED_BUFFER_NAME(float);
+PRIMER_SHARED_BUFFER_NAME(double);
+
+#undef PRIMER_SHARED_BUFFER_NAME
+
+} // end namespace detail
+
+//[ primer_shared_buffer
+template <typename T>
+class shared_buffer {
+  PRIMER_STATIC_ASSERT(std::is_arithmetic<T>::value,
+                       "shared_buffer holds only arithmetic types");
+
+  std::shared_ptr<const T> data_;
+  std::size_t size_ = 0;
+
+public:
+  shared_buffer() noexcept = default;
+
+  /// Shares a block of `n` elements which `data` owns
+  shared_buffer(std::shared_ptr<const T> data, std::size_t n) noexcept
+    : data_(std::move(data))
+    , size_(data_ ? n : 0) {}
+
+  /// Takes over the elements of a vector, without copying them
+  explicit shared_buffer(std::vector<T> v) {
+    auto owner = std::make_shared<const std::vector<T>>(std::move(v));
+    size_ = owner->size();
+    data_ = std::shared_ptr<const T>(owner, owner->data());
+  }
+
+  /// A new block, copying `n` elements from `src`
+  static shared_buffer copy_of(const T * src, std::size_t n) {
+    return shared_buffer{std::vector<T>(src, src + n)};
+  }
+
+  const T * data() const noexcept { return data_.get(); }
+  std::size_t size() const noexcept { return size_; }
+  bool empty() const noexcept { return !size_; }
+
+  const T * begin() const noexcept { return data(); }
+  const T * end() const noexcept { return data() + size_; }
+
+  const T & operator[](std::size_t i) const noexcept { return data()[i]; }
+
+  /// Number of handles to the block, in C++ and in all VMs
+  long use_count() const noexcept { return data_.use_count(); }
+};
+//]
+
+namespace detail {
+
+template <typename T>
+void
+shared_buffer_push_elem(lua_State * L, const T & t) {
+  primer::push(L, t);
+}
+
+// Bytes are pushed as integers, not as characters
+inline void
+shared_buffer_push_elem(lua_State * L, const unsigned char & c) {
+  lua_pushinteger(L, c);
+}
+
+template <typename T>
+primer::result
+shared_buffer_index(lua_State * L, const shared_buffer<T> & b, LUA_INTEGER i) {
+  if (i >= 1 && static_cast<std::size_t>(i) <= b.size()) {
+    shared_buffer_push_elem(L, b[static_cast<std::size_t>(i - 1)]);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+template <typename T>
+primer::result
+shared_buffer_newindex(lua_State *, const shared_buffer<T> &) {
+  return primer::error{"shared_buffer is read-only"};
+}
+
+template <typename T>
+primer::result
+shared_buffer_len(lua_State * L, const shared_buffer<T> & b) {
+  lua_pushinteger(L, static_cast<LUA_INTEGER>(b.size()));
+  return 1;
+}
+
+// Registry table, for each element type, from the address of each block to
+// the userdata which holds it, with weak values
+template <typename T>
+void
+shared_buffer_memo(lua_State * L) {
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+}
+
+} // end namespace detail
+
+namespace traits {
+
+template <typename T>
+struct userdata<primer::shared_buffer<T>> {
+  static constexpr const char * name = detail::shared_buffer_name<T>::value();
+
+  static void metatable(lua_State * L) {
+    PRIMER_ASSERT_TABLE(L);
+    lua_pushcfunction(L, PRIMER_ADAPT(&detail::shared_buffer_index<T>));
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, PRIMER_ADAPT(&detail::shared_buffer_newindex<T>));
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, PRIMER_ADAPT(&detail::shared_buffer_len<T>));
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, &detail::common_gc_impl<primer::shared_buffer<T>>);
+    lua_setfield(L, -2, "__gc");
+    // The handle can't be written as data. Registered buffers are permanent
+    // objects, which eris looks up before it gets here.
+    lua_pushboolean(L, false);
+    lua_setfield(L, -2, "__persist");
+    lua_pushstring(L, name);
+    lua_setfield(L, -2, "__metatable");
+  }
+};
+
+template <typename T>
+constexpr const char * userdata<primer::shared_buffer<T>>::name;
+
+template <typename T>
+struct push<primer::shared_buffer<T>> {
+  static void to_stack(lua_State * L, const primer::shared_buffer<T> & b) {
+    if (!b.data()) {
+      primer::push_udata<primer::shared_buffer<T>>(L, b);
+      return;
+    }
+
+    primer::push_singleton<&detail::shared_buffer_memo<T>>(L);
+    const void * key = b.data();
+    lua_rawgetp(L, -1, key);
+    if (auto * u = primer::test_udata<primer::shared_buffer<T>>(L, -1)) {
+      if (u->size() == b.size()) {
+        lua_remove(L, -2);
+        return;
+      }
+    }
+    lua_pop(L, 1);
+    primer::push_udata<primer::shared_buffer<T>>(L, b);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, -3, key);
+    lua_remove(L, -2);
+  }
+
+  static constexpr int stack_space_needed{4};
+};
+
+template <typename T>
+struct read<primer::shared_buffer<T>> {
+  static expected<primer::shared_buffer<T>> from_stack(lua_State * L,
+                                                       int idx) {
+    if (auto * u = primer::test_udata<primer::shared_buffer<T>>(L, idx)) {
+      return *u;
+    }
+    return primer::error{"Expected userdata '",
+                         primer::udata_name<primer::shared_buffer<T>>(),
+                         "', found ", primer::describe_lua_value(L, idx)};
+  }
+
+  static constexpr int stack_space_needed{1};
+};
+
+} // end namespace traits
+
+} // end namespace primer
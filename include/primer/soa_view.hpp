@@ -0,0 +1,619 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A soa view gives scripts the columns of a struct-of-arrays, like the
+ * components of an ECS, in place, without copying them into tables.
+ *
+ * The C++ side is a `primer::soa_columns`, which borrows a pointer to each
+ * column, with a name, and says how many rows they all have:
+ *
+ *   std::vector<float> x, y;
+ *   primer::soa_columns cols{x.size()};
+ *   cols.add("x", x.data());
+ *   cols.add("y", y.data());
+ *   primer::push_soa_view(L, cols);
+ *
+ * From lua, the view is read by rows or by columns:
+ *
+ *   view[i].x = view[i].x + view[i].y     -- a row proxy for row i
+ *   local xs = view.x                     -- a column proxy
+ *   for i = 1, #xs do xs[i] = xs[i] * 2 end
+ *
+ * `#view` and `#view.x` are the number of rows. Indexing is 1-based. Reading
+ * an out of range row, or an unknown column, gives `nil`, and writing them is
+ * an error. A column added with a pointer to const is read-only.
+ *
+ * A new proxy is made for each `view[i]` and `view.x`, so hot loops should
+ * keep the column proxies in locals, and index those.
+ *
+ * The columns may be passed to the functions of `api::array_algorithms`, and
+ * of `PRIMER_ADAPT_VECTORIZED`, wherever they take a typed array, e.g.
+ * `array.sum(view.x)` or `array.scale(view.x, 2, view.x)`. They run on the
+ * C++ storage directly. C++ callbacks can take either, by reading
+ * `primer::detail::array_ref<T>`.
+ *
+ * The view, and its proxies, hold a `nonstd::weak_ref` to the `soa_columns`.
+ * When it is destroyed, or `clear`ed because the storage moved, they expire,
+ * and using them raises an error. After `clear`, the columns can be added
+ * again, and views pushed after that see them. The storage itself is not
+ * tracked: it must stay where it is while the columns point to it.
+ *
+ * A soa view is persisted by copy: it is restored as a view of columns which
+ * it owns, in typed arrays, and a column proxy as a typed array. The elements
+ * are persisted as one string per column, see <primer/support/raw_persist.hpp>.
+ * The reconstructors are registered by `api::array_algorithms`. A row proxy
+ * can't be persisted.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/adapt.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/push.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/read.hpp>
+#include <primer/result.hpp>
+#include <primer/support/alloc_scope.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/diagnostics.hpp>
+#include <primer/traits/read.hpp>
+#include <primer/typed_array.hpp>
+#include <primer/userdata.hpp>
+#include <primer/weak_ref.hpp>
+
+#include <cstddef>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+namespace detail {
+
+template <typename T>
+void
+soa_push_element(lua_State * L, const void * data, std::size_t i) {
+  primer::push(L, static_cast<const T *>(data)[i]);
+}
+
+template <typename T>
+expected<void>
+soa_store_element(lua_State * L, void * data, std::size_t i, int idx) {
+  auto v = primer::read<T>(L, idx);
+  if (!v) { return std::move(v.err()); }
+  static_cast<T *>(data)[i] = *v;
+  return {};
+}
+
+template <typename T>
+void
+soa_save_column(lua_State * L, const void * data, std::size_t n) {
+  detail::push_typed_array_restore<T>(L, static_cast<const T *>(data), n);
+}
+
+} // end namespace detail
+
+//[ primer_soa_columns
+class soa_columns {
+public:
+  struct column {
+    std::string name;
+    void * data;
+    bool read_only;
+    // The element type is the one which these were instantiated for
+    void (*push)(lua_State *, const void *, std::size_t);
+    expected<void> (*store)(lua_State *, void *, std::size_t, int);
+    // Pushes the reconstructor of a typed array copy of `n` elements
+    void (*save)(lua_State *, const void *, std::size_t);
+
+    template <typename T>
+    bool holds() const noexcept {
+      return push == &detail::soa_push_element<T>;
+    }
+  };
+
+private:
+  std::vector<column> columns_;
+  std::size_t rows_;
+  nonstd::master_ref<soa_columns> ref_;
+
+  template <typename T>
+  void add_column(const char * name, T * data, bool read_only) {
+    PRIMER_STATIC_ASSERT(std::is_arithmetic<T>::value,
+                         "soa columns hold only arithmetic types");
+    columns_.push_back(column{name, static_cast<void *>(data), read_only,
+                              &detail::soa_push_element<T>,
+                              &detail::soa_store_element<T>,
+                              &detail::soa_save_column<T>});
+  }
+
+public:
+  /// Note: Can throw std::bad_alloc
+  explicit soa_columns(std::size_t rows = 0)
+    : columns_()
+    , rows_(rows)
+    , ref_(this) {}
+
+  soa_columns(const soa_columns &) = delete;
+  soa_columns & operator=(const soa_columns &) = delete;
+
+  /// Add a column of `rows()` elements at `data`. The element type is one of
+  /// those of `typed_array`. Note: Can throw std::bad_alloc
+  template <typename T>
+  void add(const char * name, T * data) {
+    this->add_column(name, data, false);
+  }
+
+  template <typename T>
+  void add(const char * name, const T * data) {
+    this->add_column(name, const_cast<T *>(data), true);
+  }
+
+  std::size_t rows() const noexcept { return rows_; }
+  void set_rows(std::size_t n) noexcept { rows_ = n; }
+
+  const std::vector<column> & columns() const noexcept { return columns_; }
+
+  // The column of a name, or nullptr
+  const column * find(const char * name) const noexcept {
+    for (const column & c : columns_) {
+      if (c.name == name) { return &c; }
+    }
+    return nullptr;
+  }
+
+  /// Remove the columns, and expire the views made so far.
+  /// Note: Can throw std::bad_alloc
+  void clear() {
+    ref_ = nonstd::master_ref<soa_columns>{this};
+    columns_.clear();
+  }
+
+  nonstd::weak_ref<soa_columns> get_weak_ref() const noexcept {
+    return nonstd::weak_ref<soa_columns>{ref_};
+  }
+};
+
+/// Push a view of the columns
+inline void push_soa_view(lua_State * L, const soa_columns & cols);
+
+/// Test if an entry on the stack is a column proxy, whose columns are alive
+/// and have elements of type `T`, and if so, return the column
+template <typename T>
+const soa_columns::column * test_soa_column(lua_State * L, int idx,
+                                            std::size_t * rows);
+//]
+
+namespace detail {
+
+// The view, and the proxies of its rows and columns. A column is kept by its
+// position, since adding columns may move the others.
+struct soa_view_udata {
+  nonstd::weak_ref<soa_columns> ref;
+};
+
+struct soa_row_udata {
+  nonstd::weak_ref<soa_columns> ref;
+  std::size_t row;
+};
+
+struct soa_column_udata {
+  nonstd::weak_ref<soa_columns> ref;
+  std::size_t col;
+};
+
+template <typename U>
+int
+soa_gc(lua_State * L) noexcept {
+  static_cast<U *>(lua_touserdata(L, 1))->~U();
+  return 0;
+}
+
+template <typename U>
+U &
+soa_self(lua_State * L) {
+  return *static_cast<U *>(lua_touserdata(L, 1));
+}
+
+template <typename U>
+soa_columns &
+soa_lock(lua_State * L) {
+  soa_columns * c = soa_self<U>(L).ref.lock();
+  if (!c) { luaL_error(L, "soa_view: the columns were released"); }
+  return *c;
+}
+
+// Reads a 1-based index, or returns `n`
+inline std::size_t
+soa_index(lua_State * L, int idx, std::size_t n) {
+  int isnum = 0;
+  const LUA_INTEGER i = lua_tointegerx(L, idx, &isnum);
+  if (isnum && i >= 1 && static_cast<std::size_t>(i) <= n) {
+    return static_cast<std::size_t>(i - 1);
+  }
+  return n;
+}
+
+inline primer::result
+soa_store(lua_State * L, const soa_columns::column & c, std::size_t row,
+          int idx) {
+  if (c.read_only) {
+    return primer::error{"soa_view: column '", c.name, "' is read-only"};
+  }
+  auto ok = c.store(L, c.data, row, idx);
+  if (!ok) { return std::move(ok.err()); }
+  return 0;
+}
+
+template <typename U>
+void
+soa_metatable(lua_State * L, lua_CFunction index) {
+  lua_createtable(L, 0, 6);
+  lua_pushcfunction(L, &soa_gc<U>);
+  lua_setfield(L, -2, "__gc");
+  lua_pushcfunction(L, index);
+  lua_setfield(L, -2, "__index");
+  lua_pushboolean(L, false);
+  lua_setfield(L, -2, "__persist");
+}
+
+template <typename U, void (*metatable)(lua_State *)>
+void
+soa_push(lua_State * L, U && u) {
+  PRIMER_ALLOC_SCOPE(nullptr, "soa_view");
+  // One user value, for the owner of the columns, see `soa_share_owner`
+  new (detail::newuserdata(L, sizeof(U), 1)) U(std::move(u));
+  primer::push_singleton<metatable>(L);
+  lua_setmetatable(L, -2);
+}
+
+// Row proxy
+
+inline const soa_columns::column *
+soa_row_column(lua_State * L, std::size_t * row) {
+  soa_columns & c = soa_lock<soa_row_udata>(L);
+  *row = soa_self<soa_row_udata>(L).row;
+  if (*row >= c.rows()) {
+    luaL_error(L, "soa_view: row %d was removed", static_cast<int>(*row + 1));
+  }
+  const char * name = lua_tostring(L, 2);
+  return name ? c.find(name) : nullptr;
+}
+
+inline int
+soa_row_index(lua_State * L) {
+  std::size_t row;
+  if (const soa_columns::column * col = soa_row_column(L, &row)) {
+    col->push(L, col->data, row);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+inline primer::result
+soa_row_newindex_impl(lua_State * L) {
+  std::size_t row;
+  const soa_columns::column * col = soa_row_column(L, &row);
+  if (!col) {
+    return primer::error{"soa_view: no column ", describe_lua_value(L, 2)};
+  }
+  return soa_store(L, *col, row, 3);
+}
+
+inline int
+soa_row_newindex(lua_State * L) {
+  using helper_t =
+    adapt<primer::result (*)(lua_State *), &soa_row_newindex_impl>;
+  return helper_t::adapted(L);
+}
+
+inline void
+soa_row_metatable(lua_State * L) {
+  soa_metatable<soa_row_udata>(L, &soa_row_index);
+  lua_pushcfunction(L, &soa_row_newindex);
+  lua_setfield(L, -2, "__newindex");
+}
+
+// Column proxy
+
+inline const soa_columns::column &
+soa_column_of(lua_State * L, const soa_columns & c) {
+  return c.columns()[soa_self<soa_column_udata>(L).col];
+}
+
+inline int
+soa_column_index(lua_State * L) {
+  const soa_columns & c = soa_lock<soa_column_udata>(L);
+  const std::size_t i = soa_index(L, 2, c.rows());
+  if (i < c.rows()) {
+    const soa_columns::column & col = soa_column_of(L, c);
+    col.push(L, col.data, i);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+inline primer::result
+soa_column_newindex_impl(lua_State * L) {
+  const soa_columns & c = soa_lock<soa_column_udata>(L);
+  const std::size_t i = soa_index(L, 2, c.rows());
+  if (i == c.rows()) {
+    return primer::error{"Index ", describe_lua_value(L, 2),
+                         " out of bounds, size is ", c.rows()};
+  }
+  return soa_store(L, soa_column_of(L, c), i, 3);
+}
+
+inline int
+soa_column_newindex(lua_State * L) {
+  using helper_t =
+    adapt<primer::result (*)(lua_State *), &soa_column_newindex_impl>;
+  return helper_t::adapted(L);
+}
+
+inline int
+soa_column_len(lua_State * L) {
+  const soa_columns & c = soa_lock<soa_column_udata>(L);
+  lua_pushinteger(L, static_cast<LUA_INTEGER>(c.rows()));
+  return 1;
+}
+
+// A column is persisted as a typed array with a copy of its elements
+inline int
+soa_column_persist(lua_State * L) {
+  const soa_columns & c = soa_lock<soa_column_udata>(L);
+  const soa_columns::column & col = soa_column_of(L, c);
+  col.save(L, col.data, c.rows());
+  return 1;
+}
+
+inline void
+soa_column_metatable(lua_State * L) {
+  soa_metatable<soa_column_udata>(L, &soa_column_index);
+  lua_pushcfunction(L, &soa_column_newindex);
+  lua_setfield(L, -2, "__newindex");
+  lua_pushcfunction(L, &soa_column_len);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, &soa_column_persist);
+  lua_setfield(L, -2, "__persist");
+}
+
+// View
+
+// A proxy shares the user value of its view, which owns the columns of a
+// restored view
+inline void
+soa_share_owner(lua_State * L) {
+  lua_getuservalue(L, 1);
+  lua_setuservalue(L, -2);
+}
+
+inline int
+soa_view_index(lua_State * L) {
+  const soa_columns & c = soa_lock<soa_view_udata>(L);
+  const auto & ref = soa_self<soa_view_udata>(L).ref;
+  if (lua_type(L, 2) == LUA_TSTRING) {
+    if (const soa_columns::column * col = c.find(lua_tostring(L, 2))) {
+      const std::size_t j = static_cast<std::size_t>(col - &c.columns()[0]);
+      soa_push<soa_column_udata, &soa_column_metatable>(
+        L, soa_column_udata{ref, j});
+      soa_share_owner(L);
+      return 1;
+    }
+  } else {
+    const std::size_t i = soa_index(L, 2, c.rows());
+    if (i < c.rows()) {
+      soa_push<soa_row_udata, &soa_row_metatable>(L, soa_row_udata{ref, i});
+      soa_share_owner(L);
+      return 1;
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+inline int
+soa_view_len(lua_State * L) {
+  const soa_columns & c = soa_lock<soa_view_udata>(L);
+  lua_pushinteger(L, static_cast<LUA_INTEGER>(c.rows()));
+  return 1;
+}
+
+// A view is persisted by copy. It is restored as a view of columns which it
+// owns: a `soa_copy_udata` in its user value holds them, and the typed arrays
+// which are their storage are in the user value of that. The upvalues of the
+// reconstructor are pairs of a column name and the reconstructor of its copy.
+constexpr int soa_persist_max_columns = 127;
+
+struct soa_copy_udata {
+  soa_columns cols;
+};
+
+inline void
+soa_copy_metatable(lua_State * L) {
+  lua_createtable(L, 0, 2);
+  lua_pushcfunction(L, &soa_gc<soa_copy_udata>);
+  lua_setfield(L, -2, "__gc");
+  lua_pushboolean(L, false);
+  lua_setfield(L, -2, "__persist");
+}
+
+// Adds the typed array on top of the stack as a column, if it is one of `T`
+template <typename T>
+bool
+soa_adopt(lua_State * L, soa_columns & c, const char * name) {
+  typed_array<T> * a = primer::test_udata<typed_array<T>>(L, -1);
+  if (!a) { return false; }
+  if (c.columns().empty()) {
+    c.set_rows(a->size());
+  } else if (a->size() != c.rows()) {
+    luaL_error(L, "soa_view: persisted columns differ in length");
+  }
+  bool ok = true;
+  PRIMER_TRY_BAD_ALLOC { c.add(name, a->data()); }
+  PRIMER_CATCH_BAD_ALLOC { ok = false; }
+  if (!ok) { luaL_error(L, "not enough memory"); }
+  return true;
+}
+
+inline int
+soa_view_restore(lua_State * L) {
+  int n = 0;
+  while (n < 2 * soa_persist_max_columns
+         && lua_type(L, lua_upvalueindex(n + 1)) == LUA_TSTRING) {
+    n += 2;
+  }
+  // One user value, which holds the typed arrays of the columns
+  void * storage = detail::newuserdata(L, sizeof(soa_copy_udata), 1);
+  soa_copy_udata * copy = nullptr;
+  PRIMER_TRY_BAD_ALLOC { copy = new (storage) soa_copy_udata{}; }
+  PRIMER_CATCH_BAD_ALLOC {}
+  if (!copy) { return luaL_error(L, "not enough memory"); }
+  primer::push_singleton<&soa_copy_metatable>(L);
+  lua_setmetatable(L, -2);
+  soa_columns & c = copy->cols;
+  lua_createtable(L, n / 2, 0);
+  for (int i = 1; i < n; i += 2) {
+    lua_pushvalue(L, lua_upvalueindex(i + 1));
+    lua_call(L, 0, 1);
+    const char * name = lua_tostring(L, lua_upvalueindex(i));
+    if (!soa_adopt<int>(L, c, name) && !soa_adopt<long>(L, c, name)
+        && !soa_adopt<long long>(L, c, name)
+        && !soa_adopt<unsigned int>(L, c, name)
+        && !soa_adopt<unsigned long>(L, c, name)
+        && !soa_adopt<unsigned long long>(L, c, name)
+        && !soa_adopt<float>(L, c, name) && !soa_adopt<double>(L, c, name)) {
+      return luaL_error(L, "soa_view: column '%s' is not a typed array", name);
+    }
+    lua_rawseti(L, -2, (i + 1) / 2);
+  }
+  lua_setuservalue(L, -2);
+  push_soa_view(L, c);
+  lua_insert(L, -2);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+inline int
+soa_view_persist(lua_State * L) {
+  const soa_columns & c = soa_lock<soa_view_udata>(L);
+  const std::size_t n = c.columns().size();
+  if (n > static_cast<std::size_t>(soa_persist_max_columns)) {
+    return luaL_error(L, "soa_view: can't persist more than %d columns",
+                      soa_persist_max_columns);
+  }
+  luaL_checkstack(L, static_cast<int>(2 * n) + 1, "soa_view persist");
+  for (const soa_columns::column & col : c.columns()) {
+    lua_pushlstring(L, col.name.data(), col.name.size());
+    col.save(L, col.data, c.rows());
+  }
+  lua_pushcclosure(L, &soa_view_restore, static_cast<int>(2 * n));
+  return 1;
+}
+
+inline void
+soa_view_metatable(lua_State * L) {
+  soa_metatable<soa_view_udata>(L, &soa_view_index);
+  lua_pushcfunction(L, &soa_view_len);
+  lua_setfield(L, -2, "__len");
+  lua_pushcfunction(L, &soa_view_persist);
+  lua_setfield(L, -2, "__persist");
+}
+
+} // end namespace detail
+
+inline void
+push_soa_view(lua_State * L, const soa_columns & cols) {
+  detail::soa_push<detail::soa_view_udata, &detail::soa_view_metatable>(
+    L, detail::soa_view_udata{cols.get_weak_ref()});
+}
+
+template <typename T>
+const soa_columns::column *
+test_soa_column(lua_State * L, int idx, std::size_t * rows) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  void * p = lua_touserdata(L, idx);
+  if (!p || !lua_getmetatable(L, idx)) { return nullptr; }
+  primer::push_singleton<&detail::soa_column_metatable>(L);
+  const bool is_column = lua_rawequal(L, -1, -2);
+  lua_pop(L, 2);
+  if (!is_column) { return nullptr; }
+
+  const auto & u = *static_cast<detail::soa_column_udata *>(p);
+  const soa_columns * c = u.ref.lock();
+  if (!c) { return nullptr; }
+  const soa_columns::column & col = c->columns()[u.col];
+  if (!col.template holds<T>()) { return nullptr; }
+  *rows = c->rows();
+  return &col;
+}
+
+namespace detail {
+
+// The elements of a typed array, or of a soa view column. `T` is const when
+// they are only read.
+template <typename T>
+class array_ref {
+  T * data_;
+  std::size_t size_;
+
+public:
+  array_ref(T * data, std::size_t size) noexcept
+    : data_(data)
+    , size_(size) {}
+
+  T * data() const noexcept { return data_; }
+  std::size_t size() const noexcept { return size_; }
+  T & operator[](std::size_t i) const noexcept { return data_[i]; }
+};
+
+// Test if an entry on the stack is a typed array, or a column, of `T`. A
+// read-only column is only taken when `T` is const.
+template <typename T>
+bool
+test_array_ref(lua_State * L, int idx, array_ref<T> * out) {
+  using E = typename std::remove_const<T>::type;
+  if (auto * a = primer::test_udata<typed_array<E>>(L, idx)) {
+    *out = array_ref<T>{a->data(), a->size()};
+    return true;
+  }
+  std::size_t rows;
+  const soa_columns::column * col = primer::test_soa_column<E>(L, idx, &rows);
+  if (!col || (col->read_only && !std::is_const<T>::value)) { return false; }
+  *out = array_ref<T>{static_cast<E *>(col->data), rows};
+  return true;
+}
+
+} // end namespace detail
+
+namespace traits {
+
+template <typename T>
+struct read<detail::array_ref<T>> {
+  static expected<detail::array_ref<T>> from_stack(lua_State * L, int idx) {
+    detail::array_ref<T> result{nullptr, 0};
+    if (!detail::test_array_ref(L, idx, &result)) {
+      return primer::arg_error(L, idx, "typed array");
+    }
+    return result;
+  }
+  static constexpr int stack_space_needed{2};
+};
+
+} // end namespace traits
+
+} // end namespace primer
@@ -0,0 +1,293 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Callback parameters which borrow a value on the stack, rather than binding
+ * it in the registry.
+ *
+ * Reading a `lua_ref` or `bound_function` makes a registry reference in a
+ * protected call. A callback which only uses the value before it returns can
+ * take a `stack_ref` or `stack_function` instead, which only remember the
+ * stack index of the argument. They can be pushed, read, and called while the
+ * callback runs, and `to_ref()` / `to_function()` make a persistent reference
+ * if the callback needs to keep the value.
+ *
+ * Like `table_view`, these are only valid while the value remains at the same
+ * stack index, e.g. for the duration of an adapted callback.
+ *
+ * They may be passed to the call methods of a `stack_function`, but not to
+ * those of a `bound_function` or `coroutine`, whose protected calls can't see
+ * the stack of the callback.
+ *
+ *   primer::result intf_each(lua_State * L, primer::stack_function f) {
+ *     for (const auto & e : entities_) {
+ *       auto ok = f.call_no_ret(e.name);
+ *       if (!ok) { return std::move(ok.err()); }
+ *     }
+ *     return 0;
+ *   }
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/bound_function.hpp>
+#include <primer/detail/type_traits.hpp>
+#include <primer/cpp_pcall.hpp>
+#include <primer/error.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/lua_ref_as.hpp>
+#include <primer/lua_ref_seq.hpp>
+#include <primer/push.hpp>
+#include <primer/read.hpp>
+#include <primer/support/function.hpp>
+#include <primer/support/function_check_stack.hpp>
+#include <primer/support/function_return.hpp>
+#include <primer/traits/read_type_mask.hpp>
+
+#include <type_traits>
+#include <utility>
+
+namespace primer {
+
+class stack_ref;
+class stack_function;
+
+namespace detail {
+
+template <typename A>
+using is_stack_borrowed = std::integral_constant<
+  bool, std::is_same<remove_cv_t<remove_reference_t<A>>, stack_ref>::value
+          || std::is_same<remove_cv_t<remove_reference_t<A>>,
+                          stack_function>::value>;
+
+template <typename... As>
+struct stack_borrowed_count : std::integral_constant<int, 0> {};
+
+template <typename A, typename... As>
+struct stack_borrowed_count<A, As...>
+  : std::integral_constant<int, is_stack_borrowed<A>::value
+                                  + stack_borrowed_count<As...>::value> {};
+
+} // end namespace detail
+
+//[ primer_stack_ref
+class stack_ref {
+  lua_State * L_;
+  int index_;
+
+public:
+  stack_ref(lua_State * L, int index) noexcept
+    : L_(L)
+    , index_(lua_absindex(L, index)) {}
+
+  lua_State * state() const noexcept { return L_; }
+  int index() const noexcept { return index_; }
+  int type() const noexcept { return lua_type(L_, index_); }
+
+  // False if the value is nil, or the argument was missing
+  explicit operator bool() const noexcept {
+    return !lua_isnoneornil(L_, index_);
+  }
+
+  /*<< Pushes the value onto the stack it is on. Doesn't check for stack
+       space. >>*/
+  void push() const noexcept { lua_pushvalue(L_, index_); }
+
+  /*<< Pushes the value onto `T`, which must be a thread of the same VM. >>*/
+  void push(lua_State * T) const noexcept {
+    lua_pushvalue(L_, index_);
+    if (T != L_) { lua_xmove(L_, T, 1); }
+  }
+
+  // Read the value as a C++ type
+  template <typename T>
+  expected<T> as() const {
+    return traits::read<T>::from_stack(L_, index_);
+  }
+
+  /*<< A persistent reference, as by reading a `lua_ref`. Needs a stack slot,
+       and is empty if the value is nil. >>*/
+  expected<lua_ref> to_ref() const { return this->as<lua_ref>(); }
+};
+
+class stack_function {
+  lua_State * L_;
+  int index_;
+
+  //<-
+
+  template <typename A>
+  using is_borrowed = detail::is_stack_borrowed<A>;
+
+  template <typename A>
+  static int prepush(lua_State *, const A &, std::false_type) noexcept {
+    return 0;
+  }
+
+  template <typename A>
+  static int prepush(lua_State * L, const A & a, std::true_type) noexcept {
+    lua_pushvalue(L, a.index());
+    return 1;
+  }
+
+  template <typename A>
+  static void push_arg(lua_State * L, int &, A && a, std::false_type) {
+    primer::push(L, std::forward<A>(a));
+  }
+
+  template <typename A>
+  static void push_arg(lua_State * L, int & pos, A &&, std::true_type) {
+    lua_pushvalue(L, pos++);
+  }
+
+  // As `bound_function::protected_call`, with the function found at our index
+  template <typename return_type,
+            typename helper = detail::return_helper<return_type>,
+            typename... Args>
+  expected<return_type> protected_call(Args &&... args) const noexcept {
+    expected<return_type> result{
+      primer::error::unexpected_static_value("function", "nil")};
+    if (!*this) { return result; }
+    lua_State * L = L_;
+    // Borrowed arguments are pushed before the protected call, which has its
+    // own frame, where their indices mean something else. They are then
+    // copied from there, in order with the other arguments. So the function
+    // and the borrowed arguments are on the stack twice.
+    if (auto stack_check =
+          detail::check_stack_push_each<int, int, Args..., Args...>(L)) {
+      constexpr int n = 1 + detail::stack_borrowed_count<Args...>::value;
+      lua_pushvalue(L, index_);
+      const int counts[] = {0, prepush(L, args, is_borrowed<Args>{})...};
+      static_cast<void>(counts);
+      auto ok = mem_pcall<n>(L, [&]() {
+        const int base = lua_gettop(L) - n + 1;
+        int pos = base + 1;
+        lua_pushvalue(L, base);
+        const int dummy[] = {0, (push_arg(L, pos, std::forward<Args>(args),
+                                          is_borrowed<Args>{}),
+                                 0)...};
+        static_cast<void>(dummy);
+        detail::fcn_call<return_type, helper>(result, L, sizeof...(args));
+        lua_settop(L, base - 1);
+      });
+      if (!ok) { result = std::move(ok.err()); }
+    } else {
+      result = std::move(stack_check.err());
+    }
+    return result;
+  }
+
+  //->
+public:
+  stack_function(lua_State * L, int index) noexcept
+    : L_(L)
+    , index_(lua_absindex(L, index)) {}
+
+  lua_State * state() const noexcept { return L_; }
+  int index() const noexcept { return index_; }
+
+  /*<< False if the argument was nil or missing >>*/
+  explicit operator bool() const noexcept {
+    return lua_isfunction(L_, index_);
+  }
+
+  void push() const noexcept { lua_pushvalue(L_, index_); }
+
+  // Call methods, as for `bound_function`, on the stack of the callback
+  template <typename... Args>
+  expected<void> call_no_ret(Args &&... args) const noexcept;
+
+  template <typename... Args>
+  expected<lua_ref> call_one_ret(Args &&... args) const noexcept;
+
+  template <typename... Args>
+  expected<lua_ref_seq> call(Args &&... args) const noexcept;
+
+  template <typename T, typename... Args>
+  expected<T> call_as(Args &&... args) const noexcept;
+
+  /*<< A persistent reference, as by reading a `bound_function`. Needs a stack
+       slot, and is empty if the value is nil. >>*/
+  expected<bound_function> to_function() const {
+    return traits::read<bound_function>::from_stack(L_, index_);
+  }
+};
+//]
+
+template <typename... Args>
+inline expected<void>
+stack_function::call_no_ret(Args &&... args) const noexcept {
+  return this->protected_call<void>(std::forward<Args>(args)...);
+}
+
+template <typename... Args>
+inline expected<lua_ref>
+stack_function::call_one_ret(Args &&... args) const noexcept {
+  return this->protected_call<lua_ref>(std::forward<Args>(args)...);
+}
+
+template <typename... Args>
+inline expected<lua_ref_seq>
+stack_function::call(Args &&... args) const noexcept {
+  return this->protected_call<lua_ref_seq>(std::forward<Args>(args)...);
+}
+
+template <typename T, typename... Args>
+inline expected<T>
+stack_function::call_as(Args &&... args) const noexcept {
+  return this->protected_call<T, detail::read_return_helper<T>>(
+    std::forward<Args>(args)...);
+}
+
+namespace traits {
+
+template <>
+struct push<primer::stack_ref> {
+  static void to_stack(lua_State * L, const stack_ref & r) { r.push(L); }
+  static constexpr int stack_space_needed{1};
+};
+
+template <>
+struct read<primer::stack_ref> {
+  static expected<stack_ref> from_stack(lua_State * L, int idx) {
+    return stack_ref{L, idx};
+  }
+  static constexpr int stack_space_needed{0};
+};
+
+template <>
+struct push<primer::stack_function> {
+  static void to_stack(lua_State * L, const stack_function & f) {
+    lua_pushvalue(f.state(), f.index());
+    if (L != f.state()) { lua_xmove(f.state(), L, 1); }
+  }
+  static constexpr int stack_space_needed{1};
+};
+
+template <>
+struct read<primer::stack_function> {
+  static expected<stack_function> from_stack(lua_State * L, int idx) {
+    if (lua_isnoneornil(L, idx) || lua_isfunction(L, idx)) {
+      return stack_function{L, idx};
+    }
+    return primer::arg_error(L, idx, "function");
+  }
+  static constexpr int stack_space_needed{0};
+};
+
+template <>
+struct read_type_mask<primer::stack_function>
+  : type_mask_constant<lua_type_bit(LUA_TNONE) | lua_type_bit(LUA_TNIL)
+                       | lua_type_bit(LUA_TFUNCTION)> {};
+
+} // end namespace traits
+} // end namespace primer
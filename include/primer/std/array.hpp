@@ -7,6 +7,9 @@
 
 /***
  * How to transport `std::array` to and from the stack, as tables
+ *
+ * If `traits::use_typed_array` is specialized for the array type, it is
+ * instead pushed as a `primer::typed_array` userdata.
  */
 
 #include <primer/base.hpp>
@@ -14,18 +17,43 @@
 PRIMER_ASSERT_FILESCOPE;
 
 #include <array>
+#include <primer/container/binary_base.hpp>
 #include <primer/container/seq_base.hpp>
+#include <primer/container/typed_array_base.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <primer/traits/ref_proxy.hpp>
+#include <primer/traits/typed_array.hpp>
+#include <type_traits>
 
 namespace primer {
 
 namespace traits {
 
 template <typename T, std::size_t N>
-struct push<std::array<T, N>> : container::push_seq_helper<std::array<T, N>> {};
+struct push<std::array<T, N>>
+  : std::conditional<use_typed_array<std::array<T, N>>::value,
+                     container::push_typed_array_helper<std::array<T, N>>,
+                     container::push_seq_helper<std::array<T, N>>>::type {};
 
 template <typename T, std::size_t N>
 struct read<std::array<T, N>>
-  : container::read_fixed_seq_helper<std::array<T, N>> {};
+  : std::conditional<
+      use_typed_array<std::array<T, N>>::value,
+      container::read_typed_array_fixed_seq_helper<std::array<T, N>>,
+      container::read_fixed_seq_helper<std::array<T, N>>>::type {};
+
+template <typename T, std::size_t N>
+struct read_type_mask<std::array<T, N>>
+  : type_mask_constant<seq_type_mask(use_typed_array<std::array<T, N>>::value)> {
+};
+
+template <typename T, std::size_t N>
+struct ref_proxy_access<std::array<T, N>>
+  : container::seq_proxy_helper<std::array<T, N>> {};
+
+template <typename T, std::size_t N>
+struct binary<std::array<T, N>>
+  : container::binary_fixed_seq_helper<std::array<T, N>> {};
 
 } // end namespace traits
 
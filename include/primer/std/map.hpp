@@ -14,17 +14,34 @@
 PRIMER_ASSERT_FILESCOPE;
 
 #include <map>
+#include <primer/container/binary_base.hpp>
 #include <primer/container/map_base.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <primer/traits/ref_proxy.hpp>
 
 namespace primer {
 
 namespace traits {
 
-template <typename T, typename U>
-struct push<std::map<T, U>> : container::map_push_helper<std::map<T, U>> {};
+template <typename T, typename U, typename C, typename A>
+struct push<std::map<T, U, C, A>>
+  : container::map_push_helper<std::map<T, U, C, A>> {};
 
-template <typename T, typename U>
-struct read<std::map<T, U>> : container::map_read_helper<std::map<T, U>> {};
+template <typename T, typename U, typename C, typename A>
+struct read<std::map<T, U, C, A>>
+  : container::map_read_helper<std::map<T, U, C, A>> {};
+
+template <typename T, typename U, typename C, typename A>
+struct read_type_mask<std::map<T, U, C, A>>
+  : type_mask_constant<table_type_mask> {};
+
+template <typename T, typename U, typename C, typename A>
+struct ref_proxy_access<std::map<T, U, C, A>>
+  : container::map_proxy_helper<std::map<T, U, C, A>> {};
+
+template <typename T, typename U, typename C, typename A>
+struct binary<std::map<T, U, C, A>>
+  : container::binary_map_helper<std::map<T, U, C, A>> {};
 
 } // end namespace traits
 
@@ -15,7 +15,10 @@ PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/error_capture.hpp>
 #include <primer/lua.hpp>
+#include <primer/table_pool.hpp>
+#include <primer/traits/binary.hpp>
 #include <primer/traits/push.hpp>
+#include <string>
 #include <utility>
 
 namespace primer {
@@ -30,6 +33,24 @@ struct push<std::pair<T, U>> {
     push<U>::to_stack(L, p.second);
     lua_rawseti(L, -2, 2);
   }
+
+  static void to_stack(lua_State * L, const std::pair<T, U> & p,
+                       table_pool & pool) {
+    pool.push_table(L, 2, 0);
+    primer::detail::push_pooled(L, p.first, pool);
+    lua_rawseti(L, -2, 1);
+    primer::detail::push_pooled(L, p.second, pool);
+    lua_rawseti(L, -2, 2);
+  }
+
+  static void to_stack(lua_State * L, std::pair<T, U> && p) {
+    lua_createtable(L, 2, 0);
+    push<T>::to_stack(L, std::move(p.first));
+    lua_rawseti(L, -2, 1);
+    push<U>::to_stack(L, std::move(p.second));
+    lua_rawseti(L, -2, 2);
+  }
+
   static constexpr int stack_space_needed = 2;
 };
 
@@ -76,5 +97,18 @@ struct read<std::pair<T, U>> {
   static constexpr int stack_space_needed = 1;
 };
 
+template <typename T, typename U>
+struct binary<std::pair<T, U>> {
+  static void write(std::string & out, const std::pair<T, U> & p) {
+    binary<T>::write(out, p.first);
+    binary<U>::write(out, p.second);
+  }
+
+  static bool read(const char *& pos, const char * end, std::pair<T, U> & p) {
+    return binary<T>::read(pos, end, p.first)
+           && binary<U>::read(pos, end, p.second);
+  }
+};
+
 } // end namespace traits
 } // end namespace primer
@@ -13,18 +13,29 @@
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <primer/container/binary_base.hpp>
 #include <primer/container/set_base.hpp>
+#include <primer/traits/read_type_mask.hpp>
 #include <set>
 
 namespace primer {
 
 namespace traits {
 
-template <typename T>
-struct push<std::set<T>> : container::set_push_helper<std::set<T>> {};
+template <typename T, typename C, typename A>
+struct push<std::set<T, C, A>>
+  : container::set_push_helper<std::set<T, C, A>> {};
 
-template <typename T>
-struct read<std::set<T>> : container::set_read_helper<std::set<T>> {};
+template <typename T, typename C, typename A>
+struct read<std::set<T, C, A>> : container::set_read_helper<std::set<T, C, A>> {};
+
+template <typename T, typename C, typename A>
+struct read_type_mask<std::set<T, C, A>> : type_mask_constant<table_type_mask> {
+};
+
+template <typename T, typename C, typename A>
+struct binary<std::set<T, C, A>>
+  : container::binary_seq_helper<std::set<T, C, A>> {};
 
 } // end namespace traits
 
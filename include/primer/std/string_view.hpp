@@ -0,0 +1,59 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * How to push and read `std::string_view`, without copying and without
+ * `strlen`.
+ * Only available when compiling as C++17 or later.
+ *
+ * The view refers to memory owned by lua. It is only valid while the string is
+ * still on the stack, e.g. for the duration of an adapted callback.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+
+#include <primer/traits/push.hpp>
+#include <primer/traits/read.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <string_view>
+
+namespace primer {
+
+namespace traits {
+
+template <>
+struct push<std::string_view> {
+  static void to_stack(lua_State * L, const std::string_view & s) {
+    lua_pushlstring(L, s.data(), s.size());
+  }
+  static constexpr int stack_space_needed{1};
+};
+
+template <>
+struct read<std::string_view> {
+  static expected<std::string_view> from_stack(lua_State * L, int idx) {
+    return read<lua_string_view>::from_stack(L, idx).map(
+      [](const lua_string_view & v) {
+        return std::string_view{v.data(), v.size()};
+      });
+  }
+  static constexpr int stack_space_needed{0};
+};
+
+template <>
+struct read_type_mask<std::string_view>
+  : type_mask_constant<lua_type_bit(LUA_TSTRING)> {};
+
+} // end namespace traits
+
+} // end namespace primer
+
+#endif
@@ -13,20 +13,35 @@
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <primer/container/binary_base.hpp>
 #include <primer/container/map_base.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <primer/traits/ref_proxy.hpp>
 #include <unordered_map>
 
 namespace primer {
 
 namespace traits {
 
-template <typename T, typename U>
-struct push<std::unordered_map<T, U>>
-  : container::map_push_helper<std::unordered_map<T, U>> {};
+template <typename T, typename U, typename H, typename E, typename A>
+struct push<std::unordered_map<T, U, H, E, A>>
+  : container::map_push_helper<std::unordered_map<T, U, H, E, A>> {};
 
-template <typename T, typename U>
-struct read<std::unordered_map<T, U>>
-  : container::map_read_helper<std::unordered_map<T, U>> {};
+template <typename T, typename U, typename H, typename E, typename A>
+struct read<std::unordered_map<T, U, H, E, A>>
+  : container::map_read_helper<std::unordered_map<T, U, H, E, A>> {};
+
+template <typename T, typename U, typename H, typename E, typename A>
+struct read_type_mask<std::unordered_map<T, U, H, E, A>>
+  : type_mask_constant<table_type_mask> {};
+
+template <typename T, typename U, typename H, typename E, typename A>
+struct ref_proxy_access<std::unordered_map<T, U, H, E, A>>
+  : container::map_proxy_helper<std::unordered_map<T, U, H, E, A>> {};
+
+template <typename T, typename U, typename H, typename E, typename A>
+struct binary<std::unordered_map<T, U, H, E, A>>
+  : container::binary_map_helper<std::unordered_map<T, U, H, E, A>> {};
 
 } // end namespace traits
 
@@ -0,0 +1,47 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * How to transfer `std::variant` to and from the stack. The value is pushed as
+ * the alternative which it holds, and read as the first alternative which
+ * accepts it, see <primer/container/variant_base.hpp>.
+ * Only available when compiling as C++17 or later.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+
+#include <primer/container/variant_base.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <variant>
+
+namespace primer {
+namespace traits {
+
+template <typename... Ts>
+struct push<std::variant<Ts...>> : container::variant_push_space<Ts...> {
+  static void to_stack(lua_State * L, const std::variant<Ts...> & v) {
+    std::visit(container::variant_push_visitor{L}, v);
+  }
+};
+
+template <typename... Ts>
+struct read<std::variant<Ts...>>
+  : container::variant_read<std::variant<Ts...>, Ts...> {};
+
+template <typename... Ts>
+struct read_type_mask<std::variant<Ts...>>
+  : type_mask_constant<
+      container::variant_read<std::variant<Ts...>, Ts...>::mask> {};
+
+} // end namespace traits
+} // end namespace primer
+
+#endif
@@ -7,24 +7,52 @@
 
 /***
  * How to transport `std::vector` to and from the stack, as a tables
+ *
+ * If `traits::use_typed_array` is specialized for the vector type, it is
+ * instead pushed as a `primer::typed_array` userdata.
  */
 
 #include <primer/base.hpp>
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <primer/container/binary_base.hpp>
 #include <primer/container/seq_base.hpp>
+#include <primer/container/typed_array_base.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <primer/traits/ref_proxy.hpp>
+#include <primer/traits/typed_array.hpp>
+#include <type_traits>
 #include <vector>
 
 namespace primer {
 
 namespace traits {
 
-template <typename T>
-struct push<std::vector<T>> : container::push_seq_helper<std::vector<T>> {};
-
-template <typename T>
-struct read<std::vector<T>> : container::read_seq_helper<std::vector<T>> {};
+template <typename T, typename A>
+struct push<std::vector<T, A>>
+  : std::conditional<use_typed_array<std::vector<T, A>>::value,
+                     container::push_typed_array_helper<std::vector<T, A>>,
+                     container::push_seq_helper<std::vector<T, A>>>::type {};
+
+template <typename T, typename A>
+struct read<std::vector<T, A>>
+  : std::conditional<use_typed_array<std::vector<T, A>>::value,
+                     container::read_typed_array_seq_helper<std::vector<T, A>>,
+                     container::read_seq_helper<std::vector<T, A>>>::type {};
+
+template <typename T, typename A>
+struct read_type_mask<std::vector<T, A>>
+  : type_mask_constant<seq_type_mask(use_typed_array<std::vector<T, A>>::value)> {
+};
+
+template <typename T, typename A>
+struct ref_proxy_access<std::vector<T, A>>
+  : container::seq_proxy_helper<std::vector<T, A>> {};
+
+template <typename T, typename A>
+struct binary<std::vector<T, A>>
+  : container::binary_seq_helper<std::vector<T, A>> {};
 
 } // end namespace traits
 
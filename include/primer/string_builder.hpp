@@ -0,0 +1,403 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A string builder is a userdata holding a growable string, so that a script
+ * can put together a large output without making a new lua string for each
+ * piece, as `..` in a loop does, or a table of pieces for `table.concat`.
+ *
+ * From lua, a builder supports `#b`, and
+ *
+ *   b:append(...)         appends strings, numbers and other builders
+ *   b:appendf(fmt, ...)   appends `string.format(fmt, ...)`
+ *   b:tostring()          a lua string of the contents
+ *   b:clear()             empties the builder, keeping its capacity
+ *
+ * `append` and `appendf` return the builder, so calls can be chained.
+ * `tostring(b)` and `print(b)` see the contents too.
+ *
+ * C++ code may read `primer::string_builder &`, or `primer::string_span`,
+ * which accepts a builder or a lua string, and points to its characters
+ * without copying them. A span is valid until the builder is changed, or the
+ * string is popped, so it shouldn't be kept after the callback returns.
+ *
+ * A builder is pushed by `primer::push_udata<primer::string_builder>`, or by
+ * scripts, if `primer::intf_new_string_builder` is registered:
+ *
+ *   lua_pushcfunction(L, &primer::intf_new_string_builder);
+ *   lua_setglobal(L, "string_builder");
+ *
+ * Builders can't be persisted.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/adapt.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/read.hpp>
+#include <primer/result.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/diagnostics.hpp>
+#include <primer/support/userdata_common.hpp>
+#include <primer/traits/read.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <primer/traits/userdata.hpp>
+#include <primer/userdata.hpp>
+
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <utility>
+
+namespace primer {
+
+//[ primer_string_builder
+class string_builder {
+  std::string str_;
+
+public:
+  string_builder() noexcept = default;
+
+  /// Takes over the characters of a string, without copying them
+  explicit string_builder(std::string s) noexcept
+    : str_(std::move(s)) {}
+
+  const char * data() const noexcept { return str_.data(); }
+  std::size_t size() const noexcept { return str_.size(); }
+  bool empty() const noexcept { return str_.empty(); }
+  void clear() noexcept { str_.clear(); }
+
+  /*<< May throw `std::bad_alloc` >>*/
+  void append(const char * src, std::size_t n) { str_.append(src, n); }
+
+  /*<< May throw `std::bad_alloc` >>*/
+  void reserve(std::size_t n) { str_.reserve(n); }
+
+  std::string & str() noexcept { return str_; }
+  const std::string & str() const noexcept { return str_; }
+};
+
+/// The characters of a builder or of a lua string, which it doesn't own
+struct string_span {
+  const char * data_;
+  std::size_t size_;
+
+  const char * data() const noexcept { return data_; }
+  std::size_t size() const noexcept { return size_; }
+  bool empty() const noexcept { return !size_; }
+
+  const char * begin() const noexcept { return data_; }
+  const char * end() const noexcept { return data_ + size_; }
+
+  std::string str() const { return std::string(data_, size_); }
+};
+//]
+
+namespace traits {
+
+template <>
+struct userdata<primer::string_builder> {
+  static constexpr const char * name = "primer_string_builder";
+  static void metatable(lua_State * L);
+};
+
+} // end namespace traits
+
+namespace detail {
+
+// Appends the value at `idx`, if it is a string, a number or a builder. The
+// source may be `b` itself, which could move while growing.
+inline bool
+string_builder_add(lua_State * L, string_builder & b, int idx) {
+  if (auto * other = primer::test_udata<string_builder>(L, idx)) {
+    if (other == &b) {
+      b.str().append(b.str());
+    } else {
+      b.append(other->data(), other->size());
+    }
+    return true;
+  }
+  const int t = lua_type(L, idx);
+  if (t != LUA_TSTRING && t != LUA_TNUMBER) { return false; }
+  std::size_t n;
+  const char * s = lua_tolstring(L, idx, &n);
+  b.append(s, n);
+  return true;
+}
+
+inline primer::result
+string_builder_append(lua_State * L, string_builder & b) {
+  const int top = lua_gettop(L);
+  PRIMER_TRY_BAD_ALLOC {
+    for (int i = 2; i <= top; ++i) {
+      if (!string_builder_add(L, b, i)) {
+        return primer::arg_error(L, i, "string, number or string builder");
+      }
+    }
+  }
+  PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
+  lua_settop(L, 1);
+  return 1;
+}
+
+// One conversion of a format, e.g. "%-8.3f", with the length modifier of
+// lua integers added for integer conversions
+struct string_builder_spec {
+  char fmt[16];
+  char conversion;
+};
+
+inline const char *
+string_builder_parse_spec(const char * p, string_builder_spec & spec) {
+  std::size_t n = 0;
+  spec.fmt[n++] = '%';
+  while (*p && std::strchr("-+ #0", *p) && n < 6) {
+    spec.fmt[n++] = *p++;
+  }
+  // At most two digits of width and of precision, as `string.format`
+  for (int i = 0; i < 2 && *p >= '0' && *p <= '9'; ++i) {
+    spec.fmt[n++] = *p++;
+  }
+  if (*p == '.') {
+    spec.fmt[n++] = *p++;
+    for (int i = 0; i < 2 && *p >= '0' && *p <= '9'; ++i) {
+      spec.fmt[n++] = *p++;
+    }
+  }
+  if ((*p >= '0' && *p <= '9') || !*p) { return nullptr; }
+  spec.conversion = *p++;
+  if (std::strchr("dioxX", spec.conversion)) {
+    for (const char * m = LUA_INTEGER_FRMLEN; *m; ++m) {
+      spec.fmt[n++] = *m;
+    }
+  }
+  spec.fmt[n++] = spec.conversion;
+  spec.fmt[n] = 0;
+  return p;
+}
+
+// Appends one formatted value, which may be longer than the stack buffer
+template <typename T>
+void
+string_builder_printf(string_builder & b, const char * fmt, T value) {
+  char buf[128];
+  const int n = std::snprintf(buf, sizeof buf, fmt, value);
+  if (n < 0) { return; }
+  const auto len = static_cast<std::size_t>(n);
+  if (len < sizeof buf) {
+    b.append(buf, len);
+    return;
+  }
+  std::string & s = b.str();
+  const std::size_t old = s.size();
+  s.resize(old + len + 1);
+  std::snprintf(&s[old], len + 1, fmt, value);
+  s.resize(old + len);
+}
+
+// The result of formatting: nullptr, or a message for luaL_error
+inline const char *
+string_builder_format(lua_State * L, string_builder & b, const char * fmt,
+                      int & arg) {
+  const int top = lua_gettop(L);
+  const char * p = fmt;
+  while (*p) {
+    const char * q = std::strchr(p, '%');
+    if (!q) {
+      b.append(p, std::strlen(p));
+      break;
+    }
+    b.append(p, static_cast<std::size_t>(q - p));
+    p = q + 1;
+    if (*p == '%') {
+      b.append("%", 1);
+      ++p;
+      continue;
+    }
+    string_builder_spec spec;
+    p = string_builder_parse_spec(p, spec);
+    if (!p) { return "invalid format in appendf"; }
+    if (++arg > top) { return "no value for a format in appendf"; }
+    switch (spec.conversion) {
+      case 'd':
+      case 'i':
+      case 'o':
+      case 'x':
+      case 'X': {
+        int isnum = 0;
+        const LUA_INTEGER i = lua_tointegerx(L, arg, &isnum);
+        if (!isnum) { return "number has no integer representation"; }
+        string_builder_printf(b, spec.fmt, static_cast<LUAI_UACINT>(i));
+        break;
+      }
+      case 'c': {
+        int isnum = 0;
+        const LUA_INTEGER i = lua_tointegerx(L, arg, &isnum);
+        if (!isnum) { return "number has no integer representation"; }
+        string_builder_printf(b, spec.fmt, static_cast<int>(i));
+        break;
+      }
+      case 'a':
+      case 'A':
+      case 'e':
+      case 'E':
+      case 'f':
+      case 'F':
+      case 'g':
+      case 'G': {
+        int isnum = 0;
+        const LUA_NUMBER d = lua_tonumberx(L, arg, &isnum);
+        if (!isnum) { return "number expected in appendf"; }
+        string_builder_printf(b, spec.fmt, static_cast<LUAI_UACNUMBER>(d));
+        break;
+      }
+      case 's': {
+        // A plain `%s` of a builder or a string doesn't need a copy
+        const bool plain = !spec.fmt[2];
+        if (plain && string_builder_add(L, b, arg)) { break; }
+        std::size_t n;
+        const char * s = lua_tolstring(L, arg, &n);
+        if (!s) { return "string expected in appendf"; }
+        if (plain) {
+          b.append(s, n);
+        } else {
+          string_builder_printf(b, spec.fmt, s);
+        }
+        break;
+      }
+      default: return "invalid conversion in appendf";
+    }
+  }
+  return nullptr;
+}
+
+// This is not adapted, so that the format is a `const char *` into the lua
+// string, and values with `__tostring` can be converted first
+inline int
+string_builder_appendf(lua_State * L) {
+  auto * self = primer::test_udata<string_builder>(L, 1);
+  if (!self) { return luaL_argerror(L, 1, "string builder expected"); }
+  string_builder & b = *self;
+  const char * fmt = luaL_checkstring(L, 2);
+
+  // Turn userdata and tables into strings, as `string.format` does for `%s`
+  const int top = lua_gettop(L);
+  for (int i = 3; i <= top; ++i) {
+    const int t = lua_type(L, i);
+    if (t != LUA_TSTRING && t != LUA_TNUMBER
+        && !primer::test_udata<string_builder>(L, i)) {
+      luaL_tolstring(L, i, nullptr);
+      lua_replace(L, i);
+    }
+  }
+
+  int arg = 2;
+  const char * err = nullptr;
+  const std::size_t old = b.size();
+  PRIMER_TRY_BAD_ALLOC { err = string_builder_format(L, b, fmt, arg); }
+  PRIMER_CATCH_BAD_ALLOC { err = "not enough memory"; }
+  if (err) {
+    b.str().resize(old);
+    return luaL_error(L, "%s", err);
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+inline primer::result
+string_builder_tostring(lua_State * L, string_builder & b) {
+  lua_pushlstring(L, b.data(), b.size());
+  return 1;
+}
+
+inline primer::result
+string_builder_clear(lua_State * L, string_builder & b) {
+  b.clear();
+  lua_settop(L, 1);
+  return 1;
+}
+
+inline primer::result
+string_builder_len(lua_State * L, string_builder & b) {
+  lua_pushinteger(L, static_cast<LUA_INTEGER>(b.size()));
+  return 1;
+}
+
+} // end namespace detail
+
+/// Pushes a new builder, reserving space for `n` characters if given
+inline int
+intf_new_string_builder(lua_State * L) {
+  const LUA_INTEGER n = luaL_optinteger(L, 1, 0);
+  primer::push_udata<string_builder>(L);
+  if (n > 0) {
+    auto * b = primer::test_udata<string_builder>(L, -1);
+    PRIMER_TRY_BAD_ALLOC { b->reserve(static_cast<std::size_t>(n)); }
+    PRIMER_CATCH_BAD_ALLOC { return luaL_error(L, "not enough memory"); }
+  }
+  return 1;
+}
+
+namespace traits {
+
+inline void
+userdata<primer::string_builder>::metatable(lua_State * L) {
+  PRIMER_ASSERT_TABLE(L);
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  static const luaL_Reg methods[] = {
+    {"append", PRIMER_ADAPT(&detail::string_builder_append)},
+    {"appendf", &detail::string_builder_appendf},
+    {"tostring", PRIMER_ADAPT(&detail::string_builder_tostring)},
+    {"clear", PRIMER_ADAPT(&detail::string_builder_clear)},
+    {"__tostring", PRIMER_ADAPT(&detail::string_builder_tostring)},
+    {"__len", PRIMER_ADAPT(&detail::string_builder_len)}};
+
+  for (const luaL_Reg & r : methods) {
+    lua_pushcfunction(L, r.func);
+    lua_setfield(L, -2, r.name);
+  }
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, &detail::common_gc_impl<primer::string_builder>);
+  lua_setfield(L, -2, "__gc");
+  // The characters are behind a pointer
+  lua_pushboolean(L, false);
+  lua_setfield(L, -2, "__persist");
+  lua_pushstring(L, name);
+  lua_setfield(L, -2, "__metatable");
+}
+
+template <>
+struct read<primer::string_span> {
+  static expected<primer::string_span> from_stack(lua_State * L, int idx) {
+    if (auto * b = primer::test_udata<primer::string_builder>(L, idx)) {
+      return primer::string_span{b->data(), b->size()};
+    }
+    // Numbers are not converted, which would change the stack in place
+    if (lua_type(L, idx) == LUA_TSTRING) {
+      std::size_t n;
+      const char * s = lua_tolstring(L, idx, &n);
+      return primer::string_span{s, n};
+    }
+    return primer::arg_error(L, idx, "string or string builder");
+  }
+  static constexpr int stack_space_needed{0};
+};
+
+template <>
+struct read_type_mask<primer::string_span>
+  : type_mask_constant<lua_type_bit(LUA_TSTRING)
+                       | lua_type_bit(LUA_TUSERDATA)> {};
+
+} // end namespace traits
+} // end namespace primer
@@ -0,0 +1,93 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Attribution of allocations to the primer entry point which is running.
+ *
+ * With PRIMER_ALLOC_PROFILER defined, adapted callbacks, `push_udata`, and the
+ * `to_stack` of the standard containers open an `alloc_scope` while they run.
+ * The scopes of a thread form a short stack, which `api::alloc_profiler` reads
+ * when lua allocates, to charge the memory to a callback and to the kind of
+ * object being made.
+ *
+ * A scope saves the context it replaced by value, and puts it back when it is
+ * destroyed, so the context never points into the C stack. If a lua error
+ * longjmps through a scope, the context stays stale until an enclosing scope
+ * exits, and allocations in between are charged to the scope which was left.
+ * `to_stack` and `push_udata` only raise memory errors, and an adapted
+ * callback is in scope only while the target function runs, not while its
+ * error is raised. Compile lua as C++ to make this exact.
+ *
+ * Without PRIMER_ALLOC_PROFILER, `PRIMER_ALLOC_SCOPE` expands to nothing.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+
+namespace primer {
+namespace detail {
+
+struct alloc_frame {
+  lua_CFunction func; // The lua_CFunction which lua called, or nullptr
+  const char * name;  // The kind of object which is made, or nullptr
+};
+
+struct alloc_context {
+  static constexpr int max_depth = 4;
+
+  alloc_frame frames[max_depth]; // Innermost first
+  int depth;
+  unsigned long generation; // Distinct for each context which is entered
+};
+
+inline alloc_context &
+current_alloc_context() noexcept {
+  static thread_local alloc_context context{};
+  return context;
+}
+
+inline unsigned long
+next_alloc_generation() noexcept {
+  static thread_local unsigned long generation = 0;
+  return ++generation;
+}
+
+class alloc_scope {
+  alloc_context saved_;
+
+public:
+  alloc_scope(lua_CFunction func, const char * name) noexcept
+    : saved_(current_alloc_context()) {
+    alloc_context & c = current_alloc_context();
+    for (int i = alloc_context::max_depth - 1; i > 0; --i) {
+      c.frames[i] = c.frames[i - 1];
+    }
+    c.frames[0] = alloc_frame{func, name};
+    if (c.depth < alloc_context::max_depth) { ++c.depth; }
+    c.generation = next_alloc_generation();
+  }
+
+  alloc_scope(const alloc_scope &) = delete;
+  alloc_scope & operator=(const alloc_scope &) = delete;
+
+  ~alloc_scope() noexcept { current_alloc_context() = saved_; }
+};
+
+} // end namespace detail
+} // end namespace primer
+
+#ifdef PRIMER_ALLOC_PROFILER
+#define PRIMER_ALLOC_SCOPE(FUNC, NAME)                                         \
+  ::primer::detail::alloc_scope primer_alloc_scope_{FUNC, NAME}
+#else
+#define PRIMER_ALLOC_SCOPE(FUNC, NAME)                                         \
+  static_cast<void>(FUNC);                                                     \
+  static_cast<void>(NAME)
+#endif
@@ -0,0 +1,103 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Spans around the calls from C++ into lua.
+ *
+ * With PRIMER_CALL_TRACING defined, the calls of `bound_function` and the
+ * resumes of `coroutine` look for a `call_trace_hooks` object in the registry
+ * of their state, and if there is one, tell it when the call starts and when it
+ * ends. `api::call_tracer` installs itself there.
+ *
+ * `identify` is called in the protected context of the call, with the function
+ * at the absolute index `fidx` of `T`, which is `L` for a call and the
+ * coroutine for a resume. For a resume of a yielded coroutine, `fidx` is 0. It
+ * may allocate, and it returns false to skip tracing the call.
+ *
+ * Without PRIMER_CALL_TRACING, the calls don't look, and their tokens are never
+ * written.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+
+#include <chrono>
+#include <cstdint>
+
+namespace primer {
+namespace detail {
+
+using trace_clock = std::chrono::steady_clock;
+
+struct call_trace_token;
+
+struct call_trace_hooks {
+  void * self;
+  bool (*identify)(void * self, lua_State * L, lua_State * T, int fidx,
+                   call_trace_token & t);
+  void (*end)(void * self, const call_trace_token & t, bool ok) noexcept;
+};
+
+struct call_trace_token {
+  const call_trace_hooks * hooks = nullptr;
+  std::uint32_t function = 0;
+  int nargs = 0;
+  bool resume = false;
+  trace_clock::time_point start{};
+};
+
+inline void *
+call_trace_key() noexcept {
+  static char key;
+  return &key;
+}
+
+#ifdef PRIMER_CALL_TRACING
+
+// Called in the protected context, just before the call
+inline void
+call_trace_begin(call_trace_token & t, lua_State * L, lua_State * T, int fidx,
+                 int nargs, bool resume) {
+  if (!lua_checkstack(L, 1)) { return; }
+  lua_rawgetp(L, LUA_REGISTRYINDEX, call_trace_key());
+  auto hooks = static_cast<const call_trace_hooks *>(lua_touserdata(L, -1));
+  lua_pop(L, 1);
+  if (!hooks) { return; }
+
+  t.nargs = nargs;
+  t.resume = resume;
+  if (fidx) { fidx = lua_absindex(T, fidx); }
+  if (hooks->identify(hooks->self, L, T, fidx, t)) {
+    t.hooks = hooks;
+    t.start = trace_clock::now();
+  }
+}
+
+// Called after the call, with its result
+template <typename R>
+void
+call_trace_end(const call_trace_token & t, const R & result) noexcept {
+  if (t.hooks) { t.hooks->end(t.hooks->self, t, static_cast<bool>(result)); }
+}
+
+#else
+
+inline void
+call_trace_begin(call_trace_token &, lua_State *, lua_State *, int, int,
+                 bool) noexcept {}
+
+template <typename R>
+void
+call_trace_end(const call_trace_token &, const R &) noexcept {}
+
+#endif
+
+} // end namespace detail
+} // end namespace primer
@@ -0,0 +1,80 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A queue of reference slots which were released by `lua_ref` objects on
+ * threads that don't own the lua state, waiting for the owner to unref them.
+ *
+ * Any thread may push, and only the owner takes, so it is a lock-free stack
+ * which the owner empties all at once. Since nodes are never popped one at a
+ * time, there is no ABA problem.
+ *
+ * This is used only if PRIMER_THREAD_SAFE_STATE_REFS is defined, see
+ * `lua_state_ref.hpp`.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <atomic>
+#include <new>
+
+namespace primer {
+namespace detail {
+
+struct ref_pool;
+
+struct deferred_unref {
+  int iref;
+  ref_pool * pool; // nullptr if the slot is in the registry
+  deferred_unref * next;
+};
+
+class deferred_unref_queue {
+  mutable std::atomic<deferred_unref *> head_{nullptr};
+
+public:
+  deferred_unref_queue() noexcept = default;
+  deferred_unref_queue(const deferred_unref_queue &) = delete;
+  deferred_unref_queue & operator=(const deferred_unref_queue &) = delete;
+
+  // Slots which were never taken belong to a closed state, just free them
+  ~deferred_unref_queue() noexcept { free_list(this->take_all()); }
+
+  // Returns false if the node can't be allocated, and the slot will leak
+  bool push(int iref, ref_pool * pool) const noexcept {
+    deferred_unref * node =
+      new (std::nothrow) deferred_unref{iref, pool, nullptr};
+    if (!node) { return false; }
+    node->next = head_.load(std::memory_order_relaxed);
+    while (!head_.compare_exchange_weak(node->next, node,
+                                        std::memory_order_release,
+                                        std::memory_order_relaxed)) {}
+    return true;
+  }
+
+  // Takes everything which is queued now, newest first
+  deferred_unref * take_all() const noexcept {
+    return head_.exchange(nullptr, std::memory_order_acquire);
+  }
+
+  bool empty() const noexcept {
+    return !head_.load(std::memory_order_relaxed);
+  }
+
+  static void free_list(deferred_unref * node) noexcept {
+    while (node) {
+      deferred_unref * next = node->next;
+      delete node;
+      node = next;
+    }
+  }
+};
+
+} // end namespace detail
+} // end namespace primer
@@ -0,0 +1,153 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Helper for asynchronous snapshots on POSIX systems.
+ *
+ * `fork_snapshot(f)` forks the process. The child gets a copy-on-write image of
+ * the parent's memory, calls `f(fd)` to write the snapshot to a pipe, and
+ * exits. In the parent, a thread collects the output of the pipe into a string,
+ * which the returned future yields once the child has exited.
+ *
+ * The parent returns as soon as the fork has happened, and may go on changing
+ * the lua state, since the child has its own copy.
+ *
+ * The pipe is close-on-exec, so that processes which other threads spawn
+ * meanwhile don't hold it open. If `f` throws in the child, the child exits
+ * with a failure rather than unwinding into the code of the parent.
+ *
+ * The usual caveats of fork apply. Only the calling thread exists in the child,
+ * so if another thread holds a lock that the snapshot needs, e.g. in a custom
+ * allocator, the child will deadlock.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+
+#include <cerrno>
+#include <cstddef>
+#include <future>
+#include <new>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace primer {
+namespace detail {
+
+// Sink for `persist_chunked` which writes to a file descriptor
+struct fd_sink {
+  int fd;
+
+  bool operator()(const char * data, std::size_t size) const noexcept {
+    while (size) {
+      ssize_t n = ::write(fd, data, size);
+      if (n < 0) {
+        if (errno == EINTR) { continue; }
+        return false;
+      }
+      data += n;
+      size -= static_cast<std::size_t>(n);
+    }
+    return true;
+  }
+};
+
+// Opens a pipe whose ends are closed on exec. Returns false if it fails.
+inline bool
+open_snapshot_pipe(int (&fds)[2]) noexcept {
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__)         \
+  || defined(__OpenBSD__)
+  return ::pipe2(fds, O_CLOEXEC) == 0;
+#else
+  if (::pipe(fds)) { return false; }
+  ::fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  ::fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  return true;
+#endif
+}
+
+// Reads the pipe to the end, and then reaps the child
+inline expected<std::string>
+collect_snapshot(int fd, pid_t pid) noexcept {
+  expected<std::string> result{std::string{}};
+  PRIMER_TRY_BAD_ALLOC {
+    char buf[1 << 16];
+    for (;;) {
+      ssize_t n = ::read(fd, buf, sizeof(buf));
+      if (n < 0) {
+        if (errno == EINTR) { continue; }
+        result = primer::error{"could not read snapshot"};
+        break;
+      }
+      if (!n) { break; }
+      result->append(buf, static_cast<std::size_t>(n));
+    }
+  }
+  PRIMER_CATCH_BAD_ALLOC { result = primer::error::bad_alloc(); }
+  ::close(fd);
+
+  int status = 0;
+  while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+  if (result && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+    result = primer::error{"snapshot process failed"};
+  }
+  return result;
+}
+
+inline std::future<expected<std::string>>
+ready_snapshot(expected<std::string> r) {
+  std::promise<expected<std::string>> p;
+  p.set_value(std::move(r));
+  return p.get_future();
+}
+
+// `f(int fd)` returns true if it wrote the whole snapshot
+template <typename F>
+std::future<expected<std::string>>
+fork_snapshot(F && f) {
+  int fds[2];
+  if (!open_snapshot_pipe(fds)) { return ready_snapshot(primer::error{"pipe failed"}); }
+
+  pid_t pid = ::fork();
+  if (pid < 0) {
+    ::close(fds[0]);
+    ::close(fds[1]);
+    return ready_snapshot(primer::error{"fork failed"});
+  }
+
+  if (!pid) {
+    ::close(fds[0]);
+    bool ok = false;
+    PRIMER_TRY { ok = std::forward<F>(f)(fds[1]); }
+    PRIMER_CATCH(...) { ok = false; }
+    ::close(fds[1]);
+    ::_exit(ok ? 0 : 1);
+  }
+
+  ::close(fds[1]);
+  const int fd = fds[0];
+  PRIMER_TRY {
+    return std::async(std::launch::async, &collect_snapshot, fd, pid);
+  }
+  PRIMER_CATCH(std::system_error &) {}
+
+  // No thread, so collect synchronously.
+  return ready_snapshot(collect_snapshot(fd, pid));
+}
+
+} // end namespace detail
+} // end namespace primer
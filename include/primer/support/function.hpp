@@ -21,6 +21,7 @@ PRIMER_ASSERT_FILESCOPE;
 #include <primer/expected.hpp>
 #include <primer/lua.hpp>
 #include <primer/support/function_return_fwd.hpp>
+#include <primer/support/internal_stats.hpp>
 #include <tuple>
 #include <utility>
 
@@ -38,6 +39,7 @@ pcall_helper(lua_State * L, int narg, int nret) noexcept {
                 "Not enough arguments on stack for pcall!");
   PRIMER_ASSERT(lua_isfunction(L, -1 - narg), "Missing function for pcall!");
   primer::get_error_handler(L);
+  PRIMER_INTERNAL_COUNT(L, error_handler_fetches);
   lua_insert(L, -2 - narg);
   const int error_handler_index = lua_absindex(L, -2 - narg);
   const int result_code = lua_pcall(L, narg, nret, error_handler_index);
@@ -46,6 +48,17 @@ pcall_helper(lua_State * L, int narg, int nret) noexcept {
   return std::tuple<int, int>{result_code, error_handler_index};
 }
 
+// Calls the error handler on the error object, meant to be called with
+// `lua_pcall`, so that whoever resumes a coroutine doesn't need a protected
+// context for its errors. If the handler fails, its error is reported instead.
+inline int
+apply_error_handler(lua_State * L) {
+  primer::get_error_handler(L);
+  lua_insert(L, 1);
+  lua_call(L, 1, 1);
+  return 1;
+}
+
 // Expects: Function, followed by narg arguments, on top of the stack.
 // Calls lua_resume. If an error occurs, calls the traceback error handler,
 // removes error handler. Error is left on top of the stack.
@@ -55,16 +68,21 @@ resume_helper(lua_State * L, int narg) noexcept {
   PRIMER_ASSERT(lua_gettop(L) >= (narg),
                 "Not enough arguments on stack for resume!");
 
-  const int result_index = lua_absindex(L, -1 - narg);
+  // A suspended thread's values are replaced on resume, so then the results
+  // start at the bottom of the stack.
+  const int result_index =
+    (lua_status(L) == LUA_YIELD) ? 1 : lua_absindex(L, -1 - narg);
 
-  const int result_code = lua_resume(L, nullptr, narg);
+  int nres = 0;
+  const int result_code = detail::resume(L, nullptr, narg, &nres);
   if ((result_code != LUA_OK) && (result_code != LUA_YIELD)) {
-    primer::get_error_handler(L);
+    lua_pushcfunction(L, &apply_error_handler);
     lua_insert(L, -2);
-    lua_call(L, 1, 1);
+    lua_pcall(L, 1, 1, 0);
+    return std::tuple<int, int>{result_code, result_index};
   }
 
-  return std::tuple<int, int>{result_code, result_index};
+  return std::tuple<int, int>{result_code, lua_gettop(L) - nres + 1};
 }
 
 /***
@@ -75,42 +93,89 @@ resume_helper(lua_State * L, int narg) noexcept {
  *
  * Note: This function should not have nontrivial objects on the stack.
  */
-template <typename T>
+template <typename T, typename H = return_helper<T>>
 void
 fcn_call(expected<T> & result, lua_State * L, int narg) {
   int err_code;
   int results_idx;
 
-  std::tie(err_code, results_idx) =
-    detail::pcall_helper(L, narg, return_helper<T>::nrets);
+  std::tie(err_code, results_idx) = detail::pcall_helper(L, narg, H::nrets);
+  if (err_code != LUA_OK) {
+    result = primer::pop_error(L, err_code);
+  } else {
+    H::pop(L, results_idx, result);
+  }
+
+  PRIMER_ASSERT(lua_gettop(L) == (results_idx - 1),
+                "hmm stack discipline error");
+}
+
+// Expects: Function, followed by narg arguments, on top of the stack.
+// As `fcn_call`, but with an error handler which is already on the stack.
+template <typename T, typename H>
+void
+pinned_fcn_call(expected<T> & result, lua_State * L, int narg, int handler) {
+  const int results_idx = lua_gettop(L) - narg;
+  const int err_code = lua_pcall(L, narg, H::nrets, handler);
   if (err_code != LUA_OK) {
     result = primer::pop_error(L, err_code);
   } else {
-    return_helper<T>::pop(L, results_idx, result);
+    H::pop(L, results_idx, result);
   }
 
   PRIMER_ASSERT(lua_gettop(L) == (results_idx - 1),
                 "hmm stack discipline error");
 }
 
+// True if a yielded thread was suspended inside a lua function, rather than by
+// a C function such as `coroutine.yield`. That happens when a hook yields.
+inline bool
+yielded_in_lua_function(lua_State * L) noexcept {
+  lua_Debug ar;
+  return lua_getstack(L, 0, &ar) && lua_getinfo(L, "S", &ar)
+         && *ar.what != 'C';
+}
+
 /***
- * Generic scheme for resuming a coroutine
+ * Generic scheme for resuming a coroutine, with the results popped by
+ * `pop(L, idx, result)`
+ *
+ * If the coroutine was preempted by a hook, the stack holds the frame of the
+ * interrupted lua function, so it is left alone and there are no results.
  */
-template <typename T>
+template <typename T, typename H, typename P>
 void
-resume_call(expected<T> & result, lua_State * L, int narg) {
+resume_call_with(expected<T> & result, lua_State * L, int narg, P && pop) {
   int err_code;
   int results_idx;
 
   std::tie(err_code, results_idx) = detail::resume_helper(L, narg);
+  if (err_code == LUA_YIELD && detail::yielded_in_lua_function(L)) {
+    const int top = lua_gettop(L);
+    for (int i = 0; i < H::nrets; ++i) {
+      lua_pushnil(L);
+    }
+    pop(L, top + 1, result);
+    lua_settop(L, top);
+    return;
+  }
+
   if (err_code == LUA_OK || err_code == LUA_YIELD) {
-    return_helper<T>::pop(L, results_idx, result);
+    pop(L, results_idx, result);
   } else {
     result = primer::pop_error(L, err_code);
   }
   lua_settop(L, results_idx - 1);
 }
 
+template <typename T, typename H = return_helper<T>>
+void
+resume_call(expected<T> & result, lua_State * L, int narg) {
+  detail::resume_call_with<T, H>(
+    result, L, narg,
+    [](lua_State * T_, int idx, expected<T> & r) { H::pop(T_, idx, r); });
+}
+
 } // end namespace detail
 
 } // end namespace primer
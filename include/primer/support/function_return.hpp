@@ -22,6 +22,16 @@ PRIMER_ASSERT_FILESCOPE;
 #include <primer/expected.hpp>
 #include <primer/lua_ref.hpp>
 #include <primer/lua_ref_seq.hpp>
+#include <primer/packed_ref_seq.hpp>
+#include <primer/read.hpp>
+#include <primer/support/types.hpp>
+
+#include <primer/detail/count.hpp>
+#include <primer/detail/max_int.hpp>
+
+#include <tuple>
+#include <type_traits>
+#include <utility>
 
 namespace primer {
 namespace detail {
@@ -51,5 +61,111 @@ struct return_helper<lua_ref_seq> {
   static constexpr int nrets = LUA_MULTRET;
 };
 
+template <>
+struct return_helper<packed_ref_seq> {
+  using return_type = expected<packed_ref_seq>;
+
+  static void pop(lua_State * L, int start_idx, return_type & result) {
+    result = packed_ref_seq{L, lua_gettop(L) - start_idx + 1};
+  }
+
+  static constexpr int nrets = LUA_MULTRET;
+};
+
+/***
+ * Read the return values directly as C++ values, using `traits::read`.
+ * The values are popped, so the C++ values must not refer into the lua state.
+ */
+
+template <typename T>
+struct read_return_check {
+  static constexpr bool value = !std::is_reference<T>::value
+                                && !std::is_pointer<T>::value
+                                && !std::is_same<T, lua_string_view>::value;
+  PRIMER_STATIC_ASSERT(value, "call_as cannot return a reference into the lua "
+                              "state, since the results are popped");
+};
+
+template <typename T>
+struct read_return_helper {
+  PRIMER_STATIC_ASSERT(read_return_check<T>::value, "bad call_as result type");
+  using return_type = expected<T>;
+
+  static void pop(lua_State * L, int start_idx, return_type & result) {
+    constexpr int space = primer::stack_space_for_read<T>();
+    if (space && !lua_checkstack(L, space)) {
+      result = primer::error::insufficient_stack_space(space);
+    } else {
+      result = primer::read<T>(L, start_idx);
+    }
+    lua_settop(L, start_idx - 1);
+  }
+
+  static constexpr int nrets = 1;
+};
+
+template <>
+struct read_return_helper<void> : return_helper<void> {};
+
+template <typename... Ts>
+struct read_return_helper<std::tuple<Ts...>> {
+  using return_type = expected<std::tuple<Ts...>>;
+
+  template <typename T>
+  struct impl;
+
+  template <std::size_t... indices>
+  struct impl<SizeList<indices...>> {
+    // Short-circuits after the first error, like `adapt`
+    template <typename T>
+    static expected<T> read_one(lua_State * L, int index, int which,
+                                expected<void> & ok) {
+      PRIMER_STATIC_ASSERT(read_return_check<T>::value,
+                           "bad call_as result type");
+      expected<T> result{primer::error{}};
+      if (ok) {
+        result = primer::read<T>(L, index);
+        if (!result) {
+          ok = std::move(result.err());
+          ok.err().prepend_error_line("In return value #", which, ",");
+        }
+      }
+      return result;
+    }
+
+    static void combine(return_type & result, expected<void> & ok,
+                        expected<Ts>... values) {
+      if (ok) {
+        result = std::tuple<Ts...>{(*std::move(values))...};
+      } else {
+        result = std::move(ok.err());
+      }
+    }
+
+    static void pop(lua_State * L, int start_idx, return_type & result) {
+      expected<void> ok;
+      combine(result, ok, read_one<Ts>(L, start_idx + static_cast<int>(indices),
+                                       static_cast<int>(indices) + 1, ok)...);
+    }
+  };
+
+  static void pop(lua_State * L, int start_idx, return_type & result) {
+    constexpr int space =
+      detail::max_int(0, primer::stack_space_for_read<Ts>()...);
+    if (space && !lua_checkstack(L, space)) {
+      result = primer::error::insufficient_stack_space(space);
+    } else {
+      impl<Count_t<sizeof...(Ts)>>::pop(L, start_idx, result);
+    }
+    lua_settop(L, start_idx - 1);
+  }
+
+  static constexpr int nrets = sizeof...(Ts);
+};
+
+// Reads report their failures as errors, and don't raise lua errors
+template <typename T>
+struct return_pop_cant_fail<read_return_helper<T>> : std::true_type {};
+
 } // end namespace detail
 } // end namespace primer
@@ -19,6 +19,8 @@ PRIMER_ASSERT_FILESCOPE;
 #include <primer/error.hpp>
 #include <primer/expected.hpp>
 
+#include <type_traits>
+
 namespace primer {
 namespace detail {
 
@@ -35,5 +37,13 @@ struct return_helper<void> {
   static constexpr int nrets = 0;
 };
 
+// Whether the `pop` of a return helper can't raise a lua error, so that it
+// doesn't need a protected context
+template <typename H>
+struct return_pop_cant_fail : std::false_type {};
+
+template <>
+struct return_pop_cant_fail<return_helper<void>> : std::true_type {};
+
 } // end namespace detail
 } // end namespace primer
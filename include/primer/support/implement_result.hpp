@@ -31,6 +31,7 @@ PRIMER_ASSERT_FILESCOPE;
 #include <primer/error_capture.hpp>
 #include <primer/lua.hpp>
 #include <primer/result.hpp>
+#include <primer/support/internal_stats.hpp>
 
 namespace primer {
 
@@ -42,6 +43,9 @@ implement_result_step_one(lua_State * L, primer::result r) {
   if (p) {
     return std::move(*p);
   } else {
+    if (p.err().is_bad_alloc()) {
+      PRIMER_INTERNAL_COUNT(L, bad_alloc_recoveries);
+    }
     primer::push_error(L, p.err());
     // Implementation note: This push can raise a memory error, but in
     // that case it must be an exception, so `r` is destroyed and nothing else
@@ -0,0 +1,118 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Counters of the costly things which primer itself does on behalf of a VM.
+ *
+ * With PRIMER_INTERNAL_STATS defined, and after `install_internal_stats(L)`,
+ * these sites count, in a userdata in the registry of the state:
+ *
+ * - `registry_refs`, the `luaL_ref` calls of `lua_ref::init`, i.e. refs which
+ *   weren't put in a pool or a `ref_scope`,
+ * - `cpp_pcalls`, the protected calls set up by `cpp_pcall` and `mem_pcall`,
+ * - `error_handler_fetches`, the error handlers which `pcall_helper` pushes,
+ *   i.e. the calls which don't use a pinned handler,
+ * - `metatable_lookups`, the metatables which `test_udata` fetches, to check
+ *   the type of a userdata argument,
+ * - `bad_alloc_recoveries`, the `bad_alloc` errors which a callback turns into
+ *   a lua error, and memory errors which `cpp_pcall` catches.
+ *
+ * `internal_stats(L)` takes a snapshot, and the difference of two snapshots
+ * tells which of the caching features would pay for themselves, and whether a
+ * change made the library more expensive.
+ *
+ * Each count costs a raw registry lookup by pointer. Without
+ * PRIMER_INTERNAL_STATS, nothing counts, and the snapshot is all zeros.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+
+#include <cstdint>
+#include <new>
+
+namespace primer {
+
+//[ primer_internal_stats
+struct internal_counters {
+  std::uint64_t registry_refs = 0;
+  std::uint64_t cpp_pcalls = 0;
+  std::uint64_t error_handler_fetches = 0;
+  std::uint64_t metatable_lookups = 0;
+  std::uint64_t bad_alloc_recoveries = 0;
+};
+
+/*<< Makes the counters of the state, if PRIMER_INTERNAL_STATS is defined.
+     This may raise a lua error on memory allocation failure. >>*/
+void install_internal_stats(lua_State * L);
+
+/*<< The counts since the counters were installed, or zeros. >>*/
+internal_counters internal_stats(lua_State * L) noexcept;
+//]
+
+namespace detail {
+
+inline void *
+internal_stats_key() noexcept {
+  static char key;
+  return &key;
+}
+
+#ifdef PRIMER_INTERNAL_STATS
+
+inline internal_counters *
+get_internal_counters(lua_State * L) noexcept {
+  if (!lua_checkstack(L, 1)) { return nullptr; }
+  lua_rawgetp(L, LUA_REGISTRYINDEX, internal_stats_key());
+  auto result = static_cast<internal_counters *>(lua_touserdata(L, -1));
+  lua_pop(L, 1);
+  return result;
+}
+
+#define PRIMER_INTERNAL_COUNT(L, counter)                                      \
+  do {                                                                         \
+    if (::primer::internal_counters * primer_counters_ =                       \
+          ::primer::detail::get_internal_counters(L)) {                        \
+      ++primer_counters_->counter;                                             \
+    }                                                                          \
+  } while (0)
+
+#else
+
+#define PRIMER_INTERNAL_COUNT(L, counter) static_cast<void>(L)
+
+#endif // PRIMER_INTERNAL_STATS
+
+} // end namespace detail
+
+inline void
+install_internal_stats(lua_State * L) {
+#ifdef PRIMER_INTERNAL_STATS
+  if (detail::get_internal_counters(L)) { return; }
+  new (lua_newuserdata(L, sizeof(internal_counters))) internal_counters{};
+  lua_rawsetp(L, LUA_REGISTRYINDEX, detail::internal_stats_key());
+#else
+  static_cast<void>(L);
+#endif
+}
+
+inline internal_counters
+internal_stats(lua_State * L) noexcept {
+#ifdef PRIMER_INTERNAL_STATS
+  if (const internal_counters * c = detail::get_internal_counters(L)) {
+    return *c;
+  }
+#else
+  static_cast<void>(L);
+#endif
+  return internal_counters{};
+}
+
+} // end namespace primer
@@ -8,24 +8,40 @@
 /***
  * Helper functions to assist with serialization.
  * These functions are valid "luaReader" and "luaWriter" type functions.
+ *
+ * A writer which returns nonzero makes eris raise a lua error, so the writers
+ * report failures of their output (including std::bad_alloc) that way, rather
+ * than letting an exception pass through eris.
  */
 
 #include <primer/base.hpp>
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <cstddef>
+#include <new>
+#include <istream>
+#include <ostream>
 #include <string>
 
 namespace primer {
 namespace detail {
 
-// Helper structure for the reader:
+// Helper structure for the reader: a region of memory, e.g. a string or a
+// memory-mapped file, handed to lua all at once without copying.
 struct reader_helper {
-  const std::string * str;
+  const char * data;
+  std::size_t size;
   bool sent;
 
   explicit reader_helper(const std::string & s)
-    : str(&s)
+    : data(s.c_str())
+    , size(s.size())
+    , sent(false) {}
+
+  reader_helper(const char * d, std::size_t n)
+    : data(d)
+    , size(n)
     , sent(false) {}
 };
 
@@ -38,19 +54,102 @@ trivial_string_reader(lua_State *, void * data, size_t * size) {
     return nullptr;
   }
   h.sent = true;
-  *size = h.str->size();
-  return h.str->c_str();
+  *size = h.size;
+  return h.data;
+}
+
+// Reads through a buffer of `chunk_size` bytes, which is refilled by
+// `source(char * buf, std::size_t size)`. The source returns the number of
+// bytes it read, and 0 at the end, or on failure. The buffer must be
+// allocated with `init`, before lua is called.
+template <typename F>
+struct chunked_reader {
+  F & source;
+  std::string buffer;
+  std::size_t chunk_size;
+
+  chunked_reader(F & s, std::size_t n)
+    : source(s)
+    , buffer()
+    , chunk_size(n ? n : 1) {}
+
+  void init() { buffer.resize(chunk_size); }
+
+  const char * read(std::size_t * size) {
+    *size = source(&buffer[0], chunk_size);
+    return *size ? buffer.data() : nullptr;
+  }
+};
+
+// Expects 2nd argument to be chunked_reader<F> *
+template <typename F>
+const char *
+chunked_reader_fcn(lua_State *, void * data, size_t * size) {
+  return reinterpret_cast<chunked_reader<F> *>(data)->read(size);
 }
 
 // Expects 4th argument to be std::string *
 inline int
 trivial_string_writer(lua_State *, const void * b, size_t size, void * B) {
   std::string & output = *reinterpret_cast<std::string *>(B);
-  const char * incoming = reinterpret_cast<const char *>(b);
-  for (size_t i = 0; i < size; ++i) {
-    output.push_back(incoming[i]);
+  PRIMER_TRY_BAD_ALLOC {
+    output.append(reinterpret_cast<const char *>(b), size);
+    return 0;
   }
-  return 0;
+  PRIMER_CATCH_BAD_ALLOC { return 1; }
+}
+
+// Expects 4th argument to be std::ostream *
+inline int
+ostream_writer(lua_State *, const void * b, size_t size, void * B) {
+  std::ostream & output = *reinterpret_cast<std::ostream *>(B);
+  output.write(reinterpret_cast<const char *>(b),
+               static_cast<std::streamsize>(size));
+  return output ? 0 : 1;
+}
+
+// Gathers the many small writes made by eris into chunks of `chunk_size`
+// bytes, and passes each chunk to `sink(const char *, std::size_t)`, which
+// returns false to abort. Writes at least as large as a chunk are passed on
+// directly. The buffer must be reserved with `init`, before eris is called.
+template <typename F>
+struct chunked_writer {
+  F & sink;
+  std::string buffer;
+  std::size_t chunk_size;
+
+  chunked_writer(F & s, std::size_t n)
+    : sink(s)
+    , buffer()
+    , chunk_size(n ? n : 1) {}
+
+  void init() { buffer.reserve(chunk_size); }
+
+  bool write(const char * data, std::size_t size) {
+    if (buffer.size() + size < chunk_size) {
+      buffer.append(data, size);
+      return true;
+    }
+    if (!this->flush()) { return false; }
+    if (size >= chunk_size) { return sink(data, size); }
+    buffer.append(data, size);
+    return true;
+  }
+
+  bool flush() {
+    if (buffer.empty()) { return true; }
+    bool ok = sink(buffer.data(), buffer.size());
+    buffer.clear();
+    return ok;
+  }
+};
+
+// Expects 4th argument to be chunked_writer<F> *
+template <typename F>
+int
+chunked_writer_fcn(lua_State *, const void * b, size_t size, void * B) {
+  auto & w = *reinterpret_cast<chunked_writer<F> *>(B);
+  return w.write(reinterpret_cast<const char *>(b), size) ? 0 : 1;
 }
 
 } // end namespace detail
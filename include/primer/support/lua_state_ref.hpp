@@ -22,8 +22,20 @@
  * those delegates and you don't want them to be able to take ownership of the
  * lua state.
  *
- * lua_state_ref is not thread safe -- there would be little purpose, as lua is
- * not thread-safe.
+ * lua_state_ref is not thread safe by default -- there would be little purpose,
+ * as lua is not thread-safe. If PRIMER_THREAD_SAFE_STATE_REFS is defined, the
+ * weak refs are counted atomically, so that a lua_state_ref may be copied,
+ * destroyed, and checked for expiry on other threads than the one running the
+ * state. Using the state which `lock` returns is still only safe on the thread
+ * which owns it.
+ *
+ * In that mode, each state also has a queue of deferred unrefs. A lua_ref
+ * which is released on another thread than the owner of its state pushes its
+ * slot into the queue, rather than calling `luaL_unref`, and the owner unrefs
+ * them in bulk, see `release_deferred_refs` in `lua_ref.hpp`. The owner is the
+ * thread which first obtained a state ref, or the thread which last called
+ * `release_deferred_refs`. So if a state moves to another thread, that thread
+ * should call it before using the state.
  */
 
 #include <primer/base.hpp>
@@ -40,12 +52,51 @@ PRIMER_ASSERT_FILESCOPE;
 #include <new>
 #include <utility>
 
+#ifdef PRIMER_THREAD_SAFE_STATE_REFS
+#include <primer/support/deferred_unrefs.hpp>
+
+#include <atomic>
+#include <thread>
+#endif
+
+#ifndef PRIMER_NO_STATE_REF_CACHE
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#endif
+
 namespace primer {
 
+#ifdef PRIMER_THREAD_SAFE_STATE_REFS
+namespace detail {
+
+// Atomic weak refs, whose control structure also has the owner thread of the
+// state, and its queue of deferred unrefs
+struct state_ref_policy {
+  template <typename T>
+  struct control : nonstd::weak_ref_policy::atomic::control<T> {
+    mutable std::atomic<std::thread::id> owner;
+    deferred_unref_queue unrefs;
+
+    explicit control(T * t)
+      : nonstd::weak_ref_policy::atomic::control<T>(t)
+      , owner(std::this_thread::get_id()) {}
+  };
+};
+
+} // end namespace detail
+#endif
+
 class lua_state_ref {
 
-  using weak_ptr_type = nonstd::weak_ref<lua_State>;
-  using strong_ptr_type = nonstd::master_ref<lua_State>;
+#ifdef PRIMER_THREAD_SAFE_STATE_REFS
+  using ref_policy = detail::state_ref_policy;
+#else
+  using ref_policy = nonstd::weak_ref_policy::single_threaded;
+#endif
+
+  using weak_ptr_type = nonstd::weak_ref<lua_State, ref_policy>;
+  using strong_ptr_type = nonstd::master_ref<lua_State, ref_policy>;
 
   weak_ptr_type weak_ptr_;
 
@@ -78,15 +129,72 @@ public:
   // Check validity
   explicit operator bool() const noexcept { return this->lock(); }
 
+  // The address of the control structure. It identifies the state, and isn't
+  // reused while a ref holds it. Null once the ref has been found expired.
+  const void * identity() const noexcept { return weak_ptr_.control(); }
+
+#ifdef PRIMER_THREAD_SAFE_STATE_REFS
+  // Whether the calling thread owns the state, so that it may unref directly
+  bool on_owner_thread() const noexcept {
+    auto c = weak_ptr_.control();
+    return !c
+           || c->owner.load(std::memory_order_relaxed)
+                == std::this_thread::get_id();
+  }
+
+  // Queues a slot for the owner to unref. Does nothing if the state is gone,
+  // or, if memory fails, leaks the slot.
+  void defer_unref(int iref, detail::ref_pool * pool) const noexcept {
+    if (this->lock()) { weak_ptr_.control()->unrefs.push(iref, pool); }
+  }
+
+  // Takes the queued slots of the state, if there are any, and makes the
+  // calling thread the owner. Doesn't allocate.
+  static detail::deferred_unref * take_deferred_unrefs(lua_State * L) noexcept {
+    detail::deferred_unref * result = nullptr;
+    if (detail::push_existing_singleton<&make_strong_ptr>(L)
+        == LUA_TUSERDATA) {
+      auto ptr = static_cast<strong_ptr_type *>(lua_touserdata(L, -1));
+      if (auto c = ptr->control()) {
+        c->owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+        result = c->unrefs.take_all();
+      }
+    }
+    lua_pop(L, 1);
+    return result;
+  }
+#endif
+
   // Obtain a weak ref to the given lua state.
   // This works by installing a strong ref at a special registry key.
   // If the strong ref is not found, it is lazily created.
   // The strong ref is destroyed in its __gc metamethod, or, it can be
   // explicitly destroyed by calling "close_weak_refs".
+  //
+  // Unless PRIMER_NO_STATE_REF_CACHE is defined, the strong ref of a state is
+  // also found through a process-wide table, in a slot chosen by the address
+  // of its main thread, see `state_slot`. Then obtaining a weak ref is one
+  // increment of its count, and skips the registry lookup.
   static lua_state_ref obtain_weak_ref_to_state(lua_State * L) {
     PRIMER_ASSERT_STACK_NEUTRAL(L);
-    weak_ptr_type result{get_strong_ptr(L)};
+#ifndef PRIMER_NO_STATE_REF_CACHE
+    lua_State * M = primer::main_thread(L);
+    state_slot & slot = get_slot(M);
+    if (slot.main.load(std::memory_order_acquire) == M) {
+      if (const strong_ptr_type * ptr =
+            slot.ptr.load(std::memory_order_relaxed)) {
+        return lua_state_ref{weak_ptr_type{*ptr}};
+      }
+    }
+#endif
+    strong_ptr_type & strong = get_strong_ptr(L);
+    weak_ptr_type result{strong};
     lua_pop(L, 1);
+#ifndef PRIMER_NO_STATE_REF_CACHE
+    // A closed strong ref doesn't take a slot, since its memory may be
+    // released without its finalizer, by `fast_close`.
+    if (strong.get()) { claim_slot(M, &strong); }
+#endif
     return lua_state_ref{result};
   }
 
@@ -105,11 +213,58 @@ public:
   // refs will be closed by that, during the course of lua_close execution.]
   static void close_weak_refs_to_state(lua_State * L) {
     PRIMER_ASSERT_STACK_NEUTRAL(L);
-    get_strong_ptr(L).reset();
+    strong_ptr_type & strong = get_strong_ptr(L);
+#ifndef PRIMER_NO_STATE_REF_CACHE
+    release_slot(&strong);
+#endif
+    strong.reset();
     lua_pop(L, 1);
   }
 
 private:
+#ifndef PRIMER_NO_STATE_REF_CACHE
+  // A slot holds the strong ref of at most one state, which owns it: the
+  // state takes it when a weak ref is first obtained, if it is free, and gives
+  // it back when its strong ref is closed or collected. Only the thread which
+  // runs a state reads or writes a slot which it owns. Other threads only see
+  // that the main thread in it isn't theirs, and fall back to the registry.
+  // The slot holds no count, so nothing is released on another thread.
+  struct state_slot {
+    std::atomic<lua_State *> main;
+    std::atomic<const strong_ptr_type *> ptr;
+  };
+
+  static constexpr std::size_t state_slots = 128;
+
+  static state_slot & get_slot(lua_State * M) noexcept {
+    static state_slot table[state_slots];
+    std::size_t idx =
+      (reinterpret_cast<std::uintptr_t>(M) / alignof(std::max_align_t))
+      % state_slots;
+    return table[idx];
+  }
+
+  static void claim_slot(lua_State * M, const strong_ptr_type * ptr) noexcept {
+    state_slot & slot = get_slot(M);
+    lua_State * expected = nullptr;
+    if (slot.main.compare_exchange_strong(expected, M,
+                                          std::memory_order_acq_rel)) {
+      slot.ptr.store(ptr, std::memory_order_relaxed);
+    }
+  }
+
+  static void release_slot(const strong_ptr_type * ptr) noexcept {
+    lua_State * M = ptr->get();
+    if (!M) { return; }
+    state_slot & slot = get_slot(M);
+    if (slot.main.load(std::memory_order_relaxed) == M
+        && slot.ptr.load(std::memory_order_relaxed) == ptr) {
+      slot.ptr.store(nullptr, std::memory_order_relaxed);
+      slot.main.store(nullptr, std::memory_order_release);
+    }
+  }
+#endif
+
   // Create a strong pointer in a userdata. This object will be cached,
   // and needs to be destroyed when the lua state is destroyed.
   // This function raises a lua error in case of memory allocation failures.
@@ -143,6 +298,9 @@ private:
                   "strong_ptr_gc called with argument that is not userdata");
     strong_ptr_type * ptr =
       static_cast<strong_ptr_type *>(lua_touserdata(L, 1));
+#ifndef PRIMER_NO_STATE_REF_CACHE
+    release_slot(ptr);
+#endif
     ptr->~strong_ptr_type();
     lua_pushnil(L);
     lua_setmetatable(L, -2);
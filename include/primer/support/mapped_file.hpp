@@ -0,0 +1,114 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Read-only memory-mapped files, on POSIX systems.
+ *
+ * `mapped_file::open(path)` maps a file, or returns the mapping which the
+ * process already has of it, so that any number of lua states can load from
+ * one copy of the bytes. A mapping is replaced when the file on disk changes
+ * (its inode, size or modification time).
+ *
+ * The mapping of a file which is truncated by someone else while mapped can
+ * fault when read, so the files should be replaced by renaming, not rewritten.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace primer {
+
+class mapped_file {
+  const char * data_;
+  std::size_t size_;
+  ino_t inode_;
+  time_t mtime_;
+
+  mapped_file(const char * d, std::size_t n, const struct stat & st) noexcept
+    : data_(d)
+    , size_(n)
+    , inode_(st.st_ino)
+    , mtime_(st.st_mtime) {}
+
+  bool matches(const struct stat & st) const noexcept {
+    return st.st_ino == inode_ && st.st_mtime == mtime_
+           && static_cast<std::size_t>(st.st_size) == size_;
+  }
+
+  // The mappings in use, by path
+  struct registry {
+    std::mutex mutex;
+    std::map<std::string, std::weak_ptr<const mapped_file>> files;
+  };
+
+  static registry & get_registry() {
+    static registry r;
+    return r;
+  }
+
+  static std::shared_ptr<const mapped_file> map(const std::string & path,
+                                                struct stat & st) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) { return {}; }
+
+    std::shared_ptr<const mapped_file> result;
+    if (!::fstat(fd, &st) && S_ISREG(st.st_mode)) {
+      const auto size = static_cast<std::size_t>(st.st_size);
+      if (!size) {
+        result.reset(new mapped_file{"", 0, st});
+      } else {
+        void * p = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+          result.reset(new mapped_file{static_cast<const char *>(p), size, st});
+        }
+      }
+    }
+    ::close(fd);
+    return result;
+  }
+
+public:
+  mapped_file(const mapped_file &) = delete;
+  mapped_file & operator=(const mapped_file &) = delete;
+
+  ~mapped_file() {
+    if (size_) { ::munmap(const_cast<char *>(data_), size_); }
+  }
+
+  const char * data() const noexcept { return data_; }
+  std::size_t size() const noexcept { return size_; }
+
+  // Null if the file can't be opened and mapped
+  static std::shared_ptr<const mapped_file> open(const std::string & path) {
+    struct stat st;
+    if (::stat(path.c_str(), &st)) { return {}; }
+
+    registry & r = get_registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    auto & slot = r.files[path];
+    if (auto existing = slot.lock()) {
+      if (existing->matches(st)) { return existing; }
+    }
+    auto result = mapped_file::map(path, st);
+    slot = result;
+    return result;
+  }
+};
+
+} // end namespace primer
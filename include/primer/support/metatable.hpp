@@ -10,7 +10,9 @@
  * Adapts to whether the user provided a list of methods, a function to call,
  * or nothing.
  *
- * Should provide `static void populate(lua_State *)`
+ * Should provide `static void populate(lua_State *)`, and
+ * `static int size_hint()`, the number of fields which populate is likely to
+ * set, so that the table is created at that size and doesn't rehash.
  */
 
 #include <primer/base.hpp>
@@ -24,6 +26,9 @@ PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/support/asserts.hpp>
 #include <primer/support/diagnostics.hpp>
+#include <primer/support/udata_fields.hpp>
+#include <primer/support/udata_inheritance.hpp>
+#include <primer/support/udata_persist.hpp>
 #include <primer/support/userdata_common.hpp>
 
 #include <primer/traits/userdata.hpp>
@@ -36,6 +41,16 @@ namespace primer {
 
 namespace detail {
 
+// Fields which primer may add to any metatable, besides the user's and the
+// special names: the lineage, a generated `__persist`, and the field
+// accessors.
+template <typename T>
+constexpr int
+extra_fields() {
+  return (udata_has_base<T>::value ? 2 : 0) + (udata_auto_persist<T>::value)
+         + (udata_has_fields<T>::value ? 2 : 0);
+}
+
 //[ primer_default_metatable
 // minimalistic, do-nothing metatable
 template <typename T, typename ENABLE = void>
@@ -44,13 +59,26 @@ struct metatable {
 
   static void populate(lua_State * L) {
     PRIMER_ASSERT_TABLE(L);
-    // A minimalistic metatable with __gc
+    // A minimalistic metatable, with __gc if T needs it
     lua_pushstring(L, udata::name);
     lua_setfield(L, -2, "__metatable");
-    lua_pushcfunction(L, &primer::detail::common_gc_impl<T>);
-    lua_setfield(L, -2, "__gc");
+    if (udata_needs_gc<T>::value) {
+      lua_pushcfunction(L, &primer::detail::common_gc_impl<T>);
+      lua_setfield(L, -2, "__gc");
+    }
+    // The block of a slab userdata is only a pointer, so it can't be persisted
+    // unless primer generates `__persist`
+    if (udata_in_slab<T>::value && !udata_auto_persist<T>::value) {
+      lua_pushboolean(L, false);
+      lua_setfield(L, -2, "__persist");
+    }
+    udata_lineage_populate<T>(L, udata_has_base<T>{});
+    udata_persist_populate<T>(L, udata_auto_persist<T>{});
+    if (udata_has_fields<T>::value) { udata_fields_populate<T>(L); }
   }
 
+  static int size_hint() noexcept { return 4 + extra_fields<T>(); }
+
   static constexpr int value = 0;
 };
 //]
@@ -72,8 +100,14 @@ struct metatable<T,
     PRIMER_ASSERT_TABLE(L);
     PRIMER_ASSERT_STACK_NEUTRAL(L);
     primer::traits::userdata<T>::metatable(L);
+    udata_lineage_populate<T>(L, udata_has_base<T>{});
+    udata_persist_populate<T>(L, udata_auto_persist<T>{});
+    if (udata_has_fields<T>::value) { udata_fields_populate<T>(L); }
   }
 
+  // The user's function may set anything
+  static int size_hint() noexcept { return 4 + extra_fields<T>(); }
+
   static constexpr int value = 1;
 };
 
@@ -85,6 +119,50 @@ struct metatable<T, enable_if_t<detail::is_L_Reg_sequence<decltype(
   //[ primer_automatically_generated_metatable
   using udata = primer::traits::userdata<T>;
 
+  // What the sequence holds, which is worked out once, on first use
+  struct reg_info {
+    int size = 0;
+    bool saw_gc_metamethod = false;
+    bool saw_index_metamethod = false;
+    bool saw_metatable_metamethod = false;
+    bool saw_persist_metamethod = false;
+  };
+
+  static reg_info scan() {
+    using m_t = decltype(udata::metatable);
+    // Bound as in `populate`, see the note there
+    const auto & metatable_seq =
+      detail::is_L_Reg_sequence<m_t>::adapt(udata::metatable);
+    reg_info info;
+    detail::iterate_L_Reg_sequence(
+      metatable_seq, [&info](const char * name, lua_CFunction func) {
+        if (!name) { return; }
+        if (func) { ++info.size; }
+        // Only the names of metamethods need comparing
+        if (name[0] != '_' || name[1] != '_') { return; }
+        if (0 == std::strcmp(name, "__gc")) { info.saw_gc_metamethod = true; }
+        if (0 == std::strcmp(name, "__index")) {
+          info.saw_index_metamethod = true;
+        }
+        if (0 == std::strcmp(name, "__metatable")) {
+          info.saw_metatable_metamethod = true;
+        }
+        if (0 == std::strcmp(name, "__persist")) {
+          info.saw_persist_metamethod = true;
+        }
+      });
+    return info;
+  }
+
+  static const reg_info & info() {
+    static const reg_info result = scan();
+    return result;
+  }
+
+  static int size_hint() {
+    return info().size + 4 + extra_fields<T>();
+  }
+
   static void populate(lua_State * L) {
     using m_t = decltype(udata::metatable);
     const auto & metatable_seq =
@@ -93,45 +171,47 @@ struct metatable<T, enable_if_t<detail::is_L_Reg_sequence<decltype(
     PRIMER_ASSERT_TABLE(L);
     PRIMER_ASSERT_STACK_NEUTRAL(L);
 
-    // Assign the methods to the metatable
-    // Use auto in case we use an expanded reg type later.
-    bool saw_gc_metamethod = false;
-    bool saw_index_metamethod = false;
-    bool saw_metatable_metamethod = false;
+    // The special names which the user registered, found by `scan`
+    const reg_info & seen = info();
+    const bool saw_gc_metamethod = seen.saw_gc_metamethod;
+    const bool saw_index_metamethod = seen.saw_index_metamethod;
+    const bool saw_metatable_metamethod = seen.saw_metatable_metamethod;
+    const bool saw_persist_metamethod = seen.saw_persist_metamethod;
     constexpr const char * gc_name = "__gc";
     constexpr const char * index_name = "__index";
     constexpr const char * metatable_name = "__metatable";
+    constexpr const char * persist_name = "__persist";
 
     // TODO: why can't we just use udata::metatable instead of metatable_seq?
     // it seems that causes an ODR-use or something that isn't otherwise there
     // but I'm not sure why... it might be a compiler bug?
     // This way, while more verbose, seems to allow terser registration of
     // userdata.
+    // Assign the methods to the metatable
     detail::iterate_L_Reg_sequence(
-      metatable_seq, [&](const char * name, lua_CFunction func) {
-        if (name) {
-          if (func) {
-            lua_pushcfunction(L, func);
-            lua_setfield(L, -2, name);
-          }
-          if (0 == std::strcmp(name, gc_name)) { saw_gc_metamethod = true; }
-          if (0 == std::strcmp(name, index_name)) {
-            saw_index_metamethod = true;
-          }
-          if (0 == std::strcmp(name, metatable_name)) {
-            saw_metatable_metamethod = true;
-          }
+      metatable_seq, [L](const char * name, lua_CFunction func) {
+        if (name && func) {
+          lua_pushcfunction(L, func);
+          lua_setfield(L, -2, name);
         }
       });
 
     // If the user did not register __gc then it is potentially (likely) a
     // leak, so install a trivial guy which calls the dtor.
-    // Rarely want anything besides this anyways.
-    if (!saw_gc_metamethod) {
+    // Rarely want anything besides this anyways, unless the dtor is trivial.
+    if (!saw_gc_metamethod && udata_needs_gc<T>::value) {
       lua_pushcfunction(L, &primer::detail::common_gc_impl<T>);
       lua_setfield(L, -2, gc_name);
     }
 
+    // The block of a slab userdata is only a pointer, so unless the user says
+    // how to persist it, or it is generated, make persisting it an error.
+    if (!saw_persist_metamethod && udata_in_slab<T>::value
+        && !udata_auto_persist<T>::value) {
+      lua_pushboolean(L, false);
+      lua_setfield(L, -2, persist_name);
+    }
+
     // Set the udata_name string also to be the "__metatable" field of the
     // metatable.
     // This means that when the user runs "getmetatable" on an instance,
@@ -147,6 +227,13 @@ struct metatable<T, enable_if_t<detail::is_L_Reg_sequence<decltype(
       lua_pushvalue(L, -1);
       lua_setfield(L, -2, index_name);
     }
+
+    // The base of the type, see <primer/support/udata_inheritance.hpp>, a
+    // generated `__persist`, see <primer/support/udata_persist.hpp>, and fields
+    // set by lua, see <primer/support/udata_fields.hpp>
+    udata_lineage_populate<T>(L, udata_has_base<T>{});
+    udata_persist_populate<T>(L, udata_auto_persist<T>{});
+    if (udata_has_fields<T>::value) { udata_fields_populate<T>(L); }
   }
   //]
 
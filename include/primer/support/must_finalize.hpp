@@ -0,0 +1,57 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * The userdata whose finalizers `fast_close` runs, see <primer/fast_close.hpp>.
+ *
+ * When a userdata of a type whose trait has `must_finalize` gets its metatable,
+ * it is put in a table with weak keys, in the registry. So the table holds the
+ * live objects of those types only, and tearing down a state finds them
+ * without walking the rest of its heap.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/support/asserts.hpp>
+
+namespace primer {
+namespace detail {
+
+inline void *
+must_finalize_key() noexcept {
+  static char key;
+  return &key;
+}
+
+// Adds the userdata on top of the stack to the table.
+// Note: Raises a lua error on memory allocation failure
+inline void
+track_must_finalize(lua_State * L) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  luaL_checkstack(L, 3, "track_must_finalize");
+  lua_rawgetp(L, LUA_REGISTRYINDEX, must_finalize_key());
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, must_finalize_key());
+  }
+  lua_pushvalue(L, -2);
+  lua_pushboolean(L, true);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+} // end namespace detail
+} // end namespace primer
@@ -9,6 +9,10 @@
  * This is similar to the "metatable" header. It creates a trait that handles
  * the possibilities for the "permanents" member of the userdata trait, so that
  * we can populate the permanent objects table.
+ *
+ * A type with fields also adds the function which rebuilds its objects, see
+ * <primer/support/udata_fields.hpp>, and so does a type with a generated
+ * `__persist`, see <primer/support/udata_persist.hpp>.
  */
 
 #include <primer/base.hpp>
@@ -21,6 +25,9 @@ PRIMER_ASSERT_FILESCOPE;
 #include <primer/set_funcs.hpp>
 #include <primer/support/asserts.hpp>
 #include <primer/support/diagnostics.hpp>
+#include <primer/support/udata_fields.hpp>
+#include <primer/support/udata_persist.hpp>
+#include <primer/support/userdata_common.hpp>
 #include <primer/traits/userdata.hpp>
 
 namespace primer {
@@ -28,8 +35,14 @@ namespace detail {
 
 template <typename T, typename ENABLE = void>
 struct permanents_helper {
-  static void populate(lua_State *) {}
-  static void populate_reverse(lua_State *) {}
+  static void populate(lua_State * L) {
+    udata_fields_permanents<T>(L, false, udata_has_fields<T>{});
+    udata_persist_permanents<T>(L, false, udata_auto_persist<T>{});
+  }
+  static void populate_reverse(lua_State * L) {
+    udata_fields_permanents<T>(L, true, udata_has_fields<T>{});
+    udata_persist_permanents<T>(L, true, udata_auto_persist<T>{});
+  }
   static constexpr int value = 0;
 };
 
@@ -40,10 +53,14 @@ struct permanents_helper<T,
 
   static void populate(lua_State * L) {
     primer::set_funcs(L, primer::traits::userdata<T>::permanents);
+    udata_fields_permanents<T>(L, false, udata_has_fields<T>{});
+    udata_persist_permanents<T>(L, false, udata_auto_persist<T>{});
   }
 
   static void populate_reverse(lua_State * L) {
     primer::set_funcs_reverse(L, primer::traits::userdata<T>::permanents);
+    udata_fields_permanents<T>(L, true, udata_has_fields<T>{});
+    udata_persist_permanents<T>(L, true, udata_auto_persist<T>{});
   }
 
   static constexpr int value = 1;
@@ -0,0 +1,140 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * The persisted form of the userdata which hold a block of numbers, i.e.
+ * typed arrays, byte buffers, and the columns of soa views.
+ *
+ * The block is persisted as one lua string, of a 12 byte header and then the
+ * bytes of the elements, as they are in memory:
+ *
+ *   byte 0      'i', 'u' or 'f', for signed, unsigned or floating elements
+ *   byte 1      the size of an element
+ *   byte 2      'l' or 'b', the byte order of the elements and of the count
+ *   byte 3      zero
+ *   bytes 4-11  the number of elements, as a 64 bit unsigned integer
+ *
+ * So a snapshot holds the block in one piece, rather than one lua value per
+ * element, and restoring it is one allocation and one `memcpy`. A block which
+ * was saved on a machine of the other byte order is swapped in place after
+ * the copy.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+namespace primer {
+namespace detail {
+
+constexpr std::size_t raw_persist_header_size = 12;
+
+template <typename T>
+struct raw_element_kind {
+  PRIMER_STATIC_ASSERT(std::is_arithmetic<T>::value,
+                       "raw persisted elements are numbers");
+
+  static constexpr char value = std::is_floating_point<T>::value
+                                  ? 'f'
+                                  : std::is_signed<T>::value ? 'i' : 'u';
+};
+
+template <typename T>
+constexpr char raw_element_kind<T>::value;
+
+inline char
+raw_native_order() noexcept {
+  const std::uint16_t one = 1;
+  unsigned char first;
+  std::memcpy(&first, &one, 1);
+  return first ? 'l' : 'b';
+}
+
+inline void
+raw_persist_swap(void * data, std::size_t count, std::size_t size) noexcept {
+  auto * p = static_cast<unsigned char *>(data);
+  for (std::size_t i = 0; i < count; ++i, p += size) {
+    for (std::size_t a = 0, b = size - 1; a < b; ++a, --b) {
+      const unsigned char t = p[a];
+      p[a] = p[b];
+      p[b] = t;
+    }
+  }
+}
+
+// Pushes the persisted form of `count` elements of `size` bytes at `data`.
+// Raises a lua error on memory failure.
+inline void
+raw_persist_push(lua_State * L, char kind, std::size_t size, const void * data,
+                 std::size_t count) {
+  if (count > (std::numeric_limits<std::size_t>::max()
+               - raw_persist_header_size)
+                / size) {
+    luaL_error(L, "block of %d byte elements is too large to persist",
+               static_cast<int>(size));
+  }
+  const std::size_t bytes = count * size;
+
+  char header[raw_persist_header_size];
+  header[0] = kind;
+  header[1] = static_cast<char>(size);
+  header[2] = raw_native_order();
+  header[3] = 0;
+  const std::uint64_t n = count;
+  std::memcpy(header + 4, &n, sizeof n);
+
+  luaL_Buffer b;
+#if LUA_VERSION_NUM >= 502
+  char * out = luaL_buffinitsize(L, &b, raw_persist_header_size + bytes);
+  std::memcpy(out, header, raw_persist_header_size);
+  if (bytes) { std::memcpy(out + raw_persist_header_size, data, bytes); }
+  luaL_pushresultsize(&b, raw_persist_header_size + bytes);
+#else
+  luaL_buffinit(L, &b);
+  luaL_addlstring(&b, header, raw_persist_header_size);
+  luaL_addlstring(&b, static_cast<const char *>(data), bytes);
+  luaL_pushresult(&b);
+#endif
+}
+
+// The elements of a persisted block, checked against the expected type
+struct raw_persist_block {
+  const char * data;
+  std::size_t count;
+  bool swapped; // The elements must be swapped after they are copied
+};
+
+inline bool
+raw_persist_parse(const char * s, std::size_t len, char kind, std::size_t size,
+                  raw_persist_block & out) noexcept {
+  if (len < raw_persist_header_size || s[0] != kind
+      || static_cast<std::size_t>(static_cast<unsigned char>(s[1])) != size
+      || (s[2] != 'l' && s[2] != 'b') || s[3]) {
+    return false;
+  }
+  const bool swapped = (s[2] != raw_native_order());
+  std::uint64_t n;
+  std::memcpy(&n, s + 4, sizeof n);
+  if (swapped) { raw_persist_swap(&n, 1, sizeof n); }
+
+  const std::size_t bytes = len - raw_persist_header_size;
+  if (bytes % size || n != bytes / size) { return false; }
+  out = raw_persist_block{s + raw_persist_header_size,
+                          static_cast<std::size_t>(n), swapped};
+  return true;
+}
+
+} // end namespace detail
+} // end namespace primer
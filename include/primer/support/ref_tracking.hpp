@@ -0,0 +1,110 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Notices of the slots which `lua_ref` objects take and release.
+ *
+ * With PRIMER_REF_TRACKING defined, a `lua_ref` which binds to a value looks
+ * for a `ref_tracking_hooks` object in the registry of its state, and if there
+ * is one, tells it the slot and the site which made the ref. Releasing the ref
+ * tells it again, on the thread which owns the state, so a slot released on
+ * another thread is reported when `release_deferred_refs` unrefs it.
+ * `api::ref_tracker` installs itself there.
+ *
+ * A slot is a registry index, or an index into a `lua_ref_pool`, so it is
+ * reported with the pool, or nullptr. The site is the return address of the
+ * constructor of the `lua_ref`, which PRIMER_REF_TRACKING keeps from being
+ * inlined, so it points into the code which constructed or copied the ref. It
+ * is nullptr on compilers which can't tell.
+ *
+ * Without PRIMER_REF_TRACKING, refs don't look, and nothing is reported.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+
+#if defined(PRIMER_REF_TRACKING) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace primer {
+namespace detail {
+
+struct ref_pool;
+
+struct ref_tracking_hooks {
+  void * self;
+  void (*created)(void * self, const ref_pool * pool, int iref,
+                  const void * site) noexcept;
+  void (*released)(void * self, const ref_pool * pool, int iref) noexcept;
+};
+
+inline void *
+ref_tracking_key() noexcept {
+  static char key;
+  return &key;
+}
+
+#ifdef PRIMER_REF_TRACKING
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PRIMER_REF_SITE_NOINLINE __attribute__((noinline))
+#define PRIMER_REF_SITE() __builtin_return_address(0)
+#elif defined(_MSC_VER)
+#define PRIMER_REF_SITE_NOINLINE __declspec(noinline)
+#define PRIMER_REF_SITE() _ReturnAddress()
+#else
+#define PRIMER_REF_SITE_NOINLINE
+#define PRIMER_REF_SITE() nullptr
+#endif
+
+inline const ref_tracking_hooks *
+get_ref_tracking_hooks(lua_State * L) noexcept {
+  if (!lua_checkstack(L, 1)) { return nullptr; }
+  lua_rawgetp(L, LUA_REGISTRYINDEX, ref_tracking_key());
+  auto hooks = static_cast<const ref_tracking_hooks *>(lua_touserdata(L, -1));
+  lua_pop(L, 1);
+  return hooks;
+}
+
+// Slots below zero, i.e. LUA_REFNIL and LUA_NOREF, aren't slots
+inline void
+ref_tracking_created(lua_State * L, const ref_pool * pool, int iref,
+                     const void * site) noexcept {
+  if (iref < 0) { return; }
+  if (auto hooks = get_ref_tracking_hooks(L)) {
+    hooks->created(hooks->self, pool, iref, site);
+  }
+}
+
+inline void
+ref_tracking_released(lua_State * L, const ref_pool * pool, int iref) noexcept {
+  if (iref < 0) { return; }
+  if (auto hooks = get_ref_tracking_hooks(L)) {
+    hooks->released(hooks->self, pool, iref);
+  }
+}
+
+#else
+
+#define PRIMER_REF_SITE_NOINLINE
+#define PRIMER_REF_SITE() nullptr
+
+inline void
+ref_tracking_created(lua_State *, const ref_pool *, int,
+                     const void *) noexcept {}
+
+inline void
+ref_tracking_released(lua_State *, const ref_pool *, int) noexcept {}
+
+#endif
+
+} // end namespace detail
+} // end namespace primer
@@ -0,0 +1,126 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Registry slots, used by `push_singleton` and `registry_helper` when
+ * PRIMER_REGISTRY_SLOTS is defined.
+ *
+ * Each singleton or helper gets a fixed integer key in the registry, the same
+ * in every lua state, so that finding its object is a `lua_rawgeti` into the
+ * array part of the registry, instead of a lookup in its hash part.
+ *
+ * The numbers are given out to the keys as the program starts. The first call
+ * to `reserve_registry_slots` stops that, and any key which didn't have a
+ * number then uses the hash part as usual. `reserve_registry_slots` fills the
+ * slots with `false`, if nothing else holds an integer key of the registry
+ * yet, i.e. before any `luaL_ref` on it. `api::init_caches` does it, so a
+ * state gets slots if it is initialized with `initialize_api` before making
+ * references in it. In a state which has no slots, the hash part is used.
+ *
+ * The first integer key after lua's own holds a marker, which says that the
+ * state was reserved. Since a state which wasn't may use these keys for
+ * references, the marker is checked before looking in a slot. A slot which
+ * holds `false` has no object yet.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#ifdef PRIMER_REGISTRY_SLOTS
+
+#include <primer/lua.hpp>
+#include <primer/support/asserts.hpp>
+
+#include <atomic>
+
+namespace primer {
+namespace detail {
+
+// The marker comes after the keys which lua reserves, then the slots
+constexpr int registry_slot_marker = LUA_RIDX_LAST + 1;
+constexpr int registry_slot_base = registry_slot_marker + 1;
+
+// While it is not negative, the number of slots given out. Once reserving
+// starts, it is `-n - 1` where `n` is the final number.
+inline std::atomic<int> &
+registry_slot_counter() noexcept {
+  static std::atomic<int> counter{0};
+  return counter;
+}
+
+// Gives a new slot, or 0 if slots are not given out anymore
+inline int
+next_registry_slot() noexcept {
+  auto & counter = registry_slot_counter();
+  int n = counter.load();
+  while (n >= 0 && !counter.compare_exchange_weak(n, n + 1)) {}
+  return n >= 0 ? registry_slot_base + n : 0;
+}
+
+// Stops giving out slots, and returns the number of them
+inline int
+freeze_registry_slots() noexcept {
+  auto & counter = registry_slot_counter();
+  int n = counter.load();
+  while (n >= 0 && !counter.compare_exchange_weak(n, -n - 1)) {}
+  return n >= 0 ? n : -n - 1;
+}
+
+// The slot of the key type `K`, or 0 if it has none. This is numbered during
+// static initialization, so a key used before that also gets 0.
+template <typename K>
+struct registry_slot {
+  static const int value;
+};
+
+template <typename K>
+const int registry_slot<K>::value = next_registry_slot();
+
+inline void *
+registry_slots_key() noexcept {
+  static char key;
+  return &key;
+}
+
+// Whether the slots of this state are reserved
+inline bool
+registry_slots_reserved(lua_State * L) noexcept {
+  lua_rawgeti(L, LUA_REGISTRYINDEX, registry_slot_marker);
+  const bool result = (lua_touserdata(L, -1) == registry_slots_key());
+  lua_pop(L, 1);
+  return result;
+}
+
+} // end namespace detail
+
+/***
+ * Fill the registry slots of this state with `false`, and return true. Doing
+ * it again does nothing. If the registry already has integer keys which are
+ * not lua's own, the state gets no slots, and this returns false.
+ */
+inline bool
+reserve_registry_slots(lua_State * L) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  const int n = detail::freeze_registry_slots();
+  if (detail::registry_slots_reserved(L)) { return true; }
+  if (lua_rawlen(L, LUA_REGISTRYINDEX) >= detail::registry_slot_marker) {
+    return false;
+  }
+
+  lua_pushlightuserdata(L, detail::registry_slots_key());
+  lua_rawseti(L, LUA_REGISTRYINDEX, detail::registry_slot_marker);
+  for (int i = 0; i < n; ++i) {
+    lua_pushboolean(L, false);
+    lua_rawseti(L, LUA_REGISTRYINDEX, detail::registry_slot_base + i);
+  }
+  return true;
+}
+
+} // end namespace primer
+
+#endif // PRIMER_REGISTRY_SLOTS
@@ -0,0 +1,154 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Helpers which place the calling thread on a core or a NUMA node.
+ *
+ * `pin_this_thread_to_cpu(cpu)` restricts the thread to one core, and
+ * `pin_this_thread_to_node(node)` to the cores of one node.
+ * `prefer_local_memory(node)` makes the kernel take the pages which the
+ * thread touches first from that node, which is where a chunk of a
+ * `pool_allocator` then lives.
+ *
+ * These use the linux system calls directly, so there is no dependency on
+ * libnuma. On other systems, and when the call fails, e.g. because the core
+ * is not in the cpuset of the process, they return false and change nothing.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <cstddef>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace primer {
+namespace detail {
+
+#ifdef __linux__
+inline void
+node_cpulist_path(char * buf, std::size_t size, std::size_t node) noexcept {
+  std::snprintf(buf, size, "/sys/devices/system/node/node%zu/cpulist", node);
+}
+#endif
+
+// Reads a list like "0-3,8-11" from the file at `path`, and calls `f(id)` for
+// each id in it. Returns false if the file can't be read or has no ids.
+template <typename F>
+bool
+read_id_list(const char * path, F && f) {
+  std::FILE * file = std::fopen(path, "r");
+  if (!file) { return false; }
+
+  bool any = false;
+  unsigned lo, hi;
+  int c;
+  while (std::fscanf(file, "%u", &lo) == 1) {
+    hi = lo;
+    c = std::fgetc(file);
+    if (c == '-') {
+      if (std::fscanf(file, "%u", &hi) != 1) { break; }
+      c = std::fgetc(file);
+    }
+    for (unsigned i = lo; i <= hi; ++i) {
+      f(static_cast<std::size_t>(i));
+      any = true;
+    }
+    if (c != ',') { break; }
+  }
+  std::fclose(file);
+  return any;
+}
+
+// The ids of the online NUMA nodes, which need not be contiguous, e.g. when a
+// node has no memory. {0} if the system doesn't say.
+inline std::vector<std::size_t>
+numa_online_nodes() {
+  std::vector<std::size_t> result;
+#ifdef __linux__
+  read_id_list("/sys/devices/system/node/online",
+               [&result](std::size_t id) { result.push_back(id); });
+#endif
+  if (result.empty()) { result.push_back(0); }
+  return result;
+}
+
+inline std::size_t
+cpu_count() noexcept {
+  const unsigned n = std::thread::hardware_concurrency();
+  return n ? n : 1;
+}
+
+#ifdef __linux__
+
+// Reads the cores of `node` into `set`
+inline bool
+read_node_cpus(std::size_t node, cpu_set_t & set) noexcept {
+  CPU_ZERO(&set);
+  char path[64];
+  node_cpulist_path(path, sizeof path, node);
+  return read_id_list(path, [&set](std::size_t i) {
+    if (i < CPU_SETSIZE) { CPU_SET(i, &set); }
+  });
+}
+
+#endif // __linux__
+
+inline bool
+pin_this_thread_to_cpu(std::size_t cpu) noexcept {
+#ifdef __linux__
+  if (cpu >= CPU_SETSIZE) { return false; }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return !::pthread_setaffinity_np(::pthread_self(), sizeof set, &set);
+#else
+  static_cast<void>(cpu);
+  return false;
+#endif
+}
+
+inline bool
+pin_this_thread_to_node(std::size_t node) noexcept {
+#ifdef __linux__
+  cpu_set_t set;
+  if (!read_node_cpus(node, set)) { return false; }
+  return !::pthread_setaffinity_np(::pthread_self(), sizeof set, &set);
+#else
+  static_cast<void>(node);
+  return false;
+#endif
+}
+
+inline bool
+prefer_local_memory(std::size_t node) noexcept {
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+  // MPOL_PREFERRED, from <linux/mempolicy.h>, which falls back to the other
+  // nodes rather than failing when the node is full
+  constexpr int mpol_preferred = 1;
+  constexpr std::size_t bits = 8 * sizeof(unsigned long);
+  if (node >= 4 * bits) { return false; }
+  unsigned long mask[4] = {};
+  mask[node / bits] = 1ul << (node % bits);
+  return !::syscall(SYS_set_mempolicy, mpol_preferred, mask, 4 * bits + 1);
+#else
+  static_cast<void>(node);
+  return false;
+#endif
+}
+
+} // end namespace detail
+} // end namespace primer
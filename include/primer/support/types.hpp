@@ -13,6 +13,7 @@
 
 PRIMER_ASSERT_FILESCOPE;
 
+#include <cstddef>
 #include <string>
 
 //[ primer_support_types
@@ -34,5 +35,39 @@ struct stringy {
   std::string value;
 };
 
+// Use this type if you want to read a string without copying it. It refers to
+// memory owned by lua, and is only valid while the string is on the stack.
+// (For instance, when it is a parameter of an adapted callback.)
+struct lua_string_view {
+  const char * data_;
+  std::size_t size_;
+
+  const char * data() const noexcept { return data_; }
+  std::size_t size() const noexcept { return size_; }
+  bool empty() const noexcept { return !size_; }
+
+  const char * begin() const noexcept { return data_; }
+  const char * end() const noexcept { return data_ + size_; }
+  char operator[](std::size_t i) const noexcept { return data_[i]; }
+
+  explicit operator std::string() const { return std::string(data_, size_); }
+  std::string str() const { return std::string(data_, size_); }
+};
+
+// Use these types to choose, for one parameter, whether a floating point
+// number may be converted from a string, whatever the global policy is. See
+// PRIMER_STRICT_NUMBERS. They convert to the number type.
+template <typename T>
+struct strict_number {
+  T value;
+  operator T() const noexcept { return value; }
+};
+
+template <typename T>
+struct lenient_number {
+  T value;
+  operator T() const noexcept { return value; }
+};
+
 } // end namespace primer
 //]
@@ -0,0 +1,114 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Borrowed userdata.
+ *
+ * A borrowed userdata of `T` holds only a pointer to a `T` which lives
+ * somewhere else, like in the block of a `primer::udata_array<T>`. Whatever
+ * owns the object is the uservalue of the borrowed userdata, so it lives at
+ * least as long.
+ *
+ * Its metatable is a copy of the metatable of `T`, without `__gc`, so that the
+ * object isn't destroyed through it, and with `__persist = false`, since a
+ * pointer can't be persisted. `test_udata<T>` accepts it as a `T`, so the
+ * methods of `T` work on it, and as any base of `T`.
+ *
+ * More generally, an indirect userdata is one whose block starts with a
+ * pointer to the object. Its metatable is marked with the id of `T`, and
+ * `test_udata<T>` follows the pointer, so kinds of userdata other than
+ * borrowed ones, like the blocks of `push_shared`, may use the same layout.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/metatable.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/udata_inheritance.hpp>
+
+#include <cstring>
+
+namespace primer {
+namespace detail {
+
+inline void *
+udata_indirect_key() noexcept {
+  static char key;
+  return &key;
+}
+
+// Pushes a copy of the metatable of `T`, without `__gc`, with `__persist =
+// false`, and marked as the metatable of an indirect `T`
+template <typename T>
+void
+push_udata_indirect_metatable(lua_State * L) {
+  primer::push_metatable<T>(L);
+  const int source = lua_absindex(L, -1);
+  lua_newtable(L);
+  const int result = source + 1;
+
+  lua_pushnil(L);
+  while (lua_next(L, source)) {
+    const bool skip =
+      lua_type(L, -2) == LUA_TSTRING
+      && (0 == std::strcmp(lua_tostring(L, -2), "__gc")
+          || 0 == std::strcmp(lua_tostring(L, -2), "__persist"));
+    if (skip) {
+      lua_pop(L, 1);
+    } else {
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);
+      lua_rawset(L, result);
+    }
+  }
+  lua_pushboolean(L, false);
+  lua_setfield(L, result, "__persist");
+  lua_pushlightuserdata(L, const_cast<char *>(&udata_type_id<T>::value));
+  lua_rawsetp(L, result, udata_indirect_key());
+  udata_lineage_populate<T, true>(L, udata_has_base<T>{});
+
+  lua_remove(L, source);
+}
+
+// Produces the metatable of borrowed `T`
+template <typename T>
+void
+udata_borrowed_metatable(lua_State * L) {
+  push_udata_indirect_metatable<T>(L);
+}
+
+// Push a borrowed userdata of `T`, pointing to `t`, whose uservalue is the
+// value at `owner`
+template <typename T>
+void
+push_udata_borrowed(lua_State * L, T * t, int owner) {
+  owner = lua_absindex(L, owner);
+  *static_cast<T **>(lua_newuserdata(L, sizeof(T *))) = t;
+  primer::push_singleton<&udata_borrowed_metatable<T>>(L);
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, owner);
+  lua_setuservalue(L, -2);
+}
+
+// With the metatable of the userdata block `p` on top of the stack, gives the
+// object if it is an indirect `T`, or nullptr
+template <typename T>
+T *
+udata_indirect_test(lua_State * L, void * p) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  lua_rawgetp(L, -1, udata_indirect_key());
+  const bool indirect = (lua_touserdata(L, -1) == &udata_type_id<T>::value);
+  lua_pop(L, 1);
+  return indirect ? *static_cast<T **>(p) : nullptr;
+}
+
+} // end namespace detail
+} // end namespace primer
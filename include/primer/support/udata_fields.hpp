@@ -0,0 +1,202 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Fields of userdata objects.
+ *
+ * If the userdata trait of `T` has `static constexpr bool fields = true`,
+ * scripts may set fields on its objects, like on tables. They are kept in the
+ * uservalue of each object, a table which is made the first time a field is
+ * set. So they cost nothing for objects without fields, and unlike a side
+ * table with weak keys, nothing for the collector.
+ *
+ * The metatable gets these generated entries:
+ * - `__index` looks in what the metatable would have used otherwise, e.g. the
+ *   method table, and then in the fields.
+ * - `__newindex` sets a field, unless the metatable has its own.
+ * - `__persist` persists the fields along with the object, unless it is
+ *   `false`. If the metatable has a `__persist` function, it is used for the
+ *   object itself, otherwise the bytes of the object are copied, as eris
+ *   does. The function which rebuilds the object must be in the permanent
+ *   objects table, which `api::userdatas` does.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/userdata_common.hpp>
+#include <primer/traits/userdata.hpp>
+
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace primer {
+
+template <typename T>
+void push_metatable(lua_State * L);
+
+namespace detail {
+
+// Upvalue 1 is the previous `__index`, a table, a function or nil
+inline int
+udata_fields_index(lua_State * L) {
+  lua_settop(L, 2);
+  switch (lua_type(L, lua_upvalueindex(1))) {
+    case LUA_TTABLE:
+      lua_pushvalue(L, 2);
+      if (lua_gettable(L, lua_upvalueindex(1)) != LUA_TNIL) { return 1; }
+      lua_pop(L, 1);
+      break;
+    case LUA_TFUNCTION:
+      lua_pushvalue(L, lua_upvalueindex(1));
+      lua_pushvalue(L, 1);
+      lua_pushvalue(L, 2);
+      lua_call(L, 2, 1);
+      if (!lua_isnil(L, -1)) { return 1; }
+      lua_pop(L, 1);
+      break;
+    default:
+      break;
+  }
+  if (lua_getuservalue(L, 1) == LUA_TTABLE) {
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+inline int
+udata_fields_newindex(lua_State * L) {
+  lua_settop(L, 3);
+  switch (lua_getuservalue(L, 1)) {
+    case LUA_TTABLE: break;
+    case LUA_TNIL:
+      lua_pop(L, 1);
+      lua_newtable(L);
+      lua_pushvalue(L, -1);
+      lua_setuservalue(L, 1);
+      break;
+    default:
+      // A borrowed object's uservalue is its owner
+      return luaL_error(L, "Fields can't be set on this %s",
+                        luaL_typename(L, 1));
+  }
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, 3);
+  lua_rawset(L, -3);
+  return 0;
+}
+
+// Rebuilds an object of `T`, and gives it its fields. Upvalue 1 is the
+// function which rebuilds it, or its bytes, and upvalue 2 is the uservalue.
+template <typename T>
+int
+udata_fields_restore(lua_State * L) {
+  if (lua_type(L, lua_upvalueindex(1)) == LUA_TFUNCTION) {
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_call(L, 0, 1);
+  } else {
+    std::size_t n = 0;
+    const char * bytes = lua_tolstring(L, lua_upvalueindex(1), &n);
+    std::memcpy(detail::newuserdata(L, n, udata_user_values<T>::value), bytes,
+                n);
+    primer::push_metatable<T>(L);
+    lua_setmetatable(L, -2);
+  }
+  if (lua_type(L, -1) == LUA_TUSERDATA
+      && lua_type(L, lua_upvalueindex(2)) == LUA_TTABLE) {
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_setuservalue(L, -2);
+  }
+  return 1;
+}
+
+// Upvalue 1 is the previous `__persist` function, or nil
+template <typename T>
+int
+udata_fields_persist(lua_State * L) {
+  if (lua_type(L, lua_upvalueindex(1)) == LUA_TFUNCTION) {
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, 1);
+    lua_call(L, 1, 1);
+  } else {
+    lua_pushlstring(L, static_cast<const char *>(lua_touserdata(L, 1)),
+                    lua_rawlen(L, 1));
+  }
+  if (lua_getuservalue(L, 1) != LUA_TTABLE) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+  lua_pushcclosure(L, &udata_fields_restore<T>, 2);
+  return 1;
+}
+
+// Name of the rebuilding function in the permanent objects table
+template <typename T>
+std::string
+udata_fields_restore_name() {
+  return std::string{"primer_fields_restore_"}
+         + primer::traits::userdata<T>::name;
+}
+
+// Installs the generated entries in the metatable on top of the stack
+template <typename T>
+void
+udata_fields_populate(lua_State * L) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  PRIMER_ASSERT_TABLE(L);
+
+  lua_getfield(L, -1, "__index");
+  lua_pushcclosure(L, &udata_fields_index, 1);
+  lua_setfield(L, -2, "__index");
+
+  if (lua_getfield(L, -1, "__newindex") == LUA_TNIL) {
+    lua_pushcfunction(L, &udata_fields_newindex);
+    lua_setfield(L, -3, "__newindex");
+  }
+  lua_pop(L, 1);
+
+  const int t = lua_getfield(L, -1, "__persist");
+  if (t == LUA_TNIL || t == LUA_TFUNCTION) {
+    lua_pushcclosure(L, &udata_fields_persist<T>, 1);
+    lua_setfield(L, -2, "__persist");
+  } else {
+    lua_pop(L, 1);
+  }
+}
+
+// Registers the rebuilding function in a permanent objects table, if `T` has
+// fields
+template <typename T>
+void
+udata_fields_permanents(lua_State *, bool, std::false_type) {}
+
+template <typename T>
+void
+udata_fields_permanents(lua_State * L, bool reverse, std::true_type) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  PRIMER_ASSERT_TABLE(L);
+
+  const std::string name = udata_fields_restore_name<T>();
+  if (reverse) {
+    lua_pushcfunction(L, &udata_fields_restore<T>);
+    lua_pushstring(L, name.c_str());
+    lua_settable(L, -3);
+  } else {
+    lua_pushcfunction(L, &udata_fields_restore<T>);
+    lua_setfield(L, -2, name.c_str());
+  }
+}
+
+} // end namespace detail
+} // end namespace primer
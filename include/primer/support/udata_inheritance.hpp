@@ -0,0 +1,220 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Single inheritance of userdata types.
+ *
+ * The userdata trait of `Derived` may name its base with `using base = Base;`,
+ * where `Base` is also a userdata type and a base class of `Derived`. Then an
+ * object of `Derived` is accepted by `test_udata<Base>`, `read<Base &>` and
+ * the adapted methods of `Base`, with the pointer adjusted as by
+ * `static_cast`. The methods of `Base` are also found on objects of
+ * `Derived`, if `Derived` doesn't have its own of that name.
+ *
+ * Each type has its lineage, the list of its ancestors from the root down to
+ * itself, whose length is its depth. The metatable of a type with a base has
+ * a pointer to a `udata_lineage_info`, with an array of the ids of the types
+ * of the lineage, and an array of the conversions to them. So checking if an
+ * object is a `Base` is one lookup in its metatable, and a comparison at the
+ * depth of `Base`.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/udata_slab.hpp>
+
+#include <primer/detail/is_userdata.hpp>
+#include <primer/detail/type_traits.hpp>
+#include <primer/detail/typelist.hpp>
+#include <primer/traits/userdata.hpp>
+
+#include <cstddef>
+#include <type_traits>
+
+namespace primer {
+
+template <typename T>
+void push_metatable(lua_State * L);
+
+namespace detail {
+
+// The base of a userdata type, or void
+template <typename T, typename ENABLE = void>
+struct udata_base {
+  using type = void;
+};
+
+template <typename T>
+struct udata_base<T, void_t<typename primer::traits::userdata<T>::base>> {
+  using type = typename primer::traits::userdata<T>::base;
+
+  PRIMER_STATIC_ASSERT(is_userdata<type>::value,
+                       "the base of a userdata type must be a userdata type");
+  PRIMER_STATIC_ASSERT((std::is_base_of<type, T>::value),
+                       "the base of a userdata type must be a base class");
+};
+
+// The ancestors of `T`, from the root, and then `T`
+template <typename T, typename B = typename udata_base<T>::type>
+struct udata_lineage {
+  using type = Append_t<typename udata_lineage<B>::type, T>;
+};
+
+template <typename T>
+struct udata_lineage<T, void> {
+  using type = TypeList<T>;
+};
+
+template <typename T>
+struct udata_has_base
+  : std::integral_constant<bool, udata_lineage<T>::type::size != 1> {};
+
+// The position of `T` in the lineage of its descendants
+template <typename T>
+struct udata_depth
+  : std::integral_constant<std::size_t, udata_lineage<T>::type::size - 1> {};
+
+// The id of a type is the address of this
+template <typename T>
+struct udata_type_id {
+  static constexpr char value = 0;
+};
+
+template <typename T>
+constexpr char udata_type_id<T>::value;
+
+using udata_upcast_t = void * (*)(void *);
+
+struct udata_lineage_info {
+  std::size_t depth;
+  const void * const * ids;
+  const udata_upcast_t * upcasts;
+  // The object, as a pointer to its most derived type, from its block
+  void * (*object)(void *);
+};
+
+template <typename T, typename A>
+void *
+udata_upcast(void * p) {
+  return static_cast<A *>(static_cast<T *>(p));
+}
+
+// For a borrowed userdata, the block is a pointer to the object
+template <typename T, bool borrowed>
+void *
+udata_lineage_object(void * block) {
+  return borrowed ? *static_cast<T **>(block) : udata_storage<T>::get(block);
+}
+
+template <typename T, bool borrowed,
+          typename L = typename udata_lineage<T>::type>
+struct udata_lineage_table;
+
+template <typename T, bool borrowed, typename... As>
+struct udata_lineage_table<T, borrowed, TypeList<As...>> {
+  static constexpr const void * ids[] = {&udata_type_id<As>::value...};
+  static constexpr udata_upcast_t upcasts[] = {&udata_upcast<T, As>...};
+  static constexpr udata_lineage_info info{sizeof...(As) - 1, ids, upcasts,
+                                           &udata_lineage_object<T, borrowed>};
+};
+
+template <typename T, bool borrowed, typename... As>
+constexpr const void *
+  udata_lineage_table<T, borrowed, TypeList<As...>>::ids[];
+
+template <typename T, bool borrowed, typename... As>
+constexpr udata_upcast_t
+  udata_lineage_table<T, borrowed, TypeList<As...>>::upcasts[];
+
+template <typename T, bool borrowed, typename... As>
+constexpr udata_lineage_info
+  udata_lineage_table<T, borrowed, TypeList<As...>>::info;
+
+inline void *
+udata_lineage_key() noexcept {
+  static char key;
+  return &key;
+}
+
+// With the metatable of the userdata block `p` on top of the stack, gives the
+// object as a `T` if its type descends from `T`, or nullptr
+template <typename T>
+T *
+udata_lineage_test(lua_State * L, void * p) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  lua_rawgetp(L, -1, udata_lineage_key());
+  const auto * info =
+    static_cast<const udata_lineage_info *>(lua_touserdata(L, -1));
+  lua_pop(L, 1);
+
+  constexpr std::size_t d = udata_depth<T>::value;
+  if (info && info->depth >= d && info->ids[d] == &udata_type_id<T>::value) {
+    if (void * obj = info->object(p)) {
+      return static_cast<T *>(info->upcasts[d](obj));
+    }
+  }
+  return nullptr;
+}
+
+// The `__index` table of the base, or its metatable if `__index` is not a
+// table
+template <typename T>
+void
+udata_push_base_methods(lua_State * L) {
+  primer::push_metatable<typename udata_base<T>::type>(L);
+  if (lua_getfield(L, -1, "__index") == LUA_TTABLE) {
+    lua_remove(L, -2);
+  } else {
+    lua_pop(L, 1);
+  }
+}
+
+// Records the lineage in the metatable on top of the stack, and makes the
+// methods of the base available, if `T` has a base
+template <typename T, bool borrowed = false>
+void
+udata_lineage_populate(lua_State *, std::false_type) {}
+
+template <typename T, bool borrowed = false>
+void
+udata_lineage_populate(lua_State * L, std::true_type) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  PRIMER_ASSERT_TABLE(L);
+
+  using info_t = udata_lineage_table<T, borrowed>;
+  lua_pushlightuserdata(L, const_cast<udata_lineage_info *>(&info_t::info));
+  lua_rawsetp(L, -2, udata_lineage_key());
+  if (borrowed) { return; }
+
+  // Lookups which the methods of `T` miss go to the methods of the base
+  switch (lua_getfield(L, -1, "__index")) {
+    case LUA_TNIL:
+      lua_pop(L, 1);
+      udata_push_base_methods<T>(L);
+      lua_setfield(L, -2, "__index");
+      return;
+    case LUA_TTABLE:
+      if (!lua_getmetatable(L, -1)) {
+        lua_createtable(L, 0, 1);
+        udata_push_base_methods<T>(L);
+        lua_setfield(L, -2, "__index");
+        lua_setmetatable(L, -2);
+      } else {
+        lua_pop(L, 1);
+      }
+      lua_pop(L, 1);
+      return;
+    default: lua_pop(L, 1); return;
+  }
+}
+
+} // end namespace detail
+} // end namespace primer
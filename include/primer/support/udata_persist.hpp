@@ -0,0 +1,190 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Generated `__persist` for userdata.
+ *
+ * If the userdata trait of `T` has `static constexpr bool auto_persist = true`,
+ * and the metatable has no `__persist` of its own, primer generates one. It
+ * encodes the object into a lua string, and returns a closure of one
+ * reconstructor per type, which decodes the string into a new object.
+ *
+ * - If `T` is trivially copyable, the string is the bytes of the object, and
+ *   the object is rebuilt by `memcpy`.
+ * - Otherwise `T` needs a `traits::binary`, as visitable structures have with
+ *   <primer/visit_struct.hpp>, which encodes their fields in order, and it
+ *   must be default constructible.
+ *
+ * This is more compact and much faster than a table keyed by field names. The
+ * reconstructor must be in the permanent objects table, which `api::userdatas`
+ * does. Slab userdata can be persisted this way too.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/detail/type_traits.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/udata_slab.hpp>
+#include <primer/support/userdata_common.hpp>
+#include <primer/traits/binary.hpp>
+#include <primer/traits/userdata.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <string>
+#include <type_traits>
+
+namespace primer {
+namespace detail {
+
+// Pushes a new userdata of `T`, moving from `t`. Defined in
+// <primer/userdata.hpp>.
+template <typename T>
+void push_udata_value(lua_State * L, T & t);
+
+// Whether `T` has a `traits::binary`
+template <typename T, typename ENABLE = void>
+struct udata_persist_has_binary : std::false_type {};
+
+template <typename T>
+struct udata_persist_has_binary<
+  T, enable_if_t<std::is_same<decltype(&primer::traits::binary<T>::write),
+                              decltype(&primer::traits::binary<T>::write)>::
+                   value>> : std::true_type {};
+
+// Encodes an object of `T` as a string on top of the stack, and decodes it
+// into a new userdata. `rebuild` returns false if the string is malformed.
+template <typename T, typename ENABLE = void>
+struct udata_persist_codec {
+  static constexpr bool supported = udata_persist_has_binary<T>::value;
+
+  static bool save(lua_State * L, const T & t) {
+    std::string buffer;
+    PRIMER_TRY_BAD_ALLOC { primer::traits::binary<T>::write(buffer, t); }
+    PRIMER_CATCH_BAD_ALLOC { return false; }
+    lua_pushlstring(L, buffer.data(), buffer.size());
+    return true;
+  }
+
+  static bool rebuild(lua_State * L, const char * pos, const char * end) {
+    PRIMER_STATIC_ASSERT(std::is_default_constructible<T>::value,
+                         "auto_persist needs a default constructible type");
+    T t{};
+    bool ok = false;
+    PRIMER_TRY_BAD_ALLOC {
+      ok = primer::traits::binary<T>::read(pos, end, t) && pos == end;
+    }
+    PRIMER_CATCH_BAD_ALLOC {}
+    if (ok) { push_udata_value<T>(L, t); }
+    return ok;
+  }
+};
+
+template <typename T>
+struct udata_persist_codec<T,
+                           enable_if_t<std::is_trivially_copyable<T>::value>> {
+  static constexpr bool supported = true;
+
+  static bool save(lua_State * L, const T & t) {
+    lua_pushlstring(L, reinterpret_cast<const char *>(&t), sizeof(T));
+    return true;
+  }
+
+  static bool rebuild(lua_State * L, const char * pos, const char * end) {
+    if (static_cast<std::size_t>(end - pos) != sizeof(T)) { return false; }
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    std::memcpy(&storage, pos, sizeof(T));
+    push_udata_value<T>(L, *reinterpret_cast<T *>(&storage));
+    return true;
+  }
+};
+
+// The reconstructor. Upvalue 1 is the encoded object.
+template <typename T>
+int
+udata_persist_restore(lua_State * L) {
+  std::size_t n = 0;
+  const char * data = lua_tolstring(L, lua_upvalueindex(1), &n);
+  if (!data || !udata_persist_codec<T>::rebuild(L, data, data + n)) {
+    return luaL_error(L, "Could not rebuild a persisted '%s'",
+                      primer::traits::userdata<T>::name);
+  }
+  return 1;
+}
+
+template <typename T>
+int
+udata_persist_save(lua_State * L) {
+  void * p = lua_touserdata(L, 1);
+  const T * t = p ? udata_storage<T>::get(p) : nullptr;
+  if (!t || !udata_persist_codec<T>::save(L, *t)) {
+    return luaL_error(L, "Could not persist a '%s'",
+                      primer::traits::userdata<T>::name);
+  }
+  lua_pushcclosure(L, &udata_persist_restore<T>, 1);
+  return 1;
+}
+
+// Name of the reconstructor in the permanent objects table
+template <typename T>
+std::string
+udata_persist_restore_name() {
+  return std::string{"primer_persist_restore_"}
+         + primer::traits::userdata<T>::name;
+}
+
+// Installs `__persist` in the metatable on top of the stack, if `T` asks for
+// it and the metatable has none
+template <typename T>
+void
+udata_persist_populate(lua_State *, std::false_type) {}
+
+template <typename T>
+void
+udata_persist_populate(lua_State * L, std::true_type) {
+  PRIMER_STATIC_ASSERT(udata_persist_codec<T>::supported,
+                       "auto_persist needs a trivially copyable type, or one "
+                       "with a traits::binary, like a visitable structure");
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  PRIMER_ASSERT_TABLE(L);
+
+  if (lua_getfield(L, -1, "__persist") == LUA_TNIL) {
+    lua_pushcfunction(L, &udata_persist_save<T>);
+    lua_setfield(L, -3, "__persist");
+  }
+  lua_pop(L, 1);
+}
+
+// Registers the reconstructor in a permanent objects table, if `T` has a
+// generated `__persist`
+template <typename T>
+void
+udata_persist_permanents(lua_State *, bool, std::false_type) {}
+
+template <typename T>
+void
+udata_persist_permanents(lua_State * L, bool reverse, std::true_type) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  PRIMER_ASSERT_TABLE(L);
+
+  const std::string name = udata_persist_restore_name<T>();
+  if (reverse) {
+    lua_pushcfunction(L, &udata_persist_restore<T>);
+    lua_pushstring(L, name.c_str());
+    lua_settable(L, -3);
+  } else {
+    lua_pushcfunction(L, &udata_persist_restore<T>);
+    lua_setfield(L, -2, name.c_str());
+  }
+}
+
+} // end namespace detail
+} // end namespace primer
@@ -0,0 +1,188 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Storage of "slab" userdata.
+ *
+ * If the userdata trait of `T` has `static constexpr bool slab = true`, then
+ * objects of type `T` are not placed in the lua userdata block. They live in
+ * slots of a slab, which is a chunked free list of `T`-sized slots owned by the
+ * lua state, and the userdata only holds a pointer to the slot. Type checking
+ * works through the metatable as for any other userdata.
+ *
+ * The slab of a type is created in a state when the first object is pushed,
+ * and is kept in the registry. Its holder is marked for finalization before any
+ * of its objects, so lua finalizes it after them when the state is closed.
+ * Even so, it is only destroyed once no slot is in use.
+ *
+ * `udata_storage<T>` gives the object from the address of the userdata block,
+ * for either kind of type.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/push_singleton.hpp>
+
+#include <primer/detail/type_traits.hpp>
+#include <primer/traits/userdata.hpp>
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+namespace primer {
+namespace detail {
+
+// Whether the userdata trait asks for slab storage
+template <typename T, typename ENABLE = void>
+struct udata_in_slab : std::false_type {};
+
+template <typename T>
+struct udata_in_slab<T, enable_if_t<std::is_same<
+                          decltype(primer::traits::userdata<T>::slab),
+                          const bool>::value>>
+  : std::integral_constant<bool, primer::traits::userdata<T>::slab> {};
+
+template <typename T>
+class udata_slab {
+  union slot {
+    slot * next;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  static constexpr std::size_t slots_per_chunk = 4096 / sizeof(slot) > 16
+                                                   ? 4096 / sizeof(slot)
+                                                   : 16;
+
+  struct chunk {
+    chunk * next;
+    slot slots[slots_per_chunk];
+  };
+
+  chunk * chunks_ = nullptr;
+  slot * free_ = nullptr;
+  std::size_t next_ = slots_per_chunk; // Next unused slot of the first chunk
+  std::size_t live_ = 0;
+  bool orphaned_ = false;
+
+public:
+  udata_slab() noexcept = default;
+  udata_slab(const udata_slab &) = delete;
+  udata_slab & operator=(const udata_slab &) = delete;
+
+  ~udata_slab() noexcept {
+    while (chunks_) {
+      chunk * next = chunks_->next;
+      delete chunks_;
+      chunks_ = next;
+    }
+  }
+
+  // Storage for one object, or nullptr if memory fails
+  void * allocate() noexcept {
+    slot * s = free_;
+    if (s) {
+      free_ = s->next;
+    } else {
+      if (next_ == slots_per_chunk) {
+        chunk * c = new (std::nothrow) chunk;
+        if (!c) { return nullptr; }
+        c->next = chunks_;
+        chunks_ = c;
+        next_ = 0;
+      }
+      s = &chunks_->slots[next_++];
+    }
+    ++live_;
+    return &s->storage;
+  }
+
+  // Returns a slot whose object has been destroyed. Deletes the slab if its
+  // holder is gone and this was the last slot.
+  void deallocate(void * p) noexcept {
+    slot * s = static_cast<slot *>(p);
+    s->next = free_;
+    free_ = s;
+    if (!--live_ && orphaned_) { delete this; }
+  }
+
+  std::size_t live() const noexcept { return live_; }
+
+  // Called when the holder is finalized
+  void orphan() noexcept {
+    if (live_) {
+      orphaned_ = true;
+    } else {
+      delete this;
+    }
+  }
+
+  //
+  // Per-state storage
+  //
+
+  static int holder_gc(lua_State * L) noexcept {
+    auto h = static_cast<udata_slab **>(lua_touserdata(L, 1));
+    if (h && *h) { (*h)->orphan(); }
+    return 0;
+  }
+
+  static void make_holder(lua_State * L) {
+    auto h =
+      static_cast<udata_slab **>(lua_newuserdata(L, sizeof(udata_slab *)));
+    *h = nullptr;
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, &holder_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    *h = new (std::nothrow) udata_slab;
+    if (!*h) { luaL_error(L, "not enough memory"); }
+  }
+
+  // The slab of this type in the state. May raise a lua error.
+  static udata_slab & get(lua_State * L) {
+    primer::push_singleton<&make_holder>(L);
+    auto h = static_cast<udata_slab **>(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+    return **h;
+  }
+};
+
+template <typename T>
+constexpr std::size_t udata_slab<T>::slots_per_chunk;
+
+// Access to the object in a userdata block
+template <typename T, typename ENABLE = void>
+struct udata_storage {
+  static constexpr std::size_t block_size = sizeof(T);
+
+  static T * get(void * block) noexcept { return static_cast<T *>(block); }
+
+  static void destroy(lua_State *, void * block) noexcept { get(block)->~T(); }
+};
+
+template <typename T>
+struct udata_storage<T, enable_if_t<udata_in_slab<T>::value>> {
+  static constexpr std::size_t block_size = sizeof(T *);
+
+  // nullptr if the object was never constructed, or is destroyed
+  static T * get(void * block) noexcept { return *static_cast<T **>(block); }
+
+  static void destroy(lua_State * L, void * block) noexcept {
+    if (T * t = get(block)) {
+      *static_cast<T **>(block) = nullptr;
+      t->~T();
+      udata_slab<T>::get(L).deallocate(t);
+    }
+  }
+};
+
+} // end namespace detail
+} // end namespace primer
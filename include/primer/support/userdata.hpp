@@ -17,7 +17,11 @@ PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/support/asserts.hpp>
 #include <primer/support/diagnostics.hpp>
+#include <primer/support/internal_stats.hpp>
 #include <primer/support/metatable.hpp>
+#include <primer/support/must_finalize.hpp>
+#include <primer/support/udata_borrowed.hpp>
+#include <primer/support/udata_inheritance.hpp>
 #include <primer/support/userdata_common.hpp>
 
 #include <primer/traits/userdata.hpp>
@@ -44,11 +48,18 @@ struct udata_helper<T, enable_if_t<primer::detail::is_userdata<T>::value>> {
     if (void * p = lua_touserdata(L, idx)) { /* value is a userdata? */
       if (lua_getmetatable(L, idx)) {        /* does it have a metatable? */
         primer::push_metatable<T>(L);        /* get correct metatable */
+        PRIMER_INTERNAL_COUNT(L, metatable_lookups);
         if (!lua_rawequal(L, -1, -2)) {      /* not the same? */
-          p = nullptr; /* value is a userdata with wrong metatable */
+          lua_pop(L, 1);
+          // It may still be of a type derived from `T`, or point to a `T`
+          // which lives elsewhere
+          T * t = udata_lineage_test<T>(L, p);
+          if (!t) { t = udata_indirect_test<T>(L, p); }
+          lua_pop(L, 1);
+          return t;
         }
         lua_pop(L, 2); /* remove both metatables */
-        return static_cast<T *>(p);
+        return udata_storage<T>::get(p);
       }
     }
     return nullptr; /* value is not a userdata with a metatable */
@@ -60,6 +71,7 @@ struct udata_helper<T, enable_if_t<primer::detail::is_userdata<T>::value>> {
     PRIMER_ASSERT_STACK_NEUTRAL(L);
     primer::push_metatable<T>(L);
     lua_setmetatable(L, -2);
+    if (udata_must_finalize<T>::value) { track_must_finalize(L); }
   }
 };
 
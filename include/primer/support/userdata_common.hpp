@@ -9,6 +9,16 @@
  * Implementation of "common" metamethods for an arbitrary userdata type.
  * Currently we just have a `__gc` implementation in case (or in order that)
  * the user does not need to provide one.
+ *
+ * `__gc` is only installed automatically if the type needs its destructor to
+ * be called. Objects with finalizers are more expensive for the lua collector,
+ * so for a trivially destructible type it is skipped. The userdata trait can
+ * override this with a member `static constexpr bool needs_gc`. Slab userdata
+ * always needs it, to give back its slot.
+ *
+ * A type whose finalizer must run even when the state is torn down quickly,
+ * e.g. one which holds a file handle, says so with a member
+ * `static constexpr bool must_finalize`, see <primer/fast_close.hpp>.
  */
 
 #include <primer/base.hpp>
@@ -17,7 +27,9 @@ PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/lua.hpp>
 
+#include <primer/detail/type_traits.hpp>
 #include <primer/support/diagnostics.hpp>
+#include <primer/support/udata_slab.hpp>
 #include <primer/traits/userdata.hpp>
 #include <type_traits>
 
@@ -38,7 +50,7 @@ common_gc_impl(lua_State * L) noexcept {
   PRIMER_ASSERT(d, "garbage collection metamethod for userdata '"
                      << udata::name << "' called on object of type '"
                      << describe_lua_value(L, 1) << "'");
-  static_cast<T *>(d)->~T();
+  udata_storage<T>::destroy(L, d);
   // Set metatable to nil. This prevents further access to the userdata, as
   // can happen in some obscure corner cases
   lua_pushnil(L);
@@ -46,6 +58,72 @@ common_gc_impl(lua_State * L) noexcept {
   return 0;
 }
 
+// Whether primer should install `common_gc_impl` for a type
+template <typename T, typename ENABLE = void>
+struct udata_needs_gc
+  : std::integral_constant<bool, !std::is_trivially_destructible<T>::value
+                                   || udata_in_slab<T>::value> {};
+
+template <typename T>
+struct udata_needs_gc<T, enable_if_t<std::is_same<
+                           decltype(primer::traits::userdata<T>::needs_gc),
+                           const bool>::value>>
+  : std::integral_constant<bool, primer::traits::userdata<T>::needs_gc> {};
+
+// Whether lua may set fields on the objects of a type, which are kept in their
+// uservalue tables. The trait asks for it with `static constexpr bool fields`.
+template <typename T, typename ENABLE = void>
+struct udata_has_fields : std::false_type {};
+
+template <typename T>
+struct udata_has_fields<T, enable_if_t<std::is_same<
+                             decltype(primer::traits::userdata<T>::fields),
+                             const bool>::value>>
+  : std::integral_constant<bool, primer::traits::userdata<T>::fields> {};
+
+// Whether primer generates `__persist` for a type, see
+// <primer/support/udata_persist.hpp>. The trait asks for it with
+// `static constexpr bool auto_persist`.
+template <typename T, typename ENABLE = void>
+struct udata_auto_persist : std::false_type {};
+
+template <typename T>
+struct udata_auto_persist<
+  T, enable_if_t<std::is_same<
+       decltype(primer::traits::userdata<T>::auto_persist), const bool>::value>>
+  : std::integral_constant<bool, primer::traits::userdata<T>::auto_persist> {};
+
+// Whether `fast_close` runs the finalizer of a type. The trait asks for it with
+// `static constexpr bool must_finalize`.
+template <typename T, typename ENABLE = void>
+struct udata_must_finalize : std::false_type {};
+
+template <typename T>
+struct udata_must_finalize<
+  T,
+  enable_if_t<std::is_same<
+    decltype(primer::traits::userdata<T>::must_finalize), const bool>::value>>
+  : std::integral_constant<bool, primer::traits::userdata<T>::must_finalize> {};
+
+// The number of user values of the userdata of a type, which only lua 5.4 can
+// vary. By default there is one, as in lua 5.3, so that `lua_setuservalue`
+// works the same on both. The trait can ask for another number with
+// `static constexpr int user_values`, e.g. 0 to save space. A type with fields
+// needs one.
+template <typename T, typename ENABLE = void>
+struct udata_user_values : std::integral_constant<int, 1> {};
+
+template <typename T>
+struct udata_user_values<
+  T, enable_if_t<std::is_same<decltype(
+                                primer::traits::userdata<T>::user_values),
+                              const int>::value>>
+  : std::integral_constant<int, primer::traits::userdata<T>::user_values> {
+  PRIMER_STATIC_ASSERT(!udata_has_fields<T>::value
+                         || primer::traits::userdata<T>::user_values >= 1,
+                       "a userdata type with fields needs a user value");
+};
+
 } // end namespace detail
 
 } // end namespace primer
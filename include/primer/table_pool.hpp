@@ -0,0 +1,213 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_table_pool_overview
+/*`
+A `primer::table_pool` recycles the tables which are pushed to a handler that
+only borrows them for the length of the call, e.g. the event and state tables
+which a game passes to its scripts every frame.
+
+``
+  primer::table_pool pool{L};
+  ...
+  // each frame
+  for (auto & h : handlers) {
+    h.push();
+    pool.push(L, event);
+    lua_pcall(L, 1, 0, 0);
+  }
+  pool.recycle(L);
+``
+
+`pool.push(L, t)` is `primer::push(L, t)`, except that the tables of the
+standard containers, of `std::pair`, and of visitable structures, including
+those nested in them, are taken from the pool when it has one to spare.
+`recycle` takes back every table which was handed out since the last call,
+clears it, and removes its metatable. A cleared table keeps its array and
+hash parts, so once the frames settle into the same shapes, pushing them
+allocates no tables at all.
+
+The contract is the caller's to keep: a handler must not hold on to a table
+after `recycle`, since its contents will be replaced. Copy what must be
+kept.
+
+Constructing the pool may raise a lua memory error. `push` and `recycle`
+can too, while the pool is still growing, and leave the pool consistent
+when they do.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/detail/type_traits.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/traits/push.hpp>
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+namespace primer {
+
+class table_pool;
+
+namespace detail {
+
+// True if the push trait of T can take its tables from a pool
+template <typename T, typename ENABLE = void>
+struct has_pooled_push : std::false_type {};
+
+template <typename T>
+struct has_pooled_push<
+  T, void_t<decltype(traits::push<T>::to_stack(std::declval<lua_State *>(),
+                                               std::declval<const T &>(),
+                                               std::declval<table_pool &>()))>>
+  : std::true_type {};
+
+template <typename T>
+enable_if_t<has_pooled_push<T>::value>
+push_pooled(lua_State * L, const T & t, table_pool & pool) {
+  traits::push<T>::to_stack(L, t, pool);
+}
+
+template <typename T>
+enable_if_t<!has_pooled_push<T>::value>
+push_pooled(lua_State * L, const T & t, table_pool &) {
+  traits::push<T>::to_stack(L, t);
+}
+
+// Used by the push helpers, so that a pooled push and a plain one share code
+template <typename T>
+void
+push_maybe_pooled(lua_State * L, const T & t, table_pool * pool) {
+  if (pool) {
+    push_pooled(L, t, *pool);
+  } else {
+    traits::push<T>::to_stack(L, t);
+  }
+}
+
+} // end namespace detail
+
+class table_pool {
+  // t[1] holds the spare tables, t[2] the tables handed out since `recycle`
+  lua_ref tables_;
+  int spare_;
+  int lent_;
+
+  // Sets every field of the table at `idx` to nil. This doesn't allocate, and
+  // lua doesn't shrink a table which is only assigned nils.
+  static void clear(lua_State * L, int idx) noexcept {
+    idx = lua_absindex(L, idx);
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+      lua_pop(L, 1);
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, idx);
+    }
+    lua_pushnil(L);
+    lua_setmetatable(L, idx);
+  }
+
+public:
+  // Note: Can cause lua memory allocation failure
+  explicit table_pool(lua_State * L)
+    : tables_()
+    , spare_(0)
+    , lent_(0) {
+    lua_createtable(L, 2, 0);
+    lua_newtable(L);
+    lua_rawseti(L, -2, 1);
+    lua_newtable(L);
+    lua_rawseti(L, -2, 2);
+    tables_ = lua_ref{L};
+  }
+
+  table_pool(const table_pool &) = delete;
+  table_pool & operator=(const table_pool &) = delete;
+
+  // The number of tables which are ready to be reused, and handed out
+  std::size_t spare() const noexcept {
+    return static_cast<std::size_t>(spare_);
+  }
+  std::size_t lent() const noexcept { return static_cast<std::size_t>(lent_); }
+
+  // Pushes an empty table, a spare one if there is one, and otherwise a new
+  // one of the given size, which is then counted as handed out.
+  // Note: Can cause lua memory allocation failure
+  void push_table(lua_State * L, int narr, int nrec) {
+    tables_.push(L);
+    if (spare_) {
+      lua_rawgeti(L, -1, 1);
+      lua_rawgeti(L, -1, spare_);
+      lua_pushnil(L);
+      lua_rawseti(L, -3, spare_);
+      --spare_;
+      lua_remove(L, -2);
+    } else {
+      lua_createtable(L, narr, nrec);
+    }
+
+    lua_rawgeti(L, -2, 2);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, lent_ + 1);
+    ++lent_;
+    lua_pop(L, 1);
+    lua_remove(L, -2);
+  }
+
+  // Pushes `t` as `primer::push` would, taking its tables from the pool
+  template <typename T>
+  void push(lua_State * L, const T & t) {
+    // Taking a table from the pool needs three slots more than creating it
+    luaL_checkstack(L, traits::push<T>::stack_space_needed + 3, "table_pool");
+    detail::push_pooled(L, t, *this);
+  }
+
+  // Takes back every table which was handed out. They must not be used
+  // after this.
+  // Note: Can cause lua memory allocation failure, while the pool grows
+  void recycle(lua_State * L) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    luaL_checkstack(L, 7, "table_pool");
+    tables_.push(L);
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    // The last table is only dropped from the lent list once it is a spare,
+    // so that a memory error leaves every table in exactly one of them
+    while (lent_) {
+      lua_rawgeti(L, -1, lent_);
+      clear(L, -1);
+      lua_rawseti(L, -3, spare_ + 1);
+      ++spare_;
+      lua_pushnil(L);
+      lua_rawseti(L, -2, lent_);
+      --lent_;
+    }
+    lua_pop(L, 3);
+  }
+};
+
+namespace detail {
+
+inline void
+new_table(lua_State * L, int narr, int nrec, table_pool * pool) {
+  if (pool) {
+    pool->push_table(L, narr, nrec);
+  } else {
+    lua_createtable(L, narr, nrec);
+  }
+}
+
+} // end namespace detail
+
+} // end namespace primer
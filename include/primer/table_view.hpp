@@ -0,0 +1,268 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A table_view is a lazy, non-owning handle to a table on the stack.
+ *
+ * Reading a table_view does not convert anything, it only checks that the
+ * value is a table, and remembers its stack index. Elements are converted
+ * using `traits::read` as they are accessed, so a callback which stops early,
+ * or which only streams through the elements once, never has to materialize a
+ * container.
+ *
+ * `table_view<T>` treats the table as a sequence, like `std::vector<T>`. Its
+ * index `i` corresponds to `t[i+1]` in lua.
+ *
+ * `map_view<K, V>` treats the table as a map, like `std::map<K, V>`, and is
+ * visited using `lua_next`.
+ *
+ * `for_each_index<T>(L, idx, f)` and `for_each_pair<K, V>(L, idx, f)` visit a
+ * table at a stack index in the same way, without making a view first.
+ *
+ * A view is only valid while the table remains at the same stack index, e.g.
+ * for the duration of an adapted callback. Accessing elements uses a small
+ * amount of stack space: one slot plus what reading `T` needs for `table_view`,
+ * and three slots plus what reading `K` or `V` needs for `map_view`.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/detail/type_traits.hpp>
+#include <primer/error.hpp>
+#include <primer/error_capture.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/read.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/traits/read_type_mask.hpp>
+
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+namespace primer {
+
+namespace detail {
+
+template <typename F, typename... Args>
+using visit_result_t = decltype(std::declval<F>()(std::declval<Args>()...));
+
+// Calls a visitor, which returns `bool` to say whether to continue, or `void`
+template <typename F, typename... Args>
+enable_if_t<std::is_void<visit_result_t<F, Args...>>::value, bool>
+visit_continue(F && f, Args &&... args) {
+  std::forward<F>(f)(std::forward<Args>(args)...);
+  return true;
+}
+
+template <typename F, typename... Args>
+enable_if_t<!std::is_void<visit_result_t<F, Args...>>::value, bool>
+visit_continue(F && f, Args &&... args) {
+  return static_cast<bool>(std::forward<F>(f)(std::forward<Args>(args)...));
+}
+
+} // end namespace detail
+
+//[ primer_table_view
+template <typename T>
+class table_view {
+  lua_State * L_;
+  int index_;
+
+public:
+  table_view(lua_State * L, int index) noexcept
+    : L_(L)
+    , index_(lua_absindex(L, index)) {}
+
+  lua_State * state() const noexcept { return L_; }
+  int index() const noexcept { return index_; }
+
+  // Uses `lua_rawlen`, like reading `std::vector`
+  std::size_t size() const noexcept { return lua_rawlen(L_, index_); }
+  bool empty() const noexcept { return !this->size(); }
+
+  // Converts the element `t[i+1]`
+  expected<T> operator[](std::size_t i) const {
+    PRIMER_ASSERT_STACK_NEUTRAL(L_);
+    lua_rawgeti(L_, index_, static_cast<LUA_INTEGER>(i + 1));
+    expected<T> result = traits::read<T>::from_stack(L_, -1);
+    if (!result) {
+      result.err().prepend_error_line("In index [", i + 1, "],");
+    }
+    lua_pop(L_, 1);
+    return result;
+  }
+
+  // Iterators yield `expected<T>`
+  class iterator {
+    const table_view * view_;
+    std::size_t i_;
+
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = expected<T>;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = expected<T>;
+
+    iterator(const table_view * v, std::size_t i) noexcept
+      : view_(v)
+      , i_(i) {}
+
+    expected<T> operator*() const { return (*view_)[i_]; }
+    iterator & operator++() noexcept {
+      ++i_;
+      return *this;
+    }
+    iterator operator++(int) noexcept {
+      iterator temp{*this};
+      ++i_;
+      return temp;
+    }
+    bool operator==(const iterator & o) const noexcept { return i_ == o.i_; }
+    bool operator!=(const iterator & o) const noexcept { return i_ != o.i_; }
+  };
+
+  iterator begin() const noexcept { return iterator{this, 0}; }
+  iterator end() const noexcept { return iterator{this, this->size()}; }
+
+  // Visit each element in order. The visitor is called as `f(i, T)`, and may
+  // return false to stop early. If an element cannot be converted, stops and
+  // reports the error.
+  template <typename F>
+  expected<void> for_each(F && f) const {
+    PRIMER_ASSERT_STACK_NEUTRAL(L_);
+    expected<void> result;
+
+    const std::size_t n = this->size();
+    for (std::size_t i = 0; i < n; ++i) {
+      lua_rawgeti(L_, index_, static_cast<LUA_INTEGER>(i + 1));
+      auto value = traits::read<T>::from_stack(L_, -1);
+      lua_pop(L_, 1);
+      if (!value) {
+        result = std::move(value.err());
+        result.err().prepend_error_line("In index [", i + 1, "],");
+        break;
+      }
+      if (!detail::visit_continue(f, i, std::move(*value))) { break; }
+    }
+    return result;
+  }
+};
+
+template <typename K, typename V>
+class map_view {
+  lua_State * L_;
+  int index_;
+
+public:
+  map_view(lua_State * L, int index) noexcept
+    : L_(L)
+    , index_(lua_absindex(L, index)) {}
+
+  lua_State * state() const noexcept { return L_; }
+  int index() const noexcept { return index_; }
+
+  // Visit each key-value pair, in the order given by `lua_next`.
+  // The visitor is called as `f(K, V)`, and may return false to stop early.
+  // If a key or value cannot be converted, stops and reports the error.
+  template <typename F>
+  expected<void> for_each(F && f) const {
+    PRIMER_ASSERT_STACK_NEUTRAL(L_);
+    expected<void> result;
+
+    lua_pushnil(L_);
+    while (lua_next(L_, index_)) {
+      // Read a copy of the key, in case reading it modifies it, which would
+      // confuse `lua_next`.
+      lua_pushvalue(L_, -2);
+      auto key = traits::read<K>::from_stack(L_, -1);
+      lua_pop(L_, 1);
+
+      if (!key) {
+        result = std::move(key.err().prepend_error_line("In key,"));
+      } else if (auto value = traits::read<V>::from_stack(L_, -1)) {
+        if (!detail::visit_continue(f, std::move(*key), std::move(*value))) {
+          lua_pop(L_, 2);
+          break;
+        }
+      } else {
+        result = std::move(value.err().prepend_error_line("In value,"));
+      }
+
+      if (!result) {
+        lua_pop(L_, 2);
+        break;
+      }
+      lua_pop(L_, 1);
+    }
+    return result;
+  }
+};
+
+/// Visit the elements of the table at `idx` as a sequence of `T`
+template <typename T, typename F>
+expected<void> for_each_index(lua_State * L, int idx, F && f);
+
+/// Visit the key-value pairs of the table at `idx`
+template <typename K, typename V, typename F>
+expected<void> for_each_pair(lua_State * L, int idx, F && f);
+//]
+
+template <typename T, typename F>
+expected<void>
+for_each_index(lua_State * L, int idx, F && f) {
+  if (!lua_istable(L, idx)) { return primer::arg_error(L, idx, "table"); }
+  return table_view<T>{L, idx}.for_each(std::forward<F>(f));
+}
+
+template <typename K, typename V, typename F>
+expected<void>
+for_each_pair(lua_State * L, int idx, F && f) {
+  if (!lua_istable(L, idx)) { return primer::arg_error(L, idx, "table"); }
+  return map_view<K, V>{L, idx}.for_each(std::forward<F>(f));
+}
+
+namespace traits {
+
+template <typename T>
+struct read<primer::table_view<T>> {
+  static expected<table_view<T>> from_stack(lua_State * L, int idx) {
+    if (lua_istable(L, idx)) {
+      return table_view<T>{L, idx};
+    } else {
+      return primer::arg_error(L, idx, "table");
+    }
+  }
+  static constexpr int stack_space_needed{0};
+};
+
+template <typename K, typename V>
+struct read<primer::map_view<K, V>> {
+  static expected<map_view<K, V>> from_stack(lua_State * L, int idx) {
+    if (lua_istable(L, idx)) {
+      return map_view<K, V>{L, idx};
+    } else {
+      return primer::arg_error(L, idx, "table");
+    }
+  }
+  static constexpr int stack_space_needed{0};
+};
+
+template <typename T>
+struct read_type_mask<primer::table_view<T>>
+  : type_mask_constant<table_type_mask> {};
+
+template <typename K, typename V>
+struct read_type_mask<primer::map_view<K, V>>
+  : type_mask_constant<table_type_mask> {};
+
+} // end namespace traits
+} // end namespace primer
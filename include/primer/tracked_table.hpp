@@ -0,0 +1,271 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_tracked_table_overview
+/*`
+A `primer::tracked_table` is a table which scripts modify, e.g. settings or
+the state of an entity, and which C++ reads back often. Rather than reading
+the whole table each time, C++ asks for the fields which were assigned since
+it last looked.
+
+``
+  primer::tracked_table config{L};
+  config.push(L);
+  lua_setglobal(L, "config");
+  ...
+  // each frame
+  auto ok = primer::sync_into(config, settings_);
+``
+
+Scripts are given a proxy, an empty table whose metatable reads from the
+table which holds the contents, and whose `__newindex` assigns to it and
+records the key. Each key gets a small number the first time it is assigned,
+and C++ keeps a list of the numbers of the keys which were assigned, and a
+bitset so that each is listed once. So after the first assignment of a key,
+recording it allocates nothing, and `sync` costs one step per assigned key,
+whatever the size of the table.
+
+`sync(f)` calls `f(L)` with each assigned key and its current value on top
+of the stack, and then forgets them. `sync_into`, in `primer/visit_struct.hpp`,
+reads the assigned fields of a visitable structure.
+
+Only assignments to the proxy are seen. Those to the tables in its fields,
+or by `rawset`, or from C++ to the table which holds the contents, are not.
+`#` and `pairs` work on the proxy in lua 5.3, but `next` does not. The proxy
+can't be persisted.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/function_check_stack.hpp>
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+namespace detail {
+
+// Lives in a userdata, which is an upvalue of `__newindex`
+struct table_tracker {
+  std::vector<int> dirty;   // The numbers of the keys assigned since `sync`
+  std::vector<bool> marked; // Whether each number is in `dirty`
+  int slots = 0;            // The number of keys which have a number
+
+  static int gc(lua_State * L) {
+    static_cast<table_tracker *>(lua_touserdata(L, 1))->~table_tracker();
+    return 0;
+  }
+
+  // So that marking a key never allocates
+  bool reserve(int n) noexcept {
+    PRIMER_TRY_BAD_ALLOC {
+      marked.resize(static_cast<std::size_t>(n));
+      dirty.reserve(static_cast<std::size_t>(n));
+      return true;
+    }
+    PRIMER_CATCH_BAD_ALLOC { return false; }
+  }
+
+  void mark(int slot) noexcept {
+    if (!marked[slot - 1]) {
+      marked[slot - 1] = true;
+      dirty.push_back(slot);
+    }
+  }
+
+  // Forgets the first `n` keys of the list
+  void forget(std::size_t n) noexcept {
+    for (std::size_t i = 0; i < n; ++i) {
+      marked[dirty[i] - 1] = false;
+    }
+    dirty.erase(dirty.begin(), dirty.begin() + n);
+  }
+};
+
+// Upvalues: the contents, key -> number, number -> key, and the tracker
+inline int
+tracked_newindex(lua_State * L) {
+  lua_settop(L, 3);
+  lua_pushvalue(L, 2);
+  lua_pushvalue(L, 3);
+  lua_rawset(L, lua_upvalueindex(1));
+
+  auto * t =
+    static_cast<table_tracker *>(lua_touserdata(L, lua_upvalueindex(4)));
+  int slot;
+  lua_pushvalue(L, 2);
+  if (LUA_TNUMBER == lua_rawget(L, lua_upvalueindex(2))) {
+    slot = static_cast<int>(lua_tointeger(L, -1));
+  } else {
+    slot = t->slots + 1;
+    if (!t->reserve(slot)) { return luaL_error(L, "not enough memory"); }
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, lua_upvalueindex(3), slot);
+    lua_pushvalue(L, 2);
+    lua_pushinteger(L, slot);
+    lua_rawset(L, lua_upvalueindex(2));
+    t->slots = slot;
+  }
+  t->mark(slot);
+  return 0;
+}
+
+inline int
+tracked_len(lua_State * L) {
+  lua_pushinteger(L, static_cast<lua_Integer>(
+                       lua_rawlen(L, lua_upvalueindex(1))));
+  return 1;
+}
+
+inline int
+tracked_next(lua_State * L) {
+  lua_settop(L, 2);
+  if (lua_next(L, 1)) { return 2; }
+  lua_pushnil(L);
+  return 1;
+}
+
+inline int
+tracked_pairs(lua_State * L) {
+  lua_pushcfunction(L, &tracked_next);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_pushnil(L);
+  return 3;
+}
+
+} // end namespace detail
+
+class tracked_table {
+  lua_ref proxy_;
+  lua_ref data_;
+  lua_ref keys_; // t[n] is the key numbered n
+  detail::table_tracker * tracker_ = nullptr;
+
+  // Expects the table which holds the contents on top of the stack, and pops
+  // it
+  void init(lua_State * L) {
+    const int data = lua_gettop(L);
+    lua_newtable(L);
+    lua_newtable(L);
+    auto * t = new (lua_newuserdata(L, sizeof(detail::table_tracker)))
+      detail::table_tracker{};
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, &detail::table_tracker::gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+
+    lua_newtable(L);
+    lua_createtable(L, 0, 4);
+    lua_pushvalue(L, data);
+    lua_setfield(L, -2, "__index");
+    lua_pushvalue(L, data);
+    lua_pushvalue(L, data + 2);
+    lua_pushvalue(L, data + 1);
+    lua_pushvalue(L, data + 3);
+    lua_pushcclosure(L, &detail::tracked_newindex, 4);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushvalue(L, data);
+    lua_pushcclosure(L, &detail::tracked_len, 1);
+    lua_setfield(L, -2, "__len");
+    lua_pushvalue(L, data);
+    lua_pushcclosure(L, &detail::tracked_pairs, 1);
+    lua_setfield(L, -2, "__pairs");
+    lua_setmetatable(L, -2);
+
+    proxy_ = lua_ref{L};
+    lua_pop(L, 2);
+    keys_ = lua_ref{L};
+    data_ = lua_ref{L};
+    tracker_ = t;
+  }
+
+public:
+  tracked_table() noexcept = default;
+
+  // Note: Can cause lua memory allocation failure
+  explicit tracked_table(lua_State * L) {
+    lua_newtable(L);
+    this->init(L);
+  }
+
+  // The table at `index` holds the contents. Its fields are not counted as
+  // assigned.
+  // Note: Can cause lua memory allocation failure
+  tracked_table(lua_State * L, int index) {
+    lua_pushvalue(L, index);
+    this->init(L);
+  }
+
+  tracked_table(const tracked_table &) = delete;
+  tracked_table & operator=(const tracked_table &) = delete;
+
+  // Pushes the proxy, which is what scripts should be given
+  void push(lua_State * L) const { proxy_.push(L); }
+
+  // Pushes the table which holds the contents
+  void push_contents(lua_State * L) const { data_.push(L); }
+
+  // The number of keys which were assigned since `sync`
+  std::size_t changes() const noexcept {
+    return tracker_ && proxy_.lock() ? tracker_->dirty.size() : 0;
+  }
+
+  // Forgets the keys which were assigned
+  void discard_changes() noexcept {
+    if (tracker_ && proxy_.lock()) {
+      tracker_->forget(tracker_->dirty.size());
+    }
+  }
+
+  // Calls `f(L)`, which returns `expected<void>`, for each key which was
+  // assigned since the last call, in the order they were first assigned,
+  // with the key and its value on top of the stack, and then forgets them.
+  // If `f` returns an error, it is returned, and that key and the ones after
+  // it are kept.
+  /*<< `f` must not raise lua errors, and must leave the stack as it found it.
+       It may push at most two values, more only after `lua_checkstack`. >>*/
+  template <typename F>
+  expected<void> sync(F && f) noexcept {
+    lua_State * L = data_.lock();
+    if (!L || !tracker_) { return primer::error::cant_lock_vm(); }
+    auto stack_check = detail::check_stack_push_n(L, 6);
+    if (!stack_check) { return std::move(stack_check.err()); }
+
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    data_.push(L);
+    keys_.push(L);
+    const int data = lua_absindex(L, -2);
+
+    expected<void> result;
+    std::size_t done = 0;
+    for (; done < tracker_->dirty.size(); ++done) {
+      lua_rawgeti(L, data + 1, tracker_->dirty[done]);
+      lua_pushvalue(L, -1);
+      lua_rawget(L, data);
+      result = f(L);
+      lua_pop(L, 2);
+      if (!result) { break; }
+    }
+    lua_pop(L, 2);
+
+    tracker_->forget(done);
+    return result;
+  }
+};
+
+} // end namespace primer
@@ -0,0 +1,135 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Trait which describes how to encode a C++ value directly into a string of
+ * bytes, and decode it again, without going through the lua stack.
+ *
+ * This is used by `api::persistent_value` with `api::binary_encoding`, so that
+ * a large value is handed to eris as one opaque string, rather than as a tree
+ * of lua tables.
+ *
+ * A specialization looks like this:
+
+   template <>
+   struct binary<T> {
+     // Appends the encoding of `t` to `out`. May throw `std::bad_alloc`.
+     static void write(std::string & out, const T & t);
+
+     // Decodes from `[pos, end)` into `t`, advancing `pos`.
+     // Returns false if the input is malformed. May throw `std::bad_alloc`.
+     static bool read(const char *& pos, const char * end, T & t);
+   };
+
+ * Arithmetic types are stored in their native representation, so the encoding
+ * is only meant to be read back on the same platform, like eris output.
+ * Lengths are stored as variable-length unsigned integers.
+ *
+ * The containers and visitable structures have specializations in their own
+ * headers.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/detail/type_traits.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+namespace primer {
+
+namespace traits {
+
+template <typename T, typename ENABLE = void>
+struct binary;
+
+} // end namespace traits
+
+namespace detail {
+
+// Variable-length unsigned integers, seven bits per byte
+inline void
+binary_write_size(std::string & out, std::uint64_t v) {
+  char buf[10];
+  int n = 0;
+  while (v >= 0x80) {
+    buf[n++] = static_cast<char>((v & 0x7F) | 0x80);
+    v >>= 7;
+  }
+  buf[n++] = static_cast<char>(v);
+  out.append(buf, static_cast<std::size_t>(n));
+}
+
+inline bool
+binary_read_size(const char *& pos, const char * end,
+                 std::uint64_t & v) noexcept {
+  v = 0;
+  for (int shift = 0; pos != end && shift < 64; shift += 7) {
+    const auto byte = static_cast<unsigned char>(*pos++);
+    v |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) { return true; }
+  }
+  return false;
+}
+
+// Reads a length which can't exceed the remaining input, if every element
+// takes at least one byte. This bounds any allocation by the input size.
+inline bool
+binary_read_count(const char *& pos, const char * end,
+                  std::size_t & n) noexcept {
+  std::uint64_t v;
+  if (!binary_read_size(pos, end, v)
+      || v > static_cast<std::uint64_t>(end - pos)) {
+    return false;
+  }
+  n = static_cast<std::size_t>(v);
+  return true;
+}
+
+} // end namespace detail
+
+namespace traits {
+
+template <typename T>
+struct binary<T, enable_if_t<std::is_arithmetic<T>::value
+                             || std::is_enum<T>::value>> {
+  static void write(std::string & out, const T & t) {
+    out.append(reinterpret_cast<const char *>(&t), sizeof(T));
+  }
+
+  static bool read(const char *& pos, const char * end, T & t) noexcept {
+    if (static_cast<std::size_t>(end - pos) < sizeof(T)) { return false; }
+    std::memcpy(&t, pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+  }
+};
+
+template <>
+struct binary<std::string> {
+  static void write(std::string & out, const std::string & s) {
+    detail::binary_write_size(out, s.size());
+    out.append(s);
+  }
+
+  static bool read(const char *& pos, const char * end, std::string & s) {
+    std::size_t n;
+    if (!detail::binary_read_count(pos, end, n)) { return false; }
+    s.assign(pos, n);
+    pos += n;
+    return true;
+  }
+};
+
+} // end namespace traits
+
+} // end namespace primer
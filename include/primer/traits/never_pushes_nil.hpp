@@ -0,0 +1,45 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Trait which says that pushing a type never gives `nil`.
+ *
+ * Keys which push as `nil` are skipped when a map or set is pushed, and that
+ * needs a check of each key on the stack. For key types which derive this
+ * trait from `std::true_type`, the check is removed at compile-time.
+ *
+ * Numbers, booleans and strings never push `nil`. Specialize it for other
+ * types, e.g.
+ *
+ *   namespace primer { namespace traits {
+ *   template <>
+ *   struct never_pushes_nil<entity_id> : std::true_type {};
+ *   } }
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/support/types.hpp>
+
+#include <string>
+#include <type_traits>
+
+namespace primer {
+namespace traits {
+
+template <typename T>
+struct never_pushes_nil
+  : std::integral_constant<bool, std::is_arithmetic<T>::value
+                                   || std::is_same<T, std::string>::value
+                                   || std::is_same<T, lua_string_view>::value
+                                   || std::is_same<T, stringy>::value
+                                   || std::is_same<T, truthy>::value> {};
+
+} // end namespace traits
+} // end namespace primer
@@ -12,6 +12,10 @@
  * The trait should provide:
  * static void to_stack(lua_State *, const T &);
  *   conversion function
+ *
+ * It may also provide
+ * static void to_stack(lua_State *, T &&);
+ *   which is used when a temporary is pushed, and may move from it
  */
 
 #include <primer/base.hpp>
@@ -27,6 +31,8 @@ PRIMER_ASSERT_FILESCOPE;
 
 #include <primer/detail/type_traits.hpp>
 
+#include <cstddef>
+#include <cstring>
 #include <string>
 #include <utility>
 
@@ -40,20 +46,45 @@ struct push<const char *> {
   static constexpr int stack_space_needed{1};
 };
 
+// Length-aware strings. These go through `lua_pushlstring`, so no `strlen` is
+// performed and embedded zeros are preserved.
+template <>
+struct push<lua_string_view> {
+  static void to_stack(lua_State * L, const lua_string_view & s) {
+    lua_pushlstring(L, s.data(), s.size());
+  }
+  static constexpr int stack_space_needed{1};
+};
+
 // Std-String
 template <>
 struct push<std::string> {
   static void to_stack(lua_State * L, const std::string & str) {
-    push<const char *>::to_stack(L, str.c_str());
+    lua_pushlstring(L, str.data(), str.size());
   }
   static constexpr int stack_space_needed{1};
 };
 
 // Manually decay string literals...
+// A const array is treated as a literal, whose length is known at compile-time,
+// and the final (null terminator) character is dropped.
+template <std::size_t n>
+struct push<const char[n]> {
+  PRIMER_STATIC_ASSERT(n > 0, "Cannot push a zero length char array");
+  static void to_stack(lua_State * L, const char (&str)[n]) {
+    lua_pushlstring(L, str, n - 1);
+  }
+  static constexpr int stack_space_needed{1};
+};
+
+// A mutable array is a buffer, which may be only partially filled, so it is
+// pushed up to its first null character, and at most `n` characters.
 template <std::size_t n>
 struct push<char[n]> {
+  PRIMER_STATIC_ASSERT(n > 0, "Cannot push a zero length char array");
   static void to_stack(lua_State * L, const char (&str)[n]) {
-    push<const char *>::to_stack(L, str);
+    const char * end = static_cast<const char *>(std::memchr(str, 0, n));
+    lua_pushlstring(L, str, end ? static_cast<std::size_t>(end - str) : n);
   }
   static constexpr int stack_space_needed{1};
 };
@@ -25,11 +25,26 @@ PRIMER_ASSERT_FILESCOPE;
 #include <primer/support/types.hpp>
 #include <primer/userdata.hpp>
 
+#include <cstddef>
 #include <limits>
 #include <string>
 #include <type_traits>
 
 namespace primer {
+
+namespace detail {
+
+// A base of primer's own read traits for arithmetic types. A user full
+// specialization of one of those doesn't have it, so inline fast paths, which
+// assume primer's semantics, can check `is_builtin_read` and step aside.
+struct builtin_read_tag {};
+
+template <typename T>
+struct is_builtin_read
+  : std::is_base_of<builtin_read_tag, traits::read<T>> {};
+
+} // end namespace detail
+
 namespace traits {
 
 // Primitive types
@@ -45,11 +60,26 @@ struct read<const char *> {
   static constexpr int stack_space_needed{0};
 };
 
+// Length-aware, non-owning. Embedded zeros are preserved.
+template <>
+struct read<lua_string_view> {
+  static expected<lua_string_view> from_stack(lua_State * L, int idx) {
+    if (lua_type(L, idx) == LUA_TSTRING) {
+      std::size_t len = 0;
+      const char * str = lua_tolstring(L, idx, &len);
+      return lua_string_view{str, len};
+    } else {
+      return primer::arg_error(L, idx, "string");
+    }
+  }
+  static constexpr int stack_space_needed{0};
+};
+
 template <>
 struct read<std::string> {
   static expected<std::string> from_stack(lua_State * L, int idx) {
     PRIMER_TRY_BAD_ALLOC {
-      return read<const char *>::from_stack(L, idx).convert<std::string>();
+      return read<lua_string_view>::from_stack(L, idx).convert<std::string>();
     }
     PRIMER_CATCH_BAD_ALLOC { return primer::error::bad_alloc(); }
   }
@@ -129,29 +159,76 @@ template <typename T>
 struct read<T, enable_if_t<std::is_same<T, int>::value ||  //
                            std::is_same<T, long>::value || //
                            std::is_same<T, long long>::value>>
-  : signed_read_helper<T> {};
+  : signed_read_helper<T>, detail::builtin_read_tag {};
 
 template <typename T>
 struct read<T, enable_if_t<std::is_same<T, unsigned int>::value ||  //
                            std::is_same<T, unsigned long>::value || //
                            std::is_same<T, unsigned long long>::value>>
-  : unsigned_read_helper<typename std::make_signed<T>::type> {};
+  : unsigned_read_helper<typename std::make_signed<T>::type>,
+    detail::builtin_read_tag {};
 
 // Floating point types
+
+// Lenient reads convert strings to numbers, as lua arithmetic does, and strict
+// reads only accept numbers. Integer reads never convert strings.
+template <typename T, bool strict>
+struct float_read_helper;
+
 template <typename T>
-struct read<T, enable_if_t<std::is_same<T, float>::value ||  //
-                           std::is_same<T, double>::value || //
-                           std::is_same<T, long double>::value>> {
+struct float_read_helper<T, false> {
   static expected<T> from_stack(lua_State * L, int idx) {
-    expected<T> result;
+    int isnum = 0;
+    const lua_Number n = lua_tonumberx(L, idx, &isnum);
+    if (isnum) { return static_cast<T>(n); }
+    return primer::arg_error(L, idx, "number");
+  }
+  static constexpr int stack_space_needed{0};
+};
 
-    if (lua_isnumber(L, idx)) {
-      result = static_cast<T>(lua_tonumber(L, idx));
-    } else {
-      result = primer::arg_error(L, idx, "number");
+template <typename T>
+struct float_read_helper<T, true> {
+  static expected<T> from_stack(lua_State * L, int idx) {
+    if (lua_type(L, idx) == LUA_TNUMBER) {
+      return static_cast<T>(lua_tonumber(L, idx));
     }
+    return primer::arg_error(L, idx, "number");
+  }
+  static constexpr int stack_space_needed{0};
+};
 
-    return result;
+#ifdef PRIMER_STRICT_NUMBERS
+constexpr bool strict_number_reads = true;
+#else
+constexpr bool strict_number_reads = false;
+#endif
+
+template <typename T>
+using is_float_type = std::integral_constant<
+  bool, std::is_same<T, float>::value || std::is_same<T, double>::value
+          || std::is_same<T, long double>::value>;
+
+template <typename T>
+struct read<T, enable_if_t<is_float_type<T>::value>>
+  : float_read_helper<T, strict_number_reads>, detail::builtin_read_tag {};
+
+// Per-parameter policy
+template <typename T>
+struct read<strict_number<T>, enable_if_t<is_float_type<T>::value>> {
+  static expected<strict_number<T>> from_stack(lua_State * L, int idx) {
+    auto result = float_read_helper<T, true>::from_stack(L, idx);
+    if (!result) { return std::move(result.err()); }
+    return strict_number<T>{*result};
+  }
+  static constexpr int stack_space_needed{0};
+};
+
+template <typename T>
+struct read<lenient_number<T>, enable_if_t<is_float_type<T>::value>> {
+  static expected<lenient_number<T>> from_stack(lua_State * L, int idx) {
+    auto result = float_read_helper<T, false>::from_stack(L, idx);
+    if (!result) { return std::move(result.err()); }
+    return lenient_number<T>{*result};
   }
   static constexpr int stack_space_needed{0};
 };
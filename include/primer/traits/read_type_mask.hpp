@@ -0,0 +1,140 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Trait which reports, at compile-time, which lua types `traits::read<T>`
+ * could possibly accept. This is a necessary condition only -- a value of an
+ * accepted type may still fail to convert (e.g. an integer which is too large
+ * for `int`).
+ *
+ * It is used to select among overloaded callbacks without attempting any
+ * reads, see <primer/adapt_overloads.hpp>.
+ *
+ * The mask is a bitwise-or of `primer::lua_type_bit(LUA_TFOO)`. Integers are
+ * distinguished from other numbers by the pseudo-type `primer::lua_tinteger`,
+ * see `primer::lua_type_tag`. The default is `lua_type_any`, which means
+ * "can't say". Specialize it for your own types, e.g.
+ *
+ *   namespace primer { namespace traits {
+ *   template <>
+ *   struct read_type_mask<my_point>
+ *     : type_mask_constant<lua_type_bit(LUA_TTABLE)> {};
+ *   } }
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/detail/is_userdata.hpp>
+#include <primer/detail/type_traits.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/types.hpp>
+
+#include <string>
+#include <type_traits>
+
+namespace primer {
+
+// Pseudo-type for numbers which are integers
+constexpr int lua_tinteger = LUA_NUMTAGS;
+
+// Like `lua_type`, but reports `lua_tinteger` for integers
+inline int
+lua_type_tag(lua_State * L, int idx) {
+  int t = lua_type(L, idx);
+  if (t == LUA_TNUMBER && lua_isinteger(L, idx)) { t = lua_tinteger; }
+  return t;
+}
+
+// `LUA_TNONE` is -1, so shift everything by one.
+constexpr unsigned
+lua_type_bit(int t) {
+  return 1u << (t + 1);
+}
+
+constexpr unsigned lua_type_any = ~0u;
+constexpr unsigned lua_number_bits =
+  lua_type_bit(LUA_TNUMBER) | lua_type_bit(lua_tinteger);
+
+namespace traits {
+
+template <unsigned mask>
+struct type_mask_constant {
+  static constexpr unsigned value = mask;
+};
+
+template <typename T, typename ENABLE = void>
+struct read_type_mask : type_mask_constant<lua_type_any> {};
+
+template <>
+struct read_type_mask<bool> : type_mask_constant<lua_type_bit(LUA_TBOOLEAN)> {
+};
+
+template <typename T>
+struct read_type_mask<T, enable_if_t<std::is_integral<T>::value
+                                     && !std::is_same<T, bool>::value>>
+  : type_mask_constant<lua_type_bit(lua_tinteger)> {};
+
+// Lenient reads also accept convertible strings, see PRIMER_STRICT_NUMBERS
+#ifdef PRIMER_STRICT_NUMBERS
+template <typename T>
+struct read_type_mask<T, enable_if_t<std::is_floating_point<T>::value>>
+  : type_mask_constant<lua_number_bits> {};
+#else
+template <typename T>
+struct read_type_mask<T, enable_if_t<std::is_floating_point<T>::value>>
+  : type_mask_constant<lua_number_bits | lua_type_bit(LUA_TSTRING)> {};
+#endif
+
+template <typename T>
+struct read_type_mask<strict_number<T>> : type_mask_constant<lua_number_bits> {
+};
+
+template <typename T>
+struct read_type_mask<lenient_number<T>>
+  : type_mask_constant<lua_number_bits | lua_type_bit(LUA_TSTRING)> {};
+
+template <>
+struct read_type_mask<const char *>
+  : type_mask_constant<lua_type_bit(LUA_TSTRING)> {};
+
+template <>
+struct read_type_mask<std::string>
+  : type_mask_constant<lua_type_bit(LUA_TSTRING)> {};
+
+template <>
+struct read_type_mask<lua_string_view>
+  : type_mask_constant<lua_type_bit(LUA_TSTRING)> {};
+
+template <>
+struct read_type_mask<nil_t>
+  : type_mask_constant<lua_type_bit(LUA_TNONE) | lua_type_bit(LUA_TNIL)> {};
+
+template <typename T>
+struct read_type_mask<T &, enable_if_t<primer::detail::is_userdata<T>::value>>
+  : type_mask_constant<lua_type_bit(LUA_TUSERDATA)> {};
+
+template <typename T>
+struct read_type_mask<const T &,
+                      enable_if_t<primer::detail::is_userdata<T>::value>>
+  : type_mask_constant<lua_type_bit(LUA_TUSERDATA)> {};
+
+// Types read as tables, or optionally as typed arrays
+constexpr unsigned table_type_mask = lua_type_bit(LUA_TTABLE);
+constexpr unsigned seq_type_mask(bool typed_array) {
+  return table_type_mask | (typed_array ? lua_type_bit(LUA_TUSERDATA) : 0u);
+}
+
+// Optionals accept nil in addition to whatever the value type accepts
+template <typename T>
+struct optional_type_mask
+  : type_mask_constant<lua_type_bit(LUA_TNONE) | lua_type_bit(LUA_TNIL)
+                       | read_type_mask<T>::value> {};
+
+} // end namespace traits
+} // end namespace primer
@@ -0,0 +1,39 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Trait which tells `primer::ref_proxy<T>` how to reach into a `T` lazily.
+ * See <primer/ref_proxy.hpp>.
+ *
+ * The trait should provide:
+ *
+ * static void index(lua_State * L, const T &);
+ *   push the element for the key at index 2, or nil
+ * static int next(lua_State * L, const T &);
+ *   push the key and element following the key at index 2, and return 2,
+ *   or push nil and return 1 if there are no more
+ * static std::size_t size(const T &);
+ *   result of the `#` operator
+ * static constexpr int stack_space_needed;
+ *   the most stack space that `index` or `next` needs
+ *
+ * Specializations are provided alongside the `push` specializations for the
+ * standard maps and sequences, and for visitable structures.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+namespace primer {
+namespace traits {
+
+template <typename T, typename ENABLE = void>
+struct ref_proxy_access;
+
+} // end namespace traits
+} // end namespace primer
@@ -0,0 +1,33 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Trait used to opt-in a numeric sequence type to be transported as a
+ * `primer::typed_array` userdata, rather than as a table.
+ *
+ * Specialize it to derive from `std::true_type`, e.g.
+ *
+ *   namespace primer { namespace traits {
+ *   template <>
+ *   struct use_typed_array<std::vector<double>> : std::true_type {};
+ *   } }
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <type_traits>
+
+namespace primer {
+namespace traits {
+
+template <typename T>
+struct use_typed_array : std::false_type {};
+
+} // end namespace traits
+} // end namespace primer
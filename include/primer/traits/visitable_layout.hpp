@@ -0,0 +1,58 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Trait used to select the table layout of a visitable structure.
+ *
+ * `named` (the default) keys each field by its name.
+ *
+ * `positional` puts the fields in the array part, in declaration order, so
+ * that `t[1]` is the first field. The table is smaller, and pushing and
+ * reading it doesn't hash any keys. The table gets a metatable shared by all
+ * tables of the type, whose `__fields` is the array of field names, in the
+ * same order, for debugging. Reading only looks at `t[1] .. t[n]`, and the
+ * `visitable_read` strategy is not used, except for userdata, which are read
+ * by name.
+ *
+ * `value_userdata` pushes a userdata holding a copy of the structure, which is
+ * a single object for the GC, with no table or keys. Its fields are accessed
+ * from lua by name, through the metamethods of `visitable_fields`. Reading
+ * copies the structure out of such a userdata, and also accepts a table keyed
+ * by field name. It is persisted through `__persist`, which needs the type to
+ * be registered with the `api::userdatas` feature as
+ * `primer::visitable_value<T>`. This layout needs
+ * `<primer/visitable_userdata.hpp>`.
+ *
+ * Specialize it to derive from `visitable_layout_mode<...>`, e.g.
+ *
+ *   namespace primer { namespace traits {
+ *   template <>
+ *   struct visitable_layout<my_struct>
+ *     : visitable_layout_mode<visitable_layout_style::positional> {};
+ *   } }
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <type_traits>
+
+namespace primer {
+namespace traits {
+
+enum class visitable_layout_style { named, positional, value_userdata };
+
+template <visitable_layout_style s>
+using visitable_layout_mode = std::integral_constant<visitable_layout_style, s>;
+
+template <typename T>
+struct visitable_layout
+  : visitable_layout_mode<visitable_layout_style::named> {};
+
+} // end namespace traits
+} // end namespace primer
@@ -0,0 +1,51 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Trait used to select how a visitable structure is read from a table.
+ *
+ * `per_field` (the default) looks up each declared field in the table.
+ *
+ * `single_pass` instead walks the table once with `lua_next`, dispatching each
+ * key to its field. This is faster when the struct has many fields and the
+ * tables are sparse. Fields which don't appear are read from `nil`, or, if the
+ * table has a metatable, looked up in it, so that `__index` supplies them as
+ * it does with `per_field`. Unknown keys are ignored.
+ *
+ * `single_pass_strict` is the same, but unknown keys are an error.
+ *
+ * Userdata cannot be walked, so they are always read `per_field`.
+ *
+ * Specialize it to derive from `visitable_read_mode<...>`, e.g.
+ *
+ *   namespace primer { namespace traits {
+ *   template <>
+ *   struct visitable_read<my_struct>
+ *     : visitable_read_mode<visitable_read_strategy::single_pass> {};
+ *   } }
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <type_traits>
+
+namespace primer {
+namespace traits {
+
+enum class visitable_read_strategy { per_field, single_pass, single_pass_strict };
+
+template <visitable_read_strategy s>
+using visitable_read_mode = std::integral_constant<visitable_read_strategy, s>;
+
+template <typename T>
+struct visitable_read
+  : visitable_read_mode<visitable_read_strategy::per_field> {};
+
+} // end namespace traits
+} // end namespace primer
@@ -0,0 +1,297 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Copies plain data from one lua VM directly into another, unrelated one,
+ * without reading it into C++ types or persisting it.
+ *
+ * Nil, booleans, numbers and strings are copied. Tables are copied deeply, in
+ * one traversal, and a table which is reached more than once, including by a
+ * cycle, is copied once and shared in the same way in the copy. Tables with
+ * metatables are not plain data, and are refused.
+ *
+ * Userdata of a primer userdata type `T` can be copied if
+ * `register_transfer<T>(L)` was called for the source state. The copy is made
+ * with the copy constructor of `T`, which must not throw, and gets the
+ * metatable of `T` in the destination.
+ *
+ * Functions, threads, light userdata and other userdata are refused.
+ *
+ * Nothing in the source VM is allocated or modified, and all of the work in
+ * the destination VM is done in a protected call, so memory errors there are
+ * reported rather than raised.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/cpp_pcall.hpp>
+#include <primer/detail/is_userdata.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/support/metatable.hpp>
+#include <primer/userdata.hpp>
+
+#include <type_traits>
+
+namespace primer {
+
+namespace detail {
+
+struct transfer_copier {
+  // Pushes onto `dst` a copy of the userdata at `idx` of `src`
+  void (*copy)(lua_State * src, int idx, lua_State * dst);
+};
+
+template <typename T>
+struct transfer_copier_for {
+  static void copy(lua_State * src, int idx, lua_State * dst) {
+    const T * t = udata_storage<T>::get(lua_touserdata(src, idx));
+    primer::push_udata<T>(dst, *t);
+  }
+
+  static const transfer_copier instance;
+};
+
+template <typename T>
+const transfer_copier transfer_copier_for<T>::instance{&copy};
+
+// Registry key of a table in the source state, from metatables of userdata
+// types to their copiers
+inline void *
+transfer_registry_key() noexcept {
+  static char key;
+  return &key;
+}
+
+class transfer_context {
+  static constexpr int max_depth = 200;
+
+  lua_State * src_;
+  lua_State * dst_;
+  int memo_; // Index in dst of a table, from source objects to their copies
+  int depth_ = 0;
+  // Whether src and dst are the same stack, so that values which aren't
+  // copied can be shared instead of refused
+  bool share_;
+  const char * name_;
+
+  // The copy of the object at `idx`, if there is one yet
+  bool push_memo(const void * p) {
+    if (lua_rawgetp(dst_, memo_, p) != LUA_TNIL) { return true; }
+    lua_pop(dst_, 1);
+    return false;
+  }
+
+  void set_memo(const void * p) {
+    lua_pushvalue(dst_, -1);
+    lua_rawsetp(dst_, memo_, p);
+  }
+
+  void check_stack() {
+    if (!lua_checkstack(src_, 3)) {
+      luaL_error(dst_, "%s: insufficient stack space in the source", name_);
+    }
+    luaL_checkstack(dst_, 4, name_);
+  }
+
+  // The number of fields of the table at `idx` which aren't in its sequence
+  int count_fields(int idx, int narr) {
+    int n = 0;
+    lua_pushnil(src_);
+    while (lua_next(src_, idx)) {
+      lua_pop(src_, 1);
+      ++n;
+    }
+    return n > narr ? n - narr : 0;
+  }
+
+  void copy_table(int idx) {
+    if (lua_getmetatable(src_, idx)) {
+      lua_pop(src_, 1);
+      if (!share_) {
+        luaL_error(dst_, "%s: cannot copy a table with a metatable", name_);
+      }
+    }
+    const void * p = lua_topointer(src_, idx);
+    if (this->push_memo(p)) { return; }
+
+    if (++depth_ > max_depth) {
+      luaL_error(dst_, "%s: tables are nested too deeply", name_);
+    }
+    this->check_stack();
+
+    const int narr = static_cast<int>(lua_rawlen(src_, idx));
+    lua_createtable(dst_, narr, this->count_fields(idx, narr));
+    const int t = lua_gettop(dst_);
+    this->set_memo(p);
+    if (share_ && lua_getmetatable(src_, idx)) { lua_setmetatable(dst_, t); }
+
+    // The indices are absolute, since src and dst may be the same stack
+    lua_pushnil(src_);
+    while (lua_next(src_, idx)) {
+      const int k = lua_absindex(src_, -2);
+      this->copy_value(k);
+      this->copy_value(k + 1);
+      lua_rawset(dst_, t);
+      lua_pop(src_, 1);
+    }
+    --depth_;
+  }
+
+  void copy_userdata(int idx) {
+    const void * p = lua_touserdata(src_, idx);
+    if (this->push_memo(p)) { return; }
+
+    const transfer_copier * c = nullptr;
+    if (lua_getmetatable(src_, idx)) {
+      if (lua_rawgetp(src_, LUA_REGISTRYINDEX, transfer_registry_key())
+          == LUA_TTABLE) {
+        lua_pushvalue(src_, -2);
+        lua_rawget(src_, -2);
+        c = static_cast<const transfer_copier *>(lua_touserdata(src_, -1));
+        lua_pop(src_, 1);
+      }
+      lua_pop(src_, 2);
+    }
+    if (!c) {
+      if (share_) {
+        lua_pushvalue(dst_, idx);
+        return;
+      }
+      luaL_error(dst_, "%s: cannot copy this userdata", name_);
+    }
+
+    c->copy(src_, idx, dst_);
+    this->set_memo(p);
+  }
+
+public:
+  transfer_context(lua_State * src, lua_State * dst, int memo,
+                   const char * name = "transfer") noexcept
+    : src_(src)
+    , dst_(dst)
+    , memo_(memo)
+    , share_(src == dst)
+    , name_(name) {}
+
+  // Pushes onto dst a copy of the value at the absolute index `idx` of src
+  void copy_value(int idx) {
+    switch (lua_type(src_, idx)) {
+      case LUA_TNIL: lua_pushnil(dst_); return;
+      case LUA_TBOOLEAN: {
+        lua_pushboolean(dst_, lua_toboolean(src_, idx));
+        return;
+      }
+      case LUA_TNUMBER: {
+        if (lua_isinteger(src_, idx)) {
+          lua_pushinteger(dst_, lua_tointeger(src_, idx));
+        } else {
+          lua_pushnumber(dst_, lua_tonumber(src_, idx));
+        }
+        return;
+      }
+      case LUA_TSTRING: {
+        if (share_) {
+          lua_pushvalue(dst_, idx);
+          return;
+        }
+        std::size_t len;
+        const char * str = lua_tolstring(src_, idx, &len);
+        lua_pushlstring(dst_, str, len);
+        return;
+      }
+      case LUA_TTABLE: this->copy_table(idx); return;
+      case LUA_TUSERDATA: this->copy_userdata(idx); return;
+      default: {
+        if (share_) {
+          lua_pushvalue(dst_, idx);
+          return;
+        }
+        luaL_error(dst_, "%s: cannot copy a value of type %s", name_,
+                   lua_typename(src_, lua_type(src_, idx)));
+      }
+    }
+  }
+};
+
+} // end namespace detail
+
+/***
+ * Allows userdata of type `T` to be copied out of `L`.
+ * May raise a lua error if memory fails.
+ */
+template <typename T>
+void
+register_transfer(lua_State * L) {
+  static_assert(detail::is_userdata<T>::value, "not a userdata type");
+  static_assert(std::is_nothrow_copy_constructible<T>::value,
+                "transferred userdata must be nothrow copy constructible");
+
+  if (lua_rawgetp(L, LUA_REGISTRYINDEX, detail::transfer_registry_key())
+      != LUA_TTABLE) {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, detail::transfer_registry_key());
+  }
+  primer::push_metatable<T>(L);
+  lua_pushlightuserdata(
+    L, const_cast<detail::transfer_copier *>(
+         &detail::transfer_copier_for<T>::instance));
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+/***
+ * Pushes onto `dst` a copy of the value at `idx` of `src`, or pushes nothing
+ * and returns an error. The stack of `src` is unchanged.
+ */
+inline expected<void>
+transfer_value(lua_State * src, int idx, lua_State * dst) noexcept {
+  idx = lua_absindex(src, idx);
+  const int src_top = lua_gettop(src);
+  if (!lua_checkstack(dst, 4)) {
+    return primer::error::insufficient_stack_space(4);
+  }
+
+  auto ok = primer::cpp_pcall(dst, [src, idx, dst]() {
+    lua_newtable(dst);
+    detail::transfer_context c{src, dst, lua_gettop(dst)};
+    c.copy_value(idx);
+    lua_remove(dst, -2);
+  });
+  lua_settop(src, src_top);
+  return ok;
+}
+
+/***
+ * A reference, in `dst`, to a copy of the value of `r`
+ */
+inline expected<lua_ref>
+transfer(const lua_ref & r, lua_State * dst) {
+  lua_State * src = r.lock();
+  if (!src) { return primer::error{"transfer: the source state is gone"}; }
+  if (!lua_checkstack(src, 3)) {
+    return primer::error::insufficient_stack_space(3);
+  }
+
+  r.push();
+  auto ok = primer::transfer_value(src, -1, dst);
+  lua_pop(src, 1);
+  if (!ok) { return std::move(ok.err()); }
+
+  expected<lua_ref> result;
+  auto ref_ok = primer::mem_pcall<1>(dst, [&]() { result = lua_ref{dst}; });
+  if (!ref_ok) { return std::move(ref_ok.err()); }
+  return result;
+}
+
+} // end namespace primer
@@ -0,0 +1,273 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A typed array is a userdata holding a contiguous buffer of numbers.
+ *
+ * The header and the elements live in a single userdata allocation, so
+ * creating one from a C++ buffer is one `memcpy`, and C++ code can look at
+ * the elements of one on the stack without copying, by reading
+ * `primer::typed_array<T> &`.
+ *
+ * From lua, it behaves like a fixed size sequence, supporting `#a`, `a[i]` and
+ * `a[i] = v`. Indexing is 1-based, reading out of range elements gives `nil`,
+ * and writing them is an error.
+ *
+ * A typed array is persisted as one string of its raw bytes, see
+ * <primer/support/raw_persist.hpp>. Its reconstructor is in the permanents of
+ * its userdata trait.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/adapt.hpp>
+#include <primer/error.hpp>
+#include <primer/lua.hpp>
+#include <primer/push.hpp>
+#include <primer/read.hpp>
+#include <primer/result.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/raw_persist.hpp>
+#include <primer/traits/userdata.hpp>
+#include <primer/userdata.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace primer {
+
+namespace detail {
+
+// Name of the metatable associated to each element type
+template <typename T>
+struct typed_array_name;
+
+#define PRIMER_TYPED_ARRAY_NAME(TYPE)                                          \
+  template <>                                                                  \
+  struct typed_array_name<TYPE> {                                              \
+    static constexpr const char * value() {                                    \
+      return "primer_typed_array<" #TYPE ">";                                  \
+    }                                                                          \
+  }
+
+PRIMER_TYPED_ARRAY_NAME(int);
+PRIMER_TYPED_ARRAY_NAME(long);
+PRIMER_TYPED_ARRAY_NAME(long long);
+PRIMER_TYPED_ARRAY_NAME(unsigned int);
+PRIMER_TYPED_ARRAY_NAME(unsigned long);
+PRIMER_TYPED_ARRAY_NAME(unsigned long long);
+PRIMER_TYPED_ARRAY_NAME(float);
+PRIMER_TYPED_ARRAY_NAME(double);
+
+#undef PRIMER_TYPED_ARRAY_NAME
+
+} // end namespace detail
+
+template <typename T>
+class typed_array;
+
+namespace detail {
+
+// Pushes a typed array whose elements are not initialized
+template <typename T>
+typed_array<T> & new_typed_array(lua_State * L, std::size_t n);
+
+} // end namespace detail
+
+//[ primer_typed_array
+template <typename T>
+class typed_array {
+  PRIMER_STATIC_ASSERT(std::is_arithmetic<T>::value,
+                       "typed_array holds only arithmetic types");
+  PRIMER_STATIC_ASSERT(alignof(T) <= alignof(std::size_t),
+                       "typed_array element type is overaligned");
+
+  std::size_t size_;
+
+  explicit typed_array(std::size_t n) noexcept
+    : size_(n) {}
+
+  // The elements are stored immediately after the header
+  static constexpr std::size_t header_size() {
+    return (sizeof(std::size_t) + alignof(T) - 1) / alignof(T) * alignof(T);
+  }
+
+  template <typename U>
+  friend typed_array<U> & detail::new_typed_array(lua_State *, std::size_t);
+
+public:
+  typed_array(const typed_array &) = delete;
+  typed_array & operator=(const typed_array &) = delete;
+
+  T * data() noexcept {
+    return reinterpret_cast<T *>(reinterpret_cast<char *>(this)
+                                 + header_size());
+  }
+  const T * data() const noexcept {
+    return reinterpret_cast<const T *>(reinterpret_cast<const char *>(this)
+                                       + header_size());
+  }
+  std::size_t size() const noexcept { return size_; }
+
+  T * begin() noexcept { return data(); }
+  T * end() noexcept { return data() + size_; }
+  const T * begin() const noexcept { return data(); }
+  const T * end() const noexcept { return data() + size_; }
+
+  T & operator[](std::size_t i) noexcept { return data()[i]; }
+  const T & operator[](std::size_t i) const noexcept { return data()[i]; }
+};
+
+/// Create a typed array on top of the stack, copying `n` elements from `src`.
+/// `src` may be null, in which case the elements are zero-initialized.
+template <typename T>
+typed_array<T> & push_typed_array(lua_State * L, const T * src,
+                                  std::size_t n);
+//]
+
+namespace detail {
+
+template <typename T>
+typed_array<T> &
+new_typed_array(lua_State * L, std::size_t n) {
+  void * storage =
+    detail::newuserdata(L, typed_array<T>::header_size() + n * sizeof(T), 0);
+  typed_array<T> * result = new (storage) typed_array<T>{n};
+  detail::udata_helper<typed_array<T>>::set_metatable(L);
+  return *result;
+}
+
+} // end namespace detail
+
+template <typename T>
+typed_array<T> &
+push_typed_array(lua_State * L, const T * src, std::size_t n) {
+  typed_array<T> & result = detail::new_typed_array<T>(L, n);
+  if (src) {
+    std::memcpy(result.data(), src, n * sizeof(T));
+  } else {
+    std::memset(result.data(), 0, n * sizeof(T));
+  }
+  return result;
+}
+
+namespace detail {
+
+template <typename T>
+primer::result
+typed_array_index(lua_State * L, const typed_array<T> & a, LUA_INTEGER i) {
+  if (i >= 1 && static_cast<std::size_t>(i) <= a.size()) {
+    primer::push(L, a[static_cast<std::size_t>(i - 1)]);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+template <typename T>
+primer::result
+typed_array_newindex(lua_State *, typed_array<T> & a, LUA_INTEGER i, T value) {
+  if (i < 1 || static_cast<std::size_t>(i) > a.size()) {
+    return primer::error{"Index ", i, " out of bounds, size is ", a.size()};
+  }
+  a[static_cast<std::size_t>(i - 1)] = value;
+  return 0;
+}
+
+template <typename T>
+primer::result
+typed_array_len(lua_State * L, const typed_array<T> & a) {
+  lua_pushinteger(L, static_cast<LUA_INTEGER>(a.size()));
+  return 1;
+}
+
+// The reconstructor. Upvalue 1 is the persisted block.
+template <typename T>
+int
+typed_array_restore(lua_State * L) {
+  std::size_t len = 0;
+  const char * s = lua_tolstring(L, lua_upvalueindex(1), &len);
+  raw_persist_block block;
+  if (!s
+      || !raw_persist_parse(s, len, raw_element_kind<T>::value, sizeof(T),
+                            block)) {
+    return luaL_error(L, "Could not rebuild a persisted '%s'",
+                      typed_array_name<T>::value());
+  }
+  typed_array<T> & a = new_typed_array<T>(L, block.count);
+  std::memcpy(a.data(), block.data, block.count * sizeof(T));
+  if (block.swapped) { raw_persist_swap(a.data(), a.size(), sizeof(T)); }
+  return 1;
+}
+
+// Pushes a closure of the reconstructor, of copies of `n` elements at `data`
+template <typename T>
+void
+push_typed_array_restore(lua_State * L, const T * data, std::size_t n) {
+  raw_persist_push(L, raw_element_kind<T>::value, sizeof(T), data, n);
+  lua_pushcclosure(L, &typed_array_restore<T>, 1);
+}
+
+template <typename T>
+int
+typed_array_persist(lua_State * L) {
+  const typed_array<T> * a =
+    primer::detail::udata_helper<typed_array<T>>::test_udata(L, 1);
+  if (!a) { return luaL_argerror(L, 1, typed_array_name<T>::value()); }
+  push_typed_array_restore<T>(L, a->data(), a->size());
+  return 1;
+}
+
+// Name of the reconstructor in the permanent objects table
+template <typename T>
+const char *
+typed_array_restore_name() {
+  static const std::string name =
+    std::string{typed_array_name<T>::value()} + ".restore";
+  return name.c_str();
+}
+
+} // end namespace detail
+
+namespace traits {
+
+template <typename T>
+struct userdata<primer::typed_array<T>> {
+  static constexpr const char * name = detail::typed_array_name<T>::value();
+
+  static void metatable(lua_State * L) {
+    PRIMER_ASSERT_TABLE(L);
+    lua_pushcfunction(L, PRIMER_ADAPT(&detail::typed_array_index<T>));
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, PRIMER_ADAPT(&detail::typed_array_newindex<T>));
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, PRIMER_ADAPT(&detail::typed_array_len<T>));
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, &detail::typed_array_persist<T>);
+    lua_setfield(L, -2, "__persist");
+    lua_pushstring(L, name);
+    lua_setfield(L, -2, "__metatable");
+  }
+
+  static const std::vector<luaL_Reg> & permanents() {
+    static const std::vector<luaL_Reg> permanents_array{
+      {detail::typed_array_restore_name<T>(), &detail::typed_array_restore<T>}};
+    return permanents_array;
+  }
+};
+
+template <typename T>
+constexpr const char * userdata<primer::typed_array<T>>::name;
+
+} // end namespace traits
+
+} // end namespace primer
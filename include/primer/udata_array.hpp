@@ -0,0 +1,258 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A udata array is a single userdata holding a contiguous array of objects of
+ * a userdata type `T`.
+ *
+ * Pushing `n` objects this way is one allocation, instead of one userdata for
+ * each of them, and C++ code can look at all of them without copying, using
+ * `primer::test_udata_array<T>`.
+ *
+ * From lua, it behaves like a fixed size sequence, supporting `#a`, `a[i]` and
+ * `a[i] = v`. Reading `a[i]` gives a userdata which borrows the element: it
+ * points into the block of the array, keeps the array alive, and works as a
+ * `T` with the methods of `T` and with `primer::test_udata<T>`. A new one is
+ * made each time, so two of them for the same element are not `rawequal`.
+ * Assigning `a[i] = v` copies the `T` in `v` into the element. Indexing is
+ * 1-based, reading out of range elements gives `nil`, and writing them is an
+ * error.
+ *
+ * A udata array can't be persisted.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/adapt.hpp>
+#include <primer/error.hpp>
+#include <primer/lua.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/result.hpp>
+#include <primer/support/alloc_scope.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/udata_borrowed.hpp>
+#include <primer/userdata.hpp>
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+template <typename T>
+class udata_array;
+
+namespace detail {
+
+template <typename T, typename F>
+udata_array<T> & push_udata_array_with(lua_State * L, std::size_t n, F && make);
+
+template <typename T>
+int udata_array_gc(lua_State * L) noexcept;
+
+} // end namespace detail
+
+//[ primer_udata_array
+template <typename T>
+class udata_array {
+  PRIMER_STATIC_ASSERT(detail::is_userdata<T>::value,
+                       "udata_array holds only userdata types");
+  PRIMER_STATIC_ASSERT(alignof(T) <= alignof(std::size_t),
+                       "udata_array element type is overaligned");
+
+  std::size_t size_ = 0; // The elements which are constructed
+
+  udata_array() noexcept = default;
+
+  // The elements are stored immediately after the header
+  static constexpr std::size_t header_size() {
+    return (sizeof(std::size_t) + alignof(T) - 1) / alignof(T) * alignof(T);
+  }
+
+  template <typename U, typename F>
+  friend udata_array<U> & detail::push_udata_array_with(lua_State *,
+                                                        std::size_t, F &&);
+
+  template <typename U>
+  friend int detail::udata_array_gc(lua_State *) noexcept;
+
+public:
+  udata_array(const udata_array &) = delete;
+  udata_array & operator=(const udata_array &) = delete;
+
+  T * data() noexcept {
+    return reinterpret_cast<T *>(reinterpret_cast<char *>(this)
+                                 + header_size());
+  }
+  const T * data() const noexcept {
+    return reinterpret_cast<const T *>(reinterpret_cast<const char *>(this)
+                                       + header_size());
+  }
+  std::size_t size() const noexcept { return size_; }
+
+  T * begin() noexcept { return data(); }
+  T * end() noexcept { return data() + size_; }
+  const T * begin() const noexcept { return data(); }
+  const T * end() const noexcept { return data() + size_; }
+
+  T & operator[](std::size_t i) noexcept { return data()[i]; }
+  const T & operator[](std::size_t i) const noexcept { return data()[i]; }
+};
+
+/// Create a udata array on top of the stack, copying `n` objects from `src`.
+/*<< May throw whatever the copy constructor of `T` throws >>*/
+template <typename T>
+udata_array<T> & push_udata_array(lua_State * L, const T * src,
+                                  std::size_t n);
+
+/// Create a udata array on top of the stack, moving the objects of `v`.
+template <typename T>
+udata_array<T> & push_udata_array(lua_State * L, std::vector<T> && v);
+
+/// Test if an entry on the stack is a udata array of `T`, and if so, return a
+/// pointer to it.
+template <typename T>
+udata_array<T> * test_udata_array(lua_State * L, int idx);
+//]
+
+namespace detail {
+
+template <typename T>
+int
+udata_array_gc(lua_State * L) noexcept {
+  auto * a = static_cast<udata_array<T> *>(lua_touserdata(L, 1));
+  while (a->size_) {
+    a->data()[--a->size_].~T();
+  }
+  return 0;
+}
+
+template <typename T>
+int
+udata_array_index(lua_State * L) {
+  const auto & a = *static_cast<const udata_array<T> *>(lua_touserdata(L, 1));
+  int isnum = 0;
+  const LUA_INTEGER i = lua_tointegerx(L, 2, &isnum);
+  if (isnum && i >= 1 && static_cast<std::size_t>(i) <= a.size()) {
+    detail::push_udata_borrowed(
+      L, const_cast<T *>(&a[static_cast<std::size_t>(i - 1)]), 1);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+template <typename T>
+primer::result
+udata_array_newindex_impl(lua_State * L) {
+  auto & a = *static_cast<udata_array<T> *>(lua_touserdata(L, 1));
+  int isnum = 0;
+  const LUA_INTEGER i = lua_tointegerx(L, 2, &isnum);
+  if (!isnum || i < 1 || static_cast<std::size_t>(i) > a.size()) {
+    return primer::error{"Index ", describe_lua_value(L, 2),
+                         " out of bounds, size is ", a.size()};
+  }
+  const T * value = primer::test_udata<T>(L, 3);
+  if (!value) { return primer::arg_error(L, 3, primer::udata_name<T>()); }
+  a[static_cast<std::size_t>(i - 1)] = *value;
+  return 0;
+}
+
+template <typename T>
+int
+udata_array_newindex(lua_State * L) {
+  using helper_t = adapt<primer::result (*)(lua_State *),
+                         &udata_array_newindex_impl<T>>;
+  return helper_t::adapted(L);
+}
+
+template <typename T>
+int
+udata_array_len(lua_State * L) {
+  const auto & a = *static_cast<const udata_array<T> *>(lua_touserdata(L, 1));
+  lua_pushinteger(L, static_cast<LUA_INTEGER>(a.size()));
+  return 1;
+}
+
+template <typename T>
+void
+udata_array_metatable(lua_State * L) {
+  lua_createtable(L, 0, 5);
+  lua_pushcfunction(L, &udata_array_gc<T>);
+  lua_setfield(L, -2, "__gc");
+  lua_pushcfunction(L, &udata_array_index<T>);
+  lua_setfield(L, -2, "__index");
+  lua_pushcfunction(L, &udata_array_newindex<T>);
+  lua_setfield(L, -2, "__newindex");
+  lua_pushcfunction(L, &udata_array_len<T>);
+  lua_setfield(L, -2, "__len");
+  lua_pushboolean(L, false);
+  lua_setfield(L, -2, "__persist");
+}
+
+// Make the array, and then each element with `make(storage, i)`. The
+// metatable is set first, so that if constructing an element throws, those
+// which were made are destroyed when the array is collected.
+template <typename T, typename F>
+udata_array<T> &
+push_udata_array_with(lua_State * L, std::size_t n, F && make) {
+  PRIMER_ALLOC_SCOPE(nullptr, "udata_array");
+  void * storage = detail::newuserdata(
+    L, udata_array<T>::header_size() + n * sizeof(T), 0);
+  udata_array<T> * result = new (storage) udata_array<T>{};
+  primer::push_singleton<&udata_array_metatable<T>>(L);
+  lua_setmetatable(L, -2);
+
+  PRIMER_TRY {
+    for (; result->size_ < n; ++result->size_) {
+      make(static_cast<void *>(result->data() + result->size_),
+           result->size_);
+    }
+  }
+  PRIMER_CATCH(...) {
+    lua_pop(L, 1);
+    PRIMER_RETHROW;
+  }
+  return *result;
+}
+
+} // end namespace detail
+
+template <typename T>
+udata_array<T> &
+push_udata_array(lua_State * L, const T * src, std::size_t n) {
+  return detail::push_udata_array_with<T>(
+    L, n, [src](void * storage, std::size_t i) { new (storage) T(src[i]); });
+}
+
+template <typename T>
+udata_array<T> &
+push_udata_array(lua_State * L, std::vector<T> && v) {
+  T * src = v.data();
+  return detail::push_udata_array_with<T>(
+    L, v.size(), [src](void * storage, std::size_t i) {
+      new (storage) T(std::move(src[i]));
+    });
+}
+
+template <typename T>
+udata_array<T> *
+test_udata_array(lua_State * L, int idx) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  void * p = lua_touserdata(L, idx);
+  if (!p || !lua_getmetatable(L, idx)) { return nullptr; }
+  primer::push_singleton<&detail::udata_array_metatable<T>>(L);
+  if (!lua_rawequal(L, -1, -2)) { p = nullptr; }
+  lua_pop(L, 2);
+  return static_cast<udata_array<T> *>(p);
+}
+
+} // end namespace primer
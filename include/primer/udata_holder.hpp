@@ -0,0 +1,246 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Shared userdata, which C++ code can keep alive.
+ *
+ * `primer::push_shared<T>(L, args...)` makes a userdata of `T` whose block
+ * holds the object together with a count of the C++ handles to it. Reading a
+ * `primer::udata_holder<T>` from it gives such a handle, which pins the
+ * userdata, so that the object stays alive after scripts drop it, for as long
+ * as the handle or one of its copies exists. Copying a handle only bumps the
+ * count in the block. The first handle takes a registry reference to the
+ * userdata, and the last one releases it, so that the object is collected and
+ * destroyed by its `__gc` as usual.
+ *
+ * That is one allocation for each shared object, where a userdata holding a
+ * `std::shared_ptr<T>` costs three, or two with `std::make_shared`.
+ *
+ * The object can't outlive the lua state, since it lives in lua memory. When
+ * the state is closed, the object is destroyed, and the handles to it become
+ * empty, like a `lua_ref`. Handles should be copied and destroyed on the
+ * thread which runs the state.
+ *
+ * The block starts with a pointer to the object, so that `test_udata<T>`,
+ * `read<T &>` and the methods of `T` accept a shared `T` as a `T`. Shared
+ * userdata can't be persisted.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/support/alloc_scope.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/diagnostics.hpp>
+#include <primer/support/lua_state_ref.hpp>
+#include <primer/support/udata_borrowed.hpp>
+#include <primer/support/userdata_common.hpp>
+#include <primer/traits/push.hpp>
+#include <primer/traits/read.hpp>
+#include <primer/userdata.hpp>
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace primer {
+
+template <typename T>
+class udata_holder;
+
+namespace detail {
+
+template <typename T>
+struct shared_block {
+  T * self;             // First, so that the block is an indirect `T`
+  int ref;              // Pins the userdata while there are holders
+  std::size_t holders;  // The number of holders
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+};
+
+template <typename T>
+int
+shared_block_gc(lua_State * L) {
+  auto * b = static_cast<shared_block<T> *>(lua_touserdata(L, 1));
+  if (T * t = b->self) {
+    b->self = nullptr;
+    t->~T();
+  }
+  return 0;
+}
+
+template <typename T>
+void
+udata_shared_metatable(lua_State * L) {
+  push_udata_indirect_metatable<T>(L);
+  lua_pushcfunction(L, &shared_block_gc<T>);
+  lua_setfield(L, -2, "__gc");
+}
+
+// The block of the value at `idx`, if it is a shared `T` which is alive
+template <typename T>
+shared_block<T> *
+test_shared_block(lua_State * L, int idx) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  void * p = lua_touserdata(L, idx);
+  if (!p || !lua_getmetatable(L, idx)) { return nullptr; }
+  primer::push_singleton<&udata_shared_metatable<T>>(L);
+  if (!lua_rawequal(L, -1, -2)) { p = nullptr; }
+  lua_pop(L, 2);
+  auto * b = static_cast<shared_block<T> *>(p);
+  return (b && b->self) ? b : nullptr;
+}
+
+} // end namespace detail
+
+//[ primer_udata_holder
+/// Create a shared userdata of `T` on top of the stack, using perfect
+/// forwarding, and return the object
+template <typename T, typename... Args>
+T & push_shared(lua_State * L, Args &&... args);
+
+/// A handle which keeps a shared userdata alive
+template <typename T>
+class udata_holder {
+  lua_state_ref state_;
+  detail::shared_block<T> * block_ = nullptr;
+
+  // The block starts a holder for the value at `idx`
+  udata_holder(lua_State * L, int idx, detail::shared_block<T> * b)
+    : state_(lua_state_ref::obtain_weak_ref_to_state(L))
+    , block_(b) {
+    if (!block_->holders) {
+      lua_pushvalue(L, idx);
+      block_->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    ++block_->holders;
+  }
+
+  friend struct primer::traits::read<udata_holder>;
+
+  void release() noexcept {
+    if (block_) {
+      if (lua_State * L = state_.lock()) {
+        if (!--block_->holders) {
+          luaL_unref(L, LUA_REGISTRYINDEX, block_->ref);
+          block_->ref = LUA_NOREF;
+        }
+      }
+      block_ = nullptr;
+    }
+    state_.reset();
+  }
+
+public:
+  udata_holder() noexcept = default;
+  ~udata_holder() noexcept { this->release(); }
+
+  udata_holder(const udata_holder & other) noexcept {
+    if (other.get()) {
+      state_ = other.state_;
+      block_ = other.block_;
+      ++block_->holders;
+    }
+  }
+
+  udata_holder(udata_holder && other) noexcept
+    : state_(std::move(other.state_))
+    , block_(other.block_) {
+    other.block_ = nullptr;
+  }
+
+  udata_holder & operator=(udata_holder other) noexcept {
+    this->swap(other);
+    return *this;
+  }
+
+  void swap(udata_holder & other) noexcept {
+    state_.swap(other.state_);
+    std::swap(block_, other.block_);
+  }
+
+  /// The object, or nullptr if the holder is empty or the state is closed
+  T * get() const noexcept {
+    return (block_ && state_.lock()) ? block_->self : nullptr;
+  }
+
+  T & operator*() const noexcept { return *this->get(); }
+  T * operator->() const noexcept { return this->get(); }
+  explicit operator bool() const noexcept { return this->get(); }
+
+  /// Let go of the object
+  void reset() noexcept { this->release(); }
+
+  /// Push the userdata, or nil if the holder is empty
+  void push(lua_State * L) const {
+    if (this->get()) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, block_->ref);
+    } else {
+      lua_pushnil(L);
+    }
+  }
+};
+//]
+
+template <typename T, typename... Args>
+T &
+push_shared(lua_State * L, Args &&... args) {
+  static_assert(detail::is_userdata<T>::value, "not a userdata type");
+  PRIMER_ALLOC_SCOPE(nullptr, detail::udata_helper<T>::udata::name);
+  // The metatable is pushed first, so that nothing can fail after the object
+  // is constructed and before it is given its `__gc`.
+  primer::push_singleton<&detail::udata_shared_metatable<T>>(L);
+  auto * b = static_cast<detail::shared_block<T> *>(
+    detail::newuserdata(L, sizeof(detail::shared_block<T>),
+                        detail::udata_user_values<T>::value));
+  b->self = nullptr;
+  b->ref = LUA_NOREF;
+  b->holders = 0;
+
+  PRIMER_TRY { b->self = new (&b->storage) T{std::forward<Args>(args)...}; }
+  PRIMER_CATCH(...) {
+    lua_pop(L, 2);
+    PRIMER_RETHROW;
+  }
+  lua_insert(L, -2);
+  lua_setmetatable(L, -2);
+  return *b->self;
+}
+
+namespace traits {
+
+template <typename T>
+struct push<primer::udata_holder<T>> {
+  static void to_stack(lua_State * L, const primer::udata_holder<T> & h) {
+    h.push(L);
+  }
+  static constexpr int stack_space_needed{1};
+};
+
+template <typename T>
+struct read<primer::udata_holder<T>> {
+  static expected<primer::udata_holder<T>> from_stack(lua_State * L,
+                                                      int idx) {
+    if (auto * b = primer::detail::test_shared_block<T>(L, idx)) {
+      return primer::udata_holder<T>{L, idx, b};
+    }
+    return primer::error{"Expected shared userdata '", primer::udata_name<T>(),
+                         "', found ", primer::describe_lua_value(L, idx)};
+  }
+
+  static constexpr int stack_space_needed{2};
+};
+
+} // end namespace traits
+
+} // end namespace primer
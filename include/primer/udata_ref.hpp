@@ -0,0 +1,139 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Reference userdata, with an identity map.
+ *
+ * `primer::push_ref<T>(L, ptr)` pushes a userdata which refers to a `T` owned
+ * by C++ code. Pushing the same pointer again, from any callback, gives the
+ * same userdata for as long as it is alive, so that scripts can compare
+ * objects with `==` and use them as table keys, and the proxies don't pile up.
+ *
+ * The userdata are kept, for each `T`, in a table in the registry with weak
+ * values, keyed by the pointer as a light userdata. So an entry is forgotten
+ * when its userdata is collected, and the next push makes a new one.
+ *
+ * The userdata doesn't own the object. When C++ code destroys it, it should
+ * call `primer::invalidate_ref<T>(L, ptr)`, which empties the userdata, so
+ * that scripts which still hold it get an error instead of a dangling pointer,
+ * and forgets it. `primer::clear_refs<T>(L)` does that for all of them.
+ *
+ * The block of the userdata is a pointer to the object, so `test_udata<T>`,
+ * `read<T &>` and the methods of `T` accept it as a `T`, until it is emptied.
+ * Reference userdata can't be persisted.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/lua.hpp>
+#include <primer/push_singleton.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/udata_borrowed.hpp>
+#include <primer/userdata.hpp>
+
+namespace primer {
+
+//[ primer_udata_ref
+/// Push the userdata which refers to `*ptr`, making it if there is none, or
+/// nil if `ptr` is null
+template <typename T>
+void push_ref(lua_State * L, T * ptr);
+
+/// Empty the userdata which refers to `*ptr`, if there is one, and forget it
+template <typename T>
+void invalidate_ref(lua_State * L, T * ptr);
+
+/// Empty and forget all the userdata which refer to a `T`
+template <typename T>
+void clear_refs(lua_State * L);
+//]
+
+namespace detail {
+
+template <typename T>
+int
+udata_ref_gc(lua_State * L) noexcept {
+  *static_cast<T **>(lua_touserdata(L, 1)) = nullptr;
+  return 0;
+}
+
+template <typename T>
+void
+udata_ref_metatable(lua_State * L) {
+  push_udata_indirect_metatable<T>(L);
+  lua_pushcfunction(L, &udata_ref_gc<T>);
+  lua_setfield(L, -2, "__gc");
+}
+
+// The table of reference userdata of `T`, with weak values
+template <typename T>
+void
+udata_ref_memo(lua_State * L) {
+  lua_newtable(L);
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+}
+
+} // end namespace detail
+
+template <typename T>
+void
+push_ref(lua_State * L, T * ptr) {
+  static_assert(detail::is_userdata<T>::value, "not a userdata type");
+  if (!ptr) {
+    lua_pushnil(L);
+    return;
+  }
+  primer::push_singleton<&detail::udata_ref_memo<T>>(L);
+  if (lua_rawgetp(L, -1, ptr) != LUA_TUSERDATA) {
+    lua_pop(L, 1);
+    *static_cast<T **>(lua_newuserdata(L, sizeof(T *))) = ptr;
+    primer::push_singleton<&detail::udata_ref_metatable<T>>(L);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, -3, ptr);
+  }
+  lua_remove(L, -2);
+}
+
+template <typename T>
+void
+invalidate_ref(lua_State * L, T * ptr) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  if (!ptr) { return; }
+  primer::push_singleton<&detail::udata_ref_memo<T>>(L);
+  if (lua_rawgetp(L, -1, ptr) == LUA_TUSERDATA) {
+    *static_cast<T **>(lua_touserdata(L, -1)) = nullptr;
+    lua_pushnil(L);
+    lua_rawsetp(L, -3, ptr);
+  }
+  lua_pop(L, 2);
+}
+
+template <typename T>
+void
+clear_refs(lua_State * L) {
+  PRIMER_ASSERT_STACK_NEUTRAL(L);
+  primer::push_singleton<&detail::udata_ref_memo<T>>(L);
+  const int memo = lua_absindex(L, -1);
+  lua_pushnil(L);
+  while (lua_next(L, memo)) {
+    *static_cast<T **>(lua_touserdata(L, -1)) = nullptr;
+    // Clearing the field of the key being visited is allowed by lua_next
+    lua_pop(L, 1);
+    lua_pushvalue(L, -1);
+    lua_pushnil(L);
+    lua_rawset(L, memo);
+  }
+  lua_pop(L, 1);
+}
+
+} // end namespace primer
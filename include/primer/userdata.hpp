@@ -13,6 +13,8 @@ PRIMER_ASSERT_FILESCOPE;
 #include <primer/detail/nothrow_newable.hpp>
 #include <primer/detail/type_traits.hpp>
 #include <primer/lua.hpp>
+#include <primer/support/alloc_scope.hpp>
+#include <primer/support/udata_slab.hpp>
 #include <primer/support/userdata.hpp>
 
 #include <new>
@@ -34,9 +36,12 @@ test_udata(lua_State * L, int idx) {
 template <typename T, typename... Args>
 auto
 push_udata(lua_State * L, Args &&... args)
-  -> enable_if_t<detail::nothrow_newable<T, Args...>::value> {
+  -> enable_if_t<!detail::udata_in_slab<T>::value
+                 && detail::nothrow_newable<T, Args...>::value> {
   static_assert(detail::is_userdata<T>::value, "not a userdata type");
-  new (lua_newuserdata(L, sizeof(T))) T{std::forward<Args>(args)...};
+  PRIMER_ALLOC_SCOPE(nullptr, detail::udata_helper<T>::udata::name);
+  new (detail::newuserdata(L, sizeof(T), detail::udata_user_values<T>::value))
+    T{std::forward<Args>(args)...};
   detail::udata_helper<T>::set_metatable(L);
 }
 
@@ -44,9 +49,12 @@ push_udata(lua_State * L, Args &&... args)
 template <typename T, typename... Args>
 auto
 push_udata(lua_State * L, Args &&... args)
-  -> enable_if_t<!detail::nothrow_newable<T, Args...>::value> {
+  -> enable_if_t<!detail::udata_in_slab<T>::value
+                 && !detail::nothrow_newable<T, Args...>::value> {
   static_assert(detail::is_userdata<T>::value, "not a userdata type");
-  void * storage = lua_newuserdata(L, sizeof(T));
+  PRIMER_ALLOC_SCOPE(nullptr, detail::udata_helper<T>::udata::name);
+  void * storage =
+    detail::newuserdata(L, sizeof(T), detail::udata_user_values<T>::value);
 
   PRIMER_TRY {
     new (storage) T{std::forward<Args>(args)...};
@@ -58,6 +66,66 @@ push_udata(lua_State * L, Args &&... args)
   }
 }
 
+/// For slab userdata, the object goes in a slot of the slab, and the userdata
+/// points to it. The metatable is set first, so that the slot is given back
+/// even if a lua error happens after it is taken.
+template <typename T, typename... Args>
+auto
+push_udata(lua_State * L, Args &&... args)
+  -> enable_if_t<detail::udata_in_slab<T>::value> {
+  static_assert(detail::is_userdata<T>::value, "not a userdata type");
+  PRIMER_ALLOC_SCOPE(nullptr, detail::udata_helper<T>::udata::name);
+  detail::udata_slab<T> & slab = detail::udata_slab<T>::get(L);
+  T ** block = static_cast<T **>(
+    detail::newuserdata(L, sizeof(T *), detail::udata_user_values<T>::value));
+  *block = nullptr;
+  detail::udata_helper<T>::set_metatable(L);
+
+  void * storage = slab.allocate();
+  if (!storage) { luaL_error(L, "not enough memory"); }
+  PRIMER_TRY { *block = new (storage) T{std::forward<Args>(args)...}; }
+  PRIMER_CATCH(...) {
+    slab.deallocate(storage);
+    lua_pop(L, 1);
+    PRIMER_RETHROW;
+  }
+}
+
+namespace traits {
+
+/// A base for the push trait of a userdata type which is pushed by value:
+///
+///   template <> struct push<particle> : push_udata_helper<particle> {};
+///
+/// Then `primer::push(L, p)` makes a userdata holding a copy of `p`, and
+/// pushing a temporary, or a container of them, moves it in instead, so a
+/// move-only type can be pushed too.
+template <typename T>
+struct push_udata_helper {
+  static void to_stack(lua_State * L, const T & t) {
+    primer::push_udata<T>(L, t);
+  }
+  static void to_stack(lua_State * L, T && t) {
+    primer::push_udata<T>(L, std::move(t));
+  }
+  static constexpr int stack_space_needed{3};
+};
+
+} // end namespace traits
+
+//<-
+namespace detail {
+
+// Declared in <primer/support/udata_persist.hpp>
+template <typename T>
+void
+push_udata_value(lua_State * L, T & t) {
+  primer::push_udata<T>(L, std::move(t));
+}
+
+} // end namespace detail
+//->
+
 /// Easy access to udata::name
 template <typename T>
 const char *
@@ -53,7 +53,7 @@ struct userdata_dispatcher<T, R (T::*)(lua_State *, Args...), target_func> {
 
   static int adapted(lua_State * L) {
     using helper_t = adapt<R (*)(lua_State *, T &, Args...), dispatch_target>;
-    return helper_t::adapted(L);
+    return helper_t::adapted_by(L, &adapted);
   }
 };
 
@@ -73,7 +73,7 @@ struct userdata_dispatcher<T, R (T::*)(lua_State *, Args...) const,
   static int adapted(lua_State * L) {
     using helper_t =
       adapt<R (*)(lua_State *, const T &, Args...), dispatch_target>;
-    return helper_t::adapted(L);
+    return helper_t::adapted_by(L, &adapted);
   }
 };
 
@@ -0,0 +1,185 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A variadic<T> is the trailing arguments of a call, from some stack index to
+ * the top, each converted to `T` using `traits::read`.
+ *
+ * It is meant to be the last parameter of an adapted function, which then
+ * accepts any number of further arguments:
+ *
+ *   primer::result log(lua_State * L, std::string fmt,
+ *                      primer::variadic<primer::stringy> args);
+ *
+ * If an argument can't be read, the read fails, with an error naming the
+ * argument's position.
+ *
+ * Up to `N` values are held inline, without allocating, and more than that in
+ * a `std::vector`.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/read.hpp>
+#include <primer/traits/read_type_mask.hpp>
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+//[ primer_variadic
+template <typename T, std::size_t N = 8>
+class variadic {
+  using storage_t = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+  storage_t inline_[N ? N : 1];
+  std::vector<T> heap_;
+  std::size_t size_ = 0; // Of the inline values, if not on the heap
+  bool on_heap_ = false;
+
+  T * inline_data() noexcept { return reinterpret_cast<T *>(inline_); }
+  const T * inline_data() const noexcept {
+    return reinterpret_cast<const T *>(inline_);
+  }
+
+  void destroy_inline() noexcept {
+    for (std::size_t i = 0; i < size_; ++i) {
+      inline_data()[i].~T();
+    }
+    size_ = 0;
+  }
+
+  void move_from(variadic & o) {
+    if (o.on_heap_) {
+      heap_ = std::move(o.heap_);
+      on_heap_ = true;
+    } else {
+      for (std::size_t i = 0; i < o.size_; ++i) {
+        new (inline_data() + i) T(std::move(o.inline_data()[i]));
+        ++size_;
+      }
+    }
+  }
+
+  void clear() noexcept {
+    this->destroy_inline();
+    heap_.clear();
+    on_heap_ = false;
+  }
+
+public:
+  variadic() noexcept = default;
+
+  variadic(variadic && o) noexcept(std::is_nothrow_move_constructible<T>::value)
+    : variadic() {
+    this->move_from(o);
+  }
+
+  variadic & operator=(variadic && o) noexcept(
+    std::is_nothrow_move_constructible<T>::value) {
+    if (this != &o) {
+      this->clear();
+      this->move_from(o);
+    }
+    return *this;
+  }
+
+  variadic(const variadic &) = delete;
+  variadic & operator=(const variadic &) = delete;
+
+  ~variadic() noexcept { this->destroy_inline(); }
+
+  // Moves to the heap once the inline space is used up.
+  /*<< May throw `std::bad_alloc` >>*/
+  void push_back(T && t) {
+    if (!on_heap_ && size_ < N) {
+      new (inline_data() + size_) T(std::move(t));
+      ++size_;
+      return;
+    }
+    if (!on_heap_) {
+      std::vector<T> temp;
+      temp.reserve(2 * N + 1);
+      for (std::size_t i = 0; i < size_; ++i) {
+        temp.emplace_back(std::move(inline_data()[i]));
+      }
+      heap_ = std::move(temp);
+      this->destroy_inline();
+      on_heap_ = true;
+    }
+    heap_.emplace_back(std::move(t));
+  }
+
+  std::size_t size() const noexcept { return on_heap_ ? heap_.size() : size_; }
+  bool empty() const noexcept { return !this->size(); }
+  bool is_inline() const noexcept { return !on_heap_; }
+
+  T * data() noexcept { return on_heap_ ? heap_.data() : inline_data(); }
+  const T * data() const noexcept {
+    return on_heap_ ? heap_.data() : inline_data();
+  }
+
+  T & operator[](std::size_t i) noexcept { return this->data()[i]; }
+  const T & operator[](std::size_t i) const noexcept { return this->data()[i]; }
+
+  T * begin() noexcept { return this->data(); }
+  T * end() noexcept { return this->data() + this->size(); }
+  const T * begin() const noexcept { return this->data(); }
+  const T * end() const noexcept { return this->data() + this->size(); }
+};
+//]
+
+namespace detail {
+
+template <typename T>
+struct is_variadic : std::false_type {};
+
+template <typename T, std::size_t N>
+struct is_variadic<primer::variadic<T, N>> : std::true_type {};
+
+} // end namespace detail
+
+namespace traits {
+
+template <typename T, std::size_t N>
+struct read<primer::variadic<T, N>> {
+  static expected<variadic<T, N>> from_stack(lua_State * L, int idx) {
+    expected<variadic<T, N>> result{variadic<T, N>{}};
+    const int top = lua_gettop(L);
+    for (int i = lua_absindex(L, idx); i <= top; ++i) {
+      auto value = traits::read<T>::from_stack(L, i);
+      if (!value) {
+        result = std::move(value.err());
+        result.err().prepend_error_line("In argument #", i, ",");
+        break;
+      }
+      PRIMER_TRY_BAD_ALLOC { result->push_back(std::move(*value)); }
+      PRIMER_CATCH_BAD_ALLOC {
+        result = primer::error::bad_alloc();
+        break;
+      }
+    }
+    return result;
+  }
+  static constexpr int stack_space_needed{stack_space_for_read<T>()};
+};
+
+// Each of the arguments has the mask of `T`
+template <typename T, std::size_t N>
+struct read_type_mask<primer::variadic<T, N>> : read_type_mask<T> {};
+
+} // end namespace traits
+} // end namespace primer
@@ -0,0 +1,784 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_vector_math_overview
+/*`
+`primer::vec2`, `vec3`, `vec4` and `quat` are small vectors, and a quaternion,
+of `lua_Number`, which are pushed as userdata holding a copy, rather than as
+tables like `{x = 1, y = 2, z = 3}`. So a script which does vector math reads
+a component without hashing a key, and each intermediate result is one small
+userdata, with no hash part.
+
+In lua, they have the components `x`, `y`, `z` and `w`, which may be read and
+assigned, and these operators and methods:
+
+[table
+[[Operation] [Result]]
+[[`a + b`, `a - b`, `-a`] [Componentwise, of values of the same type.]]
+[[`a * k`, `k * a`, `a / k`] [Each component multiplied or divided by the
+  number `k`.]]
+[[`a * b`, `a / b`] [For vectors, componentwise. For quaternions, `q * r`
+  is their product, and `q * v`, with `v` a `vec3`, is `v` rotated by `q`.]]
+[[`a == b`] [Whether the components are equal.]]
+[[`a:dot(b)`, `a:length()`, `a:length_squared()`] [Numbers.]]
+[[`a:normalize()`] [`a` divided by its length, or `a` if its length is zero.]]
+[[`a:lerp(b, t)`] [`a + (b - a) * t`.]]
+[[`a:mad(b, k)`] [`a + b * k`, in one step, with `k` a number or a value of
+  the same type.]]
+[[`a:unpack()`] [The components.]]
+[[`a:cross(b)`] [For `vec3`, the cross product.]]
+[[`q:conjugate()`, `q:rotate(v)`] [For `quat`.]]
+]
+
+A quaternion which rotates is a unit quaternion, with the real part `w`. The
+API feature `primer::api::vector_math`, in `<primer/api/vector_math.hpp>`,
+gives scripts the constructors, and `transform`, which rotates and
+translates many points of a typed array in one call.
+
+The same operations are available in C++, as operators and free functions.
+
+`traits::read` of these types takes the userdata, or a table with the fields
+named as the components, or a sequence of numbers. A C++ math type, e.g. of
+a geometry library, is pushed and read as one of these types when
+`traits::math_adapter` is specialized for it:
+
+``
+  namespace primer { namespace traits {
+  template <>
+  struct math_adapter<glm::dvec3> {
+    using type = primer::vec3;
+    static primer::vec3 to_primer(const glm::dvec3 & v) {
+      return {v.x, v.y, v.z};
+    }
+    static glm::dvec3 from_primer(const primer::vec3 & v) {
+      return {v.x, v.y, v.z};
+    }
+  };
+  }}
+``
+
+The userdata have `auto_persist`, so they are persisted by copying their
+bytes, see `<primer/support/udata_persist.hpp>`.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/detail/span.hpp>
+#include <primer/detail/type_traits.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/lua.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/diagnostics.hpp>
+#include <primer/traits/push.hpp>
+#include <primer/traits/read.hpp>
+#include <primer/traits/read_type_mask.hpp>
+#include <primer/traits/userdata.hpp>
+#include <primer/userdata.hpp>
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+namespace primer {
+
+//[ primer_vector_math
+struct vec2 {
+  lua_Number x;
+  lua_Number y;
+};
+
+struct vec3 {
+  lua_Number x;
+  lua_Number y;
+  lua_Number z;
+};
+
+struct vec4 {
+  lua_Number x;
+  lua_Number y;
+  lua_Number z;
+  lua_Number w;
+};
+
+// The real part is `w`
+struct quat {
+  lua_Number x;
+  lua_Number y;
+  lua_Number z;
+  lua_Number w;
+};
+//]
+
+namespace detail {
+
+// The number of components, or zero if `V` is not one of the types above
+template <typename V>
+struct vector_size : std::integral_constant<int, 0> {};
+
+template <>
+struct vector_size<vec2> : std::integral_constant<int, 2> {};
+template <>
+struct vector_size<vec3> : std::integral_constant<int, 3> {};
+template <>
+struct vector_size<vec4> : std::integral_constant<int, 4> {};
+template <>
+struct vector_size<quat> : std::integral_constant<int, 4> {};
+
+// The components are laid out as an array
+template <typename V>
+lua_Number *
+vector_data(V & v) noexcept {
+  PRIMER_STATIC_ASSERT(sizeof(V) == vector_size<V>::value * sizeof(lua_Number),
+                       "vector components must be contiguous");
+  return &v.x;
+}
+
+template <typename V>
+const lua_Number *
+vector_data(const V & v) noexcept {
+  return &v.x;
+}
+
+// The name of the constructor, and of the type in messages
+inline const char * vector_type_name(const vec2 *) { return "vec2"; }
+inline const char * vector_type_name(const vec3 *) { return "vec3"; }
+inline const char * vector_type_name(const vec4 *) { return "vec4"; }
+inline const char * vector_type_name(const quat *) { return "quat"; }
+
+template <typename V>
+using enable_if_vector_t = enable_if_t<vector_size<V>::value != 0, V>;
+
+// Componentwise products are for vectors, not quaternions
+template <typename V>
+using enable_if_plain_vector_t =
+  enable_if_t<vector_size<V>::value != 0 && !std::is_same<V, quat>::value, V>;
+
+} // end namespace detail
+
+//
+// Arithmetic
+//
+
+template <typename V>
+detail::enable_if_vector_t<V>
+operator+(const V & a, const V & b) noexcept {
+  V r;
+  for (int i = 0; i < detail::vector_size<V>::value; ++i) {
+    detail::vector_data(r)[i] =
+      detail::vector_data(a)[i] + detail::vector_data(b)[i];
+  }
+  return r;
+}
+
+template <typename V>
+detail::enable_if_vector_t<V>
+operator-(const V & a, const V & b) noexcept {
+  V r;
+  for (int i = 0; i < detail::vector_size<V>::value; ++i) {
+    detail::vector_data(r)[i] =
+      detail::vector_data(a)[i] - detail::vector_data(b)[i];
+  }
+  return r;
+}
+
+template <typename V>
+detail::enable_if_vector_t<V>
+operator-(const V & a) noexcept {
+  V r;
+  for (int i = 0; i < detail::vector_size<V>::value; ++i) {
+    detail::vector_data(r)[i] = -detail::vector_data(a)[i];
+  }
+  return r;
+}
+
+template <typename V>
+detail::enable_if_vector_t<V>
+operator*(const V & a, lua_Number k) noexcept {
+  V r;
+  for (int i = 0; i < detail::vector_size<V>::value; ++i) {
+    detail::vector_data(r)[i] = detail::vector_data(a)[i] * k;
+  }
+  return r;
+}
+
+template <typename V>
+detail::enable_if_vector_t<V>
+operator*(lua_Number k, const V & a) noexcept {
+  return a * k;
+}
+
+template <typename V>
+detail::enable_if_vector_t<V>
+operator/(const V & a, lua_Number k) noexcept {
+  V r;
+  for (int i = 0; i < detail::vector_size<V>::value; ++i) {
+    detail::vector_data(r)[i] = detail::vector_data(a)[i] / k;
+  }
+  return r;
+}
+
+template <typename V>
+detail::enable_if_plain_vector_t<V>
+operator*(const V & a, const V & b) noexcept {
+  V r;
+  for (int i = 0; i < detail::vector_size<V>::value; ++i) {
+    detail::vector_data(r)[i] =
+      detail::vector_data(a)[i] * detail::vector_data(b)[i];
+  }
+  return r;
+}
+
+template <typename V>
+detail::enable_if_plain_vector_t<V>
+operator/(const V & a, const V & b) noexcept {
+  V r;
+  for (int i = 0; i < detail::vector_size<V>::value; ++i) {
+    detail::vector_data(r)[i] =
+      detail::vector_data(a)[i] / detail::vector_data(b)[i];
+  }
+  return r;
+}
+
+template <typename V>
+enable_if_t<detail::vector_size<V>::value != 0, bool>
+operator==(const V & a, const V & b) noexcept {
+  for (int i = 0; i < detail::vector_size<V>::value; ++i) {
+    if (!(detail::vector_data(a)[i] == detail::vector_data(b)[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename V>
+enable_if_t<detail::vector_size<V>::value != 0, bool>
+operator!=(const V & a, const V & b) noexcept {
+  return !(a == b);
+}
+
+template <typename V>
+enable_if_t<detail::vector_size<V>::value != 0, lua_Number>
+dot(const V & a, const V & b) noexcept {
+  lua_Number r = 0;
+  for (int i = 0; i < detail::vector_size<V>::value; ++i) {
+    r += detail::vector_data(a)[i] * detail::vector_data(b)[i];
+  }
+  return r;
+}
+
+template <typename V>
+enable_if_t<detail::vector_size<V>::value != 0, lua_Number>
+length_squared(const V & a) noexcept {
+  return primer::dot(a, a);
+}
+
+template <typename V>
+enable_if_t<detail::vector_size<V>::value != 0, lua_Number>
+length(const V & a) noexcept {
+  return std::sqrt(primer::length_squared(a));
+}
+
+// A vector of length zero is returned as it is
+template <typename V>
+detail::enable_if_vector_t<V>
+normalize(const V & a) noexcept {
+  const lua_Number n = primer::length(a);
+  return n > 0 ? a / n : a;
+}
+
+template <typename V>
+detail::enable_if_vector_t<V>
+lerp(const V & a, const V & b, lua_Number t) noexcept {
+  V r;
+  for (int i = 0; i < detail::vector_size<V>::value; ++i) {
+    const lua_Number x = detail::vector_data(a)[i];
+    detail::vector_data(r)[i] = x + (detail::vector_data(b)[i] - x) * t;
+  }
+  return r;
+}
+
+// a + b * k
+template <typename V>
+detail::enable_if_vector_t<V>
+mad(const V & a, const V & b, lua_Number k) noexcept {
+  V r;
+  for (int i = 0; i < detail::vector_size<V>::value; ++i) {
+    detail::vector_data(r)[i] =
+      detail::vector_data(a)[i] + detail::vector_data(b)[i] * k;
+  }
+  return r;
+}
+
+// a + b * c, componentwise
+template <typename V>
+detail::enable_if_vector_t<V>
+mad(const V & a, const V & b, const V & c) noexcept {
+  V r;
+  for (int i = 0; i < detail::vector_size<V>::value; ++i) {
+    detail::vector_data(r)[i] = detail::vector_data(a)[i]
+                                + detail::vector_data(b)[i]
+                                    * detail::vector_data(c)[i];
+  }
+  return r;
+}
+
+inline vec3
+cross(const vec3 & a, const vec3 & b) noexcept {
+  return vec3{a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z,
+              a.x * b.y - a.y * b.x};
+}
+
+inline quat
+operator*(const quat & a, const quat & b) noexcept {
+  return quat{a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+              a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+              a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w,
+              a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z};
+}
+
+inline quat
+conjugate(const quat & q) noexcept {
+  return quat{-q.x, -q.y, -q.z, q.w};
+}
+
+// Rotates `v` by the unit quaternion `q`
+inline vec3
+rotate(const quat & q, const vec3 & v) noexcept {
+  const vec3 u{q.x, q.y, q.z};
+  const vec3 t = primer::cross(u, v) * 2;
+  return v + t * q.w + primer::cross(u, t);
+}
+
+inline vec3
+operator*(const quat & q, const vec3 & v) noexcept {
+  return primer::rotate(q, v);
+}
+
+// The rotation by `angle` radians around `axis`
+inline quat
+quat_from_axis_angle(const vec3 & axis, lua_Number angle) noexcept {
+  const vec3 n = primer::normalize(axis) * std::sin(angle / 2);
+  return quat{n.x, n.y, n.z, std::cos(angle / 2)};
+}
+
+// Rotates each of the `n` points at `xyz`, stored as consecutive x, y, z,
+// by `q`, and then adds `offset`. The rotation is made a matrix once, so each
+// point costs nine multiplications, in a loop which the compiler can
+// vectorize.
+inline void
+transform_points(const quat & q, const vec3 & offset, lua_Number * xyz,
+                 std::size_t n) noexcept {
+  const lua_Number xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+  const lua_Number xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+  const lua_Number wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+  const lua_Number m[9] = {
+    1 - 2 * (yy + zz), 2 * (xy - wz),     2 * (xz + wy),
+    2 * (xy + wz),     1 - 2 * (xx + zz), 2 * (yz - wx),
+    2 * (xz - wy),     2 * (yz + wx),     1 - 2 * (xx + yy)};
+
+  for (std::size_t i = 0; i < n; ++i) {
+    lua_Number * p = xyz + 3 * i;
+    const lua_Number x = p[0], y = p[1], z = p[2];
+    p[0] = m[0] * x + m[1] * y + m[2] * z + offset.x;
+    p[1] = m[3] * x + m[4] * y + m[5] * z + offset.y;
+    p[2] = m[6] * x + m[7] * y + m[8] * z + offset.z;
+  }
+}
+
+//
+// Lua bindings
+//
+
+namespace detail {
+
+template <typename V>
+struct vector_lua;
+
+// Methods which only some of the types have
+template <typename V>
+struct vector_extra_methods {
+  static span<const luaL_Reg> list() { return {}; }
+};
+
+template <>
+struct vector_extra_methods<vec3> {
+  static int cross(lua_State * L);
+
+  static span<const luaL_Reg> list() {
+    static const luaL_Reg result[] = {{"cross", &cross}};
+    return result;
+  }
+};
+
+template <>
+struct vector_extra_methods<quat> {
+  static int conjugate(lua_State * L);
+  static int rotate(lua_State * L);
+
+  static span<const luaL_Reg> list() {
+    static const luaL_Reg result[] = {{"conjugate", &conjugate},
+                                      {"rotate", &rotate}};
+    return result;
+  }
+};
+
+template <typename V>
+struct vector_lua {
+  static constexpr int size = vector_size<V>::value;
+
+  static V & check(lua_State * L, int idx) {
+    V * v = primer::test_udata<V>(L, idx);
+    if (!v) {
+      luaL_error(L, "Expected userdata '%s', found %s",
+                 primer::traits::userdata<V>::name, luaL_typename(L, idx));
+    }
+    return *v;
+  }
+
+  static int push(lua_State * L, const V & v) {
+    primer::push_udata<V>(L, v);
+    return 1;
+  }
+
+  // The position of the component named by the key at 2, or -1
+  static int component(lua_State * L) {
+    std::size_t len = 0;
+    const char * k = lua_type(L, 2) == LUA_TSTRING ? lua_tolstring(L, 2, &len)
+                                                   : nullptr;
+    if (!k || len != 1) { return -1; }
+    const int i = k[0] == 'w' ? 3 : k[0] - 'x';
+    return i >= 0 && i < size ? i : -1;
+  }
+
+  static lua_CFunction find_method(const char * k) {
+    for (const luaL_Reg & r : methods()) {
+      if (!std::strcmp(r.name, k)) { return r.func; }
+    }
+    for (const luaL_Reg & r : vector_extra_methods<V>::list()) {
+      if (!std::strcmp(r.name, k)) { return r.func; }
+    }
+    return nullptr;
+  }
+
+  static int index(lua_State * L) {
+    const V & v = check(L, 1);
+    const int i = component(L);
+    if (i >= 0) {
+      lua_pushnumber(L, vector_data(v)[i]);
+      return 1;
+    }
+    if (lua_type(L, 2) == LUA_TSTRING) {
+      if (lua_CFunction f = find_method(lua_tostring(L, 2))) {
+        lua_pushcfunction(L, f);
+        return 1;
+      }
+    }
+    lua_pushnil(L);
+    return 1;
+  }
+
+  static int newindex(lua_State * L) {
+    V & v = check(L, 1);
+    const int i = component(L);
+    if (i < 0) {
+      return luaL_error(L, "'%s' has no component %s",
+                        primer::traits::userdata<V>::name,
+                        luaL_tolstring(L, 2, nullptr));
+    }
+    vector_data(v)[i] = luaL_checknumber(L, 3);
+    return 0;
+  }
+
+  static int add(lua_State * L) { return push(L, check(L, 1) + check(L, 2)); }
+  static int sub(lua_State * L) { return push(L, check(L, 1) - check(L, 2)); }
+  static int unm(lua_State * L) { return push(L, -check(L, 1)); }
+
+  static int mul(lua_State * L) {
+    if (lua_type(L, 1) == LUA_TNUMBER) {
+      return push(L, lua_tonumber(L, 1) * check(L, 2));
+    }
+    const V & a = check(L, 1);
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+      return push(L, a * lua_tonumber(L, 2));
+    }
+    return mul_value(L, a);
+  }
+
+  // Vectors multiply componentwise
+  static int mul_value(lua_State * L, const vec2 & a) {
+    return push(L, a * check(L, 2));
+  }
+  static int mul_value(lua_State * L, const vec3 & a) {
+    return push(L, a * check(L, 2));
+  }
+  static int mul_value(lua_State * L, const vec4 & a) {
+    return push(L, a * check(L, 2));
+  }
+
+  // A quaternion multiplies another, or rotates a `vec3`
+  static int mul_value(lua_State * L, const quat & q) {
+    if (const vec3 * v = primer::test_udata<vec3>(L, 2)) {
+      return vector_lua<vec3>::push(L, primer::rotate(q, *v));
+    }
+    return push(L, q * check(L, 2));
+  }
+
+  static int div(lua_State * L) {
+    const V & a = check(L, 1);
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+      return push(L, a / lua_tonumber(L, 2));
+    }
+    return div_value(L, a);
+  }
+
+  template <typename U>
+  static int div_value(lua_State * L, const U & a) {
+    return push(L, a / check(L, 2));
+  }
+
+  static int div_value(lua_State * L, const quat &) {
+    return luaL_error(L, "A quaternion can only be divided by a number");
+  }
+
+  static int eq(lua_State * L) {
+    const V * a = primer::test_udata<V>(L, 1);
+    const V * b = primer::test_udata<V>(L, 2);
+    lua_pushboolean(L, a && b && *a == *b);
+    return 1;
+  }
+
+  // e.g. "vec3(1, 2, 3)"
+  static int tostring(lua_State * L) {
+    const V & v = check(L, 1);
+    luaL_checkstack(L, 2 * size + 1, nullptr);
+    lua_pushstring(L, vector_type_name(static_cast<V *>(nullptr)));
+    lua_pushliteral(L, "(");
+    lua_concat(L, 2);
+    for (int i = 0; i < size; ++i) {
+      lua_pushnumber(L, vector_data(v)[i]);
+      lua_pushstring(L, i + 1 < size ? ", " : ")");
+    }
+    lua_concat(L, 2 * size + 1);
+    return 1;
+  }
+
+  //
+  // Methods
+  //
+
+  static int dot(lua_State * L) {
+    lua_pushnumber(L, primer::dot(check(L, 1), check(L, 2)));
+    return 1;
+  }
+
+  static int length(lua_State * L) {
+    lua_pushnumber(L, primer::length(check(L, 1)));
+    return 1;
+  }
+
+  static int length_squared(lua_State * L) {
+    lua_pushnumber(L, primer::length_squared(check(L, 1)));
+    return 1;
+  }
+
+  static int normalize(lua_State * L) {
+    return push(L, primer::normalize(check(L, 1)));
+  }
+
+  static int lerp(lua_State * L) {
+    return push(L, primer::lerp(check(L, 1), check(L, 2),
+                                luaL_checknumber(L, 3)));
+  }
+
+  static int mad(lua_State * L) {
+    const V & a = check(L, 1);
+    const V & b = check(L, 2);
+    if (lua_type(L, 3) == LUA_TNUMBER) {
+      return push(L, primer::mad(a, b, lua_tonumber(L, 3)));
+    }
+    return push(L, primer::mad(a, b, check(L, 3)));
+  }
+
+  static int unpack(lua_State * L) {
+    const V & v = check(L, 1);
+    luaL_checkstack(L, size, nullptr);
+    for (int i = 0; i < size; ++i) {
+      lua_pushnumber(L, vector_data(v)[i]);
+    }
+    return size;
+  }
+
+  static span<const luaL_Reg> methods() {
+    static const luaL_Reg list[] = {
+      {"dot", &dot},
+      {"length", &length},
+      {"length_squared", &length_squared},
+      {"normalize", &normalize},
+      {"lerp", &lerp},
+      {"mad", &mad},
+      {"unpack", &unpack},
+    };
+    return list;
+  }
+
+  static span<const luaL_Reg> metamethods() {
+    static const luaL_Reg list[] = {
+      {"__index", &index}, {"__newindex", &newindex}, {"__add", &add},
+      {"__sub", &sub},     {"__mul", &mul},           {"__div", &div},
+      {"__unm", &unm},     {"__eq", &eq},             {"__tostring", &tostring},
+    };
+    return list;
+  }
+
+  static void metatable(lua_State * L) {
+    PRIMER_ASSERT_TABLE(L);
+    for (const luaL_Reg & r : metamethods()) {
+      lua_pushcfunction(L, r.func);
+      lua_setfield(L, -2, r.name);
+    }
+    lua_pushstring(L, primer::traits::userdata<V>::name);
+    lua_setfield(L, -2, "__metatable");
+  }
+};
+
+inline int
+vector_extra_methods<vec3>::cross(lua_State * L) {
+  using lua_t = vector_lua<vec3>;
+  return lua_t::push(L, primer::cross(lua_t::check(L, 1), lua_t::check(L, 2)));
+}
+
+inline int
+vector_extra_methods<quat>::conjugate(lua_State * L) {
+  using lua_t = vector_lua<quat>;
+  return lua_t::push(L, primer::conjugate(lua_t::check(L, 1)));
+}
+
+inline int
+vector_extra_methods<quat>::rotate(lua_State * L) {
+  return vector_lua<vec3>::push(
+    L, primer::rotate(vector_lua<quat>::check(L, 1),
+                      vector_lua<vec3>::check(L, 2)));
+}
+
+// Reads a value of `V` from the userdata, or from a table with fields named
+// as the components, or a sequence of numbers
+template <typename V>
+expected<V> read_vector(lua_State * L, int idx) {
+  if (const V * v = primer::test_udata<V>(L, idx)) { return *v; }
+  if (!lua_istable(L, idx)) {
+    return primer::error{"Expected a ",
+                         vector_type_name(static_cast<V *>(nullptr)),
+                         " or a table, found ",
+                         primer::describe_lua_value(L, idx)};
+  }
+
+  constexpr const char * names[] = {"x", "y", "z", "w"};
+  idx = lua_absindex(L, idx);
+  const bool by_name = lua_getfield(L, idx, "x") != LUA_TNIL;
+  lua_pop(L, 1);
+
+  V result;
+  for (int i = 0; i < vector_size<V>::value; ++i) {
+    if (by_name) {
+      lua_getfield(L, idx, names[i]);
+    } else {
+      lua_rawgeti(L, idx, i + 1);
+    }
+    int isnum = 0;
+    vector_data(result)[i] = lua_tonumberx(L, -1, &isnum);
+    if (traits::strict_number_reads && lua_type(L, -1) != LUA_TNUMBER) {
+      isnum = 0;
+    }
+    if (!isnum) {
+      primer::error e{"Expected a number for ", names[i], ", found ",
+                      primer::describe_lua_value(L, -1)};
+      lua_pop(L, 1);
+      return e;
+    }
+    lua_pop(L, 1);
+  }
+  return result;
+}
+
+} // end namespace detail
+
+namespace traits {
+
+#define PRIMER_VECTOR_MATH_TRAITS(TYPE)                                        \
+  template <>                                                                  \
+  struct userdata<primer::TYPE> {                                              \
+    static constexpr const char * name = "primer_" #TYPE;                      \
+    static void metatable(lua_State * L) {                                     \
+      primer::detail::vector_lua<primer::TYPE>::metatable(L);                  \
+    }                                                                          \
+    static constexpr bool auto_persist = true;                                 \
+  };                                                                           \
+                                                                               \
+  template <>                                                                  \
+  struct push<primer::TYPE> : push_udata_helper<primer::TYPE> {};              \
+                                                                               \
+  template <>                                                                  \
+  struct read<primer::TYPE> {                                                  \
+    static expected<primer::TYPE> from_stack(lua_State * L, int idx) {         \
+      return primer::detail::read_vector<primer::TYPE>(L, idx);                \
+    }                                                                          \
+    static constexpr int stack_space_needed{2};                                \
+  };                                                                           \
+                                                                               \
+  template <>                                                                  \
+  struct read_type_mask<primer::TYPE>                                          \
+    : type_mask_constant<lua_type_bit(LUA_TUSERDATA)                           \
+                         | lua_type_bit(LUA_TTABLE)> {}
+
+PRIMER_VECTOR_MATH_TRAITS(vec2);
+PRIMER_VECTOR_MATH_TRAITS(vec3);
+PRIMER_VECTOR_MATH_TRAITS(vec4);
+PRIMER_VECTOR_MATH_TRAITS(quat);
+
+#undef PRIMER_VECTOR_MATH_TRAITS
+
+// Specialize with `type`, one of the types above, and `to_primer` and
+// `from_primer`, to push and read `T` as that type
+template <typename T>
+struct math_adapter;
+
+template <typename T>
+struct push<T, enable_if_t<detail::vector_size<
+                 typename math_adapter<T>::type>::value != 0>> {
+  static void to_stack(lua_State * L, const T & t) {
+    primer::push_udata<typename math_adapter<T>::type>(
+      L, math_adapter<T>::to_primer(t));
+  }
+  static constexpr int stack_space_needed{3};
+};
+
+template <typename T>
+struct read<T, enable_if_t<detail::vector_size<
+                 typename math_adapter<T>::type>::value != 0>> {
+  static expected<T> from_stack(lua_State * L, int idx) {
+    auto v = primer::detail::read_vector<typename math_adapter<T>::type>(L, idx);
+    if (!v) { return std::move(v.err()); }
+    return math_adapter<T>::from_primer(*v);
+  }
+  static constexpr int stack_space_needed{2};
+};
+
+template <typename T>
+struct read_type_mask<T, enable_if_t<detail::vector_size<
+                           typename math_adapter<T>::type>::value != 0>>
+  : type_mask_constant<lua_type_bit(LUA_TUSERDATA) | lua_type_bit(LUA_TTABLE)> {
+};
+
+} // end namespace traits
+
+} // end namespace primer
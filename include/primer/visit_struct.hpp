@@ -17,3 +17,4 @@ PRIMER_ASSERT_FILESCOPE;
 #include <visit_struct/visit_struct_intrusive.hpp>
 
 #include <primer/container/visit_struct.hpp>
+#include <primer/visitable_userdata.hpp>
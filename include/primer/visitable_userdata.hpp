@@ -0,0 +1,236 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * Field access metamethods for userdata types which are also visitable
+ * structures.
+ *
+ * `visitable_fields<T>::index` and `visitable_fields<T>::newindex` are
+ * `lua_CFunction`s which map the field names of `T` directly onto reads and
+ * writes of the members of the C++ object, so that a script can say `obj.hp`
+ * or `obj.hp = 10` without a hand-written getter or setter, and without
+ * copying the whole structure into a table.
+ *
+ * The field name is mapped to its position in the visitation order by a
+ * single raw lookup in a table cached in the registry. Since lua strings are
+ * interned, this doesn't hash the name again. The position is then dispatched
+ * to the member at compile-time.
+ *
+ * If the key is not a field name, `index` falls back to looking it up in the
+ * metatable, so methods registered there still work. Assigning to a key which
+ * is not a field name is an error, as is assigning a value which can't be read
+ * as the field type.
+ *
+ * This is opt-in. Register the metamethods in the userdata metatable:
+ *
+ *   static constexpr std::array<luaL_Reg, 3> metatable{{
+ *     {"__index", &primer::visitable_fields<my_type>::index},
+ *     {"__newindex", &primer::visitable_fields<my_type>::newindex},
+ *     {"dump", PRIMER_ADAPT_USERDATA(my_type, &my_type::dump)},
+ *   }};
+ *
+ * `visitable_fields<T, U>` is the same for a userdata type `U` which holds a
+ * `T`. This is used for `visitable_value<T>`, the userdata which a visitable
+ * structure is pushed as when its `traits::visitable_layout` is
+ * `value_userdata`. Its userdata trait is defined here, with these
+ * metamethods, and a `__persist` which saves a copy of the structure: the
+ * bytes, if it is trivially copyable, and else a table keyed by field name.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/adapt.hpp>
+#include <primer/container/visit_struct.hpp>
+#include <primer/error.hpp>
+#include <primer/lua.hpp>
+#include <primer/result.hpp>
+#include <primer/support/asserts.hpp>
+#include <primer/support/diagnostics.hpp>
+#include <primer/userdata.hpp>
+
+#include <visit_struct/visit_struct.hpp>
+
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+namespace detail {
+
+// The structure held by a userdata
+template <typename T>
+T &
+visitable_object(T & t) noexcept {
+  return t;
+}
+
+template <typename T>
+T &
+visitable_object(visitable_value<T> & v) noexcept {
+  return v.value;
+}
+
+template <typename T>
+const T &
+visitable_object(const visitable_value<T> & v) noexcept {
+  return v.value;
+}
+
+} // end namespace detail
+
+template <typename T, typename U = T>
+struct visitable_fields {
+  PRIMER_STATIC_ASSERT(visit_struct::traits::is_visitable<T>::value,
+                       "visitable_fields requires a visitable structure");
+
+private:
+  using dispatch_t = detail::visitable_field_dispatch_t<T>;
+
+  static int field_position(lua_State * L) {
+    return detail::visitable_field_position<T>(L, 2);
+  }
+
+  static constexpr int position_stack_space =
+    detail::visitable_field_position_stack_space;
+  static constexpr int push_stack_space = detail::max_int(
+    position_stack_space, detail::visitable_stack_space_t<T>::push());
+  static constexpr int read_stack_space = detail::max_int(
+    position_stack_space, 1 + detail::visitable_stack_space_t<T>::read());
+
+  static primer::result newindex_impl(lua_State * L, U & u) {
+    T & t = detail::visitable_object(u);
+    const int which = field_position(L);
+    if (!which) {
+      return primer::error{"Unexpected key ", describe_lua_value(L, 2)};
+    }
+
+    lua_pushvalue(L, 3);
+    expected<void> ok;
+    dispatch_t::read(L, which, t, ok);
+    lua_pop(L, 1);
+
+    if (!ok) { return std::move(ok.err()); }
+    return 0;
+  }
+
+public:
+  static int index(lua_State * L) {
+    luaL_checkstack(L, push_stack_space, "not enough stack space");
+    if (const U * u = primer::test_udata<U>(L, 1)) {
+      if (const int which = field_position(L)) {
+        dispatch_t::push(L, which, detail::visitable_object(*u));
+        return 1;
+      }
+    }
+
+    // Fallback to the method table
+    if (!lua_getmetatable(L, 1)) { return 0; }
+    lua_pushvalue(L, 2);
+    lua_rawget(L, -2);
+    return 1;
+  }
+
+  static int newindex(lua_State * L) {
+    luaL_checkstack(L, read_stack_space, "not enough stack space");
+    using helper_t = adapt<primer::result (*)(lua_State *, U &),
+                           &visitable_fields::newindex_impl>;
+    return helper_t::adapted(L);
+  }
+};
+
+namespace detail {
+
+// `__persist` of a `visitable_value<T>`, which returns a closure to rebuild it
+template <typename T, typename ENABLE = void>
+struct visitable_value_persist {
+  static int persist(lua_State * L) {
+    luaL_checkstack(L, 1 + traits::push<T>::stack_space_needed,
+                    "not enough stack space");
+    const auto * u = primer::test_udata<visitable_value<T>>(L, 1);
+    if (!u) { return 0; }
+    detail::push_visitable_named(L, u->value, nullptr);
+    lua_pushcclosure(L, &visitable_value_persist::reconstruct, 1);
+    return 1;
+  }
+
+  static int reconstruct(lua_State * L) {
+    luaL_checkstack(L, traits::read<T>::stack_space_needed + 4,
+                    "not enough stack space");
+    {
+      auto t = primer::read<T>(L, lua_upvalueindex(1));
+      if (t) {
+        primer::push_udata<visitable_value<T>>(L, std::move(*t));
+        return 1;
+      }
+      lua_pushstring(L, t.err().c_str());
+    }
+    return lua_error(L);
+  }
+};
+
+template <typename T>
+struct visitable_value_persist<
+  T, enable_if_t<std::is_trivially_copyable<T>::value>> {
+  static int persist(lua_State * L) {
+    const auto * u = primer::test_udata<visitable_value<T>>(L, 1);
+    if (!u) { return 0; }
+    lua_pushlstring(L, reinterpret_cast<const char *>(&u->value), sizeof(T));
+    lua_pushcclosure(L, &visitable_value_persist::reconstruct, 1);
+    return 1;
+  }
+
+  static int reconstruct(lua_State * L) {
+    std::size_t len = 0;
+    const char * bytes = lua_tolstring(L, lua_upvalueindex(1), &len);
+    if (!bytes || len != sizeof(T)) {
+      lua_pushliteral(L, "visitable_value: persisted data has the wrong size");
+      return lua_error(L);
+    }
+    T t;
+    std::memcpy(&t, bytes, sizeof(T));
+    primer::push_udata<visitable_value<T>>(L, t);
+    return 1;
+  }
+};
+
+} // end namespace detail
+
+namespace traits {
+
+template <typename T>
+struct userdata<primer::visitable_value<T>> {
+  static constexpr const char * name = visit_struct::get_name<T>();
+
+  static const std::vector<luaL_Reg> & metatable() {
+    using fields_t = primer::visitable_fields<T, primer::visitable_value<T>>;
+    static const std::vector<luaL_Reg> metatable_array{
+      {"__index", &fields_t::index},
+      {"__newindex", &fields_t::newindex},
+      {"__persist", &detail::visitable_value_persist<T>::persist}};
+    return metatable_array;
+  }
+
+  static const std::vector<luaL_Reg> & permanents() {
+    static const std::string key =
+      std::string{"primer_visitable_value<"} + name + ">";
+    static const std::vector<luaL_Reg> permanents_array{
+      {key.c_str(), &detail::visitable_value_persist<T>::reconstruct}};
+    return permanents_array;
+  }
+};
+
+template <typename T>
+constexpr const char * userdata<primer::visitable_value<T>>::name;
+
+} // end namespace traits
+
+} // end namespace primer
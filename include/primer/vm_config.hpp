@@ -0,0 +1,214 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+//[ primer_vm_config_overview
+/*`
+`primer::new_state` makes a lua state as `luaL_newstate` does, but tuned by a
+`primer::vm_config` before anything else runs on it:
+
+* `alloc` and `alloc_ud` are the allocator, e.g. `&pool_allocator::alloc`. By
+  default, the state is made by `luaL_newstate`.
+* `generational` selects the generational collector. It exists only in lua 5.4,
+  and is ignored otherwise.
+* `gc_pause` and `gc_step_multiplier` are set with `lua_gc`, unless they are
+  `0`, which keeps lua's defaults.
+* `stack_reserve` is passed to `lua_checkstack`, so that the stack of the main
+  thread is grown once, rather than step by step.
+* `registry_refs`, `registry_fields`, `globals` and `loaded` are the sizes of
+  the registry (its array part, which holds the references made by `luaL_ref`,
+  and its other fields), of the globals table, and of the `_LOADED` table of
+  modules. These tables are made at those sizes, so filling them while the api
+  is initialized and modules are loaded doesn't rehash them again and again.
+
+The sizes are best taken from a state which has been warmed up, i.e. one which
+has initialized its api and loaded what it usually loads. `primer::vm_profile`
+records them, and `vm_config::reserve_for` copies them into a config, which
+can then make any number of states.
+
+``
+  primer::vm_config config;
+  config.alloc = &primer::pool_allocator::alloc;
+  config.alloc_ud = &pool;
+  config.stack_reserve = 256;
+  {
+    lua_State * warm = primer::new_state(config);
+    my_api api{warm};
+    config.reserve_for(primer::vm_profile::record(warm));
+    lua_close(warm);
+  }
+  ...
+  lua_State * L = primer::new_state(config);
+``
+
+`new_state` returns `nullptr` if the state can't be made, or runs out of memory
+while it is set up.
+
+Lua gives no way to size its table of interned strings, which it grows and
+shrinks itself as strings are made and collected, so that is not part of the
+config. The registry keeps its sizes until lua next rehashes it, which it does
+only when it has no free slots.
+*/
+//]
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/cpp_pcall.hpp>
+#include <primer/lua.hpp>
+
+#include <cstddef>
+
+namespace primer {
+
+struct vm_profile {
+  int registry_refs = 0;
+  int registry_fields = 0;
+  int globals = 0;
+  int loaded = 0;
+  std::size_t memory = 0; // Bytes in use
+
+  // Note: Can cause lua memory allocation failure
+  static vm_profile record(lua_State * L) {
+    PRIMER_ASSERT_STACK_NEUTRAL(L);
+    vm_profile result;
+    result.registry_refs = static_cast<int>(lua_rawlen(L, LUA_REGISTRYINDEX));
+
+    lua_pushnil(L);
+    while (lua_next(L, LUA_REGISTRYINDEX)) {
+      lua_pop(L, 1);
+      if (!lua_isinteger(L, -1)) { ++result.registry_fields; }
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    result.globals = count(L);
+    lua_pop(L, 1);
+
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+    result.loaded = count(L);
+    lua_pop(L, 1);
+
+    result.memory = static_cast<std::size_t>(lua_gc(L, LUA_GCCOUNT, 0)) * 1024
+                    + static_cast<std::size_t>(lua_gc(L, LUA_GCCOUNTB, 0));
+    return result;
+  }
+
+private:
+  // The number of fields of the table on top of the stack
+  static int count(lua_State * L) noexcept {
+    int n = 0;
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      lua_pop(L, 1);
+      ++n;
+    }
+    return n;
+  }
+};
+
+struct vm_config {
+  lua_Alloc alloc = nullptr;
+  void * alloc_ud = nullptr;
+
+  bool generational = false;
+  int gc_pause = 0;
+  int gc_step_multiplier = 0;
+
+  int stack_reserve = 0;
+
+  int registry_refs = 0;
+  int registry_fields = 0;
+  int globals = 0;
+  int loaded = 0;
+
+  void reserve_for(const vm_profile & p) noexcept {
+    registry_refs = p.registry_refs;
+    registry_fields = p.registry_fields;
+    globals = p.globals;
+    loaded = p.loaded;
+  }
+};
+
+namespace detail {
+
+// Fills the registry with placeholders, so that it grows to its final sizes in
+// one go, and removes them again. The array part, and the hash part, keep the
+// sizes, with free slots.
+inline void
+grow_registry(lua_State * L, const vm_config & config) {
+  const int first = static_cast<int>(lua_rawlen(L, LUA_REGISTRYINDEX)) + 1;
+  for (int i = first; i <= config.registry_refs; ++i) {
+    lua_pushboolean(L, false);
+    lua_rawseti(L, LUA_REGISTRYINDEX, i);
+  }
+  // Keys which can't be integers go in the hash part
+  for (int i = 0; i < config.registry_fields; ++i) {
+    lua_pushnumber(L, i + 0.5);
+    lua_pushboolean(L, false);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+  }
+
+  for (int i = 0; i < config.registry_fields; ++i) {
+    lua_pushnumber(L, i + 0.5);
+    lua_pushnil(L);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+  }
+  for (int i = config.registry_refs; i >= first; --i) {
+    lua_pushnil(L);
+    lua_rawseti(L, LUA_REGISTRYINDEX, i);
+  }
+}
+
+// Replaces the (empty) globals table and `_LOADED` table of a new state
+inline void
+presize_tables(lua_State * L, const vm_config & config) {
+  if (config.globals > 0) {
+    lua_createtable(L, 0, config.globals);
+    lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+  }
+  if (config.loaded > 0) {
+    lua_createtable(L, 0, config.loaded);
+    lua_setfield(L, LUA_REGISTRYINDEX, "_LOADED");
+  }
+}
+
+inline void
+apply_gc_config(lua_State * L, const vm_config & config) noexcept {
+#if LUA_VERSION_NUM >= 504
+  if (config.generational) { lua_gc(L, LUA_GCGEN, 0, 0); }
+#endif
+  if (config.gc_pause) { lua_gc(L, LUA_GCSETPAUSE, config.gc_pause); }
+  if (config.gc_step_multiplier) {
+    lua_gc(L, LUA_GCSETSTEPMUL, config.gc_step_multiplier);
+  }
+}
+
+} // end namespace detail
+
+inline lua_State *
+new_state(const vm_config & config) noexcept {
+  lua_State * L =
+    config.alloc ? lua_newstate(config.alloc, config.alloc_ud) : luaL_newstate();
+  if (!L) { return nullptr; }
+
+  auto ok = primer::mem_pcall(L, [&]() {
+    detail::presize_tables(L, config);
+    detail::grow_registry(L, config);
+  });
+  // The reservation is made outside of the call, for the base of the stack
+  if (!ok || (config.stack_reserve > 0
+              && !lua_checkstack(L, config.stack_reserve))) {
+    lua_close(L);
+    return nullptr;
+  }
+  lua_settop(L, 0);
+
+  detail::apply_gc_config(L, config);
+  return L;
+}
+
+} // end namespace primer
@@ -0,0 +1,226 @@
+//  (C) Copyright 2015 - 2018 Christopher Beck
+
+//  Distributed under the Boost Software License, Version 1.0. (See accompanying
+//  file LICENSE or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+/***
+ * A vm_executor runs C++ closures on the thread which owns a lua state, so
+ * that other threads can use the state without a mutex around it.
+ *
+ * Any thread may post tasks:
+ *
+ *   exec.post([](lua_State * L) { ... });          // runs in a cpp_pcall
+ *   auto fut = exec.post_call<int>(std::move(f), 1, "two");
+ *
+ * `post_call` calls a `bound_function` with the arguments, and the future
+ * gets the results, read as by `bound_function::call_as`. The arguments are
+ * copied into the task and pushed on the owner thread, so they should be
+ * plain C++ values. The function must be moved in, since copying it would use
+ * the state.
+ *
+ * The owner thread runs the tasks which are pending, in the order they were
+ * posted, by calling `run_pending()`, e.g. once per frame of the host loop, or
+ * from a count hook installed by `install_count_hook(n)`, which runs them
+ * every `n` instructions while the main thread is running lua code, and which
+ * other features share through `primer::hook_mux`. A task
+ * run from the hook sees the stack of the running function, and must leave it
+ * as it found it.
+ *
+ * The queue is a lock-free stack which the owner empties all at once, so
+ * posting never waits for the owner, and the owner checks for work with a
+ * single atomic load.
+ *
+ * Posted callables must not throw C++ exceptions, as for `cpp_pcall`. Lua
+ * errors which they raise are kept until `take_errors()`. Tasks still pending
+ * when the executor is destroyed, or when the state is gone, are dropped, and
+ * the futures of dropped calls get `std::future_errc::broken_promise`.
+ *
+ * Everything except `post`, `post_call` and `empty` must be used on the owner
+ * thread, and the executor must not outlive a state which it has hooked.
+ */
+
+#include <primer/base.hpp>
+
+PRIMER_ASSERT_FILESCOPE;
+
+#include <primer/bound_function.hpp>
+#include <primer/cpp_pcall.hpp>
+#include <primer/detail/count.hpp>
+#include <primer/error.hpp>
+#include <primer/expected.hpp>
+#include <primer/hook_mux.hpp>
+#include <primer/lua.hpp>
+#include <primer/lua_ref.hpp>
+#include <primer/support/lua_state_ref.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace primer {
+
+namespace detail {
+
+template <typename R, typename... Args>
+struct executor_call {
+  bound_function f;
+  std::tuple<Args...> args;
+  std::promise<expected<R>> promise;
+
+  template <std::size_t... indices>
+  expected<R> call(SizeList<indices...>) {
+    return f.call_as<R>(std::get<indices>(args)...);
+  }
+
+  void run() { promise.set_value(this->call(Count_t<sizeof...(Args)>{})); }
+};
+
+} // end namespace detail
+
+class vm_executor {
+public:
+  using task_t = std::function<void(lua_State *)>;
+
+private:
+  struct node {
+    task_t task;
+    node * next;
+  };
+
+  lua_state_ref sref_;
+  std::atomic<node *> head_{nullptr};
+  std::vector<primer::error> errors_;
+  hook_mux::subscription hook_ = -1;
+
+  static void count_hook(lua_State *, lua_Debug *, void * ud) {
+    auto e = static_cast<vm_executor *>(ud);
+    if (!e->empty()) { e->run_pending(); }
+  }
+
+  void push_node(node * n) noexcept {
+    n->next = head_.load(std::memory_order_relaxed);
+    while (!head_.compare_exchange_weak(n->next, n, std::memory_order_release,
+                                        std::memory_order_relaxed)) {}
+  }
+
+  // Takes everything which is pending, oldest first
+  node * take_all() noexcept {
+    node * n = head_.exchange(nullptr, std::memory_order_acquire);
+    node * result = nullptr;
+    while (n) {
+      node * next = n->next;
+      n->next = result;
+      result = n;
+      n = next;
+    }
+    return result;
+  }
+
+  static void free_list(node * n) noexcept {
+    while (n) {
+      node * next = n->next;
+      delete n;
+      n = next;
+    }
+  }
+
+public:
+  // Note: Can cause lua memory allocation failure
+  explicit vm_executor(lua_State * L)
+    : sref_(primer::obtain_state_ref(L)) {}
+
+  vm_executor(const vm_executor &) = delete;
+  vm_executor & operator=(const vm_executor &) = delete;
+
+  ~vm_executor() noexcept {
+    this->remove_count_hook();
+    free_list(this->take_all());
+  }
+
+  // Runs `f(L)` on the owner thread, in a protected context
+  template <typename F>
+  void post(F && f) {
+    this->push_node(new node{task_t{std::forward<F>(f)}, nullptr});
+  }
+
+  // Calls `f(args...)` on the owner thread
+  template <typename R, typename... Args>
+  std::future<expected<R>> post_call(bound_function && f, Args &&... args) {
+    using call_t = detail::executor_call<R, typename std::decay<Args>::type...>;
+    auto c = std::make_shared<call_t>();
+    c->f = std::move(f);
+    c->args = std::make_tuple(std::forward<Args>(args)...);
+    std::future<expected<R>> result = c->promise.get_future();
+    this->post([c](lua_State *) { c->run(); });
+    return result;
+  }
+
+  bool empty() const noexcept {
+    return !head_.load(std::memory_order_acquire);
+  }
+
+  // Runs the pending tasks. Returns the number which ran.
+  std::size_t run_pending() noexcept {
+    if (this->empty()) { return 0; }
+    node * list = this->take_all();
+    lua_State * L = sref_.lock();
+    if (!L || !lua_checkstack(L, 3)) {
+      free_list(list);
+      return 0;
+    }
+
+    primer::release_deferred_refs(L);
+    std::size_t count = 0;
+    for (node * n = list; n; n = n->next) {
+      const int top = lua_gettop(L);
+      auto ok = primer::cpp_pcall(L, [L, n]() { n->task(L); });
+      lua_settop(L, top);
+      if (!ok) {
+        PRIMER_TRY_BAD_ALLOC { errors_.emplace_back(std::move(ok.err())); }
+        PRIMER_CATCH_BAD_ALLOC {}
+      }
+      ++count;
+    }
+    free_list(list);
+    return count;
+  }
+
+  // Runs the pending tasks every `instructions` instructions, while the main
+  // thread, or a coroutine it creates later, runs lua code. The hook is shared
+  // through the `hook_mux`, and this fails if the main thread has another.
+  expected<void> install_count_hook(int instructions) noexcept {
+    lua_State * L = sref_.lock();
+    if (!L) { return primer::error::cant_lock_vm(); }
+    if (hook_ >= 0) {
+      hook_mux::set_count(L, hook_, instructions);
+      return {};
+    }
+    auto s = hook_mux::subscribe(L, &count_hook, this, 0, instructions);
+    if (!s) { return s.err(); }
+    hook_ = *s;
+    return {};
+  }
+
+  void remove_count_hook() noexcept {
+    if (hook_ < 0) { return; }
+    if (lua_State * L = sref_.lock()) { hook_mux::unsubscribe(L, hook_); }
+    hook_ = -1;
+  }
+
+  // Errors raised by tasks since the last call
+  std::vector<primer::error> take_errors() noexcept {
+    std::vector<primer::error> result;
+    result.swap(errors_);
+    return result;
+  }
+};
+
+} // end namespace primer
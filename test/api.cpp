@@ -1,12 +1,42 @@
 #include <primer/api.hpp>
+#include <primer/api/async_io.hpp>
+#include <primer/api/mapped_vfs.hpp>
+#include <primer/api/persist_many.hpp>
+#include <primer/api/pool_map.hpp>
+#include <primer/api/vfs_prefetch.hpp>
+#include <primer/api/vm_multiplexer.hpp>
+#include <primer/api/vm_pool.hpp>
+#include <primer/api/vm_template.hpp>
+#include <primer/api/vm_worker_pool.hpp>
+#include <primer/pool_allocator.hpp>
 #include <primer/primer.hpp>
+#include <primer/std/map.hpp>
 #include <primer/std/vector.hpp>
+#include <primer/vm_config.hpp>
+#include <primer/vm_executor.hpp>
 
 #include "test_harness/g_inspector.hpp"
 #include "test_harness/test_harness.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <initializer_list>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <tuple>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 struct test_api_one : primer::api::persistable<test_api_one> {
   lua_raii L;
@@ -19,6 +49,21 @@ struct test_api_one : primer::api::persistable<test_api_one> {
 
   void restore(const std::string & buffer) { this->unpersist(L, buffer); }
 
+  using persistable::persist;
+  using persistable::persist_chunked;
+  using persistable::unpersist;
+  using persistable::unpersist_chunked;
+  using persistable::persist_delta;
+  using persistable::persist_replica;
+  using persistable::persist_async;
+  using persistable::persist_compressed;
+  using persistable::unpersist_compressed;
+  using persistable::persist_sections;
+  using persistable::unpersist_sections;
+  using persistable::unpersist_delta;
+  using persistable::unpersist_replica;
+  using persistable::with_persist_options;
+
   void create_mock_state() {
     PRIMER_ASSERT_STACK_NEUTRAL(L);
 
@@ -108,6 +153,739 @@ UNIT_TEST(persist_simple) {
   }
 }
 
+UNIT_TEST(persist_sinks) {
+  test_api_one a;
+  a.create_mock_state();
+
+  std::string buffer = a.save();
+  TEST(buffer.size(), "expected some output");
+
+  {
+    std::ostringstream ss;
+    TEST_EXPECTED(a.persist(a.L, ss));
+    TEST_EQ(buffer, ss.str());
+
+    ss.setstate(std::ios_base::badbit);
+    TEST(!a.persist(a.L, ss), "expected failure writing to a bad stream");
+  }
+
+  for (std::size_t chunk_size : {1u, 7u, 64u, 1u << 16}) {
+    std::string chunked;
+    int calls = 0;
+    TEST_EXPECTED(a.persist_chunked(a.L,
+                                    [&](const char * data, std::size_t size) {
+                                      ++calls;
+                                      chunked.append(data, size);
+                                      return true;
+                                    },
+                                    chunk_size));
+    TEST_EQ(buffer, chunked);
+    TEST(calls <= 2 * static_cast<int>(buffer.size() / chunk_size) + 1,
+         "too many chunks: " << calls << " chunk size: " << chunk_size);
+  }
+
+  {
+    int calls = 0;
+    auto result = a.persist_chunked(a.L,
+                                    [&](const char *, std::size_t) {
+                                      ++calls;
+                                      return false;
+                                    },
+                                    16);
+    TEST(!result, "expected failure when the sink aborts");
+    TEST_EQ(calls, 1);
+  }
+
+  CHECK_STACK(a.L, 0);
+
+  test_api_one b;
+  b.restore(buffer);
+  TEST_EQ(true, b.test_mock_state());
+}
+
+UNIT_TEST(unpersist_sources) {
+  std::string buffer;
+  {
+    test_api_one a;
+    a.create_mock_state();
+    buffer = a.save();
+  }
+
+  {
+    test_api_one a;
+    TEST_EXPECTED(a.unpersist(a.L, buffer.data(), buffer.size()));
+    TEST_EQ(true, a.test_mock_state());
+  }
+
+  {
+    test_api_one a;
+    std::istringstream ss{buffer};
+    TEST_EXPECTED(a.unpersist(a.L, ss, 5));
+    TEST_EQ(true, a.test_mock_state());
+  }
+
+  for (std::size_t chunk_size : {1u, 7u, 1u << 16}) {
+    test_api_one a;
+    std::size_t pos = 0;
+    TEST_EXPECTED(a.unpersist_chunked(a.L,
+                                      [&](char * buf, std::size_t size) {
+                                        size = std::min(size,
+                                                        buffer.size() - pos);
+                                        buffer.copy(buf, size, pos);
+                                        pos += size;
+                                        return size;
+                                      },
+                                      chunk_size));
+    TEST_EQ(true, a.test_mock_state());
+    TEST_EQ(pos, buffer.size());
+    CHECK_STACK(a.L, 0);
+  }
+
+  {
+    // A truncated source is an error
+    test_api_one a;
+    std::size_t pos = 0;
+    auto result = a.unpersist_chunked(a.L, [&](char * buf, std::size_t size) {
+      size = std::min(size, buffer.size() / 2 - pos);
+      buffer.copy(buf, size, pos);
+      pos += size;
+      return size;
+    });
+    TEST(!result, "expected failure with a truncated source");
+    CHECK_STACK(a.L, 0);
+  }
+}
+
+UNIT_TEST(persist_async) {
+  test_api_one a;
+  a.create_mock_state();
+
+  auto f = a.persist_async(a.L);
+
+  // The parent can change the state while the child persists
+  lua_pushboolean(a.L, false);
+  lua_setglobal(a.L, "humbug");
+  TEST_EQ(false, a.test_mock_state());
+
+  primer::expected<std::string> result = f.get();
+  TEST_EXPECTED(result);
+
+  test_api_one b;
+  TEST_EXPECTED(b.unpersist(b.L, *result));
+  TEST_EQ(true, b.test_mock_state());
+
+  // The pipe isn't inherited by exec
+  auto g = primer::detail::fork_snapshot([](int fd) -> bool {
+    return ::fcntl(fd, F_GETFD) & FD_CLOEXEC;
+  });
+  TEST_EXPECTED(g.get());
+
+  // A throw in the child fails the snapshot, and doesn't unwind the child
+  g = primer::detail::fork_snapshot(
+    [](int) -> bool { throw std::runtime_error{"snapshot"}; });
+  TEST(!g.get(), "expected the snapshot to fail");
+}
+
+// Run-length encoding, as a codec: pairs of (count, byte)
+struct rle_codec {
+  char value = 0;
+  unsigned char count = 0;
+
+  static const char * name() noexcept { return "rle"; }
+
+  bool flush(primer::api::byte_sink out) {
+    if (!count) { return true; }
+    const char pair[2] = {static_cast<char>(count), value};
+    count = 0;
+    return out(pair, 2);
+  }
+
+  bool compress(const char * data, std::size_t size,
+                primer::api::byte_sink out) {
+    for (std::size_t i = 0; i < size; ++i) {
+      if (count && (data[i] != value || count == 255)) {
+        if (!this->flush(out)) { return false; }
+      }
+      value = data[i];
+      ++count;
+    }
+    return true;
+  }
+
+  bool finish(primer::api::byte_sink out) { return this->flush(out); }
+
+  std::size_t decompress(primer::api::byte_source in, char * buf,
+                         std::size_t size) {
+    std::size_t n = 0;
+    while (n < size) {
+      if (!count) {
+        char pair[2];
+        if (in(pair, 2) != 2) { break; }
+        count = static_cast<unsigned char>(pair[0]);
+        value = pair[1];
+      }
+      for (; count && n < size; --count) {
+        buf[n++] = value;
+      }
+    }
+    return n;
+  }
+};
+
+UNIT_TEST(persist_compressed) {
+  test_api_one a;
+  a.create_mock_state();
+  lua_pushstring(a.L, std::string(10000, 'x').c_str());
+  lua_setglobal(a.L, "pad");
+  std::string plain = a.save();
+
+  std::string packed;
+  {
+    rle_codec c;
+    TEST_EXPECTED(a.persist_compressed(a.L, c, packed));
+  }
+  TEST(packed.size() < plain.size() / 2,
+       "expected compression, " << packed.size() << " vs " << plain.size());
+  TEST_EQ(packed.substr(0, 4), "PRC1");
+
+  {
+    test_api_one b;
+    rle_codec c;
+    TEST_EXPECTED(b.unpersist_compressed(b.L, c, packed));
+    TEST_EQ(true, b.test_mock_state());
+  }
+
+  {
+    // The header names the codec
+    test_api_one b;
+    primer::api::identity_codec c;
+    TEST(!b.unpersist_compressed(b.L, c, packed),
+         "expected failure with the wrong codec");
+  }
+
+  {
+    std::string passthrough;
+    primer::api::identity_codec c;
+    TEST_EXPECTED(a.persist_compressed(a.L, c, passthrough));
+    TEST_EQ(passthrough.substr(9), plain);
+  }
+}
+
+static int
+count_zone_entries(lua_State * L, const char * zone) {
+  int result = -1;
+  lua_getglobal(L, zone);
+  if (lua_istable(L, -1)) { result = static_cast<int>(lua_rawlen(L, -1)); }
+  lua_pop(L, 1);
+  return result;
+}
+
+// Checks without triggering a lazy load
+static bool
+is_loaded(lua_State * L, const char * name) {
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+  lua_pushstring(L, name);
+  bool result = lua_rawget(L, -2) != LUA_TNIL;
+  lua_pop(L, 2);
+  return result;
+}
+
+UNIT_TEST(persist_sections) {
+  std::string buffer;
+  {
+    test_api_one a;
+    a.create_mock_state();
+    TEST_LUA_OK(a.L, luaL_dostring(a.L, "zone_a = {1, 2, 3} "
+                                        "zone_b = {_G, 5, 6, 7} "
+                                        "zone_c = {}"));
+    TEST_EXPECTED(
+      a.persist_sections(a.L, {"zone_a", "zone_b", "missing"}, buffer));
+    CHECK_STACK(a.L, 0);
+
+    // The state is untouched
+    TEST_EQ(3, count_zone_entries(a.L, "zone_a"));
+    TEST_EQ(4, count_zone_entries(a.L, "zone_b"));
+    TEST_EQ(true, a.test_mock_state());
+
+    // A plain persist still works
+    std::string plain = a.save();
+    test_api_one b;
+    b.restore(plain);
+    TEST_EQ(3, count_zone_entries(b.L, "zone_a"));
+  }
+
+  {
+    test_api_one a;
+    TEST_EXPECTED(a.unpersist_sections(a.L, buffer, false));
+    TEST_EQ(true, a.test_mock_state());
+    TEST_EQ(3, count_zone_entries(a.L, "zone_a"));
+    TEST_EQ(4, count_zone_entries(a.L, "zone_b"));
+    TEST_EQ(0, count_zone_entries(a.L, "zone_c"));
+  }
+
+  {
+    test_api_one a;
+    TEST_EXPECTED(a.unpersist_sections(a.L, buffer,
+                                       std::vector<std::string>{"zone_b"}));
+    TEST_EQ(true, a.test_mock_state());
+    TEST_EQ(-1, count_zone_entries(a.L, "zone_a"));
+    TEST_EQ(4, count_zone_entries(a.L, "zone_b"));
+
+    // The reference to _G in zone_b is to the restored _G
+    TEST_LUA_OK(a.L, luaL_dostring(a.L, "x = (zone_b[1] == _G)"));
+    lua_getglobal(a.L, "x");
+    TEST_EQ(true, lua_toboolean(a.L, -1));
+    lua_pop(a.L, 1);
+  }
+
+  {
+    test_api_one a;
+    TEST_EXPECTED(a.unpersist_sections(a.L, buffer));
+    TEST_EQ(false, is_loaded(a.L, "zone_a"));
+    TEST_EQ(false, is_loaded(a.L, "zone_b"));
+
+    TEST_EQ(3, count_zone_entries(a.L, "zone_a"));
+    TEST_EQ(true, is_loaded(a.L, "zone_a"));
+    TEST_EQ(false, is_loaded(a.L, "zone_b"));
+
+    // Assigning to a pending section discards it
+    TEST_LUA_OK(a.L, luaL_dostring(a.L, "zone_b = 5"));
+    TEST_LUA_OK(a.L, luaL_dostring(a.L, "zone_b = nil"));
+    TEST_EQ(-1, count_zone_entries(a.L, "zone_b"));
+    CHECK_STACK(a.L, 0);
+  }
+
+  {
+    // A state with pending sections can be persisted again
+    test_api_one a;
+    TEST_EXPECTED(a.unpersist_sections(a.L, buffer));
+    std::string again = a.save();
+
+    test_api_one b;
+    b.restore(again);
+    TEST_EQ(false, is_loaded(b.L, "zone_b"));
+    TEST_EQ(4, count_zone_entries(b.L, "zone_b"));
+  }
+}
+
+UNIT_TEST(persist_many) {
+  std::vector<test_api_one> apis(8);
+  for (std::size_t i = 0; i < apis.size(); ++i) {
+    apis[i].create_mock_state();
+    lua_pushinteger(apis[i].L, static_cast<lua_Integer>(i));
+    lua_setglobal(apis[i].L, "id");
+  }
+
+  std::string checkpoint;
+  TEST_EXPECTED(primer::api::persist_many(
+    apis.size(),
+    [&apis](std::size_t i, std::string & buffer) {
+      return apis[i].persist(apis[i].L, buffer);
+    },
+    checkpoint, 4));
+
+  auto buffers = primer::api::split_checkpoint(checkpoint);
+  TEST_EXPECTED(buffers);
+  TEST_EQ(apis.size(), buffers->size());
+
+  for (std::size_t i = 0; i < buffers->size(); ++i) {
+    test_api_one b;
+    b.restore((*buffers)[i]);
+    TEST_EQ(true, b.test_mock_state());
+    lua_getglobal(b.L, "id");
+    TEST_EQ(static_cast<lua_Integer>(i), lua_tointeger(b.L, -1));
+    lua_pop(b.L, 1);
+  }
+
+  // Errors name the state
+  auto result = primer::api::persist_many(
+    3,
+    [](std::size_t i, std::string &) -> primer::expected<void> {
+      if (i == 1) { return primer::error{"bad"}; }
+      return {};
+    },
+    checkpoint);
+  TEST(!result, "expected an error");
+  TEST_EQ(result.err().str(), "state 1: bad");
+
+  TEST(!primer::api::split_checkpoint("PRM1\x05"), "expected an error");
+}
+
+static std::string
+get_big_entry(lua_State * L, int i) {
+  lua_getglobal(L, "big");
+  if (!lua_istable(L, -1)) {
+    lua_pop(L, 1);
+    return "";
+  }
+  lua_rawgeti(L, -1, i);
+  std::string result = lua_isstring(L, -1) ? lua_tostring(L, -1) : "";
+  lua_pop(L, 2);
+  return result;
+}
+
+UNIT_TEST(persist_delta) {
+  test_api_one a;
+  a.create_mock_state();
+  TEST_LUA_OK(a.L, luaL_dostring(a.L, "big = {} for i = 1, 5000 do big[i] = "
+                                 "'entry number ' .. i end"));
+
+  std::string base = a.save();
+
+  TEST_LUA_OK(a.L, luaL_dostring(a.L, "big[2500] = 'changed'"));
+  std::string delta1;
+  TEST_EXPECTED(a.persist_delta(a.L, base, delta1));
+  TEST(delta1.size() * 10 < base.size(),
+       "delta too large: " << delta1.size() << " base: " << base.size());
+
+  TEST_LUA_OK(a.L, luaL_dostring(a.L, "humbug = false"));
+  std::string second = a.save();
+
+  {
+    test_api_one b;
+    TEST_EXPECTED(b.unpersist_delta(b.L, base, delta1));
+    TEST_EQ(true, b.test_mock_state());
+    TEST_EQ("changed", get_big_entry(b.L, 2500));
+    TEST_EQ("entry number 2499", get_big_entry(b.L, 2499));
+  }
+
+  {
+    // A chain: delta3 is made against the result of delta1
+    std::string first;
+    TEST_EXPECTED(primer::api::apply_snapshot_delta(base, delta1, first));
+    std::string delta3;
+    TEST_EXPECTED(primer::api::make_snapshot_delta(first, second, delta3));
+
+    std::string compacted;
+    TEST_EXPECTED(
+      primer::api::compact_snapshot_deltas(base, {delta1, delta3}, compacted));
+    TEST_EQ(compacted, second);
+
+    test_api_one b;
+    TEST_EXPECTED(b.unpersist(b.L, compacted));
+    TEST_EQ(false, b.test_mock_state());
+    TEST_EQ("changed", get_big_entry(b.L, 2500));
+  }
+
+  {
+    std::string out;
+    TEST(!primer::api::apply_snapshot_delta(second, delta1, out),
+         "expected failure with the wrong base");
+
+    std::string bad = delta1;
+    bad.resize(bad.size() - 3);
+    TEST(!primer::api::apply_snapshot_delta(base, bad, out),
+         "expected failure with a truncated delta");
+  }
+}
+
+UNIT_TEST(replication) {
+  test_api_one a;
+  a.create_mock_state();
+  TEST_LUA_OK(a.L, luaL_dostring(a.L, "big = {} for i = 1, 5000 do big[i] = "
+                                 "'entry number ' .. i end"));
+
+  std::string stream;
+  auto sink = [&stream](const char * data, std::size_t size) {
+    stream.append(data, size);
+    return true;
+  };
+
+  primer::api::replication_sender sender{4};
+  primer::api::replication_standby standby;
+  test_api_one b;
+
+  TEST_EXPECTED(a.persist_replica(a.L, sender, sink));
+  const std::size_t base_size = stream.size();
+  TEST_EXPECTED(standby.feed(stream.data(), stream.size()));
+  TEST_EQ(false, standby.needs_base());
+  TEST_EXPECTED(b.unpersist_replica(b.L, standby));
+  TEST_EQ(false, standby.has_update());
+  TEST_EQ(true, b.test_mock_state());
+  TEST_EQ("entry number 2500", get_big_entry(b.L, 2500));
+
+  // Deltas, fed a few bytes at a time, are applied to the warm VM
+  for (int i = 1; i <= 2; ++i) {
+    stream.clear();
+    TEST_LUA_OK(a.L, luaL_dostring(a.L, "big[2500] = 'changed' .. #big"));
+    TEST_LUA_OK(a.L, luaL_dostring(a.L, "big[#big + 1] = 'more'"));
+    TEST_EXPECTED(a.persist_replica(a.L, sender, sink));
+    TEST(stream.size() * 10 < base_size,
+         "frame too large: " << stream.size() << " base: " << base_size);
+    for (std::size_t pos = 0; pos < stream.size(); pos += 7) {
+      std::size_t n = std::min<std::size_t>(7, stream.size() - pos);
+      TEST_EXPECTED(standby.feed(stream.data() + pos, n));
+    }
+    TEST_EQ(true, standby.has_update());
+    TEST_EXPECTED(b.unpersist_replica(b.L, standby));
+  }
+  TEST_EQ(3u, standby.sequence());
+  TEST_EQ("changed5001", get_big_entry(b.L, 2500));
+  TEST_EQ("more", get_big_entry(b.L, 5002));
+
+  {
+    // A standby which missed the base waits for the next one
+    primer::api::replication_standby late;
+    stream.clear();
+    TEST_LUA_OK(a.L, luaL_dostring(a.L, "humbug = false"));
+    TEST_EXPECTED(a.persist_replica(a.L, sender, sink));
+    TEST_EXPECTED(late.feed(stream.data(), stream.size()));
+    TEST_EQ(true, late.needs_base());
+    TEST_EQ(false, late.has_update());
+    TEST_EXPECTED(standby.feed(stream.data(), stream.size()));
+
+    // The fourth frame after a base is a base again
+    stream.clear();
+    TEST_EXPECTED(a.persist_replica(a.L, sender, sink));
+    TEST(stream.size() >= base_size, "expected a base frame");
+    TEST_EXPECTED(late.feed(stream.data(), stream.size()));
+    TEST_EQ(false, late.needs_base());
+    TEST_EQ(late.image(), a.save());
+
+    TEST_EXPECTED(standby.feed(stream.data(), stream.size()));
+    TEST_EXPECTED(b.unpersist_replica(b.L, standby));
+    TEST_EQ(false, b.test_mock_state());
+  }
+
+  {
+    // A failed sink means the next frame is a base
+    primer::api::replication_standby other;
+    TEST(!a.persist_replica(
+           a.L, sender, [](const char *, std::size_t) { return false; }),
+         "expected failure of the sink");
+    stream.clear();
+    TEST_EXPECTED(a.persist_replica(a.L, sender, sink));
+    TEST_EXPECTED(other.feed(stream.data(), stream.size()));
+    TEST_EQ(false, other.needs_base());
+
+    std::string bad = "XXXX" + stream;
+    TEST(!other.feed(bad.data(), bad.size()), "expected a bad frame header");
+    TEST_EQ(true, other.needs_base());
+  }
+}
+
+struct test_api_migrating : primer::api::base<test_api_migrating> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, base_lib_);
+  API_FEATURE(primer::api::libraries<primer::api::lua_coroutine_lib>, co_lib_);
+
+  test_api_migrating()
+    : L_() {
+    this->initialize_api(L_);
+    const char * script = "shared = { count = 0 }                        \n"
+                          "function counter(n)                           \n"
+                          "  local seen = {}                             \n"
+                          "  while true do                               \n"
+                          "    n = n + 1                                 \n"
+                          "    seen[#seen + 1] = n                       \n"
+                          "    shared.count = shared.count + 1           \n"
+                          "    if coroutine.yield(n, #seen) then         \n"
+                          "      return coroutine.running()              \n"
+                          "    end                                       \n"
+                          "  end                                         \n"
+                          "end                                           \n";
+    TEST_LUA_OK(L_, luaL_dostring(L_, script));
+  }
+
+  primer::bound_function get(const char * name) {
+    lua_getglobal(L_, name);
+    return primer::bound_function{L_};
+  }
+
+  int shared_count() {
+    TEST_LUA_OK(L_, luaL_dostring(L_, "return shared.count"));
+    int n = static_cast<int>(lua_tointeger(L_, -1));
+    lua_settop(L_, 0);
+    return n;
+  }
+
+  using persistable::persist_coroutine;
+  using persistable::unpersist_coroutine;
+  using persistable::migrate;
+};
+
+UNIT_TEST(migrate_coroutine) {
+  using result_t = std::tuple<int, int>;
+
+  test_api_migrating a;
+  test_api_migrating b;
+
+  primer::coroutine co{a.get("counter")};
+  TEST_EQ(std::get<0>(*co.resume_as<result_t>(10)), 11);
+  TEST_EQ(std::get<0>(*co.resume_as<result_t>()), 12);
+  TEST_EQ(a.shared_count(), 2);
+
+  auto moved = a.migrate(a.L_, co, b, b.L_);
+  TEST_EXPECTED(moved);
+  TEST(!co, "expected the source coroutine to be reset");
+  TEST(moved->lock() == b.L_, "expected a coroutine of the target");
+
+  // The locals came along, and the globals are those of the target
+  auto r = moved->resume_as<result_t>();
+  TEST_EXPECTED(r);
+  TEST_EQ(std::get<0>(*r), 13);
+  TEST_EQ(std::get<1>(*r), 3);
+  TEST_EQ(a.shared_count(), 2);
+  TEST_EQ(b.shared_count(), 1);
+
+  {
+    // Not started yet, with its arguments
+    primer::coroutine fresh{b.get("counter")};
+    std::string buffer;
+    TEST_EXPECTED(b.persist_coroutine(b.L_, fresh, buffer));
+    auto back = a.unpersist_coroutine(a.L_, buffer);
+    TEST_EXPECTED(back);
+    TEST_EQ(std::get<0>(*back->resume_as<result_t>(100)), 101);
+    TEST_EQ(a.shared_count(), 3);
+  }
+
+  {
+    // A coroutine which has finished can't be persisted
+    auto done = moved->call_no_ret(true);
+    TEST_EXPECTED(done);
+    std::string buffer;
+    TEST(!b.persist_coroutine(b.L_, *moved, buffer), "expected an error");
+    TEST(!a.unpersist_coroutine(a.L_, "garbage"), "expected an error");
+  }
+}
+
+UNIT_TEST(persist_options) {
+  using primer::api::persist_options;
+
+  test_api_one a;
+  a.create_mock_state();
+  TEST_LUA_OK(a.L, luaL_dostring(a.L, "deep = {} local t = deep "
+                                      "for i = 1, 50 do t.next = {} "
+                                      "t = t.next end"));
+
+  std::string fast, stripped;
+  TEST_EXPECTED(a.persist(a.L, fast, persist_options::fast()));
+  {
+    persist_options opts = persist_options::fast();
+    opts.debug_info = false;
+    TEST_LUA_OK(a.L, luaL_dostring(a.L, "function f(x)\n"
+                                        "  local a, b, c = x, x, x\n"
+                                        "  return a + b + c\n"
+                                        "end"));
+    TEST_EXPECTED(a.persist(a.L, fast, persist_options::fast()));
+    TEST_EXPECTED(a.persist(a.L, stripped, opts));
+    TEST(stripped.size() < fast.size(), "debug info was not stripped");
+
+    test_api_one b;
+    TEST_EXPECTED(b.unpersist(b.L, stripped, persist_options::fast()));
+    TEST_EQ(true, b.test_mock_state());
+    TEST_LUA_OK(b.L, luaL_loadstring(b.L, "return f(2)"));
+    TEST_LUA_OK(b.L, lua_pcall(b.L, 0, 1, 0));
+    TEST_EQ(6, lua_tointeger(b.L, -1));
+    lua_pop(b.L, 1);
+  }
+
+  {
+    persist_options opts = persist_options::fast();
+    opts.maxrec = 20;
+    std::string buffer;
+    TEST(!a.persist(a.L, buffer, opts), "expected the nesting to be too deep");
+    TEST_EXPECTED(a.persist(a.L, buffer, persist_options::fast()));
+  }
+
+  // A C function which isn't a permanent object can't be persisted. Only the
+  // retry with path tracking says where it is.
+  lua_pushcfunction(a.L, [](lua_State *) { return 0; });
+  lua_setglobal(a.L, "bad_global");
+  {
+    std::string buffer;
+    auto result = a.persist(a.L, buffer, persist_options::fast());
+    TEST(!result, "expected failure");
+    TEST(result.err().str().find("bad_global") == std::string::npos,
+         result.err().str());
+
+    result = a.persist(a.L, buffer, persist_options{});
+    TEST(!result, "expected failure");
+    TEST(result.err().str().find("bad_global") != std::string::npos,
+         result.err().str());
+  }
+
+  // The previous settings are restored afterwards
+  eris_get_setting(a.L, "maxrec");
+  TEST_EQ(10000, lua_tointeger(a.L, -1));
+  lua_pop(a.L, 1);
+}
+
+UNIT_TEST(snapshot_store) {
+  const char * script = "big = {} for i = 1, 5000 do big[i] = "
+                        "'entry number ' .. i end";
+
+  primer::api::snapshot_store store;
+  std::string first;
+
+  for (int i = 0; i < 4; ++i) {
+    test_api_one a;
+    a.create_mock_state();
+    TEST_LUA_OK(a.L, luaL_dostring(a.L, script));
+    lua_pushinteger(a.L, i);
+    lua_setglobal(a.L, "id");
+
+    auto w = store.make_writer("vm" + std::to_string(i));
+    TEST_EXPECTED(a.persist_chunked(a.L, w, 1000));
+    TEST_EXPECTED(w.commit());
+    if (!i) { TEST_EXPECTED(store.get("vm0", first)); }
+  }
+
+  TEST_EQ(store.size(), 4u);
+  TEST_EQ(store.logical_bytes(), 4 * first.size());
+  TEST(store.stored_bytes() * 2 < store.logical_bytes(),
+       "not deduplicated: " << store.stored_bytes() << " of "
+                            << store.logical_bytes());
+
+  {
+    test_api_one b;
+    auto r = store.make_reader("vm2");
+    TEST_EXPECTED(r);
+    TEST_EXPECTED(b.unpersist_chunked(b.L, *r, 100));
+    TEST_EQ(true, b.test_mock_state());
+    TEST_EQ("entry number 2499", get_big_entry(b.L, 2499));
+    lua_getglobal(b.L, "id");
+    TEST_EQ(2, lua_tointeger(b.L, -1));
+    lua_pop(b.L, 1);
+  }
+
+  {
+    // The same snapshot, put as a whole, shares every chunk
+    const std::size_t chunks = store.chunk_count();
+    TEST_EXPECTED(store.put("copy", first));
+    TEST_EQ(store.chunk_count(), chunks);
+    std::string out;
+    TEST_EXPECTED(store.get("copy", out));
+    TEST_EQ(out, first);
+  }
+
+  {
+    std::string data;
+    TEST_EXPECTED(store.write(data));
+    primer::api::snapshot_store loaded;
+    TEST_EXPECTED(loaded.read(data));
+    TEST_EQ(loaded.size(), store.size());
+    TEST_EQ(loaded.chunk_count(), store.chunk_count());
+    std::string out;
+    TEST_EXPECTED(loaded.get("vm0", out));
+    TEST_EQ(out, first);
+
+    data.resize(data.size() - 3);
+    TEST(!loaded.read(data), "expected failure with a truncated store");
+    TEST_EQ(loaded.size(), store.size());
+  }
+
+  for (const char * key : {"vm0", "vm1", "vm2", "vm3", "copy"}) {
+    TEST(store.erase(key), "missing " << key);
+  }
+  TEST(!store.erase("vm0"), "expected no snapshot");
+  TEST(!store.make_reader("vm0"), "expected no snapshot");
+  TEST_EQ(store.chunk_count(), 0u);
+  TEST_EQ(store.stored_bytes(), 0u);
+  TEST_EQ(store.logical_bytes(), 0u);
+}
+
 UNIT_TEST(persist_simple_two) {
   std::string buffer;
   table_summary summary;
@@ -250,6 +1028,74 @@ UNIT_TEST(api_base) {
   }
 }
 
+struct test_api_lazy_cb : primer::api::base<test_api_lazy_cb> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, libs_);
+  API_FEATURE(primer::api::callbacks, cb_man_);
+
+  NEW_LUA_CALLBACK(sub, "subtracts")(lua_State * L, int i, int j)->primer::result {
+    lua_pushinteger(L, i - j);
+    return 1;
+  }
+
+  NEW_LUA_CALLBACK(add, "adds")(lua_State * L, int i, int j)->primer::result {
+    lua_pushinteger(L, i + j);
+    return 1;
+  }
+
+  USE_LUA_CALLBACK(help, "get help for a built-in function",
+                   &primer::api::intf_help_impl);
+
+  test_api_lazy_cb()
+    : L_()
+    , cb_man_(this, primer::api::callbacks::install_mode::lazy) {
+    this->initialize_api(L_);
+  }
+
+  std::string save() {
+    std::string result;
+    this->persist(L_, result);
+    return result;
+  }
+
+  void restore(const std::string & buffer) { this->unpersist(L_, buffer); }
+};
+
+UNIT_TEST(api_lazy_callbacks) {
+  std::string buffer;
+  {
+    test_api_lazy_cb a;
+    lua_State * L = a.L_;
+
+    // Nothing is set until it is used
+    TEST_LUA_OK(L, luaL_loadstring(L, "assert(rawget(_G, 'add') == nil) "
+                                      "assert(rawget(_G, 'sub') == nil) "
+                                      "assert(add(2, 3) == 5) "
+                                      "assert(rawget(_G, 'add') == add) "
+                                      "assert(rawget(_G, 'sub') == nil) "
+                                      "assert(type(help(sub)) == 'string') "
+                                      "assert(nope == nil) "
+                                      "x = sub(7, 2)"));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    CHECK_STACK(L, 0);
+    buffer = a.save();
+  }
+  {
+    test_api_lazy_cb a;
+    a.restore(buffer);
+    lua_State * L = a.L_;
+
+    // The metamethod is persisted, so what wasn't used is still found
+    TEST_LUA_OK(L, luaL_loadstring(L, "assert(x == 5) "
+                                      "assert(rawget(_G, 'add') == add) "
+                                      "assert(add(1, 1) == 2) "
+                                      "assert(sub(1, 1) == 0)"));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    CHECK_STACK(L, 0);
+  }
+}
+
 UNIT_TEST(api_help) {
   test_api_two a;
 
@@ -258,19 +1104,195 @@ UNIT_TEST(api_help) {
   const char * script =
     ""
     "assert(help(f) == 'this is the f help')         \n"
-    "assert(help(g) == 'this is the g help')         \n";
+    "assert(help(g) == 'this is the g help')         \n"
+    "assert(help(foo) == '')                         \n"
+    "assert(help(print) == 'No help entry was found.')\n";
 
   TEST_LUA_OK(L, luaL_loadstring(L, script));
   TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
 
   CHECK_STACK(L, 0);
-}
 
-/***
- * Test userdata persistence
- */
+  // The help of the callbacks is shared, not copied into each state
+  const auto & index = primer::detail::callbacks_help_index<test_api_two>();
+  TEST(index.size() >= 3u, "missing help entries");
+  {
+    test_api_two b;
+    lua_getglobal(b.L_, "f");
+    const char * str = primer::api::get_help_string(b.L_,
+                                                    lua_tocfunction(b.L_, -1));
+    TEST_EQ(str, index.find(lua_tocfunction(b.L_, -1)));
+    lua_pop(b.L_, 1);
+  }
 
-struct tstring {
+  // Help set at run time comes first
+  lua_getglobal(L, "f");
+  primer::api::set_help_string(L, lua_tocfunction(L, -1), "new f help");
+  lua_pop(L, 1);
+
+  const char * script2 = "assert(help(f) == 'new f help')";
+  TEST_LUA_OK(L, luaL_loadstring(L, script2));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  CHECK_STACK(L, 0);
+}
+
+/***
+ * Test several callback owners sharing one lua state
+ */
+
+struct test_api_sim : primer::callback_registrar<test_api_sim, 1> {
+  int counter_ = 0;
+
+  NEW_LUA_CALLBACK(tick, "advance the simulation")
+  (lua_State * L, int n)->primer::result {
+    counter_ += n;
+    lua_pushinteger(L, counter_);
+    return 1;
+  }
+};
+
+struct test_api_multi : primer::api::base<test_api_multi, 0> {
+  lua_raii L_;
+  test_api_sim sim_;
+  int calls_ = 0;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, libs_);
+  API_FEATURE(primer::api::callbacks, cb_man_);
+  API_FEATURE(primer::api::callbacks, sim_cb_man_);
+
+  NEW_LUA_CALLBACK(count, "count calls")
+  (lua_State * L)->primer::result {
+    lua_pushinteger(L, ++calls_);
+    return 1;
+  }
+
+  test_api_multi()
+    : L_()
+    , sim_()
+    , cb_man_(this)
+    , sim_cb_man_(&sim_) {
+    this->initialize_api(L_);
+  }
+};
+
+UNIT_TEST(api_multi_owner) {
+  test_api_multi a;
+  lua_State * L = a.L_;
+
+  const char * script =
+    ""
+    "assert(count() == 1)                            \n"
+    "assert(tick(3) == 3)                            \n"
+    "assert(count() == 2)                            \n"
+    "assert(tick(4) == 7)                            \n";
+
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  TEST_EQ(a.calls_, 2);
+  TEST_EQ(a.sim_.counter_, 7);
+
+  CHECK_STACK(L, 0);
+}
+
+/***
+ * Test an api with more callbacks and features than fit in one chunk of ranks
+ */
+
+struct init_counting_feature {
+  static int inits;
+
+  void on_init(lua_State *) { ++inits; }
+  void on_persist_table(lua_State *) {}
+  void on_unpersist_table(lua_State *) {}
+};
+
+int init_counting_feature::inits = 0;
+
+#define MANY_10(M, n)                                                          \
+  M(n##0);                                                                     \
+  M(n##1);                                                                     \
+  M(n##2);                                                                     \
+  M(n##3);                                                                     \
+  M(n##4);                                                                     \
+  M(n##5);                                                                     \
+  M(n##6);                                                                     \
+  M(n##7);                                                                     \
+  M(n##8);                                                                     \
+  M(n##9)
+
+#define MANY_100(M, n)                                                         \
+  MANY_10(M, n##0);                                                            \
+  MANY_10(M, n##1);                                                            \
+  MANY_10(M, n##2);                                                            \
+  MANY_10(M, n##3);                                                            \
+  MANY_10(M, n##4);                                                            \
+  MANY_10(M, n##5);                                                            \
+  MANY_10(M, n##6);                                                            \
+  MANY_10(M, n##7);                                                            \
+  MANY_10(M, n##8);                                                            \
+  MANY_10(M, n##9)
+
+#define MANY_CALLBACK(n) USE_LUA_CALLBACK(cb##n, &owner_type::number<n>)
+#define MANY_FEATURE(n) API_FEATURE(init_counting_feature, feature##n##_)
+
+struct test_api_large : primer::api::base<test_api_large> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, libs_);
+  API_FEATURE(primer::api::callbacks, cb_man_);
+
+  template <int n>
+  primer::result number(lua_State * L) {
+    lua_pushinteger(L, n);
+    return 1;
+  }
+
+  MANY_100(MANY_CALLBACK, 1);
+  MANY_100(MANY_CALLBACK, 2);
+  MANY_100(MANY_FEATURE, 1);
+  MANY_10(MANY_FEATURE, 20);
+  MANY_10(MANY_FEATURE, 21);
+
+  test_api_large()
+    : L_()
+    , cb_man_(this) {
+    this->initialize_api(L_);
+  }
+};
+
+#undef MANY_FEATURE
+#undef MANY_CALLBACK
+#undef MANY_100
+#undef MANY_10
+
+UNIT_TEST(api_many_callbacks) {
+  init_counting_feature::inits = 0;
+  test_api_large a;
+  lua_State * L = a.L_;
+
+  TEST_EQ(test_api_large::callbacks_array().size(), 200u);
+  TEST_EQ(init_counting_feature::inits, 120);
+
+  const char * script =
+    ""
+    "assert(cb100() == 100)                          \n"
+    "assert(cb163() == 163)                          \n"
+    "assert(cb164() == 164)                          \n"
+    "assert(cb227() == 227)                          \n"
+    "assert(cb228() == 228)                          \n"
+    "assert(cb299() == 299)                          \n";
+
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  CHECK_STACK(L, 0);
+}
+
+/***
+ * Test userdata persistence
+ */
+
+struct tstring {
   std::vector<std::string> strs;
 
   // These Ctors should not be necessary but they are to help older compilers
@@ -442,6 +1464,266 @@ UNIT_TEST(api_userdata) {
   }
 }
 
+/***
+ * Test self closures
+ */
+
+// A feature whose functions find it through their upvalue
+struct self_counter {
+  int count = 0;
+
+  static int intf_bump(lua_State * L) {
+    self_counter * self = primer::api::recover_self_upvalue<self_counter>(L);
+    lua_pushinteger(L, ++self->count);
+    return 1;
+  }
+
+  static int intf_peek(lua_State * L) {
+    self_counter * self = primer::api::recover_self_upvalue<self_counter>(L);
+    lua_pushfstring(L, "count %d", self->count);
+    return 1;
+  }
+
+  static const std::vector<luaL_Reg> & get_funcs() {
+    static const std::vector<luaL_Reg> funcs{{"bump", &intf_bump},
+                                             {"peek", &intf_peek}};
+    return funcs;
+  }
+
+  void on_init(lua_State * L) {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    primer::api::set_self_closures(L, get_funcs(), this);
+    lua_pop(L, 1);
+  }
+
+  void on_persist_table(lua_State * L) {
+    primer::api::set_self_closures_prefix_reverse(L, "self_counter__",
+                                                  get_funcs());
+  }
+
+  void on_unpersist_table(lua_State * L) {
+    primer::api::set_self_closures_prefix(L, "self_counter__", get_funcs(),
+                                          this);
+  }
+};
+
+struct test_api_self_bound : primer::api::base<test_api_self_bound> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, libs_);
+  API_FEATURE(self_counter, counter_);
+
+  test_api_self_bound()
+    : L_() {
+    this->initialize_api(L_);
+  }
+
+  std::string save() {
+    std::string result;
+    this->persist(L_, result);
+    return result;
+  }
+
+  void restore(const std::string & buffer) { this->unpersist(L_, buffer); }
+
+  void run(const char * script) {
+    TEST_LUA_OK(L_, luaL_loadstring(L_, script));
+    TEST_EXPECTED(primer::fcn_call_no_ret(L_, 0));
+  }
+};
+
+UNIT_TEST(api_self_closures) {
+  std::string buffer;
+
+  {
+    test_api_self_bound a;
+    // The two functions have their own closures, bound to the same feature
+    a.run("assert(bump ~= peek)                   \n"
+          "assert(bump() == 1 and bump() == 2)    \n"
+          "assert(peek() == 'count 2')            \n"
+          "saved = { bump = bump, peek = peek }   \n");
+    TEST_EQ(a.counter_.count, 2);
+    buffer = a.save();
+  }
+
+  {
+    // After unpersisting, the closures which scripts held are bound to the
+    // restoring feature
+    test_api_self_bound a;
+    a.restore(buffer);
+    a.run("assert(saved.bump == bump and saved.peek == peek)  \n"
+          "assert(saved.bump ~= saved.peek)                   \n"
+          "assert(saved.bump() == 1)                          \n"
+          "assert(saved.peek() == 'count 1')                  \n");
+    TEST_EQ(a.counter_.count, 1);
+
+    // And they persist again
+    buffer = a.save();
+  }
+
+  {
+    test_api_self_bound a;
+    a.restore(buffer);
+    a.run("assert(bump() == 1 and peek() == 'count 1')");
+    TEST_EQ(a.counter_.count, 1);
+  }
+}
+
+/***
+ * Test userdata fields
+ */
+
+struct fpoint {
+  double x;
+  double y;
+
+  primer::result intf_sum(lua_State * L) {
+    lua_pushnumber(L, x + y);
+    return 1;
+  }
+
+  static primer::result intf_create(lua_State * L, double x, double y) {
+    primer::push_udata<fpoint>(L, fpoint{x, y});
+    return 1;
+  }
+};
+
+// A type with its own __persist
+struct fname {
+  std::string name;
+
+  static primer::result intf_create(lua_State * L, std::string s) {
+    primer::push_udata<fname>(L, fname{std::move(s)});
+    return 1;
+  }
+
+  static primer::result intf_reconstruct(lua_State * L) {
+    primer::push_udata<fname>(L,
+                              fname{lua_tostring(L, lua_upvalueindex(1))});
+    return 1;
+  }
+
+  primer::result intf_persist(lua_State * L) {
+    primer::push(L, name);
+    lua_pushcclosure(L, PRIMER_ADAPT(&intf_reconstruct), 1);
+    return 1;
+  }
+
+  primer::result intf_get_name(lua_State * L) {
+    primer::push(L, name);
+    return 1;
+  }
+};
+
+namespace primer {
+namespace traits {
+
+template <>
+struct userdata<fpoint> {
+  static constexpr const char * const name = "fpoint";
+  static constexpr bool fields = true;
+  static const std::vector<luaL_Reg> & metatable() {
+    static const std::vector<luaL_Reg> metatable_array{
+      {"sum", PRIMER_ADAPT_USERDATA(fpoint, &fpoint::intf_sum)}};
+    return metatable_array;
+  }
+};
+
+template <>
+struct userdata<fname> {
+  static constexpr const char * const name = "fname";
+  static constexpr bool fields = true;
+  static const std::vector<luaL_Reg> & metatable() {
+    static const std::vector<luaL_Reg> metatable_array{
+      {"__persist", PRIMER_ADAPT_USERDATA(fname, &fname::intf_persist)},
+      {"get_name", PRIMER_ADAPT_USERDATA(fname, &fname::intf_get_name)}};
+    return metatable_array;
+  }
+  static const luaL_Reg * permanents() {
+    static constexpr auto permanents_array = std::array<luaL_Reg, 2>{
+      {{"fname_reconstruct", PRIMER_ADAPT(&fname::intf_reconstruct)},
+       {nullptr, nullptr}}};
+    return permanents_array.data();
+  }
+};
+
+} // end namespace traits
+} // end namespace primer
+
+static_assert(primer::detail::udata_has_fields<fpoint>::value, "");
+static_assert(!primer::detail::udata_has_fields<tstring>::value, "");
+static_assert(primer::detail::udata_user_values<fpoint>::value == 1, "");
+
+struct test_api_fields : primer::api::base<test_api_fields> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, libs_);
+  API_FEATURE(primer::api::callbacks, cb_man_);
+  using fields_udatas = primer::api::userdatas<fpoint, fname>;
+  API_FEATURE(fields_udatas, udata_man_);
+
+  USE_LUA_CALLBACK(point, "creates a point", &fpoint::intf_create);
+  USE_LUA_CALLBACK(named, "creates a name", &fname::intf_create);
+
+  test_api_fields()
+    : L_()
+    , cb_man_(this) {
+    this->initialize_api(L_);
+  }
+
+  std::string save() {
+    std::string result;
+    this->persist(L_, result);
+    return result;
+  }
+
+  void restore(const std::string & buffer) { this->unpersist(L_, buffer); }
+};
+
+UNIT_TEST(api_userdata_fields) {
+  std::string buffer;
+
+  {
+    test_api_fields a;
+    const char * script =
+      "p = point(1, 2)                                 \n"
+      "assert(p.color == nil)                          \n"
+      "p.color = 'red'                                 \n"
+      "p[1] = true                                     \n"
+      "assert(p.color == 'red' and p[1] == true)       \n"
+      "assert(p:sum() == 3)                            \n"
+      "p.sum = 'shadowed'                              \n"
+      "assert(p:sum() == 3)                            \n"
+      "q = point(3, 4)                                 \n"
+      "assert(q.color == nil)                          \n"
+      "n = named('bob')                                \n"
+      "n.age = 7                                       \n"
+      "m = named('alice')                              \n";
+    TEST_LUA_OK(a.L_, luaL_loadstring(a.L_, script));
+    TEST_EXPECTED(primer::fcn_call_no_ret(a.L_, 0));
+
+    lua_getglobal(a.L_, "p");
+    fpoint * p = primer::test_udata<fpoint>(a.L_, -1);
+    TEST(p, "expected a point");
+    TEST_EQ(p->y, 2);
+    lua_pop(a.L_, 1);
+    buffer = a.save();
+  }
+
+  {
+    test_api_fields a;
+    a.restore(buffer);
+    const char * script =
+      "assert(p.color == 'red' and p[1] == true)       \n"
+      "assert(p:sum() == 3)                            \n"
+      "assert(q:sum() == 7 and q.color == nil)         \n"
+      "assert(n:get_name() == 'bob' and n.age == 7)    \n"
+      "assert(m:get_name() == 'alice' and m.age == nil)\n";
+    TEST_LUA_OK(a.L_, luaL_loadstring(a.L_, script));
+    TEST_EXPECTED(primer::fcn_call_no_ret(a.L_, 0));
+  }
+}
+
 static_assert(
   !primer::api::
     is_serial_feature<primer::api::libraries<primer::api::lua_base_lib>>::value,
@@ -515,49 +1797,314 @@ UNIT_TEST(persistent_value) {
   }
 }
 
-struct test_api_five : primer::api::base<test_api_five> {
-  lua_raii L_;
-
-  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+using big_map_t = std::map<std::string, std::vector<int>>;
+using binary_map_t =
+  primer::api::persistent_value<big_map_t, primer::api::binary_encoding>;
 
-  USE_LUA_CALLBACK(require, "this is the require function",
-                   &primer::api::mini_require);
+struct test_api_binary : primer::api::base<test_api_binary> {
+  lua_raii L_;
 
-  API_FEATURE(primer::api::callbacks, cb_);
+  API_FEATURE(binary_map_t, map_);
 
-  test_api_five()
+  test_api_binary()
     : L_()
-    , cb_(this) {
+    , map_() {
     this->initialize_api(L_);
   }
-};
-
-UNIT_TEST(sandboxed_libs) {
-  test_api_five a;
 
-  lua_State * L = a.L_;
+  std::string save() {
+    std::string result;
+    this->persist(L_, result);
+    return result;
+  }
 
-  const char * script =
-    "t = { 4, 5 }                           \n"
-    "x, y = table.unpack(t)                 \n"
-    "assert(x == 4)                         \n"
-    "assert(y == 5)                         \n"
-    "local tablib = require \'table\'       \n"
-    "assert(tablib == table)                \n"
-    "assert(math.sin)                       \n"
-    "assert(not math.random)                \n";
+  primer::expected<void> restore(const std::string & buffer) {
+    return this->unpersist(L_, buffer);
+  }
 
-  TEST_LUA_OK(L, luaL_loadstring(L, script));
-  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
-}
+  big_map_t & get_map() { return map_.get(); }
+};
 
-struct test_api_six : primer::api::base<test_api_six> {
+struct test_api_tables : primer::api::base<test_api_tables> {
   lua_raii L_;
 
-  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+  API_FEATURE(primer::api::persistent_value<big_map_t>, map_);
 
-  USE_LUA_CALLBACK(require, "this is the require function",
-                   &primer::api::mini_require);
+  test_api_tables()
+    : L_()
+    , map_() {
+    this->initialize_api(L_);
+  }
+
+  std::string save() {
+    std::string result;
+    this->persist(L_, result);
+    return result;
+  }
+};
+
+UNIT_TEST(persistent_value_binary) {
+  std::string buffer;
+  big_map_t expected;
+  for (int i = 0; i < 100; ++i) {
+    auto & v = expected["key" + std::to_string(i)];
+    for (int j = 0; j < i; ++j) {
+      v.push_back(i * j);
+    }
+  }
+
+  {
+    test_api_binary a;
+    a.get_map() = expected;
+    buffer = a.save();
+    a.get_map().clear();
+    TEST_EXPECTED(a.restore(buffer));
+    TEST(a.get_map() == expected, "binary persistent value was not restored");
+  }
+
+  {
+    test_api_binary a;
+    TEST_EXPECTED(a.restore(buffer));
+    TEST(a.get_map() == expected, "binary persistent value was not restored");
+
+    // A plain persistent value of the same type makes a bigger snapshot, since
+    // eris serializes all of the tables.
+    test_api_tables b;
+    b.map_.get() = expected;
+    std::string tables_buffer = b.save();
+    TEST(buffer.size() < tables_buffer.size(),
+         "binary snapshot was not smaller");
+  }
+}
+
+// Counts how often the permanent objects tables are built
+struct counting_feature {
+  int persist_tables = 0;
+  int unpersist_tables = 0;
+
+  void on_init(lua_State *) {}
+  void on_persist_table(lua_State *) { ++persist_tables; }
+  void on_unpersist_table(lua_State *) { ++unpersist_tables; }
+};
+
+struct test_api_counting : primer::api::base<test_api_counting> {
+  lua_raii L_;
+
+  API_FEATURE(counting_feature, counter_);
+
+  test_api_counting()
+    : L_()
+    , counter_() {
+    this->initialize_api(L_);
+  }
+
+  std::string save() {
+    std::string result;
+    this->persist(L_, result);
+    return result;
+  }
+
+  void restore(const std::string & buffer) { this->unpersist(L_, buffer); }
+  void reinit() { this->initialize_api(L_); }
+  void invalidate() { this->invalidate_permanents(L_); }
+};
+
+UNIT_TEST(permanents_cache) {
+  test_api_counting a;
+  std::string buffer = a.save();
+  TEST_EQ(buffer, a.save());
+  TEST_EQ(a.save(), a.save());
+  TEST_EQ(1, a.counter_.persist_tables);
+
+  a.restore(buffer);
+  a.restore(buffer);
+  TEST_EQ(1, a.counter_.unpersist_tables);
+
+  a.reinit();
+  a.save();
+  a.restore(buffer);
+  TEST_EQ(2, a.counter_.persist_tables);
+  TEST_EQ(2, a.counter_.unpersist_tables);
+
+  a.invalidate();
+  a.save();
+  TEST_EQ(3, a.counter_.persist_tables);
+  CHECK_STACK(a.L_, 0);
+}
+
+struct test_api_timed : primer::api::base<test_api_timed> {
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, libs_);
+  API_FEATURE(counting_feature, counter_);
+
+  lua_State * L_;
+
+  explicit test_api_timed(lua_State * L)
+    : L_(L) {
+    this->initialize_api(L_);
+  }
+
+  primer::expected<void> save(std::string & buffer) {
+    return this->persist(L_, buffer);
+  }
+  primer::expected<void> restore(const std::string & buffer) {
+    return this->unpersist(L_, buffer);
+  }
+};
+
+UNIT_TEST(feature_timings) {
+  using timings_t = primer::api::feature_timings;
+  lua_raii L;
+  timings_t timings;
+  TEST_EXPECTED(timings.attach(L));
+  TEST_EQ(&timings, timings_t::get(L));
+
+  test_api_timed api{L};
+  TEST_EQ(2u, timings.entries().size());
+  const timings_t::entry * init = timings.find("libs_", "on_init");
+  TEST(init, "expected an entry for libs_");
+  TEST_EQ(1u, init->calls);
+  TEST(init->bytes > 0, "expected the base library to allocate");
+  TEST(timings.find("counter_", "on_init"), "expected an entry");
+
+  std::string buffer;
+  TEST_EXPECTED(api.save(buffer));
+  TEST(timings.find("libs_", "on_persist_table"), "expected an entry");
+  TEST(timings.find("counter_", "on_serialize"), "expected an entry");
+  TEST_EXPECTED(api.restore(buffer));
+  TEST(timings.find("counter_", "on_unpersist_table"), "expected an entry");
+  TEST(timings.find("counter_", "on_deserialize"), "expected an entry");
+  TEST(!timings.find("counter_", "on_persist"), "unexpected entry");
+
+  // The permanents tables are cached
+  TEST_EXPECTED(api.save(buffer));
+  TEST_EQ(1u, timings.find("libs_", "on_persist_table")->calls);
+  TEST_EQ(2u, timings.find("counter_", "on_serialize")->calls);
+
+  const std::string init_breakdown = timings.breakdown("on_init");
+  TEST_EQ(0u, init_breakdown.find("libs_: "));
+  TEST(init_breakdown.find(", counter_: ") != std::string::npos,
+       "unexpected breakdown: " << init_breakdown);
+  TEST(timings.breakdown().find("libs_: ") == 0, "expected libs_ first");
+
+  timings_t::detach(L);
+  TEST(!timings_t::get(L), "expected detached");
+  timings.clear();
+  TEST_EXPECTED(api.save(buffer));
+  TEST_EQ(0u, timings.entries().size());
+  CHECK_STACK(L, 0);
+}
+
+struct test_api_five : primer::api::base<test_api_five> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+
+  USE_LUA_CALLBACK(require, "this is the require function",
+                   &primer::api::mini_require);
+
+  API_FEATURE(primer::api::callbacks, cb_);
+
+  test_api_five()
+    : L_()
+    , cb_(this) {
+    this->initialize_api(L_);
+  }
+};
+
+UNIT_TEST(sandboxed_libs) {
+  test_api_five a;
+
+  lua_State * L = a.L_;
+
+  const char * script =
+    "t = { 4, 5 }                           \n"
+    "x, y = table.unpack(t)                 \n"
+    "assert(x == 4)                         \n"
+    "assert(y == 5)                         \n"
+    "local tablib = require \'table\'       \n"
+    "assert(tablib == table)                \n"
+    "assert(math.sin)                       \n"
+    "assert(not math.random)                \n";
+
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+}
+
+using test_lazy_libraries =
+  primer::api::libraries<primer::api::lua_base_lib_sandboxed,
+                         primer::api::lua_table_lib,
+                         primer::api::lazy<primer::api::lua_math_lib_sandboxed>,
+                         primer::api::lazy<primer::api::lua_coroutine_lib>>;
+
+struct test_api_lazy : primer::api::base<test_api_lazy> {
+  lua_raii L_;
+
+  API_FEATURE(test_lazy_libraries, libs_);
+
+  test_api_lazy()
+    : L_() {
+    this->initialize_api(L_);
+  }
+
+  void run(const char * script) {
+    TEST_LUA_OK(L_, luaL_loadstring(L_, script));
+    TEST_LUA_OK(L_, lua_pcall(L_, 0, 0, 0));
+  }
+
+  std::string save() {
+    std::string result;
+    TEST_EXPECTED(this->persist(L_, result));
+    return result;
+  }
+
+  void restore(const std::string & buffer) {
+    TEST_EXPECTED(this->unpersist(L_, buffer));
+  }
+};
+
+UNIT_TEST(lazy_libs) {
+  std::string buffer;
+  {
+    test_api_lazy a;
+    lua_State * L = a.L_;
+
+    // Nothing is opened until it is used
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+    TEST_EQ(LUA_TNIL, lua_getfield(L, -1, "math"));
+    TEST_EQ(LUA_TNIL, lua_getfield(L, -2, "coroutine"));
+    lua_pop(L, 3);
+
+    a.run("assert(rawget(_G, 'math') == nil)                              \n"
+          "assert(math.sin)                                               \n"
+          "assert(not math.random)                                        \n"
+          "assert(rawget(_G, 'math') == math)                             \n"
+          "assert(table.unpack)                                           \n"
+          "assert(rawget(_G, 'coroutine') == nil)                         \n"
+          "f = function(x) return math.floor(x) end                       \n");
+    CHECK_STACK(L, 0);
+    buffer = a.save();
+  }
+
+  {
+    test_api_lazy a;
+    a.restore(buffer);
+    a.run("assert(f(2.5) == 2)                                            \n"
+          "assert(rawget(_G, 'coroutine') == nil)                         \n"
+          "local co = coroutine.wrap(function() coroutine.yield(7) end)   \n"
+          "assert(co() == 7)                                              \n"
+          "coroutine = nil                                                \n"
+          "assert(coroutine == nil)                                       \n");
+    CHECK_STACK(a.L_, 0);
+  }
+}
+
+struct test_api_six : primer::api::base<test_api_six> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+
+  USE_LUA_CALLBACK(require, "this is the require function",
+                   &primer::api::mini_require);
 
   API_FEATURE(primer::api::callbacks, cb_);
   API_FEATURE(primer::api::print_manager, print_man_);
@@ -613,6 +2160,295 @@ UNIT_TEST(api_interpreter_context) {
   TEST_EQ(c.new_text_calls_[4], "$ foo.bar");
 }
 
+UNIT_TEST(api_interpreter_cache) {
+  test_api_six a;
+  lua_State * L = a.L_;
+
+  interpreter_capture c;
+  a.print_man_.set_interpreter_context(&c);
+  a.print_man_.set_interpreter_cache_size(L, 2);
+
+  for (int i = 1; i <= 3; ++i) {
+    a.print_man_.handle_interpreter_input(L, "x = (x or 0) + 1");
+    a.print_man_.handle_interpreter_input(L, "x");
+  }
+  TEST_EQ(a.print_man_.interpreter_cache_size(), 2u);
+  TEST_EQ(c.new_text_calls_.size(), 9u);
+  TEST_EQ(c.new_text_calls_[7], "$ x");
+  TEST_EQ(c.new_text_calls_[8], "3");
+  TEST_EQ(c.error_text_calls_.size(), 0u);
+
+  // The least recently used command is dropped
+  a.print_man_.handle_interpreter_input(L, "y");
+  TEST_EQ(a.print_man_.interpreter_cache_size(), 2u);
+  a.print_man_.handle_interpreter_input(L, "x");
+  TEST_EQ(c.new_text_calls_.back(), "3");
+
+  // A cached command follows the globals when they are replaced
+  TEST_LUA_OK(L, luaL_loadstring(
+                   L, "return setmetatable({ y = 7 }, { __index = _G })"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  lua_rawseti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+  a.print_man_.handle_interpreter_input(L, "y");
+  TEST_EQ(c.new_text_calls_.back(), "7");
+
+  // The user's `_pretty_print` is left alone
+  a.print_man_.handle_interpreter_input(L, "_pretty_print = 5");
+  a.print_man_.handle_interpreter_input(L, "y");
+  TEST_EQ(c.new_text_calls_.back(), "7");
+  a.print_man_.handle_interpreter_input(L, "_pretty_print");
+  TEST_EQ(c.new_text_calls_.back(), "5");
+
+  a.print_man_.set_interpreter_cache_size(L, 0);
+  TEST_EQ(a.print_man_.interpreter_cache_size(), 0u);
+  TEST_EQ(c.error_text_calls_.size(), 0u);
+  a.print_man_.pop_interpreter_context();
+}
+
+struct block_capture {
+  std::vector<std::string> blocks_;
+  std::vector<std::string> error_text_calls_;
+
+  void new_text(const std::string & str) { blocks_.push_back("line:" + str); }
+  void new_text_block(primer::lua_string_view v) { blocks_.push_back(v.str()); }
+  void error_text(const std::string & str) { error_text_calls_.push_back(str); }
+  void clear_input() {}
+};
+
+UNIT_TEST(api_print_buffered) {
+  test_api_six a;
+  lua_State * L = a.L_;
+
+  {
+    block_capture c;
+    a.print_man_.set_interpreter_context(&c);
+    a.print_man_.set_buffered(1 << 16);
+    TEST(a.print_man_.buffered(), "expected buffered mode");
+
+    TEST_LUA_OK(L, luaL_loadstring(L, "for i = 1, 3 do print(i, 'x') end"));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    TEST_EQ(c.blocks_.size(), 0u);
+
+    a.print_man_.flush();
+    TEST_EQ(c.blocks_.size(), 1u);
+    TEST_EQ(c.blocks_[0], "1\tx\n2\tx\n3\tx\n");
+    a.print_man_.flush();
+    TEST_EQ(c.blocks_.size(), 1u);
+
+    // Reaching the limit delivers the batch
+    a.print_man_.set_buffered(8);
+    TEST_LUA_OK(L, luaL_loadstring(L, "print('abc') print('defgh')"));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    TEST_EQ(c.blocks_.size(), 2u);
+    TEST_EQ(c.blocks_[1], "abc\ndefgh\n");
+
+    // Errors are not reordered before the buffered output
+    a.print_man_.set_buffered(1 << 16);
+    a.print_man_.handle_interpreter_input(L, "print('q') error('e')");
+    TEST_EQ(c.blocks_.size(), 3u);
+    TEST_EQ(c.blocks_[2], "$ print('q') error('e')\nq\n");
+    TEST_EQ(c.error_text_calls_.size(), 1u);
+
+    // A string builder is printed from its own buffer
+    lua_pushcfunction(L, &primer::intf_new_string_builder);
+    lua_setglobal(L, "string_builder");
+    TEST_LUA_OK(L, luaL_loadstring(L, "local b = string_builder()      \n"
+                                      "b:append('s', 1)                \n"
+                                      "print(b, 'z')"));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    a.print_man_.flush();
+    TEST_EQ(c.blocks_.size(), 4u);
+    TEST_EQ(c.blocks_[3], "s1\tz\n");
+    a.print_man_.pop_interpreter_context();
+  }
+
+  {
+    // A context without `new_text_block` gets the lines one at a time
+    interpreter_capture c;
+    a.print_man_.set_interpreter_context(&c);
+    TEST_LUA_OK(L, luaL_loadstring(L, "print('a') print('b', 'c')"));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    a.print_man_.pop_interpreter_context();
+    TEST_EQ(c.new_text_calls_.size(), 2u);
+    TEST_EQ(c.new_text_calls_[0], "a");
+    TEST_EQ(c.new_text_calls_[1], "b\tc");
+  }
+
+  a.print_man_.set_unbuffered();
+  TEST(!a.print_man_.buffered(), "expected unbuffered mode");
+}
+
+UNIT_TEST(api_print_ring) {
+  using primer::api::print_ring;
+
+  constexpr int vms = 3;
+  constexpr int lines = 200;
+
+  primer::api::print_ring_consumer consumer;
+  std::vector<std::shared_ptr<print_ring>> rings;
+  for (int i = 0; i < vms; ++i) {
+    rings.emplace_back(std::make_shared<print_ring>(1 << 16, i));
+    consumer.add(rings.back());
+  }
+  TEST_EQ(consumer.size(), static_cast<std::size_t>(vms));
+
+  std::vector<std::thread> workers;
+  for (int i = 0; i < vms; ++i) {
+    print_ring * ring = rings[i].get();
+    workers.emplace_back([ring, i]() {
+      test_api_six a;
+      a.print_man_.set_interpreter_context(ring);
+      // One of them batches its output
+      if (i == 1) { a.print_man_.set_buffered(256); }
+      luaL_loadstring(a.L_, "for n = 1, 200 do print(n) end error('done')");
+      lua_pcall(a.L_, 0, 0, 0);
+      a.print_man_.error_text("done");
+      a.print_man_.pop_interpreter_context();
+    });
+  }
+
+  // Every line arrives, in order for each ring, then the error
+  std::vector<int> next(vms, 1);
+  std::vector<bool> finished(vms, false);
+  int finished_count = 0;
+  while (finished_count < vms) {
+    consumer.drain([&](const print_ring & r, print_ring::kind k,
+                       const std::string & text) {
+      const std::size_t id = r.id();
+      if (k == print_ring::kind::error) {
+        TEST_EQ(text, "done\n");
+        TEST_EQ(next[id], lines + 1);
+        finished[id] = true;
+        ++finished_count;
+        return;
+      }
+      std::istringstream ss{text};
+      std::string line;
+      while (std::getline(ss, line)) {
+        TEST_EQ(line, std::to_string(next[id]));
+        ++next[id];
+      }
+    });
+    std::this_thread::yield();
+  }
+  for (auto & w : workers) {
+    w.join();
+  }
+  for (const auto & r : rings) {
+    TEST_EQ(r->dropped(), 0u);
+  }
+  TEST_EQ(consumer.drain([](const print_ring &, print_ring::kind,
+                            const std::string &) {}),
+          0u);
+
+  // Text which doesn't fit is dropped, rather than waited on
+  {
+    print_ring small{64};
+    TEST_EQ(small.capacity(), 64u);
+    small.new_text(std::string(100, 'x'));
+    small.new_text("fits");
+    TEST_EQ(small.dropped(), 1u);
+
+    primer::api::print_ring_consumer c;
+    std::shared_ptr<print_ring> ptr{std::shared_ptr<print_ring>{}, &small};
+    c.add(ptr);
+    std::string got;
+    c.drain([&](const print_ring &, print_ring::kind, const std::string & t) {
+      got += t;
+    });
+    TEST_EQ(got, "fits\n");
+    c.remove(&small);
+    TEST_EQ(c.size(), 0u);
+  }
+}
+
+struct test_api_logging : primer::api::base<test_api_logging> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, libs_);
+  API_FEATURE(primer::api::log, log_);
+
+  test_api_logging()
+    : L_() {
+    this->initialize_api(L_);
+  }
+
+  primer::expected<void> save(std::string & buffer) {
+    return this->persist(L_, buffer);
+  }
+  primer::expected<void> restore(const std::string & buffer) {
+    return this->unpersist(L_, buffer);
+  }
+};
+
+UNIT_TEST(api_log) {
+  using primer::api::log_level;
+  using primer::api::log_record;
+  using primer::api::log_ring;
+  using primer::api::log_value;
+
+  test_api_logging a;
+  lua_State * L = a.L_;
+  primer::api::log_consumer consumer;
+  consumer.add(a.log_.ring());
+
+  std::vector<std::string> lines;
+  std::vector<log_level> levels;
+  auto drain = [&]() {
+    return consumer.drain([&](const log_ring &, const log_record & r) {
+      lines.push_back(r.format());
+      levels.push_back(r.level());
+    });
+  };
+
+  // Filtered calls don't look at their arguments
+  const char * script =
+    "local t = setmetatable({}, {__tostring = error})               \n"
+    "log.debug('hidden', t)                                         \n"
+    "log.trace()                                                    \n"
+    "assert(not log.enabled('debug') and log.enabled('warn'))       \n"
+    "assert(not pcall(log.enabled, 'loud'))                         \n"
+    "log.info('spawned', 7, 0.5, true, nil, t)                      \n"
+    "log.error()                                                    \n";
+  TEST_LUA_OK(L, luaL_dostring(L, script));
+  const auto before = std::chrono::system_clock::now();
+  TEST_EQ(drain(), 2u);
+  TEST_EQ(lines[0], "spawned\t7\t0.5\ttrue\tnil\t<table>");
+  TEST_EQ(lines[1], "");
+  TEST(levels[0] == log_level::info, "expected info");
+  TEST(levels[1] == log_level::error, "expected error");
+
+  // The values are typed, and the time is when they were logged
+  a.log_.set_level(log_level::trace);
+  TEST_LUA_OK(L, luaL_dostring(L, "log.trace(1, 'x')"));
+  consumer.drain([&](const log_ring &, const log_record & r) {
+    TEST_EQ(r.values().size(), 2u);
+    TEST(r.values()[0].type == log_value::kind::integer, "expected integer");
+    TEST_EQ(r.values()[0].integer, 1);
+    TEST(r.values()[1].type == log_value::kind::string, "expected string");
+    TEST(r.time() >= before, "expected a later time");
+  });
+
+  // The functions survive persistence
+  std::string buffer;
+  TEST_LUA_OK(L, luaL_dostring(L, "f = log.warn"));
+  TEST_EXPECTED(a.save(buffer));
+  TEST_EXPECTED(a.restore(buffer));
+  lines.clear();
+  TEST_LUA_OK(L, luaL_dostring(L, "f('after') log.warn('again')"));
+  TEST_EQ(drain(), 2u);
+  TEST_EQ(lines[0], "after");
+  TEST_EQ(lines[1], "again");
+
+  // Records which don't fit are dropped, rather than waited on
+  a.log_.set_ring(std::make_shared<log_ring>(64));
+  const std::string big = "log.warn('" + std::string(100, 'x') + "')";
+  TEST_LUA_OK(L, luaL_dostring(L, big.c_str()));
+  TEST_LUA_OK(L, luaL_dostring(L, "log.warn('fits')"));
+  TEST_EQ(a.log_.ring()->dropped(), 1u);
+  CHECK_STACK(L, 0);
+}
+
 //[ primer_vfs_example
 // Model of vfs provider concept
 struct my_files : primer::api::vfs<my_files> {
@@ -717,6 +2553,3370 @@ UNIT_TEST(api_vfs) {
 }
 //]
 
+// Removes a directory made by a test, and everything in it
+static void
+remove_test_dir(const std::string & dir) {
+  if (DIR * d = opendir(dir.c_str())) {
+    while (dirent * ent = readdir(d)) {
+      if (ent->d_name[0] != '.') {
+        const std::string name = dir + "/" + ent->d_name;
+        remove_test_dir(name);
+        std::remove(name.c_str());
+      }
+    }
+    closedir(d);
+  }
+  rmdir(dir.c_str());
+}
+
+// vfs provider which compiles through a bytecode cache
+struct cached_files : primer::api::vfs<cached_files> {
+  using map_t = std::map<std::string, std::string>;
+  map_t files_;
+  primer::api::bytecode_cache * cache_;
+
+  cached_files(map_t m, primer::api::bytecode_cache * c)
+    : files_(std::move(m))
+    , cache_(c) {}
+
+  primer::expected<void> load(lua_State * L, const std::string & path) {
+    auto it = files_.find(path);
+    if (it == files_.end()) { return primer::error::module_not_found(path); }
+    return cache_->load(L, path, it->second);
+  }
+
+  std::uint64_t source_hash(const std::string & path) const {
+    auto it = files_.find(path);
+    if (it == files_.end()) { return 0; }
+    return primer::api::bytecode_cache::hash_source(it->second);
+  }
+};
+
+struct test_api_cached : primer::api::base<test_api_cached> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+  API_FEATURE(cached_files, vfs_);
+
+  test_api_cached(cached_files::map_t m, primer::api::bytecode_cache * c)
+    : L_()
+    , vfs_{std::move(m), c} {
+    this->initialize_api(L_);
+  }
+};
+
+UNIT_TEST(bytecode_cache) {
+  const char * script =
+    "local bar = require 'bar'                                             \n"
+    "assert(5 == bar.baz())                                                \n"
+    "assert(not pcall(require, 'bad'))                                     \n";
+
+  cached_files::map_t files{
+    {"bar", "local function baz() return 5 end; return { baz = baz }"},
+    {"bad", "return {"}};
+
+  char dir[] = "/tmp/primer_bytecode_XXXXXX";
+  TEST(mkdtemp(dir), "could not create a temporary directory");
+
+  {
+    primer::api::bytecode_cache cache{dir};
+    for (int i = 0; i < 3; ++i) {
+      test_api_cached a{files, &cache};
+      TEST_LUA_OK(a.L_, luaL_loadstring(a.L_, script));
+      TEST_LUA_OK(a.L_, lua_pcall(a.L_, 0, 0, 0));
+    }
+    TEST_EQ(cache.misses(), 1u);
+    TEST_EQ(cache.hits(), 2u);
+    TEST_EQ(cache.disk_hits(), 0u);
+
+    // A change to the source is compiled again
+    files["bar"] = "return { baz = function() return 5 end }";
+    test_api_cached a{files, &cache};
+    TEST_LUA_OK(a.L_, luaL_loadstring(a.L_, script));
+    TEST_LUA_OK(a.L_, lua_pcall(a.L_, 0, 0, 0));
+    TEST_EQ(cache.misses(), 2u);
+  }
+
+  // A new cache finds the compiled chunk in the directory
+  {
+    primer::api::bytecode_cache cache{dir};
+    test_api_cached a{files, &cache};
+    TEST_LUA_OK(a.L_, luaL_loadstring(a.L_, script));
+    TEST_LUA_OK(a.L_, lua_pcall(a.L_, 0, 0, 0));
+    TEST_EQ(cache.misses(), 0u);
+    TEST_EQ(cache.disk_hits(), 1u);
+  }
+
+  remove_test_dir(dir);
+}
+
+UNIT_TEST(vfs_prefetch) {
+  cached_files::map_t files;
+  std::vector<std::string> paths;
+  for (int i = 0; i < 16; ++i) {
+    const std::string name = "m" + std::to_string(i);
+    files[name] = "return " + std::to_string(i);
+    paths.push_back(name);
+  }
+  files["bad"] = "return {";
+  paths.push_back("bad");
+  paths.push_back("missing");
+
+  primer::api::bytecode_cache cache;
+  cached_files provider{files, &cache};
+  auto results = primer::api::prefetch_modules(provider, paths, 4);
+  TEST_EQ(results.size(), paths.size());
+  for (int i = 0; i < 16; ++i) {
+    TEST_EXPECTED(results[i]);
+  }
+  TEST(!results[16], "expected a syntax error");
+  TEST(!results[17], "expected a missing module");
+  TEST_EQ(cache.misses(), 16u);
+
+  // Requiring the modules only loads their bytecode
+  test_api_cached a{files, &cache};
+  const char * script = "assert(require 'm3' == 3)      \n"
+                        "assert(require 'm15' == 15)    \n";
+  TEST_LUA_OK(a.L_, luaL_loadstring(a.L_, script));
+  TEST_LUA_OK(a.L_, lua_pcall(a.L_, 0, 0, 0));
+  TEST_EQ(cache.misses(), 16u);
+  TEST_EQ(cache.hits(), 2u);
+
+  files["m0"] = "return 'changed'";
+  cached_files provider2{files, &cache};
+  auto f = primer::api::prefetch_modules_async(provider2, {"m0"});
+  auto results2 = f.get();
+  TEST_EQ(results2.size(), 1u);
+  TEST_EXPECTED(results2[0]);
+  TEST_EQ(cache.misses(), 17u);
+}
+
+UNIT_TEST(vfs_startup_profile) {
+  cached_files::map_t files{
+    {"main", "local a = require 'a'; local b = require 'b'; return a + b"},
+    {"a", "return require 'c' + 1"},
+    {"b", "return require 'c' + 2"},
+    {"c", "return 10"},
+    {"bad", "error 'oops'"}};
+
+  primer::api::bytecode_cache cache;
+  std::string text;
+  {
+    test_api_cached a{files, &cache};
+    const char * script = "assert(require 'main' == 23)   \n"
+                          "assert(not pcall(require, 'bad'))\n"
+                          "assert(not pcall(require, 'missing'))\n";
+    TEST_LUA_OK(a.L_, luaL_loadstring(a.L_, script));
+    TEST_LUA_OK(a.L_, lua_pcall(a.L_, 0, 0, 0));
+
+    const std::vector<std::string> expected{"main", "a", "c", "b", "bad"};
+    TEST(a.vfs_.startup_profile() == expected, "unexpected profile");
+    text = primer::api::write_startup_profile(a.vfs_.startup_profile());
+    TEST_EQ(text, "main\na\nc\nb\nbad\n");
+  }
+  TEST_EQ(cache.misses(), 5u);
+
+  auto paths = primer::api::read_startup_profile("main\r\n\na\nc\nb");
+  TEST_EQ(paths.size(), 4u);
+  TEST_EQ(paths[0], "main");
+  TEST_EQ(paths[3], "b");
+
+  // The next run prefetches the profile, and then only loads bytecode
+  files["c"] = "return 20";
+  primer::api::bytecode_cache cache2;
+  cached_files provider{files, &cache2};
+  auto results = primer::api::prefetch_modules(
+    provider, primer::api::read_startup_profile(text), 2);
+  TEST_EQ(results.size(), 5u);
+  TEST_EQ(cache2.misses(), 5u);
+
+  test_api_cached a{files, &cache2};
+  TEST_LUA_OK(a.L_, luaL_loadstring(a.L_, "assert(require 'main' == 43)"));
+  TEST_LUA_OK(a.L_, lua_pcall(a.L_, 0, 0, 0));
+  TEST_EQ(cache2.misses(), 5u);
+  TEST_EQ(cache2.hits(), 4u);
+}
+
+UNIT_TEST(vfs_reload) {
+  cached_files::map_t files{
+    {"a", "return { v = 1 }"},
+    {"b", "local a = require 'a'; return { v = a.v + 10 }"},
+    {"c", "return { v = 100 }"},
+    {"d", "local b = require 'b'; return { v = b.v * 2 }"}};
+
+  primer::api::bytecode_cache cache;
+  test_api_cached a{files, &cache};
+  lua_State * L = a.L_;
+
+  const char * script = "D = require 'd'; C = require 'c'\n"
+                        "assert(D.v == 22)\n";
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  TEST(a.vfs_.changed_modules().empty(), "expected no changes");
+
+  // Only the change and its dependents are loaded again
+  a.vfs_.files_["a"] = "return { v = 2 }";
+  auto changed = a.vfs_.changed_modules();
+  TEST_EQ(changed.size(), 1u);
+  TEST_EQ(changed[0], "a");
+  auto reloaded = a.vfs_.reload(L, changed);
+  TEST_EXPECTED(reloaded);
+  CHECK_STACK(L, 0);
+  TEST_EQ(reloaded->size(), 3u);
+  TEST_EQ((*reloaded)[0], "a");
+  TEST_EQ((*reloaded)[1], "b");
+  TEST_EQ((*reloaded)[2], "d");
+  TEST(a.vfs_.changed_modules().empty(), "expected no changes");
+
+  const char * check = "assert(require 'd' ~= D)\n"
+                       "assert(require 'd'.v == 24)\n"
+                       "assert(require 'c' == C)\n";
+  TEST_LUA_OK(L, luaL_loadstring(L, check));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  // A failure keeps the old values of the modules which weren't reloaded
+  a.vfs_.files_["b"] = "return {";
+  auto failed = a.vfs_.reload(L, {"b"});
+  TEST(!failed, "expected a syntax error");
+  CHECK_STACK(L, 0);
+  const char * check2 = "assert(require 'd'.v == 24)\n"
+                        "assert(require 'b'.v == 12)\n";
+  TEST_LUA_OK(L, luaL_loadstring(L, check2));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  // Modules which were never required are skipped
+  auto none = a.vfs_.reload(L, {"e"});
+  TEST_EXPECTED(none);
+  TEST(none->empty(), "expected nothing to reload");
+}
+
+struct test_api_mapped : primer::api::base<test_api_mapped> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+  API_FEATURE(primer::api::mapped_vfs, vfs_);
+
+  explicit test_api_mapped(const std::string & root)
+    : L_()
+    , vfs_{root} {
+    this->initialize_api(L_);
+  }
+};
+
+UNIT_TEST(mapped_vfs) {
+  char dir[] = "/tmp/primer_mapped_XXXXXX";
+  TEST(mkdtemp(dir), "could not create a temporary directory");
+  const std::string root{dir};
+  TEST_EQ(0, mkdir((root + "/pkg").c_str(), 0700));
+  std::ofstream{root + "/foo.lua"} << "return { x = 5 }";
+  std::ofstream{root + "/pkg/init.lua"} << "return { name = 'pkg' }";
+  std::ofstream{root + "/pkg/sub.lua"} << "return { name = 'sub' }";
+  std::ofstream{root + "/bad.lua"} << "return {";
+
+  const char * script =
+    "assert(5 == require('foo').x)                                         \n"
+    "assert('pkg' == require('pkg').name)                                  \n"
+    "assert('sub' == require('pkg.sub').name)                              \n"
+    "assert(type(loadfile 'foo') == 'function')                            \n"
+    "assert(not pcall(require, 'missing'))                                 \n"
+    "assert(not pcall(require, 'bad'))                                     \n"
+    "assert(not pcall(require, '..foo'))                                   \n"
+    "assert(not pcall(require, 'pkg/sub'))                                 \n";
+
+  for (int i = 0; i < 2; ++i) {
+    test_api_mapped a{root};
+    TEST_LUA_OK(a.L_, luaL_loadstring(a.L_, script));
+    TEST_LUA_OK(a.L_, lua_pcall(a.L_, 0, 0, 0));
+  }
+
+  // One mapping is shared, until the file changes
+  auto m1 = primer::mapped_file::open(root + "/foo.lua");
+  auto m2 = primer::mapped_file::open(root + "/foo.lua");
+  TEST(m1 && m1 == m2, "expected the mapping to be shared");
+  TEST_EQ(std::string(m1->data(), m1->size()), "return { x = 5 }");
+
+  std::ofstream{root + "/foo.tmp"} << "return { x = 6, y = 7 }";
+  TEST_EQ(0, std::rename((root + "/foo.tmp").c_str(),
+                         (root + "/foo.lua").c_str()));
+  auto m3 = primer::mapped_file::open(root + "/foo.lua");
+  TEST(m3 && m3 != m1, "expected a new mapping");
+  TEST_EQ(std::string(m3->data(), m3->size()), "return { x = 6, y = 7 }");
+  TEST_EQ(std::string(m1->data(), m1->size()), "return { x = 5 }");
+
+  remove_test_dir(root);
+}
+
+struct test_api_archive : primer::api::base<test_api_archive> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+  API_FEATURE(primer::api::archive_vfs, vfs_);
+
+  explicit test_api_archive(const std::string & file)
+    : L_()
+    , vfs_{file} {
+    this->initialize_api(L_);
+  }
+};
+
+UNIT_TEST(module_archive) {
+  std::map<std::string, std::string> modules{
+    {"foo", "return { x = 5 }"}, {"pkg", "return { name = 'pkg' }"}};
+  {
+    lua_raii L;
+    TEST_EXPECTED(primer::api::compile_chunk(
+      L, "pkg.sub", "return { name = 'sub' }", modules["pkg.sub"]));
+    TEST_EQ(0, lua_gettop(L));
+  }
+
+  std::string archive;
+  TEST_EXPECTED(primer::api::make_module_archive(modules, archive));
+
+  {
+    auto a = primer::api::module_archive::open(archive.data(), archive.size());
+    TEST_EXPECTED(a);
+    TEST_EQ(a->size(), 3u);
+    TEST_EQ(a->name(0), "foo");
+    const char * data;
+    std::size_t size;
+    TEST(a->find("pkg", data, size), "expected to find pkg");
+    TEST_EQ(std::string(data, size), "return { name = 'pkg' }");
+    TEST(!a->find("pk", data, size), "unexpectedly found pk");
+    TEST(!a->find("zzz", data, size), "unexpectedly found zzz");
+
+    // A truncated archive is rejected
+    TEST(!primer::api::module_archive::open(archive.data(), archive.size() - 1),
+         "expected a truncated archive to be rejected");
+  }
+
+  char dir[] = "/tmp/primer_archive_XXXXXX";
+  TEST(mkdtemp(dir), "could not create a temporary directory");
+  const std::string file = std::string{dir} + "/modules.pra";
+  std::ofstream(file, std::ios::binary) << archive;
+
+  const char * script =
+    "assert(5 == require('foo').x)                                         \n"
+    "assert('pkg' == require('pkg').name)                                  \n"
+    "assert('sub' == require('pkg.sub').name)                              \n"
+    "assert(not pcall(require, 'missing'))                                 \n";
+
+  {
+    test_api_archive a{file};
+    TEST_EXPECTED(a.vfs_.archive());
+    TEST_LUA_OK(a.L_, luaL_loadstring(a.L_, script));
+    TEST_LUA_OK(a.L_, lua_pcall(a.L_, 0, 0, 0));
+  }
+
+  {
+    test_api_archive a{file + ".missing"};
+    TEST(!a.vfs_.archive(), "expected the archive to be missing");
+    TEST_EQ(LUA_OK, luaL_loadstring(a.L_, "return pcall(require, 'foo')"));
+    TEST_EQ(LUA_OK, lua_pcall(a.L_, 0, 2, 0));
+    TEST(!lua_toboolean(a.L_, 1), "expected require to fail");
+    lua_settop(a.L_, 0);
+  }
+
+  remove_test_dir(dir);
+}
+
+// Counts the modules which it loads
+struct counted_files : primer::api::vfs<counted_files> {
+  int loads_ = 0;
+
+  primer::expected<void> load(lua_State * L, const std::string & path) {
+    if (path != "mod") { return primer::error::module_not_found(path); }
+    ++loads_;
+    luaL_loadstring(L, "return { value = 5 }");
+    return {};
+  }
+};
+
+struct test_api_session : primer::api::base<test_api_session> {
+  friend class primer::api::vm_template<test_api_session>;
+
+  lua_raii L_;
+
+  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+  API_FEATURE(counted_files, vfs_);
+
+  test_api_session()
+    : L_()
+    , vfs_() {
+    this->initialize_api(L_);
+  }
+
+  void run(const char * script) {
+    TEST_LUA_OK(L_, luaL_loadstring(L_, script));
+    TEST_LUA_OK(L_, lua_pcall(L_, 0, 0, 0));
+  }
+};
+
+UNIT_TEST(vm_template) {
+  primer::api::vm_template<test_api_session> t;
+  TEST(t.empty(), "expected an empty template");
+  {
+    test_api_session a;
+    TEST(!t.stamp(a, a.L_), "expected stamping an empty template to fail");
+
+    a.run("mod = require 'mod'; counter = 0");
+    TEST_EQ(a.vfs_.loads_, 1);
+    TEST_EXPECTED(t.capture(a, a.L_));
+  }
+  TEST(!t.empty(), "expected a template");
+
+  for (int i = 0; i < 3; ++i) {
+    test_api_session a;
+    TEST_EXPECTED(t.stamp(a, a.L_));
+    a.run("assert(mod.value == 5)                                             \n"
+          "assert(counter == 0)                                               \n"
+          "counter = counter + 1                                              \n"
+          "assert(require('mod') == mod)                                      \n");
+    // The module came with the template
+    TEST_EQ(a.vfs_.loads_, 0);
+  }
+
+  // A copy of the image works the same
+  primer::api::vm_template<test_api_session> t2{t.image()};
+  test_api_session b;
+  TEST_EXPECTED(t2.stamp(b, b.L_));
+  b.run("assert(mod.value == 5)");
+}
+
+struct test_api_pooled : primer::api::base<test_api_pooled> {
+  friend class primer::api::vm_template<test_api_pooled>;
+
+  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+  API_FEATURE(counted_files, vfs_);
+
+  explicit test_api_pooled(lua_State * L) { this->initialize_api(L); }
+};
+
+UNIT_TEST(vm_pool) {
+  using pool_t = primer::api::vm_pool<test_api_pooled>;
+
+  primer::api::vm_template<test_api_pooled> t;
+  {
+    lua_raii L;
+    test_api_pooled a{L};
+    TEST_LUA_OK(L, luaL_loadstring(L, "mod = require 'mod'; counter = 0"));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    TEST_EXPECTED(t.capture(a, L));
+  }
+
+  pool_t pool{t, 2};
+  TEST_EQ(pool.idle(), 0u);
+
+  lua_State * first = nullptr;
+  for (int i = 0; i < 3; ++i) {
+    auto v = pool.acquire();
+    TEST_EXPECTED(v);
+    lua_State * L = (*v)->L;
+    if (!first) { first = L; }
+    // The state which was released is the one which is handed out again
+    TEST(L == first, "expected the pooled state to be reused");
+    TEST_EQ(pool.idle(), 0u);
+
+    const char * script = "assert(mod.value == 5)                        \n"
+                          "assert(counter == 0)                          \n"
+                          "assert(junk == nil)                           \n"
+                          "counter = counter + 1                         \n"
+                          "junk = {}                                     \n"
+                          "assert(require('mod') == mod)                 \n";
+    TEST_LUA_OK(L, luaL_loadstring(L, script));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    TEST_EQ((*v)->api.vfs_.loads_, 0);
+
+    TEST_EQ(LUA_TNIL, lua_getfield(L, LUA_REGISTRYINDEX, "junk"));
+    lua_pushboolean(L, true);
+    lua_setfield(L, LUA_REGISTRYINDEX, "junk");
+    lua_pop(L, 1);
+
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, "_LOADED");
+    TEST_EQ(LUA_TNIL, lua_getfield(L, -1, "other"));
+    lua_pushboolean(L, true);
+    lua_setfield(L, -3, "other");
+    lua_pop(L, 2);
+
+    pool.release(std::move(*v));
+    TEST_EQ(pool.idle(), 1u);
+  }
+
+  // The pool doesn't keep more than `max_idle` states
+  TEST_EXPECTED(pool.reserve(5));
+  TEST_EQ(pool.idle(), 2u);
+  {
+    auto a = pool.acquire();
+    auto b = pool.acquire();
+    auto c = pool.acquire();
+    TEST_EXPECTED(a);
+    TEST_EXPECTED(b);
+    TEST_EXPECTED(c);
+    TEST_EQ(pool.idle(), 0u);
+    pool.release(std::move(*a));
+    pool.release(std::move(*b));
+    pool.release(std::move(*c));
+    TEST_EQ(pool.idle(), 2u);
+  }
+}
+
+UNIT_TEST(vm_worker_pool) {
+  using pool_t = primer::api::vm_worker_pool<test_api_pooled>;
+
+  const char * script = "function work(n, s) return s .. (n * 2) end       \n"
+                        "function sum(t)                                  \n"
+                        "  local r = 0                                    \n"
+                        "  for _, v in ipairs(t) do r = r + v end         \n"
+                        "  return r                                       \n"
+                        "end                                              \n";
+
+  std::atomic<int> posted{0};
+  {
+    pool_t pool{3, [script](test_api_pooled &, lua_State * L) {
+                  TEST_LUA_OK(L, luaL_loadstring(L, script));
+                  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+                }};
+    TEST_EQ(pool.size(), 3u);
+
+    std::vector<std::future<primer::expected<std::string>>> results;
+    for (int i = 0; i < 100; ++i) {
+      results.push_back(pool.call<std::string>("work", i, std::string{"x"}));
+    }
+    for (int i = 0; i < 100; ++i) {
+      auto r = results[i].get();
+      TEST_EXPECTED(r);
+      TEST_EQ(*r, "x" + std::to_string(2 * i));
+    }
+
+    auto total = pool.call<int>("sum", std::vector<int>{1, 2, 3, 4});
+    auto r = total.get();
+    TEST_EXPECTED(r);
+    TEST_EQ(*r, 10);
+
+    auto missing = pool.call<void>("no_such_function");
+    TEST(!missing.get(), "expected an error");
+
+    // Tasks which throw don't stop the workers
+    pool.post([](test_api_pooled &, lua_State *) {
+      throw std::runtime_error{"task failed"};
+    });
+    auto after = pool.call<int>("sum", std::vector<int>{5});
+    TEST_EQ(*after.get(), 5);
+
+    for (int i = 0; i < 50; ++i) {
+      pool.post([&posted](test_api_pooled &, lua_State *) { ++posted; });
+    }
+  }
+  // The destructor runs what was queued
+  TEST_EQ(posted.load(), 50);
+
+  {
+    // The global lookup of a call is protected, and the exceptions of posted
+    // tasks are kept until taken
+    pool_t pool{1, [](test_api_pooled &, lua_State * L) {
+                  TEST_LUA_OK(L, luaL_dostring(L, "setmetatable(_G, {      \n"
+                                                  "  __index = function()  \n"
+                                                  "    error('no globals') \n"
+                                                  "  end })                \n"));
+                }};
+    auto r = pool.call<int>("undefined");
+    auto e = r.get();
+    TEST(!e, "expected an error");
+    TEST(e.err().str().find("no globals") != std::string::npos,
+         "unexpected error: " << e.err().str());
+
+    pool.post([](test_api_pooled &, lua_State *) { throw 5; });
+    TEST_EQ(*pool.call<int>("tonumber", std::string{"3"}).get(), 3);
+    auto errors = pool.take_errors();
+    TEST_EQ(errors.size(), 1u);
+    TEST(pool.take_errors().empty(), "expected the errors to be taken");
+  }
+}
+
+UNIT_TEST(vm_worker_pool_placement) {
+  using pool_t = primer::api::vm_worker_pool<test_api_pooled>;
+  using primer::api::vm_placement;
+  using primer::api::vm_placement_policy;
+
+  std::mutex mutex;
+  std::vector<bool> pooled;
+  auto setup = [&](test_api_pooled &, lua_State * L) {
+    void * ud;
+    bool p = lua_getallocf(L, &ud) == &primer::pool_allocator::alloc
+             && ud == &primer::pool_allocator::this_thread();
+    std::lock_guard<std::mutex> lock(mutex);
+    pooled.push_back(p);
+  };
+
+  {
+    pool_t pool{2, vm_placement_policy::spread_over_cpus(), setup};
+    auto r = pool.call<int>("tonumber", std::string{"5"});
+    TEST_EQ(*r.get(), 5);
+  }
+  {
+    pool_t pool{2, vm_placement_policy::spread_over_nodes(), setup};
+  }
+  {
+    // Node ids are read from a list, which may have gaps
+    char path[] = "/tmp/primer_node_list_XXXXXX";
+    int fd = ::mkstemp(path);
+    TEST(fd >= 0, "expected a temporary file");
+    TEST_EQ(::write(fd, "0,2-4,7\n", 8), 8);
+    ::close(fd);
+    std::vector<std::size_t> ids;
+    TEST_EQ(true, primer::detail::read_id_list(
+                    path, [&ids](std::size_t id) { ids.push_back(id); }));
+    std::remove(path);
+    TEST(ids == (std::vector<std::size_t>{0, 2, 3, 4, 7}),
+         "unexpected node ids");
+    TEST(!primer::detail::numa_online_nodes().empty(), "expected a node");
+  }
+  {
+    // An impossible placement falls back to running anywhere
+    pool_t pool{1, vm_placement_policy{[](std::size_t) {
+                  return vm_placement::on_cpu(1u << 20);
+                }},
+                setup};
+    auto r = pool.call<int>("tonumber", std::string{"7"});
+    TEST_EQ(*r.get(), 7);
+    TEST_EQ(false, pool.placed(0));
+  }
+  TEST_EQ(pooled.size(), 5u);
+  TEST_EQ(std::count(pooled.begin(), pooled.end(), true), 5);
+
+  {
+    pool_t pool{1, [&pooled](test_api_pooled &, lua_State * L) {
+                  void * ud;
+                  pooled.push_back(lua_getallocf(L, &ud)
+                                   == &primer::pool_allocator::alloc);
+                }};
+  }
+  TEST_EQ(false, pooled.back());
+}
+
+UNIT_TEST(vm_multiplexer) {
+  using mux_t = primer::api::vm_multiplexer;
+  const std::size_t num_vms = 20;
+  const char * script = "count = 0                                         \n"
+                        "function work()                                   \n"
+                        "  for i = 1, 1000 do                              \n"
+                        "    count = count + 1                             \n"
+                        "    if i % 100 == 0 then coroutine.yield() end    \n"
+                        "  end                                             \n"
+                        "end                                               \n"
+                        "function spin()                                   \n"
+                        "  local x = 0                                     \n"
+                        "  for i = 1, 200000 do x = x + i end              \n"
+                        "  count = count + 1                               \n"
+                        "end                                               \n";
+
+  std::vector<std::unique_ptr<lua_raii>> states;
+  for (std::size_t i = 0; i < num_vms; ++i) {
+    states.emplace_back(new lua_raii);
+    lua_State * L = *states.back();
+    luaL_requiref(L, "", luaopen_base, 1);
+    luaL_requiref(L, "coroutine", luaopen_coroutine, 1);
+    lua_settop(L, 0);
+    TEST_LUA_OK(L, luaL_dostring(L, script));
+  }
+
+  auto spawn = [](const char * name) {
+    return [name](lua_State * L, primer::scheduler & sched) {
+      lua_getglobal(L, name);
+      primer::bound_function f{L};
+      sched.spawn(f);
+    };
+  };
+
+  std::unique_ptr<std::atomic<bool>[]> busy{new std::atomic<bool>[num_vms]};
+  std::atomic<bool> overlap{false};
+  std::atomic<int> ran{0};
+
+  mux_t mux{3, 1000};
+  TEST_EQ(mux.threads(), 3u);
+  std::vector<mux_t::vm_id> ids;
+  for (std::size_t i = 0; i < num_vms; ++i) {
+    busy[i] = false;
+    ids.push_back(mux.add(*states[i], i % 2 ? 2 : 1));
+  }
+
+  for (std::size_t i = 0; i < num_vms; ++i) {
+    mux.post(ids[i], spawn("work"));
+    for (int k = 0; k < 20; ++k) {
+      mux.post(ids[i], [&busy, &overlap, &ran, i](lua_State *,
+                                                  primer::scheduler &) {
+        if (busy[i].exchange(true)) { overlap = true; }
+        ++ran;
+        std::this_thread::yield();
+        busy[i] = false;
+      });
+    }
+  }
+  // A task which doesn't yield is preempted by the instruction budget
+  mux.post(ids[0], spawn("spin"));
+
+  mux.wait_idle();
+  TEST_EQ(ran.load(), static_cast<int>(20 * num_vms));
+  TEST_EQ(false, overlap.load());
+  TEST_EQ(mux.take_errors().size(), 0u);
+  for (std::size_t i = 0; i < num_vms; ++i) {
+    lua_State * L = *states[i];
+    lua_getglobal(L, "count");
+    TEST_EQ(lua_tointeger(L, -1), i ? 1000 : 1001);
+    lua_pop(L, 1);
+    TEST(mux.slices(ids[i]) >= 10, "expected a slice per yield");
+  }
+  TEST(mux.slices(ids[0]) > 100, "expected the spinning task to be preempted");
+
+  // Errors are reported with the state
+  mux.post(ids[3], [](lua_State * L, primer::scheduler &) {
+    luaL_error(L, "oops");
+  });
+  mux.wait_idle();
+  auto errors = mux.take_errors();
+  TEST_EQ(errors.size(), 1u);
+  TEST_EQ(errors[0].first, ids[3]);
+
+  // A removed state is no longer run, and its id is reused
+  mux.remove(ids[5]);
+  mux_t::vm_id again = mux.add(*states[5]);
+  TEST_EQ(again, ids[5]);
+  TEST_EQ(mux.slices(again), 0u);
+}
+
+struct test_api_buffers : primer::api::base<test_api_buffers> {
+  friend class primer::api::vm_template<test_api_buffers>;
+
+  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+  API_FEATURE(primer::api::shared_buffers, buffers_);
+
+  test_api_buffers(lua_State * L, primer::shared_buffer<int> level) {
+    buffers_.add("level", std::move(level));
+    this->initialize_api(L);
+  }
+};
+
+UNIT_TEST(shared_buffer_persist) {
+  auto level = primer::shared_buffer<int>{std::vector<int>(100000, 7)};
+
+  primer::api::vm_template<test_api_buffers> t;
+  {
+    lua_raii L;
+    test_api_buffers a{L, level};
+    primer::push(L, level);
+    lua_setglobal(L, "level");
+    TEST_LUA_OK(L, luaL_loadstring(L, "alias = level; n = #level"));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    TEST_EXPECTED(t.capture(a, L));
+
+    // The elements are not in the image
+    TEST(t.image().size() < 100000, "expected a small image");
+
+    // A buffer which isn't registered can't be persisted
+    primer::push(L, primer::shared_buffer<int>{std::vector<int>{1, 2}});
+    lua_setglobal(L, "other");
+    primer::api::vm_template<test_api_buffers> t2;
+    TEST(!t2.capture(a, L), "expected failure");
+  }
+
+  lua_raii L;
+  test_api_buffers a{L, level};
+  TEST_EXPECTED(t.stamp(a, L));
+  const char * script = "assert(alias == level)                            \n"
+                        "assert(n == 100000 and level[100000] == 7)        \n";
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  lua_getglobal(L, "level");
+  auto back = primer::read<primer::shared_buffer<int>>(L, -1);
+  TEST_EXPECTED(back);
+  TEST(back->data() == level.data(), "expected the same block");
+  lua_pop(L, 1);
+}
+
+UNIT_TEST(pool_allocator) {
+  primer::pool_allocator pool;
+  const char * script = "local t = {}                                      \n"
+                        "for i = 1, 20000 do                               \n"
+                        "  t[i % 500 + 1] = { tostring(i), i, {} }         \n"
+                        "end                                               \n"
+                        "words = {}                                        \n"
+                        "for i = 1, 100 do                                 \n"
+                        "  words[i] = string.rep('x', i)                   \n"
+                        "end                                               \n"
+                        "big = string.rep('y', 100000)                     \n";
+
+  primer::api::vm_template<test_api_pooled> t;
+  {
+    lua_State * L = pool.new_state();
+    TEST(L, "expected a new state");
+    {
+      test_api_pooled a{L};
+      TEST_LUA_OK(L, luaL_loadstring(L, script));
+      TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+      TEST(pool.bytes_in_use() > 100000, "expected the state to use the pool");
+      TEST_EXPECTED(t.capture(a, L));
+    }
+    lua_close(L);
+  }
+  TEST_EQ(pool.bytes_in_use(), 0u);
+  const std::size_t chunks = pool.chunk_bytes();
+
+  // Eris unpersists into a pooled state, and the freed blocks are reused
+  lua_State * L = pool.new_state();
+  {
+    test_api_pooled a{L};
+    TEST_EXPECTED(t.stamp(a, L));
+    const char * check = "assert(#words == 100)                             \n"
+                         "assert(words[100] == string.rep('x', 100))        \n"
+                         "assert(#big == 100000)                            \n";
+    TEST_LUA_OK(L, luaL_loadstring(L, check));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  }
+  lua_close(L);
+  TEST_EQ(pool.bytes_in_use(), 0u);
+  TEST(pool.chunk_bytes() <= chunks + 64 * 1024,
+       "expected blocks to be reused");
+
+  // The pool of this thread
+  L = primer::pool_allocator::this_thread().new_state();
+  luaL_openlibs(L);
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  lua_close(L);
+  TEST_EQ(primer::pool_allocator::this_thread().bytes_in_use(), 0u);
+}
+
+// Userdata which count their finalizations, and of which only the first kind
+// must be finalized by fast teardown
+struct closing_handle {
+  static int closed;
+  ~closing_handle() { ++closed; }
+};
+
+struct dropped_handle {
+  static int closed;
+  ~dropped_handle() { ++closed; }
+};
+
+int closing_handle::closed = 0;
+int dropped_handle::closed = 0;
+
+// A userdata whose finalizer makes more userdata which must be finalized
+struct spawning_handle {
+  static int closed;
+};
+
+int spawning_handle::closed = 0;
+
+int
+spawning_handle_gc(lua_State * L) {
+  ++spawning_handle::closed;
+  lua_pushnil(L);
+  lua_setmetatable(L, 1);
+  for (int i = 0; i < 50; ++i) {
+    primer::push_udata<closing_handle>(L);
+    lua_setglobal(L, ("spawned" + std::to_string(i)).c_str());
+  }
+  return 0;
+}
+
+namespace primer {
+namespace traits {
+
+template <>
+struct userdata<closing_handle> {
+  static constexpr const char * name = "closing_handle";
+  static constexpr bool must_finalize = true;
+};
+
+template <>
+struct userdata<dropped_handle> {
+  static constexpr const char * name = "dropped_handle";
+};
+
+template <>
+struct userdata<spawning_handle> {
+  static constexpr const char * name = "spawning_handle";
+  static constexpr bool must_finalize = true;
+  static const std::vector<luaL_Reg> & metatable() {
+    static const std::vector<luaL_Reg> metatable_array{
+      {"__gc", &spawning_handle_gc}};
+    return metatable_array;
+  }
+};
+
+} // end namespace traits
+} // end namespace primer
+
+UNIT_TEST(fast_close) {
+  primer::pool_allocator pool;
+  lua_State * L = pool.new_state();
+  TEST(L, "expected a new state");
+  luaL_openlibs(L);
+  TEST_LUA_OK(L, luaL_dostring(L, "big = string.rep('y', 100000)"));
+
+  for (int i = 0; i < 3; ++i) {
+    primer::push_udata<closing_handle>(L);
+    lua_setglobal(L, ("c" + std::to_string(i)).c_str());
+    primer::push_udata<dropped_handle>(L);
+    lua_setglobal(L, ("d" + std::to_string(i)).c_str());
+  }
+
+  // One of each is collected first, and isn't finalized again
+  TEST_LUA_OK(L, luaL_dostring(L, "c0, d0 = nil"));
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  TEST_EQ(closing_handle::closed, 1);
+  TEST_EQ(dropped_handle::closed, 1);
+
+  primer::lua_state_ref state_ref = primer::obtain_state_ref(L);
+  lua_pushboolean(L, true);
+  primer::lua_ref ref{L};
+
+  TEST_EQ(true, primer::fast_close(L));
+  TEST_EQ(closing_handle::closed, 3);
+  TEST_EQ(dropped_handle::closed, 1);
+  TEST(!state_ref.lock(), "expected the state refs to expire");
+  TEST(!ref, "expected the refs to expire");
+  ref.reset();
+
+  TEST(pool.bytes_in_use() > 100000, "expected the memory to stay");
+  pool.release_all();
+  TEST_EQ(pool.bytes_in_use(), 0u);
+  TEST_EQ(pool.chunk_bytes(), 0u);
+
+  // The pool serves new states after that
+  L = pool.new_state();
+  luaL_openlibs(L);
+  TEST_LUA_OK(L, luaL_dostring(L, "assert(#string.rep('z', 1000) == 1000)"));
+  lua_close(L);
+  TEST_EQ(pool.bytes_in_use(), 0u);
+
+  // Other states are closed as usual
+  L = luaL_newstate();
+  primer::push_udata<dropped_handle>(L);
+  lua_setglobal(L, "d");
+  TEST_EQ(false, primer::fast_close(L));
+  TEST_EQ(dropped_handle::closed, 2);
+
+  // The workers of a pool tear down their states each on its thread
+  {
+    using primer::api::vm_placement;
+    primer::api::vm_worker_pool<test_api_pooled> workers{
+      2, primer::api::vm_placement_policy{
+           [](std::size_t) { return vm_placement::anywhere(); }}};
+    workers.set_fast_teardown(true);
+    for (int i = 0; i < 2; ++i) {
+      workers.post([i](test_api_pooled &, lua_State * L) {
+        primer::push_udata<closing_handle>(L);
+        lua_setglobal(L, ("c" + std::to_string(i)).c_str());
+        primer::push_udata<dropped_handle>(L);
+        lua_setglobal(L, ("d" + std::to_string(i)).c_str());
+      });
+    }
+  }
+  TEST_EQ(closing_handle::closed, 5);
+  TEST_EQ(dropped_handle::closed, 2);
+
+  // Objects which a finalizer makes join the table, but aren't finalized
+  L = pool.new_state();
+  for (int i = 0; i < 4; ++i) {
+    primer::push_udata<closing_handle>(L);
+    lua_setglobal(L, ("c" + std::to_string(i)).c_str());
+  }
+  primer::push_udata<spawning_handle>(L);
+  lua_setglobal(L, "s");
+  TEST_EQ(true, primer::fast_close(L));
+  TEST_EQ(spawning_handle::closed, 1);
+  TEST_EQ(closing_handle::closed, 9);
+  pool.release_all();
+  TEST_EQ(pool.bytes_in_use(), 0u);
+
+  // Files which scripts leave open are flushed, once they are tracked
+  char path[] = "/tmp/primer_fast_close_XXXXXX";
+  int fd = ::mkstemp(path);
+  TEST(fd >= 0, "expected a temporary file");
+  ::close(fd);
+  L = pool.new_state();
+  luaL_openlibs(L);
+  primer::track_io_files(L);
+  primer::track_io_files(L);
+  lua_pushstring(L, path);
+  lua_setglobal(L, "path");
+  TEST_LUA_OK(L, luaL_dostring(L, "f = io.open(path, 'w') f:write('kept')"));
+  TEST_EQ(true, primer::fast_close(L));
+  pool.release_all();
+  {
+    std::ifstream in{path};
+    std::string contents;
+    std::getline(in, contents);
+    TEST_EQ(contents, "kept");
+  }
+  std::remove(path);
+}
+
+UNIT_TEST(vm_config) {
+  primer::vm_profile profile;
+  {
+    lua_raii L;
+    test_api_pooled a{L};
+    TEST_LUA_OK(L, luaL_loadstring(L, "mod = require 'mod'"));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    for (int i = 0; i < 40; ++i) {
+      lua_pushinteger(L, i);
+      luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    profile = primer::vm_profile::record(L);
+    CHECK_STACK(L, 0);
+  }
+  TEST(profile.registry_refs >= 40, "expected the references to be counted");
+  TEST(profile.registry_fields > 0, "expected registry fields");
+  TEST(profile.globals > 0, "expected globals");
+  TEST(profile.loaded > 0, "expected modules");
+  TEST(profile.memory > 0, "expected memory in use");
+
+  primer::pool_allocator pool;
+  primer::vm_config config;
+  config.alloc = &primer::pool_allocator::alloc;
+  config.alloc_ud = &pool;
+  config.gc_pause = 150;
+  config.stack_reserve = 200;
+  config.reserve_for(profile);
+  TEST_EQ(config.registry_refs, profile.registry_refs);
+
+  {
+    lua_State * L = primer::new_state(config);
+    TEST(L, "expected a new state");
+    void * ud = nullptr;
+    TEST(lua_getallocf(L, &ud) == &primer::pool_allocator::alloc && ud == &pool,
+         "expected the configured allocator");
+    CHECK_STACK(L, 0);
+    // The placeholders are gone, and references start where they would
+    TEST_EQ(lua_rawlen(L, LUA_REGISTRYINDEX), 2u);
+    lua_pushboolean(L, true);
+    TEST_EQ(luaL_ref(L, LUA_REGISTRYINDEX), 3);
+    TEST_EQ(lua_gc(L, LUA_GCSETPAUSE, 200), 150);
+    {
+      test_api_pooled a{L};
+      TEST_LUA_OK(L, luaL_loadstring(L, "mod = require 'mod'"
+                                        "; assert(mod.value == 5)"));
+      TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    }
+    lua_close(L);
+  }
+  TEST_EQ(pool.bytes_in_use(), 0u);
+
+  // A reservation which can't be made
+  config.stack_reserve = 100000000;
+  TEST(!primer::new_state(config), "expected no state");
+  TEST_EQ(pool.bytes_in_use(), 0u);
+
+  // A pool of states made from the config
+  config.stack_reserve = 0;
+  primer::api::vm_template<test_api_pooled> t;
+  {
+    lua_raii L;
+    test_api_pooled a{L};
+    TEST_EXPECTED(t.capture(a, L));
+  }
+  {
+    primer::api::vm_pool<test_api_pooled> vms{t, 1, config};
+    auto v = vms.acquire();
+    TEST_EXPECTED(v);
+    TEST(lua_getallocf((*v)->L, nullptr) == &primer::pool_allocator::alloc,
+         "expected the configured allocator");
+  }
+  TEST_EQ(pool.bytes_in_use(), 0u);
+}
+
+struct test_api_limited : primer::api::base<test_api_limited> {
+  API_FEATURE(primer::api::memory_limiter, memory_);
+  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+
+  explicit test_api_limited(lua_State * L) { this->initialize_api(L); }
+
+  primer::api::memory_limiter & memory() { return memory_; }
+};
+
+UNIT_TEST(memory_limiter) {
+  lua_raii L;
+  void * ud;
+  lua_Alloc original = lua_getallocf(L, &ud);
+  {
+    test_api_limited a{L};
+    auto & m = a.memory();
+    TEST(m.bytes_in_use() > 0, "expected the libraries to be counted");
+    TEST(m.new_objects(LUA_TTABLE) > 0, "expected tables to be counted");
+    const std::size_t tables = m.new_objects(LUA_TTABLE);
+
+    const char * tables_script = "t = {} for i = 1, 100 do t[i] = {} end";
+    TEST_LUA_OK(L, luaL_loadstring(L, tables_script));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    TEST(m.new_objects(LUA_TTABLE) >= tables + 101, "expected new tables");
+
+    // Garbage is collected to make room, and only live data hits the limit
+    m.set_limit(m.bytes_in_use() + 256 * 1024);
+    const char * churn = "for i = 1, 2000 do local s = string.rep('x', 1000)"
+                         " .. i end";
+    TEST_LUA_OK(L, luaL_loadstring(L, churn));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    TEST(!m.over_limit(), "expected to be within the limit");
+
+    const char * hog = "big = {} for i = 1, 1000 do"
+                       " big[i] = string.rep('y', 1000) .. i end";
+    TEST_LUA_OK(L, luaL_loadstring(L, hog));
+    TEST_EQ(lua_pcall(L, 0, 0, 0), LUA_ERRMEM);
+    lua_pop(L, 1);
+    TEST(m.refused() > 0, "expected allocations to be refused");
+    TEST(m.peak() <= m.limit(), "expected the limit to hold");
+
+    // The state recovers once the data is dropped
+    TEST_LUA_OK(L, luaL_loadstring(L, "big = nil collectgarbage()"));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+    // A soft limit only reports
+    m.set_limit(m.bytes_in_use() + 1024,
+                primer::api::memory_limiter::mode::soft);
+    TEST_LUA_OK(L, luaL_loadstring(L, hog));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    TEST(m.over_limit(), "expected to be over the limit");
+    TEST(m.peak() > m.limit(), "expected the peak to pass the limit");
+    m.reset_peak();
+    TEST_EQ(m.peak(), m.bytes_in_use());
+  }
+
+  // The original allocator is back
+  TEST(lua_getallocf(L, &ud) == original, "expected the original allocator");
+}
+
+// A host clock which advances by a millisecond each time it is read
+struct ticking_clock {
+  using duration = std::chrono::milliseconds;
+  using rep = duration::rep;
+  using period = duration::period;
+  using time_point = std::chrono::time_point<ticking_clock>;
+  static constexpr bool is_steady = true;
+
+  static rep ticks;
+  static time_point now() { return time_point{duration{++ticks}}; }
+};
+
+ticking_clock::rep ticking_clock::ticks = 0;
+
+struct test_api_gc : primer::api::base<test_api_gc> {
+  friend class primer::api::vm_template<test_api_gc>;
+
+  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+  API_FEATURE(primer::api::basic_gc_controller<ticking_clock>, gc_);
+
+  explicit test_api_gc(lua_State * L) { this->initialize_api(L); }
+
+  primer::api::basic_gc_controller<ticking_clock> & gc() { return gc_; }
+};
+
+UNIT_TEST(gc_controller) {
+  using gc_t = primer::api::basic_gc_controller<ticking_clock>;
+
+  primer::api::vm_template<test_api_gc> t;
+  {
+    lua_raii L;
+    test_api_gc a{L};
+    gc_t::settings s;
+    s.pause = 150;
+    s.step_multiplier = 400;
+    s.automatic = false;
+    a.gc().configure(s);
+    TEST(!lua_gc(L, LUA_GCISRUNNING, 0), "expected the collector to stop");
+    // Finish the cycle which lua started while loading the libraries
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    // Nothing to do until the heap grows
+    TEST_EQ(a.gc().step_for(std::chrono::milliseconds{5}).steps, 0u);
+
+    const char * garbage = "live = {} for i = 1, 20000 do"
+                           " live[i] = { i } local t = { tostring(i) } end";
+    TEST_LUA_OK(L, luaL_loadstring(L, garbage));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    const std::size_t before = a.gc().bytes_in_use();
+    TEST(a.gc().debt_bytes() > 0, "expected debt");
+
+    // Each frame stays within its budget, and the cycle is spread over frames
+    int frames = 0;
+    while (!a.gc().cycles() && frames < 10000) {
+      auto stats = a.gc().step_for(std::chrono::milliseconds{5});
+      TEST(stats.time <= std::chrono::milliseconds{5}, "over budget");
+      TEST(stats.steps > 0, "expected steps");
+      ++frames;
+    }
+    TEST_EQ(a.gc().cycles(), 1u);
+    TEST(a.gc().last_cycle_frames() > 1, "expected several frames");
+    TEST_EQ(a.gc().last_cycle_frames(), static_cast<std::size_t>(frames));
+    TEST(a.gc().last_cycle_time() > std::chrono::milliseconds{5},
+         "expected the cycle time to add up");
+    TEST(a.gc().bytes_in_use() < before, "expected garbage to be collected");
+    TEST_EQ(a.gc().debt_bytes(), 0u);
+    TEST(a.gc().take_errors().empty(), "unexpected errors");
+
+    TEST_EXPECTED(t.capture(a, L));
+  }
+
+  // The settings are restored with the state
+  lua_raii L;
+  test_api_gc a{L};
+  TEST_EQ(a.gc().get_settings().pause, 200);
+  TEST_EXPECTED(t.stamp(a, L));
+  TEST_EQ(a.gc().get_settings().pause, 150);
+  TEST_EQ(a.gc().get_settings().step_multiplier, 400);
+  TEST(!a.gc().get_settings().automatic, "expected manual mode");
+  TEST(!lua_gc(L, LUA_GCISRUNNING, 0), "expected the collector to stop");
+  TEST_EQ(lua_gc(L, LUA_GCSETPAUSE, 150), 150);
+}
+
+struct test_api_timers : primer::api::base<test_api_timers> {
+  friend class primer::api::vm_template<test_api_timers>;
+
+  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+  API_FEATURE(primer::api::timers, timers_);
+
+  explicit test_api_timers(lua_State * L) { this->initialize_api(L); }
+
+  primer::api::timers & timers() { return timers_; }
+};
+
+UNIT_TEST(timers) {
+  primer::api::vm_template<test_api_timers> t;
+  {
+    lua_raii L;
+    test_api_timers a{L};
+
+    const char * const script =
+      ""
+      "log = ''                                                        \n"
+      "after(0.05, function() log = log .. 'a' end)                    \n"
+      "local b = after(0.05, function() log = log .. 'b' end)          \n"
+      "after(0.02, function() error('oops') end)                       \n"
+      "after(0.02, function()                                          \n"
+      "  log = log .. 'c'                                              \n"
+      "  cancel_timer(b)                                               \n"
+      "  after(0, function() log = log .. 'd' end)                     \n"
+      "end)                                                            \n"
+      "assert(cancel_timer(after(1, function() end)))                  \n"
+      "assert(not cancel_timer(12345))                                 \n"
+      "-- Further than the first levels of the wheel reach              \n"
+      "late = after(100, function() log = log .. 'e' end)              \n";
+    TEST_LUA_OK(L, luaL_loadstring(L, script));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    TEST_EQ(a.timers().size(), 5u);
+
+    TEST_EQ(a.timers().advance(0.015), 0u);
+    TEST_EQ(a.timers().advance(0.01), 2u);
+    auto errors = a.timers().take_errors();
+    TEST_EQ(errors.size(), 1u);
+    TEST(errors[0].str().find("oops") != std::string::npos,
+         "unexpected error message: " << errors[0].str());
+
+    // The timer added with no delay fires on the next tick, and b was
+    // cancelled
+    TEST_EQ(a.timers().advance(0.04), 2u);
+    lua_getglobal(L, "log");
+    TEST_EQ(std::string{lua_tostring(L, -1)}, "cda");
+    lua_pop(L, 1);
+    TEST_EQ(a.timers().size(), 1u);
+
+    // 99.9 seconds in, the late timer is still pending
+    TEST_EQ(a.timers().advance(99.85), 0u);
+    TEST_EXPECTED(t.capture(a, L));
+  }
+
+  // The pending timer, and the time, are restored with the state
+  lua_raii L;
+  test_api_timers a{L};
+  TEST_EXPECTED(t.stamp(a, L));
+  TEST_EQ(a.timers().size(), 1u);
+  TEST(a.timers().now() > 99.8, "expected the time to be restored");
+  TEST_EQ(a.timers().advance(0.05), 0u);
+  TEST_EQ(a.timers().advance(0.1), 1u);
+  lua_getglobal(L, "log");
+  TEST_EQ(std::string{lua_tostring(L, -1)}, "cdae");
+  lua_pop(L, 1);
+  TEST_LUA_OK(L, luaL_dostring(L, "assert(not cancel_timer(late))"));
+  TEST_EQ(a.timers().size(), 0u);
+}
+
+struct test_api_vector_math : primer::api::base<test_api_vector_math> {
+  friend class primer::api::vm_template<test_api_vector_math>;
+
+  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+  API_FEATURE(primer::api::vector_math, vec_);
+
+  explicit test_api_vector_math(lua_State * L) { this->initialize_api(L); }
+};
+
+UNIT_TEST(vector_math) {
+  // C++ side
+  {
+    const primer::vec3 a{1, 2, 3};
+    const primer::vec3 b{4, 5, 6};
+    TEST_EQ(primer::dot(a, b), 32);
+    TEST(primer::cross(a, b) == (primer::vec3{-3, 6, -3}),
+         "unexpected cross product");
+    TEST(primer::mad(a, b, 2) == (primer::vec3{9, 12, 15}),
+         "unexpected mad");
+    TEST(primer::lerp(a, b, 0.5) == (primer::vec3{2.5, 3.5, 4.5}),
+         "unexpected lerp");
+
+    const auto q = primer::quat_from_axis_angle({0, 0, 2}, M_PI / 2);
+    const primer::vec3 r = q * primer::vec3{1, 0, 0};
+    TEST(std::abs(r.x) < 1e-12 && std::abs(r.y - 1) < 1e-12,
+         "unexpected rotation: " << r.x << ", " << r.y);
+    lua_Number points[] = {1, 0, 0, 0, 1, 0};
+    primer::transform_points(q, {0, 0, 1}, points, 2);
+    TEST(std::abs(points[1] - 1) < 1e-12 && std::abs(points[3] + 1) < 1e-12
+           && points[2] == 1 && points[5] == 1,
+         "unexpected transform");
+  }
+
+  primer::api::vm_template<test_api_vector_math> t;
+  {
+    lua_raii L;
+    test_api_vector_math a{L};
+
+    const char * const script =
+      ""
+      "local v = vec.vec3(1, 2, 3)                                     \n"
+      "assert(v.x == 1 and v.y == 2 and v.z == 3 and v.w == nil)       \n"
+      "local w = v + v * 2 - vec.vec3(1, 1, 1) / 1                     \n"
+      "assert(w == vec.vec3(2, 5, 8))                                  \n"
+      "assert(v:dot(w) == 36 and (-v).x == -1)                         \n"
+      "assert(v:cross(w) == vec.vec3(1, -2, 1))                        \n"
+      "assert(v:mad(w, 0.5) == vec.vec3(2, 4.5, 7))                    \n"
+      "assert(vec.vec2(3, 4):length() == 5)                            \n"
+      "assert(vec.vec4(0, 0, 0, 2):normalize().w == 1)                 \n"
+      "assert(tostring(vec.vec2(1, 2)) == 'vec2(1.0, 2.0)')            \n"
+      "local x, y, z = v:unpack()                                      \n"
+      "assert(x == 1 and y == 2 and z == 3)                            \n"
+      "v.y = 7                                                         \n"
+      "assert(v.y == 7)                                                \n"
+      "assert(not pcall(function() v.w = 1 end))                       \n"
+      "assert(not pcall(function() return v + vec.vec2() end))         \n"
+      "local q = vec.axis_angle(vec.vec3(0, 0, 1), math.pi)            \n"
+      "local r = q * vec.vec3(1, 0, 0)                                 \n"
+      "assert(math.abs(r.x + 1) < 1e-12 and math.abs(r.y) < 1e-12)     \n"
+      "assert((q * q:conjugate()):length() - 1 < 1e-12)                \n"
+      "assert(vec.quat() == vec.quat(0, 0, 0, 1))                      \n"
+      "saved = { v = v, q = q, len = v.length }                        \n";
+    TEST_LUA_OK(L, luaL_loadstring(L, script));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+    // Reading takes the userdata, a table with named fields, or a sequence
+    TEST_LUA_OK(L, luaL_dostring(L, "return saved.v, {x = 4, y = 5, z = 6}, "
+                                    "{7, 8, 9}, {x = 'a'}"));
+    auto v = primer::read<primer::vec3>(L, 1);
+    TEST_EXPECTED(v);
+    TEST(*v == (primer::vec3{1, 7, 3}), "unexpected read");
+    v = primer::read<primer::vec3>(L, 2);
+    TEST_EXPECTED(v);
+    TEST_EQ(v->z, 6);
+    v = primer::read<primer::vec3>(L, 3);
+    TEST_EXPECTED(v);
+    TEST_EQ(v->y, 8);
+    TEST(!primer::read<primer::vec3>(L, 4), "expected an error");
+    lua_settop(L, 0);
+
+    primer::push(L, primer::vec2{1, 2});
+    lua_setglobal(L, "pushed");
+    TEST_EXPECTED(t.capture(a, L));
+  }
+
+  // The values, and the methods which scripts hold, survive persistence
+  lua_raii L;
+  test_api_vector_math a{L};
+  TEST_EXPECTED(t.stamp(a, L));
+  const char * const script =
+    ""
+    "assert(saved.v == vec.vec3(1, 7, 3) and saved.len(saved.v) > 7)   \n"
+    "assert(math.abs(saved.q.z - 1) < 1e-12)                           \n"
+    "assert(pushed == vec.vec2(1, 2))                                  \n";
+  TEST_LUA_OK(L, luaL_dostring(L, script));
+
+  // Batch transforms work on typed arrays in place
+  const lua_Number xyz[] = {1, 0, 0, 2, 0, 0};
+  primer::push_typed_array(L, xyz, 6);
+  lua_setglobal(L, "points");
+  TEST_LUA_OK(L, luaL_dostring(L, "vec.transform(saved.q, vec.vec3(0, 0, 1), "
+                                  "points)                              \n"
+                                  "assert(math.abs(points[4] + 2) < 1e-12)\n"
+                                  "assert(points[6] == 1)               \n"
+                                  "assert(not pcall(vec.transform, saved.q, "
+                                  "nil, {}))                            \n"));
+  CHECK_STACK(L, 0);
+}
+
+struct test_api_profiled : primer::api::base<test_api_profiled> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::alloc_profiler, profiler_);
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, libs_);
+  API_FEATURE(primer::api::callbacks, cb_man_);
+
+  NEW_LUA_CALLBACK(make_list)(lua_State * L, int n)->primer::result {
+    primer::push(L, std::vector<int>(n, 1));
+    return 1;
+  }
+
+  NEW_LUA_CALLBACK(make_name)(lua_State * L, int i)->primer::result {
+    lua_pushfstring(L, "name number %d", i);
+    return 1;
+  }
+
+  test_api_profiled()
+    : L_()
+    , profiler_(this)
+    , cb_man_(this) {
+    this->initialize_api(L_);
+  }
+
+  primer::api::alloc_profiler & profiler() { return profiler_; }
+};
+
+// The totals charged to a callback and object kind
+primer::api::alloc_profiler::entry
+find_entry(const primer::api::alloc_profiler & p, const std::string & callback,
+           const std::string & object) {
+  for (const auto & e : p.report()) {
+    if (e.callback == callback && e.object == object) { return e; }
+  }
+  return {callback, object, 0, 0};
+}
+
+UNIT_TEST(alloc_profiler) {
+  test_api_profiled a;
+  lua_State * L = a.L_;
+  auto & p = a.profiler();
+  p.reset();
+
+  const char * script = "local keep = {}                                   \n"
+                        "for i = 1, 100 do                                 \n"
+                        "  keep[i] = make_list(100)                        \n"
+                        "  keep[i + 100] = make_name(i)                    \n"
+                        "  keep[i + 200] = { i }                           \n"
+                        "end                                               \n";
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  auto lists = find_entry(p, "make_list", "sequence");
+  TEST(lists.bytes >= 100 * 100 * sizeof(lua_Integer), "expected the lists");
+  TEST(lists.allocations >= 100, "expected the list allocations");
+  auto names = find_entry(p, "make_name", "");
+  TEST(names.allocations >= 100, "expected the names");
+  TEST(find_entry(p, "<lua>", "").allocations >= 100, "expected the tables");
+
+  auto r = p.report();
+  TEST(!r.empty(), "expected a report");
+  TEST_EQ(r.front().callback, "make_list");
+  for (std::size_t i = 1; i < r.size(); ++i) {
+    TEST(r[i - 1].bytes >= r[i].bytes, "expected the largest first");
+  }
+
+  // Pushes made by the host are charged to the object kind only
+  primer::push(L, std::vector<int>(50, 2));
+  lua_pop(L, 1);
+  TEST(find_entry(p, "<lua>", "sequence").bytes > 0, "expected the push");
+
+  std::ostringstream os;
+  TEST(p.dump_if_due(os, std::chrono::seconds{0}), "expected a dump");
+  TEST(os.str().find("make_list\tsequence") != std::string::npos,
+       "expected the callback in the dump");
+  TEST(p.report().empty(), "expected the dump to reset");
+  TEST(!p.dump_if_due(os, std::chrono::hours{1}), "expected no dump");
+}
+
+struct test_api_sampled : primer::api::base<test_api_sampled> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, base_lib_);
+  API_FEATURE(primer::api::libraries<primer::api::lua_coroutine_lib>, co_lib_);
+  API_FEATURE(primer::api::sampling_profiler, profiler_);
+
+  test_api_sampled()
+    : L_()
+    , profiler_(64, 8) {
+    this->initialize_api(L_);
+  }
+
+  primer::api::sampling_profiler & profiler() { return profiler_; }
+};
+
+UNIT_TEST(sampling_profiler) {
+  test_api_sampled a;
+  lua_State * L = a.L_;
+  auto & p = a.profiler();
+
+  const char * script = "function hot(n)                                   \n"
+                        "  local x = 0                                     \n"
+                        "  for i = 1, n do x = x + i % 7 end               \n"
+                        "  return x                                        \n"
+                        "end                                               \n"
+                        "function cold() return 1 end                      \n"
+                        "function outer()                                  \n"
+                        "  for i = 1, 50 do hot(1000) cold() end           \n"
+                        "end                                               \n"
+                        "function in_thread()                              \n"
+                        "  local co = coroutine.create(outer)              \n"
+                        "  coroutine.resume(co)                            \n"
+                        "end                                               \n";
+  TEST_LUA_OK(L, luaL_loadbuffer(L, script, std::strlen(script), "=profiled"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  auto run = [L](const char * func) {
+    lua_getglobal(L, func);
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  };
+
+  // Nothing is sampled while it is off
+  run("outer");
+  TEST_EQ(p.samples(), 0u);
+
+  p.set_interval(100);
+  TEST(p.start(), "expected to start");
+  TEST(lua_gethook(L) != nullptr, "expected a hook");
+  run("outer");
+  p.stop();
+  TEST(lua_gethook(L) == nullptr, "expected no hook");
+  TEST(p.samples() > 64, "expected the buffer to be aggregated");
+  TEST_EQ(p.dropped(), 0u);
+
+  auto r = p.flat_report();
+  TEST(!r.empty(), "expected a report");
+  TEST(r.front().function.find("hot") != std::string::npos,
+       "expected hot to be hottest, got '" << r.front().function << "'");
+  TEST(r.front().function.find("[profiled:1]") != std::string::npos,
+       "expected the location, got '" << r.front().function << "'");
+  for (std::size_t i = 1; i < r.size(); ++i) {
+    TEST(r[i - 1].self >= r[i].self, "expected the hottest first");
+  }
+  bool saw_outer = false;
+  for (const auto & e : r) {
+    TEST(e.total >= e.self, "expected total to include self");
+    // Called from C, so only its location is known
+    if (e.function == " [profiled:7]") {
+      saw_outer = true;
+      TEST(e.total >= r.front().self, "expected outer on the stack of hot");
+    }
+  }
+  TEST(saw_outer, "expected outer in the report");
+
+  std::ostringstream os;
+  p.write_folded(os);
+  const std::string folded = os.str();
+  const auto outer_pos = folded.find(" [profiled:7];");
+  TEST(outer_pos != std::string::npos, "expected outer in the stacks");
+  TEST(folded.find(";", outer_pos) != std::string::npos,
+       "expected frames below outer");
+
+  // Coroutines created while it runs are sampled, and stop with it
+  p.reset();
+  TEST_EQ(p.samples(), 0u);
+  TEST(p.start(), "expected to start again");
+  run("in_thread");
+  p.stop();
+  const std::size_t in_thread = p.samples();
+  TEST(in_thread > 0, "expected samples in the coroutine");
+  run("in_thread");
+  TEST_EQ(p.samples(), in_thread);
+
+  // The hook is shared with an executor
+  {
+    primer::vm_executor exec{L};
+    TEST_EXPECTED(exec.install_count_hook(500));
+    TEST(p.start(), "expected to start alongside the executor");
+    bool ran = false;
+    exec.post([&ran](lua_State *) { ran = true; });
+    p.reset();
+    run("outer");
+    TEST(ran, "expected the task to run from the hook");
+    TEST(p.samples() > 0, "expected samples");
+    p.stop();
+    TEST(lua_gethook(L) != nullptr, "expected the executor to keep its hook");
+    exec.remove_count_hook();
+    TEST(lua_gethook(L) == nullptr, "expected no hook");
+  }
+
+  // A hook which isn't shared is left alone
+  lua_sethook(L, [](lua_State *, lua_Debug *) {}, LUA_MASKCOUNT, 1000);
+  TEST(!p.start(), "expected to refuse to replace a hook");
+  lua_sethook(L, nullptr, 0, 0);
+}
+
+struct test_api_instrumented
+  : primer::api::base<test_api_instrumented, -1, true> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, libs_);
+  API_FEATURE(primer::api::callbacks, cb_man_);
+
+  NEW_LUA_CALLBACK(add)(lua_State *, int a, int b)->primer::result {
+    static_cast<void>(a + b);
+    return 0;
+  }
+
+  NEW_LUA_CALLBACK(nap)(lua_State *)->primer::result {
+    std::this_thread::sleep_for(std::chrono::milliseconds{2});
+    return 0;
+  }
+
+  NEW_LUA_CALLBACK(fail)(lua_State *)->primer::result {
+    return primer::error{"failed"};
+  }
+
+  test_api_instrumented()
+    : L_()
+    , cb_man_(this) {
+    this->initialize_api(L_);
+  }
+};
+
+UNIT_TEST(callback_stats) {
+  // Without instrumentation, the list holds the adapted functions themselves
+  TEST(test_api_profiled::callbacks_array()[0].func
+         == PRIMER_ADAPT_EXTRASPACE(test_api_profiled,
+                                    &test_api_profiled::intf_make_list),
+       "expected no wrapper");
+
+  test_api_instrumented::reset_callback_stats();
+  test_api_instrumented a;
+  lua_State * L = a.L_;
+
+  const char * script = "for i = 1, 100 do add(i, i) end                   \n"
+                        "for i = 1, 5 do nap() end                         \n"
+                        "for i = 1, 3 do pcall(fail) end                   \n";
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  auto stats = test_api_instrumented::callback_stats();
+  TEST_EQ(stats.size(), 3u);
+  TEST_EQ(std::string{stats[0].name}, "add");
+  TEST_EQ(stats[0].calls, 100u);
+  TEST_EQ(stats[0].returned, 100u);
+  TEST(stats[0].p50 <= stats[0].p99, "expected p50 <= p99");
+
+  TEST_EQ(std::string{stats[1].name}, "nap");
+  TEST_EQ(stats[1].calls, 5u);
+  TEST(stats[1].p50 >= std::chrono::milliseconds{2}, "expected the naps");
+  TEST(stats[1].p50 > stats[0].p99, "expected nap to be slower than add");
+
+  // Calls which raise errors are counted, but have no latency
+  TEST_EQ(std::string{stats[2].name}, "fail");
+  TEST_EQ(stats[2].calls, 3u);
+  TEST_EQ(stats[2].returned, 0u);
+  TEST(stats[2].p99 == std::chrono::nanoseconds{0}, "expected no latency");
+
+  test_api_instrumented::reset_callback_stats();
+  TEST_EQ(test_api_instrumented::callback_stats()[0].calls, 0u);
+}
+
+struct test_api_arrays : primer::api::base<test_api_arrays> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, base_lib_);
+  API_FEATURE(primer::api::array_algorithms, arrays_);
+
+  test_api_arrays()
+    : L_() {
+    this->initialize_api(L_);
+  }
+};
+
+UNIT_TEST(array_algorithms) {
+  test_api_arrays a;
+  lua_State * L = a.L_;
+
+  lua_pushcfunction(L, &primer::api::intf_help_impl);
+  lua_setglobal(L, "help");
+
+  primer::push_typed_array<double>(L, nullptr, 0);
+  lua_setglobal(L, "empty");
+  {
+    const double d[] = {3, -1, 4, 1, 5, 0.0 / 0.0, 9, 2};
+    primer::push_typed_array(L, d, 8);
+    lua_setglobal(L, "d");
+    const double x[] = {1, 2, 3, 4, 5};
+    primer::push_typed_array(L, x, 5);
+    lua_setglobal(L, "x");
+    const int i[] = {5, 3, 3, 1, 2147483647};
+    primer::push_typed_array(L, i, 5);
+    lua_setglobal(L, "i");
+  }
+
+  const char * script =
+    "assert(array.sum(x) == 15)                                     \n"
+    "assert(array.sum(empty) == 0)                                  \n"
+    "assert(array.dot(x, x) == 55)                                  \n"
+    "assert(not pcall(array.dot, x, d))                             \n"
+    "local v, k = array.min(d)                                      \n"
+    "assert(v == -1 and k == 2)                                     \n"
+    "v, k = array.max(d)                                            \n"
+    "assert(v == 9 and k == 7)                                      \n"
+    "assert(array.min(empty) == nil)                                \n"
+    "local s = array.add(x, 1)                                      \n"
+    "assert(s[1] == 2 and s[5] == 6)                                \n"
+    "assert(array.sub(10, x)[1] == 9)                               \n"
+    "assert(array.mul(x, x)[5] == 25)                               \n"
+    "assert(array.scale(x, 2, s) == s and s[3] == 6)                \n"
+    "local p = array.prefix_sum(x)                                  \n"
+    "assert(p[1] == 1 and p[3] == 6 and p[5] == 15)                 \n"
+    "assert(array.prefix_sum(x, x) == x and x[5] == 15)             \n"
+    "local o = array.argsort(d)                                     \n"
+    "assert(#o == 8 and o[1] == 2 and o[2] == 4 and o[7] == 7)      \n"
+    "assert(o[8] == 6)                                              \n"
+    "assert(array.sort(d) == d)                                     \n"
+    "assert(d[1] == -1 and d[2] == 1 and d[7] == 9 and d[8] ~= d[8]) \n"
+    "assert(array.sum(i) == -2147483648 + 11)                       \n"
+    "assert(array.argsort(i)[2] == 2 and array.argsort(i)[3] == 3)  \n"
+    "assert(array.sort(i)[1] == 1)                                  \n"
+    "assert(not pcall(array.sum, {1, 2}))                           \n"
+    "assert(not pcall(array.sum, 1))                                \n"
+    "assert(help(array.argsort) ==                                  \n"
+    "       'argsort(a): The indices which sort a typed array')     \n";
+  TEST_LUA_OK(L, luaL_dostring(L, script));
+  CHECK_STACK(L, 0);
+}
+
+UNIT_TEST(soa_view) {
+  test_api_arrays a;
+  lua_State * L = a.L_;
+
+  std::vector<float> x{1, 2, 3, 4};
+  std::vector<float> y{10, 20, 30, 40};
+  const std::vector<int> id{7, 8, 9, 10};
+
+  {
+    primer::soa_columns cols{x.size()};
+    cols.add("x", x.data());
+    cols.add("y", y.data());
+    cols.add("id", id.data());
+    primer::push_soa_view(L, cols);
+    lua_setglobal(L, "view");
+
+    const char * script =
+      "assert(#view == 4 and #view.x == 4)                            \n"
+      "assert(view[1].x == 1 and view[4].y == 40 and view[2].id == 8) \n"
+      "assert(view[5] == nil and view[0] == nil and view.z == nil)    \n"
+      "assert(view[1].z == nil)                                       \n"
+      "view[1].x = view[1].x + view[1].y                              \n"
+      "local ys = view.y                                              \n"
+      "for i = 1, #ys do ys[i] = ys[i] * 2 end                        \n"
+      "assert(ys[5] == nil)                                           \n"
+      "assert(not pcall(function() ys[5] = 1 end))                    \n"
+      "assert(not pcall(function() view[1].z = 1 end))                \n"
+      "assert(not pcall(function() view[1].x = 'a' end))              \n"
+      "assert(not pcall(function() view[1].id = 1 end))               \n"
+      "assert(not pcall(function() view.id[1] = 1 end))               \n"
+      "assert(array.sum(view.x) == 20)                                \n"
+      "assert(array.sum(view.id) == 34)                               \n"
+      "assert(array.max(view.y) == 80)                                \n"
+      "assert(array.dot(view.x, view.x) == 11 * 11 + 4 + 9 + 16)      \n"
+      "array.scale(view.x, 2, view.x)                                 \n"
+      "assert(array.prefix_sum(view.id)[4] == 34)                     \n"
+      "assert(not pcall(array.sort, view.id))                         \n"
+      "assert(not pcall(array.dot, view.x, view.id))                  \n"
+      "array.sort(view.y)                                             \n";
+    TEST_LUA_OK(L, luaL_dostring(L, script));
+    TEST_EQ(x[0], 22);
+    TEST_EQ(x[3], 8);
+    TEST_EQ(y[0], 20);
+    TEST_EQ(y[3], 80);
+
+    // Rows which are removed can't be used through old proxies
+    TEST_LUA_OK(L, luaL_dostring(L, "row4 = view[4]"));
+    cols.set_rows(3);
+    TEST_LUA_OK(L, luaL_dostring(L, "assert(#view == 3 and view[4] == nil)"));
+    TEST_LUA_OK(L, luaL_dostring(L, "assert(not pcall(function()      \n"
+                                    "  return row4.x end))              \n"));
+
+    // Clearing expires the views
+    TEST_LUA_OK(L, luaL_dostring(L, "xs = view.x"));
+    cols.clear();
+    cols.add("x", x.data());
+    TEST_LUA_OK(L, luaL_dostring(L, "assert(not pcall(function()      \n"
+                                    "  return xs[1] end))               \n"
+                                    "assert(not pcall(array.sum, xs))   \n"));
+  }
+
+  // And so does destroying the columns
+  TEST_LUA_OK(L, luaL_dostring(L, "assert(not pcall(function()        \n"
+                                  "  return #view end))                 \n"
+                                  "view, row4, xs = nil                 \n"));
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  CHECK_STACK(L, 0);
+}
+
+struct test_api_raw_persist : primer::api::base<test_api_raw_persist> {
+  lua_raii L;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, base_lib_);
+  API_FEATURE(primer::api::array_algorithms, arrays_);
+  API_FEATURE(primer::api::userdatas<primer::byte_buffer>, udata_man_);
+
+  test_api_raw_persist()
+    : L() {
+    this->initialize_api(L);
+  }
+
+  using persistable::persist;
+  using persistable::unpersist;
+};
+
+UNIT_TEST(raw_persist) {
+  std::string buffer;
+  {
+    test_api_raw_persist a;
+    lua_State * L = a.L;
+
+    std::ostringstream empty;
+    TEST_EXPECTED(a.persist(L, empty));
+
+    std::vector<double> big(1000);
+    for (std::size_t i = 0; i < big.size(); ++i) { big[i] = 0.5 * i; }
+    primer::push_typed_array(L, big.data(), big.size());
+    lua_setglobal(L, "big");
+
+    const unsigned int u[] = {1, 4000000000u, 7};
+    primer::push_typed_array(L, u, 3);
+    lua_setglobal(L, "u");
+
+    primer::push_udata<primer::byte_buffer>(L);
+    primer::test_udata<primer::byte_buffer>(L, -1)->append("a\0b", 3);
+    lua_setglobal(L, "buf");
+
+    std::vector<float> x{1.5f, 2.5f};
+    const std::vector<int> id{7, 8};
+    primer::soa_columns cols{x.size()};
+    cols.add("x", x.data());
+    cols.add("id", id.data());
+    primer::push_soa_view(L, cols);
+    lua_setglobal(L, "view");
+    TEST_LUA_OK(L, luaL_dostring(L, "xs = view.x"));
+
+    // The elements are saved as one string, not as one value each
+    std::ostringstream ss;
+    TEST_EXPECTED(a.persist(L, ss));
+    buffer = ss.str();
+    TEST(buffer.size() < empty.str().size() + big.size() * sizeof(double)
+                           + 1024,
+         "snapshot is too large: " << buffer.size());
+
+    // A row proxy can't be persisted
+    TEST_LUA_OK(L, luaL_dostring(L, "row = view[1]"));
+    std::ostringstream bad;
+    TEST(!a.persist(L, bad), "expected failure persisting a row proxy");
+    lua_settop(L, 0);
+  }
+
+  test_api_raw_persist b;
+  lua_State * L = b.L;
+  TEST_EXPECTED(b.unpersist(L, buffer.data(), buffer.size()));
+  const char * script =
+    "assert(#big == 1000 and big[1] == 0 and big[1000] == 499.5)      \n"
+    "assert(array.sum(u) == 4000000008)                               \n"
+    "assert(#view == 2 and #view.x == 2 and view[2].id == 8)          \n"
+    "assert(view.x[2] == 2.5 and array.sum(view.id) == 15)            \n"
+    "assert(xs[1] == 1.5)                                             \n"
+    "xs[1] = 3                                                        \n"
+    "assert(view.x[1] == 1.5)                                         \n"
+    "local ids = view.id                                              \n"
+    "view = nil                                                       \n"
+    "collectgarbage()                                                 \n"
+    "assert(ids[2] == 8)                                              \n";
+  TEST_LUA_OK(L, luaL_dostring(L, script));
+
+  lua_getglobal(L, "buf");
+  const primer::byte_buffer * restored =
+    primer::test_udata<primer::byte_buffer>(L, -1);
+  TEST(restored, "expected a byte buffer");
+  TEST_EQ(std::string(reinterpret_cast<const char *>(restored->data()),
+                      restored->size()),
+          std::string("a\0b", 3));
+  lua_pop(L, 1);
+
+  // A block saved with the other byte order is swapped when it's restored
+  {
+    const unsigned int v[] = {0x01020304u, 5};
+    primer::detail::push_typed_array_restore(L, v, 2);
+    lua_getupvalue(L, -1, 1);
+    std::size_t len = 0;
+    const char * str = lua_tolstring(L, -1, &len);
+    std::string s{str, len};
+    lua_pop(L, 2);
+    s[2] = (s[2] == 'l') ? 'b' : 'l';
+    primer::detail::raw_persist_swap(&s[4], 1, 8);
+    primer::detail::raw_persist_swap(&s[12], 2, sizeof(unsigned int));
+    lua_pushlstring(L, s.data(), s.size());
+    lua_pushcclosure(L, &primer::detail::typed_array_restore<unsigned int>, 1);
+    TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+    auto * a = primer::test_udata<primer::typed_array<unsigned int>>(L, -1);
+    TEST(a && a->size() == 2, "expected a typed array of two elements");
+    TEST_EQ(a->data()[0], 0x01020304u);
+    TEST_EQ(a->data()[1], 5u);
+    lua_pop(L, 1);
+
+    // And a block of another element type is refused
+    s[1] = 2;
+    lua_pushlstring(L, s.data(), s.size());
+    lua_pushcclosure(L, &primer::detail::typed_array_restore<unsigned int>, 1);
+    TEST(lua_pcall(L, 0, 1, 0) != LUA_OK, "expected a bad block to fail");
+    lua_pop(L, 1);
+  }
+  CHECK_STACK(L, 0);
+}
+
+// Runs the tasks on three new threads each time
+struct test_thread_pool {
+  std::atomic<std::size_t> tasks{0};
+
+  static void run(void * self, std::size_t n,
+                  void (*task)(void *, std::size_t), void * data) {
+    auto p = static_cast<test_thread_pool *>(self);
+    std::atomic<std::size_t> next{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 3; ++t) {
+      threads.emplace_back([&]() {
+        for (std::size_t i; (i = next++) < n;) {
+          task(data, i);
+          ++p->tasks;
+        }
+      });
+    }
+    for (auto & t : threads) {
+      t.join();
+    }
+  }
+};
+
+UNIT_TEST(parallel_array_kernels) {
+  test_api_arrays a;
+  lua_State * L = a.L_;
+
+  {
+    auto & big = primer::push_typed_array<double>(L, nullptr, 1000);
+    for (std::size_t i = 0; i < big.size(); ++i) {
+      big[i] = static_cast<double>(i + 1);
+    }
+    lua_setglobal(L, "big");
+    auto & ints = primer::push_typed_array<int>(L, nullptr, 1000);
+    for (std::size_t i = 0; i < ints.size(); ++i) {
+      ints[i] = static_cast<int>(i % 7) - 3;
+    }
+    lua_setglobal(L, "ints");
+  }
+
+  test_thread_pool threads;
+  primer::parallel_pool pool{&threads, &test_thread_pool::run, 100, 64};
+  primer::set_parallel_pool(L, &pool);
+  TEST_EQ(primer::get_parallel_pool(L), &pool);
+
+  const char * script =
+    "assert(array.sum(big) == 500500)                               \n"
+    "assert(array.dot(big, big) == 333833500)                       \n"
+    "local v, k = array.max(big)                                    \n"
+    "assert(v == 1000 and k == 1000)                                \n"
+    "v, k = array.min(ints)                                         \n"
+    "assert(v == -3 and k == 1)                                     \n"
+    "v, k = array.max(ints)                                         \n"
+    "assert(v == 3 and k == 7)                                      \n"
+    "local p = array.prefix_sum(big)                                \n"
+    "assert(p[1] == 1 and p[500] == 125250 and p[1000] == 500500)   \n"
+    "local q = array.prefix_sum(ints)                               \n"
+    "local t = 0                                                    \n"
+    "for i = 1, #ints do                                            \n"
+    "  t = t + ints[i]                                              \n"
+    "  assert(q[i] == t)                                            \n"
+    "end                                                            \n"
+    "local s = array.add(big, 1)                                    \n"
+    "assert(s[1] == 2 and s[999] == 1000 and s[1000] == 1001)       \n"
+    "assert(array.mul(big, big)[1000] == 1000000)                   \n";
+  TEST_LUA_OK(L, luaL_dostring(L, script));
+  TEST(threads.tasks > 0, "expected tasks on the pool");
+
+  // Small inputs stay on the calling thread
+  const std::size_t before = threads.tasks;
+  TEST_LUA_OK(L, luaL_dostring(L, "assert(array.sum(array.add(big, 0)) > 0)"
+                                  "assert(array.sum(array.argsort(ints)))"));
+  TEST(threads.tasks > before, "expected tasks on the pool");
+  primer::push_typed_array<double>(L, nullptr, 10);
+  lua_setglobal(L, "small");
+  const std::size_t small_before = threads.tasks;
+  TEST_LUA_OK(L,
+              luaL_dostring(L, "assert(array.sum(array.add(small, 1)) == 10)"));
+  TEST_EQ(threads.tasks, small_before);
+
+  primer::set_parallel_pool(L, nullptr);
+  TEST(!primer::get_parallel_pool(L), "expected no pool");
+  TEST_LUA_OK(L, luaL_dostring(L, "assert(array.sum(big) == 500500)"));
+  TEST_EQ(threads.tasks, small_before);
+  CHECK_STACK(L, 0);
+}
+
+struct test_api_codec : primer::api::base<test_api_codec> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, base_lib_);
+  API_FEATURE(primer::api::codec, codec_);
+
+  test_api_codec()
+    : L_() {
+    this->initialize_api(L_);
+  }
+};
+
+UNIT_TEST(codec) {
+  test_api_codec a;
+  lua_State * L = a.L_;
+
+  primer::push_udata<primer::byte_buffer>(L);
+  lua_setglobal(L, "buf");
+
+  const char * script =
+    "local v = {1, 2.5, 'x', true, {a = {}, [10] = -3}, 2^40 // 1}     \n"
+    "for _, enc in ipairs{'msgpack', 'json'} do                        \n"
+    "  local s = codec['encode_' .. enc](v)                            \n"
+    "  local w = codec['decode_' .. enc](s)                            \n"
+    "  assert(#w == 6 and w[1] == 1 and w[2] == 2.5 and w[3] == 'x')   \n"
+    "  assert(w[4] == true and w[6] == 1099511627776)                  \n"
+    "  assert(tostring(w[1]) == '1' and tostring(w[2]) == '2.5')       \n"
+    "  assert(next(w[5].a) == nil)                                     \n"
+    "  assert(w[5][10] == -3 or w[5]['10'] == -3)                      \n"
+    "end                                                               \n"
+    "assert(codec.encode_json({1, 2.0, 'a\"b\\n', false}) ==          \n"
+    "       '[1,2.0,\"a\\\\\"b\\\\n\",false]')                         \n"
+    "assert(codec.encode_json({x = {}}) == '{\"x\":{}}')               \n"
+    "local j = codec.decode_json(' {\"a\" : [1, -2e3, {\"b\": null}],' \n"
+    "  .. '\\n \"c\": \"\\\\u00e9\\\\ud83d\\\\ude00\"} ')           \n"
+    "assert(j.a[1] == 1 and j.a[2] == -2000.0 and j.a[3].b == nil)     \n"
+    "assert(j.c == '\\195\\169\\240\\159\\152\\128')                   \n"
+    "assert(tostring(codec.decode_json('2.0')) == '2.0')               \n"
+    "assert(codec.encode_msgpack(1) == '\\1')                          \n"
+    "assert(codec.encode_msgpack(-1) == '\\255')                       \n"
+    "assert(codec.encode_msgpack({}) == '\\128')                       \n"
+    "assert(codec.encode_msgpack({7}) == '\\145\\7')                   \n"
+    "local min = -9223372036854775807 - 1                              \n"
+    "assert(codec.decode_msgpack(codec.encode_msgpack(min)) == min)    \n"
+    "assert(codec.decode_msgpack(codec.encode_msgpack(-200)) == -200)  \n"
+    "assert(codec.decode_msgpack('\\205\\1\\0') == 256)                \n"
+    "local r = {}                                                      \n"
+    "r.r = r                                                           \n"
+    "assert(not pcall(codec.encode_msgpack, r))                        \n"
+    "assert(not pcall(codec.encode_json, 0 / 0))                       \n"
+    "assert(not pcall(codec.encode_json, {[true] = 1}))                \n"
+    "assert(not pcall(codec.encode_msgpack, print))                    \n"
+    "assert(not pcall(codec.decode_msgpack, '\\146\\1'))               \n"
+    "assert(not pcall(codec.decode_msgpack, '\\221\\255\\255\\255\\255'))\n"
+    "assert(not pcall(codec.decode_msgpack, '\\1\\1'))                 \n"
+    "assert(not pcall(codec.decode_msgpack, '\\193'))                  \n"
+    "assert(not pcall(codec.decode_json, '[1,'))                       \n"
+    "assert(not pcall(codec.decode_json, '[1] x'))                     \n"
+    "assert(not pcall(codec.decode_json, '\"\\\\ud800\"'))             \n"
+    "assert(not pcall(codec.decode_json, string))                      \n"
+    "assert(codec.encode_msgpack({1, 2}, buf) == buf)                  \n"
+    "assert(codec.encode_json({3}, buf) == buf)                        \n"
+    "assert(#buf == 6)                                                 \n"
+    "assert(not pcall(codec.decode_msgpack, buf))                      \n"
+    "assert(codec.decode_msgpack(buf:slice(1, 3))[2] == 2)             \n";
+  TEST_LUA_OK(L, luaL_dostring(L, script));
+  CHECK_STACK(L, 0);
+
+  // From C++
+  TEST_LUA_OK(L, luaL_dostring(L, "return {n = 5, list = {'a', 'b'}}"));
+  std::string out;
+  TEST_EXPECTED(primer::api::codec::encode_msgpack(L, -1, out));
+  CHECK_STACK(L, 1);
+  lua_pop(L, 1);
+
+  TEST_EXPECTED(primer::api::codec::decode_msgpack(L, out.data(), out.size()));
+  CHECK_STACK(L, 1);
+  lua_getfield(L, -1, "n");
+  TEST_EQ(lua_tointeger(L, -1), 5);
+  lua_pop(L, 1);
+
+  std::string json;
+  TEST_EXPECTED(primer::api::codec::encode_json(L, -1, json));
+  TEST(json == "{\"n\":5,\"list\":[\"a\",\"b\"]}"
+         || json == "{\"list\":[\"a\",\"b\"],\"n\":5}",
+       "unexpected json: " + json);
+  lua_pop(L, 1);
+
+  // A failure pushes nothing, and leaves the output as it was
+  TEST(!primer::api::codec::decode_msgpack(L, out.data(), out.size() - 1),
+       "expected an error");
+  CHECK_STACK(L, 0);
+  lua_pushcfunction(L, &lua_gettop);
+  TEST(!primer::api::codec::encode_json(L, -1, json), "expected an error");
+  TEST(json.size() > 0 && json.back() == '}', "expected the output kept");
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
+}
+
+UNIT_TEST(metrics) {
+  using primer::api::metric_kind;
+  using primer::api::metric_sample;
+
+  primer::api::metrics m;
+  auto ids = primer::api::add_vm_metrics(m);
+  const auto frames = m.add_counter("test_frames_total", "Frames run");
+  primer::api::add_callback_metrics<test_api_instrumented>(m, "test");
+
+  auto & s1 = m.make_shard("vm=\"1\"");
+  auto & s2 = m.make_shard("vm=\"2\"");
+  TEST_EQ(m.shard_count(), 2u);
+
+  // Each shard is written by its own thread
+  std::thread t{[&]() {
+    for (int i = 0; i < 1000; ++i) {
+      s2.add(frames);
+    }
+  }};
+  for (int i = 0; i < 10; ++i) {
+    s1.add(frames);
+  }
+  t.join();
+
+  test_api_instrumented::reset_callback_stats();
+  test_api_instrumented a;
+  lua_State * L = a.L_;
+  TEST_LUA_OK(L, luaL_loadstring(L, "for i = 1, 7 do add(i, i) end"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  primer::api::publish_lua_memory(s1, ids, L);
+  s1.set(ids.coroutines, 3);
+  s1.record(ids.persist_seconds, std::chrono::microseconds{5});
+  s1.record(ids.persist_seconds, std::chrono::milliseconds{2});
+  {
+    primer::api::metrics::shard::timer timer{s2, ids.persist_seconds};
+  }
+  // Of the wrong kind, or not declared, is ignored
+  s1.set(frames, 5);
+  s1.add(12345);
+
+  auto find = [](const std::vector<metric_sample> & v, const std::string & n,
+                 const std::string & labels) -> const metric_sample * {
+    for (const auto & x : v) {
+      if (x.name == n && x.labels == labels) { return &x; }
+    }
+    return nullptr;
+  };
+
+  auto samples = m.collect();
+  auto f1 = find(samples, "test_frames_total", "vm=\"1\"");
+  auto f2 = find(samples, "test_frames_total", "vm=\"2\"");
+  TEST(f1 && f2, "expected both shards");
+  TEST_EQ(f1->value, 10.0);
+  TEST_EQ(f2->value, 1000.0);
+  TEST(f1->kind == metric_kind::counter, "expected a counter");
+
+  auto bytes = find(samples, "primer_lua_bytes", "vm=\"1\"");
+  TEST(bytes && bytes->value > 1000, "expected the memory in use");
+  TEST_EQ(find(samples, "primer_coroutines", "vm=\"1\"")->value, 3.0);
+
+  auto count = find(samples, "primer_persist_seconds_count", "vm=\"1\"");
+  TEST(count, "expected a histogram count");
+  TEST_EQ(count->value, 2.0);
+  auto sum = find(samples, "primer_persist_seconds_sum", "vm=\"1\"");
+  TEST(sum && sum->value > 0.002 && sum->value < 0.0021, "expected the sum");
+  auto inf =
+    find(samples, "primer_persist_seconds_bucket", "vm=\"1\",le=\"+Inf\"");
+  TEST(inf, "expected the last bucket");
+  TEST_EQ(inf->value, 2.0);
+  TEST_EQ(find(samples, "primer_persist_seconds_count", "vm=\"2\"")->value,
+          1.0);
+
+  auto calls = find(samples, "test_callback_calls_total", "callback=\"add\"");
+  TEST(calls, "expected the callback counters");
+  TEST_EQ(calls->value, 7.0);
+
+  // The text format
+  const std::string text = m.prometheus_text();
+  TEST(text.find("# TYPE test_frames_total counter\n") != std::string::npos,
+       "expected a type line");
+  TEST(text.find("test_frames_total{vm=\"2\"} 1000\n") != std::string::npos,
+       "expected a sample line");
+  TEST(text.find("# TYPE primer_persist_seconds histogram\n")
+         != std::string::npos,
+       "expected a histogram");
+
+  // The binary snapshot reads back
+  const std::string snap = m.snapshot();
+  auto back = primer::api::metrics::read_snapshot(snap);
+  TEST_EXPECTED(back);
+  TEST_EQ(back->size(), samples.size());
+  TEST_EQ(find(*back, "test_frames_total", "vm=\"2\"")->value, 1000.0);
+  TEST(!primer::api::metrics::read_snapshot(snap.substr(0, snap.size() - 1)),
+       "expected a truncated snapshot to fail");
+
+  m.remove_shard(s2);
+  TEST_EQ(m.shard_count(), 1u);
+  TEST(!find(m.collect(), "test_frames_total", "vm=\"2\""),
+       "expected the shard to be gone");
+}
+
+struct test_api_budget : primer::api::base<test_api_budget> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, base_lib_);
+  API_FEATURE(primer::api::libraries<primer::api::lua_coroutine_lib>, co_lib_);
+  API_FEATURE(primer::api::cpu_budget, budget_);
+
+  test_api_budget()
+    : L_() {
+    this->initialize_api(L_);
+  }
+
+  primer::bound_function get(const char * name) {
+    lua_getglobal(L_, name);
+    return primer::bound_function{L_};
+  }
+};
+
+UNIT_TEST(cpu_budget) {
+  using budget_t = primer::api::cpu_budget;
+
+  test_api_budget a;
+  lua_State * L = a.L_;
+  auto & b = a.budget_;
+
+  const char * script = "function spin() while true do end end             \n"
+                        "function stubborn()                               \n"
+                        "  while true do pcall(spin) end                   \n"
+                        "end                                               \n"
+                        "function count(n)                                 \n"
+                        "  local x = 0                                     \n"
+                        "  for i = 1, n do x = x + 1 end                   \n"
+                        "  return x                                        \n"
+                        "end                                               \n"
+                        "function bad() error('bad') end                   \n";
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  primer::bound_function spin = a.get("spin");
+  primer::bound_function stubborn = a.get("stubborn");
+  primer::bound_function count = a.get("count");
+  primer::bound_function bad = a.get("bad");
+
+  budget_t::limits lim;
+  lim.instructions = 100000;
+  b.set_limits(lim);
+
+  {
+    auto r = b.run([&]() { return spin.call_no_ret(); });
+    TEST(!r, "expected the loop to be stopped");
+    TEST(r.err().is_cpu_budget_exceeded(), "expected a budget error");
+    TEST(b.exceeded(), "expected the budget to be exceeded");
+    CHECK_STACK(L, 0);
+  }
+
+  {
+    auto r = b.run([&]() { return stubborn.call_no_ret(); });
+    TEST(!r, "expected pcall not to catch the budget");
+    TEST(r.err().is_cpu_budget_exceeded(), "expected a budget error");
+  }
+
+  {
+    auto r = b.run([&]() { return count.call_one_ret(1000); });
+    TEST_EXPECTED(r);
+    TEST(!b.exceeded(), "expected to stay within budget");
+  }
+
+  {
+    auto r = b.run([&]() { return bad.call_no_ret(); });
+    TEST(!r, "expected an error");
+    TEST(!r.err().is_cpu_budget_exceeded(), "expected the script's error");
+  }
+
+  // A hook which isn't shared is left alone, and the run fails
+  lua_Hook other = [](lua_State *, lua_Debug *) {};
+  lua_sethook(L, other, LUA_MASKCOUNT, 1000000);
+  {
+    auto r = b.run([&]() { return spin.call_no_ret(); });
+    TEST(!r, "expected failure");
+    TEST(!r.err().is_cpu_budget_exceeded(), "expected not to run");
+  }
+  TEST(lua_gethook(L) == other, "expected the other hook");
+  TEST_EQ(lua_gethookcount(L), 1000000);
+  lua_sethook(L, nullptr, 0, 0);
+
+  // Wall clock
+  lim.instructions = 0;
+  lim.wall = std::chrono::milliseconds{20};
+  b.set_limits(lim);
+  {
+    const auto start = std::chrono::steady_clock::now();
+    auto r = b.run([&]() { return spin.call_no_ret(); });
+    TEST(!r && r.err().is_cpu_budget_exceeded(), "expected a budget error");
+    TEST(std::chrono::steady_clock::now() - start < std::chrono::seconds{5},
+         "expected the loop to be stopped promptly");
+  }
+
+  // Preemption of a coroutine
+  lim.instructions = 10000;
+  lim.wall = budget_t::clock_t::duration{0};
+  lim.action = budget_t::on_exceed::yield;
+  b.set_limits(lim);
+  {
+    primer::coroutine co{count};
+    int resumes = 0;
+    primer::expected<primer::lua_ref> r;
+    do {
+      r = b.run(co, [&]() { return co.call_one_ret(100000); });
+      TEST_EXPECTED(r);
+      ++resumes;
+    } while (co && b.preempted() && resumes < 1000);
+    TEST(!co, "expected the coroutine to finish");
+    TEST(resumes > 2, "expected several resumes, got " << resumes);
+    auto n = r->as<int>();
+    TEST_EXPECTED(n);
+    TEST_EQ(*n, 100000);
+    TEST(lua_gethook(L) == nullptr, "expected no hook");
+  }
+}
+
+UNIT_TEST(cancel_token) {
+  lua_raii L;
+  luaL_openlibs(L);
+
+  // Each pcall in the loop is cancelled too
+  TEST_LUA_OK(L, luaL_loadstring(L, "while true do                           \n"
+                                    "  pcall(function() while true do end end)\n"
+                                    "end                                     \n"));
+  primer::bound_function spin{L};
+  TEST_LUA_OK(L, luaL_loadstring(L, "return 5"));
+  primer::bound_function five{L};
+  CHECK_STACK(L, 0);
+
+  primer::cancel_token token;
+  TEST(!token.attached(), "expected a detached token");
+  TEST_EXPECTED(token.attach(L));
+  TEST(token.attached(), "expected an attached token");
+  // No hook while nothing is pending
+  TEST(!lua_gethook(L), "expected no hook");
+  TEST_EQ(*token.run([&]() { return five.call_as<int>(); }), 5);
+
+  std::thread supervisor{[&token]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    token.cancel();
+  }};
+  auto r = token.run([&]() { return spin.call_no_ret(); });
+  supervisor.join();
+  TEST(!r, "expected the call to be cancelled");
+  TEST(r.err().is_cancelled(), "unexpected error: " << r.err().str());
+  TEST_EQ(r.err().str(), "cancelled");
+  CHECK_STACK(L, 0);
+
+  // Still cancelled, until reset
+  TEST(token.cancelled(), "expected the token to be cancelled");
+  auto again = token.run([&]() { return five.call_as<int>(); });
+  TEST(!again && again.err().is_cancelled(), "expected a cancelled call");
+  token.reset();
+  TEST(!lua_gethook(L), "expected no hook");
+  TEST_EQ(*token.run([&]() { return five.call_as<int>(); }), 5);
+
+  // Errors of the script are not cancellations
+  TEST_LUA_OK(L, luaL_loadstring(L, "error('oops')"));
+  primer::bound_function bad{L};
+  auto e = token.run([&]() { return bad.call_no_ret(); });
+  TEST(!e && !e.err().is_cancelled(), "expected an error of the script");
+
+  token.detach();
+  TEST(!token.attached(), "expected a detached token");
+  CHECK_STACK(L, 0);
+}
+
+struct test_api_async_io : primer::api::base<test_api_async_io> {
+  friend class primer::api::vm_template<test_api_async_io>;
+
+  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+  API_FEATURE(primer::api::async_io, io_);
+
+  explicit test_api_async_io(lua_State * L) { this->initialize_api(L); }
+};
+
+UNIT_TEST(async_io) {
+  char dir[] = "/tmp/primer_aio_XXXXXX";
+  TEST(mkdtemp(dir), "could not make a directory");
+  const std::string path = std::string{dir} + "/data.bin";
+
+  lua_raii L;
+  test_api_async_io a{L};
+  primer::scheduler sched;
+  a.io_.set_scheduler(&sched);
+
+  lua_pushstring(L, path.c_str());
+  lua_setglobal(L, "path");
+  const char * script =
+    "function task()                                                    \n"
+    "  assert(aio.write(path, 'hello world') == 11)                     \n"
+    "  local b = aio.read(path)                                         \n"
+    "  assert(#b == 11 and b:get_u8(1) == string.byte('h'))             \n"
+    "  local s = aio.stat(path)                                         \n"
+    "  assert(s.size == 11 and s.type == 'file')                        \n"
+    "  local part = aio.read(path, 6, 3)                                \n"
+    "  assert(#part == 3 and part:get_u8(1) == string.byte('w'))        \n"
+    "  assert(aio.write(path, part, 0) == 3)                            \n"
+    "  assert(#aio.read(path) == 11)                                    \n"
+    "  local missing, msg, code = aio.read(path .. '.missing')          \n"
+    "  assert(missing == nil and msg:find('missing') and code > 0)      \n"
+    "  done = true                                                      \n"
+    "end                                                                \n"
+    "reads = 0                                                          \n"
+    "function reader()                                                  \n"
+    "  local b = aio.read(path)                                         \n"
+    "  assert(b:get_u8(1) == string.byte('w'))                          \n"
+    "  reads = reads + 1                                                \n"
+    "end                                                                \n";
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  auto run = [&]() {
+    std::size_t most = 0;
+    for (int i = 0; sched.size() && i < 10000; ++i) {
+      a.io_.poll();
+      sched.tick();
+      if (a.io_.in_flight() > most) { most = a.io_.in_flight(); }
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    TEST_EQ(sched.size(), 0u);
+    auto errors = sched.take_errors();
+    TEST(errors.empty(), "unexpected error: " << errors[0].str());
+    return most;
+  };
+
+  lua_getglobal(L, "task");
+  TEST(sched.spawn(primer::bound_function{L}), "expected to spawn");
+  run();
+  lua_getglobal(L, "done");
+  TEST(lua_toboolean(L, -1), "expected the task to finish");
+  lua_pop(L, 1);
+
+  // Many operations in flight from one VM thread
+  lua_getglobal(L, "reader");
+  primer::bound_function reader{L};
+  for (int i = 0; i < 50; ++i) {
+    TEST(sched.spawn(reader), "expected to spawn");
+  }
+  sched.tick();
+  TEST_EQ(a.io_.in_flight(), 50u);
+  run();
+  TEST_EQ(a.io_.in_flight(), 0u);
+  lua_getglobal(L, "reads");
+  TEST_EQ(lua_tointeger(L, -1), 50);
+  lua_pop(L, 1);
+
+  // Outside of a task
+  TEST_LUA_OK(L, luaL_loadstring(L, "aio.stat(path)"));
+  TEST_EQ(LUA_ERRRUN, lua_pcall(L, 0, 0, 0));
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
+
+  std::remove(path.c_str());
+  rmdir(dir);
+}
+
+struct test_api_pool_map : primer::api::base<test_api_pool_map> {
+  API_FEATURE(primer::api::sandboxed_basic_libraries, libs_);
+  API_FEATURE(primer::api::pool_map<test_api_pooled>, map_);
+
+  explicit test_api_pool_map(lua_State * L) { this->initialize_api(L); }
+};
+
+UNIT_TEST(pool_map) {
+  using pool_t = primer::api::vm_worker_pool<test_api_pooled>;
+
+  const char * module = "function square(x) return x * x end             \n"
+                        "function fail(x)                                \n"
+                        "  if x == 7 then error('bad item') end          \n"
+                        "  return x                                      \n"
+                        "end                                             \n"
+                        "function shape(t) return {t.name, #t.list} end  \n";
+  pool_t pool{3, [module](test_api_pooled &, lua_State * L) {
+                TEST_LUA_OK(L, luaL_loadstring(L, module));
+                TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+              }};
+
+  lua_raii L;
+  test_api_pool_map a{L};
+  primer::scheduler sched;
+  a.map_.set_pool(&pool);
+  a.map_.set_scheduler(&sched);
+
+  const char * script =
+    "function task()                                                    \n"
+    "  local items = {}                                                 \n"
+    "  for i = 1, 100 do items[i] = i end                               \n"
+    "  local r = pool.map('square', items)                              \n"
+    "  assert(#r == 100)                                                \n"
+    "  for i = 1, 100 do assert(r[i] == i * i) end                      \n"
+    "  assert(next(pool.map('square', {})) == nil)                      \n"
+    "  local s = pool.map('shape', {{name = 'a', list = {1, 2}},        \n"
+    "                               {name = 'b', list = {}}})           \n"
+    "  assert(s[1][1] == 'a' and s[1][2] == 2)                          \n"
+    "  assert(s[2][1] == 'b' and s[2][2] == 0)                          \n"
+    "  local bad, msg = pool.map('fail', items)                         \n"
+    "  assert(bad == nil and msg:find('item #7') and msg:find('bad'))   \n"
+    "  local ok, err = pcall(pool.map, 'square', {1, function() end})  \n"
+    "  assert(not ok and err:find('item #2'))                           \n"
+    "  done = true                                                      \n"
+    "end                                                                \n";
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  lua_getglobal(L, "task");
+  TEST(sched.spawn(primer::bound_function{L}), "expected to spawn");
+  for (int i = 0; sched.size() && i < 10000; ++i) {
+    a.map_.poll();
+    sched.tick();
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+  TEST_EQ(sched.size(), 0u);
+  auto errors = sched.take_errors();
+  TEST(errors.empty(), "unexpected error: " << errors[0].str());
+  TEST_EQ(a.map_.in_flight(), 0u);
+  lua_getglobal(L, "done");
+  TEST(lua_toboolean(L, -1), "expected the task to finish");
+  lua_pop(L, 1);
+
+  // Outside of a task
+  TEST_LUA_OK(L, luaL_loadstring(L, "pool.map('square', {1})"));
+  TEST_EQ(LUA_ERRRUN, lua_pcall(L, 0, 0, 0));
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
+}
+
+struct test_api_traced : primer::api::base<test_api_traced> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, base_lib_);
+  API_FEATURE(primer::api::libraries<primer::api::lua_coroutine_lib>, co_lib_);
+  API_FEATURE(primer::api::call_tracer, tracer_);
+
+  test_api_traced()
+    : L_()
+    , tracer_(8) {
+    this->initialize_api(L_);
+  }
+
+  primer::bound_function get(const char * name) {
+    lua_getglobal(L_, name);
+    return primer::bound_function{L_};
+  }
+};
+
+UNIT_TEST(call_tracer) {
+  using span = primer::api::call_tracer::span;
+
+  test_api_traced a;
+  lua_State * L = a.L_;
+  auto & t = a.tracer_;
+
+  const char * script = "function add(a, b) return a + b end               \n"
+                        "function fail() error('no') end                   \n"
+                        "function gen(n)                                   \n"
+                        "  for i = 1, n do coroutine.yield(i) end          \n"
+                        "end                                               \n";
+  TEST_LUA_OK(L, luaL_loadbuffer(L, script, std::strlen(script), "=traced"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  primer::bound_function add = a.get("add");
+  primer::bound_function fail = a.get("fail");
+  primer::bound_function gen = a.get("gen");
+
+  // Not traced until started
+  TEST_EXPECTED(add.call_one_ret(1, 2));
+  TEST_EQ(t.spans().size(), 0u);
+
+  struct hook_counts {
+    int begun = 0;
+    int ended = 0;
+  } counts;
+  t.set_hook(
+    [](void * ud, const span &, bool ended) {
+      auto c = static_cast<hook_counts *>(ud);
+      ++(ended ? c->ended : c->begun);
+    },
+    &counts);
+
+  t.start();
+  TEST_EXPECTED(add.call_one_ret(1, 2));
+  {
+    primer::lua_ref_seq args;
+    lua_pushinteger(L, 3);
+    args.emplace_back(L);
+    lua_pushinteger(L, 4);
+    args.emplace_back(L);
+    TEST_EXPECTED(add.call_one_ret(args));
+  }
+  TEST(!fail.call_no_ret(), "expected an error");
+  {
+    primer::coroutine co{gen};
+    TEST_EXPECTED(co.call_one_ret(2));
+    TEST_EXPECTED(co.call_one_ret());
+    TEST_EXPECTED(co.call_one_ret());
+    TEST(!co, "expected the coroutine to finish");
+  }
+  t.stop();
+  TEST_EXPECTED(add.call_one_ret(1, 2));
+  CHECK_STACK(L, 0);
+
+  std::vector<span> s = t.spans();
+  TEST_EQ(s.size(), 6u);
+  TEST_EQ(counts.begun, 6);
+  TEST_EQ(counts.ended, 6);
+
+  TEST_EQ(t.function_name(s[0].function), "[traced:1]");
+  TEST_EQ(s[0].function, s[1].function);
+  TEST_EQ(s[0].nargs, 2);
+  TEST_EQ(s[1].nargs, 2);
+  TEST(s[0].ok && !s[0].resume, "expected a successful call");
+
+  TEST_EQ(t.function_name(s[2].function), "[traced:2]");
+  TEST(!s[2].ok, "expected a failed call");
+
+  for (int i = 3; i < 6; ++i) {
+    TEST(s[i].resume && s[i].ok, "expected a resume at " << i);
+    TEST_EQ(t.function_name(s[i].function), "[traced:3]");
+  }
+  TEST_EQ(s[3].nargs, 1);
+  TEST_EQ(s[4].nargs, 0);
+  TEST(s[0].start_ns <= s[5].start_ns, "expected spans in order");
+
+  std::ostringstream ss;
+  t.write_chrome_trace(ss);
+  const std::string trace = ss.str();
+  TEST(trace.find("\"name\":\"[traced:3]\",\"cat\":\"resume\",\"ph\":\"X\"")
+         != std::string::npos,
+       "unexpected trace:\n" << trace);
+  TEST(trace.find("\"ok\":false") != std::string::npos,
+       "unexpected trace:\n" << trace);
+
+  // The ring keeps the newest spans
+  t.start();
+  for (int i = 0; i < 5; ++i) {
+    TEST_EXPECTED(add.call_one_ret(i, i));
+  }
+  t.stop();
+  s = t.spans();
+  TEST_EQ(s.size(), 8u);
+  TEST_EQ(t.overwritten(), 3u);
+  TEST_EQ(t.function_name(s[0].function), "[traced:3]");
+  TEST_EQ(t.function_name(s[7].function), "[traced:1]");
+
+  t.clear();
+  TEST_EQ(t.spans().size(), 0u);
+
+  // A coroutine which started before tracing
+  {
+    primer::coroutine co{gen};
+    TEST_EXPECTED(co.call_one_ret(3));
+    t.start();
+    TEST_EXPECTED(co.call_one_ret());
+    t.stop();
+    s = t.spans();
+    TEST_EQ(s.size(), 1u);
+    TEST_EQ(t.function_name(s[0].function), "[traced:3]");
+  }
+  CHECK_STACK(L, 0);
+}
+
+struct test_api_ref_tracked : primer::api::base<test_api_ref_tracked> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::ref_tracker, refs_);
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, libs_);
+
+  test_api_ref_tracked()
+    : L_()
+    , refs_(true) {
+    this->initialize_api(L_);
+  }
+};
+
+UNIT_TEST(ref_tracker) {
+  using order = primer::api::ref_tracker::order;
+
+  test_api_ref_tracked a;
+  lua_State * L = a.L_;
+  auto & t = a.refs_;
+  const std::size_t base = t.live();
+  TEST_EQ(t.sites().size(), base);
+
+  std::vector<primer::lua_ref> kept;
+  for (int i = 0; i < 2; ++i) {
+    lua_newtable(L);
+    primer::lua_ref r{L};
+    kept.push_back(std::move(r));
+  }
+  for (int i = 0; i < 3; ++i) {
+    lua_newtable(L);
+    primer::lua_ref r{L};
+    kept.push_back(std::move(r));
+  }
+  TEST_EQ(t.live(), base + 5);
+
+  // Nil takes no slot
+  lua_pushnil(L);
+  primer::lua_ref nil_ref{L};
+  TEST_EQ(t.live(), base + 5);
+
+  std::vector<primer::api::ref_tracker::site_stat> s = t.sites();
+  TEST_EQ(s.size(), 2u);
+  TEST_EQ(s[0].refs, 3u);
+  TEST_EQ(s[1].refs, 2u);
+  TEST(s[0].site && s[0].site != s[1].site, "expected two sites");
+  s = t.sites(order::oldest);
+  TEST_EQ(s[0].refs, 2u);
+
+  // A copy is a ref of its own
+  {
+    primer::lua_ref copy = kept[0];
+    TEST_EQ(t.live(), base + 6);
+    TEST_EQ(t.sites().size(), 3u);
+  }
+  TEST_EQ(t.live(), base + 5);
+
+  std::ostringstream ss;
+  t.write_report(ss);
+  TEST(ss.str().find("refs\toldest (s)\tsite\n3\t") != std::string::npos,
+       "unexpected report:\n" << ss.str());
+
+  primer::api::metrics m;
+  auto ids = primer::api::add_ref_metrics(m);
+  auto & shard = m.make_shard("vm=\"1\"");
+  primer::api::publish_refs(shard, ids, t);
+  const auto samples = m.collect();
+  TEST_EQ(samples.size(), 3u);
+  TEST_EQ(samples[0].name, "primer_lua_refs");
+  TEST_EQ(samples[0].value, static_cast<double>(base + 5));
+  TEST_EQ(samples[2].value, 2.0);
+
+  // A ref released on another thread is counted when it is unreffed
+  const std::uint64_t released = t.released();
+  std::thread([&kept]() { kept.back().reset(); }).join();
+  TEST_EQ(t.live(), base + 5);
+  TEST_EQ(primer::release_deferred_refs(L), 1u);
+  TEST_EQ(t.live(), base + 4);
+  TEST_EQ(t.released(), released + 1);
+
+  kept.clear();
+  TEST_EQ(t.live(), base);
+  TEST_EQ(t.sites().size(), base);
+
+  // Without sites, only the counts are kept
+  t.set_capture_sites(false);
+  lua_newtable(L);
+  primer::lua_ref r{L};
+  TEST_EQ(t.live(), base + 1);
+  TEST_EQ(t.sites().size(), 0u);
+  r.reset();
+  TEST_EQ(t.live(), base);
+  CHECK_STACK(L, 0);
+}
+
+struct test_api_formatting : primer::api::base<test_api_formatting> {
+  lua_raii L_;
+
+  using libs_t = primer::api::libraries<primer::api::lua_base_lib,
+                                        primer::api::lua_math_lib,
+                                        primer::api::lua_string_lib>;
+
+  API_FEATURE(libs_t, libs_);
+  API_FEATURE(primer::api::format, format_);
+
+  test_api_formatting()
+    : L_()
+    , format_(2) {
+    this->initialize_api(L_);
+  }
+
+  primer::expected<void> save(std::string & buffer) {
+    return this->persist(L_, buffer);
+  }
+  primer::expected<void> restore(const std::string & buffer) {
+    return this->unpersist(L_, buffer);
+  }
+};
+
+UNIT_TEST(api_format) {
+  using primer::api::format_string;
+
+  test_api_formatting a;
+  lua_State * L = a.L_;
+
+  // The results and the errors are those of string.format
+  const char * script =
+    "local function ours(...) local s = format(...) return s end           \n"
+    "local function theirs(...) local s = string.format(...) return s end  \n"
+    "local function check(...)                                             \n"
+    "  local ok1, r1 = pcall(ours, ...)                                    \n"
+    "  local ok2, r2 = pcall(theirs, ...)                                  \n"
+    "  if not ok1 then                                                     \n"
+    "    r1, r2 = r1:gsub('^.-:%d+: ', ''), r2:gsub('^.-:%d+: ', '')       \n"
+    "  end                                                                 \n"
+    "  assert(ok1 == ok2 and r1 == r2, tostring(r1) .. ' ~= ' .. tostring(r2))\n"
+    "end                                                                   \n"
+    "local t = setmetatable({}, {__tostring = function() return 'T' end})  \n"
+    "check('plain text')                                                   \n"
+    "check('%d items', 42)                                                 \n"
+    "check('%d %i', math.mininteger, math.maxinteger)                      \n"
+    "check('%5.2f|%-8s|%x', 3.14159, 'ab', 255)                            \n"
+    "check('%c%c|%-5d|%05d|%+d', 72, 105, 3, 4, 5)                         \n"
+    "check('%o %X %u %#x', 8, 255, 3, 16)                                  \n"
+    "check('%g %e %a %G', 1e20, 0.5, 1, 1e-10)                             \n"
+    "check('%q', 'a \"q\"\\n\\0001\\r')                                    \n"
+    "check('%q %q %q %q', 1/3, math.mininteger, 7, true)                   \n"
+    "check('%s %s %s %s %s', nil, true, t, 1.0, 10)                        \n"
+    "check('%10.3s|%-4s|', 'abcdef', 'x')                                  \n"
+    "check('%s', string.rep('x', 200))                                     \n"
+    "check('%5s', string.rep('y', 150))                                    \n"
+    "check('%%%d%% a\\0b', 5)                                              \n"
+    "check('%d', '12')                                                     \n"
+    "check('%d', 1.5)                                                      \n"
+    "check('%d', 'x')                                                      \n"
+    "check('%d and %d', 1)                                                 \n"
+    "check('%y')                                                           \n"
+    "check('%d %y', 1, 2)                                                  \n"
+    "check('%------d', 1)                                                  \n"
+    "check('%100d', 1)                                                     \n"
+    "check('%q', {})                                                       \n"
+    "check('%5s', 'a\\0b')                                                 \n"
+    "check('%')                                                            \n"
+    "check('%', 1)                                                         \n"
+    "check(12)                                                             \n";
+  TEST_LUA_OK(L, luaL_dostring(L, script));
+
+  // The cache keeps the formats used last
+  const std::uint64_t hits = a.format_.hits();
+  const std::uint64_t misses = a.format_.misses();
+  TEST_LUA_OK(L, luaL_dostring(L, "format('1 %d', 1) format('2 %d', 2)"
+                                  "format('1 %d', 1) format('3 %d', 3)"
+                                  "format('2 %d', 2)"));
+  TEST_EQ(a.format_.hits(), hits + 1);
+  TEST_EQ(a.format_.misses(), misses + 4);
+  TEST_EQ(a.format_.size(), 2u);
+
+  // A program which is evicted while it runs is kept alive by its call
+  const char * nested =
+    "local t = setmetatable({}, {__tostring = function()                  \n"
+    "  local s = format('x%d', 1) .. format('y%d', 2) .. format('z%d', 3) \n"
+    "  collectgarbage()                                                   \n"
+    "  return s                                                           \n"
+    "end})                                                                \n"
+    "assert(format('[%s|%d]', t, 5) == '[x1y2z3|5]')                      \n"
+    "g = format                                                           \n";
+  TEST_LUA_OK(L, luaL_dostring(L, nested));
+
+  // The function survives persistence
+  std::string buffer;
+  TEST_EXPECTED(a.save(buffer));
+  TEST_EXPECTED(a.restore(buffer));
+  TEST_LUA_OK(L, luaL_dostring(L, "assert(g('%d-%s', 5, 'a') == '5-a')"));
+  TEST_LUA_OK(L, luaL_dostring(L, "assert(format('%d', 6) == '6')"));
+
+  // C++ uses the same programs
+  {
+    const primer::api::format_program p{"%-6s|%5.1f|%d|%s|%s"};
+    auto r = p({"ab", 2.5, 7u, true, primer::api::format_arg{}});
+    TEST_EXPECTED(r);
+    TEST_EQ(*r, "ab    |  2.5|7|true|nil");
+
+    std::string out = "> ";
+    TEST_EXPECTED(p.format_to(out, {std::string{"x"}, 1, -2, false, 'c'}));
+    TEST_EQ(out, "> x     |  1.0|-2|false|99");
+  }
+  {
+    auto r = format_string("%d%% %s %s %q", {3.0, 1.0, 10, "a\nb"});
+    TEST_EXPECTED(r);
+    TEST_EQ(*r, "3% 1.0 10 \"a\\\nb\"");
+  }
+  {
+    auto r = format_string("%d", {1.5});
+    TEST(!r, "expected an error");
+    TEST_EQ(r.err().str(), "bad argument #1 to 'format' "
+                           "(number has no integer representation)");
+    r = format_string("%d %d", {1});
+    TEST(!r, "expected an error");
+    TEST_EQ(r.err().str(), "bad argument #2 to 'format' (no value)");
+    r = format_string("%f", {"x"});
+    TEST(!r, "expected an error");
+    TEST_EQ(r.err().str(),
+            "bad argument #1 to 'format' (number expected, got string)");
+    r = format_string("%y", {1});
+    TEST(!r, "expected an error");
+    TEST_EQ(r.err().str(), "invalid option '%y' to 'format'");
+  }
+  CHECK_STACK(L, 0);
+}
+
+struct test_api_recorded : primer::api::base<test_api_recorded> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, base_lib_);
+  API_FEATURE(primer::api::call_recorder, rec_);
+
+  test_api_recorded()
+    : L_() {
+    this->initialize_api(L_);
+  }
+
+  primer::bound_function get(const char * name) {
+    lua_getglobal(L_, name);
+    return primer::bound_function{L_};
+  }
+};
+
+int
+test_recorded_rng(lua_State * L) {
+  static lua_Integer n = 0;
+  lua_pushinteger(L, ++n * 100);
+  return 1;
+}
+
+UNIT_TEST(call_recorder) {
+  test_api_recorded a;
+  lua_State * L = a.L_;
+  auto & rec = a.rec_;
+
+  const char * script = "counter = 0                                       \n"
+                        "function step(x)                                  \n"
+                        "  counter = counter + x                           \n"
+                        "  last = counter + rng()                          \n"
+                        "  return last                                     \n"
+                        "end                                               \n"
+                        "function keep(t) kept = t.name end                \n"
+                        "function fail() error('no') end                   \n";
+  TEST_LUA_OK(L, luaL_loadbuffer(L, script, std::strlen(script), "=recorded"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  lua_register(L, "rng", &test_recorded_rng);
+
+  TEST_EXPECTED(rec.stub(L, "rng"));
+  TEST_EQ(*rec.stub(L, "rng"), true);
+  TEST_EQ(*rec.stub(L, "no_such_function"), false);
+
+  primer::bound_function step = a.get("step");
+  primer::bound_function keep = a.get("keep");
+  primer::bound_function fail = a.get("fail");
+
+  // Not recorded until started
+  TEST_EXPECTED(step.call_one_ret(0));
+  TEST_EQ(rec.calls_recorded(), 0u);
+
+  rec.start();
+  {
+    auto r = step.call_as<int>(1);
+    TEST_EXPECTED(r);
+    TEST_EQ(*r, 201);
+  }
+  {
+    lua_newtable(L);
+    lua_pushliteral(L, "a");
+    lua_setfield(L, -2, "name");
+    lua_getglobal(L, "print");
+    lua_setfield(L, -2, "f");
+    primer::lua_ref t{L};
+    TEST_EXPECTED(keep.call_no_ret(t));
+  }
+  {
+    auto r = step.call_as<int>(2);
+    TEST_EXPECTED(r);
+    TEST_EQ(*r, 303);
+  }
+  TEST(!fail.call_no_ret(), "expected an error");
+  rec.stop();
+
+  TEST_EQ(rec.calls_recorded(), 4u);
+  TEST_EQ(rec.lossy_values(), 1u);
+  TEST(!rec.incomplete(), "expected a complete recording");
+  const std::string trace = rec.trace();
+
+  // Replay from the starting state, with rng giving the recorded numbers
+  TEST_LUA_OK(L, luaL_dostring(L, "counter = 0 kept = nil"));
+  {
+    auto report = rec.replay(L, trace);
+    TEST_EXPECTED(report);
+    TEST_EQ(report->calls, 4u);
+    TEST_EQ(report->failed, 1u);
+    TEST_EQ(report->unresolved, 0u);
+    TEST_EQ(report->durations.size(), 4u);
+    TEST_EQ(report->errors.size(), 1u);
+    TEST(std::string{report->errors[0].what()}.find("no") != std::string::npos,
+         "unexpected error: " << report->errors[0].what());
+  }
+  TEST_LUA_OK(L, luaL_dostring(L, "assert(counter == 3)"
+                                  "assert(last == 303)"
+                                  "assert(kept == 'a')"));
+
+  // The stub calls rng again outside of a recording or replay
+  {
+    auto r = step.call_as<int>(0);
+    TEST_EXPECTED(r);
+    TEST_EQ(*r, 403);
+  }
+
+  // Functions which can't be found are skipped
+  {
+    auto report =
+      rec.replay(L, trace, [](lua_State *, const std::string & where) {
+        return where == "[C]";
+      });
+    TEST_EXPECTED(report);
+    TEST_EQ(report->calls, 0u);
+    TEST_EQ(report->unresolved, 4u);
+  }
+
+  TEST(!rec.replay(L, "junk"), "expected an error");
+  TEST(!rec.replay(L, trace.substr(0, trace.size() - 1)),
+       "expected an error");
+
+  rec.clear();
+  TEST_EQ(rec.calls_recorded(), 0u);
+  TEST_EQ(rec.trace().size(), 4u);
+  CHECK_STACK(L, 0);
+}
+
+UNIT_TEST(state_refs_across_threads) {
+  lua_raii L;
+  primer::lua_state_ref ref = primer::obtain_state_ref(L);
+  TEST(ref.lock() == L, "expected a live state ref");
+
+  // Workers copy and drop refs until they see the state closed
+  std::atomic<int> started{0};
+  std::vector<std::thread> workers;
+  for (int i = 0; i < 4; ++i) {
+    workers.emplace_back([&started, ref]() {
+      ++started;
+      for (;;) {
+        primer::lua_state_ref copy{ref};
+        primer::lua_state_ref other{std::move(copy)};
+        if (!other.lock()) { return; }
+      }
+    });
+  }
+  while (started.load() < 4) {
+    std::this_thread::yield();
+  }
+
+  primer::close_state_refs(L);
+  for (auto & t : workers) {
+    t.join();
+  }
+  TEST(!ref.lock(), "expected the state ref to be closed");
+}
+
+UNIT_TEST(deferred_ref_release) {
+  lua_raii L;
+  primer::lua_ref_pool pool{L};
+
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_setglobal(L, "weak");
+
+  // Half of the refs are pooled, and each object is also in the weak table
+  std::vector<primer::lua_ref> refs;
+  for (int i = 0; i < 20; ++i) {
+    lua_getglobal(L, "weak");
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, i + 1);
+    if (i % 2) {
+      refs.emplace_back(pool, L);
+    } else {
+      refs.emplace_back(L);
+    }
+    lua_pop(L, 1);
+  }
+
+  auto count_weak = [&L]() {
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    lua_getglobal(L, "weak");
+    int n = 0;
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      lua_pop(L, 1);
+      ++n;
+    }
+    lua_pop(L, 1);
+    return n;
+  };
+
+  std::thread t{[&refs]() { refs.clear(); }};
+  t.join();
+
+  // Nothing was unreffed by the other thread
+  TEST_EQ(count_weak(), 20);
+  TEST_EQ(primer::release_deferred_refs(L), 20u);
+  TEST_EQ(primer::release_deferred_refs(L), 0u);
+  TEST_EQ(count_weak(), 0);
+
+  // Released on the owner thread, it is immediate
+  lua_newtable(L);
+  primer::lua_ref local{L};
+  local.reset();
+  TEST_EQ(primer::release_deferred_refs(L), 0u);
+
+  // The collector drains the queue, once asked to
+  primer::release_deferred_refs_on_gc(L);
+  lua_getglobal(L, "weak");
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, -3, 1);
+  primer::lua_ref last{L};
+  lua_pop(L, 1);
+  std::thread{[&last]() { last.reset(); }}.join();
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  TEST_EQ(count_weak(), 0);
+}
+
+UNIT_TEST(state_ref_cache_threads) {
+  lua_State * l2 = nullptr;
+  primer::lua_state_ref r2;
+  {
+    lua_raii L1;
+    lua_raii L2;
+    lua_State * l1 = L1;
+    l2 = L2;
+
+    // Alternating states, each finds its own ref
+    for (int i = 0; i < 3; ++i) {
+      TEST_EQ(l1, primer::obtain_state_ref(L1).lock());
+      TEST_EQ(l2, primer::obtain_state_ref(L2).lock());
+    }
+
+    // The states move to another thread, which caches refs of its own
+    std::thread{[&]() {
+      TEST_EQ(l1, primer::obtain_state_ref(L1).lock());
+      r2 = primer::obtain_state_ref(L2);
+    }}.join();
+
+    primer::close_state_refs(L1);
+    TEST(!primer::obtain_state_ref(L1).lock(), "expected a dead ref");
+    TEST_EQ(l2, primer::obtain_state_ref(L2).lock());
+  }
+
+  // Refs obtained on the other thread see that the state closed
+  TEST(!r2.lock(), "expected the state ref to be closed");
+  lua_raii L3;
+  lua_State * l3 = L3;
+  TEST_EQ(l3, primer::obtain_state_ref(L3).lock());
+}
+
+UNIT_TEST(vm_executor) {
+  lua_raii L;
+  const char * script = "function add(a, b) return a + b end\n"
+                        "count = 0\n"
+                        "function bump() count = count + 1 end\n";
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  std::vector<primer::bound_function> fs;
+  for (int i = 0; i < 4; ++i) {
+    lua_getglobal(L, "add");
+    fs.emplace_back(L);
+  }
+
+  std::atomic<int> done{0};
+  std::atomic<int> correct{0};
+  {
+    primer::vm_executor exec{L};
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < 4; ++i) {
+      workers.emplace_back([&, i]() {
+        auto r = exec.post_call<int>(std::move(fs[i]), i, 10);
+        for (int j = 0; j < 25; ++j) {
+          exec.post([](lua_State * L) {
+            lua_getglobal(L, "bump");
+            lua_call(L, 0, 0);
+          });
+        }
+        auto v = r.get();
+        if (v && *v == i + 10) { ++correct; }
+        ++done;
+      });
+    }
+
+    while (done.load() < 4) {
+      exec.run_pending();
+      std::this_thread::yield();
+    }
+    for (auto & t : workers) {
+      t.join();
+    }
+    exec.run_pending();
+    TEST_EQ(correct.load(), 4);
+    lua_getglobal(L, "count");
+    TEST_EQ(lua_tointeger(L, -1), 100);
+    lua_pop(L, 1);
+
+    // Errors are kept
+    exec.post([](lua_State * L) { luaL_error(L, "boom"); });
+    TEST_EQ(exec.run_pending(), 1u);
+    auto errors = exec.take_errors();
+    TEST_EQ(errors.size(), 1u);
+    TEST_EQ(exec.run_pending(), 0u);
+
+    // The count hook runs work while a script is busy
+    TEST_EXPECTED(exec.install_count_hook(100));
+    std::thread poster{[&exec]() {
+      exec.post([](lua_State * L) {
+        lua_pushboolean(L, true);
+        lua_setglobal(L, "flag");
+      });
+    }};
+    TEST_LUA_OK(L, luaL_loadstring(L, "while not flag do end"));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+    poster.join();
+    exec.remove_count_hook();
+    TEST(!lua_gethook(L), "expected the hook to be removed");
+    TEST_EQ(lua_gettop(L), 0);
+  }
+
+  // An executor which goes away with a call still pending breaks the promise
+  std::future<primer::expected<int>> dropped;
+  {
+    primer::vm_executor exec{L};
+    lua_getglobal(L, "add");
+    primer::bound_function f{L};
+    dropped = exec.post_call<int>(std::move(f), 1, 2);
+  }
+  try {
+    dropped.get();
+    TEST(false, "expected a broken promise");
+  } catch (const std::future_error &) {}
+}
+
+/***
+ * Test registry slots
+ */
+
+static void
+slot_test_table(lua_State * L) {
+  lua_newtable(L);
+}
+
+struct slot_test_owner {};
+
+UNIT_TEST(registry_slots) {
+  using helper_t = primer::registry_helper<slot_test_owner>;
+  using producer_t =
+    std::integral_constant<lua_CFunction,
+                           primer::detail::wrapped_as_cfunc<&slot_test_table>>;
+  using slot_t = primer::detail::registry_slot<producer_t>;
+  TEST(slot_t::value, "expected the singleton to have a slot");
+  TEST(primer::detail::registry_slot<helper_t>::value,
+       "expected the helper to have a slot");
+
+  // An initialized state has slots, and uses them
+  {
+    test_api_two a;
+    lua_State * L = a.L_;
+    TEST(primer::detail::registry_slots_reserved(L), "expected slots");
+
+    primer::push_singleton<&slot_test_table>(L);
+    primer::push_singleton<&slot_test_table>(L);
+    TEST(lua_rawequal(L, -1, -2), "expected the same table");
+    lua_rawgeti(L, LUA_REGISTRYINDEX, slot_t::value);
+    TEST(lua_rawequal(L, -1, -2), "expected the table in its slot");
+    lua_pop(L, 3);
+
+    slot_test_owner owner;
+    TEST(!helper_t::obtain(L), "expected no pointer yet");
+    helper_t::store(L, &owner);
+    TEST_EQ(helper_t::obtain(L), &owner);
+    lua_rawgeti(L, LUA_REGISTRYINDEX,
+                primer::detail::registry_slot<helper_t>::value);
+    TEST_EQ(lua_touserdata(L, -1), static_cast<void *>(&owner));
+    lua_pop(L, 1);
+    CHECK_STACK(L, 0);
+  }
+
+  // A state which made references first has none, and uses the hash part
+  {
+    lua_raii L;
+    lua_newtable(L);
+    const int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    TEST(!primer::reserve_registry_slots(L), "expected no slots");
+    TEST(!primer::detail::registry_slots_reserved(L), "expected no slots");
+
+    primer::push_singleton<&slot_test_table>(L);
+    primer::push_singleton<&slot_test_table>(L);
+    TEST(lua_rawequal(L, -1, -2), "expected the same table");
+    lua_pop(L, 2);
+
+    slot_test_owner owner;
+    helper_t::store(L, &owner);
+    TEST_EQ(helper_t::obtain(L), &owner);
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    TEST_EQ(lua_type(L, -1), LUA_TTABLE);
+    lua_pop(L, 1);
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    CHECK_STACK(L, 0);
+  }
+}
+
+primer::result
+stats_test_out_of_memory(lua_State *) {
+  return primer::error::bad_alloc();
+}
+
+UNIT_TEST(internal_stats) {
+  lua_raii L;
+  luaL_openlibs(L);
+
+  primer::internal_counters c = primer::internal_stats(L);
+  TEST_EQ(c.registry_refs, 0u);
+  TEST_EQ(c.cpp_pcalls, 0u);
+
+  primer::install_internal_stats(L);
+  primer::install_internal_stats(L);
+  CHECK_STACK(L, 0);
+
+  // Refs in the registry count, and refs in a scope don't
+  lua_newtable(L);
+  primer::lua_ref r{L};
+  c = primer::internal_stats(L);
+  TEST_EQ(c.registry_refs, 1u);
+  {
+    primer::ref_scope scope{L};
+    lua_newtable(L);
+    primer::lua_ref s{L};
+    TEST_EQ(primer::internal_stats(L).registry_refs, 1u);
+  }
+
+  // A protected call fetches the error handler once
+  const auto before = primer::internal_stats(L);
+  TEST_EXPECTED(primer::cpp_pcall(L, [&]() { lua_pushnil(L); }));
+  lua_settop(L, 0);
+  c = primer::internal_stats(L);
+  TEST_EQ(c.cpp_pcalls, before.cpp_pcalls + 1);
+  TEST_EQ(c.error_handler_fetches, before.error_handler_fetches + 1);
+
+  // Each type check looks up the metatable
+  primer::push_udata<fpoint>(L, fpoint{1, 2});
+  TEST(primer::test_udata<fpoint>(L, 1), "expected an fpoint");
+  TEST(primer::test_udata<fpoint>(L, 1), "expected an fpoint");
+  lua_pop(L, 1);
+  TEST_EQ(primer::internal_stats(L).metatable_lookups, c.metatable_lookups + 2);
+
+  // A callback which runs out of memory is a recovery, but other errors aren't
+  c = primer::internal_stats(L);
+  lua_pushcfunction(L, PRIMER_ADAPT(&stats_test_out_of_memory));
+  lua_setglobal(L, "oom");
+  TEST(luaL_dostring(L, "oom()"), "expected an error");
+  TEST(luaL_dostring(L, "error('not memory')"), "expected an error");
+  lua_settop(L, 0);
+  TEST_EQ(primer::internal_stats(L).bad_alloc_recoveries,
+          c.bad_alloc_recoveries + 1);
+  CHECK_STACK(L, 0);
+}
+
 int
 main() {
   conf::log_conf();
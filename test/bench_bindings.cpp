@@ -0,0 +1,239 @@
+#include <primer/primer.hpp>
+#include <primer/std.hpp>
+
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/***
+ * Times the usual kinds of bindings through primer, with these workloads:
+ *
+ *   free_call        a free function of (int, double, string, bool), from lua
+ *   method_call      a method of a userdata, from lua
+ *   vector_read      a function which reads a table of 64 ints as a vector
+ *   vector_push      a function which returns a vector of 64 ints as a table
+ *   call_lua         a lua function of two ints, called from C++
+ *
+ * The C++ functions are kept apart from their bindings, so the numbers can be
+ * compared with the same functions bound by another library, in the same
+ * format. The state uses a counting allocator.
+ *
+ * The results are printed as CSV, one line per workload, with the
+ * nanoseconds and the lua heap bytes per operation:
+ *
+ *   library,workload,ns_per_op,lua_bytes_per_op
+ *
+ * Build in release mode for meaningful numbers.
+ */
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr int ops = 100000;
+
+std::size_t lua_bytes = 0;
+
+void *
+counting_alloc(void *, void * ptr, std::size_t osize, std::size_t nsize) {
+  if (!nsize) {
+    std::free(ptr);
+    return nullptr;
+  }
+  // When `ptr` is null, `osize` is the type of the object
+  lua_bytes += ptr ? (nsize > osize ? nsize - osize : 0) : nsize;
+  return std::realloc(ptr, nsize);
+}
+
+/***
+ * The C++ side of the workloads
+ */
+
+double
+mixed(int i, double x, const std::string & s, bool b) {
+  return b ? i * x + static_cast<double>(s.size()) : 0;
+}
+
+struct counter {
+  int value = 0;
+
+  int add(int x) { return value += x; }
+
+  // The primer binding
+  primer::result lua_add(lua_State * L, int x) {
+    lua_pushinteger(L, this->add(x));
+    return 1;
+  }
+};
+
+int
+sum(const std::vector<int> & v) {
+  int result = 0;
+  for (int x : v) {
+    result += x;
+  }
+  return result;
+}
+
+std::vector<int>
+iota(int n) {
+  std::vector<int> result(static_cast<std::size_t>(n));
+  for (int i = 0; i < n; ++i) {
+    result[static_cast<std::size_t>(i)] = i;
+  }
+  return result;
+}
+
+/***
+ * The lua side of the workloads. Each chunk gets the number of operations.
+ */
+
+struct workload {
+  const char * name;
+  const char * script;
+};
+
+const workload lua_workloads[] = {
+  {"free_call",
+   "local n = ...\n"
+   "for i = 1, n do mixed(i, 0.5, 'name', true) end\n"},
+  {"method_call",
+   "local n = ...\n"
+   "local c = make_counter()\n"
+   "for i = 1, n do c:add(1) end\n"},
+  {"vector_read",
+   "local n = ...\n"
+   "local t = {}\n"
+   "for i = 1, 64 do t[i] = i end\n"
+   "for i = 1, n do sum(t) end\n"},
+  {"vector_push",
+   "local n = ...\n"
+   "for i = 1, n do local t = iota(64) end\n"}};
+
+constexpr const char * add_script = "function add2(a, b) return a + b end";
+
+void
+print_row(const char * library, const char * name, double ns,
+          std::size_t bytes) {
+  std::cout << library << "," << name << "," << ns << ","
+            << static_cast<double>(bytes) / ops << "\n";
+}
+
+// Runs each lua workload in `L`, and `calls`, which calls `add2` `ops` times
+template <typename F>
+void
+run_workloads(const char * library, lua_State * L, F && calls) {
+  for (const workload & w : lua_workloads) {
+    int err = luaL_loadstring(L, w.script);
+    assert(err == LUA_OK);
+    lua_pushinteger(L, ops);
+
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    const std::size_t bytes_before = lua_bytes;
+    auto start = clock_type::now();
+    err = lua_pcall(L, 1, 0, 0);
+    std::chrono::duration<double, std::nano> d = clock_type::now() - start;
+    if (err != LUA_OK) {
+      std::cerr << library << " " << w.name << ": " << lua_tostring(L, -1)
+                << std::endl;
+      std::abort();
+    }
+    print_row(library, w.name, d.count() / ops, lua_bytes - bytes_before);
+  }
+
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  const std::size_t bytes_before = lua_bytes;
+  auto start = clock_type::now();
+  calls();
+  std::chrono::duration<double, std::nano> d = clock_type::now() - start;
+  print_row(library, "call_lua", d.count() / ops, lua_bytes - bytes_before);
+  assert(lua_gettop(L) == 0);
+}
+
+/***
+ * primer
+ */
+
+primer::result
+primer_mixed(lua_State * L, int i, double x, std::string s, bool b) {
+  lua_pushnumber(L, mixed(i, x, s, b));
+  return 1;
+}
+
+primer::result
+primer_make_counter(lua_State * L) {
+  primer::push_udata<counter>(L);
+  return 1;
+}
+
+primer::result
+primer_sum(lua_State * L, std::vector<int> v) {
+  lua_pushinteger(L, sum(v));
+  return 1;
+}
+
+primer::result
+primer_iota(lua_State * L, int n) {
+  primer::push(L, iota(n));
+  return 1;
+}
+
+constexpr luaL_Reg counter_methods[] = {
+  {"add", PRIMER_ADAPT_USERDATA(counter, &counter::lua_add)},
+  {nullptr, nullptr}};
+
+} // end anonymous namespace
+
+namespace primer {
+namespace traits {
+
+template <>
+struct userdata<counter> {
+  static constexpr const char * name = "counter";
+  static constexpr const luaL_Reg * metatable = counter_methods;
+};
+
+} // end namespace traits
+} // end namespace primer
+
+namespace {
+
+void
+bench_primer() {
+  lua_State * L = lua_newstate(&counting_alloc, nullptr);
+  luaL_openlibs(L);
+  lua_pushcfunction(L, PRIMER_ADAPT(&primer_mixed));
+  lua_setglobal(L, "mixed");
+  lua_pushcfunction(L, PRIMER_ADAPT(&primer_make_counter));
+  lua_setglobal(L, "make_counter");
+  lua_pushcfunction(L, PRIMER_ADAPT(&primer_sum));
+  lua_setglobal(L, "sum");
+  lua_pushcfunction(L, PRIMER_ADAPT(&primer_iota));
+  lua_setglobal(L, "iota");
+  luaL_dostring(L, add_script);
+
+  {
+    lua_getglobal(L, "add2");
+    primer::bound_function add2{L};
+    run_workloads("primer", L, [&]() {
+      for (int i = 0; i < ops; ++i) {
+        auto r = add2.call_as<int>(i, 1);
+        assert(r && *r == i + 1);
+        static_cast<void>(r);
+      }
+    });
+  }
+  lua_close(L);
+}
+
+} // end anonymous namespace
+
+int
+main() {
+  std::cout << "library,workload,ns_per_op,lua_bytes_per_op\n";
+  bench_primer();
+}
@@ -0,0 +1,76 @@
+#include <primer/primer.hpp>
+
+#include <cassert>
+#include <chrono>
+#include <iostream>
+
+/***
+ * A small benchmark comparing repeated calls through `bound_function` with
+ * calls through a `call_site`, in the shape of a per-entity update hook.
+ *
+ * Build in release mode for meaningful numbers.
+ */
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr int entities = 20000;
+constexpr int frames = 10;
+
+template <typename F>
+double
+time_frames(F && f) {
+  auto start = clock_type::now();
+  for (int frame = 0; frame < frames; ++frame) {
+    for (int i = 0; i < entities; ++i) {
+      auto ok = f(i);
+      assert(ok);
+      static_cast<void>(ok);
+    }
+  }
+  std::chrono::duration<double, std::milli> d = clock_type::now() - start;
+  return d.count() / frames;
+}
+
+} // end anonymous namespace
+
+int
+main() {
+  lua_State * L = luaL_newstate();
+
+  luaL_loadstring(L, "local sum = 0; return function(id, dt) sum = sum + id * "
+                     "dt end");
+  lua_call(L, 0, 1);
+  primer::bound_function f{L};
+
+  double bound_ms = time_frames([&](int i) { return f.call_no_ret(i, 0.5); });
+
+  double site_ms;
+  {
+    primer::call_site site{f};
+    site_ms = time_frames([&](int i) { return site.call_no_ret(i, 0.5); });
+  }
+
+  double bound_as_ms =
+    time_frames([&](int i) { return f.call_as<primer::truthy>(i, 0.5); });
+
+  double site_as_ms;
+  {
+    primer::call_site site{f};
+    site_as_ms =
+      time_frames([&](int i) { return site.call_as<primer::truthy>(i, 0.5); });
+  }
+
+  assert(lua_gettop(L) == 0);
+
+  std::cout << "ms per frame of " << entities << " calls:\n";
+  std::cout << "  bound_function::call_no_ret  " << bound_ms << "\n";
+  std::cout << "  call_site::call_no_ret       " << site_ms << "\n";
+  std::cout << "  bound_function::call_as      " << bound_as_ms << "\n";
+  std::cout << "  call_site::call_as           " << site_as_ms << "\n";
+
+  f.reset();
+  lua_close(L);
+  std::cout << "OK!" << std::endl;
+}
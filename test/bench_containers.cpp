@@ -0,0 +1,352 @@
+#include <primer/primer.hpp>
+#include <primer/std.hpp>
+#include <primer/visit_struct.hpp>
+
+#ifdef PRIMER_BENCH_BOOST
+#include <primer/boost.hpp>
+
+#include <boost/container/vector.hpp>
+#include <boost/optional/optional.hpp>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/***
+ * A benchmark of the cost of moving containers between C++ and lua, by the
+ * `traits::push` and `traits::read` of the `std/` specializations, and of the
+ * `boost/` ones in `bench_containers_boost`. These are all implemented
+ * by the `container::*_helper` bases, which are measured through them, along
+ * with `traits::binary` encoding of the same values.
+ *
+ * Each operation is reported with its time, and with the number of lua and C++
+ * heap allocations which it makes on average.
+ *
+ * Build in release mode for meaningful numbers.
+ */
+
+namespace {
+
+std::size_t heap_allocs = 0;
+std::size_t lua_allocs = 0;
+
+} // end anonymous namespace
+
+void *
+operator new(std::size_t n) {
+  ++heap_allocs;
+  if (void * p = std::malloc(n ? n : 1)) { return p; }
+  throw std::bad_alloc{};
+}
+
+void
+operator delete(void * p) noexcept {
+  std::free(p);
+}
+
+struct bench_entity {
+  int id;
+  double x;
+  double y;
+  std::string name;
+};
+
+VISITABLE_STRUCT(bench_entity, id, x, y, name);
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+// Roughly the number of elements moved by each operation of a case
+constexpr int element_budget = 20000;
+constexpr int sizes[] = {1, 16, 256, 4096};
+
+// Size of the inner containers of nested cases
+constexpr int inner_size = 4;
+
+void *
+counting_alloc(void *, void * ptr, std::size_t, std::size_t nsize) {
+  if (!nsize) {
+    std::free(ptr);
+    return nullptr;
+  }
+  ++lua_allocs;
+  return std::realloc(ptr, nsize);
+}
+
+/***
+ * Sample values
+ */
+
+template <typename T>
+struct sample;
+
+template <>
+struct sample<int> {
+  static int make(int, int i) { return i; }
+};
+
+template <>
+struct sample<std::string> {
+  static std::string make(int, int i) {
+    return "key_" + std::to_string(i);
+  }
+};
+
+template <>
+struct sample<bench_entity> {
+  static bench_entity make(int, int i) {
+    return bench_entity{i, 0.5 * i, -0.5 * i, "entity_" + std::to_string(i)};
+  }
+};
+
+template <typename T, typename U>
+struct sample<std::pair<T, U>> {
+  static std::pair<T, U> make(int n, int i) {
+    return {sample<T>::make(n, i), sample<U>::make(n, i)};
+  }
+};
+
+template <typename T, std::size_t N>
+struct sample<std::array<T, N>> {
+  static std::array<T, N> make(int, int) {
+    std::array<T, N> result;
+    for (std::size_t i = 0; i < N; ++i) {
+      result[i] = sample<T>::make(inner_size, static_cast<int>(i));
+    }
+    return result;
+  }
+};
+
+// Inserts `n` elements, whose own size is `inner_size`
+template <typename C>
+struct container_sample {
+  static C make(int n, int) {
+    C result;
+    for (int i = 0; i < n; ++i) {
+      result.insert(result.end(),
+                    sample<typename C::value_type>::make(inner_size, i));
+    }
+    return result;
+  }
+};
+
+template <typename T>
+struct sample<std::vector<T>> : container_sample<std::vector<T>> {};
+
+template <typename T>
+struct sample<std::set<T>> : container_sample<std::set<T>> {};
+
+template <typename K, typename V>
+struct sample<std::map<K, V>> {
+  static std::map<K, V> make(int n, int) {
+    std::map<K, V> result;
+    for (int i = 0; i < n; ++i) {
+      result.emplace(sample<K>::make(inner_size, i),
+                     sample<V>::make(inner_size, i));
+    }
+    return result;
+  }
+};
+
+template <typename K, typename V>
+struct sample<std::unordered_map<K, V>> {
+  static std::unordered_map<K, V> make(int n, int) {
+    std::unordered_map<K, V> result;
+    for (int i = 0; i < n; ++i) {
+      result.emplace(sample<K>::make(inner_size, i),
+                     sample<V>::make(inner_size, i));
+    }
+    return result;
+  }
+};
+
+#ifdef PRIMER_BENCH_BOOST
+template <typename T>
+struct sample<boost::container::vector<T>>
+  : container_sample<boost::container::vector<T>> {};
+
+template <typename T>
+struct sample<boost::optional<T>> {
+  static boost::optional<T> make(int n, int i) { return sample<T>::make(n, i); }
+};
+#endif
+
+/***
+ * Measurement
+ */
+
+struct op_stats {
+  double ns = -1; // Negative if the operation doesn't exist for the type
+  double lua = 0;
+  double heap = 0;
+};
+
+template <typename F>
+op_stats
+measure(int ops, F && f) {
+  const std::size_t lua_before = lua_allocs;
+  const std::size_t heap_before = heap_allocs;
+  auto start = clock_type::now();
+  for (int i = 0; i < ops; ++i) {
+    f();
+  }
+  std::chrono::duration<double, std::nano> d = clock_type::now() - start;
+
+  op_stats result;
+  result.ns = d.count() / ops;
+  result.lua = static_cast<double>(lua_allocs - lua_before) / ops;
+  result.heap = static_cast<double>(heap_allocs - heap_before) / ops;
+  return result;
+}
+
+void
+print_header() {
+  std::cout << std::left << std::setw(38) << "case" << std::right
+            << std::setw(6) << "size" << std::setw(12) << "push ns"
+            << std::setw(8) << "lua" << std::setw(8) << "heap"
+            << std::setw(12) << "read ns" << std::setw(8) << "lua"
+            << std::setw(8) << "heap" << std::setw(12) << "binary ns"
+            << std::setw(8) << "heap"
+            << "\n";
+}
+
+// Whether `traits::binary` is specialized for T
+template <typename T, typename ENABLE = void>
+struct has_binary : std::false_type {};
+
+template <typename T>
+struct has_binary<T,
+                  decltype(primer::traits::binary<T>::write(
+                    std::declval<std::string &>(), std::declval<const T &>()))>
+  : std::true_type {};
+
+template <typename T>
+primer::enable_if_t<has_binary<T>::value, op_stats>
+measure_binary(int ops, const T & value) {
+  return measure(ops, [&]() {
+    std::string buffer;
+    primer::traits::binary<T>::write(buffer, value);
+    T copy{};
+    const char * pos = buffer.data();
+    bool ok =
+      primer::traits::binary<T>::read(pos, buffer.data() + buffer.size(), copy);
+    assert(ok);
+    static_cast<void>(ok);
+  });
+}
+
+template <typename T>
+primer::enable_if_t<!has_binary<T>::value, op_stats>
+measure_binary(int, const T &) {
+  return op_stats{};
+}
+
+void
+print_stats(const op_stats & s) {
+  if (s.ns < 0) {
+    std::cout << std::setw(12) << "-" << std::setw(8) << "-";
+    return;
+  }
+  std::cout << std::fixed << std::setprecision(0) << std::setw(12) << s.ns
+            << std::setprecision(1) << std::setw(8) << s.heap
+            << std::defaultfloat;
+}
+
+// `elements` is the number of values in a sample of size 1
+template <typename T>
+void
+run_case(lua_State * L, const char * name, int size, int elements = 1) {
+  const T value = sample<T>::make(size, 0);
+  const int ops = std::max(1, element_budget / (size * elements));
+
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  op_stats push = measure(ops, [&]() {
+    primer::push(L, value);
+    lua_pop(L, 1);
+  });
+
+  primer::push(L, value);
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  op_stats read = measure(ops, [&]() {
+    auto result = primer::read<T>(L, -1);
+    assert(result);
+    static_cast<void>(result);
+  });
+  lua_pop(L, 1);
+  assert(lua_gettop(L) == 0);
+
+  op_stats binary = measure_binary(ops, value);
+
+  std::cout << std::left << std::setw(38) << name << std::right
+            << std::setw(6) << size << std::fixed << std::setprecision(0)
+            << std::setw(12) << push.ns << std::setprecision(1)
+            << std::setw(8) << push.lua << std::setw(8) << push.heap
+            << std::setprecision(0) << std::setw(12) << read.ns
+            << std::setprecision(1) << std::setw(8) << read.lua
+            << std::setw(8) << read.heap << std::defaultfloat;
+  print_stats(binary);
+  std::cout << "\n";
+}
+
+template <typename T>
+void
+run_sizes(lua_State * L, const char * name, int elements = 1) {
+  for (int size : sizes) {
+    run_case<T>(L, name, size, elements);
+  }
+}
+
+} // end anonymous namespace
+
+int
+main() {
+  lua_State * L = lua_newstate(&counting_alloc, nullptr);
+
+  print_header();
+
+  run_case<int>(L, "int", 1);
+  run_case<std::string>(L, "std::string", 1);
+  run_case<std::pair<int, std::string>>(L, "std::pair<int, std::string>", 1);
+  run_case<bench_entity>(L, "visitable struct", 1, 4);
+  run_case<std::array<int, 16>>(L, "std::array<int, 16>", 1, 16);
+
+  run_sizes<std::vector<int>>(L, "std::vector<int>");
+  run_sizes<std::vector<std::string>>(L, "std::vector<std::string>");
+  run_sizes<std::vector<bench_entity>>(L, "std::vector<visitable struct>", 4);
+  run_sizes<std::set<int>>(L, "std::set<int>");
+  run_sizes<std::map<std::string, int>>(L, "std::map<std::string, int>", 2);
+  run_sizes<std::unordered_map<std::string, int>>(
+    L, "std::unordered_map<std::string, int>", 2);
+
+  // Nesting depth 2 and 3
+  run_sizes<std::vector<std::vector<int>>>(L, "std::vector<std::vector<int>>",
+                                           inner_size);
+  run_sizes<std::vector<std::vector<std::vector<int>>>>(
+    L, "std::vector<...<int>> depth 3", inner_size * inner_size);
+  run_sizes<std::map<std::string, std::vector<int>>>(
+    L, "std::map<std::string, vector>", inner_size + 1);
+
+#ifdef PRIMER_BENCH_BOOST
+  run_case<boost::optional<int>>(L, "boost::optional<int>", 1);
+  run_case<boost::optional<std::string>>(L, "boost::optional<std::string>", 1);
+  run_sizes<boost::container::vector<int>>(L, "boost::container::vector<int>");
+#endif
+
+  lua_close(L);
+  std::cout << "OK!" << std::endl;
+}
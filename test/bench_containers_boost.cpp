@@ -0,0 +1,3 @@
+// The container benchmark, with the boost specializations
+#define PRIMER_BENCH_BOOST
+#include "bench_containers.cpp"
@@ -0,0 +1,336 @@
+#include <primer/primer.hpp>
+
+#include <primer/api/extraspace_dispatch.hpp>
+#include <primer/detail/count.hpp>
+#include <primer/std/function.hpp>
+
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <utility>
+
+/***
+ * A small benchmark of the cost of calling a C++ function from lua, by each of
+ * the ways in which primer binds one:
+ *
+ *   adapt       PRIMER_ADAPT of a free function
+ *   extraspace  PRIMER_ADAPT_EXTRASPACE of a member function
+ *   userdata    PRIMER_ADAPT_USERDATA of a member function, as `f(u, ...)`
+ *   function    push_std_function
+ *   registry    PRIMER_ADAPT of a free function which finds its object with
+ *               registry_helper, like the callbacks of vfs and print_manager
+ *
+ * Each is called with 0, 1, 4 and 8 arguments, all ints, strings, tables or
+ * userdata. Two raw lua_CFunctions are the baseline: `raw` reads nothing, and
+ * `manual` checks and converts its arguments by hand.
+ *
+ * For each binding, "dispatch" is its cost with no arguments over `raw`, and
+ * "per arg" is the cost of each further argument.
+ *
+ * Build in release mode for meaningful numbers.
+ */
+
+struct bench_udata {
+  template <typename... Args>
+  primer::result call(lua_State *, Args...);
+};
+
+namespace primer {
+namespace traits {
+
+template <>
+struct userdata<bench_udata> {
+  static constexpr const char * name = "bench_udata";
+};
+
+} // end namespace traits
+} // end namespace primer
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr int calls = 10000;
+constexpr int arities[] = {0, 1, 4, 8};
+constexpr int num_arities = sizeof(arities) / sizeof(arities[0]);
+
+long hits = 0;
+
+struct bench_owner {
+  template <typename... Args>
+  primer::result call(lua_State *, Args...) {
+    ++hits;
+    return 0;
+  }
+};
+
+} // end anonymous namespace
+
+template <typename... Args>
+primer::result
+bench_udata::call(lua_State *, Args...) {
+  ++hits;
+  return 0;
+}
+
+namespace {
+
+/***
+ * Kinds of arguments
+ */
+
+struct int_arg {
+  using type = int;
+  static constexpr const char * name = "int";
+  static void push_sample(lua_State * L) { lua_pushinteger(L, 7); }
+  static bool convert(lua_State * L, int idx) {
+    int ok = 0;
+    lua_Integer i = lua_tointegerx(L, idx, &ok);
+    return ok && i == 7;
+  }
+};
+
+struct string_arg {
+  using type = std::string;
+  static constexpr const char * name = "string";
+  static void push_sample(lua_State * L) { lua_pushstring(L, "sample"); }
+  static bool convert(lua_State * L, int idx) {
+    std::size_t len = 0;
+    const char * str = lua_tolstring(L, idx, &len);
+    return str && !std::string(str, len).empty();
+  }
+};
+
+struct table_arg {
+  using type = primer::table_view<int>;
+  static constexpr const char * name = "table";
+  static void push_sample(lua_State * L) {
+    lua_createtable(L, 3, 0);
+    for (int i = 1; i <= 3; ++i) {
+      lua_pushinteger(L, i);
+      lua_rawseti(L, -2, i);
+    }
+  }
+  static bool convert(lua_State * L, int idx) { return lua_istable(L, idx); }
+};
+
+struct udata_arg {
+  using type = bench_udata &;
+  static constexpr const char * name = "userdata";
+  static void push_sample(lua_State * L) { primer::push_udata<bench_udata>(L); }
+  static bool convert(lua_State * L, int idx) {
+    return primer::test_udata<bench_udata>(L, idx);
+  }
+};
+
+/***
+ * The bindings of a target with `n` arguments of one kind
+ */
+
+enum class path {
+  raw,
+  manual,
+  adapt,
+  extraspace,
+  userdata,
+  function,
+  registry
+};
+
+constexpr path paths[] = {path::raw,      path::manual,   path::adapt,
+                          path::extraspace, path::userdata, path::function,
+                          path::registry};
+constexpr int num_paths = sizeof(paths) / sizeof(paths[0]);
+
+const char *
+path_name(path p) {
+  switch (p) {
+    case path::raw: return "raw";
+    case path::manual: return "manual";
+    case path::adapt: return "adapt";
+    case path::extraspace: return "extraspace";
+    case path::userdata: return "userdata";
+    case path::function: return "function";
+    case path::registry: return "registry";
+  }
+  return "";
+}
+
+template <typename T, std::size_t>
+struct repeat {
+  using type = T;
+};
+
+template <typename K, typename S>
+struct bindings;
+
+template <typename K, std::size_t... Is>
+struct bindings<K, primer::detail::SizeList<Is...>> {
+  using member_t = primer::result (bench_owner::*)(
+    lua_State *, typename repeat<typename K::type, Is>::type...);
+  using udata_member_t = primer::result (bench_udata::*)(
+    lua_State *, typename repeat<typename K::type, Is>::type...);
+
+  static primer::result target(lua_State *,
+                               typename repeat<typename K::type, Is>::type...) {
+    ++hits;
+    return 0;
+  }
+
+  static primer::result
+  via_registry(lua_State * L,
+               typename repeat<typename K::type, Is>::type... args) {
+    bench_owner * owner = primer::registry_helper<bench_owner>::obtain(L);
+    return owner->call<typename repeat<typename K::type, Is>::type...>(
+      L, std::forward<typename repeat<typename K::type, Is>::type>(args)...);
+  }
+
+  static int raw(lua_State *) {
+    ++hits;
+    return 0;
+  }
+
+  static int manual(lua_State * L) {
+    bool ok = true;
+    int dummy[] = {0, (ok = K::convert(L, static_cast<int>(Is) + 1) && ok)...};
+    static_cast<void>(dummy);
+    if (!ok) { return luaL_error(L, "bad argument"); }
+    ++hits;
+    return 0;
+  }
+
+  static void push(lua_State * L, path p) {
+    switch (p) {
+      case path::raw:
+        lua_pushcfunction(L, &raw);
+        break;
+      case path::manual:
+        lua_pushcfunction(L, &manual);
+        break;
+      case path::adapt:
+        lua_pushcfunction(L, PRIMER_ADAPT(&target));
+        break;
+      case path::extraspace:
+        lua_pushcfunction(
+          L, (&primer::api::extraspace_dispatcher<
+               bench_owner, member_t,
+               &bench_owner::call<
+                 typename repeat<typename K::type, Is>::type...>>::adapted));
+        break;
+      case path::userdata:
+        lua_pushcfunction(
+          L, (&primer::userdata_dispatcher<
+               bench_udata, udata_member_t,
+               &bench_udata::call<
+                 typename repeat<typename K::type, Is>::type...>>::adapted));
+        break;
+      case path::function:
+        primer::push_std_function(
+          L, std::function<primer::result(
+               lua_State *, typename repeat<typename K::type, Is>::type...)>{
+               &target});
+        break;
+      case path::registry:
+        lua_pushcfunction(L, PRIMER_ADAPT(&via_registry));
+        break;
+    }
+  }
+};
+
+template <typename K, int n>
+using bindings_t = bindings<K, primer::detail::Count_t<n>>;
+
+template <typename K>
+void
+push_binding(lua_State * L, int arity, path p) {
+  switch (arity) {
+    case 0: return bindings_t<K, 0>::push(L, p);
+    case 1: return bindings_t<K, 1>::push(L, p);
+    case 4: return bindings_t<K, 4>::push(L, p);
+    case 8: return bindings_t<K, 8>::push(L, p);
+  }
+  assert(false && "unexpected arity");
+}
+
+// Nanoseconds per call of a binding, from a lua loop
+template <typename K>
+double
+time_calls(lua_State * L, int arity, path p) {
+  const bool method = (p == path::userdata);
+  std::string code = "local f, n, a, u = ...\nfor i = 1, n do f(";
+  for (int i = 0; i < arity + method; ++i) {
+    if (i) { code += ", "; }
+    code += (method && !i) ? "u" : "a";
+  }
+  code += ") end";
+
+  int err = luaL_loadstring(L, code.c_str());
+  assert(err == LUA_OK);
+  push_binding<K>(L, arity, p);
+  lua_pushinteger(L, calls);
+  K::push_sample(L);
+  primer::push_udata<bench_udata>(L);
+
+  hits = 0;
+  auto start = clock_type::now();
+  err = lua_pcall(L, 4, 0, 0);
+  std::chrono::duration<double, std::nano> d = clock_type::now() - start;
+  assert(err == LUA_OK);
+  assert(hits == calls);
+  static_cast<void>(err);
+  return d.count() / calls;
+}
+
+template <typename K>
+void
+report(lua_State * L) {
+  double ns[num_paths][num_arities];
+  for (int p = 0; p < num_paths; ++p) {
+    for (int a = 0; a < num_arities; ++a) {
+      ns[p][a] = time_calls<K>(L, arities[a], paths[p]);
+    }
+  }
+  assert(lua_gettop(L) == 0);
+
+  const int last = num_arities - 1;
+  std::cout << "ns per call, " << K::name << " arguments:\n";
+  std::cout << "  " << std::setw(12) << std::left << "args" << std::right;
+  for (int a = 0; a < num_arities; ++a) {
+    std::cout << std::setw(9) << arities[a];
+  }
+  std::cout << std::setw(10) << "dispatch" << std::setw(9) << "per arg\n";
+  std::cout << std::fixed << std::setprecision(1);
+  for (int p = 0; p < num_paths; ++p) {
+    std::cout << "  " << std::setw(12) << std::left << path_name(paths[p])
+              << std::right;
+    for (int a = 0; a < num_arities; ++a) {
+      std::cout << std::setw(9) << ns[p][a];
+    }
+    std::cout << std::setw(10) << (ns[p][0] - ns[0][0]) << std::setw(9)
+              << (ns[p][last] - ns[p][0]) / arities[last] << "\n";
+  }
+  std::cout << std::defaultfloat << "\n";
+}
+
+} // end anonymous namespace
+
+int
+main() {
+  lua_State * L = luaL_newstate();
+
+  bench_owner owner;
+  primer::detail::set_extraspace_owner(L, -1, &owner);
+  primer::registry_helper<bench_owner>::store(L, &owner);
+
+  report<int_arg>(L);
+  report<string_arg>(L);
+  report<table_arg>(L);
+  report<udata_arg>(L);
+
+  lua_close(L);
+  std::cout << "OK!" << std::endl;
+}
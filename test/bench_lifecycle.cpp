@@ -0,0 +1,260 @@
+#include <primer/primer.hpp>
+
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/***
+ * A benchmark of the lifecycle of the handles which primer makes into a VM:
+ *
+ * - `lua_ref` construct, copy, move, lock and destroy
+ * - `bound_function` calls with 0 to 8 arguments, in each return mode
+ * - `coroutine` create, resume to a yield, and resume to the finish
+ * - `lua_ref_seq` by `pop_n` and `push_each`
+ *
+ * Each operation is reported with its time, and with the number of bytes, and
+ * of allocations, which it asks of the lua allocator on average. This is the
+ * baseline for pooling and caching these objects.
+ *
+ * Build in release mode for meaningful numbers.
+ */
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr int ops = 20000;
+
+std::size_t lua_allocs = 0;
+std::size_t lua_bytes = 0;
+
+void *
+counting_alloc(void *, void * ptr, std::size_t osize, std::size_t nsize) {
+  if (!nsize) {
+    std::free(ptr);
+    return nullptr;
+  }
+  // When `ptr` is null, `osize` is the type of the object
+  if (!ptr) {
+    ++lua_allocs;
+    lua_bytes += nsize;
+  } else if (nsize > osize) {
+    ++lua_allocs;
+    lua_bytes += nsize - osize;
+  }
+  return std::realloc(ptr, nsize);
+}
+
+struct op_stats {
+  double ns;
+  double bytes;
+  double allocs;
+};
+
+// Calls `f(i)` for each `i` in `[0, n)`
+template <typename F>
+op_stats
+measure(int n, F && f) {
+  const std::size_t allocs_before = lua_allocs;
+  const std::size_t bytes_before = lua_bytes;
+  auto start = clock_type::now();
+  for (int i = 0; i < n; ++i) {
+    f(i);
+  }
+  std::chrono::duration<double, std::nano> d = clock_type::now() - start;
+
+  op_stats result;
+  result.ns = d.count() / n;
+  result.bytes = static_cast<double>(lua_bytes - bytes_before) / n;
+  result.allocs = static_cast<double>(lua_allocs - allocs_before) / n;
+  return result;
+}
+
+void
+print_header() {
+  std::cout << std::left << std::setw(44) << "case" << std::right
+            << std::setw(10) << "ns/op" << std::setw(12) << "bytes/op"
+            << std::setw(12) << "allocs/op"
+            << "\n";
+}
+
+void
+print_row(const std::string & name, const op_stats & s) {
+  std::cout << std::left << std::setw(44) << name << std::right << std::fixed
+            << std::setprecision(1) << std::setw(10) << s.ns << std::setw(12)
+            << s.bytes << std::setprecision(2) << std::setw(12) << s.allocs
+            << std::defaultfloat << "\n";
+}
+
+template <typename T>
+void
+check(const T & result) {
+  assert(result);
+  static_cast<void>(result);
+}
+
+/***
+ * lua_ref
+ */
+
+void
+bench_lua_ref(lua_State * L) {
+  std::vector<primer::lua_ref> refs;
+  std::vector<primer::lua_ref> copies;
+  std::vector<primer::lua_ref> moved;
+  refs.reserve(ops);
+  copies.reserve(ops);
+  moved.reserve(ops);
+
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  print_row("lua_ref construct", measure(ops, [&](int i) {
+              lua_pushinteger(L, i);
+              refs.emplace_back(L);
+            }));
+  print_row("lua_ref copy", measure(ops, [&](int i) {
+              copies.emplace_back(refs[static_cast<std::size_t>(i)]);
+            }));
+  print_row("lua_ref move", measure(ops, [&](int i) {
+              moved.emplace_back(std::move(copies[static_cast<std::size_t>(i)]));
+            }));
+  print_row("lua_ref lock", measure(ops, [&](int i) {
+              lua_State * T = refs[static_cast<std::size_t>(i)].lock();
+              assert(T);
+              static_cast<void>(T);
+            }));
+  print_row("lua_ref push", measure(ops, [&](int i) {
+              check(refs[static_cast<std::size_t>(i)].push(L));
+              lua_pop(L, 1);
+            }));
+  print_row("lua_ref destroy", measure(ops, [&](int i) {
+              refs[static_cast<std::size_t>(i)].reset();
+            }));
+  moved.clear();
+  assert(lua_gettop(L) == 0);
+}
+
+/***
+ * bound_function
+ */
+
+template <typename... Args>
+void
+bench_calls(const primer::bound_function & f, Args... args) {
+  const std::string suffix = " (" + std::to_string(sizeof...(args)) + " args)";
+  print_row("bound_function::call_no_ret" + suffix,
+            measure(ops, [&](int) { check(f.call_no_ret(args...)); }));
+  print_row("bound_function::call_one_ret" + suffix,
+            measure(ops, [&](int) { check(f.call_one_ret(args...)); }));
+  print_row("bound_function::call" + suffix,
+            measure(ops, [&](int) { check(f.call(args...)); }));
+  print_row("bound_function::call_as<int>" + suffix,
+            measure(ops, [&](int) { check(f.call_as<int>(args...)); }));
+}
+
+void
+bench_bound_function(lua_State * L) {
+  luaL_loadstring(L, "return function(...) return select('#', ...) end");
+  lua_call(L, 0, 1);
+  primer::bound_function f{L};
+
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  bench_calls(f);
+  bench_calls(f, 1);
+  bench_calls(f, 1, 2);
+  bench_calls(f, 1, 2, 3);
+  bench_calls(f, 1, 2, 3, 4);
+  bench_calls(f, 1, 2, 3, 4, 5);
+  bench_calls(f, 1, 2, 3, 4, 5, 6);
+  bench_calls(f, 1, 2, 3, 4, 5, 6, 7);
+  bench_calls(f, 1, 2, 3, 4, 5, 6, 7, 8);
+  assert(lua_gettop(L) == 0);
+}
+
+/***
+ * coroutine
+ */
+
+void
+bench_coroutine(lua_State * L) {
+  luaL_loadstring(L, "return function(x) coroutine.yield(x) return x end");
+  lua_call(L, 0, 1);
+  primer::bound_function f{L};
+
+  std::vector<primer::coroutine> coroutines;
+  coroutines.reserve(ops);
+
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  print_row("coroutine create", measure(ops, [&](int) {
+              coroutines.emplace_back(f);
+            }));
+  print_row("coroutine resume to yield", measure(ops, [&](int i) {
+              check(coroutines[static_cast<std::size_t>(i)].call_no_ret(i));
+            }));
+  print_row("coroutine resume to finish", measure(ops, [&](int i) {
+              check(coroutines[static_cast<std::size_t>(i)].call_no_ret());
+            }));
+  print_row("coroutine destroy", measure(ops, [&](int i) {
+              coroutines[static_cast<std::size_t>(i)].reset();
+            }));
+  print_row("coroutine full cycle", measure(ops, [&](int i) {
+              primer::coroutine co{f};
+              check(co.call_no_ret(i));
+              check(co.call_no_ret());
+            }));
+  assert(lua_gettop(L) == 0);
+}
+
+/***
+ * lua_ref_seq
+ */
+
+void
+bench_ref_seq(lua_State * L, int n) {
+  const std::string suffix = " (" + std::to_string(n) + " values)";
+  std::vector<primer::lua_ref_seq> seqs(ops);
+
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  print_row("lua_ref_seq pop_n" + suffix, measure(ops, [&](int i) {
+              for (int j = 0; j < n; ++j) {
+                lua_pushinteger(L, i + j);
+              }
+              seqs[static_cast<std::size_t>(i)] = primer::pop_n(L, n);
+            }));
+  print_row("lua_ref_seq push_each" + suffix, measure(ops, [&](int i) {
+              check(seqs[static_cast<std::size_t>(i)].push_each(L));
+              lua_settop(L, 0);
+            }));
+  print_row("lua_ref_seq pop_n, reused" + suffix, measure(ops, [&](int i) {
+              for (int j = 0; j < n; ++j) {
+                lua_pushinteger(L, i + j);
+              }
+              primer::pop_n(L, n, seqs[static_cast<std::size_t>(i)]);
+            }));
+  seqs.clear();
+  assert(lua_gettop(L) == 0);
+}
+
+} // end anonymous namespace
+
+int
+main() {
+  lua_State * L = lua_newstate(&counting_alloc, nullptr);
+  luaL_openlibs(L);
+
+  print_header();
+  bench_lua_ref(L);
+  bench_bound_function(L);
+  bench_coroutine(L);
+  bench_ref_seq(L, 1);
+  bench_ref_seq(L, 4);
+  bench_ref_seq(L, 8);
+
+  lua_close(L);
+  std::cout << "OK!" << std::endl;
+}
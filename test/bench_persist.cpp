@@ -0,0 +1,253 @@
+#include <primer/api.hpp>
+#include <primer/primer.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#define BENCH_HAVE_RUSAGE
+#endif
+
+/***
+ * A benchmark of `initialize_api`, `persist` and `unpersist`, over synthetic
+ * lua states of a few shapes.
+ *
+ * Usage: bench_persist [shape [size [reps]]]
+ *
+ * The shapes are "deep" (long chains of nested tables), "closures" (many
+ * closures with upvalues), "userdata" (many full userdata), and "coroutines"
+ * (many suspended coroutines). Without arguments, each shape is run at a small
+ * size.
+ *
+ * Output is CSV on stdout, with a header line, one line per phase:
+ *
+ *   shape,size,phase,ms,mb_per_s,snapshot_bytes,peak_rss_kb
+ *
+ * `ms` is the mean over the repetitions. `mb_per_s` is the snapshot size over
+ * the time, and is zero for `init`. `peak_rss_kb` is the peak resident set size
+ * of the process so far, or zero if it isn't known.
+ *
+ * Build in release mode for meaningful numbers.
+ */
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+namespace api = primer::api;
+
+struct lua_raii {
+  lua_State * L_;
+
+  lua_raii()
+    : L_(luaL_newstate()) {}
+
+  ~lua_raii() { lua_close(L_); }
+
+  operator lua_State *() const { return L_; }
+};
+
+using bench_libs = api::libraries<api::lua_base_lib, api::lua_coroutine_lib>;
+
+struct bench_api : api::base<bench_api> {
+  lua_raii lua_;
+
+  API_FEATURE(bench_libs, libs_);
+
+  bench_api()
+    : lua_()
+    , libs_() {}
+
+  bool init() { return check(this->initialize_api(lua_)); }
+
+  bool save(std::string & buffer) { return check(this->persist(lua_, buffer)); }
+
+  bool restore(const std::string & buffer) {
+    return check(this->unpersist(lua_, buffer));
+  }
+
+  static bool check(const primer::expected<void> & ok) {
+    if (!ok) { std::cerr << ok.err().what() << std::endl; }
+    return static_cast<bool>(ok);
+  }
+};
+
+// Each script gets the size as its argument, and fills the global `data`
+const char * deep_script =
+  "local n = ...                                            \n"
+  "local root = {}                                          \n"
+  "for i = 1, n // 100 + 1 do                               \n"
+  "  local cur = {}                                         \n"
+  "  root[i] = cur                                          \n"
+  "  for j = 1, 100 do                                      \n"
+  "    cur.next = { value = j, name = 'node' .. j }         \n"
+  "    cur = cur.next                                       \n"
+  "  end                                                    \n"
+  "end                                                      \n"
+  "data = root                                              \n";
+
+const char * closures_script =
+  "local n = ...                                            \n"
+  "local fs = {}                                            \n"
+  "for i = 1, n do                                          \n"
+  "  local a, b = i, tostring(i)                            \n"
+  "  fs[i] = function(x) return a + x, b end                \n"
+  "end                                                      \n"
+  "data = fs                                                \n";
+
+const char * coroutines_script =
+  "local n = ...                                            \n"
+  "local cs = {}                                            \n"
+  "for i = 1, n do                                          \n"
+  "  local co = coroutine.create(function(a)                \n"
+  "    local x = { a }                                      \n"
+  "    coroutine.yield(x)                                   \n"
+  "    return x                                             \n"
+  "  end)                                                   \n"
+  "  coroutine.resume(co, i)                                \n"
+  "  cs[i] = co                                             \n"
+  "end                                                      \n"
+  "data = cs                                                \n";
+
+bool
+run_script(lua_State * L, const char * script, int size) {
+  if (LUA_OK != luaL_loadstring(L, script)) { return false; }
+  lua_pushinteger(L, size);
+  if (LUA_OK != lua_pcall(L, 1, 0, 0)) {
+    std::cerr << lua_tostring(L, -1) << std::endl;
+    lua_pop(L, 1);
+    return false;
+  }
+  return true;
+}
+
+// Plain userdata, which eris persists literally because of `__persist = true`
+bool
+make_userdata(lua_State * L, int size) {
+  lua_createtable(L, size, 0);
+  lua_createtable(L, 0, 1);
+  lua_pushboolean(L, true);
+  lua_setfield(L, -2, "__persist");
+  for (int i = 1; i <= size; ++i) {
+    void * p = lua_newuserdata(L, 64);
+    std::memset(p, i & 0xFF, 64);
+    lua_pushvalue(L, -2);
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, -3, i);
+  }
+  lua_pop(L, 1);
+  lua_setglobal(L, "data");
+  return true;
+}
+
+bool
+build_shape(lua_State * L, const std::string & shape, int size) {
+  if (shape == "deep") { return run_script(L, deep_script, size); }
+  if (shape == "closures") { return run_script(L, closures_script, size); }
+  if (shape == "coroutines") { return run_script(L, coroutines_script, size); }
+  if (shape == "userdata") { return make_userdata(L, size); }
+  std::cerr << "unknown shape '" << shape << "'" << std::endl;
+  return false;
+}
+
+long
+peak_rss_kb() {
+#ifdef BENCH_HAVE_RUSAGE
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage)) { return 0; }
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;
+#else
+  return usage.ru_maxrss;
+#endif
+#else
+  return 0;
+#endif
+}
+
+double
+elapsed_ms(clock_type::time_point start) {
+  std::chrono::duration<double, std::milli> d = clock_type::now() - start;
+  return d.count();
+}
+
+void
+report(const std::string & shape, int size, const char * phase, double ms,
+       std::size_t bytes) {
+  const double mb_per_s =
+    (bytes && ms > 0) ? (static_cast<double>(bytes) / (1 << 20)) / (ms / 1000)
+                      : 0;
+  std::cout << shape << ',' << size << ',' << phase << ',' << ms << ','
+            << mb_per_s << ',' << bytes << ',' << peak_rss_kb() << '\n';
+}
+
+bool
+bench_shape(const std::string & shape, int size, int reps) {
+  double init_ms = 0;
+  for (int r = 0; r < reps; ++r) {
+    bench_api a;
+    auto start = clock_type::now();
+    if (!a.init()) { return false; }
+    init_ms += elapsed_ms(start);
+  }
+  report(shape, size, "init", init_ms / reps, 0);
+
+  bench_api a;
+  if (!a.init() || !build_shape(a.lua_, shape, size)) { return false; }
+
+  std::string buffer;
+  double persist_ms = 0;
+  for (int r = 0; r < reps; ++r) {
+    auto start = clock_type::now();
+    if (!a.save(buffer)) { return false; }
+    persist_ms += elapsed_ms(start);
+  }
+  report(shape, size, "persist", persist_ms / reps, buffer.size());
+
+  double unpersist_ms = 0;
+  for (int r = 0; r < reps; ++r) {
+    bench_api b;
+    if (!b.init()) { return false; }
+    auto start = clock_type::now();
+    if (!b.restore(buffer)) { return false; }
+    unpersist_ms += elapsed_ms(start);
+  }
+  report(shape, size, "unpersist", unpersist_ms / reps, buffer.size());
+  return true;
+}
+
+} // end anonymous namespace
+
+int
+main(int argc, char * argv[]) {
+  int size = 2000;
+  int reps = 3;
+  if (argc > 2) { size = std::atoi(argv[2]); }
+  if (argc > 3) { reps = std::atoi(argv[3]); }
+  if (size < 1 || reps < 1) {
+    std::cerr << "usage: bench_persist [shape [size [reps]]]" << std::endl;
+    return 1;
+  }
+
+  std::cout << "shape,size,phase,ms,mb_per_s,snapshot_bytes,peak_rss_kb\n";
+
+  bool ok = true;
+  if (argc > 1) {
+    ok = bench_shape(argv[1], size, reps);
+  } else {
+    for (const char * shape : {"deep", "closures", "userdata", "coroutines"}) {
+      ok = ok && bench_shape(shape, size, reps);
+    }
+  }
+
+  if (!ok) {
+    std::cerr << "benchmark failed" << std::endl;
+    return 1;
+  }
+  std::cout << "OK!" << std::endl;
+}
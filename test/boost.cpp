@@ -1,7 +1,9 @@
 #include <primer/boost.hpp>
 #include <primer/primer.hpp>
+#include <primer/std/vector.hpp>
 
 #include "test_harness/test_harness.hpp"
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <set>
@@ -9,6 +11,7 @@
 #include <vector>
 
 #include <boost/optional/optional.hpp>
+#include <boost/variant.hpp>
 #include <boost/version.hpp>
 
 /***
@@ -200,6 +203,168 @@ UNIT_TEST(boost_vector_roundtrip) {
   }
 }
 
+UNIT_TEST(boost_small_vector) {
+  lua_raii L;
+  using small_t = boost::container::small_vector<int, 4>;
+
+  TEST_LUA_OK(L, luaL_dostring(L, "return {1, 2, 3}"));
+  {
+    auto v = primer::read<small_t>(L, -1);
+    TEST_EXPECTED(v);
+    TEST_EQ(v->size(), 3u);
+    TEST_EQ((*v)[2], 3);
+    // Still in the inline storage
+    TEST_EQ(v->capacity(), 4u);
+  }
+  lua_pop(L, 1);
+
+  // A longer table spills onto the heap
+  TEST_LUA_OK(L, luaL_dostring(L, "return {'a', 'b', 'c', 'd', 'e', 'f'}"));
+  {
+    // Not nothrow move constructible, so it is read in place
+    boost::container::small_vector<std::string, 4> v;
+    TEST_EXPECTED(primer::read_into(L, -1, v));
+    TEST_EQ(v.size(), 6u);
+    TEST_EQ(v[5], "f");
+
+    primer::push(L, v);
+    TEST_EQ(lua_rawlen(L, -1), 6u);
+    lua_rawgeti(L, -1, 1);
+    TEST_EQ(lua_tostring(L, -1), std::string{"a"});
+    lua_pop(L, 2);
+  }
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
+}
+
+UNIT_TEST(boost_static_vector) {
+  lua_raii L;
+
+  TEST_LUA_OK(L, luaL_dostring(L, "return {4, 5, 6}"));
+  {
+    auto v = primer::read<boost::container::static_vector<int, 3>>(L, -1);
+    TEST_EXPECTED(v);
+    TEST_EQ(v->size(), 3u);
+    TEST_EQ((*v)[0], 4);
+
+    primer::push(L, *v);
+    TEST_EQ(lua_rawlen(L, -1), 3u);
+    lua_pop(L, 1);
+  }
+
+  // One more than fits is an error, rather than `std::bad_alloc`
+  {
+    auto v = primer::read<boost::container::static_vector<int, 2>>(L, -1);
+    TEST(!v, "expected failure");
+    TEST(v.err().str().find("Too many elements") != std::string::npos,
+         "unexpected error: " << v.err().str());
+
+    boost::container::static_vector<std::string, 2> w;
+    TEST(!primer::read_into(L, -1, w), "expected failure");
+  }
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
+}
+
+UNIT_TEST(boost_flat_map) {
+  lua_raii L;
+  using map_t = boost::container::flat_map<std::string, int>;
+
+  TEST_LUA_OK(L, luaL_dostring(L, "local t = {} for i = 1, 100 do "
+                                  "t['k' .. i] = i end return t"));
+  {
+    auto m = primer::read<map_t>(L, -1);
+    TEST_EXPECTED(m);
+    TEST_EQ(m->size(), 100u);
+    TEST_EQ(m->at("k1"), 1);
+    TEST_EQ(m->at("k57"), 57);
+    TEST(std::is_sorted(m->begin(), m->end(), m->value_comp()),
+         "expected the pairs to be sorted");
+  }
+  lua_pop(L, 1);
+
+  // Reading into an existing map replaces its contents
+  map_t m{{"old", 1}};
+  TEST_LUA_OK(L, luaL_dostring(L, "return {b = 2, a = 1, c = 3}"));
+  TEST_EXPECTED(primer::read_into(L, -1, m));
+  lua_pop(L, 1);
+  TEST_EQ(m.size(), 3u);
+  TEST_EQ(m.begin()->first, "a");
+  TEST(m.find("old") == m.end(), "expected the old entry to be gone");
+
+  TEST_LUA_OK(L, luaL_dostring(L, "return {a = 'not an int'}"));
+  TEST(!primer::read<map_t>(L, -1), "expected failure");
+  lua_pop(L, 1);
+
+  primer::push(L, m);
+  lua_getfield(L, -1, "c");
+  TEST_EQ(lua_tointeger(L, -1), 3);
+  lua_pop(L, 2);
+  CHECK_STACK(L, 0);
+}
+
+using V = boost::variant<int, std::string, std::vector<int>>;
+using W = boost::variant<int, std::string>;
+
+UNIT_TEST(variant_roundtrip) {
+  lua_raii L;
+
+  round_trip_value(L, W{5}, __LINE__);
+  round_trip_value(L, W{std::string{"foo"}}, __LINE__);
+  {
+    const V v{std::vector<int>{1, 2, 3}};
+    primer::push(L, v);
+    auto r = primer::read<V>(L, -1);
+    TEST_EXPECTED(r);
+    TEST(*r == v, "expected the vector back");
+    lua_pop(L, 1);
+  }
+  round_trip_value(L, boost::variant<bool, std::string>{true}, __LINE__);
+}
+
+UNIT_TEST(variant_read) {
+  lua_raii L;
+
+  lua_pushinteger(L, 7);
+  {
+    auto r = primer::read<V>(L, -1);
+    TEST_EXPECTED(r);
+    TEST(boost::get<int>(&*r), "expected an int");
+  }
+  lua_pop(L, 1);
+
+  // No alternative accepts a float
+  lua_pushnumber(L, 1.5);
+  {
+    auto r = primer::read<V>(L, -1);
+    TEST(!r, "expected an error");
+    const std::string msg = r.err().what();
+    TEST(msg.find("number or string or table") != std::string::npos,
+         "unexpected error: " << msg);
+  }
+  lua_pop(L, 1);
+
+  // An accepting alternative which fails to convert
+  lua_newtable(L);
+  lua_pushstring(L, "x");
+  lua_rawseti(L, -2, 1);
+  TEST(!primer::read<V>(L, -1), "expected an error");
+  lua_pop(L, 1);
+
+  // The first accepting alternative wins
+  lua_pushstring(L, "12");
+  {
+    auto r = primer::read<boost::variant<double, std::string>>(L, -1);
+    TEST_EXPECTED(r);
+    TEST(boost::get<double>(&*r), "expected a double");
+    auto r2 = primer::read<boost::variant<std::string, double>>(L, -1);
+    TEST_EXPECTED(r2);
+    TEST(boost::get<std::string>(&*r2), "expected a string");
+  }
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
+}
+
 } // end anonymous namespace
 
 /***
@@ -1,9 +1,17 @@
 #include <primer/primer.hpp>
 
 #include "test_harness/test_harness.hpp"
+#include <array>
 #include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <set>
 #include <string>
+#include <tuple>
+#include <unordered_set>
+#include <vector>
 
 using uint = unsigned int;
 
@@ -196,6 +204,7 @@ UNIT_TEST(roundtrip_simple) {
   test_roundtrip_value<std::string>(L, "foo", __LINE__);
   test_roundtrip_value<std::string>(L, "bar", __LINE__);
   test_roundtrip_value<std::string>(L, "", __LINE__);
+  test_roundtrip_value<std::string>(L, std::string("a\0b", 3), __LINE__);
 
   test_roundtrip_value<uint>(L, 0, __LINE__);
   test_roundtrip_value<uint>(L, 27, __LINE__);
@@ -212,6 +221,59 @@ UNIT_TEST(roundtrip_simple) {
   test_roundtrip_value<float>(L, -97.75f, __LINE__);
 }
 
+UNIT_TEST(push_string_length) {
+  lua_raii L;
+
+  primer::push(L, "foo");
+  CHECK_STACK(L, 1);
+  TEST_EQ(lua_rawlen(L, 1), 3u);
+  TEST_EQ(std::string(lua_tostring(L, 1)), "foo");
+  lua_pop(L, 1);
+
+  primer::push(L, std::string("a\0b\0", 4));
+  TEST_EQ(lua_rawlen(L, 1), 4u);
+  lua_pop(L, 1);
+
+  primer::lua_string_view v{"abcdef", 3};
+  primer::push(L, v);
+  TEST_EQ(lua_rawlen(L, 1), 3u);
+  TEST_EQ(std::string(lua_tostring(L, 1)), "abc");
+  lua_pop(L, 1);
+
+  primer::push(L, static_cast<const char *>("a\0b"));
+  TEST_EQ(lua_rawlen(L, 1), 1u);
+  lua_pop(L, 1);
+
+  // A literal keeps its embedded zeros
+  primer::push(L, "a\0b");
+  TEST_EQ(lua_rawlen(L, 1), 3u);
+  lua_pop(L, 1);
+
+  // A partly filled buffer is pushed as the C string in it
+  char name[32];
+  std::memset(name, 'x', sizeof(name));
+  std::snprintf(name, sizeof(name), "unit %d", 7);
+  primer::push(L, name);
+  TEST_EQ(lua_rawlen(L, 1), 6u);
+  TEST_EQ(std::string(lua_tostring(L, 1)), "unit 7");
+  lua_pop(L, 1);
+
+  char buf[16];
+  std::memset(buf, 'y', sizeof(buf));
+  std::strcpy(buf, "abc");
+  primer::push(L, buf);
+  TEST_EQ(lua_rawlen(L, 1), std::strlen(buf));
+  TEST_EQ(std::string(lua_tostring(L, 1)), "abc");
+  lua_pop(L, 1);
+
+  // And a full one, without a null character, as its whole size
+  char full[4] = {'a', 'b', 'c', 'd'};
+  primer::push(L, full);
+  TEST_EQ(lua_rawlen(L, 1), 4u);
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
+}
+
 template <typename U, typename T>
 void
 test_type_safety(lua_State * L, T t, int line) {
@@ -388,6 +450,232 @@ UNIT_TEST(adapt_two) {
 
 namespace {
 
+std::size_t test_string_view_size;
+std::string test_string_view_text;
+
+primer::result
+test_func_string_view(lua_State * L, primer::lua_string_view a,
+                      primer::lua_string_view b) {
+  test_string_view_size = a.size() + b.size();
+  test_string_view_text = a.str() + b.str();
+  lua_pushboolean(L, a.empty());
+  return 1;
+}
+} // end anonymous namespace
+
+UNIT_TEST(adapt_string_view) {
+  lua_raii L;
+
+  lua_CFunction func = PRIMER_ADAPT(&test_func_string_view);
+
+  lua_pushcfunction(L, func);
+  lua_pushlstring(L, "a\0b", 3);
+  lua_pushstring(L, "cd");
+
+  TEST_LUA_OK(L, lua_pcall(L, 2, 1, 0));
+  CHECK_STACK(L, 1);
+  TEST_EQ(lua_toboolean(L, 1), false);
+  TEST_EQ(test_string_view_size, 5u);
+  TEST_EQ(test_string_view_text, std::string("a\0bcd", 5));
+  lua_pop(L, 1);
+
+  lua_pushcfunction(L, func);
+  lua_pushstring(L, "");
+  lua_pushinteger(L, 5);
+
+  TEST_EQ(LUA_ERRRUN, lua_pcall(L, 2, 1, 0));
+  CHECK_STACK(L, 1);
+  lua_pop(L, 1);
+
+  lua_pushlstring(L, "x\0y", 3);
+  auto str = primer::read<std::string>(L, 1);
+  TEST_EXPECTED(str);
+  TEST_EQ(*str, std::string("x\0y", 3));
+  lua_pop(L, 1);
+}
+
+namespace {
+
+int table_view_reads;
+
+primer::result
+test_func_find(lua_State * L, primer::table_view<int> v, int target) {
+  table_view_reads = 0;
+  for (auto it = v.begin(); it != v.end(); ++it) {
+    ++table_view_reads;
+    auto item = *it;
+    if (!item) { return std::move(item.err()); }
+    if (*item == target) {
+      primer::push(L, static_cast<int>(table_view_reads));
+      return 1;
+    }
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+primer::result
+test_func_map_sum(lua_State * L, primer::map_view<std::string, int> m) {
+  int total = 0;
+  auto ok = m.for_each([&](std::string key, int value) {
+    if (key == "stop") { return false; }
+    total += value;
+    return true;
+  });
+  if (!ok) { return std::move(ok.err()); }
+  primer::push(L, total);
+  return 1;
+}
+
+} // end anonymous namespace
+
+UNIT_TEST(adapt_table_view) {
+  lua_raii L;
+
+  const char * script = "local find, sum = ...\n"
+                        "assert(find({4, 5, 6, 'x'}, 5) == 2)\n"
+                        "assert(find({4, 5, 6}, 7) == nil)\n"
+                        "assert(not pcall(find, {4, 'x', 6}, 6))\n"
+                        "assert(not pcall(find, 4, 6))\n"
+                        "assert(sum({a = 1, b = 2, c = 3}) == 6)\n"
+                        "assert(sum({}) == 0)\n"
+                        "assert(sum({stop = 1}) == 0)\n"
+                        "assert(not pcall(sum, {a = 'x'}))\n"
+                        "assert(not pcall(sum, {1}))\n";
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  TEST_EXPECTED(try_load_script(L, script));
+  lua_pushcfunction(L, PRIMER_ADAPT(&test_func_find));
+  lua_pushcfunction(L, PRIMER_ADAPT(&test_func_map_sum));
+  TEST_LUA_OK(L, lua_pcall(L, 2, 0, 0));
+  CHECK_STACK(L, 0);
+
+  // The early exit means later elements are not converted
+  lua_pushcfunction(L, PRIMER_ADAPT(&test_func_find));
+  TEST_EXPECTED(try_load_script(L, "return {1, 2, 3, 4}"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  lua_pushinteger(L, 1);
+  TEST_LUA_OK(L, lua_pcall(L, 2, 1, 0));
+  TEST_EQ(table_view_reads, 1);
+  lua_pop(L, 1);
+}
+
+namespace {
+
+primer::result
+test_func_apply(lua_State * L, primer::stack_function f, primer::stack_ref v) {
+  if (!f) { return primer::error{"expected a function"}; }
+  auto doubled = f.call_as<int>(v);
+  if (!doubled) { return std::move(doubled.err()); }
+  auto seq = f.call(*doubled);
+  if (!seq) { return std::move(seq.err()); }
+  seq->push_each(L);
+  return static_cast<int>(seq->size());
+}
+
+} // end anonymous namespace
+
+UNIT_TEST(adapt_stack_ref) {
+  lua_raii L;
+
+  const char * script = "local apply = ...\n"
+                        "local function twice(x) return 2 * x end\n"
+                        "assert(apply(twice, 3) == 12)\n"
+                        "assert(not pcall(apply, 5, 3))\n"
+                        "assert(not pcall(apply))\n"
+                        "local ok, e = pcall(apply, function() error('x') end)\n"
+                        "assert(not ok)\n";
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  TEST_EXPECTED(try_load_script(L, script));
+  lua_pushcfunction(L, PRIMER_ADAPT(&test_func_apply));
+  TEST_LUA_OK(L, lua_pcall(L, 1, 0, 0));
+  CHECK_STACK(L, 0);
+
+  // Persistent refs from the borrowed ones
+  lua_pushinteger(L, 7);
+  primer::stack_ref r{L, -1};
+  auto ref = r.to_ref();
+  TEST_EXPECTED(ref);
+  TEST_EQ(*ref->as<int>(), 7);
+  TEST_EQ(*r.as<int>(), 7);
+  lua_pop(L, 1);
+
+  TEST_EXPECTED(try_load_script(L, "return 5"));
+  primer::stack_function f{L, -1};
+  auto bound = f.to_function();
+  TEST_EXPECTED(bound);
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
+  auto five = bound->call_as<int>();
+  TEST_EXPECTED(five);
+  TEST_EQ(*five, 5);
+}
+
+UNIT_TEST(for_each_table) {
+  lua_raii L;
+
+  TEST_EXPECTED(try_load_script(L, "return {3, 4, 5, 6}, {a = 1, [2] = 5}"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 2, 0));
+
+  {
+    int total = 0;
+    std::size_t last = 0;
+    auto ok = primer::for_each_index<int>(L, 1, [&](std::size_t i, int v) {
+      total += v;
+      last = i;
+    });
+    TEST_EXPECTED(ok);
+    TEST_EQ(total, 18);
+    TEST_EQ(last, 3u);
+  }
+
+  {
+    int seen = 0;
+    auto ok = primer::for_each_index<int>(L, 1, [&](std::size_t, int v) {
+      ++seen;
+      return v < 4;
+    });
+    TEST_EXPECTED(ok);
+    TEST_EQ(seen, 2);
+  }
+  CHECK_STACK(L, 2);
+
+  {
+    int total = 0;
+    auto ok = primer::for_each_pair<primer::stringy, int>(
+      L, 2, [&](primer::stringy, int v) { total += v; });
+    TEST_EXPECTED(ok);
+    TEST_EQ(total, 6);
+  }
+
+  {
+    auto ok =
+      primer::for_each_pair<std::string, int>(L, 2, [](std::string, int) {});
+    TEST(!ok, "expected an error for an integer key");
+  }
+
+  {
+    auto ok = primer::for_each_index<std::string>(
+      L, 1, [](std::size_t, std::string) {});
+    TEST(!ok, "expected an error for numbers");
+    TEST(ok.err().str().find("In index [1]") != std::string::npos,
+         "unexpected error: " << ok.err().str());
+  }
+  CHECK_STACK(L, 2);
+
+  lua_pushinteger(L, 5);
+  TEST(!primer::for_each_index<int>(L, -1, [](std::size_t, int) {}),
+       "expected an error for a number");
+  lua_settop(L, 0);
+}
+
+namespace {
+
 primer::result
 test_func_three(lua_State * L, int i, int j, bool b) {
   if (i != 5) {
@@ -411,6 +699,441 @@ test_func_three(lua_State * L, int i, int j, bool b) {
 
 } // end anonymous namespace
 
+namespace {
+
+primer::result
+test_overload_number(lua_State * L, double d) {
+  lua_pushstring(L, "number");
+  lua_pushnumber(L, d);
+  return 2;
+}
+
+primer::result
+test_overload_string_table(lua_State * L, std::string s,
+                           primer::table_view<int> t) {
+  lua_pushstring(L, "string, table");
+  primer::push(L, s + std::to_string(t.size()));
+  return 2;
+}
+
+primer::result
+test_overload_int_opt_bool(lua_State * L, int i, primer::nil_t) {
+  lua_pushstring(L, "integer");
+  lua_pushinteger(L, i);
+  return 2;
+}
+
+int
+test_overload_fallback(lua_State * L) {
+  lua_pushstring(L, "fallback");
+  lua_pushinteger(L, lua_gettop(L) - 1);
+  return 2;
+}
+
+} // end anonymous namespace
+
+UNIT_TEST(adapt_overloads) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  luaL_requiref(L, "string", luaopen_string, 1);
+  lua_pop(L, 2);
+
+  lua_CFunction func = PRIMER_ADAPT_OVERLOADS(
+    &test_overload_int_opt_bool, &test_overload_number,
+    &test_overload_string_table);
+  lua_pushcfunction(L, func);
+  lua_setglobal(L, "f");
+
+  lua_CFunction func2 =
+    PRIMER_ADAPT_OVERLOADS(&test_overload_number, &test_overload_fallback);
+  lua_pushcfunction(L, func2);
+  lua_setglobal(L, "g");
+
+  const char * script =
+    "local a, b = f(1.5)                                             \n"
+    "assert(a == 'number' and b == 1.5)                              \n"
+    "a, b = f('foo', {1, 2, 3})                                      \n"
+    "assert(a == 'string, table' and b == 'foo3')                    \n"
+    "-- first matching overload wins                                 \n"
+    "a, b = f(3)                                                     \n"
+    "assert(a == 'integer' and b == 3)                               \n"
+    "a, b = f(3, nil)                                                \n"
+    "assert(a == 'integer' and b == 3)                               \n"
+    "-- selected overload's read errors are reported                 \n"
+    "local ok, err = pcall(f, 1 << 40)                               \n"
+    "assert(not ok and err:find('overflow'), err)                    \n"
+    "ok, err = pcall(f, 2.5, nil)                                    \n"
+    "assert(not ok and err:find('no matching overload'), err)        \n"
+    "ok, err = pcall(f, 'foo', 5)                                    \n"
+    "assert(not ok and err:find('no matching overload'), err)        \n"
+    "assert(err:find('string, number'), err)                         \n"
+    "ok, err = pcall(f, 1, 2, 3)                                     \n"
+    "assert(not ok and err:find('no matching overload'), err)        \n"
+    "a, b = g(1, 2)                                                  \n"
+    "assert(a == 'fallback' and b == 2)                              \n"
+    "a, b = g(1)                                                     \n"
+    "assert(a == 'number' and b == 1)                                \n";
+
+  TEST_EXPECTED(try_load_script(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  CHECK_STACK(L, 0);
+}
+
+namespace {
+
+std::tuple<int, std::string, bool>
+test_func_tuple(lua_State *, int i, std::string s) {
+  return std::make_tuple(i * 2, s + "!", i > 0);
+}
+
+primer::expected<std::tuple<double, int>>
+test_func_divmod(lua_State *, int a, int b) {
+  if (!b) { return primer::error{"division by zero"}; }
+  return std::make_tuple(static_cast<double>(a) / b, a % b);
+}
+
+std::tuple<>
+test_func_tuple_empty(lua_State *) {
+  return {};
+}
+
+} // end anonymous namespace
+
+UNIT_TEST(adapt_tuple_return) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  luaL_requiref(L, "string", luaopen_string, 1);
+  lua_pop(L, 2);
+
+  lua_pushcfunction(L, PRIMER_ADAPT(&test_func_tuple));
+  lua_setglobal(L, "f");
+  lua_pushcfunction(L, PRIMER_ADAPT(&test_func_divmod));
+  lua_setglobal(L, "divmod");
+  lua_pushcfunction(L, PRIMER_ADAPT(&test_func_tuple_empty));
+  lua_setglobal(L, "nothing");
+  lua_pushcfunction(L, PRIMER_ADAPT_OVERLOADS(&test_func_divmod,
+                                              &test_func_tuple));
+  lua_setglobal(L, "g");
+
+  const char * script =
+    "local a, b, c = f(3, 'x')                                       \n"
+    "assert(a == 6 and b == 'x!' and c == true)                      \n"
+    "assert(select('#', f(-1, '')) == 3)                             \n"
+    "local q, r = divmod(7, 2)                                       \n"
+    "assert(q == 3.5 and r == 1)                                     \n"
+    "local ok, err = pcall(divmod, 1, 0)                             \n"
+    "assert(not ok and err:find('division by zero'), err)            \n"
+    "ok, err = pcall(f, 'y', 'x')                                    \n"
+    "assert(not ok, 'expected a read error')                         \n"
+    "assert(select('#', nothing()) == 0)                             \n"
+    "q, r = g(9, 3)                                                  \n"
+    "assert(q == 3 and r == 0)                                       \n"
+    "a, b = g(1, 'z')                                                \n"
+    "assert(a == 2 and b == 'z!')                                    \n";
+
+  TEST_EXPECTED(try_load_script(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  CHECK_STACK(L, 0);
+}
+
+namespace {
+
+primer::result
+test_func_join(lua_State * L, std::string sep,
+               primer::variadic<primer::stringy> parts) {
+  std::string result;
+  for (const auto & p : parts) {
+    if (!result.empty()) { result += sep; }
+    result += p.value;
+  }
+  lua_pushstring(L, result.c_str());
+  lua_pushboolean(L, parts.is_inline());
+  return 2;
+}
+
+std::tuple<int, int>
+test_func_sum(lua_State *, primer::variadic<int> xs) {
+  int total = 0;
+  for (int x : xs) {
+    total += x;
+  }
+  return std::make_tuple(total, static_cast<int>(xs.size()));
+}
+
+primer::result
+test_func_count_strings(lua_State * L, primer::variadic<std::string> xs) {
+  lua_pushstring(L, "strings");
+  lua_pushinteger(L, static_cast<lua_Integer>(xs.size()));
+  return 2;
+}
+
+} // end anonymous namespace
+
+UNIT_TEST(adapt_variadic) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  luaL_requiref(L, "string", luaopen_string, 1);
+  lua_pop(L, 2);
+
+  lua_pushcfunction(L, PRIMER_ADAPT(&test_func_join));
+  lua_setglobal(L, "join");
+  lua_pushcfunction(L, PRIMER_ADAPT(&test_func_sum));
+  lua_setglobal(L, "sum");
+  lua_pushcfunction(L, PRIMER_ADAPT_OVERLOADS(&test_func_sum,
+                                              &test_func_count_strings));
+  lua_setglobal(L, "f");
+
+  const char * script =
+    "local s, inline = join(', ', 'a', 1, 'b')                       \n"
+    "assert(s == 'a, 1, b' and inline, s)                            \n"
+    "assert(join('-') == '')                                         \n"
+    "local t, n = sum()                                              \n"
+    "assert(t == 0 and n == 0)                                       \n"
+    "t, n = sum(1, 2, 3, 4, 5, 6, 7, 8, 9, 10)                       \n"
+    "assert(t == 55 and n == 10)                                     \n"
+    "local ok, err = pcall(sum, 1, 2, 'x')                           \n"
+    "assert(not ok and err:find('In argument #3'), err)              \n"
+    "local _, big = join('', 1, 2, 3, 4, 5, 6, 7, 8, 9)              \n"
+    "assert(not big)                                                 \n"
+    "t, n = f(4, 5)                                                  \n"
+    "assert(t == 9 and n == 2)                                       \n"
+    "local k, m = f('x', 'y', 'z')                                   \n"
+    "assert(k == 'strings' and m == 3)                               \n"
+    "k, m = f()                                                      \n"
+    "assert(k == 0 and m == 0)                                       \n";
+
+  TEST_EXPECTED(try_load_script(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  CHECK_STACK(L, 0);
+}
+
+namespace {
+
+primer::result
+test_func_byte_sum(lua_State * L, primer::byte_span bytes) {
+  int total = 0;
+  for (unsigned char c : bytes) {
+    total += c;
+  }
+  lua_pushinteger(L, total);
+  return 1;
+}
+
+primer::result
+test_func_new_bytes(lua_State * L, int n) {
+  primer::push_udata<primer::byte_buffer>(L, static_cast<std::size_t>(n));
+  return 1;
+}
+
+} // end anonymous namespace
+
+UNIT_TEST(byte_buffer) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  lua_pushcfunction(L, PRIMER_ADAPT(&test_func_byte_sum));
+  lua_setglobal(L, "sum");
+  lua_pushcfunction(L, PRIMER_ADAPT(&test_func_new_bytes));
+  lua_setglobal(L, "bytes");
+
+  const char * script =
+    "local b = bytes(8)                                              \n"
+    "assert(#b == 8 and sum(b) == 0)                                 \n"
+    "b:set_u16(1, 0x0102)                                            \n"
+    "assert(b:get_u16(1) == 0x0102)                                  \n"
+    "b:set_i32(5, -7)                                                \n"
+    "assert(b:get_i32(5) == -7)                                      \n"
+    "assert(not pcall(b.get_u32, b, 6))                              \n"
+    "assert(not pcall(b.set_u8, b, 1, 256))                          \n"
+    "local s = b:slice(5, 8)                                         \n"
+    "assert(#s == 4 and s:get_i32(1) == -7)                          \n"
+    "s:set_u8(1, 9)                                                  \n"
+    "assert(b:get_u8(5) == 9)                                        \n"
+    "assert(sum(s) == sum(b:slice(5)))                               \n"
+    "local t = s:slice(2, 3)                                         \n"
+    "assert(#t == 2 and t:tostring() == b:tostring(6, 7))            \n"
+    "b:append('xyz')                                                 \n"
+    "assert(#b == 11 and b:tostring(9) == 'xyz')                     \n"
+    "b:append(b:slice(9))                                            \n"
+    "assert(b:tostring(-6) == 'xyzxyz')                              \n"
+    "b:resize(6)                                                     \n"
+    "assert(#s == 2 and #t == 1)                                     \n"
+    "local f = bytes(0)                                              \n"
+    "assert(not pcall(f.set_f64, f, 1, 1.5))                         \n"
+    "f:resize(8)                                                     \n"
+    "f:set_f64(1, 1.5)                                               \n"
+    "assert(f:get_f64(1) == 1.5)                                     \n";
+
+  TEST_EXPECTED(try_load_script(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  CHECK_STACK(L, 0);
+
+  // A buffer holding a chunk is loaded without copying it
+  primer::push_udata<primer::byte_buffer>(L);
+  auto * b = primer::test_udata<primer::byte_buffer>(L, -1);
+  TEST(b, "expected a byte buffer");
+  const char chunk[] = "return 6 * 7";
+  b->append(chunk, sizeof(chunk) - 1);
+  auto span = primer::read<primer::byte_span>(L, -1);
+  TEST_EXPECTED(span);
+  TEST_EQ(span->size(), sizeof(chunk) - 1);
+  TEST_EQ(primer::load_bytes(L, *span, "=chunk"), LUA_OK);
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  TEST_EQ(lua_tointeger(L, -1), 42);
+  lua_pop(L, 1);
+
+  TEST_EQ(luaL_getmetafield(L, -1, "__persist"), LUA_TFUNCTION);
+  lua_pop(L, 2);
+
+  lua_pushliteral(L, "abc");
+  TEST(!primer::read<primer::byte_span>(L, -1), "expected a failure");
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
+}
+
+// Userdata have one user value unless their trait asks otherwise, as in 5.3
+static_assert(primer::detail::udata_user_values<primer::byte_buffer>::value
+                == 1,
+              "expected a user value by default");
+
+// Userdata which primer gives a user value keep it. Under lua 5.4 they must be
+// made with one, see `detail::newuserdata`.
+UNIT_TEST(user_values) {
+  lua_raii L;
+
+  primer::push_udata<primer::byte_buffer>(L, std::size_t{4});
+  lua_newtable(L);
+  lua_setuservalue(L, 1);
+  TEST_EQ(lua_getuservalue(L, 1), LUA_TTABLE);
+  lua_pop(L, 1);
+  primer::detail::push_byte_slice(L, 1, 0, 4);
+  TEST_EQ(lua_getuservalue(L, -1), LUA_TUSERDATA);
+  TEST(lua_rawequal(L, -1, 1), "a slice should hold its buffer");
+  lua_pop(L, 3);
+
+  primer::detail::newuserdata(L, 8, 1);
+  lua_newtable(L);
+  lua_setuservalue(L, -2);
+  TEST_EQ(lua_getuservalue(L, -1), LUA_TTABLE);
+  lua_pop(L, 2);
+
+#if LUA_VERSION_NUM >= 504
+  primer::detail::newuserdata(L, 8, 0);
+  lua_newtable(L);
+  TEST(!lua_setiuservalue(L, -2, 1),
+       "a userdata without user values can't hold one");
+  lua_pop(L, 1);
+#endif
+  CHECK_STACK(L, 0);
+}
+
+namespace {
+
+primer::result
+test_func_span_length(lua_State * L, primer::string_span s) {
+  lua_pushinteger(L, static_cast<LUA_INTEGER>(s.size()));
+  lua_pushlstring(L, s.data(), s.empty() ? 0 : 1);
+  return 2;
+}
+
+} // end anonymous namespace
+
+UNIT_TEST(string_builder) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  lua_pushcfunction(L, PRIMER_ADAPT(&test_func_span_length));
+  lua_setglobal(L, "span_length");
+  lua_pushcfunction(L, &primer::intf_new_string_builder);
+  lua_setglobal(L, "string_builder");
+
+  const char * script =
+    "local b = string_builder(64)                                    \n"
+    "assert(#b == 0 and b:tostring() == '')                          \n"
+    "assert(b:append('ab', 1, 2.5) == b)                             \n"
+    "assert(b:tostring() == 'ab12.5' and #b == 6)                    \n"
+    "b:clear()                                                       \n"
+    "for i = 1, 3 do b:append(i, ',') end                            \n"
+    "assert(tostring(b) == '1,2,3,')                                 \n"
+    "b:append(b)                                                     \n"
+    "assert(b:tostring() == '1,2,3,1,2,3,')                          \n"
+    "local f = string_builder()                                      \n"
+    "f:appendf('%d|%5.2f|%-3s|%x|%%|%s', 42, 3.14159, 'a', 255, b)   \n"
+    "assert(f:tostring() == '42| 3.14|a  |ff|%|1,2,3,1,2,3,')        \n"
+    "f:clear():appendf('%s %s %c', true, nil, 65)                    \n"
+    "assert(f:tostring() == 'true nil A')                            \n"
+    "f:clear()                                                       \n"
+    "assert(not pcall(f.appendf, f, '%d', 1.5))                      \n"
+    "assert(not pcall(f.appendf, f, '%d'))                           \n"
+    "assert(not pcall(f.appendf, f, '%123d', 1))                     \n"
+    "assert(not pcall(f.appendf, f, '%y', 1))                        \n"
+    "assert(#f == 0)                                                 \n"
+    "assert(not pcall(f.append, f, {}))                              \n"
+    "f:appendf('%099d', 7)                                           \n"
+    "assert(#f == 99)                                                \n"
+    "local n, c = span_length(b)                                     \n"
+    "assert(n == 12 and c == '1')                                    \n"
+    "assert(span_length('xyz') == 3)                                 \n"
+    "assert(not pcall(span_length, 5))                               \n";
+
+  TEST_EXPECTED(try_load_script(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  CHECK_STACK(L, 0);
+
+  // The characters are read from C++ in place
+  primer::push_udata<primer::string_builder>(L);
+  auto & b = *primer::test_udata<primer::string_builder>(L, -1);
+  b.append("hello", 5);
+  auto span = primer::read<primer::string_span>(L, -1);
+  TEST_EXPECTED(span);
+  TEST(span->data() == b.data(), "expected no copy");
+  TEST_EQ(span->str(), "hello");
+  TEST_EQ(luaL_getmetafield(L, -1, "__persist"), LUA_TBOOLEAN);
+  lua_pop(L, 2);
+  CHECK_STACK(L, 0);
+}
+
+UNIT_TEST(push_streamed) {
+  lua_raii L;
+
+  lua_pushinteger(L, 1);
+  auto ok = primer::push_streamed(L, [](primer::stream_appender & out) {
+    out.append("ab");
+    out.push_back('c');
+    // Longer than the initial buffer of luaL_Buffer
+    for (int i = 0; i < 10000; ++i) {
+      out.append(std::string{"0123456789"});
+    }
+    char * p = out.prepare(3);
+    std::memcpy(p, "xyz", 3);
+    out.commit(3);
+  });
+  TEST_EXPECTED(ok);
+  CHECK_STACK(L, 2);
+  std::size_t len;
+  const char * s = lua_tolstring(L, -1, &len);
+  TEST_EQ(len, 100006u);
+  TEST_EQ(std::string(s, 5), "abc01");
+  TEST_EQ(std::string(s + len - 4, 4), "9xyz");
+  lua_pop(L, 1);
+
+  // A writer which fails partway pushes nothing
+  ok = primer::push_streamed(L, [](primer::stream_appender & out)
+                                  -> primer::expected<void> {
+    for (int i = 0; i < 1000; ++i) {
+      out.append("partial output ");
+    }
+    return primer::error{"writer failed"};
+  });
+  TEST(!ok, "expected an error");
+  TEST_EQ(ok.err().str(), "writer failed");
+  CHECK_STACK(L, 1);
+  TEST_EQ(lua_tointeger(L, 1), 1);
+  lua_pop(L, 1);
+}
+
 UNIT_TEST(adapt_three) {
   lua_raii L;
 
@@ -499,6 +1222,117 @@ UNIT_TEST(adapt_three) {
   CHECK_STACK(L, 0);
 }
 
+namespace {
+
+primer::result
+test_func_primitives(lua_State * L, int i, unsigned u, double d, bool b) {
+  lua_pushnumber(L, b ? i + u + d : 0);
+  return 1;
+}
+
+} // end anonymous namespace
+
+UNIT_TEST(adapt_primitives) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  luaL_requiref(L, "string", luaopen_string, 1);
+  lua_pop(L, 2);
+
+  lua_pushcfunction(L, PRIMER_ADAPT(&test_func_primitives));
+  lua_setglobal(L, "f");
+
+  const char * script =
+    "assert(f(1, 2, 0.5, true) == 3.5)                               \n"
+    "assert(f(-1, 2, 1, true) == 2)                                  \n"
+    "assert(f(1, 2, 3, false) == 0)                                  \n"
+    "-- strings are converted by the general path                    \n"
+    "assert(f(1, 2, '0.25', true) == 3.25)                           \n"
+    "local ok, err = pcall(f, 1.5, 2, 3, true)                       \n"
+    "assert(not ok and err:find('integer'), err)                     \n"
+    "ok, err = pcall(f, '1', 2, 3, true)                             \n"
+    "assert(not ok and err:find('integer'), err)                     \n"
+    "ok, err = pcall(f, 1 << 40, 2, 3, true)                         \n"
+    "assert(not ok and err:find('overflow'), err)                    \n"
+    "ok, err = pcall(f, 1, -2, 3, true)                              \n"
+    "assert(not ok and err:find('nonnegative'), err)                 \n"
+    "ok, err = pcall(f, 1, 2, 3, nil)                                \n"
+    "assert(not ok and err:find('boolean'), err)                     \n"
+    "ok, err = pcall(f, 1, 2)                                        \n"
+    "assert(not ok and err:find('no value'), err)                    \n";
+
+  TEST_EXPECTED(try_load_script(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  CHECK_STACK(L, 0);
+}
+
+namespace {
+
+int memo_calls = 0;
+
+std::tuple<std::string, int>
+test_func_memoized(lua_State *, const std::string & key, int n) {
+  ++memo_calls;
+  return std::tuple<std::string, int>{key + "!", n * 2};
+}
+
+primer::expected<std::tuple<int>>
+test_func_memoized_expected(lua_State *, int n) {
+  ++memo_calls;
+  if (n < 0) { return primer::error{"negative"}; }
+  return std::tuple<int>{n + 1};
+}
+
+} // end anonymous namespace
+
+UNIT_TEST(adapt_memoized) {
+  using memo_t = PRIMER_ADAPT_MEMOIZED_TYPE(&test_func_memoized, 2);
+
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  luaL_requiref(L, "string", luaopen_string, 1);
+  lua_pop(L, 2);
+
+  lua_pushcfunction(L, PRIMER_ADAPT_MEMOIZED(&test_func_memoized, 2));
+  lua_setglobal(L, "f");
+  lua_pushcfunction(L, PRIMER_ADAPT_MEMOIZED(&test_func_memoized_expected, 4));
+  lua_setglobal(L, "g");
+
+  memo_calls = 0;
+  TEST_LUA_OK(L, luaL_dostring(L, "local s, n = f('a', 1)           \n"
+                                  "assert(s == 'a!' and n == 2)     \n"
+                                  "s, n = f('a', 1)                 \n"
+                                  "assert(s == 'a!' and n == 2)     \n"));
+  TEST_EQ(memo_calls, 1);
+  TEST_EQ(memo_t::size(), 1u);
+
+  // The one used least recently is forgotten
+  TEST_LUA_OK(L, luaL_dostring(L, "f('b', 1) f('a', 1) f('c', 1)"));
+  TEST_EQ(memo_calls, 3);
+  TEST_EQ(memo_t::size(), 2u);
+  TEST_LUA_OK(L, luaL_dostring(L, "f('a', 1) f('b', 1)"));
+  TEST_EQ(memo_calls, 4);
+
+  // Invalidating forgets everything
+  memo_t::invalidate();
+  TEST_EQ(memo_t::size(), 0u);
+  TEST_LUA_OK(L, luaL_dostring(L, "assert(f('a', 2) == 'a!')"));
+  TEST_EQ(memo_calls, 5);
+
+  // Errors of reading or of the function aren't kept
+  memo_calls = 0;
+  const char * script =
+    "local ok, err = pcall(f, 'a')                 \n"
+    "assert(not ok and err:find('no value'), err) \n"
+    "assert(g(1) == 2 and g(1) == 2)               \n"
+    "ok, err = pcall(g, -1)                        \n"
+    "assert(not ok and err:find('negative'), err)  \n"
+    "ok, err = pcall(g, -1)                        \n"
+    "assert(not ok and err:find('negative'), err)  \n";
+  TEST_LUA_OK(L, luaL_dostring(L, script));
+  TEST_EQ(memo_calls, 3);
+  CHECK_STACK(L, 0);
+}
+
 #define WEAK_REF_TEST(X)                                                       \
   TEST(X, "Unexpected value for lua_state_ref. line: " << __LINE__)
 
@@ -531,6 +1365,9 @@ UNIT_TEST(lua_state_ref_validity) {
     lua_State * l = L;
     TEST_EQ(l, r.lock());
     TEST_EQ(l, s.lock());
+
+    // Refs obtained again share the strong ref, with or without the cache
+    TEST_EQ(r.identity(), primer::obtain_state_ref(L).identity());
   }
 
   WEAK_REF_TEST(!r);
@@ -562,6 +1399,7 @@ UNIT_TEST(lua_state_ref_validity) {
     WEAK_REF_TEST(!r);
     WEAK_REF_TEST(!s);
     WEAK_REF_TEST(!t);
+    WEAK_REF_TEST(!primer::obtain_state_ref(L));
   }
 
   WEAK_REF_TEST(!r);
@@ -591,6 +1429,37 @@ UNIT_TEST(lua_state_ref_validity) {
   WEAK_REF_TEST(!t);
 }
 
+UNIT_TEST(lua_state_ref_two_states) {
+  using primer::lua_state_ref;
+
+  lua_raii L1;
+  lua_raii L2;
+  lua_State * l1 = L1;
+  lua_State * l2 = L2;
+
+  // Alternate between states, and obtain refs from a thread too
+  for (int i = 0; i < 3; ++i) {
+    lua_state_ref r1 = primer::obtain_state_ref(L1);
+    lua_state_ref r2 = primer::obtain_state_ref(L2);
+    TEST_EQ(l1, r1.lock());
+    TEST_EQ(l2, r2.lock());
+
+    lua_State * T = lua_newthread(L1);
+    lua_state_ref rt = primer::obtain_state_ref(T);
+    TEST_EQ(l1, rt.lock());
+    lua_pop(L1, 1);
+  }
+
+  CHECK_STACK(L1, 0);
+  CHECK_STACK(L2, 0);
+
+  primer::close_state_refs(L1);
+  lua_state_ref r1 = primer::obtain_state_ref(L1);
+  lua_state_ref r2 = primer::obtain_state_ref(L2);
+  WEAK_REF_TEST(!r1);
+  TEST_EQ(l2, r2.lock());
+}
+
 UNIT_TEST(lua_ref) {
   lua_raii L;
 
@@ -693,6 +1562,279 @@ UNIT_TEST(lua_ref) {
   TEST(!baz, "Expected all refs to be closed now!");
 }
 
+UNIT_TEST(lua_ref_pool) {
+  lua_raii L;
+
+  primer::lua_ref_pool pool{L};
+  TEST(pool, "expected pool to be engaged");
+  CHECK_STACK(L, 0);
+
+  // More refs than the initial pool size, and churn
+  std::vector<primer::lua_ref> refs;
+  for (int i = 0; i < 200; ++i) {
+    lua_pushinteger(L, i);
+    refs.emplace_back(pool, L);
+  }
+  CHECK_STACK(L, 0);
+
+  for (int i = 0; i < 200; i += 2) {
+    refs[i].reset();
+  }
+  for (int i = 0; i < 200; i += 2) {
+    lua_pushinteger(L, 1000 + i);
+    refs[i] = primer::lua_ref{pool, L};
+  }
+  CHECK_STACK(L, 0);
+
+  for (int i = 0; i < 200; ++i) {
+    auto maybe = refs[i].as<int>();
+    TEST_EXPECTED(maybe);
+    TEST_EQ(*maybe, (i % 2) ? i : 1000 + i);
+  }
+
+  // Copies share the pool, and outlive the original
+  primer::lua_ref copy;
+  {
+    lua_pushstring(L, "asdf");
+    primer::lua_ref orig{pool, L};
+    copy = orig;
+  }
+  TEST(copy.push(), "expected push to succeed");
+  test_top_type(L, LUA_TSTRING, __LINE__);
+  TEST_EQ(std::string{"asdf"}, lua_tostring(L, -1));
+  lua_pop(L, 1);
+
+  // The same pool is obtained again
+  primer::lua_ref_pool pool2{L};
+  lua_pushboolean(L, true);
+  primer::lua_ref b{pool2, L};
+  TEST(b.as<bool>() && *b.as<bool>(), "expected true");
+  CHECK_STACK(L, 0);
+
+  primer::close_state_refs(L);
+  TEST(!pool, "expected pool to be closed");
+  TEST(!copy, "expected ref to be closed");
+  TEST(!refs[0], "expected ref to be closed");
+}
+
+UNIT_TEST(ref_scope) {
+  lua_raii L;
+  lua_raii L2;
+
+  auto as_int = [](const primer::lua_ref & r) {
+    auto maybe = r.as<int>();
+    return maybe ? *maybe : -1;
+  };
+
+  std::vector<primer::lua_ref> refs;
+  primer::lua_ref kept;
+  primer::lua_ref other;
+  primer::bound_function handler;
+  const auto slots = lua_rawlen(L, LUA_REGISTRYINDEX);
+  {
+    primer::ref_scope scope{L};
+    for (int i = 0; i < 100; ++i) {
+      lua_pushinteger(L, i);
+      refs.emplace_back(L);
+    }
+    TEST_EQ(scope.size(), 100u);
+    // Only the table of the scope is in the registry
+    TEST(lua_rawlen(L, LUA_REGISTRYINDEX) <= slots + 1, "expected no slots");
+    TEST_EQ(as_int(refs[7]), 7);
+
+    // Copies are made in the scope, and destroying them does nothing
+    {
+      primer::lua_ref copy = refs[3];
+      TEST_EQ(as_int(copy), 3);
+      TEST_EQ(scope.size(), 101u);
+    }
+    refs[5].reset();
+    TEST_EQ(as_int(refs[6]), 6);
+
+    kept = refs[9];
+    kept.promote();
+    TEST_EQ(as_int(kept), 9);
+
+    lua_pushcfunction(L, [](lua_State * L) -> int {
+      lua_pushinteger(L, 42);
+      return 1;
+    });
+    handler = primer::bound_function{L};
+    handler.promote();
+
+    // Refs of another state don't go to the scope
+    lua_pushinteger(L2, 12);
+    other = primer::lua_ref{L2};
+
+    // A nested scope takes the refs, and ends first
+    primer::lua_ref inner;
+    const std::size_t outer = scope.size();
+    {
+      primer::ref_scope nested{L};
+      lua_pushinteger(L, 77);
+      inner = primer::lua_ref{L};
+      TEST_EQ(nested.size(), 1u);
+      TEST_EQ(scope.size(), outer);
+    }
+    TEST(!inner, "expected the ref of the nested scope to be empty");
+    TEST_EQ(as_int(refs[8]), 8);
+
+    // Releasing ends the refs, and the scope stays
+    lua_pushinteger(L, 5);
+    primer::lua_ref early{L};
+    std::vector<primer::lua_ref> more(1, early);
+    scope.release();
+    TEST(!early && !more[0], "expected released refs to be empty");
+    TEST(!refs[0], "expected released refs to be empty");
+    TEST_EQ(scope.size(), 0u);
+    lua_pushinteger(L, 6);
+    refs.back() = primer::lua_ref{L};
+    TEST_EQ(scope.size(), 1u);
+    TEST_EQ(as_int(refs.back()), 6);
+    CHECK_STACK(L, 0);
+  }
+  TEST(!refs.back(), "expected the refs of the scope to be empty");
+  TEST_EQ(as_int(kept), 9);
+  TEST_EQ(as_int(other), 12);
+  auto r = handler.call_one_ret();
+  TEST_EXPECTED(r);
+  TEST_EQ(as_int(*r), 42);
+
+  // The pool is reused, and refs of its earlier scopes stay empty
+  {
+    primer::ref_scope scope{L};
+    lua_pushinteger(L, 1);
+    primer::lua_ref fresh{L};
+    TEST_EQ(as_int(fresh), 1);
+    TEST(!refs[0] && !refs.back(), "expected old refs to be empty");
+  }
+  refs.clear();
+
+  // Outside of scopes, refs are in the registry again
+  lua_pushinteger(L, 3);
+  primer::lua_ref plain{L};
+  {
+    primer::ref_scope scope{L};
+  }
+  TEST_EQ(as_int(plain), 3);
+  CHECK_STACK(L, 0);
+  CHECK_STACK(L2, 0);
+}
+
+UNIT_TEST(lua_ref_identity) {
+  lua_raii L;
+
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  primer::lua_ref t1{L};
+  primer::lua_ref t2{L};
+  lua_newtable(L);
+  primer::lua_ref t3{L};
+  TEST(t1 == t2, "expected the same table to be equal");
+  TEST(t1 != t3, "expected different tables to differ");
+  TEST_EQ(std::hash<primer::lua_ref>{}(t1), std::hash<primer::lua_ref>{}(t2));
+
+  // Values compare like lua_rawequal, strings by content if they are short
+  lua_pushinteger(L, 3);
+  primer::lua_ref i3{L};
+  lua_pushnumber(L, 3.0);
+  primer::lua_ref f3{L};
+  lua_pushnumber(L, 3.5);
+  primer::lua_ref f35{L};
+  lua_pushstring(L, "foo");
+  primer::lua_ref s1{L};
+  lua_pushstring(L, "foo");
+  primer::lua_ref s2{L};
+  TEST(i3 == f3, "expected 3 == 3.0");
+  TEST(i3 != f35, "expected 3 ~= 3.5");
+  TEST(s1 == s2, "expected short strings to be equal");
+  TEST(primer::lua_ref{} == primer::lua_ref{}, "expected empty refs equal");
+  TEST(primer::lua_ref{} != i3, "expected empty ref to differ");
+
+  std::unordered_set<primer::lua_ref> set{t1, t2, t3, i3, f3, f35, s1, s2};
+  TEST_EQ(set.size(), 5u);
+  TEST_EQ(set.count(t2), 1u);
+  std::set<primer::lua_ref> ordered{t1, t2, t3, i3, f3, f35, s1, s2};
+  TEST_EQ(ordered.size(), 5u);
+
+  // Copies and moves keep the identity, and so does closing the state
+  primer::lua_ref copy{t1};
+  TEST(copy == t1, "expected copy to be equal");
+  primer::lua_ref moved{std::move(copy)};
+  TEST(moved == t1, "expected moved ref to be equal");
+  TEST(copy == primer::lua_ref{}, "expected moved-from ref to be empty");
+  CHECK_STACK(L, 0);
+
+  // Refs from different VMs differ, even to equal values
+  {
+    lua_raii L2;
+    lua_pushinteger(L2, 3);
+    primer::lua_ref other_i3{L2};
+    TEST(other_i3 != i3, "expected refs from another VM to differ");
+    TEST((other_i3 < i3) != (i3 < other_i3), "expected refs to be ordered");
+    TEST_EQ(set.count(other_i3), 0u);
+  }
+
+  // NaN is not equal to itself, as for lua_rawequal
+  lua_pushnumber(L, std::nan(""));
+  primer::lua_ref nan{L};
+  primer::lua_ref nan_copy{nan};
+  TEST(nan != nan_copy, "expected NaN refs to differ");
+  TEST(!(nan < nan_copy) && !(nan_copy < nan), "expected NaNs ordered");
+  CHECK_STACK(L, 0);
+
+  primer::close_state_refs(L);
+  TEST(!t1, "expected ref to be closed");
+  TEST_EQ(set.count(t1), 1u);
+}
+
+UNIT_TEST(lua_ref_seq_inline) {
+  lua_raii L;
+
+  for (int i = 0; i < 3; ++i) {
+    lua_pushinteger(L, i);
+  }
+  primer::lua_ref_seq seq = primer::pop_stack(L);
+  CHECK_STACK(L, 0);
+  TEST_EQ(seq.size(), 3u);
+  TEST_EQ(seq.capacity(), 4u);
+
+  // Grows onto the heap, keeping the order
+  for (int i = 3; i < 10; ++i) {
+    lua_pushinteger(L, i);
+    seq.emplace_back(L);
+  }
+  lua_pushinteger(L, -1);
+  seq.emplace(seq.begin(), L);
+  TEST_EQ(seq.size(), 11u);
+  for (int i = 0; i < 11; ++i) {
+    auto maybe = seq[i].as<int>();
+    TEST_EXPECTED(maybe);
+    TEST_EQ(*maybe, i - 1);
+  }
+
+  // Copies and moves, both inline and on the heap
+  primer::lua_ref_seq copy{seq};
+  TEST_EQ(copy.size(), 11u);
+  primer::lua_ref_seq moved{std::move(copy)};
+  TEST_EQ(moved.size(), 11u);
+  TEST(moved.push_each(L), "expected every push to succeed");
+  CHECK_STACK(L, 11);
+  TEST_EQ(9, lua_tointeger(L, -1));
+  lua_settop(L, 0);
+
+  moved.resize(2);
+  primer::lua_ref_seq small{std::move(moved)};
+  TEST_EQ(small.size(), 2u);
+  TEST_EQ(*small.back().as<int>(), 0);
+  small.insert(small.begin() + 1, seq.begin() + 5, seq.begin() + 7);
+  TEST_EQ(small.size(), 4u);
+  TEST_EQ(*small[1].as<int>(), 4);
+  TEST_EQ(*small[2].as<int>(), 5);
+  TEST_EQ(*small[3].as<int>(), 0);
+  CHECK_STACK(L, 0);
+}
+
 UNIT_TEST(lua_ref_examples) {
   //[ primer_example_ref
   lua_State * L = luaL_newstate();
@@ -786,22 +1928,492 @@ UNIT_TEST(primer_call) {
   }
 
   {
-    lua_pushcfunction(L, f4);
-    lua_pushinteger(L, 19);
-    lua_pushinteger(L, -5);
+    lua_pushcfunction(L, f4);
+    lua_pushinteger(L, 19);
+    lua_pushinteger(L, -5);
+
+    auto result = primer::fcn_call_one_ret(L, 2);
+
+    CHECK_STACK(L, 0);
+    TEST_EXPECTED(result);
+
+    auto as_int = result->as<int>();
+    CHECK_STACK(L, 0);
+
+    TEST_EXPECTED(as_int);
+    TEST_EQ(14, *as_int);
+  }
+  CHECK_STACK(L, 0);
+}
+
+UNIT_TEST(bound_function_call_as) {
+  lua_raii L;
+
+  TEST_LUA_OK(L, luaL_loadstring(L, "return function(x, y) return x / y, x "
+                                    "* y, 'done' end"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  primer::bound_function f{L};
+  CHECK_STACK(L, 0);
+
+  {
+    auto result = f.call_as<double>(3, 2);
+    CHECK_STACK(L, 0);
+    TEST_EXPECTED(result);
+    TEST_EQ(*result, 1.5);
+  }
+
+  {
+    auto result = f.call_as<std::tuple<double, int, std::string>>(3, 2);
+    CHECK_STACK(L, 0);
+    TEST_EXPECTED(result);
+    TEST_EQ(std::get<0>(*result), 1.5);
+    TEST_EQ(std::get<1>(*result), 6);
+    TEST_EQ(std::get<2>(*result), "done");
+  }
+
+  {
+    // The second result is not an integer
+    auto result = f.call_as<std::tuple<double, int>>(3, 2.5);
+    CHECK_STACK(L, 0);
+    TEST(!result, "expected failure");
+    TEST(result.err().str().find("return value #2")
+           != std::string::npos,
+         "expected the error to name the result: " << result.err().str());
+  }
+
+  {
+    // Missing results are read as nil
+    auto result =
+      f.call_as<std::tuple<double, int, std::string, primer::truthy>>(1, 1);
+    CHECK_STACK(L, 0);
+    TEST_EXPECTED(result);
+    TEST(!std::get<3>(*result).value, "expected nil to be falsy");
+  }
+
+  {
+    // Errors in the call itself
+    auto result = f.call_as<double>(3, "asdf");
+    CHECK_STACK(L, 0);
+    TEST(!result, "expected failure");
+  }
+}
+
+UNIT_TEST(lean_error_handler) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  TEST_LUA_OK(L, luaL_loadstring(L, "return function()\n"
+                                    "  local x = nil\n"
+                                    "  return x.y\n"
+                                    "end"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  primer::bound_function f{L};
+
+  {
+    auto result = f.call_no_ret();
+    TEST(!result, "expected failure");
+    TEST(result.err().str().find("stack traceback") != std::string::npos,
+         "expected a traceback: " << result.err().str());
+  }
+
+  primer::use_lean_error_handler(L);
+  primer::get_error_handler(L);
+  TEST_EQ(lua_tocfunction(L, -1), &primer::lean_error_handler);
+  lua_pop(L, 1);
+
+  {
+    auto result = f.call_no_ret();
+    TEST(!result, "expected failure");
+    const std::string msg = result.err().str();
+    TEST(msg.find("stack traceback") == std::string::npos,
+         "expected no traceback: " << msg);
+    const std::string where = "at [string \"return function()...\"]:3";
+    TEST(msg.find(where) != std::string::npos,
+         "expected the faulting line: " << msg);
+  }
+
+  // Restore the default
+  lua_pushnil(L);
+  primer::set_error_handler(L);
+  {
+    auto result = f.call_no_ret();
+    TEST(!result, "expected failure");
+    TEST(result.err().str().find("stack traceback") != std::string::npos,
+         "expected a traceback: " << result.err().str());
+  }
+  CHECK_STACK(L, 0);
+}
+
+UNIT_TEST(bound_function_call_each) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  TEST_LUA_OK(L, luaL_loadstring(L, "return function(x) if x < 0 then "
+                                    "error('negative') end; return x * 2 "
+                                    "end"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  primer::bound_function f{L};
+  CHECK_STACK(L, 0);
+
+  const std::vector<int> inputs{1, 2, -1, 4};
+  std::vector<int> outputs;
+  std::vector<std::string> errors;
+
+  auto ok = f.call_each<int>(inputs, [&](primer::expected<int> r) {
+    if (r) {
+      outputs.push_back(*r);
+    } else {
+      errors.push_back(r.err().str());
+    }
+  });
+  CHECK_STACK(L, 0);
+  TEST_EXPECTED(ok);
+  TEST_EQ(outputs.size(), 3u);
+  TEST_EQ(outputs[0], 2);
+  TEST_EQ(outputs[1], 4);
+  TEST_EQ(outputs[2], 8);
+  TEST_EQ(errors.size(), 1u);
+  TEST(errors[0].find("negative") != std::string::npos,
+       "unexpected error message: " << errors[0]);
+
+  int count = 0;
+  ok = f.call_each(inputs, [&](primer::expected<void> r) {
+    if (r) { ++count; }
+  });
+  CHECK_STACK(L, 0);
+  TEST_EXPECTED(ok);
+  TEST_EQ(count, 3);
+
+  ok = primer::bound_function{}.call_each(inputs, [](primer::expected<void>) {});
+  TEST(!ok, "expected failure");
+}
+
+UNIT_TEST(listener_group) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  luaL_requiref(L, LUA_TABLIBNAME, luaopen_table, 1);
+  lua_pop(L, 2);
+
+  primer::listener_group group{L};
+  TEST(group.empty(), "expected an empty group");
+
+  // Each listener records its argument in a log table, and one fails
+  TEST_LUA_OK(L, luaL_dostring(L, "log = {}"));
+  const char * const sources[] = {
+    "return function(t, x) log[#log + 1] = 'a' .. x; t.n = t.n + 1 end",
+    "return function(t, x) error('b failed') end",
+    "return function(t, x) log[#log + 1] = 'c' .. x; t.n = t.n + 1; "
+    "return t.n end",
+  };
+  std::vector<primer::listener_group::listener_id> ids;
+  for (const char * src : sources) {
+    TEST_LUA_OK(L, luaL_loadstring(L, src));
+    TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+    primer::bound_function f{L};
+    auto id = group.add(f);
+    TEST_EXPECTED(id);
+    ids.push_back(*id);
+  }
+  CHECK_STACK(L, 0);
+  TEST_EQ(group.size(), 3u);
+
+  // The listeners share the table argument
+  TEST_LUA_OK(L, luaL_dostring(L, "return {n = 0}"));
+  primer::lua_ref t{L};
+  auto errors = group.broadcast(t, 1);
+  CHECK_STACK(L, 0);
+  TEST_EXPECTED(errors);
+  TEST_EQ(errors->size(), 1u);
+  TEST_EQ((*errors)[0].first, ids[1]);
+  TEST((*errors)[0].second.str().find("b failed") != std::string::npos,
+       "unexpected error message: " << (*errors)[0].second.str());
+  t.push(L);
+  lua_getfield(L, -1, "n");
+  TEST_EQ(lua_tointeger(L, -1), 2);
+  lua_pop(L, 2);
+
+  std::vector<std::pair<primer::listener_group::listener_id, int>> results;
+  auto ok = group.call_each<int>(
+    [&](primer::listener_group::listener_id id, primer::expected<int> r) {
+      if (r) { results.emplace_back(id, *r); }
+    },
+    t, 2);
+  CHECK_STACK(L, 0);
+  TEST_EXPECTED(ok);
+  // The first listener returns nothing, which isn't an int
+  TEST_EQ(results.size(), 1u);
+  TEST_EQ(results[0].first, ids[2]);
+  TEST_EQ(results[0].second, 4);
+
+  // A removed listener is not called, and its id is reused
+  group.remove(ids[1]);
+  group.remove(ids[1]);
+  TEST_EQ(group.size(), 2u);
+  errors = group.broadcast(t, 3);
+  TEST_EXPECTED(errors);
+  TEST_EQ(errors->size(), 0u);
+
+  TEST_LUA_OK(L, luaL_loadstring(L, "return function() end"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  auto again = group.add(primer::bound_function{L});
+  TEST_EXPECTED(again);
+  TEST_EQ(*again, ids[1]);
+
+  TEST_LUA_OK(L, luaL_dostring(L, "return table.concat(log, ' ')"));
+  TEST_EQ(lua_tostring(L, -1), std::string{"a1 c1 a2 c2 a3 c3"});
+  lua_pop(L, 1);
+
+  TEST(!group.add(primer::bound_function{}), "expected failure");
+  primer::listener_group empty;
+  TEST(!empty.broadcast(1), "expected failure");
+}
+
+UNIT_TEST(tracked_table) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  TEST_LUA_OK(L, luaL_dostring(L, "return {a = 1, b = 2, 'x'}"));
+  primer::tracked_table t{L, -1};
+  lua_pop(L, 1);
+  t.push(L);
+  lua_setglobal(L, "t");
+  TEST_EQ(t.changes(), 0u);
+
+  // Reads see the contents, and each assigned key is listed once
+  const char * const script =
+    ""
+    "assert(t.a == 1 and t[1] == 'x' and #t == 1)                      \n"
+    "local n = 0                                                       \n"
+    "for k, v in pairs(t) do n = n + 1 end                             \n"
+    "assert(n == 3)                                                    \n"
+    "t.b = 3                                                           \n"
+    "t.c = 4                                                           \n"
+    "t.b = 5                                                           \n"
+    "assert(t.b == 5 and rawget(t, 'b') == nil)                        \n";
+  TEST_LUA_OK(L, luaL_dostring(L, script));
+  TEST_EQ(t.changes(), 2u);
+
+  std::vector<std::pair<std::string, int>> seen;
+  auto ok = t.sync([&seen](lua_State * L) -> primer::expected<void> {
+    seen.emplace_back(lua_tostring(L, -2),
+                      static_cast<int>(lua_tointeger(L, -1)));
+    return {};
+  });
+  CHECK_STACK(L, 0);
+  TEST_EXPECTED(ok);
+  TEST_EQ(seen.size(), 2u);
+  TEST_EQ(seen[0].first, "b");
+  TEST_EQ(seen[0].second, 5);
+  TEST_EQ(seen[1].first, "c");
+  TEST_EQ(t.changes(), 0u);
+
+  // A key which was seen before gets the same number, and an error keeps the
+  // rest of the changes
+  TEST_LUA_OK(L, luaL_dostring(L, "t.c = 6; t.a = nil"));
+  TEST_EQ(t.changes(), 2u);
+  ok = t.sync(
+    [](lua_State *) -> primer::expected<void> { return primer::error{"no"}; });
+  TEST(!ok, "expected an error");
+  TEST_EQ(t.changes(), 2u);
+  t.discard_changes();
+  TEST_EQ(t.changes(), 0u);
+
+  t.push_contents(L);
+  lua_getfield(L, -1, "a");
+  TEST(lua_isnil(L, -1), "expected the field to be removed");
+  lua_getfield(L, -2, "c");
+  TEST_EQ(lua_tointeger(L, -1), 6);
+  lua_pop(L, 3);
+  CHECK_STACK(L, 0);
+}
+
+UNIT_TEST(event_channel) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  const char * const src =
+    ""
+    "calls = 0                                                          \n"
+    "return function(events, n)                                         \n"
+    "  calls = calls + 1                                                \n"
+    "  assert(#events == n)                                             \n"
+    "  sum = 0                                                          \n"
+    "  for i = 1, n do sum = sum * 10 + events[i] end                   \n"
+    "  if n == 1 then error('one event') end                            \n"
+    "end                                                                \n";
+  TEST_LUA_OK(L, luaL_loadstring(L, src));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  primer::event_channel<int> ch{primer::bound_function{L}, 3};
+  TEST_EQ(ch.capacity(), 3u);
+  TEST_EXPECTED(ch.deliver());
+
+  // The events wrap around the end of the buffer, and one call gets them
+  // all, in order
+  TEST(ch.post(1), "expected the event to fit");
+  TEST(ch.post(2), "expected the event to fit");
+  TEST_EXPECTED(ch.deliver());
+  TEST(ch.empty(), "expected the events to be delivered");
+  TEST(ch.post(3), "expected the event to fit");
+  TEST(ch.post(4), "expected the event to fit");
+  TEST(ch.post(5), "expected the event to fit");
+  TEST(!ch.post(6), "expected the buffer to be full");
+  TEST_EQ(ch.dropped(), 1u);
+  TEST_EXPECTED(ch.deliver());
+  CHECK_STACK(L, 0);
+
+  lua_getglobal(L, "sum");
+  TEST_EQ(lua_tointeger(L, -1), 345);
+  lua_getglobal(L, "calls");
+  TEST_EQ(lua_tointeger(L, -1), 2);
+  lua_pop(L, 2);
+
+  // An error in the handler is returned, and the events are gone
+  TEST(ch.post(7), "expected the event to fit");
+  auto ok = ch.deliver();
+  TEST(!ok, "expected an error");
+  TEST(ok.err().str().find("one event") != std::string::npos,
+       "unexpected error message: " << ok.err().str());
+  TEST(ch.empty(), "expected the events to be delivered");
+  CHECK_STACK(L, 0);
+
+  primer::event_channel<double> unbound{primer::bound_function{}, 1};
+  TEST(unbound.post(1.5), "expected the event to fit");
+  TEST(!unbound.deliver(), "expected failure");
+  TEST_EQ(unbound.size(), 1u);
+}
+
+UNIT_TEST(call_site) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  TEST_LUA_OK(L, luaL_loadstring(L, "local n = 0; return function(x) n = n + "
+                                    "x; if n > 10 then error('big') end; "
+                                    "return n, 'ok' end"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  primer::bound_function f{L};
+  CHECK_STACK(L, 0);
+
+  {
+    primer::call_site site{f};
+    TEST(site, "expected a live call site");
+
+    for (int i = 1; i <= 3; ++i) {
+      auto result = site.call_as<int>(1);
+      TEST_EXPECTED(result);
+      TEST_EQ(*result, i);
+    }
+
+    auto one = site.call_one_ret(2);
+    TEST_EXPECTED(one);
+    auto n = one->as<int>();
+    TEST_EXPECTED(n);
+    TEST_EQ(*n, 5);
+
+    auto seq = site.call(2);
+    TEST_EXPECTED(seq);
+    TEST_EQ(seq->size(), 2u);
+
+    TEST_EXPECTED(site.call_no_ret(1));
+
+    // An error in the function doesn't disturb the pinned slots
+    auto bad = site.call_no_ret(10);
+    TEST(!bad, "expected failure");
+    TEST(bad.err().str().find("big") != std::string::npos,
+         "unexpected error message: " << bad.err().str());
+
+    auto bad_arg = site.call_as<int>("asdf");
+    TEST(!bad_arg, "expected failure");
+
+    // Still usable afterwards
+    auto again = site.call_as<std::tuple<int, std::string>>(-100);
+    TEST_EXPECTED(again);
+    TEST_EQ(std::get<1>(*again), "ok");
+  }
+  CHECK_STACK(L, 0);
+
+  {
+    primer::call_site site{primer::bound_function{}};
+    TEST(!site, "expected an empty call site");
+    TEST(!site.call_no_ret(), "expected failure");
+  }
+  CHECK_STACK(L, 0);
+}
 
-    auto result = primer::fcn_call_one_ret(L, 2);
+UNIT_TEST(global_function_cache) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
 
-    CHECK_STACK(L, 0);
-    TEST_EXPECTED(result);
+  TEST_LUA_OK(L, luaL_loadstring(L, "n = 0                                   \n"
+                                    "function on_update(x)                   \n"
+                                    "  n = n + x; return n                   \n"
+                                    "end                                     \n"
+                                    "not_a_function = 5                      \n"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 0));
+
+  primer::global_function_cache cache{L};
+  const int on_update = cache.add("on_update");
+  const int on_event = cache.add("on_event");
+  const int other = cache.add("not_a_function");
+  CHECK_STACK(L, 0);
+  TEST_EQ(on_update, 1);
+  TEST_EQ(on_event, 2);
+  TEST_EQ(cache.add("on_update"), on_update);
+  TEST(cache.has(on_update), "expected a function");
+  TEST(!cache.has(on_event), "expected no function");
+  TEST(!cache.has(other), "expected no function");
+
+  for (int i = 1; i <= 3; ++i) {
+    auto r = cache.call_as<int>(on_update, 2);
+    TEST_EXPECTED(r);
+    TEST_EQ(*r, 2 * i);
+  }
+  TEST(!cache.call_no_ret(on_event), "expected failure");
+  CHECK_STACK(L, 0);
 
-    auto as_int = result->as<int>();
-    CHECK_STACK(L, 0);
+  // Reassigning is seen by rebind
+  TEST_LUA_OK(L, luaL_loadstring(L, "function on_update(x) return -x end"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 0));
+  TEST_EQ(*cache.call_as<int>(on_update, 2), 8);
+  TEST_EXPECTED(cache.rebind());
+  TEST_EQ(*cache.call_as<int>(on_update, 2), -2);
+
+  // Defining a name is seen by the watch, which keeps an existing __newindex
+  TEST_LUA_OK(L, luaL_loadstring(L, "defined = {}                            \n"
+                                    "setmetatable(_G, { __newindex =         \n"
+                                    "  function(t, k, v)                     \n"
+                                    "    defined[#defined + 1] = k           \n"
+                                    "    rawset(t, k, v)                     \n"
+                                    "  end })                                \n"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 0));
+  TEST_EXPECTED(cache.watch());
+  TEST_LUA_OK(L, luaL_loadstring(L, "function on_event(e) return e .. '!' end\n"
+                                    "assert(defined[1] == 'on_event')        \n"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 0));
+  TEST(cache.has(on_event), "expected a function");
+  auto seq = cache.call(on_event, "hi");
+  TEST_EXPECTED(seq);
+  TEST_EQ(seq->size(), 1u);
+  auto s = (*seq)[0].as<std::string>();
+  TEST_EXPECTED(s);
+  TEST_EQ(*s, "hi!");
 
-    TEST_EXPECTED(as_int);
-    TEST_EQ(14, *as_int);
+  {
+    primer::call_site site{cache.function(on_update)};
+    TEST(site, "expected a live call site");
+    TEST_EQ(*site.call_as<int>(3), -3);
   }
   CHECK_STACK(L, 0);
+
+  primer::global_function_cache empty;
+  TEST(!empty, "expected an empty cache");
+  TEST_EQ(empty.add("on_update"), 0);
+  TEST(!empty.call_no_ret(1), "expected failure");
 }
 
 UNIT_TEST(primer_resume) {
@@ -1152,6 +2764,419 @@ returner(lua_State * L) {
   return 1;
 }
 
+UNIT_TEST(packed_ref_seq) {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+  luaopen_coroutine(L);
+  lua_getfield(L, -1, "yield");
+  lua_setglobal(L, "yield");
+  lua_pop(L, 1);
+
+  // Nils in the middle and at the end are preserved
+  lua_pushinteger(L, 1);
+  lua_pushnil(L);
+  lua_pushstring(L, "a");
+  lua_pushnil(L);
+  primer::packed_ref_seq p = primer::pop_n_packed(L, 4);
+  CHECK_STACK(L, 0);
+  TEST_EQ(p.size(), 4);
+
+  TEST(p.push_each(L), "expected push to succeed");
+  CHECK_STACK(L, 4);
+  TEST_EQ(lua_tointeger(L, 1), 1);
+  TEST(lua_isnil(L, 2), "expected nil");
+  TEST_EQ(std::string{"a"}, lua_tostring(L, 3));
+  TEST(lua_isnil(L, 4), "expected nil");
+  lua_settop(L, 0);
+
+  TEST_LUA_OK(L, luaL_loadstring(L, "return function(x) return x, x + 1, x + "
+                                    "2 end"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  primer::bound_function f{L};
+
+  auto result = f.call_packed(5);
+  CHECK_STACK(L, 0);
+  TEST_EXPECTED(result);
+  TEST_EQ(result->size(), 3);
+  result->push_each(L);
+  CHECK_STACK(L, 3);
+  TEST_EQ(lua_tointeger(L, 1), 5);
+  TEST_EQ(lua_tointeger(L, 3), 7);
+  lua_settop(L, 0);
+
+  TEST_LUA_OK(L, luaL_loadstring(L, "return function(x) while true do x = "
+                                    "yield(x, -x) end end"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  primer::bound_function g{L};
+  primer::coroutine c{g};
+
+  auto yielded = c.call_packed(3);
+  CHECK_STACK(L, 0);
+  TEST_EXPECTED(yielded);
+  TEST_EQ(yielded->size(), 2);
+  yielded->push_each(L);
+  TEST_EQ(lua_tointeger(L, 2), -3);
+  lua_settop(L, 0);
+
+  // Empty
+  primer::packed_ref_seq e = primer::pop_n_packed(L, 0);
+  TEST(e.empty(), "expected empty");
+  TEST(e.push_each(L), "expected push to succeed");
+  CHECK_STACK(L, 0);
+}
+
+UNIT_TEST(coroutine_pool) {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+  luaL_requiref(L, "coroutine", luaopen_coroutine, 1);
+  lua_pop(L, 1);
+
+  TEST_LUA_OK(L, luaL_loadstring(L, "return function(x) "
+                                    "  if x < 0 then error('negative') end "
+                                    "  local y = coroutine.yield(x + 1) "
+                                    "  return x + y "
+                                    "end"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  primer::bound_function f{L};
+  CHECK_STACK(L, 0);
+
+  primer::coroutine_pool pool{L};
+  TEST(pool, "expected a valid pool");
+  TEST_EQ(pool.size(), 0u);
+
+  for (int i = 0; i < 3; ++i) {
+    primer::coroutine c{pool, f};
+    TEST(c, "expected a valid coroutine");
+    TEST_EQ(pool.size(), 0u);
+
+    auto r1 = c.call_one_ret(i);
+    TEST_EXPECTED(r1);
+    TEST_EQ(*r1->as<int>(), i + 1);
+    TEST(c, "expected the coroutine to be suspended");
+
+    auto r2 = c.call_one_ret(10);
+    TEST_EXPECTED(r2);
+    TEST_EQ(*r2->as<int>(), i + 10);
+    TEST(!c, "expected the coroutine to be finished");
+    TEST_EQ(pool.size(), 1u);
+    CHECK_STACK(L, 0);
+  }
+
+  {
+    // A coroutine which raises an error is not recycled
+    primer::coroutine c{pool, f};
+    TEST_EQ(pool.size(), 0u);
+    auto r = c.call_no_ret(-1);
+    TEST(!r, "expected failure");
+    TEST(!c, "expected the coroutine to be finished");
+    TEST_EQ(pool.size(), 0u);
+  }
+
+  {
+    // Nor is one which is dropped while suspended
+    primer::coroutine c{pool, f};
+    TEST_EXPECTED(c.call_no_ret(1));
+    TEST(c, "expected the coroutine to be suspended");
+  }
+  TEST_EQ(pool.size(), 0u);
+  CHECK_STACK(L, 0);
+}
+
+UNIT_TEST(scheduler) {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+  luaL_requiref(L, "coroutine", luaopen_coroutine, 1);
+  lua_pop(L, 1);
+
+  TEST_LUA_OK(L, luaL_loadstring(L, "log = {} "
+                                    "local function push(x) "
+                                    "  log[#log + 1] = x "
+                                    "end "
+                                    "return function() "
+                                    "  push('a1'); coroutine.yield(); "
+                                    "  push('a2'); coroutine.yield(3); "
+                                    "  push('a3') "
+                                    "end, function() "
+                                    "  push('b1'); coroutine.yield('go'); "
+                                    "  push('b2'); error('oops') "
+                                    "end, function() "
+                                    "  local n = 0 "
+                                    "  while n < 100000 do n = n + 1 end "
+                                    "  push('c') "
+                                    "end"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 3));
+  primer::bound_function c{L};
+  primer::bound_function b{L};
+  primer::bound_function a{L};
+  CHECK_STACK(L, 0);
+
+  auto log = [&]() {
+    std::string result;
+    lua_getglobal(L, "log");
+    for (int i = 1; lua_rawgeti(L, -1, i) == LUA_TSTRING; ++i) {
+      result += lua_tostring(L, -1);
+      result += " ";
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    return result;
+  };
+
+  primer::scheduler s{primer::coroutine_pool{L}};
+  TEST(s.spawn(a), "expected to spawn");
+  TEST(s.spawn(b), "expected to spawn");
+  TEST_EQ(s.size(), 2u);
+
+  TEST_EQ(s.tick(), 2u);
+  TEST_EQ(log(), "a1 b1 ");
+  TEST_EQ(s.tick(), 1u);
+  TEST_EQ(log(), "a1 b1 a2 ");
+
+  // a sleeps for 3 ticks, b waits for the signal
+  TEST_EQ(s.pending(), 1u);
+  TEST_EQ(s.tick(), 0u);
+  TEST_EQ(s.tick(), 0u);
+  s.signal("go");
+  TEST_EQ(s.pending(), 2u);
+  TEST_EQ(s.tick(), 2u);
+  TEST_EQ(log(), "a1 b1 a2 b2 a3 ");
+  TEST_EQ(s.size(), 0u);
+
+  auto errors = s.take_errors();
+  TEST_EQ(errors.size(), 1u);
+  TEST(errors[0].str().find("oops") != std::string::npos,
+       "unexpected error: " << errors[0].str());
+  TEST(s.take_errors().empty(), "expected errors to be taken");
+  CHECK_STACK(L, 0);
+
+  // With a budget, the long task is preempted and continues
+  s.set_budget(1000);
+  TEST(s.spawn(c), "expected to spawn");
+  std::size_t ticks = 0;
+  while (s.size()) {
+    s.tick();
+    ++ticks;
+    TEST(ticks < 10000, "task did not finish");
+  }
+  TEST(ticks > 10, "expected the task to be preempted, ticks = " << ticks);
+  TEST_EQ(log(), "a1 b1 a2 b2 a3 c ");
+  TEST(s.take_errors().empty(), "unexpected errors");
+  CHECK_STACK(L, 0);
+}
+
+namespace {
+
+struct test_hook_counts {
+  int calls = 0;
+  int lines = 0;
+  bool once = false;
+};
+
+void
+test_count_hook(lua_State *, lua_Debug * ar, void * ud) {
+  auto c = static_cast<test_hook_counts *>(ud);
+  if (ar->event == LUA_HOOKLINE) {
+    ++c->lines;
+  } else {
+    ++c->calls;
+  }
+}
+
+} // end anonymous namespace
+
+UNIT_TEST(hook_mux) {
+  using mux = primer::hook_mux;
+  lua_raii L;
+
+  TEST_LUA_OK(L, luaL_loadstring(L, "local n = 0 "
+                                    "for i = 1, 100000 do n = n + i end "
+                                    "return n"));
+  primer::bound_function loop{L};
+  CHECK_STACK(L, 0);
+
+  test_hook_counts fast, slow, lines;
+  auto a = mux::subscribe(L, &test_count_hook, &fast, 0, 100);
+  auto b = mux::subscribe(L, &test_count_hook, &slow, 0, 1000);
+  TEST_EXPECTED(a);
+  TEST_EXPECTED(b);
+
+  // The hook runs at the count of the most demanding subscriber
+  TEST_EQ(lua_gethookmask(L), LUA_MASKCOUNT);
+  TEST_EQ(lua_gethookcount(L), 100);
+
+  TEST_EXPECTED(loop.call_no_ret());
+  TEST(slow.calls > 0, "expected calls");
+  TEST(fast.calls >= 9 * slow.calls && fast.calls <= 11 * slow.calls + 10,
+       "fast = " << fast.calls << ", slow = " << slow.calls);
+
+  // A line subscriber adds the line mask
+  auto c = mux::subscribe(L, &test_count_hook, &lines, LUA_MASKLINE, 0);
+  TEST_EXPECTED(c);
+  TEST_EQ(lua_gethookmask(L), LUA_MASKCOUNT | LUA_MASKLINE);
+  fast.calls = 0;
+  TEST_EXPECTED(loop.call_no_ret());
+  TEST(lines.lines > 0, "expected line events");
+  TEST_EQ(slow.lines, 0);
+
+  // Line events, which come more often than the count, don't restart it
+  TEST(fast.calls > 0, "expected count events between line events");
+
+  mux::unsubscribe(L, *a);
+  TEST_EQ(lua_gethookcount(L), 1000);
+  mux::unsubscribe(L, *c);
+  TEST_EQ(lua_gethookmask(L), LUA_MASKCOUNT);
+
+  // Stopping the count from the callback gives a deadline
+  mux::set_count(L, *b, 5000);
+  slow.calls = 0;
+  struct deadline {
+    static void hook(lua_State * L, lua_Debug *, void * ud) {
+      auto d = static_cast<std::pair<int, mux::subscription> *>(ud);
+      ++d->first;
+      mux::set_count(L, d->second, 0);
+    }
+  };
+  std::pair<int, mux::subscription> d{0, -1};
+  auto e = mux::subscribe(L, &deadline::hook, &d, 0, 50);
+  TEST_EXPECTED(e);
+  d.second = *e;
+  TEST_EXPECTED(loop.call_no_ret());
+  TEST_EQ(d.first, 1);
+  TEST(slow.calls > 0, "expected the other subscriber to go on");
+  mux::unsubscribe(L, *e);
+
+  // No subscribers, no hook
+  mux::unsubscribe(L, *b);
+  TEST(!lua_gethook(L), "expected the hook to be removed");
+
+  // A hook which isn't shared is not replaced
+  lua_Hook other = [](lua_State *, lua_Debug *) {};
+  lua_sethook(L, other, LUA_MASKCOUNT, 10);
+  TEST(!mux::subscribe(L, &test_count_hook, &fast, 0, 100),
+       "expected to refuse");
+  TEST(lua_gethook(L) == other, "expected the other hook");
+  lua_sethook(L, nullptr, 0, 0);
+  CHECK_STACK(L, 0);
+}
+
+namespace {
+
+primer::scheduler * test_sched = nullptr;
+std::vector<primer::scheduler::ticket> test_tickets;
+
+int
+test_await(lua_State * L) {
+  auto t = test_sched->make_ticket();
+  if (lua_toboolean(L, 1)) {
+    // Completes before the task is suspended
+    test_sched->complete(t, "now");
+  } else {
+    test_tickets.push_back(t);
+  }
+  return primer::scheduler::await(L, t);
+}
+
+int
+test_make_ticket(lua_State *) {
+  test_tickets.push_back(test_sched->make_ticket());
+  return 0;
+}
+
+} // end anonymous namespace
+
+UNIT_TEST(scheduler_await) {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+  lua_pushcfunction(L, &test_await);
+  lua_setglobal(L, "fetch");
+
+  TEST_LUA_OK(L, luaL_loadstring(L, "local function run(early) "
+                                    "  local a, b = fetch(early) "
+                                    "  result = tostring(a) .. tostring(b) "
+                                    "end "
+                                    "return function() run(false) end, "
+                                    "  function() run(true) end"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 2));
+  primer::bound_function g{L};
+  primer::bound_function f{L};
+
+  primer::scheduler s;
+  test_sched = &s;
+  test_tickets.clear();
+
+  TEST(s.spawn(f), "expected to spawn");
+  TEST_EQ(s.tick(), 1u);
+  TEST_EQ(test_tickets.size(), 1u);
+
+  // Nothing runs until the ticket is completed
+  TEST_EQ(s.tick(), 0u);
+  TEST_EQ(s.size(), 1u);
+  TEST(s.complete(test_tickets[0], "reply", 7), "expected to complete");
+  TEST_EQ(s.tick(), 1u);
+  TEST_EQ(s.size(), 0u);
+
+  lua_getglobal(L, "result");
+  TEST_EQ(std::string{lua_tostring(L, -1)}, "reply7");
+  lua_pop(L, 1);
+
+  // A C function may also complete the ticket before awaiting it
+  TEST(s.spawn(g), "expected to spawn");
+  s.tick();
+  TEST_EQ(s.tick(), 1u);
+  TEST_EQ(s.size(), 0u);
+
+  lua_getglobal(L, "result");
+  TEST_EQ(std::string{lua_tostring(L, -1)}, "nownil");
+  lua_pop(L, 1);
+
+  // Values for the tickets of a task which ends without awaiting them are
+  // dropped, whether they were completed before it ended or after
+  luaL_requiref(L, "coroutine", luaopen_coroutine, 1);
+  lua_pop(L, 1);
+  lua_pushcfunction(L, &test_make_ticket);
+  lua_setglobal(L, "make_ticket");
+  TEST_LUA_OK(L, luaL_dostring(L, "weak = setmetatable({}, {__mode = 'v'})"));
+  TEST_LUA_OK(L, luaL_loadstring(L, "return function() "
+                                    "  make_ticket() make_ticket() "
+                                    "  coroutine.yield() "
+                                    "end"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  primer::bound_function h{L};
+  test_tickets.clear();
+  TEST(s.spawn(h), "expected to spawn");
+  TEST_EQ(s.tick(), 1u);
+  TEST_EQ(test_tickets.size(), 2u);
+
+  auto complete_with_table = [&](primer::scheduler::ticket t, int i) {
+    lua_getglobal(L, "weak");
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, i);
+    primer::lua_ref value{L};
+    lua_pop(L, 1);
+    TEST(s.complete(t, value), "expected to complete");
+  };
+  complete_with_table(test_tickets[0], 1);
+  TEST_EQ(s.tick(), 1u);
+  TEST_EQ(s.size(), 0u);
+  complete_with_table(test_tickets[1], 2);
+
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  TEST_LUA_OK(L, luaL_dostring(L, "assert(next(weak) == nil)"));
+
+  TEST(s.take_errors().empty(), "unexpected errors");
+  test_sched = nullptr;
+  CHECK_STACK(L, 0);
+}
+
 UNIT_TEST(coroutine_two) {
   lua_raii L;
 
@@ -1187,6 +3212,110 @@ UNIT_TEST(coroutine_two) {
   TEST_EQ(7, *i);
 }
 
+UNIT_TEST(generator_range) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+  luaopen_coroutine(L);
+  lua_getfield(L, -1, "yield");
+  lua_setglobal(L, "yield");
+  lua_pop(L, 1);
+
+  const char * script = "return function()              \n"
+                        "  for i = 1, 5 do yield(i * i) end\n"
+                        "  return 'done'                \n"
+                        "end                            \n";
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  primer::bound_function f{L};
+
+  {
+    primer::coroutine c{f};
+    auto r = c.resume_as<int>();
+    TEST_EXPECTED(r);
+    TEST_EQ(*r, 1);
+    auto r2 = c.resume_as<std::string>();
+    TEST(!r2, "expected an error reading a number as a string");
+  }
+
+  std::vector<int> squares;
+  primer::generator_range<int> g{primer::coroutine{f}};
+  for (int x : g) {
+    squares.push_back(x);
+  }
+  TEST_EXPECTED(g.error());
+  TEST_EQ(squares.size(), 5u);
+  TEST_EQ(squares[4], 25);
+  CHECK_STACK(L, 0);
+
+  // A generator which yields something else, or fails, ends the range
+  const char * script2 = "return function()       \n"
+                         "  yield(1, 2)           \n"
+                         "  yield('x')            \n"
+                         "end                     \n";
+  TEST_LUA_OK(L, luaL_loadstring(L, script2));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  primer::bound_function f2{L};
+  primer::generator_range<std::tuple<int, int>> g2{primer::coroutine{f2}};
+  int count = 0;
+  for (const auto & t : g2) {
+    TEST_EQ(std::get<1>(t), 2);
+    ++count;
+  }
+  TEST_EQ(count, 1);
+  TEST(!g2.error(), "expected a read error");
+
+  TEST_LUA_OK(L, luaL_loadstring(L, "return function() error('bad') end"));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  primer::bound_function f3{L};
+  primer::generator_range<int> g3{primer::coroutine{f3}};
+  TEST(g3.begin() == g3.end(), "expected an empty range");
+  TEST(!g3.error(), "expected the error of the coroutine");
+  CHECK_STACK(L, 0);
+}
+
+static_assert(primer::detail::push_cant_fail<int, double &, const bool &,
+                                             primer::lua_ref>::value,
+              "");
+static_assert(!primer::detail::push_cant_fail<int, std::string>::value, "");
+
+UNIT_TEST(coroutine_unprotected_resume) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+  luaopen_coroutine(L);
+  lua_getfield(L, -1, "yield");
+  lua_setglobal(L, "yield");
+  lua_pop(L, 1);
+
+  const char * script = "return function(x, y, s)        \n"
+                        "  while x > 0 do                \n"
+                        "    x, y, s = yield(s, x + y)   \n"
+                        "  end                           \n"
+                        "  error('stopped at ' .. y)     \n"
+                        "end                             \n";
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  primer::bound_function f{L};
+  primer::coroutine c{f};
+
+  // Numbers are pushed without protection, strings with it
+  TEST_EXPECTED(c.call_no_ret(1, 2.5));
+  auto r = c.call_one_ret(2, 3, std::string{"str"});
+  TEST_EXPECTED(r);
+  TEST_EXPECTED(r->as<int>());
+  TEST_EQ(*r->as<int>(), 5);
+  TEST(c, "expected the coroutine to be suspended");
+
+  // Errors go through the error handler
+  auto e = c.call_no_ret(0, 9);
+  TEST(!e, "expected an error");
+  TEST(e.err().str().find("stopped at 9") != std::string::npos,
+       "unexpected message: " + e.err().str());
+  TEST(!c, "expected the coroutine to be finished");
+  CHECK_STACK(L, 0);
+}
+
 // This test catches a subtle issue regarding whether or not cpp_pcall
 // messes up the stack when it returns.
 UNIT_TEST(cpp_pcall_returns) {
@@ -1218,6 +3347,234 @@ UNIT_TEST(cpp_pcall_returns) {
   TEST_EQ(0, lua_gettop(L));
 }
 
+UNIT_TEST(cpp_pcall_no_allocation) {
+  lua_raii L;
+
+  int count = 0;
+  auto f = [&]() { ++count; };
+  TEST_EXPECTED(primer::cpp_pcall(L, f));
+
+  lua_gc(L, LUA_GCSTOP, 0);
+  auto heap_size = [&]() {
+    return 1024 * lua_gc(L, LUA_GCCOUNT, 0) + lua_gc(L, LUA_GCCOUNTB, 0);
+  };
+  const int before = heap_size();
+  for (int i = 0; i < 1000; ++i) {
+    lua_pushinteger(L, i);
+    TEST_EXPECTED(primer::cpp_pcall<1>(L, [&]() {
+      count += static_cast<int>(lua_tointeger(L, 1));
+      lua_pop(L, 1);
+    }));
+  }
+  const int after = heap_size();
+  lua_gc(L, LUA_GCRESTART, 0);
+
+  CHECK_STACK(L, 0);
+  TEST_EQ(count, 1 + 999 * 500);
+  TEST_EQ(before, after);
+}
+
+/***
+ * Test interned strings
+ */
+
+struct test_event_names {
+  static const std::array<const char *, 3> & names() {
+    static const std::array<const char *, 3> n{{"spawn", "hit", "die"}};
+    return n;
+  }
+};
+
+enum class test_event { spawn, hit, die };
+
+namespace primer {
+namespace traits {
+template <>
+struct push<test_event> : interned_enum<test_event, test_event_names> {};
+template <>
+struct read<test_event> : interned_enum<test_event, test_event_names> {};
+} // end namespace traits
+} // end namespace primer
+
+UNIT_TEST(interned_strings) {
+  using strings = primer::interned_strings<test_event_names>;
+  using handle = primer::interned_string<test_event_names>;
+
+  lua_raii L;
+  TEST_EQ(strings::size(), 3u);
+
+  strings::push(L, 1);
+  CHECK_STACK(L, 1);
+  TEST_EQ(lua_tostring(L, 1), std::string{"hit"});
+  TEST_EQ(strings::find(L, 1), 1u);
+  lua_pop(L, 1);
+
+  lua_pushstring(L, "other");
+  TEST_EQ(strings::find(L, -1), 3u);
+  lua_pushinteger(L, 0);
+  TEST_EQ(strings::find(L, -1), 3u);
+  lua_pop(L, 2);
+
+  primer::push(L, handle{2});
+  TEST_EQ(lua_tostring(L, -1), std::string{"die"});
+  auto h = primer::read<handle>(L, -1);
+  TEST_EXPECTED(h);
+  TEST(*h == handle{2}, "expected the same string");
+  TEST_EQ(h->c_str(), std::string{"die"});
+  lua_pop(L, 1);
+
+  primer::push(L, test_event::spawn);
+  TEST_EQ(lua_tostring(L, -1), std::string{"spawn"});
+  lua_pushstring(L, "hit");
+  auto e = primer::read<test_event>(L, -1);
+  TEST_EXPECTED(e);
+  TEST(*e == test_event::hit, "expected hit");
+  lua_pushstring(L, "jump");
+  TEST(!primer::read<test_event>(L, -1), "expected an error");
+  lua_pop(L, 3);
+  CHECK_STACK(L, 0);
+}
+
+enum class test_color { red, green, blue };
+enum class test_mode { off, on };
+
+namespace primer {
+namespace traits {
+template <>
+struct enum_names<test_color> {
+  static const std::array<const char *, 3> & names() {
+    static const std::array<const char *, 3> n{{"red", "green", "blue"}};
+    return n;
+  }
+};
+
+template <>
+struct enum_names<test_mode> {
+  static const std::array<const char *, 2> & names() {
+    static const std::array<const char *, 2> n{{"off", "on"}};
+    return n;
+  }
+  static constexpr enum_push_policy policy = enum_push_policy::integer;
+};
+} // end namespace traits
+} // end namespace primer
+
+static primer::result
+test_func_paint(lua_State * L, test_color c, test_mode m) {
+  primer::push(L, c);
+  primer::push(L, m);
+  return 2;
+}
+
+UNIT_TEST(enum_names) {
+  lua_raii L;
+
+  primer::push(L, test_color::blue);
+  TEST_EQ(lua_tostring(L, -1), std::string{"blue"});
+  primer::push(L, test_mode::on);
+  TEST(lua_isinteger(L, -1), "expected an integer");
+  TEST_EQ(lua_tointeger(L, -1), 1);
+  lua_pop(L, 2);
+
+  lua_pushstring(L, "green");
+  lua_pushinteger(L, 2);
+  lua_pushinteger(L, 3);
+  lua_pushstring(L, "purple");
+  lua_pushnumber(L, 1.5);
+  TEST(*primer::read<test_color>(L, 1) == test_color::green, "expected green");
+  TEST(*primer::read<test_color>(L, 2) == test_color::blue, "expected blue");
+  TEST(!primer::read<test_color>(L, 3), "expected out of range");
+  TEST(!primer::read<test_color>(L, 4), "expected an unknown name");
+  TEST(!primer::read<test_color>(L, 5), "expected a non-integer error");
+  lua_settop(L, 0);
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+  const char * script = "local paint = ...\n"
+                        "local c, m = paint('red', 'on')\n"
+                        "assert(c == 'red' and m == 1)\n"
+                        "assert(not pcall(paint, 'pink', 0))\n";
+  TEST_EXPECTED(try_load_script(L, script));
+  lua_pushcfunction(L, PRIMER_ADAPT(&test_func_paint));
+  TEST_LUA_OK(L, lua_pcall(L, 1, 0, 0));
+  CHECK_STACK(L, 0);
+}
+
+UNIT_TEST(number_policy) {
+  lua_raii L;
+
+  lua_pushnumber(L, 1.5);
+  lua_pushstring(L, "2.5");
+  lua_pushstring(L, "x");
+
+  TEST_EQ(*primer::read<primer::strict_number<double>>(L, 1), 1.5);
+  TEST(!primer::read<primer::strict_number<double>>(L, 2), "expected an error");
+  TEST_EQ(*primer::read<primer::lenient_number<double>>(L, 2), 2.5);
+  TEST(!primer::read<primer::lenient_number<float>>(L, 3), "expected an error");
+
+#ifdef PRIMER_STRICT_NUMBERS
+  TEST(!primer::read<double>(L, 2), "expected an error");
+#else
+  TEST_EQ(*primer::read<double>(L, 2), 2.5);
+#endif
+  TEST(!primer::read<double>(L, 3), "expected an error");
+
+  // Integers are never converted from strings
+  lua_pushstring(L, "3");
+  TEST(!primer::read<int>(L, 4), "expected an error");
+  lua_settop(L, 0);
+}
+
+UNIT_TEST(error_objects) {
+  primer::error kept;
+  {
+    lua_raii L;
+    lua_pushcfunction(L, [](lua_State * L) -> int { return lua_error(L); });
+    lua_setglobal(L, "raise");
+
+    // A string error is copied, and the code line is added when it is used
+    TEST_EQ(LUA_OK, luaL_loadstring(L, "raise('oops')"));
+    int code = lua_pcall(L, 0, 0, 0);
+    TEST_EQ(LUA_ERRRUN, code);
+    primer::error e{primer::pop_error(L, code)};
+    CHECK_STACK(L, 0);
+    TEST_EQ(LUA_ERRRUN, e.lua_code());
+    TEST(!e.has_lua_object(), "a string error should just be text");
+    TEST_EQ(e.str(), "a runtime error:\noops");
+
+    TEST_EQ(LUA_OK, luaL_loadstring(L, "raise({ code = 7 })"));
+    code = lua_pcall(L, 0, 0, 0);
+    e = primer::pop_error(L, code);
+    CHECK_STACK(L, 0);
+    TEST_EQ(LUA_ERRRUN, e.lua_code());
+    TEST(e.has_lua_object(), "the table should be kept");
+
+    // Context keeps the object, and copies share it
+    kept = e;
+    kept.prepend_error_line("In test:");
+    TEST_EQ(kept.str(),
+            "In test:\na runtime error:\n(error object is a table value)");
+    TEST_EQ(e.str(), "a runtime error:\n(error object is a table value)");
+
+    TEST(primer::push_error_object(L, kept), "expected the original object");
+    TEST_EQ(LUA_TNUMBER, lua_getfield(L, -1, "code"));
+    TEST_EQ(7, lua_tointeger(L, -1));
+    lua_pop(L, 2);
+    CHECK_STACK(L, 0);
+
+    // Errors which aren't from lua have no code
+    TEST_EQ(LUA_OK, primer::error{"foo"}.lua_code());
+    TEST(!primer::push_error_object(L, primer::error{"foo"}), "no object");
+    TEST_EQ(std::string{"foo"}, lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+
+  // The VM is gone, the error still has its text and code
+  TEST_EQ(LUA_ERRRUN, kept.lua_code());
+  TEST_EQ(kept.str(),
+          "In test:\na runtime error:\n(error object is a table value)");
+}
+
 //[ primer_raise_lua_error_decl
 
 // This is a custom exception type, which is supposed to be handled by raising
@@ -1359,6 +1359,7 @@ u_proto(Info *info) {                                            /* ... proto */
 
   /* Read debug information if any is present. */
   if (!READ_VALUE(uint8_t)) {
+    lua_pushvalue(info->L, -1);                            /* ... proto proto */
     return;
   }
 
@@ -1359,6 +1359,10 @@ u_proto(Info *info) {                                            /* ... proto */
 
   /* Read debug information if any is present. */
   if (!READ_VALUE(uint8_t)) {
+#if defined(LUA_SHARED_CODE)
+    luaF_sharecode(info->L, p);
+#endif
+    lua_pushvalue(info->L, -1);                            /* ... proto proto */
     return;
   }
 
@@ -1401,6 +1405,9 @@ u_proto(Info *info) {                                            /* ... proto */
     poppath(info);
   }
   poppath(info);
+#if defined(LUA_SHARED_CODE)
+  luaF_sharecode(info->L, p);
+#endif
   lua_pushvalue(info->L, -1);                              /* ... proto proto */
 
   eris_assert(lua_type(info->L, -1) == LUA_TLIGHTUSERDATA);
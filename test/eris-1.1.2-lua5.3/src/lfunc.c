@@ -11,6 +11,10 @@
 
 
 #include <stddef.h>
+#if defined(LUA_SHARED_CODE)
+#include <stdlib.h>
+#include <string.h>
+#endif
 
 #include "lua.h"
 
@@ -113,6 +117,9 @@ Proto *luaF_newproto (lua_State *L) {
   f->numparams = 0;
   f->is_vararg = 0;
   f->maxstacksize = 0;
+#if defined(LUA_SHARED_CODE)
+  f->sharedcode = 0;
+#endif
   f->locvars = NULL;
   f->sizelocvars = 0;
   f->linedefined = 0;
@@ -122,10 +129,148 @@ Proto *luaF_newproto (lua_State *L) {
 }
 
 
+#if defined(LUA_SHARED_CODE)
+
+/*
+** Arrays of code and of line information are immutable once a prototype is
+** loaded, so identical ones are kept once for the whole process, outside of
+** any state, and shared by reference count. They are allocated with 'malloc',
+** since the states may each have their own allocator, and are not part of
+** the memory which any state accounts for.
+*/
+
+#if !defined(__GNUC__)
+#error "LUA_SHARED_CODE needs the atomic builtins of gcc or clang"
+#endif
+
+#define SHAREDBUCKETS	4096
+
+typedef struct SharedArray {
+  struct SharedArray *next;
+  size_t size;
+  unsigned int hash;
+  int refs;
+  L_Umaxalign data[1];  /* the array itself */
+} SharedArray;
+
+static SharedArray *sharedbuckets[SHAREDBUCKETS];
+static size_t sharedtotal = 0;
+static int sharedlock = 0;
+
+#define lockshared() \
+  while (__atomic_test_and_set(&sharedlock, __ATOMIC_ACQUIRE)) {}
+#define unlockshared()	__atomic_clear(&sharedlock, __ATOMIC_RELEASE)
+
+#define sharedof(b) \
+  cast(SharedArray *, cast(char *, (b)) - offsetof(SharedArray, data))
+
+
+static unsigned int hasharray (const void *b, size_t size) {
+  const unsigned char *p = cast(const unsigned char *, b);
+  unsigned int h = 2166136261u;  /* FNV-1a */
+  size_t i;
+  for (i = 0; i < size; i++)
+    h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+
+/*
+** Returns the shared copy of array 'b', or NULL if it can't be made
+*/
+static void *sharearray (const void *b, size_t size) {
+  unsigned int h = hasharray(b, size);
+  SharedArray **bucket = &sharedbuckets[h % SHAREDBUCKETS];
+  SharedArray *a;
+  lockshared();
+  for (a = *bucket; a != NULL; a = a->next) {
+    if (a->hash == h && a->size == size && memcmp(a->data, b, size) == 0) {
+      a->refs++;
+      unlockshared();
+      return a->data;
+    }
+  }
+  a = cast(SharedArray *, malloc(offsetof(SharedArray, data) + size));
+  if (a != NULL) {
+    a->size = size;
+    a->hash = h;
+    a->refs = 1;
+    memcpy(a->data, b, size);
+    a->next = *bucket;
+    *bucket = a;
+    sharedtotal += size;
+  }
+  unlockshared();
+  return (a != NULL) ? a->data : NULL;
+}
+
+
+static void releasearray (void *b) {
+  SharedArray *a = sharedof(b);
+  lockshared();
+  if (--a->refs == 0) {
+    SharedArray **p = &sharedbuckets[a->hash % SHAREDBUCKETS];
+    while (*p != a) p = &(*p)->next;
+    *p = a->next;
+    sharedtotal -= a->size;
+    free(a);
+  }
+  unlockshared();
+}
+
+
+/*
+** Replaces the code and line information of a loaded prototype with their
+** shared copies. Called once they are read, and before the prototype runs.
+*/
+void luaF_sharecode (lua_State *L, Proto *f) {
+  if (!(f->sharedcode & PROTO_SHAREDCODE) && f->sizecode > 0) {
+    void *b = sharearray(f->code, f->sizecode * sizeof(Instruction));
+    if (b != NULL) {
+      luaM_freearray(L, f->code, f->sizecode);
+      f->code = cast(Instruction *, b);
+      f->sharedcode |= PROTO_SHAREDCODE;
+    }
+  }
+  if (!(f->sharedcode & PROTO_SHAREDLINEINFO) && f->sizelineinfo > 0) {
+    void *b = sharearray(f->lineinfo, f->sizelineinfo * sizeof(int));
+    if (b != NULL) {
+      luaM_freearray(L, f->lineinfo, f->sizelineinfo);
+      f->lineinfo = cast(int *, b);
+      f->sharedcode |= PROTO_SHAREDLINEINFO;
+    }
+  }
+}
+
+
+/*
+** Bytes of code and line information shared by the process
+*/
+size_t luaF_sharedcodesize (void) {
+  size_t n;
+  lockshared();
+  n = sharedtotal;
+  unlockshared();
+  return n;
+}
+
+#endif
+
+
 void luaF_freeproto (lua_State *L, Proto *f) {
+#if defined(LUA_SHARED_CODE)
+  if (f->sharedcode & PROTO_SHAREDCODE)
+    releasearray(f->code);
+  else
+#endif
   luaM_freearray(L, f->code, f->sizecode);
   luaM_freearray(L, f->p, f->sizep);
   luaM_freearray(L, f->k, f->sizek);
+#if defined(LUA_SHARED_CODE)
+  if (f->sharedcode & PROTO_SHAREDLINEINFO)
+    releasearray(f->lineinfo);
+  else
+#endif
   luaM_freearray(L, f->lineinfo, f->sizelineinfo);
   luaM_freearray(L, f->locvars, f->sizelocvars);
   luaM_freearray(L, f->upvalues, f->sizeupvalues);
@@ -57,5 +57,14 @@ LUAI_FUNC void luaF_freeproto (lua_State *L, Proto *f);
 LUAI_FUNC const char *luaF_getlocalname (const Proto *func, int local_number,
                                          int pc);
 
+#if defined(LUA_SHARED_CODE)
+/* bits of 'sharedcode' */
+#define PROTO_SHAREDCODE	1
+#define PROTO_SHAREDLINEINFO	2
+
+LUAI_FUNC void luaF_sharecode (lua_State *L, Proto *f);
+LUAI_FUNC size_t luaF_sharedcodesize (void);
+#endif
+
 
 #endif
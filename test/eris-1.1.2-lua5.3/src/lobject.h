@@ -409,6 +409,9 @@ typedef struct Proto {
   lu_byte numparams;  /* number of fixed parameters */
   lu_byte is_vararg;
   lu_byte maxstacksize;  /* number of registers needed by this function */
+#if defined(LUA_SHARED_CODE)
+  lu_byte sharedcode;  /* which of 'code' and 'lineinfo' are shared */
+#endif
   int sizeupvalues;  /* size of 'upvalues' */
   int sizek;  /* size of 'k' */
   int sizecode;
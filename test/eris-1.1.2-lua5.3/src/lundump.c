@@ -213,6 +213,9 @@ static void LoadFunction (LoadState *S, Proto *f, TString *psource) {
   LoadUpvalues(S, f);
   LoadProtos(S, f);
   LoadDebug(S, f);
+#if defined(LUA_SHARED_CODE)
+  luaF_sharecode(S->L, f);
+#endif
 }
 
 
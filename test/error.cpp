@@ -1,7 +1,9 @@
 #include <cassert>
 #include <iostream>
+#include <limits>
 #include <primer/error.hpp>
 #include <string>
+#include <thread>
 
 /***
  * This is a small test of primer::error, meant to help
@@ -10,6 +12,9 @@
 
 using primer::error;
 
+static_assert(sizeof(error) <= 3 * sizeof(void *),
+              "primer::error should be small");
+
 int
 main() {
   primer::error e1{"aa"};
@@ -18,5 +23,63 @@ main() {
   primer::error e2{"bb"};
   assert(e2.str() == "bb");
 
+  // Deferred messages
+  primer::error e3 = error::unexpected_value("table", "nil");
+  assert(std::string{e3.what()} == "Expected table found: 'nil'");
+  assert(e3.str() == "Expected table found: 'nil'");
+
+  const primer::error e = error::unexpected_value("number", "string");
+  primer::error e4{e};
+  primer::error e5{e};
+  e4.prepend_error_line("In index [1],");
+  assert(e4.str() == "In index [1],\nExpected number found: 'string'");
+  assert(e5.str() == "Expected number found: 'string'");
+
+  assert(error::integer_overflow(-5).str() == "Integer overflow occurred: -5");
+  assert(error::integer_overflow(std::numeric_limits<unsigned long long>::max())
+           .str()
+         == "Integer overflow occurred: "
+              + std::to_string(std::numeric_limits<unsigned long long>::max()));
+  assert(error::insufficient_stack_space(7).str()
+         == "Insufficient stack space: needed 7");
+
+  // Copies share the message, and adding context doesn't affect other copies
+  primer::error e6{"foo ", 5};
+  const primer::error e7{e6};
+  assert(e6.what() == e7.what());
+  e6.prepend_error_line("bar");
+  assert(e6.str() == "bar\nfoo 5");
+  assert(e7.str() == "foo 5");
+
+  primer::error e8{std::move(e6)};
+  assert(e8.str() == "bar\nfoo 5");
+  e6 = e7;
+  assert(e6.str() == "foo 5");
+  e6 = error::bad_alloc();
+  assert(e6.str() == "bad_alloc");
+  e6.prepend_error_line("baz");
+  assert(e6.str() == "baz\nbad_alloc");
+
+  // The public name copies strings which aren't static
+  primer::error e9;
+  {
+    std::string found{"a string which goes away"};
+    e9 = error::unexpected_value("number", found.c_str());
+  }
+  assert(e9.str() == "Expected number found: 'a string which goes away'");
+
+  // Copies of a deferred message may be rendered on different threads
+  const primer::error original = error::unexpected_static_value("table", "nil");
+  primer::error c1{original};
+  primer::error c2{original};
+  std::string seen[2];
+  std::thread t1{[&] { seen[0] = c1.what(); }};
+  std::thread t2{[&] { seen[1] = c2.what(); }};
+  t1.join();
+  t2.join();
+  assert(seen[0] == "Expected table found: 'nil'");
+  assert(seen[1] == seen[0]);
+  assert(original.str() == "Expected table found: 'nil'");
+
   std::cout << "OK!" << std::endl;
 }
@@ -11,6 +11,9 @@
 
 using primer::expected;
 
+static_assert(sizeof(expected<int>) <= 4 * sizeof(void *),
+              "expected<int> should be small");
+
 int
 main() {
   expected<int> a;
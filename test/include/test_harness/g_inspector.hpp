@@ -27,6 +27,8 @@ struct lua_value {
   bool matches(const lua_value & o) const {
     if (type != o.type) { return false; }
     if (type == LUA_TTABLE || type == LUA_TUSERDATA) { return true; }
+    // Closures have a new address after they are restored
+    if (type == LUA_TFUNCTION) { return true; }
     return desc == o.desc;
   }
 };
@@ -0,0 +1,100 @@
+/*
+** Test of LUA_SHARED_CODE in the vendored eris sources: states which load the
+** same bytecode share one copy of its code and line information, which lives
+** as long as some state uses it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lualib.h"
+#include "lauxlib.h"
+
+/* From lfunc.h, which is internal */
+size_t luaF_sharedcodesize (void);
+
+#define CHECK(c) \
+  do { \
+    if (!(c)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #c); \
+      exit(EXIT_FAILURE); \
+    } \
+  } while (0)
+
+typedef struct Buffer {
+  char *data;
+  size_t size;
+} Buffer;
+
+static int writer (lua_State *L, const void *p, size_t n, void *ud) {
+  Buffer *b = (Buffer *)ud;
+  char *data = (char *)realloc(b->data, b->size + n);
+  (void)L;
+  if (data == NULL) return 1;
+  memcpy(data + b->size, p, n);
+  b->data = data;
+  b->size += n;
+  return 0;
+}
+
+/* A state holding, as global 'f', the function returned by the chunk */
+static lua_State *load (const Buffer *chunk) {
+  lua_State *L = luaL_newstate();
+  CHECK(L != NULL);
+  CHECK(luaL_loadbufferx(L, chunk->data, chunk->size, "=chunk", "b") == LUA_OK);
+  CHECK(lua_pcall(L, 0, 1, 0) == LUA_OK);
+  lua_setglobal(L, "f");
+  return L;
+}
+
+static lua_Integer call (lua_State *L, lua_Integer x) {
+  lua_Integer result;
+  lua_getglobal(L, "f");
+  lua_pushinteger(L, x);
+  CHECK(lua_pcall(L, 1, 1, 0) == LUA_OK);
+  result = lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return result;
+}
+
+int main (void) {
+  Buffer chunk = {NULL, 0};
+  lua_State *A, *B, *C;
+  size_t shared;
+
+  /* Functions compiled from source are not shared */
+  C = luaL_newstate();
+  CHECK(C != NULL);
+  CHECK(luaL_loadstring(C, "local k = 2\n"
+                           "return function(x)\n"
+                           "  return x * k + 1\n"
+                           "end\n") == LUA_OK);
+  CHECK(lua_dump(C, writer, &chunk, 0) == 0);
+  lua_close(C);
+  CHECK(luaF_sharedcodesize() == 0);
+
+  A = load(&chunk);
+  shared = luaF_sharedcodesize();
+  CHECK(shared > 0);
+  CHECK(call(A, 20) == 41);
+
+  /* A second state loading the same chunk adds nothing */
+  B = load(&chunk);
+  CHECK(luaF_sharedcodesize() == shared);
+  CHECK(call(B, 3) == 7);
+
+  /* The shared copy outlives the first state */
+  lua_close(A);
+  CHECK(luaF_sharedcodesize() == shared);
+  lua_gc(B, LUA_GCCOLLECT, 0);
+  CHECK(call(B, 5) == 11);
+
+  lua_close(B);
+  CHECK(luaF_sharedcodesize() == 0);
+
+  free(chunk.data);
+  printf("shared code: OK\n");
+  return EXIT_SUCCESS;
+}
@@ -1,15 +1,39 @@
 #include <primer/primer.hpp>
 #include <primer/std.hpp>
+#include <primer/transfer.hpp>
 
 #include "test_harness/test_harness.hpp"
 #include <iostream>
 #include <string>
 
 #include <array>
+#include <cstdint>
 #include <map>
+#include <memory>
 #include <set>
 #include <vector>
 
+// A user specialization for an arithmetic type, which reads percentages. The
+// fast path for sequences of arithmetic types must not bypass it.
+namespace primer {
+namespace traits {
+
+template <>
+struct read<long double> {
+  static expected<long double> from_stack(lua_State * L, int idx) {
+    auto result = read<double>::from_stack(L, idx);
+    if (!result) { return std::move(result.err()); }
+    return static_cast<long double>(*result) / 100;
+  }
+  static constexpr int stack_space_needed{0};
+};
+
+} // end namespace traits
+} // end namespace primer
+
+static_assert(primer::detail::is_builtin_read<double>::value, "hmm");
+static_assert(!primer::detail::is_builtin_read<long double>::value, "hmm");
+
 namespace maybe_int_tests {
 
 // Static asserts which check the "stack_space_for_push" and read feature
@@ -310,6 +334,210 @@ test_vector_round_trip() {
   round_trip_value(L, std::vector<float>{-0.5f, .5f, 6.5f}, __LINE__);
   round_trip_value(L, std::vector<std::string>{"asdf", "jkl;", "", "wer"},
                    __LINE__);
+  round_trip_value(L, std::vector<bool>{true, false, false, true}, __LINE__);
+}
+
+void
+test_vector_read_arithmetic() {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1); // remove lib
+
+  TEST_EXPECTED(try_load_script(L, "return { 1, 2, 3.5, '4' }"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  CHECK_STACK(L, 1);
+
+  {
+    auto vec = primer::read<std::vector<double>>(L, 1);
+#ifdef PRIMER_STRICT_NUMBERS
+    // The fast path follows the policy of read<double>
+    TEST(!vec, "expected failure");
+    TEST(vec.err().str().find("[4]") != std::string::npos,
+         "expected index in error message: " << vec.err().str());
+    TEST(!primer::read<std::vector<float>>(L, 1), "expected failure");
+#else
+    TEST_EXPECTED(vec);
+    TEST_EQ(vec->size(), 4u);
+    TEST_EQ((*vec)[2], 3.5);
+    TEST_EQ((*vec)[3], 4);
+#endif
+  }
+  TEST(!primer::read<std::vector<int>>(L, 1), "expected failure");
+  CHECK_STACK(L, 1);
+  lua_pop(L, 1);
+
+  TEST_EXPECTED(try_load_script(L, "return { 1, 2, -3 }"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  {
+    auto vec = primer::read<std::vector<int>>(L, 1);
+    TEST_EXPECTED(vec);
+    TEST_EQ(vec->size(), 3u);
+    TEST_EQ((*vec)[2], -3);
+  }
+  {
+    auto vec = primer::read<std::vector<unsigned int>>(L, 1);
+    TEST(!vec, "expected failure");
+    TEST(vec.err().str().find("[3]") != std::string::npos,
+         "expected index in error message: " << vec.err().str());
+  }
+  {
+    // A user specialization of the element read is used for every element
+    auto vec = primer::read<std::vector<long double>>(L, 1);
+    TEST_EXPECTED(vec);
+    TEST_EQ(vec->size(), 3u);
+    TEST_EQ((*vec)[0], 0.01L);
+    TEST_EQ((*vec)[2], -0.03L);
+  }
+  CHECK_STACK(L, 1);
+  lua_pop(L, 1);
+
+  TEST_EXPECTED(try_load_script(L, "return { 1, 2 ^ 40 }"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  TEST_EXPECTED(primer::read<std::vector<double>>(L, 1));
+  TEST(!primer::read<std::vector<int>>(L, 1), "expected failure");
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
+}
+
+void
+test_read_into() {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1); // remove lib
+
+  std::vector<std::vector<std::string>> vec;
+  vec.reserve(10);
+  vec.resize(3);
+  vec[0].reserve(10);
+  const std::vector<std::string> * outer_data = vec.data();
+  const std::string * inner_data = vec[0].data();
+
+  TEST_EXPECTED(try_load_script(L, "return { { 'a', 'b' }, { 'c' } }"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  TEST_EXPECTED(primer::read_into(L, 1, vec));
+  CHECK_STACK(L, 1);
+  TEST_EQ(vec.size(), 2u);
+  TEST_EQ(vec[0].size(), 2u);
+  TEST_EQ(vec[0][1], "b");
+  TEST_EQ(vec[1].size(), 1u);
+  TEST_EQ(vec[1][0], "c");
+  TEST_EQ(vec.data(), outer_data);
+  TEST_EQ(vec[0].data(), inner_data);
+  lua_pop(L, 1);
+
+  std::vector<int> ints{1, 2, 3, 4, 5};
+  const int * int_data = ints.data();
+  TEST_EXPECTED(try_load_script(L, "return { 7, 8 }"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  TEST_EXPECTED(primer::read_into(L, 1, ints));
+  TEST_EQ(ints.size(), 2u);
+  TEST_EQ(ints[1], 8);
+  TEST_EQ(ints.data(), int_data);
+
+  // Failure is reported
+  TEST(!primer::read_into(L, 1, vec), "expected failure");
+  lua_pop(L, 1);
+
+  // The elements of a vector<bool> are proxies, they are assigned into
+  std::vector<bool> flags{false, false, true};
+  TEST_EXPECTED(try_load_script(L, "return { true, false }"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  TEST_EXPECTED(primer::read_into(L, 1, flags));
+  TEST_EQ(flags, (std::vector<bool>{true, false}));
+  lua_pop(L, 1);
+
+  std::map<std::string, int> m{{"z", 26}};
+  TEST_EXPECTED(try_load_script(L, "return { a = 1, b = 2 }"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  TEST_EXPECTED(primer::read_into(L, 1, m));
+  TEST_EQ(m.size(), 2u);
+  TEST_EQ(m["b"], 2);
+  lua_pop(L, 1);
+
+  // Types without into_existing fall back to from_stack
+  std::string str;
+  lua_pushstring(L, "asdf");
+  TEST_EXPECTED(primer::read_into(L, 1, str));
+  TEST_EQ(str, "asdf");
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
+}
+
+// A stateful allocator which is not default constructible, standing in for an
+// arena or memory resource
+template <typename T>
+struct counting_allocator {
+  using value_type = T;
+
+  int * count;
+
+  explicit counting_allocator(int * c) noexcept
+    : count(c) {}
+  template <typename U>
+  counting_allocator(const counting_allocator<U> & o) noexcept
+    : count(o.count) {}
+
+  T * allocate(std::size_t n) {
+    ++*count;
+    return std::allocator<T>{}.allocate(n);
+  }
+  void deallocate(T * p, std::size_t n) noexcept {
+    std::allocator<T>{}.deallocate(p, n);
+  }
+
+  template <typename U>
+  bool operator==(const counting_allocator<U> & o) const noexcept {
+    return count == o.count;
+  }
+  template <typename U>
+  bool operator!=(const counting_allocator<U> & o) const noexcept {
+    return count != o.count;
+  }
+};
+
+void
+test_read_allocator() {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1); // remove lib
+
+  int count = 0;
+
+  TEST_EXPECTED(try_load_script(L, "return { 4, 5, 6 }"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  {
+    std::vector<int, counting_allocator<int>> vec{counting_allocator<int>{
+      &count}};
+    TEST_EXPECTED(primer::read_into(L, 1, vec));
+    TEST_EQ(vec.size(), 3u);
+    TEST_EQ(vec[2], 6);
+    TEST(count > 0, "expected allocator to be used");
+
+    // Pushing also works
+    primer::push(L, vec);
+    test_top_type(L, LUA_TTABLE, __LINE__);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+
+  count = 0;
+
+  TEST_EXPECTED(try_load_script(L, "return { a = 1, b = 2 }"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  {
+    using alloc_t = counting_allocator<std::pair<const std::string, int>>;
+    std::map<std::string, int, std::less<std::string>, alloc_t> m{
+      std::less<std::string>{}, alloc_t{&count}};
+    TEST_EXPECTED(primer::read_into(L, 1, m));
+    TEST_EQ(m.size(), 2u);
+    TEST_EQ(m["b"], 2);
+    TEST_EQ(count, 2);
+  }
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
 }
 
 void
@@ -352,8 +580,21 @@ test_map_round_trip() {
     std::map<int, std::vector<std::string>>{
       {1, {}}, {2, {}}, {3, {"a", "b", "c"}}, {9, {"asdf", "jkl;"}}},
     __LINE__);
+
+  // Dense, sparse and negative integer keys
+  round_trip_value(L, std::map<int, int>{{1, 5}, {2, 6}, {3, 7}, {4, 8}},
+                   __LINE__);
+  round_trip_value(L, std::map<int, int>{{1, 5}, {1000, 6}, {-3, 7}, {0, 8}},
+                   __LINE__);
+  round_trip_value(L, std::map<unsigned, int>{{2, 1}, {3, 2}, {70000, 3}},
+                   __LINE__);
 }
 
+static_assert(primer::traits::never_pushes_nil<std::string>::value,
+              "strings never push nil");
+static_assert(!primer::traits::never_pushes_nil<const char *>::value,
+              "a null pointer pushes nil");
+
 void
 test_unordered_map_round_trip() {
   lua_raii L;
@@ -372,6 +613,47 @@ test_unordered_map_round_trip() {
     std::unordered_map<int, std::vector<std::string>>{
       {1, {}}, {2, {}}, {3, {"a", "b", "c"}}, {9, {"asdf", "jkl;"}}},
     __LINE__);
+
+  // Reserved from a count of the entries
+  TEST_EXPECTED(try_load_script(L, "local t = {}                   \n"
+                                   "for i = 1, 5000 do              \n"
+                                   "  t['k' .. i] = i               \n"
+                                   "end                             \n"
+                                   "return t                        \n"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  {
+    auto m = primer::read<std::unordered_map<std::string, int>>(L, -1);
+    TEST_EXPECTED(m);
+    TEST_EQ(m->size(), 5000u);
+    TEST_EQ(m->at("k4321"), 4321);
+    const auto buckets = m->bucket_count();
+    m->reserve(5000);
+    TEST_EQ(m->bucket_count(), buckets);
+
+    // Read into again, it has room, so the entries aren't counted
+    using map_reserved =
+      primer::container::reserved_helper<std::unordered_map<std::string, int>>;
+    TEST(map_reserved::reserved(*m), "expected a reserved map");
+    TEST_EXPECTED(primer::read_into(L, -1, *m));
+    TEST_EQ(m->size(), 5000u);
+    TEST_EQ(m->bucket_count(), buckets);
+  }
+  {
+    using map_reserved =
+      primer::container::reserved_helper<std::unordered_map<std::string, int>>;
+    using vec_reserved = primer::container::reserved_helper<std::vector<int>>;
+
+    std::unordered_map<std::string, int> empty;
+    TEST(!map_reserved::reserved(empty), "expected an unreserved map");
+    empty.reserve(100);
+    TEST(map_reserved::reserved(empty), "expected a reserved map");
+    std::vector<int> vec;
+    TEST(!vec_reserved::reserved(vec), "expected an unreserved vector");
+    vec.reserve(4);
+    TEST(vec_reserved::reserved(vec), "expected a reserved vector");
+  }
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
 }
 
 void
@@ -380,6 +662,7 @@ test_set_round_trip() {
 
   round_trip_value(L, std::set<int>{}, __LINE__);
   round_trip_value(L, std::set<int>{1, 5, 6, 10, 234}, __LINE__);
+  round_trip_value(L, std::set<int>{1, 2, 3, 4, 5, -1}, __LINE__);
   round_trip_value(
     L, std::set<std::string>{"wer", "qWQE", "asjdkljweWERWERE", "", "foo"},
     __LINE__);
@@ -478,6 +761,25 @@ test_userdata() {
   TEST(primer::test_udata<userdata_test>(L, 1),
        "did not recover userdata from stack");
 
+  // The cached metatable is the one registered under the userdata name
+  primer::push_metatable<userdata_test>(L);
+  luaL_getmetatable(L, primer::udata_name<userdata_test>());
+  TEST(lua_rawequal(L, -1, -2), "cached metatable mismatch");
+  lua_pop(L, 2);
+
+  // It is presized for the methods and the special names, and has the usual
+  // fields of `luaL_newmetatable`
+  using mt = primer::detail::metatable<userdata_test>;
+  TEST(mt::size_hint() >= 2 + 3, "size hint = " << mt::size_hint());
+  TEST(mt::info().saw_index_metamethod == false, "no __index was registered");
+  primer::push_metatable<userdata_test>(L);
+  TEST_EQ(lua_getfield(L, -1, "__index"), LUA_TTABLE);
+  TEST(lua_rawequal(L, -1, -2), "expected to be its own __index");
+  lua_pop(L, 1);
+  TEST_EQ(lua_getfield(L, -1, "__name"), LUA_TSTRING);
+  TEST_EQ(std::string{lua_tostring(L, -1)}, "userdata_test_type");
+  lua_pop(L, 2);
+
   auto ref = primer::read<userdata_test &>(L, 1);
   TEST_EXPECTED(ref);
 
@@ -605,47 +907,1554 @@ test_userdata_two() {
   CHECK_STACK(L, 0);
 }
 
+/***
+ * Userdata finalizers
+ */
+
+struct pod_handle {
+  int id;
+};
+
+struct pod_tracked {
+  int id;
+};
+
+// Defaulted metatables and method lists get __gc only if the dtor matters
+namespace primer {
+namespace traits {
+
+template <>
+struct userdata<pod_handle> {
+  static constexpr const char * name = "pod_handle";
+};
+
+template <>
+struct userdata<pod_tracked> {
+  static constexpr const char * name = "pod_tracked";
+  static constexpr const luaL_Reg * metatable = method_list;
+  static constexpr bool needs_gc = true;
+};
+
+} // end namespace traits
+} // end namespace primer
+
+static_assert(!primer::detail::udata_needs_gc<pod_handle>::value,
+              "trivial udata should not need __gc");
+static_assert(primer::detail::udata_needs_gc<pod_tracked>::value,
+              "needs_gc should override the default");
+static_assert(primer::detail::udata_needs_gc<userdata_test>::value,
+              "nontrivial udata should need __gc");
+
+bool
+metatable_has_gc(lua_State * L) {
+  const bool result = luaL_getmetafield(L, -1, "__gc") != LUA_TNIL;
+  lua_pop(L, result ? 2 : 1);
+  return result;
+}
+
 void
-test_std_function() {
+test_userdata_finalizers() {
   lua_raii L;
 
-  //[ primer_example_std_function
-  std::function<primer::result(lua_State * L, int x, int y)> f =
-    [](lua_State * L, int x, int y) -> primer::result {
-    if (y == x) { return primer::error{"bad input"}; }
-    lua_pushinteger(L, x - y);
+  primer::push_udata<pod_handle>(L, pod_handle{1});
+  TEST(!metatable_has_gc(L), "expected no __gc");
+
+  primer::push_udata<pod_tracked>(L, pod_tracked{2});
+  TEST(metatable_has_gc(L), "expected __gc");
+
+  primer::push_udata<userdata_test>(L);
+  TEST(metatable_has_gc(L), "expected __gc");
+
+  // vec2 is trivial, and blocks __gc in its list anyways
+  primer::push_udata<vec2_test>(L, 1.0f, 2.0f);
+  TEST(!metatable_has_gc(L), "expected no __gc");
+
+  CHECK_STACK(L, 0);
+}
+
+/***
+ * Slab userdata
+ */
+
+struct entity_handle {
+  std::uint64_t id;
+  std::uint64_t generation;
+
+  static int alive;
+
+  entity_handle(std::uint64_t i, std::uint64_t g)
+    : id(i)
+    , generation(g) {
+    ++alive;
+  }
+  ~entity_handle() { --alive; }
+
+  primer::result get_id(lua_State * L) {
+    lua_pushinteger(L, static_cast<lua_Integer>(id));
     return 1;
-  };
+  }
 
-  primer::push_std_function(L, std::move(f));
-  //]
+  primer::result same(lua_State * L, entity_handle & other) {
+    lua_pushboolean(L, id == other.id && generation == other.generation);
+    return 1;
+  }
+};
 
-  CHECK_STACK(L, 1);
+int entity_handle::alive = 0;
+
+static constexpr luaL_Reg entity_methods[] = {
+  {"id", PRIMER_ADAPT_USERDATA(entity_handle, &entity_handle::get_id)},
+  {"__eq", PRIMER_ADAPT_USERDATA(entity_handle, &entity_handle::same)},
+  {nullptr, nullptr}};
+
+namespace primer {
+namespace traits {
+
+template <>
+struct userdata<entity_handle> {
+  static constexpr const char * name = "entity_handle";
+  static constexpr const luaL_Reg * metatable = entity_methods;
+  static constexpr bool slab = true;
+};
 
+} // end namespace traits
+} // end namespace primer
+
+static_assert(primer::detail::udata_in_slab<entity_handle>::value,
+              "entity_handle should be slab userdata");
+static_assert(!primer::detail::udata_in_slab<vec2_test>::value,
+              "vec2 should not be slab userdata");
+
+primer::result
+entity_ctor(lua_State * L, int id) {
+  primer::push_udata<entity_handle>(L, static_cast<std::uint64_t>(id), 1u);
+  return 1;
+}
+
+void
+test_slab_userdata() {
   {
-    lua_pushvalue(L, 1);
+    lua_raii L;
+    luaL_requiref(L, "", luaopen_base, 1);
+    lua_pop(L, 1);
+    lua_pushcfunction(L, PRIMER_ADAPT(&entity_ctor));
+    lua_setglobal(L, "entity");
+
+    primer::push_udata<entity_handle>(L, 7u, 3u);
+    entity_handle * e = primer::test_udata<entity_handle>(L, -1);
+    TEST(e, "expected to find the handle");
+    TEST_EQ(e->id, 7u);
+    TEST_EQ(e->generation, 3u);
+    TEST(!primer::test_udata<vec2_test>(L, -1), "expected a type mismatch");
+    auto r = primer::read<entity_handle &>(L, -1);
+    TEST_EXPECTED(r);
+    TEST(&*r == e, "expected a reference to the slot");
+    lua_setglobal(L, "kept");
+
+    // The objects are in the slab, and their slots are reused once collected
+    auto & slab = primer::detail::udata_slab<entity_handle>::get(L);
+    const char * script = "for i = 1, 5000 do                            \n"
+                          "  local e = entity(i)                          \n"
+                          "  assert(e:id() == i)                          \n"
+                          "  assert(e == entity(i))                       \n"
+                          "end                                            \n"
+                          "assert(kept:id() == 7)                         \n";
+    TEST_EXPECTED(try_load_script(L, script));
+    TEST_EXPECTED(primer::fcn_call_no_ret(L, 0));
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    TEST_EQ(slab.live(), 1u);
+    TEST_EQ(entity_handle::alive, 1);
+
+    // Their blocks are only pointers, so by default they can't be persisted
+    lua_getglobal(L, "kept");
+    TEST_EQ(luaL_getmetafield(L, -1, "__persist"), LUA_TBOOLEAN);
+    lua_pop(L, 2);
+    CHECK_STACK(L, 0);
+  }
+  // The ones still alive are finalized when the state is closed
+  TEST_EQ(entity_handle::alive, 0);
+}
 
-    lua_pushinteger(L, 3);
-    lua_pushinteger(L, 2);
+/***
+ * Pushing temporaries
+ */
 
-    auto result = primer::fcn_call_one_ret(L, 2);
-    CHECK_STACK(L, 1);
-    TEST_EXPECTED(result);
-    auto maybe_int = result->as<int>();
-    CHECK_STACK(L, 1);
-    TEST_EXPECTED(maybe_int);
-    TEST_EQ(*maybe_int, 1);
+struct moved_cell {
+  std::vector<int> data;
+
+  static int copies;
+
+  explicit moved_cell(std::vector<int> d)
+    : data(std::move(d)) {}
+  moved_cell(const moved_cell & o)
+    : data(o.data) {
+    ++copies;
+  }
+  moved_cell(moved_cell &&) = default;
+  moved_cell & operator=(const moved_cell &) = default;
+};
+
+int moved_cell::copies = 0;
+
+struct move_only_cell {
+  std::unique_ptr<int> value;
+};
+
+namespace primer {
+namespace traits {
+
+template <>
+struct userdata<moved_cell> {
+  static constexpr const char * name = "moved_cell";
+};
+
+template <>
+struct push<moved_cell> : push_udata_helper<moved_cell> {};
+
+template <>
+struct userdata<move_only_cell> {
+  static constexpr const char * name = "move_only_cell";
+};
+
+template <>
+struct push<move_only_cell> : push_udata_helper<move_only_cell> {};
+
+} // end namespace traits
+} // end namespace primer
+
+void
+test_push_by_move() {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  // An lvalue is copied
+  moved_cell c{std::vector<int>{1, 2, 3}};
+  primer::push(L, c);
+  TEST_EQ(moved_cell::copies, 1);
+  TEST_EQ(c.data.size(), 3u);
+  TEST_EQ(primer::test_udata<moved_cell>(L, -1)->data.size(), 3u);
+  lua_pop(L, 1);
+
+  // A temporary is moved, and so are the elements of a temporary container
+  primer::push(L, std::move(c));
+  TEST_EQ(moved_cell::copies, 1);
+  TEST(c.data.empty(), "expected to be moved from");
+  lua_pop(L, 1);
+
+  std::vector<moved_cell> v;
+  v.emplace_back(std::vector<int>{4});
+  v.emplace_back(std::vector<int>{5, 6});
+  primer::push(L, v);
+  TEST_EQ(moved_cell::copies, 3);
+  lua_pop(L, 1);
+  primer::push(L, std::move(v));
+  TEST_EQ(moved_cell::copies, 3);
+  TEST(v[1].data.empty(), "expected the elements to be moved from");
+  TEST_EQ(lua_rawgeti(L, -1, 2), LUA_TUSERDATA);
+  TEST_EQ(primer::test_udata<moved_cell>(L, -1)->data.size(), 2u);
+  lua_pop(L, 2);
+
+  // A move-only type can be pushed, and is forwarded through a call
+  TEST_EXPECTED(try_load_script(L, "return function(x) return x end"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  primer::bound_function id{L};
+  move_only_cell m{std::unique_ptr<int>{new int{9}}};
+  auto r = id.call(std::move(m));
+  TEST_EXPECTED(r);
+  TEST(!m.value, "expected to be moved from");
+  TEST_EQ(r->size(), 1u);
+  (*r)[0].push();
+  TEST_EQ(*primer::test_udata<move_only_cell>(L, -1)->value, 9);
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
+}
+
+/***
+ * Udata arrays
+ */
+
+struct counted_cell {
+  int value;
+
+  static int alive;
+
+  explicit counted_cell(int v)
+    : value(v) {
+    ++alive;
+  }
+  counted_cell(const counted_cell & o)
+    : value(o.value) {
+    ++alive;
   }
+  counted_cell & operator=(const counted_cell &) = default;
+  ~counted_cell() { --alive; }
+};
+
+int counted_cell::alive = 0;
+
+namespace primer {
+namespace traits {
+
+template <>
+struct userdata<counted_cell> {
+  static constexpr const char * name = "counted_cell";
+};
 
+} // end namespace traits
+} // end namespace primer
+
+void
+test_udata_array() {
   {
-    lua_pushvalue(L, 1);
-    lua_pushinteger(L, 4);
-    lua_pushinteger(L, 4);
+    lua_raii L;
+    luaL_requiref(L, "", luaopen_base, 1);
+    lua_pop(L, 1);
+    lua_pushcfunction(L, PRIMER_ADAPT(&vec2_ctor));
+    lua_setglobal(L, "vec2");
+
+    std::vector<vec2_test> vs{{1, 1}, {2, 3}, {4, 5}};
+    auto & a = primer::push_udata_array(L, std::move(vs));
+    TEST_EQ(a.size(), 3u);
+    TEST_EQ(a[1].y, 3);
+    TEST(primer::test_udata_array<vec2_test>(L, -1) == &a,
+         "expected to find the array");
+    TEST(!primer::test_udata<vec2_test>(L, -1), "expected a type mismatch");
+    lua_setglobal(L, "a");
+
+    // Elements borrow into the block, and have the methods of vec2
+    const char * script = "assert(#a == 3)                               \n"
+                          "assert(a[0] == nil and a[4] == nil)           \n"
+                          "assert(a[2]:norm() == 13)                     \n"
+                          "_ = a[2] + vec2(1, 1)                         \n"
+                          "local x, y = a[2]:dump()                      \n"
+                          "assert(x == 3 and y == 4)                     \n"
+                          "a[1] = vec2(7, 8)                             \n"
+                          "a[3] = a[1]                                   \n"
+                          "assert(not pcall(function() a[4] = a[1] end)) \n"
+                          "assert(not pcall(function() a[1] = 5 end))    \n"
+                          "e = a[3]                                      \n"
+                          "a = nil                                       \n";
+    TEST_EXPECTED(try_load_script(L, script));
+    TEST_EXPECTED(primer::fcn_call_no_ret(L, 0));
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    // The element keeps the array alive
+    lua_getglobal(L, "e");
+    vec2_test * e = primer::test_udata<vec2_test>(L, -1);
+    TEST(e, "expected a borrowed vec2");
+    TEST_EQ(e->x, 7);
+    TEST_EQ(e->y, 8);
+    auto r = primer::read<vec2_test &>(L, -1);
+    TEST_EXPECTED(r);
+    TEST(&*r == e, "expected a reference into the array");
+    TEST_EQ(luaL_getmetafield(L, -1, "__persist"), LUA_TBOOLEAN);
+    lua_pop(L, 2);
+    CHECK_STACK(L, 0);
+  }
 
-    auto result = primer::fcn_call_one_ret(L, 2);
-    CHECK_STACK(L, 1);
-    TEST(!result, "expected failure");
+  // Each element is destroyed when the array is collected
+  {
+    lua_raii L;
+    std::vector<counted_cell> cells;
+    for (int i = 0; i < 100; ++i) {
+      cells.emplace_back(i);
+    }
+    auto & a = primer::push_udata_array(L, cells.data(), cells.size());
+    TEST_EQ(a.size(), 100u);
+    TEST_EQ(a[99].value, 99);
+    TEST_EQ(counted_cell::alive, 200);
+    lua_pop(L, 1);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    TEST_EQ(counted_cell::alive, 100);
+    CHECK_STACK(L, 0);
   }
+  TEST_EQ(counted_cell::alive, 0);
+}
+
+/***
+ * Userdata inheritance
+ */
+
+struct shape {
+  int sides;
+
+  explicit shape(int s)
+    : sides(s) {}
+
+  primer::result intf_sides(lua_State * L) {
+    lua_pushinteger(L, sides);
+    return 1;
+  }
+
+  primer::result intf_name(lua_State * L) {
+    lua_pushliteral(L, "shape");
+    return 1;
+  }
+};
+
+// Something before `shape` in the layout, so that upcasts move the pointer
+struct tagged {
+  long tag = 42;
+};
+
+struct square : tagged, shape {
+  int side;
+
+  explicit square(int s)
+    : shape(4)
+    , side(s) {}
+
+  primer::result intf_area(lua_State * L) {
+    lua_pushinteger(L, side * side);
+    return 1;
+  }
+
+  primer::result intf_name(lua_State * L) {
+    lua_pushliteral(L, "square");
+    return 1;
+  }
+};
+
+// No methods of its own
+struct tile : square {
+  tile()
+    : square(1) {}
+};
+
+primer::result
+shape_sides_twice(lua_State * L, shape & s) {
+  lua_pushinteger(L, 2 * s.sides);
+  return 1;
+}
+
+namespace primer {
+namespace traits {
+
+template <>
+struct userdata<shape> {
+  static constexpr const char * name = "shape";
+  static const std::vector<luaL_Reg> & metatable() {
+    static const std::vector<luaL_Reg> metatable_array{
+      {"sides", PRIMER_ADAPT_USERDATA(shape, &shape::intf_sides)},
+      {"name", PRIMER_ADAPT_USERDATA(shape, &shape::intf_name)}};
+    return metatable_array;
+  }
+};
+
+template <>
+struct userdata<square> {
+  static constexpr const char * name = "square";
+  using base = shape;
+  static const std::vector<luaL_Reg> & metatable() {
+    static const std::vector<luaL_Reg> metatable_array{
+      {"area", PRIMER_ADAPT_USERDATA(square, &square::intf_area)},
+      {"name", PRIMER_ADAPT_USERDATA(square, &square::intf_name)}};
+    return metatable_array;
+  }
+};
+
+template <>
+struct userdata<tile> {
+  static constexpr const char * name = "tile";
+  using base = square;
+};
+
+} // end namespace traits
+} // end namespace primer
+
+static_assert(primer::detail::udata_depth<shape>::value == 0, "");
+static_assert(primer::detail::udata_depth<tile>::value == 2, "");
+static_assert(!primer::detail::udata_has_base<shape>::value, "");
+
+void
+test_udata_inheritance() {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+  lua_pushcfunction(L, PRIMER_ADAPT(&shape_sides_twice));
+  lua_setglobal(L, "sides_twice");
+
+  primer::push_udata<shape>(L, 3);
+  lua_setglobal(L, "tri");
+  primer::push_udata<square>(L, 5);
+  square & sq = *primer::test_udata<square>(L, -1);
+  lua_setglobal(L, "sq");
+  primer::push_udata<tile>(L);
+  lua_setglobal(L, "t");
+
+  // Methods of the base are found, and can be replaced
+  const char * script = "assert(tri:sides() == 3 and tri:name() == 'shape')\n"
+                        "assert(sq:sides() == 4 and sq:area() == 25)       \n"
+                        "assert(sq:name() == 'square')                     \n"
+                        "assert(t:sides() == 4 and t:area() == 1)          \n"
+                        "assert(t:name() == 'square')                      \n"
+                        "assert(sides_twice(sq) == 8)                      \n"
+                        "assert(sides_twice(t) == 8)                       \n"
+                        "assert(not pcall(tri.area, tri))                  \n";
+  TEST_EXPECTED(try_load_script(L, script));
+  TEST_EXPECTED(primer::fcn_call_no_ret(L, 0));
+
+  // The pointer is adjusted to the base
+  lua_getglobal(L, "sq");
+  shape * s = primer::test_udata<shape>(L, -1);
+  TEST(s == static_cast<shape *>(&sq), "expected the shape of the square");
+  TEST(static_cast<void *>(s) != static_cast<void *>(&sq),
+       "expected the base to be at an offset");
+  auto r = primer::read<shape &>(L, -1);
+  TEST_EXPECTED(r);
+  TEST(&*r == s, "expected a reference to the shape");
+  TEST(primer::test_udata<square>(L, -1) == &sq, "expected the square");
+  TEST(!primer::test_udata<tile>(L, -1), "a square is not a tile");
+  lua_pop(L, 1);
+
+  lua_getglobal(L, "t");
+  TEST(primer::test_udata<shape>(L, -1), "expected a tile to be a shape");
+  TEST(primer::test_udata<square>(L, -1), "expected a tile to be a square");
+  lua_pop(L, 1);
+
+  lua_getglobal(L, "tri");
+  TEST(!primer::test_udata<square>(L, -1), "a shape is not a square");
+  lua_pop(L, 1);
+
+  // Borrowed elements are also accepted as their bases
+  std::vector<square> squares{square{2}, square{3}};
+  primer::push_udata_array(L, std::move(squares));
+  lua_setglobal(L, "a");
+  const char * script2 = "assert(a[2]:area() == 9 and a[2]:sides() == 4)\n"
+                         "assert(sides_twice(a[1]) == 8)                \n";
+  TEST_EXPECTED(try_load_script(L, script2));
+  TEST_EXPECTED(primer::fcn_call_no_ret(L, 0));
+  CHECK_STACK(L, 0);
+}
+
+/***
+ * Lazy iterators
+ */
+
+// Counts the elements which were converted
+struct counting_int {
+  int value;
+  static int pushed;
+};
+
+int counting_int::pushed = 0;
+
+namespace primer {
+namespace traits {
+
+template <>
+struct push<counting_int> {
+  static void to_stack(lua_State * L, const counting_int & c) {
+    ++counting_int::pushed;
+    lua_pushinteger(L, c.value);
+  }
+  static constexpr int stack_space_needed{1};
+};
+
+} // end namespace traits
+} // end namespace primer
+
+void
+test_push_iterator() {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  std::vector<counting_int> v;
+  for (int i = 1; i <= 100; ++i) {
+    v.push_back(counting_int{i * 10});
+  }
+  std::map<std::string, int> m{{"a", 1}, {"b", 2}, {"c", 3}};
+
+  lua_pushlightuserdata(L, &v);
+  lua_pushcclosure(L, [](lua_State * L) -> int {
+    const auto & vec = *static_cast<const std::vector<counting_int> *>(
+      lua_touserdata(L, lua_upvalueindex(1)));
+    primer::push_iterator(L, vec.begin(), vec.end());
+    return 3;
+  }, 1);
+  lua_setglobal(L, "items");
+
+  primer::push_iterator(L, m);
+  CHECK_STACK(L, 3);
+  lua_pushcclosure(L, [](lua_State * L) -> int {
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_pushvalue(L, lua_upvalueindex(2));
+    lua_pushvalue(L, lua_upvalueindex(3));
+    return 3;
+  }, 3);
+  lua_setglobal(L, "pairs_of_m");
+
+  const char * script = "local n = 0                                     \n"
+                        "for i, x in items() do                          \n"
+                        "  assert(x == i * 10)                           \n"
+                        "  n = n + 1                                     \n"
+                        "  if i == 3 then break end                      \n"
+                        "end                                             \n"
+                        "assert(n == 3)                                  \n"
+                        "local s = ''                                    \n"
+                        "for k, v in pairs_of_m() do s = s .. k .. v end \n"
+                        "assert(s == 'a1b2c3')                           \n"
+                        "local step = items()                            \n"
+                        "assert(not pcall(step, {}))                     \n";
+  TEST_EXPECTED(try_load_script(L, script));
+  TEST_EXPECTED(primer::fcn_call_no_ret(L, 0));
+
+  // Only the elements which the loop consumed were converted
+  TEST_EQ(counting_int::pushed, 3);
+  CHECK_STACK(L, 0);
+}
+
+/***
+ * Shared userdata
+ */
+
+void
+test_shared_udata() {
+  TEST_EQ(counted_cell::alive, 0);
+  primer::udata_holder<counted_cell> kept;
+  {
+    lua_raii L;
+    luaL_requiref(L, "", luaopen_base, 1);
+    lua_pop(L, 1);
+
+    counted_cell & c = primer::push_shared<counted_cell>(L, 7);
+    TEST_EQ(counted_cell::alive, 1);
+    TEST(primer::test_udata<counted_cell>(L, -1) == &c,
+         "expected a shared object to be a counted_cell");
+
+    auto h = primer::read<primer::udata_holder<counted_cell>>(L, -1);
+    TEST_EXPECTED(h);
+    TEST(h->get() == &c, "expected the holder to point to the object");
+    lua_pop(L, 1);
+    CHECK_STACK(L, 0);
+
+    // The holder and its copies keep the object alive
+    auto h2 = *h;
+    h->reset();
+    TEST(!*h, "expected a reset holder to be empty");
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    TEST_EQ(counted_cell::alive, 1);
+    TEST_EQ(h2->value, 7);
+
+    // The userdata can be pushed again
+    primer::push(L, h2);
+    TEST(primer::test_udata<counted_cell>(L, -1) == &c,
+         "expected the same userdata");
+    lua_setglobal(L, "c");
+    h2.reset();
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    TEST_EQ(counted_cell::alive, 1);
+
+    lua_pushnil(L);
+    lua_setglobal(L, "c");
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    TEST_EQ(counted_cell::alive, 0);
+
+    // Only shared objects give holders
+    primer::push_udata<counted_cell>(L, 3);
+    TEST(!primer::read<primer::udata_holder<counted_cell>>(L, -1),
+         "expected an error reading a holder from a plain object");
+    lua_pop(L, 1);
+
+    primer::push_shared<counted_cell>(L, 5);
+    kept = *primer::read<primer::udata_holder<counted_cell>>(L, -1);
+    lua_pop(L, 1);
+    CHECK_STACK(L, 0);
+  }
+
+  // Closing the state destroys the object and empties its holders
+  TEST_EQ(counted_cell::alive, 0);
+  TEST(!kept, "expected the holder to be empty after the state is closed");
+}
+
+/***
+ * Reference userdata
+ */
+
+void
+test_ref_udata() {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  counted_cell cells[2]{counted_cell{1}, counted_cell{2}};
+  lua_pushlightuserdata(L, cells);
+  lua_pushcclosure(L, [](lua_State * L) -> int {
+    auto * cs = static_cast<counted_cell *>(lua_touserdata(L,
+                                                           lua_upvalueindex(1)));
+    primer::push_ref(L, &cs[luaL_checkinteger(L, 1)]);
+    return 1;
+  }, 1);
+  lua_setglobal(L, "get");
+  TEST_EQ(counted_cell::alive, 2);
+
+  const char * script = "local a, b = get(0), get(1)                     \n"
+                        "assert(a ~= b)                                  \n"
+                        "assert(a == get(0))                             \n"
+                        "local t = {[a] = 'a'}                           \n"
+                        "assert(t[get(0)] == 'a')                        \n"
+                        "kept = get(1)                                   \n";
+  TEST_EXPECTED(try_load_script(L, script));
+  TEST_EXPECTED(primer::fcn_call_no_ret(L, 0));
+
+  // The userdata refers to the object, and is kept while it is alive
+  lua_getglobal(L, "kept");
+  TEST(primer::test_udata<counted_cell>(L, -1) == &cells[1],
+       "expected a reference to be a counted_cell");
+  primer::push_ref(L, &cells[1]);
+  TEST(lua_rawequal(L, -1, -2), "expected the same userdata");
+  lua_pop(L, 2);
+
+  // Once collected, a new one is made, and the object isn't destroyed
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  TEST_EQ(counted_cell::alive, 2);
+  primer::push_ref(L, &cells[0]);
+  TEST(primer::test_udata<counted_cell>(L, -1) == &cells[0],
+       "expected a reference to be a counted_cell");
+  lua_pop(L, 1);
+
+  // An invalidated userdata is empty, and a new one is made
+  primer::invalidate_ref(L, &cells[1]);
+  lua_getglobal(L, "kept");
+  TEST(!primer::test_udata<counted_cell>(L, -1),
+       "expected an invalidated reference to be empty");
+  primer::push_ref(L, &cells[1]);
+  TEST(!lua_rawequal(L, -1, -2), "expected a new userdata");
+  TEST(primer::test_udata<counted_cell>(L, -1) == &cells[1],
+       "expected a reference to be a counted_cell");
+  lua_pop(L, 2);
+
+  primer::push_ref(L, &cells[0]);
+  primer::clear_refs<counted_cell>(L);
+  TEST(!primer::test_udata<counted_cell>(L, -1),
+       "expected a cleared reference to be empty");
+  lua_pop(L, 1);
+
+  primer::push_ref<counted_cell>(L, nullptr);
+  TEST(lua_isnil(L, -1), "expected nil for a null pointer");
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
+}
+
+void
+test_std_function() {
+  lua_raii L;
+
+  //[ primer_example_std_function
+  std::function<primer::result(lua_State * L, int x, int y)> f =
+    [](lua_State * L, int x, int y) -> primer::result {
+    if (y == x) { return primer::error{"bad input"}; }
+    lua_pushinteger(L, x - y);
+    return 1;
+  };
+
+  primer::push_std_function(L, std::move(f));
+  //]
+
+  CHECK_STACK(L, 1);
+
+  {
+    lua_pushvalue(L, 1);
+
+    lua_pushinteger(L, 3);
+    lua_pushinteger(L, 2);
+
+    auto result = primer::fcn_call_one_ret(L, 2);
+    CHECK_STACK(L, 1);
+    TEST_EXPECTED(result);
+    auto maybe_int = result->as<int>();
+    CHECK_STACK(L, 1);
+    TEST_EXPECTED(maybe_int);
+    TEST_EQ(*maybe_int, 1);
+  }
+
+  {
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 4);
+    lua_pushinteger(L, 4);
+
+    auto result = primer::fcn_call_one_ret(L, 2);
+    CHECK_STACK(L, 1);
+    TEST(!result, "expected failure");
+  }
+}
+
+void
+test_ref_proxy() {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  std::vector<std::string> v{"a", "b", "c"};
+  std::map<std::string, int> m{{"x", 1}, {"y", 2}};
+
+  primer::push(L, primer::make_ref_proxy(v));
+  lua_setglobal(L, "v");
+  primer::push(L, primer::make_ref_proxy(m));
+  lua_setglobal(L, "m");
+  CHECK_STACK(L, 0);
+
+  const char * script =
+    ""
+    "assert(type(v) == 'userdata')                  \n"
+    "assert(#v == 3)                                \n"
+    "assert(v[1] == 'a' and v[3] == 'c')            \n"
+    "assert(v[0] == nil and v[4] == nil)            \n"
+    "assert(v.foo == nil)                           \n"
+    "local s = ''                                   \n"
+    "for i, x in pairs(v) do s = s .. i .. x end    \n"
+    "assert(s == '1a2b3c')                          \n"
+    "assert(#m == 2)                                \n"
+    "assert(m.x == 1 and m.y == 2 and m.z == nil)   \n"
+    "assert(m[1] == nil)                            \n"
+    "local total = 0                                \n"
+    "for k, x in pairs(m) do total = total + x end  \n"
+    "assert(total == 3)                             \n"
+    "local f = pairs(m)                             \n"
+    "assert(not pcall(f, {}, nil))                  \n";
+
+  TEST_EXPECTED(try_load_script(L, script));
+  auto result = primer::fcn_call_no_ret(L, 0);
+  TEST_EXPECTED(result);
+
+  // Changes to the object are visible through the proxy
+  v[1] = "q";
+  TEST_EXPECTED(try_load_script(L, "assert(v[2] == 'q')"));
+  result = primer::fcn_call_no_ret(L, 0);
+  TEST_EXPECTED(result);
+
+  // A tracked proxy raises an error once the object is gone
+  {
+    nonstd::weakly_referenced<std::vector<int>> w{std::vector<int>{4, 5}};
+    primer::push(L, primer::make_ref_proxy(w));
+    lua_setglobal(L, "w");
+    TEST_EXPECTED(try_load_script(L, "assert(#w == 2 and w[2] == 5)"));
+    result = primer::fcn_call_no_ret(L, 0);
+    TEST_EXPECTED(result);
+  }
+  TEST_EXPECTED(try_load_script(L, "return w[1]"));
+  result = primer::fcn_call_no_ret(L, 0);
+  TEST(!result, "expected an error");
+  TEST(result.err().str().find("gone") != std::string::npos,
+       "unexpected error: " << result.err().str());
+
+  CHECK_STACK(L, 0);
+}
+
+void
+test_push_closure() {
+  lua_raii L;
+
+  //[ primer_example_push_closure
+  int offset = 10;
+  primer::push_closure(L, [offset](lua_State * L, int x) -> primer::result {
+    if (x < 0) { return primer::error{"bad input"}; }
+    lua_pushinteger(L, x + offset);
+    return 1;
+  });
+  //]
+
+  CHECK_STACK(L, 1);
+
+  // Trivially destructible, so no metatable is needed
+  lua_getupvalue(L, 1, 1);
+  TEST(lua_isuserdata(L, -1), "expected a userdata upvalue");
+  TEST(!lua_getmetatable(L, -1), "expected no metatable");
+  lua_pop(L, 1);
+
+  {
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, 5);
+    auto result = primer::fcn_call_one_ret(L, 1);
+    CHECK_STACK(L, 1);
+    TEST_EXPECTED(result);
+    auto maybe_int = result->as<int>();
+    TEST_EXPECTED(maybe_int);
+    TEST_EQ(*maybe_int, 15);
+  }
+
+  {
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, -5);
+    auto result = primer::fcn_call_one_ret(L, 1);
+    CHECK_STACK(L, 1);
+    TEST(!result, "expected failure");
+  }
+
+  lua_pop(L, 1);
+
+  // Mutable state, and a non-trivial destructor
+  std::string prefix{"item "};
+  int count = 0;
+  for (int i = 0; i < 3; ++i) {
+    primer::push_closure(L, [prefix, count](lua_State * L) mutable
+                         -> primer::result {
+                           ++count;
+                           primer::push(L, prefix + std::to_string(count));
+                           return 1;
+                         });
+  }
+  CHECK_STACK(L, 3);
+
+  lua_getupvalue(L, 1, 1);
+  TEST(lua_getmetatable(L, -1), "expected a metatable");
+  lua_pop(L, 2);
+
+  lua_pushvalue(L, 1);
+  TEST_EXPECTED(primer::fcn_call_one_ret(L, 0));
+  lua_pushvalue(L, 1);
+  auto result = primer::fcn_call_one_ret(L, 0);
+  TEST_EXPECTED(result);
+  auto maybe_str = result->as<std::string>();
+  TEST_EXPECTED(maybe_str);
+  TEST_EQ(*maybe_str, "item 2");
+
+  // Closures are collected
+  lua_settop(L, 0);
+  lua_gc(L, LUA_GCCOLLECT, 0);
+}
+
+// Opt-in to typed arrays
+namespace primer {
+namespace traits {
+
+template <>
+struct use_typed_array<std::vector<double>> : std::true_type {};
+
+template <>
+struct use_typed_array<std::array<double, 3>> : std::true_type {};
+
+} // end namespace traits
+} // end namespace primer
+
+static_assert(!primer::traits::use_typed_array<std::vector<int>>::value,
+              "typed arrays should be opt-in");
+
+primer::result
+typed_array_sum(lua_State * L, const primer::typed_array<double> & a) {
+  double total = 0;
+  for (double d : a) {
+    total += d;
+  }
+  primer::push(L, total);
+  return 1;
+}
+
+void
+test_typed_array() {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1); // remove lib
+
+  round_trip_value(L, std::vector<double>{}, __LINE__);
+  round_trip_value(L, std::vector<double>{1.5, -2, 3.25}, __LINE__);
+  round_trip_value(L, std::array<double, 3>{{1, -5, 2932}}, __LINE__);
+
+  primer::push(L, std::vector<double>{1.5, -2, 3.25});
+  test_top_type(L, LUA_TUSERDATA, __LINE__);
+  CHECK_STACK(L, 1);
+
+  {
+    auto * a = primer::test_udata<primer::typed_array<double>>(L, 1);
+    TEST(a, "did not recover typed array from stack");
+    TEST_EQ(a->size(), 3u);
+    TEST_EQ((*a)[2], 3.25);
+  }
+
+  const char * const script =
+    ""
+    "local a, sum = ...                             \n"
+    "assert(#a == 3)                                \n"
+    "assert(a[1] == 1.5)                            \n"
+    "assert(a[4] == nil)                            \n"
+    "a[2] = 10                                      \n"
+    "assert(a[2] == 10)                             \n"
+    "assert(not pcall(function() a[4] = 1 end))     \n"
+    "assert(not pcall(function() a[1] = 'x' end))   \n"
+    "return sum(a)                                  \n";
+
+  TEST_EXPECTED(try_load_script(L, script));
+  lua_pushvalue(L, 1);
+  lua_pushcfunction(L, PRIMER_ADAPT(&typed_array_sum));
+  {
+    auto result = primer::fcn_call_one_ret(L, 2);
+    TEST_EXPECTED(result);
+    auto maybe_double = result->as<double>();
+    TEST_EXPECTED(maybe_double);
+    TEST_EQ(*maybe_double, 14.75);
+  }
+  CHECK_STACK(L, 1);
+
+  // Writes from lua are visible
+  {
+    auto vec = primer::read<std::vector<double>>(L, 1);
+    TEST_EXPECTED(vec);
+    TEST_EQ(vec->size(), 3u);
+    TEST_EQ((*vec)[1], 10);
+  }
+  lua_pop(L, 1);
+
+  // Tables are still accepted
+  primer::push(L, std::vector<int>{4, 5});
+  {
+    auto vec = primer::read<std::vector<double>>(L, 1);
+    TEST_EXPECTED(vec);
+    TEST_EQ(vec->size(), 2u);
+    TEST_EQ((*vec)[1], 5);
+  }
+  lua_pop(L, 1);
+
+  // Wrong element type
+  primer::push_typed_array<float>(L, nullptr, 2);
+  TEST(!primer::read<std::vector<double>>(L, 1), "expected failure");
+  lua_pop(L, 1);
+  CHECK_STACK(L, 0);
+}
+
+double
+vectorized_lerp(double a, double b, double t) {
+  return a + (b - a) * t;
+}
+
+int
+vectorized_square(int x) {
+  return x * x;
+}
+
+void
+test_adapt_vectorized() {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1); // remove lib
+
+  lua_pushcfunction(L, PRIMER_ADAPT_VECTORIZED(&vectorized_lerp));
+  lua_setglobal(L, "lerp");
+  lua_pushcfunction(L, PRIMER_ADAPT_VECTORIZED(&vectorized_square));
+  lua_setglobal(L, "square");
+
+  primer::push(L, std::vector<double>{0, 10, 20});
+  lua_setglobal(L, "a");
+  primer::push(L, std::vector<double>{10, 20, 40});
+  lua_setglobal(L, "b");
+  primer::push(L, std::vector<double>{0.5});
+  lua_setglobal(L, "half");
+  primer::push(L, std::vector<double>{1, 2});
+  lua_setglobal(L, "short");
+  primer::push_typed_array<int>(L, nullptr, 3);
+  lua_setglobal(L, "ints");
+
+  const char * const script =
+    ""
+    "assert(lerp(0, 10, 0.5) == 5)                              \n"
+    "local r = lerp(a, b, 0.5)                                  \n"
+    "assert(#r == 3 and r[1] == 5 and r[2] == 15 and r[3] == 30) \n"
+    "r = lerp(a, b, half)                                       \n"
+    "assert(r[3] == 30)                                         \n"
+    "local out = lerp(a, b, 0)                                  \n"
+    "assert(lerp(a, b, b, out) == out)                          \n"
+    "assert(out[1] == 100 and out[3] == 820)                    \n"
+    "assert(not pcall(lerp, a, short, 0))                       \n"
+    "assert(not pcall(lerp, a, b, 'x'))                         \n"
+    "assert(not pcall(lerp, a, b, ints))                        \n"
+    "assert(not pcall(lerp, a, b, 0, short))                    \n"
+    "assert(not pcall(lerp, a, b, 0, ints))                     \n"
+    "ints[1] = 2 ints[2] = -3                                   \n"
+    "r = square(ints)                                           \n"
+    "assert(r[1] == 4 and r[2] == 9 and r[3] == 0)              \n"
+    "assert(square(ints, ints) == ints and ints[2] == 9)        \n"
+    "assert(not pcall(square, 1.5))                             \n";
+
+  TEST_EXPECTED(try_load_script(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  CHECK_STACK(L, 0);
+}
+
+// Rows of a matrix of doubles are typed arrays
+namespace primer {
+namespace traits {
+
+template <>
+struct use_typed_array<primer::matrix<double>> : std::true_type {};
+
+} // end namespace traits
+} // end namespace primer
+
+void
+test_matrix() {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1); // remove lib
+
+  {
+    primer::matrix<int> m{2, 3};
+    for (std::size_t i = 0; i < m.size(); ++i) {
+      m.data()[i] = static_cast<int>(i);
+    }
+    TEST_EQ(m(1, 2), 5);
+
+    primer::push(L, m);
+    test_top_type(L, LUA_TTABLE, __LINE__);
+    auto back = primer::read<primer::matrix<int>>(L, 1);
+    TEST_EXPECTED(back);
+    TEST(*back == m, "matrix did not round trip");
+    lua_pop(L, 1);
+  }
+
+  const char * const script =
+    ""
+    "return { {1, 2, 3}, {4, 5, 6}, {7, 8, 9}, {10, 11, 12} }, \n"
+    "       { {1, 2}, {3} },                                   \n"
+    "       { {1, 2}, {3, 'x'} },                              \n"
+    "       { 5 },                                             \n"
+    "       {}                                                 \n";
+
+  TEST_EXPECTED(try_load_script(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 5, 0));
+  CHECK_STACK(L, 5);
+
+  {
+    auto m = primer::read<primer::matrix<double>>(L, 1);
+    TEST_EXPECTED(m);
+    TEST_EQ(m->rows(), 4u);
+    TEST_EQ(m->cols(), 3u);
+    TEST_EQ(m->row(2)[1], 8);
+    TEST_EQ((*m)(3, 2), 12);
+  }
+
+  {
+    auto m = primer::read<primer::matrix<int>>(L, 2);
+    TEST(!m, "expected a failure");
+    TEST(m.err().str().find("In index [2]") != std::string::npos,
+         "unexpected error: " << m.err().str());
+  }
+
+  {
+    auto m = primer::read<primer::matrix<int>>(L, 3);
+    TEST(!m, "expected a failure");
+    TEST(m.err().str().find("In index [2]") != std::string::npos,
+         "unexpected error: " << m.err().str());
+  }
+
+  TEST(!primer::read<primer::matrix<int>>(L, 4), "expected a failure");
+
+  {
+    auto m = primer::read<primer::matrix<int>>(L, 5);
+    TEST_EXPECTED(m);
+    TEST(m->empty(), "expected an empty matrix");
+  }
+  lua_settop(L, 0);
+
+  // With typed array rows
+  {
+    primer::matrix<double> m{2, 2};
+    m(0, 0) = 1.5;
+    m(1, 1) = -4;
+    primer::push(L, m);
+    lua_rawgeti(L, 1, 2);
+    auto * a = primer::test_udata<primer::typed_array<double>>(L, -1);
+    TEST(a, "expected a typed array row");
+    TEST_EQ(a->size(), 2u);
+    TEST_EQ((*a)[1], -4);
+    lua_pop(L, 1);
+
+    auto back = primer::read<primer::matrix<double>>(L, 1);
+    TEST_EXPECTED(back);
+    TEST(*back == m, "matrix did not round trip");
+  }
+  lua_settop(L, 0);
+  CHECK_STACK(L, 0);
+}
+
+void
+test_cached() {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1); // remove lib
+
+  using cached_t = primer::cached<std::vector<int>>;
+
+  const char * const script =
+    ""
+    "return { 1, 2, 3 }, { 4, 'x' }, 7 \n";
+
+  TEST_EXPECTED(try_load_script(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 3, 0));
+  CHECK_STACK(L, 3);
+
+  const std::vector<int> * first = nullptr;
+  {
+    auto a = primer::read<cached_t>(L, 1);
+    TEST_EXPECTED(a);
+    TEST_EQ(a->get().size(), 3u);
+    TEST_EQ((**a)[2], 3);
+    first = &a->get();
+
+    // The same table gives the same value, without reading it again
+    auto b = primer::read<cached_t>(L, 1);
+    TEST_EXPECTED(b);
+    TEST(&b->get() == first, "expected the cached conversion");
+    CHECK_STACK(L, 3);
+  }
+
+  {
+    auto c = primer::read<cached_t>(L, 2);
+    TEST(!c, "expected a failure");
+    TEST(c.err().str().find("In index [2]") != std::string::npos,
+         "unexpected error: " << c.err().str());
+    CHECK_STACK(L, 3);
+  }
+
+  // Not a table, so converted each time
+  TEST(!primer::read<cached_t>(L, 3), "expected a failure");
+
+  // A changed table is seen once it is invalidated
+  {
+    auto held = primer::read<cached_t>(L, 1);
+    TEST_EXPECTED(held);
+
+    lua_pushinteger(L, 9);
+    lua_rawseti(L, 1, 4);
+
+    auto stale = primer::read<cached_t>(L, 1);
+    TEST_EXPECTED(stale);
+    TEST_EQ(stale->get().size(), 3u);
+
+    primer::invalidate_cached<std::vector<int>>(L, 1);
+    CHECK_STACK(L, 3);
+
+    auto fresh = primer::read<cached_t>(L, 1);
+    TEST_EXPECTED(fresh);
+    TEST_EQ(fresh->get().size(), 4u);
+    TEST_EQ(fresh->get()[3], 9);
+
+    // The value which was held is still alive
+    TEST_EQ(held->get().size(), 3u);
+
+    primer::clear_cached<std::vector<int>>(L);
+    CHECK_STACK(L, 3);
+
+    auto again = primer::read<cached_t>(L, 1);
+    TEST_EXPECTED(again);
+    TEST(&again->get() != &fresh->get(), "expected a new conversion");
+    TEST_EQ(again->get().size(), 4u);
+  }
+
+  lua_settop(L, 0);
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  CHECK_STACK(L, 0);
+}
+
+void
+test_transfer() {
+  lua_raii L1;
+  lua_raii L2;
+  for (lua_State * L : {static_cast<lua_State *>(L1),
+                        static_cast<lua_State *>(L2)}) {
+    luaL_requiref(L, "", luaopen_base, 1);
+    lua_pop(L, 1);
+    lua_pushcfunction(L, PRIMER_ADAPT(&vec2_ctor));
+    lua_setglobal(L, "vec2");
+  }
+
+  const char * const script =
+    ""
+    "local t = { a = 1, b = 's\\0z', c = { 1, 2, 3 }, d = true, f = 1.5 }  \n"
+    "t.self = t                                                        \n"
+    "t.shared = t.c                                                    \n"
+    "t[t.c] = 'table key'                                              \n"
+    "t.v = vec2(1, 2)                                                  \n"
+    "t.w = t.v                                                         \n"
+    "return t                                                          \n";
+  TEST_EXPECTED(try_load_script(L1, script));
+  auto t = primer::fcn_call_one_ret(L1, 0);
+  TEST_EXPECTED(t);
+
+  // The userdata type must be registered first
+  TEST(!primer::transfer(*t, L2), "expected failure");
+  CHECK_STACK(L2, 0);
+  primer::register_transfer<vec2_test>(L1);
+
+  auto copy = primer::transfer(*t, L2);
+  TEST_EXPECTED(copy);
+  CHECK_STACK(L1, 0);
+  CHECK_STACK(L2, 0);
+
+  const char * const check =
+    ""
+    "local t = ...                                                     \n"
+    "assert(t.a == 1)                                                  \n"
+    "assert(t.b == 's\\0z' and #t.b == 3)                               \n"
+    "assert(#t.c == 3 and t.c[3] == 3)                                 \n"
+    "assert(t.d == true and t.f == 1.5)                                \n"
+    "assert(t.self == t)                                               \n"
+    "assert(t.shared == t.c)                                           \n"
+    "assert(t[t.c] == 'table key')                                     \n"
+    "assert(t.w == t.v)                                                \n"
+    "local x, y = t.v:dump()                                           \n"
+    "assert(x == 1 and y == 2)                                         \n";
+  TEST_EXPECTED(try_load_script(L2, check));
+  TEST(copy->push(), "expected push to succeed");
+  TEST_EXPECTED(primer::fcn_call_no_ret(L2, 1));
+
+  // Functions and tables with metatables are not plain data
+  TEST_EXPECTED(try_load_script(L1, "return { f = print }"));
+  auto with_f = primer::fcn_call_one_ret(L1, 0);
+  TEST_EXPECTED(with_f);
+  TEST(!primer::transfer(*with_f, L2), "expected failure");
+  TEST_EXPECTED(try_load_script(L1, "return setmetatable({}, {})"));
+  auto with_mt = primer::fcn_call_one_ret(L1, 0);
+  TEST_EXPECTED(with_mt);
+  TEST(!primer::transfer(*with_mt, L2), "expected failure");
+
+  lua_pushcfunction(L1, PRIMER_ADAPT(&vec2_ctor));
+  TEST(!primer::transfer_value(L1, -1, L2), "expected failure");
+  CHECK_STACK(L1, 1);
+  CHECK_STACK(L2, 0);
+  lua_pop(L1, 1);
+}
+
+void
+test_deep_copy() {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+  lua_pushcfunction(L, PRIMER_ADAPT(&vec2_ctor));
+  lua_setglobal(L, "vec2");
+  lua_pushcfunction(L, &primer::intf_deep_copy);
+  lua_setglobal(L, "deepcopy");
+
+  auto run = [&](const char * code) {
+    TEST_EXPECTED(try_load_script(L, code));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+  };
+
+  const char * const script =
+    ""
+    "local mt = { __index = function() return 'default' end }          \n"
+    "local t = { a = 1, b = 'str', c = { 1, 2, 3 }, f = print }        \n"
+    "t.self = t                                                        \n"
+    "t.shared = t.c                                                    \n"
+    "t[t.c] = 'table key'                                              \n"
+    "t.m = setmetatable({ x = 1 }, mt)                                 \n"
+    "t.v = vec2(1, 2)                                                  \n"
+    "t.w = t.v                                                         \n"
+    "return t, mt                                                      \n";
+  TEST_EXPECTED(try_load_script(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 2, 0));
+  lua_setglobal(L, "mt");
+  lua_setglobal(L, "t");
+
+  // Unregistered userdata are shared
+  run(""
+    "local u = deepcopy(t)                                             \n"
+    "assert(u ~= t and u.self == u)                                    \n"
+    "assert(u.c ~= t.c and u.shared == u.c and #u.c == 3)              \n"
+    "assert(u[u.c] == 'table key' and u[t.c] == nil)                   \n"
+    "assert(u.a == 1 and u.b == 'str' and u.f == print)                \n"
+    "assert(u.m ~= t.m and getmetatable(u.m) == mt)                    \n"
+    "assert(u.m.x == 1 and u.m.y == 'default')                         \n"
+    "assert(u.v == t.v)                                                \n"
+    "u.c[1] = 5                                                        \n"
+    "assert(t.c[1] == 1)                                               \n"
+    "assert(deepcopy(5) == 5 and deepcopy(nil) == nil)                 \n");
+  CHECK_STACK(L, 0);
+
+  primer::register_transfer<vec2_test>(L);
+  lua_getglobal(L, "t");
+  auto t = primer::lua_ref{L};
+  auto copy = primer::deep_copy(t);
+  TEST_EXPECTED(copy);
+  CHECK_STACK(L, 0);
+
+  TEST(copy->push(), "expected push to succeed");
+  lua_setglobal(L, "u");
+  run(""
+    "assert(u ~= t and u.self == u)                                    \n"
+    "assert(u.v ~= t.v and u.w == u.v)                                 \n"
+    "local x, y = u.v:dump()                                           \n"
+    "assert(x == 1 and y == 2)                                         \n");
+
+  // Too deep
+  run(""
+    "local d = {}                                                      \n"
+    "for i = 1, 300 do d = { d } end                                   \n"
+    "deep = d                                                          \n");
+  lua_getglobal(L, "deep");
+  TEST(!primer::deep_copy_value(L, -1), "expected failure");
+  CHECK_STACK(L, 1);
+  lua_pop(L, 1);
+}
+
+void
+test_shared_buffer() {
+  lua_raii L1;
+  lua_raii L2;
+
+  auto buf = primer::shared_buffer<double>{std::vector<double>{1.5, -2, 4}};
+  TEST_EQ(buf.size(), 3u);
+  TEST_EQ(buf.use_count(), 1);
+
+  const char * const script =
+    ""
+    "local b, c = ...                                \n"
+    "assert(#b == 3)                                 \n"
+    "assert(b[1] == 1.5 and b[3] == 4)               \n"
+    "assert(b[0] == nil and b[4] == nil)             \n"
+    "assert(not pcall(function() b[1] = 2 end))      \n"
+    "assert(b == c)                                  \n"
+    "return b                                        \n";
+
+  for (lua_State * L : {static_cast<lua_State *>(L1),
+                        static_cast<lua_State *>(L2)}) {
+    luaL_requiref(L, "", luaopen_base, 1);
+    lua_pop(L, 1);
+
+    TEST_EXPECTED(try_load_script(L, script));
+    primer::push(L, buf);
+    primer::push(L, buf);
+    auto result = primer::fcn_call_one_ret(L, 2);
+    TEST_EXPECTED(result);
+
+    // The same block comes back, without a copy
+    auto back = result->as<primer::shared_buffer<double>>();
+    TEST_EXPECTED(back);
+    TEST(back->data() == buf.data(), "expected the same block");
+    CHECK_STACK(L, 0);
+  }
+  // One handle here, and one userdata in each VM
+  TEST_EQ(buf.use_count(), 3);
+
+  lua_pushinteger(L1, 5);
+  TEST(!primer::read<primer::shared_buffer<double>>(L1, -1),
+       "expected failure");
+  lua_pop(L1, 1);
+
+  auto bytes = primer::shared_buffer<unsigned char>::copy_of(
+    reinterpret_cast<const unsigned char *>("abc"), 3);
+  primer::push(L1, bytes);
+  lua_len(L1, -1);
+  TEST_EQ(lua_tointeger(L1, -1), 3);
+  lua_pop(L1, 2);
+}
+
+void
+test_table_pool() {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  primer::table_pool pool{L};
+  std::vector<std::map<std::string, int>> frame{{{"x", 1}, {"y", 2}},
+                                                {{"z", 3}}};
+
+  pool.push(L, frame);
+  const void * outer = lua_topointer(L, -1);
+  lua_rawgeti(L, -1, 1);
+  const void * inner = lua_topointer(L, -1);
+  lua_pop(L, 2);
+  TEST_EQ(pool.lent(), 3u);
+  TEST_EQ(pool.spare(), 0u);
+
+  pool.recycle(L);
+  TEST_EQ(pool.lent(), 0u);
+  TEST_EQ(pool.spare(), 3u);
+  CHECK_STACK(L, 0);
+
+  // The next frame gets the same tables, cleared
+  frame[0].erase("y");
+  const char * const script =
+    ""
+    "local t = ...                                                     \n"
+    "assert(#t == 2)                                                   \n"
+    "assert(t[1].x == 1 and t[1].y == nil)                             \n"
+    "assert(t[2].z == 3 and t[2].x == nil)                             \n";
+  TEST_EXPECTED(try_load_script(L, script));
+  pool.push(L, frame);
+  TEST(lua_topointer(L, -1) == outer, "expected the table to be reused");
+  lua_rawgeti(L, -1, 1);
+  TEST(lua_topointer(L, -1) == inner, "expected the table to be reused");
+  lua_pop(L, 1);
+  TEST_EQ(pool.spare(), 0u);
+  TEST_LUA_OK(L, lua_pcall(L, 1, 0, 0));
+  pool.recycle(L);
+
+  // Nested in a pair, and mixed with values which are not tables
+  pool.push(L, std::make_pair(5, std::vector<int>{1, 2, 3}));
+  TEST_EQ(pool.lent(), 2u);
+  TEST_EQ(pool.spare(), 1u);
+  lua_rawgeti(L, -1, 2);
+  TEST_EQ(lua_rawlen(L, -1), 3u);
+  lua_pop(L, 2);
+  pool.recycle(L);
+  TEST_EQ(pool.spare(), 3u);
+
+  // A plain push doesn't touch the pool
+  primer::push(L, frame);
+  TEST(lua_topointer(L, -1) != outer, "expected a new table");
+  lua_pop(L, 1);
+  TEST_EQ(pool.spare(), 3u);
+  CHECK_STACK(L, 0);
+}
+
+void
+test_push_into() {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  std::map<std::string, std::vector<int>> state{{"a", {1, 2, 3}},
+                                                 {"b", {4}}};
+  primer::push(L, state);
+  lua_pushvalue(L, -1);
+  lua_setglobal(L, "state");
+  lua_getfield(L, -1, "a");
+  const void * inner = lua_topointer(L, -1);
+  lua_pop(L, 1);
+
+  // A script holds the tables, and adds a key which is not in the map
+  const char * const script =
+    ""
+    "held = state.a                                                    \n"
+    "state.junk = true                                                 \n";
+  TEST_EXPECTED(try_load_script(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  state["a"] = {1, 5};
+  state.erase("b");
+  state["c"] = {6, 7};
+  TEST_EXPECTED(primer::push_into(L, -1, state));
+  CHECK_STACK(L, 1);
+  lua_getfield(L, -1, "a");
+  TEST(lua_topointer(L, -1) == inner, "expected the table to be kept");
+  lua_pop(L, 1);
+
+  const char * const check =
+    ""
+    "assert(held == state.a)                                           \n"
+    "assert(#held == 2 and held[1] == 1 and held[2] == 5)              \n"
+    "assert(held[3] == nil)                                            \n"
+    "assert(state.b == nil and state.junk == nil)                      \n"
+    "assert(#state.c == 2 and state.c[2] == 7)                         \n";
+  TEST_EXPECTED(try_load_script(L, check));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  // The result is what `push` gives
+  auto copy = primer::read<decltype(state)>(L, -1);
+  TEST_EXPECTED(copy);
+  TEST(*copy == state, "expected the same contents");
+
+  // A value which is not a table is an error
+  lua_pushinteger(L, 5);
+  TEST(!primer::push_into(L, -1, state), "expected an error");
+  lua_pop(L, 2);
+  CHECK_STACK(L, 0);
 }
 
 int
@@ -659,14 +2468,36 @@ main() {
     {"map push", &test_map_push},
     {"set push", &test_set_push},
     {"vector roundtrip", &test_vector_round_trip},
+    {"vector read arithmetic", &test_vector_read_arithmetic},
+    {"read into", &test_read_into},
+    {"read with allocator", &test_read_allocator},
     {"array roundtrip", &test_array_round_trip},
     {"pair roundtrip", &test_pair_round_trip},
     {"map roundtrip", &test_map_round_trip},
     {"set roundtrip", &test_set_round_trip},
-    {"unordered map roundtrip", &test_map_round_trip},
+    {"unordered map roundtrip", &test_unordered_map_round_trip},
     {"userdata", &test_userdata},
     {"userdata two", &test_userdata_two},
+    {"userdata finalizers", &test_userdata_finalizers},
+    {"slab userdata", &test_slab_userdata},
+    {"push by move", &test_push_by_move},
+    {"udata array", &test_udata_array},
+    {"udata inheritance", &test_udata_inheritance},
+    {"shared udata", &test_shared_udata},
+    {"ref udata", &test_ref_udata},
+    {"push iterator", &test_push_iterator},
     {"std function", &test_std_function},
+    {"push closure", &test_push_closure},
+    {"ref proxy", &test_ref_proxy},
+    {"typed array", &test_typed_array},
+    {"adapt vectorized", &test_adapt_vectorized},
+    {"matrix", &test_matrix},
+    {"cached", &test_cached},
+    {"transfer", &test_transfer},
+    {"deep copy", &test_deep_copy},
+    {"shared buffer", &test_shared_buffer},
+    {"table pool", &test_table_pool},
+    {"push into", &test_push_into},
   };
   int num_fails = tests.run();
   std::cout << "\n";
@@ -22,5 +22,17 @@ main() {
   std::string s4{primer::detail::str_cat("a", 5, "b")};
   assert(s4 == "a5b");
 
+  std::string s5{primer::detail::str_cat("a", std::string{"bc"}, -12, 'd')};
+  assert(s5 == "abc-12100");
+
+  std::string s6{primer::detail::str_cat(0u, " ", -9223372036854775807LL - 1)};
+  assert(s6 == "0 -9223372036854775808");
+
+  std::string s7{primer::detail::str_cat(1.5, " ", 0.1f, " ", 2.0)};
+  assert(s7 == "1.5 0.10000000149012 2");
+
+  std::string s8{primer::detail::str_cat()};
+  assert(s8.empty());
+
   std::cout << "OK!" << std::endl;
 }
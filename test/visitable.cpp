@@ -1,8 +1,11 @@
 #include <primer/primer.hpp>
 #include <primer/visit_struct.hpp>
 
+#include <primer/api/base.hpp>
 #include <primer/api/callback_registrar.hpp>
 #include <primer/api/callbacks.hpp>
+#include <primer/api/libraries.hpp>
+#include <primer/api/userdatas.hpp>
 
 #include "test_harness/test_harness.hpp"
 #include <iostream>
@@ -24,9 +27,80 @@ struct bar {
   END_VISITABLES;
 };
 
+struct sparse {
+  primer::truthy x;
+  primer::truthy y;
+  int z;
+};
+
+struct strict {
+  int a;
+  primer::truthy b;
+};
+
+struct point {
+  double x;
+  double y;
+  std::string tag;
+};
+
+struct color {
+  float r;
+  float g;
+  float b;
+};
+
+struct label {
+  std::string text;
+  int size;
+};
+
 } // end namespace test
 
 VISITABLE_STRUCT(test::foo, a, b, c);
+VISITABLE_STRUCT(test::sparse, x, y, z);
+VISITABLE_STRUCT(test::strict, a, b);
+VISITABLE_STRUCT(test::point, x, y, tag);
+VISITABLE_STRUCT(test::color, r, g, b);
+VISITABLE_STRUCT(test::label, text, size);
+
+namespace primer {
+namespace traits {
+
+template <>
+struct visitable_read<test::sparse>
+  : visitable_read_mode<visitable_read_strategy::single_pass> {};
+
+template <>
+struct visitable_read<test::strict>
+  : visitable_read_mode<visitable_read_strategy::single_pass_strict> {};
+
+template <>
+struct visitable_layout<test::point>
+  : visitable_layout_mode<visitable_layout_style::positional> {};
+
+template <>
+struct visitable_layout<test::color>
+  : visitable_layout_mode<visitable_layout_style::value_userdata> {};
+
+template <>
+struct visitable_layout<test::label>
+  : visitable_layout_mode<visitable_layout_style::value_userdata> {};
+
+} // end namespace traits
+} // end namespace primer
+
+// Stack space is computed at compile-time from the fields
+static_assert(primer::stack_space_for_push<test::foo>() == 4,
+              "unexpected stack space for foo");
+static_assert(primer::stack_space_for_push<test::bar>() == 7,
+              "unexpected stack space for bar");
+static_assert(primer::stack_space_for_read<test::foo>() == 3,
+              "unexpected stack space for foo");
+static_assert(primer::stack_space_for_read<test::bar>() == 5,
+              "unexpected stack space for bar");
+static_assert(primer::stack_space_for_push_each<int, test::bar>() == 8,
+              "unexpected stack space for push_each");
 
 UNIT_TEST(visitable_push) {
 
@@ -144,6 +218,90 @@ UNIT_TEST(visitable_read) {
   TEST_EQ(result->a, 10);
   TEST_EQ(result->b, false);
   TEST_EQ(result->c, 8.5f);
+
+  test::foo existing{true, 1, 1.0f};
+  TEST_EXPECTED(primer::read_into(L, 1, existing));
+  TEST_EQ(existing.a, 10);
+  TEST_EQ(existing.b, false);
+  TEST_EQ(existing.c, 8.5f);
+  CHECK_STACK(L, 1);
+}
+
+UNIT_TEST(visitable_read_single_pass) {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1); // remove lib
+
+  TEST_EXPECTED(try_load_script(L, "return { y = 1, z = 5, w = 'extra' }"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  CHECK_STACK(L, 1);
+
+  {
+    auto result = primer::read<test::sparse>(L, 1);
+    TEST_EXPECTED(result);
+    TEST_EQ(result->x.value, false);
+    TEST_EQ(result->y.value, true);
+    TEST_EQ(result->z, 5);
+  }
+  CHECK_STACK(L, 1);
+  lua_pop(L, 1);
+
+  // Missing fields are still read from nil, and can fail
+  TEST_EXPECTED(try_load_script(L, "return { x = true }"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  {
+    auto result = primer::read<test::sparse>(L, 1);
+    TEST(!result, "expected failure");
+    TEST(result.err().str().find("'z'") != std::string::npos,
+         "expected field name in error: " << result.err().str());
+  }
+  CHECK_STACK(L, 1);
+  lua_pop(L, 1);
+
+  // Fields which did not appear are looked up, if there is a metatable which
+  // could supply them, as when reading per field
+  TEST_EXPECTED(try_load_script(
+    L, "return setmetatable({ y = 1 }, { __index = { x = 2, z = 7 } })"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  {
+    auto result = primer::read<test::sparse>(L, 1);
+    TEST_EXPECTED(result);
+    TEST_EQ(result->x.value, true);
+    TEST_EQ(result->y.value, true);
+    TEST_EQ(result->z, 7);
+  }
+  CHECK_STACK(L, 1);
+  lua_pop(L, 1);
+
+  // Field errors during the pass leave the stack balanced
+  TEST_EXPECTED(try_load_script(L, "return { z = 'five' }"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  TEST(!primer::read<test::sparse>(L, 1), "expected failure");
+  CHECK_STACK(L, 1);
+  lua_pop(L, 1);
+
+  // Strict mode rejects unknown keys
+  TEST_EXPECTED(try_load_script(L, "return { a = 3, b = true }"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  {
+    auto result = primer::read<test::strict>(L, 1);
+    TEST_EXPECTED(result);
+    TEST_EQ(result->a, 3);
+    TEST_EQ(result->b.value, true);
+  }
+  lua_pop(L, 1);
+
+  TEST_EXPECTED(try_load_script(L, "return { a = 3, c = true }"));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 1, 0));
+  {
+    auto result = primer::read<test::strict>(L, 1);
+    TEST(!result, "expected failure");
+    TEST(result.err().str().find("c") != std::string::npos,
+         "expected key in error: " << result.err().str());
+  }
+  CHECK_STACK(L, 1);
+  lua_pop(L, 1);
 }
 
 UNIT_TEST(visitable_round_trip) {
@@ -217,6 +375,186 @@ UNIT_TEST(visitable_round_trip) {
   }
 }
 
+UNIT_TEST(visitable_positional) {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  test::point p{1.5, -2, "origin"};
+  primer::push(L, p);
+  CHECK_STACK(L, 1);
+  TEST_EQ(lua_rawlen(L, 1), 3u);
+
+  lua_rawgeti(L, 1, 3);
+  TEST_EQ(lua_tostring(L, -1), std::string{"origin"});
+  lua_pop(L, 1);
+
+  {
+    auto q = primer::read<test::point>(L, 1);
+    TEST_EXPECTED(q);
+    TEST_EQ(q->x, p.x);
+    TEST_EQ(q->y, p.y);
+    TEST_EQ(q->tag, p.tag);
+  }
+
+  // The field names are in the metatable, shared by all the points
+  const char * script = "local p, q = ...                                 \n"
+                        "local mt = getmetatable(p)                       \n"
+                        "assert(mt == getmetatable(q))                    \n"
+                        "assert(mt.__fields[1] == 'x')                    \n"
+                        "assert(mt.__fields[3] == 'tag')                  \n"
+                        "assert(p.x == nil)                               \n"
+                        "return {4, 5, 'moved'}, {4, 'x', 'bad'}          \n";
+  TEST_EXPECTED(try_load_script(L, script));
+  lua_pushvalue(L, 1);
+  primer::push(L, test::point{0, 0, ""});
+  TEST_LUA_OK(L, lua_pcall(L, 2, 2, 0));
+
+  {
+    auto q = primer::read<test::point>(L, 2);
+    TEST_EXPECTED(q);
+    TEST_EQ(q->y, 5);
+    TEST_EQ(q->tag, "moved");
+  }
+
+  {
+    auto q = primer::read<test::point>(L, 3);
+    TEST(!q, "expected failure");
+    TEST(q.err().str().find("'y'") != std::string::npos,
+         "unexpected error: " << q.err().str());
+  }
+  lua_settop(L, 0);
+}
+
+UNIT_TEST(visitable_table_pool) {
+  lua_raii L;
+
+  primer::table_pool pool{L};
+  pool.push(L, test::point{1, 2, "p"});
+  const void * pt = lua_topointer(L, -1);
+  TEST(lua_getmetatable(L, -1), "expected a metatable");
+  lua_pop(L, 2);
+
+  test::bar b{"asdf", test::foo{true, 1, 1.5f}, test::foo{false, 2, 2.5f}};
+  pool.push(L, b);
+  TEST_EQ(pool.lent(), 4u);
+  lua_getfield(L, -1, "e");
+  lua_getfield(L, -1, "a");
+  TEST_EQ(lua_tointeger(L, -1), 1);
+  lua_pop(L, 3);
+  pool.recycle(L);
+
+  // The spares are reused in the order they were handed out, so the
+  // positional table comes back first, without its metatable
+  pool.push(L, test::foo{true, 7, 0.5f});
+  TEST(lua_topointer(L, -1) == pt, "expected the table to be reused");
+  TEST(!lua_getmetatable(L, -1), "expected no metatable");
+  lua_rawgeti(L, -1, 1);
+  TEST(lua_isnil(L, -1), "expected the old fields to be cleared");
+  lua_getfield(L, -2, "a");
+  TEST_EQ(lua_tointeger(L, -1), 7);
+  lua_settop(L, 0);
+
+  // A value userdata is not a table, and doesn't come from the pool
+  pool.push(L, test::color{1, 0, 0});
+  TEST(lua_isuserdata(L, -1), "expected a userdata");
+  TEST_EQ(pool.lent(), 1u);
+  lua_settop(L, 0);
+  pool.recycle(L);
+}
+
+UNIT_TEST(visitable_push_into) {
+  lua_raii L;
+
+  test::bar b{"asdf", test::foo{true, 1, 1.5f}, test::foo{false, 2, 2.5f}};
+  primer::push(L, b);
+  lua_getfield(L, -1, "e");
+  const void * e = lua_topointer(L, -1);
+  lua_pop(L, 1);
+  // Keys which aren't fields are kept
+  lua_pushinteger(L, 3);
+  lua_setfield(L, -2, "extra");
+
+  b.d = "jkl";
+  b.e.a = 5;
+  TEST_EXPECTED(primer::push_into(L, -1, b));
+  CHECK_STACK(L, 1);
+  lua_getfield(L, -1, "e");
+  TEST(lua_topointer(L, -1) == e, "expected the table to be kept");
+  lua_getfield(L, -1, "a");
+  TEST_EQ(lua_tointeger(L, -1), 5);
+  lua_getfield(L, -3, "d");
+  TEST_EQ(std::string{lua_tostring(L, -1)}, "jkl");
+  lua_getfield(L, -4, "extra");
+  TEST_EQ(lua_tointeger(L, -1), 3);
+  lua_settop(L, 0);
+
+  // Positional, the table keeps its metatable
+  test::point p{1, 2, "p"};
+  primer::push(L, p);
+  p.y = 4;
+  TEST_EXPECTED(primer::push_into(L, -1, p));
+  lua_rawgeti(L, -1, 2);
+  TEST_EQ(lua_tonumber(L, -1), 4);
+  lua_pop(L, 1);
+  TEST(lua_getmetatable(L, -1), "expected a metatable");
+  lua_settop(L, 0);
+}
+
+UNIT_TEST(visitable_sync_into) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  test::foo f{true, 1, 1.5f};
+  primer::push(L, f);
+  primer::tracked_table t{L, -1};
+  lua_pop(L, 1);
+  t.push(L);
+  lua_setglobal(L, "f");
+
+  // Only the assigned fields are read, and other keys are ignored
+  f.c = 9.5f;
+  TEST_LUA_OK(L, luaL_dostring(L, "f.a = 7; f.extra = 'x'"));
+  TEST_EXPECTED(primer::sync_into(t, f));
+  TEST_EQ(f.a, 7);
+  TEST_EQ(f.c, 9.5f);
+  TEST_EQ(t.changes(), 0u);
+
+  // A field of the wrong type is an error, and is kept
+  TEST_LUA_OK(L, luaL_dostring(L, "f.a = 'seven'"));
+  TEST(!primer::sync_into(t, f), "expected an error");
+  TEST_EQ(t.changes(), 1u);
+  CHECK_STACK(L, 0);
+}
+
+UNIT_TEST(visitable_event_channel) {
+  lua_raii L;
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  // Each field is a typed array of the events
+  const char * const src =
+    ""
+    "return function(events, n)                                         \n"
+    "  assert(n == 2 and #events.r == 2 and #events.b == 2)             \n"
+    "  result = events.r[1] + events.g[2] * 10 + events.b[2] * 100      \n"
+    "end                                                                \n";
+  TEST_LUA_OK(L, luaL_loadstring(L, src));
+  TEST_LUA_OK(L, primer::protected_call(L, 0, 1));
+  primer::event_channel<test::color> ch{primer::bound_function{L}, 2};
+
+  TEST(ch.post(test::color{1, 2, 3}), "expected the event to fit");
+  TEST(ch.post(test::color{4, 5, 6}), "expected the event to fit");
+  TEST_EXPECTED(ch.deliver());
+  CHECK_STACK(L, 0);
+
+  lua_getglobal(L, "result");
+  TEST_EQ(lua_tonumber(L, -1), 651);
+  lua_pop(L, 1);
+}
+
 primer::result
 test_func_one(lua_State * L, test::foo f, test::foo g) {
   test::foo result{f.b != g.b, f.a - g.a, f.c + g.c};
@@ -369,6 +707,313 @@ UNIT_TEST(api_callbacks) {
   TEST_EQ(4, a.internal_state_);
 }
 
+/***
+ * Visitable userdata with generated field accessors
+ */
+
+namespace test {
+
+struct unit {
+  int hp;
+  std::string name;
+
+  primer::result heal(lua_State *, int amount) {
+    hp += amount;
+    return 0;
+  }
+};
+
+} // end namespace test
+
+VISITABLE_STRUCT(test::unit, hp, name);
+
+static constexpr luaL_Reg unit_methods[] = {
+  {"__index", &primer::visitable_fields<test::unit>::index},
+  {"__newindex", &primer::visitable_fields<test::unit>::newindex},
+  {"heal", PRIMER_ADAPT_USERDATA(test::unit, &test::unit::heal)},
+  {nullptr, nullptr}};
+
+namespace primer {
+namespace traits {
+
+template <>
+struct userdata<test::unit> {
+  static constexpr const char * name = "test_unit";
+  static constexpr const luaL_Reg * metatable = unit_methods;
+};
+
+} // end namespace traits
+} // end namespace primer
+
+UNIT_TEST(visitable_userdata_fields) {
+  lua_raii L;
+
+  luaL_requiref(L, "", luaopen_base, 1);
+  lua_pop(L, 1);
+
+  primer::push_udata<test::unit>(L, test::unit{10, "orc"});
+  lua_setglobal(L, "u");
+  CHECK_STACK(L, 0);
+
+  const char * script =
+    ""
+    "assert(u.hp == 10)                              \n"
+    "assert(u.name == 'orc')                         \n"
+    "u.hp = u.hp - 3                                 \n"
+    "u:heal(5)                                       \n"
+    "assert(u.hp == 12)                              \n"
+    "u.name = 'troll'                                \n"
+    "assert(u.missing == nil)                        \n"
+    "assert(not pcall(function() u.missing = 1 end)) \n"
+    "assert(not pcall(function() u.hp = 'a' end))    \n"
+    "assert(u.hp == 12)                              \n";
+
+  TEST_LUA_OK(L, luaL_loadstring(L, script));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  // A plain visitable structure can be viewed by reference
+  test::foo f{true, 3, 1.5f};
+  primer::push(L, primer::make_ref_proxy(f));
+  lua_setglobal(L, "f");
+
+  const char * script2 =
+    ""
+    "assert(f.a == 3 and f.b == true and f.c == 1.5) \n"
+    "assert(f.d == nil)                              \n"
+    "assert(#f == 3)                                 \n"
+    "local n = 0                                     \n"
+    "for k, v in pairs(f) do                         \n"
+    "  n = n + 1                                     \n"
+    "  assert(f[k] == v)                             \n"
+    "end                                             \n"
+    "assert(n == 3)                                  \n";
+
+  TEST_LUA_OK(L, luaL_loadstring(L, script2));
+  TEST_LUA_OK(L, lua_pcall(L, 0, 0, 0));
+
+  lua_getglobal(L, "u");
+  auto ref = primer::read<test::unit &>(L, 1);
+  TEST_EXPECTED(ref);
+  TEST_EQ(ref->hp, 12);
+  TEST_EQ(ref->name, "troll");
+  lua_pop(L, 1);
+
+  CHECK_STACK(L, 0);
+}
+
+struct test_value_api : primer::api::base<test_value_api> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, libs_);
+  using values_t = primer::api::userdatas<primer::visitable_value<test::color>,
+                                          primer::visitable_value<test::label>>;
+  API_FEATURE(values_t, udata_man_);
+
+  test_value_api()
+    : L_() {
+    this->initialize_api(L_);
+  }
+
+  void save(std::string & buffer) { TEST_EXPECTED(this->persist(L_, buffer)); }
+  void restore(const std::string & buffer) {
+    TEST_EXPECTED(this->unpersist(L_, buffer));
+  }
+};
+
+UNIT_TEST(visitable_value_userdata) {
+  std::string buffer;
+
+  {
+    test_value_api a;
+    lua_State * L = a.L_;
+
+    primer::push(L, test::color{0.5f, 1, 0.25f});
+    TEST_EQ(lua_type(L, -1), LUA_TUSERDATA);
+    lua_setglobal(L, "c");
+    primer::push(L, test::label{"hello", 12});
+    lua_setglobal(L, "l");
+
+    const char * script = "assert(c.r == 0.5 and c.b == 0.25)              \n"
+                          "c.g = 0.75                                      \n"
+                          "assert(not pcall(function() c.a = 1 end))       \n"
+                          "assert(not pcall(function() c.r = 'x' end))     \n"
+                          "assert(l.text == 'hello')                       \n"
+                          "l.size = l.size + 1                             \n"
+                          "return c, {text = 'from a table', size = 3}     \n";
+    TEST_EXPECTED(try_load_script(L, script));
+    TEST_LUA_OK(L, lua_pcall(L, 0, 2, 0));
+
+    {
+      auto c = primer::read<test::color>(L, 1);
+      TEST_EXPECTED(c);
+      TEST_EQ(c->g, 0.75f);
+      auto l = primer::read<test::label>(L, 2);
+      TEST_EXPECTED(l);
+      TEST_EQ(l->text, "from a table");
+      TEST_EQ(l->size, 3);
+      TEST(!primer::read<test::label>(L, 1), "expected failure");
+    }
+    lua_settop(L, 0);
+
+    a.save(buffer);
+  }
+
+  {
+    test_value_api a;
+    lua_State * L = a.L_;
+    a.restore(buffer);
+
+    lua_getglobal(L, "c");
+    auto c = primer::read<test::color>(L, -1);
+    TEST_EXPECTED(c);
+    TEST_EQ(c->r, 0.5f);
+    TEST_EQ(c->g, 0.75f);
+    lua_getglobal(L, "l");
+    auto l = primer::read<test::label>(L, -1);
+    TEST_EXPECTED(l);
+    TEST_EQ(l->text, "hello");
+    TEST_EQ(l->size, 13);
+    lua_settop(L, 0);
+  }
+}
+
+namespace test {
+
+// Persisted by generated `__persist`s
+struct hero {
+  int hp;
+  std::string name;
+  foo stats;
+};
+
+struct vec3 {
+  float x;
+  float y;
+  float z;
+};
+
+} // end namespace test
+
+VISITABLE_STRUCT(test::hero, hp, name, stats);
+
+static constexpr luaL_Reg hero_methods[] = {
+  {"__index", &primer::visitable_fields<test::hero>::index},
+  {"__newindex", &primer::visitable_fields<test::hero>::newindex},
+  {nullptr, nullptr}};
+
+namespace primer {
+namespace traits {
+
+template <>
+struct userdata<test::hero> {
+  static constexpr const char * name = "test_hero";
+  static constexpr const luaL_Reg * metatable = hero_methods;
+  static constexpr bool auto_persist = true;
+};
+
+template <>
+struct userdata<test::vec3> {
+  static constexpr const char * name = "test_vec3";
+  static constexpr bool slab = true;
+  static constexpr bool auto_persist = true;
+};
+
+} // end namespace traits
+} // end namespace primer
+
+static_assert(primer::detail::udata_auto_persist<test::hero>::value, "");
+static_assert(!primer::detail::udata_auto_persist<test::unit>::value, "");
+
+struct test_auto_persist_api : primer::api::base<test_auto_persist_api> {
+  lua_raii L_;
+
+  API_FEATURE(primer::api::libraries<primer::api::lua_base_lib>, libs_);
+  using udatas_t = primer::api::userdatas<test::hero, test::vec3>;
+  API_FEATURE(udatas_t, udata_man_);
+
+  test_auto_persist_api()
+    : L_() {
+    this->initialize_api(L_);
+  }
+
+  void save(std::string & buffer) { TEST_EXPECTED(this->persist(L_, buffer)); }
+  void restore(const std::string & buffer) {
+    TEST_EXPECTED(this->unpersist(L_, buffer));
+  }
+};
+
+UNIT_TEST(visitable_auto_persist) {
+  std::string buffer;
+
+  {
+    test_auto_persist_api a;
+    lua_State * L = a.L_;
+
+    primer::push_udata<test::hero>(L,
+                                   test::hero{30, "knight", {true, 4, 2.5f}});
+    lua_setglobal(L, "h");
+    primer::push_udata<test::vec3>(L, test::vec3{1, 2, 3});
+    lua_pushvalue(L, -1);
+    lua_setglobal(L, "v");
+    lua_setglobal(L, "w");
+
+    TEST_LUA_OK(L, luaL_dostring(L, "h.hp = h.hp - 5                   \n"
+                                    "h.name = 'squire of the realm'    \n"));
+    a.save(buffer);
+  }
+
+  {
+    test_auto_persist_api a;
+    lua_State * L = a.L_;
+    a.restore(buffer);
+
+    const char * script = "assert(h.hp == 25)                          \n"
+                          "assert(h.name == 'squire of the realm')     \n"
+                          "assert(rawequal(v, w))                      \n";
+    TEST_LUA_OK(L, luaL_dostring(L, script));
+    lua_getglobal(L, "h");
+    test::hero * h = primer::test_udata<test::hero>(L, -1);
+    TEST(h, "expected a hero");
+    TEST_EQ(h->stats.a, 4);
+    TEST_EQ(h->stats.c, 2.5f);
+    lua_getglobal(L, "v");
+    test::vec3 * v = primer::test_udata<test::vec3>(L, -1);
+    TEST(v, "expected a vec3");
+    TEST_EQ(v->x, 1.0f);
+    TEST_EQ(v->z, 3.0f);
+    lua_pop(L, 2);
+    CHECK_STACK(L, 0);
+  }
+}
+
+UNIT_TEST(visitable_binary) {
+  test::bar b;
+  b.d = "baz";
+  b.e = test::foo{true, 5, 1.5f};
+  b.f = test::foo{false, -7, 2.25f};
+
+  std::string buffer;
+  primer::traits::binary<test::bar>::write(buffer, b);
+
+  test::bar c;
+  const char * pos = buffer.data();
+  const char * end = pos + buffer.size();
+  TEST_EQ(true, primer::traits::binary<test::bar>::read(pos, end, c));
+  TEST_EQ(pos, end);
+  TEST_EQ(c.d, "baz");
+  TEST_EQ(c.e.b, true);
+  TEST_EQ(c.e.a, 5);
+  TEST_EQ(c.e.c, 1.5f);
+  TEST_EQ(c.f.b, false);
+  TEST_EQ(c.f.a, -7);
+  TEST_EQ(c.f.c, 2.25f);
+
+  // Truncated input is rejected
+  pos = buffer.data();
+  end = pos + buffer.size() - 1;
+  TEST_EQ(false, primer::traits::binary<test::bar>::read(pos, end, c));
+}
+
 int
 main() {
   conf::log_conf();